@@ -13,6 +13,9 @@
 
 #include "loc2stap.h"
 #include "analysis.h"
+#include "cache.h"
+#include "util.h"
+#include <fstream>
 #include <dyninst/Symtab.h>
 #include <dyninst/Function.h>
 #include <dyninst/liveness.h>
@@ -35,8 +38,56 @@ public:
 typedef map<string, bin_info> parsed_bin;
 static parsed_bin cached_info;
 
-// Clean things up when analysis no longer needs the cached dyninst objects
-void flush_analysis_caches()
+// Liveness answers for one binary, by address and dwarf register.  They
+// are kept on disk under the binary's build-id, so that later runs only
+// need to parse the binary for questions it hasn't answered before.
+struct liveness_answers {
+  string path; // the cache file, or empty if there is none
+  map<pair<Dwarf_Addr, unsigned>, int> answers;
+  bool dirty;
+  liveness_answers(): dirty(false) {}
+};
+static map<string, liveness_answers> cached_answers; // by executable
+
+static liveness_answers&
+get_liveness_answers(systemtap_session& s, const string& executable,
+		     Dwfl_Module *module)
+{
+  auto it = cached_answers.find(executable);
+  if (it != cached_answers.end())
+    return it->second;
+
+  liveness_answers& la = cached_answers[executable];
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length;
+  if (module && s.use_cache
+      && (bits_length = dwfl_module_build_id(module, &bits, &vaddr)) > 0)
+    la.path = get_build_id_cache_path(s, "liveness",
+				      hex_dump(bits, bits_length), ".live");
+  if (la.path.empty() || s.poison_cache)
+    return la;
+
+  ifstream in(la.path.c_str());
+  Dwarf_Addr addr;
+  unsigned regno;
+  int used;
+  while (in >> hex >> addr >> dec >> regno >> used)
+    la.answers[make_pair(addr, regno)] = used;
+  if (!la.answers.empty())
+    {
+      touch_cache_index_entry(s, la.path);
+      if (s.verbose > 2)
+	clog << _F("liveness %s: using %zu cached answers from %s",
+		   executable.c_str(), la.answers.size(), la.path.c_str())
+	     << endl;
+    }
+  return la;
+}
+
+// Clean things up when analysis no longer needs the cached dyninst objects,
+// saving any new liveness answers for the next run.
+void flush_analysis_caches(systemtap_session& s)
 {
   for(auto i: cached_info) {
     delete i.second.co;
@@ -44,6 +95,17 @@ void flush_analysis_caches()
     SymtabAPI::Symtab::closeSymtab(i.second.symtab);
   }
   cached_info.clear();
+
+  for (auto& i: cached_answers) {
+    if (!i.second.dirty || i.second.path.empty())
+      continue;
+    ostringstream image;
+    for (auto& a: i.second.answers)
+      image << hex << a.first.first << dec << ' ' << a.first.second
+	    << ' ' << a.second << '\n';
+    add_data_to_cache(s, i.second.path, image.str());
+  }
+  cached_answers.clear();
 }
 
 
@@ -241,10 +303,24 @@ static precomputed_liveness cached_liveness;
 int liveness(systemtap_session& s,
 	     target_symbol *e,
 	     string executable,
+	     Dwfl_Module *module,
 	     Dwarf_Addr addr,
 	     location_context ctx)
 {
   try{
+	// Find where the variable is located
+	location *loc = ctx.locations.back ();
+
+	// If variable isn't in a register, punt (return 0)
+	if (loc->type != loc_register) return 0;
+	unsigned int regno = loc->regno;
+
+	// Maybe this was answered before, without parsing the binary
+	liveness_answers& answers = get_liveness_answers(s, executable, module);
+	auto known = answers.answers.find(make_pair(addr, regno));
+	if (known != answers.answers.end())
+		return known->second;
+
 	// Doing this inside a try/catch because dyninst may require
 	// too much memory to parse the binary.
 	// should cache the executable names like the other things
@@ -261,14 +337,7 @@ int liveness(systemtap_session& s,
 	// Determine whether 32-bit or 64-bit code as the register names are different in dyninst
 	int reg_width = func_to_analyze.co->cs()->getAddressWidth();
 
-	// Find where the variable is located
-	location *loc = ctx.locations.back ();
-
-	// If variable isn't in a register, punt (return 0)
-	if (loc->type != loc_register) return 0;
-
 	// Map dwarf number to dyninst register name, punt if out of range
-	unsigned int regno = loc->regno;
 	switch (reg_width){
 	case 4:
 		if (regno >= (sizeof(dyninst_register_32)/sizeof(MachRegister))) return 0;
@@ -313,6 +382,8 @@ int liveness(systemtap_session& s,
 	// Query to see if whether the register is live at that point
 	bool used;
 	la->query(iloc, LivenessAnalyzer::Before, r, used);
+	answers.answers[make_pair(addr, regno)] = (used ? 1 : -1);
+	answers.dirty = true;
 	return (used ? 1 : -1);
   } catch (std::bad_alloc & ex){
     s.print_warning(_F("unable to allocate memory for liveness analysis of %s",
@@ -20,14 +20,15 @@
 extern int liveness(systemtap_session& s,
 		    target_symbol *e,
 		    std::string executable,
+		    Dwfl_Module *module,
 		    Dwarf_Addr location,
 		    location_context ctx);
 
-extern void flush_analysis_caches();
+extern void flush_analysis_caches(systemtap_session& s);
 #else
 
-#define liveness(session, target, executable, location, var) (0)
-#define flush_analysis_caches() {/* nothing to do */}
+#define liveness(session, target, executable, module, location, var) (0)
+#define flush_analysis_caches(session) {/* nothing to do */}
 
 #endif // HAVE_DYNINST
 #endif // ANALYSIS_H
@@ -445,6 +445,10 @@ bpf_function_nargs (unsigned id)
     case BPF_FUNC_get_current_comm:	return 2;
     case BPF_FUNC_perf_event_read:	return 2;
     case BPF_FUNC_perf_event_output:	return 5;
+    case BPF_FUNC_get_stackid:		return 3;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+    case BPF_FUNC_ringbuf_output:	return 4;
+#endif
     default:				return 5;
     }
 }
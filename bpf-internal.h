@@ -82,6 +82,20 @@ enum bpf_target {
 #define BPF_TRANSPORT_ARG uint64_t
 // XXX: BPF_TRANSPORT_ARG is for small numerical arguments, not pe_long values.
 
+// Through the ring buffer transport, the upper half of a message's
+// BPF_TRANSPORT_VAL holds the cpu that sent it, so that stapbpf can
+// put the parts of a printf from one cpu back together:
+#define BPF_TRANSPORT_CPU_SHIFT 32
+#define BPF_TRANSPORT_TYPE_MASK 0xffffffffULL
+
+// Size of the ring buffer transport, a power of two multiple of pages:
+#define BPF_RINGBUF_SIZE (256 * 1024)
+
+// Distinct backtraces the stack map holds, and the frames kept of each
+// (at most the kernel's PERF_MAX_STACK_DEPTH):
+#define BPF_MAXSTACKS 1024
+#define BPF_MAXSTACKDEPTH 127
+
 // DEPRECATED constants for foreach sorting.
 // Kept in the unlikely case we want to use new stapbpf to load old .bo's.
 // Use globals::foreach_info instead for generating new .bo's.
@@ -561,6 +575,21 @@ struct globals
   // at translation time and must be determined by the stapbpf loader:
   static const int NUM_CPUS_PLACEHOLDER = 0;
 
+  // Whether the perf_event_map is a BPF_MAP_TYPE_RINGBUF shared by
+  // all cpus, rather than a PERF_EVENT_ARRAY of per-cpu buffers:
+  bool use_ringbuf = false;
+
+  // The BPF_MAP_TYPE_STACK_TRACE map of the get_stackid helper, only
+  // created for scripts that take backtraces:
+  map_idx stack_map_idx = -1;
+
+  // The BPF_MAP_TYPE_PROG_ARRAY that chains the programs of a kernel
+  // probe handler split up to fit the verifier, and the percpu map
+  // that keeps their locals in the meantime, one element per split
+  // probe.  Only created for scripts that need them:
+  map_idx tail_call_map_idx = -1;
+  map_idx split_locals_map_idx = -1;
+
   // Types of transport messages supported:
   enum perf_event_type
   {
@@ -573,6 +602,8 @@ struct globals
     STP_PRINTF_FORMAT,
     STP_PRINTF_ARG_LONG,
     STP_PRINTF_ARG_STR,
+    STP_PRINT_STACK,  // -- arg is a backtrace() id
+    STP_PRINT_USTACK, // -- arg is a ubacktrace() id
     // TODO PR23476: Yet more messages to request things such as histogram printing.
   };
 
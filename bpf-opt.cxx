@@ -813,42 +813,164 @@ choose_spill_reg(unsigned tmpreg, std::vector<regno> &ordered, std::vector<bool>
 }
 
 static void
-spill(unsigned reg, unsigned num_spills, program &p)
+remove_insn(block *b, insn *j)
+{
+  insn *p = j->prev, *n = j->next;
+  if (p)
+    p->next = n;
+  else
+    b->first = n;
+  if (n)
+    n->prev = p;
+  else
+    b->last = p;
+}
+
+// If every definition of reg sets it to the same small constant,
+// return one of them: reg is then cheaper to recompute at each use
+// than to keep on the stack.
+static insn *
+find_remat_def(unsigned reg, program &p)
 {
   unsigned nblocks = p.blocks.size();
-  value *frame = p.lookup_reg(BPF_REG_10);
+  insn *def = NULL;
 
-  // Reserve reg's stack offset.
-  int off = BPF_REG_SIZE * (num_spills + 1) + p.max_tmp_space;
-  if (off > (int)p.max_reg_space)
-    p.max_reg_space = (unsigned)off;
+  for (unsigned i = 0; i < nblocks; ++i)
+    for (insn *j = p.blocks[i]->first; j != NULL; j = j->next)
+      {
+        if (!j->dest || j->dest->reg_val != reg)
+          continue;
+        if ((j->code != (BPF_ALU64 | BPF_MOV | BPF_K)
+             && j->code != (BPF_ALU | BPF_MOV | BPF_K))
+            || !j->src1->is_imm())
+          return NULL;
+        if (def && (def->code != j->code
+                    || def->src1->imm() != j->src1->imm()))
+          return NULL;
+        def = j;
+      }
+
+  return def;
+}
+
+// Replace reg by a new temporary loaded with the constant of def right
+// before each use, and drop the definitions.
+static void
+rematerialize(unsigned reg, insn *def, program &p)
+{
+  unsigned nblocks = p.blocks.size();
+  value *c = def->src1;
+
+  for (unsigned i = 0; i < nblocks; ++i)
+    {
+      block *b = p.blocks[i];
+
+      for (insn *n, *j = b->first; j != NULL; j = n)
+        {
+          n = j->next;
+          if (j->dest && j->dest->reg_val == reg)
+            {
+              remove_insn(b, j);
+              continue;
+            }
+
+          value *src0 = j->src0;
+          value *src1 = j->src1;
+          if ((src0 && src0->reg_val == reg) || (src1 && src1->reg_val == reg))
+            {
+              insn_before_inserter ins(b, j, "regalloc");
+              value *new_tmp = p.new_reg();
+
+              p.mk_mov (ins, new_tmp, c);
+              if (src0 && src0->reg_val == reg)
+                j->src0 = new_tmp;
+              if (src1 && src1->reg_val == reg)
+                j->src1 = new_tmp;
+            }
+        }
+    }
+}
+
+// Reserve the stack slot of the num_slots'th spilled register.
+static int
+new_spill_slot(unsigned num_slots, program &p)
+{
+  int off = BPF_REG_SIZE * (num_slots + 1) + p.max_tmp_space;
 
   // Ensure double word alignment.
   if (off % BPF_REG_SIZE)
     off += BPF_REG_SIZE - off % BPF_REG_SIZE;
+  if (off > (int)p.max_reg_space)
+    p.max_reg_space = (unsigned)off;
 
   if (off > MAX_BPF_STACK(p.target))
     throw std::runtime_error(
 	    _("register allocation failed due to insufficent BPF stack size"));
+  return off;
+}
+
+// Keep reg in the stack slot at -off, storing it after each definition
+// and loading it for its uses.
+//
+// With split, the live range of reg is split at block boundaries and
+// calls instead: within such a piece, reg lives in a new temporary
+// from its first load or definition on, so that several uses close
+// together take one load.  Such a temporary may have to be spilled
+// itself later, without split, to the same slot.  Each temporary that
+// spill creates is recorded in slots, and it is marked in spilled
+// unless it could still be split off further.
+static void
+spill(unsigned reg, int off, bool split, program &p,
+      std::vector<bool> &spilled, std::vector<int> &slots)
+{
+  unsigned nblocks = p.blocks.size();
+  value *frame = p.lookup_reg(BPF_REG_10);
+  unsigned first_tmp = p.max_reg();
+  std::vector<unsigned> uses;
 
   for (unsigned i = 0; i < nblocks; ++i)
     {
       block *b = p.blocks[i];
+      value *cur = NULL; // holds the value of reg, when split
 
-      for (insn *j = b->last; j != NULL; j = j->prev)
+      for (insn *n, *j = b->first; j != NULL; j = n)
         {
+          n = j->next;
           value *src0 = j->src0;
           value *src1 = j->src1;
           value *dest = j->dest;
           value *new_tmp = NULL;
 
-          // If reg is a source, insert a load before j
+          // The loads and stores of an earlier split of reg's slot
+          // are redone below.
+          if (j->code == (BPF_LDX | BPF_MEM | BPF_DW) && src1 == frame
+              && j->off == -off && dest && dest->reg_val == reg)
+            {
+              remove_insn(b, j);
+              cur = NULL;
+              continue;
+            }
+          if (j->code == (BPF_STX | BPF_MEM | BPF_DW) && src0 == frame
+              && j->off == -off && src1 && src1->reg_val == reg)
+            {
+              remove_insn(b, j);
+              continue;
+            }
+
+          // If reg is a source, insert a load before j, unless a
+          // temporary holds it already.
           if ((src0 && src0->reg_val == reg) || (src1 && src1->reg_val == reg))
             {
-              insn_before_inserter ins(b, j, "regalloc");
-              new_tmp = p.new_reg();
+              if (cur == NULL)
+                {
+                  insn_before_inserter ins(b, j, "regalloc");
+                  cur = p.new_reg();
+                  uses.push_back(0);
 
-              p.mk_ld (ins, BPF_DW, new_tmp, frame, -off);
+                  p.mk_ld (ins, BPF_DW, cur, frame, -off);
+                }
+              new_tmp = cur;
+              uses[new_tmp->reg() - first_tmp]++;
 
               // Replace reg with new_tmp
               if (src0 && src0->reg_val == reg)
@@ -861,15 +983,240 @@ spill(unsigned reg, unsigned num_spills, program &p)
           if (dest && dest->reg_val == reg)
             {
               insn_after_inserter ins(b, j, "regalloc");
-              new_tmp = new_tmp ?: p.new_reg();
+              if (new_tmp == NULL)
+                {
+                  new_tmp = p.new_reg();
+                  uses.push_back(0);
+                }
 
               p.mk_st (ins, BPF_DW, frame, -off, new_tmp);
               j->dest = new_tmp;
+              cur = new_tmp;
             }
+
+          if (!split || j->is_call())
+            cur = NULL;
         }
     }
 
-  return;
+  for (unsigned i = first_tmp; i < p.max_reg(); ++i)
+    {
+      spilled.push_back(!split || uses[i - first_tmp] < 2);
+      slots.push_back(off);
+    }
+}
+
+// Whether the BPF_K form of j can take c in place of its src1 register.
+static bool
+imm_operand_ok(const insn *j, int64_t c)
+{
+  if (c != (int32_t)c)
+    return false;
+
+  switch (BPF_CLASS (j->code))
+    {
+    case BPF_ALU64:
+      switch (BPF_OP (j->code))
+	{
+	case BPF_MOV:
+	  return true;
+	case BPF_DIV:
+	case BPF_MOD:
+	  // The verifier rejects a constant division by zero.
+	  return c != 0;
+	case BPF_LSH:
+	case BPF_RSH:
+	case BPF_ARSH:
+	  return c >= 0 && c < 64;
+	default:
+	  return j->is_binary();
+	}
+    case BPF_JMP:
+      return j->is_jmp() && BPF_OP (j->code) != BPF_JA;
+    case BPF_STX:
+      return BPF_MODE (j->code) == BPF_MEM;
+    default:
+      return false;
+    }
+}
+
+// A load whose value some register still holds.
+struct avail_load
+{
+  regno dest, base;
+  int off;
+  opcode code;
+};
+
+// Forget what a definition of reg invalidates.
+static void
+kill_copies(regno reg, std::unordered_map<regno, value *> &copies,
+	    std::unordered_map<regno, int64_t> &consts,
+	    std::vector<avail_load> &loads)
+{
+  copies.erase(reg);
+  consts.erase(reg);
+  for (auto c = copies.begin(); c != copies.end(); )
+    if (c->second->reg() == reg)
+      c = copies.erase(c);
+    else
+      ++c;
+  for (unsigned k = 0; k < loads.size(); )
+    if (loads[k].dest == reg || loads[k].base == reg)
+      {
+	loads[k] = loads.back();
+	loads.pop_back();
+      }
+    else
+      ++k;
+}
+
+// Within each block, replace uses of a temporary that is a copy of
+// another temporary, of the frame pointer or of a small constant by
+// the original, and turn a load that some register holds already into
+// a move from it.  The copies left dead are removed afterwards by
+// remove_dead_insns.  This runs on the two-operand form, after
+// fixup_operands, so that the destination input of an operation is
+// never replaced.
+static void
+propagate_copies(program &p)
+{
+  const unsigned nblocks = p.blocks.size();
+  std::unordered_map<regno, value *> copies;
+  std::unordered_map<regno, int64_t> consts;
+  std::vector<avail_load> loads;
+
+  for (unsigned i = 0; i < nblocks; ++i)
+    {
+      block *b = p.blocks[i];
+      copies.clear();
+      consts.clear();
+      loads.clear();
+
+      for (insn *n, *j = b->first; j != NULL; j = n)
+	{
+	  n = j->next;
+
+	  // Replace the sources.  The first one is only a plain input
+	  // of compares and stores, where it must stay a register.
+	  if (!j->dest && !j->is_call() && j->src0 && j->src0->is_reg())
+	    {
+	      auto c = copies.find(j->src0->reg());
+	      if (c != copies.end())
+		j->src0 = c->second;
+	    }
+	  if (j->src1 && j->src1->is_reg() && !j->is_call())
+	    {
+	      regno r = j->src1->reg();
+	      auto c = copies.find(r);
+	      auto k = consts.find(r);
+	      if (c != copies.end())
+		j->src1 = c->second;
+	      else if (k != consts.end() && imm_operand_ok(j, k->second))
+		{
+		  j->src1 = p.new_imm(k->second);
+		  if (BPF_CLASS (j->code) == BPF_STX)
+		    j->code = BPF_ST | BPF_MEM | BPF_SIZE (j->code);
+		  else
+		    j->code &= ~BPF_X;
+		}
+	    }
+
+	  // A load of what a register holds is a move from it.
+	  bool removed = false;
+	  if (BPF_CLASS (j->code) == BPF_LDX && j->src1->is_reg())
+	    for (auto &l : loads)
+	      if (l.code == j->code && l.base == j->src1->reg()
+		  && l.off == j->off)
+		{
+		  if (l.dest == j->dest->reg())
+		    {
+		      remove_insn(b, j);
+		      removed = true;
+		    }
+		  else
+		    {
+		      j->code = BPF_ALU64 | BPF_MOV | BPF_X;
+		      j->src1 = p.lookup_reg(l.dest);
+		      j->off = 0;
+		    }
+		  break;
+		}
+	  if (removed)
+	    continue;
+
+	  // Forget what j's definitions invalidate.  Helpers and stores
+	  // may write any memory.
+	  if (j->is_call())
+	    {
+	      for (regno r = BPF_REG_0; r <= BPF_REG_5; ++r)
+		kill_copies(r, copies, consts, loads);
+	      loads.clear();
+	    }
+	  else if (BPF_CLASS (j->code) == BPF_ST
+		   || BPF_CLASS (j->code) == BPF_STX)
+	    loads.clear();
+	  if (j->dest)
+	    kill_copies(j->dest->reg(), copies, consts, loads);
+
+	  // Record what j makes available.
+	  value *d = j->dest, *s1 = j->src1;
+	  if (d && d->type == value::TMPREG && j->is_move() && s1->is_reg()
+	      && (s1->type == value::TMPREG || s1->reg() == BPF_REG_10)
+	      && d->reg() != s1->reg())
+	    copies[d->reg()] = s1;
+	  else if (d && d->type == value::TMPREG && j->is_move()
+		   && j->code != BPF_LD_MAP && s1->is_imm())
+	    consts[d->reg()] = s1->imm();
+	  else if (BPF_CLASS (j->code) == BPF_LDX && s1->is_reg()
+		   && d->reg() != s1->reg())
+	    loads.push_back({ d->reg(), s1->reg(), j->off, j->code });
+	  else if (j->code == (BPF_STX | BPF_MEM | BPF_DW)
+		   && j->src0->is_reg() && s1->is_reg()
+		   && s1->type == value::TMPREG)
+	    loads.push_back({ s1->reg(), j->src0->reg(), j->off,
+			      BPF_LDX | BPF_MEM | BPF_DW });
+	}
+    }
+}
+
+// Remove the instructions that only compute a temporary nobody reads.
+// Returns whether any were found.
+static bool
+remove_dead_insns(program &p)
+{
+  const unsigned nblocks = p.blocks.size();
+  const unsigned nregs = p.max_reg();
+  life_data life(nblocks, nregs);
+  bitset::set1 live(nregs);
+  bool changed = false;
+
+  find_lifetimes(life, p);
+  for (unsigned i = 0; i < nblocks; ++i)
+    {
+      block *b = p.blocks[i];
+      live = life.live_out[i];
+
+      for (insn *n, *j = b->last; j != NULL; j = n)
+	{
+	  n = j->prev;
+	  value *d = j->dest;
+	  if (d && d->type == value::TMPREG && !live.test(d->reg())
+	      && (BPF_CLASS (j->code) == BPF_ALU64
+		  || BPF_CLASS (j->code) == BPF_ALU
+		  || BPF_CLASS (j->code) == BPF_LDX
+		  || j->is_move()))
+	    {
+	      remove_insn(b, j);
+	      changed = true;
+	      continue;
+	    }
+	  j->mark_sets(live, 0);
+	  j->mark_uses(live, 1);
+	}
+    }
+
+  return changed;
 }
 
 static void
@@ -900,8 +1247,10 @@ reg_alloc(program &p)
   bool done = false;
   const unsigned nblocks = p.blocks.size();
   std::vector<bool> spilled(p.max_reg());
+  std::vector<int> slots(p.max_reg()); // -- stack offsets of spilled regs
+  unsigned num_slots = 0;
 
-  for (unsigned num_spills = 0; !done; ++num_spills)
+  while (!done)
     {
       const unsigned nregs = p.max_reg();
 
@@ -940,15 +1289,22 @@ reg_alloc(program &p)
       if (reg)
        {
           // reg could not be allocated. Spill the lowest priority
-          // temporary that has already been allocated.
+          // temporary that has already been allocated.  A constant
+          // is recomputed where it is used rather than spilled, and
+          // a register spilled for the first time is split up.
           reg = choose_spill_reg(reg, ordered, spilled);
-          spill(reg, num_spills, p);
-
-          // Add new temporaries to spilled.
-          for (unsigned i = nregs; i < p.max_reg(); ++i)
-            spilled.push_back(true);
-
           spilled[reg] = true;
+          if (insn *def = find_remat_def(reg, p))
+            {
+              rematerialize(reg, def, p);
+              spilled.resize(p.max_reg(), true);
+              slots.resize(p.max_reg(), 0);
+            }
+          else if (slots[reg])
+            spill(reg, slots[reg], false, p, spilled, slots);
+          else
+            spill(reg, new_spill_slot(num_slots++, p), true, p,
+                  spilled, slots);
         }
       else
         {
@@ -1013,16 +1369,76 @@ zero_stack(program &p)
 
 // XXX: Also zero the spilled registers that are loaded but not saved.
 // This is a degenerate case but it happens on some programs with the
-// current register allocator:
+// current register allocator.  Only the slots that some path from
+// the entry can load before storing them need it:
 void
 zero_spilled(program &p)
 {
+  const int lo = -(int)p.max_reg_space;
+  const int hi = -(int)p.max_tmp_space;
+  if (lo >= hi)
+    return;
+
+  const unsigned nblocks = p.blocks.size();
+  const unsigned nslots = (hi - lo + BPF_REG_SIZE - 1) / BPF_REG_SIZE;
+  bitset::set2 unstored(nblocks, nslots); // -- on entry to each block
+  bitset::set1 cur(nslots), need(nslots);
+
+  // Spill slots are only ever accessed as double words off the frame.
+  auto slot_of = [&](const insn *j, bool store) -> int {
+    value *base = store ? j->src0 : j->src1;
+    if (j->code != ((store ? BPF_STX : BPF_LDX) | BPF_MEM | BPF_DW)
+	|| !base || !base->is_reg() || base->reg() != BPF_REG_10
+	|| j->off < lo || j->off >= hi)
+      return -1;
+    return (j->off - lo) / BPF_REG_SIZE;
+  };
+
+  for (unsigned k = 0; k < nslots; ++k)
+    unstored[0].set(k);
+  bool changed;
+  do
+    {
+      changed = false;
+      for (unsigned i = 0; i < nblocks; ++i)
+	{
+	  block *b = p.blocks[i];
+	  cur = unstored[i];
+	  for (insn *j = b->first; j != NULL; j = j->next)
+	    {
+	      int k = slot_of(j, true);
+	      if (k >= 0)
+		cur.reset(k);
+	    }
+	  for (edge *e : { b->taken, b->fallthru })
+	    if (e && !cur.is_subset_of(unstored[e->next->id]))
+	      {
+		unstored[e->next->id] |= cur;
+		changed = true;
+	      }
+	}
+    }
+  while (changed);
+
+  for (unsigned i = 0; i < nblocks; ++i)
+    {
+      cur = unstored[i];
+      for (insn *j = p.blocks[i]->first; j != NULL; j = j->next)
+	{
+	  int k = slot_of(j, false);
+	  if (k >= 0 && cur.test(k))
+	    need.set(k);
+	  if ((k = slot_of(j, true)) >= 0)
+	    cur.reset(k);
+	}
+    }
+
   block *entry_block = p.blocks[0];
   insn_before_inserter ins(entry_block, entry_block->first, "zero_spilled");
   value *frame = p.lookup_reg(BPF_REG_10);
-  for (int32_t ofs = -(int32_t)p.max_reg_space;
-       ofs < -(int32_t)p.max_tmp_space; ofs += 4)
-    p.mk_st(ins, BPF_W, frame, (int32_t)ofs, p.new_imm(0));
+  for (size_t k = need.find_first(); k != bitset::set1_ref::npos;
+       k = need.find_next(k))
+    p.mk_st(ins, BPF_DW, frame, lo + (int)k * BPF_REG_SIZE, p.new_imm(0));
 }
 
 void
@@ -1039,6 +1455,9 @@ program::generate()
   thread_jumps(*this);
   fold_jumps(*this);
   reorder_blocks(*this);
+  propagate_copies(*this);
+  while (remove_dead_insns(*this))
+    ;
   reg_alloc(*this);
   zero_spilled(*this);
   post_alloc_cleanup(*this);
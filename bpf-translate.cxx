@@ -15,6 +15,8 @@
 #include "translator-output.h"
 #include "tapsets.h"
 #include <sstream>
+#include <climits>
+#include <cerrno>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -155,6 +157,13 @@ struct bpf_unparser : public throwing_visitor
   globals &glob;
   value *this_in_arg0 = NULL;
 
+  // In fentry and fexit programs, the context is the u64 array of the
+  // arguments of the function, after which fexit has the return value
+  // if fexit_ret_slot is known, rather than a pt_regs.
+  bool fentry_ctx = false, fexit_ctx = false;
+  int fexit_ret_slot = -1;
+  void set_section_ctx(const std::string &section);
+
   // The "current" block into which we are currently emitting code.
   insn_append_inserter this_ins;
   void set_block(block *b)
@@ -241,7 +250,6 @@ struct bpf_unparser : public throwing_visitor
   // visit_perf_op -> ?? should already be handled in earlier pass
 
   // TODO: Other bpf functionality to take advantage of in tapsets, or as alternate implementations:
-  // - backtrace.stp :: BPF_MAP_TYPE_STACKTRACE + bpf_getstackid
   // - BPF_MAP_TYPE_LRU_HASH :: for size-limited maps
   // - BPF_MAP_GET_NEXT_KEY :: for user-space iteration through maps
   // see https://ferrisellis.com/posts/ebpf_syscall_and_maps/#ebpf-map-types
@@ -262,6 +270,7 @@ struct bpf_unparser : public throwing_visitor
 
   void emit_transport_msg(globals::perf_event_type msg,
                           value *arg = NULL, exp_type format_type = pe_unknown);
+  void emit_transport_cpu_tag(value *base, int ofs, value *type);
   value *emit_functioncall(functiondecl *f, const std::vector<value *> &args);
   value *emit_print_format(const std::string &format,
                            const std::vector<value *> &actual,
@@ -308,6 +317,21 @@ struct bpf_unparser : public throwing_visitor
   virtual ~bpf_unparser ();
 };
 
+void
+bpf_unparser::set_section_ctx(const std::string &section)
+{
+  if (section.compare(0, 7, "fentry/") == 0)
+    fentry_ctx = true;
+  else if (section.compare(0, 6, "fexit/") == 0)
+    {
+      // fexit/FUNC/SLOTS
+      fexit_ctx = true;
+      size_t slash = section.find('/', 6);
+      if (slash != std::string::npos)
+        fexit_ret_slot = std::stoi(section.substr(slash + 1));
+    }
+}
+
 bpf_unparser::bpf_unparser(program &p, globals &g)
   : throwing_visitor ("unhandled statement or expression type"),
     result(NULL), this_prog(p), glob(g), this_locals(NULL),
@@ -320,9 +344,21 @@ bpf_unparser::bpf_unparser(program &p, globals &g)
       // Example: MAXERRORS=3
       size_t delim = macro.find('='); 
 
+      if (delim == std::string::npos)
+        continue;
+
       std::string option = macro.substr(0, delim);
-      int limit = std::stoi(macro.substr(delim + 1));
-      
+      const char *value = macro.c_str() + delim + 1;
+      char *end;
+      errno = 0;
+      long n = strtol(value, &end, 0);
+
+      // Only numbers can be limits, others are left for max_probe_insns
+      // to complain about if they matter.
+      if (errno || end == value || *end || n > INT_MAX || n < INT_MIN)
+        continue;
+      int limit = n;
+
       // Negative limits become 0.
       if (limit < 0)
         limit = 0;
@@ -1424,6 +1460,10 @@ bpf_unparser::emit_asm_arg (const asm_stmt &stmt, const std::string &arg,
     }
   else if (arg == "$ctx")
     {
+      /* Only helpers know what the context of fentry/fexit is. */
+      if ((fentry_ctx || fexit_ctx) && stmt.kind != "call")
+        throw SEMANTIC_ERROR (_("$ctx of an fentry/fexit probe only passes "
+                                "to helper calls"), stmt.tok);
       /* provide the context where available */
       return this_in_arg0 ? this_in_arg0 : this_prog.new_imm(0x0);
     }
@@ -1864,15 +1904,55 @@ bpf_unparser::visit_embeddedcode (embeddedcode *s)
           assert (!stmt.params.empty());
           std::string func_name = stmt.params[0];
           bpf_func_id hid = bpf_function_id(func_name);
-          if (hid != __BPF_FUNC_MAX_ID)
+          std::vector<std::string> params = stmt.params;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+          // The transport messages of the tapsets go to the ring
+          // buffer as well: perf_event_output(ctx, map, flags, data,
+          // size) becomes ringbuf_output(map, data, size, 0).
+          if (hid == BPF_FUNC_perf_event_output && glob.use_ringbuf
+              && params.size() == 6)
+            {
+              hid = BPF_FUNC_ringbuf_output;
+              params = { params[0], params[2], params[4], params[5], "0" };
+
+              // Their messages are tagged with the cpu as well.
+              value *data = emit_asm_arg(stmt, params[2], /*allow_imm=*/false);
+              value *type = this_prog.new_reg();
+              this_prog.mk_ld(this_ins, BPF_DW, type, data, 0);
+              emit_transport_cpu_tag(data, 0, type);
+            }
+#endif
+          if (hid == BPF_FUNC_get_stackid)
+            {
+              // The stack map is ours to pass: get_stackid(ctx, flags)
+              // becomes get_stackid(ctx, stack_map, flags).
+              if (params.size() != 3)
+                throw SEMANTIC_ERROR (_("bpf embeddedcode get_stackid expects "
+                                        "ctx and flags"), stmt.tok);
+              assert (glob.stack_map_idx >= 0);
+              value *ctx = emit_asm_arg(stmt, params[1]);
+              value *flags = emit_asm_arg(stmt, params[2]);
+              emit_mov(this_prog.lookup_reg(BPF_REG_1), ctx);
+              this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_2),
+                                 glob.stack_map_idx);
+              emit_mov(this_prog.lookup_reg(BPF_REG_3), flags);
+              this_prog.mk_call(this_ins, hid, 3);
+              if (stmt.dest != "-")
+                {
+                  value *dest = get_asm_reg(stmt, stmt.dest);
+                  this_prog.mk_mov(this_ins, dest,
+                                   this_prog.lookup_reg(BPF_REG_0) /* returnval */);
+                }
+            }
+          else if (hid != __BPF_FUNC_MAX_ID)
             {
               // ??? For diagnostics: check if the number of arguments is correct.
               regno r = BPF_REG_1; unsigned nargs = 0;
-              for (unsigned k = 1; k < stmt.params.size(); k++)
+              for (unsigned k = 1; k < params.size(); k++)
                 {
                   // ??? Could make params optional to avoid the MOVs,
                   // ??? since the calling convention is well-known.
-                  value *from_reg = emit_asm_arg(stmt, stmt.params[k]);
+                  value *from_reg = emit_asm_arg(stmt, params[k]);
                   value *to_reg = this_prog.lookup_reg(r);
                   this_prog.mk_mov(this_ins, to_reg, from_reg);
                   nargs++; r++;
@@ -3241,9 +3321,49 @@ bpf_unparser::visit_target_deref (target_deref* e)
   result = d;
 }
 
+// Returns the slot of the argument in DWARF register regno at a function
+// entry in the context of an fentry program, or -1 if none.  The
+// registers are those of the target architecture, not the host's.
+static int
+func_arg_slot (const systemtap_session& s, unsigned regno)
+{
+  if (s.architecture == "x86_64")
+    switch (regno)
+      {
+      case 5: return 0; // rdi
+      case 4: return 1; // rsi
+      case 1: return 2; // rdx
+      case 2: return 3; // rcx
+      case 8: return 4; // r8
+      case 9: return 5; // r9
+      }
+  else if (s.architecture == "arm64")
+    {
+      if (regno < 8)
+        return regno; // x0-x7
+    }
+  return -1;
+}
+
 void
 bpf_unparser::visit_target_register (target_register* e)
 {
+  // The context of fentry/fexit has the arguments and return value,
+  // which the verifier lets us load from it directly.  The others
+  // registers are not there, the probe falls back to a kprobe.
+  if (fentry_ctx || fexit_ctx)
+    {
+      int slot = fentry_ctx ? func_arg_slot (*glob.session, e->regno)
+                 : (e->regno == 0 ? fexit_ret_slot : -1);
+      if (slot < 0)
+        throw SEMANTIC_ERROR(_("register unavailable in an fentry/fexit probe"),
+                             e->tok);
+      value *d = this_prog.new_reg ();
+      this_prog.mk_ld (this_ins, BPF_DW, d, this_in_arg0, slot * 8);
+      result = d;
+      return;
+    }
+
   // ??? Should not hard-code register size.
   int size = sizeof(void *);
   // ??? Should not hard-code register offsets in pr_regs.
@@ -3764,6 +3884,22 @@ globals::intern_string (std::string& str)
   return this_idx;
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+// Stores type, tagged with the cpu (see BPF_TRANSPORT_CPU_SHIFT), as
+// the type word of the ring buffer message at base+ofs.
+void
+bpf_unparser::emit_transport_cpu_tag (value *base, int ofs, value *type)
+{
+  value *tag = this_prog.new_reg();
+  this_prog.mk_call(this_ins, BPF_FUNC_get_smp_processor_id, 0);
+  emit_mov(tag, this_prog.lookup_reg(BPF_REG_0));
+  this_prog.mk_binary(this_ins, BPF_LSH, tag, tag,
+                      this_prog.new_imm(BPF_TRANSPORT_CPU_SHIFT));
+  this_prog.mk_binary(this_ins, BPF_OR, tag, tag, type);
+  this_prog.mk_st(this_ins, BPF_DW, base, ofs, tag);
+}
+#endif
+
 // Generates perf_event_output transport message glue code.
 //
 // XXX: Based on the interface of perf_event_output, this_in_arg0 must
@@ -3858,6 +3994,23 @@ bpf_unparser::emit_transport_msg (globals::perf_event_type msg,
         assert(false); // XXX: Should be caught earlier.
       }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (glob.use_ringbuf)
+    {
+      emit_transport_cpu_tag(frame, msg_ofs, this_prog.new_imm(msg));
+
+      this_prog.load_map(this_ins, this_prog.lookup_reg(BPF_REG_1),
+                         globals::perf_event_map_idx);
+      this_prog.mk_binary(this_ins, BPF_ADD,
+                          this_prog.lookup_reg(BPF_REG_2),
+                          frame, this_prog.new_imm(msg_ofs));
+      emit_mov(this_prog.lookup_reg(BPF_REG_3), this_prog.new_imm(-msg_ofs));
+      emit_mov(this_prog.lookup_reg(BPF_REG_4), this_prog.new_imm(0)); // flags
+      this_prog.mk_call(this_ins, BPF_FUNC_ringbuf_output, 4);
+      return;
+    }
+#endif
+
   // double word -- XXX verifier forces aligned access
   this_prog.mk_st(this_ins, BPF_DW, frame, msg_ofs, this_prog.new_imm(msg));
 
@@ -4087,6 +4240,8 @@ bpf_unparser::visit_stat_op (stat_op* e)
     case sc_min:
     case sc_max:
     case sc_variance:
+    case sc_quantile:
+    case sc_distinct:
     default:
       throw SEMANTIC_ERROR (_("unhandled stat op"), e->tok);
     }
@@ -4205,19 +4360,220 @@ build_internal_globals(globals& glob)
   glob.maps.push_back
     ({ BPF_MAP_TYPE_HASH, 4, /* NB: value_size */ 8, globals::NUM_INTERNALS, 0 });
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  // One ring buffer keeps the messages of all cpus in order, in less
+  // memory than a perf buffer for each:
+  if (glob.use_ringbuf)
+    {
+      glob.maps.push_back
+        ({ BPF_MAP_TYPE_RINGBUF, 0, 0, BPF_RINGBUF_SIZE, 0 });
+      return;
+    }
+#endif
+
   // PR22330: Use a PERF_EVENT_ARRAY map for message transport:
   glob.maps.push_back
     ({ BPF_MAP_TYPE_PERF_EVENT_ARRAY, 4, 4, globals::NUM_CPUS_PLACEHOLDER, 0 });
   // XXX: NUM_CPUS_PLACEHOLDER will be replaced at loading time.
 }
 
+// The ring buffer came with kernel 5.8.  -DSTAPBPF_RINGBUF=0 keeps the
+// perf_event transport on newer kernels too.
+static bool
+use_ringbuf_transport (systemtap_session& s)
+{
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  for (std::string macro: s.c_macros)
+    if (macro == "STAPBPF_RINGBUF=0")
+      return false;
+  return strverscmp(s.kernel_base_release.c_str(), "5.8") >= 0;
+#else
+  (void) s;
+  return false;
+#endif
+}
+
+// Whether any function left after elaboration takes backtraces, and
+// so needs the stack map.
+static bool
+uses_stack_map (systemtap_session& s)
+{
+  for (auto i = s.functions.begin(); i != s.functions.end(); ++i)
+    {
+      embeddedcode *e = dynamic_cast<embeddedcode *>(i->second->body);
+      if (e && e->code.find("get_stackid") != std::string::npos)
+        return true;
+    }
+  return false;
+}
+
+// Finds the long arrays that kernel probes only count into, with ++,
+// --, += or -= statements, and that only userspace probes (begin, end,
+// error and procfs) read.  Such a counter can take a percpu map, which
+// the kernel probes update without contending for a shared element,
+// and which stapbpf sums up when it reads the counter.
+struct percpu_counter_visitor : public traversing_visitor
+{
+  std::set<vardecl *> candidates;
+  bool in_kernel;
+  bool in_function;
+
+  percpu_counter_visitor(systemtap_session& s)
+    : in_kernel(false), in_function(false)
+  {
+    for (auto i = s.globals.begin(); i != s.globals.end(); ++i)
+      if ((*i)->arity > 0 && (*i)->type == pe_long && !(*i)->wrap)
+        candidates.insert(*i);
+  }
+
+  vardecl *candidate (expression *e)
+  {
+    arrayindex *a = dynamic_cast<arrayindex *>(e);
+    if (a == NULL)
+      return NULL;
+    symbol *sym = NULL;
+    if (a->base == NULL || !a->base->is_symbol(sym) || candidates.find(sym->referent) == candidates.end())
+      return NULL;
+    return sym->referent;
+  }
+
+  // Anything but a read from userspace probes makes v a plain array.
+  void use (vardecl *v, bool read)
+  {
+    if (v && (in_kernel || in_function || !read))
+      candidates.erase(v);
+  }
+
+  void visit_indexes (arrayindex *a)
+  {
+    for (unsigned i = 0; i < a->indexes.size(); i++)
+      if (a->indexes[i])
+        a->indexes[i]->visit (this);
+  }
+
+  void visit_expr_statement (expr_statement *s)
+  {
+    if (in_kernel && !in_function)
+      {
+        expression *operand = NULL, *right = NULL;
+        if (pre_crement *e = dynamic_cast<pre_crement *>(s->value))
+          operand = e->operand;
+        else if (post_crement *e = dynamic_cast<post_crement *>(s->value))
+          operand = e->operand;
+        else if (assignment *e = dynamic_cast<assignment *>(s->value))
+          if (e->op == "+=" || e->op == "-=")
+            {
+              operand = e->left;
+              right = e->right;
+            }
+        if (candidate(operand))
+          {
+            // The counting itself, per cpu.
+            visit_indexes (static_cast<arrayindex *>(operand));
+            if (right)
+              right->visit (this);
+            return;
+          }
+      }
+    traversing_visitor::visit_expr_statement (s);
+  }
+
+  void visit_pre_crement (pre_crement *e)
+  {
+    use (candidate(e->operand), false);
+    traversing_visitor::visit_pre_crement (e);
+  }
+
+  void visit_post_crement (post_crement *e)
+  {
+    use (candidate(e->operand), false);
+    traversing_visitor::visit_post_crement (e);
+  }
+
+  void visit_assignment (assignment *e)
+  {
+    use (candidate(e->left), false);
+    traversing_visitor::visit_assignment (e);
+  }
+
+  // As the keys are shared by all cpus, deleting elements is fine
+  // from anywhere.
+  void visit_delete_statement (delete_statement *s)
+  {
+    if (candidate(s->value))
+      {
+        visit_indexes (static_cast<arrayindex *>(s->value));
+        return;
+      }
+    symbol *sym = dynamic_cast<symbol *>(s->value);
+    if (sym && candidates.find(sym->referent) != candidates.end())
+      return;
+    traversing_visitor::visit_delete_statement (s);
+  }
+
+  void visit_arrayindex (arrayindex *e)
+  {
+    use (candidate(e), true);
+    traversing_visitor::visit_arrayindex (e);
+  }
+
+  // Whole array uses, such as foreach.
+  void visit_symbol (symbol *e)
+  {
+    if (candidates.find(e->referent) != candidates.end())
+      use (e->referent, true);
+  }
+};
+
+static std::set<vardecl *>
+find_percpu_counters (systemtap_session& s)
+{
+  // The probes which stapbpf interprets in userspace:
+  std::set<derived_probe *> user_probes;
+  std::vector<derived_probe *> begin_v, end_v, error_v;
+  sort_for_bpf(s, s.be_derived_probes, begin_v, end_v, error_v);
+  user_probes.insert(begin_v.begin(), begin_v.end());
+  user_probes.insert(end_v.begin(), end_v.end());
+  user_probes.insert(error_v.begin(), error_v.end());
+  sort_for_bpf_probe_arg_vector procfs_v;
+  sort_for_bpf(s, s.procfs_derived_probes, procfs_v);
+  for (auto i = procfs_v.begin(); i != procfs_v.end(); ++i)
+    user_probes.insert(i->first);
+
+  percpu_counter_visitor v(s);
+  for (auto i = s.probes.begin(); i != s.probes.end(); ++i)
+    {
+      v.in_kernel = user_probes.find(*i) == user_probes.end();
+      (*i)->body->visit (&v);
+    }
+
+  // What a function reads or writes depends on where it is called
+  // from, so any use in one leaves the array alone.
+  v.in_function = true;
+  for (auto i = s.functions.begin(); i != s.functions.end(); ++i)
+    i->second->body->visit (&v);
+  return v.candidates;
+}
+
 static void
 translate_globals (globals &glob, systemtap_session& s)
 {
   int long_map = -1; // -- for scalar long variables
   int str_map = -1;  // -- for scalar string variables
+  glob.use_ringbuf = use_ringbuf_transport(s);
   build_internal_globals(glob);
 
+  // Backtraces are kept once in the kernel, and named by their id:
+  if (uses_stack_map(s))
+    {
+      glob.stack_map_idx = glob.maps.size();
+      glob.maps.push_back
+        ({ BPF_MAP_TYPE_STACK_TRACE, 4, 8 * BPF_MAXSTACKDEPTH,
+           BPF_MAXSTACKS, 0 });
+    }
+
+  std::set<vardecl *> percpu_counters = find_percpu_counters(s);
+
   for (auto i = s.globals.begin(); i != s.globals.end(); ++i)
     {
       vardecl *v = *i;
@@ -4315,6 +4671,8 @@ translate_globals (globals &glob, systemtap_session& s)
 	    } while (element);
             max_entries = v->maxsize > 0 ? v->maxsize : BPF_MAXMAPENTRIES;
 
+            if (v->topk)
+              throw SEMANTIC_ERROR (_("unsupported @topk statistics array"), v->tok);
             if (v->type == pe_stats)
               {
                 glob.array_stats[v] = globals::stats_map();
@@ -4344,6 +4702,14 @@ translate_globals (globals &glob, systemtap_session& s)
             else
               {
                 globals::bpf_map_def m = { BPF_MAP_TYPE_HASH, 0, 0, 0, 0 };
+#ifdef HAVE_BPF_MAP_TYPE_LRU_HASH
+                // A % array makes room for new elements by dropping
+                // old ones, which an LRU map does by itself.
+                if (v->wrap)
+                  m.type = BPF_MAP_TYPE_LRU_HASH;
+#endif
+                if (percpu_counters.count(v))
+                  m.type = BPF_MAP_TYPE_PERCPU_HASH;
                 m.key_size = key_size;
 
                 switch (v->type)
@@ -4912,10 +5278,12 @@ bpf_unparser::add_epilogue()
 }
 
 static void
-translate_probe(program &prog, globals &glob, derived_probe *dp)
+translate_probe(program &prog, globals &glob, derived_probe *dp,
+                const std::string &section = "")
 {
   bpf_unparser u(prog, glob);
   u.this_locals = u.new_locals(dp->locals);
+  u.set_section_ctx(section);
 
   u.set_block(prog.new_block ());
 
@@ -4999,6 +5367,282 @@ translate_init_and_probe_v(program &prog, globals &glob, init_block &b,
     }
 }
 
+// A kernel probe handler too large for the verifier is split between
+// its top-level statements into a chain of programs, each of which
+// ends by tail calling the next through the tail_call_map.  The locals
+// used on both sides of a split are stored in the probe's element of
+// the split_locals_map in the meantime.  String locals can't be kept
+// that way, since they point into the stack, so no split separates
+// the statements using one.
+struct probe_split
+{
+  std::vector<statement *> stmts;
+  std::vector<std::set<vardecl *> > stmt_refs; // -- locals each one uses
+  std::vector<unsigned> bounds; // -- part c is [bounds[c], bounds[c+1])
+  std::vector<std::set<vardecl *> > part_refs;
+  std::map<vardecl *, int> slots; // -- offsets in the split_locals_map
+  globals::map_idx tail_call_map = globals::internal_map_idx;
+  globals::map_idx locals_map = globals::internal_map_idx;
+  int key = 0;            // -- of the probe in the split_locals_map
+  int first_tail_idx = 0; // -- of part 1 in the tail_call_map
+
+  unsigned nparts() const { return bounds.size() - 1; }
+  void assign_slots();
+};
+
+struct local_refs_visitor : public traversing_visitor
+{
+  const std::set<vardecl *> &locals;
+  std::set<vardecl *> refs;
+
+  local_refs_visitor(const std::set<vardecl *> &l) : locals(l) { }
+
+  void visit_symbol (symbol *e)
+  {
+    if (e->referent && locals.count(e->referent))
+      refs.insert(e->referent);
+  }
+};
+
+static void
+flatten_statements (statement *s, std::vector<statement *> &v)
+{
+  if (::block *b = dynamic_cast< ::block *>(s))
+    for (unsigned i = 0; i < b->statements.size(); ++i)
+      flatten_statements(b->statements[i], v);
+  else if (s)
+    v.push_back(s);
+}
+
+// Collects the locals of each part, and gives a slot to those that more
+// than one part uses.
+void
+probe_split::assign_slots()
+{
+  part_refs.assign(nparts(), std::set<vardecl *>());
+  for (unsigned c = 0; c < nparts(); ++c)
+    for (unsigned i = bounds[c]; i < bounds[c + 1]; ++i)
+      part_refs[c].insert(stmt_refs[i].begin(), stmt_refs[i].end());
+
+  std::map<vardecl *, unsigned> nrefs;
+  for (unsigned c = 0; c < nparts(); ++c)
+    for (vardecl *v : part_refs[c])
+      nrefs[v]++;
+
+  slots.clear();
+  for (auto i = nrefs.begin(); i != nrefs.end(); ++i)
+    if (i->second > 1)
+      {
+        int ofs = slots.size() * 8;
+        slots[i->first] = ofs;
+      }
+}
+
+// Loads the locals of part c that an earlier part set, or stores those
+// that a later part needs.
+static void
+emit_split_locals(bpf_unparser &u, const probe_split &ps, unsigned c,
+                  bool load)
+{
+  program &p = u.this_prog;
+  std::vector<std::pair<value *, int> > vars;
+
+  for (auto i = ps.slots.begin(); i != ps.slots.end(); ++i)
+    {
+      vardecl *v = i->first;
+      if (!ps.part_refs[c].count(v))
+        continue;
+
+      bool other = false;
+      for (unsigned d = 0; d < ps.nparts() && !other; ++d)
+        if (load ? d < c : d > c)
+          other = ps.part_refs[d].count(v);
+      if (other)
+        vars.push_back(std::make_pair(u.this_locals->at(v), i->second));
+    }
+  if (vars.empty())
+    return;
+
+  value *frame = p.lookup_reg(BPF_REG_10);
+  value *r0 = p.lookup_reg(BPF_REG_0);
+  p.mk_st(u.this_ins, BPF_W, frame, -4, p.new_imm(ps.key));
+  p.use_tmp_space(4);
+  p.load_map(u.this_ins, p.lookup_reg(BPF_REG_1), ps.locals_map);
+  p.mk_binary(u.this_ins, BPF_ADD, p.lookup_reg(BPF_REG_2), frame,
+              p.new_imm(-4));
+  p.mk_call(u.this_ins, BPF_FUNC_map_lookup_elem, 2);
+
+  block *cont_block = p.new_block();
+  p.mk_jcond(u.this_ins, EQ, r0, p.new_imm(0), u.get_ret0_block(),
+             cont_block);
+  u.set_block(cont_block);
+
+  for (auto i = vars.begin(); i != vars.end(); ++i)
+    if (load)
+      p.mk_ld(u.this_ins, BPF_DW, i->first, r0, i->second);
+    else
+      p.mk_st(u.this_ins, BPF_DW, r0, i->second, i->first);
+}
+
+// Translates part c of a split kernel probe.  Only the first part has
+// the prologue; should a tail call fail, the handler just ends.
+static void
+translate_probe_part(program &prog, globals &glob, derived_probe *dp,
+                     const probe_split &ps, unsigned c)
+{
+  bpf_unparser u(prog, glob);
+  u.this_locals = u.new_locals(dp->locals);
+
+  u.set_block(prog.new_block ());
+
+  u.this_in_arg0 = prog.lookup_reg(BPF_REG_6);
+  prog.mk_mov(u.this_ins, u.this_in_arg0, prog.lookup_reg(BPF_REG_1));
+
+  if (c == 0)
+    u.add_prologue();
+  else
+    {
+      u.error_status = prog.new_reg();
+      u.emit_mov(u.error_status, prog.new_imm(0));
+      emit_split_locals(u, ps, c, true);
+    }
+
+  for (unsigned i = ps.bounds[c]; i < ps.bounds[c + 1]; ++i)
+    u.emit_stmt(ps.stmts[i]);
+
+  if (u.in_block() && c + 1 < ps.nparts())
+    {
+      emit_split_locals(u, ps, c, false);
+      prog.mk_mov(u.this_ins, prog.lookup_reg(BPF_REG_1), u.this_in_arg0);
+      prog.load_map(u.this_ins, prog.lookup_reg(BPF_REG_2), ps.tail_call_map);
+      prog.mk_mov(u.this_ins, prog.lookup_reg(BPF_REG_3),
+                  prog.new_imm(ps.first_tail_idx + c));
+      prog.mk_call(u.this_ins, BPF_FUNC_tail_call, 3);
+    }
+  if (u.in_block())
+    u.emit_jmp(u.get_ret0_block());
+}
+
+// Counts the instructions of a generated program.
+static unsigned
+count_insns(const program &prog)
+{
+  unsigned ninsns = 0;
+
+  for (auto i = prog.blocks.begin(); i != prog.blocks.end(); ++i)
+    for (insn *j = (*i)->first; j != NULL; j = j->next)
+      ninsns += ((j->code & 0xff) == (BPF_LD | BPF_IMM | BPF_DW) ? 2 : 1);
+  return ninsns;
+}
+
+// The number of instructions part c of ps takes, or UINT_MAX if it
+// doesn't translate, e.g. for lack of stack.
+static unsigned
+probe_part_insns(globals &glob, derived_probe *dp, probe_split &ps,
+                 unsigned c)
+{
+  size_t nloops = glob.foreach_loop_info.size();
+  unsigned ninsns;
+
+  ps.assign_slots();
+  try
+    {
+      program p(target_kernel_bpf);
+      translate_probe_part(p, glob, dp, ps, c);
+      p.generate();
+      ninsns = count_insns(p);
+    }
+  catch (const std::runtime_error &)
+    {
+      ninsns = UINT_MAX;
+    }
+
+  // Forget the loops of the trial translation.
+  glob.foreach_loop_info.erase(glob.foreach_loop_info.begin() + nloops,
+                               glob.foreach_loop_info.end());
+  return ninsns;
+}
+
+// Splits the handler of dp into parts of at most max_insns
+// instructions, each as long as it can be.  Returns false if that
+// takes a split within a statement, where a string local is used on
+// both sides, or more tail calls than the kernel allows.
+static bool
+split_probe(globals &glob, derived_probe *dp, unsigned max_insns,
+            probe_split &ps)
+{
+  // The kernel allows a chain of 33 tail calls.
+  const unsigned max_parts = 34;
+
+  flatten_statements(dp->body, ps.stmts);
+  const unsigned n = ps.stmts.size();
+  if (n < 2)
+    return false;
+
+  std::set<vardecl *> locals(dp->locals.begin(), dp->locals.end());
+  for (unsigned i = 0; i < n; ++i)
+    {
+      local_refs_visitor v(locals);
+      ps.stmts[i]->visit(&v);
+      ps.stmt_refs.push_back(v.refs);
+    }
+
+  // A split before statement b is allowed unless a string local is
+  // used both before and after it.
+  std::vector<bool> allowed(n + 1, true);
+  for (vardecl *v : locals)
+    {
+      if (v->type == pe_long)
+        continue;
+      unsigned first = n, last = 0;
+      for (unsigned i = 0; i < n; ++i)
+        if (ps.stmt_refs[i].count(v))
+          {
+            first = std::min(first, i);
+            last = i;
+          }
+      for (unsigned b = first + 1; b <= last; ++b)
+        allowed[b] = false;
+    }
+
+  ps.bounds.assign(1, 0);
+  while (ps.bounds.back() < n)
+    {
+      unsigned a = ps.bounds.back();
+      unsigned c = ps.bounds.size() - 1;
+      if (c + 1 >= max_parts)
+        return false;
+
+      // Find the last allowed end of this part that fits, by
+      // bisection, with the rest of the statements as one more part.
+      std::vector<unsigned> ends;
+      for (unsigned e = a + 1; e <= n; ++e)
+        if (allowed[e])
+          ends.push_back(e);
+
+      unsigned lo = 0, hi = ends.size();
+      while (lo < hi)
+        {
+          unsigned mid = (lo + hi) / 2;
+          ps.bounds.push_back(ends[mid]);
+          if (ends[mid] < n)
+            ps.bounds.push_back(n);
+          bool fits = probe_part_insns(glob, dp, ps, c) <= max_insns;
+          ps.bounds.resize(c + 1);
+          if (fits)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+      if (lo == 0)
+        return false;
+      ps.bounds.push_back(ends[lo - 1]);
+    }
+
+  ps.assign_slots();
+  return ps.nparts() > 1;
+}
+
 static BPF_Section *
 output_probe(BPF_Output &eo, program &prog,
 	     const std::string &name, unsigned flags)
@@ -5128,6 +5772,139 @@ output_probe(BPF_Output &eo, program &prog,
   return so;
 }
 
+// -DSTAPBPF_MAXINSNS=N sets the size above which kernel probe handlers
+// are split up, 0 never splits them.
+static unsigned
+max_probe_insns (systemtap_session& s)
+{
+  for (std::string macro: s.c_macros)
+    if (macro.compare(0, 17, "STAPBPF_MAXINSNS=") == 0)
+      {
+        const char *value = macro.c_str() + 17;
+        char *end;
+        errno = 0;
+        long n = strtol (value, &end, 0);
+        if (errno || end == value || *end || n > INT_MAX)
+          throw SEMANTIC_ERROR (_F("invalid -DSTAPBPF_MAXINSNS value '%s'",
+                                   value));
+        return std::max (0L, n);
+      }
+  return BPF_MAXINSNS;
+}
+
+// Translates and outputs the handler of a kernel probe, split into
+// a chain of tail called programs if it doesn't fit the verifier.
+// Returns the kprobe section standing in for an fentry/fexit one.
+static std::string
+fentry_fallback (const std::string &name)
+{
+  if (name.compare(0, 7, "fentry/") == 0)
+    return "kprobe/" + name.substr(7);
+  std::string func = name.substr(6);
+  return "kretprobe/" + func.substr(0, func.find('/'));
+}
+
+static void
+output_kernel_probe(BPF_Output &eo, globals &glob, derived_probe *dp,
+                    const std::string &section)
+{
+  unsigned max_insns = max_probe_insns(*glob.session);
+  size_t nloops = glob.foreach_loop_info.size();
+  std::string name = section;
+  probe_split ps;
+
+  // An fentry/fexit program is cheaper than a kprobe, but its handler
+  // may only read the registers of the arguments and return value, and
+  // must not be split, as tail calls don't carry its BTF attachment.
+  if (name.compare(0, 7, "fentry/") == 0 || name.compare(0, 6, "fexit/") == 0)
+    {
+      try
+        {
+          program p(target_kernel_bpf);
+          translate_probe(p, glob, dp, name);
+          p.generate();
+          if (max_insns == 0 || count_insns(p) <= max_insns)
+            {
+              output_probe(eo, p, name, SHF_ALLOC);
+              return;
+            }
+        }
+      catch (const std::runtime_error &)
+        {
+        }
+      glob.foreach_loop_info.erase(glob.foreach_loop_info.begin() + nloops,
+                                   glob.foreach_loop_info.end());
+      name = fentry_fallback(name);
+      if (glob.session->verbose > 1)
+        std::clog << _F("probe %s attached as %s",
+                        dp->sole_location()->str().c_str(), name.c_str())
+                  << std::endl;
+    }
+
+  try
+    {
+      program p(target_kernel_bpf);
+      translate_probe(p, glob, dp);
+      p.generate();
+      if (max_insns == 0 || count_insns(p) <= max_insns)
+        {
+          output_probe(eo, p, name, SHF_ALLOC);
+          return;
+        }
+      if (!split_probe(glob, dp, max_insns, ps))
+        {
+          output_probe(eo, p, name, SHF_ALLOC);
+          return;
+        }
+    }
+  catch (const std::runtime_error &)
+    {
+      ps = probe_split();
+      if (max_insns == 0 || !split_probe(glob, dp, max_insns, ps))
+        throw;
+    }
+
+  // Forget the loops of the whole handler.
+  glob.foreach_loop_info.erase(glob.foreach_loop_info.begin() + nloops,
+                               glob.foreach_loop_info.end());
+
+  if (glob.tail_call_map_idx < 0)
+    {
+      glob.tail_call_map_idx = glob.maps.size();
+      glob.maps.push_back({ BPF_MAP_TYPE_PROG_ARRAY, 4, 4, 0, 0 });
+      glob.split_locals_map_idx = glob.maps.size();
+      glob.maps.push_back({ BPF_MAP_TYPE_PERCPU_ARRAY, 4, 8, 0, 0 });
+    }
+  globals::bpf_map_def &tm = glob.maps[glob.tail_call_map_idx];
+  globals::bpf_map_def &lm = glob.maps[glob.split_locals_map_idx];
+  ps.tail_call_map = glob.tail_call_map_idx;
+  ps.locals_map = glob.split_locals_map_idx;
+  ps.first_tail_idx = tm.max_entries;
+  ps.key = lm.max_entries++;
+  tm.max_entries += ps.nparts() - 1;
+  lm.value_size = std::max(lm.value_size, (unsigned) ps.slots.size() * 8);
+
+  if (glob.session->verbose > 1)
+    std::clog << _F("split probe %s into %u programs",
+                    dp->sole_location()->str().c_str(), ps.nparts())
+              << std::endl;
+
+  for (unsigned c = 0; c < ps.nparts(); ++c)
+    {
+      program p(target_kernel_bpf);
+      translate_probe_part(p, glob, dp, ps, c);
+      p.generate();
+      // The later parts are only loaded into the tail_call_map, at
+      // the index and with the program type the section name gives.
+      if (c == 0)
+        output_probe(eo, p, name, SHF_ALLOC);
+      else
+        output_probe(eo, p, "tailcall/" + std::to_string(ps.tail_call_map)
+                     + "/" + std::to_string(ps.first_tail_idx + c - 1)
+                     + "/" + name, SHF_ALLOC);
+    }
+}
+
 static void
 output_symbols_sections(BPF_Output &eo)
 {
@@ -5203,7 +5980,6 @@ translate_bpf_pass (systemtap_session& s)
   try
     {
       translate_globals(glob, s);
-      output_maps(eo, glob);
 
       if (s.be_derived_probes || !glob.empty())
         {
@@ -5257,10 +6033,7 @@ translate_bpf_pass (systemtap_session& s)
           for (auto i = kprobe_v.begin(); i != kprobe_v.end(); ++i)
             {
               t = i->first->tok;
-              program p(target_kernel_bpf);
-              translate_probe(p, glob, i->first);
-              p.generate();
-              output_probe(eo, p, i->second, SHF_ALLOC);
+              output_kernel_probe(eo, glob, i->first, i->second);
             }
         }
 
@@ -5287,10 +6060,7 @@ translate_bpf_pass (systemtap_session& s)
           for (auto i = perf_v.begin(); i != perf_v.end(); ++i)
             {
               t = i->first->tok;
-              program p(target_kernel_bpf);
-              translate_probe(p, glob, i->first);
-              p.generate();
-              output_probe(eo, p, i->second, SHF_ALLOC);
+              output_kernel_probe(eo, glob, i->first, i->second);
             }
         }
 
@@ -5304,10 +6074,7 @@ translate_bpf_pass (systemtap_session& s)
             {
               t = i->first->tok;
               // TODO PR23477: Also support userspace timer probes.
-              program p(target_kernel_bpf);
-              translate_probe(p, glob, i->first);
-              p.generate();
-              output_probe(eo, p, i->second, SHF_ALLOC);
+              output_kernel_probe(eo, glob, i->first, i->second);
             }
         }
 
@@ -5319,10 +6086,7 @@ translate_bpf_pass (systemtap_session& s)
           for (auto i = trace_v.begin(); i != trace_v.end(); ++i)
             {
               t = i->first->tok;
-              program p(target_kernel_bpf);
-              translate_probe(p, glob, i->first);
-              p.generate();
-              output_probe(eo, p, i->second, SHF_ALLOC);
+              output_kernel_probe(eo, glob, i->first, i->second);
             }
         }
 
@@ -5334,10 +6098,7 @@ translate_bpf_pass (systemtap_session& s)
           for (auto i = uprobe_v.begin(); i != uprobe_v.end(); ++i)
             {
               t = i->first->tok;
-              program p(target_kernel_bpf);
-              translate_probe(p, glob, i->first);
-              p.generate();
-              output_probe(eo, p, i->second, SHF_ALLOC);
+              output_kernel_probe(eo, glob, i->first, i->second);
             }
         }
 
@@ -5363,6 +6124,8 @@ translate_bpf_pass (systemtap_session& s)
       // s.vma_tracker_derived_probes -- synthetic
       // s.dynprobe_derived_probes -- synthetic, dyninst only
 
+      // The maps go last, as splitting probes may add some.
+      output_maps(eo, glob);
       output_kernel_version(eo, s.kernel_base_release);
       output_license(eo);
       output_stapbpf_script_name(eo, escaped_literal_string(s.script_basename()));
@@ -11,6 +11,7 @@
 #include "session.h"
 #include "util.h"
 #include "hash.h"
+#include "cache.h"
 #include "translate.h"
 
 #include <cstdlib>
@@ -40,6 +41,24 @@ extern "C" {
 
 using namespace std;
 
+/* How many make jobs kbuild may run at once, or 0 to leave it serial. */
+static long
+make_jobs()
+{
+  // Exploit SMP parallelism, if available.
+  long smp = thread::hardware_concurrency();
+  if (smp <= 0) smp = 1;
+  // PR16276: but only if we're not running severely nproc-rlimited
+  struct rlimit rlim;
+  int rlimit_rc = getrlimit(RLIMIT_NPROC, &rlim);
+  const unsigned int severely_limited = smp*30; // WAG at number of gcc+make etc. nested processes
+  bool nproc_limited = (rlimit_rc == 0 && (rlim.rlim_max <= severely_limited || 
+                                           rlim.rlim_cur <= severely_limited));
+  if (smp >= 1 && !nproc_limited)
+    return smp+1;
+  return 0;
+}
+
 /* Adjust and run make_cmd to build a kernel module. */
 static int
 run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
@@ -66,17 +85,9 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       make_cmd.push_back("--no-print-directory");
     }
 
-  // Exploit SMP parallelism, if available.
-  long smp = thread::hardware_concurrency();
-  if (smp <= 0) smp = 1;
-  // PR16276: but only if we're not running severely nproc-rlimited
-  struct rlimit rlim;
-  int rlimit_rc = getrlimit(RLIMIT_NPROC, &rlim);
-  const unsigned int severely_limited = smp*30; // WAG at number of gcc+make etc. nested processes
-  bool nproc_limited = (rlimit_rc == 0 && (rlim.rlim_max <= severely_limited || 
-                                           rlim.rlim_cur <= severely_limited));
-  if (smp >= 1 && !nproc_limited)
-    make_cmd.push_back("-j" + lex_cast(smp+1));
+  long jobs = make_jobs();
+  if (jobs > 0)
+    make_cmd.push_back("-j" + lex_cast(jobs));
 
   if (strverscmp (s.kernel_base_release.c_str(), "2.6.29") < 0)
     {
@@ -86,6 +97,12 @@ run_make_cmd(systemtap_session& s, vector<string>& make_cmd,
       null_out = true;
     }
 
+  time_trace_scope ts ("kbuild", [&]{
+      for (unsigned i = 0; i < make_cmd.size(); ++i)
+        if (startswith (make_cmd[i], "M="))
+          return make_cmd[i].substr(2);
+      return string();
+    });
   int rc = stap_system (s.verbose, "kbuild", make_cmd, null_out, null_err);
   if (rc != 0)
     s.set_try_server ();
@@ -344,7 +361,16 @@ compile_pass (systemtap_session& s)
   o << "\t";
   if (s.verbose < 4)
     o << "@";
-  o << "$(MAKE) -f \"$(firstword $(MAKEFILE_LIST))\" gen-stapconf" << endl;
+  // The autoconf tests below are independent targets, so run them as
+  // one parallel batch.  Under kbuild's jobserver the sub-make shares
+  // its job slots; otherwise it gets its own -j.  STAP_GEN_STAPCONF
+  // lets the sub-make skip the module flag setup, whose cc-option
+  // probes would otherwise run serially again before the first test.
+  o << "$(MAKE)";
+  long jobs = make_jobs();
+  if (jobs > 0)
+    o << " $(if $(findstring jobserver,$(MAKEFLAGS)),,-j" << jobs << ")";
+  o << " -f \"$(firstword $(MAKEFILE_LIST))\" gen-stapconf STAP_GEN_STAPCONF=1" << endl;
 
   vector<string> cs;  // to hold autoconf C file names
 
@@ -361,6 +387,12 @@ compile_pass (systemtap_session& s)
   output_autoconf(s, o, cs, "autoconf-nameidata.c", "STAPCONF_NAMEIDATA_CLEANUP", NULL);
   output_dual_exportconf(s, o2, "unregister_kprobes", "unregister_kretprobes", "STAPCONF_UNREGISTER_KPROBES");
   output_autoconf(s, o, cs, "autoconf-kprobe-symbol-name.c", "STAPCONF_KPROBE_SYMBOL_NAME", NULL);
+  output_dual_exportconf(s, o2, "register_ftrace_function", "ftrace_set_filter_ip", "STAPCONF_FTRACE_SET_FILTER_IP");
+  output_exportconf(s, o2, "ftrace_set_filter_ips", "STAPCONF_FTRACE_SET_FILTER_IPS");
+  output_autoconf(s, o, cs, "autoconf-ftrace-regs.c", "STAPCONF_FTRACE_REGS", NULL);
+  output_dual_exportconf(s, o2, "register_fprobe_ips", "unregister_fprobe", "STAPCONF_FPROBE");
+  output_autoconf(s, o, cs, "autoconf-fprobe-ret-ip.c", "STAPCONF_FPROBE_RET_IP", NULL);
+  output_autoconf(s, o, cs, "autoconf-fprobe-fregs.c", "STAPCONF_FPROBE_FREGS", NULL);
   output_autoconf(s, o, cs, "autoconf-real-parent.c", "STAPCONF_REAL_PARENT", NULL);
   output_autoconf(s, o, cs, "autoconf-uaccess.c", "STAPCONF_LINUX_UACCESS_H", NULL);
   output_autoconf(s, o, cs, "autoconf-oneachcpu-retry.c", "STAPCONF_ONEACHCPU_RETRY", NULL);
@@ -533,6 +565,9 @@ compile_pass (systemtap_session& s)
   output_autoconf(s, o, cs, "autoconf-files_lookup_fd_raw.c",
                   "STAPCONF_FILES_LOOKUP_FD_RAW", NULL);
   output_autoconf(s, o, cs, "autoconf-task-state.c", "STAPCONF_TASK_STATE", NULL);
+  output_autoconf(s, o, cs, "autoconf-irq-work.c", "STAPCONF_IRQ_WORK", NULL);
+  output_autoconf(s, o, cs, "autoconf-kernel-fpu-api.c",
+                  "STAPCONF_KERNEL_FPU_API", NULL);
   
   // used by runtime/linux/netfilter.c
   output_exportconf(s, o2, "nf_register_hook", "STAPCONF_NF_REGISTER_HOOK");
@@ -556,6 +591,9 @@ compile_pass (systemtap_session& s)
     o << "@";
   o << "cat $^ > $(STAPCONF_HEADER)" << endl;
 
+  // Nothing below matters to the autoconf sub-make.
+  o << "ifneq ($(STAP_GEN_STAPCONF),1)" << endl;
+
   o << module_cflags << " += -include $(STAPCONF_HEADER)" << endl;
 
   for (unsigned i=0; i<s.c_macros.size(); i++)
@@ -624,12 +662,29 @@ compile_pass (systemtap_session& s)
       o << "EXTRA_CFLAGS += -I\"" << s.runtime_path << "\"" << endl;
     }
 
+  o << "endif" << endl;
+
   // XXX: this may help ppc toc overflow
   // o << "CFLAGS := $(subst -Os,-O2,$(CFLAGS)) -fminimal-toc" << endl;
   o << "obj-m := " << s.module_name << ".o" << endl;
 
-  // print out all the auxiliary source (->object) file names
+  // print out the translated_source file name first.  It can't simply
+  // be named MODULENAME.c, since kbuild doesn't allow a foo.ko file
+  // consisting of multiple .o's to have foo.o/foo.c as a source.
+  // (It uses ld -r -o foo.o EACH.o EACH.o).  make -j starts the
+  // objects in this order, and the translated source, which has the
+  // whole runtime and every probe handler in it, takes longest by far,
+  // so it should not wait behind the auxiliary files for a job slot.
   o << s.module_name << "-y := ";
+  {
+    string srcname = s.translated_source;
+    assert (srcname != "" && srcname.rfind('/') != string::npos);
+    string objname = srcname.substr(srcname.rfind('/')+1); // basename
+    assert (objname != "" && objname[objname.size()-1] == 'c');
+    objname[objname.size()-1] = 'o'; // now objname
+    o << " " + objname;
+  }
+  // and once again, for all the auxiliary source (->object) file names
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
     {
       if (s.auxiliary_outputs[i]->trailer_p) continue;
@@ -640,18 +695,6 @@ compile_pass (systemtap_session& s)
       objname[objname.size()-1] = 'o'; // now objname
       o << " " + objname;
     }
-  // and once again, for the translated_source file.  It can't simply
-  // be named MODULENAME.c, since kbuild doesn't allow a foo.ko file
-  // consisting of multiple .o's to have foo.o/foo.c as a source.
-  // (It uses ld -r -o foo.o EACH.o EACH.o).
-  {
-    string srcname = s.translated_source;
-    assert (srcname != "" && srcname.rfind('/') != string::npos);
-    string objname = srcname.substr(srcname.rfind('/')+1); // basename
-    assert (objname != "" && objname[objname.size()-1] == 'c');
-    objname[objname.size()-1] = 'o'; // now objname
-    o << " " + objname;
-  }
   // and once again, for the trailer type auxiliary outputs.
   for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
     {
@@ -665,6 +708,29 @@ compile_pass (systemtap_session& s)
     }
   o << " stap_symbols.o" << endl;
 
+  // Reuse the objects of auxiliary units unchanged since an earlier
+  // build (e.g. the per-header tracepoint wrappers, which are costly
+  // to compile), by copying them in and overriding kbuild's rule.
+  vector<string> cached_objects (s.auxiliary_outputs.size());
+  vector<bool> reused_objects (s.auxiliary_outputs.size(), false);
+  for (unsigned i=0; s.use_cache && i<s.auxiliary_outputs.size(); i++)
+    {
+      if (s.auxiliary_outputs[i]->trailer_p) continue;
+      string objname = s.auxiliary_outputs[i]->filename;
+      objname[objname.size()-1] = 'o';
+      cached_objects[i] = find_object_hash (s, s.auxiliary_outputs[i]->filename);
+      if (cached_objects[i].empty() || s.poison_cache
+          || !file_exists (cached_objects[i])
+          || !copy_file (cached_objects[i], objname, s.verbose > 2))
+        continue;
+      reused_objects[i] = true;
+      touch_cache_index_entry (s, cached_objects[i]);
+      o << objname << ": ;" << endl;
+      if (s.verbose > 1)
+        clog << _F("Reusing cached object %s for %s", cached_objects[i].c_str(),
+                   s.auxiliary_outputs[i]->filename.c_str()) << endl;
+    }
+
   o << s.tmpdir << "/stap_symbols.o: $(STAPCONF_HEADER)" << endl;
 
   // add all stapconf dependencies
@@ -705,6 +771,15 @@ compile_pass (systemtap_session& s)
   rc = run_make_cmd(s, make_cmd);
   if (rc)
     s.set_try_server ();
+  else
+    for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
+      if (!cached_objects[i].empty() && !reused_objects[i])
+        {
+          string objname = s.auxiliary_outputs[i]->filename;
+          objname[objname.size()-1] = 'o';
+          if (copy_file (objname, cached_objects[i], s.verbose > 2))
+            add_cache_index_entry (s, cached_objects[i]);
+        }
   return rc;
 }
 
@@ -805,6 +880,7 @@ get_cached_uprobes(systemtap_session& s)
           get_file_size(cachesyms) > 0 && copy_file(cachesyms, tmpsyms))
         {
           s.uprobes_path = tmpko;
+          touch_cache_index_entry(s, cacheko);
           return true;
         }
     }
@@ -818,11 +894,13 @@ set_cached_uprobes(systemtap_session& s)
     {
       string cacheko = s.uprobes_hash + ".ko";
       string tmpko = s.tmpdir + "/uprobes/uprobes.ko";
-      copy_file(tmpko, cacheko);
+      if (copy_file(tmpko, cacheko))
+        add_cache_index_entry(s, cacheko);
 
       string cachesyms = s.uprobes_hash + ".symvers";
       string tmpsyms = s.tmpdir + "/uprobes/Module.symvers";
-      copy_file(tmpsyms, cachesyms);
+      if (copy_file(tmpsyms, cachesyms))
+        add_cache_index_entry(s, cachesyms);
     }
 }
 
@@ -960,6 +1038,12 @@ make_kernel_run_command (systemtap_session& s, const string& remotedir,
   if (s.monitor)
     cmd.insert(cmd.end(), { "-M", lex_cast(s.monitor_interval) });
 
+  if (!s.hwtrace_file.empty())
+    cmd.insert(cmd.end(), { "-H", s.hwtrace_file });
+
+  if (!s.handoff_module.empty())
+    cmd.insert(cmd.end(), { "-O", s.handoff_module });
+
   cmd.push_back((remotedir.empty() ? s.tmpdir : remotedir)
                         + "/" + s.module_filename());
 
@@ -18,6 +18,7 @@
 #include <cassert>
 #include <sstream>
 #include <vector>
+#include <gelf.h>
 
 extern "C" {
 #include <sys/types.h>
@@ -28,6 +29,9 @@ extern "C" {
 #include <utime.h>
 #include <sys/time.h>
 #include <unistd.h>
+#if HAVE_NSS
+#include "staprun/modverify.h"
+#endif
 }
 
 using namespace std;
@@ -37,18 +41,308 @@ using namespace std;
 #define SYSTEMTAP_CACHE_DEFAULT_MB 256
 #define SYSTEMTAP_CACHE_CLEAN_INTERVAL_FILENAME "cache_clean_interval_s"
 #define SYSTEMTAP_CACHE_CLEAN_DEFAULT_INTERVAL_S 300
+#define SYSTEMTAP_CACHE_RELEASE_MAX_FILENAME "cache_release_mb_limit"
+#define SYSTEMTAP_CACHE_INDEX_FILENAME "cache_index"
+#define SYSTEMTAP_CACHE_INDEX_MAGIC "STAPCIDX 1"
+#define SYSTEMTAP_CACHE_REINDEX_INTERVAL_S 86400
 
 struct cache_ent_info {
-  vector<string> paths;
+  map<string, off_t> paths; // with the size of each
   off_t size; // sum across all paths
-  time_t mtime; // newest of all paths
+  time_t atime; // most recent use of any path
+  string release; // kernel release it was built for, if known
 
+  cache_ent_info(): size(0), atime(0) {}
   cache_ent_info(const vector<string>& paths);
+  void add_path(const string& path, off_t path_size);
   bool operator<(const struct cache_ent_info& other) const;
   void unlink() const;
 };
 
 
+// The cache index lets clean_cache() account for the cache without
+// scanning it.  After a header line with the time of the last full
+// scan, each line records a file added to the cache:
+//   + ATIME SIZE RELEASE PATH
+// or a use of an existing cache entry:
+//   u ATIME PATH
+// Records are only appended; clean_cache() rewrites the index compactly.
+static string
+cache_index_path(systemtap_session& s)
+{
+  return s.cache_path + "/" SYSTEMTAP_CACHE_INDEX_FILENAME;
+}
+
+
+// The index is only created by clean_cache() after a full scan, so
+// until then there is nothing to append to.  Records are short enough
+// that concurrent O_APPEND writers don't interleave them.
+static void
+append_cache_index(systemtap_session& s, const string& record)
+{
+  if (!s.use_cache || s.cache_path.empty())
+    return;
+
+  int fd = open(cache_index_path(s).c_str(), O_WRONLY | O_APPEND);
+  if (fd == -1)
+    return;
+  if (write(fd, record.data(), record.size()) != (ssize_t) record.size()
+      && s.verbose > 1)
+    clog << _F("cache index write failed: %s", strerror(errno)) << endl;
+  close(fd);
+}
+
+
+void
+add_cache_index_entry(systemtap_session& s, const string& path)
+{
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return;
+
+  ostringstream record;
+  record << "+ " << time(NULL) << " " << (long long) st.st_size << " "
+         << (s.kernel_release.empty() ? "-" : s.kernel_release)
+         << " " << path << "\n";
+  append_cache_index(s, record.str());
+}
+
+
+void
+touch_cache_index_entry(systemtap_session& s, const string& path)
+{
+  ostringstream record;
+  record << "u " << time(NULL) << " " << path << "\n";
+  append_cache_index(s, record.str());
+}
+
+
+// Replace PATH with DATA atomically.  Returns false with errno set.
+static bool
+replace_file(const string& path, const string& data)
+{
+  string tmp = path + string(".XXXXXX");
+  char *tmp_name = (char *)tmp.c_str();
+  int fd = mkstemp(tmp_name);
+  if (fd == -1)
+    return false;
+
+  for (size_t done = 0; done < data.size(); )
+    {
+      ssize_t n = write(fd, data.data() + done, data.size() - done);
+      if (n <= 0)
+        {
+          close(fd);
+          unlink(tmp_name);
+          return false;
+        }
+      done += n;
+    }
+
+  {
+    mode_t mask = umask(0);
+    fchmod(fd, 0666 & ~mask);
+    umask(mask);
+  }
+
+  if (close(fd) == -1 || rename(tmp_name, path.c_str()) == -1)
+    {
+      unlink(tmp_name);
+      return false;
+    }
+  return true;
+}
+
+
+// The remote cache is a plain HTTP store shared by many hosts, keyed
+// by the file names of the local cache (which embed the script hash).
+string
+remote_cache_key(const string& path)
+{
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+
+static bool
+remote_cache_get(systemtap_session& s, const string& key, const string& dest)
+{
+  vector<string> cmd { "curl", "-fsS", "-o", dest,
+                       s.remote_cache_url + "/" + key };
+  return stap_system(s.verbose, cmd, true, s.verbose < 2) == 0
+         && file_exists(dest);
+}
+
+
+static bool
+remote_cache_put(systemtap_session& s, const string& key, const string& src)
+{
+  vector<string> cmd { "curl", "-fsS", "-T", src,
+                       s.remote_cache_url + "/" + key };
+  return stap_system(s.verbose, cmd, true, s.verbose < 2) == 0;
+}
+
+
+// Copy a module and its C source into the remote cache.  Only signed
+// modules are shared, since other hosts will not accept them otherwise.
+static void
+add_script_to_remote_cache(systemtap_session& s, const string& c_path)
+{
+  if (!file_exists(s.hash_path + ".sgn"))
+    {
+      if (s.verbose > 1)
+        clog << _F("Not adding unsigned module %s to the remote cache",
+                   s.hash_path.c_str()) << endl;
+      return;
+    }
+
+  // The module goes last, so nobody sees it before its signature.
+  if (remote_cache_put(s, remote_cache_key(c_path), c_path) &&
+      remote_cache_put(s, remote_cache_key(s.hash_path) + ".sgn",
+                       s.hash_path + ".sgn") &&
+      remote_cache_put(s, remote_cache_key(s.hash_path), s.hash_path))
+    {
+      if (s.verbose > 1)
+        clog << _F("Added %s to the remote cache %s",
+                   s.hash_path.c_str(), s.remote_cache_url.c_str()) << endl;
+    }
+  else if (s.verbose > 0)
+    clog << _F("Unable to add %s to the remote cache %s",
+               s.hash_path.c_str(), s.remote_cache_url.c_str()) << endl;
+}
+
+
+#if HAVE_NSS
+// The name a kernel module was built with, from its .modinfo section,
+// or "" if it has none.
+static string
+module_modinfo_name(string& data)
+{
+  string name;
+  if (elf_version(EV_CURRENT) == EV_NONE)
+    return name;
+
+  Elf *elf = elf_memory(&data[0], data.size());
+  size_t shstrndx;
+  if (elf && elf_getshdrstrndx(elf, &shstrndx) == 0)
+    for (Elf_Scn *scn = elf_nextscn(elf, NULL); scn; scn = elf_nextscn(elf, scn))
+      {
+        GElf_Shdr shdr_mem, *shdr = gelf_getshdr(scn, &shdr_mem);
+        const char *sname = shdr ? elf_strptr(elf, shstrndx, shdr->sh_name) : NULL;
+        if (!sname || strcmp(sname, ".modinfo") != 0)
+          continue;
+
+        Elf_Data *d = elf_getdata(scn, NULL);
+        const char *p = d ? (const char *) d->d_buf : NULL;
+        const char *end = p ? p + d->d_size : NULL;
+        for (; p && p < end; p += strnlen(p, end - p) + 1)
+          if (strncmp(p, "name=", 5) == 0)
+            {
+              name.assign(p + 5, strnlen(p + 5, end - p - 5));
+              break;
+            }
+        break;
+      }
+  if (elf)
+    elf_end(elf);
+  return name;
+}
+#endif
+
+
+// Try to take this script's module from the remote cache, once pass 3
+// has translated it, instead of compiling it.  A trusted signature only
+// says that some trusted host built the module, and anyone may store
+// files under any key.  So the fetched module is only used if its C
+// source is the very C file just translated here, and if the module
+// has the name that source was built with, which embeds the script
+// hash.  It is then left in the tmpdir, as pass 4 would, for
+// add_script_to_cache().
+bool
+get_module_from_remote_cache(systemtap_session& s)
+{
+  if (s.remote_cache_url.empty() || !s.use_script_cache || s.poison_cache
+      || s.runtime_usermode_p())
+    return false;
+
+#if HAVE_NSS
+  string key = remote_cache_key(s.hash_path);
+  string c_key = key;
+  if (endswith(c_key, ".ko"))
+    c_key.resize(c_key.size() - 3);
+  c_key += ".c";
+
+  string module_tmp = s.tmpdir + "/remote_" + key;
+  string c_tmp = s.tmpdir + "/remote_" + c_key;
+
+  if (!remote_cache_get(s, key, module_tmp))
+    return false;
+  if (!remote_cache_get(s, key + ".sgn", module_tmp + ".sgn") ||
+      !remote_cache_get(s, c_key, c_tmp))
+    {
+      if (s.verbose > 1)
+        clog << _F("Remote cache entry for %s is incomplete", key.c_str()) << endl;
+      return false;
+    }
+
+  ifstream c_file(c_tmp.c_str(), ios::binary);
+  string c_data((istreambuf_iterator<char>(c_file)), istreambuf_iterator<char>());
+  ifstream translated(s.translated_source.c_str(), ios::binary);
+  string translated_data((istreambuf_iterator<char>(translated)),
+                         istreambuf_iterator<char>());
+  if (c_data.empty() || c_data != translated_data)
+    {
+      if (s.verbose > 0)
+        clog << _F("Ignoring remote cache module %s built from other C source",
+                   key.c_str()) << endl;
+      return false;
+    }
+
+  ifstream module_file(module_tmp.c_str(), ios::binary);
+  string module_data((istreambuf_iterator<char>(module_file)),
+                     istreambuf_iterator<char>());
+  int rc = verify_module((module_tmp + ".sgn").c_str(), module_tmp.c_str(),
+                         module_data.data(), module_data.size());
+  if (rc != MODULE_OK)
+    {
+      if (s.verbose > 0)
+        clog << _F("Ignoring remote cache module %s without a trusted signature",
+                   key.c_str()) << endl;
+      return false;
+    }
+
+  string name = module_modinfo_name(module_data);
+  if (name != s.module_name)
+    {
+      if (s.verbose > 0)
+        clog << _F("Ignoring remote cache module %s named '%s' rather than '%s'",
+                   key.c_str(), name.c_str(), s.module_name.c_str()) << endl;
+      return false;
+    }
+
+  string module_dest_path = s.tmpdir + "/" + s.module_filename();
+  bool verbose = s.verbose > 1;
+  if (!copy_file(module_tmp + ".sgn", module_dest_path + ".sgn", verbose) ||
+      !copy_file(module_tmp, module_dest_path, verbose))
+    {
+      unlink(module_dest_path.c_str());
+      unlink((module_dest_path + ".sgn").c_str());
+      return false;
+    }
+  s.remote_cache_hit = true;
+
+  if (s.verbose > 1)
+    clog << _F("Fetched %s from the remote cache %s", key.c_str(),
+               s.remote_cache_url.c_str()) << endl;
+  return true;
+#else
+  if (s.verbose > 1)
+    clog << _("Remote cache modules can't be verified without NSS support") << endl;
+  return false;
+#endif
+}
+
+
 void
 add_stapconf_to_cache(systemtap_session& s)
 {
@@ -63,6 +357,8 @@ add_stapconf_to_cache(systemtap_session& s)
       // s.use_script_cache = false;
       // return;
     }
+  else
+    add_cache_index_entry(s, s.stapconf_path);
 }
 
 
@@ -82,9 +378,11 @@ add_script_to_cache(systemtap_session& s)
       s.use_script_cache = false;
       return;
     }
+  add_cache_index_entry(s, s.hash_path);
   // Copy the signature file, if any. It is not an error if this fails.
-  if (file_exists (module_src_path + ".sgn"))
-    copy_file(module_src_path + ".sgn", s.hash_path + ".sgn", verbose);
+  if (file_exists (module_src_path + ".sgn")
+      && copy_file(module_src_path + ".sgn", s.hash_path + ".sgn", verbose))
+    add_cache_index_entry(s, s.hash_path + ".sgn");
 
   string c_dest_path = s.hash_path;
   if (endswith(c_dest_path, ".ko") || endswith(c_dest_path, ".so"))
@@ -98,7 +396,12 @@ add_script_to_cache(systemtap_session& s)
       // already copied.
       //
       // s.use_script_cache = false;
+      return;
     }
+  add_cache_index_entry(s, c_dest_path);
+
+  if (!s.remote_cache_url.empty() && !s.remote_cache_hit)
+    add_script_to_remote_cache(s, c_dest_path);
 }
 
 
@@ -129,6 +432,7 @@ get_stapconf_from_cache(systemtap_session& s)
 
   // We're done with this file handle.
   close(fd_stapconf);
+  touch_cache_index_entry(s, s.stapconf_path);
 
   if (s.verbose > 1)
     clog << _("Pass 4: using cached ") << s.stapconf_path << endl;
@@ -199,6 +503,7 @@ get_script_from_cache(systemtap_session& s)
   // We're done with these file handles.
   close(fd_module);
   close(fd_c);
+  touch_cache_index_entry(s, s.hash_path);
 
   // To preserve semantics (since this will happen if we're not
   // caching), display the C source if the last pass is 3.
@@ -228,6 +533,165 @@ get_script_from_cache(systemtap_session& s)
 }
 
 
+// Return the path for some per-object data keyed by build-id, e.g.
+// "$cache/funcidx/<build-id>.fidx", creating the subdirectory as
+// needed.  The full build-id keeps these entries recognizable to
+// clean_cache(), so they age out along with the cached modules.
+string
+get_build_id_cache_path(systemtap_session& s, const string& subdir,
+                        const string& build_id, const string& suffix)
+{
+  if (!s.use_cache || s.cache_path.empty() || build_id.empty())
+    return "";
+
+  string dir = s.cache_path + "/" + subdir;
+  if (create_dir(dir.c_str()) != 0)
+    {
+      if (s.verbose > 1)
+        clog << _F("failed to create cache directory (\"%s\"): %s",
+                   dir.c_str(), strerror(errno)) << endl;
+      return "";
+    }
+
+  return dir + "/" + build_id + suffix;
+}
+
+
+// Write a blob of data into the cache.  Like copy_file(), go through
+// a temporary file and an atomic rename, so concurrent stap runs never
+// see a partially written entry.
+bool
+add_data_to_cache(systemtap_session& s, const string& path, const string& data)
+{
+  if (path.empty() || s.poison_cache)
+    return false;
+
+  if (!replace_file(path, data))
+    {
+      if (s.verbose > 1)
+        clog << _F("Cache write failed (\"%s\"): %s", path.c_str(), strerror(errno)) << endl;
+      return false;
+    }
+
+  add_cache_index_entry(s, path);
+  if (s.verbose > 2)
+    clog << _F("Added %zu bytes to cache as %s", data.size(), path.c_str()) << endl;
+  return true;
+}
+
+
+// Cache entries made of several files (module, source, signature)
+// share a HASH_LEN component in their names; group them by it.
+static string
+cache_group_key(const regex_t& hash_len_re, const string& path)
+{
+  regmatch_t hash_len;
+  if (regexec(&hash_len_re, path.c_str(), 1, &hash_len, 0)
+      || hash_len.rm_so == -1 || hash_len.rm_eo == -1)
+    return path; // ungrouped
+  return path.substr(hash_len.rm_so, hash_len.rm_eo - hash_len.rm_so);
+}
+
+
+// Find the cache entries by globbing for all files that look like hashes.
+static bool
+scan_cache(systemtap_session& s, const regex_t& hash_len_re,
+           map<string, cache_ent_info>& entries)
+{
+  glob_t cache_glob;
+  ostringstream glob_pattern;
+  glob_pattern << s.cache_path << "/*/*";
+  for (unsigned int i = 0; i < 32; i++)
+    glob_pattern << "[[:xdigit:]]";
+  glob_pattern << "*";
+  int rc = glob(glob_pattern.str().c_str(), 0, NULL, &cache_glob);
+  if (rc == GLOB_NOMATCH)
+    return true;
+  if (rc) {
+    cerr << _F("clean_cache glob error rc=%d", rc) << endl;
+    return false;
+  }
+
+  // group all files with the same HASH_LEN
+  map<string, vector<string> > cache_groups;
+  for (size_t i = 0; i < cache_glob.gl_pathc; i++)
+    cache_groups[cache_group_key(hash_len_re, cache_glob.gl_pathv[i])]
+      .push_back(cache_glob.gl_pathv[i]);
+  globfree(&cache_glob);
+
+  for (map<string, vector<string> >::const_iterator it = cache_groups.begin();
+       it != cache_groups.end(); ++it)
+    entries.insert(make_pair(it->first, cache_ent_info(it->second)));
+  return true;
+}
+
+
+// Load the cache index, if there is a valid one, and the time of the
+// full scan it started from.
+static bool
+read_cache_index(systemtap_session& s, const regex_t& hash_len_re,
+                 map<string, cache_ent_info>& entries, time_t& scan_time)
+{
+  ifstream idx(cache_index_path(s).c_str());
+  string line;
+  const string magic = SYSTEMTAP_CACHE_INDEX_MAGIC " ";
+  if (!getline(idx, line) || line.compare(0, magic.size(), magic) != 0)
+    return false;
+  scan_time = strtol(line.c_str() + magic.size(), NULL, 10);
+
+  while (getline(idx, line))
+    {
+      istringstream record(line);
+      char op;
+      long when;
+      long long size = 0;
+      string release, path;
+      if (!(record >> op >> when))
+        continue;
+      if (op == '+' && !(record >> size >> release))
+        continue;
+      record.get(); // the space before the path
+      if (!getline(record, path) || path.empty())
+        continue;
+
+      string key = cache_group_key(hash_len_re, path);
+      if (op == '+')
+        {
+          cache_ent_info& e = entries[key];
+          e.add_path(path, size);
+          if (release != "-")
+            e.release = release;
+          e.atime = max(e.atime, (time_t) when);
+        }
+      else if (op == 'u')
+        {
+          map<string, cache_ent_info>::iterator it = entries.find(key);
+          if (it != entries.end())
+            it->second.atime = max(it->second.atime, (time_t) when);
+        }
+    }
+  return true;
+}
+
+
+static void
+write_cache_index(systemtap_session& s, time_t scan_time,
+                  const set<cache_ent_info>& contents)
+{
+  ostringstream idx;
+  idx << SYSTEMTAP_CACHE_INDEX_MAGIC " " << scan_time << "\n";
+  for (set<cache_ent_info>::const_iterator i = contents.begin();
+       i != contents.end(); ++i)
+    for (map<string, off_t>::const_iterator j = i->paths.begin();
+         j != i->paths.end(); ++j)
+      idx << "+ " << i->atime << " " << (long long) j->second << " "
+          << (i->release.empty() ? "-" : i->release) << " " << j->first << "\n";
+
+  if (!replace_file(cache_index_path(s), idx.str()) && s.verbose > 1)
+    clog << _F("Cache index write failed: %s", strerror(errno)) << endl;
+}
+
+
 void
 clean_cache(systemtap_session& s)
 {
@@ -256,6 +720,18 @@ clean_cache(systemtap_session& s)
                        s.cache_path.c_str(), SYSTEMTAP_CACHE_MAX_FILENAME) << endl;
         }
 
+      /* Get the optional per-kernel-release size limit */
+      string release_max_filename = s.cache_path + "/";
+      release_max_filename += SYSTEMTAP_CACHE_RELEASE_MAX_FILENAME;
+      ifstream release_max_file(release_max_filename.c_str(), ios::in);
+      unsigned long release_mb_max = 0;
+
+      if (release_max_file.is_open())
+        {
+          release_max_file >> release_mb_max;
+          release_max_file.close();
+        }
+
       /* Get cache clean interval from file in the stap cache dir */
       string cache_clean_interval_filename = s.cache_path + "/";
       cache_clean_interval_filename += SYSTEMTAP_CACHE_CLEAN_INTERVAL_FILENAME;
@@ -306,82 +782,101 @@ clean_cache(systemtap_session& s)
                        (long) (current_time.tv_sec-sb.st_mtime), cache_clean_interval)  << endl;
         }
 
-      // glob for all files that look like hashes
-      glob_t cache_glob;
-      ostringstream glob_pattern;
-      glob_pattern << s.cache_path << "/*/*";
-      for (unsigned int i = 0; i < 32; i++)
-        glob_pattern << "[[:xdigit:]]";
-      glob_pattern << "*";
-      int rc = glob(glob_pattern.str().c_str(), 0, NULL, &cache_glob);
-      if (rc) {
-        cerr << _F("clean_cache glob error rc=%d", rc) << endl;
-        return;
-      }
-
       regex_t hash_len_re;
-      rc = regcomp (&hash_len_re, "([[:xdigit:]]{32}_[[:digit:]]+)", REG_EXTENDED);
+      int rc = regcomp (&hash_len_re, "([[:xdigit:]]{32}_[[:digit:]]+)", REG_EXTENDED);
       if (rc) {
         cerr << _F("clean_cache regcomp error rc=%d", rc) << endl;
-        globfree(&cache_glob);
         return;
       }
 
-      // group all files with the same HASH_LEN
-      map<string, vector<string> > cache_groups;
-      for (size_t i = 0; i < cache_glob.gl_pathc; i++)
+      // Account from the index when possible.  Every so often rescan
+      // anyway, to notice files added or removed behind its back, but
+      // keep the release and use times the index knows about.
+      map<string, cache_ent_info> entries;
+      time_t scan_time = 0;
+      bool indexed = read_cache_index(s, hash_len_re, entries, scan_time);
+      if (!indexed || difftime(current_time.tv_sec, scan_time)
+                      > SYSTEMTAP_CACHE_REINDEX_INTERVAL_S)
         {
-          const char* path = cache_glob.gl_pathv[i];
-          regmatch_t hash_len;
-          rc = regexec(&hash_len_re, path, 1, &hash_len, 0);
-          if (rc || hash_len.rm_so == -1 || hash_len.rm_eo == -1)
-            cache_groups[path].push_back(path); // ungrouped
-          else
-            cache_groups[string(path + hash_len.rm_so,
-                                hash_len.rm_eo - hash_len.rm_so)]
-              .push_back(path);
+          map<string, cache_ent_info> scanned;
+          if (!scan_cache(s, hash_len_re, scanned))
+            {
+              regfree(&hash_len_re);
+              return;
+            }
+          for (map<string, cache_ent_info>::iterator it = scanned.begin();
+               it != scanned.end(); ++it)
+            {
+              map<string, cache_ent_info>::const_iterator old = entries.find(it->first);
+              if (old == entries.end())
+                continue;
+              it->second.release = old->second.release;
+              it->second.atime = max(it->second.atime, old->second.atime);
+            }
+          entries.swap(scanned);
+          scan_time = current_time.tv_sec;
+          if (s.verbose > 1)
+            clog << _F("Rebuilt cache index from %zu entries.", entries.size()) << endl;
         }
       regfree(&hash_len_re);
-      globfree(&cache_glob);
 
-
-      // create each cache entry and accumulate the sum
+      // order the entries by last use and accumulate the sums
       off_t cache_size_b = 0;
+      map<string, off_t> release_size_b;
       set<cache_ent_info> cache_contents;
-      for (map<string, vector<string> >::const_iterator it = cache_groups.begin();
-           it != cache_groups.end(); ++it)
+      for (map<string, cache_ent_info>::const_iterator it = entries.begin();
+           it != entries.end(); ++it)
         {
-          cache_ent_info cur_info(it->second);
-          if (cache_contents.insert(cur_info).second)
-            cache_size_b += cur_info.size;
+          if (cache_contents.insert(it->second).second)
+            {
+              cache_size_b += it->second.size;
+              if (!it->second.release.empty())
+                release_size_b[it->second.release] += it->second.size;
+            }
         }
 
       unsigned long r_cache_size = cache_size_b;
-      vector<const cache_ent_info*> removed;
+      vector<string> removed;
 
-      //unlink .ko and .c until the cache size is under the limit
-      for (set<cache_ent_info>::iterator i = cache_contents.begin();
-           i != cache_contents.end(); ++i)
+      // unlink the least recently used entries until the cache, and each
+      // kernel release's share of it, are under their limits
+      set<cache_ent_info>::iterator i = cache_contents.begin();
+      while (i != cache_contents.end())
         {
-          if (r_cache_size < cache_mb_max * 1024 * 1024) //convert cache_mb_max to bytes
-            break;
+          bool over_release = (release_mb_max && !i->release.empty()
+                               && (unsigned long) release_size_b[i->release]
+                                  >= release_mb_max * 1024 * 1024);
+          if (!over_release && r_cache_size < cache_mb_max * 1024 * 1024) //convert cache_mb_max to bytes
+            {
+              if (!release_mb_max)
+                break;
+              ++i;
+              continue;
+            }
 
           //remove this (*i) cache_entry, add to removed list
-          for (size_t j = 0; j < i->paths.size(); ++j)
-            PROBE1(stap, cache__clean, i->paths[j].c_str());
+          for (map<string, off_t>::const_iterator j = i->paths.begin();
+               j != i->paths.end(); ++j)
+            {
+              PROBE1(stap, cache__clean, j->first.c_str());
+              removed.push_back(j->first);
+            }
           i->unlink();
           r_cache_size -= i->size;
-          removed.push_back(&*i);
+          if (!i->release.empty())
+            release_size_b[i->release] -= i->size;
+          cache_contents.erase(i++);
         }
 
       if (s.verbose > 1 && !removed.empty())
         {
           clog << _("Cache cleaning successful, removed entries: ") << endl;
-          for (size_t i = 0; i < removed.size(); ++i)
-            for (size_t j = 0; j < removed[i]->paths.size(); ++j)
-              clog << "  " << removed[i]->paths[j] << endl;
+          for (size_t j = 0; j < removed.size(); ++j)
+            clog << "  " << removed[j] << endl;
         }
 
+      write_cache_index(s, scan_time, cache_contents);
+
       if(utime(cache_clean_interval_filename.c_str(), NULL)<0)
         {
           const char* e = strerror (errno);
@@ -398,42 +893,48 @@ clean_cache(systemtap_session& s)
 
 
 cache_ent_info::cache_ent_info(const vector<string>& paths):
-  paths(paths), size(0), mtime(0)
+  size(0), atime(0)
 {
+  // Use the newer of the access and modification times, since the
+  // cache may well be on a filesystem mounted noatime.
   struct stat file_info;
   for (size_t i = 0; i < paths.size(); ++i)
     if (stat(paths[i].c_str(), &file_info) == 0)
       {
-        size += file_info.st_size;
-        if (file_info.st_mtime > mtime)
-          mtime = file_info.st_mtime;
+        add_path(paths[i], file_info.st_size);
+        atime = max(atime, max(file_info.st_atime, file_info.st_mtime));
       }
 }
 
 
+void
+cache_ent_info::add_path(const string& path, off_t path_size)
+{
+  off_t& old_size = paths[path];
+  size += path_size - old_size;
+  old_size = path_size;
+}
+
+
 // The ordering here determines the order that
 // files will be removed from the cache.
 bool
 cache_ent_info::operator<(const struct cache_ent_info& other) const
 {
-  if (mtime != other.mtime)
-    return mtime < other.mtime;
+  if (atime != other.atime)
+    return atime < other.atime;
   if (size != other.size)
     return size < other.size;
-  if (paths.size() != other.paths.size())
-    return paths.size() < other.paths.size();
-  for (size_t i = 0; i < paths.size(); ++i)
-    if (paths[i] != other.paths[i])
-      return paths[i] < other.paths[i];
-  return false;
+  return paths < other.paths;
 }
 
 
 void
 cache_ent_info::unlink() const
 {
-  for (size_t i = 0; i < paths.size(); ++i)
-    ::unlink(paths[i].c_str());
+  for (map<string, off_t>::const_iterator i = paths.begin();
+       i != paths.end(); ++i)
+    ::unlink(i->first.c_str());
 }
 
 
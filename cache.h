@@ -6,4 +6,17 @@ bool get_stapconf_from_cache(systemtap_session& s);
 
 void clean_cache(systemtap_session& s);
 
+std::string get_build_id_cache_path(systemtap_session& s,
+                                    const std::string& subdir,
+                                    const std::string& build_id,
+                                    const std::string& suffix);
+bool add_data_to_cache(systemtap_session& s, const std::string& path,
+                       const std::string& data);
+
+void add_cache_index_entry(systemtap_session& s, const std::string& path);
+void touch_cache_index_entry(systemtap_session& s, const std::string& path);
+
+std::string remote_cache_key(const std::string& path);
+bool get_module_from_remote_cache(systemtap_session& s);
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
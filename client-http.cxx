@@ -20,6 +20,7 @@
 #include <sstream>
 #include <fstream>
 #include <map>
+#include <set>
 #include <vector>
 
 
@@ -58,7 +59,7 @@ public:
   json_object *root;
   std::map<std::string, std::string> header_values;
   std::vector<std::tuple<std::string, std::string>> env_vars;
-  enum download_type {json_type, file_type};
+  enum download_type {json_type, file_type, head_type};
   std::string pem_cert_file;
   std::string host;
   enum cert_type {signer_trust, ssl_trust};
@@ -68,6 +69,7 @@ public:
   bool download_pem_cert (const std::string & url, std::string & certs);
   bool post (const string & url, vector<tuple<string, string>> & request_parameters);
   void add_file (std::string filename);
+  void skip_known_files (const std::string & url, vector<tuple<string, string>> & request_parameters);
   void add_module (std::string module);
   void get_header_field (const std::string & data, const std::string & field);
   static size_t get_data_shim (void *ptr, size_t size, size_t nitems, void *client);
@@ -89,6 +91,7 @@ private:
       Dwarf_Addr base, void *client);
   int process_buildid (Dwfl_Module *dwflmod);
   std::vector<std::string> files;
+  std::set<std::string> known_files;
   std::vector<std::string> modules;
   std::vector<std::tuple<std::string, std::string>> buildids;
   systemtap_session &s;
@@ -345,7 +348,11 @@ http_client::download (const std::string & url, http_client::download_type type,
     }
   curl_easy_setopt (curl, CURLOPT_URL, url.c_str ());
   curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1); //Prevent "longjmp causes uninitialized stack frame" bug
-  curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "deflate");
+  // Take any encoding libcurl can decode; servers compress modules with zstd.
+  curl_easy_setopt (curl, CURLOPT_ACCEPT_ENCODING, "");
+  // The connection is kept across requests (curl_easy_reset leaves it
+  // open), including through the long waits while a build runs.
+  curl_easy_setopt (curl, CURLOPT_TCP_KEEPALIVE, 1L);
   headers = curl_slist_append (headers, "Accept: */*");
   headers = curl_slist_append (headers, "Content-Type: text/html");
   curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
@@ -378,6 +385,8 @@ http_client::download (const std::string & url, http_client::download_type type,
       curl_easy_setopt (curl, CURLOPT_WRITEDATA, File);
       curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, http_client::get_file);
     }
+  else if (type == head_type)
+    curl_easy_setopt (curl, CURLOPT_NOBODY, 1L);
   curl_easy_setopt (curl, CURLOPT_HEADERDATA, http);
   curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, http_client::get_header_shim);
 
@@ -647,7 +656,6 @@ http_client::post (const string & url,
                    vector<tuple<string, string>> & request_parameters)
 {
   struct curl_slist *headers = NULL;
-  int still_running = false;
   struct curl_httppost *formpost = NULL;
   struct curl_httppost *lastptr = NULL;
   struct json_object *jobj = json_object_new_object();
@@ -697,6 +705,9 @@ http_client::post (const string & url,
       string filename = (*it);
       string filebase = basename (filename.c_str());
 
+      if (known_files.count (filename))
+        continue;
+
       curl_formadd (&formpost, &lastptr,
 		    CURLFORM_COPYNAME, filebase.c_str(),
 		    CURLFORM_FILE, filename.c_str(),
@@ -762,81 +773,23 @@ http_client::post (const string & url,
 
   headers = curl_slist_append (headers, "Expect:");
 
+  curl_easy_setopt (curl, CURLOPT_NOBODY, 0L);
   curl_easy_setopt (curl, CURLOPT_URL, url.c_str());
   curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
   curl_easy_setopt (curl, CURLOPT_HTTPPOST, formpost);
 
-  CURLM *multi_handle = curl_multi_init();
-  curl_multi_add_handle (multi_handle, curl);
-  curl_multi_perform (multi_handle, &still_running);
-  do {
-      struct timeval timeout;
-      int rc; // select() return code
-      CURLMcode mc; // curl_multi_fdset() return code
-
-      fd_set fdread;
-      fd_set fdwrite;
-      fd_set fdexcep;
-      int maxfd = -1;
-
-      long curl_timeo = -1;
-
-      FD_ZERO (&fdread);
-      FD_ZERO (&fdwrite);
-      FD_ZERO (&fdexcep);
-
-      // set a suitable timeout to play around with
-      timeout.tv_sec = 1;
-      timeout.tv_usec = 0;
-
-      curl_multi_timeout (multi_handle, &curl_timeo);
-      if (curl_timeo >= 0)
-        {
-          timeout.tv_sec = curl_timeo / 1000;
-          if (timeout.tv_sec > 1)
-            timeout.tv_sec = 1;
-          else
-            timeout.tv_usec = (curl_timeo % 1000) * 1000;
-        }
-
-      // get file descriptors from the transfers
-      mc = curl_multi_fdset (multi_handle, &fdread, &fdwrite, &fdexcep, &maxfd);
-
-      if (mc != CURLM_OK)
-        {
-          clog << "curl_multi_fdset() failed" << curl_multi_strerror (mc) << endl;
-          return false;
-        }
-
-      /* On success the value of maxfd is guaranteed to be >= -1. We call
-         select(maxfd + 1, ...); specially in case of (maxfd == -1) there are
-         no fds ready yet so we call select(0, ...)to sleep 100ms,
-         the minimum suggested value */
-
-      if (maxfd == -1)
-        {
-          struct timeval wait = { 0, 100 * 1000 }; // 100ms
-          rc = select (0, NULL, NULL, NULL, &wait);
-        }
-      else
-        rc = select (maxfd+1, &fdread, &fdwrite, &fdexcep, &timeout);
-
-      switch (rc)
-      {
-      case -1:
-        /* select error */
-        break;
-      case 0:
-      default:
-        curl_multi_perform (multi_handle, &still_running);
-        break;
-      }
-  } while (still_running);
+  // A plain perform keeps the connection in the handle's cache for
+  // the polling that follows.
+  CURLcode res = curl_easy_perform (curl);
 
-  curl_multi_cleanup (multi_handle);
   curl_formfree (formpost);
   curl_slist_free_all (headers);
 
+  if (res != CURLE_OK)
+    {
+      clog << curl_easy_strerror (res) << ' ' << url << endl;
+      return false;
+    }
   return true;
 }
 
@@ -849,6 +802,35 @@ http_client::add_file (std::string filename)
 }
 
 
+// Don't upload the files the server at URL already has; name them and
+// their hashes in the "known_files" request parameter instead.  Servers
+// that don't keep uploads answer 404 and get everything.
+
+void
+http_client::skip_known_files (const std::string & url,
+                               vector<tuple<string, string>> & request_parameters)
+{
+  known_files.clear ();
+  for (auto it = files.begin (); it != files.end (); ++it)
+    {
+      string hash = file_sha256 (*it);
+      if (! hash.empty ()
+          && download (url + "/uploads/" + hash, head_type, false, false)
+          && get_response_code () == 200)
+        {
+          if (s.verbose >= 2)
+            clog << "Server already has " << *it << endl;
+          // NB: at the front, since post() wants equal parameter types
+          // adjacent and can't end on a run of them.
+          request_parameters.insert (request_parameters.begin (),
+                                     make_tuple ("known_files",
+                                                 string (basename (it->c_str ())) + "=" + hash));
+          known_files.insert (*it);
+        }
+    }
+}
+
+
 // Add MODULE to modules
 
 void
@@ -1208,8 +1190,10 @@ http_client_backend::find_and_connect_to_server ()
       // FIXME: The server returns its version number. We might
       // need to check it for compatibility.
 
-      // Send our build request.
-      if (http->post (url + "/builds", request_parameters))
+      // Send our build request, less what the server already has.
+      vector<tuple<string, string>> parameters = request_parameters;
+      http->skip_known_files (url, parameters);
+      if (http->post (url + "/builds", parameters))
         {
           s.winning_server = url;
           http->host = url;
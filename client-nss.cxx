@@ -100,6 +100,8 @@ typedef struct connectionState_t
   PRNetAddr   addr;
   const char *infileName;
   const char *outfileName;
+  const char *requestDirName;  /* streamed instead of infileName, */
+  const char *responseDirName; /* and outfileName, if set */
   const char *trustNewServerMode;
 } connectionState_t;
 
@@ -310,6 +312,21 @@ handle_connection (PRFileDesc *sslSocket, connectionState_t *connectionState)
 
 #define READ_BUFFER_SIZE (60 * 1024)
 
+  /* Stream the request directory straight from the disk, and the
+     response straight back onto it. */
+  if (connectionState->requestDirName)
+    {
+      numBytes = htonl ((PRInt32)CS_STREAM_REQUEST_SIZE);
+      numBytes = PR_Write (sslSocket, & numBytes, sizeof (numBytes));
+      if (numBytes < 0)
+	return SECFailure;
+      if (nss_send_tree (sslSocket, connectionState->requestDirName) != SECSuccess)
+	return SECFailure;
+      if (nss_receive_tree (sslSocket, connectionState->responseDirName, 0) < 0)
+	return SECFailure;
+      return SECSuccess;
+    }
+
   /* If we don't have both the input and output file names, then we're
      contacting this server only in order to establish trust. In this case send
      0 as the file size and exit. */
@@ -475,7 +492,9 @@ isIPv6LinkLocal (const PRNetAddr &address)
 static int
 client_connect (const compile_server_info &server,
 		const char* infileName, const char* outfileName,
-		const char* trustNewServer)
+		const char* trustNewServer,
+		const char* requestDirName = NULL,
+		const char* responseDirName = NULL)
 {
   SECStatus   secStatus;
   PRErrorCode errorNumber;
@@ -489,6 +508,8 @@ client_connect (const compile_server_info &server,
   connectionState.addr = server.address;
   connectionState.infileName = infileName;
   connectionState.outfileName = outfileName;
+  connectionState.requestDirName = requestDirName;
+  connectionState.responseDirName = responseDirName;
   connectionState.trustNewServerMode = trustNewServer;
 
   /* Some errors (see below) represent a situation in which trying again
@@ -526,7 +547,7 @@ client_connect (const compile_server_info &server,
 }
 
 nss_client_backend::nss_client_backend (systemtap_session &s)
-  : client_backend(s), argc(0)
+  : client_backend(s), argc(0), response_streamed(false)
 {
   server_tmpdir = s.tmpdir + "/server";
 }
@@ -695,16 +716,28 @@ nss_client_backend::finalize_mok_fingerprints ()
 }
 
 // Package the client's temp directory into a form suitable for sending to the
-// server.
+// server.  Servers which take a stream are sent the directory itself, so the
+// zip file is only made once a server turns out to need it.
 int
 nss_client_backend::package_request ()
 {
+  return 0;
+}
+
+int
+nss_client_backend::zip_request ()
+{
+  if (! client_zipfile.empty ())
+    return 0;
+
   // Package up the temporary directory into a zip file.
-  client_zipfile = client_tmpdir + ".zip";
+  string zipfile = client_tmpdir + ".zip";
   string cmd = "cd " + cmdstr_quoted(client_tmpdir) + " && zip -qr "
-      + cmdstr_quoted(client_zipfile) + " *";
+      + cmdstr_quoted(zipfile) + " *";
   vector<string> sh_cmd { "sh", "-c", cmd };
   int rc = stap_system (s.verbose, sh_cmd);
+  if (rc == 0)
+    client_zipfile = zipfile;
   return rc;
 }
 
@@ -894,8 +927,22 @@ nss_client_backend::compile_using_server (
                 "  using certificates from the database in %s\n",
                 lex_cast(*j).c_str(), cert_dir);
 
-	  rc = client_connect (*j, client_zipfile.c_str(), server_zipfile.c_str (),
-			       NULL/*trustNewServer_p*/);
+	  if (! j->version.empty ()
+	      && ! (cs_protocol_version (j->version.c_str ()) < CS_STREAM_PROTOCOL_VERSION))
+	    {
+	      rc = client_connect (*j, NULL, NULL, NULL/*trustNewServer_p*/,
+				   client_tmpdir.c_str (), server_tmpdir.c_str ());
+	      response_streamed = true;
+	    }
+	  else
+	    {
+	      rc = zip_request ();
+	      if (rc != 0)
+		return rc;
+	      rc = client_connect (*j, client_zipfile.c_str(), server_zipfile.c_str (),
+				   NULL/*trustNewServer_p*/);
+	      response_streamed = false;
+	    }
 	  if (rc == NSS_SUCCESS)
 	    {
 	      s.winning_server = lex_cast(*j);
@@ -946,13 +993,19 @@ nss_client_backend::compile_using_server (
 int
 nss_client_backend::unpack_response ()
 {
-  // Unzip the response package.
-  vector<string> cmd { "unzip", "-qd", server_tmpdir, server_zipfile };
-  int rc = stap_system (s.verbose, cmd);
-  if (rc != 0)
+  // Unzip the response package, unless it was streamed straight into
+  // server_tmpdir.
+  vector<string> cmd;
+  int rc = 0;
+  if (! response_streamed)
     {
-      clog << _F("Unable to unzip the server response '%s'\n", server_zipfile.c_str());
-      return rc;
+      cmd = { "unzip", "-qd", server_tmpdir, server_zipfile };
+      rc = stap_system (s.verbose, cmd);
+      if (rc != 0)
+	{
+	  clog << _F("Unable to unzip the server response '%s'\n", server_zipfile.c_str());
+	  return rc;
+	}
     }
 
   // Determine the server protocol version.
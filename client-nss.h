@@ -52,6 +52,7 @@ public:
 
 private:
   unsigned argc;
+  bool response_streamed;
   std::string client_zipfile;
   std::string server_zipfile;
   std::string locale_vars;
@@ -60,6 +61,7 @@ private:
   std::vector<std::string> private_ssl_dbs;
   std::vector<std::string> public_ssl_dbs;
 
+  int zip_request ();
   int compile_using_server (std::vector<compile_server_info> &servers);
   void show_server_compatibility () const;
 };
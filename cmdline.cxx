@@ -64,5 +64,16 @@ struct option stap_long_options[] = {
   { "interactive",                 no_argument,       NULL, LONG_OPT_INTERACTIVE},
   { "example",                     no_argument,       NULL, LONG_OPT_RUN_EXAMPLE},
   { "no-global-var-display",       no_argument,       NULL, LONG_OPT_NO_GLOBAL_VAR_DISPLAY},
+  { "jobs",                        required_argument, NULL, LONG_OPT_JOBS },
+  { "remote-cache",                required_argument, NULL, LONG_OPT_REMOTE_CACHE },
+  { "output-format",               required_argument, NULL, LONG_OPT_OUTPUT_FORMAT },
+  { "defer-symbols",               no_argument,       NULL, LONG_OPT_DEFER_SYMBOLS },
+  { "lazy-unwind",                 no_argument,       NULL, LONG_OPT_LAZY_UNWIND },
+  { "pgo",                         optional_argument, NULL, LONG_OPT_PGO },
+  { "compile-daemon",              required_argument, NULL, LONG_OPT_COMPILE_DAEMON },
+  { "use-compile-daemon",          required_argument, NULL, LONG_OPT_USE_COMPILE_DAEMON },
+  { "time-trace",                  required_argument, NULL, LONG_OPT_TIME_TRACE },
+  { "hwtrace",                     required_argument, NULL, LONG_OPT_HWTRACE },
+  { "handoff",                     optional_argument, NULL, LONG_OPT_HANDOFF },
   { NULL, 0, NULL, 0 }
 };
@@ -68,6 +68,17 @@ enum {
   LONG_OPT_INTERACTIVE,
   LONG_OPT_RUN_EXAMPLE,
   LONG_OPT_NO_GLOBAL_VAR_DISPLAY,
+  LONG_OPT_JOBS,
+  LONG_OPT_REMOTE_CACHE,
+  LONG_OPT_OUTPUT_FORMAT,
+  LONG_OPT_DEFER_SYMBOLS,
+  LONG_OPT_LAZY_UNWIND,
+  LONG_OPT_PGO,
+  LONG_OPT_COMPILE_DAEMON,
+  LONG_OPT_USE_COMPILE_DAEMON,
+  LONG_OPT_TIME_TRACE,
+  LONG_OPT_HWTRACE,
+  LONG_OPT_HANDOFF,
 };
 
 // NB: when adding new options, consider very carefully whether they
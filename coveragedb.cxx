@@ -17,6 +17,7 @@
 #ifdef HAVE_LIBSQLITE3
 
 #include <iostream>
+#include <fstream>
 #include <sqlite3.h>
 #include <cstdlib>
 
@@ -153,42 +154,63 @@ void sql_stmt(sqlite3 *db, const char* stmt)
   }
 }
 
-void enter_element(sqlite3 *db, coverage_element &x)
+// The statements every element goes through, prepared once when the
+// database is opened, rather than an sqlite3_exec() of freshly quoted
+// text for each one.  Only one database is open at a time.
+static struct {
+  sqlite3_stmt *insert;
+  sqlite3_stmt *add_compiled;
+  sqlite3_stmt *add_executed;
+} coverage_stmts;
+
+#define COVERAGE_KEY "file==?1 and line==?2 and col==?3 and type==?4 and name==?5"
+
+static sqlite3_stmt *
+sql_prepare(sqlite3 *db, const char *stmt)
 {
-  ostringstream command;
-  command << "insert or ignore into counts values ('"
-          << x.file << "', '"
-          << x.line << "', '"
-          << x.col  << "', '"
-          << x.type << "','"
-          << x.name << "', '"
-          << x.parent <<"',"
-          << "'0', '0')";
-  sql_stmt(db, command.str().c_str());
+  sqlite3_stmt *ps = NULL;
+  if (sqlite3_prepare_v2(db, stmt, -1, &ps, NULL) != SQLITE_OK)
+    cerr << _("Error in statement: ") << stmt << " [" << sqlite3_errmsg(db) << "]."
+				 << endl;
+  return ps;
+}
+
+// Run a prepared statement for element x, with ?6 bound to value.
+static void
+sql_step_element(sqlite3_stmt *ps, coverage_element &x, int64_t value)
+{
+  if (!ps)
+    return;
+  // type stays text, as the table has always stored it
+  string type = lex_cast(x.type);
+  sqlite3_bind_text(ps, 1, x.file.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(ps, 2, x.line);
+  sqlite3_bind_int(ps, 3, x.col);
+  sqlite3_bind_text(ps, 4, type.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(ps, 5, x.name.c_str(), -1, SQLITE_TRANSIENT);
+  if (sqlite3_bind_parameter_count(ps) >= 6)
+    sqlite3_bind_text(ps, 6, x.parent.c_str(), -1, SQLITE_TRANSIENT);
+  if (sqlite3_bind_parameter_count(ps) >= 7)
+    sqlite3_bind_int64(ps, 7, value);
+  if (sqlite3_step(ps) != SQLITE_DONE)
+    cerr << _("Error in statement: ") << sqlite3_sql(ps) << " ["
+	 << sqlite3_errmsg(sqlite3_db_handle(ps)) << "]." << endl;
+  sqlite3_reset(ps);
+  sqlite3_clear_bindings(ps);
+}
+
+void enter_element(sqlite3 *, coverage_element &x)
+{
+  sql_step_element(coverage_stmts.insert, x, 0);
 }
 
 
 void increment_element(sqlite3 *db, coverage_element &x)
 {
-  ostringstream command;
   // make sure value in table
-  command << "insert or ignore into counts values ('"
-          << x.file << "', '"
-          << x.line << "', '"
-          << x.col  << "', '"
-          << x.type << "','"
-          << x.name << "', '"
-          << x.parent <<"',"
-          << "'0', '0'); "
+  enter_element(db, x);
   // increment appropriate value
-	  << "update counts set compiled=compiled+"
-	  << x.compiled << " where ("
-	  << "file=='" << x.file << "' and "
-	  << "line=='" << x.line << "' and "
-	  << "col=='" << x.col << "' and "
-	  << "type=='" << x.type << "' and "
-	  << "name=='" << x.name << "')";
-  sql_stmt(db, command.str().c_str());
+  sql_step_element(coverage_stmts.add_compiled, x, x.compiled);
 }
 
 
@@ -323,7 +345,8 @@ sql_update_unused_globals(sqlite3 *db, systemtap_session &s)
   }
 }
 
-void update_coverage_db(systemtap_session &s)
+static sqlite3 *
+open_coverage_db(systemtap_session &s)
 {
   sqlite3 *db;
   int rc;
@@ -334,7 +357,7 @@ void update_coverage_db(systemtap_session &s)
   if( rc ){
     cerr << "Can't open database: " << sqlite3_errmsg(db) << endl;
     sqlite3_close(db);
-    return;
+    return NULL;
   }
 
   // lock the database
@@ -355,6 +378,38 @@ void update_coverage_db(systemtap_session &s)
   if (!has_index(db, "tokens"))
     sql_stmt(db, create_index.c_str());
 
+  coverage_stmts.insert =
+    sql_prepare(db, "insert or ignore into counts values "
+		"(?1, ?2, ?3, ?4, ?5, ?6, 0, 0)");
+  coverage_stmts.add_compiled =
+    sql_prepare(db, "update counts set compiled=compiled+?7 where " COVERAGE_KEY);
+  coverage_stmts.add_executed =
+    sql_prepare(db, "update counts set executed=executed+?7 where " COVERAGE_KEY);
+
+  return db;
+}
+
+// Commit everything entered since open_coverage_db() at once.
+static void
+close_coverage_db(sqlite3 *db)
+{
+  sqlite3_finalize(coverage_stmts.insert);
+  sqlite3_finalize(coverage_stmts.add_compiled);
+  sqlite3_finalize(coverage_stmts.add_executed);
+  coverage_stmts.insert = coverage_stmts.add_compiled
+    = coverage_stmts.add_executed = NULL;
+
+  // unlock the database and close database
+  sql_stmt(db, "commit");
+  sqlite3_close(db);
+}
+
+void update_coverage_db(systemtap_session &s)
+{
+  sqlite3 *db = open_coverage_db(s);
+  if (!db)
+    return;
+
   sql_update_used_probes(db, s);
   sql_update_unused_probes(db, s);
   sql_update_used_functions(db, s);
@@ -362,10 +417,167 @@ void update_coverage_db(systemtap_session &s)
   sql_update_used_globals(db, s);
   sql_update_unused_globals(db, s);
 
-  // unlock the database and close database
-  sql_stmt(db, "commit");
+  close_coverage_db(db);
+}
 
-  sqlite3_close(db);
+
+// Split a "file:line:col" location, as printed in the -t reports.
+static bool
+parse_report_location(const string &loc, coverage_element &x)
+{
+  size_t colon2 = loc.rfind(':');
+  if (colon2 == string::npos || colon2 == 0)
+    return false;
+  size_t colon1 = loc.rfind(':', colon2 - 1);
+  if (colon1 == string::npos)
+    return false;
+  try
+    {
+      x.file = loc.substr(0, colon1);
+      x.line = lex_cast<int>(loc.substr(colon1 + 1, colon2 - colon1 - 1));
+      x.col = lex_cast<int>(loc.substr(colon2 + 1));
+    }
+  catch (const runtime_error&)
+    {
+      return false;
+    }
+  return true;
+}
+
+
+void add_executed(sqlite3 *db, coverage_element &x)
+{
+  enter_element(db, x);
+  sql_step_element(coverage_stmts.add_executed, x, x.executed);
+}
+
+
+// Add the probe hits and branch counts of a saved -t report, or the
+// hits of a saved -q coverage report.  Their lines look like
+//   PP, (FILE:LINE:COL), hits: N, ...        in either report
+//   FILE:LINE:COL, taken: N, not taken: M    in the branch report
+//   NAME(), (FILE:LINE:COL), calls: N        in the coverage report
+void import_pgo_report(systemtap_session &s, const string &report)
+{
+  ifstream in(report.c_str());
+  if (!in)
+    throw SEMANTIC_ERROR(_F("cannot open -t report '%s'", report.c_str()));
+
+  sqlite3 *db = open_coverage_db(s);
+  if (!db)
+    return;
+
+  enum { none, probes, branches, coverage } section = none;
+  unsigned imported = 0;
+  string line;
+  while (getline(in, line))
+    {
+      if (startswith(line, "----- "))
+        {
+          section = (line.find("probe hit report") != string::npos) ? probes
+            : (line.find("branch report") != string::npos) ? branches
+            : (line.find("coverage report") != string::npos) ? coverage : none;
+          continue;
+        }
+
+      coverage_element x;
+      if (section == coverage && line.find("), calls: ") != string::npos)
+        {
+          size_t calls = line.find("), calls: ");
+          size_t open = line.rfind("(), (", calls);
+          if (open == string::npos
+              || !parse_report_location(line.substr(open + 5, calls - open - 5), x))
+            continue;
+          x.type = db_type_function;
+          x.name = line.substr(0, open);
+          x.executed = atoll(line.c_str() + calls + 10);
+          add_executed(db, x);
+          imported++;
+        }
+      else if (section == probes || section == coverage)
+        {
+          // The probe point may itself contain ", (", so split at the
+          // fixed "), hits: " text after the location.
+          size_t hits = line.find("), hits: ");
+          if (hits == string::npos)
+            continue;
+          size_t open = line.rfind(", (", hits);
+          if (open == string::npos
+              || !parse_report_location(line.substr(open + 3, hits - open - 3), x))
+            continue;
+          x.type = db_type_probe_hits;
+          x.name = line.substr(0, open);
+          x.executed = atoll(line.c_str() + hits + 9);
+          add_executed(db, x);
+          imported++;
+        }
+      else if (section == branches)
+        {
+          size_t taken = line.find(", taken: ");
+          size_t not_taken = line.find(", not taken: ");
+          if (taken == string::npos || not_taken == string::npos
+              || !parse_report_location(line.substr(0, taken), x))
+            continue;
+          x.type = db_type_branch;
+          x.name = "taken";
+          x.executed = atoi(line.c_str() + taken + 9);
+          add_executed(db, x);
+          x.name = "not taken";
+          x.executed = atoi(line.c_str() + not_taken + 13);
+          add_executed(db, x);
+          imported++;
+        }
+    }
+
+  close_coverage_db(db);
+
+  if (s.verbose > 1)
+    clog << _F("Added %u profile entries from '%s' to the coverage database",
+               imported, report.c_str()) << endl;
+}
+
+
+// Fill s.pgo_probe_hits and s.pgo_branch_hits from the coverage
+// database, for translate.cxx to lay out the generated code with.
+void load_pgo_profile(systemtap_session &s)
+{
+  sqlite3 *db = open_coverage_db(s);
+  if (!db)
+    return;
+
+  int rc, rows, columns;
+  char *errmsg;
+  char **results = NULL;
+
+  ostringstream command;
+  command << "SELECT file, line, col, type, name, executed FROM counts "
+	  << "WHERE type=='" << db_type_probe_hits << "' OR type=='"
+	  << db_type_branch << "'";
+
+  rc = sqlite3_get_table(db, command.str().c_str(),
+			 &results, &rows, &columns, &errmsg);
+  if(rc != SQLITE_OK) {
+    cerr << _("Error in statement: ") << command.str() << " [" << errmsg << "]."
+				 << endl;
+  } else {
+    // row 0 holds the column names
+    for (int i = 1; i <= rows; i++) {
+      char **row = results + i * columns;
+      string loc = string(row[0] ?: "") + ":" + (row[1] ?: "0") + ":" + (row[2] ?: "0");
+      int type = atoi(row[3] ?: "0");
+      string name(row[4] ?: "");
+      int64_t executed = atoll(row[5] ?: "0");
+      if (type == db_type_probe_hits)
+        s.pgo_probe_hits[name + "@" + loc] += executed;
+      else if (name == "taken")
+        s.pgo_branch_hits[loc].first += executed;
+      else
+        s.pgo_branch_hits[loc].second += executed;
+    }
+  }
+  sqlite3_free_table(results);
+
+  close_coverage_db(db);
 }
 
 #endif /* HAVE_LIBSQLITE3 */
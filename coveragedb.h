@@ -24,7 +24,7 @@ times executed
 if (compiled == 0) object never compiled
 if (compiled > 0) object compiled
 
-The following are not currently implemented.
+With a -q coverage report imported, for probe hits and functions:
 if (executed == 0) never executed
 if (executed > 0) executed
 
@@ -50,6 +50,8 @@ enum db_type {
   db_type_function = 2,
   db_type_local = 3,
   db_type_global = 4,
+  db_type_probe_hits = 5, // name: probe point, executed: -t hits
+  db_type_branch = 6, // name: "taken" or "not taken", executed: -t counts
 };
 
 class coverage_element {
@@ -61,7 +63,7 @@ public:
   std::string name;
   std::string parent;
   int compiled;
-  int executed;
+  int64_t executed;
 
   coverage_element():
     line(0), col(0), compiled(0), executed(0) {}
@@ -75,6 +77,8 @@ public:
 
 void print_coverage_info(systemtap_session &s);
 void update_coverage_db(systemtap_session &s);
+void import_pgo_report(systemtap_session &s, const std::string &report);
+void load_pgo_profile(systemtap_session &s);
 
 #endif
 
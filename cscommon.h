@@ -42,8 +42,17 @@ extern "C"
 //       - Uses --tmpdir to specify temp directory to be used by stap, instead of -k, in order to
 //         avoid parsing error messages in search of stap's randomly-generated temp dir.
 //       - Advertises its protocol version using a 'version' tag in avahi.
+//   Versions 4.9 and higher
+//     Client:
+//       - Sends the request directory as a stream of files (see nss_send_tree) rather
+//         than as a zip file, to servers which advertise this version, announced by
+//         CS_STREAM_REQUEST_SIZE in place of the size of the zip file.
+//     Server:
+//       - Unpacks a streamed request as it arrives, and streams the response back.
 //
 #define CURRENT_CS_PROTOCOL_VERSION VERSION
+#define CS_STREAM_PROTOCOL_VERSION "4.9"
+#define CS_STREAM_REQUEST_SIZE (-1)
 
 struct cs_protocol_version
 {
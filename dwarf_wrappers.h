@@ -32,6 +32,10 @@ extern "C" {
 #define DW_ATE_UTF 0x10
 #endif
 
+#if ! _ELFUTILS_PREREQ(0, 171)
+#define DW_TAG_skeleton_unit 0x4a
+#endif
+
 #define DWFL_ASSERT(desc, arg) \
   dwfl_assert(desc, arg, __FILE__, __LINE__)
 
@@ -24,10 +24,12 @@
 #include "rpm_finder.h"
 #include "setupdwfl.h"
 #include "loc2stap.h"
+#include "cache.h"
 
 #include <cstdlib>
 #include <algorithm>
 #include <deque>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
@@ -38,6 +40,9 @@
 #include <cassert>
 #include <iomanip>
 #include <cerrno>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 extern "C" {
 #include <fcntl.h>
@@ -48,8 +53,13 @@ extern "C" {
 #include <regex.h>
 #include <glob.h>
 #include <fnmatch.h>
+#include <endian.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -114,6 +124,9 @@ dwflpp::~dwflpp()
   delete_map(module_cu_cache);
   delete_map(cu_function_cache);
   delete_map(mod_function_cache);
+  delete_map(function_indexes);
+  delete_map(probe_cu_indexes);
+  delete_map(function_name_tables);
   delete_map(cu_inl_function_cache);
   delete_map(cu_call_sites_cache);
   delete_map(global_alias_cache);
@@ -143,7 +156,13 @@ module_cache::~module_cache ()
 void
 dwflpp::get_module_dwarf(bool required, bool report)
 {
+  // Only the first call per module reads the debuginfo; libdwfl keeps it.
+  bool trace = (time_trace_active () && mod_info->dwarf_status == info_unknown);
+  if (trace)
+    time_trace_begin ("load debuginfo", module_name.empty () ? "kernel" : module_name);
   module_dwarf = dwfl_module_getdwarf(module, &module_bias);
+  if (trace)
+    time_trace_end ();
   mod_info->dwarf_status = (module_dwarf ? info_present : info_absent);
   if (!module_dwarf && report)
     {
@@ -296,6 +315,37 @@ dwflpp::function_name_matches_pattern(const string& name, const string& pattern)
 }
 
 
+// Whether the cached function index of the current module has a
+// function matching PATTERN, found without opening the module's DWARF.
+// KNOWN is false if there is no such index to tell.
+bool
+dwflpp::cached_functions_match(const string& pattern, bool& known)
+{
+  assert(module);
+  known = false;
+
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length;
+  if (!sess.use_cache || sess.poison_cache
+      || (bits_length = dwfl_module_build_id(module, &bits, &vaddr)) <= 0)
+    return false;
+
+  string path = get_build_id_cache_path(sess, "funcidx",
+                                        hex_dump(bits, bits_length), ".fidx");
+  function_index idx;
+  if (path.empty() || !idx.load(path))
+    return false;
+  touch_cache_index_entry(sess, path);
+
+  known = true;
+  for (const function_index::entry* e = idx.begin(); e != idx.end(); ++e)
+    if (function_name_matches_pattern(idx.name(*e), pattern))
+      return true;
+  return false;
+}
+
+
 bool
 dwflpp::function_name_matches(const string& pattern)
 {
@@ -430,6 +480,76 @@ dwflpp::iterate_over_modules<void>(int (*callback)(Dwfl_Module*,
 }
 
 
+// The compile units of DW, read once.  The skeleton units of split
+// DWARF are kept as they are, and only swapped for their split units,
+// whose .dwo or .dwp files libdw then opens, once something visits them.
+vector<Dwarf_Die>*
+dwflpp::get_module_cus(Dwarf* dw)
+{
+  vector<Dwarf_Die>*& v = module_cu_cache[dw];
+  if (v)
+    return v;
+  v = new vector<Dwarf_Die>;
+
+  Dwarf_Off off = 0;
+  size_t cuhl;
+  Dwarf_Off noff;
+  while (dwarf_nextcu (dw, off, &noff, &cuhl, NULL, NULL, NULL) == 0)
+    {
+      assert_no_interrupts();
+      Dwarf_Die die_mem;
+      Dwarf_Die *die;
+      die = dwarf_offdie (dw, off + cuhl, &die_mem);
+      /* Skip partial units. */
+      int tag = dwarf_tag (die);
+      if (tag == DW_TAG_compile_unit || tag == DW_TAG_skeleton_unit)
+        {
+          v->push_back (*die); /* copy */
+          if (tag == DW_TAG_skeleton_unit
+              || dwarf_hasattr (die, DW_AT_GNU_dwo_id))
+            split_dwarf_modules.insert (dw);
+        }
+      off = noff;
+    }
+  return v;
+}
+
+
+// Swap a skeleton unit for its split unit, if libdw can find it.
+void
+dwflpp::resolve_split_unit(Dwarf_Die* cu)
+{
+#if _ELFUTILS_PREREQ (0, 171)
+  uint8_t unit_type;
+  Dwarf_Die subdie;
+  memset (&subdie, 0, sizeof (subdie));
+  if (dwarf_cu_info (cu->cu, NULL, &unit_type, NULL, &subdie,
+                     NULL, NULL, NULL) == 0
+      && unit_type == DW_UT_skeleton && subdie.cu != NULL
+      && dwarf_tag (&subdie) == DW_TAG_compile_unit)
+    *cu = subdie;
+#else
+  (void) cu;
+#endif
+}
+
+
+Dwarf_Off
+dwflpp::cu_offset(Dwarf_Die* cu)
+{
+#if _ELFUTILS_PREREQ (0, 171)
+  uint8_t unit_type;
+  Dwarf_Die subdie;
+  memset (&subdie, 0, sizeof (subdie));
+  if (dwarf_cu_info (cu->cu, NULL, &unit_type, NULL, &subdie,
+                     NULL, NULL, NULL) == 0
+      && unit_type == DW_UT_split_compile && subdie.cu != NULL)
+    return dwarf_dieoffset (&subdie);
+#endif
+  return dwarf_dieoffset (cu);
+}
+
+
 template<> void
 dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
                                void *data,
@@ -439,27 +559,7 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
   Dwarf *dw = module_dwarf;
   if (!dw) return;
 
-  vector<Dwarf_Die>* v = module_cu_cache[dw];
-  if (v == 0)
-    {
-      v = new vector<Dwarf_Die>;
-      module_cu_cache[dw] = v;
-
-      Dwarf_Off off = 0;
-      size_t cuhl;
-      Dwarf_Off noff;
-      while (dwarf_nextcu (dw, off, &noff, &cuhl, NULL, NULL, NULL) == 0)
-        {
-          assert_no_interrupts();
-          Dwarf_Die die_mem;
-          Dwarf_Die *die;
-          die = dwarf_offdie (dw, off + cuhl, &die_mem);
-          /* Skip partial units. */
-          if (dwarf_tag (die) == DW_TAG_compile_unit)
-            v->push_back (*die); /* copy */
-          off = noff;
-        }
-    }
+  vector<Dwarf_Die>* v = get_module_cus(dw);
 
   if (want_types && module_tus_read.find(dw) == module_tus_read.end())
     {
@@ -483,8 +583,16 @@ dwflpp::iterate_over_cus<void>(int (*callback)(Dwarf_Die*, void*),
       module_tus_read.insert(dw);
     }
 
+  bool split = split_dwarf_modules.count(dw);
   for (auto i = v->begin(); i != v->end(); ++i)
     {
+      // A skeleton without its split unit has nothing to offer.
+      if (split)
+        resolve_split_unit (&*i);
+      if (split && dwarf_tag (&*i) == DW_TAG_skeleton_unit)
+        continue;
+      time_trace_scope ts ("cu", [&]{ const char *n = dwarf_diename (&*i);
+                                      return string (n ?: "<unknown>"); });
       int rc = (*callback)(&*i, data);
       assert_no_interrupts();
       if (rc != DWARF_CB_OK)
@@ -587,8 +695,17 @@ dwflpp::iterate_over_inline_instances<void>(int (*callback)(Dwarf_Die*, void*),
   assert (function);
   assert (func_is_inline ());
 
-  if (cu_inl_function_cache_done.insert(cu->addr).second)
-    cache_inline_instances(cu);
+  if (!cu_inl_function_cache_done.count(cu->addr))
+    {
+      function_index *idx = module_dwarf ? get_function_index(false) : NULL;
+      if (idx && idx->has_origins())
+        fill_origin_caches_from_index(idx, cu);
+      else
+        {
+          cu_inl_function_cache_done.insert(cu->addr);
+          cache_inline_instances(cu);
+        }
+    }
 
   vector<Dwarf_Die>* v = cu_inl_function_cache[function->addr];
   if (!v)
@@ -654,8 +771,17 @@ dwflpp::iterate_over_call_sites<void> (int (*callback)(Dwarf_Die*, Dwarf_Die*, v
   assert (cu);
   assert (function);
 
-  if (cu_call_sites_cache_done.insert(cu->addr).second)
-    cache_call_sites(cu, NULL);
+  if (!cu_call_sites_cache_done.count(cu->addr))
+    {
+      function_index *idx = module_dwarf ? get_function_index(false) : NULL;
+      if (idx && idx->has_origins())
+        fill_origin_caches_from_index(idx, cu);
+      else
+        {
+          cu_call_sites_cache_done.insert(cu->addr);
+          cache_call_sites(cu, NULL);
+        }
+    }
 
   vector<call_site_cache_t>* v = cu_call_sites_cache[function->addr];
   if (!v)
@@ -872,171 +998,1366 @@ dwflpp::get_parent_scope(Dwarf_Die* die)
   return NULL;
 }
 
-static const char*
-cache_type_prefix(Dwarf_Die* type)
+static const char*
+cache_type_prefix(Dwarf_Die* type)
+{
+  switch (dwarf_tag(type))
+    {
+    case DW_TAG_enumeration_type:
+      return "enum ";
+    case DW_TAG_structure_type:
+    case DW_TAG_class_type:
+      // treating struct/class as equals
+      return "struct ";
+    case DW_TAG_union_type:
+      return "union ";
+    }
+  return "";
+}
+
+/* GCC might generate a struct/class without DW_AT_declaration,
+   but that only contains members which have DW_AT_declaration
+   set.  We aren't interested in those.  PR14434 (GCC bug #54181).  */
+static bool
+has_only_decl_members (Dwarf_Die *die)
+{
+  Dwarf_Die child, import;
+  if (dwarf_child(die, &child) != 0)
+    return false; /* no members */
+
+  do
+    {
+      if (! dwarf_hasattr(&child, DW_AT_declaration))
+	return false; /* real member found.  */
+      int tag = dwarf_tag(&child);
+      if ((tag == DW_TAG_namespace
+           || tag == DW_TAG_structure_type
+           || tag == DW_TAG_class_type)
+          && ! has_only_decl_members (&child))
+	return false; /* real grand child member found.  */
+
+      // Unlikely to ever happen, but if there is an imported unit
+      // then check its children as if they are children of this DIE.
+      if (tag == DW_TAG_imported_unit
+	  && dwarf_attr_die(&child, DW_AT_import, &import)
+	  && ! has_only_decl_members (&import))
+	return false;
+    }
+  while (dwarf_siblingof(&child, &child) == 0);
+
+  return true; /* Tried all children and grandchildren. */
+}
+
+int
+dwflpp::global_alias_caching_callback(Dwarf_Die *die, bool has_inner_types,
+                                      const string& prefix, cu_type_cache_t *cache)
+{
+  const char *name = dwarf_diename(die);
+
+  if (!name || dwarf_hasattr(die, DW_AT_declaration)
+      || has_only_decl_members(die))
+    return DWARF_CB_OK;
+
+  int tag = dwarf_tag(die);
+  if (has_inner_types && (tag == DW_TAG_namespace
+                          || tag == DW_TAG_structure_type
+                          || tag == DW_TAG_class_type))
+    iterate_over_types(die, has_inner_types, prefix + name + "::",
+                       global_alias_caching_callback, cache);
+
+  if (tag != DW_TAG_namespace)
+    {
+      string type_name = prefix + cache_type_prefix(die) + name;
+      if (cache->find(type_name) == cache->end())
+        (*cache)[type_name] = *die;
+    }
+
+  return DWARF_CB_OK;
+}
+
+int
+dwflpp::global_alias_caching_callback_cus(Dwarf_Die *die, dwflpp *dw)
+{
+  mod_cu_type_cache_t *global_alias_cache;
+  global_alias_cache = &dw->global_alias_cache;
+
+  cu_type_cache_t *v = (*global_alias_cache)[die->addr];
+  if (v != 0)
+    return DWARF_CB_OK;
+
+  v = new cu_type_cache_t;
+  (*global_alias_cache)[die->addr] = v;
+  iterate_over_globals(die, global_alias_caching_callback, v);
+
+  return DWARF_CB_OK;
+}
+
+Dwarf_Die *
+dwflpp::declaration_resolve_other_cus(const string& name)
+{
+  iterate_over_cus(global_alias_caching_callback_cus, this, true);
+  for (auto i = global_alias_cache.begin();
+         i != global_alias_cache.end(); ++i)
+    {
+      cu_type_cache_t *v = (*i).second;
+      if (v->find(name) != v->end())
+        return & ((*v)[name]);
+    }
+
+  return NULL;
+}
+
+Dwarf_Die *
+dwflpp::declaration_resolve(const string& name)
+{
+  cu_type_cache_t *v = global_alias_cache[cu->addr];
+  if (v == 0) // need to build the cache, just once per encountered module/cu
+    {
+      v = new cu_type_cache_t;
+      global_alias_cache[cu->addr] = v;
+      iterate_over_globals(cu, global_alias_caching_callback, v);
+      if (sess.verbose > 4)
+        clog << _F("global alias cache %s:%s size %zu", module_name.c_str(),
+                   cu_name().c_str(), v->size()) << endl;
+    }
+
+  // XXX: it may be desirable to search other modules' declarations
+  // too, in case a module/shared-library processes a
+  // forward-declared pointer type only, where the actual definition
+  // may only be in vmlinux or the application.
+
+  if (v->find(name) == v->end())
+    return declaration_resolve_other_cus(name);
+
+  return & ((*v)[name]);
+}
+
+Dwarf_Die *
+dwflpp::declaration_resolve(Dwarf_Die *type)
+{
+  const char* name = dwarf_diename(type);
+  if (!name)
+    return NULL;
+
+  string type_name = cache_type_prefix(type) + string(name);
+  return declaration_resolve(type_name);
+}
+
+
+int
+dwflpp::cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v)
+{
+  const char *name = dwarf_diename(func);
+  if (!name)
+    return DWARF_CB_OK;
+
+  v->insert(make_pair(name, *func));
+  return DWARF_CB_OK;
+}
+
+
+int
+dwflpp::mod_function_caching_callback (Dwarf_Die* cu, cu_function_cache_t *v)
+{
+  // need to cast callback to func which accepts void*
+  dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
+                  v, 0);
+  return DWARF_CB_OK;
+}
+
+
+#define FUNCTION_INDEX_MAGIC "STAPFIDX"
+#define FUNCTION_INDEX_VERSION 2
+
+function_index::~function_index()
+{
+  if (map)
+    munmap(map, map_size);
+}
+
+
+// Point the entry and string tables into a serialized image, checking
+// that everything in it is self-consistent.
+bool
+function_index::attach(const char* data, size_t size)
+{
+  if (size < sizeof(header))
+    return false;
+
+  const header* h = (const header*) data;
+  if (memcmp(h->magic, FUNCTION_INDEX_MAGIC, sizeof(h->magic)) != 0
+      || h->version != FUNCTION_INDEX_VERSION)
+    return false;
+
+  size_t ents_size = (size_t) h->count * sizeof(entry);
+  size_t origs_size = (size_t) h->origin_count * sizeof(origin);
+  if (size != sizeof(header) + ents_size + origs_size + h->strtab_size
+      || h->strtab_size == 0)
+    return false;
+
+  const char* strs = data + sizeof(header) + ents_size + origs_size;
+  if (strs[h->strtab_size - 1] != '\0')
+    return false;
+
+  const entry* ents = (const entry*) (data + sizeof(header));
+  for (size_t i = 0; i < h->count; ++i)
+    if (ents[i].name >= h->strtab_size)
+      return false;
+
+  entries = ents;
+  count = h->count;
+  origins = (const origin*) (data + sizeof(header) + ents_size);
+  origin_count = h->origin_count;
+  origins_p = (h->flags & header_origins) != 0;
+  strtab = strs;
+  strtab_size = h->strtab_size;
+  return true;
+}
+
+
+bool
+function_index::load(const string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(header))
+    {
+      close(fd);
+      return false;
+    }
+
+  void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m == MAP_FAILED)
+    return false;
+
+  if (!attach((const char*) m, st.st_size))
+    {
+      munmap(m, st.st_size);
+      return false;
+    }
+
+  map = m;
+  map_size = st.st_size;
+
+  // Refresh the mtime so clean_cache() treats this as recently used.
+  utime(path.c_str(), NULL);
+  return true;
+}
+
+
+void
+function_index::build(const vector<entry>& ents, const vector<origin>& origs,
+                      bool with_origins, const string& strings)
+{
+  header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, FUNCTION_INDEX_MAGIC, sizeof(h.magic));
+  h.version = FUNCTION_INDEX_VERSION;
+  h.count = ents.size();
+  h.strtab_size = strings.size();
+  h.origin_count = origs.size();
+  h.flags = with_origins ? header_origins : 0;
+
+  owned.clear();
+  owned.reserve(sizeof(h) + ents.size() * sizeof(entry)
+                + origs.size() * sizeof(origin) + strings.size());
+  owned.append((const char*) &h, sizeof(h));
+  if (!ents.empty())
+    owned.append((const char*) &ents[0], ents.size() * sizeof(entry));
+  if (!origs.empty())
+    owned.append((const char*) &origs[0], origs.size() * sizeof(origin));
+  owned.append(strings);
+
+  bool ok = attach(owned.data(), owned.size());
+  assert(ok);
+  (void) ok;
+}
+
+
+static bool
+function_index_entry_less(const function_index::entry& a,
+                          const function_index::entry& b)
+{
+  if (a.cu_offset != b.cu_offset)
+    return a.cu_offset < b.cu_offset;
+  return a.die_offset < b.die_offset;
+}
+
+
+pair<const function_index::entry*, const function_index::entry*>
+function_index::cu_range(Dwarf_Off cu_offset) const
+{
+  entry key;
+  memset(&key, 0, sizeof(key));
+  key.cu_offset = cu_offset;
+  const entry* lo = lower_bound(begin(), end(), key, function_index_entry_less);
+  key.die_offset = (uint64_t) -1;
+  const entry* hi = upper_bound(lo, end(), key, function_index_entry_less);
+  return make_pair(lo, hi);
+}
+
+
+static bool
+function_index_origin_less(const function_index::origin& a,
+                           const function_index::origin& b)
+{
+  return a.cu_offset < b.cu_offset;
+}
+
+
+pair<const function_index::origin*, const function_index::origin*>
+function_index::origin_range(Dwarf_Off cu_offset) const
+{
+  origin key;
+  memset(&key, 0, sizeof(key));
+  key.cu_offset = cu_offset;
+  return equal_range(origins, origins + origin_count, key,
+                     function_index_origin_less);
+}
+
+
+static int
+collect_cu_dies_callback (Dwarf_Die* cu, vector<Dwarf_Die*>* v)
+{
+  v->push_back(cu);
+  return DWARF_CB_OK;
+}
+
+
+struct function_index_builder
+{
+  vector<function_index::entry> entries;
+  vector<function_index::origin> origins;
+  bool with_origins = false;
+  string strings;
+  unordered_map<string, uint32_t> string_offsets;
+  Dwarf_Off cu_offset;
+
+  uint32_t add_string(const char* s)
+  {
+    auto it = string_offsets.find(s);
+    if (it != string_offsets.end())
+      return it->second;
+    uint32_t off = strings.size();
+    strings.append(s, strlen(s) + 1);
+    string_offsets[s] = off;
+    return off;
+  }
+
+  static int func_callback(Dwarf_Die* func, function_index_builder* b)
+  {
+    // same selection as cu_function_caching_callback
+    const char *name = dwarf_diename(func);
+    if (!name)
+      return DWARF_CB_OK;
+
+    function_index::entry e;
+    memset(&e, 0, sizeof(e));
+    e.cu_offset = b->cu_offset;
+    e.die_offset = dwarf_dieoffset(func);
+    e.name = b->add_string(name);
+    if (dwarf_func_inline(func) != 0)
+      e.flags |= function_index::flag_inline;
+    Dwarf_Addr pc;
+    if (dwarf_entrypc(func, &pc) == 0)
+      {
+        e.entrypc = pc;
+        e.flags |= function_index::flag_entrypc;
+      }
+    b->entries.push_back(e);
+    return DWARF_CB_OK;
+  }
+
+  // The walks of dwflpp::cache_inline_instances() and
+  // dwflpp::cache_call_sites() in one, with SCOPE the function around
+  // DIE, and IMPORTED whether DIE was reached through an imported unit,
+  // which only the former follows.
+  void add_origins(Dwarf_Die* die, Dwarf_Die* scope, bool imported)
+  {
+    int tag = dwarf_tag(die);
+    Dwarf_Die origin;
+    if ((tag == DW_TAG_inlined_subroutine
+         || (tag == DW_TAG_GNU_call_site && scope && !imported))
+        && dwarf_attr_die(die, DW_AT_abstract_origin, &origin))
+      {
+        function_index::origin o;
+        memset(&o, 0, sizeof(o));
+        o.cu_offset = cu_offset;
+        o.origin_offset = dwarf_dieoffset(&origin);
+        o.die_offset = dwarf_dieoffset(die);
+        if (tag == DW_TAG_GNU_call_site)
+          {
+            o.kind = function_index::origin_call_site;
+            o.scope_offset = dwarf_dieoffset(scope);
+          }
+        origins.push_back(o);
+      }
+
+    Dwarf_Die child, import;
+    if (dwarf_child(die, &child) == 0)
+      do
+        {
+          switch (dwarf_tag (&child))
+            {
+            case DW_TAG_compile_unit:
+            case DW_TAG_module:
+            case DW_TAG_lexical_block:
+            case DW_TAG_with_stmt:
+            case DW_TAG_catch_block:
+            case DW_TAG_try_block:
+            case DW_TAG_entry_point:
+            case DW_TAG_GNU_call_site:
+              add_origins(&child, scope, imported);
+              break;
+
+            case DW_TAG_inlined_subroutine:
+            case DW_TAG_subprogram:
+              add_origins(&child, &child, imported);
+              break;
+
+            case DW_TAG_imported_unit:
+              if (dwarf_attr_die(&child, DW_AT_import, &import))
+                add_origins(&import, scope, true);
+              break;
+
+            default:
+              break;
+            }
+        }
+      while (dwarf_siblingof(&child, &child) == 0);
+  }
+
+  static int cu_callback(Dwarf_Die* cu, function_index_builder* b)
+  {
+    b->cu_offset = dwarf_dieoffset(cu);
+    // need to cast callback to func which accepts void*
+    dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))func_callback, b, 0);
+    if (b->with_origins)
+      b->add_origins(cu, NULL, false);
+    return DWARF_CB_OK;
+  }
+};
+
+
+// Whether the origins of a module's index can be recorded: not with a
+// dwz alt file, whose DIE offsets overlap those of the module.
+static bool
+function_index_origins_p(Dwarf* dw)
+{
+#if _ELFUTILS_PREREQ (0, 159)
+  return dwarf_getalt (dw) == NULL;
+#else
+  (void) dw;
+  return true;
+#endif
+}
+
+
+// Scan a share of the CUs of a debuginfo file on a private libdw
+// handle.  libdw handles are not safe to share between threads, so
+// each worker opens the file itself and only reports DIE offsets,
+// which mean the same thing in the main thread's handle.  Workers
+// pull CUs off a shared counter so that big and small CUs balance out.
+static void
+function_index_worker(const char* path, const vector<Dwarf_Off>* cus,
+                      atomic<size_t>* next, function_index_builder* b,
+                      bool* ok)
+{
+  *ok = false;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+  Elf* elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+  GElf_Ehdr ehdr_mem, *ehdr = elf ? gelf_getehdr(elf, &ehdr_mem) : NULL;
+  // ET_REL debuginfo (kernel modules) needs libdwfl's relocations.
+  Dwarf* dw = (ehdr && ehdr->e_type != ET_REL)
+              ? dwarf_begin_elf(elf, DWARF_C_READ, NULL) : NULL;
+  if (dw)
+    {
+      *ok = true;
+      for (size_t i = (*next)++; i < cus->size(); i = (*next)++)
+        {
+          Dwarf_Die cu_mem;
+          if (pending_interrupts
+              || dwarf_offdie(dw, (*cus)[i], &cu_mem) == NULL)
+            {
+              *ok = false;
+              break;
+            }
+          function_index_builder::cu_callback(&cu_mem, b);
+        }
+      dwarf_end(dw);
+    }
+  if (elf)
+    elf_end(elf);
+  close(fd);
+}
+
+
+// Combine the per-worker results into IDX, sorted by (CU, DIE) and with
+// the names laid out in that order, so the image doesn't depend on how
+// the CUs were split up.
+static void
+merge_function_index_builders(vector<function_index_builder>& builders,
+                              function_index* idx)
+{
+  vector<pair<function_index::entry, const char*> > all;
+  for (auto& b : builders)
+    for (auto& e : b.entries)
+      all.push_back(make_pair(e, b.strings.data() + e.name));
+  sort(all.begin(), all.end(),
+       [](const pair<function_index::entry, const char*>& a,
+          const pair<function_index::entry, const char*>& b)
+       { return function_index_entry_less(a.first, b.first); });
+
+  function_index_builder merged;
+  merged.add_string(""); // offset 0 is the empty string
+  for (auto& p : all)
+    {
+      p.first.name = merged.add_string(p.second);
+      merged.entries.push_back(p.first);
+    }
+
+  // Each CU's origins are in the order of its walk, by one builder.
+  for (auto& b : builders)
+    merged.origins.insert(merged.origins.end(),
+                          b.origins.begin(), b.origins.end());
+  stable_sort(merged.origins.begin(), merged.origins.end(),
+              function_index_origin_less);
+  merged.with_origins = !builders.empty() && builders[0].with_origins;
+
+  idx->build(merged.entries, merged.origins, merged.with_origins,
+             merged.strings);
+}
+
+
+// Walk the whole module once, the way the uncached function caches
+// would, and keep the result in IDX.  With --jobs, the CUs are split
+// among worker threads; the entries are sorted and their names laid
+// out again afterwards, so the image doesn't depend on the split.
+void
+dwflpp::build_function_index(function_index* idx)
+{
+  vector<Dwarf_Die*> cu_dies;
+  iterate_over_cus (collect_cu_dies_callback, &cu_dies, false);
+
+  vector<function_index_builder> builders;
+  bool origins = function_index_origins_p (module_dwarf);
+  unsigned jobs = min((size_t) sess.jobs, cu_dies.size() / 16);
+  const char *mainfile = NULL, *debugfile = NULL;
+  if (jobs > 1)
+    dwfl_module_info (module, NULL, NULL, NULL, NULL, NULL,
+                      &mainfile, &debugfile);
+#if _ELFUTILS_PREREQ (0, 159)
+  // A private handle wouldn't reliably find a dwz alt file, and
+  // names found through it could go missing.
+  if (dwarf_getalt (module_dwarf) != NULL)
+    jobs = 1;
+#endif
+  if (jobs > 1 && (debugfile || mainfile))
+    {
+      vector<Dwarf_Off> cus;
+      for (auto cu : cu_dies)
+        cus.push_back(dwarf_dieoffset(cu));
+
+      atomic<size_t> next(0);
+      builders.resize(jobs);
+      for (auto& b : builders)
+        b.with_origins = origins;
+      unique_ptr<bool[]> ok(new bool[jobs]);
+      vector<thread> workers;
+      for (unsigned i = 0; i < jobs; ++i)
+        workers.push_back(thread(function_index_worker,
+                                 debugfile ?: mainfile, &cus, &next,
+                                 &builders[i], &ok[i]));
+      for (auto& w : workers)
+        w.join();
+      assert_no_interrupts();
+
+      for (unsigned i = 0; i < jobs; ++i)
+        if (!ok[i])
+          {
+            if (sess.verbose > 2)
+              clog << _F("function index %s: parallel scan failed, retrying serially",
+                         module_name.c_str()) << endl;
+            builders.clear();
+            break;
+          }
+      if (!builders.empty() && sess.verbose > 2)
+        clog << _F("function index %s: scanned %zu CUs with %u jobs",
+                   module_name.c_str(), cus.size(), jobs) << endl;
+    }
+
+  if (builders.empty())
+    {
+      builders.resize(1);
+      builders[0].with_origins = origins;
+      for (auto cu : cu_dies)
+        {
+          function_index_builder::cu_callback(cu, &builders[0]);
+          assert_no_interrupts();
+        }
+    }
+
+  merge_function_index_builders(builders, idx);
+}
+
+
+// Return the function index for the current module, loading it from
+// the cache or building (and saving) it on first use.  NULL means the
+// index wouldn't help: nothing can be cached (no cache, or no build-id
+// to key on) and there is no --jobs parallelism to exploit in building
+// one just for this run.  Callers then walk the DWARF directly.  Unless
+// build is set, an index that isn't there already is not built, since
+// that walks the whole module: only a lookup in every CU pays for it.
+function_index*
+dwflpp::get_function_index(bool build)
+{
+  assert(module && module_dwarf);
+
+  auto it = function_indexes.find(module_dwarf);
+  if (it != function_indexes.end())
+    return it->second;
+  function_index*& idx = function_indexes[module_dwarf];
+  idx = NULL;
+
+  string path;
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length;
+  if (sess.use_cache
+      && (bits_length = dwfl_module_build_id(module, &bits, &vaddr)) > 0)
+    path = get_build_id_cache_path(sess, "funcidx",
+                                   hex_dump(bits, bits_length), ".fidx");
+  if (path.empty() && sess.jobs <= 1)
+    return NULL;
+
+  // The index is keyed by offsets in the main debuginfo file, which
+  // functions in split units don't have.
+  get_module_cus(module_dwarf);
+  if (split_dwarf_modules.count(module_dwarf))
+    return NULL;
+
+  idx = new function_index;
+  if (!path.empty() && !sess.poison_cache && idx->load(path))
+    {
+      touch_cache_index_entry(sess, path);
+      if (sess.verbose > 2)
+        clog << _F("function index %s: using cached %s", module_name.c_str(),
+                   path.c_str()) << endl;
+      return idx;
+    }
+  if (!build)
+    {
+      delete idx;
+      function_indexes.erase(module_dwarf);
+      return NULL;
+    }
+
+  // Don't walk the whole module to build one when its own accelerator
+  // table already points probe points at the few CUs they need.
+  if (get_function_name_table())
+    {
+      delete idx;
+      idx = NULL;
+      return NULL;
+    }
+
+  build_function_index(idx);
+  if (!path.empty())
+    add_data_to_cache(sess, path, idx->image());
+  if (sess.verbose > 2)
+    clog << _F("function index %s: built %zu entries", module_name.c_str(),
+               (size_t) (idx->end() - idx->begin())) << endl;
+  return idx;
+}
+
+
+struct function_index_prefetch
+{
+  string object; // "kernel" or a user-space path
+  string path; // cache file, if an index was built
+  string image;
+};
+
+
+static int
+prefetch_module_callback(Dwfl_Module *mod, void **, const char *, Dwarf_Addr,
+                         void *arg)
+{
+  *(Dwfl_Module **) arg = mod;
+  return DWARF_CB_ABORT;
+}
+
+
+// Build the function index of one object on a private Dwfl, walking
+// the same debuginfo file that dwflpp would open for it.
+static void
+prefetch_function_index(const systemtap_session* s, function_index_prefetch* p)
+{
+  Dwfl *dwfl = setup_dwfl_private(p->object, *s);
+  if (!dwfl)
+    return;
+
+  Dwfl_Module *mod = NULL;
+  dwfl_getmodules(dwfl, prefetch_module_callback, &mod, 0);
+
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = mod ? dwfl_module_build_id(mod, &bits, &vaddr) : 0;
+  string path;
+  if (bits_length > 0)
+    path = get_build_id_cache_path(*(systemtap_session*) s, "funcidx",
+                                   hex_dump(bits, bits_length), ".fidx");
+  if (path.empty() || (!s->poison_cache && access(path.c_str(), R_OK) == 0))
+    {
+      dwfl_end(dwfl);
+      return;
+    }
+
+  Dwarf_Addr bias;
+  Dwarf *dw = dwfl_module_getdwarf(mod, &bias);
+  if (dw)
+    {
+      vector<function_index_builder> builders(1);
+      builders[0].with_origins = function_index_origins_p (dw);
+      Dwarf_Off off = 0, noff;
+      size_t cuhl;
+      while (!pending_interrupts
+             && dwarf_nextcu(dw, off, &noff, &cuhl, NULL, NULL, NULL) == 0)
+        {
+          // NB: only full CUs, like iterate_over_cus()
+          Dwarf_Die cu_mem, *cu = dwarf_offdie(dw, off + cuhl, &cu_mem);
+          if (cu && dwarf_tag(cu) == DW_TAG_compile_unit)
+            function_index_builder::cu_callback(cu, &builders[0]);
+          off = noff;
+        }
+      if (!pending_interrupts)
+        {
+          function_index idx;
+          merge_function_index_builders(builders, &idx);
+          p->path = path;
+          p->image = idx.image();
+        }
+    }
+  dwfl_end(dwfl);
+}
+
+
+static void
+prefetch_function_index_worker(const systemtap_session* s,
+                               vector<function_index_prefetch>* work,
+                               atomic<size_t>* next)
+{
+  for (size_t i = (*next)++; i < work->size(); i = (*next)++)
+    prefetch_function_index(s, &(*work)[i]);
+}
+
+
+// Build the function indexes of several objects at once, one --jobs
+// worker per object, before probe derivation gets to them one at a
+// time.  Derivation itself stays serial -- it mutates shared session
+// state all over -- but then finds the indexes already in the cache.
+void
+prefetch_function_indexes(systemtap_session& s, const set<string>& objects)
+{
+  unsigned jobs = min((size_t) s.jobs, objects.size());
+  if (jobs <= 1 || !s.use_cache)
+    return;
+
+  vector<function_index_prefetch> work(objects.size());
+  size_t n = 0;
+  for (auto it = objects.begin(); it != objects.end(); ++it)
+    work[n++].object = *it;
+
+  atomic<size_t> next(0);
+  vector<thread> workers;
+  for (unsigned i = 0; i < jobs; ++i)
+    workers.push_back(thread(prefetch_function_index_worker, &s, &work, &next));
+  for (auto& w : workers)
+    w.join();
+  assert_no_interrupts();
+
+  // Write the results from this thread only, in a fixed order.
+  for (auto& p : work)
+    if (!p.path.empty())
+      {
+        if (s.verbose > 2)
+          clog << _F("function index %s: prefetched into %s",
+                     p.object.c_str(), p.path.c_str()) << endl;
+        add_data_to_cache(s, p.path, p.image);
+      }
+}
+
+
+// Return the probe point CU index of the current module, loading it
+// from the cache on first use.  Each line of the file lists the hex
+// offsets of the CUs a probe point matched, a tab, and the probe point.
+probe_cu_index*
+dwflpp::get_probe_cu_index()
+{
+  assert(module && module_dwarf);
+
+  probe_cu_index*& idx = probe_cu_indexes[module_dwarf];
+  if (idx)
+    return idx;
+  idx = new probe_cu_index;
+
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id(module, &bits, &vaddr);
+  if (bits_length <= 0)
+    return idx;
+  idx->path = get_build_id_cache_path(sess, "probecus",
+                                      hex_dump(bits, bits_length), ".cus");
+  if (idx->path.empty() || sess.poison_cache)
+    return idx;
+
+  ifstream in(idx->path.c_str());
+  string line;
+  if (!getline(in, line) || line != "stap probe cus 1")
+    return idx;
+  while (getline(in, line))
+    {
+      size_t tab = line.find('\t');
+      if (tab == string::npos)
+        continue;
+      vector<Dwarf_Off>& cus = idx->cus[line.substr(tab + 1)];
+      istringstream offs(line.substr(0, tab));
+      Dwarf_Off off;
+      while (offs >> hex >> off)
+        cus.push_back(off);
+    }
+  touch_cache_index_entry(sess, idx->path);
+  if (sess.verbose > 2)
+    clog << _F("probe point CUs %s: using cached %s", module_name.c_str(),
+               idx->path.c_str()) << endl;
+  return idx;
+}
+
+
+bool
+dwflpp::get_probe_point_cus(const string& probe_point, vector<Dwarf_Die>& cus)
+{
+  get_module_dwarf(false);
+  if (!module_dwarf)
+    return false;
+
+  probe_cu_index* idx = get_probe_cu_index();
+  auto it = idx->cus.find(probe_point);
+  if (it == idx->cus.end())
+    return false;
+
+  cus.clear();
+  for (auto off = it->second.begin(); off != it->second.end(); ++off)
+    {
+      Dwarf_Die cu_mem;
+      int tag = -1;
+      if (dwarf_offdie (module_dwarf, *off, &cu_mem) != NULL)
+        tag = dwarf_tag (&cu_mem);
+      if (tag != DW_TAG_compile_unit && tag != DW_TAG_skeleton_unit)
+        {
+          // Not the debuginfo it was recorded against after all.
+          idx->cus.erase(it);
+          cus.clear();
+          return false;
+        }
+      resolve_split_unit (&cu_mem);
+      if (dwarf_tag (&cu_mem) != DW_TAG_skeleton_unit)
+        cus.push_back (cu_mem);
+    }
+  return true;
+}
+
+
+// Little-endian, as .gdb_index always is.
+static inline uint32_t
+gdb_index_u32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return le32toh(v);
+}
+
+static inline uint64_t
+gdb_index_u64(const unsigned char* p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return le64toh(v);
+}
+
+
+// Read the functions of a .gdb_index, versions 7 to 9, whose CU
+// vectors say what kind of symbol each name is.
+bool
+function_name_table::read_gdb_index(Elf_Data* data)
+{
+  const unsigned char* p = (const unsigned char*) data->d_buf;
+  size_t size = data->d_size;
+  if (p == NULL || size < 24)
+    return false;
+
+  uint32_t version = gdb_index_u32(p);
+  uint32_t cu_list = gdb_index_u32(p + 4);
+  uint32_t types_list = gdb_index_u32(p + 8);
+  uint32_t symtab = gdb_index_u32(p + 16);
+  uint32_t pool = gdb_index_u32(p + 20);
+  if (version < 7 || version > 9
+      || cu_list > types_list || types_list > size
+      || symtab > pool || pool > size)
+    return false;
+
+  size_t cu_count = (types_list - cu_list) / 16;
+  for (size_t i = 0; i < cu_count; ++i)
+    covered_cus.insert(gdb_index_u64(p + cu_list + 16 * i));
+
+  for (size_t slot = symtab; slot + 8 <= pool; slot += 8)
+    {
+      uint32_t name = gdb_index_u32(p + slot);
+      uint32_t vec = gdb_index_u32(p + slot + 4);
+      if (name == 0 && vec == 0)
+        continue;
+      if ((size_t) pool + name >= size || (size_t) pool + vec + 4 > size)
+        return false;
+      const char* str = (const char*) p + pool + name;
+      if (memchr(str, '\0', size - pool - name) == NULL)
+        return false;
+
+      // C++ names are qualified here, but probe points match the
+      // plain DW_AT_name, so index the last component too.
+      const char* last = NULL;
+      int depth = 0;
+      for (const char* c = str; *c; ++c)
+        if (*c == '<' || *c == '(')
+          ++depth;
+        else if (*c == '>' || *c == ')')
+          --depth;
+        else if (depth == 0 && c[0] == ':' && c[1] == ':')
+          last = c + 2;
+
+      size_t count = gdb_index_u32(p + pool + vec);
+      if ((size_t) pool + vec + 4 + 4 * count > size)
+        return false;
+      for (size_t j = 0; j < count; ++j)
+        {
+          uint32_t cu = gdb_index_u32(p + pool + vec + 4 + 4 * j);
+          uint32_t index = cu & 0xffffff;
+          uint32_t kind = (cu >> 28) & 7;
+          if (kind != 3 /* GDB_INDEX_SYMBOL_KIND_FUNCTION */ || index >= cu_count)
+            continue;
+          Dwarf_Off off = gdb_index_u64(p + cu_list + 16 * index);
+          names.push_back(make_pair(str, off));
+          if (last && *last)
+            names.push_back(make_pair(last, off));
+        }
+    }
+  return true;
+}
+
+
+static bool
+debug_names_uleb(const unsigned char*& p, const unsigned char* end, uint64_t& v)
 {
-  switch (dwarf_tag(type))
+  v = 0;
+  for (unsigned shift = 0; p < end && shift < 64; shift += 7)
     {
-    case DW_TAG_enumeration_type:
-      return "enum ";
-    case DW_TAG_structure_type:
-    case DW_TAG_class_type:
-      // treating struct/class as equals
-      return "struct ";
-    case DW_TAG_union_type:
-      return "union ";
+      unsigned char b = *p++;
+      v |= (uint64_t) (b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
     }
-  return "";
+  return false;
 }
 
-/* GCC might generate a struct/class without DW_AT_declaration,
-   but that only contains members which have DW_AT_declaration
-   set.  We aren't interested in those.  PR14434 (GCC bug #54181).  */
+
+// Skip an attribute value of a .debug_names entry, keeping it in V if
+// it is a constant.
 static bool
-has_only_decl_members (Dwarf_Die *die)
+debug_names_value(const unsigned char*& p, const unsigned char* end,
+                  uint64_t form, uint64_t& v)
 {
-  Dwarf_Die child, import;
-  if (dwarf_child(die, &child) != 0)
-    return false; /* no members */
-
-  do
+  size_t n;
+  switch (form)
     {
-      if (! dwarf_hasattr(&child, DW_AT_declaration))
-	return false; /* real member found.  */
-      int tag = dwarf_tag(&child);
-      if ((tag == DW_TAG_namespace
-           || tag == DW_TAG_structure_type
-           || tag == DW_TAG_class_type)
-          && ! has_only_decl_members (&child))
-	return false; /* real grand child member found.  */
-
-      // Unlikely to ever happen, but if there is an imported unit
-      // then check its children as if they are children of this DIE.
-      if (tag == DW_TAG_imported_unit
-	  && dwarf_attr_die(&child, DW_AT_import, &import)
-	  && ! has_only_decl_members (&import))
-	return false;
+    case DW_FORM_flag_present:
+      v = 1;
+      return true;
+    case DW_FORM_udata:
+    case DW_FORM_ref_udata:
+    case DW_FORM_sdata:
+      return debug_names_uleb(p, end, v);
+    case DW_FORM_data1: case DW_FORM_ref1: case DW_FORM_flag: n = 1; break;
+    case DW_FORM_data2: case DW_FORM_ref2: n = 2; break;
+    case DW_FORM_data4: case DW_FORM_ref4: n = 4; break;
+    case DW_FORM_data8: case DW_FORM_ref8: case DW_FORM_ref_sig8: n = 8; break;
+    default:
+      return false;
     }
-  while (dwarf_siblingof(&child, &child) == 0);
-
-  return true; /* Tried all children and grandchildren. */
+  if ((size_t) (end - p) < n)
+    return false;
+  v = 0;
+  memcpy(&v, p, n);   // the table is in host byte order, checked by the caller
+  p += n;
+  return true;
 }
 
-int
-dwflpp::global_alias_caching_callback(Dwarf_Die *die, bool has_inner_types,
-                                      const string& prefix, cu_type_cache_t *cache)
+
+// Read the functions and inlined functions of every name index in a
+// DWARF5 .debug_names section.
+bool
+function_name_table::read_debug_names(Elf_Data* data, Elf_Data* str)
 {
-  const char *name = dwarf_diename(die);
+  const unsigned char* p = (const unsigned char*) data->d_buf;
+  const unsigned char* end = p + data->d_size;
+  const char* strs = (const char*) str->d_buf;
+  if (p == NULL || strs == NULL)
+    return false;
 
-  if (!name || dwarf_hasattr(die, DW_AT_declaration)
-      || has_only_decl_members(die))
-    return DWARF_CB_OK;
+  while (end - p >= 4)
+    {
+      uint64_t len;
+      unsigned offsize = 4;
+      uint32_t len32;
+      memcpy(&len32, p, 4);
+      p += 4;
+      len = len32;
+      if (len32 == 0xffffffff)
+        {
+          if (end - p < 8)
+            return false;
+          memcpy(&len, p, 8);
+          p += 8;
+          offsize = 8;
+        }
+      if (len < 36 || (uint64_t) (end - p) < len)
+        return false;
+      const unsigned char* unit_end = p + len;
 
-  int tag = dwarf_tag(die);
-  if (has_inner_types && (tag == DW_TAG_namespace
-                          || tag == DW_TAG_structure_type
-                          || tag == DW_TAG_class_type))
-    iterate_over_types(die, has_inner_types, prefix + name + "::",
-                       global_alias_caching_callback, cache);
+      uint16_t version;
+      memcpy(&version, p, 2);
+      if (version != 5)
+        return false;
+      uint32_t h[7]; // CUs, local TUs, foreign TUs, buckets, names,
+                     // abbrev table size, augmentation string size
+      memcpy(h, p + 4, sizeof(h));
+      const unsigned char* q = p + 4 + sizeof(h) + ((h[6] + 3) & ~3U);
 
-  if (tag != DW_TAG_namespace)
-    {
-      string type_name = prefix + cache_type_prefix(die) + name;
-      if (cache->find(type_name) == cache->end())
-        (*cache)[type_name] = *die;
+      auto read_off = [offsize](const unsigned char* at) -> uint64_t
+        {
+          uint64_t v = 0;
+          memcpy(&v, at, offsize);
+          return v;
+        };
+
+      const unsigned char* cus = q;
+      q += (uint64_t) h[0] * offsize;
+      q += (uint64_t) h[1] * offsize + (uint64_t) h[2] * 8;
+      q += (uint64_t) h[3] * 4 + (h[3] ? (uint64_t) h[4] * 4 : 0);
+      const unsigned char* str_offs = q;
+      q += (uint64_t) h[4] * offsize;
+      const unsigned char* entry_offs = q;
+      q += (uint64_t) h[4] * offsize;
+      const unsigned char* abbrevs = q;
+      q += h[5];
+      const unsigned char* pool = q;
+      if (q > unit_end || q < p)
+        return false;
+
+      for (uint32_t i = 0; i < h[0]; ++i)
+        covered_cus.insert(read_off(cus + i * offsize));
+
+      struct abbrev { uint64_t tag; vector<pair<uint64_t, uint64_t> > attrs; };
+      unordered_map<uint64_t, abbrev> abbrev_table;
+      for (const unsigned char* a = abbrevs; a < pool; )
+        {
+          uint64_t code, idx, form;
+          if (!debug_names_uleb(a, pool, code))
+            return false;
+          if (code == 0)
+            break;
+          abbrev& ab = abbrev_table[code];
+          if (!debug_names_uleb(a, pool, ab.tag))
+            return false;
+          while (true)
+            {
+              if (!debug_names_uleb(a, pool, idx) || !debug_names_uleb(a, pool, form))
+                return false;
+              if (idx == 0 && form == 0)
+                break;
+              ab.attrs.push_back(make_pair(idx, form));
+            }
+        }
+
+      for (uint32_t i = 0; i < h[4]; ++i)
+        {
+          uint64_t name_off = read_off(str_offs + i * offsize);
+          uint64_t entry_off = read_off(entry_offs + i * offsize);
+          if (name_off >= str->d_size
+              || memchr(strs + name_off, '\0', str->d_size - name_off) == NULL
+              || entry_off >= (uint64_t) (unit_end - pool))
+            return false;
+          const char* name = strs + name_off;
+
+          for (const unsigned char* e = pool + entry_off; ; )
+            {
+              uint64_t code;
+              if (!debug_names_uleb(e, unit_end, code))
+                return false;
+              if (code == 0)
+                break;
+              auto ab = abbrev_table.find(code);
+              if (ab == abbrev_table.end())
+                return false;
+              uint64_t cu = h[0] == 1 ? 0 : h[0];
+              for (auto& attr : ab->second.attrs)
+                {
+                  uint64_t v;
+                  if (!debug_names_value(e, unit_end, attr.second, v))
+                    return false;
+                  if (attr.first == 1 /* DW_IDX_compile_unit */)
+                    cu = v;
+                }
+              if ((ab->second.tag == DW_TAG_subprogram
+                   || ab->second.tag == DW_TAG_inlined_subroutine)
+                  && cu < h[0])
+                names.push_back(make_pair(name, (Dwarf_Off) read_off(cus + cu * offsize)));
+            }
+        }
+      p = unit_end;
     }
+  return true;
+}
 
-  return DWARF_CB_OK;
+
+void
+function_name_table::sort()
+{
+  std::sort(names.begin(), names.end(),
+            [](const pair<const char*, Dwarf_Off>& a,
+               const pair<const char*, Dwarf_Off>& b)
+            {
+              int c = strcmp(a.first, b.first);
+              return c < 0 || (c == 0 && a.second < b.second);
+            });
 }
 
-int
-dwflpp::global_alias_caching_callback_cus(Dwarf_Die *die, dwflpp *dw)
+
+// Read the current module's accelerator table, preferring .debug_names,
+// on first use.  NULL if it has none, or none this can read.
+function_name_table*
+dwflpp::get_function_name_table()
 {
-  mod_cu_type_cache_t *global_alias_cache;
-  global_alias_cache = &dw->global_alias_cache;
+  assert(module && module_dwarf);
 
-  cu_type_cache_t *v = (*global_alias_cache)[die->addr];
-  if (v != 0)
-    return DWARF_CB_OK;
+  auto it = function_name_tables.find(module_dwarf);
+  if (it != function_name_tables.end())
+    return it->second;
+  function_name_table*& table = function_name_tables[module_dwarf];
+  table = NULL;
 
-  v = new cu_type_cache_t;
-  (*global_alias_cache)[die->addr] = v;
-  iterate_over_globals(die, global_alias_caching_callback, v);
+  Elf* elf = dwarf_getelf(module_dwarf);
+  GElf_Ehdr ehdr_mem, *ehdr = elf ? gelf_getehdr(elf, &ehdr_mem) : NULL;
+  size_t shstrndx;
+  if (ehdr == NULL || elf_getshdrstrndx(elf, &shstrndx) != 0)
+    return NULL;
 
-  return DWARF_CB_OK;
-}
+  Elf_Data *debug_names = NULL, *debug_str = NULL, *gdb_index = NULL;
+  for (Elf_Scn* scn = elf_nextscn(elf, NULL); scn; scn = elf_nextscn(elf, scn))
+    {
+      GElf_Shdr shdr_mem, *shdr = gelf_getshdr(scn, &shdr_mem);
+      const char* name = shdr ? elf_strptr(elf, shstrndx, shdr->sh_name) : NULL;
+      if (name == NULL || shdr->sh_type == SHT_NOBITS)
+        continue;
+      Elf_Data** data = NULL;
+      if (strcmp(name, ".debug_names") == 0)
+        data = &debug_names;
+      else if (strcmp(name, ".debug_str") == 0)
+        data = &debug_str;
+      else if (strcmp(name, ".gdb_index") == 0)
+        data = &gdb_index;
+      if (data == NULL)
+        continue;
+#if _ELFUTILS_PREREQ (0, 165)
+      // libdw has already decompressed the sections it reads itself.
+      if ((shdr->sh_flags & SHF_COMPRESSED) && elf_compress(scn, 0, 0) < 0)
+        continue;
+#endif
+      *data = elf_getdata(scn, NULL);
+    }
 
-Dwarf_Die *
-dwflpp::declaration_resolve_other_cus(const string& name)
-{
-  iterate_over_cus(global_alias_caching_callback_cus, this, true);
-  for (auto i = global_alias_cache.begin();
-         i != global_alias_cache.end(); ++i)
+  bool host_order = ehdr->e_ident[EI_DATA] ==
+    (__BYTE_ORDER == __LITTLE_ENDIAN ? ELFDATA2LSB : ELFDATA2MSB);
+  const char* kind = NULL;
+  table = new function_name_table;
+  if (debug_names && debug_str && host_order
+      && table->read_debug_names(debug_names, debug_str))
+    kind = ".debug_names";
+  else
     {
-      cu_type_cache_t *v = (*i).second;
-      if (v->find(name) != v->end())
-        return & ((*v)[name]);
+      table->names.clear();
+      table->covered_cus.clear();
+      if (gdb_index && table->read_gdb_index(gdb_index))
+        kind = ".gdb_index";
+    }
+  if (kind == NULL || table->covered_cus.empty())
+    {
+      delete table;
+      table = NULL;
+      return NULL;
     }
 
-  return NULL;
+  table->sort();
+  if (sess.verbose > 2)
+    clog << _F("function names %s: %zu from %s, covering %zu CUs",
+               module_name.c_str(), table->names.size(), kind,
+               table->covered_cus.size()) << endl;
+  return table;
 }
 
-Dwarf_Die *
-dwflpp::declaration_resolve(const string& name)
+
+bool
+dwflpp::get_function_name_cus(const string& function, vector<Dwarf_Die>& cus)
 {
-  cu_type_cache_t *v = global_alias_cache[cu->addr];
-  if (v == 0) // need to build the cache, just once per encountered module/cu
+  get_module_dwarf(false);
+  if (!module_dwarf || function.empty())
+    return false;
+#if _ELFUTILS_PREREQ (0, 159)
+  // Functions in a dwz alt file's partial units show up in whichever
+  // CUs import them, which the table doesn't say.
+  if (dwarf_getalt (module_dwarf) != NULL)
+    return false;
+#endif
+  function_name_table* table = get_function_name_table();
+  if (table == NULL)
+    return false;
+
+  // Only the names sharing the pattern's literal prefix can match it.
+  string prefix = function.substr(0, function.find_first_of("*?[\\"));
+  unordered_set<Dwarf_Off> matched;
+  auto it = lower_bound(table->names.begin(), table->names.end(), prefix,
+                        [](const pair<const char*, Dwarf_Off>& a, const string& b)
+                        { return strcmp(a.first, b.c_str()) < 0; });
+  for (; it != table->names.end()
+         && strncmp(it->first, prefix.c_str(), prefix.size()) == 0; ++it)
+    if (fnmatch(function.c_str(), it->first, 0) == 0)
+      matched.insert(it->second);
+
+  cus.clear();
+  vector<Dwarf_Die>* all = get_module_cus(module_dwarf);
+  bool split = split_dwarf_modules.count(module_dwarf);
+  for (auto& cu_die : *all)
     {
-      v = new cu_type_cache_t;
-      global_alias_cache[cu->addr] = v;
-      iterate_over_globals(cu, global_alias_caching_callback, v);
-      if (sess.verbose > 4)
-        clog << _F("global alias cache %s:%s size %zu", module_name.c_str(),
-                   cu_name().c_str(), v->size()) << endl;
+      int tag = dwarf_tag(&cu_die);
+      if (tag == DW_TAG_type_unit)
+        continue;
+      // The table has unit offsets, before the CU header.
+      Dwarf_Die skeleton = cu_die;
+      Dwarf_Off die_off = cu_offset(&skeleton);
+      if (die_off != dwarf_dieoffset(&cu_die))
+        dwarf_offdie(module_dwarf, die_off, &skeleton);
+      Dwarf_Off off = die_off - dwarf_cuoffset(&skeleton);
+      if (table->covered_cus.count(off) && !matched.count(off))
+        continue;
+      if (split)
+        resolve_split_unit(&cu_die);
+      if (dwarf_tag(&cu_die) != DW_TAG_skeleton_unit)
+        cus.push_back(cu_die);
     }
+  return true;
+}
 
-  // XXX: it may be desirable to search other modules' declarations
-  // too, in case a module/shared-library processes a
-  // forward-declared pointer type only, where the actual definition
-  // may only be in vmlinux or the application.
 
-  if (v->find(name) == v->end())
-    return declaration_resolve_other_cus(name);
+void
+dwflpp::set_probe_point_cus(const string& probe_point,
+                            const vector<Dwarf_Off>& cus)
+{
+  get_module_dwarf(false);
+  if (!module_dwarf)
+    return;
 
-  return & ((*v)[name]);
+  probe_cu_index* idx = get_probe_cu_index();
+  idx->cus[probe_point] = cus;
+  if (idx->path.empty())
+    return;
+
+  ostringstream image;
+  image << "stap probe cus 1\n" << hex;
+  for (auto it = idx->cus.begin(); it != idx->cus.end(); ++it)
+    {
+      for (size_t i = 0; i < it->second.size(); ++i)
+        image << (i ? " " : "") << it->second[i];
+      image << '\t' << it->first << '\n';
+    }
+  add_data_to_cache(sess, idx->path, image.str());
 }
 
-Dwarf_Die *
-dwflpp::declaration_resolve(Dwarf_Die *type)
+
+// Fill a function cache from the index, either for one CU or (with a
+// NULL cu) the whole module.  Only the DIEs named by the index are
+// materialized, without any dwarf_getfuncs traversal.
+void
+dwflpp::fill_function_cache_from_index(function_index* idx, Dwarf_Die* cu,
+                                       cu_function_cache_t* v)
 {
-  const char* name = dwarf_diename(type);
-  if (!name)
-    return NULL;
+  const function_index::entry *first = idx->begin(), *last = idx->end();
+  if (cu)
+    tie(first, last) = idx->cu_range(dwarf_dieoffset(cu));
 
-  string type_name = cache_type_prefix(type) + string(name);
-  return declaration_resolve(type_name);
+  unordered_set<void*> inline_dies;
+  for (const function_index::entry* e = first; e != last; ++e)
+    {
+      Dwarf_Die die;
+      if (dwarf_offdie(module_dwarf, e->die_offset, &die) == NULL)
+        continue;
+      v->insert(make_pair(idx->name(*e), die));
+      if (e->flags & function_index::flag_inline)
+        inline_dies.insert(die.addr);
+    }
+  mod_info->update_symtab(v, &inline_dies);
 }
 
 
-int
-dwflpp::cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v)
+// Fill whichever of the inline instance and call site caches of CU
+// aren't yet, from the origins IDX recorded for it.
+void
+dwflpp::fill_origin_caches_from_index(function_index* idx, Dwarf_Die* cu)
 {
-  const char *name = dwarf_diename(func);
-  if (!name)
-    return DWARF_CB_OK;
+  bool inlines = cu_inl_function_cache_done.insert(cu->addr).second;
+  bool call_sites = cu_call_sites_cache_done.insert(cu->addr).second;
 
-  v->insert(make_pair(name, *func));
-  return DWARF_CB_OK;
-}
+  const function_index::origin *first, *last;
+  tie(first, last) = idx->origin_range(dwarf_dieoffset(cu));
+  for (const function_index::origin* o = first; o != last; ++o)
+    {
+      bool call_site = o->kind == function_index::origin_call_site;
+      if (call_site ? !call_sites : !inlines)
+        continue;
 
+      Dwarf_Die die, origin, scope;
+      if (dwarf_offdie(module_dwarf, o->die_offset, &die) == NULL
+          || dwarf_offdie(module_dwarf, o->origin_offset, &origin) == NULL)
+        continue;
 
-int
-dwflpp::mod_function_caching_callback (Dwarf_Die* cu, cu_function_cache_t *v)
-{
-  // need to cast callback to func which accepts void*
-  dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                  v, 0);
-  return DWARF_CB_OK;
+      if (!call_site)
+        {
+          vector<Dwarf_Die>*& v = cu_inl_function_cache[origin.addr];
+          if (!v)
+            v = new vector<Dwarf_Die>;
+          v->push_back(die);
+        }
+      else if (dwarf_offdie(module_dwarf, o->scope_offset, &scope) != NULL)
+        {
+          vector<call_site_cache_t>*& v = cu_call_sites_cache[origin.addr];
+          if (!v)
+            v = new vector<call_site_cache_t>;
+          v->push_back(call_site_cache_t(die, scope));
+        }
+    }
 }
 
 
@@ -1053,13 +2374,22 @@ dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
     {
       v = new cu_function_cache_t;
       cu_function_cache[cu->addr] = v;
-      // need to cast callback to func which accepts void*
-      dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                      v, 0);
+      // An exact name may only be looked up in a few CUs, so scan just
+      // this one unless a pattern will have every CU scanned anyway.
+      bool all_cus = name_has_wildcard(function) || startswith(function, "_Z");
+      function_index *idx = module_dwarf ? get_function_index(all_cus) : NULL;
+      if (idx)
+        fill_function_cache_from_index(idx, cu, v);
+      else
+        {
+          // need to cast callback to func which accepts void*
+          dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
+                          v, 0);
+          mod_info->update_symtab(v);
+        }
       if (sess.verbose > 4)
         clog << _F("function cache %s:%s size %zu", module_name.c_str(),
                    cu_name().c_str(), v->size()) << endl;
-      mod_info->update_symtab(v);
     }
 
   auto range = v->equal_range(function);
@@ -1137,15 +2467,39 @@ dwflpp::iterate_single_function<void>(int (*callback)(Dwarf_Die*, void*),
     return rc;
 
   cu_function_cache_t *v = mod_function_cache[module_dwarf];
+  vector<Dwarf_Die> name_cus;
+  if (v == 0 && !get_function_index()
+      && get_function_name_cus(function, name_cus))
+    {
+      // Rather than cache the functions of every CU, look in just the
+      // CUs the accelerator table names.
+      for (auto it = name_cus.begin(); it != name_cus.end(); ++it)
+        {
+          focus_on_cu(&*it);
+          rc = iterate_over_functions<void>(callback, data, function);
+          if (rc != DWARF_CB_OK) break;
+        }
+      this->cu = NULL;
+      this->function_name.clear();
+      this->function = NULL;
+      return rc;
+    }
+
   if (v == 0)
     {
       v = new cu_function_cache_t;
       mod_function_cache[module_dwarf] = v;
-      iterate_over_cus (mod_function_caching_callback, v, false);
+      function_index *idx = get_function_index();
+      if (idx)
+        fill_function_cache_from_index(idx, NULL, v);
+      else
+        {
+          iterate_over_cus (mod_function_caching_callback, v, false);
+          mod_info->update_symtab(v);
+        }
       if (sess.verbose > 4)
         clog << _F("module function cache %s size %zu", module_name.c_str(),
                    v->size()) << endl;
-      mod_info->update_symtab(v);
     }
 
   auto range = v->equal_range(function);
@@ -4311,6 +5665,129 @@ dwflpp::type_die_for_local (vector<Dwarf_Die>& scopes,
 }
 
 
+// Whether a location expression translates the same at any pc: no
+// CFA, entry values, implicit data or references to other DIEs.
+// Sets USES_FB if it needs the frame base.
+static bool
+location_is_pc_independent (const Dwarf_Op *expr, size_t len, bool &uses_fb)
+{
+  for (size_t i = 0; i < len; ++i)
+    {
+      unsigned atom = expr[i].atom;
+      if ((atom >= DW_OP_lit0 && atom <= DW_OP_lit31)
+          || (atom >= DW_OP_reg0 && atom <= DW_OP_reg31)
+          || (atom >= DW_OP_breg0 && atom <= DW_OP_breg31))
+        continue;
+      switch (atom)
+        {
+        case DW_OP_fbreg:
+          uses_fb = true;
+          break;
+        case DW_OP_addr: case DW_OP_regx: case DW_OP_bregx:
+        case DW_OP_const1u: case DW_OP_const1s: case DW_OP_const2u:
+        case DW_OP_const2s: case DW_OP_const4u: case DW_OP_const4s:
+        case DW_OP_const8u: case DW_OP_const8s: case DW_OP_constu:
+        case DW_OP_consts: case DW_OP_plus: case DW_OP_plus_uconst:
+        case DW_OP_minus: case DW_OP_mul: case DW_OP_div: case DW_OP_mod:
+        case DW_OP_and: case DW_OP_or: case DW_OP_xor: case DW_OP_not:
+        case DW_OP_neg: case DW_OP_abs: case DW_OP_shl: case DW_OP_shr:
+        case DW_OP_shra: case DW_OP_deref: case DW_OP_deref_size:
+        case DW_OP_dup: case DW_OP_drop: case DW_OP_swap: case DW_OP_over:
+        case DW_OP_pick: case DW_OP_rot: case DW_OP_stack_value:
+        case DW_OP_piece: case DW_OP_bit_piece:
+          break;
+        default:
+          return false;
+        }
+    }
+  return true;
+}
+
+
+static void
+print_location_ops (ostream &o, const Dwarf_Op *expr, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+    o << ' ' << (unsigned) expr[i].atom << ':' << expr[i].number
+      << ':' << expr[i].number2;
+}
+
+
+// Wide probes such as kernel.function("*") { print($$parms) } access
+// the same variables, with the same types, in the same registers or
+// frame slots over and over.  The translation only depends on the
+// location expression, the type and the access path, so key on those,
+// and let the callers reuse one accessor function for all of them.  The
+// type goes by its DIE offset in the module, so variables of different
+// CUs share an accessor when their type is the very same DIE, as with
+// the partial units of dwz or with type units.
+string
+dwflpp::tvar_accessor_key (vector<Dwarf_Die>& scopes, Dwarf_Addr pc,
+                           string const & local, const target_symbol *e,
+                           bool userspace_p)
+{
+  Dwarf_Die vardie, typedie, funcdie;
+  Dwarf_Attribute fb_attr_mem, *fb_attr;
+  try
+    {
+      fb_attr = find_variable_and_frame_base (scopes, pc, local, e,
+                                              &vardie, &typedie,
+                                              &fb_attr_mem, &funcdie);
+    }
+  catch (const semantic_error &)
+    {
+      return ""; // let the translation report it
+    }
+
+  Dwarf_Attribute loc_mem, *loc;
+  loc = dwarf_attr_integrate (&vardie, DW_AT_location, &loc_mem);
+  if (loc == NULL || dwarf_attr_die (&vardie, DW_AT_type, &typedie) == NULL)
+    return "";
+
+  Dwarf_Op *expr, *fb_expr = NULL;
+  size_t len, fb_len = 0;
+  bool uses_fb = false, fb_uses_fb = false;
+  if (dwarf_getlocation_addr (loc, pc, &expr, &len, 1) != 1 || len == 0
+      || !location_is_pc_independent (expr, len, uses_fb))
+    return "";
+  if (uses_fb
+      && (fb_attr == NULL
+          || dwarf_getlocation_addr (fb_attr, pc, &fb_expr, &fb_len, 1) != 1
+          || fb_len == 0
+          || !location_is_pc_independent (fb_expr, fb_len, fb_uses_fb)
+          || fb_uses_fb))
+    return "";
+
+  ostringstream key;
+  key << module_dwarf << ' ' << dwarf_dieoffset (&typedie) << ' '
+      << userspace_p << e->addressof << ' '
+      << e->tok->location.file->name << " loc";
+  print_location_ops (key, expr, len);
+  if (uses_fb)
+    {
+      key << " fb";
+      print_location_ops (key, fb_expr, fb_len);
+    }
+  for (auto c = e->components.begin(); c != e->components.end(); ++c)
+    switch (c->type)
+      {
+      case target_symbol::comp_struct_member:
+        key << " ->" << c->member;
+        break;
+      case target_symbol::comp_pretty_print:
+        key << " $" << c->member;
+        break;
+      case target_symbol::comp_literal_array_index:
+        key << " [" << c->num_index << ']';
+        break;
+      default:
+        key << " [*]";
+        break;
+      }
+  return key.str();
+}
+
+
 bool
 dwflpp::literal_stmt_for_return (location_context &ctx,
 				 Dwarf_Die *scope_die,
@@ -144,7 +144,8 @@ module_info
   std::set<std::pair<std::string,std::string> > marks; /* <provider,name> */
 
   void get_symtab();
-  void update_symtab(cu_function_cache_t *funcs);
+  void update_symtab(cu_function_cache_t *funcs,
+                     const std::unordered_set<void*> *inline_dies = NULL);
 
   module_info(const char *name) :
     mod(NULL),
@@ -202,6 +203,128 @@ struct inline_instance_info : base_func_info
   bool operator<(const inline_instance_info& other) const;
 };
 
+// An index of the functions that dwarf_getfuncs reports for every CU
+// of a module, persisted in the cache by build-id.  The on-disk image
+// is used in place via mmap: a header, an entry array sorted by
+// (cu_offset, die_offset), an origin array sorted by cu_offset, then a
+// NUL-separated string table.  This lets later runs fill the function
+// caches with dwarf_offdie() on just the DIEs they need, instead of
+// walking every CU of the module.  The origins, the inline instances
+// and call sites of each CU with their DW_AT_abstract_origin, likewise
+// fill the inline instance and call site caches.
+struct function_index
+{
+  struct header
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t strtab_size;
+    uint32_t origin_count;
+    uint32_t flags;
+  };
+
+  struct entry
+  {
+    uint64_t cu_offset;
+    uint64_t die_offset;
+    uint64_t entrypc;
+    uint32_t name;   // offset into the string table
+    uint32_t flags;
+  };
+
+  enum { flag_inline = 1, flag_entrypc = 2 };
+
+  struct origin
+  {
+    uint64_t cu_offset;
+    uint64_t origin_offset;
+    uint64_t die_offset;
+    uint64_t scope_offset; // function around a call site
+    uint32_t kind;
+    uint32_t reserved;
+  };
+
+  enum { origin_inline = 0, origin_call_site = 1 };
+
+  // Header flag: the origins were recorded.  They aren't for modules
+  // with a dwz alt file, whose offsets overlap the module's own.
+  enum { header_origins = 1 };
+
+  function_index(): entries(NULL), count(0), origins(NULL),
+    origin_count(0), origins_p(false), strtab(NULL), strtab_size(0),
+    map(NULL), map_size(0) {}
+  ~function_index();
+
+  bool load(const std::string& path);
+  void build(const std::vector<entry>& ents,
+             const std::vector<origin>& origs, bool with_origins,
+             const std::string& strings);
+  const std::string& image() const { return owned; }
+
+  std::pair<const entry*, const entry*> cu_range(Dwarf_Off cu_offset) const;
+  const entry* begin() const { return entries; }
+  const entry* end() const { return entries + count; }
+  const char* name(const entry& e) const { return strtab + e.name; }
+
+  bool has_origins() const { return origins_p; }
+  std::pair<const origin*, const origin*> origin_range(Dwarf_Off cu_offset) const;
+
+private:
+  const entry* entries;
+  size_t count;
+  const origin* origins;
+  size_t origin_count;
+  bool origins_p;
+  const char* strtab;
+  size_t strtab_size;
+  void* map;
+  size_t map_size;
+  std::string owned; // image when freshly built rather than mapped
+
+  bool attach(const char* data, size_t size);
+};
+
+// module -> function index
+typedef std::unordered_map<Dwarf*, function_index*> mod_function_index_t;
+
+// The CUs in which each probe point found functions, as remembered
+// across runs for one module's debuginfo.
+struct probe_cu_index
+{
+  std::string path; // cache file, empty if not cached
+  std::unordered_map<std::string, std::vector<Dwarf_Off> > cus;
+};
+
+// module -> probe point CU index
+typedef std::unordered_map<Dwarf*, probe_cu_index*> mod_probe_cu_index_t;
+
+// The function names in a module's own accelerator table, DWARF5
+// .debug_names or the older .gdb_index, each with the offset of a CU
+// that defines or inlines a function by that name, sorted by name.
+// The names point into the section data, which lives as long as the
+// module's Dwarf.  A probe point can then visit only the CUs whose
+// names match it, plus any CUs the table doesn't cover, such as those
+// of objects compiled without one, instead of walking all of them.
+struct function_name_table
+{
+  std::vector<std::pair<const char*, Dwarf_Off> > names;
+  std::unordered_set<Dwarf_Off> covered_cus; // all the CUs it indexes
+
+  bool read_debug_names(Elf_Data* data, Elf_Data* str);
+  bool read_gdb_index(Elf_Data* data);
+  void sort();
+};
+
+// module -> function name table, NULL if it has none
+typedef std::unordered_map<Dwarf*, function_name_table*> mod_function_name_table_t;
+
+// Build and cache the function indexes of the given objects ("kernel"
+// or user-space paths) on --jobs worker threads.
+void prefetch_function_indexes(systemtap_session& s,
+                               const std::set<std::string>& objects);
+
+
 struct location;
 class location_context;
 
@@ -242,6 +365,7 @@ struct dwflpp
   bool module_name_final_match(const std::string& pattern);
 
   bool function_name_matches_pattern(const std::string& name, const std::string& pattern);
+  bool cached_functions_match(const std::string& pattern, bool& known);
   bool function_name_matches(const std::string& pattern);
   bool function_scope_matches(const std::vector<std::string>& scopes);
 
@@ -268,6 +392,22 @@ struct dwflpp
                                   (void*)data);
     }
 
+  // The CUs of the current module in which PROBE_POINT found functions
+  // in an earlier run, if known.
+  bool get_probe_point_cus(const std::string& probe_point,
+                           std::vector<Dwarf_Die>& cus);
+  void set_probe_point_cus(const std::string& probe_point,
+                           const std::vector<Dwarf_Off>& cus);
+
+  // The CUs of the current module that may have functions matching
+  // FUNCTION, from its accelerator table.  False if it has none.
+  bool get_function_name_cus(const std::string& function,
+                             std::vector<Dwarf_Die>& cus);
+
+  // The offset to remember a CU by: that of its skeleton, for a split
+  // unit, since split units are only found through their skeletons.
+  static Dwarf_Off cu_offset(Dwarf_Die* cu);
+
   template<typename T>
   void iterate_over_cus(int (* callback)(Dwarf_Die*, T*),
                         T *data,
@@ -488,6 +628,24 @@ struct dwflpp
                                  Dwarf_Die *die_mem,
 				 bool lvalue);
 
+  // A key for the rvalue accessor of LOCAL at PC, equal for any other
+  // pc or variable of the module, in any CU, of the same type DIE and
+  // whose location translates the same; empty if the translation may
+  // depend on the pc.
+  std::string tvar_accessor_key (std::vector<Dwarf_Die>& scopes,
+                                 Dwarf_Addr pc,
+                                 std::string const & local,
+                                 const target_symbol *e,
+                                 bool userspace_p);
+
+  // Accessor functions already synthesized, by tvar_accessor_key(),
+  // and whether their result goes through fp32_to_fp64.
+  std::unordered_map<std::string, std::pair<functiondecl*, bool> > tvar_accessors;
+
+  // Pretty-printers of whole structs and unions by their address, by
+  // module, type DIE, print depth and script file.
+  std::unordered_map<std::string, functiondecl*> pretty_printers;
+
   bool literal_stmt_for_return (location_context &ctx,
 				Dwarf_Die *scope_die,
 				const target_symbol *e,
@@ -556,6 +714,23 @@ private:
   mod_cu_function_cache_t cu_function_cache;
   mod_function_cache_t mod_function_cache;
 
+  mod_function_index_t function_indexes;
+  function_index* get_function_index(bool build = true);
+  void build_function_index(function_index* idx);
+  void fill_function_cache_from_index(function_index* idx, Dwarf_Die* cu,
+                                      cu_function_cache_t* v);
+  void fill_origin_caches_from_index(function_index* idx, Dwarf_Die* cu);
+
+  mod_probe_cu_index_t probe_cu_indexes;
+  probe_cu_index* get_probe_cu_index();
+
+  mod_function_name_table_t function_name_tables;
+  function_name_table* get_function_name_table();
+
+  std::vector<Dwarf_Die>* get_module_cus(Dwarf* dw);
+  std::unordered_set<Dwarf*> split_dwarf_modules;
+  void resolve_split_unit(Dwarf_Die* cu);
+
   std::set<void*> cu_inl_function_cache_done; // CUs that are already cached
   cu_inl_function_cache_t cu_inl_function_cache;
   void cache_inline_instances (Dwarf_Die* die);
@@ -64,7 +64,7 @@ expression* add_condition (expression* a, expression* b)
 
 derived_probe::derived_probe (probe *p, probe_point *l, bool rewrite_loc):
   base (p), base_pp(l), group(NULL), sdt_semaphore_addr(0),
-  session_index((unsigned)-1)
+  session_index((unsigned)-1), sample(0)
 {
   assert (p);
   this->tok = p->tok;
@@ -1021,6 +1021,7 @@ derive_probes (systemtap_session& s,
 
           try
 	    {
+	      time_trace_scope ts ("derive_probes", [&]{ return loc->str (); });
 	      s.pattern_root->find_and_build (s, p, loc, 0, dps, builders); // <-- actual derivation!
 	    }
           catch (const semantic_error& e)
@@ -1293,7 +1294,7 @@ struct stat_decl_collector
   {
     symbol *sym = get_symbol_within_expression (e->stat);
     statistic_decl new_stat = statistic_decl();
-    int bit_shift = (e->params.size() == 0) ? 0 : e->params[0];
+    int bit_shift = (e->params.size() == 0 || e->ctype != sc_variance) ? 0 : e->params[0];
     int stat_op = STAT_OP_NONE;
 
     if ((bit_shift < 0) || (bit_shift > 62))
@@ -1301,6 +1302,22 @@ struct stat_decl_collector
                                bit_shift),
 			    e->tok);
 
+    if (e->ctype == sc_quantile)
+      {
+        // @quantile(S, N[, D]) is the N/D quantile, D defaulting to 100.
+        int64_t num = e->params[0];
+        int64_t den = (e->params.size() > 1) ? e->params[1] : 100;
+
+        if ((den < 1) || (den > 1000000000))
+          throw SEMANTIC_ERROR (_F("quantile divisor (%s) out of range <1..1000000000>",
+                                   lex_cast(den).c_str()),
+                                e->tok);
+        if ((num < 0) || (num > den))
+          throw SEMANTIC_ERROR (_F("quantile (%s/%s) out of range <0..1>",
+                                   lex_cast(num).c_str(), lex_cast(den).c_str()),
+                                e->tok);
+      }
+
     // The following helps to track which statistical operators are being
     // used with given global/local variable.  This information later helps
     // to optimize the runtime behaviour.
@@ -1317,9 +1334,18 @@ struct stat_decl_collector
       stat_op = STAT_OP_AVG;
     else if (e->ctype == sc_variance)
       stat_op = STAT_OP_VARIANCE;
+    else if (e->ctype == sc_quantile)
+      // The sketch estimates are bounded by the real min and max.
+      stat_op = STAT_OP_COUNT | STAT_OP_MIN | STAT_OP_MAX;
+    else if (e->ctype == sc_distinct)
+      stat_op = STAT_OP_COUNT;
 
     new_stat.bit_shift = bit_shift;
     new_stat.stat_ops |= stat_op;
+    if (e->ctype == sc_quantile)
+      new_stat.type = statistic_decl::quantile;
+    else if (e->ctype == sc_distinct)
+      new_stat.type = statistic_decl::distinct;
 
     map<interned_string, statistic_decl>::iterator i = session.stat_decls.find(sym->name);
     if (i == session.stat_decls.end())
@@ -1328,6 +1354,21 @@ struct stat_decl_collector
       {
 	i->second.stat_ops |= stat_op;
 
+	if ((e->ctype == sc_quantile && i->second.type != statistic_decl::quantile
+	     && i->second.type != statistic_decl::hdr)
+	    || (e->ctype == sc_distinct && i->second.type != statistic_decl::distinct))
+	  {
+	    if (i->second.type == statistic_decl::none)
+	      i->second.type = new_stat.type;
+	    else
+	      {
+		// FIXME: Support multiple co-declared histogram types
+		semantic_error se(ERR_SRC, _F("multiple histogram types declared on '%s'",
+					      sym->name.to_string().c_str()), e->tok);
+		session.print_error (se);
+	      }
+	  }
+
 	// The @variance operator for given stat S (i.e. call to
 	// _stp_stat_init()) is optionally parametrizeable
 	// (@variance(S[, N]), where N is a bit shift (the default is
@@ -1412,6 +1453,16 @@ struct stat_decl_collector
 	new_stat.linear_high = e->params[1];
 	new_stat.linear_step = e->params[2];
       }
+    else if (e->htype == hist_hdr)
+      {
+	new_stat.type = statistic_decl::hdr;
+	assert (e->params.size() == 1);
+	new_stat.hdr_bits = e->params[0];
+	if ((new_stat.hdr_bits < 1) || (new_stat.hdr_bits > 8))
+	  throw SEMANTIC_ERROR (_F("hdr histogram bits (%s) out of range <1..8>",
+				   lex_cast(new_stat.hdr_bits).c_str()),
+				e->tok);
+      }
     else
       {
 	assert (e->htype == hist_log);
@@ -1427,12 +1478,16 @@ struct stat_decl_collector
 	statistic_decl & old_stat = i->second;
 	if (!(old_stat == new_stat))
 	  {
-	    if (old_stat.type == statistic_decl::none)
+	    if (old_stat.type == statistic_decl::none
+		|| (old_stat.type == statistic_decl::quantile
+		    && new_stat.type == statistic_decl::hdr))
 	      {
+		// NB: @quantile can use any hdr histogram.
 	        i->second.type = new_stat.type;
 		i->second.linear_low = new_stat.linear_low;
 		i->second.linear_high = new_stat.linear_high;
 		i->second.linear_step = new_stat.linear_step;
+		i->second.hdr_bits = new_stat.hdr_bits;
 	      }
 	    else
 	      {
@@ -1450,6 +1505,7 @@ struct stat_decl_collector
 static int
 semantic_pass_stats (systemtap_session & sess)
 {
+  time_trace_scope ts ("semantic_pass_stats");
   stat_decl_collector sdc(sess);
 
   for (map<string,functiondecl*>::iterator it = sess.functions.begin(); it != sess.functions.end(); it++)
@@ -1483,6 +1539,7 @@ semantic_pass_stats (systemtap_session & sess)
 static int
 semantic_pass_vars (systemtap_session & sess)
 {
+  time_trace_scope ts ("semantic_pass_vars");
 
   map<functiondecl *, set<vardecl *> *> fmv;
   no_var_mutation_during_iteration_check chk(sess, fmv);
@@ -1562,9 +1619,92 @@ derived_probe_condition_inline (derived_probe *p)
   p->body = new block (ifs, p->body);
 }
 
+// The parts of a probe condition that only compare the current task
+// with constants, like pid() == target() or execname() != "bash", can
+// be checked in C before the probe handler even takes a context.  This
+// returns such a check as a C expression that holds whenever the
+// condition does, or an empty string if no part of it qualifies.  The
+// condition still goes into the probe body as usual.
+
+static string
+probe_prefilter_operand (expression* e, bool& is_string)
+{
+  if (functioncall* fc = dynamic_cast<functioncall*>(e))
+    {
+      // Only the tapset functions, not some script's namesakes.
+      if (!fc->args.empty() || fc->referents.size() != 1
+          || !fc->referents[0]->tok->location.file->privileged)
+        return "";
+      is_string = false;
+      if (fc->function == "pid")
+        return "((int64_t) current->tgid)";
+      if (fc->function == "tid")
+        return "((int64_t) current->pid)";
+      if (fc->function == "target")
+        return "((int64_t) _stp_target)";
+      if (fc->function == "uid")
+        return "_stp_prefilter_uid()";
+      is_string = true;
+      if (fc->function == "execname")
+        return "current->comm";
+      return "";
+    }
+  if (literal_number* ln = dynamic_cast<literal_number*>(e))
+    {
+      is_string = false;
+      if (ln->value == INT64_MIN)
+        return "";
+      return "((int64_t) " + lex_cast(ln->value) + "LL)";
+    }
+  if (literal_string* ls = dynamic_cast<literal_string*>(e))
+    {
+      is_string = true;
+      return lex_cast_qstring(string(ls->value));
+    }
+  return "";
+}
+
+static string
+probe_prefilter (expression* e)
+{
+  if (logical_and_expr* la = dynamic_cast<logical_and_expr*>(e))
+    {
+      // Either side will do, both are better.
+      string l = probe_prefilter (la->left);
+      string r = probe_prefilter (la->right);
+      if (l.empty() || r.empty())
+        return l + r;
+      return "(" + l + " && " + r + ")";
+    }
+  if (logical_or_expr* lo = dynamic_cast<logical_or_expr*>(e))
+    {
+      // Both sides are needed.
+      string l = probe_prefilter (lo->left);
+      string r = probe_prefilter (lo->right);
+      if (l.empty() || r.empty())
+        return "";
+      return "(" + l + " || " + r + ")";
+    }
+  if (comparison* c = dynamic_cast<comparison*>(e))
+    {
+      bool ls = false, rs = false;
+      string l = probe_prefilter_operand (c->left, ls);
+      string r = probe_prefilter_operand (c->right, rs);
+      if (l.empty() || r.empty() || ls != rs
+          || (c->op != "==" && c->op != "!=" && c->op != "<"
+              && c->op != "<=" && c->op != ">" && c->op != ">="))
+        return "";
+      if (ls)
+        return "(strcmp (" + l + ", " + r + ") " + string(c->op) + " 0)";
+      return "(" + l + " " + string(c->op) + " " + r + ")";
+    }
+  return "";
+}
+
 static int
 semantic_pass_conditions (systemtap_session & sess)
 {
+  time_trace_scope ts ("semantic_pass_conditions");
   map<derived_probe*, set<vardecl*> > vars_read_in_cond;
   map<derived_probe*, set<vardecl*> > vars_written_in_body;
 
@@ -1591,6 +1731,8 @@ semantic_pass_conditions (systemtap_session & sess)
                                                 "include impure embedded-C"),
                                               e->tok));
 
+          if (! sess.runtime_usermode_p())
+            p->prefilter = probe_prefilter (e);
           derived_probe_condition_inline(p);
 
           if (! vcv_cond.read.empty()) { // insert only if nonempty
@@ -1701,7 +1843,8 @@ semantic_pass_conditions (systemtap_session & sess)
 
 // This is only for pragmas that don't have any other side-effect than
 // needing some initialization at module init time. Currently handles
-// /* pragma:vma */ /* pragma:unwind */ /* pragma:symbols */ /* pragma:lines */
+// /* pragma:vma */ /* pragma:unwind */ /* pragma:kunwind */ /* pragma:symbols */
+// /* pragma:lines */
 
 // /* pragma:uprobes */ is handled during the typeresolution_info pass.
 // /* pure */, /* unprivileged */. /* myproc-unprivileged */ and /* guru */
@@ -1743,8 +1886,11 @@ embeddedcode_info::examine (Embeddish e, const token *tok)
       enable_vma_tracker(session);
     }
 
+  // pragma:kunwind only unwinds kernel stacks, so the context needs no
+  // room for user stack unwinding.
+  bool kunwind = e->tagged_p("/* pragma:kunwind */");
   if (! session.need_unwind
-      && e->tagged_p("/* pragma:unwind */"))
+      && (kunwind || e->tagged_p("/* pragma:unwind */")))
     {
       if (session.verbose > 2)
 	clog << _F("Turning on unwind support, pragma:unwind found in %s",
@@ -1752,7 +1898,16 @@ embeddedcode_info::examine (Embeddish e, const token *tok)
       session.need_unwind = true;
     }
 
-  if (! session.need_symbols
+  if (! session.need_user_unwind
+      && e->tagged_p("/* pragma:unwind */"))
+    session.need_user_unwind = true;
+
+  // Deferred backtraces print raw addresses, so need no symbols or
+  // lines of their own.
+  bool deferred = session.defer_symbols
+    && (kunwind || e->tagged_p("/* pragma:unwind */"));
+
+  if (! session.need_symbols && ! deferred
       && e->tagged_p("/* pragma:symbols */"))
     {
       if (session.verbose > 2)
@@ -1761,7 +1916,7 @@ embeddedcode_info::examine (Embeddish e, const token *tok)
       session.need_symbols = true;
     }
 
-  if (! session.need_lines
+  if (! session.need_lines && ! deferred
       && e->tagged_p("/* pragma:lines */"))
     {
       if (session.verbose > 2)
@@ -1792,10 +1947,25 @@ struct regex_collecting_visitor: public functioncall_traversing_visitor
 {
 protected:
   systemtap_session& session;
+  set<regex_query*> chained;
 
 public:
   regex_collecting_visitor (systemtap_session& s): session(s) { }
 
+  void visit_if_statement (if_statement *s) {
+    // A chain of =~ tests on the same variable gets a dfa of its own
+    // too, for c_unparser to scan the string just once.  The tail of a
+    // chain is a chain as well, but not a new one.
+    vector<regex_query*> chain;
+    if (regex_chain (s, chain) && chained.find(chain[0]) == chained.end())
+      {
+        chained.insert(chain.begin(), chain.end());
+        regex_chain_to_stapdfa (&session, chain);
+      }
+
+    functioncall_traversing_visitor::visit_if_statement (s);
+  }
+
   void visit_regex_query (regex_query *q) {
     functioncall_traversing_visitor::visit_regex_query (q);
 
@@ -1868,7 +2038,7 @@ build_no_more (systemtap_session& s)
 
   // No further analysis is going to be done.
   // Free up the memory used by the Dyninst analysis.
-  flush_analysis_caches();
+  flush_analysis_caches(s);
 }
 
 
@@ -1881,6 +2051,7 @@ build_no_more (systemtap_session& s)
 static int
 semantic_pass_symbols (systemtap_session& s)
 {
+  time_trace_scope ts ("semantic_pass_symbols");
   symresolution_info sym (s);
 
   // If we're listing functions, then we need to include all the files. Probe
@@ -1901,6 +2072,8 @@ semantic_pass_symbols (systemtap_session& s)
       s.files.insert (s.files.end(), s.user_files.begin(), s.user_files.end());
     }
 
+  prefetch_dwarf_function_indexes (s);
+
   for (unsigned i = 0; i < s.files.size(); i++)
     {
       assert_no_interrupts();
@@ -2096,7 +2269,7 @@ void add_global_var_display (systemtap_session& s)
       if (l->synthetic)
         continue;
 
-      bool tapset_global = false;
+      bool tapset_global = (s.library_globals.count(l->name) > 0);
       for (size_t m=0; m < s.library_files.size(); m++)
 	{
 	  for (size_t n=0; n < s.library_files[m]->globals.size(); n++)
@@ -2506,6 +2679,73 @@ static void monitor_mode_write(systemtap_session& s)
   dp->body->visit (&sym);
 }
 
+// For --handoff: gates every probe on __handoff_enabled, which a
+// "handoff" procfs write turns off ("freeze") and on ("thaw") while
+// staprun -O copies the globals from one module to the next.  The new
+// module is loaded with __handoff_enabled=0, so that not even its begin
+// probes run before it has the old one's state.  See also
+// runtime/linux/handoff.c.
+static void handoff_mode(systemtap_session& s)
+{
+  if (!s.handoff) return;
+
+  vardecl* v = new vardecl;
+  v->name = "__global___handoff_enabled";
+  v->unmangled_name = "__handoff_enabled";
+  v->tok = s.probes.empty() ? 0 : s.probes[0]->tok;
+  v->set_arity(0, v->tok);
+  v->type = pe_long;
+  v->init = new literal_number(1);
+  // NB: not synthetic, so that it gets a module parameter.
+  s.globals.push_back(v);
+
+  for (auto it = s.probes.cbegin(); it != s.probes.cend(); ++it)
+    {
+      symbol* sym = new symbol;
+      sym->name = v->name;
+      sym->tok = (*it)->tok;
+      sym->type = pe_long;
+      sym->referent = v;
+
+      if ((*it)->sole_location()->condition)
+        {
+          logical_and_expr *e = new logical_and_expr;
+          e->tok = sym->tok;
+          e->left = sym;
+          e->op = "&&";
+          e->type = pe_long;
+          e->right = (*it)->sole_location()->condition;
+          (*it)->sole_location()->condition = e;
+        }
+      else
+        (*it)->sole_location()->condition = sym;
+    }
+
+  stringstream code;
+  code << "probe procfs(\"handoff\").write {" << endl;
+  code << "if ($value == \"freeze\") __handoff_enabled = 0" << endl;
+  code << "else if ($value == \"thaw\") __handoff_enabled = 1" << endl;
+  code << "else if ($value == \"exit\") exit()" << endl;
+  code << "}" << endl;
+
+  probe* p = parse_synthetic_probe(s, code, 0);
+  if (!p)
+    throw SEMANTIC_ERROR (_("can't create procfs probe"), 0);
+
+  vector<derived_probe*> dps;
+  derive_probes (s, p, dps);
+
+  derived_probe* dp = dps[0];
+  s.probes.push_back (dp);
+  dp->join_group (s);
+
+  // Repopulate symbol info
+  symresolution_info sym (s, /* omniscient-unmangled */ true);
+  sym.current_function = 0;
+  sym.current_probe = dp;
+  dp->body->visit (&sym);
+}
+
 static void setup_timeout(systemtap_session& s)
 {
   if (!s.timeout) return;
@@ -2547,6 +2787,7 @@ semantic_pass (systemtap_session& s)
       if (rc == 0) setup_timeout(s);
       if (rc == 0) rc = semantic_pass_symbols (s);
       if (rc == 0) monitor_mode_write (s);
+      if (rc == 0) handoff_mode (s);
       if (rc == 0) rc = semantic_pass_conditions (s);
       if (rc == 0) rc = semantic_pass_optimize1 (s);
       if (rc == 0) rc = semantic_pass_types (s);
@@ -3077,6 +3318,7 @@ symresolution_info::find_var (const string& name, int arity, const token* tok)
   
   
   // search not-yet-chosen library globals
+  session.demand_library_symbol (name, true);
   for (unsigned i=0; i<session.library_files.size(); i++)
     {
       stapfile* f = session.library_files[i];
@@ -3172,7 +3414,9 @@ symresolution_info::find_functions (functioncall *call, const string& name, unsi
         last = fd;
     }
 
-  // functions scanned by the parser are overloaded
+  // functions scanned by the parser are overloaded; make sure any
+  // deferred tapset files defining them have been parsed and counted
+  session.demand_library_symbol (name, false);
   unsigned alternatives = session.overload_count[name];
   for (unsigned alt = 0; alt < alternatives; alt++)
     {
@@ -3307,6 +3551,11 @@ symresolution_info::collect_functions(void)
           funcs.insert(f->functions[j]->unmangled_name);
     }
 
+  // ... including those of tapset files not parsed yet
+  for (auto it = session.library_functions.begin();
+       it != session.library_functions.end(); ++it)
+    funcs.insert(it->first);
+
   return funcs;
 }
 
@@ -3334,7 +3583,8 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
       functiondecl* fd = it->second;
       if (ftv.seen.find(fd) == ftv.seen.end())
         {
-          if (! fd->synthetic && !fd->cloned_p && s.is_user_file(fd->tok->location.file->name))
+          if (! fd->synthetic && !fd->cloned_p && !fd->inlined_p
+              && s.is_user_file(fd->tok->location.file->name))
             s.print_warning (_F("Eliding unused function '%s'",
                                 fd->unmangled_name.to_string().c_str()),
 			     fd->tok);
@@ -3348,7 +3598,7 @@ void semantic_pass_opt1 (systemtap_session& s, bool& relaxed_p)
       map<string,functiondecl*>::iterator where = s.functions.find (new_unused_functions[i]->name);
       assert (where != s.functions.end());
       s.functions.erase (where);
-      if (s.tapset_compile_coverage)
+      if (s.tapset_compile_coverage && !new_unused_functions[i]->inlined_p)
         s.unused_functions.push_back (new_unused_functions[i]);
     }
 }
@@ -3542,6 +3792,7 @@ struct dead_assignment_remover: public update_visitor
   systemtap_session& session;
   bool& relaxed_p;
   const varuse_collecting_visitor& vut;
+  set<vardecl*> focal_vars;
 
   dead_assignment_remover(systemtap_session& s, bool& r,
                           const varuse_collecting_visitor& v):
@@ -3645,7 +3896,9 @@ dead_assignment_remover::visit_assignment (assignment* e)
 
           varuse_collecting_visitor lvut(session);
           e->left->visit (& lvut);
-          if (lvut.side_effect_free () && !is_global // XXX: use _wrt() once we track focal_vars
+          // NB: index expressions may call tapset helpers, whose own
+          // locals don't count as side-effects here.
+          if (lvut.side_effect_free_wrt (focal_vars) && !is_global
               && !leftvar->synthetic) // don't elide assignment to synthetic $context variables
             {
               /* PR 1119: NB: This is not necessary here.  A write-only
@@ -3704,11 +3957,28 @@ void semantic_pass_opt3 (systemtap_session& s, bool& relaxed_p)
   dead_assignment_remover dar (s, relaxed_p, vut);
   // This instance may be reused for multiple probe/function body trims.
 
+  // The focal variables are those of semantic_pass_opt4, so that an
+  // assignment whose value only calls helpers free of side-effects
+  // (say an argstr in a syscall alias) goes away entirely once its
+  // variable turns out to be unread.
   for (unsigned i=0; i<s.probes.size(); i++)
-    dar.replace (s.probes[i]->body);
+    {
+      derived_probe* p = s.probes[i];
+      dar.focal_vars.clear ();
+      dar.focal_vars.insert (s.globals.begin(), s.globals.end());
+      dar.focal_vars.insert (p->locals.begin(), p->locals.end());
+      dar.replace (p->body);
+    }
   for (map<string,functiondecl*>::iterator it = s.functions.begin();
        it != s.functions.end(); it++)
-    dar.replace (it->second->body);
+    {
+      functiondecl* fn = it->second;
+      dar.focal_vars.clear ();
+      dar.focal_vars.insert (fn->locals.begin(), fn->locals.end());
+      dar.focal_vars.insert (fn->formal_args.begin(), fn->formal_args.end());
+      dar.focal_vars.insert (s.globals.begin(), s.globals.end());
+      dar.replace (fn->body);
+    }
   // The rewrite operation is performed within the visitor.
 
   // XXX: we could also zap write-only globals here
@@ -5073,6 +5343,304 @@ const_folder::visit_target_symbol (target_symbol* e)
     }
 }
 
+// ------------------------------------------------------------------------
+// function inlining
+
+// Calls of small, non-recursive script functions are replaced by the
+// function body, which saves the context frame and MAXNESTING check of
+// a call and lets the constant folder see through it.  A function whose
+// body is just "return E" is inlined into any expression, its parameters
+// replaced by the arguments.  One without a return statement is inlined
+// where it's called as a statement, its parameters copied into new
+// locals of the caller.
+
+// The size of a function body, in expressions and statements, up to
+// which calls to it are inlined.
+static const unsigned inline_max_size = 24;
+
+struct inline_candidate_checker: public expression_visitor
+{
+  unsigned size;
+  bool ok;
+  bool has_return;
+  const vector<vardecl*>& params;
+  map<vardecl*, unsigned> uses;
+  inline_candidate_checker (const vector<vardecl*>& p):
+    size (0), ok (true), has_return (false), params (p) {}
+
+  void visit_expression (expression*) { size++; }
+  void visit_block (block* s)
+  {
+    size += s->statements.size();
+    expression_visitor::visit_block (s);
+  }
+  void visit_return_statement (return_statement* s)
+  {
+    has_return = true;
+    expression_visitor::visit_return_statement (s);
+  }
+  void visit_symbol (symbol* e)
+  {
+    if (find (params.begin(), params.end(), e->referent) != params.end())
+      uses[e->referent]++;
+    expression_visitor::visit_symbol (e);
+  }
+
+  // Code that depends on the context it runs in.
+  void visit_embeddedcode (embeddedcode*) { ok = false; }
+  void visit_try_block (try_block*) { ok = false; }
+  void visit_next_statement (next_statement*) { ok = false; }
+  void visit_embedded_expr (embedded_expr*) { ok = false; }
+  void visit_target_register (target_register*) { ok = false; }
+  void visit_target_deref (target_deref*) { ok = false; }
+  void visit_target_bitfield (target_bitfield*) { ok = false; }
+  void visit_target_symbol (target_symbol*) { ok = false; }
+  void visit_cast_op (cast_op*) { ok = false; }
+  void visit_autocast_op (autocast_op*) { ok = false; }
+  void visit_atvar_op (atvar_op*) { ok = false; }
+  void visit_defined_op (defined_op*) { ok = false; }
+  void visit_entry_op (entry_op*) { ok = false; }
+  void visit_perf_op (perf_op*) { ok = false; }
+};
+
+
+struct inline_candidate
+{
+  expression* value; // E of "return E", or null for a statement body
+  bool pure;         // whether E has no side effects
+  map<vardecl*, unsigned> uses; // of each parameter in E
+};
+
+
+static bool
+find_inline_candidate (systemtap_session& s, functiondecl* fd,
+                       inline_candidate& c)
+{
+  if (fd->synthetic || fd->has_next || !fd->locals.empty() || !fd->body)
+    return false;
+
+  inline_candidate_checker icc (fd->formal_args);
+  fd->body->visit (& icc);
+  if (!icc.ok || icc.size > inline_max_size)
+    return false;
+
+  // Recursive functions stay calls.
+  functioncall_traversing_visitor ftv;
+  fd->body->visit (& ftv);
+  if (ftv.seen.count (fd))
+    return false;
+
+  statement* body = fd->body;
+  block* b = dynamic_cast<block*>(body);
+  if (b && b->statements.size() == 1)
+    body = b->statements[0];
+
+  c.value = 0;
+  c.pure = false;
+  return_statement* r = dynamic_cast<return_statement*>(body);
+  if (r && r->value)
+    {
+      varuse_collecting_visitor vut (s);
+      r->value->visit (& vut);
+      for (unsigned i = 0; i < fd->formal_args.size(); i++)
+        if (vut.written.count (fd->formal_args[i]))
+          return false;
+      c.value = r->value;
+      c.pure = vut.side_effect_free ();
+      c.uses = icc.uses;
+      return true;
+    }
+  return !icc.has_return;
+}
+
+
+// Copies an inlined function body, with its parameters replaced by the
+// arguments or by new locals.
+struct inline_copier: public deep_copy_visitor
+{
+  map<vardecl*, expression*> args;
+  map<vardecl*, vardecl*> vars;
+
+  void visit_symbol (symbol* e)
+  {
+    auto a = args.find (e->referent);
+    if (a != args.end())
+      {
+        inline_copier c;
+        provide (c.require (a->second));
+        return;
+      }
+
+    symbol* n = new symbol (*e);
+    auto v = vars.find (e->referent);
+    if (v != vars.end())
+      {
+        n->referent = v->second;
+        n->name = v->second->name;
+      }
+    update_visitor::visit_symbol (n);
+  }
+};
+
+
+struct function_inliner: public update_visitor
+{
+  systemtap_session& session;
+  bool& relaxed_p;
+  map<functiondecl*, inline_candidate>& candidates;
+  functiondecl* current_function;
+  derived_probe* current_probe;
+
+  function_inliner (systemtap_session& s, bool& r,
+                    map<functiondecl*, inline_candidate>& c):
+    update_visitor (s.verbose), session (s), relaxed_p (r), candidates (c),
+    current_function (0), current_probe (0) {}
+
+  functiondecl* inlinable (functioncall* e);
+  void visit_expr_statement (expr_statement* s);
+  void visit_functioncall (functioncall* e);
+};
+
+
+functiondecl*
+function_inliner::inlinable (functioncall* e)
+{
+  if (e->referents.size() != 1 || e->referents[0] == current_function
+      || !candidates.count (e->referents[0]))
+    return 0;
+  functiondecl* fd = e->referents[0];
+  return e->args.size() == fd->formal_args.size() ? fd : 0;
+}
+
+
+void
+function_inliner::visit_expr_statement (expr_statement* s)
+{
+  functioncall* e = dynamic_cast<functioncall*>(s->value);
+  functiondecl* fd = e ? inlinable (e) : 0;
+  if (!fd || candidates[fd].value)
+    return update_visitor::visit_expr_statement (s);
+
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    replace (e->args[i]);
+
+  if (session.verbose > 2)
+    clog << _F("Inlining function '%s' at %s",
+               fd->unmangled_name.to_string().c_str(),
+               lex_cast(*e->tok).c_str()) << endl;
+
+  // Copy each argument into a new local standing for its parameter.
+  block* b = new block;
+  b->tok = s->tok;
+  inline_copier ic;
+  for (unsigned i = 0; i < fd->formal_args.size(); ++i)
+    {
+      vardecl* p = fd->formal_args[i];
+      vardecl* v = new vardecl;
+      v->unmangled_name = v->name = "__inline_" + lex_cast(session.opt_local_counter++)
+        + "_" + p->unmangled_name.to_string();
+      v->tok = e->tok;
+      v->set_arity(0, e->tok);
+      v->type = p->type;
+      if (current_function)
+        current_function->locals.push_back(v);
+      else
+        current_probe->locals.push_back(v);
+      ic.vars[p] = v;
+
+      symbol* sym = new symbol;
+      sym->name = v->name;
+      sym->tok = e->tok;
+      sym->referent = v;
+      sym->type = v->type;
+
+      assignment* a = new assignment;
+      a->tok = e->tok;
+      a->op = "=";
+      a->left = sym;
+      a->right = e->args[i];
+      a->type = v->type;
+
+      expr_statement* es = new expr_statement;
+      es->tok = e->tok;
+      es->value = a;
+      b->statements.push_back(es);
+    }
+  b->statements.push_back(ic.require (fd->body));
+
+  fd->inlined_p = true;
+  relaxed_p = false;
+  provide (b);
+}
+
+
+void
+function_inliner::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    replace (e->args[i]);
+
+  functiondecl* fd = inlinable (e);
+  if (!fd || !candidates[fd].value)
+    return provide (e);
+
+  // The arguments are no longer evaluated once each, before the body,
+  // so they must have no side effects, nor see the body's.  Those
+  // used more than once must be cheap to repeat.
+  inline_candidate& c = candidates[fd];
+  inline_copier ic;
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    {
+      expression* arg = e->args[i];
+      bool simple = dynamic_cast<literal*>(arg) != 0;
+      varuse_collecting_visitor vut (session);
+      arg->visit (& vut);
+      if (!vut.side_effect_free ()
+          || (!c.pure && !simple)
+          || (c.uses[fd->formal_args[i]] > 1 && !simple
+              && !dynamic_cast<symbol*>(arg)))
+        return provide (e);
+      ic.args[fd->formal_args[i]] = arg;
+    }
+
+  if (session.verbose > 2)
+    clog << _F("Inlining function '%s' at %s",
+               fd->unmangled_name.to_string().c_str(),
+               lex_cast(*e->tok).c_str()) << endl;
+
+  fd->inlined_p = true;
+  relaxed_p = false;
+  provide (ic.require (c.value));
+}
+
+
+static void semantic_pass_inline (systemtap_session& s, bool& relaxed_p)
+{
+  map<functiondecl*, inline_candidate> candidates;
+  for (auto it = s.functions.begin(); it != s.functions.end(); it++)
+    {
+      inline_candidate c;
+      if (find_inline_candidate (s, it->second, c))
+        candidates[it->second] = c;
+    }
+  if (candidates.empty())
+    return;
+
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      function_inliner fi (s, relaxed_p, candidates);
+      fi.current_probe = s.probes[i];
+      fi.replace (s.probes[i]->body);
+    }
+  for (auto it = s.functions.begin(); it != s.functions.end(); it++)
+    {
+      function_inliner fi (s, relaxed_p, candidates);
+      fi.current_function = it->second;
+      fi.replace (it->second->body);
+    }
+}
+
+
 static int initial_typeres_pass(systemtap_session& s);
 static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
 {
@@ -5088,6 +5656,12 @@ static int semantic_pass_const_fold (systemtap_session& s, bool& relaxed_p)
       return rc;
     }
 
+  // Inline calls once their types are checked, so that a mismatch
+  // between a function and its callers is still reported, but before
+  // folding, so that constant arguments fold into the inlined bodies.
+  if (!s.unoptimized)
+    semantic_pass_inline (s, relaxed_p);
+
   // Let's simplify statements with constant values.
   const_folder cf (s, relaxed_p, true /* collapse remaining @defined()->0 now */ );
   // This instance may be reused for multiple probe/function body trims.
@@ -5158,45 +5732,440 @@ static void semantic_pass_dead_control (systemtap_session& s, bool& relaxed_p)
 }
 
 
-// Looks for next statements in function declarations and marks
-// them.
-struct function_next_check : public traversing_visitor
-{
-  functiondecl* current_function;
-
-  function_next_check()
-    : current_function(0) { }
-
-  void visit_next_statement(next_statement*)
-  {
-    current_function->has_next = true;
-  }
+// ------------------------------------------------------------------------
+// loop invariants
 
-  void visit_embeddedcode(embeddedcode* s)
-  {
-    if (s->tagged_p("STAP_NEXT;"))
-      current_function->has_next = true;
-  }
-};
+// Moves the string concatenations, array reads, "in" tests and
+// @count/@sum extractions that don't change within a loop ahead of it,
+// into a local.  None of these can fail, so they are safe to evaluate
+// even if the loop body doesn't run.  Then, in a foreach over an array,
+// reads of the current element become the loop's value variable, which
+// saves the lookup each iteration.
 
-struct dead_overload_remover : public traversing_visitor
+struct loop_invariant_hoister: public update_visitor
 {
-  systemtap_session& s;
+  systemtap_session& session;
   bool& relaxed_p;
+  functiondecl* current_function;
+  derived_probe* current_probe;
+  set<vardecl*> written; // in the loop being hoisted from
+  vector<statement*> hoisted;
+  bool in_loop;
 
-  dead_overload_remover(systemtap_session& sess,
-                        bool& r)
-    : s(sess), relaxed_p(r) { }
+  loop_invariant_hoister(systemtap_session& s, bool& r):
+    update_visitor(s.verbose), session(s), relaxed_p(r),
+    current_function(0), current_probe(0), in_loop(false) {}
 
-  void visit_functioncall(functioncall* e);
+  bool invariant_p (expression* e, bool& worth);
+  bool hoistable (expression* e);
+  symbol* hoist (expression* e);
+  statement* hoist_loop (statement* s);
+
+  void visit_for_loop (for_loop* s);
+  void visit_foreach_loop (foreach_loop* s);
+  void visit_concatenation (concatenation* e);
+  void visit_binary_expression (binary_expression* e);
+  void visit_arrayindex (arrayindex* e);
+  void visit_array_in (array_in* e);
+  void visit_stat_op (stat_op* e);
+  void visit_hist_op (hist_op* e);
 };
 
-void dead_overload_remover::visit_functioncall(functioncall *e)
+
+// Whether e has the same value all through the loop, and whether it's
+// worth a local, that is has more than arithmetic.
+bool
+loop_invariant_hoister::invariant_p (expression* e, bool& worth)
 {
-  unsigned reachable = 1;
-  bool chained = true;
+  if (dynamic_cast<literal*>(e))
+    return true;
 
-  for (unsigned fd = 0; fd < e->referents.size(); fd++)
+  if (symbol* sym = dynamic_cast<symbol*>(e))
+    return sym->referent && sym->referent->arity <= 0
+      && !written.count(sym->referent);
+
+  if (concatenation* c = dynamic_cast<concatenation*>(e))
+    {
+      worth = true;
+      return invariant_p (c->left, worth) && invariant_p (c->right, worth);
+    }
+
+  if (arrayindex* ai = dynamic_cast<arrayindex*>(e))
+    {
+      symbol* base;
+      if (!ai->base->is_symbol (base) || !base->referent
+          || base->referent->type == pe_stats || written.count(base->referent))
+        return false;
+      for (unsigned i = 0; i < ai->indexes.size(); ++i)
+        if (!ai->indexes[i] || !invariant_p (ai->indexes[i], worth))
+          return false;
+      worth = true;
+      return true;
+    }
+
+  if (array_in* ain = dynamic_cast<array_in*>(e))
+    return invariant_p (ain->operand, worth);
+
+  if (stat_op* so = dynamic_cast<stat_op*>(e))
+    {
+      // The other extractions are errors on empty aggregates.
+      if (so->ctype != sc_count && so->ctype != sc_sum)
+        return false;
+      symbol* base = dynamic_cast<symbol*>(so->stat);
+      arrayindex* ai = dynamic_cast<arrayindex*>(so->stat);
+      if (ai && !ai->base->is_symbol (base))
+        return false;
+      if (!base || !base->referent || written.count(base->referent))
+        return false;
+      if (ai)
+        for (unsigned i = 0; i < ai->indexes.size(); ++i)
+          if (!ai->indexes[i] || !invariant_p (ai->indexes[i], worth))
+            return false;
+      worth = true;
+      return true;
+    }
+
+  // No division, which may fail.
+  binary_expression* be = dynamic_cast<binary_expression*>(e);
+  if (be && !dynamic_cast<assignment*>(e)
+      && (be->op == "+" || be->op == "-" || be->op == "*"
+          || be->op == "&" || be->op == "|" || be->op == "^"
+          || be->op == "<<" || be->op == ">>"))
+    return invariant_p (be->left, worth) && invariant_p (be->right, worth);
+
+  return false;
+}
+
+
+bool
+loop_invariant_hoister::hoistable (expression* e)
+{
+  bool worth = false;
+  return in_loop && invariant_p (e, worth) && worth;
+}
+
+
+symbol*
+loop_invariant_hoister::hoist (expression* e)
+{
+  vardecl* v = new vardecl;
+  v->unmangled_name = v->name = "__invariant_"
+    + lex_cast(session.opt_local_counter++);
+  v->tok = e->tok;
+  v->set_arity(0, e->tok);
+  v->type = e->type;
+  if (current_function)
+    current_function->locals.push_back(v);
+  else
+    current_probe->locals.push_back(v);
+
+  symbol* sym = new symbol;
+  sym->name = v->name;
+  sym->tok = e->tok;
+  sym->referent = v;
+  sym->type = e->type;
+
+  assignment* a = new assignment;
+  a->tok = e->tok;
+  a->op = "=";
+  a->left = sym;
+  a->right = e;
+  a->type = e->type;
+
+  expr_statement* es = new expr_statement;
+  es->tok = e->tok;
+  es->value = a;
+  hoisted.push_back(es);
+
+  if (session.verbose > 2)
+    clog << _F("Moving loop invariant %s out of the loop at %s",
+               lex_cast(*e).c_str(), lex_cast(*e->tok).c_str()) << endl;
+  relaxed_p = false;
+
+  symbol* use = new symbol;
+  use->name = v->name;
+  use->tok = e->tok;
+  use->referent = v;
+  use->type = e->type;
+  return use;
+}
+
+
+// Moves the invariants of loop s ahead of it, with the loops nested in
+// it done in turn.  Returns s, or a block of the hoisted assignments
+// and s.
+statement*
+loop_invariant_hoister::hoist_loop (statement* s)
+{
+  varuse_collecting_visitor vut (session);
+  s->visit (&vut);
+  // Embedded code may write what it doesn't declare.
+  if (vut.embedded_seen)
+    return s;
+
+  set<vardecl*> outer_written = written;
+  vector<statement*> outer_hoisted = hoisted;
+  written = vut.written;
+  hoisted.clear();
+
+  bool outer_in_loop = in_loop;
+  in_loop = true;
+  if (for_loop* fl = dynamic_cast<for_loop*>(s))
+    {
+      replace (fl->cond);
+      replace (fl->incr);
+      replace (fl->block);
+    }
+  else if (foreach_loop* fe = dynamic_cast<foreach_loop*>(s))
+    replace (fe->block);
+  in_loop = outer_in_loop;
+
+  statement* result = s;
+  if (!hoisted.empty())
+    {
+      block* b = new block;
+      b->tok = s->tok;
+      b->statements = hoisted;
+      b->statements.push_back(s);
+      result = b;
+    }
+
+  written = outer_written;
+  hoisted = outer_hoisted;
+  return result;
+}
+
+
+void
+loop_invariant_hoister::visit_for_loop (for_loop* s)
+{
+  replace (s->init);
+  provide (hoist_loop (s));
+}
+
+
+// Replaces reads of the element a foreach is at with its value.
+struct foreach_value_replacer: public update_visitor
+{
+  foreach_loop* loop;
+  symbol* value;
+  unsigned replaced;
+  foreach_value_replacer(systemtap_session& s, foreach_loop* l, symbol* v):
+    update_visitor(s.verbose), loop(l), value(v), replaced(0) {}
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    for (unsigned i = 0; i < e->indexes.size(); ++i)
+      replace (e->indexes[i]);
+    symbol *base, *array;
+    if (!e->base->is_symbol (base) || !loop->base->is_symbol (array)
+        || base->referent != array->referent
+        || e->indexes.size() != loop->indexes.size())
+      return provide (e);
+    for (unsigned i = 0; i < e->indexes.size(); ++i)
+      {
+        symbol* sym = dynamic_cast<symbol*>(e->indexes[i]);
+        if (!sym || sym->referent != loop->indexes[i]->referent)
+          return provide (e);
+      }
+    symbol* n = new symbol (*value);
+    n->tok = e->tok;
+    replaced++;
+    provide (n);
+  }
+  // Aggregates are only read through these.
+  void visit_stat_op (stat_op* e) { provide (e); }
+  void visit_hist_op (hist_op* e) { provide (e); }
+  void visit_array_in (array_in* e) { provide (e); }
+};
+
+
+void
+loop_invariant_hoister::visit_foreach_loop (foreach_loop* s)
+{
+  for (unsigned i = 0; i < s->indexes.size(); ++i)
+    replace (s->indexes[i]);
+  for (unsigned i = 0; i < s->array_slice.size(); ++i)
+    replace (s->array_slice[i]);
+  replace (s->base);
+  replace (s->value);
+  replace (s->limit);
+
+  // The array and the indexes are the same all through the body, so
+  // the element's value is too.
+  symbol* array;
+  varuse_collecting_visitor vut (session);
+  s->block->visit (&vut);
+  if (s->base->is_symbol (array) && array->referent
+      && array->referent->type != pe_stats && !vut.embedded_seen
+      && !vut.written.count(array->referent)
+      && (!s->value || (s->value->referent
+                        && !vut.written.count(s->value->referent))))
+    {
+      bool indexes_written = false;
+      for (unsigned i = 0; i < s->indexes.size(); ++i)
+        if (vut.written.count(s->indexes[i]->referent))
+          indexes_written = true;
+
+      symbol* value = s->value;
+      if (!value)
+        {
+          vardecl* v = new vardecl;
+          v->unmangled_name = v->name = "__foreach_value_"
+            + lex_cast(session.opt_local_counter++);
+          v->tok = s->tok;
+          v->set_arity(0, s->tok);
+          value = new symbol;
+          value->name = v->name;
+          value->tok = s->tok;
+          value->referent = v;
+        }
+
+      foreach_value_replacer fvr (session, s, value);
+      if (!indexes_written)
+        fvr.replace (s->block);
+      if (fvr.replaced)
+        {
+          if (!s->value)
+            {
+              s->value = value;
+              if (current_function)
+                current_function->locals.push_back(value->referent);
+              else
+                current_probe->locals.push_back(value->referent);
+            }
+          if (session.verbose > 2)
+            clog << _F("Reading %zu elements of the foreach at %s from %s",
+                       (size_t) fvr.replaced, lex_cast(*s->tok).c_str(),
+                       value->name.to_string().c_str()) << endl;
+          relaxed_p = false;
+        }
+    }
+
+  provide (hoist_loop (s));
+}
+
+
+void
+loop_invariant_hoister::visit_concatenation (concatenation* e)
+{
+  if (hoistable (e))
+    return provide (hoist (e));
+  update_visitor::visit_concatenation (e);
+}
+
+
+void
+loop_invariant_hoister::visit_binary_expression (binary_expression* e)
+{
+  if (hoistable (e))
+    return provide (hoist (e));
+  update_visitor::visit_binary_expression (e);
+}
+
+
+void
+loop_invariant_hoister::visit_arrayindex (arrayindex* e)
+{
+  if (hoistable (e))
+    return provide (hoist (e));
+  update_visitor::visit_arrayindex (e);
+}
+
+
+void
+loop_invariant_hoister::visit_array_in (array_in* e)
+{
+  if (hoistable (e))
+    return provide (hoist (e));
+  // The operand has to stay an arrayindex.
+  for (unsigned i = 0; i < e->operand->indexes.size(); ++i)
+    replace (e->operand->indexes[i]);
+  provide (e);
+}
+
+
+void
+loop_invariant_hoister::visit_stat_op (stat_op* e)
+{
+  if (hoistable (e))
+    return provide (hoist (e));
+  // The aggregate itself can't be read any other way.
+  if (arrayindex* ai = dynamic_cast<arrayindex*>(e->stat))
+    for (unsigned i = 0; i < ai->indexes.size(); ++i)
+      replace (ai->indexes[i]);
+  provide (e);
+}
+
+
+void
+loop_invariant_hoister::visit_hist_op (hist_op* e)
+{
+  if (arrayindex* ai = dynamic_cast<arrayindex*>(e->stat))
+    for (unsigned i = 0; i < ai->indexes.size(); ++i)
+      replace (ai->indexes[i]);
+  provide (e);
+}
+
+
+static void semantic_pass_loop_invariants (systemtap_session& s, bool& relaxed_p)
+{
+  for (unsigned i=0; i<s.probes.size(); i++)
+    {
+      loop_invariant_hoister lih (s, relaxed_p);
+      lih.current_probe = s.probes[i];
+      lih.replace (s.probes[i]->body);
+    }
+
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); it++)
+    {
+      loop_invariant_hoister lih (s, relaxed_p);
+      lih.current_function = it->second;
+      lih.replace (it->second->body);
+    }
+}
+
+
+// Looks for next statements in function declarations and marks
+// them.
+struct function_next_check : public traversing_visitor
+{
+  functiondecl* current_function;
+
+  function_next_check()
+    : current_function(0) { }
+
+  void visit_next_statement(next_statement*)
+  {
+    current_function->has_next = true;
+  }
+
+  void visit_embeddedcode(embeddedcode* s)
+  {
+    if (s->tagged_p("STAP_NEXT;"))
+      current_function->has_next = true;
+  }
+};
+
+struct dead_overload_remover : public traversing_visitor
+{
+  systemtap_session& s;
+  bool& relaxed_p;
+
+  dead_overload_remover(systemtap_session& sess,
+                        bool& r)
+    : s(sess), relaxed_p(r) { }
+
+  void visit_functioncall(functioncall* e);
+};
+
+void dead_overload_remover::visit_functioncall(functioncall *e)
+{
+  unsigned reachable = 1;
+  bool chained = true;
+
+  for (unsigned fd = 0; fd < e->referents.size(); fd++)
     {
       functiondecl* r = e->referents[fd];
 
@@ -5704,9 +6673,613 @@ void semantic_pass_opt7(systemtap_session& s)
     }
 }
 
+// ------------------------------------------------------------------------
+// target read elimination
+
+// Each $var or @cast() read is a call to a synthetic function, which
+// does a kread or fetch_register with its fault handling.  Once opt6 has
+// merged those with the same body, reads that a handler repeats are
+// calls to the same function with the same arguments.  Such reads are
+// treated as non-volatile, so within a block, the first statement that
+// surely makes one has its value saved in a local beforehand, and it
+// and the statements after it use the local.  A read under a condition
+// is not moved ahead of it, since it might fault where the script has
+// checked that it doesn't.
+
+struct target_read_analysis: public traversing_visitor
+{
+  bool reads;
+  target_read_analysis(): reads(false) {}
+  void visit_target_deref (target_deref* e)
+    { reads = true; traversing_visitor::visit_target_deref (e); }
+  void visit_target_register (target_register*) { reads = true; }
+};
+
+// Returns a string that is the same for calls making the same target
+// read, or "" if e makes none.  Its arguments must be literals, or
+// variables the code around it never writes.
+static string
+target_read_key (functioncall* e, const set<functiondecl*>& target_reads,
+                 const set<vardecl*>& written)
+{
+  if (e->referents.size() != 1 || !target_reads.count(e->referents[0]))
+    return "";
+
+  ostringstream key;
+  key << e->function << "(";
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    {
+      symbol* sym = dynamic_cast<symbol*>(e->args[i]);
+      if (!dynamic_cast<literal*>(e->args[i])
+          && (!sym || !sym->referent || written.count(sym->referent)))
+        return "";
+      key << (i ? "," : "") << *e->args[i];
+    }
+  key << ")";
+  return key.str();
+}
+
+// Collects the target reads of a statement, in order.  Unless all is
+// set, only those it makes whatever its conditions are, which leaves
+// out nested blocks, which target_read_cse goes through on their own.
+struct target_read_finder: public traversing_visitor
+{
+  const set<functiondecl*>& target_reads;
+  const set<vardecl*>& written;
+  bool all;
+  vector<pair<string,functioncall*> > found;
+  target_read_finder(const set<functiondecl*>& tr, const set<vardecl*>& w,
+                     bool a):
+    target_reads(tr), written(w), all(a) {}
+
+  void visit_block (block* s)
+    { if (all) traversing_visitor::visit_block (s); }
+  void visit_try_block (try_block* s)
+    { if (all) traversing_visitor::visit_try_block (s); }
+  void visit_if_statement (if_statement* s);
+  void visit_for_loop (for_loop* s);
+  void visit_foreach_loop (foreach_loop* s);
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_functioncall (functioncall* e);
+};
+
+void target_read_finder::visit_if_statement (if_statement* s)
+{
+  if (all)
+    return traversing_visitor::visit_if_statement (s);
+  s->condition->visit (this);
+}
+
+void target_read_finder::visit_for_loop (for_loop* s)
+{
+  if (all)
+    return traversing_visitor::visit_for_loop (s);
+  if (s->init) s->init->visit (this);
+  s->cond->visit (this);
+}
+
+void target_read_finder::visit_foreach_loop (foreach_loop* s)
+{
+  if (all)
+    return traversing_visitor::visit_foreach_loop (s);
+  for (unsigned i=0; i<s->array_slice.size(); i++)
+    if (s->array_slice[i])
+      s->array_slice[i]->visit (this);
+  if (s->limit)
+    s->limit->visit (this);
+}
+
+void target_read_finder::visit_logical_or_expr (logical_or_expr* e)
+{
+  if (all)
+    return traversing_visitor::visit_logical_or_expr (e);
+  e->left->visit (this);
+}
+
+void target_read_finder::visit_logical_and_expr (logical_and_expr* e)
+{
+  if (all)
+    return traversing_visitor::visit_logical_and_expr (e);
+  e->left->visit (this);
+}
+
+void target_read_finder::visit_ternary_expression (ternary_expression* e)
+{
+  if (all)
+    return traversing_visitor::visit_ternary_expression (e);
+  e->cond->visit (this);
+}
+
+void target_read_finder::visit_functioncall (functioncall* e)
+{
+  traversing_visitor::visit_functioncall (e);
+  string key = target_read_key (e, target_reads, written);
+  if (!key.empty())
+    found.push_back (make_pair (key, e));
+}
+
+struct target_read_cse: public update_visitor
+{
+  systemtap_session& session;
+  functiondecl* current_function;
+  derived_probe* current_probe;
+  const set<functiondecl*>& target_reads;
+  set<vardecl*> written;
+  map<string,vardecl*> saved;
+  target_read_cse(systemtap_session& s, const set<functiondecl*>& tr):
+    update_visitor(s.verbose), session(s), current_function(0),
+    current_probe(0), target_reads(tr) {}
+
+  void visit_block (block* s);
+  void visit_functioncall (functioncall* e);
+};
+
+void target_read_cse::visit_block (block* s)
+{
+  map<string,vardecl*> outer_saved = saved;
+  vector<statement*> stmts;
+
+  for (unsigned i = 0; i < s->statements.size(); ++i)
+    {
+      target_read_finder tf (target_reads, written, false);
+      s->statements[i]->visit (&tf);
+
+      for (unsigned j = 0; j < tf.found.size(); ++j)
+        {
+          const string& key = tf.found[j].first;
+          functioncall* e = tf.found[j].second;
+          if (saved.count(key))
+            continue;
+
+          // Only worth a local if it's read again.
+          target_read_finder uses (target_reads, written, true);
+          for (unsigned k = i; k < s->statements.size(); ++k)
+            s->statements[k]->visit (&uses);
+          unsigned n = 0;
+          for (unsigned k = 0; k < uses.found.size(); ++k)
+            if (uses.found[k].first == key)
+              n++;
+          if (n < 2)
+            continue;
+
+          vardecl* v = new vardecl;
+          v->unmangled_name = v->name = "__target_" + lex_cast(session.opt_local_counter++)
+            + "_value";
+          v->tok = e->tok;
+          v->set_arity(0, e->tok);
+          v->type = e->type;
+          if (current_function)
+            current_function->locals.push_back(v);
+          else
+            current_probe->locals.push_back(v);
+          saved[key] = v;
+
+          symbol* sym = new symbol;
+          sym->name = v->name;
+          sym->tok = e->tok;
+          sym->referent = v;
+          sym->type = e->type;
+
+          // The call is replaced by the local where it was, so it moves
+          // here as it is.
+          assignment* a = new assignment;
+          a->tok = e->tok;
+          a->op = "=";
+          a->left = sym;
+          a->right = e;
+          a->type = e->type;
+
+          expr_statement* es = new expr_statement;
+          es->tok = e->tok;
+          es->value = a;
+          stmts.push_back(es);
+
+          if (session.verbose > 2)
+            clog << _F("Saving %s read %u times at %s in %s",
+                       e->function.to_string().c_str(), n,
+                       lex_cast(*e->tok).c_str(), v->name.to_string().c_str())
+                 << endl;
+        }
+
+      replace (s->statements[i]);
+      stmts.push_back (s->statements[i]);
+    }
+
+  s->statements = stmts;
+  saved = outer_saved;
+  provide (s);
+}
+
+void target_read_cse::visit_functioncall (functioncall* e)
+{
+  for (unsigned i = 0; i < e->args.size(); ++i)
+    replace (e->args[i]);
+
+  auto it = saved.find (target_read_key (e, target_reads, written));
+  if (it == saved.end())
+    return provide (e);
+
+  symbol* sym = new symbol;
+  sym->name = it->second->name;
+  sym->tok = e->tok;
+  sym->referent = it->second;
+  sym->type = e->type;
+  provide (sym);
+}
+
+static void
+target_read_cse_body (systemtap_session& s, statement*& body,
+                      const set<functiondecl*>& target_reads,
+                      functiondecl* fd, derived_probe* dp)
+{
+  target_read_cse cse (s, target_reads);
+  cse.current_function = fd;
+  cse.current_probe = dp;
+
+  varuse_collecting_visitor vut (s);
+  if (fd)
+    vut.current_function = fd;
+  body->visit (&vut);
+
+  // Only guru code may write what a target read reads.
+  if (s.guru_mode && vut.embedded_seen)
+    return;
+
+  cse.written = vut.written;
+  cse.replace (body);
+}
+
+void semantic_pass_target_cse(systemtap_session& s)
+{
+  set<functiondecl*> target_reads;
+  for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
+    {
+      functiondecl* fd = it->second;
+      if (!fd->synthetic)
+        continue;
+      target_read_analysis tra;
+      fd->body->visit(&tra);
+      if (!tra.reads)
+        continue;
+      varuse_collecting_visitor vut (s);
+      vut.current_function = fd;
+      fd->body->visit(&vut);
+      // Setters write the target, and so count as embedded.
+      bool pure = !vut.embedded_seen;
+      for (auto v = vut.written.begin(); v != vut.written.end(); ++v)
+        if (find (fd->locals.begin(), fd->locals.end(), *v) == fd->locals.end())
+          pure = false;
+      if (pure)
+        target_reads.insert(fd);
+    }
+  if (target_reads.empty())
+    return;
+
+  for (auto it = s.probes.begin(); it != s.probes.end(); ++it)
+    target_read_cse_body (s, (*it)->body, target_reads, 0, *it);
+
+  for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
+    if (!target_reads.count(it->second))
+      target_read_cse_body (s, it->second->body, target_reads,
+                            it->second, 0);
+}
+
+// ------------------------------------------------------------------------
+// per-CPU counters
+
+// A global array that is only ever added to ("x[k] += v", "x[k]++" as
+// statements) in the probes that write it, and only read in other
+// probes, is a counter.  Its updates are independent of each other, so
+// it can be kept as a statistic with just @sum: each CPU then adds into
+// its own map under the shared lock, and readers merge the per-CPU maps
+// like they do for any other statistic.
+
+static vardecl*
+percpu_counter_of (expression* e, const set<vardecl*>& vars)
+{
+  arrayindex* ai = dynamic_cast<arrayindex*>(e);
+  if (!ai)
+    return 0;
+  symbol* sym;
+  hist_op* hist;
+  classify_indexable (ai->base, sym, hist);
+  if (!sym || !sym->referent || !vars.count (sym->referent))
+    return 0;
+  return sym->referent;
+}
+
+
+// Is this statement a counter update?  If so, return the counter and
+// the expression being added, or null for ++/--.
+static vardecl*
+percpu_counter_update (expr_statement* s, const set<vardecl*>& vars,
+                       arrayindex*& ai, expression*& addend, bool& negate)
+{
+  if (dynamic_cast<delete_statement*>(s))
+    return 0;
+
+  addend = 0;
+  negate = false;
+  if (assignment* a = dynamic_cast<assignment*>(s->value))
+    {
+      if (a->op != "+=" && a->op != "-=")
+        return 0;
+      addend = a->right;
+      negate = (a->op == "-=");
+      ai = static_cast<arrayindex*>(a->left);
+      return percpu_counter_of (a->left, vars);
+    }
+
+  unary_expression* u = dynamic_cast<pre_crement*>(s->value);
+  if (!u)
+    u = dynamic_cast<post_crement*>(s->value);
+  if (!u)
+    return 0;
+  negate = (u->op == "--");
+  ai = static_cast<arrayindex*>(u->operand);
+  return percpu_counter_of (u->operand, vars);
+}
+
+
+struct percpu_counter_finder: public functioncall_traversing_visitor
+{
+  const set<vardecl*>& candidates;
+  set<vardecl*>& rejected;
+  set<vardecl*> updated;
+  set<vardecl*> read;
+
+  percpu_counter_finder (const set<vardecl*>& c, set<vardecl*>& r):
+    candidates (c), rejected (r) {}
+
+  void visit_indexes (arrayindex* e)
+  {
+    for (unsigned i = 0; i < e->indexes.size(); ++i)
+      if (e->indexes[i])
+        e->indexes[i]->visit (this);
+  }
+
+  void visit_expr_statement (expr_statement* s)
+  {
+    arrayindex* ai;
+    expression* addend;
+    bool negate;
+    vardecl* v = percpu_counter_update (s, candidates, ai, addend, negate);
+    if (!v)
+      return functioncall_traversing_visitor::visit_expr_statement (s);
+
+    updated.insert (v);
+    visit_indexes (ai);
+    if (addend)
+      addend->visit (this);
+  }
+
+  // Any other kind of write, or a write whose value is used.
+  void visit_assignment (assignment* e)
+  {
+    if (vardecl* v = percpu_counter_of (e->left, candidates))
+      rejected.insert (v);
+    functioncall_traversing_visitor::visit_assignment (e);
+  }
+
+  void visit_pre_crement (pre_crement* e)
+  {
+    if (vardecl* v = percpu_counter_of (e->operand, candidates))
+      rejected.insert (v);
+    functioncall_traversing_visitor::visit_pre_crement (e);
+  }
+
+  void visit_post_crement (post_crement* e)
+  {
+    if (vardecl* v = percpu_counter_of (e->operand, candidates))
+      rejected.insert (v);
+    functioncall_traversing_visitor::visit_post_crement (e);
+  }
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    vardecl* v = percpu_counter_of (e, candidates);
+    if (!v)
+      return functioncall_traversing_visitor::visit_arrayindex (e);
+    read.insert (v);
+    visit_indexes (e);
+  }
+
+  void visit_delete_statement (delete_statement* s)
+  {
+    symbol* sym = dynamic_cast<symbol*>(s->value);
+    if (sym && sym->referent && candidates.count (sym->referent))
+      return;
+    if (percpu_counter_of (s->value, candidates))
+      return visit_indexes (static_cast<arrayindex*>(s->value));
+    functioncall_traversing_visitor::visit_delete_statement (s);
+  }
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol* sym;
+    hist_op* hist;
+    classify_indexable (s->base, sym, hist);
+    if (!sym || !sym->referent || !candidates.count (sym->referent))
+      return functioncall_traversing_visitor::visit_foreach_loop (s);
+
+    // A value variable would see the statistic, not its sum.
+    if (s->value)
+      rejected.insert (sym->referent);
+    read.insert (sym->referent);
+    for (unsigned i = 0; i < s->array_slice.size(); ++i)
+      if (s->array_slice[i])
+        s->array_slice[i]->visit (this);
+    if (s->limit)
+      s->limit->visit (this);
+    s->block->visit (this);
+  }
+
+  // What remains are uses that a statistic doesn't allow.
+  void visit_symbol (symbol* e)
+  {
+    if (e->referent && candidates.count (e->referent))
+      rejected.insert (e->referent);
+  }
+};
+
+
+struct percpu_counter_rewriter: public update_visitor
+{
+  const set<vardecl*>& counters;
+
+  percpu_counter_rewriter (systemtap_session& s, const set<vardecl*>& c):
+    update_visitor (s.verbose), counters (c) {}
+
+  void replace_indexes (arrayindex* e)
+  {
+    for (unsigned i = 0; i < e->indexes.size(); ++i)
+      replace (e->indexes[i]);
+  }
+
+  void visit_expr_statement (expr_statement* s)
+  {
+    arrayindex* ai;
+    expression* addend;
+    bool negate;
+    if (!percpu_counter_update (s, counters, ai, addend, negate))
+      return update_visitor::visit_expr_statement (s);
+
+    replace_indexes (ai);
+    if (addend)
+      replace (addend);
+    else
+      {
+        addend = new literal_number (1);
+        addend->tok = s->value->tok;
+      }
+    if (negate)
+      {
+        unary_expression* neg = new unary_expression;
+        neg->tok = s->value->tok;
+        neg->op = "-";
+        neg->operand = addend;
+        addend = neg;
+      }
+
+    assignment* a = new assignment;
+    a->tok = s->value->tok;
+    a->op = "<<<";
+    a->left = ai;
+    a->right = addend;
+    s->value = a;
+    provide (s);
+  }
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    if (!percpu_counter_of (e, counters))
+      return update_visitor::visit_arrayindex (e);
+
+    replace_indexes (e);
+    stat_op* sum = new stat_op;
+    sum->tok = e->tok;
+    sum->ctype = sc_sum;
+    sum->stat = e;
+    provide (sum);
+  }
+
+  void visit_array_in (array_in* e)
+  {
+    if (!percpu_counter_of (e->operand, counters))
+      return update_visitor::visit_array_in (e);
+    replace_indexes (e->operand);
+    provide (e);
+  }
+
+  void visit_delete_statement (delete_statement* s)
+  {
+    if (!percpu_counter_of (s->value, counters))
+      return update_visitor::visit_delete_statement (s);
+    replace_indexes (static_cast<arrayindex*>(s->value));
+    provide (s);
+  }
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol* sym;
+    hist_op* hist;
+    classify_indexable (s->base, sym, hist);
+    if (sym && sym->referent && counters.count (sym->referent)
+        && s->sort_direction && s->sort_column == 0)
+      s->sort_aggr = sc_sum;
+    update_visitor::visit_foreach_loop (s);
+  }
+};
+
+
+static void
+semantic_pass_percpu_counters (systemtap_session& s)
+{
+  time_trace_scope ts ("semantic_pass_percpu_counters");
+  // Before 1.5, @sum of an empty aggregate was an error, not 0.
+  // --handoff doesn't carry statistics over to the next module.
+  if (s.unoptimized || s.dump_mode || s.monitor || s.handoff
+      || s.runtime_mode == systemtap_session::bpf_runtime
+      || strverscmp (s.compatible.c_str(), "1.5") < 0)
+    return;
+
+  // A pmap holds its maximum number of entries on each cpu, so arrays
+  // given a size of their own, which may be large, are left alone.
+  set<vardecl*> candidates;
+  for (unsigned i = 0; i < s.globals.size(); ++i)
+    {
+      vardecl* v = s.globals[i];
+      if (v->arity > 0 && v->maxsize == 0
+          && (v->type == pe_unknown || v->type == pe_long))
+        candidates.insert (v);
+    }
+  if (candidates.empty())
+    return;
+
+  // Each probe, including the functions it calls, may either update a
+  // counter or read it, but not both: a read merges all the per-CPU
+  // maps, which we don't want on the hot path.
+  set<vardecl*> rejected, updated, read;
+  for (unsigned i = 0; i < s.probes.size(); ++i)
+    {
+      percpu_counter_finder pcf (candidates, rejected);
+      s.probes[i]->body->visit (&pcf);
+      for (set<vardecl*>::iterator it = pcf.updated.begin();
+           it != pcf.updated.end(); ++it)
+        if (pcf.read.count (*it))
+          rejected.insert (*it);
+      updated.insert (pcf.updated.begin(), pcf.updated.end());
+      read.insert (pcf.read.begin(), pcf.read.end());
+    }
+
+  set<vardecl*> counters;
+  for (set<vardecl*>::iterator it = candidates.begin();
+       it != candidates.end(); ++it)
+    if (!rejected.count (*it) && updated.count (*it) && read.count (*it))
+      {
+        counters.insert (*it);
+        if (s.verbose > 1)
+          clog << _F("Using per-CPU counters for global '%s'",
+                     (*it)->unmangled_name.to_string().c_str()) << endl;
+      }
+  if (counters.empty())
+    return;
+
+  percpu_counter_rewriter pcr (s, counters);
+  for (unsigned i = 0; i < s.probes.size(); ++i)
+    pcr.replace (s.probes[i]->body);
+  for (map<string,functiondecl*>::iterator it = s.functions.begin();
+       it != s.functions.end(); ++it)
+    pcr.replace (it->second->body);
+}
+
+
 static int
 semantic_pass_optimize1 (systemtap_session& s)
 {
+  time_trace_scope ts ("semantic_pass_optimize1");
   // In this pass, we attempt to rewrite probe/function bodies to
   // eliminate some blatantly unnecessary code.  This is run before
   // type inference, but after symbol resolution and derived_probe
@@ -5759,6 +7332,9 @@ semantic_pass_optimize1 (systemtap_session& s)
       if (!s.unoptimized)
         semantic_pass_dead_control (s, relaxed_p);
 
+      if (!s.unoptimized)
+        semantic_pass_loop_invariants (s, relaxed_p);
+
       if (!s.unoptimized)
         semantic_pass_overload (s, relaxed_p);
 
@@ -5795,6 +7371,8 @@ semantic_pass_optimize1 (systemtap_session& s)
   
   if (!s.unoptimized && !s.dump_mode)
     s.probes = non_empty_probes;
+
+  semantic_pass_percpu_counters (s);
       
   return rc;
 }
@@ -5803,6 +7381,7 @@ semantic_pass_optimize1 (systemtap_session& s)
 static int
 semantic_pass_optimize2 (systemtap_session& s)
 {
+  time_trace_scope ts ("semantic_pass_optimize2");
   // This is run after type inference.  We run an outer "relaxation"
   // loop that repeats the optimizations until none of them find
   // anything to remove.
@@ -5834,7 +7413,10 @@ semantic_pass_optimize2 (systemtap_session& s)
     }
 
   if (!s.unoptimized)
-    semantic_pass_opt7(s);
+    {
+      semantic_pass_target_cse(s);
+      semantic_pass_opt7(s);
+    }
 
   return rc;
 }
@@ -6023,6 +7605,7 @@ static int initial_typeres_pass(systemtap_session& s)
 static int
 semantic_pass_types (systemtap_session& s)
 {
+  time_trace_scope ts ("semantic_pass_types");
   int rc = 0;
 
   // next pass: type inference
@@ -6146,6 +7729,9 @@ semantic_pass_types (systemtap_session& s)
             {
               throw SEMANTIC_ERROR(_("wrapping not supported for scalars"), gd->tok);
             }
+          if (gd->topk && (gd->arity == 0
+                           || (gd->type != pe_unknown && gd->type != pe_stats)))
+            throw SEMANTIC_ERROR(_("@topk only supported for statistics arrays"), gd->tok);
         }
 
       if (ti.num_newly_resolved == 0) // converged
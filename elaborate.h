@@ -244,6 +244,10 @@ public:
   virtual bool needs_global_locks () { return true; }
   // by default, probes need locks around global variables
 
+  virtual bool writes_rarely () { return false; }
+  // whether the probe fires so rarely, like on a procfs write, that the
+  // long scalar globals only it writes may be read without locks
+
   // Location of semaphores to activate sdt probes
   Dwarf_Addr sdt_semaphore_addr;
 
@@ -257,6 +261,14 @@ public:
   // this probe.
   std::set<derived_probe*> probes_with_affected_conditions;
 
+  // C expression implied by the probe condition, which the handler
+  // checks before it takes a context; empty if there is none.
+  std::string prefilter;
+
+  // Run the handler only on every sample'th hit on each cpu, as of
+  // .sample(N); 0 runs it on all of them.
+  int64_t sample;
+
   virtual void use_internal_buffer(const std::string&) {}
 };
 
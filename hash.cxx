@@ -18,6 +18,7 @@
 #include "session.h"
 #include "hash.h"
 #include "util.h"
+#include "parse.h"
 
 #include <cstdlib>
 #include <cstring>
@@ -30,91 +31,11 @@ extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include "mdfour.h"
 }
 
 using namespace std;
 
 
-class stap_hash
-{
-private:
-  struct mdfour md4;
-  std::ostringstream parm_stream;
-
-public:
-  stap_hash() { start(); }
-  stap_hash(const stap_hash &base) { md4 = base.md4; parm_stream << base.parm_stream.str(); }
-
-  void start();
-
-  void add(const std::string& description, const unsigned char *buffer, size_t size);
-  template<typename T> void add(const std::string& d, const T& x);
-  void add(const std::string& d, const char *s) { add((const std::string&)d, (const unsigned char *)s, strlen(s)); }
-  void add(const std:: string& d, const std::string& s) { add(d, (const unsigned char *)s.c_str(), s.length()); }
-
-  void add_path(const std::string& description, const std::string& path);
-
-  void result(std::string& r);
-  std::string get_parms() { return parm_stream.str(); }
-};
-
-
-void
-stap_hash::start()
-{
-  mdfour_begin(&md4);
-}
-
-
-void
-stap_hash::add(const std::string& description, const unsigned char *buffer, size_t size)
-{
-  parm_stream << description << buffer << endl;
-  mdfour_update(&md4, buffer, size);
-}
-
-
-template <typename T> void
-stap_hash::add(const std::string& d, const T& x)
-{
-  parm_stream << d << x << endl;
-  mdfour_update(&md4, (const unsigned char *)&x, sizeof(x));
-}
-
-
-void
-stap_hash::add_path(const std::string& description, const std::string& path)
-{
-  struct stat st;
-  memset (&st, 0, sizeof(st));
-
-  if (stat(path.c_str(), &st) != 0)
-    st.st_size = st.st_mtime = -1;
-
-  add(description + "Path: ", path);
-  add(description + "Size: ", st.st_size);
-  add(description + "Timestamp: ", st.st_mtime);
-}
-
-
-void
-stap_hash::result(string& r)
-{
-  ostringstream rstream;
-  unsigned char sum[16];
-
-  mdfour_update(&md4, NULL, 0);
-  mdfour_result(&md4, sum);
-
-  for (int i=0; i<16; i++)
-    {
-      rstream << hex << setfill('0') << setw(2) << (unsigned)sum[i];
-    }
-  rstream << "_" << setw(0) << dec << (unsigned)md4.totalN;
-  r = rstream.str();
-}
-
 void create_hash_log(const string &type_str, const string &parms, const string &result, const string &hash_log_path)
 {
   ofstream log_file;
@@ -233,6 +154,10 @@ find_script_hash (systemtap_session& s, const string& script)
   h.add("Error suppression (--suppress-handler-errors): ", s.suppress_handler_errors);
   h.add("Suppress Time Limits (--suppress-time-limits): ", s.suppress_time_limits);
   h.add("Prologue Searching (--prologue-searching[=WHEN]): ", int(s.prologue_searching_mode));
+  h.add("Binary Output (--output-format): ", s.binary_output);
+  h.add("Deferred Symbols (--defer-symbols): ", s.defer_symbols);
+  h.add("Lazy Unwind Data (--lazy-unwind): ", s.lazy_unwind);
+  h.add("Handoff (--handoff): ", s.handoff);
 
   for (unsigned i = 0; i < s.c_macros.size(); i++)
     h.add("Macros: ", s.c_macros[i]);
@@ -390,4 +315,120 @@ find_uprobes_hash (systemtap_session& s)
   return hashdir + "/uprobes_" + result;
 }
 
+
+// The cache name for the object file compiled from one auxiliary
+// source file of the module, or "" if it can't be cached.
+string
+find_object_hash (systemtap_session& s, const string& source)
+{
+  ifstream f (source.c_str(), ios::in | ios::binary);
+  string contents;
+  if (!f || !getline (f, contents, '\0').eof())
+    return "";
+
+  stap_hash h(get_base_hash(s));
+
+  // Everything else that goes into the compile besides the source
+  // (the stapconf name already hashes the kbuild flags)
+  h.add("Stapconf: ", s.stapconf_name);
+  for (unsigned i = 0; i < s.kbuildflags.size(); i++)
+    h.add("Kbuildflags: ", s.kbuildflags[i]);
+  for (unsigned i = 0; i < s.c_macros.size(); i++)
+    h.add("Macro: ", s.c_macros[i]);
+
+  // Digest the source separately, so it isn't copied into the log.
+  stap_hash src;
+  src.add("Source: ", (const unsigned char *)contents.data(), contents.size());
+  string src_result;
+  src.result(src_result);
+  h.add("Source digest: ", src_result);
+
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("object_hash"), h.get_parms(), result,
+                  hashdir + "/object_" + result + "_hash.log");
+  return hashdir + "/object_" + result + ".o";
+}
+
+string
+find_tapset_lexer_hash (systemtap_session& s, const string& contents,
+                        const string& compatible)
+{
+  // NB: not based on get_base_hash(), since the lexer output of a
+  // tapset file doesn't depend on the kernel or runtime at all.
+  stap_hash h;
+  h.add("Systemtap version: ", s.version_string());
+  h.add_path("Systemtap ", get_self_path());
+  h.add("Compatible: ", compatible);
+  h.add("Contents: ", (const unsigned char *)contents.data(), contents.size());
+
+  string result;
+  h.result(result);
+  return result;
+}
+
+
+string
+find_tapset_index_hash (systemtap_session& s)
+{
+  // Everything that can change which symbols a tapset file defines:
+  // the preprocessor conditional inputs, the library macros, and the
+  // tapset files themselves.
+  stap_hash h;
+  h.add("Systemtap version: ", s.version_string());
+  h.add_path("Systemtap ", get_self_path());
+  h.add("Compatible: ", s.compatible);
+  h.add("Kernel Release: ", s.kernel_release);
+  h.add("Architecture: ", s.architecture);
+  h.add("Runtime mode: ", s.runtime_mode);
+  h.add("Privilege: ", s.privilege);
+  h.add("Guru mode ", s.guru_mode);
+  for (auto it = s.kernel_config.begin(); it != s.kernel_config.end(); ++it)
+    h.add("Kernel config: ", string(it->first) + "=" + string(it->second));
+  for (unsigned i = 0; i < s.args.size(); i++)
+    h.add("Argument: ", s.args[i]);
+
+  for (auto it = s.library_macros.begin(); it != s.library_macros.end(); ++it)
+    {
+      h.add("Library macro: ", it->first);
+      const macrodecl* m = it->second;
+      for (unsigned i = 0; i < m->formal_args.size(); i++)
+        h.add("Macro arg: ", m->formal_args[i]);
+      for (unsigned i = 0; i < m->body.size(); i++)
+        h.add("Macro token: ", string(m->body[i]->content));
+    }
+
+  for (unsigned i = 0; i < s.library_stubs.size(); i++)
+    {
+      h.add("Tapset flags: ", s.library_stubs[i]->flags);
+      h.add_path("Tapset ", s.library_stubs[i]->path);
+    }
+
+  string result;
+  h.result(result);
+  return result;
+}
+
+
+string
+find_regex_hash (systemtap_session& s, const string& kind,
+                 const vector<string>& patterns)
+{
+  // NB: not based on get_base_hash(), since a DFA depends on nothing
+  // but its patterns and the translator that built it.
+  stap_hash h;
+  h.add("Systemtap version: ", s.version_string());
+  h.add_path("Systemtap ", get_self_path());
+  h.add("Kind: ", kind);
+  for (unsigned i = 0; i < patterns.size(); i++)
+    h.add("Pattern: ", patterns[i]);
+
+  string result;
+  h.result(result);
+  return result;
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
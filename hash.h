@@ -1,5 +1,78 @@
+#ifndef HASH_H
+#define HASH_H
+
 #include <string>
 #include <vector>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+extern "C" {
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "mdfour.h"
+}
+
+struct systemtap_session;
+
+// An md4 hash of a series of described values, which also keeps a
+// readable log of them.  NB: also used by stap-serverd, so this is all
+// inline rather than in hash.cxx with its session dependencies.
+class stap_hash
+{
+private:
+  struct mdfour md4;
+  std::ostringstream parm_stream;
+
+public:
+  stap_hash() { start(); }
+  stap_hash(const stap_hash &base) { md4 = base.md4; parm_stream << base.parm_stream.str(); }
+
+  void start() { mdfour_begin(&md4); }
+
+  void add(const std::string& description, const unsigned char *buffer, size_t size)
+  {
+    parm_stream << description << buffer << std::endl;
+    mdfour_update(&md4, buffer, size);
+  }
+  template<typename T> void add(const std::string& d, const T& x)
+  {
+    parm_stream << d << x << std::endl;
+    mdfour_update(&md4, (const unsigned char *)&x, sizeof(x));
+  }
+  void add(const std::string& d, const char *s) { add((const std::string&)d, (const unsigned char *)s, strlen(s)); }
+  void add(const std:: string& d, const std::string& s) { add(d, (const unsigned char *)s.c_str(), s.length()); }
+
+  void add_path(const std::string& description, const std::string& path)
+  {
+    struct stat st;
+    memset (&st, 0, sizeof(st));
+
+    if (stat(path.c_str(), &st) != 0)
+      st.st_size = st.st_mtime = -1;
+
+    add(description + "Path: ", path);
+    add(description + "Size: ", st.st_size);
+    add(description + "Timestamp: ", st.st_mtime);
+  }
+
+  void result(std::string& r)
+  {
+    std::ostringstream rstream;
+    unsigned char sum[16];
+
+    mdfour_update(&md4, NULL, 0);
+    mdfour_result(&md4, sum);
+
+    for (int i=0; i<16; i++)
+      {
+        rstream << std::hex << std::setfill('0') << std::setw(2) << (unsigned)sum[i];
+      }
+    rstream << "_" << std::setw(0) << std::dec << (unsigned)md4.totalN;
+    r = rstream.str();
+  }
+  std::string get_parms() { return parm_stream.str(); }
+};
 
 // Grabbed from linux/module.h kernel include.
 #define MODULE_NAME_LEN (64 - sizeof(unsigned long))
@@ -10,5 +83,14 @@ std::string find_tracequery_hash (systemtap_session& s,
                                   const std::string& header);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
 std::string find_uprobes_hash (systemtap_session& s);
+std::string find_object_hash (systemtap_session& s, const std::string& source);
+std::string find_tapset_lexer_hash (systemtap_session& s,
+                                    const std::string& contents,
+                                    const std::string& compatible);
+std::string find_tapset_index_hash (systemtap_session& s);
+std::string find_regex_hash (systemtap_session& s, const std::string& kind,
+                             const std::vector<std::string>& patterns);
+
+#endif // HASH_H
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -380,6 +380,52 @@ public:
     build_collection_rh(string n) : request_handler(n) {}
 };
 
+// Uploaded files are kept here, named by the SHA-256 of their contents,
+// so that a client can skip uploading one we already have.
+static string
+upload_cache_dir()
+{
+    const char *s_d = getenv("SYSTEMTAP_DIR");
+    string dir = (s_d ? string(s_d) : string(get_home_directory()) + "/.systemtap")
+	+ "/cache/uploads";
+    if (create_dir(dir.c_str(), 0700) != 0) {
+	server_error(_F("Could not create upload cache directory %s: %s",
+			dir.c_str(), strerror(errno)));
+	return "";
+    }
+    return dir;
+}
+
+static bool
+valid_upload_hash(const string &hash)
+{
+    return (hash.size() == 64
+	    && hash.find_first_not_of("0123456789abcdef") == string::npos);
+}
+
+class upload_rh : public request_handler
+{
+public:
+    upload_rh(string n) : request_handler(n) {}
+
+    response GET(const request &req);
+};
+
+response upload_rh::GET(const request &req)
+{
+    // matches[0] is the entire string '/uploads/XXXX'. matches[1] is
+    // just the hash 'XXXX'.
+    string hash = req.matches[1];
+    string dir = upload_cache_dir();
+    if (!valid_upload_hash(hash) || dir.empty()
+	|| !file_exists(dir + "/" + hash))
+	return get_404_response();
+
+    response r(200, "application/json");
+    r.content = "{ \"hash\": \"" + hash + "\" }\n";
+    return r;
+}
+
 response build_collection_rh::POST(const request &req)
 {
     client_request_data *crd = new client_request_data;
@@ -395,6 +441,7 @@ response build_collection_rh::POST(const request &req)
     vector<string> file_name;
     vector<string> build_id;
     vector<string> file_pkg;
+    vector<string> known_files;
     for (auto it = req.params.begin(); it != req.params.end(); it++) {
 	if (it->first == "kver") {
 	    crd->kver = it->second[0];
@@ -425,6 +472,9 @@ response build_collection_rh::POST(const request &req)
 	else if (it->first == "file_pkg") {
 	    file_pkg = it->second;
 	}
+	else if (it->first == "known_files") {
+	    known_files = it->second;
+	}
 	else if (it->first == "env_vars") {
 	    // Get rid of a few standard environment variables (which
 	    // might cause us to do unintended things) from the list
@@ -493,6 +543,34 @@ response build_collection_rh::POST(const request &req)
 	}
     }
 
+    // Keep what was uploaded for next time, and fetch the files the
+    // client didn't upload since we already had them. Each of those
+    // comes as "NAME=HASH".
+    string upload_dir = upload_cache_dir();
+    if (!upload_dir.empty()) {
+	for (auto i = crd->files.begin(); i != crd->files.end(); i++) {
+	    string path = crd->server_dir + "/" + *i;
+	    string hash = file_sha256(path);
+	    if (!hash.empty() && !file_exists(upload_dir + "/" + hash))
+		copy_file(path, upload_dir + "/" + hash);
+	}
+    }
+    for (auto i = known_files.begin(); i != known_files.end(); i++) {
+	size_t eq = i->rfind('=');
+	string name = i->substr(0, eq);
+	string hash = (eq == string::npos) ? "" : i->substr(eq + 1);
+	if (name.empty() || name.find("..") != string::npos
+	    || name.find('/') != string::npos || !valid_upload_hash(hash)
+	    || upload_dir.empty()
+	    || !copy_file(upload_dir + "/" + hash, crd->server_dir + "/" + name)) {
+	    server_error(_F("400 - bad request (known file '%s')", i->c_str()));
+	    response error400(400);
+	    error400.content = "<h1>Bad request</h1>";
+	    return error400;
+	}
+	crd->files.push_back(name);
+    }
+
     // Make sure we've got everything we need.
     if (crd->kver.empty() || crd->arch.empty() || crd->cmd_args.empty()
 	|| crd->distro_name.empty() || crd->distro_version.empty()) {
@@ -665,10 +743,43 @@ response result_file_rh::GET(const request &req)
     return rsp;
 }
 
+class status_rh : public request_handler
+{
+public:
+    response GET(const request &req);
+
+    status_rh(string n) : request_handler(n) {}
+};
+
+// Report how busy the server is: the builds it knows about, and the
+// state of the backends (such as the container pool's utilization).
+response status_rh::GET(const request &)
+{
+    struct json_object *root = json_object_new_object();
+    json_object_object_add(root, "version", json_object_new_string(VERSION));
+    {
+	// Use a lock_guard to ensure the mutex gets released even if an
+	// exception is thrown.
+	lock_guard<mutex> lock(builds_mutex);
+	json_object_object_add(root, "builds",
+			       json_object_new_int(build_infos.size()));
+    }
+    get_backend_status(root);
+
+    response rsp(200);
+    rsp.content_type = "application/json";
+    rsp.content = json_object_to_json_string_ext(root, JSON_C_TO_STRING_PRETTY);
+    rsp.content += "\n";
+    json_object_put(root);
+    return rsp;
+}
+
 build_collection_rh builds_rh("build collection");
 individual_build_rh build_rh("individual build");
 individual_result_rh result_rh("individual result");
 result_file_rh result_file_rh("result file");
+upload_rh uploads_rh("upload");
+status_rh server_status_rh("status");
 
 void
 build_info::set_result(result_info *ri)
@@ -1063,4 +1174,6 @@ void api_add_request_handlers(server &http)
     http.add_request_handler("/builds/([0-9a-f]+)$", build_rh);
     http.add_request_handler("/results/([0-9a-f]+)$", result_rh);
     http.add_request_handler("/results/([^/]+)/([^/]+)$", result_file_rh);
+    http.add_request_handler("/uploads/([0-9a-f]+)$", uploads_rh);
+    http.add_request_handler("/status$", server_status_rh);
 }
@@ -9,6 +9,9 @@
 #include "backends.h"
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "../util.h"
 #include "utils.h"
 
@@ -173,6 +176,54 @@ private:
 };
 
 
+// Warm build containers, kept by image hash. Rather than each build
+// creating a container and deleting it when done, builds for the same
+// kernel share a container, up to max_runs of them at once, and a
+// container that has been idle for idle_timeout seconds is removed by
+// a reaper thread.
+class container_pool
+{
+public:
+    container_pool() : builds(0), reuses(0), stopping(false) {}
+    ~container_pool();
+
+    void initialize(const string &buildah_path);
+    bool acquire(const string &hash, const string &image, string &name,
+		 const string &stdout_path, const string &stderr_path);
+    void release(const string &name, bool broken);
+    void add_status(struct json_object *root);
+
+    static unsigned max_runs;
+    static unsigned idle_timeout;
+
+private:
+    struct warm_container
+    {
+	string hash;
+	string name;
+	unsigned runs;
+	bool broken;
+	time_t last_used;
+    };
+
+    // The buildah executable path.
+    string buildah_path;
+
+    mutex pool_mutex;
+    condition_variable pool_cv;
+    vector<warm_container> containers;
+    unsigned long builds, reuses;
+    bool stopping;
+    thread reaper;
+
+    void reap();
+    void remove(const vector<string> &names);
+};
+
+unsigned container_pool::max_runs = 4;
+unsigned container_pool::idle_timeout = 600;
+
+
 class container_backend : public backend_base
 {
 public:
@@ -184,6 +235,7 @@ public:
 			const string &uuid,
 			const string &stdout_path,
 			const string &stderr_path);
+    void add_status(struct json_object *root);
 
 private:
     // The buildah executable path.
@@ -203,6 +255,8 @@ private:
 
     container_image_cache image_cache;
 
+    container_pool pool;
+
     // The current user's uid/gid.
     string uid_gid_str;
 };
@@ -226,6 +280,7 @@ container_backend::container_backend()
     }
     
     image_cache.initialize(buildah_path);
+    pool.initialize(buildah_path);
 
     build_docker_file_script_path = string(PKGLIBDIR)
 	+ "/httpd/docker/stap_build_docker_file.py";
@@ -301,9 +356,6 @@ container_backend::generate_module(const client_request_data *crd,
 				const string &stdout_path,
 				const string &stderr_path)
 {
-    vector<string> images_to_remove;
-    vector<string> containers_to_remove;
-
     // Handle capturing the container build and run stdout and stderr
     // (along with using /dev/null for stdin). If the client requested
     // it, just use stap's stdout/stderr files.
@@ -445,70 +497,47 @@ container_backend::generate_module(const client_request_data *crd,
 	image_cache.add(hash, stap_image_name);
     }
 
-    // We need a unique name for the container that "buildah run stap
-    // ..." will create, so grab another uuid.
-    string stap_container_uuid = get_uuid();
-
-    // At this point, we've got an image. We need to convert it to a
-    // container. Note that instead of copying the user's file(s) into
-    // the container, running stap, then copying the resulting file(s)
-    // out of the container, we're just going to bind mount the temp
-    // directory into the container.
-    cmd_args.clear();
-    cmd_args.push_back("sudo");
-    cmd_args.push_back(buildah_path);
-    cmd_args.push_back("from");
-    cmd_args.push_back("--name");
-    cmd_args.push_back(stap_container_uuid);
-    cmd_args.push_back("--volume");
-    // The mount options are:
-    //    rw: read-write mode
-    //    Z: private unshared selinux label (so the host os and
-    //       container can privately share the directory)
-    cmd_args.push_back(crd->client_dir + ":" + crd->client_dir + ":rw,Z");
-    cmd_args.push_back(stap_image_name);
-    rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-			     stdout_path, stderr_path);
-    server_error(_F("Spawned process returned %d", rc));
-    if (rc != 0) {
+    // At this point, we've got an image. Get a container made from it
+    // out of the pool (which will create one if none is free).
+    string stap_container_name;
+    if (!pool.acquire(hash, stap_image_name, stap_container_name,
+		      stdout_path, stderr_path)) {
 	server_error("buildah from failed.");
 	return -1;
     }
 
-    // If we're here, we built the image and converted it into a
-    // container successfully. Now configure the container with
-    // environment variables that were sent over from the client (if
-    // any) and the right working directory.
+    // Instead of copying the user's file(s) into the container,
+    // running stap, then copying the resulting file(s) out of the
+    // container, we're just going to bind mount the temp directory
+    // into the container for this run only, so that other builds
+    // sharing the container can't see it. The mount options are:
+    //    rw: read-write mode
+    //    Z: private unshared selinux label (so the host os and
+    //       container can privately share the directory)
     //
     // When running "stap --tmpdir=/tmp/FOO", your current directory
     // needs to be /tmp/FOO for stap to run successfully (for some odd
-    // reason).
-    cmd_args.clear();
-    cmd_args.push_back("sudo");
-    cmd_args.push_back(buildah_path);
-    cmd_args.push_back("config");
+    // reason). The environment variables that were sent over from
+    // the client (if any) are set with env(1), since the container's
+    // own configuration is shared.
+    vector<string> run_args;
+    run_args.push_back("sudo");
+    run_args.push_back(buildah_path);
+    run_args.push_back("run");
+    run_args.push_back("--volume");
+    run_args.push_back(crd->client_dir + ":" + crd->client_dir + ":rw,Z");
+    run_args.push_back("--workingdir");
+    run_args.push_back(crd->client_dir);
+    run_args.push_back(stap_container_name);
+    run_args.push_back("--");
+
+    // Now run stap.
+    cmd_args = run_args;
+    cmd_args.push_back("env");
+    cmd_args.push_back("--");
     for (auto i = crd->env_vars.begin(); i < crd->env_vars.end(); ++i) {
-	cmd_args.push_back("--env");
 	cmd_args.push_back(*i);
     }
-    cmd_args.push_back("--workingdir");
-    cmd_args.push_back(crd->client_dir);
-    cmd_args.push_back(stap_container_uuid);
-    rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-			     stdout_path, stderr_path);
-    server_error(_F("Spawned process returned %d", rc));
-    if (rc != 0) {
-	server_error("buildah config failed.");
-	return -1;
-    }
-
-    // Now start the container and run stap.
-    cmd_args.clear();
-    cmd_args.push_back("sudo");
-    cmd_args.push_back(buildah_path);
-    cmd_args.push_back("run");
-    cmd_args.push_back(stap_container_uuid);
-    cmd_args.push_back("--");
     for (auto it = argv.begin(); it != argv.end(); it++) {
 	cmd_args.push_back(*it);
     }
@@ -523,12 +552,7 @@ container_backend::generate_module(const client_request_data *crd,
     // files get owned by root, the 'stap-http-server' user will have
     // trouble deleting them. So, let's change owner/group of the
     // files from inside the container (where we're root).
-    cmd_args.clear();
-    cmd_args.push_back("sudo");
-    cmd_args.push_back(buildah_path);
-    cmd_args.push_back("run");
-    cmd_args.push_back(stap_container_uuid);
-    cmd_args.push_back("--");
+    cmd_args = run_args;
     cmd_args.push_back("chown");
     cmd_args.push_back("-R");
     cmd_args.push_back(uid_gid_str);
@@ -540,79 +564,27 @@ container_backend::generate_module(const client_request_data *crd,
 	server_error("buildah run failed.");
     }
 
-    // At this point we've built the container and run stap
-    // (successfully or unsuccessfully). We're finished with the
-    // container.
-    containers_to_remove.push_back(stap_container_uuid);
-
-    // OK, at this point we've created a container, run stap, and
-    // copied out any result. Let's do a little cleanup and delete the
-    // last layer. We'll leave (for now) the container with all the
-    // files, but delete the layer that got created as stap was run
-    // (since there is no reuse there).
-    //
-    // buildah rm/rmi stap_container_uuid
+    // We're finished with the container. It goes back to the pool
+    // for the next build of this kernel, unless even "chown" failed
+    // in it, in which case something is wrong with the container
+    // itself and the pool drops it.
     //
-    // Note that we have to remove the containers first, because they
-    // depend on the images.
-
-    // FIXME: MORE CLEANUP NEEDED!
-    //
-    // Note that we're not removing the initial buildah image we built,
+    // FIXME: Note that we're still not removing the images we build,
     // so if the user turns right around again and builds another
-    // script that image will get reused. But, that initial docker
-    // image never gets deleted currently. The "buildah images" command
-    // knows when an image was created, but not the last time it was
-    // used.
-    //
-    // We might be able to tie in the information from "buildah
-    // containers", which lists all containers, and when they were
-    // created. Since the containers are short-lived (they just exist
-    // to run "stap"), their creation date is really the last used
-    // date of the related image. But, of course we delete that
-    // container at the end of every run so that info gets deleted. In
-    // theory we could leave that container around and every so often
-    // run a python script that puts the two bits of information
-    // together and deletes images and containers that haven't been
-    // used in a while.
-
-    if (! containers_to_remove.empty()) {
-	cmd_args.clear();
-	cmd_args.push_back("sudo");
-	cmd_args.push_back(buildah_path);
-	cmd_args.push_back("rm");
-	for (auto i = containers_to_remove.begin();
-	     i != containers_to_remove.end(); i++) {
-	    cmd_args.push_back(*i);
-	}
-	rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-				 container_stdout_path, container_stderr_path);
-	// Note that we're ignoring any errors here.
-	server_error(_F("Spawned process returned %d", rc));
-	if (rc != 0) {
-	    server_error("buildah rm failed.");
-	}
-    }
-    if (! images_to_remove.empty()) {
-	cmd_args.clear();
-	cmd_args.push_back("sudo");
-	cmd_args.push_back(buildah_path);
-	cmd_args.push_back("rmi");
-	for (auto i = images_to_remove.begin(); i != images_to_remove.end();
-	     i++) {
-	    cmd_args.push_back(*i);
-	}
-	rc = execute_and_capture(2, cmd_args, vector<std::string> (),
-				 container_stdout_path, container_stderr_path);
-	// Note that we're ignoring any errors here.
-	server_error(_F("Spawned process returned %d", rc));
-	if (rc != 0) {
-	    server_error("buildah rmi failed.");
-	}
-    }
+    // script that image will get reused. But, images never get
+    // deleted currently. The "buildah images" command knows when an
+    // image was created, but not the last time it was used.
+    pool.release(stap_container_name, rc != 0);
     return saved_rc;
 }
 
+void
+container_backend::add_status(struct json_object *root)
+{
+    if (!buildah_path.empty())
+	pool.add_status(root);
+}
+
 
 void
 container_image_cache::initialize(const string &bp)
@@ -772,6 +744,193 @@ container_image_cache::find(const string &hash, string &id)
 }
 
 
+void
+container_pool::initialize(const string &bp)
+{
+    buildah_path = bp;
+}
+
+container_pool::~container_pool()
+{
+    vector<string> names;
+    {
+	lock_guard<mutex> lock(pool_mutex);
+	stopping = true;
+	for (auto it = containers.begin(); it != containers.end(); it++)
+	    names.push_back(it->name);
+	containers.clear();
+    }
+    pool_cv.notify_all();
+    if (reaper.joinable())
+	reaper.join();
+    remove(names);
+}
+
+// Find a container made from the image with this hash with room for
+// another build, or create one.
+bool
+container_pool::acquire(const string &hash, const string &image,
+			string &name, const string &stdout_path,
+			const string &stderr_path)
+{
+    {
+	lock_guard<mutex> lock(pool_mutex);
+	builds++;
+	warm_container *best = NULL;
+	for (auto it = containers.begin(); it != containers.end(); it++) {
+	    if (it->hash == hash && !it->broken && it->runs < max_runs
+		&& (best == NULL || it->runs < best->runs))
+		best = &*it;
+	}
+	if (best) {
+	    best->runs++;
+	    best->last_used = time(NULL);
+	    reuses++;
+	    name = best->name;
+	    return true;
+	}
+    }
+
+    // We need a unique name for the new container, so grab another
+    // uuid.
+    name = get_uuid();
+    vector<string> cmd_args;
+    cmd_args.push_back("sudo");
+    cmd_args.push_back(buildah_path);
+    cmd_args.push_back("from");
+    cmd_args.push_back("--name");
+    cmd_args.push_back(name);
+    cmd_args.push_back(image);
+    int rc = execute_and_capture(2, cmd_args, vector<std::string> (),
+				 stdout_path, stderr_path);
+    server_error(_F("Spawned process returned %d", rc));
+    if (rc != 0)
+	return false;
+
+    lock_guard<mutex> lock(pool_mutex);
+    containers.push_back({ hash, name, 1, false, time(NULL) });
+    if (!reaper.joinable())
+	reaper = thread(&container_pool::reap, this);
+    return true;
+}
+
+void
+container_pool::release(const string &name, bool broken)
+{
+    vector<string> names;
+    {
+	lock_guard<mutex> lock(pool_mutex);
+	for (auto it = containers.begin(); it != containers.end(); it++) {
+	    if (it->name != name)
+		continue;
+	    it->runs--;
+	    it->last_used = time(NULL);
+	    it->broken |= broken;
+	    if (it->broken && it->runs == 0) {
+		names.push_back(it->name);
+		containers.erase(it);
+	    }
+	    break;
+	}
+    }
+    remove(names);
+}
+
+// Remove the containers that have been idle for too long, checking
+// every so often until the pool is destroyed.
+void
+container_pool::reap()
+{
+    unique_lock<mutex> lock(pool_mutex);
+    while (!stopping) {
+	pool_cv.wait_for(lock, chrono::seconds(max(1U, idle_timeout / 4)));
+	if (stopping)
+	    break;
+
+	vector<string> names;
+	time_t now = time(NULL);
+	for (auto it = containers.begin(); it != containers.end(); ) {
+	    if (it->runs == 0 && now - it->last_used >= (time_t)idle_timeout) {
+		names.push_back(it->name);
+		it = containers.erase(it);
+	    }
+	    else
+		it++;
+	}
+	if (names.empty())
+	    continue;
+	lock.unlock();
+	remove(names);
+	lock.lock();
+    }
+}
+
+void
+container_pool::remove(const vector<string> &names)
+{
+    if (names.empty())
+	return;
+
+    vector<string> cmd_args;
+    cmd_args.push_back("sudo");
+    cmd_args.push_back(buildah_path);
+    cmd_args.push_back("rm");
+    cmd_args.insert(cmd_args.end(), names.begin(), names.end());
+    ostringstream out;
+    int rc = stap_system_read(0, cmd_args, out);
+    // Note that we're ignoring any errors here.
+    server_error(_F("Spawned process returned %d", rc));
+    if (rc != 0) {
+	server_error("buildah rm failed.");
+    }
+}
+
+void
+container_pool::add_status(struct json_object *root)
+{
+    unsigned busy = 0, runs = 0;
+    lock_guard<mutex> lock(pool_mutex);
+    for (auto it = containers.begin(); it != containers.end(); it++) {
+	if (it->runs)
+	    busy++;
+	runs += it->runs;
+    }
+
+    struct json_object *pool = json_object_new_object();
+    json_object_object_add(pool, "containers",
+			   json_object_new_int(containers.size()));
+    json_object_object_add(pool, "busy_containers", json_object_new_int(busy));
+    json_object_object_add(pool, "running_builds", json_object_new_int(runs));
+    json_object_object_add(pool, "capacity",
+			   json_object_new_int(containers.size() * max_runs));
+    json_object_object_add(pool, "max_builds_per_container",
+			   json_object_new_int(max_runs));
+    json_object_object_add(pool, "idle_timeout",
+			   json_object_new_int(idle_timeout));
+    json_object_object_add(pool, "builds", json_object_new_int64(builds));
+    json_object_object_add(pool, "reused", json_object_new_int64(reuses));
+    json_object_object_add(root, "container_pool", pool);
+}
+
+void
+set_container_pool_limits(unsigned max_builds, unsigned idle_timeout)
+{
+    if (max_builds)
+	container_pool::max_runs = max_builds;
+    if (idle_timeout)
+	container_pool::idle_timeout = idle_timeout;
+}
+
+void
+get_backend_status(struct json_object *root)
+{
+    vector<backend_base *> backends;
+    get_backends(backends);
+    for (auto it = backends.begin(); it != backends.end(); it++)
+	(*it)->add_status(root);
+}
+
+
 static vector<backend_base *>saved_backends;
 static void backends_atexit_handler()
 {
@@ -24,8 +24,13 @@ public:
 				const std::string &uuid,
 				const std::string &stdout_path,
 				const std::string &stderr_path) = 0;
+
+    // Add this backend's state, if any, to the server status.
+    virtual void add_status(struct json_object *) { }
 };
 
 void get_backends(std::vector<backend_base *> &backends);
+void get_backend_status(struct json_object *root);
+void set_container_pool_limits(unsigned max_builds, unsigned idle_timeout);
 
 #endif /* __BACKEND_H__ */
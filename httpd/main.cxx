@@ -8,6 +8,7 @@
 
 #include "server.h"
 #include "api.h"
+#include "backends.h"
 #include <iostream>
 #include "../util.h"
 #include "nss_funcs.h"
@@ -20,6 +21,7 @@ extern "C" {
 #include <errno.h>
 #include <sys/signalfd.h>
 #include <getopt.h>
+#include <limits.h>
 }
 
 server *httpd = NULL;
@@ -105,17 +107,21 @@ parse_cmdline(int argc, char *const argv[])
 	LONG_OPT_PORT = 256,
 	LONG_OPT_SSL,
 	LONG_OPT_LOG,
+	LONG_OPT_CONTAINER_BUILDS,
+	LONG_OPT_CONTAINER_IDLE,
     };
     static struct option long_options[] = {
         { "port", 1, NULL, LONG_OPT_PORT },
         { "ssl", 1, NULL, LONG_OPT_SSL },
         { "log", 1, NULL, LONG_OPT_LOG },
+        { "container-builds", 1, NULL, LONG_OPT_CONTAINER_BUILDS },
+        { "container-idle-timeout", 1, NULL, LONG_OPT_CONTAINER_IDLE },
         { NULL, 0, NULL, 0 }
     };
     while (true) {
 	int grc = getopt_long(argc, argv, "", long_options, NULL);
 	char *num_endptr;
-	unsigned long port_tmp;
+	unsigned long port_tmp, num_tmp;
 	if (grc < 0)
 	    break;
 	switch (grc) {
@@ -140,6 +146,24 @@ parse_cmdline(int argc, char *const argv[])
 	  case LONG_OPT_LOG:
 	    start_log(optarg, true);
 	    break;
+	  case LONG_OPT_CONTAINER_BUILDS:
+	  case LONG_OPT_CONTAINER_IDLE:
+	    errno = 0;
+	    num_tmp = strtoul(optarg, &num_endptr, 10);
+	    if (*num_endptr != '\0' || errno != 0 || num_tmp == 0
+		|| num_tmp > UINT_MAX) {
+		server_error(_F("%s: invalid entry: '--%s=%s' must be a"
+				" positive number", argv[0],
+				(grc == LONG_OPT_CONTAINER_BUILDS
+				 ? "container-builds"
+				 : "container-idle-timeout"), optarg));
+		exit(1);
+	    }
+	    if (grc == LONG_OPT_CONTAINER_BUILDS)
+		set_container_pool_limits(num_tmp, 0);
+	    else
+		set_container_pool_limits(0, num_tmp);
+	    break;
 	  default:
 	    break;
 	}
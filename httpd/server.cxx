@@ -26,6 +26,9 @@ extern "C"
 #include <limits.h>
 #include <json-c/json.h>
 #include <sys/utsname.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 }
 
 using namespace std;
@@ -404,6 +407,7 @@ enum class request_method
 {
     UNKNOWN = 0,
     GET,
+    HEAD,
     POST,
     PUT,
     DELETE,
@@ -438,6 +442,10 @@ server::access_handler(struct MHD_Connection *connection,
     if (strcmp(method, MHD_HTTP_METHOD_GET) == 0) {
 	rq_method = request_method::GET;
     }
+    else if (strcmp(method, MHD_HTTP_METHOD_HEAD) == 0) {
+	// MHD leaves the body out of the response to a HEAD.
+	rq_method = request_method::HEAD;
+    }
     else if (strcmp(method, MHD_HTTP_METHOD_POST) == 0) {
 	rq_method = request_method::POST;
     }
@@ -518,6 +526,7 @@ server::access_handler(struct MHD_Connection *connection,
     // method and pass it the request info.
     switch (rq_method) {
       case request_method::GET:
+      case request_method::HEAD:
 	return queue_response(rh->GET(rq_info), connection);
       case request_method::POST:
 	return queue_response(rh->POST(rq_info), connection);
@@ -547,7 +556,39 @@ server::queue_response(const response &response, MHD_Connection *connection)
 	    close(fd);
 	    return queue_response(get_404_response(), connection);
 	}	    
-	mhd_response = MHD_create_response_from_fd(stat_buf.st_size, fd);
+	mhd_response = NULL;
+#ifdef HAVE_LIBZSTD
+	// Compress files (like modules) for clients that take zstd.
+	const char *accept = MHD_lookup_connection_value(connection,
+							 MHD_HEADER_KIND,
+							 MHD_HTTP_HEADER_ACCEPT_ENCODING);
+	if (accept && strstr(accept, "zstd") && stat_buf.st_size > 0) {
+	    string contents((size_t)stat_buf.st_size, '\0');
+	    if (pread(fd, &contents[0], contents.size(), 0)
+		== (ssize_t)contents.size()) {
+		size_t bound = ZSTD_compressBound(contents.size());
+		void *buf = malloc(bound);
+		size_t len = buf ? ZSTD_compress(buf, bound, contents.data(),
+						 contents.size(), 3) : 0;
+		if (buf && !ZSTD_isError(len)) {
+		    mhd_response = MHD_create_response_from_buffer(len, buf,
+								   MHD_RESPMEM_MUST_FREE);
+		    if (mhd_response != NULL) {
+			MHD_add_response_header(mhd_response,
+						MHD_HTTP_HEADER_CONTENT_ENCODING,
+						"zstd");
+			close(fd);
+		    }
+		    else
+			free(buf);
+		}
+		else
+		    free(buf);
+	    }
+	}
+#endif
+	if (mhd_response == NULL)
+	    mhd_response = MHD_create_response_from_fd(stat_buf.st_size, fd);
     }
     else {
 	mhd_response = MHD_create_response_from_buffer(response.content.length(),
@@ -601,6 +642,10 @@ server::start()
 				NULL, NULL, // default accept policy
 				&server::access_handler_shim, this,
 				MHD_OPTION_THREAD_POOL_SIZE, 4,
+				// Clients keep their connection open
+				// while polling for a build; drop it if
+				// they go quiet.
+				MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int) 120,
 				MHD_OPTION_NOTIFY_COMPLETED,
 				&server::request_completed_handler_shim, this,
 				MHD_OPTION_HTTPS_MEM_KEY, key_pk12.c_str(),
@@ -14,6 +14,7 @@
 #include "parse.h"
 #include "csclient.h"
 #include "client-nss.h"
+#include "tapsets.h"
 
 #include "stap-probe.h"
 
@@ -762,6 +763,35 @@ public:
   }
 };
 
+// Open the kernel debuginfo in this long-lived process, the way a
+// --compile-daemon does, so that every forked run inherits it warm
+// instead of opening and indexing it afresh.  Only tried once.
+static void
+warm_up_for_runs (systemtap_session &s)
+{
+  static bool tried = false;
+  if (tried || s.runtime_usermode_p() || s.last_pass < 2
+      || !s.specified_servers.empty())
+    return;
+  tried = true;
+
+  unsigned saved_verbose = s.verbose;
+  s.verbose = s.perpass_verbose[1];
+  try
+    {
+      warm_kernel_debuginfo (s);
+      if (s.verbose)
+	clog << _("Kernel debuginfo kept open for later runs.") << endl;
+    }
+  catch (const semantic_error& e)
+    {
+      // The runs that need it will report the problem themselves.
+      if (s.verbose > 1)
+	s.print_error (e);
+    }
+  s.verbose = saved_verbose;
+}
+
 class run_cmd : public cmdopt
 {
 public:
@@ -787,6 +817,7 @@ public:
     // just use the current session.
     s.cmdline_script = join(script_vec, "\n");
     s.have_script = true;
+    warm_up_for_runs(s);
     int rc = forked_passes_0_4(s);
 #if 0
     if (rc)
@@ -1798,8 +1798,9 @@ location_context::handle_GNU_parameter_ref (Dwarf_Op expr)
   unwind_pc->tok = e->tok;
 
   std::string unwind_code;
-  unwind_code = "/* pragma:unwind */ /* pragma:vma */"
-                "({ unsigned long addr = 0;";
+  unwind_code = this->userspace_p ? "/* pragma:unwind */ /* pragma:vma */"
+                                  : "/* pragma:kunwind */ /* pragma:vma */";
+  unwind_code += "({ unsigned long addr = 0;";
   if (this->userspace_p) {
     unwind_code += "addr = _stp_stack_unwind_one_user(c, 1);"
                    "c->uregs = &c->uwcontext_user.info.regs;";
@@ -40,6 +40,8 @@
 #include "stap-probe.h"
 
 #include <cstdlib>
+#include <cerrno>
+#include <climits>
 #include <thread>
 #include <algorithm>
 
@@ -56,6 +58,10 @@ extern "C" {
 #include <wordexp.h>
 #include <ftw.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 }
 
 using namespace std;
@@ -545,6 +551,7 @@ passes_0_4 (systemtap_session &s)
   // PASS 0: setting up
   s.verbose = s.perpass_verbose[0];
   PROBE1(stap, pass0__start, &s);
+  time_trace_scope pass0_span ("pass 0");
 
   // For PR1477, we used to override $PATH and $LC_ALL and other stuff
   // here.  We seem to use complete pathnames in
@@ -585,6 +592,7 @@ passes_0_4 (systemtap_session &s)
   // translate.cxx:emit_symbol_data()
   s.symbols_source = string(s.tmpdir) + "/stap_symbols.c";
 
+  pass0_span.close ();
   PROBE1(stap, pass0__end, &s);
 
   struct tms tms_before;
@@ -594,6 +602,7 @@ passes_0_4 (systemtap_session &s)
 
   // PASS 1a: PARSING LIBRARY SCRIPTS
   PROBE1(stap, pass1a__start, &s);
+  time_trace_scope pass1a_span ("pass 1a");
 
   // prep this array for tapset $n use too ... although we will reset once again for user scripts
   s.used_args.resize(s.args.size(), false);
@@ -783,9 +792,15 @@ passes_0_4 (systemtap_session &s)
 	    }
 	}
 
-      // Next, gather and parse the library files.
+      // Next, gather and parse the library files.  When possible, only
+      // note them down here, and let the tapset index decide which ones
+      // actually need parsing (see load_library_index).
       set<pair<dev_t, ino_t> > seen_library_files;
       set<string> seen_library_files_names;
+      bool lazy_tapsets = (s.use_cache
+                           && s.dump_mode == systemtap_session::dump_none
+                           && !s.interactive_mode
+                           && !(s.last_pass == 1 && s.verbose));
 
       for (unsigned i=0; i<s.include_path.size(); i++)
         {
@@ -799,11 +814,11 @@ passes_0_4 (systemtap_session &s)
               path_dir = s.include_path[i] + "/PATH";
               (void) nftw(dir.c_str(), collect_stp, 1, flags);
 
-	      unsigned prev_s_library_files = s.library_files.size();
+	      unsigned prev_s_library_files = s.library_files.size() + s.library_stubs.size();
 
               for (auto it = files.begin(); it != files.end(); ++it)
 	        {
-                  unsigned tapset_flags = pf_guru | pf_squash_errors;
+                  unsigned tapset_flags = pf_guru | pf_squash_errors | pf_cache_lexemes;
 
                   // The first path is special, as it's the builtin tapset.
                   // Allow all features no matter what s.compatible says.
@@ -856,6 +871,12 @@ passes_0_4 (systemtap_session &s)
 		      seen_library_files_names.insert (tail_part);
 		    }
 
+		  if (lazy_tapsets)
+		    {
+		      s.library_stubs.push_back (new library_stub (*it, tapset_flags));
+		      continue;
+		    }
+
 		  if (s.verbose>2)
 		    clog << _F("Processing tapset \"%s\"", it->c_str()) << endl;
 
@@ -877,7 +898,7 @@ passes_0_4 (systemtap_session &s)
                     }
 		}
 
-	      unsigned next_s_library_files = s.library_files.size();
+	      unsigned next_s_library_files = s.library_files.size() + s.library_stubs.size();
 	      if (s.verbose>1 && !files.empty())
 		  //TRANSLATORS: Searching through directories, 'processed' means 'examined so far'
 		clog << _F("Searched: \"%s\", found: %zu, processed: %u",
@@ -886,6 +907,9 @@ passes_0_4 (systemtap_session &s)
 	    }
 	}
 
+      if (lazy_tapsets)
+        s.load_library_index ();
+
       if (s.num_errors())
 	rc ++;
 
@@ -896,7 +920,9 @@ passes_0_4 (systemtap_session &s)
   }
 
   // PASS 1b: PARSING USER SCRIPT
+  pass1a_span.close ();
   PROBE1(stap, pass1b__start, &s);
+  time_trace_scope pass1b_span ("pass 1b");
 
   // reset for user scripts -- it's their use of $* we care about
   // except that tapsets like argv.stp can consume $parms
@@ -1035,6 +1061,7 @@ passes_0_4 (systemtap_session &s)
   if (rc && !s.dump_mode)
     cerr << _("Pass 1: parse failed.  [man error::pass1]") << endl;
 
+  pass1b_span.close ();
   PROBE1(stap, pass1__end, &s);
 
   assert_no_interrupts();
@@ -1048,6 +1075,7 @@ passes_0_4 (systemtap_session &s)
   // PASS 2: ELABORATION
   s.verbose = s.perpass_verbose[1];
   PROBE1(stap, pass2__start, &s);
+  time_trace_scope pass2_span ("pass 2");
   rc = semantic_pass (s);
 
   // http handled probes need probe information from pass 2
@@ -1135,6 +1163,7 @@ passes_0_4 (systemtap_session &s)
   if (rc && !s.dump_mode && !s.try_server ())
     cerr << _("Pass 2: analysis failed.  [man error::pass2]") << endl;
 
+  pass2_span.close ();
   PROBE1(stap, pass2__end, &s);
 
   assert_no_interrupts();
@@ -1207,11 +1236,13 @@ passes_0_4 (systemtap_session &s)
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
   PROBE1(stap, pass3__start, &s);
+  time_trace_scope pass3_span ("pass 3");
 
   if (s.runtime_mode == systemtap_session::bpf_runtime)
     {
       times (& tms_after);
       gettimeofday (&tv_after, NULL);
+      pass3_span.close ();
       PROBE1(stap, pass3__end, &s);
 
       if (s.verbose)
@@ -1247,6 +1278,7 @@ passes_0_4 (systemtap_session &s)
       if (rc && ! s.try_server ())
 	cerr << _("Pass 3: translation failed.  [man error::pass3]") << endl;
 
+      pass3_span.close ();
       PROBE1(stap, pass3__end, &s);
 
       assert_no_interrupts();
@@ -1259,6 +1291,7 @@ passes_0_4 (systemtap_session &s)
   times (& tms_before);
   gettimeofday (&tv_before, NULL);
   PROBE1(stap, pass4__start, &s);
+  time_trace_scope pass4_span ("pass 4");
 
   if (s.runtime_mode == systemtap_session::bpf_runtime)
     rc = translate_bpf_pass (s);
@@ -1269,7 +1302,12 @@ passes_0_4 (systemtap_session &s)
 	  find_stapconf_hash(s);
 	  get_stapconf_from_cache(s);
 	}
-      rc = compile_pass (s);
+      // On a local cache miss, another host may already have built
+      // the module from the same C source.
+      if (get_module_from_remote_cache (s))
+	rc = s.need_uprobes ? uprobes_pass (s) : 0;
+      else
+	rc = compile_pass (s);
     }
 
   if (! rc && s.last_pass <= 4)
@@ -1341,6 +1379,7 @@ passes_0_4 (systemtap_session &s)
     }
 #endif
   
+  pass4_span.close ();
   PROBE1(stap, pass4__end, &s);
 
   return rc;
@@ -1359,6 +1398,7 @@ pass_5 (systemtap_session &s, vector<remote*> targets)
   // a "hello, I'm starting" message, but then the others aren't interactive
   // and don't take an indefinite amount of time.
   PROBE1(stap, pass5__start, &s);
+  time_trace_scope pass5_span ("pass 5");
   if (s.verbose) clog << _("Pass 5: starting run.") << endl;
   int rc = remote::run(targets);
   struct tms tms_after;
@@ -1376,6 +1416,7 @@ pass_5 (systemtap_session &s, vector<remote*> targets)
     // Interrupting pass-5 to quit is normal, so we want an EXIT_SUCCESS below.
     pending_interrupts = 0;
 
+  pass5_span.close ();
   PROBE1(stap, pass5__end, &s);
 
   return rc;
@@ -1386,6 +1427,7 @@ cleanup (systemtap_session &s, int rc)
 {
   // PASS 6: cleaning up
   PROBE1(stap, pass6__start, &s);
+  time_trace_scope pass6_span ("pass 6");
 
   for (systemtap_session::session_map_t::iterator it = s.subsessions.begin();
        it != s.subsessions.end(); ++it)
@@ -1395,6 +1437,12 @@ cleanup (systemtap_session &s, int rc)
   if (!rc && s.tapset_compile_coverage && !pending_interrupts) {
 #ifdef HAVE_LIBSQLITE3
     update_coverage_db(s);
+    // The module's own hit counts went to the -o file, in its coverage
+    // report.  Bulk mode output and -o URIs are left to --pgo=REPORT.
+    if (s.last_pass >= 5 && !s.bulk_mode && !s.output_file.empty()
+        && s.output_file.find("://") == string::npos
+        && file_exists(s.output_file))
+      import_pgo_report(s, s.output_file);
 #else
     cerr << _("Coverage database not available without libsqlite3") << endl;
 #endif
@@ -1402,7 +1450,11 @@ cleanup (systemtap_session &s, int rc)
 
   s.report_suppression();
 
+  pass6_span.close ();
   PROBE1(stap, pass6__end, &s);
+
+  if (!s.time_trace_file.empty())
+    time_trace_write (s.time_trace_file);
 }
 
 static int
@@ -1426,6 +1478,360 @@ passes_0_4_again_with_server (systemtap_session &s)
   return rc;
 }
 
+// --compile-daemon state, kept to tell whether a request targets the
+// kernel that the daemon warmed up.
+static string daemon_release, daemon_arch, daemon_build_tree, daemon_sysroot;
+static int daemon_child_pipe[2] = { -1, -1 };
+
+extern "C"
+void handle_daemon_child (int)
+{
+  int saved_errno = errno;
+  char c = 0;
+  if (write (daemon_child_pipe[1], &c, 1) < 0)
+    ; // already pending
+  errno = saved_errno;
+}
+
+
+static bool
+read_fully (int fd, void *buf, size_t len)
+{
+  for (size_t done = 0; done < len; )
+    {
+      ssize_t n = read (fd, (char *) buf + done, len - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+  return true;
+}
+
+
+static bool
+send_fully (int fd, const void *buf, size_t len)
+{
+  for (size_t done = 0; done < len; )
+    {
+      ssize_t n = send (fd, (const char *) buf + done, len - done, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false;
+      done += n;
+    }
+  return true;
+}
+
+
+// Read a compile daemon request: a 32-bit length, then the client's
+// working directory and arguments as NUL-terminated strings, with its
+// stdin, stdout and stderr attached to the first byte.
+static bool
+receive_daemon_request (int conn, string& cwd, vector<string>& args)
+{
+  uint32_t len;
+  int fds[3];
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg;
+  memset (&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  ssize_t n;
+  do
+    n = recvmsg (conn, &msg, MSG_WAITALL);
+  while (n < 0 && errno == EINTR);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  if (n != sizeof(len) || !cmsg || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+    return false;
+  memcpy (fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  vector<char> payload (len);
+  if (len == 0 || len > (1U << 20) || !read_fully (conn, payload.data(), len)
+      || payload.back() != '\0')
+    {
+      for (unsigned i = 0; i < 3; ++i)
+        close (fds[i]);
+      return false;
+    }
+
+  for (unsigned i = 0; i < 3; ++i)
+    {
+      dup2 (fds[i], i);
+      close (fds[i]);
+    }
+
+  const char *p = payload.data(), *end = p + len;
+  cwd = p;
+  for (p += cwd.size() + 1; p < end; p += strlen(p) + 1)
+    args.push_back (p);
+  return true;
+}
+
+
+// Serve --use-compile-daemon clients on the unix socket s.compile_daemon.
+// The kernel debuginfo is opened and indexed once up front.  Each
+// request then runs in a forked child, which inherits that warm state
+// copy-on-write, takes over the client's stdio and working directory,
+// and returns true with the client's arguments in ARGS so main() can
+// parse them on top of the daemon's own and run the passes as usual.
+// The daemon itself only returns (false, with RC) when shutting down.
+static bool
+compile_daemon (systemtap_session& s, vector<string>& args, int& rc)
+{
+  rc = EXIT_FAILURE;
+  try
+    {
+      warm_kernel_debuginfo (s);
+    }
+  catch (const semantic_error& e)
+    {
+      s.print_error (e);
+      return false;
+    }
+  daemon_release = s.kernel_release;
+  daemon_arch = s.architecture;
+  daemon_build_tree = s.kernel_build_tree;
+  daemon_sysroot = s.sysroot;
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (s.compile_daemon.size() >= sizeof(addr.sun_path))
+    {
+      cerr << _F("ERROR: socket path too long: %s", s.compile_daemon.c_str()) << endl;
+      return false;
+    }
+  strcpy (addr.sun_path, s.compile_daemon.c_str());
+
+  int listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t old_umask = umask (0077);
+  (void) unlink (addr.sun_path);
+  int bound = listener < 0 ? -1
+    : bind (listener, (struct sockaddr *) &addr, sizeof(addr));
+  umask (old_umask);
+  if (bound != 0 || listen (listener, 16) != 0
+      || pipe2 (daemon_child_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    {
+      cerr << _F("ERROR: cannot listen on %s: %s", s.compile_daemon.c_str(),
+                 strerror(errno)) << endl;
+      if (listener >= 0)
+        close (listener);
+      return false;
+    }
+
+  struct sigaction sa;
+  memset (&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_daemon_child;
+  sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigaction (SIGCHLD, &sa, NULL);
+
+  if (s.verbose)
+    clog << _F("Compile daemon for %s listening on %s",
+               s.kernel_release.c_str(), s.compile_daemon.c_str()) << endl;
+
+  map<pid_t, int> requests; // child -> client connection
+  while (!pending_interrupts)
+    {
+      struct pollfd pfds[2] = { { listener, POLLIN, 0 },
+                                { daemon_child_pipe[0], POLLIN, 0 } };
+      if (poll (pfds, 2, -1) < 0)
+        continue; // EINTR; recheck pending_interrupts
+
+      if (pfds[1].revents & POLLIN)
+        {
+          char c;
+          while (read (daemon_child_pipe[0], &c, 1) > 0)
+            ;
+          int status;
+          pid_t pid;
+          while ((pid = waitpid (-1, &status, WNOHANG)) > 0)
+            {
+              auto it = requests.find (pid);
+              if (it == requests.end())
+                continue;
+              int32_t code = WIFEXITED(status) ? WEXITSTATUS(status)
+                : 128 + WTERMSIG(status);
+              (void) send_fully (it->second, &code, sizeof(code));
+              close (it->second);
+              requests.erase (it);
+            }
+        }
+
+      if (!(pfds[0].revents & POLLIN))
+        continue;
+
+      int conn = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+      if (conn < 0)
+        continue;
+
+      // Only serve our own user; the socket mode should already ensure it.
+      struct ucred cred;
+      socklen_t cred_len = sizeof(cred);
+      if (getsockopt (conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0
+          || cred.uid != geteuid())
+        {
+          close (conn);
+          continue;
+        }
+
+      pid_t pid = fork ();
+      if (pid < 0)
+        {
+          close (conn);
+          continue;
+        }
+      if (pid > 0)
+        {
+          requests[pid] = conn;
+          continue;
+        }
+
+      // The child: become the client's stap.
+      close (listener);
+      close (daemon_child_pipe[0]);
+      close (daemon_child_pipe[1]);
+      signal (SIGCHLD, SIG_DFL);
+
+      string cwd;
+      int32_t self = getpid();
+      if (!receive_daemon_request (conn, cwd, args)
+          || chdir (cwd.c_str()) != 0
+          || !send_fully (conn, &self, sizeof(self)))
+        _exit (EXIT_FAILURE);
+      close (conn);
+      rc = 0;
+      return true;
+    }
+
+  for (auto it = requests.begin(); it != requests.end(); ++it)
+    {
+      kill (it->first, SIGTERM);
+      close (it->second);
+    }
+  close (listener);
+  (void) unlink (addr.sun_path);
+  rc = EXIT_SUCCESS;
+  return false;
+}
+
+
+// In a compile daemon child, after the client's arguments have been
+// parsed: drop the warm kernel state if they target another kernel.
+static void
+compile_daemon_check_target (systemtap_session& s)
+{
+  if (s.kernel_release == daemon_release && s.architecture == daemon_arch
+      && s.kernel_build_tree == daemon_build_tree && s.sysroot == daemon_sysroot)
+    return;
+
+  delete s.warm_kernel_dw;
+  s.warm_kernel_dw = 0;
+  delete s.module_cache;
+  s.module_cache = 0;
+}
+
+
+// Run this stap command in the --compile-daemon at s.use_compile_daemon,
+// forwarding our arguments (less --use-compile-daemon), working directory
+// and stdio, and relaying interrupts.  Returns the command's exit code,
+// or -1 if the daemon can't be reached and we should run it here instead.
+static int
+compile_daemon_client (systemtap_session& s, int argc, char * const argv [])
+{
+  char cwd[PATH_MAX];
+  if (!getcwd (cwd, sizeof(cwd)))
+    return -1;
+
+  string payload = string(cwd) + '\0';
+  for (int i = 1; i < argc; ++i)
+    {
+      if (!strcmp (argv[i], "--use-compile-daemon"))
+        {
+          ++i;
+          continue;
+        }
+      if (startswith (argv[i], "--use-compile-daemon="))
+        continue;
+      payload += argv[i];
+      payload += '\0';
+    }
+
+  struct sockaddr_un addr;
+  memset (&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, s.use_compile_daemon.c_str(), sizeof(addr.sun_path) - 1);
+
+  int conn = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn < 0 || connect (conn, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+    {
+      s.print_warning (_F("cannot reach compile daemon at %s: %s, running locally",
+                          s.use_compile_daemon.c_str(), strerror(errno)));
+      if (conn >= 0)
+        close (conn);
+      return -1;
+    }
+
+  uint32_t len = payload.size();
+  int fds[3] = { 0, 1, 2 };
+  char cbuf[CMSG_SPACE(sizeof(fds))];
+  memset (cbuf, 0, sizeof(cbuf));
+  struct iovec iov = { &len, sizeof(len) };
+  struct msghdr msg;
+  memset (&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy (CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int32_t pid = 0, code = EXIT_FAILURE;
+  if (sendmsg (conn, &msg, MSG_NOSIGNAL) != sizeof(len)
+      || !send_fully (conn, payload.data(), payload.size())
+      || !read_fully (conn, &pid, sizeof(pid)))
+    {
+      cerr << _F("ERROR: compile daemon at %s did not accept the request",
+                 s.use_compile_daemon.c_str()) << endl;
+      close (conn);
+      return EXIT_FAILURE;
+    }
+
+  // Wait for the exit code, passing our interrupts on to the child.
+  // NB: poll, unlike read, isn't restarted after our SA_RESTART handlers.
+  int relayed = 0;
+  for (;;)
+    {
+      struct pollfd pfd = { conn, POLLIN, 0 };
+      if (poll (&pfd, 1, -1) < 0)
+        {
+          while (relayed < pending_interrupts)
+            {
+              kill (pid, SIGINT);
+              relayed++;
+            }
+          continue;
+        }
+      if (!read_fully (conn, &code, sizeof(code)))
+        code = EXIT_FAILURE; // daemon went away
+      break;
+    }
+  close (conn);
+  return code;
+}
+
+
 int
 main (int argc, char * const argv [])
 {
@@ -1479,6 +1885,37 @@ main (int argc, char * const argv [])
     if (rc != 0)
       return rc;
 
+    if (!s.use_compile_daemon.empty()
+        && (rc = compile_daemon_client (s, argc, argv)) >= 0)
+      return rc;
+
+    // A compile daemon returns here only in the child serving a request;
+    // its arguments are parsed on top of the daemon's own, like those of
+    // the rc file.
+    vector<string> daemon_args;
+    if (!s.compile_daemon.empty())
+      {
+        if (!compile_daemon (s, daemon_args, rc))
+          return rc;
+
+        free (extended_argv);
+        extended_argc = daemon_args.size() + 1;
+        extended_argv = (char**) calloc (extended_argc + 1, sizeof(char*));
+        extended_argv[0] = argv[0];
+        for (unsigned i = 0; i < daemon_args.size(); ++i)
+          extended_argv[i + 1] = (char*) daemon_args[i].c_str();
+
+        s.compile_daemon.clear();
+        optind = 0;
+        rc = s.parse_cmdline (extended_argc, extended_argv);
+        if (rc != 0)
+          return rc;
+        compile_daemon_check_target (s);
+      }
+
+    if (!s.time_trace_file.empty())
+      time_trace_start ();
+
     // Create the temp dir.
     s.create_tmp_dir();
 
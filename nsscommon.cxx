@@ -22,12 +22,19 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
 #include <cerrno>
 #include <cstdio>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 extern "C" {
 #include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <arpa/inet.h>
 #include <termios.h>
 #include <unistd.h>
 #include <glob.h>
@@ -48,6 +55,7 @@ extern "C" {
 #include <openssl/x509.h>
 #include <openssl/pem.h>
 #include <openssl/x509v3.h>
+#include <openssl/evp.h>
 #endif
 }
 
@@ -1528,6 +1536,37 @@ have_san_match (string & hostname, string & pem_cert)
 
   return have_match;
 }
+
+/*
+ * The SHA-256 of the contents of the file at PATH, in hex, or "" if it can't
+ * be read.  The http client and server name uploaded files by it.
+ */
+string
+file_sha256 (const string &path)
+{
+  ifstream f (path.c_str (), ios::binary);
+  if (! f)
+    return "";
+
+  EVP_MD_CTX *ctx = EVP_MD_CTX_create ();
+  EVP_DigestInit_ex (ctx, EVP_sha256 (), NULL);
+  char buf[64 * 1024];
+  while (f.read (buf, sizeof (buf)) || f.gcount () > 0)
+    EVP_DigestUpdate (ctx, buf, f.gcount ());
+  bool ok = f.eof ();
+
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned md_len = 0;
+  EVP_DigestFinal_ex (ctx, md, & md_len);
+  EVP_MD_CTX_destroy (ctx);
+  if (! ok)
+    return "";
+
+  ostringstream hex;
+  for (unsigned i = 0; i < md_len; i++)
+    hex << std::hex << setfill ('0') << setw (2) << (unsigned) md[i];
+  return hex.str ();
+}
 #endif
 
 
@@ -1695,6 +1734,331 @@ PRInt32 PR_Read_Complete (PRFileDesc *fd, void *buf, PRInt32 requestedBytes)
   return totalBytes;
 }
 
+// Directory trees sent as a stream, in place of a zip file written out
+// and read back on either side.  The stream is a series of records, each
+// a type byte followed by its fields, with integers in network byte order:
+//
+//   'D' u32 namelen, name, u32 mode              a directory
+//   'F' u32 namelen, name, u32 mode, u64 size,   a file and its contents
+//       data
+//   'E'                                          the end of the tree
+//
+// Names are relative to the top of the tree, and a directory comes
+// before anything in it.  Symbolic links are followed, like zip does.
+
+#define TREE_STREAM_BUFSIZE (64 * 1024)
+
+namespace {
+
+struct tree_stream_writer
+{
+  PRFileDesc *fd;
+  PRInt32 len;
+  char buf[TREE_STREAM_BUFSIZE];
+
+  tree_stream_writer (PRFileDesc *fd): fd(fd), len(0) {}
+
+  SECStatus flush ()
+    {
+      if (len > 0 && PR_Write (fd, buf, len) != len)
+	return SECFailure;
+      len = 0;
+      return SECSuccess;
+    }
+
+  SECStatus put (const void *data, size_t n)
+    {
+      const char *p = (const char *) data;
+      while (n > 0)
+	{
+	  if (len == TREE_STREAM_BUFSIZE && flush () != SECSuccess)
+	    return SECFailure;
+	  size_t chunk = min (n, (size_t) (TREE_STREAM_BUFSIZE - len));
+	  memcpy (buf + len, p, chunk);
+	  len += chunk;
+	  p += chunk;
+	  n -= chunk;
+	}
+      return SECSuccess;
+    }
+
+  SECStatus put_u32 (PRUint32 v)
+    {
+      v = htonl (v);
+      return put (& v, sizeof (v));
+    }
+
+  SECStatus put_u64 (PRUint64 v)
+    {
+      if (put_u32 ((PRUint32) (v >> 32)) != SECSuccess)
+	return SECFailure;
+      return put_u32 ((PRUint32) v);
+    }
+
+  SECStatus put_header (char type, const string &name, mode_t mode)
+    {
+      if (put (& type, 1) != SECSuccess
+	  || put_u32 (name.size ()) != SECSuccess
+	  || put (name.data (), name.size ()) != SECSuccess)
+	return SECFailure;
+      return put_u32 (mode & 07777);
+    }
+
+  SECStatus put_file (const string &path, const string &name, const struct stat &st);
+  SECStatus put_dir (const string &path, const string &prefix);
+};
+
+SECStatus
+tree_stream_writer::put_file (const string &path, const string &name,
+			      const struct stat &st)
+{
+  int file = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+  if (file < 0)
+    {
+      nsscommon_error (_F("Could not open input file %s", path.c_str ()));
+      return SECFailure;
+    }
+
+  SECStatus secStatus = SECFailure;
+  PRUint64 left = st.st_size;
+  if (put_header ('F', name, st.st_mode) != SECSuccess
+      || put_u64 (left) != SECSuccess)
+    goto done;
+
+  // Read the contents straight into the buffer.
+  while (left > 0)
+    {
+      if (len == TREE_STREAM_BUFSIZE && flush () != SECSuccess)
+	goto done;
+      size_t want = min (left, (PRUint64) (TREE_STREAM_BUFSIZE - len));
+      ssize_t got = read (file, buf + len, want);
+      if (got < 0 && errno == EINTR)
+	continue;
+      if (got <= 0)
+	{
+	  // The file changed size under us; the receiver expects what we
+	  // promised, so there's nothing to do but fail.
+	  nsscommon_error (_F("Error reading %s", path.c_str ()));
+	  goto done;
+	}
+      len += got;
+      left -= got;
+    }
+  secStatus = SECSuccess;
+
+ done:
+  close (file);
+  return secStatus;
+}
+
+SECStatus
+tree_stream_writer::put_dir (const string &path, const string &prefix)
+{
+  DIR *d = opendir (path.c_str ());
+  if (d == NULL)
+    {
+      nsscommon_error (_F("Could not open directory %s", path.c_str ()));
+      return SECFailure;
+    }
+  vector<string> names;
+  while (struct dirent *e = readdir (d))
+    if (strcmp (e->d_name, ".") != 0 && strcmp (e->d_name, "..") != 0)
+      names.push_back (e->d_name);
+  closedir (d);
+  sort (names.begin (), names.end ());
+
+  for (size_t i = 0; i < names.size (); i++)
+    {
+      string subpath = path + "/" + names[i];
+      string name = prefix + names[i];
+      struct stat st;
+      if (stat (subpath.c_str (), & st) != 0)
+	continue; // a dangling symlink; zip would skip it too
+      if (S_ISDIR (st.st_mode))
+	{
+	  if (put_header ('D', name, st.st_mode) != SECSuccess
+	      || put_dir (subpath, name + "/") != SECSuccess)
+	    return SECFailure;
+	}
+      else if (S_ISREG (st.st_mode))
+	{
+	  if (put_file (subpath, name, st) != SECSuccess)
+	    return SECFailure;
+	}
+    }
+  return SECSuccess;
+}
+
+struct tree_stream_reader
+{
+  PRFileDesc *fd;
+  PRInt64 total;
+
+  tree_stream_reader (PRFileDesc *fd): fd(fd), total(0) {}
+
+  SECStatus get (void *data, PRInt32 n)
+    {
+      if (PR_Read_Complete (fd, data, n) != n)
+	return SECFailure;
+      total += n;
+      return SECSuccess;
+    }
+
+  SECStatus get_u32 (PRUint32 &v)
+    {
+      if (get (& v, sizeof (v)) != SECSuccess)
+	return SECFailure;
+      v = ntohl (v);
+      return SECSuccess;
+    }
+
+  SECStatus get_u64 (PRUint64 &v)
+    {
+      PRUint32 hi, lo;
+      if (get_u32 (hi) != SECSuccess || get_u32 (lo) != SECSuccess)
+	return SECFailure;
+      v = ((PRUint64) hi << 32) | lo;
+      return SECSuccess;
+    }
+};
+
+} // anonymous namespace
+
+// A name from the stream must stay within the tree it's unpacked into.
+static bool
+tree_stream_name_ok (const string &name)
+{
+  if (name.empty () || name[0] == '/')
+    return false;
+  vector<string> components;
+  tokenize (name, components, "/");
+  for (size_t i = 0; i < components.size (); i++)
+    if (components[i].empty () || components[i] == "." || components[i] == "..")
+      return false;
+  return name[name.size () - 1] != '/';
+}
+
+SECStatus
+nss_send_tree (PRFileDesc *fd, const string &dir)
+{
+  tree_stream_writer w (fd);
+  if (w.put_dir (dir, "") != SECSuccess || w.put ("E", 1) != SECSuccess
+      || w.flush () != SECSuccess)
+    {
+      nsscommon_error (_F("Error sending %s", dir.c_str ()));
+      nssError ();
+      return SECFailure;
+    }
+  return SECSuccess;
+}
+
+PRInt64
+nss_receive_tree (PRFileDesc *fd, const string &dir, size_t max_size)
+{
+  tree_stream_reader r (fd);
+  PRUint64 data_size = 0;
+  char buf[TREE_STREAM_BUFSIZE];
+
+  if (create_dir (dir.c_str (), 0700) != 0)
+    {
+      nsscommon_error (_F("Could not create directory %s: %s", dir.c_str (),
+			  strerror (errno)));
+      return -1;
+    }
+
+  for (;;)
+    {
+      char type;
+      PRUint32 namelen, mode;
+      if (r.get (& type, 1) != SECSuccess)
+	goto read_error;
+      if (type == 'E')
+	return r.total;
+      if (type != 'D' && type != 'F')
+	{
+	  nsscommon_error (_F("Unknown record type %d in the stream for %s",
+			      type, dir.c_str ()));
+	  return -1;
+	}
+
+      if (r.get_u32 (namelen) != SECSuccess)
+	goto read_error;
+      if (namelen == 0 || namelen >= PATH_MAX)
+	{
+	  nsscommon_error (_F("Invalid name length %u in the stream for %s",
+			      namelen, dir.c_str ()));
+	  return -1;
+	}
+      string name (namelen, '\0');
+      if (r.get (& name[0], namelen) != SECSuccess || r.get_u32 (mode) != SECSuccess)
+	goto read_error;
+      if (! tree_stream_name_ok (name))
+	{
+	  nsscommon_error (_F("Invalid name '%s' in the stream for %s",
+			      name.c_str (), dir.c_str ()));
+	  return -1;
+	}
+      string path = dir + "/" + name;
+
+      if (type == 'D')
+	{
+	  if (mkdir (path.c_str (), 0700) != 0 && errno != EEXIST)
+	    {
+	      nsscommon_error (_F("Could not create directory %s: %s",
+				  path.c_str (), strerror (errno)));
+	      return -1;
+	    }
+	  continue;
+	}
+
+      PRUint64 size;
+      if (r.get_u64 (size) != SECSuccess)
+	goto read_error;
+      data_size += size;
+      if (max_size && data_size > max_size)
+	{
+	  nsscommon_error (_F("Size of the tree sent for %s is over the limit of %zu bytes",
+			      dir.c_str (), max_size));
+	  return -1;
+	}
+
+      // O_TRUNC rather than O_EXCL, so that a retried transfer can land
+      // over a broken one.
+      int file = open (path.c_str (),
+		       O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		       (mode & 0777) | S_IRUSR | S_IWUSR);
+      if (file < 0)
+	{
+	  nsscommon_error (_F("Could not open output file %s: %s",
+			      path.c_str (), strerror (errno)));
+	  return -1;
+	}
+      while (size > 0)
+	{
+	  PRInt32 n = (PRInt32) min (size, (PRUint64) sizeof (buf));
+	  if (r.get (buf, n) != SECSuccess)
+	    {
+	      close (file);
+	      goto read_error;
+	    }
+	  if (write (file, buf, n) != n)
+	    {
+	      nsscommon_error (_F("Could not write to %s: %s",
+				  path.c_str (), strerror (errno)));
+	      close (file);
+	      return -1;
+	    }
+	  size -= n;
+	}
+      close (file);
+    }
+
+ read_error:
+  nsscommon_error (_F("Error reading the stream for %s", dir.c_str ()));
+  nssError ();
+  return -1;
+}
+
 SECStatus
 read_cert_info_from_file (const string &certPath, string &fingerprint)
 {
@@ -72,6 +72,7 @@ bool get_host_name (CERTCertificate *c, std::string &host_name);
 bool cvt_nss_to_pem (CERTCertificate *c, std::string &cert_pem);
 bool get_pem_cert (const std::string &db_path, const std::string &nss_cert_name, const std::string &host, std::string &cert);
 bool have_san_match (std::string & hostname, std::string & server_cert);
+std::string file_sha256 (const std::string &path);
 #endif
 
 int check_cert (const std::string &db_path, const std::string &nss_cert_name, bool use_db_password = false);
@@ -91,6 +92,9 @@ SECStatus
 read_cert_info_from_file (const std::string &certPath,
 			  std::string &fingerprint);
 
+SECStatus nss_send_tree (PRFileDesc *fd, const std::string &dir);
+PRInt64 nss_receive_tree (PRFileDesc *fd, const std::string &dir, size_t max_size);
+
 #endif // defined(c_plusplus) || defined(__cplusplus)
 
 #endif // NSS_COMMON_H
@@ -15,6 +15,8 @@
 #include "session.h"
 #include "util.h"
 #include "stringtable.h"
+#include "cache.h"
+#include "hash.h"
 
 #include <iostream>
 
@@ -54,10 +56,19 @@ public:
 
   unordered_set<interned_string> keywords;
   static unordered_set<string> atwords;
+
+  // Tapset lexeme cache: the token stream of an unmodified tapset file
+  // is the same on every run, so it can be replayed from the cache
+  // instead of being rescanned character by character.
+  void open_cache ();
+  void close_cache ();
+
 private:
   inline int input_get ();
   inline int input_peek (unsigned n=0);
   void input_put (const string&, const token*);
+  void input_take (unsigned char cls, string& str);
+  void input_advance (const char *to);
   string input_name;
   string input_contents; // NB: being a temporary, no need to interned_string optimize this object
   const char *input_pointer; // index into input_contents; NB: recompute if input_contents changed!
@@ -70,6 +81,28 @@ private:
   systemtap_session& session;
   stapfile* current_file;
   const token* current_token_chain;
+
+  struct lexeme
+  {
+    unsigned line;
+    unsigned column;
+    token_type type;
+    token_junk_type junk_type;
+    bool ate_comment;
+    bool ate_whitespace;
+    string content;
+  };
+  string cache_path;
+  bool cache_replay; // tokens come from cached_lexemes, not input_contents
+  bool cache_record; // scanned tokens are appended to cached_lexemes
+  bool cache_ok; // nothing session-dependent leaked into the tokens
+  bool cache_eof; // the whole input has been scanned
+  vector<lexeme> cached_lexemes;
+  size_t cache_pos;
+  bool load_cache ();
+  void save_cache ();
+  token* scan_cached ();
+  token* scan_input ();
 };
 
 
@@ -241,6 +274,7 @@ private: // nonterminals
 stapfile*
 parse (systemtap_session& s, const string& n, istream& i, unsigned flags)
 {
+  time_trace_scope ts ("parse", [&]{ return n; });
   parser p (s, n, i, flags);
   return p.parse ();
 }
@@ -275,7 +309,8 @@ parse_library_macros (systemtap_session& s, const string& name)
       return 0;
     }
 
-  parser p (s, name, i);
+  time_trace_scope ts ("parse macros", [&]{ return name; });
+  parser p (s, name, i, pf_cache_lexemes);
   return p.parse_library_macros ();
 }
 
@@ -294,6 +329,8 @@ parser::parser (systemtap_session& s, const string &n, istream& i, unsigned flag
   user_file (flags & pf_user_file), auto_path (flags & pf_auto_path),
   context(con_unknown), systemtap_v_seen(0), last_t (0), next_t (0), num_errors (0)
 {
+  if (flags & pf_cache_lexemes)
+    input.open_cache ();
 }
 
 parser::~parser()
@@ -788,6 +825,7 @@ parser::parse_library_macros ()
       session.library_macros[name]->context = ctx_library;
     }
 
+  input.close_cache ();
   return f;
 }
 
@@ -1410,7 +1448,9 @@ lexer::lexer (istream& input, const string& in, systemtap_session& s, bool cc):
   ate_comment(false), ate_whitespace(false), saw_tokens(false), check_compatible(cc),
   input_name (in), input_pointer (0), input_end (0), cursor_suspend_count(0),
   cursor_suspend_line (1), cursor_suspend_column (1), cursor_line (1),
-  cursor_column (1), session(s), current_file (0), current_token_chain (0)
+  cursor_column (1), session(s), current_file (0), current_token_chain (0),
+  cache_replay (false), cache_record (false), cache_ok (true),
+  cache_eof (false), cache_pos (0)
 {
   getline(input, input_contents, '\0');
 
@@ -1468,6 +1508,10 @@ lexer::lexer (istream& input, const string& in, systemtap_session& s, bool cc):
       atwords.insert("max");
       atwords.insert("hist_linear");
       atwords.insert("hist_log");
+      atwords.insert("hist_hdr");
+      atwords.insert("quantile");
+      atwords.insert("distinct");
+      atwords.insert("topk");
       if (has_version("3.1"))
         {
           atwords.insert("const");
@@ -1554,6 +1598,86 @@ lexer::input_get ()
 }
 
 
+// Character classes for the lexer.  Unlike isalpha() and friends, these
+// don't depend on the locale, and they're a plain table lookup.
+enum
+  {
+    lc_space = 1, lc_digit = 2, lc_alpha = 4, lc_punct = 8,
+    lc_alnum = lc_digit | lc_alpha,
+    lc_ident = 16 // the rest of an identifier: alnum, '_' or '$'
+  };
+
+static const struct lexer_char_classes
+{
+  unsigned char cls[256];
+
+  lexer_char_classes ()
+  {
+    for (unsigned c = 0; c < 256; c++)
+      {
+        cls[c] = 0;
+        if (c == ' ' || (c >= '\t' && c <= '\r'))
+          cls[c] |= lc_space;
+        else if (c >= '0' && c <= '9')
+          cls[c] |= lc_digit | lc_ident;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
+          cls[c] |= lc_alpha | lc_ident;
+        else if (c > ' ' && c < 0x7f)
+          cls[c] |= lc_punct;
+      }
+    cls[(unsigned char) '_'] |= lc_ident;
+    cls[(unsigned char) '$'] |= lc_ident;
+  }
+} lexer_classes;
+
+static inline bool
+lex_is (int c, unsigned char cls)
+{
+  return c >= 0 && (lexer_classes.cls[c] & cls);
+}
+
+
+// Consume a run of characters of class CLS (which must not include
+// newlines) and append them to STR.  Outside of input_put() text, this
+// is a tight loop over the buffer rather than a call per character.
+void
+lexer::input_take (unsigned char cls, string& str)
+{
+  if (cursor_suspend_count)
+    {
+      while (lex_is (input_peek (), cls))
+        str.push_back (input_get ());
+      return;
+    }
+
+  const char *p = input_pointer;
+  while (p < input_end && lex_is ((unsigned char) *p, cls))
+    p++;
+  str.append (input_pointer, p);
+  cursor_column += p - input_pointer;
+  input_pointer = p;
+}
+
+
+// Skip ahead to TO, keeping the cursor up to date.  Only for use
+// outside of input_put() text.
+void
+lexer::input_advance (const char *to)
+{
+  assert (cursor_suspend_count == 0 && to >= input_pointer && to <= input_end);
+
+  const char *p = input_pointer, *nl;
+  while ((nl = (const char *) memchr (p, '\n', to - p)) != NULL)
+    {
+      cursor_line++;
+      cursor_column = 1;
+      p = nl + 1;
+    }
+  cursor_column += to - p;
+  input_pointer = to;
+}
+
+
 void
 lexer::input_put (const string& chars, const token* t)
 {
@@ -1570,8 +1694,158 @@ lexer::input_put (const string& chars, const token* t)
 }
 
 
+void
+lexer::open_cache ()
+{
+  string compatible = check_compatible ? session.compatible : "";
+  string hash = find_tapset_lexer_hash (session, input_contents, compatible);
+  cache_path = get_build_id_cache_path (session, "tapsets", hash, ".lex");
+  if (cache_path.empty())
+    return;
+
+  if (!session.poison_cache && load_cache ())
+    {
+      cache_replay = true;
+      touch_cache_index_entry (session, cache_path);
+      if (session.verbose > 2)
+        clog << _F("Replaying %zu cached tokens for \"%s\" from %s",
+                   cached_lexemes.size(), input_name.c_str(),
+                   cache_path.c_str()) << endl;
+    }
+  else
+    cache_record = true;
+}
+
+
+void
+lexer::close_cache ()
+{
+  if (cache_record && cache_ok && cache_eof)
+    save_cache ();
+  cache_record = false;
+  cached_lexemes.clear ();
+}
+
+
+#define LEXEME_CACHE_MAGIC "STAPLEX1"
+
+// The cache file is a magic string followed by one record per token:
+// line, column, type, junk type, whitespace/comment flags, content
+// length (all as native uint32_t) and the raw content bytes.
+bool
+lexer::load_cache ()
+{
+  ifstream f (cache_path.c_str(), ios::in | ios::binary);
+  if (!f)
+    return false;
+
+  string data;
+  getline (f, data, '\0');
+  if (f.bad() || data.compare (0, 8, LEXEME_CACHE_MAGIC) != 0)
+    return false;
+
+  const char *p = data.data() + 8;
+  const char *end = data.data() + data.size();
+  while (p < end)
+    {
+      uint32_t rec[6];
+      if ((size_t)(end - p) < sizeof(rec))
+        goto bad;
+      memcpy (rec, p, sizeof(rec));
+      p += sizeof(rec);
+      if (rec[2] > tok_keyword || rec[3] > tok_junk_unclosed_embedded
+          || (size_t)(end - p) < rec[5])
+        goto bad;
+
+      lexeme l;
+      l.line = rec[0];
+      l.column = rec[1];
+      l.type = (token_type) rec[2];
+      l.junk_type = (token_junk_type) rec[3];
+      l.ate_comment = rec[4] & 1;
+      l.ate_whitespace = rec[4] & 2;
+      l.content.assign (p, rec[5]);
+      p += rec[5];
+      cached_lexemes.push_back (l);
+    }
+  return true;
+
+bad:
+  if (session.verbose > 1)
+    clog << _F("Ignoring corrupt lexer cache file %s", cache_path.c_str()) << endl;
+  cached_lexemes.clear ();
+  return false;
+}
+
+
+void
+lexer::save_cache ()
+{
+  string data = LEXEME_CACHE_MAGIC;
+  for (size_t i = 0; i < cached_lexemes.size(); ++i)
+    {
+      const lexeme& l = cached_lexemes[i];
+      uint32_t rec[6] = { l.line, l.column, (uint32_t) l.type,
+                          (uint32_t) l.junk_type,
+                          (uint32_t) (l.ate_comment | (l.ate_whitespace << 1)),
+                          (uint32_t) l.content.size() };
+      data.append ((const char *) rec, sizeof(rec));
+      data.append (l.content);
+    }
+  add_data_to_cache (session, cache_path, data);
+}
+
+
 token*
 lexer::scan ()
+{
+  if (cache_replay)
+    return scan_cached ();
+
+  token* n = scan_input ();
+  if (cache_record && n)
+    {
+      lexeme l;
+      l.line = n->location.line;
+      l.column = n->location.column;
+      l.type = n->type;
+      l.junk_type = n->junk_type;
+      l.ate_comment = ate_comment;
+      l.ate_whitespace = ate_whitespace;
+      l.content = n->content;
+      cached_lexemes.push_back (l);
+    }
+  return n;
+}
+
+
+token*
+lexer::scan_cached ()
+{
+  ate_comment = false;
+  ate_whitespace = false;
+  if (cache_pos >= cached_lexemes.size())
+    return 0;
+
+  const lexeme& l = cached_lexemes[cache_pos++];
+  saw_tokens = true;
+  ate_comment = l.ate_comment;
+  ate_whitespace = l.ate_whitespace;
+
+  token* n = new token;
+  n->location.file = current_file;
+  n->location.line = l.line;
+  n->location.column = l.column;
+  n->chain = current_token_chain;
+  n->type = l.type;
+  n->junk_type = l.junk_type;
+  n->content = l.content;
+  return n;
+}
+
+
+token*
+lexer::scan_input ()
 {
   ate_comment = false; // reset for each new token
   ate_whitespace = false; // reset for each new token
@@ -1596,12 +1870,20 @@ skip:
     {
       delete n;
       saw_tokens = old_saw_tokens;
+      cache_eof = true;
       return 0;
     }
 
-  if (isspace (c))
+  if (lex_is (c, lc_space))
     {
       ate_whitespace = true;
+      if (cursor_suspend_count == 0)
+        {
+          const char *p = input_pointer;
+          while (p < input_end && lex_is ((unsigned char) *p, lc_space))
+            p++;
+          input_advance (p);
+        }
       goto skip;
     }
 
@@ -1617,6 +1899,7 @@ skip:
       token_str.push_back (c);
       token_str.push_back (c2);
       input_get(); // swallow '#'
+      cache_ok = false; // depends on the command line
 
       if (suspended)
         {
@@ -1628,9 +1911,10 @@ skip:
       token_str.clear();
       goto skip;
     }
-  else if ((c == '$' || c == '@') && (isdigit (c2)))
+  else if ((c == '$' || c == '@') && lex_is (c2, lc_digit))
     {
       unsigned idx = 0;
+      cache_ok = false; // depends on the command line
       token_str.push_back (c);
       do
         {
@@ -1639,7 +1923,7 @@ skip:
           idx = (idx * 10) + (c2 - '0');
           c2 = input_peek ();
         } while (c2 > 0 &&
-                 isdigit (c2) &&
+                 lex_is (c2, lc_digit) &&
                  idx <= session.args.size()); // prevent overflow
       if (suspended) 
         {
@@ -1659,15 +1943,10 @@ skip:
       goto skip;
     }
 
-  else if (isalpha (c) || c == '$' || c == '@' || c == '_')
+  else if (lex_is (c, lc_alpha) || c == '$' || c == '@' || c == '_')
     {
       token_str = (char) c;
-      while (isalnum (c2) || c2 == '_' || c2 == '$')
-	{
-          input_get ();
-          token_str.push_back (c2);
-          c2 = input_peek ();
-        }
+      input_take (lc_ident, token_str);
       n->content = token_str;
 
       if (n->content[0] == '@')
@@ -1681,21 +1960,15 @@ skip:
       return n;
     }
 
-  else if (isdigit (c)) // positive literal
+  else if (lex_is (c, lc_digit)) // positive literal
     {
       n->type = tok_number;
       token_str = (char) c;
 
-      while (isalnum (c2))
-	{
-          // NB: isalnum is very permissive.  We rely on strtol, called in
-          // parser::parse_literal below, to confirm that the number string
-          // is correctly formatted and in range.
-
-          input_get ();
-          token_str.push_back (c2);
-          c2 = input_peek ();
-	}
+      // NB: alnum is very permissive.  We rely on strtol, called in
+      // parser::parse_literal below, to confirm that the number string
+      // is correctly formatted and in range.
+      input_take (lc_alnum, token_str);
 
       n->content = token_str;
       return n;
@@ -1752,7 +2025,7 @@ skip:
       return n;
     }
 
-  else if (ispunct (c))
+  else if (lex_is (c, lc_punct))
     {
       int c3 = input_peek (1);
 
@@ -1761,20 +2034,20 @@ skip:
       // 1-1 would be parsed as tok_number(1) and tok_number(-1)
       // instead of tok_number(1) tok_operator('-') tok_number(1)
 
-      if (c == '#') // shell comment
-        {
-          unsigned this_line = cursor_line;
-          do { c = input_get (); }
-          while (c >= 0 && cursor_line == this_line);
-          ate_comment = true;
-          ate_whitespace = true;
-          goto skip;
-        }
-      else if ((c == '/' && c2 == '/')) // C++ comment
+      if (c == '#' || (c == '/' && c2 == '/')) // shell or C++ comment
         {
-          unsigned this_line = cursor_line;
-          do { c = input_get (); }
-          while (c >= 0 && cursor_line == this_line);
+          if (cursor_suspend_count == 0)
+            {
+              const char *nl = (const char *)
+                memchr (input_pointer, '\n', input_end - input_pointer);
+              input_advance (nl ? nl + 1 : input_end);
+            }
+          else
+            {
+              unsigned this_line = cursor_line;
+              do { c = input_get (); }
+              while (c >= 0 && cursor_line == this_line);
+            }
           ate_comment = true;
           ate_whitespace = true;
           goto skip;
@@ -1782,6 +2055,15 @@ skip:
       else if (c == '/' && c2 == '*') // C comment
 	{
           (void) input_get (); // swallow '*' already in c2
+          if (cursor_suspend_count == 0)
+            {
+              const char *end = (const char *)
+                memmem (input_pointer, input_end - input_pointer, "*/", 2);
+              input_advance (end ? end + 2 : input_end);
+              ate_comment = true;
+              ate_whitespace = true;
+              goto skip;
+            }
           c = input_get ();
           c2 = input_get ();
           while (c2 >= 0)
@@ -1799,6 +2081,21 @@ skip:
         {
           n->type = tok_embedded;
           (void) input_get (); // swallow '{' already in c2
+          const char *end = (cursor_suspend_count == 0) ? (const char *)
+            memmem (input_pointer, input_end - input_pointer, "%}", 2) : NULL;
+          if (end)
+            {
+              for (const char *typo = input_pointer;
+                   (typo = (const char *) memmem (typo, end + 1 - typo, "}%", 2));
+                   typo++)
+                {
+                  session.print_warning (_("possible erroneous closing '}%', use '%}'?"), n);
+                  cache_ok = false; // keep warning on later runs
+                }
+              n->content = string (input_pointer, end);
+              input_advance (end + 2);
+              return n;
+            }
           c = input_get ();
           c2 = input_get ();
           while (c2 >= 0)
@@ -1809,7 +2106,10 @@ skip:
                   return n;
                 }
               if (c == '}' && c2 == '%') // possible typo
-                session.print_warning (_("possible erroneous closing '}%', use '%}'?"), n);
+                {
+                  session.print_warning (_("possible erroneous closing '}%', use '%}'?"), n);
+                  cache_ok = false; // keep warning on later runs
+                }
               token_str.push_back (c);
               c = c2;
               c2 = input_get();
@@ -2016,6 +2316,8 @@ parser::parse ()
       f = 0;
     }
 
+  if (f)
+    input.close_cache ();
   input.set_current_file(0);
   return f;
 }
@@ -2352,6 +2654,12 @@ parser::do_parse_global (vector <vardecl*>& globals, vector<probe*>&,
           swallow ();
           t = peek();
         }
+      else if (t && t->type == tok_operator && t->content == "@topk") // heavy hitters
+        {
+          d->topk = true;
+          swallow ();
+          t = peek();
+        }
 
       if (t && t->type == tok_operator && t->content == "[") // array size
 	{
@@ -3803,13 +4111,15 @@ parser::parse_hist_op_or_bare_name (hist_op *&hop, interned_string &name)
 {
   hop = NULL;
   const token* t = expect_ident_or_atword (name);
-  if (name == "@hist_linear" || name == "@hist_log")
+  if (name == "@hist_linear" || name == "@hist_log" || name == "@hist_hdr")
     {
       hop = new hist_op;
       if (name == "@hist_linear")
 	hop->htype = hist_linear;
       else if (name == "@hist_log")
 	hop->htype = hist_log;
+      else if (name == "@hist_hdr")
+	hop->htype = hist_hdr;
       hop->tok = t;
       expect_op("(");
       hop->stat = parse_expression ();
@@ -3823,6 +4133,12 @@ parser::parse_hist_op_or_bare_name (hist_op *&hop, interned_string &name)
 	      hop->params.push_back (tnum);
 	    }
 	}
+      else if (hop->htype == hist_hdr)
+	{
+	  expect_op (",");
+	  expect_number (tnum);
+	  hop->params.push_back (tnum);
+	}
       expect_op(")");
     }
   return t;
@@ -3904,6 +4220,10 @@ expression* parser::parse_symbol ()
 	    sop->ctype = sc_min;
 	  else if (name == "@max")
 	    sop->ctype = sc_max;
+	  else if (name == "@quantile")
+	    sop->ctype = sc_quantile, max_params = 2;
+	  else if (name == "@distinct")
+	    sop->ctype = sc_distinct;
 	  else
 	    throw PARSE_ERROR(_F("unknown operator %s",
                                  name.to_string().c_str()));
@@ -3932,6 +4252,8 @@ expression* parser::parse_symbol ()
 	          sop->params.push_back (tnum);
 	        }
 	    }
+	  if (sop->ctype == sc_quantile && sop->params.empty())
+	    throw PARSE_ERROR(_("missing quantile parameter"), sop->tok);
 	  return sop;
 	}
 
@@ -3940,7 +4262,8 @@ expression* parser::parse_symbol ()
 	  expect_op("(");
 	  if ((name == "print" || name == "println" ||
 	       name == "sprint" || name == "sprintln") &&
-	      (peek_op("@hist_linear") || peek_op("@hist_log")))
+	      (peek_op("@hist_linear") || peek_op("@hist_log")
+	       || peek_op("@hist_hdr")))
 	    {
 	      // We have a special case where we recognize
 	      // print(@hist_foo(bar)) as a magic print-the-histogram
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <stdexcept>
 #include "stringtable.h"
+#include "util.h"
 
 
 struct systemtap_session;
@@ -66,6 +67,10 @@ struct token
 
   std::string junk_message(systemtap_session& session) const;
 
+  // Tokens are small and numerous; see pool_alloc.
+  static void *operator new (size_t size) { return pool_alloc (size); }
+  static void operator delete (void *p, size_t size) { pool_free (p, size); }
+
   // Creates a new token with the same content but different coordinates.
   // Can be used for exact error reporting *within* a token e.g. embedded-code.
   token *adjust_location(const source_loc &adjusted_loc) const
@@ -119,6 +124,7 @@ enum parse_flag
     pf_squash_errors = 4,
     pf_user_file = 8,
     pf_auto_path = 16,
+    pf_cache_lexemes = 32,
   };
 
 
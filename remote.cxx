@@ -11,14 +11,20 @@
 extern "C" {
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#ifdef AF_VSOCK
+#include <linux/vm_sockets.h>
+#endif
 }
 
 #include <cstdio>
+#include <deque>
 #include <iomanip>
 #include <memory>
 #include <stdexcept>
@@ -27,6 +33,7 @@ extern "C" {
 #include <vector>
 
 #include "buildrun.h"
+#include "cache.h"
 #include "remote.h"
 #include "util.h"
 
@@ -126,12 +133,32 @@ class direct : public remote {
 
 class stapsh : public remote {
   private:
+    static const size_t read_batch = 65536; // output read per call
     int interrupts_sent;
     int fdin, fdout;
     FILE *IN, *OUT;
     string remote_version;
     size_t data_size;
     string target_stream;
+    size_t poll_first, poll_end; // where our fds are in run()'s pollfds
+    bool running; // staprun has been started
+
+    // A command sent whose reply is still to come.  A "fetch" that
+    // fails is retried as an upload of the local file.
+    struct command {
+      string name, local, dest;
+    };
+    vector<command> pending;
+
+    // A "file" command and its data, still to be written out.  All of the
+    // remotes' uploads are written as their pipes take them, from run()'s
+    // poll loop, rather than one remote after another.
+    struct upload {
+      string head;
+      void *map;
+      size_t size, done;
+    };
+    deque<upload> uploads;
 
     enum {
       STAPSH_READY, // ready to receive next command
@@ -140,6 +167,20 @@ class stapsh : public remote {
 
     virtual void prepare_poll(vector<pollfd>& fds)
       {
+        poll_first = fds.size();
+        if (!running)
+          {
+            if (pending_interrupts)
+              close();
+            else if (fdin >= 0 && IN && !uploads.empty())
+              {
+                pollfd p = { fdin, POLLOUT, 0 };
+                fds.push_back(p);
+              }
+            poll_end = fds.size();
+            return;
+          }
+
         if (fdout >= 0 && OUT)
           {
             pollfd p = { fdout, POLLIN, 0 };
@@ -152,11 +193,23 @@ class stapsh : public remote {
             pollfd p = { fdin, POLLOUT, 0 };
             fds.push_back(p);
           }
+        poll_end = fds.size();
       }
 
     virtual void handle_poll(vector<pollfd>& fds)
       {
-        for (unsigned i=0; i < fds.size(); ++i)
+        // Only look at our own fds, so that a poll over hundreds of
+        // remotes doesn't cost each of them a scan of all the rest.
+        if (!running)
+          {
+            for (size_t i = poll_first; i < poll_end; ++i)
+              if (fds[i].fd == fdin && fds[i].revents
+                  && send_uploads() != 0)
+                close();
+            return;
+          }
+
+        for (size_t i = poll_first; i < poll_end; ++i)
           if (fds[i].fd == fdin || fds[i].fd == fdout)
             {
               bool err = false;
@@ -181,7 +234,7 @@ class stapsh : public remote {
                       // data is available for reading. One way could be to
                       // splice in small chunks and poll() fdout to check if
                       // there's more.
-                      char buf[4096];
+                      char buf[read_batch];
                       size_t bytes_read;
                       while ((bytes_read = fread(buf, 1, sizeof(buf), OUT)) > 0)
                         printout(buf, bytes_read);
@@ -246,7 +299,7 @@ class stapsh : public remote {
                           if (data_size != 0)
                             {
                               // keep reading from OUT until either dry or data_size bytes done
-                              char buf[4096];
+                              char buf[read_batch];
                               size_t max_read = min<size_t>(sizeof(buf), data_size);
                               size_t bytes_read = 0;
                               while (max_read > 0
@@ -278,7 +331,7 @@ class stapsh : public remote {
         // actually start running, and there's no get_reply after that.  So
         // we'll just loop and skip those that start with "stapsh:".
         char reply[4096];
-        while (fgets(reply, sizeof(reply), OUT))
+        while (OUT && fgets(reply, sizeof(reply), OUT))
           {
             if (!startswith(reply, "stapsh:"))
               return reply;
@@ -308,60 +361,139 @@ class stapsh : public remote {
 
     int send_file(const string& filename, const string& dest)
       {
-        int rc = 0;
-        FILE* f = fopen(filename.c_str(), "r");
-        if (!f)
+        int fd = open(filename.c_str(), O_RDONLY|O_CLOEXEC);
+        if (fd < 0)
           return 1;
 
         struct stat fs;
-        rc = fstat(fileno(f), &fs);
-        if (!rc)
+        upload u = { "", NULL, 0, 0 };
+        int rc = fstat(fd, &fs);
+        if (!rc && fs.st_size > 0)
           {
-            ostringstream cmd;
-            cmd << "file " << fs.st_size << " " << dest << "\n";
-            rc = send_command(cmd.str());
+            u.size = fs.st_size;
+            u.map = mmap(NULL, u.size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (u.map == MAP_FAILED)
+              rc = 1;
           }
+        ::close(fd);
+        if (rc)
+          return rc;
+
+        ostringstream cmd;
+        cmd << "file " << fs.st_size << " " << dest << "\n";
+        u.head = cmd.str();
+        uploads.push_back(u);
 
-        off_t i = 0;
-        while (!rc && i < fs.st_size)
+        // The reply is left for prepare_done().
+        pending.push_back(command{"file", filename, dest});
+        return 0;
+      }
+
+    // Ask stapsh to download a file from the remote cache itself, rather
+    // than have us send it.  This is queued like an upload to keep the
+    // commands in order.
+    void send_fetch(const string& key, const string& filename, const string& dest)
+      {
+        upload u = { "fetch " + dest + " "
+                     + qpencode(s->remote_cache_url + "/" + key) + "\n",
+                     NULL, 0, 0 };
+        uploads.push_back(u);
+        pending.push_back(command{"fetch", filename, dest});
+      }
+
+    // Write out as much of the queued uploads as the pipe takes.  When
+    // fdin blocks, that's all of them.
+    int send_uploads()
+      {
+        while (!uploads.empty())
           {
-            char buf[4096];
-            size_t r = sizeof(buf);
-            if (fs.st_size - i < (off_t)r)
-              r = fs.st_size - i;
-            r = fread(buf, 1, r, f);
-            if (r == 0)
-              rc = 1;
-            else
+            upload& u = uploads.front();
+            size_t hlen = u.head.size();
+            struct iovec iov[2];
+            int n = 0;
+            if (u.done < hlen)
+              {
+                iov[n].iov_base = (void*) (u.head.data() + u.done);
+                iov[n++].iov_len = hlen - u.done;
+              }
+            size_t off = u.done < hlen ? 0 : u.done - hlen;
+            if (off < u.size)
+              {
+                iov[n].iov_base = (char*) u.map + off;
+                iov[n++].iov_len = u.size - off;
+              }
+
+            ssize_t w = n ? writev(fdin, iov, n) : 0;
+            if (w < 0 && errno == EINTR)
+              continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+              return 0;
+            if (w < 0)
+              return 1;
+
+            u.done += w;
+            if (u.done == hlen + u.size)
               {
-                size_t w = fwrite(buf, 1, r, IN);
-                if (w != r)
-                  rc = 1;
-                else
-                  i += w;
+                if (u.map)
+                  munmap(u.map, u.size);
+                uploads.pop_front();
               }
           }
-        if (!rc)
-          rc = fflush(IN);
 
-        fclose(f);
+        // All sent; the replies are read in the usual blocking way.
+        return set_blocking(fdin, true);
+      }
 
-        if (!rc)
+    static int set_blocking(int fd, bool blocking)
+      {
+        long flags = fcntl(fd, F_GETFL);
+        if (flags == -1)
+          return 1;
+        flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+        return fcntl(fd, F_SETFL, flags) == -1;
+      }
+
+    // Read the reply to each command sent since last time.
+    int await_replies()
+      {
+        int rc = 0;
+        vector<command> retry;
+        for (size_t i = 0; i < pending.size(); ++i)
           {
             string reply = get_reply();
-            if (reply != "OK\n")
+            if (reply != "OK\n" && pending[i].name == "fetch" && !reply.empty())
+              {
+                if (s->verbose > 1)
+                  clog << _F("stapsh fetch replied %s", reply.c_str());
+                retry.push_back(pending[i]);
+              }
+            else if (reply != "OK\n" && !rc)
               {
                 rc = 1;
                 if (s->verbose > 0)
                   {
                     if (reply.empty())
-                      clog << _("stapsh file ERROR: no reply") << endl;
+                      clog << _F("stapsh %s ERROR: no reply", pending[i].name.c_str()) << endl;
                     else
-                      clog << _F("stapsh file replied %s", reply.c_str());
+                      clog << _F("stapsh %s replied %s", pending[i].name.c_str(), reply.c_str());
                   }
               }
+            if (reply.empty())
+              break;
           }
+        pending.clear();
 
+        // Send what couldn't be fetched after all.  fdin is blocking
+        // again by now, so this waits until it is all written.
+        if (!rc && !retry.empty())
+          {
+            for (size_t i = 0; i < retry.size() && !rc; ++i)
+              rc = send_file(retry[i].local, retry[i].dest);
+            if (!rc)
+              rc = send_uploads();
+            if (!rc)
+              rc = await_replies();
+          }
         return rc;
       }
 
@@ -416,7 +548,6 @@ class stapsh : public remote {
                   cout << prefix;
                 cout.write(it->first, it->second);
               }
-            cout.flush();
             const char *last_line = lines.back().first;
             const char last_char = last_line[lines.back().second-1];
             on_same_line = !lines.empty() && last_char != '\n';
@@ -428,11 +559,9 @@ class stapsh : public remote {
             // NB: The buf could contain binary data,
             // including \0, so write as a block instead of
             // the usual << string.
+            // run() flushes cout once it has been round the remotes.
             if (target_stream == "stdout")
-              {
-                cout.write(buf, size);
-                cout.flush();
-              }
+              cout.write(buf, size);
             else // stderr
               clog.write(buf, size);
           }
@@ -443,7 +572,8 @@ class stapsh : public remote {
       : remote(s), interrupts_sent(0),
         fdin(-1), fdout(-1), IN(0), OUT(0),
         data_size(0), target_stream("stdout"), // default to stdout for schemes
-        stream_state(STAPSH_READY)         // that don't pipe stderr (e.g. ssh)
+        poll_first(0), poll_end(0),        // that don't pipe stderr (e.g. ssh)
+        running(false), stream_state(STAPSH_READY)
       {}
 
     vector<string> options;
@@ -463,12 +593,26 @@ class stapsh : public remote {
 	string localmodule = s->tmpdir + "/" + s->module_name + extension;
         string remotemodule = s->module_name + extension;
 
-        if ((rc = send_file(localmodule, remotemodule)))
-          return rc;
+        // A signed module that went into the --remote-cache can be
+        // fetched from there by the remote itself, so that many remotes
+        // don't all wait on our own uplink.
+        if (!s->remote_cache_url.empty() && !s->hash_path.empty() &&
+            file_exists(localmodule + ".sgn") &&
+            strverscmp("4.9", remote_version.c_str()) <= 0)
+          {
+            string key = remote_cache_key(s->hash_path);
+            send_fetch(key + ".sgn", localmodule + ".sgn", remotemodule + ".sgn");
+            send_fetch(key, localmodule, remotemodule);
+          }
+        else
+          {
+            if ((rc = send_file(localmodule, remotemodule)))
+              return rc;
 
-        if (file_exists(localmodule + ".sgn") &&
-            (rc = send_file(localmodule + ".sgn", remotemodule + ".sgn")))
-          return rc;
+            if (file_exists(localmodule + ".sgn") &&
+                (rc = send_file(localmodule + ".sgn", remotemodule + ".sgn")))
+              return rc;
+          }
 
         if (!s->uprobes_path.empty())
           {
@@ -481,9 +625,19 @@ class stapsh : public remote {
               return rc;
           }
 
+        // The uploads go out from run()'s poll loop.
+        if (!IN || fflush(IN) != 0 || set_blocking(fdin, false))
+          return 1;
         return rc;
       }
 
+    virtual int prepare_done()
+      {
+        if (!IN || !uploads.empty()) // lost or interrupted
+          return 1;
+        return await_replies();
+      }
+
     virtual int start()
       {
         // Send the staprun args
@@ -507,32 +661,31 @@ class stapsh : public remote {
         run << '\n';
 
         int rc = send_command(run.str());
+        if (rc)
+          // If run failed for any reason, then this
+          // connection is effectively dead to us.
+          close();
+        else
+          pending.push_back(command{"run", "", ""});
+        return rc;
+      }
 
-        if (!rc)
-          {
-            string reply = get_reply();
-            if (reply != "OK\n")
-              {
-                rc = 1;
-                if (s->verbose > 0)
-                  {
-                    if (reply.empty())
-                      clog << _("stapsh run ERROR: no reply") << endl;
-                    else
-                      clog << _F("stapsh run replied %s", reply.c_str());
-                  }
-              }
-          }
+    virtual int start_done()
+      {
+        if (pending.empty()) // start() failed
+          return 0;
+
+        int rc = await_replies();
 
         if (!rc)
           {
-            long flags;
-            if ((flags = fcntl(fdout, F_GETFL)) == -1
-              || fcntl(fdout, F_SETFL, flags | O_NONBLOCK) == -1)
+            if (set_blocking(fdout, false))
               {
                 clog << _("failed to change to non-blocking mode") << endl;
                 rc = 1;
               }
+            else
+              running = true;
           }
 
         if (rc)
@@ -549,6 +702,11 @@ class stapsh : public remote {
         if (OUT) fclose(OUT);
         IN = OUT = NULL;
         fdin = fdout = -1;
+        pending.clear();
+        for (size_t i = 0; i < uploads.size(); ++i)
+          if (uploads[i].map)
+            munmap(uploads[i].map, uploads[i].size);
+        uploads.clear();
       }
 
     virtual int finish()
@@ -562,12 +720,21 @@ class stapsh : public remote {
         if (fdin >= 0 || fdout >= 0 || IN || OUT)
           throw runtime_error(_("stapsh file descriptors already set"));
 
+        // From here on the fds are ours, and close() releases them even
+        // if this throws.
         fdin = in;
         fdout = out;
         IN = fdopen(fdin, "w");
         OUT = fdopen(fdout, "r");
         if (!IN || !OUT)
-          throw runtime_error(_("invalid file descriptors for stapsh"));
+          {
+            if (!IN && !(OUT && fdout == fdin))
+              ::close(fdin);
+            if (!OUT && fdout != fdin)
+              ::close(fdout);
+            fdin = fdout = -1;
+            throw runtime_error(_("invalid file descriptors for stapsh"));
+          }
 
         if (send_command("stap " VERSION "\n"))
           throw runtime_error(_("error sending hello to stapsh"));
@@ -727,9 +894,8 @@ class unix_stapsh : public stapsh {
           }
         catch (runtime_error&)
           {
+            // set_child_fds() owns both fds now; finish() closes them.
             finish();
-            ::close(fd);
-            ::close(fd2);
             throw;
           }
       }
@@ -740,6 +906,124 @@ class unix_stapsh : public stapsh {
     virtual ~unix_stapsh() { finish(); }
 };
 
+// The port "stapsh -V" listens on in the stapsh-vsock service of a guest.
+#define STAPSH_VSOCK_PORT 4771
+
+class vsock_stapsh : public stapsh {
+  private:
+
+    vsock_stapsh(systemtap_session& s, const uri_decoder& ud)
+      : stapsh(s)
+      {
+        // Request that data be encapsulated since both stdout and stderr have
+        // to go over the same line. Also makes stapsh tell us when it quits.
+        this->options.push_back("data");
+
+        // set verbosity to the requested level
+        for (unsigned i = 1; i < s.perpass_verbose[4]; i++)
+          this->options.push_back("verbose");
+
+        // vsock://CID[:PORT], or vsock:CID[:PORT]
+        string target = ud.has_authority ? ud.authority : ud.path;
+        if (ud.has_authority && !ud.path.empty())
+          throw runtime_error(_("vsock target URI doesn't support a /path"));
+        if (ud.has_query)
+          throw runtime_error(_("vsock target URI doesn't support a ?query"));
+        if (ud.has_fragment)
+          throw runtime_error(_("vsock target URI doesn't support a #fragment"));
+
+#ifdef AF_VSOCK
+        vector<string> matches;
+        if (regexp_match(target, "^([0-9]+)(:([0-9]+))?$", matches) != 0)
+          throw runtime_error(_F("vsock target requires a CID[:PORT], not '%s'",
+                                 target.c_str()));
+        unsigned long cid = strtoul(matches[1].c_str(), NULL, 10);
+        unsigned long port = matches[3].empty() ? STAPSH_VSOCK_PORT
+                             : strtoul(matches[3].c_str(), NULL, 10);
+        if (cid > 0xffffffffUL || port > 0xffffffffUL)
+          throw runtime_error(_F("vsock target %s is out of range",
+                                 target.c_str()));
+
+        sockaddr_vm server;
+        memset(&server, 0, sizeof(server));
+        server.svm_family = AF_VSOCK;
+        server.svm_cid = cid;
+        server.svm_port = port;
+
+        int fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+          throw runtime_error(_F("error opening a vsock socket: %s",
+                                 strerror(errno)));
+
+        // Match the guest's larger buffer, so script output can stream
+        // without waiting on every credit update.  Best effort.
+        unsigned long long size = 1024 * 1024;
+        (void) setsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE,
+                          &size, sizeof(size));
+        (void) setsockopt(fd, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE,
+                          &size, sizeof(size));
+
+        // stapsh -V only takes connections from a privileged port, which
+        // proves we are root here, so bind one first, as rresvport does.
+        sockaddr_vm local;
+        memset(&local, 0, sizeof(local));
+        local.svm_family = AF_VSOCK;
+        local.svm_cid = VMADDR_CID_ANY;
+        int rc = -1;
+        for (unsigned p = 1023; rc < 0 && p >= 512; --p)
+          {
+            local.svm_port = p;
+            rc = bind(fd, (struct sockaddr *)&local, sizeof(local));
+            if (rc < 0 && errno != EADDRINUSE)
+              break;
+          }
+        if (rc < 0)
+          {
+            const char *msg = strerror(errno);
+            ::close(fd);
+            throw runtime_error(_F("error binding a privileged vsock port "
+                                   "(vsock targets need root): %s", msg));
+          }
+
+        if (connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0)
+          {
+            const char *msg = strerror(errno);
+            ::close(fd);
+            throw runtime_error(_F("error connecting to vsock %lu:%lu: %s",
+                                    cid, port, msg));
+          }
+
+        // Separate fds for the fdopen handles, as with unix_stapsh.
+        int fd2 = dup(fd);
+        if (fd2 < 0)
+          {
+            const char *msg = strerror(errno);
+            ::close(fd);
+            throw runtime_error(_F("error duplicating the vsock socket: %s",
+                                   msg));
+          }
+
+        try
+          {
+            set_child_fds(fd, fd2);
+          }
+        catch (runtime_error&)
+          {
+            // set_child_fds() owns both fds now; finish() closes them.
+            finish();
+            throw;
+          }
+#else
+        throw runtime_error(_("vsock targets are not supported on this host"));
+#endif
+      }
+
+  public:
+    friend class remote;
+
+    virtual ~vsock_stapsh() { finish(); }
+};
+
 class libvirt_stapsh : public stapsh {
   private:
 
@@ -868,13 +1152,15 @@ class ssh_remote : public stapsh {
 
     ssh_remote(systemtap_session& s): stapsh(s), child(0) {}
 
-    int connect(const string& host, const string& port)
+    int connect(const string& host, const string& port, bool compress)
       {
         int rc = 0;
         int in, out;
         vector<string> cmd { "ssh", "-q", host };
         if (!port.empty())
           cmd.insert(cmd.end(), { "-p", port });
+        if (compress)
+          cmd.push_back("-C");
 
         // This is crafted so that we get a silent failure with status 127 if
         // the command is not found.  The combination of -P and $cmd ensures
@@ -933,7 +1219,8 @@ class ssh_remote : public stapsh {
 
   public:
 
-    static remote* create(systemtap_session& s, const string& host);
+    static remote* create(systemtap_session& s, const string& host,
+                          bool compress=false);
     static remote* create(systemtap_session& s, const uri_decoder& ud);
 
     virtual ~ssh_remote() { finish(); }
@@ -1156,7 +1443,7 @@ class ssh_legacy_remote : public remote {
 // Try to establish a stapsh connection to the remote, but fallback
 // to the older mechanism if the command is not found.
 remote*
-ssh_remote::create(systemtap_session& s, const string& target)
+ssh_remote::create(systemtap_session& s, const string& target, bool compress)
 {
   string port, host = target;
   size_t i = host.find(':');
@@ -1167,7 +1454,7 @@ ssh_remote::create(systemtap_session& s, const string& target)
     }
 
   unique_ptr<ssh_remote> p (new ssh_remote(s));
-  int rc = p->connect(host, port);
+  int rc = p->connect(host, port, compress);
   if (rc == 0)
     return p.release();
   else if (rc == 127) // stapsh command not found
@@ -1182,12 +1469,14 @@ ssh_remote::create(systemtap_session& s, const uri_decoder& ud)
     throw runtime_error(_("ssh target requires a hostname"));
   if (!ud.path.empty() && ud.path != "/")
     throw runtime_error(_("ssh target URI doesn't support a /path"));
-  if (ud.has_query)
-    throw runtime_error(_("ssh target URI doesn't support a ?query"));
+  // ?compress has ssh compress the module and the output, which pays
+  // off for chatty scripts over slow links.
+  if (ud.has_query && ud.query != "compress")
+    throw runtime_error(_("ssh target URI doesn't support a ?query other than ?compress"));
   if (ud.has_fragment)
     throw runtime_error(_("ssh target URI doesn't support a #fragment"));
 
-  return create(s, ud.authority);
+  return create(s, ud.authority, ud.has_query);
 }
 
 
@@ -1213,6 +1502,8 @@ remote::create(systemtap_session& s, const string& uri, int idx)
             it = new direct_stapsh(s);
           else if (ud.scheme == "unix")
             it = new unix_stapsh(s, ud);
+          else if (ud.scheme == "vsock")
+            it = new vsock_stapsh(s, ud);
           else if (ud.scheme == "libvirt")
             it = new libvirt_stapsh(s, ud);
           else if (ud.scheme == "ssh")
@@ -1241,6 +1532,34 @@ remote::create(systemtap_session& s, const string& uri, int idx)
   return it;
 }
 
+// Poll the remotes until none has an fd left to watch: first while
+// they're sent their files, and then while their scripts run.
+void
+remote::poll_remotes(const vector<remote*>& remotes)
+{
+  // mask signals while we're preparing to poll
+  stap_sigmasker masked;
+
+  // polling loop for remotes that have fds to watch
+  for (;;)
+    {
+      vector<pollfd> fds;
+      for (unsigned i = 0; i < remotes.size(); ++i)
+        remotes[i]->prepare_poll (fds);
+      if (fds.empty())
+        break;
+
+      int rc = ppoll (&fds[0], fds.size(), NULL, &masked.old);
+      if (rc < 0 && errno != EINTR)
+        break;
+
+      for (unsigned i = 0; i < remotes.size(); ++i)
+        remotes[i]->handle_poll (fds);
+      cout.flush();
+    }
+}
+
+
 int
 remote::run(const vector<remote*>& remotes)
 {
@@ -1257,6 +1576,13 @@ remote::run(const vector<remote*>& remotes)
       if (rc)
         return rc;
     }
+  poll_remotes(remotes);
+  for (unsigned i = 0; i < remotes.size() && !pending_interrupts; ++i)
+    {
+      rc = remotes[i]->prepare_done();
+      if (rc)
+        return rc;
+    }
 
   for (unsigned i = 0; i < remotes.size() && !pending_interrupts; ++i)
     {
@@ -1264,28 +1590,14 @@ remote::run(const vector<remote*>& remotes)
       if (!ret)
         ret = rc;
     }
+  for (unsigned i = 0; i < remotes.size() && !pending_interrupts; ++i)
+    {
+      rc = remotes[i]->start_done();
+      if (!ret)
+        ret = rc;
+    }
 
-  // mask signals while we're preparing to poll
-  {
-    stap_sigmasker masked;
-
-    // polling loop for remotes that have fds to watch
-    for (;;)
-      {
-        vector<pollfd> fds;
-        for (unsigned i = 0; i < remotes.size(); ++i)
-          remotes[i]->prepare_poll (fds);
-        if (fds.empty())
-          break;
-
-        rc = ppoll (&fds[0], fds.size(), NULL, &masked.old);
-        if (rc < 0 && errno != EINTR)
-          break;
-
-        for (unsigned i = 0; i < remotes.size(); ++i)
-          remotes[i]->handle_poll (fds);
-      }
-  }
+  poll_remotes(remotes);
 
   for (unsigned i = 0; i < remotes.size(); ++i)
     {
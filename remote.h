@@ -24,9 +24,17 @@ class remote {
     virtual int start() = 0;
     virtual int finish() = 0;
 
+    // run() sends every remote its files and its run command before it
+    // waits on any of their replies, so that with many remotes the round
+    // trips overlap.  These wait for the replies.
+    virtual int prepare_done() { return 0; }
+    virtual int start_done() { return 0; }
+
     virtual void prepare_poll(std::vector<pollfd>&) {}
     virtual void handle_poll(std::vector<pollfd>&) {}
 
+    static void poll_remotes(const std::vector<remote*>& remotes);
+
   protected:
     systemtap_session* s;
     std::string prefix; // stap --remote-prefix
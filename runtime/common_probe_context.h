@@ -12,9 +12,6 @@
    context structures. */
 int data_index;
 
-/* The index of the active probe within stap_probes[].  */
-size_t probe_index;
-
 /* The lock for this context structure. */
 pthread_mutex_t lock;
 
@@ -32,6 +29,11 @@ atomic_t busy;
 
 #endif
 
+#if defined(__DYNINST__) || defined(STP_OUTPUT_RATE)
+/* The index of the active probe within stap_probes[].  */
+size_t probe_index;
+#endif
+
 /* The fully-resolved probe point associated with a currently running probe
    handler, including alias and wild-card expansion effects.
    aka stap_probe->pp.  Setup by common_probe_entryfn_prologue.
@@ -83,6 +85,12 @@ int aborted;
    been locked or not. PR26296 */
 int locked;
 
+/* The busy flag of the spare map this handler swapped in for a foreach
+   snapshot, if any, until the delete after the loop clears it and hands
+   it back.  A handler that ends without that delete merges the snapshot
+   back into its array instead. */
+atomic_t *snapshot_busy;
+
 /* A place to format error messages into if some error occurs, last_error
    will then be pointed here.  */
 string_t error_buffer;
@@ -185,17 +193,25 @@ cycles_t cycles_base;
 cycles_t cycles_sum;
 #endif
 
-/* Current state of the unwinder (as used in the unwind.c dwarf unwinder). */
+/* Current state of the unwinder (as used in the unwind.c dwarf unwinder).
+   The user stack parts are left out for scripts that only unwind kernel
+   stacks, see pragma:kunwind.  */
 #if defined(STP_NEED_UNWIND_DATA)
-struct unwind_cache uwcache_user;
 struct unwind_cache uwcache_kernel;
-struct unwind_context uwcontext_user;
 struct unwind_context uwcontext_kernel;
+#if defined(STP_NEED_USER_UNWIND_DATA)
+struct unwind_cache uwcache_user;
+struct unwind_context uwcontext_user;
+#if STP_STACK_WINDOW > 0
+struct stack_window uwwindow_user;
+#endif
+#endif
 #endif
 
 /* Only used when perf dervied probes have been defined. */
 #ifdef _HAVE_PERF_
 long *perf_read_values;
+struct stap_perf_sample *perf_sample; /* in perf .profile handlers */
 #endif
 
 /* Maximum number of backtrace levels. */
@@ -204,5 +220,7 @@ long *perf_read_values;
 #endif
 
 /* PR26673 we should allocate this array in struct context instead of on the
- * kernel stack */
+ * kernel stack.  Only stack.c uses it, which needs STP_NEED_UNWIND_DATA. */
+#if defined(STP_NEED_UNWIND_DATA)
 unsigned long kern_bt_entries[MAXBACKTRACE];
+#endif
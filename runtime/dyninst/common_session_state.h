@@ -4,6 +4,7 @@
 
 // Forward declarations for things in runtime/dyninst/shm.c
 static void *_stp_shm_base;
+static void *_stp_shm_data(void);
 static void *_stp_shm_alloc(size_t size);
 
 #include "session_attributes.h"
@@ -45,10 +46,8 @@ struct stp_runtime_session {
 static inline struct stp_runtime_session* _stp_session(void)
 {
 	// Since the session is always the first thing allocated, it lives
-	// directly at the start of shared memory.
-	// NB: We always reference the main shm pointer, rather than our own
-	// local copy, because reallocations may cause it to move dynamically.
-	return _stp_shm_base;
+	// directly after the allocator's header in shared memory.
+	return _stp_shm_data();
 }
 
 
@@ -162,7 +161,7 @@ static inline struct _stp_transport_session_data *stp_transport_data(void)
 
 #define global_lock(name)	(&_global_raw(name ## _lock))
 #define global_lock_init(name)	\
-	stp_pthread_rwlock_init_shared(global_lock(name))
+	stp_rwlock_init_shared(global_lock(name))
 
 #ifdef STP_TIMING
 #define global_skipped(name)	(&_global_raw(name ## _lock_skip_count))
@@ -182,7 +181,7 @@ static int stp_session_init(void)
 		return -ENOMEM;
 
 	// If we weren't the very first thing allocated, then something is wrong!
-	if (session != _stp_shm_base)
+	if (session != _stp_shm_data())
 		return -EINVAL;
 
 	atomic_set(session_state(), STAP_SESSION_UNINITIALIZED);
@@ -25,6 +25,7 @@
 #define mlist_entry	olist_entry
 #define mlist_move_tail	olist_move_tail
 
+#define mlist_for_each	olist_for_each
 #define mlist_for_each_safe	olist_for_each_safe
 
 
@@ -16,6 +16,23 @@
 #define MAP_GET_CPU()	STAT_GET_CPU()
 #define MAP_PUT_CPU()	STAT_PUT_CPU()
 
+/* The dyninst runtime always aggregates pmaps from scratch. */
+static inline void _stp_map_mark_dirty(MAP m, uint32_t hv) { }
+static inline void _stp_map_mark_all_dirty(MAP m) { }
+static inline void _stp_map_clear_dirty(MAP m) { }
+
+/* Nor does it stripe map locks; the whole map is locked instead. */
+static inline unsigned long _stp_map_stripe_lock(MAP m, uint32_t hv) { return 0; }
+static inline void _stp_map_stripe_unlock(MAP m, uint32_t hv, unsigned long flags) { }
+static inline void _stp_map_list_lock(MAP m) { }
+static inline void _stp_map_list_unlock(MAP m) { }
+static inline int _stp_map_init_stripes(MAP m) { return 0; }
+
+/* Nor sort arrays of the nodes; sorts work on the node lists. */
+static inline int _stp_map_init_sort(MAP m) { return 0; }
+static inline int _stp_pmap_init_sort(PMAP pmap) { return 0; }
+static inline struct map_sort_ent *_stp_map_sort_ents(MAP m) { return NULL; }
+
 struct pmap {
 	int bit_shift;    /* scale factor for integer arithmetic */
 	int stat_ops;     /* related statistical operators */
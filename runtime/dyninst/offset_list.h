@@ -77,6 +77,9 @@ static inline int olist_empty(struct olist_head *head)
 #define olist_entry(ptr, type, member)	\
 	container_of(ptr, type, member)
 
+#define olist_for_each(pos, head)				\
+	for (pos = olist_onext(head); pos != (head); pos = olist_onext(pos))
+
 #define olist_for_each_safe(pos, n, head)			\
 	for (pos = olist_onext(head), n = olist_onext(pos);	\
 	     pos != (head); pos = n, n = olist_onext(pos))
@@ -11,10 +11,6 @@
 #ifndef _STAPDYN_PRINT_C_
 #define _STAPDYN_PRINT_C_
 
-#ifdef STP_BULKMODE
-#error "Bulk mode output (percpu files) not supported for --runtime=dyninst"
-#endif
-
 #include "transport.c"
 #include "vsprintf.c"
 
@@ -10,24 +10,97 @@
 #ifndef _STAPDYN_PROBE_LOCK_H
 #define _STAPDYN_PROBE_LOCK_H
 
-#include <pthread.h>
+#include <sched.h>
 
 struct stp_probe_lock {
 	#ifdef STP_TIMING
 	atomic_t *skipped;
 	atomic_t *contention;
 	#endif
-	pthread_rwlock_t *lock;
+	stp_rwlock_t *lock;
 	unsigned write_p;
 };
 
 
+/* Spins this many times on a busy lock before yielding the cpu, since
+ * the holder is most likely running a short handler on another one. */
+#ifndef STP_RWLOCK_SPINS
+#define STP_RWLOCK_SPINS 100
+#endif
+
+static inline void stp_rwlock_relax(unsigned *spins)
+{
+	if (++*spins < STP_RWLOCK_SPINS) {
+#if defined(__i386__) || defined(__x86_64__)
+		__builtin_ia32_pause();
+#else
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+	} else {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+/* A reader counts itself in the slot of its context, and backs out
+ * again if it finds a writer there first.  Both sides use sequentially
+ * consistent operations, so that either the reader sees the writer's
+ * flag or the writer sees the reader's count. */
+static inline struct stp_rwlock_slot *
+stp_rwlock_slot(stp_rwlock_t *lock)
+{
+	return &lock->slots[_stp_runtime_get_data_index() % STP_RWLOCK_SLOTS];
+}
+
+static void stp_rwlock_read_lock(stp_rwlock_t *lock)
+{
+	struct stp_rwlock_slot *slot = stp_rwlock_slot(lock);
+	unsigned spins = 0;
+
+	for (;;) {
+		__atomic_add_fetch(&slot->readers, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&lock->writer, __ATOMIC_SEQ_CST))
+			return;
+		__atomic_sub_fetch(&slot->readers, 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED))
+			stp_rwlock_relax(&spins);
+	}
+}
+
+static void stp_rwlock_read_unlock(stp_rwlock_t *lock)
+{
+	__atomic_sub_fetch(&stp_rwlock_slot(lock)->readers, 1,
+			   __ATOMIC_RELEASE);
+}
+
+static void stp_rwlock_write_lock(stp_rwlock_t *lock)
+{
+	unsigned i, spins = 0;
+
+	while (__atomic_exchange_n(&lock->writer, 1, __ATOMIC_SEQ_CST))
+		while (__atomic_load_n(&lock->writer, __ATOMIC_RELAXED))
+			stp_rwlock_relax(&spins);
+	for (i = 0; i < STP_RWLOCK_SLOTS; ++i)
+		while (__atomic_load_n(&lock->slots[i].readers,
+				       __ATOMIC_ACQUIRE))
+			stp_rwlock_relax(&spins);
+}
+
+static void stp_rwlock_write_unlock(stp_rwlock_t *lock)
+{
+	__atomic_store_n(&lock->writer, 0, __ATOMIC_RELEASE);
+}
+
+
 static void
 stp_unlock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 {
 	unsigned i;
 	for (i = num_locks; i-- > 0;) {
-		pthread_rwlock_unlock(locks[i].lock);
+		if (locks[i].write_p)
+			stp_rwlock_write_unlock(locks[i].lock);
+		else
+			stp_rwlock_read_unlock(locks[i].lock);
 	}
 }
 
@@ -35,53 +108,15 @@ stp_unlock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 static unsigned
 stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 {
-#if 0 // XXX: should we bother with trylocks in pure userspace?
-	unsigned i, retries = 0;
-	for (i = 0; i < num_locks; ++i) {
-		if (locks[i].write_p)
-			while (!pthread_rwlock_trywrlock(locks[i].lock)) {
-#if !define(STAP_SUPRESS_TIME_LIMITS_ENABLE)
-				if (++retries > MAXTRYLOCK)
-					goto skip;
-#endif
-				#ifdef STP_TIMING
-					atomic_inc(locks[i].contention);
-				#endif
-				udelay (TRYLOCKDELAY);
-			}
-		else
-			while (!pthread_rwlock_tryrdlock(locks[i].lock)) {
-#if !define(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
-				if (++retries > MAXTRYLOCK)
-					goto skip;
-#endif
-				#ifdef STP_TIMING
-					atomic_inc(locks[i].contention);
-				#endif
-				udelay (TRYLOCKDELAY);
-			}
-	}
-	return 1;
-
-skip:
-	atomic_inc(skipped_count());
-#ifdef STP_TIMING
-	atomic_inc(locks[i].skipped);
-#endif
-	stp_unlock_probe(locks, i);
-	return 0;
-#else
 	unsigned i;
 	for (i = 0; i < num_locks; ++i) {
 		if (locks[i].write_p)
-			pthread_rwlock_wrlock(locks[i].lock);
+			stp_rwlock_write_lock(locks[i].lock);
 		else
-			pthread_rwlock_rdlock(locks[i].lock);
+			stp_rwlock_read_lock(locks[i].lock);
 	}
 	return 1;
-#endif
 }
 
 
 #endif /* _STAPDYN_PROBE_LOCK_H */
-
@@ -190,8 +190,32 @@ static void systemtap_module_exit(void);
 static inline unsigned long _stap_hash_seed(); /* see common_session_state.h */
 #define stap_hash_seed _stap_hash_seed()
 
-/* typedef pthread_rwlock_t rwlock_t; */ /* for globals */
-#define stp_rwlock_t pthread_rwlock_t /* for globals */
+/*
+ * The lock of each global, kept with it in shared memory.  It's a
+ * "big reader" lock: a reader only counts itself in the slot of its
+ * context, so that handlers that merely read a global don't all bounce
+ * one cache line between the threads.  A writer sets 'writer' and then
+ * waits for every slot to empty.  See probe_lock.h.
+ */
+#ifndef STP_RWLOCK_SLOTS
+#define STP_RWLOCK_SLOTS 16
+#endif
+#define STP_RWLOCK_CACHELINE 64
+
+struct stp_rwlock_slot {
+	int readers;
+} __attribute__((aligned(STP_RWLOCK_CACHELINE)));
+
+typedef struct {
+	int writer __attribute__((aligned(STP_RWLOCK_CACHELINE)));
+	struct stp_rwlock_slot slots[STP_RWLOCK_SLOTS];
+} stp_rwlock_t; /* for globals */
+
+static inline int stp_rwlock_init_shared(stp_rwlock_t *lock)
+{
+	memset(lock, 0, sizeof(*lock));
+	return 0;
+}
 
 static int stp_pthread_mutex_init_shared(pthread_mutex_t *mutex)
 {
@@ -249,34 +273,6 @@ err_attr:
 	return rc;
 }
 
-static int stp_pthread_rwlock_init_shared(pthread_rwlock_t *rwlock)
-{
-	int rc;
-	pthread_rwlockattr_t attr;
-
-	rc = pthread_rwlockattr_init(&attr);
-	if (rc != 0) {
-	    _stp_error("pthread_rwlockattr_init failed");
-	    return rc;
-	}
-
-	rc = pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-	if (rc != 0) {
-	    _stp_error("pthread_rwlockattr_setpshared failed");
-	    goto err_attr;
-	}
-
-	rc = pthread_rwlock_init(rwlock, &attr);
-	if (rc != 0) {
-	    _stp_error("pthread_rwlock_init failed");
-	    goto err_attr;
-	}
-
-err_attr:
-	(void)pthread_rwlockattr_destroy(&attr);
-	return rc;
-}
-
 static inline void stp_synchronize_sched(void) { }
 
 /*
@@ -362,11 +358,8 @@ static int stp_dyninst_session_init_finished(void)
 {
     _stp_shm_finalize();
 
-    /* Now that the shared memory is finalized, start the
-     * transport. If we started it before now, allocations could have
-     * caused the base address of the shared memory to move around,
-     * which would cause the addresses of the mutexes to move
-     * around. */
+    /* Now that the session is set up in shared memory, start the
+     * transport. */
     return _stp_dyninst_transport_session_start();
 }
 
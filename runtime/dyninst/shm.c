@@ -20,15 +20,38 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+/*
+ * The shared memory is one file, mapped at the same size in every process
+ * that uses it: STP_DYNINST_SHM_RESERVE bytes of address space, much more
+ * than the file holds at first.  Allocating grows the file, and since every
+ * mapping already covers the new pages, nothing ever has to be remapped or
+ * move.  So allocations aren't limited to startup, and any process can make
+ * them, serialized by the lock in the header at the start of the file.
+ *
+ * Memory is never handed out twice and new file pages read as zero, so the
+ * pages of an allocation only take up memory once they're touched.  In
+ * particular, the contexts of cpus that never run a probe cost next to
+ * nothing.
+ */
+#ifndef STP_DYNINST_SHM_RESERVE
+#define STP_DYNINST_SHM_RESERVE \
+	(sizeof(void *) > 4 ? (size_t)1 << 32 : (size_t)1 << 28)
+#endif
+
+struct _stp_shm_header {
+	pthread_mutex_t lock;
+	size_t size;		/* of the file, in whole pages */
+	size_t allocated;	/* handed out so far, including this header */
+} __attribute__((aligned(64)));
+
 static char _stp_shm_name[NAME_MAX] = { '\0' };
 static int _stp_shm_fd = -1;
-static int _stp_shm_page_size = -1;
-static off_t _stp_shm_size = 0;
-static off_t _stp_shm_allocated = 0;
+static size_t _stp_shm_page_size = 0;
 static void *_stp_shm_base = NULL;
 
 static const char *_stp_shm_init(void);
 static int _stp_shm_connect(const char *name);
+static void *_stp_shm_data(void);
 static void *_stp_shm_alloc(size_t size);
 static void *_stp_shm_zalloc(size_t size);
 static void _stp_shm_free(void *ptr);
@@ -50,6 +73,7 @@ static const char *_stp_shm_init(void)
 	long page_size;
 	int fd;
 	void *base;
+	struct _stp_shm_header *hdr;
 
 	// If we already have shared memory, carry on...
 	if (_stp_shm_base)
@@ -77,25 +101,31 @@ static const char *_stp_shm_init(void)
 	if (ftruncate(fd, page_size) < 0)
 		goto err_fd;
 
-	// Now finally map it into this process.
-	base = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
-		    MAP_SHARED, fd, 0);
+	// Now finally map it into this process, with room to grow.
+	base = mmap(NULL, STP_DYNINST_SHM_RESERVE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_NORESERVE, fd, 0);
 	if (base == MAP_FAILED)
 		goto err_fd;
 
+	hdr = base;
+	if (stp_pthread_mutex_init_shared(&hdr->lock) != 0) {
+		munmap(base, STP_DYNINST_SHM_RESERVE);
+		goto err_fd;
+	}
+	hdr->size = page_size;
+	hdr->allocated = sizeof(*hdr);
+
 	// We're done; set globals and go home!
 	strlcpy(_stp_shm_name, name, sizeof(_stp_shm_name));
 	_stp_shm_fd = fd;
 	_stp_shm_page_size = page_size;
-	_stp_shm_size = page_size;
-	_stp_shm_allocated = 0;
 	_stp_shm_base = base;
 	shm_dbug("initialized %s @ %p", _stp_shm_name, _stp_shm_base);
 	return _stp_shm_name;
 
 err_fd:
 	close(fd);
-	shm_unlink(_stp_shm_name);
+	shm_unlink(name);
 	return NULL;
 }
 
@@ -114,22 +144,28 @@ static int _stp_shm_connect(const char *name)
 	if (fd < 0)
 		rc = fd;
 
-	// Find out the shared memory's size.
-	// (This implies that the main process is done allocating.)
+	// Make sure the main process mapped it at our size.
 	if (rc == 0)
 		rc = fstat(fd, &st);
+	if (rc == 0 && (size_t) st.st_size > STP_DYNINST_SHM_RESERVE)
+		rc = -1;
 
-	// Map it into this process.
+	// Map it into this process.  The fd stays open, so that this
+	// process can grow the memory too.
 	if (rc == 0) {
-		base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
-			    MAP_SHARED, fd, 0);
+		base = mmap(NULL, STP_DYNINST_SHM_RESERVE,
+			    PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_NORESERVE, fd, 0);
 		if (base == MAP_FAILED)
 			rc = -1;
-		else
+		else {
 			_stp_shm_base = base;
+			_stp_shm_fd = fd;
+			_stp_shm_page_size = sysconf(_SC_PAGESIZE);
+		}
 	}
 
-	if (fd >= 0)
+	if (rc != 0 && fd >= 0)
 		close(fd);
 
 	if (rc == 0)
@@ -138,63 +174,67 @@ static int _stp_shm_connect(const char *name)
 }
 
 
+// The first allocation, just past the header.
+static inline void *_stp_shm_data(void)
+{
+	if (_stp_shm_base == NULL)
+		return NULL;
+	return _stp_shm_base + sizeof(struct _stp_shm_header);
+}
+
+
 // Allocate space from shared memory
 static void *_stp_shm_alloc(size_t size)
 {
-	void *alloc;
+	struct _stp_shm_header *hdr = _stp_shm_base;
+	void *alloc = NULL;
 
-	// We're not initialized or already finalized.
-	// Either way, we're not taking new requests.
-	if (_stp_shm_fd < 0)
+	// We're not initialized or connected, or already destroyed.
+	if (_stp_shm_fd < 0 || hdr == NULL)
 		return NULL;
 
 	// Round up to 8-byte aligned sizes, just to be a little safer
 	size = (size + 7) & ~7;
-	if (size <= 0)
+	if (size == 0)
 		return NULL; // either 0 requested or overflow
 
-	// Check if more memory is needed.
-	if (_stp_shm_size - _stp_shm_allocated < size) {
-		void *new_base;
+	pthread_mutex_lock(&hdr->lock);
+
+	if (size > STP_DYNINST_SHM_RESERVE - hdr->allocated)
+		goto out; // out of reserved address space
 
-		// Round up to the nearest page size
-		off_t new_size = _stp_shm_allocated + size;
+	// Check if the file needs to grow, rounded up to whole pages.  It
+	// only ever grows under the lock, so no process can shrink it
+	// under another.
+	if (hdr->size - hdr->allocated < size) {
+		size_t new_size = hdr->allocated + size;
 		new_size += _stp_shm_page_size - 1;
 		new_size /= _stp_shm_page_size;
 		new_size *= _stp_shm_page_size;
-		if (new_size < _stp_shm_allocated ||
-		    new_size - _stp_shm_allocated < size)
-			return NULL; // math overflow?
+		if (new_size > STP_DYNINST_SHM_RESERVE)
+			new_size = STP_DYNINST_SHM_RESERVE;
 
-		// Try to resize the underlying file.
 		if (ftruncate(_stp_shm_fd, new_size) < 0)
-			return NULL;
-
-		// Try to remap the address in memory.
-		new_base = mremap(_stp_shm_base, _stp_shm_size,
-				  new_size, MREMAP_MAYMOVE);
-		if (new_base == MAP_FAILED)
-			return NULL;
-
-		// Update globals
-		_stp_shm_size = new_size;
-		_stp_shm_base = new_base;
+			goto out;
+		hdr->size = new_size;
 	}
 
 	// Finally return some memory.
-	alloc = _stp_shm_base + _stp_shm_allocated;
-	_stp_shm_allocated += size;
+	alloc = _stp_shm_base + hdr->allocated;
+	hdr->allocated += size;
+
+out:
+	pthread_mutex_unlock(&hdr->lock);
 	return alloc;
 }
 
 
-// Allocate zeroed space from shared memory
+// Allocate zeroed space from shared memory.  Nothing is ever handed out
+// twice, and the file grows with zeros, so it's zeroed already -- and by
+// not writing it here, its pages stay unallocated until first used.
 static void *_stp_shm_zalloc(size_t size)
 {
-	void *ptr = _stp_shm_alloc(size);
-	if (ptr)
-		memset(ptr, 0, size);
-	return ptr;
+	return _stp_shm_alloc(size);
 }
 
 
@@ -204,16 +244,14 @@ static void _stp_shm_free(void *ptr __attribute__((unused)))
 }
 
 
-// Signal that we're done allocating in shared memory.
-// It won't be allowed to grow or move from here on out.
+// Signal that the session is set up, and other processes may connect.
+// The memory may still grow from here on, but never moves.
 static void _stp_shm_finalize(void)
 {
-	if (_stp_shm_fd >= 0) {
-		close(_stp_shm_fd);
-		_stp_shm_fd = -1;
-	}
-	shm_dbug("mapped %" PRIi64 " bytes @ %p, used %" PRIi64, _stp_shm_size,
-		 _stp_shm_base, _stp_shm_allocated);
+	struct _stp_shm_header *hdr __attribute__((unused)) = _stp_shm_base;
+
+	shm_dbug("mapped %zu bytes @ %p, used %zu", hdr->size,
+		 _stp_shm_base, hdr->allocated);
 }
 
 
@@ -224,10 +262,8 @@ static void _stp_shm_finalize(void)
 static void _stp_shm_destroy(void)
 {
 	if (_stp_shm_base) {
-		munmap(_stp_shm_base, _stp_shm_size);
+		munmap(_stp_shm_base, STP_DYNINST_SHM_RESERVE);
 		_stp_shm_base = NULL;
-		_stp_shm_size = 0;
-		_stp_shm_allocated = 0;
 	}
 
 	if (_stp_shm_fd >= 0) {
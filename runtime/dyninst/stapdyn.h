@@ -125,12 +125,34 @@ extern int stp_global_setter(const char *name, const char *value);
 int stp_dyninst_exit_status(void);
 
 
+/**** STAP 4.9 : ****/
+
+/* The handler never looks at the registers, so the probe site may call
+ * enter_dyninst_uprobe with NULL regs rather than capturing them.  */
+#define STAPDYN_PROBE_FLAG_NO_REGS	0x2
+
+/* The DWARF registers the handler reads, by bit number, so the probe
+ * site need only capture those.  All bits are set if it can't tell.  */
+extern uint64_t stp_dyninst_probe_regs(uint64_t index);
+
+/* The probe is at an SDT site, whose nop stapdyn may leave alone and have
+ * the kernel trap instead.  */
+#define STAPDYN_PROBE_FLAG_SDT		0x4
+
+/* Installs the SIGTRAP handler that runs the probes of SDT sites trapped
+ * with perf uprobe events, whose sig_data is the probe index.  Returns 0,
+ * or a negative errno.  Only defined where the handler knows how to get
+ * the registers.  */
+extern int stp_dyninst_sdt_trap_init(void);
+
+
 /**** STAP 2.x : ****/
 
 
 /* STAPDYN_PROBE_ALL_FLAGS was first added for 2.1, but is placed here so
  * it can continue to be updated with new flags too.  */
 #define STAPDYN_PROBE_ALL_FLAGS (uint64_t)(STAPDYN_PROBE_FLAG_RETURN	\
+    | STAPDYN_PROBE_FLAG_NO_REGS | STAPDYN_PROBE_FLAG_SDT		\
     | STAPDYN_PROBE_FLAG_PROC_BEGIN | STAPDYN_PROBE_FLAG_PROC_END	\
     | STAPDYN_PROBE_FLAG_THREAD_BEGIN | STAPDYN_PROBE_FLAG_THREAD_END)
 
@@ -17,6 +17,8 @@
 #include <spawn.h>
 
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #include <errno.h>
 #include <string.h>
@@ -34,9 +36,11 @@
 // that context's print and log (warning/error) buffers. There is a
 // session-wide double-buffered queue (stored in the
 // '_stp_transport_session_data' structure) where each probe can send
-// print/control messages to a fairly simple consumer thread (see
+// log/control messages to a fairly simple consumer thread (see
 // _stp_dyninst_transport_thread_func() for details). The consumer
 // thread swaps the read/write queues, then handles each request.
+// Prints don't go through that queue, but through a ring in each
+// context, so that probes in many threads don't contend for it.
 //
 // Note that there is as little as possible data copying going on. A
 // probe adds data to a print/log buffer stored in shared memory, then
@@ -64,7 +68,9 @@
 // The consumer thread waits on the 'queue_data_avail' condition
 // variable to know when more items are available. When probes add
 // items to the queue (using __stp_dyninst_transport_queue_add()),
-// 'queue_data_avail' gets set.
+// 'queue_data_avail' gets set.  Probes adding prints only take the
+// 'queue_mutex' to set it when 'consumer_waiting' says the consumer
+// is asleep.
 //
 // 
 // LOG BUFFER OVERVIEW
@@ -113,6 +119,14 @@
 // _stp_dyninst_transport_unreserve_bytes() if the bytes haven't been
 // flushed.
 //
+// A flush adds the reserved bytes to the context's 'print_items'
+// ring.  It is single-producer, single-consumer: the probe (with the
+// context locked) is the only writer of 'print_tail', the consumer
+// thread the only writer of 'print_head', so neither needs a lock to
+// add or take items.  The consumer writes out each context's items in
+// order, a contiguous run at a time.  If the ring is full, the probe
+// waits on 'print_space_avail' like for buffer space.
+//
 // If the print buffer doesn't have enough bytes available, probes
 // will flush any reserved bytes earlier than normal, then wait on the
 // 'print_space_avail' condition variable for more space to become
@@ -124,11 +138,40 @@
 // of bytes to write 'write_bytes) is only written to by the probes
 // (with a locked context).
 //
+//
+// BULK MODE OVERVIEW
+//
+// With STP_BULKMODE (stap -b), each context's prints go to a file of
+// their own, written by a thread of their own, so that the output of
+// probes in many threads isn't funneled through the single consumer
+// thread.  The writer thread takes the consumer's place on the
+// context's 'print_items' ring, and waits on the context's
+// 'print_data_avail' while 'writer_waiting' is set, the same way the
+// consumer does on 'queue_data_avail'.  Each print is written out as
+// a trace record with a 'struct _stp_trace' header, numbered per
+// context and stamped with CLOCK_MONOTONIC, like the kernel runtime's
+// percpu files, so that stap-merge can put them back together.  The
+// consumer thread still handles the log messages and the rest of the
+// queue.
+//
 ////////////////////////////////////////
 
 static pthread_t _stp_transport_thread;
 static int _stp_transport_thread_started = 0;
 
+#ifdef STP_BULKMODE
+// The writer threads and files, one for each context.
+static pthread_t *_stp_bulk_threads;
+static int *_stp_bulk_fds;
+static int _stp_bulk_threads_started = 0;
+static int _stp_bulk_stopping = 0;
+
+// How many prints a writer thread gathers for one writev().
+#ifndef STP_DYNINST_BULK_BATCH
+#define STP_DYNINST_BULK_BATCH 64
+#endif
+#endif
+
 #ifndef STP_DYNINST_TIMEOUT_SECS
 #define STP_DYNINST_TIMEOUT_SECS 5
 #endif
@@ -307,6 +350,44 @@ _stp_write_retry(int fd, const void *buf, size_t count)
 	return count;
 }
 
+#ifdef STP_BULKMODE
+// The trace record timestamp.  All the processes of a session share
+// the one clock, so records of different contexts merge sensibly.
+static inline uint64_t _stp_trace_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Like _stp_write_retry(), for an array of buffers.  The iovecs are
+// used up along the way.
+static ssize_t
+_stp_writev_retry(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t total = 0;
+	while (iovcnt > 0) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return ret;
+		}
+		total += ret;
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return total;
+}
+#endif
+
 static int
 stap_strfloctime(char *buf, size_t max, const char *fmt, time_t t)
 {
@@ -325,6 +406,182 @@ stap_strfloctime(char *buf, size_t max, const char *fmt, time_t t)
 	return (int)ret;
 }
 
+// Whether any context has prints waiting for the consumer thread.
+static int
+__stp_d_t_prints_pending(void)
+{
+#ifdef STP_BULKMODE
+	// Those are the writer threads' business.
+	return 0;
+#else
+	int i;
+	for_each_possible_cpu(i) {
+		struct context *c = stp_session_context(i);
+		if (c != NULL
+		    && (__atomic_load_n(&c->transport_data.print_tail,
+					__ATOMIC_SEQ_CST)
+			!= c->transport_data.print_head))
+			return 1;
+	}
+	return 0;
+#endif
+}
+
+// Hand the print buffer up to 'end' and the ring up to 'head' back to
+// the context's probes.
+static void
+__stp_d_t_prints_written(struct _stp_transport_context_data *data,
+			 size_t head, size_t end)
+{
+	pthread_mutex_lock(&(data->print_mutex));
+
+	// Now we need to update the read pointer. Note that we're doing
+	// this with or without that context locked, but the print_mutex
+	// is locked.
+	data->read_offset = end;
+	__atomic_store_n(&data->print_head, head, __ATOMIC_RELEASE);
+
+	// Signal more bytes available to any waiters.
+	pthread_cond_signal(&(data->print_space_avail));
+	pthread_mutex_unlock(&(data->print_mutex));
+
+	_stp_transport_debug(
+		"STP_DYN_NORMAL_DATA flushed,"
+		" read_offset %ld, write_offset %ld)\n",
+		data->read_offset, data->write_offset);
+}
+
+// Write out a context's waiting prints.  This is the consumer side of
+// the 'print_items' ring.
+static void
+__stp_d_t_write_context_prints(struct context *c, int out_fd)
+{
+	struct _stp_transport_context_data *data = &c->transport_data;
+	size_t head, tail, end = 0;
+
+	head = data->print_head;
+	tail = __atomic_load_n(&data->print_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return;
+
+#ifdef STP_BULKMODE
+	// Each print is a trace record of its own, so write out a
+	// batch of them, headers and all, at a time.
+	while (head != tail) {
+		struct _stp_trace hdrs[STP_DYNINST_BULK_BATCH];
+		struct iovec iov[2 * STP_DYNINST_BULK_BATCH];
+		int n = 0;
+
+		while (head != tail && n < STP_DYNINST_BULK_BATCH) {
+			struct _stp_transport_queue_item *item =
+				&data->print_items[head % STP_DYNINST_PRINT_ITEMS];
+
+			hdrs[n].sequence = item->sequence;
+			hdrs[n].pdu_len = item->bytes;
+			hdrs[n].timestamp = item->timestamp;
+			iov[2 * n].iov_base = &hdrs[n];
+			iov[2 * n].iov_len = sizeof(hdrs[n]);
+			iov[2 * n + 1].iov_base =
+				data->print_buf + _STP_D_T_PRINT_NORM(item->offset);
+			iov[2 * n + 1].iov_len = item->bytes;
+			end = _STP_D_T_PRINT_ADD(item->offset, item->bytes);
+			head++;
+			n++;
+		}
+
+		_stp_transport_debug("STP_DYN_NORMAL_DATA (%d records)\n", n);
+		if (_stp_writev_retry(out_fd, iov, 2 * n) < 0)
+			_stp_transport_err(
+				"couldn't write %d records of data: %s\n",
+				n, strerror(errno));
+		__stp_d_t_prints_written(data, head, end);
+	}
+#else
+	while (head != tail) {
+		struct _stp_transport_queue_item *item =
+			&data->print_items[head % STP_DYNINST_PRINT_ITEMS];
+		size_t offset = item->offset, bytes = item->bytes;
+
+		// Take along the items that follow on in the buffer, for
+		// one write.
+		head++;
+		while (head != tail) {
+			item = &data->print_items[head % STP_DYNINST_PRINT_ITEMS];
+			if (item->offset != _STP_D_T_PRINT_ADD(offset, bytes)
+			    || _STP_D_T_PRINT_NORM(item->offset) == 0)
+				break;
+			bytes += item->bytes;
+			head++;
+		}
+
+		_stp_transport_debug("STP_DYN_NORMAL_DATA"
+			" (%ld bytes at offset %ld)\n",
+			bytes, offset);
+		if (_stp_write_retry(out_fd, (data->print_buf
+				     + _STP_D_T_PRINT_NORM(offset)),
+				     bytes) < 0)
+			_stp_transport_err(
+				"couldn't write %ld bytes data: %s\n",
+				(long)bytes, strerror(errno));
+		end = _STP_D_T_PRINT_ADD(offset, bytes);
+	}
+	__stp_d_t_prints_written(data, head, end);
+#endif
+}
+
+#ifndef STP_BULKMODE
+// Write out every context's waiting prints.
+static void
+__stp_d_t_write_prints(int out_fd)
+{
+	int i;
+	for_each_possible_cpu(i) {
+		struct context *c = stp_session_context(i);
+		if (c != NULL)
+			__stp_d_t_write_context_prints(c, out_fd);
+	}
+}
+#else
+// A context's writer thread, for bulk mode.  It writes out the
+// context's prints as they come, until the transport shuts down.
+static void *
+_stp_dyninst_transport_bulk_thread_func(void *arg)
+{
+	int i = (int)(long)arg;
+	int out_fd = _stp_bulk_fds[i];
+	struct context *c = stp_session_context(i);
+	struct _stp_transport_context_data *data = &c->transport_data;
+
+	for (;;) {
+		int stopping;
+
+		pthread_mutex_lock(&(data->print_mutex));
+		// While there are no prints, wait.  Probes look at
+		// 'writer_waiting' after adding them, so either we see
+		// their prints here, or they see we're waiting and
+		// wake us.
+		__atomic_store_n(&data->writer_waiting, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&data->print_tail, __ATOMIC_SEQ_CST)
+		       == data->print_head
+		       && !__atomic_load_n(&_stp_bulk_stopping,
+					   __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&(data->print_data_avail),
+					  &(data->print_mutex));
+		__atomic_store_n(&data->writer_waiting, 0, __ATOMIC_RELAXED);
+		stopping = __atomic_load_n(&_stp_bulk_stopping,
+					   __ATOMIC_ACQUIRE);
+		pthread_mutex_unlock(&(data->print_mutex));
+
+		// Write out what there is, including, when stopping,
+		// what the last probes left behind.
+		__stp_d_t_write_context_prints(c, out_fd);
+		if (stopping)
+			break;
+	}
+	return NULL;
+}
+#endif
+
 static void *
 _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 {
@@ -335,6 +592,10 @@ _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 	if (sess_data == NULL)
 		return NULL;
 
+#ifdef STP_BULKMODE
+	// The writer threads have the output files.
+	out_fd = -1;
+#else
 	if (strlen(stp_session_attributes()->outfile_name)) {
 		char buf[PATH_MAX];
 		int rc;
@@ -355,8 +616,11 @@ _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 	}
 	else
 		out_fd = STDOUT_FILENO;
+	if (out_fd < 0)
+		return NULL;
+#endif
 	err_fd = STDERR_FILENO;
-	if (out_fd < 0 || err_fd < 0)
+	if (err_fd < 0)
 		return NULL;
 
 	while (! stopping) {
@@ -367,15 +631,22 @@ _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 		void *read_ptr;
 
 		pthread_mutex_lock(&(sess_data->queue_mutex));
-		// While there are no queue entries, wait.
+		// While there are no queue entries or prints, wait.
+		// Probes adding prints look at 'consumer_waiting' after
+		// adding them, so either we see their prints here, or
+		// they see we're waiting and wake us.
 		q = _STP_D_T_WRITE_QUEUE(sess_data);
-		while (q->items == 0) {
+		__atomic_store_n(&sess_data->consumer_waiting, 1,
+				 __ATOMIC_SEQ_CST);
+		while (q->items == 0 && !__stp_d_t_prints_pending()) {
 			// Mutex is locked. It is automatically
 			// unlocked while we are waiting.
 			pthread_cond_wait(&(sess_data->queue_data_avail),
 					  &(sess_data->queue_mutex));
 			// Mutex is locked again.
 		}
+		__atomic_store_n(&sess_data->consumer_waiting, 0,
+				 __ATOMIC_RELAXED);
 
 		// We've got data. Swap the queues and let any waiters
 		// know there is more space available.
@@ -461,44 +732,17 @@ _stp_dyninst_transport_thread_func(void *arg __attribute((unused)))
 			pthread_mutex_unlock(&(data->log_mutex));
 		}
 
-		// Handle the non-OOB data.
+		// Write out the prints, then handle the rest of the
+		// queue.  An exit request comes after the prints of
+		// the probes that were done before it.
+#ifndef STP_BULKMODE
+		__stp_d_t_write_prints(out_fd);
+#endif
+
 		for (size_t i = 0; i < q->items; i++) {
 			item = &(q->queue[i]);
 
 			switch (item->type) {
-			case STP_DYN_NORMAL_DATA:
-				_stp_transport_debug("STP_DYN_NORMAL_DATA"
-					" (%ld bytes at offset %ld)\n",
-					item->bytes, item->offset);
-				c = stp_session_context(item->data_index);
-				data = &c->transport_data;
-				read_ptr = (data->print_buf
-					    + _STP_D_T_PRINT_NORM(item->offset));
-				if (_stp_write_retry(out_fd, read_ptr, item->bytes) < 0)
-					_stp_transport_err(
-						"couldn't write %ld bytes data: %s\n",
-						(long)item->bytes, strerror(errno));
-
-				pthread_mutex_lock(&(data->print_mutex));
-
-				// Now we need to update the read
-				// pointer, using the data_index we
-				// received. Note that we're doing
-				// this with or without that context
-				// locked, but the print_mutex is
-				// locked.
-				data->read_offset = _STP_D_T_PRINT_ADD(item->offset, item->bytes);
-
-				// Signal more bytes available to any waiters.
-				pthread_cond_signal(&(data->print_space_avail));
-				pthread_mutex_unlock(&(data->print_mutex));
-
-				_stp_transport_debug(
-					"STP_DYN_NORMAL_DATA flushed,"
-					" read_offset %ld, write_offset %ld)\n",
-					data->read_offset, data->write_offset);
-				break;
-
 			case STP_DYN_EXIT:
 				_stp_transport_debug("STP_DYN_EXIT\n");
 				stopping = 1;
@@ -610,6 +854,14 @@ static int _stp_dyninst_transport_session_init(void)
 			return rc;
 		}
 
+#ifdef STP_BULKMODE
+		rc = stp_pthread_cond_init_shared(&(data->print_data_avail));
+		if (rc != 0) {
+			_stp_error("transport bulk cond variable initialization failed");
+			return rc;
+		}
+#endif
+
 		rc = stp_pthread_mutex_init_shared(&(data->log_mutex));
 		if (rc != 0) {
 			_stp_error("transport log mutex initialization failed");
@@ -626,6 +878,94 @@ static int _stp_dyninst_transport_session_init(void)
 	return 0;
 }
 
+#ifdef STP_BULKMODE
+// Open each context's output file, named like stapio's percpu files:
+// FILE_N with -o FILE, stpd_cpuN otherwise.  Then start its writer.
+static int __stp_d_t_bulk_start(void)
+{
+	const char *outfile_name = stp_session_attributes()->outfile_name;
+	int i, rc;
+
+	_stp_bulk_threads = calloc(_stp_runtime_num_contexts,
+				   sizeof(*_stp_bulk_threads));
+	_stp_bulk_fds = calloc(_stp_runtime_num_contexts,
+			       sizeof(*_stp_bulk_fds));
+	if (_stp_bulk_threads == NULL || _stp_bulk_fds == NULL) {
+		_stp_error("transport bulk mode allocation failed");
+		return -ENOMEM;
+	}
+	for (i = 0; i < _stp_runtime_num_contexts; i++)
+		_stp_bulk_fds[i] = -1;
+
+	for_each_possible_cpu(i) {
+		char buf[PATH_MAX];
+		int len = 0;
+
+		if (stp_session_context(i) == NULL)
+			continue;
+		if (strlen(outfile_name)) {
+			len = stap_strfloctime(buf, PATH_MAX, outfile_name,
+					       time(NULL));
+			if (len < 0) {
+				_stp_error("Invalid FILE name format");
+				return -EINVAL;
+			}
+		}
+		if (snprintf(buf + len, PATH_MAX - len,
+			     len ? "_%d" : "stpd_cpu%d", i) >= PATH_MAX - len) {
+			_stp_error("output file name too long");
+			return -ENAMETOOLONG;
+		}
+		_stp_bulk_fds[i] = open(buf, O_CREAT|O_TRUNC|O_WRONLY|O_CLOEXEC,
+					0666);
+		if (_stp_bulk_fds[i] < 0) {
+			_stp_error("Couldn't open output file %s: %s",
+				   buf, strerror(errno));
+			return -errno;
+		}
+
+		rc = pthread_create(&_stp_bulk_threads[i], NULL,
+				    &_stp_dyninst_transport_bulk_thread_func,
+				    (void *)(long)i);
+		if (rc != 0) {
+			close(_stp_bulk_fds[i]);
+			_stp_bulk_fds[i] = -1;
+			_stp_error("transport writer thread creation failed (%d)",
+				   rc);
+			return rc;
+		}
+	}
+	_stp_bulk_threads_started = 1;
+	return 0;
+}
+
+// Let the writer threads write out what's left, and wait for them.
+static void __stp_d_t_bulk_stop(void)
+{
+	int i;
+
+	__atomic_store_n(&_stp_bulk_stopping, 1, __ATOMIC_RELEASE);
+	for_each_possible_cpu(i) {
+		struct context *c;
+
+		if (_stp_bulk_fds == NULL || _stp_bulk_fds[i] < 0)
+			continue;
+		c = stp_session_context(i);
+		pthread_mutex_lock(&(c->transport_data.print_mutex));
+		pthread_cond_signal(&(c->transport_data.print_data_avail));
+		pthread_mutex_unlock(&(c->transport_data.print_mutex));
+		pthread_join(_stp_bulk_threads[i], NULL);
+		close(_stp_bulk_fds[i]);
+		_stp_bulk_fds[i] = -1;
+	}
+	free(_stp_bulk_threads);
+	_stp_bulk_threads = NULL;
+	free(_stp_bulk_fds);
+	_stp_bulk_fds = NULL;
+	_stp_bulk_threads_started = 0;
+}
+#endif
+
 static int _stp_dyninst_transport_session_start(void)
 {
 	int rc;
@@ -638,6 +978,13 @@ static int _stp_dyninst_transport_session_start(void)
 		return rc;
 	}
 	_stp_transport_thread_started = 1;
+
+#ifdef STP_BULKMODE
+	// And a writer for each context.
+	rc = __stp_d_t_bulk_start();
+	if (rc != 0)
+		return rc;
+#endif
 	return 0;
 }
 
@@ -655,13 +1002,12 @@ _stp_dyninst_transport_write_oob_data(char *buffer, size_t bytes)
 	return 0;
 }
 
-static int _stp_dyninst_transport_write(void)
+// Add the reserved bytes to the context's print ring. 'locked' says
+// whether the caller holds the context's 'print_mutex' already.
+static int __stp_dyninst_transport_write(struct context *c, int locked)
 {
-	// This thread should already have a context structure.
-        struct context* c = _stp_runtime_get_context();
-	if (c == NULL)
-		return 0;
 	struct _stp_transport_context_data *data = &c->transport_data;
+	struct _stp_transport_session_data *sess_data = stp_transport_data();
 	size_t bytes = data->write_bytes;
 
 	if (bytes == 0)
@@ -670,15 +1016,39 @@ static int _stp_dyninst_transport_write(void)
 	// This should be thread-safe without using any additional
 	// locking. This probe is the only one using this context and
 	// the transport thread (the consumer) only writes to
-	// 'read_offset'. Any concurrent-running probe will be using a
-	// different context.
+	// 'read_offset' and 'print_head'. Any concurrent-running probe
+	// will be using a different context.
 	_stp_transport_debug(
 		"read_offset %ld, write_offset %ld, write_bytes %ld\n",
 		data->read_offset, data->write_offset, data->write_bytes);
 
+	// If the ring is full, wait for the consumer to take some.
+	size_t tail = data->print_tail;
+	if (tail - __atomic_load_n(&data->print_head, __ATOMIC_ACQUIRE)
+	    == STP_DYNINST_PRINT_ITEMS) {
+		if (!locked)
+			pthread_mutex_lock(&(data->print_mutex));
+		while (tail - __atomic_load_n(&data->print_head,
+					      __ATOMIC_ACQUIRE)
+		       == STP_DYNINST_PRINT_ITEMS)
+			pthread_cond_wait(&(data->print_space_avail),
+					  &(data->print_mutex));
+		if (!locked)
+			pthread_mutex_unlock(&(data->print_mutex));
+	}
+
 	// Notice we're not normalizing 'write_offset'. The consumer
 	// thread needs "raw" offsets.
-	size_t saved_write_offset = data->write_offset;
+	struct _stp_transport_queue_item *item =
+		&data->print_items[tail % STP_DYNINST_PRINT_ITEMS];
+	item->type = STP_DYN_NORMAL_DATA;
+	item->data_index = c->data_index;
+	item->offset = data->write_offset;
+	item->bytes = bytes;
+#ifdef STP_BULKMODE
+	item->sequence = ++data->print_sequence;
+	item->timestamp = _stp_trace_clock();
+#endif
 	data->write_bytes = 0;
 
 	// Note that if we're writing all remaining bytes in the
@@ -686,12 +1056,37 @@ static int _stp_dyninst_transport_write(void)
 	// 0).
 	data->write_offset = _STP_D_T_PRINT_ADD(data->write_offset, bytes);
 
-	__stp_dyninst_transport_queue_add(STP_DYN_NORMAL_DATA,
-					  c->data_index,
-					  saved_write_offset, bytes);
+	// Publish the item, then wake the consumer if it's asleep.
+	__atomic_store_n(&data->print_tail, tail + 1, __ATOMIC_SEQ_CST);
+#ifdef STP_BULKMODE
+	(void) sess_data;
+	if (__atomic_load_n(&data->writer_waiting, __ATOMIC_SEQ_CST)) {
+		if (!locked)
+			pthread_mutex_lock(&(data->print_mutex));
+		pthread_cond_signal(&(data->print_data_avail));
+		if (!locked)
+			pthread_mutex_unlock(&(data->print_mutex));
+	}
+#else
+	if (sess_data != NULL
+	    && __atomic_load_n(&sess_data->consumer_waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&(sess_data->queue_mutex));
+		pthread_cond_signal(&(sess_data->queue_data_avail));
+		pthread_mutex_unlock(&(sess_data->queue_mutex));
+	}
+#endif
 	return 0;
 }
 
+static int _stp_dyninst_transport_write(void)
+{
+	// This thread should already have a context structure.
+        struct context* c = _stp_runtime_get_context();
+	if (c == NULL)
+		return 0;
+	return __stp_dyninst_transport_write(c, 0);
+}
+
 static void _stp_dyninst_transport_shutdown(void)
 {
 	// If we started the thread, tear everything down.
@@ -706,6 +1101,12 @@ static void _stp_dyninst_transport_shutdown(void)
 	pthread_join(_stp_transport_thread, NULL);
 	_stp_transport_thread_started = 0;
 
+#ifdef STP_BULKMODE
+	// The writer threads go after it, with any prints the last
+	// messages flushed out.
+	__stp_d_t_bulk_stop();
+#endif
+
 	// Tear down the transport session data.
 	struct _stp_transport_session_data *sess_data = stp_transport_data();
 	if (sess_data != NULL) {
@@ -725,6 +1126,9 @@ static void _stp_dyninst_transport_shutdown(void)
 		data = &c->transport_data;
 		pthread_mutex_destroy(&(data->print_mutex));
 		pthread_cond_destroy(&(data->print_space_avail));
+#ifdef STP_BULKMODE
+		pthread_cond_destroy(&(data->print_data_avail));
+#endif
 		pthread_mutex_destroy(&(data->log_mutex));
 		pthread_cond_destroy(&(data->log_space_avail));
 	}
@@ -872,7 +1276,7 @@ recheck:
 			// possible for the consumer thread to signal
 			// the condition variable before we were
 			// waiting on it.)
-			_stp_dyninst_transport_write();
+			__stp_dyninst_transport_write(c, 1);
 
 			// Mutex is locked. It is automatically
 			// unlocked while we are waiting.
@@ -51,6 +51,12 @@
 #define STP_DYNINST_QUEUE_ITEMS 64
 #endif
 
+// The maximum number of flushed prints each context can have waiting
+// to be written out.
+#ifndef STP_DYNINST_PRINT_ITEMS
+#define STP_DYNINST_PRINT_ITEMS 256
+#endif
+
 struct _stp_transport_queue_item {
 	// The type variable lets the thread know what it needs to do.
 	unsigned type;
@@ -66,6 +72,13 @@ struct _stp_transport_queue_item {
 	// When 'type' indicates that normal or oob data needs to be
 	// output, this is the number of bytes to output.
 	size_t bytes;
+
+#ifdef STP_BULKMODE
+	// For prints in bulk mode, the stamps of the trace record
+	// header written out ahead of the bytes, for stap-merge.
+	uint32_t sequence;
+	uint64_t timestamp;
+#endif
 };
 
 struct _stp_transport_queue {
@@ -80,6 +93,8 @@ struct _stp_transport_session_data {
 	pthread_mutex_t queue_mutex;
 	pthread_cond_t queue_space_avail;
 	pthread_cond_t queue_data_avail;
+	/* Set while the consumer thread waits on 'queue_data_avail'. */
+	int consumer_waiting;
 };
 
 // This structure is stored in every context structure.
@@ -89,10 +104,30 @@ struct _stp_transport_context_data {
 	size_t write_offset;
 	size_t write_bytes;
 	char print_buf[_STP_DYNINST_BUFFER_SIZE];
+	/*
+	 * The flushed parts of 'print_buf' not yet written out, as a
+	 * ring that only this context's probes add to (at 'print_tail')
+	 * and only the consumer thread takes from (at 'print_head').
+	 * Both count up without wrapping.
+	 */
+	size_t print_head;
+	size_t print_tail;
+	struct _stp_transport_queue_item print_items[STP_DYNINST_PRINT_ITEMS];
 	/* The condition variable is used to signal our thread. */
 	pthread_cond_t print_space_avail;
 	/* The lock for this print state. */
 	pthread_mutex_t print_mutex;
+#ifdef STP_BULKMODE
+	/*
+	 * In bulk mode, each context has a writer thread of its own,
+	 * which takes the place of the consumer thread for prints.
+	 * 'print_sequence' numbers this context's trace records.
+	 */
+	uint32_t print_sequence;
+	/* Set while the writer thread waits on 'print_data_avail'. */
+	int writer_waiting;
+	pthread_cond_t print_data_avail;
+#endif
 
 	/*
 	 * The buffer and variables used for log (warn/error)
@@ -123,4 +123,151 @@ enter_dyninst_uprobe_regs(uint64_t index, unsigned long nregs, ...)
         return enter_dyninst_uprobe(index, &regs);
 }
 
+
+/* SDT sites that stapdyn has the kernel trap, rather than patching them,
+ * come here by way of a perf uprobe event with sigtrap set.  The signal
+ * arrives once the site's nop has run, so the registers are all there in
+ * the signal context, with the IP just past the nop.  */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STP_SDT_NOP_LEN 1
+#elif defined(__powerpc64__) || defined(__aarch64__)
+#define STP_SDT_NOP_LEN 4
+#endif
+
+#ifdef STP_SDT_NOP_LEN
+
+#include <signal.h>
+#include <ucontext.h>
+
+#ifndef TRAP_PERF
+#define TRAP_PERF 6
+#endif
+
+/* Older C libraries don't name the TRAP_PERF fields, which follow the
+ * fault address.  */
+#ifndef si_perf_data
+#define _stp_si_perf_data(si) \
+	(*(unsigned long *)((char *)&(si)->si_addr + sizeof(void *)))
+#define _stp_si_perf_type(si) \
+	(*(uint32_t *)((char *)&(si)->si_addr + 2 * sizeof(void *)))
+#else
+#define _stp_si_perf_data(si) ((si)->si_perf_data)
+#define _stp_si_perf_type(si) ((si)->si_perf_type)
+#endif
+
+static struct sigaction _stp_sdt_trap_oldact;
+static int _stp_sdt_trap_pmu = -1;
+
+static void
+_stp_sdt_trap_regs(struct pt_regs *regs, const ucontext_t *uc)
+{
+#if defined(__x86_64__)
+	const greg_t *g = uc->uc_mcontext.gregs;
+	regs->r15 = g[REG_R15];
+	regs->r14 = g[REG_R14];
+	regs->r13 = g[REG_R13];
+	regs->r12 = g[REG_R12];
+	regs->rbp = g[REG_RBP];
+	regs->rbx = g[REG_RBX];
+	regs->r11 = g[REG_R11];
+	regs->r10 = g[REG_R10];
+	regs->r9 = g[REG_R9];
+	regs->r8 = g[REG_R8];
+	regs->rax = g[REG_RAX];
+	regs->rcx = g[REG_RCX];
+	regs->rdx = g[REG_RDX];
+	regs->rsi = g[REG_RSI];
+	regs->rdi = g[REG_RDI];
+	regs->rip = g[REG_RIP];
+	regs->eflags = g[REG_EFL];
+	regs->rsp = g[REG_RSP];
+#elif defined(__i386__)
+	const greg_t *g = uc->uc_mcontext.gregs;
+	regs->ebx = g[REG_EBX];
+	regs->ecx = g[REG_ECX];
+	regs->edx = g[REG_EDX];
+	regs->esi = g[REG_ESI];
+	regs->edi = g[REG_EDI];
+	regs->ebp = g[REG_EBP];
+	regs->eax = g[REG_EAX];
+	regs->eip = g[REG_EIP];
+	regs->eflags = g[REG_EFL];
+	regs->esp = g[REG_UESP];
+#elif defined(__powerpc64__)
+	for (unsigned long r = 0; r < 32; ++r)
+		regs->gpr[r] = uc->uc_mcontext.gp_regs[r];
+	regs->nip = uc->uc_mcontext.gp_regs[PT_NIP];
+	regs->link = uc->uc_mcontext.gp_regs[PT_LNK];
+	regs->ctr = uc->uc_mcontext.gp_regs[PT_CTR];
+#elif defined(__aarch64__)
+	for (unsigned long r = 0; r < 31; ++r)
+		regs->regs[r] = uc->uc_mcontext.regs[r];
+	regs->sp = uc->uc_mcontext.sp;
+	regs->pc = uc->uc_mcontext.pc;
+	regs->pstate = uc->uc_mcontext.pstate;
+#endif
+	/* Report the site itself, as a patched probe would.  */
+	SET_REG_IP(regs, REG_IP(regs) - STP_SDT_NOP_LEN);
+}
+
+static void
+_stp_sdt_trap(int sig, siginfo_t *si, void *ctx)
+{
+	if (si->si_code == TRAP_PERF
+	    && _stp_si_perf_type(si) == (uint32_t)_stp_sdt_trap_pmu
+	    && _stp_si_perf_data(si) < stp_dyninst_probe_count()) {
+		struct pt_regs regs = {};
+		int saved_errno = errno;
+
+		_stp_sdt_trap_regs(&regs, ctx);
+		enter_dyninst_uprobe(_stp_si_perf_data(si), &regs);
+		errno = saved_errno;
+		return;
+	}
+
+	/* Not ours: pass it on to whoever had SIGTRAP before us.  */
+	if (_stp_sdt_trap_oldact.sa_flags & SA_SIGINFO)
+		_stp_sdt_trap_oldact.sa_sigaction(sig, si, ctx);
+	else if (_stp_sdt_trap_oldact.sa_handler == SIG_DFL) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	}
+	else if (_stp_sdt_trap_oldact.sa_handler != SIG_IGN)
+		_stp_sdt_trap_oldact.sa_handler(sig);
+}
+
+int
+stp_dyninst_sdt_trap_init(void)
+{
+	struct sigaction sa;
+	FILE *f;
+
+	if (_stp_sdt_trap_pmu >= 0)
+		return 0;
+
+	/* The kernel's uprobe PMU, to tell our traps from others.  */
+	f = fopen("/sys/bus/event_source/devices/uprobe/type", "r");
+	if (f == NULL)
+		return -errno;
+	if (fscanf(f, "%d", &_stp_sdt_trap_pmu) != 1)
+		_stp_sdt_trap_pmu = -1;
+	fclose(f);
+	if (_stp_sdt_trap_pmu < 0)
+		return -ENODEV;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = _stp_sdt_trap;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGTRAP, &sa, &_stp_sdt_trap_oldact) < 0) {
+		int rc = -errno;
+		_stp_sdt_trap_pmu = -1;
+		return rc;
+	}
+	return 0;
+}
+
+#endif /* STP_SDT_NOP_LEN */
+
 #endif /* _UPROBES_REGS_DYNINST_C_ */
@@ -71,5 +71,12 @@ uint64_t stp_dyninst_probe_flags(uint64_t index)
 	return stapdu_probes[index].flags;
 }
 
+uint64_t stp_dyninst_probe_regs(uint64_t index)
+{
+	if (index >= stp_dyninst_probe_count())
+		return (uint64_t)-1;
+	return stapdu_probes[index].regs;
+}
+
 #endif /* _UPROBES_DYNINST_C_ */
 
@@ -27,6 +27,7 @@ struct stapdu_probe {
 	uint64_t offset; /* the probe offset within the file */
 	uint64_t semaphore; /* the sdt semaphore offset within the file */
 	uint64_t flags; /* a mask of STAPDYN_PROBE_FLAG_* */
+	uint64_t regs; /* a mask of the DWARF registers the handler reads */
 	const struct stap_probe * const probe;
 };
 
@@ -0,0 +1,121 @@
+/* -*- linux-c -*-
+ * Hardware floating point for the floatingpoint tapset
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STP_FPU_C_
+#define _STP_FPU_C_
+
+/** @file fpu.c
+ * @brief SSE2 arithmetic for fp_add() and friends, where allowed
+ *
+ * softfloat takes dozens of times as long as the FPU for each operation.
+ * On x86_64, fp_add(), fp_sub(), fp_mul(), fp_div() and fp_sqrt() each
+ * do their operation inside a kernel_fpu_begin() region of its own, if
+ * the context allows one, so that preemption is only held off for the
+ * operation itself.  The task's FPU state is saved by the first region
+ * after a switch and restored on the way back to user space, so the
+ * later regions of a handler cost little.
+ *
+ * Where the FPU can't be used, as in NMIs, and with NaN operands, whose
+ * propagation softfloat does its own way, the operations are left to
+ * softfloat.  The results are otherwise the same: both round to
+ * nearest even, and an invalid operation gives softfloat's default NaN.
+ */
+
+#if defined(__KERNEL__) && defined(__x86_64__) \
+    && defined(STAPCONF_KERNEL_FPU_API) && !defined(STP_NO_FPU)
+
+#define STP_FPU 1
+
+#include <asm/fpu/api.h>
+
+#define _STP_FPU_NAN(v) (((v) & ~(1ULL << 63)) > 0x7ff0000000000000ULL)
+#define _STP_FPU_DEFAULT_NAN 0x7ff8000000000000ULL /* defaultNaNF64UI */
+
+/** Enters an FPU region for one operation.  Returns 0 if the FPU can't
+ * be used here.
+ */
+static inline int _stp_fpu_begin(void)
+{
+	static const u32 mxcsr = 0x1f80; /* nearest even, all masked */
+
+	if (in_nmi() || !irq_fpu_usable())
+		return 0;
+
+	kernel_fpu_begin();
+	/* Older kernels leave the task's own control word in place. */
+	asm volatile("ldmxcsr %0" : : "m" (mxcsr));
+	return 1;
+}
+
+static inline void _stp_fpu_end(void)
+{
+	kernel_fpu_end();
+}
+
+/* The kernel is built without SSE, so the operations are done in
+   functions of their own that may use it.  Their "x" operands let the
+   compiler pick the xmm registers and know which ones they take; they
+   are only called inside an FPU region. */
+#define _STP_FPU_SSE2 __attribute__((target("sse2"))) noinline notrace
+
+#define _STP_FPU_FN2(name, insn)					\
+static _STP_FPU_SSE2 uint64_t _stp_fpu_##name##_sse2(uint64_t a, uint64_t b) \
+{									\
+	asm(insn " %1, %0" : "+x" (a) : "x" (b));			\
+	return a;							\
+}									\
+									\
+static inline int _stp_fpu_##name(uint64_t a, uint64_t b, uint64_t *r)	\
+{									\
+	uint64_t v;							\
+	if (_STP_FPU_NAN(a) || _STP_FPU_NAN(b) || !_stp_fpu_begin())	\
+		return 0;						\
+	v = _stp_fpu_##name##_sse2(a, b);				\
+	_stp_fpu_end();							\
+	*r = _STP_FPU_NAN(v) ? _STP_FPU_DEFAULT_NAN : v;		\
+	return 1;							\
+}
+
+_STP_FPU_FN2(add, "addsd")
+_STP_FPU_FN2(sub, "subsd")
+_STP_FPU_FN2(mul, "mulsd")
+_STP_FPU_FN2(div, "divsd")
+
+static _STP_FPU_SSE2 uint64_t _stp_fpu_sqrt_sse2(uint64_t a)
+{
+	uint64_t v;
+
+	asm("sqrtsd %1, %0" : "=x" (v) : "x" (a));
+	return v;
+}
+
+static inline int _stp_fpu_sqrt(uint64_t a, uint64_t *r)
+{
+	uint64_t v;
+
+	if (_STP_FPU_NAN(a) || !_stp_fpu_begin())
+		return 0;
+	v = _stp_fpu_sqrt_sse2(a);
+	_stp_fpu_end();
+	*r = _STP_FPU_NAN(v) ? _STP_FPU_DEFAULT_NAN : v;
+	return 1;
+}
+
+#else /* no FPU: always softfloat */
+
+#define _stp_fpu_add(a, b, r) 0
+#define _stp_fpu_sub(a, b, r) 0
+#define _stp_fpu_mul(a, b, r) 0
+#define _stp_fpu_div(a, b, r) 0
+#define _stp_fpu_sqrt(a, r) 0
+
+#endif
+
+#endif /* _STP_FPU_C_ */
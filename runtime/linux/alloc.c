@@ -47,6 +47,30 @@ static long _stp_allocated_net_memory = 0;
 
 static long _stp_allocated_memory = 0;
 
+#ifdef CONFIG_NUMA
+/* The part of _stp_allocated_memory that the _node allocators placed
+ * on each node, for the summary of _stp_print_kernel_info(). */
+static long _stp_allocated_node_memory[MAX_NUMNODES];
+
+static inline void _stp_account_node_memory(int node, size_t size)
+{
+	if (node >= 0 && node < MAX_NUMNODES)
+		_stp_allocated_node_memory[node] += size;
+}
+
+/* The percpu allocator places each cpu's copy on that cpu's node. */
+static inline void _stp_account_percpu_memory(size_t size)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		_stp_account_node_memory(cpu_to_node(cpu), size);
+}
+#else
+#define _stp_account_node_memory(node, size) do { } while (0)
+#define _stp_account_percpu_memory(size) do { } while (0)
+#endif
+
 #ifdef DEBUG_MEM
 static STP_DEFINE_SPINLOCK(_stp_mem_lock);
 
@@ -432,12 +456,14 @@ static void *_stp_vzalloc_node(size_t size, int node)
 	ret = vzalloc_node(size + MEM_DEBUG_SIZE, node);
 	if (likely(ret)) {
 	        _stp_allocated_memory += size;
+		_stp_account_node_memory(node, size);
 		ret = _stp_mem_debug_setup(ret, size, MEM_VMALLOC);
 	}
 #else
 	ret = vzalloc_node(size, node);
 	if (likely(ret)) {
 	        _stp_allocated_memory += size;
+		_stp_account_node_memory(node, size);
 	}
 #endif
 	return ret;
@@ -478,11 +504,13 @@ static void *_stp_alloc_percpu(size_t size)
 			return NULL;
 		}
 	        _stp_allocated_memory += size * num_possible_cpus();
+		_stp_account_percpu_memory(size);
 		_stp_mem_debug_percpu(m, ret, size);
 	}
 #else
 	if (likely(ret)) {
 	        _stp_allocated_memory += size * num_possible_cpus();
+		_stp_account_percpu_memory(size);
 	}
 #endif
 	return ret;
@@ -510,12 +538,14 @@ static void *_stp_kmalloc_node_gfp(size_t size, int node, gfp_t gfp_mask)
 	ret = kmalloc_node(size + MEM_DEBUG_SIZE, gfp_mask, node);
 	if (likely(ret)) {
 	        _stp_allocated_memory += size;
+		_stp_account_node_memory(node, size);
 		ret = _stp_mem_debug_setup(ret, size, MEM_KMALLOC);
 	}
 #else
 	ret = kmalloc_node(size, gfp_mask, node);
 	if (likely(ret)) {
 	        _stp_allocated_memory += size;
+		_stp_account_node_memory(node, size);
 	}
 #endif
 	return ret;
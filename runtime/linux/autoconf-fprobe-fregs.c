@@ -0,0 +1,14 @@
+#include <linux/fprobe.h>
+
+/* fprobe exit handlers get ftrace_regs, from which pt_regs are made */
+static void
+stapkp_test_exit(struct fprobe *fp, unsigned long entry_ip,
+		 unsigned long ret_ip, struct ftrace_regs *fregs, void *data)
+{
+  struct pt_regs regs;
+  (void) ftrace_partial_regs(fregs, &regs);
+}
+
+struct fprobe stapkp_test_fprobe = {
+  .exit_handler = stapkp_test_exit,
+};
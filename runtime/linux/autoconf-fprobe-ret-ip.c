@@ -0,0 +1,13 @@
+#include <linux/fprobe.h>
+
+/* fprobe exit handlers get the return address and pt_regs, 6.5+ */
+static void
+stapkp_test_exit(struct fprobe *fp, unsigned long entry_ip,
+		 unsigned long ret_ip, struct pt_regs *regs, void *data)
+{
+}
+
+struct fprobe stapkp_test_fprobe = {
+  .exit_handler = stapkp_test_exit,
+  .nr_maxactive = 1,
+};
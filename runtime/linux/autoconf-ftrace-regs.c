@@ -0,0 +1,14 @@
+#include <linux/ftrace.h>
+
+/* ftrace callbacks get struct ftrace_regs rather than pt_regs, 5.11+ */
+static void notrace
+stapkp_test_callback(unsigned long ip, unsigned long parent_ip,
+		     struct ftrace_ops *op, struct ftrace_regs *fregs)
+{
+  (void) ftrace_get_regs(fregs);
+}
+
+struct ftrace_ops stapkp_test_ops = {
+  .func = stapkp_test_callback,
+  .flags = FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_RECURSION,
+};
@@ -0,0 +1,16 @@
+/*
+ * Does the kernel have irq_work, for deferring work out of probe
+ * context?  (since 2.6.37)
+ */
+
+#include <linux/irq_work.h>
+
+static void foo_work_fn (struct irq_work *work) { }
+
+void foo (void)
+{
+  static struct irq_work work;
+  init_irq_work (&work, foo_work_fn);
+  irq_work_queue (&work);
+  irq_work_sync (&work);
+}
@@ -0,0 +1,15 @@
+/*
+ * Can modules use the FPU between kernel_fpu_begin() and
+ * kernel_fpu_end(), with <asm/fpu/api.h>?  (x86, since 4.2)
+ */
+
+#include <asm/fpu/api.h>
+
+int foo (void)
+{
+  if (!irq_fpu_usable ())
+    return 0;
+  kernel_fpu_begin ();
+  kernel_fpu_end ();
+  return 1;
+}
@@ -0,0 +1,96 @@
+/* -*- linux-c -*-
+ * Probe and function hit counts for the coverage database
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _COVERAGE_C_
+#define _COVERAGE_C_
+
+/** @file coverage.c
+ * @brief Probe and function hit counts, with -DSTP_COVERAGE
+ *
+ * Each cpu counts the hits of every probe handler and the calls of
+ * every script function in a row of its own, with plain increments,
+ * so the counting costs about as much as a local variable.  The rows
+ * are summed up only once, at exit, into a coverage report that stap
+ * -q adds to the coverage database.
+ */
+
+#ifdef STP_COVERAGE
+
+/* Probes first, then functions, STP_COVERAGE_COUNT for each cpu. */
+#define STP_COVERAGE_COUNT (STP_PROBE_COUNT + STP_FUNCTION_COUNT)
+
+static unsigned long *_stp_coverage_counts;
+
+/** Counts a hit of probe @index, or a call of function
+ * STP_PROBE_COUNT + @index.  Called with preemption disabled.
+ */
+static inline void _stp_coverage_hit(size_t index)
+{
+	if (likely(_stp_coverage_counts != NULL))
+		_stp_coverage_counts[raw_smp_processor_id()
+				     * STP_COVERAGE_COUNT + index]++;
+}
+
+static unsigned long _stp_coverage_sum(size_t index)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += _stp_coverage_counts[cpu * STP_COVERAGE_COUNT + index];
+	return sum;
+}
+
+/** Allocates the counters.  Returns non-zero on error. */
+static int _stp_coverage_init(void)
+{
+	_stp_coverage_counts = _stp_vzalloc(nr_cpu_ids * STP_COVERAGE_COUNT
+					    * sizeof(*_stp_coverage_counts));
+	return _stp_coverage_counts == NULL ? -ENOMEM : 0;
+}
+
+/** Prints the hits, once no probe handler can run anymore, in the
+ * format of the -t probe hit report. */
+static void _stp_coverage_report(void)
+{
+	size_t i;
+
+	if (_stp_coverage_counts == NULL)
+		return;
+	_stp_printf("----- coverage report:\n");
+	for (i = 0; i < STP_PROBE_COUNT; i++) {
+		unsigned long hits = _stp_coverage_sum(i);
+
+		if (hits)
+			_stp_printf("%s, (%s), hits: %lu\n", stap_probes[i].pp,
+				    stap_probes[i].location, hits);
+	}
+	for (i = 0; i < STP_FUNCTION_COUNT; i++) {
+		unsigned long calls = _stp_coverage_sum(STP_PROBE_COUNT + i);
+
+		if (calls)
+			_stp_printf("%s(), (%s), calls: %lu\n",
+				    stp_coverage_functions[i].name,
+				    stp_coverage_functions[i].location, calls);
+	}
+	_stp_print_flush();
+}
+
+static void _stp_coverage_exit(void)
+{
+	if (_stp_coverage_counts == NULL)
+		return;
+	_stp_vfree(_stp_coverage_counts);
+	_stp_coverage_counts = NULL;
+}
+
+#endif /* STP_COVERAGE */
+
+#endif /* _COVERAGE_C_ */
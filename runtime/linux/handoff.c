@@ -0,0 +1,168 @@
+/* -*- linux-c -*-
+ * Handing the globals of a session over to the next one
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _HANDOFF_C_
+#define _HANDOFF_C_
+
+/** @file handoff.c
+ * @brief The "state" file of a stap --handoff module
+ *
+ * Reading the "state" file of the transport gives a snapshot of the
+ * script's globals, one line per scalar or array element:
+ *
+ *	NAME SIG [KEY...] VALUE
+ *
+ * where SIG is the keysym of the global ("i" for a number, "s" for a
+ * string, "is" for an array of strings indexed by numbers, ...), numbers
+ * are in decimal, and strings are an 'x' and the hex of their bytes.
+ * Statistics are listed as just "NAME x", as they are not carried over.
+ *
+ * Writing such a line to the "state" file of another module sets that
+ * global, or fails with ENOENT if it has no global of that name, EINVAL
+ * if it is of another type, EOPNOTSUPP if it is a statistic, ENOSPC if
+ * the array is full, and EBADMSG if the line is garbled.  A write must
+ * hold exactly one line.  staprun -O does the copying, while the probes
+ * of both modules are held off by __handoff_enabled; see handoff_mode()
+ * in elaborate.cxx.
+ */
+
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+/* The longest line a write may hold: nine keys and a value, all strings. */
+#define STP_HANDOFF_LINE_MAX (10 * (2 * MAXSTRINGLEN + 2) + 256)
+
+/* Generated by the translator, after the globals. */
+static void _stp_handoff_export(struct seq_file *m);
+static int _stp_handoff_import(char *line);
+
+/* The parsed keys and value of the line being imported; the writes are
+   serialized by module_refresh_mutex. */
+static char _stp_handoff_strs[10][MAXSTRINGLEN];
+static int64_t _stp_handoff_ints[10];
+
+static void _stp_handoff_put_int(struct seq_file *m, int64_t v)
+{
+	seq_printf(m, " %lld", (long long) v);
+}
+
+static void _stp_handoff_put_str(struct seq_file *m, const char *s)
+{
+	seq_puts(m, " x");
+	for (; s && *s; s++)
+		seq_printf(m, "%02x", (unsigned char) *s);
+}
+
+/* Cuts the next space-separated word off *P, or returns NULL at the end. */
+static char *_stp_handoff_word(char **p)
+{
+	char *w = *p, *e;
+
+	if (*w == '\0')
+		return NULL;
+	e = strchr(w, ' ');
+	if (e) {
+		*e = '\0';
+		*p = e + 1;
+	} else
+		*p = w + strlen(w);
+	return w;
+}
+
+static int _stp_handoff_get_int(char **p, int64_t *v)
+{
+	char *w = _stp_handoff_word(p);
+	char *endp;
+
+	if (w == NULL)
+		return -EBADMSG;
+	/* simple_strtoll isn't exported, see also runtime.h */
+	if (*w == '-')
+		*v = -simple_strtoull(w + 1, &endp, 10);
+	else
+		*v = simple_strtoull(w, &endp, 10);
+	return (endp == w || *endp != '\0') ? -EBADMSG : 0;
+}
+
+static int _stp_handoff_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+/* Strings longer than this module's MAXSTRINGLEN are cut short, as an
+   assignment would. */
+static int _stp_handoff_get_str(char **p, char *s)
+{
+	char *w = _stp_handoff_word(p);
+	unsigned i = 0;
+
+	if (w == NULL || *w++ != 'x')
+		return -EBADMSG;
+	for (; w[0] && w[1]; w += 2) {
+		int hi = _stp_handoff_nibble(w[0]);
+		int lo = _stp_handoff_nibble(w[1]);
+		if (hi < 0 || lo < 0)
+			return -EBADMSG;
+		if (i < MAXSTRINGLEN - 1)
+			s[i++] = (hi << 4) | lo;
+	}
+	s[i] = '\0';
+	return w[0] ? -EBADMSG : 0;
+}
+
+static int _stp_handoff_show(struct seq_file *m, void *v)
+{
+	/* As in _stp_session_stats_show(), the mutex keeps the globals
+	   from being freed under us while the session is RUNNING. */
+	mutex_lock(&module_refresh_mutex);
+	if (atomic_read(session_state()) == STAP_SESSION_RUNNING)
+		_stp_handoff_export(m);
+	mutex_unlock(&module_refresh_mutex);
+	return 0;
+}
+
+static ssize_t _stp_handoff_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	char *line;
+	int rc;
+
+	if (count == 0)
+		return 0;
+	if (count > STP_HANDOFF_LINE_MAX)
+		return -E2BIG;
+
+	line = kmalloc(count + 1, GFP_KERNEL);
+	if (line == NULL)
+		return -ENOMEM;
+	if (copy_from_user(line, buf, count)) {
+		kfree(line);
+		return -EFAULT;
+	}
+	line[count] = '\0';
+	if (line[count - 1] == '\n')
+		line[count - 1] = '\0';
+
+	mutex_lock(&module_refresh_mutex);
+	if (atomic_read(session_state()) == STAP_SESSION_RUNNING)
+		rc = _stp_handoff_import(line);
+	else
+		rc = -EBUSY;
+	mutex_unlock(&module_refresh_mutex);
+
+	kfree(line);
+	return rc ? rc : count;
+}
+
+#endif /* _HANDOFF_C_ */
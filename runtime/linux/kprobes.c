@@ -57,6 +57,47 @@ extern void *_stp_kallsyms_on_each_symbol;
 #define KRETACTIVE (max(15, 6 * (int)num_possible_cpus()))
 #endif
 
+// Number of probes registered by one register_k[ret]probes() call.
+#ifndef STP_KPROBES_BATCH
+#define STP_KPROBES_BATCH 64
+#endif
+
+// With STP_KPROBES_ASYNC, stapkp_init() only queues the arming of the
+// probes to a workqueue, so that the begin probes run right away and the
+// kprobes come online a batch at a time.
+#ifdef STP_KPROBES_ASYNC
+#include <linux/workqueue.h>
+#endif
+
+#if defined(STAPCONF_UNREGISTER_KPROBES) && !defined(__ia64__)
+#define STAPKP_BATCH_REGISTER
+#endif
+
+// Function entry probes the translator found eligible (.fentry_p) are
+// hooked with one ftrace_ops rather than with kprobes, unless
+// STP_NO_FENTRY is defined.  Those ftrace won't take fall back to kprobes.
+#if defined(STP_KPROBES_FENTRY_MAX) && !defined(STP_NO_FENTRY) \
+      && defined(STAPCONF_FTRACE_SET_FILTER_IP) \
+      && defined(CONFIG_DYNAMIC_FTRACE_WITH_REGS)
+#define STAPKP_FENTRY
+#endif
+
+// Likewise, eligible return probes are hooked with one fprobe, whose exit
+// handlers share one pool of return instances instead of a maxactive-sized
+// one per kretprobe, unless STP_NO_FEXIT is defined.
+#if defined(STP_KPROBES_FEXIT_MAX) && !defined(STP_NO_FEXIT) \
+      && defined(STAPCONF_FTRACE_SET_FILTER_IP) && defined(STAPCONF_FPROBE) \
+      && (defined(STAPCONF_FPROBE_RET_IP) || defined(STAPCONF_FPROBE_FREGS))
+#define STAPKP_FEXIT
+#include <linux/fprobe.h>
+#endif
+
+#include <linux/sort.h>
+
+#if defined(STAPKP_FENTRY) || defined(STAPKP_FEXIT)
+#include <linux/ftrace.h>
+#endif
+
 // This shouldn't happen, but check as a precaution. If we're on kver >= 2.6.30,
 // then we must also have STP_ON_THE_FLY_TIMER_ENABLE (which is turned on for
 // kver >= 2.6.17, see translate_pass()). This indicates that the background
@@ -83,7 +124,9 @@ struct stap_kprobe_probe {
    const unsigned return_p:1;
    const unsigned maxactive_p:1;
    const unsigned optional_p:1;
+   const unsigned fentry_p:1;
    unsigned registered_p:1;
+   unsigned fentry_armed_p:1;	// hooked through ftrace or fprobe
    const unsigned short maxactive_val;
 
    // data saved in the kretprobe_instance packet
@@ -120,6 +163,16 @@ enter_kprobe_probe(struct kprobe *inst,
 static int
 enter_kretprobe_common(struct kretprobe_instance *inst,
                        struct pt_regs *regs, int entry);
+#ifdef STAPKP_FENTRY
+static void
+enter_fentry_probe(struct stap_kprobe_probe *skp, unsigned long addr,
+                   struct pt_regs *regs);
+#endif
+#ifdef STAPKP_FEXIT
+static void
+enter_fexit_probe(struct stap_kprobe_probe *skp, unsigned long ret_ip,
+                  struct pt_regs *regs);
+#endif
 
 // Helper entry functions for kretprobes
 static int
@@ -602,12 +655,17 @@ stapkp_enabled(struct stap_kprobe_probe *skp)
 }
 
 
+// A probe of probe_throttle.c on hold is kept disarmed too.
+#ifndef _stp_probe_enabled
+#define _stp_probe_enabled(p) ((p)->cond_enabled)
+#endif
+
 static int
 stapkp_should_enable_probe(struct stap_kprobe_probe *skp)
 {
    return  skp->registered_p
        && !stapkp_enabled(skp)
-       &&  skp->probe->cond_enabled;
+       &&  _stp_probe_enabled(skp->probe);
 }
 
 
@@ -637,7 +695,7 @@ stapkp_should_disable_probe(struct stap_kprobe_probe *skp)
 {
    return  skp->registered_p
        &&  stapkp_enabled(skp)
-       && !skp->probe->cond_enabled;
+       && !_stp_probe_enabled(skp->probe);
 }
 
 
@@ -675,14 +733,171 @@ stapkp_refresh_probe(struct stap_kprobe_probe *skp)
 #endif /* LINUX_VERSION_CODE >= 2.6.30 */
 
 
+#ifdef STAPKP_BATCH_REGISTER
+
+static void * stapkp_batch[STP_KPROBES_BATCH];
+
+// Forget what a failed register_k[ret]probes() call may have left in the
+// k[ret]probe (PR16861), but keep the address kallsyms resolved for it.
+static void
+stapkp_reset_probe(struct stap_kprobe_probe *skp)
+{
+   struct stap_kprobe *sk = skp->kprobe;
+   void *addr = NULL;
+
+   if (skp->symbol_name && USE_KALLSYMS_ON_EACH_SYMBOL)
+      addr = skp->return_p ? sk->u.krp.kp.addr : sk->u.kp.addr;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+   else if (skp->symbol_name) {
+      if (skp->return_p) {
+	 if (sk->u.krp.kp.symbol_name != NULL)
+	    kfree(sk->u.krp.kp.symbol_name);
+      }
+      else {
+	 if (sk->u.kp.symbol_name != NULL)
+	    kfree(sk->u.kp.symbol_name);
+      }
+   }
+#endif
+   memset(sk, 0, sizeof(struct stap_kprobe));
+   if (skp->return_p)
+      sk->u.krp.kp.addr = addr;
+   else
+      sk->u.kp.addr = addr;
+}
+
+// Register the prepared probes in probes[batch[0..n-1]] of one kind with a
+// single call.  When that fails, the kernel has backed them all out again,
+// so they are registered one by one to find the culprits.  Fills rcs[]
+// with each probe's result.
+static void
+stapkp_register_batch(struct stap_kprobe_probe *probes, size_t *batch,
+		      size_t n, int return_p, int *rcs)
+{
+   size_t i;
+   int rc;
+
+   if (n == 0)
+      return;
+   for (i = 0; i < n; i++)
+      stapkp_batch[i] = (return_p
+			 ? (void *) &probes[batch[i]].kprobe->u.krp
+			 : (void *) &probes[batch[i]].kprobe->u.kp);
+   rc = (return_p
+	 ? register_kretprobes((struct kretprobe **) stapkp_batch, n)
+	 : register_kprobes((struct kprobe **) stapkp_batch, n));
+   if (rc == 0) {
+      for (i = 0; i < n; i++) {
+	 probes[batch[i]].registered_p = 1;
+	 rcs[batch[i]] = 0;
+      }
+      dbug_stapkp("+%s * %zu\n", return_p ? "kretprobe" : "kprobe", n);
+      return;
+   }
+
+   dbug_stapkp("batch of %zu failed (rc %d), one by one\n", n, rc);
+   for (i = 0; i < n; i++) {
+      struct stap_kprobe_probe *skp = &probes[batch[i]];
+
+      stapkp_reset_probe(skp);
+      rc = return_p ? stapkp_prepare_kretprobe(skp)
+		    : stapkp_prepare_kprobe(skp);
+      if (rc == 0)
+	 rc = return_p ? stapkp_arch_register_kretprobe(skp)
+		       : stapkp_arch_register_kprobe(skp);
+      rcs[batch[i]] = rc;
+   }
+}
+
+#endif /* STAPKP_BATCH_REGISTER */
+
+
+// The symbol_name+offset probes to resolve, sorted by the name to look
+// for in kallsyms, so that each kallsyms symbol costs one binary search
+// rather than a pass over all the probes.
+struct stapkp_symbol_entry {
+   const char *name;
+   struct stap_kprobe_probe *skp;
+};
+
 struct stapkp_symbol_data {
    struct stap_kprobe_probe *probes;
    size_t nprobes;			/* number of probes in "probes" */
    size_t probe_max;			/* number of probes to process */
    const char *modname;
+   struct stapkp_symbol_entry *index;	/* NULL to scan all probes */
+   size_t nindex;
 };
 
 
+static int
+stapkp_symbol_entry_cmp(const void *a, const void *b)
+{
+   return strcmp(((const struct stapkp_symbol_entry *)a)->name,
+		 ((const struct stapkp_symbol_entry *)b)->name);
+}
+
+
+// The name kallsyms knows the probe's symbol by: for a module probe the
+// part after "module:", else the whole symbol_name.  NULL if the probe
+// can't match any symbol.
+static const char *
+stapkp_symbol_lookup_name(struct stap_kprobe_probe *skp)
+{
+   if (skp->module && skp->module[0] != '\0') {
+      const char *colon = strchr(skp->symbol_name, ':');
+      return colon ? colon + 1 : NULL;
+   }
+   return skp->symbol_name;
+}
+
+
+// Point a probe at the kallsyms symbol if it is the one it is after.
+// Returns nonzero once all the needed probes have been found.
+static int
+stapkp_symbol_match(struct stapkp_symbol_data *sd,
+		    struct stap_kprobe_probe *skp, const char *name,
+		    struct module *mod, unsigned long addr)
+{
+   int update_addr = 0;
+
+   // Registered ones are done, maybe by a refresh racing the
+   // STP_KPROBES_ASYNC worker; their k[ret]probe is the kernel's now.
+   if (! skp->symbol_name || skp->registered_p)
+      return 0;
+
+   // If (1) We're probing a module symbol and we're in that module
+   // and the names match; or (2) we're probing a symbol in the
+   // kernel and the names match, then update the k[ret]probe
+   // address.
+   if (mod && skp->module && strcmp(mod->name, skp->module) == 0) {
+      char *colon = strchr(skp->symbol_name, ':');
+
+      if (colon != NULL && strcmp(name, colon+1) == 0)
+	 update_addr = 1;
+   }
+   else if (!mod && (skp->module == NULL || skp->module[0] == '\0')
+	    && strcmp(name, skp->symbol_name) == 0)
+      update_addr = 1;
+   if (update_addr) {
+
+      if (skp->return_p)
+	 skp->kprobe->u.krp.kp.addr = (void *)(addr + skp->offset);
+      else
+	 skp->kprobe->u.kp.addr = (void *)(addr + skp->offset);
+      // Note that we could have more than 1 probe at the same
+      // symbol (with the same or differing offsets), so we can't
+      // return here.
+      //
+      // But we can quit if we've processed all the needed probes.
+      --sd->probe_max;
+      if (sd->probe_max == 0)
+	 return 1;
+   }
+   return 0;
+}
+
+
 static int
 stapkp_symbol_callback(void *data, const char *name,
 		       struct module *mod, unsigned long addr)
@@ -694,52 +909,516 @@ stapkp_symbol_callback(void *data, const char *name,
        || (!mod && sd->modname))
       return 0;
 
-   for (i = 0; i < sd->nprobes; i++) {
-      struct stap_kprobe_probe *skp = &sd->probes[i];
-      int update_addr = 0;
+   if (sd->index) {
+      // Find the first entry for this name, then try each of them.
+      size_t lo = 0, hi = sd->nindex;
+      while (lo < hi) {
+	 size_t mid = lo + (hi - lo) / 2;
+	 if (strcmp(sd->index[mid].name, name) < 0)
+	    lo = mid + 1;
+	 else
+	    hi = mid;
+      }
+      for (i = lo; i < sd->nindex && strcmp(sd->index[i].name, name) == 0; i++)
+	 if (stapkp_symbol_match(sd, sd->index[i].skp, name, mod, addr))
+	    return -1;
+      return 0;
+   }
 
-      if (! skp->symbol_name)
-	 continue;
+   for (i = 0; i < sd->nprobes; i++)
+      if (stapkp_symbol_match(sd, &sd->probes[i], name, mod, addr))
+	 return -1;
+   return 0;
+}
 
-      // If (1) We're probing a module symbol and we're in that module
-      // and the names match; or (2) we're probing a symbol in the
-      // kernel and the names match, then update the k[ret]probe
-      // address.
-      if (mod && skp->module && strcmp(mod->name, skp->module) == 0) {
-	 char *colon = strchr(skp->symbol_name, ':');
 
-	 if (colon != NULL && strcmp(name, colon+1) == 0)
-	    update_addr = 1;
-      }
-      else if (!mod && (skp->module == NULL || skp->module[0] == '\0')
-	       && strcmp(name, skp->symbol_name) == 0)
-	 update_addr = 1;
-      if (update_addr) {
+// Resolve the unregistered symbol_name+offset probes, of the module
+// modname or else of all, in one pass over kallsyms.
+static void
+stapkp_lookup_symbols(struct stap_kprobe_probe *probes, size_t nprobes,
+		      size_t probe_max, const char *modname)
+{
+   struct stapkp_symbol_data sd;
+   size_t i;
 
-	 if (skp->return_p)
-	    skp->kprobe->u.krp.kp.addr = (void *)(addr + skp->offset);
-	 else
-	    skp->kprobe->u.kp.addr = (void *)(addr + skp->offset);
-	 // Note that we could have more than 1 probe at the same
-	 // symbol (with the same or differing offsets), so we can't
-	 // return here.
-	 //
-	 // But we can quit if we've processed all the needed probes.
-	 --sd->probe_max;
-	 if (sd->probe_max == 0)
-	    return -1;
+   sd.probes = probes;
+   sd.nprobes = nprobes;
+   sd.probe_max = probe_max;
+   sd.modname = modname;
+   sd.nindex = 0;
+   // Without the index, fall back to trying every probe per symbol.
+   sd.index = _stp_vzalloc(probe_max * sizeof(*sd.index));
+   if (sd.index) {
+      for (i = 0; i < nprobes && sd.nindex < probe_max; i++) {
+	 struct stap_kprobe_probe *skp = &probes[i];
+	 const char *name;
+
+	 if (! skp->symbol_name || skp->registered_p)
+	    continue;
+	 if (modname && !(skp->module && strcmp(modname, skp->module) == 0))
+	    continue;
+	 name = stapkp_symbol_lookup_name(skp);
+	 if (name == NULL)
+	    continue;
+	 sd.index[sd.nindex].name = name;
+	 sd.index[sd.nindex].skp = skp;
+	 sd.nindex++;
       }
+      sort(sd.index, sd.nindex, sizeof(*sd.index), stapkp_symbol_entry_cmp,
+	   NULL);
    }
-   return 0;
+
+   dbug_stapkp("looking up %lu probes\n", probe_max);
+#ifdef STAPCONF_MODULE_MUTEX
+   mutex_lock(&module_mutex);
+#endif
+   preempt_disable();
+   kallsyms_on_each_symbol(stapkp_symbol_callback, &sd);
+   preempt_enable();
+#ifdef STAPCONF_MODULE_MUTEX
+   mutex_unlock(&module_mutex);
+#endif
+   dbug_stapkp("%lu probes not found\n", sd.probe_max);
+
+   if (sd.index)
+      _stp_vfree(sd.index);
 }
 
 
+#if defined(STAPKP_FENTRY) || defined(STAPKP_FEXIT)
+
+// The probes hooked through ftrace by address, for the callbacks to look up.
+struct stapkp_fentry {
+   unsigned long addr;
+   struct stap_kprobe_probe *skp;
+};
+
+// How far past the start of a function ftrace may call us from, as with
+// an endbr64 or a BTI landing pad in front of the call to __fentry__.
+#ifndef STP_FENTRY_SLACK
+#define STP_FENTRY_SLACK 16
+#endif
+
 static int
-stapkp_init(struct stap_kprobe_probe *probes,
-            size_t nprobes)
+stapkp_fentry_cmp(const void *a, const void *b)
+{
+   unsigned long x = ((const struct stapkp_fentry *)a)->addr;
+   unsigned long y = ((const struct stapkp_fentry *)b)->addr;
+
+   return x < y ? -1 : x > y;
+}
+
+// Find the probes on the function ftrace called us at ip from, that is the
+// last function starting at or shortly before ip.  Returns one past the
+// last of them in the sorted table tab, or 0 if there are none.
+static size_t
+stapkp_fentry_find(const struct stapkp_fentry *tab, size_t n,
+		   unsigned long ip)
+{
+   size_t lo = 0, hi = n;
+
+   while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (tab[mid].addr <= ip)
+	 lo = mid + 1;
+      else
+	 hi = mid;
+   }
+   if (lo == 0 || ip - tab[lo - 1].addr > STP_FENTRY_SLACK)
+      return 0;
+   return lo;
+}
+
+// Keep those of the n addresses in tab that ftrace can hook, one by one,
+// adding them to the filter of ops unless reset.  Returns how many are left.
+static size_t
+stapkp_fentry_filter(struct ftrace_ops *ops, struct stapkp_fentry *tab,
+		     size_t n, int reset)
+{
+   size_t i, j = 0;
+
+   for (i = 0; i < n; i++)
+      if (ftrace_set_filter_ip(ops, tab[i].addr, 0, reset) == 0)
+	 tab[j++] = tab[i];
+      else
+	 dbug_stapkp("no fentry for %p\n", (void *)tab[i].addr);
+   return j;
+}
+
+#endif /* STAPKP_FENTRY || STAPKP_FEXIT */
+
+
+#ifdef STAPKP_FENTRY
+
+static struct stapkp_fentry stapkp_fentries[STP_KPROBES_FENTRY_MAX];
+static unsigned long stapkp_fentry_ips[STP_KPROBES_FENTRY_MAX];
+static size_t stapkp_nfentries;
+static int stapkp_fentry_registered;
+
+static void
+stapkp_fentry_handle(unsigned long ip, struct pt_regs *regs)
+{
+   size_t i = stapkp_fentry_find(stapkp_fentries, stapkp_nfentries, ip);
+   unsigned long addr;
+
+   if (i == 0 || regs == NULL)
+      return;
+   // Several probes may be on the same function.
+   addr = stapkp_fentries[i - 1].addr;
+   while (i > 0 && stapkp_fentries[i - 1].addr == addr) {
+      enter_fentry_probe(stapkp_fentries[i - 1].skp, addr, regs);
+      i--;
+   }
+}
+
+#ifdef STAPCONF_FTRACE_REGS
+static void notrace
+stapkp_fentry_callback(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, struct ftrace_regs *fregs)
+{
+   stapkp_fentry_handle(ip, ftrace_get_regs(fregs));
+}
+#else
+static void notrace
+stapkp_fentry_callback(unsigned long ip, unsigned long parent_ip,
+		       struct ftrace_ops *op, struct pt_regs *regs)
+{
+   stapkp_fentry_handle(ip, regs);
+}
+#endif
+
+static struct ftrace_ops stapkp_fentry_ops = {
+   .func = stapkp_fentry_callback,
+#ifdef STAPCONF_FTRACE_REGS
+   .flags = FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_RECURSION,
+#else
+   .flags = FTRACE_OPS_FL_SAVE_REGS,
+#endif
+};
+
+// Hook the .fentry_p probes through ftrace.  Those it takes are marked
+// fentry_armed_p, the others are left to be kprobes.
+static void
+stapkp_fentry_arm(struct stap_kprobe_probe *probes, size_t nprobes)
+{
+   size_t i, n = 0;
+   int rc = -EINVAL;
+
+   for (i = 0; i < nprobes && n < STP_KPROBES_FENTRY_MAX; i++) {
+      struct stap_kprobe_probe *skp = &probes[i];
+      unsigned long addr;
+
+      if (!skp->fentry_p || skp->return_p || skp->registered_p)
+	 continue;
+      addr = stapkp_relocate_addr(skp);
+      if (addr == 0)
+	 continue;
+      stapkp_fentries[n].addr = addr;
+      stapkp_fentries[n].skp = skp;
+      stapkp_fentry_ips[n] = addr;
+      n++;
+   }
+   if (n == 0)
+      return;
+
+   // Setting the whole filter at once saves rehashing it per function.
+   // Should any function be untraceable, take them one by one instead,
+   // keeping only those that work.
+#ifdef STAPCONF_FTRACE_SET_FILTER_IPS
+   rc = ftrace_set_filter_ips(&stapkp_fentry_ops, stapkp_fentry_ips, n, 0, 0);
+#endif
+   if (rc != 0) {
+      ftrace_free_filter(&stapkp_fentry_ops);
+      n = stapkp_fentry_filter(&stapkp_fentry_ops, stapkp_fentries, n, 0);
+      if (n == 0)
+	 return;
+   }
+
+   sort(stapkp_fentries, n, sizeof(stapkp_fentries[0]), stapkp_fentry_cmp,
+	NULL);
+   stapkp_nfentries = n;
+   rc = register_ftrace_function(&stapkp_fentry_ops);
+   if (rc != 0) {
+      dbug_stapkp("register_ftrace_function rc %d\n", rc);
+      stapkp_nfentries = 0;
+      ftrace_free_filter(&stapkp_fentry_ops);
+      return;
+   }
+   stapkp_fentry_registered = 1;
+   for (i = 0; i < n; i++)
+      stapkp_fentries[i].skp->fentry_armed_p = 1;
+   dbug_stapkp("+fentry * %zu\n", n);
+}
+
+static void
+stapkp_fentry_disarm(struct stap_kprobe_probe *probes, size_t nprobes)
+{
+   size_t i;
+
+   if (!stapkp_fentry_registered)
+      return;
+   unregister_ftrace_function(&stapkp_fentry_ops);
+   ftrace_free_filter(&stapkp_fentry_ops);
+   stapkp_fentry_registered = 0;
+   stapkp_nfentries = 0;
+   for (i = 0; i < nprobes; i++)
+      if (!probes[i].return_p)
+	 probes[i].fentry_armed_p = 0;
+   dbug_stapkp("-fentry\n");
+}
+
+#else
+#define stapkp_fentry_arm(probes, nprobes) do { } while (0)
+#define stapkp_fentry_disarm(probes, nprobes) do { } while (0)
+#endif /* STAPKP_FENTRY */
+
+
+#ifdef STAPKP_FEXIT
+
+static struct stapkp_fentry stapkp_fexits[STP_KPROBES_FEXIT_MAX];
+static unsigned long stapkp_fexit_ips[STP_KPROBES_FEXIT_MAX];
+static size_t stapkp_nfexits;
+static int stapkp_fexit_registered;
+
+// Number of returns of all the fprobe'd functions that may be pending at
+// once, where the kernel still pools them.
+#ifndef STP_FEXIT_MAXACTIVE
+#define STP_FEXIT_MAXACTIVE (max(1024, 32 * (int)num_possible_cpus()))
+#endif
+
+static void
+stapkp_fexit_handle(unsigned long entry_ip, unsigned long ret_ip,
+		    struct pt_regs *regs)
+{
+   size_t i = stapkp_fentry_find(stapkp_fexits, stapkp_nfexits, entry_ip);
+   unsigned long addr;
+
+   if (i == 0 || regs == NULL)
+      return;
+   addr = stapkp_fexits[i - 1].addr;
+   while (i > 0 && stapkp_fexits[i - 1].addr == addr) {
+      enter_fexit_probe(stapkp_fexits[i - 1].skp, ret_ip, regs);
+      i--;
+   }
+}
+
+#ifdef STAPCONF_FPROBE_FREGS
+static void notrace
+stapkp_fexit_callback(struct fprobe *fp, unsigned long entry_ip,
+		      unsigned long ret_ip, struct ftrace_regs *fregs,
+		      void *data)
+{
+   struct pt_regs regs;
+
+   stapkp_fexit_handle(entry_ip, ret_ip, ftrace_partial_regs(fregs, &regs));
+}
+#else
+static void notrace
+stapkp_fexit_callback(struct fprobe *fp, unsigned long entry_ip,
+		      unsigned long ret_ip, struct pt_regs *regs, void *data)
+{
+   stapkp_fexit_handle(entry_ip, ret_ip, regs);
+}
+#endif
+
+static struct fprobe stapkp_fexit_fprobe = {
+   .exit_handler = stapkp_fexit_callback,
+};
+
+// Hook the .fentry_p return probes with one fprobe, marking them
+// fentry_armed_p; the others are left to be kretprobes.
+static void
+stapkp_fexit_arm(struct stap_kprobe_probe *probes, size_t nprobes)
+{
+   size_t i, n = 0;
+   int rc;
+
+   for (i = 0; i < nprobes && n < STP_KPROBES_FEXIT_MAX; i++) {
+      struct stap_kprobe_probe *skp = &probes[i];
+      unsigned long addr;
+
+      if (!skp->fentry_p || !skp->return_p || skp->registered_p)
+	 continue;
+      addr = stapkp_relocate_addr(skp);
+      if (addr == 0)
+	 continue;
+      stapkp_fexits[n].addr = addr;
+      stapkp_fexits[n].skp = skp;
+      n++;
+   }
+   if (n == 0)
+      return;
+
+   sort(stapkp_fexits, n, sizeof(stapkp_fexits[0]), stapkp_fentry_cmp, NULL);
+   for (i = 0; i < n; i++)
+      stapkp_fexit_ips[i] = stapkp_fexits[i].addr;
+   stapkp_nfexits = n;
+#ifndef STAPCONF_FPROBE_FREGS
+   // Newer kernels keep the returns on the shadow stack instead.
+   stapkp_fexit_fprobe.nr_maxactive = STP_FEXIT_MAXACTIVE;
+#endif
+   rc = register_fprobe_ips(&stapkp_fexit_fprobe, stapkp_fexit_ips, n);
+   if (rc != 0) {
+      // Some function can't be traced.  Find out which with a scratch
+      // ftrace_ops, and try again without them.
+      static struct ftrace_ops scratch;
+
+      dbug_stapkp("register_fprobe_ips rc %d\n", rc);
+      n = stapkp_fentry_filter(&scratch, stapkp_fexits, n, 1);
+      ftrace_free_filter(&scratch);
+      for (i = 0; i < n; i++)
+	 stapkp_fexit_ips[i] = stapkp_fexits[i].addr;
+      stapkp_nfexits = n;
+      rc = n ? register_fprobe_ips(&stapkp_fexit_fprobe, stapkp_fexit_ips, n)
+	     : -ENOENT;
+   }
+   if (rc != 0) {
+      stapkp_nfexits = 0;
+      return;
+   }
+   stapkp_fexit_registered = 1;
+   for (i = 0; i < n; i++)
+      stapkp_fexits[i].skp->fentry_armed_p = 1;
+   dbug_stapkp("+fexit * %zu\n", n);
+}
+
+static void
+stapkp_fexit_disarm(struct stap_kprobe_probe *probes, size_t nprobes)
+{
+   size_t i;
+
+   if (!stapkp_fexit_registered)
+      return;
+   unregister_fprobe(&stapkp_fexit_fprobe);
+   atomic_add(stapkp_fexit_fprobe.nmissed, skipped_count());
+#ifdef STP_TIMING
+   if (stapkp_fexit_fprobe.nmissed)
+      _stp_warn ("Skipped due to missed fprobe returns: %lu\n",
+		 stapkp_fexit_fprobe.nmissed);
+#endif
+   stapkp_fexit_registered = 0;
+   stapkp_nfexits = 0;
+   for (i = 0; i < nprobes; i++)
+      if (probes[i].return_p)
+	 probes[i].fentry_armed_p = 0;
+   dbug_stapkp("-fexit\n");
+}
+
+#else
+#define stapkp_fexit_arm(probes, nprobes) do { } while (0)
+#define stapkp_fexit_disarm(probes, nprobes) do { } while (0)
+#endif /* STAPKP_FEXIT */
+
+
+// Warn about a probe that failed to register.
+static void
+stapkp_register_failed(struct stap_kprobe_probe *skp, int rc)
+{
+   if (rc == 1) // failed to relocate addr?
+      return;   // don't fuss about it, module probably not loaded
+
+   // NB: We keep going even if a probe failed to register (PR6749). We only
+   // warn about it if it wasn't optional and isn't in a module.
+   if (rc && !skp->optional_p
+       && ((skp->module == NULL) || skp->module[0] == '\0'
+	   || strcmp(skp->module, "kernel") == 0)) {
+      if (skp->symbol_name)
+	 _stp_warn("probe %s (%s+%u) registration error [man warning::pass5] (rc %d)",
+		   skp->probe->pp, skp->symbol_name, skp->offset, rc);
+      else
+	 _stp_warn("probe %s (address 0x%lx) registration error [man warning::pass5] (rc %d)",
+		   skp->probe->pp, stapkp_relocate_addr(skp), rc);
+   }
+}
+
+
+// Register the first n probes, at most STP_KPROBES_BATCH of them.
+static void
+stapkp_register_chunk(struct stap_kprobe_probe *probes, size_t n)
+{
+   size_t i;
+
+#ifdef STAPKP_BATCH_REGISTER
+   // Too big for the stack; the callers are serialized.
+   static size_t kps[STP_KPROBES_BATCH], krps[STP_KPROBES_BATCH];
+   static int rcs[STP_KPROBES_BATCH];
+   size_t nkp = 0, nkrp = 0;
+
+   // Prepare them all, then hand each kind to the kernel at once.
+   for (i = 0; i < n; i++) {
+      struct stap_kprobe_probe *skp = &probes[i];
+
+      rcs[i] = 0;
+      if (skp->registered_p || skp->fentry_armed_p)
+	 continue;
+      rcs[i] = skp->return_p ? stapkp_prepare_kretprobe(skp)
+			     : stapkp_prepare_kprobe(skp);
+      if (rcs[i] != 0)
+	 continue;
+      if (skp->return_p)
+	 krps[nkrp++] = i;
+      else
+	 kps[nkp++] = i;
+   }
+   stapkp_register_batch(probes, kps, nkp, 0, rcs);
+   stapkp_register_batch(probes, krps, nkrp, 1, rcs);
+   for (i = 0; i < n; i++)
+      stapkp_register_failed(&probes[i], rcs[i]);
+#else
+   for (i = 0; i < n; i++)
+      if (!probes[i].fentry_armed_p)
+	 stapkp_register_failed(&probes[i],
+				stapkp_register_probe(&probes[i]));
+#endif
+}
+
+
+#ifdef STP_KPROBES_ASYNC
+// Serializes the arming worker against stapkp_refresh() and stapkp_exit().
+static DEFINE_MUTEX(stapkp_mutex);
+#define stapkp_lock() mutex_lock(&stapkp_mutex)
+#define stapkp_unlock() mutex_unlock(&stapkp_mutex)
+#else
+#define stapkp_lock() do { } while (0)
+#define stapkp_unlock() do { } while (0)
+#endif
+
+
+#ifdef STP_KPROBES_ASYNC
+// Tell stapio how far the arming got: after the last batch, and otherwise
+// at most a few times a second.
+static void
+stapkp_report_armed(struct stap_kprobe_probe *probes, size_t n,
+		    size_t nprobes, int done)
 {
+   static struct _stp_msg_probes_armed msg;
+   static unsigned long last_report;
    size_t i;
 
+   for (i = 0; i < n; i++)
+      if (probes[i].registered_p || probes[i].fentry_armed_p)
+	 msg.armed++;
+   msg.tried += n;
+   msg.total = nprobes;
+   msg.done = done;
+   if (!done && last_report && time_before(jiffies, last_report + HZ/4))
+      return;
+   last_report = jiffies;
+   _stp_ctl_send(STP_PROBES_ARMED, &msg, sizeof(msg));
+}
+#endif
+
+
+// Resolve the symbol_name+offset probes with kallsyms, then register them
+// all in batches.  Unless stop is NULL, this gives up as soon as it is set,
+// and lets others in between the batches.
+static void
+stapkp_arm(struct stap_kprobe_probe *probes, size_t nprobes,
+	   const int *stop)
+{
+   size_t i;
+
+   stapkp_lock();
    if (USE_KALLSYMS_ON_EACH_SYMBOL) {
      // If we have any symbol_name+offset probes, we need to try to
      // convert those into address-based probes.
@@ -751,50 +1430,65 @@ stapkp_init(struct stap_kprobe_probe *probes,
 	 continue;
        ++probe_max;
      }
-     if (probe_max > 0) {
-       // Here we're going to try to convert any symbol_name+offset
-       // probes into address probes.
-       struct stapkp_symbol_data sd;
-       dbug_stapkp("looking up %lu probes\n", probe_max);
-       sd.probes = probes;
-       sd.nprobes = nprobes;
-       sd.probe_max = probe_max;
-       sd.modname = NULL;
-#ifdef STAPCONF_MODULE_MUTEX
-       mutex_lock(&module_mutex);
-#endif
-       preempt_disable();
-       kallsyms_on_each_symbol(stapkp_symbol_callback, &sd);
-       preempt_enable();
-#ifdef STAPCONF_MODULE_MUTEX
-       mutex_unlock(&module_mutex);
-#endif
-       dbug_stapkp("found %lu probes\n", sd.probe_max);
-     }
+     // Here we're going to try to convert any symbol_name+offset
+     // probes into address probes.
+     if (probe_max > 0)
+       stapkp_lookup_symbols(probes, nprobes, probe_max, NULL);
    }
 
-   for (i = 0; i < nprobes; i++) {
-      struct stap_kprobe_probe *skp = &probes[i];
-      int rc = 0;
-
-      rc = stapkp_register_probe(skp);
-      if (rc == 1) // failed to relocate addr?
-         continue; // don't fuss about it, module probably not loaded
-
-      // NB: We keep going even if a probe failed to register (PR6749). We only
-      // warn about it if it wasn't optional and isn't in a module.
-      if (rc && !skp->optional_p
-	  && ((skp->module == NULL) || skp->module[0] == '\0'
-	      || strcmp(skp->module, "kernel") == 0)) {
-	 if (skp->symbol_name)
-	    _stp_warn("probe %s (%s+%u) registration error [man warning::pass5] (rc %d)",
-		      skp->probe->pp, skp->symbol_name, skp->offset, rc);
-	 else
-	    _stp_warn("probe %s (address 0x%lx) registration error [man warning::pass5] (rc %d)",
-		      skp->probe->pp, stapkp_relocate_addr(skp), rc);
+   stapkp_fentry_arm(probes, nprobes);
+   stapkp_fexit_arm(probes, nprobes);
+   stapkp_unlock();
+
+   for (i = 0; i < nprobes; i += STP_KPROBES_BATCH) {
+      size_t n = min_t(size_t, nprobes - i, STP_KPROBES_BATCH);
+      if (stop && *(volatile const int *)stop)
+	 break;
+      stapkp_lock();
+      stapkp_register_chunk(&probes[i], n);
+      stapkp_unlock();
+      if (stop) {
+#ifdef STP_KPROBES_ASYNC
+	 stapkp_report_armed(&probes[i], n, nprobes, i + n == nprobes);
+#endif
+	 cond_resched();
       }
    }
+}
+
+
+#ifdef STP_KPROBES_ASYNC
+
+static struct {
+   struct work_struct work;
+   struct stap_kprobe_probe *probes;
+   size_t nprobes;
+   int stop;
+} stapkp_async;
 
+static void
+stapkp_async_worker(struct work_struct *work)
+{
+   stapkp_arm(stapkp_async.probes, stapkp_async.nprobes, &stapkp_async.stop);
+   dbug_stapkp("armed %zu probes\n", stapkp_async.nprobes);
+}
+
+#endif /* STP_KPROBES_ASYNC */
+
+
+static int
+stapkp_init(struct stap_kprobe_probe *probes,
+            size_t nprobes)
+{
+#ifdef STP_KPROBES_ASYNC
+   stapkp_async.probes = probes;
+   stapkp_async.nprobes = nprobes;
+   stapkp_async.stop = 0;
+   INIT_WORK(&stapkp_async.work, stapkp_async_worker);
+   schedule_work(&stapkp_async.work);
+#else
+   stapkp_arm(probes, nprobes, NULL);
+#endif
    return 0;
 }
 
@@ -811,6 +1505,7 @@ stapkp_refresh(const char *modname,
 
    dbug_stapkp("refresh %lu probes with module %s\n", nprobes, modname ?: "?");
 
+   stapkp_lock();
    if (USE_KALLSYMS_ON_EACH_SYMBOL) {
      if (modname) {
        size_t probe_max = 0;
@@ -826,22 +1521,8 @@ stapkp_refresh(const char *modname,
 	     && skp->symbol_name && skp->registered_p == 0)
            ++probe_max;
        }
-       if (probe_max > 0) {
-	 struct stapkp_symbol_data sd;
-	 sd.probes = probes;
-	 sd.nprobes = nprobes;
-	 sd.probe_max = probe_max;
-	 sd.modname = modname;
-#ifdef STAPCONF_MODULE_MUTEX
-         mutex_lock(&module_mutex);
-#endif
-	 preempt_disable();
-	 kallsyms_on_each_symbol(stapkp_symbol_callback, &sd);
-	 preempt_enable();
-#ifdef STAPCONF_MODULE_MUTEX
-         mutex_unlock(&module_mutex);
-#endif
-       }
+       if (probe_max > 0)
+	 stapkp_lookup_symbols(probes, nprobes, probe_max, modname);
      }
    }
 
@@ -871,6 +1552,7 @@ stapkp_refresh(const char *modname,
       }
 #endif
    }
+   stapkp_unlock();
 }
 
 
@@ -878,6 +1560,13 @@ static void
 stapkp_exit(struct stap_kprobe_probe *probes,
             size_t nprobes)
 {
+#ifdef STP_KPROBES_ASYNC
+   // Stop arming, and wait until the worker gave up.
+   stapkp_async.stop = 1;
+   cancel_work_sync(&stapkp_async.work);
+#endif
+   stapkp_fexit_disarm(probes, nprobes);
+   stapkp_fentry_disarm(probes, nprobes);
    stapkp_unregister_probes(probes, nprobes);
 }
 
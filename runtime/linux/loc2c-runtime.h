@@ -851,6 +851,10 @@ static inline char *kderef_buffer_(char *dst, void *addr, size_t len)
  * pagefault when trying to read the string.
  */
 
+/* Whether any byte of W is zero. */
+#define _STP_ONE_BYTES (~0UL / 0xff)
+#define _stp_has_zero_byte(w) (((w) - _STP_ONE_BYTES) & ~(w) & (_STP_ONE_BYTES << 7))
+
 static inline long _stp_deref_string_nofault(char *dst, const char *addr,
 					     size_t len, stp_mm_segment_t seg)
 {
@@ -870,6 +874,31 @@ static inline long _stp_deref_string_nofault(char *dst, const char *addr,
       for (i = 0; i + 1 < len; ++i)
 	{
 	  u8 v;
+
+	  /* From an aligned address on, copy whole words while none of
+	   * their bytes is the terminator or the last that fits.  An
+	   * aligned word doesn't straddle pages, so it faults only where
+	   * reading its first byte would.  Whatever stops this is then
+	   * dealt with a byte at a time. */
+	  if (((uintptr_t)addr + i) % sizeof(unsigned long) == 0)
+	    {
+	      while (i + sizeof(unsigned long) < len)
+		{
+		  unsigned long w;
+		  if (__stp_get_either(w, (unsigned long *)(addr + i), seg)
+		      || _stp_has_zero_byte(w))
+		    break;
+		  if (dst)
+		    {
+		      memcpy(dst, &w, sizeof(w));
+		      dst += sizeof(w);
+		    }
+		  i += sizeof(w);
+		}
+	      if (i + 1 >= len)
+		break;
+	    }
+
 	  err = __stp_get_either(v, (u8 *)addr + i, seg);
 	  if (err || v == '\0')
 	    break;
@@ -0,0 +1,78 @@
+/* -*- linux-c -*-
+ * The refill worker of the maps that grow
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _MAP_GROW_C_
+#define _MAP_GROW_C_
+
+/** @file map_grow.c
+ * @brief Allocating the chunks of the maps that grow, for -DSTP_MAP_GROW
+ *
+ * A probe that cuts a map's chunk down to half sets grow_wanted on the
+ * map, and _stp_map_grow_pending (see map_runtime.h).  A timer checks
+ * the latter every STP_MAP_GROW_TICK and schedules the worker, which
+ * has _stp_map_refill() allocate the next chunk of each map that asked.
+ */
+
+#ifdef MAP_GROWABLE
+
+#ifndef STP_MAP_GROW_TICK
+#define STP_MAP_GROW_TICK (HZ / 100 ? HZ / 100 : 1)
+#endif
+
+/* Generated by the translator: _stp_pmap_refill() on each array. */
+static void _stp_map_refill_all(void);
+
+static struct timer_list _stp_map_grow_timer;
+static struct work_struct _stp_map_grow_work;
+static int _stp_map_grow_on;
+
+static void _stp_map_grow_worker(struct work_struct *work)
+{
+	(void) work;
+	_stp_map_refill_all();
+}
+
+static void _stp_map_grow_callback(stp_timer_callback_parameter_t unused)
+{
+	if (*(volatile int *)&_stp_map_grow_pending) {
+		_stp_map_grow_pending = 0;
+		schedule_work(&_stp_map_grow_work);
+	}
+	if (*(volatile int *)&_stp_map_grow_on)
+		mod_timer(&_stp_map_grow_timer, jiffies + STP_MAP_GROW_TICK);
+}
+
+/** Starts the timer, before the probes are registered, so that the
+ * maps begin probes fill up grow too.
+ */
+static void _stp_map_grow_start(void)
+{
+	INIT_WORK(&_stp_map_grow_work, _stp_map_grow_worker);
+	_stp_map_grow_on = 1;
+	timer_setup(&_stp_map_grow_timer, _stp_map_grow_callback, 0);
+	_stp_map_grow_timer.expires = jiffies + STP_MAP_GROW_TICK;
+	add_timer(&_stp_map_grow_timer);
+}
+
+/** Stops the timer and the worker, once no probe handler can run
+ * anymore, and before the maps are freed.
+ */
+static void _stp_map_grow_stop(void)
+{
+	if (!_stp_map_grow_on)
+		return;
+	_stp_map_grow_on = 0;
+	del_timer_sync(&_stp_map_grow_timer);
+	cancel_work_sync(&_stp_map_grow_work);
+}
+
+#endif /* MAP_GROWABLE */
+
+#endif /* _MAP_GROW_C_ */
@@ -25,6 +25,7 @@
 #define mlist_entry	list_entry
 #define mlist_move_tail	list_move_tail
 
+#define mlist_for_each	list_for_each
 #define mlist_for_each_safe	list_for_each_safe
 
 static inline struct list_head* list_next(struct list_head* head)
@@ -46,6 +47,7 @@ static inline struct list_head* list_prev(struct list_head* head)
 
 #define mhlist_add_head	hlist_add_head
 #define mhlist_del_init	hlist_del_init
+#define mhlist_empty	hlist_empty
 
 #define mhlist_for_each_entry	stap_hlist_for_each_entry
 
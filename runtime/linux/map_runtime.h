@@ -19,6 +19,7 @@
 struct pmap {
 	int bit_shift;	/* scale factor for integer arithmetic */
 	int stat_ops;	/* related statistical operators */
+	int agg_valid;	/* agg is up to date, but for the dirty buckets */
 	MAP agg;	/* aggregation map */
 	MAP *map;	/* per-cpu maps */
 };
@@ -33,6 +34,163 @@ static inline void _stp_pmap_set_agg(PMAP p, MAP agg)
 	p->agg = agg;
 }
 
+/* Note that the keys of hash bucket hv need to be aggregated again. */
+static inline void _stp_map_mark_dirty(MAP m, uint32_t hv)
+{
+	if (m->dirty)
+		__set_bit(hv & m->hash_table_mask, m->dirty);
+}
+
+/* Note that some keys of the map changed, without knowing which. */
+static inline void _stp_map_mark_all_dirty(MAP m)
+{
+	m->dirty_all = 1;
+}
+
+static inline void _stp_map_clear_dirty(MAP m)
+{
+	if (m->dirty)
+		bitmap_zero(m->dirty, m->hash_table_mask + 1);
+	m->dirty_all = 0;
+}
+
+/* Groups of hash buckets locked apart in a striped map, a power of two. */
+#ifndef STP_MAP_STRIPES
+#define STP_MAP_STRIPES 64
+#endif
+#if STP_MAP_STRIPES & (STP_MAP_STRIPES - 1)
+#error "STP_MAP_STRIPES must be a power of two"
+#endif
+
+/* Lock the group of hash buckets of hv, in a striped map.  With open
+   addressing a key may sit in any slot, so there is one group. */
+static inline unsigned long _stp_map_stripe_lock(MAP m, uint32_t hv)
+{
+	unsigned long flags = 0;
+
+	if (m->stripes) {
+#ifdef MAP_OPEN_ADDRESSING
+		hv = 0;
+#endif
+		stp_spin_lock_irqsave(&m->stripes[hv & m->hash_table_mask
+						  & (STP_MAP_STRIPES - 1)],
+				      flags);
+	}
+	return flags;
+}
+
+static inline void _stp_map_stripe_unlock(MAP m, uint32_t hv,
+					  unsigned long flags)
+{
+	if (m->stripes) {
+#ifdef MAP_OPEN_ADDRESSING
+		hv = 0;
+#endif
+		stp_spin_unlock_irqrestore(&m->stripes[hv & m->hash_table_mask
+						       & (STP_MAP_STRIPES - 1)],
+					   flags);
+	}
+}
+
+/* Lock the node lists of a striped map, inside a stripe lock. */
+static inline void _stp_map_list_lock(MAP m)
+{
+	if (m->stripes)
+		stp_spin_lock(&m->list_lock);
+}
+
+static inline void _stp_map_list_unlock(MAP m)
+{
+	if (m->stripes)
+		stp_spin_unlock(&m->list_lock);
+}
+
+/** Make the single-key operations on map m lock the buckets of their
+ * key, rather than count on their caller to lock the whole map.  The
+ * caller still has to exclude them from any operation on the whole
+ * map.  A wrapping map is left alone, since making room evicts a node
+ * of any bucket.  Returns non-zero on error.
+ */
+static int _stp_map_init_stripes(MAP m)
+{
+	unsigned i;
+
+	if (m->wrap)
+		return 0;
+	m->stripes = _stp_kzalloc(STP_MAP_STRIPES * sizeof(*m->stripes));
+	if (m->stripes == NULL)
+		return -1;
+	for (i = 0; i < STP_MAP_STRIPES; i++)
+		stp_spin_lock_init(&m->stripes[i]);
+	stp_spin_lock_init(&m->list_lock);
+	return 0;
+}
+
+#ifdef MAP_STRING_TIERED
+static char *_stp_map_get_str_buf(MAP m)
+{
+	char *buf = m->str_free;
+
+	if (buf)
+		m->str_free = *(char **)buf;
+	return buf;
+}
+
+static void _stp_map_put_str_buf(MAP m, char *buf)
+{
+	*(char **)buf = m->str_free;
+	m->str_free = buf;
+}
+
+/* Set or append to a string key or value of a node of map m.  Returns
+ * -1, leaving it as it was, if it needs a long string buffer and the
+ * map has none left. */
+static int _stp_map_str_set(MAP m, struct map_str *s, char *src, int add)
+{
+	size_t len = src ? strlen(src) : 0;
+
+	if (add)
+		len += strlen(MAP_STR(*s));
+
+	if (len >= MAP_STRING_INLINE && s->ptr == NULL) {
+		char *buf = _stp_map_get_str_buf(m);
+		if (buf == NULL)
+			return -1;
+		if (add)
+			strlcpy(buf, s->str, MAP_STRING_LENGTH);
+		s->ptr = buf;
+	} else if (len < MAP_STRING_INLINE && s->ptr && !add) {
+		_stp_map_put_str_buf(m, s->ptr);
+		s->ptr = NULL;
+	}
+
+	if (add) {
+		if (src)
+			strlcat(MAP_STR(*s), src, s->ptr ? MAP_STRING_LENGTH
+						       : MAP_STRING_INLINE);
+	} else if (src)
+		strlcpy(MAP_STR(*s), src, s->ptr ? MAP_STRING_LENGTH
+					       : MAP_STRING_INLINE);
+	else
+		s->str[0] = '\0';
+	return 0;
+}
+
+/* Give the long strings of node n back to the pool of map m. */
+static void _stp_map_put_strs(MAP m, struct map_node *n)
+{
+	unsigned i;
+
+	for (i = 0; i < m->nstrs; i++) {
+		struct map_str *s = (void *)n + m->str_offsets[i];
+		if (s->ptr) {
+			_stp_map_put_str_buf(m, s->ptr);
+			s->ptr = NULL;
+		}
+	}
+}
+#endif
+
 static inline MAP _stp_pmap_get_map(PMAP p, unsigned cpu)
 {
 	return *per_cpu_ptr(p->map, cpu);
@@ -57,6 +215,25 @@ static void _stp_map_del(MAP map)
 
 	if (map->node_mem)
 		_stp_vfree(map->node_mem);
+	if (map->dirty)
+		_stp_vfree(map->dirty);
+	if (map->stripes)
+		_stp_kfree(map->stripes);
+	if (map->sort_ents)
+		_stp_vfree(map->sort_ents);
+#ifdef MAP_STRING_TIERED
+	if (map->str_mem)
+		_stp_vfree(map->str_mem);
+#endif
+#ifdef MAP_GROWABLE
+	while (map->chunks) {
+		struct map_chunk *c = map->chunks;
+		map->chunks = c->next;
+		_stp_vfree(c);
+	}
+	if (map->spare)
+		_stp_vfree(map->spare);
+#endif
 
 	_stp_vfree(map);
 }
@@ -97,9 +274,11 @@ _stp_map_vzalloc(size_t size, int cpu)
 }
 
 
+/* Allocate the first initial of the max_entries nodes of map m.  Unless
+ * that is all of them, the map then grows, see _stp_map_grow_pool(). */
 static int
-_stp_map_init(MAP m, unsigned max_entries, unsigned hash_table_mask,
-              int wrap, int node_size, int cpu)
+_stp_map_init(MAP m, unsigned max_entries, unsigned initial,
+              unsigned hash_table_mask, int wrap, int node_size, int cpu)
 {
 	unsigned i;
 
@@ -107,55 +286,204 @@ _stp_map_init(MAP m, unsigned max_entries, unsigned hash_table_mask,
 	INIT_MLIST_HEAD(&m->head);
 
         m->hash_table_mask = hash_table_mask;
+#ifdef MAP_OPEN_ADDRESSING
+	/* The slots were zeroed, i.e. emptied, by _stp_map_vzalloc(). */
+	m->node_size = node_size;
+	m->slots_used = 0;
+#else
 	for (i = 0; i <= hash_table_mask; i++)
 		INIT_MHLIST_HEAD(&m->hashes[i]);
+#endif
 
 	m->maxnum = max_entries;
 	m->wrap = wrap;
 
 	/* Since we're using _stp_map_vzalloc(), we can afford to
 	 * allocate the nodes in one big chunk. */
-	m->node_mem = _stp_map_vzalloc(node_size * max_entries, cpu);
+	m->node_mem = _stp_map_vzalloc(node_size * initial, cpu);
 	if (m->node_mem == NULL)
 		return -1;
 
-	for (i = 0; i < max_entries; i++) {
+#ifdef MAP_GROWABLE
+	m->node_size = node_size;
+	m->cpu = cpu;
+	m->allocated = initial;
+	if (initial < max_entries) {
+		/* The nodes are cut from the chunk as they're needed,
+		 * so that it's known when it runs low. */
+		m->bump = m->node_mem;
+		m->bump_left = initial;
+		return 0;
+	}
+#endif
+	for (i = 0; i < initial; i++) {
 		struct map_node *node = m->node_mem + i * node_size;
 		mlist_add(&node->lnode, &m->pool);
+#ifndef MAP_OPEN_ADDRESSING
 		INIT_MHLIST_NODE(&node->hnode);
+#endif
 	}
 
 	return 0;
 }
 
 
-/** Create a new map.
- * Maps must be created at module initialization time.
- * @param max_entries The maximum number of entries allowed. Currently that
- * number will be preallocated.If more entries are required, the oldest ones
- * will be deleted. This makes it effectively a circular buffer.
- * @return A MAP on success or NULL on failure.
- * @ingroup map_create
- */
-
+/* As _stp_map_new(), but with only initial of the nodes allocated. */
 static MAP
-_stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
+_stp_map_new_initial(unsigned max_entries, unsigned initial, int wrap,
+		     int node_size, int cpu)
 {
 	MAP m;
+#ifdef MAP_OPEN_ADDRESSING
+        unsigned hash_table_mask = MAPSLOTSIZE(max_entries)-1; /* usable as bitmask */
+	m = _stp_map_vzalloc(sizeof(struct map_root) +
+                             sizeof(struct map_slot) * (hash_table_mask+1),
+                             cpu);
+#else
         unsigned hash_table_mask = HASHTABLESIZE(max_entries)-1; /* usable as bitmask */
 	m = _stp_map_vzalloc(sizeof(struct map_root) +
                              sizeof(struct mhlist_head) * (hash_table_mask+1),
                              cpu);
+#endif
 	if (m == NULL)
 		return NULL;
 
-	if (_stp_map_init(m, max_entries, hash_table_mask, wrap, node_size, cpu)) {
+	if (_stp_map_init(m, max_entries, initial, hash_table_mask, wrap,
+			  node_size, cpu)) {
 		_stp_map_del(m);
 		return NULL;
 	}
 	return m;
 }
 
+/** Create a new map.
+ * Maps must be created at module initialization time.
+ * @param max_entries The maximum number of entries allowed. Currently that
+ * number will be preallocated.If more entries are required, the oldest ones
+ * will be deleted. This makes it effectively a circular buffer.
+ * @return A MAP on success or NULL on failure.
+ * @ingroup map_create
+ */
+
+static MAP
+_stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
+{
+	return _stp_map_new_initial(max_entries, max_entries, wrap,
+				    node_size, cpu);
+}
+
+#ifdef MAP_GROWABLE
+/* Set when some map wants another chunk, for the timer of map_grow.c
+ * to hand over to the worker.  Probes can't wake the worker up
+ * themselves: they may be running in the scheduler. */
+static int _stp_map_grow_pending;
+
+static inline void _stp_map_want_grow(MAP m)
+{
+	if (!m->grow_wanted) {
+		m->grow_wanted = 1;
+		*(volatile int *)&_stp_map_grow_pending = 1;
+	}
+}
+
+/* Put another node into the empty pool of map m, cut from its chunk,
+ * or else from the spare one.  Returns 0 if there is none to be had.
+ * Runs in probe context, so it never allocates: once the chunk is down
+ * to half, it asks _stp_map_refill() for the next one instead. */
+static int _stp_map_grow_pool(MAP m)
+{
+	struct map_node *node;
+
+	if (m->bump_left == 0) {
+		struct map_chunk *c;
+
+		if (m->allocated >= m->maxnum && m->spare == NULL)
+			return 0;
+		c = xchg(&m->spare, NULL);
+		if (c == NULL) {
+			m->grow_misses++;
+			_stp_map_want_grow(m);
+			return 0;
+		}
+		c->next = m->chunks;
+		m->chunks = c;
+		m->bump = c->nodes;
+		m->bump_left = c->count;
+	}
+
+	node = (struct map_node *) m->bump;
+	m->bump += m->node_size;
+	m->bump_left--;
+	INIT_MHLIST_NODE(&node->hnode);
+	mlist_add(&node->lnode, &m->pool);
+
+	if (m->bump_left <= STP_MAP_GROW_CHUNK / 2 && m->spare == NULL
+	    && m->allocated < m->maxnum)
+		_stp_map_want_grow(m);
+	return 1;
+}
+
+/* Allocate the next chunk of map m, if it asked for one.  Runs in the
+ * worker, the only one to set spare, which the map's probes then take. */
+static void _stp_map_refill(MAP m)
+{
+	struct map_chunk *c;
+	unsigned count;
+
+	if (m == NULL || !*(volatile int *)&m->grow_wanted)
+		return;
+	m->grow_wanted = 0;
+	smp_mb(); /* a request after this is seen the next time round */
+	if (*(struct map_chunk * volatile *)&m->spare != NULL
+	    || m->allocated >= m->maxnum)
+		return;
+
+	count = min_t(unsigned, STP_MAP_GROW_CHUNK, m->maxnum - m->allocated);
+	c = _stp_map_vzalloc(sizeof(*c) + (size_t)count * m->node_size, m->cpu);
+	if (c == NULL)
+		return; /* asked again at the next node */
+	c->count = count;
+	m->allocated += count;
+	smp_wmb(); /* the chunk before the pointer to it */
+	m->spare = c;
+}
+
+static void _stp_pmap_refill(PMAP pmap)
+{
+	int i;
+
+	if (pmap == NULL)
+		return;
+	for_each_possible_cpu(i)
+		_stp_map_refill(_stp_pmap_get_map(pmap, i));
+}
+
+/* The times the per-cpu maps of pmap were found full while growing. */
+static unsigned _stp_pmap_grow_misses(PMAP pmap)
+{
+	unsigned misses = 0;
+	int i;
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map(pmap, i);
+		if (likely(m != NULL))
+			misses += *(volatile unsigned *)&m->grow_misses;
+	}
+	return misses;
+}
+#endif
+
+/* How many nodes the per-cpu maps of a pmap start with. */
+static inline unsigned _stp_map_grow_initial(unsigned max_entries, int wrap)
+{
+#ifdef MAP_GROWABLE
+	/* Maps that wrap need all their nodes before they may. */
+	if (!wrap && max_entries > STP_MAP_GROW_CHUNK)
+		return STP_MAP_GROW_CHUNK;
+#endif
+	return max_entries;
+}
+
 static PMAP
 _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 {
@@ -184,10 +512,23 @@ _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
         * context structs can only happen right here.
         */
 	for_each_online_cpu(i) {
-		m = _stp_map_new(max_entries, wrap, node_size, i);
+		m = _stp_map_new_initial(max_entries,
+					 _stp_map_grow_initial(max_entries, wrap),
+					 wrap, node_size, i);
 		if (unlikely(m == NULL))
 			goto err1;
                 _stp_pmap_set_map(pmap, m, i);
+#ifndef STP_PMAP_FULL_AGG
+		/* Track which buckets change, so that _stp_pmap_agg() can
+		 * fold only those into the aggregate.  Wrapping maps drop
+		 * their oldest entries, which would go untracked. */
+		if (!wrap) {
+			m->dirty = _stp_map_vzalloc(BITS_TO_LONGS(m->hash_table_mask + 1)
+						    * sizeof(unsigned long), i);
+			if (unlikely(m->dirty == NULL))
+				goto err1;
+		}
+#endif
 	}
 
 	/* Allocate the aggregate map.  */
@@ -209,4 +550,64 @@ err1:
 	return NULL;
 }
 
+/* Give a map that foreach sorts the arrays that its sorts use. */
+static int _stp_map_init_sort(MAP m)
+{
+	m->sort_ents = _stp_map_vzalloc(2 * (size_t)m->maxnum
+					* sizeof(struct map_sort_ent), -1);
+	return m->sort_ents == NULL ? -1 : 0;
+}
+
+/* As _stp_map_init_sort(), for a pmap, whose aggregate is what is sorted. */
+static int _stp_pmap_init_sort(PMAP pmap)
+{
+	return _stp_map_init_sort(_stp_pmap_get_agg(pmap));
+}
+
+static inline struct map_sort_ent *_stp_map_sort_ents(MAP m)
+{
+	return m->sort_ents;
+}
+
+#ifdef MAP_STRING_TIERED
+/* Note where the strings are in the nodes of map m, and allocate the
+ * long string buffers for percent of them. */
+static int _stp_map_init_strs(MAP m, unsigned nstrs, const unsigned *offsets,
+			      int cpu, unsigned percent)
+{
+	unsigned i, nbufs;
+
+	m->nstrs = nstrs;
+	for (i = 0; i < nstrs; i++)
+		m->str_offsets[i] = offsets[i];
+
+	nbufs = (m->maxnum * percent + 99) / 100 * nstrs;
+	if (nbufs == 0)
+		return 0;
+	m->str_mem = _stp_map_vzalloc((size_t)nbufs * MAP_STRING_LENGTH, cpu);
+	if (m->str_mem == NULL)
+		return -1;
+	for (i = 0; i < nbufs; i++)
+		_stp_map_put_str_buf(m, m->str_mem + i * MAP_STRING_LENGTH);
+	return 0;
+}
+
+/* As _stp_map_init_strs(), for all the maps of a pmap.  The aggregate
+ * gets a buffer for every string, so that merging never fails. */
+static int _stp_pmap_init_strs(PMAP pmap, unsigned nstrs, const unsigned *offsets)
+{
+	int i;
+	MAP m;
+
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (likely(m != NULL)
+		    && _stp_map_init_strs(m, nstrs, offsets, i, MAP_STRING_SPILL))
+			return -1;
+	}
+	return _stp_map_init_strs(_stp_pmap_get_agg(pmap), nstrs, offsets,
+				  -1, 100);
+}
+#endif
+
 #endif /* _LINUX_MAP_RUNTIME_H_ */
@@ -59,4 +59,87 @@ static void nf_unregister_hook(struct nf_hook_ops *reg)
 }
 
 #endif	// STAPCONF_NF_REGISTER_HOOK
+
+
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <net/ipv6.h>
+
+// Checks a packet against the header predicates of a probe point, such
+// as netfilter.ipv4.pre_routing.tcp.dport(443), before the hook takes a
+// context.  A predicate of -1 matches anything; the arguments are all
+// constants, so this folds down to the checks actually asked for.
+static inline int _stp_nf_match(const struct sk_buff *skb, int pf,
+				int protocol, int sport, int dport)
+{
+	unsigned int off;
+	u8 proto;
+	int fragment = 0;
+	__be16 _ports[2];
+	const __be16 *ports;
+
+	if (skb == NULL)
+		return 0;
+
+	if (pf == NFPROTO_IPV4) {
+		struct iphdr _iph;
+		const struct iphdr *iph;
+
+		iph = skb_header_pointer(skb, skb_network_offset(skb),
+					 sizeof(_iph), &_iph);
+		if (iph == NULL)
+			return 0;
+		proto = iph->protocol;
+		fragment = (ntohs(iph->frag_off) & IP_OFFSET) != 0;
+		off = skb_network_offset(skb) + iph->ihl * 4;
+	}
+#if defined(CONFIG_IPV6) || defined(CONFIG_IPV6_MODULE)
+	else if (pf == NFPROTO_IPV6) {
+		struct ipv6hdr _ip6h;
+		const struct ipv6hdr *ip6h;
+		int hoff;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+		__be16 frag_off;
+#endif
+
+		ip6h = skb_header_pointer(skb, skb_network_offset(skb),
+					  sizeof(_ip6h), &_ip6h);
+		if (ip6h == NULL)
+			return 0;
+		proto = ip6h->nexthdr;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,3,0)
+		hoff = ipv6_skip_exthdr(skb, skb_network_offset(skb)
+					+ sizeof(_ip6h), &proto, &frag_off);
+		fragment = (ntohs(frag_off) & ~0x7) != 0;
+#else
+		hoff = ipv6_skip_exthdr(skb, skb_network_offset(skb)
+					+ sizeof(_ip6h), &proto);
+#endif
+		if (hoff < 0)
+			return 0;
+		off = hoff;
+	}
+#endif
+	else
+		return 0;
+
+	if (protocol >= 0 && proto != protocol)
+		return 0;
+	if (sport < 0 && dport < 0)
+		return 1;
+
+	// Both tcp and udp start with the source and destination ports,
+	// which only the first fragment carries.
+	if (fragment)
+		return 0;
+	ports = skb_header_pointer(skb, off, sizeof(_ports), _ports);
+	if (ports == NULL)
+		return 0;
+	if (sport >= 0 && ntohs(ports[0]) != sport)
+		return 0;
+	if (dport >= 0 && ntohs(ports[1]) != dport)
+		return 0;
+	return 1;
+}
+
 #endif	// __NETFILTER_C__
@@ -0,0 +1,195 @@
+/* -*- linux-c -*-
+ * Per-probe output rate limits and drop accounting
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _OUTPUT_LIMIT_C_
+#define _OUTPUT_LIMIT_C_
+
+/** @file output_limit.c
+ * @brief Per-probe output rate limits, with -DSTP_OUTPUT_RATE=N
+ *
+ * Each probe may send N records of output a second on each cpu, in
+ * bursts of up to STP_OUTPUT_BURST.  A token bucket per probe and cpu
+ * decides, when the print buffer is flushed, whether the record goes
+ * to the transport or is dropped right there, so that an overloaded
+ * session loses output from its busiest probes rather than from
+ * whichever probe next finds the buffers full.  STP_OUTPUT_RATE=0
+ * leaves the output alone and only does the accounting.
+ *
+ * Records dropped either way are counted per probe and cpu.  Every
+ * STP_OUTPUT_REPORT_MS, a timer sums up the new ones and warns about
+ * each probe that lost some, so the loss shows while it happens rather
+ * than only as a total at the end.
+ */
+
+#ifdef STP_OUTPUT_RATE
+
+/* Records a probe may send at once after being quiet, on each cpu. */
+#ifndef STP_OUTPUT_BURST
+#define STP_OUTPUT_BURST (STP_OUTPUT_RATE > 100 ? STP_OUTPUT_RATE / 10 : 10)
+#endif
+
+/* Milliseconds between reports of dropped records. */
+#ifndef STP_OUTPUT_REPORT_MS
+#define STP_OUTPUT_REPORT_MS 1000
+#endif
+
+struct _stp_output_bucket {
+	unsigned long stamp;	/* jiffies the tokens were last added */
+	u64 tokens;		/* records times HZ */
+	unsigned long limited;	/* dropped by the rate limit */
+	unsigned long lost;	/* dropped for want of buffer space */
+};
+
+struct _stp_output_report {
+	unsigned long limited, lost;	/* summed at the last report */
+};
+
+/* STP_PROBE_COUNT of them for each of nr_cpu_ids, by cpu then probe. */
+static struct _stp_output_bucket *_stp_output_buckets;
+static struct _stp_output_report *_stp_output_reports;
+static struct timer_list _stp_output_limit_timer;
+static int _stp_output_limit_on;
+
+/** The bucket of the probe running on this cpu, or NULL outside of a
+ * probe handler.  Called with the print lock held.
+ */
+static struct _stp_output_bucket *_stp_output_bucket(void)
+{
+	struct context *c = _stp_runtime_get_context();
+
+	if (unlikely(_stp_output_buckets == NULL || c == NULL
+		     || !atomic_read(&c->busy)
+		     || c->probe_index >= STP_PROBE_COUNT))
+		return NULL;
+	return &_stp_output_buckets[raw_smp_processor_id() * STP_PROBE_COUNT
+				    + c->probe_index];
+}
+
+static int _stp_output_admit(void)
+{
+	struct _stp_output_bucket *b;
+	const u64 cost = HZ, full = (u64) STP_OUTPUT_BURST * HZ;
+	unsigned long now;
+
+	if (STP_OUTPUT_RATE == 0 || (b = _stp_output_bucket()) == NULL)
+		return 1;
+
+	/* Each jiffy adds STP_OUTPUT_RATE / HZ records' worth. */
+	now = jiffies;
+	b->tokens += (u64) (now - b->stamp) * STP_OUTPUT_RATE;
+	if (b->tokens > full || b->stamp == 0)
+		b->tokens = full;
+	b->stamp = now;
+
+	if (b->tokens < cost)
+		return 0;
+	b->tokens -= cost;
+	return 1;
+}
+
+static void _stp_output_drop(int limited)
+{
+	struct _stp_output_bucket *b = _stp_output_bucket();
+
+	if (b == NULL)
+		return;
+	if (limited)
+		b->limited++;
+	else
+		b->lost++;
+}
+
+static void _stp_output_report(void)
+{
+	unsigned i;
+
+	for (i = 0; i < STP_PROBE_COUNT; i++) {
+		struct _stp_output_report *r = &_stp_output_reports[i];
+		unsigned long limited = 0, lost = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct _stp_output_bucket *b =
+				&_stp_output_buckets[cpu * STP_PROBE_COUNT + i];
+			limited += *(volatile unsigned long *)&b->limited;
+			lost += *(volatile unsigned long *)&b->lost;
+		}
+		if (limited != r->limited || lost != r->lost)
+			_stp_warn("probe %s dropped %lu records of output "
+				  "(%lu over the rate limit, %lu for want of "
+				  "buffer space), %lu in all so far",
+				  stap_probes[i].pp,
+				  (limited - r->limited) + (lost - r->lost),
+				  limited - r->limited, lost - r->lost,
+				  limited + lost);
+		r->limited = limited;
+		r->lost = lost;
+	}
+}
+
+static void _stp_output_limit_callback(stp_timer_callback_parameter_t unused)
+{
+	_stp_output_report();
+	if (*(volatile int *)&_stp_output_limit_on)
+		mod_timer(&_stp_output_limit_timer,
+			  jiffies + msecs_to_jiffies(STP_OUTPUT_REPORT_MS));
+}
+
+/** Sets up the buckets, and the report timer.  Returns non-zero on
+ * error.
+ */
+static int _stp_output_limit_init(void)
+{
+	_stp_output_reports = _stp_vzalloc(STP_PROBE_COUNT
+					   * sizeof(*_stp_output_reports));
+	if (_stp_output_reports == NULL)
+		return -ENOMEM;
+	_stp_output_buckets = _stp_vzalloc(nr_cpu_ids * STP_PROBE_COUNT
+					   * sizeof(*_stp_output_buckets));
+	if (_stp_output_buckets == NULL) {
+		_stp_vfree(_stp_output_reports);
+		_stp_output_reports = NULL;
+		return -ENOMEM;
+	}
+	_stp_output_limit_on = 1;
+	timer_setup(&_stp_output_limit_timer, _stp_output_limit_callback, 0);
+	_stp_output_limit_timer.expires =
+		jiffies + msecs_to_jiffies(STP_OUTPUT_REPORT_MS);
+	add_timer(&_stp_output_limit_timer);
+	return 0;
+}
+
+/** Stops the report timer, with a last report, before the probes are
+ * unregistered.
+ */
+static void _stp_output_limit_stop(void)
+{
+	if (!_stp_output_limit_on)
+		return;
+	_stp_output_limit_on = 0;
+	del_timer_sync(&_stp_output_limit_timer);
+	_stp_output_report();
+}
+
+/** Frees the buckets, once no probe handler can run anymore. */
+static void _stp_output_limit_exit(void)
+{
+	_stp_output_limit_stop();
+	if (_stp_output_buckets == NULL)
+		return;
+	_stp_vfree(_stp_output_buckets);
+	_stp_output_buckets = NULL;
+	_stp_vfree(_stp_output_reports);
+	_stp_output_reports = NULL;
+}
+
+#endif /* STP_OUTPUT_RATE */
+
+#endif /* _OUTPUT_LIMIT_C_ */
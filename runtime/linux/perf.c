@@ -182,6 +182,8 @@ static void _stp_perf_init_work (struct work_struct *work)
   for (i = 0; i < pwork->nprobes; ++i) {
     struct stap_perf_probe* stp = &pwork->probes[i];
 
+    if (stp->shared)
+      continue;
     if (stp->system_wide)
       pwork->rc = _stp_perf_init(stp, NULL);
     else if (stp->task_finder)
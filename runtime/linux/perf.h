@@ -32,6 +32,8 @@ struct stap_perf_probe {
 	} e;
 	unsigned system_wide : 1;
 	unsigned task_finder : 1;
+	unsigned profile : 1;
+	unsigned shared : 1;	/* runs off an earlier probe's events */
 	struct mutex cb_lock;
 };
 
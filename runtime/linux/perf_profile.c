@@ -0,0 +1,194 @@
+/* -*- linux-c -*-
+ * Perf Profile Functions
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _PERF_PROFILE_C_
+#define _PERF_PROFILE_C_
+
+#include <linux/jhash.h>
+
+/** @file perf_profile.c
+ * @brief Sampling profiler mode of perf probes
+ *
+ * A perf .profile probe doesn't run its handler for each sample.  The
+ * sample only takes the kernel and user stack ids, and appends them
+ * to a ring of its cpu, which needs no locks as only that cpu writes
+ * it.  A timer drains all rings now and then, adds the samples up by
+ * probe, task and stacks, and runs the handler once for each distinct
+ * one, with its count.
+ */
+
+/* Samples each cpu holds between drains, a power of two. */
+#ifndef STP_PERF_PROFILE_RING
+#define STP_PERF_PROFILE_RING 1024
+#endif
+#if STP_PERF_PROFILE_RING & (STP_PERF_PROFILE_RING - 1)
+#error "STP_PERF_PROFILE_RING must be a power of two"
+#endif
+
+/* Distinct samples a drain adds up before it runs their handlers,
+   a power of two. */
+#ifndef STP_PERF_PROFILE_GROUPS
+#define STP_PERF_PROFILE_GROUPS 256
+#endif
+#if STP_PERF_PROFILE_GROUPS & (STP_PERF_PROFILE_GROUPS - 1)
+#error "STP_PERF_PROFILE_GROUPS must be a power of two"
+#endif
+
+/* Milliseconds between drains. */
+#ifndef STP_PERF_PROFILE_MS
+#define STP_PERF_PROFILE_MS 100
+#endif
+
+struct _stp_perf_ring {
+	unsigned long head;	/* only written by its cpu */
+	unsigned long tail;	/* only written by the drain */
+	unsigned long dropped;
+	struct stap_perf_sample rec[STP_PERF_PROFILE_RING];
+};
+
+static struct _stp_perf_ring *_stp_perf_rings;	/* nr_cpu_ids of them */
+static struct stap_perf_sample _stp_perf_groups[STP_PERF_PROFILE_GROUPS];
+static unsigned _stp_perf_ngroups;
+static struct timer_list _stp_perf_profile_timer;
+static int _stp_perf_profile_on;
+
+/** Takes a sample of a .profile probe, from its perf event handler. */
+static void _stp_perf_profile_sample(struct context *c, unsigned i)
+{
+	struct _stp_perf_ring *r = &_stp_perf_rings[smp_processor_id()];
+	unsigned long head = r->head;
+	struct stap_perf_sample *s;
+
+	if (head - *(volatile unsigned long *)&r->tail
+	    >= STP_PERF_PROFILE_RING) {
+		r->dropped++;
+		return;
+	}
+	s = &r->rec[head & (STP_PERF_PROFILE_RING - 1)];
+	s->probe = i;
+	s->pid = current->tgid;
+	s->tid = current->pid;
+	s->kstack = c->kregs ? _stp_stack_kernel_id(c) : 0;
+	s->ustack = current->mm ? _stp_stack_user_id(c) : 0;
+	s->count = 1;
+	smp_wmb(); /* pairs with _stp_perf_profile_drain() */
+	*(volatile unsigned long *)&r->head = head + 1;
+}
+
+/* Run the handler for each group, and empty them. */
+static void _stp_perf_profile_flush(void)
+{
+	unsigned i;
+
+	for (i = 0; i < STP_PERF_PROFILE_GROUPS; i++) {
+		struct stap_perf_sample *g = &_stp_perf_groups[i];
+		if (g->count) {
+			handle_perf_profile(g);
+			g->count = 0;
+		}
+	}
+	_stp_perf_ngroups = 0;
+}
+
+/* Add a sample to the group of those like it. */
+static void _stp_perf_profile_add(const struct stap_perf_sample *s)
+{
+	u32 h = jhash_3words(s->tid, (u32) s->kstack,
+			     (u32) s->ustack, s->probe);
+	unsigned i;
+
+	/* Past three quarters full, the probing gets long. */
+	if (_stp_perf_ngroups >= STP_PERF_PROFILE_GROUPS / 4 * 3)
+		_stp_perf_profile_flush();
+	for (i = h & (STP_PERF_PROFILE_GROUPS - 1);;
+	     i = (i + 1) & (STP_PERF_PROFILE_GROUPS - 1)) {
+		struct stap_perf_sample *g = &_stp_perf_groups[i];
+
+		if (g->count == 0) {
+			*g = *s;
+			_stp_perf_ngroups++;
+			return;
+		}
+		if (g->probe == s->probe && g->tid == s->tid
+		    && g->pid == s->pid && g->kstack == s->kstack
+		    && g->ustack == s->ustack) {
+			g->count += s->count;
+			return;
+		}
+	}
+}
+
+/* Empty the rings of all cpus into the groups, then run the handlers. */
+static void _stp_perf_profile_drain(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct _stp_perf_ring *r = &_stp_perf_rings[cpu];
+		unsigned long head = *(volatile unsigned long *)&r->head;
+		unsigned long tail = r->tail;
+
+		smp_rmb(); /* pairs with _stp_perf_profile_sample() */
+		for (; tail != head; tail++)
+			_stp_perf_profile_add(&r->rec[tail & (STP_PERF_PROFILE_RING - 1)]);
+		smp_mb(); /* the records are read before they are reused */
+		*(volatile unsigned long *)&r->tail = tail;
+	}
+	_stp_perf_profile_flush();
+}
+
+static void _stp_perf_profile_callback(stp_timer_callback_parameter_t unused)
+{
+	_stp_perf_profile_drain();
+	if (*(volatile int *)&_stp_perf_profile_on)
+		mod_timer(&_stp_perf_profile_timer,
+			  jiffies + msecs_to_jiffies(STP_PERF_PROFILE_MS));
+}
+
+/** Sets up the rings and starts the drain timer, before the perf
+ * events are created.  Returns non-zero on error.
+ */
+static int _stp_perf_profile_init(void)
+{
+	_stp_perf_rings = _stp_vzalloc(nr_cpu_ids * sizeof(*_stp_perf_rings));
+	if (_stp_perf_rings == NULL)
+		return -ENOMEM;
+	_stp_perf_ngroups = 0;
+	_stp_perf_profile_on = 1;
+	timer_setup(&_stp_perf_profile_timer, _stp_perf_profile_callback, 0);
+	_stp_perf_profile_timer.expires = jiffies
+		+ msecs_to_jiffies(STP_PERF_PROFILE_MS);
+	add_timer(&_stp_perf_profile_timer);
+	return 0;
+}
+
+/** Stops the drain timer, once the perf events are gone, and reports
+ * the samples the rings had no room for.
+ */
+static void _stp_perf_profile_exit(void)
+{
+	unsigned long dropped = 0;
+	int cpu;
+
+	if (_stp_perf_rings == NULL)
+		return;
+	_stp_perf_profile_on = 0;
+	del_timer_sync(&_stp_perf_profile_timer);
+	for_each_possible_cpu(cpu)
+		dropped += _stp_perf_rings[cpu].dropped;
+	if (dropped)
+		_stp_warn("perf profile dropped %lu samples, try a larger "
+			  "-DSTP_PERF_PROFILE_RING or a smaller "
+			  "-DSTP_PERF_PROFILE_MS", dropped);
+	_stp_vfree(_stp_perf_rings);
+	_stp_perf_rings = NULL;
+}
+
+#endif /* _PERF_PROFILE_C_ */
@@ -16,6 +16,17 @@
  */
 
 #ifdef _HAVE_PERF_
+#include <linux/types.h>
+
+/* A sample of a perf .profile probe, or the samples of a drain that
+   were all alike, as handle_perf_profile runs the probe handler for. */
+struct stap_perf_sample {
+	unsigned probe;		/* index into stap_perf_probes */
+	pid_t pid, tid;
+	int64_t kstack, ustack;	/* stack ids, 0 if none */
+	u64 count;
+};
+
 // perf counter probes call _stp_perf_read
 struct task_struct;
 static int _stp_perf_read_init (unsigned i, struct task_struct* pid);
@@ -0,0 +1,32 @@
+/* -*- linux-c -*-
+ * Probe prefilter helpers
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _LINUX_PREFILTER_H_
+#define _LINUX_PREFILTER_H_
+
+/* The stap_probe prefilter() functions check the simple parts of a
+ * probe condition before the handler takes a context.  They only look
+ * at the current task; these give the values the tapset functions of
+ * the same names would. */
+
+static inline int64_t _stp_prefilter_uid(void)
+{
+#ifdef STAPCONF_TASK_UID
+	return current->uid;
+#else
+#if defined(CONFIG_USER_NS) || (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	return from_kuid_munged(current_user_ns(), current_uid());
+#else
+	return current_uid();
+#endif
+#endif
+}
+
+#endif /* _LINUX_PREFILTER_H_ */
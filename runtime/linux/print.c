@@ -40,6 +40,9 @@ struct _stp_log {
 	char *buf; /* NB we don't use arrays here to avoid allocating memory
 		      on offline CPUs (but still possible ones) */
 	atomic_t reentrancy_lock;
+#ifdef STP_OUTPUT_RATE
+	int rejected; /* the buffered record is over the rate limit */
+#endif
 };
 #include "print_flush.c"
 
@@ -262,6 +265,80 @@ static void _stp_unreserve_bytes (int numbytes)
 		log->len -= numbytes;
 }
 
+#ifdef STP_DIRECT_PRINT
+
+/** Reserves space for a whole trace record in the transport buffer, so
+ * that it can be formatted there in place rather than being copied out
+ * of the print buffer later.  If the record would straddle the end of the
+ * current sub-buffer, this falls back on _stp_reserve_bytes() and sets
+ * *entry to NULL.  Must be called with _stp_print_trylock_irqsave() held.
+ */
+static void * _stp_reserve_print_bytes (int numbytes, void **entry)
+{
+	const size_t hlen = sizeof(struct _stp_trace);
+	struct _stp_log *log;
+	unsigned char *data;
+
+	*entry = NULL;
+	if (unlikely(numbytes == 0 || numbytes > STP_BUFFER_SIZE))
+		return NULL;
+
+	/* Anything already buffered must go out ahead of this record. */
+	log = per_cpu_ptr(_stp_log_pcpu, raw_smp_processor_id());
+	__stp_print_flush(log);
+
+#ifdef STP_OUTPUT_RATE
+	/* Over the rate limit, it's buffered for __stp_print_flush() to
+	   drop and count, without asking the bucket again. */
+	if (!_stp_output_admit()) {
+		log->rejected = 1;
+		return _stp_reserve_bytes(numbytes);
+	}
+#endif
+	if (!_stp_data_write_reserve_whole(hlen + numbytes, entry)) {
+		*entry = NULL;
+		return _stp_reserve_bytes(numbytes);
+	}
+
+	data = _stp_data_entry_data(*entry);
+	{
+		struct _stp_trace t = {
+			.sequence = _stp_seq_inc(),
+			.pdu_len = numbytes,
+			.timestamp = _stp_trace_clock()
+		};
+		memcpy(data, &t, hlen);
+	}
+	return data + hlen;
+}
+
+static void _stp_unreserve_print_bytes (int numbytes, void *entry)
+{
+	if (entry)
+		_stp_data_write_unreserve(entry,
+					  sizeof(struct _stp_trace) + numbytes);
+	else {
+		_stp_unreserve_bytes(numbytes);
+#ifdef STP_OUTPUT_RATE
+		{
+			/* With the record gone, there is nothing to drop. */
+			struct _stp_log *log = per_cpu_ptr(_stp_log_pcpu,
+							   raw_smp_processor_id());
+			if (log->len == 0)
+				log->rejected = 0;
+		}
+#endif
+	}
+}
+
+static void _stp_commit_print_bytes (void *entry)
+{
+	if (entry)
+		_stp_data_write_commit(entry);
+}
+
+#endif /* STP_DIRECT_PRINT */
+
 /** Write 64-bit args directly into the output stream.
  * This function takes a variable number of 64-bit arguments
  * and writes them directly into the output stream.  Marginally faster
@@ -345,9 +422,27 @@ static void _stp_print_char (const char c)
 
 static void _stp_print_kernel_info(char *sname, char *vstr, int ctx, int num_probes)
 {
+#ifdef CONFIG_NUMA
+	/* how much of alloc each node got, e.g. "0:1200/1:1184" */
+	char nodes[96] = "";
+	int node, len = 0;
+
+	for_each_online_node(node) {
+		if (_stp_allocated_node_memory[node] == 0
+		    || len >= (int) sizeof(nodes))
+			continue;
+		len += snprintf(nodes + len, sizeof(nodes) - len, "%s%d:%lu",
+				len ? "/" : "", node,
+				_stp_allocated_node_memory[node] / 1024);
+	}
+#endif
+
 	printk(KERN_DEBUG
                "%s (%s): systemtap: %s, base: %lx"
                ", memory: %ludata/%lutext/%uctx/%lunet/%lualloc kb"
+#ifdef CONFIG_NUMA
+               " (%s kb by node)"
+#endif
                ", probes: %d"
 #if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV)
                ", unpriv-uid: %d"
@@ -375,6 +470,9 @@ static void _stp_print_kernel_info(char *sname, char *vstr, int ctx, int num_pro
 	       _stp_allocated_net_memory/1024,
 	       (_stp_allocated_memory - _stp_allocated_net_memory - ctx)/1024,
                /* (un-double-counting net/ctx because they're also stp_alloc'd) */
+#ifdef CONFIG_NUMA
+               nodes,
+#endif
                num_probes
 #if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV)
                , _stp_uid
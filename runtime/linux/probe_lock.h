@@ -41,8 +41,11 @@ stp_unlock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 }
 
 
+/* Take the locks in order, giving up after MAXTRYLOCK retries in all.
+   Returns num_locks if they are all held, or else the index of the
+   lock that timed out, with none held. */
 static unsigned
-stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
+__stp_trylock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 {
 	unsigned i, retries = 0;
 	for (i = 0; i < num_locks; ++i) {
@@ -69,16 +72,204 @@ stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
 				udelay (TRYLOCKDELAY);
 			}
 	}
-	return 1;
+	return num_locks;
 
 skip:
+	stp_unlock_probe(locks, i);
+	return i;
+}
+
+
+static void
+__stp_skip_probe(const struct stp_probe_lock *locks, unsigned i)
+{
 	atomic_inc(skipped_count());
 #ifdef STP_TIMING
 	atomic_inc(locks[i].skipped);
 #endif
-	stp_unlock_probe(locks, i);
+}
+
+
+static unsigned
+stp_lock_probe(const struct stp_probe_lock *locks, unsigned num_locks)
+{
+	unsigned i = __stp_trylock_probe(locks, num_locks);
+	if (i == num_locks)
+		return 1;
+	__stp_skip_probe(locks, i);
+	return 0;
+}
+
+
+/* Claim the spare map of a global for a foreach snapshot, retrying
+   like the locks, and note it in *claimed for the handler to hand back
+   with stp_snapshot_release().  The claim outlasts the locks, so a
+   handler on another cpu may still be going through the last snapshot. */
+static unsigned
+stp_snapshot_claim(atomic_t *busy, atomic_t **claimed)
+{
+	unsigned retries = 0;
+	while (atomic_cmpxchg(busy, 0, 1) != 0) {
+#if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
+		if (++retries > MAXTRYLOCK) {
+			atomic_inc(skipped_count());
+			return 0;
+		}
+#endif
+		udelay (TRYLOCKDELAY);
+	}
+	*claimed = busy;
+	return 1;
+}
+
+
+static void
+stp_snapshot_release(atomic_t **claimed)
+{
+	smp_mb();
+	atomic_set(*claimed, 0);
+	*claimed = NULL;
+}
+
+
+/* Take the write lock of a global whose foreach snapshot has to be put
+   back, at the end of a handler that left the loop without its delete,
+   retrying like the locks.  Returns 0 if that timed out. */
+static unsigned
+stp_snapshot_lock(stp_rwlock_t *lock)
+{
+	unsigned retries = 0;
+	while (!stp_write_trylock(lock)) {
+#if !defined(STAP_SUPPRESS_TIME_LIMITS_ENABLE)
+		if (++retries > MAXTRYLOCK) {
+			atomic_inc(skipped_count());
+			return 0;
+		}
+#endif
+		udelay (TRYLOCKDELAY);
+	}
+	return 1;
+}
+
+
+#ifdef STP_DEFER_UPDATES
+
+/* Updates queued per cpu by one probe handler, if its locks are taken
+   too long.  The translator only lets a handler queue its updates if
+   they all commute (++, +=, -=, <<<) and only use its locals, so an
+   entry is a copy of the locals, which the next run of the handler to
+   get the locks replays. */
+
+#ifndef STP_DEFER_QUEUE
+#define STP_DEFER_QUEUE 16
+#endif
+
+struct stp_defer_cpu {
+	stp_spinlock_t lock;
+	unsigned count;
+	char entries[];
+};
+
+struct stp_defer_queue {
+	atomic_t pending;	/* entries queued on any cpu */
+	size_t size;		/* of an entry */
+	void *cpus;		/* percpu struct stp_defer_cpu */
+};
+
+static int
+stp_defer_init(struct stp_defer_queue *q, size_t size)
+{
+	int cpu;
+
+	atomic_set(&q->pending, 0);
+	q->size = size;
+	q->cpus = _stp_alloc_percpu(sizeof(struct stp_defer_cpu)
+				    + STP_DEFER_QUEUE * size);
+	if (q->cpus == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct stp_defer_cpu *d = per_cpu_ptr(q->cpus, cpu);
+		stp_spin_lock_init(&d->lock);
+		d->count = 0;
+	}
+	return 0;
+}
+
+static void
+stp_defer_free(struct stp_defer_queue *q)
+{
+	if (q->cpus)
+		_stp_free_percpu(q->cpus);
+	q->cpus = NULL;
+}
+
+static inline int
+stp_defer_pending(struct stp_defer_queue *q)
+{
+	return q->cpus && atomic_read(&q->pending) > 0;
+}
+
+/* Queue a copy of locals on this cpu.  Returns 0 if it is full. */
+static int
+stp_defer_push(struct stp_defer_queue *q, const void *locals)
+{
+	struct stp_defer_cpu *d = per_cpu_ptr(q->cpus, smp_processor_id());
+	unsigned long flags;
+	int rc = 0;
+
+	stp_spin_lock_irqsave(&d->lock, flags);
+	if (d->count < STP_DEFER_QUEUE) {
+		memcpy(d->entries + d->count++ * q->size, locals, q->size);
+		atomic_inc(&q->pending);
+		rc = 1;
+	}
+	stp_spin_unlock_irqrestore(&d->lock, flags);
+	return rc;
+}
+
+/* Take an entry queued on any cpu into locals.  Returns 0 if none. */
+static int
+stp_defer_pop(struct stp_defer_queue *q, void *locals)
+{
+	unsigned long flags;
+	int cpu, rc = 0;
+
+	if (!stp_defer_pending(q))
+		return 0;
+	for_each_possible_cpu(cpu) {
+		struct stp_defer_cpu *d = per_cpu_ptr(q->cpus, cpu);
+		if (d->count == 0)
+			continue;
+		stp_spin_lock_irqsave(&d->lock, flags);
+		if (d->count > 0) {
+			memcpy(locals, d->entries + --d->count * q->size,
+			       q->size);
+			atomic_dec(&q->pending);
+			rc = 1;
+		}
+		stp_spin_unlock_irqrestore(&d->lock, flags);
+		if (rc)
+			break;
+	}
+	return rc;
+}
+
+/* Like stp_lock_probe, but on a timeout queue the handler's locals
+   instead, and only skip the probe if the queue is full. */
+static unsigned
+stp_lock_probe_or_defer(const struct stp_probe_lock *locks,
+			unsigned num_locks, struct stp_defer_queue *q,
+			const void *locals)
+{
+	unsigned i = __stp_trylock_probe(locks, num_locks);
+	if (i == num_locks)
+		return 1;
+	if (!stp_defer_push(q, locals))
+		__stp_skip_probe(locks, i);
 	return 0;
 }
 
+#endif /* STP_DEFER_UPDATES */
+
 
 #endif /* _STAPLINUX_PROBE_LOCK_H */
@@ -0,0 +1,329 @@
+/* -*- linux-c -*-
+ * Probe sampling and throttling
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _PROBE_THROTTLE_C_
+#define _PROBE_THROTTLE_C_
+
+/** @file probe_throttle.c
+ * @brief Per-probe sampling and throttling
+ *
+ * A probe point with a .sample(N) only runs its handler on every Nth
+ * hit on each cpu, the others bail out before taking a context.
+ *
+ * Unless -DSTP_NO_PROBE_STATS, each probe also counts the runs of its
+ * handler on each cpu, and adds up the cycles they take, without a lock
+ * or an atomic operation.  Only when stapio asks for them, on SIGUSR1,
+ * are they summed over the cpus, and the probes that took the most
+ * cycles sent back to it.
+ *
+ * With -DSTP_THROTTLE, a timer sums the cycles up once a second, and a
+ * probe that took more than STP_THROTTLE_THRESHOLD cycles is put on
+ * hold for STP_THROTTLE_HOLD_MS.  Unlike STP_OVERLOAD, that stops the
+ * hot probe rather than the whole session.  Held kprobes are disarmed
+ * by the module refresh, other probes skip their handler while held.
+ */
+
+/* Scripts with more probes than this don't count them, as each online
+ * cpu takes 24 bytes a probe. */
+#ifndef STP_PROBE_STATS_MAX_PROBES
+#define STP_PROBE_STATS_MAX_PROBES 4096
+#endif
+
+#if !defined(STP_NO_PROBE_STATS) \
+    && STP_PROBE_COUNT <= STP_PROBE_STATS_MAX_PROBES
+#define STP_NEED_PROBE_STATS 1
+#endif
+
+/* Probes whose stats are sent to stapio, of those with the most cycles. */
+#ifndef STP_PROBE_STATS_TOP
+#define STP_PROBE_STATS_TOP 20
+#endif
+
+#if defined(STP_THROTTLE) || defined(STP_NEED_PROBE_STATS)
+#define STP_PROBE_ACCOUNT 1
+#endif
+
+#if defined(STP_PROBE_ACCOUNT) || defined(STP_NEED_PROBE_SAMPLE)
+#define STP_PROBE_COUNTS 1
+
+/* Handler cycles a probe may take a second, over all cpus. */
+#ifndef STP_THROTTLE_THRESHOLD
+#define STP_THROTTLE_THRESHOLD 300000000LL
+#endif
+
+/* Milliseconds a throttled probe is kept on hold. */
+#ifndef STP_THROTTLE_HOLD_MS
+#define STP_THROTTLE_HOLD_MS 5000
+#endif
+
+struct _stp_probe_counts {
+	unsigned long hits;	/* of .sample probes */
+	unsigned long runs;	/* of the handlers */
+	u64 cycles;		/* of the handlers */
+};
+
+struct _stp_probe_hold {
+	u64 last;		/* cycles summed at the last tick */
+	unsigned long until;	/* jiffies the hold ends */
+	int throttled;
+};
+
+/* For each cpu, its STP_PROBE_COUNT counts.  Like the pmaps, only the
+ * cpus online at startup get them, on their own node, and probes on
+ * cpus plugged in later go uncounted. */
+static struct _stp_probe_counts **_stp_probe_counts;
+
+#ifdef STP_THROTTLE
+static struct _stp_probe_hold *_stp_probe_holds;
+static struct timer_list _stp_probe_throttle_timer;
+static int _stp_probe_throttle_on;
+
+#define _stp_probe_enabled(p) \
+	((p)->cond_enabled \
+	 && !*(volatile int *)&_stp_probe_holds[(p)->index].throttled)
+#endif
+
+static inline struct _stp_probe_counts *
+_stp_probe_counts_cpu(int cpu)
+{
+	return *per_cpu_ptr(_stp_probe_counts, cpu);
+}
+
+/** The counts of probe p on this cpu, or NULL. */
+static inline struct _stp_probe_counts *
+_stp_probe_counts_of(const struct stap_probe *p)
+{
+	struct _stp_probe_counts *pc =
+		_stp_probe_counts_cpu(raw_smp_processor_id());
+
+	return likely(pc) ? &pc[p->index] : NULL;
+}
+
+/** Whether a hit of probe p should skip its handler, for being on hold
+ * or for not being one its .sample() picks.
+ */
+static inline int _stp_probe_skip(const struct stap_probe *p)
+{
+#ifdef STP_THROTTLE
+	if (unlikely(*(volatile int *)&_stp_probe_holds[p->index].throttled))
+		return 1;
+#endif
+#ifdef STP_NEED_PROBE_SAMPLE
+	if (p->sample > 1) {
+		struct _stp_probe_counts *pc = _stp_probe_counts_of(p);
+
+		if (pc && ++pc->hits % p->sample)
+			return 1;
+	}
+#endif
+	return 0;
+}
+
+#ifdef STP_PROBE_ACCOUNT
+/** Adds a handler run and its cycles to its probe, on this cpu. */
+static inline void _stp_probe_account(const struct stap_probe *p,
+				      u32 cycles)
+{
+	struct _stp_probe_counts *pc = _stp_probe_counts_of(p);
+
+	if (unlikely(pc == NULL))
+		return;
+	pc->runs++;
+	pc->cycles += cycles;
+}
+#endif
+
+#ifdef STP_THROTTLE
+static void _stp_probe_throttle_callback(stp_timer_callback_parameter_t unused)
+{
+	int refresh = 0;
+	unsigned i;
+
+	for (i = 0; i < STP_PROBE_COUNT; i++) {
+		struct _stp_probe_hold *h = &_stp_probe_holds[i];
+		u64 sum = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			struct _stp_probe_counts *pc =
+				_stp_probe_counts_cpu(cpu);
+			if (pc)
+				sum += pc[i].cycles;
+		}
+		if (h->throttled) {
+			if (time_after_eq(jiffies, h->until)) {
+				*(volatile int *)&h->throttled = 0;
+				_stp_warn("probe %s resumed", stap_probes[i].pp);
+				refresh = 1;
+			}
+		} else if (sum - h->last > STP_THROTTLE_THRESHOLD) {
+			h->until = jiffies + msecs_to_jiffies(STP_THROTTLE_HOLD_MS);
+			*(volatile int *)&h->throttled = 1;
+			_stp_warn("probe %s throttled for %d ms, it took %llu "
+				  "cycles in the last second (threshold %lld)",
+				  stap_probes[i].pp, STP_THROTTLE_HOLD_MS,
+				  (unsigned long long) (sum - h->last),
+				  (long long) STP_THROTTLE_THRESHOLD);
+			refresh = 1;
+		}
+		h->last = sum;
+	}
+
+	/* Have the held kprobes disarmed, or the resumed ones rearmed. */
+	if (refresh) {
+		atomic_set(&need_module_refresh, 1);
+		schedule_work(&module_refresher_work);
+	}
+	if (*(volatile int *)&_stp_probe_throttle_on)
+		mod_timer(&_stp_probe_throttle_timer, jiffies + HZ);
+}
+#endif /* STP_THROTTLE */
+
+/** Sets up the counters, and the throttle timer.  Returns non-zero on
+ * error.
+ */
+static void _stp_probe_counts_free(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		_stp_vfree(_stp_probe_counts_cpu(cpu));
+	_stp_free_percpu(_stp_probe_counts);
+	_stp_probe_counts = NULL;
+}
+
+static int _stp_probe_throttle_init(void)
+{
+	int cpu;
+
+	_stp_probe_counts = _stp_alloc_percpu(sizeof(*_stp_probe_counts));
+	if (_stp_probe_counts == NULL)
+		return -ENOMEM;
+	for_each_online_cpu(cpu) {
+		struct _stp_probe_counts *pc =
+			_stp_vzalloc_node(STP_PROBE_COUNT * sizeof(*pc),
+					  cpu_to_node(cpu));
+		if (pc == NULL) {
+			_stp_probe_counts_free();
+			return -ENOMEM;
+		}
+		*per_cpu_ptr(_stp_probe_counts, cpu) = pc;
+	}
+#ifdef STP_THROTTLE
+	_stp_probe_holds = _stp_vzalloc(STP_PROBE_COUNT
+					* sizeof(*_stp_probe_holds));
+	if (_stp_probe_holds == NULL) {
+		_stp_probe_counts_free();
+		return -ENOMEM;
+	}
+	_stp_probe_throttle_on = 1;
+	timer_setup(&_stp_probe_throttle_timer, _stp_probe_throttle_callback, 0);
+	_stp_probe_throttle_timer.expires = jiffies + HZ;
+	add_timer(&_stp_probe_throttle_timer);
+#endif
+	return 0;
+}
+
+/** Stops the throttle timer, before the probes are unregistered. */
+static void _stp_probe_throttle_stop(void)
+{
+#ifdef STP_THROTTLE
+	if (!_stp_probe_throttle_on)
+		return;
+	_stp_probe_throttle_on = 0;
+	del_timer_sync(&_stp_probe_throttle_timer);
+#endif
+}
+
+/** Frees the counters, once no probe handler can run anymore. */
+static void _stp_probe_throttle_exit(void)
+{
+	_stp_probe_throttle_stop();
+	if (_stp_probe_counts == NULL)
+		return;
+#ifdef STP_THROTTLE
+	_stp_vfree(_stp_probe_holds);
+	_stp_probe_holds = NULL;
+#endif
+	_stp_probe_counts_free();
+}
+
+#endif /* STP_PROBE_COUNTS */
+
+/** Answers stapio's STP_PROBE_STATS request: a message for each of the
+ * STP_PROBE_STATS_TOP probes whose handlers took the most cycles, most
+ * first, then one with the totals.  Requests come one at a time, from
+ * the control channel.
+ */
+static void _stp_probe_stats_send(void)
+{
+	static struct { unsigned index; u64 runs, cycles; }
+		top[STP_PROBE_STATS_TOP];
+	static struct _stp_msg_probe_stats msg;
+	unsigned ntop = 0, i, j;
+	u64 runs = 0, cycles = 0;
+	uint32_t probes = 0;
+	int enabled = 0;
+
+#ifdef STP_NEED_PROBE_STATS
+	enabled = (_stp_probe_counts != NULL);
+	for (i = 0; enabled && i < STP_PROBE_COUNT; i++) {
+		u64 r = 0, c = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			volatile struct _stp_probe_counts *pc =
+				_stp_probe_counts_cpu(cpu);
+			if (pc == NULL)
+				continue;
+			r += pc[i].runs;
+			c += pc[i].cycles;
+		}
+		if (r == 0)
+			continue;
+		probes++;
+		runs += r;
+		cycles += c;
+
+		/* An insertion sort, keeping the top ones. */
+		for (j = ntop; j > 0 && top[j - 1].cycles < c; j--)
+			if (j < STP_PROBE_STATS_TOP)
+				top[j] = top[j - 1];
+		if (j < STP_PROBE_STATS_TOP) {
+			top[j].index = i;
+			top[j].runs = r;
+			top[j].cycles = c;
+			if (ntop < STP_PROBE_STATS_TOP)
+				ntop++;
+		}
+	}
+#endif
+
+	for (i = 0; i < ntop; i++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.index = top[i].index;
+		msg.enabled = 1;
+		msg.probes = 1;
+		msg.runs = top[i].runs;
+		msg.cycles = top[i].cycles;
+		strlcpy(msg.pp, stap_probes[top[i].index].pp, sizeof(msg.pp));
+		_stp_ctl_send(STP_PROBE_STATS, &msg, sizeof(msg));
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.index = -1;
+	msg.enabled = enabled;
+	msg.probes = probes;
+	msg.runs = runs;
+	msg.cycles = cycles;
+	_stp_ctl_send_notify(STP_PROBE_STATS, &msg, sizeof(msg));
+}
+
+#endif /* _PROBE_THROTTLE_C_ */
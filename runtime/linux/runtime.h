@@ -188,12 +188,37 @@ static const char *privilege_to_text (int p) {
 /* atomic globals */
 static atomic_t _stp_transport_failures = ATOMIC_INIT (0);
 
+#ifdef STP_BULKMODE
+/* Bulk mode files are merged by (timestamp, cpu, sequence) after the
+   fact, so each cpu can number its own trace records without bouncing
+   a shared counter between caches. */
+static DEFINE_PER_CPU(uint32_t, _stp_seq_pcpu);
+
+#define _stp_seq_inc() (this_cpu_inc_return(_stp_seq_pcpu))
+#else
+/* In stream mode, stapio relies on consecutive sequence numbers across
+   all cpus to interleave their output. */
 static struct
 {
 	atomic_t ____cacheline_aligned_in_smp seq;
 } _stp_seq = { ATOMIC_INIT (0) };
 
 #define _stp_seq_inc() (atomic_inc_return(&_stp_seq.seq))
+#endif
+
+/* The trace record timestamp.  It only needs to be NMI-safe and close
+   enough across cpus to merge their output sensibly; see the same
+   settings in timestamp_monotonic.stp. */
+#if defined(STAPCONF_LINUX_SCHED_HEADERS)
+#include <linux/sched/clock.h>
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)) && defined (STAPCONF_LOCAL_CLOCK)
+#define _stp_trace_clock() ((uint64_t) local_clock())
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,33)) && defined (STAPCONF_CPU_CLOCK)
+#define _stp_trace_clock() ((uint64_t) cpu_clock(smp_processor_id()))
+#else
+#define _stp_trace_clock() ((uint64_t) get_jiffies_64() * (NSEC_PER_SEC / HZ))
+#endif
 
 /* dwarf unwinder only tested so far on arm, i386, x86_64, ppc64 and s390x.
    Only define STP_USE_DWARF_UNWINDER when STP_NEED_UNWIND_DATA,
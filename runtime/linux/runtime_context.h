@@ -11,8 +11,13 @@
 #ifndef _LINUX_RUNTIME_CONTEXT_H_
 #define _LINUX_RUNTIME_CONTEXT_H_
 
-/* Can't use a lock primitive for this because lock_acquire() has tracepoints */
-static atomic_t _stp_contexts_busy_ctr = ATOMIC_INIT(0);
+/* Set once the contexts are about to be freed.  Users take them with
+ * preemption disabled, which makes for an RCU-sched read side, so a
+ * grace period after setting this is enough to be rid of them, and
+ * probe entry doesn't write to any memory shared between cpus.  (Can't
+ * use a lock primitive for this because lock_acquire() has
+ * tracepoints.) */
+static volatile int _stp_contexts_closing = 0;
 
 /* Per-cpu data is always initialized with zero filled. */
 static DEFINE_PER_CPU(struct context *, contexts);
@@ -56,7 +61,7 @@ static bool _stp_runtime_context_trylock(void)
 		return false;
 
 	preempt_disable();
-	locked = atomic_add_unless(&_stp_contexts_busy_ctr, 1, INT_MAX);
+	locked = !_stp_contexts_closing;
 	if (!locked)
 		preempt_enable_no_resched();
 
@@ -65,20 +70,20 @@ static bool _stp_runtime_context_trylock(void)
 
 static void _stp_runtime_context_unlock(void)
 {
-	atomic_dec(&_stp_contexts_busy_ctr);
 	preempt_enable_no_resched();
 }
 
 /* We should be free of all probes by this time, but for example the timer for
  * _stp_ctl_work_callback may still be running and looking for contexts.  We
- * use _stp_contexts_busy_ctr to be sure its safe to free them.  */
+ * use _stp_contexts_closing to be sure its safe to free them.  */
 static void _stp_runtime_contexts_free(void)
 {
 	unsigned int cpu;
 
-	/* Sync to make sure existing readers are done */
-	while (atomic_cmpxchg(&_stp_contexts_busy_ctr, 0, INT_MAX))
-		cpu_relax();
+	/* Sync to make sure existing readers are done; later ones see
+	 * the flag and back off. */
+	_stp_contexts_closing = 1;
+	stp_synchronize_sched();
 
 	/* Now we can actually free the contexts */
 
@@ -109,7 +114,7 @@ static struct context * _stp_runtime_entryfn_get_context(void)
 	c = _stp_runtime_get_context();
 	if (c != NULL) {
 		if (!atomic_cmpxchg(&c->busy, 0, 1)) {
-			// NB: Notice we're not releasing _stp_contexts_busy_ctr
+			// NB: Notice we're not enabling preemption
 			// here. We exepect the calling code to call
 			// _stp_runtime_entryfn_get_context() and
 			// _stp_runtime_entryfn_put_context() as a
@@ -0,0 +1,109 @@
+/* -*- linux-c -*-
+ * Live session statistics
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _SESSION_STATS_C_
+#define _SESSION_STATS_C_
+
+/** @file session_stats.c
+ * @brief The "stats" file of a running session
+ *
+ * The module directory of the transport holds a read-only "stats" file,
+ * which staprun -q prints.  Each read takes a fresh look at the session:
+ * its error and skip counts, how the output buffers are doing, the runs
+ * and cycles of each probe handler that has run, and how full each
+ * global array is.  Nothing is reset, and the probes keep running.
+ *
+ * The counters are read without their locks, so the numbers of a busy
+ * session may be a little out of step with each other.
+ */
+
+#include <linux/seq_file.h>
+
+/* Generated by the translator, after the globals. */
+static void _stp_global_stats(struct seq_file *m);
+
+static const char *_stp_session_state_name(int state)
+{
+	switch (state) {
+	case STAP_SESSION_STARTING:	return "starting";
+	case STAP_SESSION_RUNNING:	return "running";
+	case STAP_SESSION_ERROR:	return "error";
+	case STAP_SESSION_STOPPING:	return "stopping";
+	case STAP_SESSION_STOPPED:	return "stopped";
+	default:			return "uninitialized";
+	}
+}
+
+static int _stp_session_stats_show(struct seq_file *m, void *v)
+{
+	struct _stp_msg_transport_stats st;
+	int state;
+#ifdef STP_NEED_PROBE_STATS
+	unsigned i;
+#endif
+
+	/* systemtap_module_exit() takes this mutex before it unregisters
+	   the probes, and only frees the globals and counters after, so
+	   they stay put while we hold it in the RUNNING state. */
+	mutex_lock(&module_refresh_mutex);
+	state = atomic_read(session_state());
+
+	seq_printf(m, "state: %s\n", _stp_session_state_name(state));
+	seq_printf(m, "errors: %d\n", atomic_read(error_count()));
+	seq_printf(m, "skipped: %d\n", atomic_read(skipped_count()));
+	seq_printf(m, "skipped_lowstack: %d\n",
+		   atomic_read(skipped_count_lowstack()));
+	seq_printf(m, "skipped_reentrant: %d\n",
+		   atomic_read(skipped_count_reentrant()));
+	seq_printf(m, "skipped_uprobe_reg: %d\n",
+		   atomic_read(skipped_count_uprobe_reg()));
+	seq_printf(m, "skipped_uprobe_unreg: %d\n",
+		   atomic_read(skipped_count_uprobe_unreg()));
+
+	if (_stp_transport_data_fs_stats(-1, &st) == 0) {
+		seq_printf(m, "transport_wakeups: %llu\n",
+			   (unsigned long long) st.wakeups);
+		seq_printf(m, "transport_overruns: %llu\n",
+			   (unsigned long long) st.overruns);
+		seq_printf(m, "transport_peak: %u/%u\n", st.peak, st.n_subbufs);
+	}
+
+	if (state != STAP_SESSION_RUNNING)
+		goto out;
+
+#ifdef STP_NEED_PROBE_STATS
+	for (i = 0; _stp_probe_counts != NULL && i < STP_PROBE_COUNT; i++) {
+		u64 runs = 0, cycles = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			volatile struct _stp_probe_counts *pc =
+				_stp_probe_counts_cpu(cpu);
+			if (pc == NULL)
+				continue;
+			runs += pc[i].runs;
+			cycles += pc[i].cycles;
+		}
+		if (runs == 0)
+			continue;
+		seq_printf(m, "probe %u runs: %llu cycles: %llu %s\n", i,
+			   (unsigned long long) runs,
+			   (unsigned long long) cycles, stap_probes[i].pp);
+	}
+#endif
+
+	_stp_global_stats(m);
+
+out:
+	mutex_unlock(&module_refresh_mutex);
+	return 0;
+}
+
+#endif /* _SESSION_STATS_C_ */
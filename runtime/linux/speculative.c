@@ -0,0 +1,298 @@
+/* -*- linux-c -*-
+ * Speculative output buffers
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _LINUX_SPECULATIVE_C_
+#define _LINUX_SPECULATIVE_C_
+
+/** @file speculative.c
+ * @brief Buffers behind speculation(), speculate(), commit() and discard()
+ *
+ * Each speculation owns one of STP_SPECULATION_SLOTS slots until it is
+ * committed or discarded.  Its text goes into chunks of
+ * STP_SPECULATION_CHUNK bytes, taken as it grows from a pool of
+ * STP_SPECULATION_CHUNKS shared by all speculations.  speculate() only
+ * reserves room with a cmpxchg and copies its string in, so any number
+ * of cpus may append to the same speculation without taking a lock.
+ * commit() closes the slot, waits for the appends under way, and hands
+ * the text to the print buffer.
+ *
+ * A speculation id is its sequence number times STP_SPECULATION_SLOTS,
+ * plus its slot, plus one, so that ids keep growing as before, never
+ * are 0, and find their slot without a lookup.  An id whose slot has
+ * since been reused no longer matches it, and is ignored.
+ *
+ * Nothing here fails a script.  When all the slots are open, as they
+ * end up when a script never commits nor discards some speculations,
+ * speculation() takes over the oldest one.  Text that finds no room is
+ * dropped.  Both are counted, and reported at the end.
+ */
+
+#ifndef STP_SPECULATION_SLOTS
+#define STP_SPECULATION_SLOTS 128
+#endif
+
+#ifndef STP_SPECULATION_CHUNK
+#define STP_SPECULATION_CHUNK 4096
+#endif
+
+#ifndef STP_SPECULATION_CHUNKS
+#define STP_SPECULATION_CHUNKS (2 * STP_SPECULATION_SLOTS)
+#endif
+
+/* The most chunks one speculation may hold. */
+#ifndef STP_SPECULATION_MAX_CHUNKS
+#define STP_SPECULATION_MAX_CHUNKS 64
+#endif
+
+/* The id of a slot being committed, discarded or taken over. */
+#define STP_SPECULATION_CLOSING (-1L)
+
+struct _stp_speculation_chunk {
+	atomic_t used;
+	char buf[STP_SPECULATION_CHUNK];
+};
+
+struct _stp_speculation {
+	atomic_long_t id;	/* owner, 0 while free */
+	atomic_t writers;	/* appends under way */
+	atomic_t len;		/* bytes reserved */
+	struct _stp_speculation_chunk *chunks[STP_SPECULATION_MAX_CHUNKS];
+};
+
+static struct _stp_speculation _stp_speculations[STP_SPECULATION_SLOTS];
+static struct _stp_speculation_chunk _stp_speculation_pool[STP_SPECULATION_CHUNKS];
+static atomic_long_t _stp_speculation_seq = ATOMIC_LONG_INIT(0);
+static atomic_t _stp_speculation_hint = ATOMIC_INIT(0);
+
+/* What was lost, for _stp_speculation_report(). */
+static atomic_t _stp_speculation_taken = ATOMIC_INIT(0);
+static atomic_t _stp_speculation_dropped = ATOMIC_INIT(0);
+static atomic_t _stp_speculation_lost = ATOMIC_INIT(0);
+
+static struct _stp_speculation_chunk *_stp_speculation_chunk_get(void)
+{
+	unsigned start = atomic_inc_return(&_stp_speculation_hint);
+	unsigned i;
+
+	for (i = 0; i < STP_SPECULATION_CHUNKS; i++) {
+		struct _stp_speculation_chunk *c =
+			&_stp_speculation_pool[(start + i) % STP_SPECULATION_CHUNKS];
+
+		if (atomic_read(&c->used) == 0
+		    && atomic_cmpxchg(&c->used, 0, 1) == 0)
+			return c;
+	}
+	return NULL;
+}
+
+static inline void _stp_speculation_chunk_put(struct _stp_speculation_chunk *c)
+{
+	smp_mb__before_atomic();
+	atomic_set(&c->used, 0);
+}
+
+/** Empties slot @s, which its closer owns, and gives back its chunks. */
+static void _stp_speculation_clear(struct _stp_speculation *s)
+{
+	unsigned i;
+
+	for (i = 0; i < STP_SPECULATION_MAX_CHUNKS && s->chunks[i]; i++) {
+		_stp_speculation_chunk_put(s->chunks[i]);
+		s->chunks[i] = NULL;
+	}
+	atomic_set(&s->len, 0);
+}
+
+/** Takes slot @s from its owner @old, waiting out the appends that are
+ * still under way.  Returns 0 if someone else got there first.
+ */
+static int _stp_speculation_close(struct _stp_speculation *s, long old)
+{
+	if (old <= 0
+	    || atomic_long_cmpxchg(&s->id, old, STP_SPECULATION_CLOSING) != old)
+		return 0;
+
+	/* Appends that saw the id before it changed are short; new ones
+	   back off. */
+	while (atomic_read(&s->writers))
+		cpu_relax();
+	smp_rmb();
+	return 1;
+}
+
+/** Claims a slot for a new speculation, and returns its id.  Without a
+ * free slot, the oldest open speculation gives up its own.
+ */
+static long _stp_speculation_new(void)
+{
+	long seq = atomic_long_inc_return(&_stp_speculation_seq);
+	struct _stp_speculation *oldest;
+	unsigned i, tries;
+
+	for (tries = 0; tries < 4; tries++) {
+		long oldest_id = 0;
+
+		oldest = NULL;
+		for (i = 0; i < STP_SPECULATION_SLOTS; i++) {
+			unsigned slot = (seq + i) % STP_SPECULATION_SLOTS;
+			long id = seq * STP_SPECULATION_SLOTS + slot + 1;
+			struct _stp_speculation *s = &_stp_speculations[slot];
+			long cur = atomic_long_read(&s->id);
+
+			if (cur == 0 && atomic_long_cmpxchg(&s->id, 0, id) == 0)
+				return id;
+			if (cur > 0 && (oldest == NULL || cur < oldest_id)) {
+				oldest = s;
+				oldest_id = cur;
+			}
+		}
+
+		if (oldest && _stp_speculation_close(oldest, oldest_id)) {
+			long id = seq * STP_SPECULATION_SLOTS
+				  + (oldest - _stp_speculations) + 1;
+
+			_stp_speculation_clear(oldest);
+			atomic_inc(&_stp_speculation_taken);
+			smp_mb();
+			atomic_long_set(&oldest->id, id);
+			return id;
+		}
+	}
+
+	/* Every slot is changing hands; what goes to this id is lost. */
+	atomic_inc(&_stp_speculation_taken);
+	return seq * STP_SPECULATION_SLOTS + seq % STP_SPECULATION_SLOTS + 1;
+}
+
+static inline struct _stp_speculation *_stp_speculation_slot(long id)
+{
+	if (id <= 0)
+		return NULL;
+	return &_stp_speculations[(id - 1) % STP_SPECULATION_SLOTS];
+}
+
+/** Makes sure @s has chunks for its first @end bytes.  Returns 0 if it
+ * can't.
+ */
+static int _stp_speculation_grow(struct _stp_speculation *s, int end)
+{
+	unsigned i, n = (end + STP_SPECULATION_CHUNK - 1) / STP_SPECULATION_CHUNK;
+
+	if (n > STP_SPECULATION_MAX_CHUNKS)
+		return 0;
+	for (i = 0; i < n; i++) {
+		struct _stp_speculation_chunk *c;
+
+		if (*(struct _stp_speculation_chunk * volatile *)&s->chunks[i])
+			continue;
+		c = _stp_speculation_chunk_get();
+		if (c == NULL)
+			return 0;
+		if (cmpxchg(&s->chunks[i], NULL, c) != NULL)
+			_stp_speculation_chunk_put(c);
+	}
+	return 1;
+}
+
+/** Appends @str to speculation @id, unless it was committed or
+ * discarded.  Text that doesn't fit is dropped and counted.
+ */
+static void _stp_speculation_append(long id, const char *str)
+{
+	struct _stp_speculation *s = _stp_speculation_slot(id);
+	int n = strlen(str);
+
+	if (s == NULL || n == 0)
+		return;
+
+	atomic_inc(&s->writers);
+	smp_mb__after_atomic();
+	if (atomic_long_read(&s->id) == id) {
+		int off, end;
+
+		do {
+			off = atomic_read(&s->len);
+			end = off + n;
+			if (end < off || !_stp_speculation_grow(s, end)) {
+				atomic_inc(&_stp_speculation_dropped);
+				goto out;
+			}
+		} while (atomic_cmpxchg(&s->len, off, end) != off);
+
+		while (off < end) {
+			int in = off % STP_SPECULATION_CHUNK;
+			int k = min_t(int, end - off, STP_SPECULATION_CHUNK - in);
+
+			memcpy(&s->chunks[off / STP_SPECULATION_CHUNK]->buf[in],
+			       str, k);
+			str += k;
+			off += k;
+		}
+	}
+out:
+	smp_mb__before_atomic();
+	atomic_dec(&s->writers);
+}
+
+/** Ends speculation @id, first sending what it holds to the print buffer
+ * if @commit.
+ */
+static void _stp_speculation_end(long id, int commit)
+{
+	struct _stp_speculation *s = _stp_speculation_slot(id);
+	unsigned long flags;
+	int len, off = 0;
+
+	if (s == NULL || !_stp_speculation_close(s, id))
+		return;
+
+	len = atomic_read(&s->len);
+	if (commit && len > 0 && _stp_print_trylock_irqsave(&flags)) {
+		while (off < len) {
+			int in = off % STP_SPECULATION_CHUNK;
+			int n = min_t(int, len - off, STP_SPECULATION_CHUNK - in);
+			char *p;
+
+			n = min_t(int, n, STP_BUFFER_SIZE);
+			p = _stp_reserve_bytes(n);
+			if (p == NULL)
+				break;
+			memcpy(p, &s->chunks[off / STP_SPECULATION_CHUNK]->buf[in], n);
+			off += n;
+		}
+		_stp_print_unlock_irqrestore(&flags);
+	}
+	if (commit && off < len)
+		atomic_add(len - off, &_stp_speculation_lost);
+
+	_stp_speculation_clear(s);
+	smp_mb();
+	atomic_long_set(&s->id, 0);
+}
+
+/** Warns about what was lost, once. */
+static void _stp_speculation_report(void)
+{
+	int taken = atomic_xchg(&_stp_speculation_taken, 0);
+	int dropped = atomic_xchg(&_stp_speculation_dropped, 0);
+	int lost = atomic_xchg(&_stp_speculation_lost, 0);
+
+	if (taken)
+		_stp_warn("%d speculations were taken over by newer ones, "
+			  "try -DSTP_SPECULATION_SLOTS=N", taken);
+	if (dropped)
+		_stp_warn("%d speculate() strings found no room, "
+			  "try -DSTP_SPECULATION_CHUNKS=N", dropped);
+	if (lost)
+		_stp_warn("%d bytes of committed speculations were dropped",
+			  lost);
+}
+
+#endif /* _LINUX_SPECULATIVE_C_ */
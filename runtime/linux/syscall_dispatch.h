@@ -0,0 +1,73 @@
+/* -*- linux-c -*-
+ * Syscall number dispatch for raw_syscalls tracepoint probes
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _LINUX_SYSCALL_DISPATCH_H_
+#define _LINUX_SYSCALL_DISPATCH_H_
+
+#include <linux/sort.h>
+#include "syscall.h"
+
+/* The tp_syscall.* probes all hang off sys_enter and sys_exit, and
+ * each starts by comparing the syscall number with its own.  Rather
+ * than registering every one of them with the tracepoint, the
+ * translator registers one callback per tracepoint, with a table of
+ * (syscall number, probe) entries for the numbers each probe's gate
+ * lets through.  The numbers are only known to the compiler, so the
+ * table is sorted at module init, and each syscall then finds its
+ * probes with a binary search. */
+
+struct _stp_syscall_dispatch {
+	long nr;
+	unsigned probe;		/* case label in the generated callback */
+};
+
+static int _stp_syscall_dispatch_cmp(const void *a, const void *b)
+{
+	const struct _stp_syscall_dispatch *x = a, *y = b;
+
+	if (x->nr != y->nr)
+		return x->nr < y->nr ? -1 : 1;
+	return x->probe < y->probe ? -1 : x->probe > y->probe;
+}
+
+/** Sorts a table by number, dropping the duplicates left by a probe
+ * whose native and compat numbers are the same.  Returns the number
+ * of entries kept. */
+static size_t _stp_syscall_dispatch_sort(struct _stp_syscall_dispatch *t,
+					 size_t n)
+{
+	size_t i, kept = 0;
+
+	sort(t, n, sizeof(*t), _stp_syscall_dispatch_cmp, NULL);
+	for (i = 0; i < n; i++)
+		if (kept == 0 || _stp_syscall_dispatch_cmp(&t[kept - 1], &t[i]))
+			t[kept++] = t[i];
+	return kept;
+}
+
+/** The first entry for @nr in a sorted table, or NULL. */
+static inline const struct _stp_syscall_dispatch *
+_stp_syscall_dispatch_find(const struct _stp_syscall_dispatch *t, size_t n,
+			   long nr)
+{
+	size_t lo = 0, hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (t[mid].nr < nr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo < n && t[lo].nr == nr) ? &t[lo] : NULL;
+}
+
+#endif /* _LINUX_SYSCALL_DISPATCH_H_ */
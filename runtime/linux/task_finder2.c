@@ -6,6 +6,9 @@
 #include <linux/list.h>
 #include <linux/binfmts.h>
 #include <linux/mount.h>
+#include <linux/namei.h>
+#include <linux/jhash.h>
+#include <linux/hash.h>
 #include "stap_mmap_lock.h"
 #ifndef STAPCONF_TASK_UID
 #include <linux/cred.h>
@@ -26,6 +29,18 @@ static LIST_HEAD(__stp_task_finder_list);
 
 struct stap_task_finder_target;
 
+/*
+ * Index of the procname-based targets of __stp_task_finder_list, by
+ * the inode their procname resolved to at startup and by the last
+ * component of their procname, so that clone and exec don't have to
+ * build and compare the path of the executable against each target.
+ */
+#define __STP_TF_HASH_BITS 6
+#define __STP_TF_HASH_SIZE (1 << __STP_TF_HASH_BITS)
+static struct hlist_head __stp_tf_inode_table[__STP_TF_HASH_SIZE];
+static struct hlist_head __stp_tf_name_table[__STP_TF_HASH_SIZE];
+static unsigned __stp_tf_any_targets;	/* targets of all threads */
+
 #define __STP_TF_UNITIALIZED	0
 #define __STP_TF_STARTING	1
 #define __STP_TF_RUNNING	2
@@ -87,6 +102,11 @@ struct stap_task_finder_target {
 	struct list_head callback_list;
 	struct utrace_engine_ops ops;
 	size_t pathlen;
+	struct hlist_node inode_node;	/* __stp_tf_inode_table linkage */
+	struct hlist_node name_node;	/* __stp_tf_name_table linkage */
+	dev_t dev;			/* procname's inode, if it resolved */
+	unsigned long ino;
+	u32 name_hash;			/* procname's last component */
 	unsigned engine_attached:1;
 	unsigned mmap_events:1;
 	unsigned munmap_events:1;
@@ -383,6 +403,69 @@ stap_register_task_finder_target(struct stap_task_finder_target *new_tgt)
 	return 0;
 }
 
+static inline u32
+__stp_tf_name_hash(const void *name, unsigned len)
+{
+	return jhash(name, len, 0);
+}
+
+static inline unsigned
+__stp_tf_inode_hash(dev_t dev, unsigned long ino)
+{
+	return hash_long(ino ^ (unsigned long) dev, __STP_TF_HASH_BITS);
+}
+
+// Fill the target index, once all targets are registered.  A
+// procname that doesn't resolve yet is only indexed by its name.
+static void
+__stp_tf_index_targets(void)
+{
+	struct stap_task_finder_target *tgt;
+	int i;
+
+	for (i = 0; i < __STP_TF_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&__stp_tf_inode_table[i]);
+		INIT_HLIST_HEAD(&__stp_tf_name_table[i]);
+	}
+	__stp_tf_any_targets = 0;
+
+	list_for_each_entry(tgt, &__stp_task_finder_list, list) {
+		const char *name;
+
+		tgt->dev = 0;
+		tgt->ino = 0;
+		if (tgt->pathlen == 0) {
+			if (tgt->pid == 0)
+				__stp_tf_any_targets++;
+			continue;
+		}
+
+		name = strrchr(tgt->procname, '/');
+		name = name ? name + 1 : tgt->procname;
+		tgt->name_hash = __stp_tf_name_hash(name, strlen(name));
+		hlist_add_head(&tgt->name_node,
+			       &__stp_tf_name_table[tgt->name_hash
+						    & (__STP_TF_HASH_SIZE - 1)]);
+#ifdef STAPCONF_KERN_PATH
+		{
+			struct path path;
+
+			if (kern_path(tgt->procname, LOOKUP_FOLLOW, &path) == 0) {
+				struct inode *inode = path.dentry->d_inode;
+
+				if (inode) {
+					tgt->dev = inode->i_sb->s_dev;
+					tgt->ino = inode->i_ino;
+					hlist_add_head(&tgt->inode_node,
+						       &__stp_tf_inode_table[__stp_tf_inode_hash(tgt->dev, tgt->ino)]);
+				}
+				path_put(&path);
+			}
+		}
+#endif
+	}
+}
+
 static int
 stap_utrace_detach(struct task_struct *tsk,
 		   const struct utrace_engine_ops *ops)
@@ -464,6 +547,16 @@ stap_utrace_detach(struct task_struct *tsk,
 	return rc;
 }
 
+static char *
+__stp_get_file_path(struct file *vm_file, char *buf, int buflen)
+{
+#ifdef STAPCONF_DPATH_PATH
+	return d_path(&(vm_file->f_path), buf, buflen);
+#else
+	return d_path(vm_file->f_dentry, vm_file->f_vfsmnt, buf, buflen);
+#endif
+}
+
 static char *
 __stp_get_mm_path(struct mm_struct *mm, char *buf, int buflen)
 {
@@ -471,12 +564,7 @@ __stp_get_mm_path(struct mm_struct *mm, char *buf, int buflen)
 	char *rc = NULL;
 
 	if (vm_file) {
-#ifdef STAPCONF_DPATH_PATH
-		rc = d_path(&(vm_file->f_path), buf, buflen);
-#else
-		rc = d_path(vm_file->f_dentry, vm_file->f_vfsmnt,
-			    buf, buflen);
-#endif
+		rc = __stp_get_file_path(vm_file, buf, buflen);
 		fput(vm_file);
 	}
 	else {
@@ -654,23 +742,25 @@ __stp_call_callbacks(struct stap_task_finder_target *tgt,
 	}
 }
 
-bool
-__verify_build_id(struct task_struct *tsk, unsigned long addr,
-			  unsigned const char *build_id, int build_id_len)
+// Returns 1 if the build-id at addr in tsk is build_id, 0 if it is
+// another one, or -errno if it can't be read.
+int
+__check_build_id(struct task_struct *tsk, unsigned long addr,
+		 unsigned const char *build_id, int build_id_len)
 {
 #define MAX_HEXSTR_LEN 64
 	int i;
 	unsigned char tsk_build_id[MAX_HEXSTR_LEN + 1];
 
 	if (build_id_len > MAX_HEXSTR_LEN)
-		return false;
+		return -EINVAL;
 
 	for (i = 0; i < build_id_len / 2; i++) {
 		int rc;
 		unsigned char b;
 
 		if ((rc = __access_process_vm_noflush(tsk, addr + i, &b, 1, 0)) != 1)
-			return false;
+			return -EFAULT;
 
 		tsk_build_id[i * 2]     = "0123456789abcdef"[b >> 4];
 		tsk_build_id[i * 2 + 1] = "0123456789abcdef"[b & 0xf];
@@ -680,10 +770,17 @@ __verify_build_id(struct task_struct *tsk, unsigned long addr,
 	if (strcmp(build_id, tsk_build_id)) {
 		dbug_task(2, "target build-id not matched: [%s] @ 0x%lx != [%s]\n",
 			  build_id, addr, tsk_build_id);
-		return false;
+		return 0;
 	}
 
-	return true;
+	return 1;
+}
+
+bool
+__verify_build_id(struct task_struct *tsk, unsigned long addr,
+		  unsigned const char *build_id, int build_id_len)
+{
+	return __check_build_id(tsk, addr, build_id, build_id_len) == 1;
 }
 
 static void
@@ -879,14 +976,56 @@ __stp_call_mprotect_callbacks(struct stap_task_finder_target *tgt,
 	}
 }
 
-static inline void
-__stp_utrace_attach_match_filename(struct task_struct *tsk,
-				   const char * const filename,
-				   int process_p)
+static inline int
+__stp_utrace_attach_match_target(struct task_struct *tsk,
+				 struct stap_task_finder_target *tgt,
+				 uid_t tsk_euid)
+{
+	int rc;
+
+#if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV) && \
+    ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPSYS)
+	/* Make sure unprivileged users only probe their own threads. */
+	if (_stp_uid != tsk_euid) {
+		if (tgt->pid != 0) {
+			_stp_warn("Process %d does not belong to unprivileged user %d",
+				  tsk->pid, _stp_uid);
+		}
+		return 0;
+	}
+#endif
+
+	// Set up events we need for attached tasks. We won't
+	// actually call the callbacks here - we'll call them
+	// when the thread gets quiesced.
+	rc = __stp_utrace_attach(tsk, &tgt->ops, tgt,
+				 __STP_ATTACHED_TASK_EVENTS,
+				 UTRACE_INTERRUPT);
+	if (rc != 0 && rc != EPERM)
+		return rc;
+	tgt->engine_attached = 1;
+	return 0;
+}
+
+// Attach the targets of the executable file to tsk.  Targets of all
+// threads always match, procname-based ones are found by the inode of
+// the file, and only those named like the file but not of its inode
+// (it may have been replaced, or not existed at startup) need the path
+// of the file built to be compared.
+static void
+__stp_utrace_attach_match_file(struct task_struct *tsk, struct file *file,
+			       struct dentry *dentry, int process_p)
 {
-	size_t filelen;
-	struct list_head *tgt_node;
 	struct stap_task_finder_target *tgt;
+	struct inode *inode = dentry->d_inode;
+	dev_t dev = inode ? inode->i_sb->s_dev : 0;
+	unsigned long ino = inode ? inode->i_ino : 0;
+	u32 name_hash = __stp_tf_name_hash(dentry->d_name.name,
+					   dentry->d_name.len);
+	char *mmpath_buf = NULL;
+	char *mmpath = NULL;
+	size_t mmpathlen = 0;
+	struct hlist_node *node;
 	uid_t tsk_euid;
 
 #ifdef STAPCONF_TASK_UID
@@ -898,62 +1037,69 @@ __stp_utrace_attach_match_filename(struct task_struct *tsk,
 	tsk_euid = task_euid(tsk);
 #endif
 #endif
-	filelen = strlen(filename);
-	list_for_each(tgt_node, &__stp_task_finder_list) {
-		int rc;
 
-		tgt = list_entry(tgt_node, struct stap_task_finder_target,
-				 list);
-		// If we've got a matching procname or a matching build-id
-		// or we're probing all threads, we've got a match.  We've
-		// got to keep matching since a single thread could match a
-		// procname/build-id and match an "all thread" probe.
-		if (tgt == NULL)
-			continue;
-                /* buildid-based target ... gets checked in __stp_tf_quiesce_worker */
-                /* procname-based target */
-		else if (tgt->pathlen > 0
-			 && (tgt->pathlen != filelen
-			     || strcmp(tgt->procname, filename) != 0))
-		{
-			dbug_task(2, "target path NOT matched: [%s] != [%s]",
-			          tgt->procname, filename);
-			continue;
+	/* Targets without a procname that probe all threads.
+	 * buildid-based ones get checked in __stp_tf_quiesce_worker,
+	 * pid-based ones were handled at startup. */
+	if (__stp_tf_any_targets) {
+		list_for_each_entry(tgt, &__stp_task_finder_list, list) {
+			if (tgt->pathlen == 0 && tgt->pid == 0
+			    && __stp_utrace_attach_match_target(tsk, tgt,
+								tsk_euid))
+				return;
 		}
-		/* Ignore pid-based target, they were handled at startup. */
-		else if (tgt->pid != 0)
-			continue;
-		/* Notice that "pid == 0" (which means to probe all
-		 * threads) falls through. */
+	}
 
-#if ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPDEV) && \
-    ! STP_PRIVILEGE_CONTAINS (STP_PRIVILEGE, STP_PR_STAPSYS)
-		/* Make sure unprivileged users only probe their own threads. */
-		if (_stp_uid != tsk_euid) {
-			if (tgt->pid != 0) {
-				_stp_warn("Process %d does not belong to unprivileged user %d",
-					  tsk->pid, _stp_uid);
+	/* procname-based targets of this very file */
+	if (inode) {
+		stap_hlist_for_each_entry(tgt, node,
+					  &__stp_tf_inode_table[__stp_tf_inode_hash(dev, ino)],
+					  inode_node) {
+			if (tgt->ino == ino && tgt->dev == dev
+			    && __stp_utrace_attach_match_target(tsk, tgt,
+								tsk_euid))
+				return;
+		}
+	}
+
+	/* procname-based targets only named like it */
+	stap_hlist_for_each_entry(tgt, node,
+				  &__stp_tf_name_table[name_hash & (__STP_TF_HASH_SIZE - 1)],
+				  name_node) {
+		if (tgt->name_hash != name_hash
+		    || (inode && tgt->ino == ino && tgt->dev == dev))
+			continue;
+		if (mmpath == NULL) {
+			mmpath_buf = _stp_kmalloc(PATH_MAX);
+			if (mmpath_buf == NULL) {
+				_stp_error("Unable to allocate space for path");
+				return;
 			}
+			mmpath = __stp_get_file_path(file, mmpath_buf, PATH_MAX);
+			if (mmpath == NULL || IS_ERR(mmpath)) {
+				int rc = -PTR_ERR(mmpath);
+				if (rc != ENOENT)
+					_stp_error("Unable to get path (error %d) for pid %d",
+						   rc, (int)tsk->pid);
+				break;
+			}
+			mmpathlen = strlen(mmpath);
+		}
+		if (tgt->pathlen != mmpathlen
+		    || strcmp(tgt->procname, mmpath) != 0) {
+			dbug_task(2, "target path NOT matched: [%s] != [%s]",
+				  tgt->procname, mmpath);
 			continue;
 		}
-#endif
-
-
-		// Set up events we need for attached tasks. We won't
-		// actually call the callbacks here - we'll call them
-		// when the thread gets quiesced.
-		rc = __stp_utrace_attach(tsk, &tgt->ops, tgt,
-					 __STP_ATTACHED_TASK_EVENTS,
-					 UTRACE_INTERRUPT);
-		if (rc != 0 && rc != EPERM)
+		if (__stp_utrace_attach_match_target(tsk, tgt, tsk_euid))
 			break;
-		tgt->engine_attached = 1;
 	}
+	_stp_kfree(mmpath_buf);
 }
 
 // This function handles the details of getting a task's associated
-// procname, and calling __stp_utrace_attach_match_filename() to
-// attach to it if we find the procname "interesting".  So, what's the
+// executable, and calling __stp_utrace_attach_match_file() to attach
+// to it if we find the executable "interesting".  So, what's the
 // difference between path_tsk and match_tsk?  Normally they are the
 // same, except in one case.  In an UTRACE_EVENT(EXEC), we need to
 // detach engines from the newly exec'ed process (since its path has
@@ -965,18 +1111,14 @@ __stp_utrace_attach_match_tsk(struct task_struct *path_tsk,
 			      struct task_struct *match_tsk, int process_p)
 {
 	struct mm_struct *mm;
-	char *mmpath_buf;
-	char *mmpath;
+	struct file *vm_file;
 
-#if 0
-	printk(KERN_ERR "%s:%d entry\n", __FUNCTION__, __LINE__);
-#endif
 	if (path_tsk == NULL || path_tsk->pid <= 0
 	    || match_tsk == NULL || match_tsk->pid <= 0
 	    || (_stp_target && match_tsk != path_tsk))
 		return;
 
-	// Grab the path associated with the path_tsk.
+	// Grab the executable associated with the path_tsk.
 	//
 	// Note we're not calling get_task_mm()/mmput() here.  Since
 	// we're in the the context of path_task, the mm should stick
@@ -988,33 +1130,17 @@ __stp_utrace_attach_match_tsk(struct task_struct *path_tsk,
 		return;
 	}
 
-	// Allocate space for a path
-	mmpath_buf = _stp_kmalloc(PATH_MAX);
-	if (mmpath_buf == NULL) {
-		_stp_error("Unable to allocate space for path");
+	vm_file = stap_find_exe_file(mm);
+	if (vm_file == NULL)
 		return;
-	}
-
-	// Grab the path associated with the new task
-	mmpath = __stp_get_mm_path(mm, mmpath_buf, PATH_MAX);
-	if (mmpath == NULL || IS_ERR(mmpath)) {
-		int rc = -PTR_ERR(mmpath);
-		if (rc != ENOENT)
-			_stp_error("Unable to get path (error %d) for pid %d",
-				   rc, (int)path_tsk->pid);
-	}
-	else {
-#if 0
-		_stp_dbug(__FUNCTION__, __LINE__,
-			  "calling __stp_utrace_attach_match_filename(%p, %s, %d, %d)\n",
-			  match_tsk, mmpath, register_p, process_p);
+#ifdef STAPCONF_DPATH_PATH
+	__stp_utrace_attach_match_file(match_tsk, vm_file,
+				       vm_file->f_path.dentry, process_p);
+#else
+	__stp_utrace_attach_match_file(match_tsk, vm_file,
+				       vm_file->f_dentry, process_p);
 #endif
-		__stp_utrace_attach_match_filename(match_tsk, mmpath,
-						   process_p);
-	}
-
-	_stp_kfree(mmpath_buf);
-	return;
+	fput(vm_file);
 }
 
 static void
@@ -1714,6 +1840,7 @@ stap_start_task_finder(void)
 	}
 
         __stp_tf_map_initialize();
+	__stp_tf_index_targets();
 
 	atomic_set(&__stp_task_finder_state, __STP_TF_RUNNING);
 
@@ -62,6 +62,28 @@ static inline void _stp_hrtimer_update(struct stap_hrtimer_probe *stp)
 }
 
 
+/* Whether any probe sharing the timer of @lead wants it running. */
+static inline int _stp_hrtimer_wanted(struct stap_hrtimer_probe *lead)
+{
+	struct stap_hrtimer_probe *stp;
+
+	for (stp = lead; stp != NULL; stp = stp->next)
+		if (stp->probe->cond_enabled)
+			return 1;
+	return 0;
+}
+
+
+/* Whether @stp is to run on this expiry of its lead's timer. */
+static inline int _stp_hrtimer_due(struct stap_hrtimer_probe *stp)
+{
+	if (stp->ticks > 1 && ++stp->tick < stp->ticks)
+		return 0;
+	stp->tick = 0;
+	return stp->probe->cond_enabled;
+}
+
+
 static int
 _stp_hrtimer_start(struct stap_hrtimer_probe *stp)
 {
@@ -84,6 +106,8 @@ _stp_hrtimer_create(struct stap_hrtimer_probe *stp,
 static void
 _stp_hrtimer_cancel(struct stap_hrtimer_probe *stp)
 {
+	if (stp->lead != stp)	/* never had a timer of its own */
+		return;
 	hrtimer_cancel(&stp->hrtimer);
 }
 
@@ -25,6 +25,12 @@ struct stap_hrtimer_probe {
 	int64_t intrv;
 	int64_t rnd;
 	unsigned enabled;
+	/* Probes whose interval is a multiple of another's, neither of
+	   them randomized, run off that probe's timer: lead owns the
+	   hrtimer, next chains the probes it runs, and each of them runs
+	   on every ticks'th expiry. */
+	struct stap_hrtimer_probe *lead, *next;
+	unsigned ticks, tick;
 };
 
 // The function signature changed in 2.6.21.
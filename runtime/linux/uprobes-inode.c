@@ -17,6 +17,7 @@
 #include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/uprobes.h>
+#include <linux/sort.h>
 
 /* STAPIU: SystemTap Inode Uprobes */
 
@@ -97,9 +98,15 @@ struct stapiu_process {
   unsigned long relocation;         // the mmap'ed .text address
   unsigned long base;               // the address to apply sdt offsets against
   pid_t tgid;                       // pid
+  int sems_applied;                 // its group's semaphores were incremented
 };
 
 
+/* Number of build-id mismatches remembered per consumer. */
+#ifndef STAPIU_MISMATCH_CACHE
+#define STAPIU_MISMATCH_CACHE 8
+#endif
+
 /* A consumer is a declaration of a family of uprobes we want to
    place, on one or more IDENTICAL files specified by name or buildid.
    When a matching binaries are found, new stapiu_instances are
@@ -130,9 +137,24 @@ struct stapiu_consumer {
   unsigned long solib_build_id_vaddr;
   const char *solib_build_id;
   int solib_build_id_len;
+  // Files mapped from their start whose build-id didn't match, pinned
+  // so their inodes aren't reused, so that mapping them again in some
+  // process needs no build-id read.  Replaced round-robin; protected
+  // by consumer_lock.
+  struct inode *solib_mismatch[STAPIU_MISMATCH_CACHE];
+  unsigned solib_mismatch_next;
 
   // The key by which we can match the _stp_module[] element
   const char *module_name;
+
+  // The first consumer of the same file, e.g. of a process.function("*")
+  // with its thousands of consumers.  Its instances and build-id
+  // mismatches tell the whole group whether an inode was verified, so
+  // that only its first consumer reads the build-id.  That one also
+  // writes the sdt semaphores of the group.  Set by stapiu_init.
+  struct stapiu_consumer *group;
+  unsigned group_nr; // consumers in the group it leads, itself included
+  unsigned group_sems; // ... and how many of them have a semaphore
   
   struct mutex consumer_lock;
   // a lock to protect lists etc. from iteration/modification; NB: not
@@ -316,9 +338,50 @@ stapiu_write_task_semaphore(struct task_struct* task,
 }
 
 
-static void
-stapiu_decrement_process_semaphores(struct stapiu_process *p,
-				    struct stapiu_consumer *c)
+/* Add delta to the semaphores of a task at the sorted addrs, which may
+ * repeat.  Only the two bytes of each semaphore are read and written, once
+ * per distinct address, so that nothing else in the task's memory is
+ * rewritten from a stale copy.  An increment is all or nothing: if one
+ * semaphore can't be written, those already written are put back.  A
+ * decrement goes on with the rest.  */
+static int
+stapiu_write_task_semaphores(struct task_struct* task,
+			     const unsigned long *addrs, size_t n, short delta)
+{
+    size_t i, j, k;
+    int rc = 0;
+
+    for (i = 0; i < n; i = j) {
+      for (j = i + 1; j < n && addrs[j] == addrs[i]; j++)
+	;
+      if (! stapiu_write_task_semaphore(task, addrs[i], delta * (short) (j - i)))
+	continue;
+      rc = 1;
+      if (delta < 0)
+	continue;
+      for (k = 0; k < i; k = j) {
+	for (j = k + 1; j < i && addrs[j] == addrs[k]; j++)
+	  ;
+	stapiu_write_task_semaphore(task, addrs[k], -delta * (short) (j - k));
+      }
+      break;
+    }
+    return rc;
+}
+
+
+static int
+stapiu_addr_cmp(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *) a;
+  unsigned long y = *(const unsigned long *) b;
+  return (x > y) - (x < y);
+}
+
+
+/* Find a task by its tgid, with a reference, or NULL if it exited.  */
+static struct task_struct *
+stapiu_get_task(pid_t tgid)
 {
     struct task_struct *task;
     rcu_read_lock();
@@ -326,51 +389,140 @@ stapiu_decrement_process_semaphores(struct stapiu_process *p,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
     /* We'd like to call find_task_by_pid_ns() here, but it isn't
      * exported.  So, we call what it calls...  */
-    task = pid_task(find_pid_ns(p->tgid, &init_pid_ns), PIDTYPE_PID);
+    task = pid_task(find_pid_ns(tgid, &init_pid_ns), PIDTYPE_PID);
 #else
-    task = find_task_by_pid(p->tgid);
+    task = find_task_by_pid(tgid);
 #endif
 
+    /* Holding the rcu read lock makes us atomic, and we can't write
+     * userspace memory while atomic (which could pagefault).  So,
+     * instead we lock the task structure, then release the rcu read
+     * lock. */
+    if (task)
+      get_task_struct(task);
+    rcu_read_unlock();
+    return task;
+}
+
+
+/* Decrement the semaphores of the group c leads, which
+ * stapiu_change_semaphore_plus() incremented for p.  */
+static void
+stapiu_decrement_process_semaphores(struct stapiu_process *p,
+				    struct stapiu_consumer *c)
+{
     /* The task may have exited while we weren't watching.  */
+    struct task_struct *task = stapiu_get_task(p->tgid);
+    struct stapiu_consumer *m;
+
     if (task) {
-      /* Holding the rcu read lock makes us atomic, and we
-       * can't write userspace memory while atomic (which
-       * could pagefault).  So, instead we lock the task
-       * structure, then release the rcu read lock. */
-      get_task_struct(task);
-      rcu_read_unlock();
-      
-      if (c->sdt_sem_offset) {
-	unsigned long addr = p->base + c->sdt_sem_offset;
-	stapiu_write_task_semaphore(task, addr, -1);
-      }
+      for (m = c; m < c + c->group_nr; m++)
+	if (m->sdt_sem_offset) {
+	  unsigned long addr = p->base + m->sdt_sem_offset;
+	  stapiu_write_task_semaphore(task, addr, -1);
+	}
       put_task_struct(task);
-    } else {
-      rcu_read_unlock();
     }
 }
 
 
+struct stapiu_semaphore {
+  pid_t tgid;
+  unsigned long addr;
+};
+
+static int
+stapiu_semaphore_cmp(const void *a, const void *b)
+{
+  const struct stapiu_semaphore *x = a, *y = b;
+  if (x->tgid != y->tgid)
+    return (x->tgid > y->tgid) - (x->tgid < y->tgid);
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+
 /* As part of shutdown, we need to decrement the semaphores in every task we've
- * been attached to.  */
+ * been attached to: exactly those of each group leader's processes that
+ * stapiu_change_semaphore_plus() incremented.  They are sorted by task, so
+ * that each task is looked up once and its semaphores are written
+ * together.  */
 static void
 stapiu_decrement_semaphores(struct stapiu_consumer *consumers, size_t nconsumers)
 {
-  size_t i;
+  size_t i, j, n = 0;
+  struct stapiu_semaphore *sems;
+  unsigned long *addrs;
+
   /* NB: no process_list_lock use needed as the task_finder engine is
    * already stopped by now, so no one else will mess with us.  We need
    * to be sleepable for access_process_vm.  */
   for (i = 0; i < nconsumers; ++i) {
     struct stapiu_consumer *c = &consumers[i];
     struct stapiu_process *p;
-    int has_semaphores = 0;
     
-    if (! c->sdt_sem_offset)
+    if (c->group != c || ! c->group_sems)
       continue;
-    
     list_for_each_entry(p, &c->process_list_head, process_list)
-      stapiu_decrement_process_semaphores(p, c);
+      if (p->sems_applied)
+	n += c->group_sems;
+  }
+  if (n == 0)
+    return;
+
+  sems = _stp_vzalloc(n * sizeof(*sems));
+  addrs = sems ? _stp_vzalloc(n * sizeof(*addrs)) : NULL;
+  if (addrs == NULL) {
+    /* Do it the slow way.  */
+    _stp_vfree(sems);
+    for (i = 0; i < nconsumers; ++i) {
+      struct stapiu_consumer *c = &consumers[i];
+      struct stapiu_process *p;
+      
+      if (c->group != c || ! c->group_sems)
+	continue;
+      list_for_each_entry(p, &c->process_list_head, process_list)
+	if (p->sems_applied)
+	  stapiu_decrement_process_semaphores(p, c);
+    }
+    return;
   }
+
+  n = 0;
+  for (i = 0; i < nconsumers; ++i) {
+    struct stapiu_consumer *c = &consumers[i];
+    struct stapiu_consumer *m;
+    struct stapiu_process *p;
+    
+    if (c->group != c || ! c->group_sems)
+      continue;
+    list_for_each_entry(p, &c->process_list_head, process_list) {
+      if (! p->sems_applied)
+	continue;
+      for (m = c; m < c + c->group_nr; m++)
+	if (m->sdt_sem_offset) {
+	  sems[n].tgid = p->tgid;
+	  sems[n].addr = p->base + m->sdt_sem_offset;
+	  n++;
+	}
+    }
+  }
+  sort(sems, n, sizeof(*sems), stapiu_semaphore_cmp, NULL);
+
+  for (i = 0; i < n; i = j) {
+    struct task_struct *task;
+
+    for (j = i; j < n && sems[j].tgid == sems[i].tgid; j++)
+      addrs[j - i] = sems[j].addr;
+    /* The task may have exited while we weren't watching.  */
+    task = stapiu_get_task(sems[i].tgid);
+    if (task) {
+      stapiu_write_task_semaphores(task, addrs, j - i, -1);
+      put_task_struct(task);
+    }
+    cond_resched();
+  }
+  _stp_vfree(addrs);
+  _stp_vfree(sems);
 }
 
 
@@ -380,6 +532,7 @@ stapiu_consumer_unreg(struct stapiu_consumer *c)
 {
   struct stapiu_instance *inst, *in2;
   struct stapiu_process *p, *tmp;  
+  unsigned i;
 
   // no need for locking protection; by the time this cleanup
   // is triggered, no further list modifying ops can also go
@@ -399,6 +552,12 @@ stapiu_consumer_unreg(struct stapiu_consumer *c)
     // no refcount used for the inode field
     _stp_kfree (p);
   }
+
+  for (i = 0; i < STAPIU_MISMATCH_CACHE; i++) {
+    if (c->solib_mismatch[i])
+      iput(c->solib_mismatch[i]);
+    c->solib_mismatch[i] = NULL;
+  }
 }
 
 
@@ -439,6 +598,28 @@ stapiu_exit(struct stapiu_consumer *consumers, size_t nconsumers)
 }
 
 
+static int
+stapiu_streq(const char *a, const char *b)
+{
+  return (a == b) || (a && b && strcmp(a, b) == 0);
+}
+
+/* Whether two consumers are for the same file.  */
+static int
+stapiu_same_file(const struct stapiu_consumer *a,
+		 const struct stapiu_consumer *b)
+{
+  return a->finder.pid == b->finder.pid
+    && stapiu_streq(a->finder.procname, b->finder.procname)
+    && stapiu_streq((const char *) a->finder.build_id,
+		    (const char *) b->finder.build_id)
+    && stapiu_streq(a->solib_pathname, b->solib_pathname)
+    && stapiu_streq(a->solib_build_id, b->solib_build_id)
+    && a->solib_build_id_vaddr == b->solib_build_id_vaddr
+    && stapiu_streq(a->module_name, b->module_name);
+}
+
+
 /* Initialize every consumer.  */
 static int
 stapiu_init(struct stapiu_consumer *consumers, size_t nconsumers)
@@ -447,6 +628,14 @@ stapiu_init(struct stapiu_consumer *consumers, size_t nconsumers)
   size_t i;
   for (i = 0; i < nconsumers; ++i) {
     struct stapiu_consumer *c = &consumers[i];
+    // The consumers of one file are generated next to each other.
+    c->group = c;
+    c->group_nr = c->group_sems = 0;
+    if (i > 0 && stapiu_same_file(consumers[i-1].group, c))
+      c->group = consumers[i-1].group;
+    c->group->group_nr++;
+    if (c->sdt_sem_offset)
+      c->group->group_sems++;
     INIT_LIST_HEAD(&c->instance_list_head);
     INIT_LIST_HEAD(&c->process_list_head);
     mutex_init(&c->consumer_lock);
@@ -480,6 +669,54 @@ stapiu_refresh(struct stapiu_consumer *consumers, size_t nconsumers)
 }
 
 
+/* Whether the build-id of an inode is known for the consumers of the
+   group c leads: 1 if it matched (c has an instance for it, which pins
+   it), -1 if it didn't, 0 if it wasn't checked yet.  */
+static int
+stapiu_build_id_known(struct stapiu_consumer *c, struct inode *inode)
+{
+  struct stapiu_instance *inst;
+  int known = 0;
+  unsigned i;
+
+  mutex_lock(&c->consumer_lock);
+  list_for_each_entry(inst, &c->instance_list_head, instance_list) {
+    if (inst->inode == inode) {
+      known = 1;
+      goto out;
+    }
+  }
+  for (i = 0; i < STAPIU_MISMATCH_CACHE; i++) {
+    if (c->solib_mismatch[i] == inode) {
+      known = -1;
+      break;
+    }
+  }
+out:
+  mutex_unlock(&c->consumer_lock);
+  return known;
+}
+
+
+/* Remember that the build-id of an inode didn't match. */
+static void
+stapiu_build_id_mismatch(struct stapiu_consumer *c, struct inode *inode)
+{
+  struct inode *old;
+
+  inode = igrab(inode);
+  if (!inode)
+    return;
+  mutex_lock(&c->consumer_lock);
+  old = c->solib_mismatch[c->solib_mismatch_next];
+  c->solib_mismatch[c->solib_mismatch_next] = inode;
+  c->solib_mismatch_next = (c->solib_mismatch_next + 1) % STAPIU_MISMATCH_CACHE;
+  mutex_unlock(&c->consumer_lock);
+  if (old)
+    iput(old);
+}
+
+
 /* Task-finder found a process with a target that we're interested in.
    Time to create a stapiu_instance for this inode/consumer combination. */
 static int
@@ -504,11 +741,14 @@ stapiu_change_plus(struct stapiu_consumer* c, struct task_struct *task,
      0 for LOADable "R E" segments, because the read-only .note.*
      stuff may have been loaded earlier, separately.  PR23890. */
   // NB: this is not really necessary for buildid-based probes,
-  // which had this verified already.
-  rc = _stp_usermodule_check(task, c->module_name,
-			     relocation - offset);
-  if (rc)
-    goto out;
+  // which had this verified already, nor for an inode the group
+  // leader already has an instance for.
+  if (stapiu_build_id_known(c->group, inode) <= 0) {
+    rc = _stp_usermodule_check(task, c->module_name,
+			       relocation - offset);
+    if (rc)
+      goto out;
+  }
 
   dbug_uprobes("notified for inode-offset arrival u%sprobe "
 	       "%lu:%p pidx %zu target procname:%s buildid:%s\n",
@@ -581,65 +821,84 @@ stapiu_change_plus(struct stapiu_consumer* c, struct task_struct *task,
 
 
 /* Task-finder found a writable mapping in our interested target.
- * Increment the semaphore now.  */
+ * Increment the semaphores now: those of all the consumers of the
+ * group c leads, in one batch, since they are for the same file.  */
 static int
 stapiu_change_semaphore_plus(struct stapiu_consumer* c, struct task_struct *task,
 			     unsigned long relocation, struct inode* inode)
 {
   int rc = 0;
   struct stapiu_process *p;
+  struct stapiu_consumer *m;
+  unsigned long base = 0, *addrs;
   int any_found;
   unsigned long flags;
+  size_t n = 0;
   
-  if (! c->sdt_sem_offset) // nothing to do
+  if (c->group != c) // the group's first consumer did it
+    return 0;
+  if (! c->group_sems) // nothing to do
     return 0;
 
-  dbug_uprobes("considering semaphore (u%sprobe) pid %ld inode 0x%lx"
+  dbug_uprobes("considering semaphores (u%sprobe) pid %ld inode 0x%lx"
                "pidx %zu\n",
                c->return_p ? "ret" : "",
                (long) task->tgid,
                (unsigned long) inode,
                c->probe->index);
   
-  // NB: we mustn't hold a lock while changing the task memory,
-  // but we need a lock to protect the process_list from concurrent
-  // add/delete.  So hold a spinlock during iteration until the first
-  // hit, then unlock & process.  NB: We could in principle have multiple
-  // instances of the same process in the list (e.g., if the process
-  // somehow maps in the same solib multiple times).  We can't easily
-  // both iterate this list (in a spinlock-protected safe way), and
-  // relax the spinlock enough to do a safe stapiu_write_task_semaphore()
-  // call within the loop.  So we will hit only the first copy in our list.
+  // NB: we mustn't hold a lock while changing the task memory, but
+  // we need a lock to protect the process_list from concurrent
+  // add/delete, so only take the base address under it.  NB: We
+  // could in principle have multiple instances of the same process in
+  // the list (e.g., if the process somehow maps in the same solib
+  // multiple times).  We will hit only the first copy in our list.
   any_found = 0;
   spin_lock_irqsave(&c->process_list_lock, flags);
-  /* Look through all the consumer's processes and increment semaphores.  */
   list_for_each_entry(p, &c->process_list_head, process_list) {
-    unsigned long addr = p->base + c->sdt_sem_offset;
-    int rc2;
     if (p->tgid != task->tgid) continue; // skip other processes in the list
     if (p->inode != inode) continue; // skip other inodes
+    if (p->sems_applied) break; // done already, by an earlier mapping
+    base = p->base;
+    any_found = 1;
+    break; // exit list_for_each loop
+  }
+  spin_unlock_irqrestore(&c->process_list_lock, flags);
+  if (! any_found)
+    return 0;
 
-    // unlock list and process write for this entry
-    spin_unlock_irqrestore(&c->process_list_lock, flags);
-    any_found=1;
-
+  addrs = _stp_kmalloc(c->group_sems * sizeof(*addrs));
+  if (addrs == NULL)
+    return -ENOMEM;
+  for (m = c; m < c + c->group_nr; m++) {
+    if (! m->sdt_sem_offset) // nothing to do
+      continue;
     dbug_uprobes("incrementing semaphore (u%sprobe) pid %ld "
                  "pidx %zu address 0x%lx\n",
-                 c->return_p ? "ret" : "",
+                 m->return_p ? "ret" : "",
                  (long) task->tgid,
-                 c->probe->index,
-                 (unsigned long) addr);
-
-    rc2 = stapiu_write_task_semaphore(task, addr, +1);
-    if (!rc)
-            rc = rc2;
-    break; // exit list_for_each loop
+                 m->probe->index,
+                 base + m->sdt_sem_offset);
+    addrs[n++] = base + m->sdt_sem_offset;
   }
-  if (! any_found)
+  if (n) {
+    sort(addrs, n, sizeof(*addrs), stapiu_addr_cmp, NULL);
+    rc = stapiu_write_task_semaphores(task, addrs, n, +1);
+  }
+  _stp_kfree(addrs);
+
+  // Only what was incremented is decremented at shutdown.  If p went
+  // away meanwhile, its process is unmapping, and nothing needs undoing.
+  if (rc == 0) {
+    struct stapiu_process *q;
+    spin_lock_irqsave(&c->process_list_lock, flags);
+    list_for_each_entry(q, &c->process_list_head, process_list)
+      if (q == p) {
+	p->sems_applied = 1;
+	break;
+      }
     spin_unlock_irqrestore(&c->process_list_lock, flags);
-  else
-    ; // already unlocked
-
+  }
   return rc;
 }
 
@@ -788,13 +1047,14 @@ stapiu_process_found(struct stap_task_finder_target *tf_target,
 }
 
 
-bool
-__verify_build_id (struct task_struct *tsk, unsigned long addr,
-		   unsigned const char *build_id, int build_id_len);
+int
+__check_build_id (struct task_struct *tsk, unsigned long addr,
+		  unsigned const char *build_id, int build_id_len);
 // defined in task_finder2.c
 
 
 
+
 /* The task_finder_mmap_callback.  These callbacks are NOT
    pre-filtered for buildid or pathname matches (because task_finder
    deals with TASKS only), so we get to do that here.  */
@@ -876,11 +1136,24 @@ stapiu_mmap_found(struct stap_task_finder_target *tf_target,
      * the build-id. */
     if (c->solib_pathname && path && strcmp (path, c->solib_pathname))
       return 0;
-    if (c->solib_build_id_len > 0 && !__verify_build_id(task,
-  						        addr - offset + c->solib_build_id_vaddr,
-  						        c->solib_build_id,
-						        c->solib_build_id_len))
-      return 0;
+    if (c->solib_build_id_len > 0) {
+      int known = stapiu_build_id_known(c->group, dentry->d_inode);
+      if (known < 0)
+        return 0;
+      if (known == 0) {
+        rc = __check_build_id(task, addr - offset + c->solib_build_id_vaddr,
+                              c->solib_build_id, c->solib_build_id_len);
+        if (rc != 1) {
+          // Only a mapping from the start of the file that holds the
+          // whole build-id tells for sure that it's another file.
+          if (rc == 0 && offset == 0
+              && c->solib_build_id_vaddr + c->solib_build_id_len / 2 <= length)
+            stapiu_build_id_mismatch(c->group, dentry->d_inode);
+          return 0;
+        }
+        rc = 0;
+      }
+    }
   }
 
   // If we made it this far, we have an interesting solib.
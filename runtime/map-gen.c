@@ -46,9 +46,9 @@
 #define VSTYPE char*
 #define VALNAME str
 #define VALN s
-#define VALSTOR char value[MAP_STRING_LENGTH]
-#define MAP_GET_VAL(node) ((node)->value)
-#define MAP_SET_VAL(map,node,val,add,s1,s2,s3,s4,s5) _new_map_set_str(map,MAP_GET_VAL(node),val,add)
+#define VALSTOR MAP_STR_STOR(value)
+#define MAP_GET_VAL(node) MAP_STR((node)->value)
+#define MAP_SET_VAL(map,node,val,add,s1,s2,s3,s4,s5) MAP_STR_SET(map,(node)->value,val,add)
 #define MAP_COPY_VAL(map,node,val,add) MAP_SET_VAL(map,node,val,add,0,0,0,0,0)
 #define NULLRET ""
 #elif VALUE_TYPE == INT64
@@ -128,15 +128,17 @@
 #define KEY1TYPE char*
 #define KEY1NAME str
 #define KEY1N s
-#define KEY1STOR char key1[MAP_STRING_LENGTH]
-#define KEY1CPY(m) str_copy(m->key1, key1)
+#define KEY1STOR MAP_STR_STOR(key1)
+#define KEY1CPY(m) MAP_STR_COPY(map, m->key1, key1)
+#define KEY1GET(m) MAP_STR((m)->key1)
 #define KEY1_HASH MURMUR_STRING(key1)
 #else
 #define KEY1TYPE int64_t
 #define KEY1NAME int64
 #define KEY1N i
 #define KEY1STOR int64_t key1
-#define KEY1CPY(m) m->key1=key1
+#define KEY1CPY(m) (m->key1=key1, 0)
+#define KEY1GET(m) ((m)->key1)
 
 /* Instead of ...
    #define KEY1_HASH MURMUR_INT64(key1)
@@ -160,15 +162,17 @@
 #define KEY2TYPE char*
 #define KEY2NAME str
 #define KEY2N s
-#define KEY2STOR char key2[MAP_STRING_LENGTH]
-#define KEY2CPY(m) str_copy(m->key2, key2)
+#define KEY2STOR MAP_STR_STOR(key2)
+#define KEY2CPY(m) MAP_STR_COPY(map, m->key2, key2)
+#define KEY2GET(m) MAP_STR((m)->key2)
 #define KEY2_HASH MURMUR_STRING(key2)
 #else
 #define KEY2TYPE int64_t
 #define KEY2NAME int64
 #define KEY2N i
 #define KEY2STOR int64_t key2
-#define KEY2CPY(m) m->key2=key2
+#define KEY2CPY(m) (m->key2=key2, 0)
+#define KEY2GET(m) ((m)->key2)
 #define KEY2_HASH MURMUR_INT64(key2)
 #endif
 #define KEY2_EQ_P JOIN(KEY2NAME,eq_p)
@@ -181,15 +185,17 @@
 #define KEY3TYPE char*
 #define KEY3NAME str
 #define KEY3N s
-#define KEY3STOR char key3[MAP_STRING_LENGTH]
-#define KEY3CPY(m) str_copy(m->key3, key3)
+#define KEY3STOR MAP_STR_STOR(key3)
+#define KEY3CPY(m) MAP_STR_COPY(map, m->key3, key3)
+#define KEY3GET(m) MAP_STR((m)->key3)
 #define KEY3_HASH MURMUR_STRING(key3)
 #else
 #define KEY3TYPE int64_t
 #define KEY3NAME int64
 #define KEY3N i
 #define KEY3STOR int64_t key3
-#define KEY3CPY(m) m->key3=key3
+#define KEY3CPY(m) (m->key3=key3, 0)
+#define KEY3GET(m) ((m)->key3)
 #define KEY3_HASH MURMUR_INT64(key3)
 #endif
 #define KEY3_EQ_P JOIN(KEY3NAME,eq_p)
@@ -202,15 +208,17 @@
 #define KEY4TYPE char*
 #define KEY4NAME str
 #define KEY4N s
-#define KEY4STOR char key4[MAP_STRING_LENGTH]
-#define KEY4CPY(m) str_copy(m->key4, key4)
+#define KEY4STOR MAP_STR_STOR(key4)
+#define KEY4CPY(m) MAP_STR_COPY(map, m->key4, key4)
+#define KEY4GET(m) MAP_STR((m)->key4)
 #define KEY4_HASH MURMUR_STRING(key4)
 #else
 #define KEY4TYPE int64_t
 #define KEY4NAME int64
 #define KEY4N i
 #define KEY4STOR int64_t key4
-#define KEY4CPY(m) m->key4=key4
+#define KEY4CPY(m) (m->key4=key4, 0)
+#define KEY4GET(m) ((m)->key4)
 #define KEY4_HASH MURMUR_INT64(key4)
 #endif
 #define KEY4_EQ_P JOIN(KEY4NAME,eq_p)
@@ -223,15 +231,17 @@
 #define KEY5TYPE char*
 #define KEY5NAME str
 #define KEY5N s
-#define KEY5STOR char key5[MAP_STRING_LENGTH]
-#define KEY5CPY(m) str_copy(m->key5, key5)
+#define KEY5STOR MAP_STR_STOR(key5)
+#define KEY5CPY(m) MAP_STR_COPY(map, m->key5, key5)
+#define KEY5GET(m) MAP_STR((m)->key5)
 #define KEY5_HASH MURMUR_STRING(key5)
 #else
 #define KEY5TYPE int64_t
 #define KEY5NAME int64
 #define KEY5N i
 #define KEY5STOR int64_t key5
-#define KEY5CPY(m) m->key5=key5
+#define KEY5CPY(m) (m->key5=key5, 0)
+#define KEY5GET(m) ((m)->key5)
 #define KEY5_HASH MURMUR_INT64(key5)
 #endif
 #define KEY5_EQ_P JOIN(KEY5NAME,eq_p)
@@ -244,15 +254,17 @@
 #define KEY6TYPE char*
 #define KEY6NAME str
 #define KEY6N s
-#define KEY6STOR char key6[MAP_STRING_LENGTH]
-#define KEY6CPY(m) str_copy(m->key6, key6)
+#define KEY6STOR MAP_STR_STOR(key6)
+#define KEY6CPY(m) MAP_STR_COPY(map, m->key6, key6)
+#define KEY6GET(m) MAP_STR((m)->key6)
 #define KEY6_HASH MURMUR_STRING(key6)
 #else
 #define KEY6TYPE int64_t
 #define KEY6NAME int64
 #define KEY6N i
 #define KEY6STOR int64_t key6
-#define KEY6CPY(m) m->key6=key6
+#define KEY6CPY(m) (m->key6=key6, 0)
+#define KEY6GET(m) ((m)->key6)
 #define KEY6_HASH MURMUR_INT64(key6)
 #endif
 #define KEY6_EQ_P JOIN(KEY6NAME,eq_p)
@@ -265,15 +277,17 @@
 #define KEY7TYPE char*
 #define KEY7NAME str
 #define KEY7N s
-#define KEY7STOR char key7[MAP_STRING_LENGTH]
-#define KEY7CPY(m) str_copy(m->key7, key7)
+#define KEY7STOR MAP_STR_STOR(key7)
+#define KEY7CPY(m) MAP_STR_COPY(map, m->key7, key7)
+#define KEY7GET(m) MAP_STR((m)->key7)
 #define KEY7_HASH MURMUR_STRING(key7)
 #else
 #define KEY7TYPE int64_t
 #define KEY7NAME int64
 #define KEY7N i
 #define KEY7STOR int64_t key7
-#define KEY7CPY(m) m->key7=key7
+#define KEY7CPY(m) (m->key7=key7, 0)
+#define KEY7GET(m) ((m)->key7)
 #define KEY7_HASH MURMUR_INT64(key7)
 #endif
 #define KEY7_EQ_P JOIN(KEY7NAME,eq_p)
@@ -286,15 +300,17 @@
 #define KEY8TYPE char*
 #define KEY8NAME str
 #define KEY8N s
-#define KEY8STOR char key8[MAP_STRING_LENGTH]
-#define KEY8CPY(m) str_copy(m->key8, key8)
+#define KEY8STOR MAP_STR_STOR(key8)
+#define KEY8CPY(m) MAP_STR_COPY(map, m->key8, key8)
+#define KEY8GET(m) MAP_STR((m)->key8)
 #define KEY8_HASH MURMUR_STRING(key8)
 #else
 #define KEY8TYPE int64_t
 #define KEY8NAME int64
 #define KEY8N i
 #define KEY8STOR int64_t key8
-#define KEY8CPY(m) m->key8=key8
+#define KEY8CPY(m) (m->key8=key8, 0)
+#define KEY8GET(m) ((m)->key8)
 #define KEY8_HASH MURMUR_INT64(key8)
 #endif
 #define KEY8_EQ_P JOIN(KEY8NAME,eq_p)
@@ -307,15 +323,17 @@
 #define KEY9TYPE char*
 #define KEY9NAME str
 #define KEY9N s
-#define KEY9STOR char key9[MAP_STRING_LENGTH]
-#define KEY9CPY(m) str_copy(m->key9, key9)
+#define KEY9STOR MAP_STR_STOR(key9)
+#define KEY9CPY(m) MAP_STR_COPY(map, m->key9, key9)
+#define KEY9GET(m) MAP_STR((m)->key9)
 #define KEY9_HASH MURMUR_STRING(key9)
 #else
 #define KEY9TYPE int64_t
 #define KEY9NAME int64
 #define KEY9N i
 #define KEY9STOR int64_t key9
-#define KEY9CPY(m) m->key9=key9
+#define KEY9CPY(m) (m->key9=key9, 0)
+#define KEY9GET(m) ((m)->key9)
 #define KEY9_HASH MURMUR_INT64(key9)
 #endif
 #define KEY9_EQ_P JOIN(KEY9NAME,eq_p)
@@ -332,65 +350,65 @@
 #define KEYSYM(x) JOIN2(x,KEY1N,VALN)
 #define ALLKEYS(x) x##1
 #define ALLKEYSD(x) KEY1TYPE x##1
-#define KEYCPY(m) {KEY1CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1))
+#define KEYCPY(m) (KEY1CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1))
 #elif KEY_ARITY == 2
 #define KEYSYM(x) JOIN3(x,KEY1N,KEY2N,VALN)
 #define ALLKEYS(x) x##1, x##2
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2))
 #elif KEY_ARITY == 3
 #define KEYSYM(x) JOIN4(x,KEY1N,KEY2N,KEY3N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3))
 #elif KEY_ARITY == 4
 #define KEYSYM(x) JOIN5(x,KEY1N,KEY2N,KEY3N,KEY4N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3, x##4
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3, KEY4TYPE x##4
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);KEY4CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3)\
-		&& KEY4_EQ_P(m->key4,key4))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m) | KEY4CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3)\
+		&& KEY4_EQ_P(KEY4GET(m),key4))
 #elif KEY_ARITY == 5
 #define KEYSYM(x) JOIN6(x,KEY1N,KEY2N,KEY3N,KEY4N,KEY5N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3, x##4, x##5
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3, KEY4TYPE x##4, KEY5TYPE x##5
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);KEY4CPY(m);KEY5CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3)\
-		&& KEY4_EQ_P(m->key4,key4) && KEY5_EQ_P(m->key5,key5))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m) | KEY4CPY(m) | KEY5CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3)\
+		&& KEY4_EQ_P(KEY4GET(m),key4) && KEY5_EQ_P(KEY5GET(m),key5))
 #elif KEY_ARITY == 6
 #define KEYSYM(x) JOIN7(x,KEY1N,KEY2N,KEY3N,KEY4N,KEY5N,KEY6N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3, x##4, x##5, x##6
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3, KEY4TYPE x##4, KEY5TYPE x##5, KEY6TYPE x##6
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);KEY4CPY(m);KEY5CPY(m);KEY6CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3)\
-		&& KEY4_EQ_P(m->key4,key4) && KEY5_EQ_P(m->key5,key5) && KEY6_EQ_P(m->key6,key6))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m) | KEY4CPY(m) | KEY5CPY(m) | KEY6CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3)\
+		&& KEY4_EQ_P(KEY4GET(m),key4) && KEY5_EQ_P(KEY5GET(m),key5) && KEY6_EQ_P(KEY6GET(m),key6))
 #elif KEY_ARITY == 7
 #define KEYSYM(x) JOIN8(x,KEY1N,KEY2N,KEY3N,KEY4N,KEY5N,KEY6N,KEY7N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3, x##4, x##5, x##6, x##7
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3, KEY4TYPE x##4, KEY5TYPE x##5, KEY6TYPE x##6, KEY7TYPE x##7
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);KEY4CPY(m);KEY5CPY(m);KEY6CPY(m);KEY7CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3)\
-		&& KEY4_EQ_P(m->key4,key4) && KEY5_EQ_P(m->key5,key5) && KEY6_EQ_P(m->key6,key6)\
-		&& KEY7_EQ_P(m->key7,key7))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m) | KEY4CPY(m) | KEY5CPY(m) | KEY6CPY(m) | KEY7CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3)\
+		&& KEY4_EQ_P(KEY4GET(m),key4) && KEY5_EQ_P(KEY5GET(m),key5) && KEY6_EQ_P(KEY6GET(m),key6)\
+		&& KEY7_EQ_P(KEY7GET(m),key7))
 #elif KEY_ARITY == 8
 #define KEYSYM(x) JOIN9(x,KEY1N,KEY2N,KEY3N,KEY4N,KEY5N,KEY6N,KEY7N,KEY8N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3, x##4, x##5, x##6, x##7, x##8
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3, KEY4TYPE x##4, KEY5TYPE x##5, KEY6TYPE x##6, KEY7TYPE x##7, KEY8TYPE x##8
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);KEY4CPY(m);KEY5CPY(m);KEY6CPY(m);KEY7CPY(m);KEY8CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3)\
-		&& KEY4_EQ_P(m->key4,key4) && KEY5_EQ_P(m->key5,key5) && KEY6_EQ_P(m->key6,key6)\
-		&& KEY7_EQ_P(m->key7,key7) && KEY8_EQ_P(m->key8,key8))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m) | KEY4CPY(m) | KEY5CPY(m) | KEY6CPY(m) | KEY7CPY(m) | KEY8CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3)\
+		&& KEY4_EQ_P(KEY4GET(m),key4) && KEY5_EQ_P(KEY5GET(m),key5) && KEY6_EQ_P(KEY6GET(m),key6)\
+		&& KEY7_EQ_P(KEY7GET(m),key7) && KEY8_EQ_P(KEY8GET(m),key8))
 #elif KEY_ARITY == 9
 #define KEYSYM(x) JOIN10(x,KEY1N,KEY2N,KEY3N,KEY4N,KEY5N,KEY6N,KEY7N,KEY8N,KEY9N,VALN)
 #define ALLKEYS(x) x##1, x##2, x##3, x##4, x##5, x##6, x##7, x##8, x##9
 #define ALLKEYSD(x) KEY1TYPE x##1, KEY2TYPE x##2, KEY3TYPE x##3, KEY4TYPE x##4, KEY5TYPE x##5, KEY6TYPE x##6, KEY7TYPE x##7, KEY8TYPE x##8, KEY9TYPE x##9
-#define KEYCPY(m) {KEY1CPY(m);KEY2CPY(m);KEY3CPY(m);KEY4CPY(m);KEY5CPY(m);KEY6CPY(m);KEY7CPY(m);KEY8CPY(m);KEY9CPY(m);}
-#define KEY_EQ_P(m) (KEY1_EQ_P(m->key1,key1) && KEY2_EQ_P(m->key2,key2) && KEY3_EQ_P(m->key3,key3)\
-		&& KEY4_EQ_P(m->key4,key4) && KEY5_EQ_P(m->key5,key5) && KEY6_EQ_P(m->key6,key6)\
-		&& KEY7_EQ_P(m->key7,key7) && KEY8_EQ_P(m->key8,key8) && KEY9_EQ_P(m->key9,key9))
+#define KEYCPY(m) (KEY1CPY(m) | KEY2CPY(m) | KEY3CPY(m) | KEY4CPY(m) | KEY5CPY(m) | KEY6CPY(m) | KEY7CPY(m) | KEY8CPY(m) | KEY9CPY(m))
+#define KEY_EQ_P(m) (KEY1_EQ_P(KEY1GET(m),key1) && KEY2_EQ_P(KEY2GET(m),key2) && KEY3_EQ_P(KEY3GET(m),key3)\
+		&& KEY4_EQ_P(KEY4GET(m),key4) && KEY5_EQ_P(KEY5GET(m),key5) && KEY6_EQ_P(KEY6GET(m),key6)\
+		&& KEY7_EQ_P(KEY7GET(m),key7) && KEY8_EQ_P(KEY8GET(m),key8) && KEY9_EQ_P(KEY9GET(m),key9))
 #endif
 
 /* */
@@ -465,56 +483,56 @@ static key_data KEYSYM(map_get_key) (struct map_node *mn, int n, int *type)
 
 	switch (n) {
 	case 1:
-		ptr = (key_data)m->key1;
+		ptr = (key_data)KEY1GET(m);
 		if (type)
 			*type = type_to_enum(KEY1TYPE);
 		break;
 #if KEY_ARITY > 1
 	case 2:
-		ptr = (key_data)m->key2;
+		ptr = (key_data)KEY2GET(m);
 		if (type)
 			*type = type_to_enum(KEY2TYPE);
 
 		break;
 #if KEY_ARITY > 2
 	case 3:
-		ptr = (key_data)m->key3;
+		ptr = (key_data)KEY3GET(m);
 		if (type)
 			*type = type_to_enum(KEY3TYPE);
 		break;
 #if KEY_ARITY > 3
 	case 4:
-		ptr = (key_data)m->key4;
+		ptr = (key_data)KEY4GET(m);
 		if (type)
 			*type = type_to_enum(KEY4TYPE);
 		break;
 #if KEY_ARITY > 4
 	case 5:
-		ptr = (key_data)m->key5;
+		ptr = (key_data)KEY5GET(m);
 		if (type)
 			*type = type_to_enum(KEY5TYPE);
 		break;
 #if KEY_ARITY > 5
 	case 6:
-		ptr = (key_data)m->key6;
+		ptr = (key_data)KEY6GET(m);
 		if (type)
 			*type = type_to_enum(KEY6TYPE);
 		break;
 #if KEY_ARITY > 6
 	case 7:
-		ptr = (key_data)m->key7;
+		ptr = (key_data)KEY7GET(m);
 		if (type)
 			*type = type_to_enum(KEY7TYPE);
 		break;
 #if KEY_ARITY > 7
 	case 8:
-		ptr = (key_data)m->key8;
+		ptr = (key_data)KEY8GET(m);
 		if (type)
 			*type = type_to_enum(KEY8TYPE);
 		break;
 #if KEY_ARITY > 8
 	case 9:
-		ptr = (key_data)m->key9;
+		ptr = (key_data)KEY9GET(m);
 		if (type)
 			*type = type_to_enum(KEY9TYPE);
 		break;
@@ -702,6 +720,54 @@ static uint32_t KEYSYM(hash) (ALLKEYSD(key)) /* NB: unscaled! */
 }
 
 
+#ifdef MAP_STRING_TIERED
+/* Fill in the offsets of the string keys and value in a node, and
+ * return how many there are. */
+static unsigned KEYSYM(_stp_map_str_offsets) (unsigned *offsets)
+{
+	unsigned n = 0;
+#if KEY1_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key1);
+#endif
+#if KEY_ARITY > 1 && KEY2_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key2);
+#endif
+#if KEY_ARITY > 2 && KEY3_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key3);
+#endif
+#if KEY_ARITY > 3 && KEY4_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key4);
+#endif
+#if KEY_ARITY > 4 && KEY5_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key5);
+#endif
+#if KEY_ARITY > 5 && KEY6_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key6);
+#endif
+#if KEY_ARITY > 6 && KEY7_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key7);
+#endif
+#if KEY_ARITY > 7 && KEY8_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key8);
+#endif
+#if KEY_ARITY > 8 && KEY9_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), key9);
+#endif
+#if VALUE_TYPE == STRING
+	offsets[n++] = offsetof(struct KEYSYM(map_node), value);
+#endif
+	return n;
+}
+
+static int KEYSYM(_stp_map_init_strs) (MAP m)
+{
+	unsigned offsets[MAP_MAX_STRS];
+	unsigned n = KEYSYM(_stp_map_str_offsets) (offsets);
+	return _stp_map_init_strs (m, n, offsets, -1, MAP_STRING_SPILL);
+}
+#endif
+
+
 #if VALUE_TYPE == INT64 || VALUE_TYPE == STRING
 /*
  * _stp_map_new* ()
@@ -710,7 +776,7 @@ static uint32_t KEYSYM(hash) (ALLKEYSD(key)) /* NB: unscaled! */
  */
 static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 {
-	int max_entries=0, wrap=0;
+	int max_entries=0, wrap=0, striped=0;
 	int arg = first_arg;
 	MAP m;
 	va_list ap;
@@ -724,6 +790,9 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		case KEY_STAT_WRAP:
 			wrap = 1;
 		break;
+		case KEY_MAP_STRIPED:
+			striped = 1;
+		break;
 		default:
 			_stp_warn ("Unknown argument %d\n", arg);
 		}
@@ -734,6 +803,16 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 
 	m = _stp_map_new (max_entries, wrap,
 	                  sizeof(struct KEYSYM(map_node)), -1);
+	if (m && striped && _stp_map_init_stripes (m)) {
+		_stp_map_del (m);
+		m = NULL;
+	}
+#ifdef MAP_STRING_TIERED
+	if (m && KEYSYM(_stp_map_init_strs) (m)) {
+		_stp_map_del (m);
+		m = NULL;
+	}
+#endif
 	return m;
 }
 #else
@@ -747,8 +826,8 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 {
 
-	int start=0, stop=0, interval=0, bit_shift=0;
-	int max_entries=0, wrap=0, htype=0;
+	int start=0, stop=0, interval=0, bits=0, bit_shift=0;
+	int max_entries=0, wrap=0, topk=0, htype=0;
 	int arg = first_arg;
 	MAP m;
 	va_list ap;
@@ -762,6 +841,9 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		case KEY_STAT_WRAP:
 			wrap = 1;
 			break;
+		case KEY_STAT_TOPK:
+			wrap = topk = 1;
+			break;
 		case KEY_HIST_TYPE:
 			htype = va_arg(ap, int);
 			if (htype == HIST_LINEAR) {
@@ -769,6 +851,8 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 				stop = va_arg(ap, int);
 				interval = va_arg(ap, int);
 			}
+			if (htype == HIST_HDR || htype == HIST_HLL)
+				bits = va_arg(ap, int);
 			break;
 		default:
 			_stp_warn ("Unknown argument %d\n", arg);
@@ -786,6 +870,12 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		m = _stp_map_new_hstat_log (max_entries, wrap,
 		                            sizeof(struct KEYSYM(map_node)));
 		break;
+	case HIST_HDR:
+	case HIST_HLL:
+		m = _stp_map_new_hstat_bits (max_entries, wrap,
+		                             sizeof(struct KEYSYM(map_node)),
+		                             htype, bits);
+		break;
 	case HIST_LINEAR:
 		m = _stp_map_new_hstat_linear (max_entries, wrap,
 		                               sizeof(struct KEYSYM(map_node)),
@@ -796,6 +886,14 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 		m = NULL;
 	}
 
+	if (m && topk)
+		m->topk = offsetof(struct KEYSYM(map_node), value);
+#ifdef MAP_STRING_TIERED
+	if (m && KEYSYM(_stp_map_init_strs) (m)) {
+		_stp_map_del (m);
+		m = NULL;
+	}
+#endif
 	return m;
 }
 
@@ -804,9 +902,10 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int add, int s1, int s2, int s3, int s4, int s5)
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
+	unsigned long flags;
+	int takeover, rc;
 
 	if (map == NULL)
 		return -2;
@@ -814,20 +913,37 @@ static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -2;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
+	_stp_map_mark_dirty(map, hv);
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	flags = _stp_map_stripe_lock(map, hv);
+	map_for_each_hash_entry(map, hv, n, e) {
 		if (KEY_EQ_P(n)) {
-			return MAP_SET_VAL(map, n, val, add, s1, s2, s3, s4, s5);
+			rc = MAP_SET_VAL(map, n, val, add, s1, s2, s3, s4, s5);
+			_stp_map_stripe_unlock(map, hv, flags);
+			return rc;
 		}
 	}
-	/* key not found */
-	n = KEYSYM(get_map_node)(_new_map_create (map, head));
-	if (n == NULL)
-		return -1;
-	KEYCPY(n);
-	return MAP_SET_VAL(map, n, val, 0, s1, s2, s3, s4, s5);
+	/* key not found; in a full @topk map, it carries on from the
+	   statistics of the key it evicts. */
+	_stp_map_list_lock(map);
+	takeover = map->topk && mlist_empty(&map->pool);
+	n = KEYSYM(get_map_node)(_new_map_create (map, hv));
+	if (n == NULL) {
+		rc = -1;
+		goto out;
+	}
+	/* NB: with tiered strings, a long key or value can fail to
+	   find a buffer, and then the new node goes back. */
+	rc = KEYCPY(n);
+	if (rc == 0)
+		rc = MAP_SET_VAL(map, n, val, takeover, s1, s2, s3, s4, s5);
+	if (rc)
+		_new_map_del_node(map, &n->node);
+out:
+	_stp_map_list_unlock(map);
+	_stp_map_stripe_unlock(map, hv, flags);
+	return rc;
 }
 
 static int KEYSYM(_stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val)
@@ -841,34 +957,39 @@ static int KEYSYM(_stp_map_add) (MAP map, ALLKEYSD(key), VSTYPE val)
 }
 
 
+/* NB: in a striped map, a string value is only safe to read until
+   another single-key operation deletes its node, so the translator
+   only stripes maps of longs. */
 static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
+	unsigned long flags;
+	VALTYPE val = NULLRET;
 
 	if (map == NULL)
 		return NULLRET;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	flags = _stp_map_stripe_lock(map, hv);
+	map_for_each_hash_entry(map, hv, n, e) {
 		if (KEY_EQ_P(n)) {
-			return MAP_GET_VAL(n);
+			val = MAP_GET_VAL(n);
+			break;
 		}
 	}
-	/* key not found */
-	return NULLRET;
+	_stp_map_stripe_unlock(map, hv, flags);
+	return val;
 }
 
 static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
+	unsigned long flags;
 
 	if (map == NULL)
 		return -1;
@@ -876,32 +997,34 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -1;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	flags = _stp_map_stripe_lock(map, hv);
+	map_for_each_hash_entry(map, hv, n, e) {
 		if (KEY_EQ_P(n)) {
+			_stp_map_mark_dirty(map, hv);
+			_stp_map_list_lock(map);
 			_new_map_del_node(map, &n->node);
-			return 0;
+			_stp_map_list_unlock(map);
+			break;
 		}
 	}
-	/* key not found */
+	_stp_map_stripe_unlock(map, hv, flags);
 	return 0;
 }
 
-static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
+static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* unscaled */,
                                       ALLKEYSD(key))
 {
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return -1;
 
-	head = &map->hashes[hv];
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hash_entry(map, hv, n, e) {
 		if (KEY_EQ_P(n)) {
+			_stp_map_mark_dirty(map, hv);
 			_new_map_del_node(map, &n->node);
 			return 0;
 		}
@@ -913,23 +1036,25 @@ static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
 static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
+	unsigned long flags;
+	int found = 0;
 
 	if (map == NULL)
 		return 0;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	flags = _stp_map_stripe_lock(map, hv);
+	map_for_each_hash_entry(map, hv, n, e) {
 		if (KEY_EQ_P(n)) {
-			return 1;
+			found = 1;
+			break;
 		}
 	}
-	/* key not found */
-	return 0;
+	_stp_map_stripe_unlock(map, hv, flags);
+	return found;
 }
 
 
@@ -945,6 +1070,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY1_TYPE
 #undef KEY1STOR
 #undef KEY1CPY
+#undef KEY1GET
 #undef KEY1_HASH
 
 #undef KEY2NAME
@@ -953,6 +1079,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY2_TYPE
 #undef KEY2STOR
 #undef KEY2CPY
+#undef KEY2GET
 #undef KEY2_HASH
 
 #undef KEY3NAME
@@ -961,6 +1088,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY3_TYPE
 #undef KEY3STOR
 #undef KEY3CPY
+#undef KEY3GET
 #undef KEY3_HASH
 
 #undef KEY4NAME
@@ -969,6 +1097,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY4_TYPE
 #undef KEY4STOR
 #undef KEY4CPY
+#undef KEY4GET
 #undef KEY4_HASH
 
 #undef KEY5NAME
@@ -977,6 +1106,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY5_TYPE
 #undef KEY5STOR
 #undef KEY5CPY
+#undef KEY5GET
 #undef KEY5_HASH
 
 #undef KEY6NAME
@@ -985,6 +1115,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY6_TYPE
 #undef KEY6STOR
 #undef KEY6CPY
+#undef KEY6GET
 #undef KEY6_HASH
 
 #undef KEY7NAME
@@ -993,6 +1124,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY7_TYPE
 #undef KEY7STOR
 #undef KEY7CPY
+#undef KEY7GET
 #undef KEY7_HASH
 
 #undef KEY8NAME
@@ -1001,6 +1133,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY8_TYPE
 #undef KEY8STOR
 #undef KEY8CPY
+#undef KEY8GET
 #undef KEY8_HASH
 
 #undef KEY9NAME
@@ -1009,6 +1142,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY9_TYPE
 #undef KEY9STOR
 #undef KEY9CPY
+#undef KEY9GET
 #undef KEY9_HASH
 
 #undef KEY_ARITY
@@ -42,6 +42,26 @@ static MAP _stp_map_new_hstat_log (unsigned max_entries, int wrap, int node_size
 	return m;
 }
 
+static MAP
+_stp_map_new_hstat_bits (unsigned max_entries, int wrap, int node_size,
+			 int htype, int bits)
+{
+	MAP m;
+	int buckets = _stp_stat_calc_bits_buckets(htype, bits);
+	if (!buckets)
+		return NULL;
+
+	/* the node already has stat_data, just add size for buckets */
+	node_size += buckets * sizeof(int64_t);
+	m = _stp_map_new (max_entries, wrap, node_size, -1);
+	if (m) {
+		m->hist.type = htype;
+		m->hist.bits = bits;
+		m->hist.buckets = buckets;
+	}
+	return m;
+}
+
 static MAP
 _stp_map_new_hstat_linear (unsigned max_entries, int wrap, int node_size,
 			   int start, int stop, int interval)
@@ -130,6 +150,38 @@ _stp_pmap_new_hstat_log (unsigned max_entries, int wrap, int node_size)
 	return pmap;
 }
 
+static PMAP
+_stp_pmap_new_hstat_bits (unsigned max_entries, int wrap, int node_size,
+			  int htype, int bits)
+{
+	PMAP pmap;
+	int buckets = _stp_stat_calc_bits_buckets(htype, bits);
+	if (!buckets)
+		return NULL;
+
+	/* the node already has stat_data, just add size for buckets */
+	node_size += buckets * sizeof(int64_t);
+	pmap = _stp_pmap_new (max_entries, wrap, node_size);
+	if (pmap) {
+		int i;
+		MAP m;
+		for_each_possible_cpu(i) {
+			m = _stp_pmap_get_map (pmap, i);
+			if (unlikely(m == NULL))
+				continue;
+			m->hist.type = htype;
+			m->hist.bits = bits;
+			m->hist.buckets = buckets;
+		}
+		/* now set agg map params */
+		m = _stp_pmap_get_agg(pmap);
+		m->hist.type = htype;
+		m->hist.bits = bits;
+		m->hist.buckets = buckets;
+	}
+	return pmap;
+}
+
 static PMAP
 _stp_pmap_new_hstat (unsigned max_entries, int wrap, int node_size)
 {
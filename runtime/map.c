@@ -95,6 +95,48 @@ static struct map_node *_stp_map_iterdel(MAP map, struct map_node *m)
   return r_map;
 }
 
+#ifdef MAP_OPEN_ADDRESSING
+static void _stp_map_slot_insert(MAP map, struct map_node *m)
+{
+	unsigned it = m->hash & map->hash_table_mask;
+
+	while (map->slots[it].node != MAP_SLOT_EMPTY
+	       && map->slots[it].node != MAP_SLOT_DELETED)
+		it = (it + 1) & map->hash_table_mask;
+	if (map->slots[it].node == MAP_SLOT_EMPTY)
+		map->slots_used++;
+	map->slots[it].hash = m->hash;
+	map->slots[it].node = ((char *)m - (char *)map->node_mem)
+			      / map->node_size + 1;
+	m->slot = it;
+}
+
+static void _stp_map_slot_remove(MAP map, struct map_node *m)
+{
+	unsigned next = (m->slot + 1) & map->hash_table_mask;
+
+	/* A slot followed by an empty one ends no probe sequence but its
+	 * own, so it can be emptied rather than marked deleted. */
+	if (map->slots[next].node == MAP_SLOT_EMPTY) {
+		map->slots[m->slot].node = MAP_SLOT_EMPTY;
+		map->slots_used--;
+	} else
+		map->slots[m->slot].node = MAP_SLOT_DELETED;
+}
+
+/* Rebuild the slots from the live nodes, dropping deleted slots. */
+static void _stp_map_rehash(MAP map)
+{
+	struct mlist_head *e;
+
+	memset(map->slots, 0,
+	       sizeof(struct map_slot) * (map->hash_table_mask + 1));
+	map->slots_used = 0;
+	mlist_for_each(e, &map->head)
+		_stp_map_slot_insert(map, mlist_map_node(e));
+}
+#endif
+
 /** Clears all the elements in a map.
  * @param map 
  */
@@ -103,13 +145,32 @@ static void _stp_map_clear(MAP map)
 {
 	struct map_node *m;
 
+#ifdef MAP_OPEN_ADDRESSING
+	/* With deleted slots around, walking the nodes won't clear them
+	 * all, so wipe the whole table instead. */
+	int wipe = (map->slots_used != map->num);
+	if (wipe)
+		memset(map->slots, 0,
+		       sizeof(struct map_slot) * (map->hash_table_mask + 1));
+	map->slots_used = 0;
+#endif
+
 	map->num = 0;
+	map->topk_min = 0;
+	_stp_map_clear_dirty(map);
 
 	while (!mlist_empty(&map->head)) {
 		m = mlist_map_node(mlist_next(&map->head));
 
 		/* remove node from old hash list */
+#ifdef MAP_OPEN_ADDRESSING
+		if (!wipe)
+			map->slots[m->slot].node = MAP_SLOT_EMPTY;
+#else
 		mhlist_del_init(&m->hnode);
+#endif
+
+		_stp_map_put_strs(map, m);
 
 		/* remove from entry list */
 		mlist_del(&m->lnode);
@@ -139,6 +200,26 @@ static void _stp_pmap_clear(PMAP pmap)
 #define SORT_MAX   -2
 #define SORT_AVG   -1
 
+/* The integer that stats sort on. */
+static int64_t _stp_sort_stat_key(stat_data *sd, int keynum)
+{
+	switch (keynum) {
+	case SORT_COUNT:
+		return sd->count;
+	case SORT_SUM:
+		return sd->sum;
+	case SORT_MIN:
+		return sd->min;
+	case SORT_MAX:
+		return sd->max;
+	case SORT_AVG:
+		return _stp_div64 (NULL, sd->sum, sd->count);
+	default:
+		/* should never happen */
+		return 0;
+	}
+}
+
 /* comparison function for sorts. */
 static int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
 		     int keynum, int dir, map_get_key_fn get_key)
@@ -154,39 +235,81 @@ static int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
 		a = strcmp(k1.strp, k2.strp);
 		b = 0;
 	} else if (type == STAT) {
-		stat_data *sd1 = k1.statp;
-		stat_data *sd2 = k2.statp;
-		switch (keynum) {
-		case SORT_COUNT:
-			a = sd1->count;
-			b = sd2->count;
-			break;
-		case SORT_SUM:
-			a = sd1->sum;
-			b = sd2->sum;
-			break;
-		case SORT_MIN:
-			a = sd1->min;
-			b = sd2->min;
-			break;
-		case SORT_MAX:
-			a = sd1->max;
-			b = sd2->max;
-			break;
-		case SORT_AVG:
-			a = _stp_div64 (NULL, sd1->sum, sd1->count);
-			b = _stp_div64 (NULL, sd2->sum, sd2->count);
-			break;
-		default:
-			/* should never happen */
-			a = b = 0;
-		}
+		a = _stp_sort_stat_key(k1.statp, keynum);
+		b = _stp_sort_stat_key(k2.statp, keynum);
 	}
 	if ((a < b && dir > 0) || (a > b && dir < 0))
 		return 1;
 	return 0;
 }
 
+/* Make ent the entry for node e at position pos of the list.
+ * Returns the type of its key. */
+static int _stp_sort_ent_set (struct map_sort_ent *ent, struct mlist_head *e,
+			      unsigned pos, int keynum, map_get_key_fn get_key)
+{
+	int type = END;
+	key_data k = (*get_key)(mlist_map_node(e), keynum, &type);
+
+	if (type == STRING)
+		ent->k.strp = k.strp;
+	else if (type == STAT)
+		ent->k.val = _stp_sort_stat_key(k.statp, keynum);
+	else
+		ent->k.val = k.val;
+	ent->lnode = e;
+	ent->pos = pos;
+	return type;
+}
+
+/* As _stp_cmp(), for two entries with keys of the given type. */
+static inline int _stp_sort_after (const struct map_sort_ent *e1,
+				   const struct map_sort_ent *e2,
+				   int type, int dir)
+{
+	int64_t a, b;
+	if (type == STRING) {
+		a = strcmp(e1->k.strp, e2->k.strp);
+		b = 0;
+	} else {
+		a = e1->k.val;
+		b = e2->k.val;
+	}
+	return (a < b && dir > 0) || (a > b && dir < 0);
+}
+
+/* Whether e1 comes after e2 in the sorted map, ties going by the
+ * order of the list. */
+static inline int _stp_sort_later (const struct map_sort_ent *e1,
+				   const struct map_sort_ent *e2,
+				   int type, int dir)
+{
+	if (_stp_sort_after(e1, e2, type, dir))
+		return 1;
+	if (_stp_sort_after(e2, e1, type, dir))
+		return 0;
+	return e1->pos > e2->pos;
+}
+
+/* Sift ents[i] down the heap of n entries whose root is the one that
+ * comes last. */
+static void _stp_sort_sift (struct map_sort_ent *ents, unsigned i, unsigned n,
+			    int type, int dir)
+{
+	struct map_sort_ent e = ents[i];
+	unsigned c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && _stp_sort_later(&ents[c + 1], &ents[c], type, dir))
+			c++;
+		if (!_stp_sort_later(&ents[c], &e, type, dir))
+			break;
+		ents[i] = ents[c];
+		i = c;
+	}
+	ents[i] = e;
+}
+
 /* swap function for bubble sort */
 static inline void _stp_swap (struct mlist_head *a, struct mlist_head *b)
 {
@@ -195,6 +318,86 @@ static inline void _stp_swap (struct mlist_head *a, struct mlist_head *b)
 }
 
 
+/* Sort a map whose sort arrays were allocated: a merge sort of the
+ * entries, from ents to the scratch space past maxnum of them and back,
+ * then the list relinked in their order.  Like the list merge sort it
+ * keeps ties in the order of the list, but it fetches each key once,
+ * and merges within arrays rather than chasing the list. */
+static void _stp_map_sort_array (MAP map, struct map_sort_ent *ents,
+				 int keynum, int dir, map_get_key_fn get_key)
+{
+	struct map_sort_ent *src = ents, *dst = ents + map->maxnum, *tmp;
+	struct mlist_head *e;
+	unsigned n = 0, width, lo, mid, hi, i, j, k;
+	int type = END;
+
+	mlist_for_each(e, &map->head) {
+		type = _stp_sort_ent_set(&ents[n], e, n, keynum, get_key);
+		n++;
+	}
+
+	for (width = 1; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			mid = width < n - lo ? lo + width : n;
+			hi = 2 * width < n - lo ? lo + 2 * width : n;
+			for (i = lo, j = mid, k = lo; k < hi; k++) {
+				if (i < mid && (j == hi
+						|| !_stp_sort_after(&src[i], &src[j], type, dir)))
+					dst[k] = src[i++];
+				else
+					dst[k] = src[j++];
+			}
+		}
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	for (i = 0; i < n; i++)
+		mlist_move_tail(src[i].lnode, &map->head);
+}
+
+/* Move the top n entries of a map to the front of its list, in order,
+ * keeping them in a heap whose root is the one that comes last, so
+ * that each of the others takes O(log n) time at most. */
+static void _stp_map_sortn_heap (MAP map, struct map_sort_ent *ents,
+				 unsigned n, int keynum, int dir,
+				 map_get_key_fn get_key)
+{
+	struct map_sort_ent ent;
+	struct mlist_head *e;
+	unsigned pos = 0, i;
+	int type = END;
+
+	mlist_for_each(e, &map->head) {
+		if (pos < n) {
+			type = _stp_sort_ent_set(&ents[pos], e, pos, keynum, get_key);
+			if (++pos == n)
+				for (i = n / 2; i-- > 0; )
+					_stp_sort_sift(ents, i, n, type, dir);
+			continue;
+		}
+		_stp_sort_ent_set(&ent, e, pos++, keynum, get_key);
+		if (_stp_sort_later(&ents[0], &ent, type, dir)) {
+			ents[0] = ent;
+			_stp_sort_sift(ents, 0, n, type, dir);
+		}
+	}
+
+	/* heapsort what is left, so that ents[0] comes first */
+	for (i = n; i-- > 1; ) {
+		ent = ents[0];
+		ents[0] = ents[i];
+		ents[i] = ent;
+		_stp_sort_sift(ents, 0, i, type, dir);
+	}
+
+	for (i = n; i-- > 0; ) {
+		mlist_del(ents[i].lnode);
+		mlist_add(ents[i].lnode, &map->head);
+	}
+}
+
 /** Sort an entire array.
  * Sorts an entire array using merge sort.
  *
@@ -210,10 +413,16 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
         struct mlist_head *p, *q, *e, *tail;
         int nmerges, psize, qsize, i, insize = 1;
 	struct mlist_head *head = &map->head;
+	struct map_sort_ent *ents = _stp_map_sort_ents(map);
 
 	if (mlist_empty(head))
 		return;
 
+	if (ents && map->num <= map->maxnum) {
+		_stp_map_sort_array(map, ents, keynum, dir, get_key);
+		return;
+	}
+
         do {
 		tail = head;
 		p = mlist_next(head);
@@ -269,7 +478,11 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
 static void _stp_map_sortn(MAP map, int n, int keynum, int dir,
 			   map_get_key_fn get_key)
 {
-	if (n == 0 || n > 30) {
+	struct map_sort_ent *ents = _stp_map_sort_ents(map);
+
+	if (ents && n > 0 && (unsigned)n < map->num && map->num <= map->maxnum) {
+		_stp_map_sortn_heap(map, ents, n, keynum, dir, get_key);
+	} else if (n == 0 || n > 30) {
 		_stp_map_sort(map, keynum, dir, get_key);
 	} else {
 		struct mlist_head *head = &map->head;
@@ -314,35 +527,132 @@ static void _stp_map_sortn(MAP map, int n, int keynum, int dir,
 	}
 }
 
-static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
+/* The @count of a node of a @topk map. */
+static inline int64_t _stp_map_topk_count (MAP map, struct map_node *m)
+{
+	return ((stat_data *)((char *)m + map->topk))->count;
+}
+
+static struct map_node *_stp_new_agg(MAP agg, uint32_t hv,
 				     struct map_node *ptr, map_update_fn update)
 {
 	struct map_node *aptr;
 	/* copy keys and aggregate */
-	aptr = _new_map_create(agg, ahead);
+	aptr = _new_map_create(agg, hv);
 	if (aptr == NULL)
 		return NULL;
 	(*update)(agg, aptr, ptr, 0);
+	/* a merged key brings its own count, which may be below topk_min */
+	if (agg->topk && _stp_map_topk_count(agg, aptr) < agg->topk_min)
+		agg->topk_min = _stp_map_topk_count(agg, aptr);
 	return aptr;
 }
 
-/** Aggregate per-cpu maps.
- * This function aggregates the per-cpu maps into an aggregated
- * map. A pointer to that aggregated map is returned.
- * 
- * A write lock must be held on the map during this function.
+/* Merge node ptr into map agg, as a new node if there is none for its
+ * key yet.  An existing node is only updated if add.  hv is the hash
+ * of the node's key. */
+static int _stp_map_merge_node(MAP agg, uint32_t hv, struct map_node *ptr,
+			       map_update_fn update, map_cmp_fn cmp, int add)
+{
+	struct map_node *aptr;
+#ifdef MAP_OPEN_ADDRESSING
+	unsigned it;
+
+	for (it = hv & agg->hash_table_mask;
+	     agg->slots[it].node != MAP_SLOT_EMPTY;
+	     it = (it + 1) & agg->hash_table_mask) {
+		if (agg->slots[it].node == MAP_SLOT_DELETED
+		    || agg->slots[it].hash != hv)
+			continue;
+		aptr = _stp_map_slot_node(agg, it);
+		if ((*cmp)(ptr, aptr)) {
+			if (add)
+				(*update)(agg, aptr, ptr, 1);
+			return 0;
+		}
+	}
+#else
+	struct mhlist_node *f;
+
+	mhlist_for_each_entry(aptr, f, &agg->hashes[hv & agg->hash_table_mask], hnode) {
+		if (aptr->hash == hv && (*cmp)(ptr, aptr)) {
+			if (add)
+				(*update)(agg, aptr, ptr, 1);
+			return 0;
+		}
+	}
+#endif
+	return _stp_new_agg(agg, hv, ptr, update) ? 0 : -1;
+}
+
+/* Merge a node of a per-cpu map into the aggregated map. */
+static int _stp_agg_merge_node(MAP agg, uint32_t hv, struct map_node *ptr,
+			       map_update_fn update, map_cmp_fn cmp)
+{
+	return _stp_map_merge_node(agg, hv, ptr, update, cmp, 1);
+}
+
+/* Merge the nodes of map src into map m, see _stp_map_merge(). */
+static unsigned __stp_map_merge(MAP m, MAP src, map_update_fn update,
+				map_cmp_fn cmp, int add)
+{
+	struct mlist_head *e;
+	unsigned lost = 0;
+
+	mlist_for_each(e, &src->head) {
+		struct map_node *ptr = mlist_map_node(e);
+		if (_stp_map_merge_node(m, ptr->hash, ptr, update, cmp, add))
+			lost++;
+	}
+	return lost;
+}
+
+/** Merge the entries of map src back into map m, then clear src.
+ * This is for a foreach snapshot of m whose handler stopped before the
+ * delete that would have dropped them.  The values m has by then are
+ * newer, so they stay, unless add, where the two are combined, as
+ * statistics are.
  *
- * @param map A pointer to a pmap.
- * @returns a pointer to the aggregated map. Null on failure.
+ * A write lock must be held on m.
+ *
+ * @returns the number of entries that no longer fit in m.
  */
-static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
+static unsigned _stp_map_merge(MAP m, MAP src, map_update_fn update,
+			       map_cmp_fn cmp, int add)
 {
-	int i, hash;
+	unsigned lost = __stp_map_merge(m, src, update, cmp, add);
+
+	_stp_map_clear(src);
+	return lost;
+}
+
+/** The same for a pmap, cpu by cpu, adding up the statistics. */
+static unsigned _stp_pmap_merge(PMAP pmap, PMAP src, map_update_fn update,
+				map_cmp_fn cmp)
+{
+	unsigned lost = 0;
+	int i;
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map(pmap, i);
+		MAP s = _stp_pmap_get_map(src, i);
+		if (likely(m != NULL && s != NULL))
+			lost += __stp_map_merge(m, s, update, cmp, 1);
+	}
+	_stp_pmap_clear(src);
+#ifdef __KERNEL__
+	pmap->agg_valid = 0;
+#endif
+	return lost;
+}
+
+/* Aggregate all of the per-cpu maps from scratch. */
+static MAP _stp_pmap_agg_all (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
+{
+	int i;
 	MAP m, agg;
-	struct map_node *ptr, *aptr = NULL;
-	struct mhlist_head *head, *ahead;
-	struct mhlist_node *e, *f;
-	int quit = 0;
+	struct map_node *ptr;
+	struct mlist_head *e;
 
 	agg = _stp_pmap_get_agg(pmap);
 
@@ -357,61 +667,242 @@ static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
 			continue;
 		}
 
-		/* walk the hash chains. */
-		for (hash = 0; hash <= m->hash_table_mask; hash++) {
-			head = &m->hashes[hash];
-			ahead = &agg->hashes[hash];
-			mhlist_for_each_entry(ptr, e, head, hnode) {
-				int match = 0;
-				mhlist_for_each_entry(aptr, f, ahead, hnode) {
-					if ((*cmp)(ptr, aptr)) {
-						match = 1;
-						break;
-					}
-				}
-				if (match)
-					(*update)(agg, aptr, ptr, 1);
-				else {
-					if (!_stp_new_agg(agg, ahead, ptr, update)) {
-                                                agg = NULL;
-						goto out;
-                                                // NB: break would head out to the for (hash...) 
-                                                // loop, which behaves badly with an agg==NULL.
-					}
-				}
-			}
+		/* walk the live nodes, probing agg by their stored hash. */
+		mlist_for_each(e, &m->head) {
+			ptr = mlist_map_node(e);
+			if (_stp_agg_merge_node(agg, ptr->hash, ptr, update, cmp))
+				return NULL;
 		}
 	}
+	return agg;
+}
+
+#ifdef __KERNEL__
+/* Aggregate the keys of hash bucket b again, from scratch. */
+static int _stp_pmap_agg_bucket (PMAP pmap, unsigned b, map_update_fn update,
+				 map_cmp_fn cmp)
+{
+	int i;
+	MAP m, agg = _stp_pmap_get_agg(pmap);
+	struct map_node *ptr;
+#ifdef MAP_OPEN_ADDRESSING
+	unsigned it;
+
+	/* NB: the keys of a bucket sit in its probe sequence. */
+	for (it = b; agg->slots[it].node != MAP_SLOT_EMPTY;
+	     it = (it + 1) & agg->hash_table_mask)
+		if (agg->slots[it].node != MAP_SLOT_DELETED
+		    && (agg->slots[it].hash & agg->hash_table_mask) == b)
+			_new_map_del_node(agg, _stp_map_slot_node(agg, it));
+#else
+	struct mhlist_node *e;
+
+	while (!mhlist_empty(&agg->hashes[b]))
+		_new_map_del_node(agg, container_of(agg->hashes[b].first,
+						    struct map_node, hnode));
+#endif
+
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (unlikely(m == NULL))
+			continue;
+		__clear_bit(b, m->dirty);
+#ifdef MAP_OPEN_ADDRESSING
+		for (it = b; m->slots[it].node != MAP_SLOT_EMPTY;
+		     it = (it + 1) & m->hash_table_mask) {
+			if (m->slots[it].node == MAP_SLOT_DELETED
+			    || (m->slots[it].hash & m->hash_table_mask) != b)
+				continue;
+			ptr = _stp_map_slot_node(m, it);
+			if (_stp_agg_merge_node(agg, ptr->hash, ptr, update, cmp))
+				return -1;
+		}
+#else
+		mhlist_for_each_entry(ptr, e, &m->hashes[b], hnode) {
+			if (_stp_agg_merge_node(agg, ptr->hash, ptr, update, cmp))
+				return -1;
+		}
+#endif
+	}
+	return 0;
+}
+
+/* Bring the aggregated map up to date by aggregating only the hash
+ * buckets that changed since the last time.  Returns -1 if that is
+ * not possible, and the whole map needs aggregating. */
+static int _stp_pmap_agg_dirty (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
+{
+	int i;
+	unsigned b, nbuckets = _stp_pmap_get_agg(pmap)->hash_table_mask + 1;
+	MAP m;
+
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (likely(m != NULL) && (m->dirty == NULL || m->dirty_all))
+			return -1;
+	}
+
+	/* NB: each bucket is aggregated once, since that clears its
+	 * dirty bit in every map. */
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (unlikely(m == NULL))
+			continue;
+		for (b = find_first_bit(m->dirty, nbuckets); b < nbuckets;
+		     b = find_next_bit(m->dirty, nbuckets, b + 1))
+			if (_stp_pmap_agg_bucket(pmap, b, update, cmp))
+				return -1;
+	}
+	return 0;
+}
+#endif
+
+/** Aggregate per-cpu maps.
+ * This function aggregates the per-cpu maps into an aggregated
+ * map. A pointer to that aggregated map is returned.
+ *
+ * In the kernel, the per-cpu maps track which of their hash buckets
+ * changed since the last aggregation, so that only the keys in those
+ * need aggregating again.  -DSTP_PMAP_FULL_AGG turns that off.
+ * 
+ * A write lock must be held on the map during this function.
+ *
+ * @param map A pointer to a pmap.
+ * @returns a pointer to the aggregated map. Null on failure.
+ */
+static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
+{
+	MAP agg;
+#ifdef __KERNEL__
+	int i;
+
+	if (pmap->agg_valid && _stp_pmap_agg_dirty(pmap, update, cmp) == 0)
+		return _stp_pmap_get_agg(pmap);
+	pmap->agg_valid = 0;
+#endif
+
+	agg = _stp_pmap_agg_all(pmap, update, cmp);
 
-out:
+#ifdef __KERNEL__
+	if (agg == NULL)
+		return NULL;
+	pmap->agg_valid = 1;
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map (pmap, i);
+		if (unlikely(m == NULL))
+			continue;
+		if (m->dirty == NULL)
+			pmap->agg_valid = 0;
+		_stp_map_clear_dirty(m);
+	}
+#endif
 	return agg;
 }
 
-static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
+/* The node of a full @topk map with the smallest count.  No node has
+ * a count below map->topk_min: counts only grow, and a key that takes
+ * over a node starts above its count.  So the first node found at
+ * topk_min will do.  The nodes passed over on the way go to the tail
+ * of the list, so that the next search starts after them; only when
+ * none is left at topk_min does it go round the whole map, to find the
+ * new smallest count. */
+static struct map_node *_stp_map_topk_victim (MAP map)
+{
+	struct map_node *m, *victim = NULL;
+	int64_t count, min = 0;
+	unsigned i;
+
+	for (i = 0; i < map->num; i++) {
+		m = mlist_map_node(mlist_next(&map->head));
+		count = _stp_map_topk_count(map, m);
+		if (count <= map->topk_min)
+			return m;
+		if (victim == NULL || count < min) {
+			victim = m;
+			min = count;
+		}
+		mlist_move_tail(&m->lnode, &map->head);
+	}
+	map->topk_min = min;
+	return victim;
+}
+
+/** Make the maps of a pmap keep their heaviest keys.
+ * Once a per-cpu map is full, a new key takes over the node of the key
+ * with the smallest count, statistics and all, as in the space-saving
+ * algorithm, so that a key's count is never below its true count.  The
+ * aggregate drops its smallest keys instead, as it merges.
+ *
+ * @param pmap A pointer to a pmap created wrapping.
+ * @param offset The offset of the stat_data in each node.
+ */
+static void _stp_pmap_set_topk (PMAP pmap, unsigned offset)
+{
+	int i;
+	MAP m;
+
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (likely(m != NULL))
+			m->topk = offset;
+	}
+	_stp_pmap_get_agg(pmap)->topk = offset;
+}
+
+static struct map_node *_new_map_create (MAP map, uint32_t hv)
 {
 	struct map_node *m;
-	if (mlist_empty(&map->pool)) {
+	if (mlist_empty(&map->pool)
+#ifdef MAP_GROWABLE
+	    && !_stp_map_grow_pool(map)
+#endif
+	    ) {
 		if (!map->wrap) {
 			/* ERROR. no space left */
 			return NULL;
 		}
-		m = mlist_map_node(mlist_next(&map->head));
+		if (map->topk)
+			m = _stp_map_topk_victim(map);
+		else
+			m = mlist_map_node(mlist_next(&map->head));
+		_stp_map_mark_all_dirty(map);
+		_stp_map_put_strs(map, m);
+#ifdef MAP_OPEN_ADDRESSING
+		_stp_map_slot_remove(map, m);
+#else
 		mhlist_del_init(&m->hnode);
+#endif
 	} else {
 		m = mlist_map_node(mlist_next(&map->pool));
-		map->num++;
+		if (++map->num > map->hwm)
+			map->hwm = map->num;
+		map->topk_min = 0; /* its count starts from scratch */
 	}
 	mlist_move_tail(&m->lnode, &map->head);
 
 	/* add node to new hash list */
-	mhlist_add_head(&m->hnode, head);
+	m->hash = hv;
+#ifdef MAP_OPEN_ADDRESSING
+	if (map->slots_used >= (map->hash_table_mask + 1) / 4 * 3)
+		_stp_map_rehash(map);
+	else
+		_stp_map_slot_insert(map, m);
+#else
+	mhlist_add_head(&m->hnode, &map->hashes[hv & map->hash_table_mask]);
+#endif
 	return m;
 }
 
 static void _new_map_del_node (MAP map, struct map_node *n)
 {
 	/* remove node from old hash list */
+#ifdef MAP_OPEN_ADDRESSING
+	_stp_map_slot_remove(map, n);
+#else
 	mhlist_del_init(&n->hnode);
+#endif
+
+	_stp_map_put_strs(map, n);
 
 	/* remove from entry list */
 	mlist_del(&n->lnode);
@@ -442,7 +933,7 @@ static int _new_map_set_str (MAP map, char *dst, char *val, int add)
 	return 0;
 }
 
-static int _new_map_set_stat (MAP map, struct stat_data *sd, int64_t val, int add, int s1, int s2, int s3, int s4, int s5)
+static inline int _new_map_set_stat (MAP map, struct stat_data *sd, int64_t val, int add, int s1, int s2, int s3, int s4, int s5)
 {
 	if (!add) {
 		Hist st = &map->hist;
@@ -504,11 +995,8 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
                         sd1->variance_s = _stp_div64(NULL, (S11 + S12 + S21 + S22), (sd1->count - 1));
                         sd1->variance = sd1->variance_s >> (2 * sd2->shift);
                 }
-		if (st->type != HIST_NONE) {
-			int j;
-			for (j = 0; j < st->buckets; j++)
-				sd1->histogram[j] += sd2->histogram[j];
-		}
+		if (st->type != HIST_NONE)
+			_stp_stat_merge_histogram(st, sd1, sd2);
 	} else {
 		sd1->count = sd2->count;
 		sd1->sum = sd2->sum;
@@ -559,5 +1047,45 @@ static int _stp_pmap_size (PMAP pmap)
 	}
 	return num;
 }
+
+/** Return the number of elements in the fullest per-cpu map of a pmap
+ * Each per-cpu map holds at most as many elements as the pmap was
+ * created for, so this is the count to hold against that limit.
+ * @param pmap 
+ * @returns an int
+ */
+static int _stp_pmap_fullest (PMAP pmap)
+{
+	int i, num = 0;
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map (pmap, i);
+		if (unlikely(m == NULL))
+			continue;
+		if ((int) m->num > num)
+			num = m->num;
+	}
+	return num;
+}
+
+/** Return the most elements any map of a pmap has held at once
+ * That is of its per-cpu maps, and of its aggregate, which may hold
+ * more keys than any one cpu saw.  This is what the pmap's limit
+ * needs to be for the run so far.
+ * @param pmap 
+ * @returns an unsigned
+ */
+static unsigned _stp_pmap_hwm (PMAP pmap)
+{
+	unsigned hwm = _stp_pmap_get_agg(pmap)->hwm;
+	int i;
+
+	for_each_possible_cpu(i) {
+		MAP m = _stp_pmap_get_map (pmap, i);
+		if (likely(m != NULL) && m->hwm > hwm)
+			hwm = m->hwm;
+	}
+	return hwm;
+}
 #endif /* _MAP_C_ */
 
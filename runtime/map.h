@@ -14,6 +14,7 @@
 #ifdef __KERNEL__
 #include <linux/log2.h>
 #include "linux/map_list.h"
+#include "stp_helper_lock.h"
 #elif defined(__DYNINST__)
 #include "dyninst/ilog2.h"
 #include "dyninst/map_list.h"
@@ -33,6 +34,39 @@
 #define HASHTABLESIZE(entries) (1 << max_t(int, ilog2(entries)+MAPHASHBIAS, 1))
 /* NB: a power of two, since we truncate hv with & rather than % */
 
+/* With STP_MAP_OPEN_ADDRESSING, the kernel runtime finds map nodes
+   through an open-addressed (linear probing) table of 8-byte slots
+   instead of hash chains.  Each slot holds the full key hash next to the
+   node's index, so a lookup usually touches one slot cache line plus the
+   matching node, and never walks through unrelated nodes.  The table
+   is kept at most 3/4 full, including deleted slots, by sizing it at
+   two to four times the maximum number of entries.  */
+#if defined(STP_MAP_OPEN_ADDRESSING) && defined(__KERNEL__)
+#define MAP_OPEN_ADDRESSING 1
+#define MAPSLOTSIZE(entries) (1 << max_t(int, ilog2(entries)+2, 2))
+#endif
+
+/* With STP_MAP_GROW, the per-cpu maps of the statistics arrays start
+   with STP_MAP_GROW_CHUNK nodes rather than their maximum number, and
+   get more in chunks of that many as they fill up, until they reach
+   it.  The chunks are allocated by a worker, out of probe context: a
+   map that uses up its chunks faster than the worker comes round is
+   full until it does.  Arrays that wrap, and the aggregates, are still
+   allocated whole.  Kernel only, and not with STP_MAP_OPEN_ADDRESSING,
+   whose slots index a single block of nodes.  */
+#if defined(STP_MAP_GROW) && defined(__KERNEL__) && !defined(MAP_OPEN_ADDRESSING)
+#define MAP_GROWABLE 1
+#ifndef STP_MAP_GROW_CHUNK
+#define STP_MAP_GROW_CHUNK 256
+#endif
+
+struct map_chunk {
+	struct map_chunk *next;
+	unsigned count;
+	char nodes[0] __attribute__((aligned(8)));
+};
+#endif
+
 
 /** @file map.h
  * @brief Header file for maps and lists 
@@ -50,6 +84,34 @@
 #define MAP_STRING_LENGTH MAXSTRINGLEN
 #endif
 
+/** With -DMAP_STRING_INLINE=N, string keys and values keep only N
+    bytes, including the NUL, in the map nodes.  Longer ones take a
+    MAP_STRING_LENGTH buffer from a pool of the map, which is sized for
+    MAP_STRING_SPILL percent of them: a map that runs out of those is
+    full for the keys and values that need one.  Kernel only. */
+#if defined(MAP_STRING_INLINE) && MAP_STRING_INLINE < MAP_STRING_LENGTH && defined(__KERNEL__)
+#define MAP_STRING_TIERED 1
+#ifndef MAP_STRING_SPILL
+#define MAP_STRING_SPILL 25
+#endif
+#define MAP_MAX_STRS 10 /* nine keys and a value */
+
+struct map_str {
+	char *ptr;	/* the string's buffer from the pool, if it is long */
+	char str[MAP_STRING_INLINE];
+};
+
+#define MAP_STR_STOR(name) struct map_str name
+#define MAP_STR(s) ((s).ptr ? (s).ptr : (s).str)
+#define MAP_STR_SET(map, dst, src, add) _stp_map_str_set(map, &(dst), src, add)
+#else
+#define MAP_STR_STOR(name) char name[MAP_STRING_LENGTH]
+#define MAP_STR(s) (s)
+#define MAP_STR_SET(map, dst, src, add) _new_map_set_str(map, dst, src, add)
+#define _stp_map_put_strs(map, n) do {} while (0)
+#endif
+#define MAP_STR_COPY(map, dst, src) MAP_STR_SET(map, dst, src, 0)
+
 /** @cond DONT_INCLUDE */
 #define INT64 0
 #define STRING 1
@@ -72,12 +134,43 @@ struct map_node {
 	/* list of other nodes in the map */
 	struct mlist_head lnode;
 
+	/* the full hash of the key, checked before comparing keys */
+	uint32_t hash;
+
+#ifdef MAP_OPEN_ADDRESSING
+	/* the slot that points to this node */
+	uint32_t slot;
+#else
 	/* list of nodes with the same hash value */
 	struct mhlist_node hnode;
+#endif
+};
+
+#ifdef MAP_OPEN_ADDRESSING
+/* A slot of the open-addressed table.  NODE is the index of the node
+   in node_mem plus one, or one of these: */
+#define MAP_SLOT_EMPTY   0
+#define MAP_SLOT_DELETED 0xffffffffU
+struct map_slot {
+	uint32_t hash;
+	uint32_t node;
 };
+#endif
 
 #define mlist_map_node(head) mlist_entry((head), struct map_node, lnode)
 
+/* An entry of the arrays that sorts use in place of the node list:
+   the node, its position in the list, and its sort key, fetched
+   once rather than at each comparison. */
+struct map_sort_ent {
+	union {
+		int64_t val;
+		const char *strp;
+	} k;
+	struct mlist_head *lnode;
+	unsigned pos;
+};
+
 /* This structure contains all information about a map.
  * It is allocated once when _stp_map_new() is called. 
  */
@@ -88,9 +181,19 @@ struct map_root {
 	/* current number of used elements */
 	unsigned num;
 
+	/* the most elements there have been at once */
+	unsigned hwm;
+
 	/* when more than maxnum elements, wrap or discard? */
 	int wrap;
 
+	/* for the maps of @topk arrays, the offset of the stat_data in
+	   each node, else 0: these wrap by evicting the smallest count. */
+	unsigned topk;
+	/* and a count no node of theirs is below, see
+	   _stp_map_topk_victim() */
+	int64_t topk_min;
+
         /* scale factor for integer arithmetic */
         int bit_shift;
 
@@ -99,6 +202,51 @@ struct map_root {
 
 #ifdef __KERNEL__
 	void *node_mem;
+
+	/* for the per-cpu maps of a pmap, the hash buckets changed
+	   since the last aggregation, when these are tracked.
+	   dirty_all is set when some change could not be tracked. */
+	unsigned long *dirty;
+	int dirty_all;
+
+	/* for striped maps, the locks of STP_MAP_STRIPES groups of hash
+	   buckets, which single-key operations take so that those on
+	   keys of different groups run at once, and the lock of the
+	   node lists and string buffers they share. */
+	stp_spinlock_t *stripes;
+	stp_spinlock_t list_lock;
+
+	/* for the maps that foreach sorts, room for twice maxnum
+	   entries: the nodes and the merge sort's scratch space. */
+	struct map_sort_ent *sort_ents;
+#endif
+
+#ifdef MAP_GROWABLE
+	/* for a map that grows, see _stp_map_grow_pool(): new nodes are
+	   cut from the chunk at bump, then from spare, the next one the
+	   worker has allocated.  allocated counts the nodes of all the
+	   chunks, spare included, and only the worker changes it. */
+	unsigned node_size;
+	int cpu;
+	unsigned allocated;
+	unsigned bump_left;
+	char *bump;
+	struct map_chunk *chunks;
+	struct map_chunk *spare;
+	int grow_wanted;
+
+	/* times the map was found full before it had grown to maxnum */
+	unsigned grow_misses;
+#endif
+
+#ifdef MAP_STRING_TIERED
+	/* the offsets of the string keys and value in each node, and
+	   the unused buffers for long strings, linked through their
+	   first bytes. */
+	unsigned nstrs;
+	unsigned str_offsets[MAP_MAX_STRS];
+	void *str_mem;
+	char *str_free;
 #endif
 
 	/* linked list of current entries */
@@ -110,9 +258,21 @@ struct map_root {
 	/* used if this map's nodes contain stats */
 	struct _Hist hist;
 
+#ifdef MAP_OPEN_ADDRESSING
+	/* size of each node in node_mem */
+	unsigned node_size;
+
+	/* slots that are not empty, i.e. live or deleted */
+	unsigned slots_used;
+
+	/* the hash table for this array */
+        unsigned hash_table_mask;
+	struct map_slot slots[0]; /* dynamically allocated at tail */
+#else
 	/* the hash table for this array */
         unsigned hash_table_mask;
 	struct mhlist_head hashes[0]; /* dynamically allocated at tail */
+#endif
 };
 
 /** All maps are of this type. */
@@ -137,6 +297,41 @@ typedef int (*map_cmp_fn)(struct map_node *dst, struct map_node *src);
 #define foreach(map, ptr)						\
 	for (ptr = _stp_map_start(map); ptr; ptr = _stp_map_iter (map, ptr))
 
+/** Loop through the nodes of a map that may match a hash value.
+ * @param map
+ * @param hv the full (unscaled) hash of the key
+ * @param n pointer to the struct containing a struct map_node named "node"
+ * @param it iterator, of type map_hash_iter
+ *
+ * Only nodes with the same full hash are visited, so that strings are
+ * hardly ever compared but for the matching key.  The caller still has
+ * to compare the keys of each node.
+ */
+#ifdef MAP_OPEN_ADDRESSING
+typedef unsigned map_hash_iter;
+
+#define _stp_map_slot_node(map, it)					\
+	((struct map_node *)((char *)(map)->node_mem			\
+			     + ((map)->slots[it].node - 1) * (map)->node_size))
+
+#define map_for_each_hash_entry(map, hv, n, it)				\
+	for (it = (hv) & (map)->hash_table_mask;			\
+	     (map)->slots[it].node != MAP_SLOT_EMPTY;			\
+	     it = (it + 1) & (map)->hash_table_mask)			\
+		if ((map)->slots[it].node != MAP_SLOT_DELETED		\
+		    && (map)->slots[it].hash == (uint32_t)(hv)		\
+		    && ((n) = container_of(_stp_map_slot_node(map, it),	\
+					   typeof(*(n)), node)))
+#else
+typedef struct mhlist_node *map_hash_iter;
+
+#define map_for_each_hash_entry(map, hv, n, it)				\
+	mhlist_for_each_entry(n, it,					\
+			      &(map)->hashes[(hv) & (map)->hash_table_mask], \
+			      node.hnode)				\
+		if ((n)->node.hash == (uint32_t)(hv))
+#endif
+
 /** @} */
 
 
@@ -166,7 +361,7 @@ static struct map_node * _stp_map_iter(MAP map, struct map_node *m);
 static void _stp_map_del(MAP map);
 static void _stp_map_clear(MAP map);
 
-static struct map_node *_new_map_create (MAP map, struct mhlist_head *head);
+static struct map_node *_new_map_create (MAP map, uint32_t hv);
 static int _new_map_set_int64 (MAP map, int64_t *dst, int64_t val, int add);
 static int _new_map_set_str (MAP map, char* dst, char *val, int add);
 static void _new_map_del_node (MAP map, struct map_node *n);
@@ -176,8 +371,13 @@ static PMAP _stp_pmap_new_hstat_linear (unsigned max_entries, int wrap,
 static PMAP _stp_pmap_new_hstat_log (unsigned max_entries, int wrap, int node_size);
 static PMAP _stp_pmap_new_hstat (unsigned max_entries, int wrap, int node_size);
 static void _stp_pmap_del(PMAP pmap);
+static void _stp_pmap_set_topk(PMAP pmap, unsigned offset);
 static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp);
-static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
+static unsigned _stp_map_merge(MAP m, MAP src, map_update_fn update,
+			       map_cmp_fn cmp, int add);
+static unsigned _stp_pmap_merge(PMAP pmap, PMAP src, map_update_fn update,
+				map_cmp_fn cmp);
+static struct map_node *_stp_new_agg(MAP agg, uint32_t hv,
 				     struct map_node *ptr, map_update_fn update);
 static int _new_map_set_stat (MAP map, struct stat_data *dst, int64_t val, int add, int s1, int s2, int s3, int s4, int s5);
 static int _new_map_copy_stat (MAP map, struct stat_data *dst, struct stat_data *src, int add);
@@ -11,12 +11,30 @@
 #ifndef _STP_MEMPOOL_C_
 #define _STP_MEMPOOL_C_
 
+/* Number of free buffers each cpu caches in front of the shared list.
+ * The pool is topped up by this many buffers per cpu, so that buffers
+ * parked on other cpus never reduce the number that can be allocated.
+ * Zero disables the per-cpu caches. */
+#ifndef STP_MEMPOOL_MAGAZINE
+#define STP_MEMPOOL_MAGAZINE 8
+#endif
+
+/* for internal use only */
+struct _stp_mem_buffer;
+
+/* for internal use only: a cpu's cache of free buffers */
+struct _stp_mem_magazine {
+	unsigned count;
+	struct _stp_mem_buffer *bufs[STP_MEMPOOL_MAGAZINE ?: 1];
+};
+
 /* An opaque struct identifying the memory pool. */
 typedef struct {
 	struct list_head free_list;
 	unsigned num;
 	unsigned size;
 	stp_spinlock_t lock;
+	struct _stp_mem_magazine *magazines; /* percpu, or NULL */
 } _stp_mempool_t;
 
 /* for internal use only */
@@ -30,11 +48,23 @@ struct _stp_mem_buffer {
 static void _stp_mempool_destroy(_stp_mempool_t *pool)
 {
 	struct list_head *p, *tmp;
+	unsigned i;
+	int cpu;
+
 	if (pool) {
 		list_for_each_safe(p, tmp, &pool->free_list) {
 			list_del(p);
 			_stp_vfree(p);
 		}
+		if (pool->magazines) {
+			for_each_possible_cpu(cpu) {
+				struct _stp_mem_magazine *mag =
+					per_cpu_ptr(pool->magazines, cpu);
+				for (i = 0; i < mag->count; i++)
+					_stp_vfree(mag->bufs[i]);
+			}
+			_stp_free_percpu(pool->magazines);
+		}
 		_stp_kfree(pool);
 	}
 }
@@ -53,6 +83,15 @@ static _stp_mempool_t *_stp_mempool_init(size_t size, size_t num)
 
 	INIT_LIST_HEAD(&pool->free_list);
 	stp_spin_lock_init(&pool->lock);
+	pool->magazines = NULL;
+
+	/* The magazines are only an optimization; without them every
+	   call just takes the lock. */
+	if (STP_MEMPOOL_MAGAZINE > 0) {
+		pool->magazines = _stp_alloc_percpu(sizeof(struct _stp_mem_magazine));
+		if (pool->magazines)
+			num += STP_MEMPOOL_MAGAZINE * num_possible_cpus();
+	}
 
 	alloc_size = size + sizeof(struct _stp_mem_buffer) - sizeof(void *);
 
@@ -72,6 +111,34 @@ err:
 	return NULL;
 }
 
+/* Move up to half a magazine of buffers from the shared list into
+ * mag.  Called with irqs off, on the cpu owning mag. */
+static void _stp_mempool_refill(_stp_mempool_t *pool,
+				struct _stp_mem_magazine *mag)
+{
+	struct _stp_mem_buffer *ptr;
+
+	stp_spin_lock(&pool->lock);
+	while (mag->count < (STP_MEMPOOL_MAGAZINE + 1) / 2
+	       && !list_empty(&pool->free_list)) {
+		ptr = (struct _stp_mem_buffer *)pool->free_list.next;
+		list_del_init(&ptr->list);
+		mag->bufs[mag->count++] = ptr;
+	}
+	stp_spin_unlock(&pool->lock);
+}
+
+/* Move half of a full magazine back to the shared list.  Called with
+ * irqs off, on the cpu owning mag. */
+static void _stp_mempool_spill(_stp_mempool_t *pool,
+			       struct _stp_mem_magazine *mag)
+{
+	stp_spin_lock(&pool->lock);
+	while (mag->count > STP_MEMPOOL_MAGAZINE / 2)
+		list_add(&mag->bufs[--mag->count]->list, &pool->free_list);
+	stp_spin_unlock(&pool->lock);
+}
+
 /* allocate a buffer from a memory pool */
 static void *_stp_mempool_alloc(_stp_mempool_t *pool)
 {
@@ -81,6 +148,20 @@ static void *_stp_mempool_alloc(_stp_mempool_t *pool)
          actually initialized. */
         if (pool == NULL)
                 return NULL;
+
+	if (pool->magazines) {
+		struct _stp_mem_magazine *mag;
+
+		local_irq_save(flags);
+		mag = per_cpu_ptr(pool->magazines, smp_processor_id());
+		if (unlikely(mag->count == 0))
+			_stp_mempool_refill(pool, mag);
+		if (likely(mag->count > 0))
+			ptr = mag->bufs[--mag->count];
+		local_irq_restore(flags);
+		return ptr ? &ptr->buf : NULL;
+	}
+
 	stp_spin_lock_irqsave(&pool->lock, flags);
 	if (likely(!list_empty(&pool->free_list))) {
 		ptr = (struct _stp_mem_buffer *)pool->free_list.next;
@@ -97,6 +178,19 @@ static void _stp_mempool_free(void *buf)
 {
 	unsigned long flags;
 	struct _stp_mem_buffer *m = container_of(buf, struct _stp_mem_buffer, buf);
+
+	if (m->pool->magazines) {
+		struct _stp_mem_magazine *mag;
+
+		local_irq_save(flags);
+		mag = per_cpu_ptr(m->pool->magazines, smp_processor_id());
+		if (unlikely(mag->count == STP_MEMPOOL_MAGAZINE))
+			_stp_mempool_spill(m->pool, mag);
+		mag->bufs[mag->count++] = m;
+		local_irq_restore(flags);
+		return;
+	}
+
 	stp_spin_lock_irqsave(&m->pool->lock, flags);
 	list_add(&m->list, &m->pool->free_list);
 	stp_spin_unlock_irqrestore(&m->pool->lock, flags);
@@ -21,23 +21,23 @@ static int KEYSYM(pmap_key_cmp) (struct map_node *m1, struct map_node *m2)
 {
 	struct KEYSYM(map_node) *n1 = KEYSYM(get_map_node)(m1);
 	struct KEYSYM(map_node) *n2 = KEYSYM(get_map_node)(m2);
-		if (KEY1_EQ_P(n1->key1, n2->key1)
+		if (KEY1_EQ_P(KEY1GET(n1), KEY1GET(n2))
 #if KEY_ARITY > 1
-		    && KEY2_EQ_P(n1->key2, n2->key2)
+		    && KEY2_EQ_P(KEY2GET(n1), KEY2GET(n2))
 #if KEY_ARITY > 2
-		    && KEY3_EQ_P(n1->key3, n2->key3)
+		    && KEY3_EQ_P(KEY3GET(n1), KEY3GET(n2))
 #if KEY_ARITY > 3
-		    && KEY4_EQ_P(n1->key4, n2->key4)
+		    && KEY4_EQ_P(KEY4GET(n1), KEY4GET(n2))
 #if KEY_ARITY > 4
-		    && KEY5_EQ_P(n1->key5, n2->key5)
+		    && KEY5_EQ_P(KEY5GET(n1), KEY5GET(n2))
 #if KEY_ARITY > 5
-		    && KEY6_EQ_P(n1->key6, n2->key6)
+		    && KEY6_EQ_P(KEY6GET(n1), KEY6GET(n2))
 #if KEY_ARITY > 6
-		    && KEY7_EQ_P(n1->key7, n2->key7)
+		    && KEY7_EQ_P(KEY7GET(n1), KEY7GET(n2))
 #if KEY_ARITY > 7
-		    && KEY8_EQ_P(n1->key8, n2->key8)
+		    && KEY8_EQ_P(KEY8GET(n1), KEY8GET(n2))
 #if KEY_ARITY > 8
-		    && KEY9_EQ_P(n1->key9, n2->key9)
+		    && KEY9_EQ_P(KEY9GET(n1), KEY9GET(n2))
 #endif
 #endif
 #endif
@@ -52,61 +52,61 @@ static int KEYSYM(pmap_key_cmp) (struct map_node *m1, struct map_node *m2)
 			return 0;
 }
 
-/* copy keys for m2 -> m1 */
-static void KEYSYM(pmap_copy_keys) (struct map_node *m1, struct map_node *m2)
+/* copy keys for m2 -> m1, a node of map m */
+static void KEYSYM(pmap_copy_keys) (MAP m, struct map_node *m1, struct map_node *m2)
 {
 	struct KEYSYM(map_node) *dst = KEYSYM(get_map_node)(m1);
 	struct KEYSYM(map_node) *src = KEYSYM(get_map_node)(m2);
 #if KEY1_TYPE == STRING
-	str_copy (dst->key1, src->key1); 
+	MAP_STR_COPY (m, dst->key1, MAP_STR(src->key1));
 #else
 	dst->key1 = src->key1;
 #endif
 #if KEY_ARITY > 1
 #if KEY2_TYPE == STRING
-	str_copy (dst->key2, src->key2); 
+	MAP_STR_COPY (m, dst->key2, MAP_STR(src->key2));
 #else
 	dst->key2 = src->key2;
 #endif
 #if KEY_ARITY > 2
 #if KEY3_TYPE == STRING
-	str_copy (dst->key3, src->key3); 
+	MAP_STR_COPY (m, dst->key3, MAP_STR(src->key3));
 #else
 	dst->key3 = src->key3;
 #endif
 #if KEY_ARITY > 3
 #if KEY4_TYPE == STRING
-	str_copy (dst->key4, src->key4); 
+	MAP_STR_COPY (m, dst->key4, MAP_STR(src->key4));
 #else
 	dst->key4 = src->key4;
 #endif
 #if KEY_ARITY > 4
 #if KEY5_TYPE == STRING
-	str_copy (dst->key5, src->key5); 
+	MAP_STR_COPY (m, dst->key5, MAP_STR(src->key5));
 #else
 	dst->key5 = src->key5;
 #endif
 #if KEY_ARITY > 5
 #if KEY6_TYPE == STRING
-	str_copy (dst->key6, src->key6); 
+	MAP_STR_COPY (m, dst->key6, MAP_STR(src->key6));
 #else
 	dst->key6 = src->key6;
 #endif
 #if KEY_ARITY > 6
 #if KEY7_TYPE == STRING
-	str_copy (dst->key7, src->key7); 
+	MAP_STR_COPY (m, dst->key7, MAP_STR(src->key7));
 #else
 	dst->key7 = src->key7;
 #endif
 #if KEY_ARITY > 7
 #if KEY8_TYPE == STRING
-	str_copy (dst->key8, src->key8); 
+	MAP_STR_COPY (m, dst->key8, MAP_STR(src->key8));
 #else
 	dst->key8 = src->key8;
 #endif
 #if KEY_ARITY > 8
 #if KEY9_TYPE == STRING
-	str_copy (dst->key9, src->key9); 
+	MAP_STR_COPY (m, dst->key9, MAP_STR(src->key9));
 #else
 	dst->key9 = src->key9;
 #endif
@@ -120,6 +120,15 @@ static void KEYSYM(pmap_copy_keys) (struct map_node *m1, struct map_node *m2)
 #endif
 }
 
+#ifdef MAP_STRING_TIERED
+static int KEYSYM(_stp_pmap_init_strs) (PMAP pmap)
+{
+	unsigned offsets[MAP_MAX_STRS];
+	unsigned n = KEYSYM(_stp_map_str_offsets) (offsets);
+	return _stp_pmap_init_strs (pmap, n, offsets);
+}
+#endif
+
 /* update the keys and value of a map_node */
 static void KEYSYM(pmap_update_node) (MAP m, struct map_node *m1, struct map_node *m2, int add)
 {
@@ -132,7 +141,7 @@ static void KEYSYM(pmap_update_node) (MAP m, struct map_node *m1, struct map_nod
 
 	src = KEYSYM(get_map_node)(m2);
 	if (!add)
-		KEYSYM(pmap_copy_keys)(m1, m2);
+		KEYSYM(pmap_copy_keys)(m, m1, m2);
 	MAP_COPY_VAL(m, dst, MAP_GET_VAL(src), add);
 }
 
@@ -141,6 +150,12 @@ static PMAP KEYSYM(_stp_pmap_new) (unsigned max_entries, int wrap)
 {
 	PMAP pmap = _stp_pmap_new (max_entries, wrap,
 				   sizeof(struct KEYSYM(map_node)));
+#ifdef MAP_STRING_TIERED
+	if (pmap && KEYSYM(_stp_pmap_init_strs) (pmap)) {
+		_stp_pmap_del (pmap);
+		pmap = NULL;
+	}
+#endif
 	return pmap;
 }
 #else
@@ -154,8 +169,8 @@ static PMAP KEYSYM(_stp_pmap_new) (unsigned max_entries, int wrap)
 static PMAP
 KEYSYM(_stp_pmap_new) (int first_arg, ...)
 {
-	int start=0, stop=0, interval=0, bit_shift=0;
-	int max_entries=0, wrap=0, stat_ops=0, htype=0;
+	int start=0, stop=0, interval=0, bits=0, bit_shift=0;
+	int max_entries=0, wrap=0, topk=0, stat_ops=0, htype=0;
 	int arg = first_arg;
 	PMAP pmap;
 	va_list ap;
@@ -169,6 +184,9 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 		case KEY_STAT_WRAP:
 			wrap = 1;
 			break;
+		case KEY_STAT_TOPK:
+			wrap = topk = 1;
+			break;
 		case KEY_HIST_TYPE:
 			htype = va_arg(ap, int);
 			if (htype == HIST_LINEAR) {
@@ -176,6 +194,8 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 				stop = va_arg(ap, int);
 				interval = va_arg(ap, int);
 			}
+			if (htype == HIST_HDR || htype == HIST_HLL)
+				bits = va_arg(ap, int);
 			break;
 		case STAT_OP_COUNT:
 			stat_ops |= STAT_OP_COUNT;
@@ -216,6 +236,16 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 		pmap = _stp_pmap_new_hstat_log (max_entries, wrap,
 		                                sizeof(struct KEYSYM(map_node)));
 		break;
+	case HIST_HDR:
+	case HIST_HLL:
+		pmap = _stp_pmap_new_hstat_bits (max_entries, wrap,
+		                                 sizeof(struct KEYSYM(map_node)),
+		                                 htype, bits);
+		if (pmap) {
+			pmap->bit_shift = bit_shift;
+			pmap->stat_ops = stat_ops;
+		}
+		break;
 	case HIST_LINEAR:
 		pmap = _stp_pmap_new_hstat_linear (max_entries, wrap,
 		                                   sizeof(struct KEYSYM(map_node)),
@@ -226,7 +256,14 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 		pmap = NULL;
 	}
 
-
+	if (pmap && topk)
+		_stp_pmap_set_topk(pmap, offsetof(struct KEYSYM(map_node), value));
+#ifdef MAP_STRING_TIERED
+	if (pmap && KEYSYM(_stp_pmap_init_strs) (pmap)) {
+		_stp_pmap_del (pmap);
+		pmap = NULL;
+	}
+#endif
 	return pmap;
 }
 
@@ -260,8 +297,7 @@ static inline int KEYSYM(_stp_pmap_add) (PMAP pmap, ALLKEYSD(key), VSTYPE val, i
 static VALTYPE KEYSYM(_stp_pmap_get_cpu) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
 	VALTYPE res;
 	MAP map;
@@ -269,9 +305,8 @@ static VALTYPE KEYSYM(_stp_pmap_get_cpu) (PMAP pmap, ALLKEYSD(key))
 	map = _stp_pmap_get_map (pmap, MAP_GET_CPU());
 	if (unlikely(map == NULL))
 	       return NULLRET;
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	hv = KEYSYM(hash) (ALLKEYS(key));
+	map_for_each_hash_entry(map, hv, n, e) {
 		if (KEY_EQ_P(n)) {
 			res = MAP_GET_VAL(n);
 			MAP_PUT_CPU();
@@ -287,8 +322,7 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
 	int cpu, clear_agg = 0;
-	struct mhlist_head *head, *ahead;
-	struct mhlist_node *e;
+	map_hash_iter e;
 	struct KEYSYM(map_node) *n;
 	struct map_node *anode = NULL;
 	MAP map, agg;
@@ -297,8 +331,7 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 
 	/* first look it up in the aggregation map */
 	agg = _stp_pmap_get_agg(pmap);
-	ahead = &agg->hashes[hv & agg->hash_table_mask];
-	mhlist_for_each_entry(n, e, ahead, node.hnode) {
+	map_for_each_hash_entry(agg, hv, n, e) {
 		if (KEY_EQ_P(n)) {
 			anode = &n->node;
 			clear_agg = 1;
@@ -313,11 +346,10 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
                        /* offline CPU or a newly-added online CPU */
                        continue;
 		}
-		head = &map->hashes[hv & map->hash_table_mask];
-		mhlist_for_each_entry(n, e, head, node.hnode) {
+		map_for_each_hash_entry(map, hv, n, e) {
 			if (KEY_EQ_P(n)) {
 				if (anode == NULL) {
-					anode = _stp_new_agg(agg, ahead, &n->node,
+					anode = _stp_new_agg(agg, hv, &n->node,
 							     KEYSYM(pmap_update_node));
 				} else {
 					if (clear_agg) {
@@ -342,6 +374,19 @@ static MAP KEYSYM(_stp_pmap_agg) (PMAP pmap)
 			     KEYSYM(pmap_key_cmp));
 }
 
+/* Put back the entries of a foreach snapshot, see _stp_map_merge(). */
+static unsigned KEYSYM(_stp_map_merge) (MAP map, MAP src)
+{
+	return _stp_map_merge(map, src, KEYSYM(pmap_update_node),
+			      KEYSYM(pmap_key_cmp), VALUE_TYPE == STAT);
+}
+
+static unsigned KEYSYM(_stp_pmap_merge) (PMAP pmap, PMAP src)
+{
+	return _stp_pmap_merge(pmap, src, KEYSYM(pmap_update_node),
+			       KEYSYM(pmap_key_cmp));
+}
+
 static int KEYSYM(_stp_pmap_del) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
@@ -358,8 +403,7 @@ static int KEYSYM(_stp_pmap_del) (PMAP pmap, ALLKEYSD(key))
 		m = _stp_pmap_get_map (pmap, cpu);
 		if (unlikely(m == NULL))
                        continue;
-		(void)KEYSYM(_stp_map_del_hash) (m, hv & m->hash_table_mask,
-                                                 ALLKEYS(key));
+		(void)KEYSYM(_stp_map_del_hash) (m, hv, ALLKEYS(key));
 	}
 
 	/* Note that we don't need to delete the aggregate's value,
@@ -17,6 +17,18 @@ static int _stp_print_init(void);
 static void _stp_print_cleanup(void);
 static void *_stp_reserve_bytes(int numbytes);
 static void _stp_unreserve_bytes (int numbytes);
+#if defined(STP_DIRECT_PRINT) && defined(__KERNEL__)
+static void *_stp_reserve_print_bytes(int numbytes, void **entry);
+static void _stp_unreserve_print_bytes(int numbytes, void *entry);
+static void _stp_commit_print_bytes(void *entry);
+#else
+/* Without direct printing, everything goes through the print buffer. */
+#define _stp_reserve_print_bytes(numbytes, entry) \
+	(*(entry) = NULL, _stp_reserve_bytes(numbytes))
+#define _stp_unreserve_print_bytes(numbytes, entry) \
+	_stp_unreserve_bytes(numbytes)
+#define _stp_commit_print_bytes(entry) do { } while (0)
+#endif
 static void _stp_printf(const char *fmt, ...);
 static void _stp_print(const char *str);
 static inline void _stp_print_flush(void);
@@ -8,6 +8,12 @@
  * later version.
  */
 
+#ifdef STP_OUTPUT_RATE
+/* From output_limit.c, which needs the probe table. */
+static int _stp_output_admit(void);
+static void _stp_output_drop(int limited);
+#endif
+
 /** Send the print buffer to the transport now.
  * Output accumulates in the print buffer until it
  * is filled, or this is called. This MUST be called before returning
@@ -30,6 +36,15 @@ static void __stp_print_flush(struct _stp_log *log)
 	log->len = 0; /* clear it for later reuse */
 	dbug_trans(1, "len = %zu\n", len);
 
+#ifdef STP_OUTPUT_RATE
+	/* A record turned down when it was reserved stays turned down. */
+	if (log->rejected || !_stp_output_admit()) {
+		log->rejected = 0;
+		_stp_output_drop(1);
+		return;
+	}
+#endif
+
         /* try to reserve header + len */
         bytes_reserved = _stp_data_write_reserve(hlen+len,
                                                  &entry);
@@ -38,7 +53,8 @@ static void __stp_print_flush(struct _stp_log *log)
                 /* copy new _stp_trace_ header */
                 struct _stp_trace t = {
                         .sequence = _stp_seq_inc(),
-                        .pdu_len = len
+                        .pdu_len = len,
+                        .timestamp = _stp_trace_clock()
                 };
                 memcpy(_stp_data_entry_data(entry), &t, hlen);
                 /* copy the first part of the message */
@@ -61,10 +77,16 @@ static void __stp_print_flush(struct _stp_log *log)
                         } else { /* rest of message cannot fit at this time */
                                 /* NB: the receiver must somehow resynch the framing! */
                                 atomic_inc(&_stp_transport_failures);
+#ifdef STP_OUTPUT_RATE
+                                _stp_output_drop(0);
+#endif
                                 break;
                         }
                 }
         } else {
                 atomic_inc(&_stp_transport_failures);
+#ifdef STP_OUTPUT_RATE
+                _stp_output_drop(0);
+#endif
         }
 }
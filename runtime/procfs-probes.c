@@ -15,6 +15,9 @@
 #include <linux/mutex.h>
 #include <linux/fs.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
 
 #include "procfs-probes.h"
 
@@ -33,17 +36,134 @@ struct stap_procfs_probe {
 	struct mutex lock;
 	int opencount;
 	wait_queue_head_t waitq;
+
+	/* With .cache(MS), the read probe runs from a work item, at
+	 * most every cache_ms, rendering into buffer; the result is
+	 * swapped into cache, and readers each get a copy of the last
+	 * such snapshot.  While the file keeps being read, the work
+	 * item renders ahead of the readers, so they don't wait. */
+	char *cache;
+	size_t cache_count;
+	const unsigned cache_ms;
+	int cache_state;	/* 1 if cache is valid, or an error */
+	int cache_stopping;
+	unsigned long cache_stamp, last_read, renders;
+	struct delayed_work cache_work;
+
+	/* With .mmap as well, each snapshot is also published to a ring
+	 * that readers can map; see struct _stp_procfs_ring_header. */
+	const int mmap;
+	void *ring;
+	size_t ring_size;
+};
+
+/* A reader's copy of a cached file's snapshot. */
+struct _stp_procfs_copy {
+	char *buffer;
+	size_t count;
 };
 
-static inline void _spp_init(struct stap_procfs_probe *spp)
+static void _stp_proc_cache_work(struct work_struct *work);
+
+static int _spp_init_ring(struct stap_procfs_probe *spp)
+{
+	struct _stp_procfs_ring_header *h;
+	size_t slot_size = PAGE_ALIGN(sizeof(struct _stp_procfs_ring_slot)
+				      + spp->bufsize);
+
+	/* vmalloc_user() gives zeroed pages that remap_vmalloc_range()
+	 * can map. */
+	spp->ring_size = PAGE_SIZE + STP_PROCFS_MMAP_SLOTS * slot_size;
+	spp->ring = vmalloc_user(spp->ring_size);
+	if (spp->ring == NULL)
+		return -ENOMEM;
+	h = spp->ring;
+	h->magic = STP_PROCFS_RING_MAGIC;
+	h->version = STP_PROCFS_RING_VERSION;
+	h->nslots = STP_PROCFS_MMAP_SLOTS;
+	h->slot_size = slot_size;
+	h->slot_offset = PAGE_SIZE;
+	h->seq = 0;
+	return 0;
+}
+
+static inline int _spp_init(struct stap_procfs_probe *spp)
 {
 	init_waitqueue_head(&spp->waitq);
 	spp->opencount = 0;
 	mutex_init(&spp->lock);
+	if (spp->cache_ms) {
+		spp->cache_state = 0;
+		spp->cache_stopping = 0;
+		INIT_DELAYED_WORK(&spp->cache_work, _stp_proc_cache_work);
+		if (spp->mmap)
+			return _spp_init_ring(spp);
+	}
+	return 0;
 }
 #define _spp_lock(spp)		mutex_lock(&(spp)->lock)
 #define _spp_unlock(spp)	mutex_unlock(&(spp)->lock)
-#define _spp_shutdown(spp)	mutex_destroy(&(spp)->lock)
+
+static inline void _spp_shutdown(struct stap_procfs_probe *spp)
+{
+	mutex_destroy(&spp->lock);
+	if (spp->ring != NULL) {
+		/* Pages still mapped by a reader stay around until it
+		 * unmaps them. */
+		vfree(spp->ring);
+		spp->ring = NULL;
+	}
+}
+
+/* Publishes a new snapshot to the ring.  Only the work item calls
+ * this, so there's one writer. */
+static void _stp_proc_ring_publish(struct stap_procfs_probe *spp,
+				   const char *data, size_t len)
+{
+	struct _stp_procfs_ring_header *h = spp->ring;
+	uint64_t seq = h->seq + 1;
+	struct _stp_procfs_ring_slot *slot = (struct _stp_procfs_ring_slot *)
+		((char *)spp->ring + h->slot_offset
+		 + (seq % h->nslots) * h->slot_size);
+
+	*(volatile uint64_t *)&slot->seq = 0;
+	smp_wmb();
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	slot->stamp = ktime_to_ns(ktime_get());
+	smp_wmb();
+	*(volatile uint64_t *)&slot->seq = seq;
+	smp_wmb();
+	*(volatile uint64_t *)&h->seq = seq;
+}
+
+/* Stops rendering a cached file's snapshots, before the probes are
+ * unregistered. */
+static inline void _spp_stop(struct stap_procfs_probe *spp)
+{
+	if (!spp->cache_ms)
+		return;
+	_spp_lock(spp);
+	spp->cache_stopping = 1;
+	_spp_unlock(spp);
+	cancel_delayed_work_sync(&spp->cache_work);
+	wake_up_all(&spp->waitq);
+}
+
+#ifdef STAPCONF_PDE_DATA2
+#define _stp_proc_spp(inode) ((struct stap_procfs_probe *)pde_data(inode))
+#else
+#define _stp_proc_spp(inode) ((struct stap_procfs_probe *)PDE_DATA(inode))
+#endif
+
+/* Cached files opened read-only don't need to be opened one at a
+ * time, since each reader has its own copy. */
+static inline int _stp_proc_shared_open(struct stap_procfs_probe *spp,
+					struct file *filp)
+{
+	return spp->cache_ms && spp->read_probe != NULL
+		&& (filp->f_flags & O_ACCMODE) == O_RDONLY;
+}
 
 static int _stp_proc_fill_read_buffer(struct stap_procfs_probe *spp);
 
@@ -56,11 +176,7 @@ _stp_proc_open_file(struct inode *inode, struct file *filp)
 	struct stap_procfs_probe *spp;
 	int res;
 
-#ifdef STAPCONF_PDE_DATA2
-	spp = (struct stap_procfs_probe *)pde_data(inode);
-#else
-	spp = (struct stap_procfs_probe *)PDE_DATA(inode);
-#endif
+	spp = _stp_proc_spp(inode);
 	if (spp == NULL) {
 		return -EINVAL;
 	}
@@ -69,6 +185,11 @@ _stp_proc_open_file(struct inode *inode, struct file *filp)
 	if (res)
 		return res;
 
+	if (_stp_proc_shared_open(spp, filp)) {
+		filp->private_data = _stp_kzalloc(sizeof(struct _stp_procfs_copy));
+		return filp->private_data ? 0 : -ENOMEM;
+	}
+
 	/* To avoid concurrency problems, we only allow 1 open at a
 	 * time. */
 
@@ -118,8 +239,17 @@ _stp_proc_release_file(struct inode *inode, struct file *filp)
 {
 	struct stap_procfs_probe *spp;
 
-	spp = (struct stap_procfs_probe *)filp->private_data;
-	if (spp != NULL) {
+	spp = _stp_proc_spp(inode);
+	if (spp != NULL && _stp_proc_shared_open(spp, filp)) {
+		struct _stp_procfs_copy *copy = filp->private_data;
+
+		if (copy != NULL) {
+			if (copy->buffer != NULL)
+				_stp_vfree(copy->buffer);
+			_stp_kfree(copy);
+		}
+	}
+	else if (spp != NULL) {
 		/* Decrement the open count. */
 		_spp_lock(spp);
 		spp->opencount--;
@@ -131,14 +261,146 @@ _stp_proc_release_file(struct inode *inode, struct file *filp)
 	return 0;
 }
 
+static void _stp_proc_cache_work(struct work_struct *work)
+{
+	struct stap_procfs_probe *spp =
+		container_of(to_delayed_work(work), struct stap_procfs_probe,
+			     cache_work);
+	int rc, rearm;
+
+	/* Only this work item uses spp->buffer of a cached file. */
+	spp->buffer[0] = '\0';
+	spp->count = 0;
+	spp->needs_fill = 1;
+	rc = _stp_proc_fill_read_buffer(spp);
+
+	_spp_lock(spp);
+	if (rc == 0) {
+		char *tmp = spp->cache;
+
+		spp->cache = spp->buffer;
+		spp->cache_count = spp->count;
+		spp->buffer = tmp;
+		spp->cache_stamp = jiffies;
+		spp->cache_state = 1;
+		if (spp->ring != NULL)
+			_stp_proc_ring_publish(spp, spp->cache,
+					       spp->cache_count);
+	}
+	else if (spp->cache_state != 1)
+		spp->cache_state = rc;
+	spp->renders++;
+
+	/* Keep rendering ahead while someone read the file within the
+	 * last couple of periods. */
+	rearm = (rc == 0 && !spp->cache_stopping
+		 && time_before_eq(jiffies, spp->last_read
+				   + 2 * msecs_to_jiffies(spp->cache_ms)));
+	_spp_unlock(spp);
+	wake_up_all(&spp->waitq);
+
+	if (rearm)
+		schedule_delayed_work(&spp->cache_work,
+				      msecs_to_jiffies(spp->cache_ms));
+}
+
+/* Makes sure there's a snapshot no more than two periods old, waiting
+ * for a new one if needed.  Called with the lock held, which it may
+ * drop while it waits. */
+static int _stp_proc_fresh_cache(struct stap_procfs_probe *spp)
+{
+	int rc;
+
+	spp->last_read = jiffies;
+	if (spp->cache_state != 1
+	    || time_after(jiffies, spp->cache_stamp
+			  + 2 * msecs_to_jiffies(spp->cache_ms))) {
+		unsigned long renders = spp->renders;
+
+		if (!spp->cache_stopping) {
+			cancel_delayed_work(&spp->cache_work);
+			schedule_delayed_work(&spp->cache_work, 0);
+		}
+		_spp_unlock(spp);
+		rc = wait_event_interruptible(spp->waitq,
+					      spp->renders != renders
+					      || spp->cache_stopping);
+		_spp_lock(spp);
+		if (rc)
+			return rc;
+	}
+
+	if (spp->cache_state != 1)
+		return spp->cache_state ? spp->cache_state : -EIO;
+	return 0;
+}
+
+/* Gives a reader a copy of the snapshot. */
+static int _stp_proc_copy_cache(struct stap_procfs_probe *spp,
+				struct _stp_procfs_copy *copy)
+{
+	int rc;
+
+	_spp_lock(spp);
+	rc = _stp_proc_fresh_cache(spp);
+	if (rc)
+		goto out;
+	copy->buffer = _stp_vzalloc(spp->cache_count + 1);
+	if (copy->buffer == NULL) {
+		rc = -ENOMEM;
+		goto out;
+	}
+	memcpy(copy->buffer, spp->cache, spp->cache_count);
+	copy->count = spp->cache_count;
+out:
+	_spp_unlock(spp);
+	return rc;
+}
+
+/* Maps the snapshot ring of a .mmap file, shared and read-only. */
+static int
+_stp_proc_mmap_file(struct file *file, struct vm_area_struct *vma)
+{
+	struct stap_procfs_probe *spp =
+		_stp_proc_spp(file->f_path.dentry->d_inode);
+	int rc;
+
+	if (spp == NULL || spp->ring == NULL
+	    || !_stp_proc_shared_open(spp, file))
+		return -ENODEV;
+	if (!(vma->vm_flags & VM_SHARED) || (vma->vm_flags & VM_WRITE))
+		return -EPERM;
+
+	/* Mapping the file counts as reading it, so the snapshots keep
+	 * coming for a while. */
+	_spp_lock(spp);
+	rc = _stp_proc_fresh_cache(spp);
+	_spp_unlock(spp);
+	if (rc)
+		return rc;
+	return remap_vmalloc_range(vma, spp->ring, vma->vm_pgoff);
+}
+
 static ssize_t
 _stp_proc_read_file(struct file *file, char __user *buf, size_t count,
 		    loff_t *ppos) 
 {
-	struct stap_procfs_probe *spp = file->private_data;
+	struct stap_procfs_probe *spp =
+		_stp_proc_spp(file->f_path.dentry->d_inode);
 	ssize_t retval = 0;
 
-	if (spp == NULL || spp->buffer == NULL) {
+	if (spp != NULL && _stp_proc_shared_open(spp, file)) {
+		struct _stp_procfs_copy *copy = file->private_data;
+
+		if (copy->buffer == NULL
+		    && (retval = _stp_proc_copy_cache(spp, copy)))
+			goto out;
+		return simple_read_from_buffer(buf, count, ppos,
+					       copy->buffer, copy->count);
+	}
+
+	/* A cached file's buffer belongs to its work item. */
+	if (spp == NULL || spp->buffer == NULL || spp->cache_ms) {
 		goto out;
 	}
 
@@ -190,6 +452,7 @@ static struct proc_ops _stp_proc_fops = {
 	.proc_read		= _stp_proc_read_file,
 	.proc_write		= _stp_proc_write_file,
 	.proc_lseek		= generic_file_llseek,
+	.proc_mmap		= _stp_proc_mmap_file,
 	.proc_release	= _stp_proc_release_file,
 };
 #else
@@ -199,6 +462,7 @@ static struct file_operations _stp_proc_fops = {
 	.read		= _stp_proc_read_file,
 	.write		= _stp_proc_write_file,
 	.llseek		= generic_file_llseek,
+	.mmap		= _stp_proc_mmap_file,
 	.release	= _stp_proc_release_file,
 };
 #endif
@@ -24,4 +24,36 @@ struct _stp_procfs_data {
 #define STP_PROCFS_BUFSIZE MAXSTRINGLEN
 #endif
 
+/* Snapshots kept in the ring of a procfs file read with .mmap. */
+#ifndef STP_PROCFS_MMAP_SLOTS
+#define STP_PROCFS_MMAP_SLOTS 4
+#endif
+
+/* A procfs file read with .mmap can be mapped (shared, read-only) by
+ * readers.  The mapping starts with this header, and holds nslots
+ * slots of slot_size bytes from slot_offset on.  Each new snapshot
+ * goes to slot (seq % nslots), after which seq is updated.  A reader
+ * takes the slot for the seq it finds, copies slot->len bytes of
+ * slot->data, and keeps the copy if slot->seq is that same seq both
+ * before and after (the slot's seq is 0 while it is written).  All
+ * fields are in the host's byte order. */
+#define STP_PROCFS_RING_MAGIC	0x53545052	/* "STPR" */
+#define STP_PROCFS_RING_VERSION	1
+
+struct _stp_procfs_ring_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;
+	uint32_t slot_size;
+	uint64_t slot_offset;
+	uint64_t seq;		/* of the newest snapshot, 0 if none yet */
+};
+
+struct _stp_procfs_ring_slot {
+	uint64_t seq;
+	uint64_t stamp;		/* ns of CLOCK_MONOTONIC when written */
+	uint64_t len;
+	char data[];
+};
+
 #endif	/* _STP_PROCFS_PROBES_H_ */
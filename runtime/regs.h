@@ -21,6 +21,7 @@
 
 #define REG_IP(regs) regs->rip
 #define REG_SP(regs) regs->rsp
+#define REG_FP(regs) regs->rbp
 
 #elif defined (__i386__)
 
@@ -46,6 +47,7 @@
 
 #define REG_IP(regs_arg) (regs_arg)->pc
 #define REG_SP(regs_arg) (regs_arg)->sp
+#define REG_FP(regs_arg) (regs_arg)->regs[29]
 #define REG_LINK(regs_arg) (regs_arg)->regs[30]
 
 #elif defined (__arm__)
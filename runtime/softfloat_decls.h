@@ -0,0 +1,26 @@
+/* -*- linux-c -*-
+ * Declarations for the softfloat routines
+ * Copyright (C) 2026 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STP_SOFTFLOAT_DECLS_H_
+#define _STP_SOFTFLOAT_DECLS_H_
+
+/* The softfloat.c routines are compiled in their own unit (see
+ * STP_SOFTFLOAT_UNIT); the generated module only needs the types and
+ * prototypes, set up the same way softfloat.c sees them. */
+#undef INT64_C
+#undef UINT64_C
+#define int_fast16_t sf_int_fast16_t
+#define uint_fast16_t sf_uint_fast16_t
+#define int_fast32_t sf_int_fast32_t
+#define uint_fast32_t sf_uint_fast32_t
+#include "softfloat/platform.h"
+#include "softfloat.h"
+
+#endif /* _STP_SOFTFLOAT_DECLS_H_ */
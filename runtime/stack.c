@@ -43,6 +43,32 @@
 #include <asm/unwind.h>
 #endif
 
+/* The backtrace engines, chosen with -DSTP_UNWIND=dwarf, fp or orc.
+ * dwarf, the default, interprets the CFI of the modules.  fp walks the
+ * frame pointer chains of user stacks, for programs built with
+ * -fno-omit-frame-pointer, and leaves kernel stacks to the kernel's
+ * own unwinder.  orc only does the latter; the kernel unwinds by orc
+ * or by frame pointers, as it was configured. */
+#define _STP_UNWIND_dwarf 1
+#define _STP_UNWIND_fp 2
+#define _STP_UNWIND_orc 3
+#define _STP_UNWIND_ENGINE_(e) _STP_UNWIND_##e
+#define _STP_UNWIND_ENGINE(e) _STP_UNWIND_ENGINE_(e)
+
+#ifdef STP_UNWIND
+#if _STP_UNWIND_ENGINE(STP_UNWIND) == _STP_UNWIND_fp
+#ifndef REG_FP
+#error "STP_UNWIND=fp is not supported on this architecture"
+#endif
+#define STP_UNWIND_USER_FP
+#define STP_UNWIND_KERNEL_NATIVE
+#elif _STP_UNWIND_ENGINE(STP_UNWIND) == _STP_UNWIND_orc
+#define STP_UNWIND_KERNEL_NATIVE
+#elif _STP_UNWIND_ENGINE(STP_UNWIND) != _STP_UNWIND_dwarf
+#error "STP_UNWIND must be dwarf, fp or orc"
+#endif
+#endif
+
 #if defined(STAPCONF_STACK_TRACE_SAVE_REGS) /* linux 5.2+ apprx. */
 static __typeof__(stack_trace_save_regs) (*stack_trace_save_regs_fn); /* not exported */
 
@@ -72,6 +98,35 @@ _stp_init_stack(void)
 
 #endif /* STAPCONF_STACK_TRACE_SAVE_REGS */
 
+/* Have the kernel's own unwinder save up to max return addresses of
+ * the stack at regs, after skipping skip.  Returns how many it saved,
+ * or -1 if it is not available. */
+static int _stp_stack_kernel_save_regs(struct pt_regs *regs,
+				       unsigned long *entries,
+				       unsigned max, int skip)
+{
+#if defined(STAPCONF_STACK_TRACE_SAVE_REGS)
+	if (!stack_trace_save_regs_fn)
+		return -1;
+	return (*stack_trace_save_regs_fn)(regs, entries, max, skip);
+#else
+	struct stack_trace trace;
+
+	if (!save_stack_trace_regs_fn)
+		return -1;
+
+	memset(&trace, 0, sizeof(trace));
+	trace.max_entries = max;
+	trace.entries = entries;
+	trace.skip = skip;
+	(* (save_stack_trace_regs_fn))(regs, &trace);
+
+	dbug_unwind(1, "trace.nr_entries: %d\n", trace.nr_entries);
+	dbug_unwind(1, "trace.max_entries: %d\n", trace.max_entries);
+	dbug_unwind(1, "trace.skip %d\n", trace.skip);
+	return trace.nr_entries;
+#endif
+}
 
 
 static void _stp_stack_print_fallback(struct context *, unsigned long,
@@ -184,40 +239,18 @@ static void _stp_stack_print_fallback(struct context *c, unsigned long sp,
 				      struct pt_regs *regs, int sym_flags,
 				      int levels, int skip) {
         unsigned long *entries = c->kern_bt_entries;
-        unsigned i;
-        unsigned num_entries;
-        
-#if defined(STAPCONF_STACK_TRACE_SAVE_REGS) /* linux 5.2+ apprx. */
-	if (!stack_trace_save_regs_fn) {
-		dbug_unwind(1, "no fallback kernel stacktrace (giving up)\n");
-		_stp_print_addr(0, sym_flags | _STP_SYM_INEXACT, NULL);
-		return;
-	}
+        int i, num_entries;
 
-        num_entries = (*stack_trace_save_regs_fn)(regs, &entries[0], MAXBACKTRACE, skip);
-#else
-	struct stack_trace trace;
-	/* If don't have save_stack_trace_regs unwinder, just give up. */
-	if (!save_stack_trace_regs_fn) {
+	/* Use kernel provided save_stack_trace_regs unwinder if available */
+	dbug_unwind(1, "fallback kernel stacktrace (save_stack_trace_regs)\n");
+	num_entries = _stp_stack_kernel_save_regs(regs, entries, MAXBACKTRACE, skip);
+	if (num_entries < 0) {
+		/* If don't have save_stack_trace_regs unwinder, just give up. */
 		dbug_unwind(1, "no fallback kernel stacktrace (giving up)\n");
 		_stp_print_addr(0, sym_flags | _STP_SYM_INEXACT, NULL);
 		return;
 	}
 
-	/* Use kernel provided save_stack_trace_regs unwinder if available */
-	dbug_unwind(1, "fallback kernel stacktrace (save_stack_trace_regs)\n");
-	memset(&trace, 0, sizeof(trace));
-	trace.max_entries = MAXBACKTRACE;
-	trace.entries = &(entries[0]);
-	trace.skip = skip;
-	(* (save_stack_trace_regs_fn))(regs, &trace);
-
-	dbug_unwind(1, "trace.nr_entries: %d\n", trace.nr_entries);
-	dbug_unwind(1, "trace.max_entries: %d\n", trace.max_entries);
-	dbug_unwind(1, "trace.skip %d\n", trace.skip);
-        num_entries = trace.nr_entries;
-#endif
-
 	/* save_stack_trace_reg() adds a ULONG_MAX after last valid entry. Ignore it. */
 	for (i=0; i<MAXBACKTRACE && i<num_entries && entries[i]!=ULONG_MAX; ++i) {
 		/* When we have frame pointers, the unwind addresses can be
@@ -400,10 +433,44 @@ _stp_stack_unwind_one_kernel(struct context *c, unsigned depth)
 #endif
 }
 
+#ifdef STP_UNWIND_KERNEL_NATIVE
+/* Fill the kernel unwind cache in one go from the kernel's own
+ * unwinder. */
+static void _stp_stack_kernel_fill(struct context *c)
+{
+	unsigned long *entries = c->kern_bt_entries;
+	struct unwind_cache *cache = &c->uwcache_kernel;
+	int i, n = 0;
+
+	cache->pc[0] = _stp_stack_unwind_one_kernel(c, 0);
+	cache->depth = 1;
+	cache->state = uwcache_finished;
+	if (cache->pc[0] && c->kregs)
+		n = _stp_stack_kernel_save_regs(c->kregs, entries,
+						MAXBACKTRACE, 0);
+	dbug_unwind(1, "kernel unwinder saved %d entries\n", n);
+
+	for (i = 0; i < n && cache->depth < MAXBACKTRACE; i++) {
+		/* The list ends with ULONG_MAX on older kernels. */
+		if (entries[i] == ULONG_MAX
+		    || entries[i] == _stp_kretprobe_trampoline)
+			break;
+		/* It starts with the pc of regs, which we already have. */
+		if (i == 0 && entries[0] == REG_IP(c->kregs))
+			continue;
+		cache->pc[cache->depth++] = entries[i];
+	}
+}
+#endif
+
 static unsigned long _stp_stack_kernel_get(struct context *c, unsigned depth)
 {
 	unsigned long pc = 0;
 
+#ifdef STP_UNWIND_KERNEL_NATIVE
+	if (c->uwcache_kernel.state == uwcache_uninitialized)
+		_stp_stack_kernel_fill(c);
+#endif
 	if (c->uwcache_kernel.state == uwcache_uninitialized) {
 		c->uwcache_kernel.depth = 0;
 		c->uwcache_kernel.state = uwcache_partial;
@@ -445,6 +512,10 @@ static void _stp_stack_kernel_print(struct context *c, int sym_flags)
 	unsigned n, remaining;
 	unsigned long l;
 
+#ifdef STP_DEFER_SYMBOLS
+	sym_flags |= _STP_SYM_DEFER;
+#endif
+
 	/* print the current address */
 	if (c->probe_type == stp_probe_type_kretprobe && c->ips.krp.pi
 	    && (sym_flags & _STP_SYM_FULL) == _STP_SYM_FULL) {
@@ -455,7 +526,14 @@ static void _stp_stack_kernel_print(struct context *c, int sym_flags)
 	}
 	_stp_print_addr(_stp_stack_kernel_get(c, 0), sym_flags, NULL);
 
-#ifdef STP_USE_DWARF_UNWINDER
+#ifdef STP_UNWIND_KERNEL_NATIVE
+	for (n = 1; n < MAXBACKTRACE; n++) {
+		l = _stp_stack_kernel_get(c, n);
+		if (l == 0)
+			break;
+		_stp_print_addr(l, sym_flags, NULL);
+	}
+#elif defined(STP_USE_DWARF_UNWINDER)
 	for (n = 1; n < MAXBACKTRACE; n++) {
 		l = _stp_stack_kernel_get(c, n);
 		if (l == 0) {
@@ -505,6 +583,102 @@ static void _stp_stack_kernel_print(struct context *c, int sym_flags)
 #endif
 }
 
+/* The user stack unwinding below needs the user parts of the context,
+ * which scripts that only unwind kernel stacks leave out. */
+#ifdef STP_NEED_USER_UNWIND_DATA
+
+#if STP_STACK_WINDOW > 0 \
+    && (defined(STP_UNWIND_USER_FP) || defined(STP_USE_DWARF_UNWINDER))
+/* Copy the user stack from sp up into the stack window of the context.
+ * This goes a page at a time, so that the end of the stack mapping just
+ * makes the window shorter. */
+static void _stp_stack_window_fill(struct context *c, unsigned long sp)
+{
+	struct stack_window *w = &c->uwwindow_user;
+	unsigned long len = 0;
+
+	w->base = sp;
+	while (len < STP_STACK_WINDOW) {
+		unsigned long n = PAGE_SIZE - ((sp + len) & (PAGE_SIZE - 1));
+
+		if (n > STP_STACK_WINDOW - len)
+			n = STP_STACK_WINDOW - len;
+		if (_stp_copy_from_user((char *) w->buf + len,
+					(const char __user *) (sp + len), n))
+			break;
+		len += n;
+	}
+	w->len = len;
+	dbug_unwind(1, "stack window %lx+%lx\n", sp, len);
+}
+#endif
+
+#ifdef STP_UNWIND_USER_FP
+/* Read user stack memory, out of the stack window if it is there.
+ * Returns 0, or -EFAULT. */
+static int _stp_stack_read_user(struct context *c, void *dst,
+				unsigned long addr, size_t size)
+{
+#if STP_STACK_WINDOW > 0
+	if (_stp_stack_window_read(&c->uwwindow_user, dst, addr, size) == 0)
+		return 0;
+#endif
+	if (_stp_copy_from_user((char *) dst, (const char __user *) addr, size))
+		return -EFAULT;
+	return 0;
+}
+
+/* Unwind one user frame by its frame pointer.  A frame record holds
+ * the frame pointer of the caller followed by the return address, and
+ * is read in a single copy.  Records must lie further up the stack
+ * with each frame, which also ends loops in corrupt chains. */
+static unsigned long
+_stp_stack_unwind_fp_user(struct context *c, struct pt_regs *regs,
+			  unsigned depth, unsigned long *sp)
+{
+	unsigned long fp = c->uwcache_user.fp;
+	unsigned long next, pc;
+
+	if (depth == 1) {
+		fp = REG_FP(regs);
+		if (fp < REG_SP(regs))
+			return 0;
+#if STP_STACK_WINDOW > 0
+		_stp_stack_window_fill(c, REG_SP(regs));
+#endif
+	}
+
+	if (_stp_is_compat_task()) {
+#if defined(__x86_64__)
+		u32 record[2];
+
+		if (fp == 0 || (fp & (sizeof(u32) - 1))
+		    || _stp_stack_read_user(c, record, fp, sizeof(record)))
+			return 0;
+		next = record[0];
+		pc = record[1];
+		*sp = fp + sizeof(record);
+#else
+		/* 32-bit frame records are laid out differently here. */
+		return 0;
+#endif
+	} else {
+		unsigned long record[2];
+
+		if (fp == 0 || (fp & (sizeof(long) - 1))
+		    || _stp_stack_read_user(c, record, fp, sizeof(record)))
+			return 0;
+		next = record[0];
+		pc = record[1];
+		*sp = fp + sizeof(record);
+	}
+
+	dbug_unwind(1, "frame record at %lx: fp=%lx pc=%lx\n", fp, next, pc);
+	c->uwcache_user.fp = next > fp ? next : 0;
+	return pc;
+}
+#endif
+
 static unsigned long
 _stp_stack_unwind_one_user(struct context *c, unsigned depth)
 {
@@ -546,7 +720,26 @@ _stp_stack_unwind_one_user(struct context *c, unsigned depth)
 #endif
 	}
 
-#ifdef STP_USE_DWARF_UNWINDER
+#ifdef STP_UNWIND_USER_FP
+	{
+		unsigned long pc, sp;
+
+		dbug_unwind(1, "CONTINUING user frame pointer walk to depth %d\n",
+			    depth);
+		pc = _stp_stack_unwind_fp_user(c, regs, depth, &sp);
+#ifdef STAPCONF_UPROBE_GET_PC
+		if (pc && ri) {
+			maybe_pc = uprobe_get_pc(ri, pc, sp);
+			if (maybe_pc)
+				pc = maybe_pc;
+		}
+#endif
+		if (pc && _stp_lookup_bad_addr(VERIFY_READ, sizeof(long),
+					       pc, STP_USER_DS))
+			return 0;
+		return pc;
+	}
+#elif defined(STP_USE_DWARF_UNWINDER)
 	info = &c->uwcontext_user.info;
 
 	dbug_unwind(1, "CONTINUING user unwind to depth %d\n", depth);
@@ -560,6 +753,10 @@ _stp_stack_unwind_one_user(struct context *c, unsigned depth)
 		}
 
 		arch_unw_init_frame_info(info, regs, 0);
+#if STP_STACK_WINDOW > 0
+		_stp_stack_window_fill(c, UNW_SP(info));
+		c->uwcontext_user.window = &c->uwwindow_user;
+#endif
 	}
 
 	ret = unwind(&c->uwcontext_user, 1);
@@ -629,6 +826,10 @@ static void _stp_stack_user_print(struct context *c, int sym_flags)
 	struct uretprobe_instance *ri = NULL;
 	unsigned n; unsigned long l;
 
+#ifdef STP_DEFER_SYMBOLS
+	sym_flags |= _STP_SYM_DEFER;
+#endif
+
 	if (c->probe_type == stp_probe_type_uretprobe)
 		ri = c->ips.ri;
 #ifdef STAPCONF_UPROBE_GET_PC
@@ -661,7 +862,7 @@ static void _stp_stack_user_print(struct context *c, int sym_flags)
 	_stp_print_addr(_stp_stack_user_get(c, 0), sym_flags, current);
 
 	/* print rest of stack... */
-#ifdef STP_USE_DWARF_UNWINDER
+#if defined(STP_USE_DWARF_UNWINDER) || defined(STP_UNWIND_USER_FP)
 	for (n = 1; n < MAXBACKTRACE; n++) {
 		l = _stp_stack_user_get(c, n);
 		if (l == 0) break; // No user space fallback available
@@ -676,6 +877,8 @@ static void _stp_stack_user_print(struct context *c, int sym_flags)
 #endif
 }
 
+#endif /* STP_NEED_USER_UNWIND_DATA */
+
 /** Writes stack backtrace to a string
  *
  * @param str string
@@ -709,6 +912,7 @@ static void _stp_stack_kernel_sprint(char *str, int size, struct context* c,
 	_stp_print_unlock_irqrestore(&flags);
 }
 
+#ifdef STP_NEED_USER_UNWIND_DATA
 static void _stp_stack_user_sprint(char *str, int size, struct context* c,
 				   int sym_flags)
 {
@@ -735,5 +939,14 @@ static void _stp_stack_user_sprint(char *str, int size, struct context* c,
 	log->len = 0;
 	_stp_print_unlock_irqrestore(&flags);
 }
+#endif /* STP_NEED_USER_UNWIND_DATA */
+
+/* The stack id tapset asks for these; they need the context. */
+#ifdef STP_NEED_STACK_IDS
+#include "stack_ids.c"
+#endif
+#ifdef STP_NEED_ASYNC_USTACKS
+#include "stack_async.c"
+#endif
 
 #endif /* _STACK_C_ */
@@ -0,0 +1,186 @@
+/*  -*- linux-c -*-
+ * Deferred user stacks
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STACK_ASYNC_C_
+#define _STACK_ASYNC_C_
+
+/** @file stack_async.c
+ * @brief Deferred User Stacks
+ *
+ * Probes that interrupt a task, such as timer.profile or perf ones,
+ * can't fault in the user stack, so their user backtraces often stop
+ * short.  A deferred user stack only saves the user registers in the
+ * probe, and walks the stack from a task worker, which runs in the
+ * task just before it returns to user space.  That first faults the
+ * top of the stack in, then enters the stack into the user stack id
+ * table of stack_ids.c.  Each capture is named by a sample number,
+ * which the stack id can be looked up by once the worker ran.
+ */
+
+/* Number of captures in flight or looked up, a power of two. */
+#ifndef STP_ASYNC_USTACKS
+#define STP_ASYNC_USTACKS 256
+#endif
+#if STP_ASYNC_USTACKS & (STP_ASYNC_USTACKS - 1)
+#error "STP_ASYNC_USTACKS must be a power of two"
+#endif
+
+/* Task workers come with the task finder, without kernel utrace. */
+#if defined(HAVE_TASK_FINDER) && !defined(CONFIG_UTRACE)
+#define STP_ASYNC_USTACK_WORKER
+#endif
+
+enum { _stp_async_ustack_free, _stp_async_ustack_pending,
+       _stp_async_ustack_done };
+
+struct _stp_async_ustack {
+	atomic_t state;
+	int64_t sample;
+	int64_t id;		/* user stack id, when done */
+	struct pt_regs regs;	/* user registers of the sample */
+};
+
+static struct _stp_async_ustack _stp_async_ustacks[STP_ASYNC_USTACKS];
+static atomic_t _stp_async_ustack_samples = ATOMIC_INIT(0);
+
+static void _stp_async_ustack_done(struct _stp_async_ustack *a, int64_t id)
+{
+	a->id = id;
+	smp_wmb();
+	atomic_set(&a->state, _stp_async_ustack_done);
+}
+
+#ifdef STP_ASYNC_USTACK_WORKER
+/* Touch each page of the top of the user stack, so that walking it
+ * with page faults disabled finds them in.  This may sleep. */
+static void _stp_async_ustack_prefault(unsigned long sp)
+{
+	unsigned long addr, end = sp + max_t(unsigned long, STP_STACK_WINDOW,
+					     PAGE_SIZE);
+	char b;
+
+	for (addr = sp; addr < end; addr = (addr & PAGE_MASK) + PAGE_SIZE)
+		if (get_user(b, (const char __user *) addr))
+			break;
+}
+
+static void _stp_async_ustack_worker(struct task_work *work)
+{
+	struct __stp_tf_task_work *tf_work =
+		container_of(work, struct __stp_tf_task_work, work);
+	struct _stp_async_ustack *a = tf_work->data;
+	struct context *c;
+	int64_t id = 0;
+
+	might_sleep();
+	if (atomic_read(&__stp_task_finder_state) != __STP_TF_RUNNING
+	    || (current->flags & PF_EXITING) || current->mm == NULL) {
+		_stp_async_ustack_done(a, 0);
+		return;
+	}
+	_stp_async_ustack_prefault(REG_SP(&a->regs));
+
+	preempt_disable();
+	c = _stp_runtime_entryfn_get_context();
+	if (c != NULL) {
+		/* Only what the user unwinder looks at. */
+		c->probe_point = "ustack_async";
+		c->probe_type = stp_probe_type_been;
+		c->kregs = NULL;
+		c->uregs = &a->regs;
+		c->user_mode_p = 1;
+		c->full_uregs_p = 1;
+		c->uwcache_user.state = uwcache_uninitialized;
+		id = _stp_stack_user_id(c);
+		c->uregs = NULL;
+	}
+	_stp_runtime_entryfn_put_context(c);
+	preempt_enable();
+
+	_stp_async_ustack_done(a, id);
+}
+
+/* Save the user registers in a and have a task worker do the rest.
+ * Returns 0, or nonzero if the stack has to be walked right away. */
+static int _stp_async_ustack_queue(struct context *c,
+				   struct _stp_async_ustack *a)
+{
+	struct pt_regs *regs = _stp_get_uregs(c);
+	struct task_work *work;
+
+	if (in_nmi() || regs == NULL || !c->full_uregs_p
+	    || (current->flags & PF_EXITING))
+		return -EINVAL;
+	a->regs = *regs;
+	work = __stp_tf_alloc_task_work(a);
+	if (work == NULL)
+		return -ENOMEM;
+	__stp_tf_init_task_work(work, &_stp_async_ustack_worker);
+	if (__stp_tf_task_work_add(current, work)) {
+		__stp_tf_task_work_free(work);
+		return -ESRCH;
+	}
+	return 0;
+}
+#endif /* STP_ASYNC_USTACK_WORKER */
+
+/** Captures the current user stack for later, see ustack_async().
+ * Returns its sample number, or 0 if all the slots are in flight.
+ * Without task workers, or in NMI context, the stack is walked right
+ * away instead.
+ */
+static int64_t _stp_async_ustack_capture(struct context *c)
+{
+	struct _stp_async_ustack *a;
+	int64_t sample;
+	int state;
+
+	if (! current->mm)
+		return 0;
+	sample = (unsigned) atomic_inc_return(&_stp_async_ustack_samples);
+	if (sample == 0)
+		sample = (unsigned) atomic_inc_return(&_stp_async_ustack_samples);
+	a = &_stp_async_ustacks[(sample - 1) & (STP_ASYNC_USTACKS - 1)];
+	state = atomic_read(&a->state);
+	if (state == _stp_async_ustack_pending
+	    || atomic_cmpxchg(&a->state, state, _stp_async_ustack_pending)
+	       != state)
+		return 0;
+	a->sample = sample;
+	smp_wmb();
+
+#ifdef STP_ASYNC_USTACK_WORKER
+	if (_stp_async_ustack_queue(c, a) == 0)
+		return sample;
+#endif
+	_stp_async_ustack_done(a, _stp_stack_user_id(c));
+	return sample;
+}
+
+/** Returns the user stack id of a sample, 0 while its stack is not
+ * walked yet, or if it could not be, or was long overwritten.
+ */
+static int64_t _stp_async_ustack_id(int64_t sample)
+{
+	struct _stp_async_ustack *a;
+	int64_t id;
+
+	if (sample < 1)
+		return 0;
+	a = &_stp_async_ustacks[(sample - 1) & (STP_ASYNC_USTACKS - 1)];
+	if (atomic_read(&a->state) != _stp_async_ustack_done)
+		return 0;
+	smp_rmb();
+	id = a->id;
+	smp_rmb();
+	return a->sample == sample ? id : 0;
+}
+
+#endif /* _STACK_ASYNC_C_ */
@@ -0,0 +1,286 @@
+/*  -*- linux-c -*-
+ * Stack id tables
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+
+#ifndef _STACK_IDS_C_
+#define _STACK_IDS_C_
+
+/** @file stack_ids.c
+ * @brief Stack Id Tables
+ *
+ * Each distinct backtrace is stored once, and is named by a small
+ * integer id, so that scripts aggregating by stack key their arrays
+ * on the id instead of on the backtrace string.  The stacks are only
+ * symbolized when the ids are printed.  Kernel and user stacks have
+ * separate tables, and ids.
+ */
+
+#include <linux/jhash.h>
+
+/* Number of distinct stacks each table holds, a power of two. */
+#ifndef STP_STACK_IDS
+#define STP_STACK_IDS 1024
+#endif
+#if STP_STACK_IDS & (STP_STACK_IDS - 1)
+#error "STP_STACK_IDS must be a power of two"
+#endif
+
+/* How many slots are tried before a table counts as full. */
+#define STP_STACK_ID_PROBES 32
+
+enum { _stp_stack_id_free, _stp_stack_id_busy, _stp_stack_id_ready };
+
+struct _stp_stack_id {
+	atomic_t state;
+	u32 hash;
+	unsigned depth;
+	unsigned long pc[MAXBACKTRACE];
+};
+
+/* User stacks also remember the process, whose addresses they are, and
+   where they fall in its modules, which is what they are printed by,
+   as the process may be gone by then. */
+struct _stp_ustack_id {
+	struct _stp_stack_id s;
+	pid_t tgid;
+	struct _stp_module *mod[MAXBACKTRACE];
+	unsigned long rel[MAXBACKTRACE];
+};
+
+static struct _stp_stack_id _stp_kstack_ids[STP_STACK_IDS];
+static struct _stp_ustack_id _stp_ustack_ids[STP_STACK_IDS];
+
+/* Find the slot of the stack of depth pcs, or claim a free one for
+ * it, which the caller then fills in and marks ready.  Sets *found
+ * if it was already there.  A slot another cpu is still filling is
+ * passed over, which may rarely give the same stack two ids.  Returns
+ * -1 if the table is full. */
+static int _stp_stack_id_slot(struct _stp_stack_id *s, size_t stride,
+			      const unsigned long *pc, unsigned depth,
+			      u32 hash, pid_t tgid, int *found)
+{
+	unsigned i, idx;
+
+	for (i = 0; i < STP_STACK_ID_PROBES; i++) {
+		struct _stp_stack_id *e;
+
+		idx = (hash + i) & (STP_STACK_IDS - 1);
+		e = (struct _stp_stack_id *) ((char *) s + idx * stride);
+		switch (atomic_read(&e->state)) {
+		case _stp_stack_id_ready:
+			smp_rmb();
+			if (e->hash == hash && e->depth == depth
+			    && (tgid == 0 || ((struct _stp_ustack_id *) e)->tgid == tgid)
+			    && memcmp(e->pc, pc, depth * sizeof(*pc)) == 0) {
+				*found = 1;
+				return idx;
+			}
+			break;
+		case _stp_stack_id_free:
+			if (atomic_cmpxchg(&e->state, _stp_stack_id_free,
+					   _stp_stack_id_busy)
+			    == _stp_stack_id_free) {
+				e->hash = hash;
+				e->depth = depth;
+				memcpy(e->pc, pc, depth * sizeof(*pc));
+				*found = 0;
+				return idx;
+			}
+			break;
+		}
+	}
+	return -1;
+}
+
+/* Finds the frames of the current kernel stack the way
+ * _stp_stack_kernel_print() prints them: the current address, the
+ * callers up to the first 0 and, where the dwarf unwinder gives out,
+ * those the kernel's own unwinder finds beyond.  Returns how many, 0
+ * without kernel registers, and points *pcs at them. */
+static unsigned _stp_stack_kernel_frames(struct context *c,
+					 unsigned long **pcs)
+{
+	unsigned n;
+
+	*pcs = c->uwcache_kernel.pc;
+	if (!c->kregs)
+		return 0;
+
+	/* This leaves the stack in the unwind cache. */
+	_stp_stack_kernel_get(c, 0);
+	for (n = 1; n < MAXBACKTRACE; n++)
+		if (_stp_stack_kernel_get(c, n) == 0)
+			break;
+
+#if defined(STP_USE_DWARF_UNWINDER) && !defined(STP_UNWIND_KERNEL_NATIVE) \
+    && !defined(STAPCONF_KERNEL_STACKTRACE) \
+    && !defined(STAPCONF_KERNEL_STACKTRACE_NO_BP)
+	if (n < MAXBACKTRACE) {
+		unsigned long *entries = c->kern_bt_entries;
+		int i, k;
+
+		k = _stp_stack_kernel_save_regs(&c->uwcontext_kernel.info.regs,
+						entries, MAXBACKTRACE - n, 0);
+		for (i = 0; i < k && entries[i] != ULONG_MAX; i++)
+			;
+		if (i > 0) {
+			memmove(entries + n, entries, i * sizeof(*entries));
+			memcpy(entries, c->uwcache_kernel.pc, n * sizeof(*entries));
+			*pcs = entries;
+			n += i;
+		}
+	}
+#endif
+	return n;
+}
+
+/** Returns the id of the current kernel stack, 0 if the table is
+ * full or there is no stack.
+ */
+static int64_t _stp_stack_kernel_id(struct context *c)
+{
+	unsigned long *pc;
+	unsigned depth;
+	int idx, found;
+
+	depth = _stp_stack_kernel_frames(c, &pc);
+	if (depth == 0)
+		return 0;
+
+	idx = _stp_stack_id_slot(_stp_kstack_ids, sizeof(_stp_kstack_ids[0]),
+				 pc, depth, jhash(pc, depth * sizeof(*pc), 0),
+				 0, &found);
+	if (idx < 0)
+		return 0;
+	if (!found) {
+		smp_wmb();
+		atomic_set(&_stp_kstack_ids[idx].state, _stp_stack_id_ready);
+	}
+	return idx + 1;
+}
+
+#ifdef STP_NEED_USER_UNWIND_DATA
+/** Returns the id of the current user stack, 0 if the table is full
+ * or there is no stack.
+ */
+static int64_t _stp_stack_user_id(struct context *c)
+{
+	unsigned long *pc = c->uwcache_user.pc;
+	struct _stp_ustack_id *e;
+	unsigned depth, i;
+	int idx, found;
+
+	/* As _stp_stack_user_print() prints it: the current address,
+	   then the callers up to the first 0. */
+	if (!current->mm || !_stp_get_uregs(c))
+		return 0;
+	_stp_stack_user_get(c, 0);
+	for (depth = 1; depth < MAXBACKTRACE; depth++)
+		if (_stp_stack_user_get(c, depth) == 0)
+			break;
+
+	idx = _stp_stack_id_slot(&_stp_ustack_ids[0].s,
+				 sizeof(_stp_ustack_ids[0]), pc, depth,
+				 jhash(pc, depth * sizeof(*pc), current->tgid),
+				 current->tgid, &found);
+	if (idx < 0)
+		return 0;
+	e = &_stp_ustack_ids[idx];
+	if (!found) {
+		/* Only new stacks pay for the module lookups. */
+		e->tgid = current->tgid;
+		for (i = 0; i < depth; i++) {
+			unsigned long offset = 0, vm_start = 0;
+
+			e->mod[i] = _stp_umod_lookup(pc[i], current, NULL,
+						     &offset, &vm_start, NULL);
+			if (e->mod[i] && strcmp(".dynamic",
+						e->mod[i]->sections[0].name) == 0)
+				e->rel[i] = pc[i] - vm_start + offset;
+			else
+				e->rel[i] = pc[i];
+		}
+		smp_wmb();
+		atomic_set(&e->s.state, _stp_stack_id_ready);
+	}
+	return idx + 1;
+}
+#endif /* STP_NEED_USER_UNWIND_DATA */
+
+/* Prints, or writes to str when not NULL, one address of a user stack
+ * by its module, in the format of _stp_snprint_addr. */
+static int _stp_snprint_uaddr_id(char *str, size_t len, unsigned long pc,
+				 struct _stp_module *m, unsigned long rel,
+				 int sym_flags)
+{
+	const char *name = NULL, *modname;
+	unsigned long offset = 0, size = 0;
+
+	if (m == NULL)
+		return _stp_snprintf(str, len, "%p\n", (int64_t) pc);
+	name = _stp_section_symbol(&m->sections[0], rel, &size, &offset);
+	modname = m->path;
+	if (sym_flags & _STP_SYM_MODULE_BASENAME) {
+		const char *slash = strrchr(modname, '/');
+		if (slash)
+			modname = slash + 1;
+	}
+	if (name && name[0] == '.')
+		name++;
+	if (sym_flags == _STP_SYM_SIMPLE)
+		return (name
+			? _stp_snprintf(str, len, "%s+%#lx [%s]\n", name,
+					offset, modname)
+			: _stp_snprintf(str, len, "%p [%s+%#lx]\n",
+					(int64_t) pc, modname, rel));
+	return (name
+		? _stp_snprintf(str, len, " %p : %s+%#lx/%#lx [%s]\n",
+				(int64_t) pc, name, offset, size, modname)
+		: _stp_snprintf(str, len, " %p [%s+%#lx]\n", (int64_t) pc,
+				modname, rel));
+}
+
+/** Prints the stack of an id, or writes it to str when not NULL.
+ * @param user Whether it is a user stack id.
+ * @param sym_flags _STP_SYM_FULL or _STP_SYM_SIMPLE
+ */
+static void _stp_stack_id_snprint(char *str, size_t len, int64_t id,
+				  int user, int sym_flags)
+{
+	struct _stp_stack_id *e;
+	unsigned i;
+	size_t n = 0;
+
+	if (str && len)
+		*str = '\0';
+	if (id < 1 || id > STP_STACK_IDS)
+		return;
+	e = user ? &_stp_ustack_ids[id - 1].s : &_stp_kstack_ids[id - 1];
+	if (atomic_read(&e->state) != _stp_stack_id_ready)
+		return;
+	smp_rmb();
+
+	for (i = 0; i < e->depth; i++) {
+		char *s = str ? str + n : NULL;
+		size_t l = str ? len - n : 0;
+		int r;
+
+		if (user) {
+			struct _stp_ustack_id *u = (struct _stp_ustack_id *) e;
+			r = _stp_snprint_uaddr_id(s, l, e->pc[i], u->mod[i],
+						  u->rel[i], sym_flags);
+		} else
+			r = _stp_snprint_addr(s, l, e->pc[i], sym_flags, NULL);
+		if (str && (r < 0 || (size_t) r >= l))
+			break;
+		n += r;
+	}
+}
+
+#endif /* _STACK_IDS_C_ */
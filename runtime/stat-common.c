@@ -34,6 +34,26 @@ static int _stp_stat_calc_buckets(int stop, int start, int interval)
 	return buckets;
 }
 
+/* Returns the number of buckets of a HIST_HDR or HIST_HLL histogram
+ * with the given bits, or 0 if these are out of range. */
+static int _stp_stat_calc_bits_buckets(int htype, int bits)
+{
+	if (htype == HIST_HLL) {
+		if (bits < HIST_HLL_MIN_BITS || bits > HIST_HLL_MAX_BITS) {
+			_stp_warn("distinct: sketch precision must be between %d and %d bits\n",
+				  HIST_HLL_MIN_BITS, HIST_HLL_MAX_BITS);
+			return 0;
+		}
+		return HIST_HLL_BUCKETS(bits);
+	}
+	if (bits < 1 || bits > HIST_HDR_MAX_BITS) {
+		_stp_warn("histogram: hdr precision must be between 1 and %d bits\n",
+			  HIST_HDR_MAX_BITS);
+		return 0;
+	}
+	return HIST_HDR_BUCKETS(bits);
+}
+
 static int needed_space(int64_t v)
 {
 	int space = 0;
@@ -123,6 +143,202 @@ static int _stp_val_to_bucket(int64_t val)
 	return res;
 }
 
+/* Returns the bucket of a log-linear (hdr) histogram for a value.
+ * Bucket 0 counts values below zero.  Values below 2^(bits+1) get a
+ * bucket each, and above that every power of two is split into 2^bits
+ * equal buckets.
+ */
+static inline int _stp_val_to_hdr_bucket(int64_t val, int bits)
+{
+	int e;
+
+	if (val < 0)
+		return 0;
+	if (val < (1LL << bits))
+		return val + 1;
+
+	e = 63 - __builtin_clzll((uint64_t) val);
+	return ((e - bits + 1) << bits) + (int) (val >> (e - bits)) - (1 << bits) + 1;
+}
+
+/* Given a bucket number for a hdr histogram, return the lowest value
+ * it counts. */
+static int64_t _stp_hdr_bucket_to_val(int num, int bits)
+{
+	int shift;
+
+	if (num-- <= 0)
+		return 0;
+	shift = (num >> bits) - 1;
+	if (shift <= 0)
+		return num;
+	return (int64_t) ((1 << bits) + (num & ((1 << bits) - 1))) << shift;
+}
+
+/* Given a bucket number for a hdr histogram, return how many values
+ * it counts. */
+static inline int64_t _stp_hdr_bucket_width(int num, int bits)
+{
+	int shift = ((num - 1) >> bits) - 1;
+
+	return (num <= 0 || shift <= 0) ? 1 : 1LL << shift;
+}
+
+/* Returns the num/den quantile of a hdr histogram, e.g. 99/100 for
+ * the 99th percentile: the value of the sample at rank ceil(count *
+ * num / den), estimated as the middle of its bucket and bounded by the
+ * min and max actually seen.  The stat must not be empty.
+ */
+static int64_t _stp_stat_quantile(Hist st, stat_data *sd, int64_t num,
+				  int64_t den)
+{
+	int64_t rank, seen = 0, val;
+	int i;
+
+	if (st->type != HIST_HDR || den <= 0 || sd->count == 0)
+		return 0;
+	if (num <= 0)
+		return sd->min;
+	if (num >= den)
+		return sd->max;
+
+	/* NB: count * num would overflow for large counts; split it. */
+	rank = _stp_div64(NULL, sd->count, den) * num
+		+ _stp_div64(NULL, _stp_mod64(NULL, sd->count, den) * num + den - 1, den);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < st->buckets - 1; i++) {
+		seen += sd->histogram[i];
+		if (seen >= rank)
+			break;
+	}
+	if (i == 0)
+		return sd->min;
+	val = _stp_hdr_bucket_to_val(i, st->bits)
+		+ (_stp_hdr_bucket_width(i, st->bits) >> 1);
+	if (val < sd->min)
+		val = sd->min;
+	if (val > sd->max)
+		val = sd->max;
+	return val;
+}
+
+/* Mixes a value into a 64-bit hash (splitmix64), for the HyperLogLog
+ * sketch.  This is a bijection, so distinct values never collide. */
+static inline uint64_t _stp_hll_hash(int64_t val)
+{
+	uint64_t z = (uint64_t) val + 0x9e3779b97f4a7c15ULL;
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Adds a value to a HyperLogLog sketch: the top bits of its hash pick
+ * a register, which keeps the longest run of leading zeros (plus one)
+ * seen in the rest of the hashes it was picked by. */
+static inline void _stp_hll_add(Hist st, stat_data *sd, int64_t val)
+{
+	uint8_t *regs = (uint8_t *) sd->histogram;
+	uint64_t h = _stp_hll_hash(val);
+	unsigned j = h >> (64 - st->bits);
+	/* NB: the or'ed bit bounds the rank, and keeps clzll defined. */
+	uint8_t rank = __builtin_clzll((h << st->bits)
+				       | (1ULL << (st->bits - 1))) + 1;
+
+	if (rank > regs[j])
+		regs[j] = rank;
+}
+
+/* Merges the histogram of sd into that of agg.  HyperLogLog registers
+ * merge by keeping the larger of each, bucket counts by adding up. */
+static void _stp_stat_merge_histogram(Hist st, stat_data *agg, stat_data *sd)
+{
+	int j;
+
+	if (st->type == HIST_HLL) {
+		uint8_t *aregs = (uint8_t *) agg->histogram;
+		uint8_t *regs = (uint8_t *) sd->histogram;
+		for (j = 0; j < (1 << st->bits); j++)
+			if (regs[j] > aregs[j])
+				aregs[j] = regs[j];
+		return;
+	}
+	for (j = 0; j < st->buckets; j++)
+		agg->histogram[j] += sd->histogram[j];
+}
+
+/* Returns log2(x) for x > 0, as a fixed-point number with 24
+ * fractional bits, by repeated squaring of the mantissa. */
+static int64_t _stp_log2_q24(uint64_t x)
+{
+	int e = 63 - __builtin_clzll(x), i;
+	int64_t res = (int64_t) e << 24;
+	uint64_t y = e >= 31 ? x >> (e - 31) : x << (31 - e);
+
+	/* y is the mantissa, in [1, 2) with 31 fractional bits */
+	for (i = 23; i >= 0; i--) {
+		y = (y * y) >> 31;
+		if (y >= (1ULL << 32)) {
+			y >>= 1;
+			res |= 1LL << i;
+		}
+	}
+	return res;
+}
+
+/* Returns the number of distinct values added to a HyperLogLog sketch,
+ * estimated from the harmonic mean of its registers as in Flajolet et
+ * al., with linear counting of the empty registers for small counts.
+ * This is all integer arithmetic, and the stat must not be empty.
+ */
+static int64_t _stp_stat_distinct(Hist st, stat_data *sd)
+{
+	uint8_t *regs = (uint8_t *) sd->histogram;
+	int k = 62 - st->bits, j, t, zs, e;
+	uint64_t m = 1ULL << st->bits, z = 0, a, q;
+	unsigned zeros = 0;
+
+	if (st->type != HIST_HLL || sd->count == 0)
+		return 0;
+
+	/* z is the sum of 2^-regs[j], with k fractional bits; registers
+	 * above k add too little to matter. */
+	for (j = 0; j < m; j++) {
+		if (regs[j] == 0)
+			zeros++;
+		if (regs[j] <= k)
+			z += 1ULL << (k - regs[j]);
+	}
+	if (z == 0)
+		z = 1;
+
+	/* a is alpha * m^2, alpha with 16 fractional bits */
+	switch (st->bits) {
+	case 4: a = 44106; break;
+	case 5: a = 45679; break;
+	case 6: a = 46466; break;
+	default: a = _stp_div64(NULL, 47274 * m * 1000, m * 1000 + 1079); break;
+	}
+	a *= m * m;
+
+	/* q = a / z, normalized so that the division keeps 31 bits or so */
+	t = 62 - (64 - __builtin_clzll(a));
+	zs = 64 - __builtin_clzll(z) - 31;
+	if (zs < 0)
+		zs = 0;
+	q = _stp_div64(NULL, a << t, z >> zs);
+	e = k - t - zs - 16;
+	q = e >= 0 ? q << e : q >> -e;
+
+	/* linear counting, m * ln(m / zeros), with ln 2 in 16 bits */
+	if (q <= 5 * m / 2 && zeros)
+		q = (m * (uint64_t) (_stp_log2_q24(m) - _stp_log2_q24(zeros))
+		     * 45426 + (1ULL << 39)) >> 40;
+	return q;
+}
+
 #ifndef HIST_WIDTH
 #define HIST_WIDTH 50
 #endif
@@ -146,7 +362,8 @@ static void _stp_stat_print_histogram_buf(char *buf, size_t size, Hist st,
 #define HIST_PRINTF(fmt, args...) \
 	(*bufptr += _stp_snprintf(cur_buf, buf + size - cur_buf, fmt, ## args))
 
-	if (st->type != HIST_LOG && st->type != HIST_LINEAR)
+	if (st->type != HIST_LOG && st->type != HIST_LINEAR
+	    && st->type != HIST_HDR)
 		return;
 
 	/* Get the maximum value, for scaling. Also calculate the low
@@ -185,6 +402,12 @@ static void _stp_stat_print_histogram_buf(char *buf, size_t size, Hist st,
 			under = 1;
 		if (high_bucket == st->buckets-1)
 			over = 1;
+	} else if (st->type == HIST_HDR) {
+		/* Don't include underflow if it is 0. */
+		if (low_bucket == 0 && sd->histogram[0] == 0)
+			low_bucket++;
+		if (low_bucket == 0)
+			under = 1;
 	}
 
 	if (valmax <= HIST_WIDTH)
@@ -203,6 +426,9 @@ static void _stp_stat_print_histogram_buf(char *buf, size_t size, Hist st,
 	if (st->type == HIST_LINEAR) {
 		val_space = max(needed_space(st->start) + under,
 				needed_space(st->start +  st->interval * high_bucket) + over);
+	} else if (st->type == HIST_HDR) {
+		val_space = max(needed_space(_stp_hdr_bucket_to_val(low_bucket, st->bits)) + under,
+				needed_space(_stp_hdr_bucket_to_val(high_bucket, st->bits)));
 	} else {
 		val_space = max(needed_space(_stp_bucket_to_val(high_bucket)),
 				needed_space(_stp_bucket_to_val(low_bucket)));
@@ -265,6 +491,11 @@ static void _stp_stat_print_histogram_buf(char *buf, size_t size, Hist st,
 				val_prefix = ">";
 			} else
 				val = st->start + (int64_t)(i - 1) * st->interval;
+		} else if (st->type == HIST_HDR) {
+			val = _stp_hdr_bucket_to_val(i, st->bits);
+			if (i == 0)
+				/* underflow */
+				val_prefix = "<";
 		} else
 			val = _stp_bucket_to_val(i);
 
@@ -295,13 +526,18 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 	int n;
 	int delta = 0;
 
-	sd->shift = st->bit_shift;
-	sd->stat_ops = st->stat_ops;
+	/* NB: the stat_op_* are constants at each call site, so once
+	 * this is inlined, only the fields some extractor reads are
+	 * kept up to date. */
 	if (sd->count == 0) {
+		sd->shift = st->bit_shift;
+		sd->stat_ops = st->stat_ops;
 		sd->count = 1;
 		sd->sum = sd->min = sd->max = val;
-		sd->avg_s = val << sd->shift;
-		sd->_M2 = 0;
+		if (stat_op_variance) {
+			sd->avg_s = val << sd->shift;
+			sd->_M2 = 0;
+		}
 	} else {
 		if(stat_op_count)
 			sd->count++;
@@ -349,6 +585,13 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 			val = st->buckets - 1;
 
 		sd->histogram[val]++;
+		break;
+	case HIST_HDR:
+		sd->histogram[_stp_val_to_hdr_bucket(val, st->bits)]++;
+		break;
+	case HIST_HLL:
+		_stp_hll_add(st, sd, val);
+		break;
 	default:
 		break;
 	}
@@ -27,7 +27,8 @@
  * accuracy of the integer arithmetics.
  *
  * Histograms are optional. If you want a histogram, you must set "type"
- * to HIST_LOG or HIST_LINEAR when you call _stp_stat_init().
+ * to HIST_LOG, HIST_LINEAR, HIST_HDR or HIST_HLL when you call
+ * _stp_stat_init().
  *
  * @{
  */
@@ -48,11 +49,17 @@
  * @param stop - An integer. The stopping value. Should be > start.
  * @param interval - An integer. The interval.
  *
+ * For HIST_HDR, the following additional parameter is required:
+ * @param bits - An integer. Each power of two is split into 2^bits buckets.
+ *
+ * For HIST_HLL, the following additional parameter is required:
+ * @param bits - An integer. The sketch has 2^bits registers.
+ *
  * @param stat_ops (STAT_OP_* and associated parameter bit_shift for STAT_OP_VARIANCE)
  */
 static Stat _stp_stat_init (int first_arg, ...)
 {
-	int size, buckets=0, start=0, stop=0, interval=0, bit_shift=0;
+	int size, buckets=0, start=0, stop=0, interval=0, bits=0, bit_shift=0;
 	int stat_ops=0, htype=0;
 	int arg = first_arg;
 	Stat st;
@@ -76,6 +83,15 @@ static Stat _stp_stat_init (int first_arg, ...)
 			}
 			if (htype == HIST_LOG)
 				buckets = HIST_LOG_BUCKETS;
+			if (htype == HIST_HDR || htype == HIST_HLL) {
+				bits = va_arg(ap, int);
+
+				buckets = _stp_stat_calc_bits_buckets(htype, bits);
+				if (!buckets) {
+					va_end (ap);
+					return NULL;
+				}
+			}
                         break;
 		case STAT_OP_COUNT:
 			stat_ops |= STAT_OP_COUNT;
@@ -112,6 +128,7 @@ static Stat _stp_stat_init (int first_arg, ...)
 	st->hist.start = start;
 	st->hist.stop = stop;
 	st->hist.interval = interval;
+	st->hist.bits = bits;
 	st->hist.buckets = buckets;
 	st->hist.bit_shift = bit_shift;
 	st->hist.stat_ops = stat_ops;
@@ -201,10 +218,8 @@ static stat_data *_stp_stat_get (Stat st, int clear)
 				agg->max = sd->max;
 			if (sd->min < agg->min)
 				agg->min = sd->min;
-			if (st->hist.type != HIST_NONE) {
-				for (j = 0; j < st->hist.buckets; j++)
-					agg->histogram[j] += sd->histogram[j];
-			}
+			if (st->hist.type != HIST_NONE)
+				_stp_stat_merge_histogram(&st->hist, agg, sd);
 		}
 		STAT_UNLOCK(sd);
 	}
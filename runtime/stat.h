@@ -20,6 +20,37 @@
 #define HIST_LOG_BUCKETS 128
 #define HIST_LOG_BUCKET0 64
 
+/* buckets for log-linear (hdr) histogram: an underflow bucket
+   for values below zero, then 2^bits buckets for each power of two. */
+#define HIST_HDR_MAX_BITS 8
+#define HIST_HDR_BUCKETS(bits) (((64 - (bits)) << (bits)) + 1)
+
+/* sub-bucket bits of the hdr histogram behind @quantile.  Each bucket
+   spans at most 1/2^STP_QUANTILE_BITS of its lower bound, so the
+   default of 4 keeps quantiles within about 3%. */
+#ifndef STP_QUANTILE_BITS
+#define STP_QUANTILE_BITS 4
+#endif
+#if STP_QUANTILE_BITS < 1 || STP_QUANTILE_BITS > HIST_HDR_MAX_BITS
+#error "STP_QUANTILE_BITS must be between 1 and 8"
+#endif
+
+/* registers of a HyperLogLog sketch: 2^bits of them, a byte each,
+   packed into the int64_t buckets of the histogram. */
+#define HIST_HLL_MIN_BITS 4
+#define HIST_HLL_MAX_BITS 16
+#define HIST_HLL_BUCKETS(bits) ((1 << (bits)) / 8)
+
+/* register bits of the HyperLogLog sketch behind @distinct.  Its
+   standard error is 1.04/sqrt(2^STP_DISTINCT_BITS), so the default
+   of 10 keeps counts within about 3%, for 1KB per cpu. */
+#ifndef STP_DISTINCT_BITS
+#define STP_DISTINCT_BITS 10
+#endif
+#if STP_DISTINCT_BITS < HIST_HLL_MIN_BITS || STP_DISTINCT_BITS > HIST_HLL_MAX_BITS
+#error "STP_DISTINCT_BITS must be between 4 and 16"
+#endif
+
 /* statistical operations used with a global */
 #define STAT_OP_COUNT     1 << 1
 #define STAT_OP_SUM       1 << 2
@@ -33,9 +64,11 @@
 #define KEY_MAPENTRIES    1 << 7
 #define KEY_STAT_WRAP     1 << 8
 #define KEY_HIST_TYPE     1 << 9
+#define KEY_STAT_TOPK     1 << 10
+#define KEY_MAP_STRIPED   1 << 11
 
 /** histogram type */
-enum histtype { HIST_NONE, HIST_LOG, HIST_LINEAR };
+enum histtype { HIST_NONE, HIST_LOG, HIST_LINEAR, HIST_HDR, HIST_HLL };
 
 /** Statistics are stored in this struct.  This is per-cpu or per-node data 
     and is variable length due to the unknown size of the histogram. */
@@ -61,6 +94,7 @@ struct _Hist {
 	int start;
 	int stop;
 	int interval;
+	int bits;
 	int buckets;
 	int bit_shift;
 	int stat_ops;
@@ -30,6 +30,7 @@ static inline void stp_spin_unlock(raw_spinlock_t *lock)	{ raw_spin_unlock(lock)
 
 #define stp_spin_lock_irqsave(lock, flags)		raw_spin_lock_irqsave(lock, flags)
 #define stp_spin_unlock_irqrestore(lock, flags)		raw_spin_unlock_irqrestore(lock, flags)
+#define stp_spin_trylock_irqsave(lock, flags)		raw_spin_trylock_irqsave(lock, flags)
 
 #define stp_rwlock_t raw_spinlock_t
 
@@ -63,6 +64,7 @@ static inline void stp_spin_unlock(spinlock_t *lock)		{ spin_unlock(lock); }
 
 #define stp_spin_lock_irqsave(lock, flags)		spin_lock_irqsave(lock, flags)
 #define stp_spin_unlock_irqrestore(lock, flags)		spin_unlock_irqrestore(lock, flags)
+#define stp_spin_trylock_irqsave(lock, flags)		spin_trylock_irqsave(lock, flags)
 
 #define stp_rwlock_t rwlock_t
 
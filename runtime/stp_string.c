@@ -49,6 +49,27 @@ static int _stp_vscnprintf(char *buf, size_t size, const char *fmt, va_list args
 	return (i >= size) ? (size - 1) : i;
 }
 
+/** Append to a script string of known length.
+ * Like strlcat() into a MAXSTRINGLEN buffer, but without scanning
+ * @dst for its end first, so a chain of appends (as in a . b . c)
+ * copies each byte only once.
+ *
+ * @param dst The string to append to.
+ * @param len The current length of @dst.
+ * @param src The string to append.
+ *
+ * @return The new length of @dst.
+ */
+static inline size_t _stp_string_append(char *dst, size_t len, const char *src)
+{
+	size_t n;
+
+	if (len >= MAXSTRINGLEN - 1)
+		return len;
+	n = strlcpy(dst + len, src, MAXSTRINGLEN - len);
+	return (n >= MAXSTRINGLEN - len) ? (MAXSTRINGLEN - 1) : (len + n);
+}
+
 
 /**
  * Decode a UTF-8 sequence into its codepoint.
@@ -134,17 +134,27 @@ struct utrace {
 	struct task_work report_work;
 };
 
+/*
+ * The table is sized in utrace_init() for twice the threads there are
+ * then, between 2^TASK_UTRACE_HASH_BITS and 2^TASK_UTRACE_HASH_BITS_MAX
+ * buckets, so that the chains stay short on big hosts too.  Lookups
+ * only take the RCU read lock; the bucket locks serialize updates.
+ */
 #ifndef TASK_UTRACE_HASH_BITS
 #define TASK_UTRACE_HASH_BITS 8
 #endif
-#define TASK_UTRACE_TABLE_SIZE (1 << TASK_UTRACE_HASH_BITS)
+#ifndef TASK_UTRACE_HASH_BITS_MAX
+#define TASK_UTRACE_HASH_BITS_MAX 16
+#endif
+#define TASK_UTRACE_TABLE_SIZE (1U << task_utrace_hash_bits)
 
 struct utrace_bucket {
 	struct hlist_head head;
 	stp_spinlock_t lock;
 };
 
-static struct utrace_bucket task_utrace_table[TASK_UTRACE_TABLE_SIZE];
+static struct utrace_bucket *task_utrace_table;
+static unsigned task_utrace_hash_bits = TASK_UTRACE_HASH_BITS;
 
 /* Tracepoint reporting is delayed using task_work structures stored
    in the following linked list: */
@@ -354,6 +364,24 @@ stp_signal_wake_up(struct task_struct *t, bool resume)
 }
 
 
+/* Pick the table size for the number of threads running now. */
+static unsigned utrace_hash_bits(void)
+{
+	struct task_struct *grp, *tsk;
+	unsigned long threads = 0;
+	unsigned bits = TASK_UTRACE_HASH_BITS;
+
+	rcu_read_lock();
+	do_each_thread(grp, tsk) {
+		threads++;
+	} while_each_thread(grp, tsk);
+	rcu_read_unlock();
+
+	while (bits < TASK_UTRACE_HASH_BITS_MAX && (1UL << bits) < 2 * threads)
+		bits++;
+	return bits;
+}
+
 static int utrace_init(void)
 {
 	int i;
@@ -362,6 +390,14 @@ static int utrace_init(void)
 	if (unlikely(stp_task_work_init() != 0))
 		goto error;
 
+	task_utrace_hash_bits = utrace_hash_bits();
+	task_utrace_table = _stp_vzalloc(TASK_UTRACE_TABLE_SIZE
+					 * sizeof(struct utrace_bucket));
+	if (unlikely(task_utrace_table == NULL)) {
+		rc = -ENOMEM;
+		goto error;
+	}
+
 	/* initialize the list heads */
 	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
 		struct utrace_bucket *bucket = &task_utrace_table[i];
@@ -447,6 +483,8 @@ error2:
 	STP_TRACE_UNREGISTER(sched_process_fork, utrace_report_clone);
 	tracepoint_synchronize_unregister();
 error:
+	_stp_vfree(task_utrace_table);
+	task_utrace_table = NULL;
 	return rc;
 }
 
@@ -479,7 +517,7 @@ static int utrace_exit(void)
 #ifdef STP_TF_DEBUG
 	printk(KERN_ERR "%s:%d - freeing task-specific\n", __FUNCTION__, __LINE__);
 #endif
-	for (i = 0; i < TASK_UTRACE_TABLE_SIZE; i++) {
+	for (i = 0; task_utrace_table && i < TASK_UTRACE_TABLE_SIZE; i++) {
 		struct utrace_bucket *bucket = &task_utrace_table[i];
 
 		rcu_read_lock();
@@ -490,6 +528,11 @@ static int utrace_exit(void)
 		rcu_read_unlock();
 	}
 
+	/* The utrace structs are all unhashed, and nobody looks them up
+	 * anymore, so the buckets can go. */
+	_stp_vfree(task_utrace_table);
+	task_utrace_table = NULL;
+
 	/* Likewise, free any task_work_list item(s). */
 	stp_spin_lock_irqsave(&__stp_utrace_task_work_list_lock, flags);
 	list_for_each_entry_safe(task_node, task_node2, &__stp_utrace_task_work_list, list) {
@@ -664,7 +707,7 @@ static void utrace_shutdown(void)
 
 static struct utrace_bucket *find_utrace_bucket(struct task_struct *task)
 {
-	return &task_utrace_table[hash_ptr(task, TASK_UTRACE_HASH_BITS)];
+	return &task_utrace_table[hash_ptr(task, task_utrace_hash_bits)];
 }
 
 static struct utrace *get_utrace_struct(struct utrace_bucket *bucket,
@@ -686,6 +729,41 @@ static struct utrace *get_utrace_struct(struct utrace_bucket *bucket,
 	return found;
 }
 
+/*
+ * Like get_utrace_struct(), but only if @task has an engine that wants
+ * one of @events.  The flags are checked before taking the reference:
+ * the syscall tracepoints fire for every thread on the system, in every
+ * module that uses utrace, while most threads are attached only for
+ * clone/exec/death by the task finder.  Their refcount is then left
+ * alone, rather than bounced between cpus on each syscall by each of
+ * the modules.  A flag being set concurrently may be missed, as it may
+ * be anyway by a syscall already past its tracepoint.
+ */
+static struct utrace *get_utrace_struct_events(struct utrace_bucket *bucket,
+					       struct task_struct *task,
+					       unsigned int events)
+{
+	struct utrace *utrace, *found = NULL;
+	struct hlist_node *node;
+
+	rcu_read_lock();
+	stap_hlist_for_each_entry_rcu(utrace, node, &bucket->head, hlist) {
+		if (utrace->task == task) {
+			/* READ_ONCE() isn't available on all supported
+			 * kernels.  The struct stays around until the
+			 * rcu grace period is over. */
+			if ((*(volatile unsigned int *)&utrace->utrace_flags
+			     & events)
+			    && atomic_add_unless(&utrace->refcount, 1, 0))
+				found = utrace;
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return found;
+}
+
 /*
  * Set up @task.utrace for the first time.  We can have races
  * between two utrace_attach_task() calls here.  The task_lock()
@@ -2302,7 +2380,8 @@ static void utrace_report_syscall_entry(void *cb_data __attribute__ ((unused)),
 		return;
 
 	bucket = find_utrace_bucket(task);
-	utrace = get_utrace_struct(bucket, task);
+	utrace = get_utrace_struct_events(bucket, task,
+					   UTRACE_EVENT(SYSCALL_ENTRY)|ENGINE_STOP);
 
 	if (!utrace)
 		return;
@@ -2347,7 +2426,8 @@ put_utrace:
 		return;
 
 	bucket = find_utrace_bucket(task);
-	utrace = get_utrace_struct(bucket, task);
+	utrace = get_utrace_struct_events(bucket, task,
+					   UTRACE_EVENT(SYSCALL_ENTRY)|ENGINE_STOP);
 	if (!utrace)
 		return;
 
@@ -2420,7 +2500,8 @@ static void utrace_report_syscall_exit(void *cb_data __attribute__ ((unused)),
 		return;
 
 	bucket = find_utrace_bucket(task);
-	utrace = get_utrace_struct(bucket, task);
+	utrace = get_utrace_struct_events(bucket, task,
+					   UTRACE_EVENT(SYSCALL_EXIT)|ENGINE_STOP);
 	if (!utrace)
 		return;
 
@@ -2464,7 +2545,8 @@ put_utrace:
 		return;
 
 	bucket = find_utrace_bucket(task);
-	utrace = get_utrace_struct(bucket, task);
+	utrace = get_utrace_struct_events(bucket, task,
+					   UTRACE_EVENT(SYSCALL_EXIT)|ENGINE_STOP);
 	if (!utrace)
 		return;
 
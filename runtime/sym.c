@@ -15,9 +15,6 @@
 #include "sym.h"
 #include "vma.c"
 #include "stp_string.c"
-#ifdef STP_NEED_LINE_DATA
-#include "unwind/unwind.h"
-#endif
 #include <asm/unaligned.h>
 #include <asm/uaccess.h>
 #include <linux/list.h>
@@ -128,6 +125,54 @@ static struct _stp_module *_stp_kmod_sec_lookup(unsigned long addr,
   return NULL;
 }
 
+/* The states of _stp_module.lazy_unwind.  Modules with their unwind
+   data built in stay at _stp_lazy_none. */
+enum {
+	_stp_lazy_none,
+	_stp_lazy_wanted,	/* not asked for yet */
+	_stp_lazy_requested,	/* asked stapio, or stapio failed */
+	_stp_lazy_loaded	/* the unwind data may be used */
+};
+
+static int _stp_ctl_send(int type, void *data, unsigned len);
+
+/* Ask stapio, once, for the unwind data of a lazy module. */
+static void _stp_lazy_unwind_request(struct _stp_module *m)
+{
+	struct _stp_msg_lazy_unwind req;
+	unsigned i;
+
+	if (cmpxchg(&m->lazy_unwind, _stp_lazy_wanted, _stp_lazy_requested)
+	    != _stp_lazy_wanted)
+		return;
+	for (i = 0; i < _stp_num_modules; i++)
+		if (_stp_modules[i] == m)
+			break;
+
+	memset(&req, 0, sizeof(req));
+	req.index = i;
+	if (m->build_id_len > 0 && m->build_id_len <= STP_LAZY_BUILD_ID_LEN) {
+		req.build_id_len = m->build_id_len;
+		memcpy(req.build_id, m->build_id_bits, m->build_id_len);
+	}
+	strlcpy(req.path, m->path, sizeof(req.path));
+	dbug_sym(1, "requesting unwind data of %s\n", m->path);
+	if (_stp_ctl_send(STP_LAZY_UNWIND, &req, sizeof(req)) <= 0)
+		m->lazy_unwind = _stp_lazy_wanted; /* try again later */
+}
+
+/* Whether the unwind data of a module is there to be used. */
+static inline int _stp_lazy_unwind_ready(struct _stp_module *m)
+{
+	if (likely(m->lazy_unwind == _stp_lazy_none))
+		return 1;
+	/* READ_ONCE() isn't available on all supported kernels. */
+	if (*(volatile int *)&m->lazy_unwind != _stp_lazy_loaded)
+		return 0;
+	smp_rmb(); /* pairs with _stp_lazy_unwind_install() */
+	return 1;
+}
+
 /* Return (user) module in which the the given addr falls.  Returns
    NULL when no module can be found that contains the addr.  Fills in
    vm_start (addr where module is mapped in) and (base) name of module
@@ -153,11 +198,93 @@ static struct _stp_module *_stp_umod_lookup(unsigned long addr,
 	struct _stp_module *m = (struct _stp_module *)user;
 	dbug_sym(1, "found module %s at 0x%lx\n", m->path,
 		 vm_start ? *vm_start : 0);
+	if (unlikely(m->lazy_unwind == _stp_lazy_wanted))
+		_stp_lazy_unwind_request(m);
 	return m;
       }
   return NULL;
 }
 
+static uint64_t _stp_uleb128(const uint8_t **p)
+{
+	uint64_t v = 0;
+	unsigned shift = 0;
+	uint8_t b;
+
+	do {
+		b = *(*p)++;
+		v |= (uint64_t) (b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return v;
+}
+
+/* Return the symbol of a section that addr, relative to the section,
+   falls in, and fill in its size and the offset of addr in it when
+   given.  Returns NULL if there is none. */
+static const char *_stp_section_symbol(struct _stp_section *sec,
+				       unsigned long addr,
+				       unsigned long *symbolsize,
+				       unsigned long *offset)
+{
+	struct _stp_symbol_block *b;
+	const uint8_t *rowp;
+	unsigned long sym_addr, next_addr = 0;
+	unsigned begin = 0, end, blocks, rows, i;
+	uint32_t name;
+
+	blocks = DIV_ROUND_UP(sec->num_symbols, STP_SYMBOL_BLOCK);
+	if (blocks == 0)
+		return NULL;
+
+	/* binary search for the block within the module */
+	end = blocks;
+	do {
+		unsigned mid = (begin + end) / 2;
+		if (addr < sec->symbols[mid].addr)
+			end = mid;
+		else
+			begin = mid;
+	} while (begin + 1 < end);
+	/* result index in $begin */
+
+	b = &sec->symbols[begin];
+	if (unlikely(addr < b->addr))
+		return NULL;
+
+	/* then for the symbol within the block */
+	sym_addr = b->addr;
+	name = b->name;
+	rowp = sec->symbol_rows + b->rows;
+	rows = min_t(unsigned, STP_SYMBOL_BLOCK,
+		     sec->num_symbols - begin * STP_SYMBOL_BLOCK);
+	for (i = 1; i < rows; i++) {
+		unsigned long a = sym_addr + _stp_uleb128(&rowp);
+		uint32_t n = _stp_uleb128(&rowp);
+		if (addr < a) {
+			next_addr = a;
+			break;
+		}
+		sym_addr = a;
+		name = n;
+	}
+	if (next_addr == 0 && begin + 1 < blocks)
+		next_addr = sec->symbols[begin + 1].addr;
+
+	if (offset)
+		*offset = addr - sym_addr;
+	/* We could also pass sec->name here. */
+	if (symbolsize) {
+		if (next_addr)
+			*symbolsize = next_addr - sym_addr;
+		else
+			*symbolsize = 0;
+		// NB: This is only a heuristic.  Sometimes there are large
+		// gaps between text areas of modules.
+	}
+	return _stp_symbol_names + name;
+}
+
 static const char *_stp_kallsyms_lookup(unsigned long addr,
                                         unsigned long *symbolsize,
                                         unsigned long *offset, 
@@ -167,8 +294,6 @@ static const char *_stp_kallsyms_lookup(unsigned long addr,
 {
 	struct _stp_module *m = NULL;
 	struct _stp_section *sec = NULL;
-	struct _stp_symbol *s = NULL;
-	unsigned end, begin = 0;
 	unsigned long rel_addr = 0;
 
 	if (addr == 0)
@@ -220,155 +345,40 @@ static const char *_stp_kallsyms_lookup(unsigned long addr,
           return NULL;
         
         /* NB: relativize the address to the section. */
-        addr = rel_addr;
-	end = sec->num_symbols;
-
-	/* binary search for symbols within the module */
-	do {
-		unsigned mid = (begin + end) / 2;
-		if (addr < sec->symbols[mid].addr)
-			end = mid;
-		else
-			begin = mid;
-	} while (begin + 1 < end);
-	/* result index in $begin */
-
-	s = & sec->symbols[begin];
-	if (likely(addr >= s->addr)) {
-		if (offset)
-			*offset = addr - s->addr;
-                /* We could also pass sec->name here. */
-		if (symbolsize) {
-			if ((begin + 1) < sec->num_symbols)
-				*symbolsize = sec->symbols[begin + 1].addr - s->addr;
-			else
-				*symbolsize = 0;
-			// NB: This is only a heuristic.  Sometimes there are large
-			// gaps between text areas of modules.
-		}
-		return s->symbol;
-	}
-	return NULL;
+	return _stp_section_symbol(sec, rel_addr, symbolsize, offset);
 }
 
 #ifdef STP_NEED_LINE_DATA
-static void _stp_filename_lookup(struct _stp_module *mod, char ** filename,
-                                 uint8_t *dirsecp, uint8_t *enddirsecp,
-                                 unsigned fileidx, int user, int compat_task)
+static int64_t _stp_sleb128(const uint8_t **p)
 {
-  uint8_t *linep = dirsecp;
-  static char fullpath [MAXSTRINGLEN];
-  char *dirname_entry = NULL, *filename_entry = NULL;
-  unsigned diridx = 0, i, j;
-
-  // skip past the directory table in the debug_line info
-  while (*linep != 0 && linep < enddirsecp)
-    {
-      char *entry = (char *) linep;
-      uint8_t *endnamep = (uint8_t *) memchr (entry, '\0', (size_t) (enddirsecp-linep));
-      if (endnamep == NULL || (endnamep + 1) > enddirsecp)
-        return;
-      linep = endnamep + 1;
-    }
-
-  if ((char) linep[0] != '\0')
-    return;
-  ++linep;
-
-  // at the filename table
-  for (i = 1; *linep != 0 && linep < enddirsecp; ++i)
-    {
-      uint8_t *endnamep = NULL;
-      filename_entry = (char *) linep;
-      endnamep = (uint8_t *) memchr (filename_entry, '\0', (size_t) (enddirsecp-linep));
-      if (endnamep == NULL || (endnamep + 1) > enddirsecp)
-        return;
-
-      // move the line pointer past the file name. account for the null byte
-      linep = endnamep + 1;
-
-      // save the directory index
-      diridx = read_pointer ((const uint8_t **) &linep, enddirsecp, DW_EH_PE_leb128, user, compat_task);
-
-      if (linep > enddirsecp)
-        return;
-      if (i == fileidx)
-        break;
-
-      filename_entry = NULL;
-
-      // modification time
-      read_pointer ((const uint8_t **) &linep, enddirsecp, DW_EH_PE_leb128, user, compat_task);
-      // length of a file
-      read_pointer ((const uint8_t **) &linep, enddirsecp, DW_EH_PE_leb128, user, compat_task);
-      // check that nothing went wrong with reading the ulebs
-      if (linep > enddirsecp)
-        return;
-    }
-
-  if (filename_entry == NULL)
-    return; // return just the linenumber
-
-  // if  dirid == 0, it's the compilation directory. otherwise retrieve the
-  // directory path if the file path was relative
-  if (diridx != 0 && filename_entry[0] != '/')
-    {
-      linep = dirsecp;
-      for (j = 1; *linep != 0 && linep < enddirsecp; j++)
-        {
-          uint8_t *endnamep = NULL;
-          dirname_entry = (char *) linep;
-          endnamep = (uint8_t *) memchr (dirname_entry, '\0', (size_t) (enddirsecp-linep));
-          if (endnamep == NULL || (endnamep + 1) > enddirsecp)
-            return;
-
-          if (j == diridx)
-            break;
-
-          dirname_entry = NULL;
-          linep = endnamep + 1;
-        }
-
-      if (dirname_entry == NULL)
-        return;
-    }
-
-  // bring it all together
-  // the filename was the full path
-  if (filename_entry[0] == '/')
-    *filename = filename_entry;
-  // relative filename, and the dir corresponds to the compilation dir
-  else if (diridx == 0)
-    {
-      char *slash = strrchr (mod->path, '/');
-      strlcpy(fullpath, mod->path, (size_t) (2 + slash - mod->path));
-      strlcat(fullpath, filename_entry, MAXSTRINGLEN);
-      *filename = fullpath;
-    }
-  // relative filename and a directory from the table in the debug line data
-  else
-    {
-      strlcpy(fullpath, dirname_entry, MAXSTRINGLEN);
-      strlcat(fullpath, "/", MAXSTRINGLEN);
-      strlcat(fullpath, filename_entry, MAXSTRINGLEN);
-      *filename = fullpath;
-    }
+  int64_t v = 0;
+  unsigned shift = 0;
+  uint8_t b;
+
+  do {
+    b = *(*p)++;
+    v |= (int64_t) (b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  if (shift < 64 && (b & 0x40))
+    v |= -((int64_t) 1 << shift);
+  return v;
 }
-
 #endif /* STP_NEED_LINE_DATA */
 
 unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *task, char ** filename, int need_filename)
 {
+// the portion below is encased in this conditional because the line
+// tables are only emitted with it
+#ifdef STP_NEED_LINE_DATA
   struct _stp_module *m;
   struct _stp_section *sec;
   const char *modname = NULL;
-  uint8_t *linep, *enddatap;
-  int compat_task = _stp_is_compat_task();
-  int user = (task ? 1 : 0);
+  struct _stp_line_block *b;
+  const uint8_t *rowp;
+  unsigned long row_addr, linenum;
+  unsigned file, lo, hi, i, rows;
 
-// the portion below is encased in this conditional because some of the functions
-// and constants needed are encased in a similar condition
-#ifdef STP_NEED_LINE_DATA
   if (addr == 0)
       return 0;
 
@@ -384,7 +394,7 @@ unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *tas
   else
     m = _stp_kmod_sec_lookup(addr, &sec);
 
-  if (m == NULL || m->debug_line == NULL)
+  if (m == NULL || m->line_blocks == NULL)
     return 0;
 
   // if addr is a kernel address, it will need to be adjusted
@@ -405,236 +415,49 @@ unsigned long _stp_linenumber_lookup(unsigned long addr, struct task_struct *tas
       addr = addr - offset;
     }
 
-
-  linep = m->debug_line;
-  enddatap = m->debug_line + m->debug_line_len;
-
-  while (linep < enddatap)
+  // find the last block starting at or before addr
+  lo = 0;
+  hi = m->num_line_blocks;
+  while (lo < hi)
     {
-      // State machine "curr" values are updated directly.
-      // A "row" is committed line data that we should compare against, only
-      // updated for DW_LNS_copy, DW_LNE_end_sequence, and special opcodes.
-      uint64_t curr_addr = 0, row_addr = 0;
-      unsigned int curr_file_idx = 1, row_file_idx = 1;
-      unsigned long curr_linenum = 1, row_linenum = 1;
-      unsigned int row_end_sequence = 1;
-
-      unsigned int length = 4;
-      unsigned int skip_to_seq_end = 0, op_index = 0;
-      uint64_t unit_length, hdr_length;
-      uint8_t *endunitp, *endhdrp, *dirsecp, *stdopcode_lens_secp;
-      uint16_t version;
-      uint8_t opcode_base, line_range, min_instr_len = 0, max_ops = 1;
-      int8_t line_base;
-
-      unit_length = (uint64_t) read_pointer ((const uint8_t **) &linep, enddatap, DW_EH_PE_data4, user, compat_task);
-      if (unit_length == 0xffffffff)
-        {
-          if (unlikely (linep + 8 > enddatap))
-            return 0;
-          unit_length = (uint64_t) read_pointer ((const uint8_t **) &linep, enddatap, DW_EH_PE_data8, user, compat_task);
-          length = 8;
-        }
-      if (unit_length < (length + 2) || (linep + unit_length) > enddatap)
-        return 0;
-
-      endunitp = linep + unit_length;
-
-      version = read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_data2, user, compat_task);
-
-      if (length == 4)
-        hdr_length = (uint64_t) read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_data4, user, compat_task);
+      unsigned mid = lo + (hi - lo) / 2;
+      if (m->line_blocks[mid].addr <= addr)
+        lo = mid + 1;
       else
-        hdr_length = (uint64_t) read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_data8, user, compat_task);
-
-      if ((linep + hdr_length) > endunitp || hdr_length < (version >= 4 ? 6 : 5))
-        return 0;
-
-      endhdrp = linep + hdr_length;
-
-      // minimum instruction length
-      min_instr_len = *linep++;
-      // max operations per instruction
-      if (version >= 4)
-        {
-          max_ops = *linep++;
-          if (max_ops == 0)
-              return 0; // max operations per instruction is supposed to > 0;
-        }
-      // default value of the is_stmt register
-      ++linep;
-      // line base. this is a signed value.
-      line_base = *linep++;
-      // line range
-      line_range = *linep++;
-      if (line_range == 0)
-        return 0;
-      // opcode base
-      opcode_base = *linep++;
-      // opcodes
-      stdopcode_lens_secp = linep - 1;
-      // need this check if the header length check covers this region?
-      if ((linep + opcode_base - 1) >= endhdrp)
-        return 0;
-      linep += opcode_base - 1;
-
-      // at the directory table. don't need an other information from the header
-      // in order to find the desired line number, so we will save a pointer to
-      // this point and skip ahead to the end of the header. this portion of the
-      // header will be visited again after a line number has been found if a
-      // filename is needed.
-      dirsecp = linep;
-      linep = endhdrp;
-
-      // iterating through the opcodes. will deal with three defined types of
-      // opcode: special, extended and standard. there is also a portion at
-      // the end of this loop that will deal with unknown (standard) opcodes.
-      while (linep < endunitp)
-        {
-          uint8_t opcode = *linep++;
-          long addr_adv = 0;
-          unsigned int commit_row = 0;
-          unsigned int end_sequence = 0;
-
-          if (opcode >= opcode_base) // special opcode
-            {
-              // line range was checked before this point. this variable is not altered after it is initialized.
-              curr_linenum += (line_base + ((opcode - opcode_base) % line_range));
-              addr_adv = ((opcode - opcode_base) / line_range);
-              commit_row = 1;
-            }
-
-          else if (opcode == 0) // extended opcode
-            {
-              int len;
-              uint8_t subopcode;
-
-              if (linep + 1 > endunitp)
-                return 0;
-
-              len = *linep++;
-              if (linep + len > endunitp || len < 1)
-                return 0;
-
-              subopcode = *linep++; // the sub opcode
-              switch (subopcode)
-                {
-                  case DW_LNE_end_sequence:
-                    // NB: we don't clear "curr" values until after the row is compared.
-                    op_index = 0;
-                    skip_to_seq_end = 0;
-                    end_sequence = 1;
-                    commit_row = 1;
-                    break;
-                  case DW_LNE_set_address:
-                    if ((len - 1) == 4) // account for the opcode (the -1)
-                      curr_addr = (uint64_t) read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_data4, user, compat_task);
-                    else if ((len - 1) == 8)
-                      curr_addr = (uint64_t) read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_data8, user, compat_task);
-                    else
-                      return 0;
-
-                    // if the set address is past the address we want, iterate
-                    // to the end of the sequence without doing more address
-                    // and linenumber calcs than necessary
-                    if (curr_addr > addr)
-                      skip_to_seq_end = 1;
-                    op_index = 0;
-                    break;
-                  default: // advance the ptr by the specified amount
-                    linep += len-1;
-                    break;
-                }
-            }
-          else if (opcode <= DW_LNS_set_isa) // known standard opcode
-            {
-              uint8_t *linep_before = linep;
-              switch (opcode)
-                {
-                  case DW_LNS_copy:
-                    commit_row = 1;
-                    break;
-                  case DW_LNS_advance_pc:
-                    addr_adv = read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_leb128, user, compat_task);
-                    break;
-                  case DW_LNS_fixed_advance_pc:
-                    addr_adv = read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_data2, user, compat_task);
-                    if (linep_before == linep) // the read failed
-                      return 0;
-                    op_index = 0;
-                    break;
-                  case DW_LNS_advance_line:
-                    curr_linenum += read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_leb128+DW_EH_PE_signed, user, compat_task);
-                    break;
-                  case DW_LNS_set_file:
-                    curr_file_idx = read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_leb128, user, compat_task);
-                    break;
-                  case DW_LNS_set_column:
-                    read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_leb128, user, compat_task);
-                    break;
-                  case DW_LNS_const_add_pc:
-                    addr_adv = ((255 - opcode_base) / line_range);
-                    break;
-                  case DW_LNS_set_isa:
-                    read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_leb128, user, compat_task);
-                    break;
-                }
-                if (linep > endunitp) // reading in the leb128 failed
-                  return 0;
-            }
-          else
-            {
-              int i;
-              for (i=stdopcode_lens_secp[opcode]; i>0; --i)
-                {
-                  read_pointer ((const uint8_t **) &linep, endunitp, DW_EH_PE_leb128, user, compat_task);
-                  if (linep > endunitp)
-                    return 0;
-                }
-            }
-
-          // don't worry about doing address advances since we are waiting
-          // till we hit the end of the sequence or the end of the unit at which
-          // point the address and linenumber will be reset
-          if (skip_to_seq_end)
-            continue;
-
-          // calculate actual address advance
-          if (addr_adv != 0 && opcode != DW_LNS_fixed_advance_pc)
-            {
-              addr_adv = min_instr_len * (op_index + addr_adv) / max_ops;
-              op_index =  (op_index + addr_adv) % max_ops;
-            }
-          curr_addr += addr_adv;
-
-          if (commit_row) {
-            // compare the whole range from the prior committed row
-            // (except an end_sequence can't be the base)
-            if (row_end_sequence == 0 && row_addr <= addr && addr < curr_addr)
-              {
-                if (need_filename)
-                  _stp_filename_lookup(m, filename, dirsecp, endhdrp,
-                                       row_file_idx, user, compat_task);
-                return row_linenum;
-              }
-
-            if (end_sequence) {
-              curr_addr = 0;
-              curr_file_idx = 1;
-              curr_linenum = 1;
-            }
+        hi = mid;
+    }
+  if (lo == 0)
+    return 0;
+  i = lo - 1;
+
+  // then walk its rows up to addr
+  b = &m->line_blocks[i];
+  row_addr = b->addr;
+  linenum = b->line;
+  file = b->file;
+  rowp = m->line_rows + b->rows;
+  rows = min_t(unsigned, STP_LINE_BLOCK, m->num_line_rows - i * STP_LINE_BLOCK);
+  for (i = 1; i < rows; i++)
+    {
+      int64_t v;
 
-            row_addr = curr_addr;
-            row_file_idx = curr_file_idx;
-            row_linenum = curr_linenum;
-            row_end_sequence = end_sequence;
-          }
-        }
+      row_addr += _stp_uleb128(&rowp);
+      if (row_addr > addr)
+        break;
+      v = _stp_sleb128(&rowp);
+      linenum += v >> 1;
+      if (v & 1)
+        file = _stp_uleb128(&rowp);
     }
-#endif /* STP_NEED_LINE_DATA */
 
-  // no linenumber was found otherwise this function would have returned before this point
+  if (linenum == 0)
+    return 0;
+  if (need_filename)
+    *filename = (char *) m->line_files[file];
+  return linenum;
+#else
   return 0;
+#endif /* STP_NEED_LINE_DATA */
 }
 
 
@@ -887,6 +710,61 @@ static int _stp_usermodule_check(struct task_struct *tsk, const char *path_name,
 }
 
 
+/* Prints an address as " <path:build-id:section+offset>", which needs
+   no symbol lookups, nor symbol tables. */
+static int _stp_snprint_addr_deferred(char *str, size_t len,
+				      unsigned long address,
+				      const char *prestr, const char *poststr,
+				      struct task_struct *task)
+{
+  enum { max_buildid_hexstring = 65 };
+  static const char hexnibble[16]="0123456789abcdef";
+  char build_id[max_buildid_hexstring] = "-";
+  struct _stp_module *m = NULL;
+  struct _stp_section *sec = NULL;
+  unsigned long rel_addr = 0;
+  int i, j;
+
+  if (task)
+    {
+      unsigned long sect_offset = 0, vm_start = 0;
+      unsigned long addr = address;
+#ifdef CONFIG_COMPAT
+      if (_stp_is_compat_task2(task))
+	addr &= ((compat_ulong_t) ~0);
+#endif
+      m = _stp_umod_lookup(addr, task, NULL, &sect_offset, &vm_start, NULL);
+      if (m)
+	{
+	  sec = &m->sections[0];
+	  if (strcmp(".dynamic", sec->name) == 0)
+	    rel_addr = addr - vm_start + sect_offset;
+	  else
+	    rel_addr = addr;
+	}
+    }
+  else
+    {
+      m = _stp_kmod_sec_lookup(address, &sec);
+      if (m)
+	rel_addr = address - sec->static_addr;
+    }
+
+  if (m == NULL || sec == NULL)
+    return _stp_snprintf(str, len, "%s%p%s", prestr, (int64_t) address, poststr);
+
+  for (i = 0, j = 0; j < min((max_buildid_hexstring-1)/2, m->build_id_len); j++)
+    {
+      build_id[i++] = hexnibble[m->build_id_bits[j] >> 4];
+      build_id[i++] = hexnibble[m->build_id_bits[j] & 15];
+      build_id[i] = '\0';
+    }
+
+  return _stp_snprintf(str, len, "%s%p <%s:%s:%s+%#lx>%s", prestr,
+		       (int64_t) address, m->path, build_id, sec->name,
+		       rel_addr, poststr);
+}
+
 /** Prints an address based on the _STP_SYM flags.
  * @param address The address to lookup.
  * @param task The address to lookup (if NULL lookup kernel/module address).
@@ -911,6 +789,9 @@ static int _stp_snprint_addr(char *str, size_t len, unsigned long address,
   else
     poststr = "";
 
+  if ((flags & _STP_SYM_DEFER) && (flags & (_STP_SYM_SYMBOL | _STP_SYM_MODULE)))
+    return _stp_snprint_addr_deferred(str, len, address, prestr, poststr, task);
+
   if (flags & (_STP_SYM_SYMBOL | _STP_SYM_MODULE)) {
     name = _stp_kallsyms_lookup(address, &size, &offset, &modname, task);
     if (name && name[0] == '.')
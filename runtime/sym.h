@@ -39,6 +39,9 @@
 #define _STP_SYM_LINENUMBER 1024
 /* Adds the filename the symbol is from when  _STP_SYM_LINENUMBER is used. */
 #define _STP_SYM_FILENAME 2048
+/* Prints the address with its module, build-id, section and offset in
+   that section, to be symbolized by stap-symbolize after the run. */
+#define _STP_SYM_DEFER 4096
 
 /* Used for backtraces in hex string form. */
 #define _STP_SYM_NONE	(_STP_SYM_HEXSTR | _STP_SYM_POST_SPACE)
@@ -62,41 +65,41 @@
 #define _STP_SYM_DATA   (_STP_SYM_SYMBOL | _STP_SYM_MODULE \
 			 | _STP_SYM_OFFSET | _STP_SYM_SIZE)
 
-#ifdef STP_NEED_LINE_DATA
-/* DWARF standard opcode encodings.  */
-#define DW_LNS_copy             1
-#define DW_LNS_advance_pc       2
-#define DW_LNS_advance_line     3
-#define DW_LNS_set_file         4
-#define DW_LNS_set_column       5
-#define DW_LNS_negate_stmt      6
-#define DW_LNS_set_basic_block  7
-#define DW_LNS_const_add_pc     8
-#define DW_LNS_fixed_advance_pc 9
-#define DW_LNS_set_prologue_end 10
-#define DW_LNS_set_epilogue_begin 11
-#define DW_LNS_set_isa          12
-
-/* DWARF extended opcode encodings.  */
-#define DW_LNE_end_sequence   1
-#define DW_LNE_set_address    2
-#define DW_LNE_define_file    3
-#define DW_LNE_set_discriminator  4
-#define DW_LNE_lo_user        128
-#define DW_LNE_hi_user        255
-
-#endif /* STP_NEED_LINE_DATA */
-
-struct _stp_symbol {
+/* The translator decodes the line programs into sorted rows, of which
+   every STP_LINE_BLOCK-th is kept whole here.  The rows in between are
+   in line_rows, each as the uleb128 address delta to its predecessor,
+   the sleb128 of twice its line delta plus one if the file changes,
+   then the uleb128 new file index if it does.  A row covers addresses
+   up to the next; line 0 means no line information.  */
+#define STP_LINE_BLOCK 16
+
+struct _stp_line_block {
+	unsigned long addr;
+	uint32_t rows;	/* offset of the following rows in line_rows */
+	uint32_t line;
+	uint32_t file;	/* index in line_files */
+};
+
+/* Symbol tables are stored like the line tables: every
+   STP_SYMBOL_BLOCK-th symbol is kept whole, and the symbols in between
+   are in symbol_rows as the uleb128 address delta to their predecessor
+   and the uleb128 offset of their name.  Names are offsets into
+   _stp_symbol_names, which holds each distinct name once for all
+   modules, and needs no relocations.  */
+#define STP_SYMBOL_BLOCK 16
+
+struct _stp_symbol_block {
 	unsigned long addr;
-	const char *symbol;
+	uint32_t rows;	/* offset of the following symbols in symbol_rows */
+	uint32_t name;	/* offset in _stp_symbol_names */
 };
 
 struct _stp_section {
         const char *name;
         unsigned long static_addr; /* XXX non-null if everywhere the same. */
 	unsigned long size; /* length of the address space module covers. */
-	struct _stp_symbol *symbols;  /* ordered by address */
+	struct _stp_symbol_block *symbols;  /* ordered by address */
+	uint8_t *symbol_rows;
   	unsigned num_symbols;
 
 	/* Synthesized index for .debug_frame table, keep section
@@ -117,13 +120,21 @@ struct _stp_module {
 	void *debug_frame;
 	void *eh_frame;
 	void *unwind_hdr;	
-  void *debug_line;
 	uint32_t debug_frame_len;
 	uint32_t eh_frame_len;
 	uint32_t unwind_hdr_len;
-  uint32_t debug_line_len;
 	unsigned long eh_frame_addr; /* Orig load address (offset) .eh_frame */
 	unsigned long unwind_hdr_addr; /* same for .eh_frame_hdr */
+	/* For user modules translated with --lazy-unwind, the unwind
+	   data is requested from stapio on first use; see sym.c. */
+	int lazy_unwind;
+
+	/* Line table, see struct _stp_line_block. */
+	struct _stp_line_block *line_blocks;
+	uint8_t *line_rows;
+	const char **line_files;
+	uint32_t num_line_blocks;
+	uint32_t num_line_rows;
 
 	/* build-id information */
 	unsigned char *build_id_bits;
@@ -135,6 +146,7 @@ struct _stp_module {
 /* Defined by translator-generated stap-symbols.h. */
 extern struct _stp_module *_stp_modules [];
 extern const unsigned _stp_num_modules;
+extern const char _stp_symbol_names[];
 
 /* Used in the unwinder to special case unwinding through kretprobes. */
 /* Initialized through translator (stap-symbols.h) relative to kernel */
@@ -163,8 +175,8 @@ static void _stp_kmodule_update_address(const char* module,
     || defined(STP_NEED_LINE_DATA)
 extern struct _stp_module _stp_module_self;
 extern struct _stp_section _stp_module_self_sections[];
-extern struct _stp_symbol _stp_module_self_symbols_0[];
-extern struct _stp_symbol _stp_module_self_symbols_1[];
+extern struct _stp_symbol_block _stp_module_self_symbols_0[];
+extern struct _stp_symbol_block _stp_module_self_symbols_1[];
 #endif /* defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)
           || defined(STP_NEED_LINE_DATA) */
 #endif /* _STP_SYM_H_ */
@@ -4,6 +4,7 @@
 #include <linux/file.h>
 #include <linux/list.h>
 #include <linux/jhash.h>
+#include <linux/sort.h>
 
 #include <linux/fs.h>
 #include <linux/dcache.h>
@@ -84,13 +85,41 @@ struct __stp_tf_vma_entry {
 	void *user;
 };
 
+// A task's entries sorted by vm_start, so that address lookups can
+// bisect them rather than walk the whole bucket.  An index is never
+// changed once published: each add or removal replaces it under the
+// bucket lock, and readers see the old or the new one under RCU.  A
+// task whose index couldn't be allocated simply has none, and its
+// lookups fall back to the bucket walk until the next add rebuilds it.
+struct __stp_tf_vma_index {
+	struct hlist_node hlist;
+	struct rcu_head rcu;
+	struct task_struct *tsk;
+	unsigned n;
+	struct __stp_tf_vma_entry *entries[];
+};
+
 struct __stp_tf_vma_bucket {
 	struct hlist_head head;
+	struct hlist_head index;
 	stp_spinlock_t lock;
 };
 
 static struct __stp_tf_vma_bucket *__stp_tf_vma_map;
 
+// Each cpu remembers the entry its last address lookup found, as long
+// as no entry has been removed since: bumping the generation on every
+// removal invalidates all the caches at once, so a cached entry is
+// always still in the map.  Generation 0 marks an empty cache.
+// The fields are volatile as  isn't on all supported kernels.
+struct __stp_tf_vma_cache {
+	volatile unsigned long gen;
+	struct __stp_tf_vma_entry * volatile entry;
+};
+
+static DEFINE_PER_CPU(struct __stp_tf_vma_cache, __stp_tf_vma_cache);
+static atomic_long_t __stp_tf_vma_gen = ATOMIC_LONG_INIT(1);
+
 // __stp_tf_vma_new_entry(): Returns an newly allocated or NULL.
 // Must only be called from user context.
 // ... except, with inode-uprobes / task-finder2, it can be called from
@@ -118,7 +147,111 @@ static void __stp_tf_vma_free_entry(struct rcu_head *rcu)
 
 	kfree(entry);
 }
+
+static void __stp_tf_vma_free_index(struct rcu_head *rcu)
+{
+	struct __stp_tf_vma_index *index = container_of(rcu, typeof(*index), rcu);
+
+	kfree(index);
+}
+#endif
+
+static int __stp_tf_vma_index_cmp(const void *a, const void *b)
+{
+	const struct __stp_tf_vma_entry *x = *(struct __stp_tf_vma_entry **)a;
+	const struct __stp_tf_vma_entry *y = *(struct __stp_tf_vma_entry **)b;
+
+	if (x->vm_start != y->vm_start)
+		return x->vm_start < y->vm_start ? -1 : 1;
+	return 0;
+}
+
+// __stp_tf_vma_index_find(): The task's index, if it has one.  Called
+// with the bucket lock or the RCU read lock held.
+static struct __stp_tf_vma_index *
+__stp_tf_vma_index_find(struct __stp_tf_vma_bucket *bucket,
+			struct task_struct *tsk)
+{
+	struct __stp_tf_vma_index *index;
+	struct hlist_node *node;
+
+	stap_hlist_for_each_entry_rcu(index, node, &bucket->index, hlist) {
+		if (index->tsk == tsk)
+			return index;
+	}
+	return NULL;
+}
+
+// __stp_tf_vma_index_update(): Replace the task's index with one that
+// has @added, already in the bucket, and lacks @removed, already taken
+// out of it.  Called with the bucket lock held.
+static void
+__stp_tf_vma_index_update(struct __stp_tf_vma_bucket *bucket,
+			  struct task_struct *tsk,
+			  struct __stp_tf_vma_entry *added,
+			  struct __stp_tf_vma_entry *removed)
+{
+	struct __stp_tf_vma_index *old = __stp_tf_vma_index_find(bucket, tsk);
+	struct __stp_tf_vma_index *index = NULL;
+	struct __stp_tf_vma_entry *entry;
+	struct hlist_node *node;
+	unsigned i, max = 0, n = 0;
+
+	// Without an index, only an add builds one, from the bucket.
+	if (old)
+		max = old->n + 1;
+	else if (added) {
+		stap_hlist_for_each_entry_rcu(entry, node, &bucket->head, hlist) {
+			if (entry->tsk == tsk)
+				max++;
+		}
+	}
+	if (max)
+		index = kmalloc(sizeof(*index) + max * sizeof(index->entries[0]),
+				GFP_ATOMIC | __GFP_NOWARN);
+
+	if (index) {
+		index->tsk = tsk;
+		if (old) {
+			for (i = 0; i < old->n; i++)
+				if (old->entries[i] != removed)
+					index->entries[n++] = old->entries[i];
+			if (added)
+				index->entries[n++] = added;
+		} else {
+			stap_hlist_for_each_entry_rcu(entry, node, &bucket->head, hlist) {
+				if (entry->tsk == tsk)
+					index->entries[n++] = entry;
+			}
+		}
+		index->n = n;
+		sort(index->entries, n, sizeof(index->entries[0]),
+		     __stp_tf_vma_index_cmp, NULL);
+	}
+
+	// An empty index isn't worth keeping.
+	if (index && n == 0) {
+		kfree(index);
+		index = NULL;
+	}
+
+	if (old && index)
+		hlist_replace_rcu(&old->hlist, &index->hlist);
+	else if (old)
+		hlist_del_rcu(&old->hlist);
+	else if (index)
+		hlist_add_head_rcu(&index->hlist, &bucket->index);
+	else
+		return;
+
+	if (old) {
+#ifdef kfree_rcu
+		kfree_rcu(old, rcu);
+#else
+		call_rcu(&old->rcu, __stp_tf_vma_free_index);
 #endif
+	}
+}
 
 // __stp_tf_vma_put_entry(): Put a specified number of references on the entry.
 static void
@@ -137,6 +270,8 @@ __stp_tf_vma_put_entry(struct __stp_tf_vma_bucket *bucket,
 
 	stp_spin_lock_irqsave(&bucket->lock, flags);
 	hlist_del_rcu(&entry->hlist);
+	__stp_tf_vma_index_update(bucket, entry->tsk, NULL, entry);
+	atomic_long_inc(&__stp_tf_vma_gen);
 	stp_spin_unlock_irqrestore(&bucket->lock, flags);
 
 #ifdef kfree_rcu
@@ -166,6 +301,7 @@ stap_initialize_vma_map(void)
 		struct __stp_tf_vma_bucket *bucket = &buckets[i];
 
 		INIT_HLIST_HEAD(&bucket->head);
+		INIT_HLIST_HEAD(&bucket->index);
 		stp_spin_lock_init(&bucket->lock);
 	}
 
@@ -267,6 +403,7 @@ stap_add_vma_map_info(struct task_struct *tsk, unsigned long vm_start,
 
 	stp_spin_lock_irqsave(&bucket->lock, flags);
 	hlist_add_tail_rcu(&entry->hlist, &bucket->head);
+	__stp_tf_vma_index_update(bucket, tsk, entry, NULL);
 	stp_spin_unlock_irqrestore(&bucket->lock, flags);
 	return 0;
 }
@@ -310,6 +447,80 @@ stap_remove_vma_map_info(struct task_struct *tsk, unsigned long vm_start)
 	return 0;
 }
 
+// __stp_tf_vma_lookup(): Get a reference on the task's entry covering
+// addr, trying this cpu's last hit, then the task's index, and only
+// then the whole bucket.
+static struct __stp_tf_vma_entry *
+__stp_tf_vma_lookup(struct __stp_tf_vma_bucket *bucket,
+		    struct task_struct *tsk, unsigned long addr)
+{
+	struct __stp_tf_vma_cache *cache;
+	struct __stp_tf_vma_index *index;
+	struct __stp_tf_vma_entry *entry, *found = NULL;
+	unsigned long gen, cached_gen;
+	unsigned lo, hi;
+
+	rcu_read_lock();
+	cache = &get_cpu_var(__stp_tf_vma_cache);
+	gen = atomic_long_read(&__stp_tf_vma_gen);
+
+	// An interrupt may refill the cache under us: take the entry
+	// only if the generation read on either side of it agrees.
+	cached_gen = cache->gen;
+	barrier();
+	entry = cache->entry;
+	barrier();
+	if (cached_gen == gen && cache->gen == gen
+	    && entry && entry->tsk == tsk
+	    && addr >= entry->vm_start && addr <= entry->vm_end
+	    && atomic_add_unless(&entry->refcount, 1, 0)) {
+		found = entry;
+		goto out;
+	}
+
+	index = __stp_tf_vma_index_find(bucket, tsk);
+	if (index) {
+		// The last entry starting at or below addr.
+		lo = 0;
+		hi = index->n;
+		while (lo < hi) {
+			unsigned mid = lo + (hi - lo) / 2;
+
+			if (index->entries[mid]->vm_start <= addr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		entry = lo ? index->entries[lo - 1] : NULL;
+		if (entry && addr <= entry->vm_end
+		    && atomic_add_unless(&entry->refcount, 1, 0))
+			found = entry;
+	} else {
+		struct hlist_node *node;
+
+		stap_hlist_for_each_entry_rcu(entry, node, &bucket->head, hlist) {
+			if (entry->tsk == tsk && addr >= entry->vm_start
+			    && addr <= entry->vm_end
+			    && atomic_add_unless(&entry->refcount, 1, 0)) {
+				found = entry;
+				break;
+			}
+		}
+	}
+
+	if (found) {
+		cache->gen = 0;
+		barrier();
+		cache->entry = found;
+		barrier();
+		cache->gen = gen;
+	}
+out:
+	put_cpu_var(__stp_tf_vma_cache);
+	rcu_read_unlock();
+	return found;
+}
+
 // Finds vma info if the vma is present in the vma map hash table for
 // a given task and address (between vm_start and vm_end).
 // Returns -ESRCH if not present.
@@ -325,8 +536,7 @@ stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 		return -ESRCH;
 
 	bucket = __stp_tf_get_vma_bucket(tsk);
-	entry = __stp_tf_get_vma_map(bucket, tsk, 1, addr >= entry->vm_start &&
-				     addr <= entry->vm_end);
+	entry = __stp_tf_vma_lookup(bucket, tsk, addr);
 	if (!entry)
 		return -ESRCH;
 
@@ -14,13 +14,101 @@
 #include "symbols.c"
 #include <linux/delay.h>
 #include <linux/poll.h>
+#include <linux/seq_file.h>
 #include "../uidgid_compatibility.h"
+#include <linux/jhash.h>
+
+/* Identical warnings within STP_WARN_DEDUP_INTERVAL jiffies of the
+   first are counted rather than sent, for a "repeated" summary at the
+   end of the interval.  STP_WARN_DEDUP_SLOTS=0 sends every one.  */
+#ifndef STP_WARN_DEDUP_SLOTS
+#define STP_WARN_DEDUP_SLOTS	32
+#endif
+#ifndef STP_WARN_DEDUP_INTERVAL
+#define STP_WARN_DEDUP_INTERVAL	HZ
+#endif
 
 static _stp_mempool_t *_stp_pool_q;
-static struct list_head _stp_ctl_ready_q;
-static STP_DEFINE_SPINLOCK(_stp_ctl_ready_lock);
 static STP_DEFINE_SPINLOCK(_stp_ctl_special_msg_lock);
 
+/* Messages ready for stapio, oldest first, form a lock-free queue
+   with many producers and one consumer: a producer links a buffer in
+   with a single xchg() on the tail, so _stp_ctl_send() on one cpu
+   never waits for another.  The consumer, _stp_ctl_read_cmd() under
+   _stp_ctl_read_mutex, takes buffers off the head; the stub entry
+   keeps the queue from ever being empty of entries.  */
+static struct list_head _stp_ctl_ready_stub;
+static struct list_head *_stp_ctl_ready_head = &_stp_ctl_ready_stub;
+static struct list_head *_stp_ctl_ready_tail = &_stp_ctl_ready_stub;
+static DEFINE_MUTEX(_stp_ctl_read_mutex);
+
+/* Set by stapio's STP_CTL_BATCH, for read() to return as many messages
+   as fit, each preceded by its length.  */
+static int _stp_ctl_batch;
+
+/* Taken off the queue, but didn't fit in the last batch.  */
+static struct _stp_buffer *_stp_ctl_pending;
+
+/* READ_ONCE() isn't available on all supported kernels.  */
+#define _stp_ctl_next(entry) (*(struct list_head * volatile *)&(entry)->next)
+
+static void _stp_ctl_ready_push(struct list_head *entry)
+{
+	struct list_head *prev;
+
+	entry->next = NULL;
+	prev = xchg(&_stp_ctl_ready_tail, entry);	/* full barrier */
+	_stp_ctl_next(prev) = entry;
+}
+
+/* Returns the oldest ready message, or NULL if there is none or the
+   next one is still being linked in.  */
+static struct _stp_buffer *_stp_ctl_ready_pop(void)
+{
+	struct list_head *head = _stp_ctl_ready_head;
+	struct list_head *next = _stp_ctl_next(head);
+
+	if (head == &_stp_ctl_ready_stub) {
+		if (next == NULL)
+			return NULL;
+		_stp_ctl_ready_head = head = next;
+		next = _stp_ctl_next(head);
+	}
+	if (next == NULL) {
+		/* head is the last entry; move the stub behind it so it
+		   can be taken. */
+		if (head != *(struct list_head * volatile *)&_stp_ctl_ready_tail)
+			return NULL;
+		_stp_ctl_ready_push(&_stp_ctl_ready_stub);
+		next = _stp_ctl_next(head);
+		if (next == NULL)
+			return NULL;
+	}
+	_stp_ctl_ready_head = next;
+	smp_rmb();
+	return container_of(head, struct _stp_buffer, list);
+}
+
+static int _stp_ctl_ready_empty(void)
+{
+	/* NB: may be called without _stp_ctl_read_mutex, as a hint */
+	struct list_head *head = *(struct list_head * volatile *)&_stp_ctl_ready_head;
+	return head == &_stp_ctl_ready_stub && _stp_ctl_next(head) == NULL;
+}
+
+#if STP_WARN_DEDUP_SLOTS > 0
+/* A recently sent warning, and how often it has come again since.  */
+struct _stp_warn_dedup {
+	stp_spinlock_t lock;
+	u32 hash;
+	unsigned repeats;
+	unsigned long expires;
+	unsigned len;		/* 0 if unused */
+	char buf[STP_CTL_BUFFER_SIZE];
+};
+static struct _stp_warn_dedup _stp_warn_dedup[STP_WARN_DEDUP_SLOTS];
+#endif
+
 static void _stp_cleanup_and_exit(int send_exit);
 static void _stp_handle_tzinfo (struct _stp_msg_tzinfo* tzi);
 static void _stp_handle_privilege_credentials (struct _stp_msg_privilege_credentials* pc);
@@ -177,8 +265,62 @@ static ssize_t _stp_ctl_write_cmd(struct file *file, const char __user *buf, siz
         }
         break;
 
+	case STP_CTL_BATCH:
+		_stp_ctl_batch = 1;
+		break;
+
+	case STP_SUBBUFS_CONSUMED:
+        {
+                static struct _stp_msg_consumed cons;
+                if (count < sizeof(cons)) {
+                        rc = 0;
+                        goto out;
+                }
+                if (copy_from_user(&cons, buf, sizeof(cons))) {
+                        rc = -EFAULT;
+                        goto out;
+                }
+                rc = _stp_transport_data_fs_consumed(cons.cpu, cons.consumed);
+                if (rc)
+                        goto out;
+        }
+        break;
+
+	case STP_SNAPSHOT:
+        {
+                static struct _stp_msg_snapshot snap;
+                if (count < sizeof(snap)) {
+                        rc = 0;
+                        goto out;
+                }
+                if (copy_from_user(&snap, buf, sizeof(snap))) {
+                        rc = -EFAULT;
+                        goto out;
+                }
+                rc = _stp_transport_data_fs_snapshot(snap.seconds);
+                if (rc)
+                        goto out;
+        }
+        break;
+
 	case STP_READY:
 		break;
+
+	case STP_PROBE_STATS:
+		_stp_probe_stats_send();
+		break;
+
+	case STP_LAZY_UNWIND:
+		if (euid != 0) {
+                        rc = -EPERM;
+                        goto out;
+                }
+                /* This message is too large to copy here. */
+		rc = _stp_lazy_unwind_install(buf, count);
+		if (rc)
+			goto out;
+		break;
+
   case STP_NAMESPACES_PID:
     {
     static struct _stp_msg_ns_pid nspid;
@@ -262,6 +404,18 @@ static void _stp_ctl_write_dbug(int type, void *data, int len)
 	case STP_REQUEST_EXIT:
 		dbug_trans2("sending STP_REQUEST_EXIT\n");
 		break;
+	case STP_TRANSPORT_STATS:
+		dbug_trans2("sending STP_TRANSPORT_STATS\n");
+		break;
+	case STP_LAZY_UNWIND:
+		dbug_trans2("sending STP_LAZY_UNWIND\n");
+		break;
+	case STP_PROBES_ARMED:
+		dbug_trans2("sending STP_PROBES_ARMED\n");
+		break;
+	case STP_PROBE_STATS:
+		dbug_trans2("sending STP_PROBE_STATS\n");
+		break;
 	default:
 		dbug_trans2("ERROR: unknown message type: %d\n", type);
 		break;
@@ -422,7 +576,11 @@ static struct _stp_buffer *_stp_ctl_get_buffer(int type, const char *data,
 	/* Is it a dynamically allocated message type? */
 	if (type == STP_OOB_DATA
 	    || type == STP_SYSTEM
-	    || type == STP_REALTIME_DATA)
+	    || type == STP_REALTIME_DATA
+	    || type == STP_TRANSPORT_STATS
+	    || type == STP_LAZY_UNWIND
+	    || type == STP_PROBES_ARMED
+	    || type == STP_PROBE_STATS)
 		bptr = _stp_mempool_alloc(_stp_pool_q);
 
 	if (bptr != NULL) {
@@ -524,7 +682,7 @@ static void _stp_ctl_free_buffer(struct _stp_buffer *bptr)
 	}
 }
 
-/* Put a message on the _stp_ctl_ready_q.  Safe to call from a probe context.
+/* Put a message on the ready queue.  Safe to call from a probe context.
    Doesn't call wake_up on _stp_ctl_wq (which would not be safe from all
    probe context). A timer will come by and pick up the message to notify
    any readers. Returns the number of bytes queued/send or zero/negative
@@ -533,7 +691,6 @@ static int _stp_ctl_send(int type, void *data, unsigned len)
 {
 	struct context* __restrict__ c = NULL;
 	struct _stp_buffer *bptr;
-	unsigned long flags;
 	unsigned hlen;
 
 #ifdef DEBUG_TRANS
@@ -557,7 +714,6 @@ static int _stp_ctl_send(int type, void *data, unsigned len)
 	   Since _stp_ctl_send may be called from arbitrary probe context, we
 	   have to make sure that all locks it wants can't possibly be held
 	   outside probe context too.  This includes:
-	    * _stp_ctl_ready_lock
 	    * _stp_pool_q->lock
 	    * _stp_ctl_special_msg_lock
 	   We ensure this by grabbing the context here and everywhere else that
@@ -575,12 +731,8 @@ static int _stp_ctl_send(int type, void *data, unsigned len)
 		return -ENOMEM;
 	}
 
-	/* Put it on the pool of ready buffers.  It's possible to recursively
-	   hit a probe here, like a kprobe in NMI or the lock tracepoints, but
-	   they will be squashed since we're holding the context busy.  */
-	stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	list_add_tail(&bptr->list, &_stp_ctl_ready_q);
-	stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
+	/* Put it on the queue of ready buffers.  */
+	_stp_ctl_ready_push(&bptr->list);
 
 	_stp_runtime_entryfn_put_context(c);
 
@@ -590,6 +742,86 @@ static int _stp_ctl_send(int type, void *data, unsigned len)
 	return len + sizeof(bptr->type);
 }
 
+/* Returns 1 if the warning in bptr repeats one sent within the last
+   STP_WARN_DEDUP_INTERVAL, and so was counted instead.  Otherwise
+   remembers it, if its slot is free, and returns 0.  */
+static int _stp_ctl_warn_repeated(struct _stp_buffer *bptr)
+{
+#if STP_WARN_DEDUP_SLOTS > 0
+	struct _stp_warn_dedup *d;
+	unsigned long flags;
+	u32 hash;
+	int rc = 0;
+
+	hash = jhash(bptr->buf, bptr->len, 0);
+	d = &_stp_warn_dedup[hash % STP_WARN_DEDUP_SLOTS];
+
+	/* Never spin here: we may have interrupted the holder.  */
+	if (!stp_spin_trylock_irqsave(&d->lock, flags))
+		return 0;
+	if (d->len == bptr->len && d->hash == hash
+	    && memcmp(d->buf, bptr->buf, bptr->len) == 0) {
+		if (d->repeats < UINT_MAX)
+			d->repeats++;
+		rc = 1;
+	} else if (d->repeats == 0) {
+		/* Nothing to report for the last one, so take its slot.  */
+		d->hash = hash;
+		d->len = bptr->len;
+		d->expires = jiffies + STP_WARN_DEDUP_INTERVAL;
+		memcpy(d->buf, bptr->buf, bptr->len);
+	}
+	stp_spin_unlock_irqrestore(&d->lock, flags);
+	return rc;
+#else
+	return 0;
+#endif
+}
+
+/* Sends a summary for each remembered warning that repeated, once its
+   interval is over (or right away, if all), and forgets it.  Called by
+   the ctl timer and at exit, never from a probe.  */
+static void _stp_ctl_warn_flush(int all)
+{
+#if STP_WARN_DEDUP_SLOTS > 0
+	struct context *__restrict__ c;
+	struct _stp_warn_dedup *d;
+	struct _stp_buffer *bptr;
+	unsigned long flags;
+	unsigned i;
+
+	/* Prevent probe reentrancy while grabbing probe-used locks.  */
+	c = _stp_runtime_entryfn_get_context();
+	for (i = 0; i < STP_WARN_DEDUP_SLOTS; i++) {
+		d = &_stp_warn_dedup[i];
+		stp_spin_lock_irqsave(&d->lock, flags);
+		if (d->len == 0
+		    || (!all && time_before(jiffies, d->expires)))
+			goto next;
+		if (d->repeats) {
+			bptr = _stp_ctl_get_buffer(STP_OOB_DATA, "WARNING: ", 9);
+			if (!bptr)
+				goto next; /* try again next time */
+			if (bptr != _stp_ctl_oob_warn) {
+				/* d->buf starts with "WARNING: " too */
+				bptr->len = scnprintf(bptr->buf, STP_CTL_BUFFER_SIZE,
+						      "WARNING: Repeated %u more times: %.*s",
+						      d->repeats, (int)d->len - 9,
+						      d->buf + 9);
+				if (bptr->buf[bptr->len - 1] != '\n')
+					bptr->buf[bptr->len++] = '\n';
+			}
+			_stp_ctl_ready_push(&bptr->list);
+		}
+		d->len = 0;
+		d->repeats = 0;
+next:
+		stp_spin_unlock_irqrestore(&d->lock, flags);
+	}
+	_stp_runtime_entryfn_put_context(c);
+#endif
+}
+
 /* Logs a warning or error through the control channel. This function mimics
    _stp_ctl_send() but directly uses an _stp_buffer to construct the warning or
    error message. This is *only* for warnings and errors. The logtype string
@@ -601,7 +833,6 @@ static void _stp_ctl_log_werr(const char *logtype, size_t logtype_len,
 {
 	struct context *__restrict__ c;
 	struct _stp_buffer *bptr;
-	unsigned long flags;
 
 	c = _stp_runtime_entryfn_get_context();
 	bptr = _stp_ctl_get_buffer(STP_OOB_DATA, logtype, logtype_len);
@@ -631,10 +862,15 @@ static void _stp_ctl_log_werr(const char *logtype, size_t logtype_len,
 	if (bptr->buf[bptr->len - 1] != '\n')
 		bptr->buf[bptr->len++] = '\n';
 
+	/* Only count a warning that was sent recently.  */
+	if (strncmp(logtype, "WARNING: ", 9) == 0
+	    && _stp_ctl_warn_repeated(bptr)) {
+		_stp_ctl_free_buffer(bptr);
+		goto put_context;
+	}
+
 send_msg:
-	stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	list_add_tail(&bptr->list, &_stp_ctl_ready_q);
-	stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
+	_stp_ctl_ready_push(&bptr->list);
 put_context:
 	_stp_runtime_entryfn_put_context(c);
 }
@@ -659,59 +895,79 @@ static int _stp_ctl_send_notify(int type, void *data, unsigned len)
 }
 
 /** Called when someone tries to read from our .cmd file.
-    Will take _stp_ctl_ready_lock and pick off the next _stp_buffer
-    from the _stp_ctl_ready_q, will wait_event on _stp_ctl_wq.  */
+    Takes the next _stp_buffer off the ready queue, waiting on
+    _stp_ctl_wq for one if need be.  With _stp_ctl_batch set, returns
+    as many as fit in count instead, each preceded by its u32 length.  */
 static ssize_t _stp_ctl_read_cmd(struct file *file, char __user *buf,
 				 size_t count, loff_t *ppos)
 {
 	struct context* __restrict__ c = NULL;
 	struct _stp_buffer *bptr;
-	int len;
-	unsigned long flags;
-
-	/* Prevent probe reentrancy while grabbing probe-used locks.  */
-	c = _stp_runtime_entryfn_get_context();
+	size_t total = 0, hlen;
+	ssize_t rc = 0;
+	u32 len;
 
+again:
 	/* wait for nonempty ready queue */
-	stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	while (list_empty(&_stp_ctl_ready_q)) {
-		stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
-		_stp_runtime_entryfn_put_context(c);
+	while (_stp_ctl_pending == NULL && _stp_ctl_ready_empty()) {
 		if (file->f_flags & O_NONBLOCK)
 			return -EAGAIN;
-		if (wait_event_interruptible(_stp_ctl_wq, !list_empty(&_stp_ctl_ready_q)))
+		if (wait_event_interruptible(_stp_ctl_wq, !_stp_ctl_ready_empty()))
 			return -ERESTARTSYS;
-		c = _stp_runtime_entryfn_get_context();
-		stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
 	}
 
-	/* get the next buffer off the ready list */
-	bptr = (struct _stp_buffer *)_stp_ctl_ready_q.next;
-	list_del_init(&bptr->list);
-	stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
+	mutex_lock(&_stp_ctl_read_mutex);
+	do {
+		bptr = _stp_ctl_pending;
+		_stp_ctl_pending = NULL;
+		if (bptr == NULL) {
+			/* Prevent probe reentrancy while grabbing
+			   probe-used locks.  */
+			c = _stp_runtime_entryfn_get_context();
+			bptr = _stp_ctl_ready_pop();
+			_stp_runtime_entryfn_put_context(c);
+		}
+		if (bptr == NULL)
+			break;
 
-	/* NB: we can't hold the context across copy_to_user, as it might fault.  */
-	_stp_runtime_entryfn_put_context(c);
+		/* write it out */
+		len = bptr->len + 4;
+		hlen = _stp_ctl_batch ? sizeof(len) : 0;
+		if (total && total + hlen + len > count) {
+			/* leave it for the next read */
+			_stp_ctl_pending = bptr;
+			break;
+		}
+		if (total + hlen + len > count
+		    || (hlen && copy_to_user(buf + total, &len, hlen))
+		    || copy_to_user(buf + total + hlen, &bptr->type, len)) {
+			/* Now what?  We took it off the queue then
+			 * failed to send it.  We can't put it back on
+			 * the queue because it will likely be
+			 * out-of-order.  Fortunately, this should
+			 * never happen.
+			 *
+			 * FIXME: need to mark this as a transport failure. */
+			errk("Supplied buffer too small. count:%d len:%d\n", (int)count, len);
+			rc = -EFAULT;
+		} else
+			total += hlen + len;
+
+		/* put it on the pool of free buffers */
+		c = _stp_runtime_entryfn_get_context();
+		_stp_ctl_free_buffer(bptr);
+		_stp_runtime_entryfn_put_context(c);
+	} while (_stp_ctl_batch && rc == 0);
+	mutex_unlock(&_stp_ctl_read_mutex);
 
-	/* write it out */
-	len = bptr->len + 4;
-	if (len > count || copy_to_user(buf, &bptr->type, len)) {
-		/* Now what?  We took it off the queue then failed to
-		 * send it.  We can't put it back on the queue because
-		 * it will likely be out-of-order.  Fortunately, this
-		 * should never happen.
-		 *
-		 * FIXME: need to mark this as a transport failure. */
-		errk("Supplied buffer too small. count:%d len:%d\n", (int)count, len);
-		return -EFAULT;
+	if (total == 0 && rc == 0) {
+		/* The next message is still being linked in.  */
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		cond_resched();
+		goto again;
 	}
-
-	/* put it on the pool of free buffers */
-	c = _stp_runtime_entryfn_get_context();
-	_stp_ctl_free_buffer(bptr);
-	_stp_runtime_entryfn_put_context(c);
-
-	return len;
+	return total ? total : rc;
 }
 
 static int _stp_ctl_open_cmd(struct inode *inode, struct file *file)
@@ -752,6 +1008,9 @@ static int _stp_ctl_open_cmd(struct inode *inode, struct file *file)
 	__module_get(THIS_MODULE);
 	file->f_op = &_stp_ctl_fops;
 
+	/* until this reader asks for STP_CTL_BATCH */
+	_stp_ctl_batch = 0;
+
 	_stp_attach();
 	return 0;
 }
@@ -774,16 +1033,13 @@ static unsigned _stp_ctl_poll_cmd(struct file *file, poll_table *wait)
 	   which is used by stapio to see whether select
 	   works. */
 	unsigned res = POLLPRI | POLLOUT | POLLWRNORM;
-	unsigned long flags;
 
         poll_wait(file, &_stp_ctl_wq, wait);
 
         /* If there are messages waiting, then there will be
 	   data available to read. */
-	stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	if (! list_empty(&_stp_ctl_ready_q))
+	if (_stp_ctl_pending || ! _stp_ctl_ready_empty())
 		res |= POLLIN | POLLRDNORM;
-	stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
 
 	return res;
 }
@@ -807,16 +1063,75 @@ static struct proc_ops _stp_ctl_proc_ops_cmd = {
 };
 #endif
 
+/* The read-only "stats" file next to .cmd, see session_stats.c. */
+static int _stp_ctl_open_stats(struct inode *inode, struct file *file)
+{
+	return single_open(file, _stp_session_stats_show, NULL);
+}
+
+static struct file_operations _stp_ctl_fops_stats = {
+	.owner = THIS_MODULE,
+	.open = _stp_ctl_open_stats,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+#ifdef STAPCONF_PROC_OPS
+static struct proc_ops _stp_ctl_proc_ops_stats = {
+	.proc_open = _stp_ctl_open_stats,
+	.proc_read = seq_read,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release
+};
+#endif
+
+#ifdef STP_HANDOFF
+/* The "state" file of a --handoff module, see handoff.c. */
+static int _stp_ctl_open_state(struct inode *inode, struct file *file)
+{
+	return single_open(file, _stp_handoff_show, NULL);
+}
+
+static struct file_operations _stp_ctl_fops_state = {
+	.owner = THIS_MODULE,
+	.open = _stp_ctl_open_state,
+	.read = seq_read,
+	.write = _stp_handoff_write,
+	.llseek = seq_lseek,
+	.release = single_release
+};
+#ifdef STAPCONF_PROC_OPS
+static struct proc_ops _stp_ctl_proc_ops_state = {
+	.proc_open = _stp_ctl_open_state,
+	.proc_read = seq_read,
+	.proc_write = _stp_handoff_write,
+	.proc_lseek = seq_lseek,
+	.proc_release = single_release
+};
+#endif
+#endif
+
 static int _stp_register_ctl_channel(void)
 {
-	INIT_LIST_HEAD(&_stp_ctl_ready_q);
+#if STP_WARN_DEDUP_SLOTS > 0
+	unsigned i;
+
+	for (i = 0; i < STP_WARN_DEDUP_SLOTS; i++) {
+		stp_spin_lock_init(&_stp_warn_dedup[i].lock);
+		_stp_warn_dedup[i].len = 0;
+		_stp_warn_dedup[i].repeats = 0;
+	}
+#endif
+	_stp_ctl_ready_stub.next = NULL;
+	_stp_ctl_ready_head = _stp_ctl_ready_tail = &_stp_ctl_ready_stub;
+	_stp_ctl_pending = NULL;
 
 	/* allocate buffers */
 	_stp_pool_q = _stp_mempool_init(sizeof(struct _stp_buffer),
 					STP_DEFAULT_BUFFERS);
 	if (unlikely(_stp_pool_q == NULL))
 		goto err0;
-	_stp_allocated_net_memory += sizeof(struct _stp_buffer) * STP_DEFAULT_BUFFERS;
+	_stp_allocated_net_memory += sizeof(struct _stp_buffer) * _stp_pool_q->num;
 
 	if (unlikely(_stp_ctl_alloc_special_buffers() != 0))
 		goto err0;
@@ -834,15 +1149,15 @@ err0:
 
 static void _stp_unregister_ctl_channel(void)
 {
-	struct _stp_buffer *bptr, *tmp;
+	struct _stp_buffer *bptr;
 
 	_stp_unregister_ctl_channel_fs();
 
 	/* Return memory to pool and free it. */
-	list_for_each_entry_safe(bptr, tmp, &_stp_ctl_ready_q, list) {
-		list_del(&bptr->list);
+	if (_stp_ctl_pending)
+		_stp_ctl_free_buffer(_stp_ctl_pending);
+	while ((bptr = _stp_ctl_ready_pop()) != NULL)
 		_stp_ctl_free_buffer(bptr);
-	}
 	_stp_ctl_free_special_buffers();
 	_stp_mempool_destroy(_stp_pool_q);
 }
@@ -16,8 +16,6 @@
 #include <linux/list.h>
 #include "../stp_helper_lock.h"
 
-static struct list_head _stp_ctl_ready_q;
-static stp_spinlock_t _stp_ctl_ready_lock;
 static wait_queue_head_t _stp_ctl_wq;
 
 struct _stp_buffer {
@@ -28,8 +26,16 @@ struct _stp_buffer {
 };
 
 static struct file_operations _stp_ctl_fops_cmd;
+static struct file_operations _stp_ctl_fops_stats;
 #ifdef STAPCONF_PROC_OPS
 static struct proc_ops _stp_ctl_proc_ops_cmd;
+static struct proc_ops _stp_ctl_proc_ops_stats;
+#endif
+#ifdef STP_HANDOFF
+static struct file_operations _stp_ctl_fops_state;
+#ifdef STAPCONF_PROC_OPS
+static struct proc_ops _stp_ctl_proc_ops_state;
+#endif
 #endif
 
 static int _stp_ctl_send(int type, void *data, unsigned len);
@@ -16,7 +16,7 @@
 
 
 
-/* Always returns zero, we just push all messages on the _stp_ctl_ready_q.  */
+/* Always returns zero, we just push all messages on the ready queue.  */
 inline static int _stp_debugfs_ctl_write_fs(int type, void *data, unsigned len)
 {
 	return 0;
@@ -25,6 +25,10 @@ inline static int _stp_debugfs_ctl_write_fs(int type, void *data, unsigned len)
 static struct dentry *__stp_debugfs_root_dir = NULL;    // DEBUGFS/systemtap/
 static struct dentry *__stp_debugfs_module_dir = NULL;  // DEBUGFS/systemtap/MODULE/
 static struct dentry *_stp_cmd_file = NULL;             // DEBUGFS/systemtap/MODULE/.cmd
+static struct dentry *_stp_stats_file = NULL;           // DEBUGFS/systemtap/MODULE/stats
+#ifdef STP_HANDOFF
+static struct dentry *_stp_state_file = NULL;           // DEBUGFS/systemtap/MODULE/state
+#endif
 
 
 static int _stp_debugfs_register_ctl_channel_fs(void)
@@ -52,11 +56,45 @@ static int _stp_debugfs_register_ctl_channel_fs(void)
 	_stp_cmd_file->d_inode->i_uid = KUIDT_INIT(_stp_uid);
 	_stp_cmd_file->d_inode->i_gid = KGIDT_INIT(_stp_gid);
 
+	/* create [debugfs]/systemtap/module_name/stats; the session
+	   runs on without it.  */
+	_stp_stats_file = debugfs_create_file("stats", 0400, module_dir,
+					      NULL, &_stp_ctl_fops_stats);
+	if (_stp_stats_file == NULL || IS_ERR(_stp_stats_file)) {
+		_stp_stats_file = NULL;
+		errk("Error creating systemtap debugfs stats file.\n");
+	}
+	else {
+		_stp_stats_file->d_inode->i_uid = KUIDT_INIT(_stp_uid);
+		_stp_stats_file->d_inode->i_gid = KGIDT_INIT(_stp_gid);
+	}
+
+#ifdef STP_HANDOFF
+	/* create [debugfs]/systemtap/module_name/state; staprun -O
+	   can't hand over to or from us without it.  */
+	_stp_state_file = debugfs_create_file("state", 0600, module_dir,
+					      NULL, &_stp_ctl_fops_state);
+	if (_stp_state_file == NULL || IS_ERR(_stp_state_file)) {
+		_stp_state_file = NULL;
+		errk("Error creating systemtap debugfs state file.\n");
+	}
+	else {
+		_stp_state_file->d_inode->i_uid = KUIDT_INIT(_stp_uid);
+		_stp_state_file->d_inode->i_gid = KGIDT_INIT(_stp_gid);
+	}
+#endif
+
 	return 0;
 }
 
 static void _stp_debugfs_unregister_ctl_channel_fs(void)
 {
+#ifdef STP_HANDOFF
+	if (_stp_state_file)
+		debugfs_remove(_stp_state_file);
+#endif
+	if (_stp_stats_file)
+		debugfs_remove(_stp_stats_file);
 	if (_stp_cmd_file)
 		debugfs_remove(_stp_cmd_file);
 }
@@ -185,27 +185,11 @@ static void _stp_rmdir_proc_module(void)
 }
 
 
+/* Always returns zero, we just push all messages on the ready queue.
+   (Appending to a queued message would race with its reader now that
+   the queue takes no lock.)  */
 inline static int _stp_procfs_ctl_write_fs(int type, void *data, unsigned len)
 {
-	struct _stp_buffer *bptr;
-	unsigned long flags;
-
-#define WRITE_AGG
-#ifdef WRITE_AGG
-	stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	if (!list_empty(&_stp_ctl_ready_q)) {
-		bptr = (struct _stp_buffer *)_stp_ctl_ready_q.prev;
-		if ((bptr->len + len) <= STP_CTL_BUFFER_SIZE
-		    && type == STP_REALTIME_DATA
-		    && bptr->type == STP_REALTIME_DATA) {
-			memcpy(bptr->buf + bptr->len, data, len);
-			bptr->len += len;
-			stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
-			return len;
-		}
-	}
-	stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
-#endif
 	return 0;
 }
 
@@ -228,6 +212,10 @@ static struct file_operations _stp_ctl_fops_cmd;
 #ifdef STAPCONF_PROC_OPS /* control.c */
 static struct proc_ops _stp_ctl_proc_ops_cmd;
 #endif
+static struct proc_dir_entry *_stp_procfs_stats_file = NULL;
+#ifdef STP_HANDOFF
+static struct proc_dir_entry *_stp_procfs_state_file = NULL;
+#endif
 
 
 static int _stp_procfs_register_ctl_channel_fs(void)
@@ -248,6 +236,34 @@ static int _stp_procfs_register_ctl_channel_fs(void)
 		goto err1;
         proc_set_user(de, KUIDT_INIT(_stp_uid), KGIDT_INIT(_stp_gid));
 
+	/* create /proc/systemtap/module_name/stats; the session runs on
+	   without it.  */
+#ifdef STAPCONF_PROC_OPS
+	de = proc_create("stats", 0400, _stp_procfs_module_dir, &_stp_ctl_proc_ops_stats);
+#else
+	de = proc_create("stats", 0400, _stp_procfs_module_dir, &_stp_ctl_fops_stats);
+#endif
+	if (de == NULL)
+		errk("Error creating systemtap procfs stats file.\n");
+	else
+		proc_set_user(de, KUIDT_INIT(_stp_uid), KGIDT_INIT(_stp_gid));
+	_stp_procfs_stats_file = de;
+
+#ifdef STP_HANDOFF
+	/* create /proc/systemtap/module_name/state; staprun -O can't
+	   hand over to or from us without it.  */
+#ifdef STAPCONF_PROC_OPS
+	de = proc_create("state", 0600, _stp_procfs_module_dir, &_stp_ctl_proc_ops_state);
+#else
+	de = proc_create("state", 0600, _stp_procfs_module_dir, &_stp_ctl_fops_state);
+#endif
+	if (de == NULL)
+		errk("Error creating systemtap procfs state file.\n");
+	else
+		proc_set_user(de, KUIDT_INIT(_stp_uid), KGIDT_INIT(_stp_gid));
+	_stp_procfs_state_file = de;
+#endif
+
 	return 0;
 
 err1:
@@ -258,6 +274,14 @@ err0:
 
 static void _stp_procfs_unregister_ctl_channel_fs(void)
 {
+	if (_stp_procfs_stats_file)
+		remove_proc_entry("stats", _stp_procfs_module_dir);
+	_stp_procfs_stats_file = NULL;
+#ifdef STP_HANDOFF
+	if (_stp_procfs_state_file)
+		remove_proc_entry("state", _stp_procfs_module_dir);
+	_stp_procfs_state_file = NULL;
+#endif
 	remove_proc_entry(".cmd", _stp_procfs_module_dir);
 	_stp_rmdir_proc_module();
 }
@@ -32,12 +32,27 @@
 #include "../linux/timer_compatibility.h"
 #include "../uidgid_compatibility.h"
 #include "relay_compat.h"
+#ifdef STAPCONF_IRQ_WORK
+#include <linux/irq_work.h>
+#endif
 
 #ifndef STP_RELAY_TIMER_INTERVAL
-/* Wakeup timer interval in jiffies (default 1 ms) */
+/* Wakeup timer interval in jiffies while there is output (default 1 ms) */
 #define STP_RELAY_TIMER_INTERVAL		((HZ + 999) / 1000)
 #endif
 
+#ifndef STP_RELAY_TIMER_MAX_INTERVAL
+/* Longest interval the timer backs off to while there is no output
+ * (default 64 ms) */
+#define STP_RELAY_TIMER_MAX_INTERVAL		((HZ + 15) / 16)
+#endif
+
+#ifndef STP_RELAY_WAKEUP_WATERMARK
+/* Percentage of a cpu's sub-buffers which, once full, wake its reader
+ * without waiting for the timer.  0 disables this. */
+#define STP_RELAY_WAKEUP_WATERMARK		50
+#endif
+
 /* Note: if struct _stp_relay_data_type changes, staplog.c might need
  * to be changed. */
 struct _stp_relay_data_type {
@@ -46,9 +61,32 @@ struct _stp_relay_data_type {
 	atomic_t wakeup;
 	struct timer_list timer;
 	int overwrite_flag;
+	atomic_t frozen;		/* output held for a snapshot */
+	unsigned long interval;		/* current timer interval */
+	unsigned watermark;		/* in sub-buffers */
+	atomic_t wakeups;		/* readers woken */
+#ifdef STAPCONF_IRQ_WORK
+	atomic_t urgent;		/* wakeup_work queued */
+	struct irq_work wakeup_work;
+#endif
 };
 struct _stp_relay_data_type _stp_relay_data;
 
+/* Per-cpu buffer accounting, so that uneven load shows up. */
+struct _stp_relay_cpu_stats {
+	atomic_t overruns;		/* full buffer found */
+	unsigned peak;			/* most sub-buffers unread */
+};
+static DEFINE_PER_CPU(struct _stp_relay_cpu_stats, _stp_relay_cpu_stats);
+
+/* When each sub-buffer was started, in jiffies, indexed by cpu and
+ * then sub-buffer, so that a snapshot can leave out older ones. */
+static u64 *_stp_relay_stamps;
+
+/* Room reserved for a struct _stp_subbuf_hdr at the start of each
+ * sub-buffer; nonzero only when stapio reads the buffers via mmap. */
+static size_t _stp_relay_hdr_size;
+
 /* relay_file_operations is const, so .owner is obviously not set there.
  * Below struct, filled in _stp_transport_data_fs_init(), fixes it. */
 static struct file_operations relay_file_operations_w_owner;
@@ -90,12 +128,17 @@ static size_t __stp_relay_switch_subbuf(struct rchan_buf *buf, size_t length)
 	buf->data = new;
 	buf->padding[new_subbuf] = 0;
 
+	/* leave room for any header the callback reserved */
+	if (unlikely(length > buf->chan->subbuf_size - buf->offset))
+		length = buf->chan->subbuf_size - buf->offset;
+
 	return length;
 }
 
 static bool __stp_relay_buf_empty(struct rchan_buf *buf)
 {
-	return !buf->offset && buf->subbufs_produced == buf->subbufs_consumed;
+	return buf->offset <= _stp_relay_hdr_size &&
+		buf->subbufs_produced == buf->subbufs_consumed;
 }
 
 static int __stp_relay_file_open(struct inode *inode, struct file *filp)
@@ -139,10 +182,18 @@ static ssize_t __stp_relay_file_read(struct file *filp, char __user *buffer,
 	struct rchan_buf *buf = filp->private_data;
 	unsigned long flags;
 
-	/* This trylock will only fail after the print driver is destroyed */
-	if (_stp_print_trylock_irqsave(&flags)) {
-		/* Switch out the current buffer if it has any data */
-		if (buf->offset)
+	/*
+	 * Switch out the current buffer if it has any data, but only once
+	 * the reader has caught up.  While there are complete sub-buffers
+	 * left, a reader taking many records per read() is still working
+	 * through a backlog, and switching would cut the one being filled
+	 * short.  A read that ends mid-record resumes there next time.
+	 *
+	 * This trylock will only fail after the print driver is destroyed.
+	 */
+	if (buf->subbufs_produced == buf->subbufs_consumed
+	    && _stp_print_trylock_irqsave(&flags)) {
+		if (buf->offset > _stp_relay_hdr_size)
 			__stp_relay_switch_subbuf(buf, 0);
 		_stp_print_unlock_irqrestore(&flags);
 	}
@@ -161,43 +212,73 @@ static ssize_t __stp_relay_file_read(struct file *filp, char __user *buffer,
 static void __stp_relay_wakeup_readers(struct rchan_buf *buf)
 {
 	if (buf && waitqueue_active(&buf->read_wait) &&
-	    !__stp_relay_buf_empty(buf))
+	    !__stp_relay_buf_empty(buf)) {
+		atomic_inc(&_stp_relay_data.wakeups);
 		wake_up_interruptible(&buf->read_wait);
+	}
 }
 
-static void __stp_relay_wakeup_timer(stp_timer_callback_parameter_t unused)
+static void __stp_relay_wakeup_all_readers(void)
 {
+	struct rchan_buf *buf;
 	int i;
 
+	/* NB it makes no sense to wake up readers on offline CPUs */
+	for_each_online_cpu(i) {
+		buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, i);
+
+		/* relay_open() only initializes bufs on the online CPUs
+		 * at the time of invocation. The online CPUs may
+		 * change at any time, so the current online CPU might
+		 * be offline when relay_open() was called.  so we must
+		 * check if the buf for the current CPU is invalid
+		 * otherwise we may dereference a NULL pointer.
+		 */
+		if (likely(buf))
+			__stp_relay_wakeup_readers(buf);
+	}
+}
+
+/*
+ * The timer wakes readers whenever there has been output since it last
+ * ran.  While there is none it doubles its interval, up to
+ * STP_RELAY_TIMER_MAX_INTERVAL, so that an idle session costs little.
+ */
+static void __stp_relay_wakeup_timer(stp_timer_callback_parameter_t unused)
+{
 	if (atomic_cmpxchg(&_stp_relay_data.wakeup, 1, 0)) {
-		struct rchan_buf *buf;
-
-		/* NB it makes no sense to wake up readers on offline CPUs */
-		for_each_online_cpu(i) {
-			buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf,
-						    i);
-
-			/* relay_open() only initializes bufs on the online CPUs
-			 * at the time of invocation. The online CPUs may
-			 * change at any time, so the current online CPU might
-			 * be offline when relay_open() was called.  so we must
-			 * check if the buf for the current CPU is invalid
-			 * otherwise we may dereference a NULL pointer.
-			 */
-			if (likely(buf))
-				__stp_relay_wakeup_readers(buf);
-		}
+		__stp_relay_wakeup_all_readers();
+		_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
+	} else if (_stp_relay_data.interval < STP_RELAY_TIMER_MAX_INTERVAL) {
+		_stp_relay_data.interval = min_t(unsigned long,
+						 _stp_relay_data.interval * 2,
+						 STP_RELAY_TIMER_MAX_INTERVAL);
 	}
 
 	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
-        	mod_timer(&_stp_relay_data.timer, jiffies + STP_RELAY_TIMER_INTERVAL);
+        	mod_timer(&_stp_relay_data.timer, jiffies + _stp_relay_data.interval);
         else
 		dbug_trans(0, "relay_v2 wakeup timer expiry\n");
 }
 
+#ifdef STAPCONF_IRQ_WORK
+/*
+ * Queued from probe context once a buffer fills past the watermark,
+ * where waking the reader directly isn't safe.
+ */
+static void __stp_relay_wakeup_work(struct irq_work *work)
+{
+	__stp_relay_wakeup_all_readers();
+	/* output is flowing; have the timer pick up the pace again */
+	_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
+	atomic_set(&_stp_relay_data.urgent, 0);
+}
+#endif
+
 static void __stp_relay_timer_init(void)
 {
 	atomic_set(&_stp_relay_data.wakeup, 0);
+	_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
 	timer_setup(&_stp_relay_data.timer, __stp_relay_wakeup_timer, 0);
 	_stp_relay_data.timer.expires = jiffies + STP_RELAY_TIMER_INTERVAL;
 	add_timer(&_stp_relay_data.timer);
@@ -212,6 +293,59 @@ static enum _stp_transport_state _stp_transport_get_state(void)
 static void _stp_transport_data_fs_overwrite(int overwrite)
 {
 	_stp_relay_data.overwrite_flag = overwrite;
+	/* Whoever attached or detached is done with any snapshot. */
+	atomic_set(&_stp_relay_data.frozen, 0);
+}
+
+static int _stp_transport_data_fs_freeze(void)
+{
+	if (!_stp_relay_data.overwrite_flag)
+		return 0;
+	return atomic_cmpxchg(&_stp_relay_data.frozen, 0, 1) == 0;
+}
+
+static int _stp_transport_data_fs_snapshot(unsigned seconds)
+{
+	struct rchan_buf *buf;
+	size_t n, consumed;
+	u64 now, cutoff;
+	int cpu;
+
+	if (!_stp_relay_data.rchan)
+		return -EINVAL;
+
+	/* Hold further output, and let writers already past the check
+	   in _stp_data_write_reserve() finish. */
+	atomic_set(&_stp_relay_data.frozen, 1);
+	stp_synchronize_sched();
+
+	now = get_jiffies_64();
+	if (!seconds || !_stp_relay_stamps || now < (u64) seconds * HZ)
+		return 0;
+	cutoff = now - (u64) seconds * HZ;
+
+	n = _stp_relay_data.rchan->n_subbufs;
+	for_each_possible_cpu(cpu) {
+		buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, cpu);
+		if (unlikely(buf == NULL))
+			continue;
+
+		/* Start from the oldest sub-buffer overwriting has left,
+		   as relay's own read would, and pass over each that was
+		   done with before the cutoff: that is, once the next one
+		   had been started. */
+		consumed = buf->subbufs_consumed;
+		if (buf->subbufs_produced - consumed >= n)
+			consumed = buf->subbufs_produced - n + 1;
+		while (consumed < buf->subbufs_produced
+		       && _stp_relay_stamps[cpu * n + (consumed + 1) % n] < cutoff)
+			consumed++;
+		if (consumed != buf->subbufs_consumed) {
+			buf->subbufs_consumed = consumed;
+			buf->bytes_consumed = 0;
+		}
+	}
+	return 0;
 }
 
 
@@ -223,12 +357,42 @@ static int __stp_relay_subbuf_start_callback(struct rchan_buf *buf,
                                              void *subbuf, void *prev_subbuf,
                                              size_t prev_padding)
 {
-        if (_stp_relay_data.overwrite_flag || !relay_buf_full(buf))
+	struct _stp_relay_cpu_stats *cs = per_cpu_ptr(&_stp_relay_cpu_stats, buf->cpu);
+	unsigned unread = buf->subbufs_produced - buf->subbufs_consumed;
+	struct _stp_subbuf_hdr *hdr;
+
+	if (unread > buf->chan->n_subbufs)	/* overwrite mode */
+		unread = buf->chan->n_subbufs;
+	if (unread > cs->peak)
+		cs->peak = unread;
+
+	/* Mark the previous sub-buffer complete for an mmap reader,
+	 * once its data is visible. */
+	if (_stp_relay_hdr_size && prev_subbuf) {
+		hdr = prev_subbuf;
+		smp_wmb();
+		hdr->padding = prev_padding;
+	}
+
+        if (_stp_relay_data.overwrite_flag || !relay_buf_full(buf)) {
+		if (_stp_relay_stamps)
+			_stp_relay_stamps[buf->cpu * buf->chan->n_subbufs
+					  + ((char *) subbuf - (char *) buf->start)
+					    / buf->chan->subbuf_size]
+				= get_jiffies_64();
+		if (_stp_relay_hdr_size) {
+			hdr = subbuf;
+			hdr->padding = STP_SUBBUF_FILLING;
+			hdr->subbuf_size = buf->chan->subbuf_size;
+			hdr->n_subbufs = buf->chan->n_subbufs;
+			smp_wmb();
+			hdr->produced = buf->subbufs_produced;
+			subbuf_start_reserve(buf, _stp_relay_hdr_size);
+		}
                 return 1;
+	}
         
-#ifdef _STP_USE_DROPPED_FILE
-        atomic_inc(&_stp_relay_data.dropped);
-#endif
+        atomic_inc(&cs->overruns);
         return 0;
 }
 
@@ -286,6 +450,9 @@ static void _stp_transport_data_fs_stop(void)
 	if (atomic_read (&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING) {
 		atomic_set (&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 		del_timer_sync(&_stp_relay_data.timer);
+#ifdef STAPCONF_IRQ_WORK
+		irq_work_sync(&_stp_relay_data.wakeup_work);
+#endif
 		dbug_trans(0, "flushing...\n");
 		if (_stp_relay_data.rchan)
 			relay_flush(_stp_relay_data.rchan);
@@ -299,17 +466,40 @@ static void _stp_transport_data_fs_close(void)
 		relay_close(_stp_relay_data.rchan);
 		_stp_relay_data.rchan = NULL;
 	}
+	if (_stp_relay_stamps) {
+		_stp_vfree(_stp_relay_stamps);
+		_stp_relay_stamps = NULL;
+	}
 }
 
 static int _stp_transport_data_fs_init(void)
 {
-	int rc;
+	int rc, i;
 	u64 npages;
 	struct sysinfo si;
 
 	atomic_set(&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 	_stp_relay_data.overwrite_flag = 0;
+	atomic_set(&_stp_relay_data.frozen, 0);
 	_stp_relay_data.rchan = NULL;
+	atomic_set(&_stp_relay_data.wakeups, 0);
+	for_each_possible_cpu(i) {
+		struct _stp_relay_cpu_stats *cs = per_cpu_ptr(&_stp_relay_cpu_stats, i);
+		atomic_set(&cs->overruns, 0);
+		cs->peak = 0;
+	}
+	_stp_relay_data.watermark = _stp_nsubbufs * STP_RELAY_WAKEUP_WATERMARK / 100;
+	if (STP_RELAY_WAKEUP_WATERMARK && !_stp_relay_data.watermark)
+		_stp_relay_data.watermark = 1;
+#ifdef STAPCONF_IRQ_WORK
+	atomic_set(&_stp_relay_data.urgent, 0);
+	init_irq_work(&_stp_relay_data.wakeup_work, __stp_relay_wakeup_work);
+#endif
+#ifdef STP_BULKMODE
+	/* Only bulk mode files are written out as they are. */
+	if (_stp_relay_mmap)
+		_stp_relay_hdr_size = sizeof(struct _stp_subbuf_hdr);
+#endif
 
 	/* Create "trace" file. */
 	npages = _stp_subbuf_size * _stp_nsubbufs;
@@ -330,6 +520,13 @@ static int _stp_transport_data_fs_init(void)
 		       "log buffer size exceeds free memory(%luMB)\n",
 		       MB(si.freeram));
 	}
+	/* relay_open() starts the first sub-buffers, so this comes first. */
+	_stp_relay_stamps = _stp_vzalloc(sizeof(u64) * nr_cpu_ids * _stp_nsubbufs);
+	if (!_stp_relay_stamps) {
+		rc = -ENOMEM;
+		goto err;
+	}
+
 	relay_file_operations_w_owner = relay_file_operations;
 	relay_file_operations_w_owner.owner = THIS_MODULE;
 	relay_file_operations_w_owner.poll = __stp_relay_file_poll;
@@ -390,6 +587,42 @@ err:
 }
 
 
+/**
+ *	_stp_transport_data_fs_consumed - release sub-buffers read via mmap
+ *	@cpu: cpu whose buffer was read
+ *	@consumed: number of sub-buffers written out since last time
+ *
+ *	Like a read() of the trace file, this also switches out the
+ *	sub-buffer being filled once the reader has caught up, so that
+ *	it need not wait for that one to fill.  That can only be done
+ *	on the buffer's own cpu; stapio pins its reader threads there.
+ */
+static int _stp_transport_data_fs_consumed(unsigned cpu, unsigned consumed)
+{
+	struct rchan_buf *buf;
+	unsigned long flags;
+
+	if (!_stp_relay_hdr_size || !_stp_relay_data.rchan
+	    || cpu >= nr_cpu_ids)
+		return -EINVAL;
+
+	buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, cpu);
+	if (unlikely(buf == NULL))
+		return -EINVAL;
+
+	if (consumed)
+		relay_subbufs_consumed(_stp_relay_data.rchan, cpu, consumed);
+
+	if (buf->subbufs_produced == buf->subbufs_consumed
+	    && _stp_print_trylock_irqsave(&flags)) {
+		if (cpu == smp_processor_id()
+		    && buf->offset > _stp_relay_hdr_size)
+			__stp_relay_switch_subbuf(buf, 0);
+		_stp_print_unlock_irqrestore(&flags);
+	}
+	return 0;
+}
+
 /**
  *      _stp_data_write_reserve - try to reserve size_request bytes
  *      @size_request: number of bytes to attempt to reserve
@@ -422,6 +655,10 @@ _stp_data_write_reserve(size_t size_request, void **entry)
 	if (unlikely(buf == NULL))
 		return -EINVAL;
 
+	/* snapshot() is keeping what's there for stapio to dump. */
+	if (unlikely(atomic_read(&_stp_relay_data.frozen)))
+		return 0;
+
 	if (buf->offset >= buf->chan->subbuf_size) {
 		size_request = __stp_relay_switch_subbuf(buf, size_request);
 		if (!size_request)
@@ -435,6 +672,50 @@ _stp_data_write_reserve(size_t size_request, void **entry)
 	return size_request;
 }
 
+static size_t
+_stp_data_write_reserve_whole(size_t size_request, void **entry)
+{
+	struct rchan_buf *buf;
+
+	if (entry == NULL)
+		return 0;
+
+	buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf,
+				    smp_processor_id());
+	if (unlikely(buf == NULL))
+		return 0;
+
+	if (unlikely(size_request > buf->chan->subbuf_size - _stp_relay_hdr_size))
+		return 0;
+	if (unlikely(atomic_read(&_stp_relay_data.frozen)))
+		return 0;
+
+	if (buf->offset >= buf->chan->subbuf_size) {
+		if (!__stp_relay_switch_subbuf(buf, size_request))
+			return 0;
+	} else if (buf->offset + size_request > buf->chan->subbuf_size) {
+		/* Leave the tail for the caller to fill in pieces. */
+		return 0;
+	}
+	*entry = (char*)buf->data + buf->offset;
+	buf->offset += size_request;
+
+	return size_request;
+}
+
+static void _stp_data_write_unreserve(void *entry, size_t size)
+{
+	struct rchan_buf *buf;
+
+	buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf,
+				    smp_processor_id());
+	if (unlikely(buf == NULL))
+		return;
+
+	if ((char*)entry + size == (char*)buf->data + buf->offset)
+		buf->offset -= size;
+}
+
 static unsigned char *_stp_data_entry_data(void *entry)
 {
 	/* Nothing to do here. */
@@ -443,6 +724,50 @@ static unsigned char *_stp_data_entry_data(void *entry)
 
 static int _stp_data_write_commit(void *entry)
 {
+#ifdef STAPCONF_IRQ_WORK
+	struct rchan_buf *buf;
+#endif
+
 	atomic_set(&_stp_relay_data.wakeup, 1);
+
+#ifdef STAPCONF_IRQ_WORK
+	/* Don't leave a filling buffer to a backed-off timer. */
+	if (!_stp_relay_data.watermark)
+		return 0;
+	buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf,
+				    smp_processor_id());
+	if (likely(buf) && waitqueue_active(&buf->read_wait)
+	    && buf->subbufs_produced - buf->subbufs_consumed >= _stp_relay_data.watermark
+	    && atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING
+	    && !atomic_cmpxchg(&_stp_relay_data.urgent, 0, 1))
+		irq_work_queue(&_stp_relay_data.wakeup_work);
+#endif
+	return 0;
+}
+
+static int _stp_transport_data_fs_stats(int cpu, struct _stp_msg_transport_stats *st)
+{
+	struct _stp_relay_cpu_stats *cs;
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	st->cpu = cpu;
+	st->n_subbufs = _stp_nsubbufs;
+	if (cpu >= 0) {
+		if (cpu >= nr_cpu_ids || !_stp_relay_data.rchan
+		    || !_stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, cpu))
+			return -ENOENT;
+		cs = per_cpu_ptr(&_stp_relay_cpu_stats, cpu);
+		st->peak = cs->peak;
+		st->overruns = atomic_read(&cs->overruns);
+		return 0;
+	}
+
+	st->wakeups = atomic_read(&_stp_relay_data.wakeups);
+	for_each_possible_cpu(i) {
+		cs = per_cpu_ptr(&_stp_relay_cpu_stats, i);
+		st->peak = max(st->peak, cs->peak);
+		st->overruns += atomic_read(&cs->overruns);
+	}
 	return 0;
 }
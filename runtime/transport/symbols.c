@@ -123,6 +123,71 @@ static void _stp_do_relocation(const char __user *buf, size_t count)
   _stp_kmodule_update_address(msg.module, msg.reloc, msg.address);
 }
 
+/* Takes the unwind data stapio sent for a lazy user module, see
+   _stp_lazy_unwind_request(). */
+static int _stp_lazy_unwind_install(const char __user *buf, size_t count)
+{
+  static struct _stp_msg_lazy_unwind_data msg; /* by protocol, never concurrently used */
+  struct _stp_module *m;
+  size_t hdr_off;
+  char *data;
+
+  if (count < sizeof(msg))
+    return -EINVAL;
+  if (copy_from_user(&msg, buf, sizeof(msg)))
+    return -EFAULT;
+  buf += sizeof(msg);
+  count -= sizeof(msg);
+
+  if (msg.index >= _stp_num_modules
+      || msg.eh_frame_len == 0
+      || (size_t) msg.eh_frame_len + msg.unwind_hdr_len > count)
+    return -EINVAL;
+  m = _stp_modules[msg.index];
+  if (m->lazy_unwind != _stp_lazy_requested)
+    return -EINVAL;
+
+  /* Keep the .eh_frame_hdr aligned, after the .eh_frame. */
+  hdr_off = ALIGN((size_t) msg.eh_frame_len, sizeof(long));
+  data = _stp_vzalloc(hdr_off + msg.unwind_hdr_len);
+  if (data == NULL)
+    return -ENOMEM;
+  if (copy_from_user(data, buf, msg.eh_frame_len)
+      || copy_from_user(data + hdr_off, buf + msg.eh_frame_len,
+			msg.unwind_hdr_len)) {
+    _stp_vfree(data);
+    return -EFAULT;
+  }
+
+  dbug_sym(1, "got %u+%u bytes of unwind data for %s\n",
+	   msg.eh_frame_len, msg.unwind_hdr_len, m->path);
+  m->eh_frame = data;
+  m->eh_frame_len = msg.eh_frame_len;
+  m->unwind_hdr = msg.unwind_hdr_len ? data + hdr_off : NULL;
+  m->unwind_hdr_len = msg.unwind_hdr_len;
+  smp_wmb(); /* pairs with _stp_lazy_unwind_ready() */
+  m->lazy_unwind = _stp_lazy_loaded;
+  return 0;
+}
+
+/* Frees what _stp_lazy_unwind_install() took in, once no probe runs. */
+static void _stp_lazy_unwind_free(void)
+{
+  unsigned i;
+
+  for (i = 0; i < _stp_num_modules; i++) {
+    struct _stp_module *m = _stp_modules[i];
+    if (m->lazy_unwind == _stp_lazy_loaded) {
+      m->lazy_unwind = _stp_lazy_requested;
+      _stp_vfree(m->eh_frame);
+      m->eh_frame = NULL;
+      m->eh_frame_len = 0;
+      m->unwind_hdr = NULL;
+      m->unwind_hdr_len = 0;
+    }
+  }
+}
+
 
 
 /* Module section attributes tell us where module sections are/were
@@ -21,6 +21,7 @@
 #include <linux/namei.h>
 #include <linux/delay.h>
 #include <linux/mutex.h>
+#include <linux/seq_file.h>
 #ifdef STAPCONF_LOCKDOWN_DEBUGFS
 #include <linux/security.h>
 #endif
@@ -82,10 +83,20 @@ static unsigned _stp_subbuf_size = PAGE_SIZE;
 static int _stp_bufsize;
 module_param(_stp_bufsize, int, 0);
 MODULE_PARM_DESC(_stp_bufsize, "buffer size");
+static int _stp_relay_mmap;
+module_param(_stp_relay_mmap, int, 0);
+MODULE_PARM_DESC(_stp_relay_mmap, "sub-buffer headers for an mmap reader (bulk mode)");
 
 /* forward declarations */
 static void systemtap_module_exit(void);
 static int systemtap_module_init(void);
+static void _stp_probe_stats_send(void);
+static int _stp_session_stats_show(struct seq_file *m, void *v);
+#ifdef STP_HANDOFF
+static int _stp_handoff_show(struct seq_file *m, void *v);
+static ssize_t _stp_handoff_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos);
+#endif
 
 static int _stp_module_notifier_active = 0;
 static int _stp_module_notifier (struct notifier_block * nb,
@@ -424,6 +435,7 @@ static void _stp_cleanup_and_exit(int send_exit)
 			systemtap_module_exit();
 			dbug_trans(1, "done with systemtap_module_exit\n");
 		}
+		_stp_ctl_warn_flush(1);
 
 		failures = atomic_read(&_stp_transport_failures);
 		if (failures)
@@ -432,6 +444,20 @@ static void _stp_cleanup_and_exit(int send_exit)
 		dbug_trans(1, "*** calling _stp_transport_data_fs_stop ***\n");
 		_stp_transport_data_fs_stop();
 
+		{
+			/* The totals, then any cpu that overran or
+			   came within half of doing so.  */
+			struct _stp_msg_transport_stats st;
+			int cpu;
+			_stp_transport_data_fs_stats(-1, &st);
+			_stp_ctl_send(STP_TRANSPORT_STATS, &st, sizeof(st));
+			for_each_possible_cpu(cpu) {
+				if (_stp_transport_data_fs_stats(cpu, &st) == 0
+				    && (st.overruns || st.peak >= st.n_subbufs / 2))
+					_stp_ctl_send(STP_TRANSPORT_STATS, &st, sizeof(st));
+			}
+		}
+
 		dbug_trans(1, "ctl_send STP_EXIT\n");
 		if (send_exit) {
 			/* send_exit is only set to one if called from
@@ -514,21 +540,8 @@ static void _stp_attach(void)
  */
 static void _stp_ctl_work_callback(stp_timer_callback_parameter_t unused)
 {
-	int do_io = 0;
-	unsigned long flags;
-	struct context* __restrict__ c = NULL;
-
-	/* Prevent probe reentrancy while grabbing probe-used locks.  */
-	c = _stp_runtime_entryfn_get_context();
-
-	stp_spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
-	if (!list_empty(&_stp_ctl_ready_q))
-		do_io = 1;
-	stp_spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
-
-	_stp_runtime_entryfn_put_context(c);
-
-	if (do_io)
+	_stp_ctl_warn_flush(0);
+	if (!_stp_ctl_ready_empty())
 		wake_up_interruptible(&_stp_ctl_wq);
 
 	/* if exit flag is set AND we have finished with systemtap_module_init() */
@@ -550,6 +563,7 @@ static void _stp_transport_close(void)
 		   current->pid);
 	_stp_cleanup_and_exit(0);
 	_stp_unregister_ctl_channel();
+	_stp_lazy_unwind_free();
 	_stp_print_cleanup(); /* Requires the transport, so free this first */
 	_stp_transport_fs_close();
 	_stp_mem_debug_done();
@@ -79,6 +79,7 @@ static gid_t _stp_gid;
 static atomic_t _stp_ctl_attached;
 
 static int _stp_bufsize;
+static int _stp_relay_mmap;
 
 
 enum _stp_transport_state {
@@ -133,10 +134,51 @@ static void _stp_transport_data_fs_close(void);
  * overwrite:		boolean
  *
  * When in overwrite mode and the transport buffers are full, older
- * data gets overwritten.
+ * data gets overwritten.  Either way, this ends any snapshot.
  */
 static void _stp_transport_data_fs_overwrite(int overwrite);
 
+/*
+ * _stp_transport_data_fs_freeze - keep the flight recorder's output
+ *
+ * Called by snapshot().  While in overwrite mode, output from then on
+ * is dropped rather than overwriting what the buffers hold, until
+ * stapio attaches to dump it.  Returns 1 if this froze the buffers,
+ * or 0 if they were frozen already or aren't being overwritten.
+ */
+static int _stp_transport_data_fs_freeze(void);
+
+/*
+ * _stp_transport_data_fs_snapshot - prepare the buffers for a dump
+ * seconds:		how far back to keep, or 0 for everything
+ *
+ * Freezes the buffers as above, and marks as read each sub-buffer
+ * that was finished with more than @seconds ago, so that reading the
+ * trace files then yields the rest.  Returns 0, or -EINVAL if there
+ * are no buffers.
+ */
+static int _stp_transport_data_fs_snapshot(unsigned seconds);
+
+/*
+ * _stp_transport_data_fs_consumed - release sub-buffers read via mmap
+ * cpu:			cpu whose buffer was read
+ * consumed:		number of sub-buffers written out
+ *
+ * Lets the transport reuse sub-buffers that a reader mapping the
+ * buffer has finished with.  Returns 0, or -EINVAL if mmap reading
+ * isn't enabled.
+ */
+static int _stp_transport_data_fs_consumed(unsigned cpu, unsigned consumed);
+
+/*
+ * _stp_transport_data_fs_stats - get transport counters
+ * cpu:			cpu whose buffer to report, or -1 for the totals
+ * st:			counters are returned here
+ *
+ * Returns 0, or -ENOENT if the cpu has no buffer.
+ */
+static int _stp_transport_data_fs_stats(int cpu, struct _stp_msg_transport_stats *st);
+
 /*
  * _stp_data_write_reserve - reserve bytes
  * size_request:	number of bytes to reserve
@@ -167,4 +209,25 @@ static unsigned char *_stp_data_entry_data(void *entry);
  */
 static int _stp_data_write_commit(void *entry);
 
+/*
+ * _stp_data_write_reserve_whole - reserve bytes without splitting
+ * size_request:	number of bytes to reserve
+ * entry:		allocated buffer is returned here
+ *
+ * Like _stp_data_write_reserve(), but either reserves all of
+ * size_request contiguous bytes or nothing, returning 0 when the
+ * request would straddle the end of the current sub-buffer.
+ */
+static size_t _stp_data_write_reserve_whole(size_t size_request, void **entry);
+
+/*
+ * _stp_data_write_unreserve - give back a reservation
+ * entry:		pointer returned by _stp_data_write_reserve_whole()
+ * size:		number of bytes reserved there
+ *
+ * This function returns the bytes to the transport, if no other
+ * reservation has been made since.
+ */
+static void _stp_data_write_unreserve(void *entry, size_t size);
+
 #endif /* _TRANSPORT_TRANSPORT_H_ */
@@ -18,10 +18,14 @@
 #define STP_SYMBOL_NAME_LEN 128
 #define STP_TZ_NAME_LEN 64
 #define STP_REMOTE_URI_LEN 128
+#define STP_LAZY_PATH_LEN 256
+#define STP_LAZY_BUILD_ID_LEN 64
+#define STP_PROBE_STATS_PP_LEN 256
 
 struct _stp_trace {
-	uint32_t sequence;	/* event number */
+	uint32_t sequence;	/* event number, per-cpu in bulk mode */
 	uint32_t pdu_len;	/* length of data after this trace */
+	uint64_t timestamp;	/* trace clock ns, for merging bulk mode files */
 };
 
 /* stp control channel command values */
@@ -70,7 +74,8 @@ enum
         STP_RELOCATION,
 	/** Never used.  deprecated STP_TRANSPORT_VERSION == 1 **/
 	STP_BUF_INFO,
-	/** Never used.  */
+	/** Sent by stapio -m when it has written out sub-buffers it
+	    read through mmap, so the module can reuse them.  */
 	STP_SUBBUFS_CONSUMED,
 	/** Used by the module only when STP_TRANSPORT_VERSION == 1 for
 	    stapio to write realtime data packet to disk.  */
@@ -91,7 +96,33 @@ enum
 	STP_MAX_CMD,
   /** Sent by stapio after having recevied STP_TRANSPORT. Notifies
       the module of the target namespaces pid.*/
-  STP_NAMESPACES_PID
+  STP_NAMESPACES_PID,
+	/** Sent by the module as it stops the transport, with counters
+	    for stapio to report.  */
+	STP_TRANSPORT_STATS,
+	/** Sent by stapio after STP_READY, to read the control channel
+	    in batches: each read() then returns as many messages as fit,
+	    each preceded by its uint32_t length.  Older modules reject
+	    it, and keep to one message per read().  */
+	STP_CTL_BATCH,
+	/** Sent by the module the first time an address falls in a
+	    user module whose unwind data was left out of the module with
+	    stap --lazy-unwind.  stapio sends back the module's .eh_frame
+	    and .eh_frame_hdr, read from the file.  */
+	STP_LAZY_UNWIND,
+	/** Sent by the module while it arms its kprobes after startup
+	    (-DSTP_KPROBES_ASYNC), and once more when it is done, so
+	    stapio can report the progress.  */
+	STP_PROBES_ARMED,
+	/** Sent by stapio -s as it attaches, to freeze the flight
+	    recorder buffers and skip what's older than it asked for,
+	    before dumping the rest.  The buffers go back to overwriting
+	    when it detaches.  */
+	STP_SNAPSHOT,
+	/** Sent by stapio on SIGUSR1, and back by the module for each
+	    of the probes that took the most cycles, then with the
+	    totals.  */
+	STP_PROBE_STATS
 };
 
 #ifdef DEBUG_TRANS
@@ -114,6 +145,12 @@ static const char *_stp_command_name[] = {
 	"STP_PRIVILEGE_CREDENTIALS",
 	"STP_REMOTE_ID",
   "STP_NAMESPACES_PID",
+	"STP_TRANSPORT_STATS",
+	"STP_CTL_BATCH",
+	"STP_LAZY_UNWIND",
+	"STP_PROBES_ARMED",
+	"STP_SNAPSHOT",
+	"STP_PROBE_STATS",
 };
 #endif /* DEBUG_TRANS */
 
@@ -173,3 +210,81 @@ struct _stp_msg_remote_id
         int32_t remote_id;
         char remote_uri[STP_REMOTE_URI_LEN];
 };
+
+/* Transport counters, for the totals and then for each cpu whose
+   buffer came close to filling. module->stapio */
+struct _stp_msg_transport_stats
+{
+	int32_t cpu;		/* -1 for the totals */
+	uint32_t n_subbufs;	/* sub-buffers per cpu */
+	uint32_t peak;		/* most sub-buffers waiting for stapio */
+	uint32_t reserved;
+	uint64_t wakeups;	/* times a reader was woken for new output */
+	uint64_t overruns;	/* times a buffer was found full */
+};
+
+/* Progress of arming the probes after startup. module->stapio */
+struct _stp_msg_probes_armed
+{
+	uint32_t armed;		/* probes registered so far */
+	uint32_t tried;		/* probes attempted so far */
+	uint32_t total;		/* probes to attempt */
+	uint32_t done;		/* nonzero on the last message */
+};
+
+/* Handler runs and cycles of a probe, or of all of them for the
+   totals. module->stapio */
+struct _stp_msg_probe_stats
+{
+	int32_t index;		/* of the probe, -1 for the totals */
+	uint32_t enabled;	/* zero if the module keeps no stats */
+	uint32_t probes;	/* that ran, in the totals */
+	uint32_t reserved;
+	uint64_t runs;
+	uint64_t cycles;
+	char pp[STP_PROBE_STATS_PP_LEN];
+};
+
+/* Unwind data wanted for a user module. module->stapio */
+struct _stp_msg_lazy_unwind
+{
+	uint32_t index;		/* of the module in _stp_modules */
+	uint32_t build_id_len;	/* 0 if the file is not to be checked */
+	unsigned char build_id[STP_LAZY_BUILD_ID_LEN];
+	char path[STP_LAZY_PATH_LEN];
+};
+
+/* The reply, followed by the .eh_frame and the .eh_frame_hdr
+   contents. stapio->module */
+struct _stp_msg_lazy_unwind_data
+{
+	uint32_t index;
+	uint32_t eh_frame_len;
+	uint32_t unwind_hdr_len;
+	uint32_t reserved;
+};
+
+/* How much of the buffers a snapshot dumps. stapio->module */
+struct _stp_msg_snapshot
+{
+	uint32_t seconds;	/* the last this many seconds of output */
+};
+
+/* Sub-buffers written out by an mmap reader. stapio->module */
+struct _stp_msg_consumed
+{
+	uint32_t cpu;
+	uint32_t consumed;	/* number of sub-buffers since the last message */
+};
+
+/* In bulk mode with stapio -m, each relay sub-buffer starts with this
+   header, so the reader can tell from the mapping alone which
+   sub-buffers are complete and how much of each holds data.  */
+struct _stp_subbuf_hdr
+{
+	uint32_t produced;	/* sequence number of this sub-buffer */
+	uint32_t padding;	/* unused bytes at its end, once complete */
+	uint32_t subbuf_size;
+	uint32_t n_subbufs;
+};
+#define STP_SUBBUF_FILLING 0xffffffff	/* padding while not complete */
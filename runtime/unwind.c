@@ -1163,13 +1163,61 @@ divzero:
 #undef	POP
 }
 
+#if STP_UNWIND_CACHE_SIZE > 0
+static DEFINE_PER_CPU(unsigned long, _stp_unwind_cache_hits);
+static DEFINE_PER_CPU(unsigned long, _stp_unwind_cache_misses);
+
+/* The cache entry for a pc (relative to base) with the unwind rules
+ * of table. */
+static struct unwind_rules *_stp_unwind_cached(struct unwind_context *context,
+					       const void *table,
+					       unsigned long pc)
+{
+	unsigned long h = pc ^ ((unsigned long) table >> 4);
+
+	h ^= h >> 7;
+	h ^= h >> 13;
+	return &context->cache[h & (STP_UNWIND_CACHE_SIZE - 1)];
+}
+
+/* Report how well the unwind rules caches did, with -t. */
+static void _stp_unwind_cache_report(void)
+{
+	unsigned long hits = 0, misses = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		hits += per_cpu(_stp_unwind_cache_hits, cpu);
+		misses += per_cpu(_stp_unwind_cache_misses, cpu);
+	}
+	if (hits || misses)
+		_stp_printf("----- unwind cache: %lu hits, %lu misses\n",
+			    hits, misses);
+}
+#endif
+
+/* Read a saved register of a user frame out of the stack window of
+   the context.  Returns nonzero if it has to be read from the stack. */
+static inline int _stp_unwind_window_read(struct unwind_context *context,
+					  int user, void *dst,
+					  unsigned long addr, size_t size)
+{
+#if STP_STACK_WINDOW > 0
+	if (user)
+		return _stp_stack_window_read(context->window, dst, addr, size);
+#endif
+	return -1;
+}
+
 /* Unwind to previous to frame.  Returns 0 if successful, negative
  * number in case of an error.  A positive return means unwinding is finished;
- * don't try to fallback to dumping addresses on the stack. */
+ * don't try to fallback to dumping addresses on the stack.
+ * base is where the module is mapped, for user modules, so that the
+ * cached rules of a pc hold in every process that maps it. */
 static int unwind_frame(struct unwind_context *context,
 			struct _stp_module *m, struct _stp_section *s,
 			void *table, uint32_t table_len, int is_ehframe,
-			int user, int compat_task)
+			int user, int compat_task, unsigned long base)
 {
 	const u32 *fde = NULL, *cie = NULL;
 	/* The start and end of the CIE CFI instructions. */
@@ -1184,6 +1232,9 @@ static int unwind_frame(struct unwind_context *context,
 	uleb128_t retAddrReg = 0;
 	struct uw_state *state = &context->state;
 	unsigned long addr;
+#if STP_UNWIND_CACHE_SIZE > 0
+	struct unwind_rules *rules;
+#endif
 
 	if (unlikely(table_len == 0)) {
 		// Don't _stp_warn about this, debug_frame and/or eh_frame
@@ -1196,6 +1247,19 @@ static int unwind_frame(struct unwind_context *context,
 		goto err;
 	}
 
+#if STP_UNWIND_CACHE_SIZE > 0
+	rules = _stp_unwind_cached(context, table, pc - base);
+	if (rules->table == table && rules->pc == pc - base) {
+		__this_cpu_inc(_stp_unwind_cache_hits);
+		state->stackDepth = 0;
+		memcpy(&REG_STATE, &rules->rs, sizeof(REG_STATE));
+		retAddrReg = rules->retAddrReg;
+		frame->call_frame = rules->call_frame;
+		goto apply_rules;
+	}
+	__this_cpu_inc(_stp_unwind_cache_misses);
+#endif
+
 	/* Sets all rules to default Same value. */
 	memset(state, 0, sizeof(*state));
 
@@ -1307,6 +1371,14 @@ static int unwind_frame(struct unwind_context *context,
 	    || REG_STATE.regs[retAddrReg].where == Nowhere)
 		goto err;
 
+#if STP_UNWIND_CACHE_SIZE > 0
+	rules->table = table;
+	rules->pc = pc - base;
+	memcpy(&rules->rs, &REG_STATE, sizeof(rules->rs));
+	rules->retAddrReg = retAddrReg;
+	rules->call_frame = call_frame;
+apply_rules:
+#endif
 	/* update frame */
 	if (REG_STATE.cfa_is_expr) {
 		if (compute_expr(REG_STATE.cfa_expr, frame, &cfa, user, compat_task))
@@ -1440,7 +1512,9 @@ static int unwind_frame(struct unwind_context *context,
 			   for 32-on-64 bit unwinding we need to ensure this is 0xFFFFFFFF */
 			switch (reg_info[i].width) {
 #define CASE(n)     case sizeof(u##n):					\
-				if (unlikely(_stp_deref_nofault(FRAME_REG(i, u##n), sizeof(u##n), (u##n *)addr, \
+				if (_stp_unwind_window_read(context, user, &FRAME_REG(i, u##n), \
+							    addr, sizeof(u##n)) \
+				    && unlikely(_stp_deref_nofault(FRAME_REG(i, u##n), sizeof(u##n), (u##n *)addr, \
 								(user ? STP_USER_DS : STP_KERNEL_DS)))) \
 					goto copy_failed;		\
 				if (compat_task) FRAME_REG(i, u##n) &= 0xFFFFFFFF; \
@@ -1480,6 +1554,7 @@ static int unwind(struct unwind_context *context, int user)
 	struct unwind_frame_info *frame = &context->info;
 	unsigned long pc = UNW_PC(frame) - frame->call_frame;
 	int res;
+	unsigned long base = 0;
         const char *module_name = 0;
 	/* compat_task is a flag for 32bit process unwinding on a 64-bit
 	   architecture.  If this flag is set, it means a mapping of
@@ -1495,7 +1570,7 @@ static int unwind(struct unwind_context *context, int user)
 
 	if (user)
 	  {
-	    m = _stp_umod_lookup (pc, current, & module_name, NULL, NULL, NULL);
+	    m = _stp_umod_lookup (pc, current, & module_name, NULL, &base, NULL);
 	    if (m)
 	      s = &m->sections[0];
 	  }
@@ -1533,11 +1608,11 @@ static int unwind(struct unwind_context *context, int user)
 
 	dbug_unwind(1, "trying debug_frame\n");
 	res = unwind_frame (context, m, s, m->debug_frame,
-			    m->debug_frame_len, 0, user, compat_task);
-	if (res != 0) {
+			    m->debug_frame_len, 0, user, compat_task, base);
+	if (res != 0 && _stp_lazy_unwind_ready(m)) {
 	  dbug_unwind(1, "debug_frame failed: %d, trying eh_frame\n", res);
 	  res = unwind_frame (context, m, s, m->eh_frame,
-			      m->eh_frame_len, 1, user, compat_task);
+			      m->eh_frame_len, 1, user, compat_task, base);
 	}
 
         /* This situation occurs where some unwind data was found, but
@@ -13,8 +13,7 @@
 #ifndef _STP_UNWIND_H_
 #define _STP_UNWIND_H_
 
-// portions of code needed by the debug_line decoder
-#if defined(STP_USE_DWARF_UNWINDER) || defined(STP_NEED_LINE_DATA)
+#if defined(STP_USE_DWARF_UNWINDER)
 
 struct unwind_frame_info
 {
@@ -217,7 +216,7 @@ static unsigned long read_pointer(const u8 **pLoc, const void *end, signed ptrTy
 	return read_ptr_sect(pLoc, end, ptrType, 0, 0, user, compat_task, 0);
 }
 
-#endif /* defined(STP_USE_DWARF_UNWINDER) || defined(STP_NEED_LINE_DATA) */
+#endif /* defined(STP_USE_DWARF_UNWINDER) */
 
 #ifdef STP_USE_DWARF_UNWINDER
 
@@ -504,9 +503,32 @@ struct uw_state {
 	struct unwind_item cie_regs[ARRAY_SIZE(reg_info)];
 };
 
+/* Number of pcs, a power of two, whose unwind rules each unwind
+   context remembers, so that unwinding through them again needs no
+   search for their FDE nor CFI interpretation.  0 turns it off. */
+#ifndef STP_UNWIND_CACHE_SIZE
+#define STP_UNWIND_CACHE_SIZE 64
+#endif
+#if STP_UNWIND_CACHE_SIZE & (STP_UNWIND_CACHE_SIZE - 1)
+#error "STP_UNWIND_CACHE_SIZE must be a power of two"
+#endif
+
+/* The rules that processing the CFI of a pc gave. */
+struct unwind_rules {
+	const void *table;	/* eh_frame or debug_frame, NULL if unused */
+	unsigned long pc;	/* from the start of its mapping, for users */
+	struct unwind_reg_state rs;
+	uleb128_t retAddrReg;
+	int call_frame;
+};
+
 struct unwind_context {
     struct unwind_frame_info info;
     struct uw_state state;
+#if STP_UNWIND_CACHE_SIZE > 0
+    struct unwind_rules cache[STP_UNWIND_CACHE_SIZE];
+#endif
+    struct stack_window *window; /* copy of the user stack, or NULL */
 };
 
 static const struct cfa badCFA = { ARRAY_SIZE(reg_info), 1 };
@@ -526,6 +548,40 @@ struct unwind_cache {
 	} state;
 	unsigned depth; /* pc[0..(depth-1)] contains valid entries */
 	unsigned long pc[MAXBACKTRACE];
+	unsigned long fp; /* next frame record, for frame pointer walks */
+};
+
+/* Bytes of the user stack above the stack pointer that are copied
+   at once at the start of each user backtrace, so that the saved
+   registers and frame records in them need no single reads.  0 turns
+   it off, as it is for dyninst, which reads the stack directly. */
+#ifndef STP_STACK_WINDOW
+#if defined(__KERNEL__)
+#define STP_STACK_WINDOW 4096
+#else
+#define STP_STACK_WINDOW 0
+#endif
+#endif
+
+#if STP_STACK_WINDOW > 0
+struct stack_window {
+	unsigned long base;	/* user address of buf[0] */
+	unsigned long len;	/* bytes of buf holding the stack */
+	unsigned char buf[STP_STACK_WINDOW];
 };
 
+/* Copy size bytes at user address addr out of the window.  Returns 0,
+   or -1 if they are not all in it. */
+static inline int _stp_stack_window_read(const struct stack_window *w,
+					 void *dst, unsigned long addr,
+					 size_t size)
+{
+	if (w == NULL || addr < w->base || addr - w->base > w->len
+	    || size > w->len - (addr - w->base))
+		return -1;
+	memcpy(dst, w->buf + (addr - w->base), size);
+	return 0;
+}
+#endif
+
 #endif /*_STP_UNWIND_H_*/
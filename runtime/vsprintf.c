@@ -13,6 +13,7 @@
 #define _VSPRINTF_C_
 
 #include "print.h"
+#include "vsprintf_number.h"
 
 static int skip_atoi(const char **s)
 {
@@ -30,12 +31,8 @@ noinline static char *
 number(char * buf, char * end, uint64_t num, int base, int size, int precision, enum print_flag type)
 {
 	char c,sign,tmp[66];
-	const char *digits;
-	static const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-	static const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-	int i;
+	int i, j;
 
-	digits = (type & STP_LARGE) ? large_digits : small_digits;
 	if (type & STP_LEFT)
 		type &= ~STP_ZEROPAD;
 	if (base < 2 || base > 36)
@@ -61,11 +58,8 @@ number(char * buf, char * end, uint64_t num, int base, int size, int precision,
 		else if (base == 8)
 			size--;
 	}
-	i = 0;
-	if (num == 0)
-		tmp[i++]='0';
-	else while (num != 0)
-		tmp[i++] = digits[do_div(num,base)];
+	i = _stp_number_digits(num, base);
+	_stp_number_fill(tmp + i, num, base, type & STP_LARGE);
 	if (i > precision)
 		precision = i;
 	size -= precision;
@@ -91,7 +85,7 @@ number(char * buf, char * end, uint64_t num, int base, int size, int precision,
 				*buf = '0';
 			++buf;
 			if (buf <= end)
-				*buf = digits[33];
+				*buf = (type & STP_LARGE) ? 'X' : 'x';
 			++buf;
 		}
 	}
@@ -107,9 +101,9 @@ number(char * buf, char * end, uint64_t num, int base, int size, int precision,
 			*buf = '0';
 		++buf;
 	}
-	while (i-- > 0) {
+	for (j = 0; j < i; j++) {
 		if (buf <= end)
-			*buf = tmp[i];
+			*buf = tmp[j];
 		++buf;
 	}
 	while (size-- > 0) {
@@ -127,18 +121,13 @@ number(char * buf, char * end, uint64_t num, int base, int size, int precision,
  */
 noinline static int
 number_size(uint64_t num, int base, int size, int precision, enum print_flag type) {
-    char c,sign,tmp[66];
-    const char *digits;
-    static const char small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-    static const char large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+    char sign;
     int i, num_bytes = 0;
 
-    digits = (type & STP_LARGE) ? large_digits : small_digits;
     if (type & STP_LEFT)
             type &= ~STP_ZEROPAD;
     if (base < 2 || base > 36)
             return 0;
-    c = (type & STP_ZEROPAD) ? '0' : ' ';
     sign = 0;
     if (type & STP_SIGN) {
             if ((int64_t) num < 0) {
@@ -159,11 +148,7 @@ number_size(uint64_t num, int base, int size, int precision, enum print_flag typ
             else if (base == 8)
                     size--;
     }
-    i = 0;
-    if (num == 0)
-            tmp[i++]='0';
-    else while (num != 0)
-            tmp[i++] = digits[do_div(num,base)];
+    i = _stp_number_digits(num, base);
     if (i > precision)
             precision = i;
     size -= precision;
@@ -200,6 +185,46 @@ number_size(uint64_t num, int base, int size, int precision, enum print_flag typ
 
 }
 
+/*
+ * Fast paths for the compiled printf conversions that take no width or
+ * precision: %d, %u, %x, %X and %p.  Called with a constant base and
+ * flags, they inline down to the digit count and conversion of
+ * vsprintf_number.h, instead of running number()'s general padding
+ * logic twice.  _stp_fast_number() writes exactly the len bytes that
+ * _stp_fast_number_size() returned.
+ */
+static inline int
+_stp_fast_number_size(uint64_t num, int base, enum print_flag type)
+{
+	int n = 0;
+
+	if ((type & STP_SIGN) && (int64_t) num < 0) {
+		num = - (int64_t) num;
+		n++;
+	}
+	if ((type & STP_SPECIAL) && base == 16)
+		n += 2;
+	return n + _stp_number_digits(num, base);
+}
+
+static inline char *
+_stp_fast_number(char *str, uint64_t num, int len, int base,
+		 enum print_flag type)
+{
+	if ((type & STP_SIGN) && (int64_t) num < 0) {
+		*str++ = '-';
+		num = - (int64_t) num;
+		len--;
+	}
+	if ((type & STP_SPECIAL) && base == 16) {
+		*str++ = '0';
+		*str++ = (type & STP_LARGE) ? 'X' : 'x';
+		len -= 2;
+	}
+	_stp_number_fill(str + len, num, base, type & STP_LARGE);
+	return str + len;
+}
+
 
 /*
  * Output one character into the buffer.  Usually this is just a
@@ -940,4 +965,55 @@ err_unlock:
 	return 0;
 }
 
+static char *_stp_binary_record_hdr(char *str, uint32_t id, int num_bytes)
+{
+	uint32_t len = num_bytes - STP_BINARY_RECORD_HDR_SIZE;
+
+	*str++ = '\0';
+	*str++ = 'E';
+	memcpy(str, &id, sizeof(id));
+	memcpy(str + sizeof(id), &len, sizeof(len));
+	return str + sizeof(id) + sizeof(len);
+}
+
+static char *_stp_binary_record_int64(char *str, int64_t val)
+{
+	memcpy(str, &val, sizeof(val));
+	return str + sizeof(val);
+}
+
+static char *_stp_binary_record_string(char *str, const char *s, uint32_t len)
+{
+	memcpy(str, &len, sizeof(len));
+	memcpy(str + sizeof(len), s, len);
+	return str + sizeof(len) + len;
+}
+
+/** Write the schema records for binary printf, one per format.
+ * This has to precede any of their event records in the output.
+ */
+static void _stp_print_binary_schema(const char * const *formats, unsigned n)
+{
+	unsigned long flags;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		uint32_t len = strlen(formats[i]);
+		char *str;
+
+		if (!_stp_print_trylock_irqsave(&flags))
+			return;
+		str = _stp_reserve_bytes(STP_BINARY_RECORD_HDR_SIZE + len);
+		if (str) {
+			*str++ = '\0';
+			*str++ = 'S';
+			memcpy(str, &i, sizeof(uint32_t));
+			memcpy(str + sizeof(uint32_t), &len, sizeof(len));
+			memcpy(str + 2 * sizeof(uint32_t), formats[i], len);
+		}
+		_stp_print_unlock_irqrestore(&flags);
+	}
+	_stp_print_flush();
+}
+
 #endif /* _VSPRINTF_C_ */
@@ -17,6 +17,10 @@ static char *number(char * buf, char * end, uint64_t num, int base,
 		    int size, int precision, enum print_flag type);
 static int number_size(uint64_t num, int base, int size, int precision,
 		       enum print_flag type);
+static inline int _stp_fast_number_size(uint64_t num, int base,
+					enum print_flag type);
+static inline char *_stp_fast_number(char *str, uint64_t num, int len,
+				     int base, enum print_flag type);
 
 static char *_stp_vsprint_char(char * str, char * end, char c,
 			       int width, enum print_flag flags);
@@ -36,6 +40,18 @@ static int _stp_vsprint_binary_size(int64_t num, int width, int precision);
 static int _stp_vsnprintf(char *buf, size_t size, const char *fmt,
 			  va_list args);
 
+/* Binary printf records (stap --output-format=binary), which stap-decode
+ * turns back into text.  Each starts with a NUL byte and a type byte:
+ *   'S' u32 id, u32 len, len bytes of format string
+ *   'E' u32 id, u32 len, len bytes of arguments, each either an int64
+ *       or, for %s, a u32 length and that many bytes. */
+#define STP_BINARY_RECORD_HDR_SIZE (2 + 2 * sizeof(uint32_t))
+
+static char *_stp_binary_record_hdr(char *str, uint32_t id, int num_bytes);
+static char *_stp_binary_record_int64(char *str, int64_t val);
+static char *_stp_binary_record_string(char *str, const char *s, uint32_t len);
+static void _stp_print_binary_schema(const char * const *formats, unsigned n);
+
 #include "transport/transport.h"
 
 #endif /* _STP_VSPRINTF_H_ */
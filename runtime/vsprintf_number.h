@@ -0,0 +1,107 @@
+/* -*- linux-c -*-
+ * Digit conversion for vsprintf.c
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ */
+#ifndef _VSPRINTF_NUMBER_H_
+#define _VSPRINTF_NUMBER_H_
+
+/*
+ * The digits of a number, for number() and the compiled printf fast
+ * paths.  Bases 8 and 16 take shifts and masks, base 10 two digits per
+ * division by way of a table, and the digit count needs no conversion
+ * at all.  Besides uint64_t, this only needs do_div(), so that
+ * testsuite/systemtap.printf/number_bench.c can build it in user space.
+ */
+
+static const uint64_t _stp_pow10[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL,
+	10000000000000000000ULL
+};
+
+static const char _stp_dec_pairs[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const char _stp_small_digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+static const char _stp_large_digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+/* The number of digits of num in base, at least one. */
+static inline int _stp_number_digits(uint64_t num, int base)
+{
+	/* NB: num | 1 has as many digits as num, but is never 0. */
+	int bits = 64 - __builtin_clzll(num | 1);
+	int n;
+
+	switch (base) {
+	case 16:
+		return (bits + 3) >> 2;
+	case 8:
+		return (bits + 2) / 3;
+	case 10:
+		/* 1233/4096 is just over log10(2) */
+		n = (bits * 1233) >> 12;
+		return n + ((num | 1) >= _stp_pow10[n]);
+	default:
+		n = 1;
+		while (num >= (uint64_t) base) {
+			do_div(num, base);
+			n++;
+		}
+		return n;
+	}
+}
+
+/* Write the digits of num in base so that they end just before end,
+   as counted by _stp_number_digits(). */
+static inline void _stp_number_fill(char *end, uint64_t num, int base,
+				    int large)
+{
+	const char *digits = large ? _stp_large_digits : _stp_small_digits;
+	unsigned r;
+
+	switch (base) {
+	case 16:
+		do {
+			*--end = digits[num & 15];
+			num >>= 4;
+		} while (num);
+		break;
+	case 8:
+		do {
+			*--end = '0' + (num & 7);
+			num >>= 3;
+		} while (num);
+		break;
+	case 10:
+		while (num >= 100) {
+			r = do_div(num, 100);
+			*--end = _stp_dec_pairs[2 * r + 1];
+			*--end = _stp_dec_pairs[2 * r];
+		}
+		if (num >= 10) {
+			*--end = _stp_dec_pairs[2 * num + 1];
+			*--end = _stp_dec_pairs[2 * num];
+		} else
+			*--end = '0' + num;
+		break;
+	default:
+		do {
+			*--end = digits[do_div(num, base)];
+		} while (num);
+		break;
+	}
+}
+
+#endif /* _VSPRINTF_NUMBER_H_ */
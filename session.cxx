@@ -42,6 +42,7 @@ extern "C" {
 #include <unistd.h>
 #include <sys/wait.h>
 #include <wordexp.h>
+#include <fnmatch.h>
 }
 
 #if HAVE_NSS
@@ -69,6 +70,7 @@ systemtap_session::systemtap_session ():
   runtime_mode(kernel_runtime),
   base_hash(0),
   pattern_root(new match_node),
+  opt_local_counter (0),
   dfa_counter (0),
   dfa_maxmap (0),
   dfa_maxtag (0),
@@ -151,11 +153,15 @@ systemtap_session::systemtap_session ():
   use_cache = true;
   use_script_cache = true;
   poison_cache = false;
+  remote_cache_url = "";
+  remote_cache_hit = false;
   tapset_compile_coverage = false;
   need_uprobes = false;
   need_unwind = false;
+  need_user_unwind = false;
   need_symbols = false;
   need_lines = false;
+  need_stack_ids = false;
   uprobes_path = "";
   load_only = false;
   skip_badvars = false;
@@ -187,8 +193,17 @@ systemtap_session::systemtap_session ():
   interactive_mode = false;
   run_example = false;
   no_global_var_display = false;
+  binary_output = false;
+  defer_symbols = false;
+  lazy_unwind = false;
+  handoff = false;
+  pgo = false;
+  warm_kernel_dw = 0;
   pass_1a_complete = false;
+  library_stub_base = 0;
+  library_aliases_registered = false;
   timeout = 0;
+  jobs = 1;
   use_bpf_raw_tracepoint = false;
   symbol_resolver = 0;
 
@@ -270,6 +285,7 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   base_hash(0),
   pattern_root(new match_node),
   user_files (other.user_files),
+  opt_local_counter(0),
   dfa_counter(0),
   dfa_maxmap(0),
   dfa_maxtag (0),
@@ -350,11 +366,15 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   use_cache = other.use_cache;
   use_script_cache = other.use_script_cache;
   poison_cache = other.poison_cache;
+  remote_cache_url = other.remote_cache_url;
+  remote_cache_hit = false;
   tapset_compile_coverage = other.tapset_compile_coverage;
   need_uprobes = false;
   need_unwind = false;
+  need_user_unwind = false;
   need_symbols = false;
   need_lines = false;
+  need_stack_ids = false;
   uprobes_path = "";
   load_only = other.load_only;
   skip_badvars = other.skip_badvars;
@@ -379,8 +399,19 @@ systemtap_session::systemtap_session (const systemtap_session& other,
   interactive_mode = other.interactive_mode;
   run_example = other.run_example;
   no_global_var_display = other.no_global_var_display;
+  binary_output = other.binary_output;
+  defer_symbols = other.defer_symbols;
+  lazy_unwind = other.lazy_unwind;
+  handoff = other.handoff;
+  handoff_module = other.handoff_module;
+  pgo = other.pgo;
+  pgo_report = other.pgo_report;
+  warm_kernel_dw = 0;
   pass_1a_complete = other.pass_1a_complete;
+  library_stub_base = 0;
+  library_aliases_registered = false;
   timeout = other.timeout;
+  jobs = other.jobs;
   // don't bother copy typequery_memo
 
   include_path = other.include_path;
@@ -428,6 +459,8 @@ systemtap_session::~systemtap_session ()
   remove_tmp_dir();
   delete_map(subsessions);
   delete pattern_root;
+  for (unsigned i = 0; i < library_stubs.size(); ++i)
+    delete library_stubs[i];
 }
 
 const string
@@ -726,6 +759,32 @@ systemtap_session::usage (int exitcode)
     "              save uprobes.ko to current directory if it is built from source\n"
     "   --target-namespace=PID\n"
     "              sets the target namespaces pid to PID\n"
+    "   --jobs=N   use up to N threads for parallelizable pass-2/3 work\n"
+    "   --remote-cache=URL\n"
+    "              fetch and store signed modules in a shared cache at URL\n"
+    "   --output-format=text|binary\n"
+    "              have printf write binary records, for stap-decode\n"
+    "   --defer-symbols\n"
+    "              print raw backtrace addresses, for stap-symbolize\n"
+    "   --lazy-unwind\n"
+    "              load user unwind data through stapio when first used\n"
+    "   --pgo[=REPORT]\n"
+    "              use the hits in the coverage database, after adding\n"
+    "              those of a -t REPORT, to lay out the generated code\n"
+    "   --compile-daemon=SOCKET\n"
+    "              keep the kernel debuginfo open and translate scripts\n"
+    "              for --use-compile-daemon clients connecting to SOCKET\n"
+    "   --use-compile-daemon=SOCKET\n"
+    "              run this stap command in the daemon at SOCKET\n"
+    "   --time-trace=FILE\n"
+    "              write the time spent per pass, probe point, file and\n"
+    "              compilation unit to FILE, in the Chrome trace format\n"
+    "   --hwtrace=FILE\n"
+    "              record the control flow of the -c/-x target process\n"
+    "              with Intel PT or CoreSight into FILE\n"
+    "   --handoff[=MODULE]\n"
+    "              build a module that can hand its globals over to the\n"
+    "              next version of the script, and take over from MODULE\n"
 #if HAVE_MONITOR_LIBS
     "   --monitor=INTERVAL\n"
     "              enables runtime interactive monitoring\n"
@@ -1278,6 +1337,18 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  poison_cache = true;
 	  break;
 
+	case LONG_OPT_REMOTE_CACHE:
+	  if (client_options) {
+	    cerr << _F("ERROR: %s is invalid with %s", "--remote-cache", "--client-options") << endl;
+	    return 1;
+	  }
+	  assert(optarg);
+	  remote_cache_url = optarg;
+	  // Keys are appended as path components.
+	  while (!remote_cache_url.empty() && remote_cache_url.back() == '/')
+	    remote_cache_url.pop_back();
+	  break;
+
 	case LONG_OPT_CLEAN_CACHE:
 	  if (client_options) {
 	    cerr << _F("ERROR: %s is invalid with %s", "--clean-cache", "--client-options") << endl;
@@ -1679,6 +1750,91 @@ systemtap_session::parse_cmdline (int argc, char * const argv [])
 	  no_global_var_display = true;
 	  break;
 
+        case LONG_OPT_JOBS:
+          assert(optarg);
+          if (!strcmp(optarg, "auto"))
+            jobs = max(thread::hardware_concurrency(), 1U);
+          else
+            {
+              jobs = (unsigned) strtoul(optarg, &num_endptr, 10);
+              if (*num_endptr != '\0' || jobs < 1)
+                {
+                  cerr << _("Invalid --jobs value (should be a positive number or 'auto').") << endl;
+                  return 1;
+                }
+            }
+          break;
+
+        case LONG_OPT_OUTPUT_FORMAT:
+          assert(optarg);
+          if (!strcmp(optarg, "text"))
+            binary_output = false;
+          else if (!strcmp(optarg, "binary"))
+            binary_output = true;
+          else
+            {
+              cerr << _F("Invalid argument '%s' for --output-format.", optarg) << endl;
+              return 1;
+            }
+          break;
+
+        case LONG_OPT_DEFER_SYMBOLS:
+          defer_symbols = true;
+          break;
+
+        case LONG_OPT_LAZY_UNWIND:
+          lazy_unwind = true;
+          break;
+
+        case LONG_OPT_PGO:
+#ifdef HAVE_LIBSQLITE3
+          pgo = true;
+          if (optarg)
+            pgo_report = optarg;
+          // The profile is not part of the script hash.
+          use_script_cache = false;
+#else
+          cerr << _("Coverage database not available without libsqlite3") << endl;
+          return 1;
+#endif
+          break;
+
+        case LONG_OPT_COMPILE_DAEMON:
+        case LONG_OPT_USE_COMPILE_DAEMON:
+          if (client_options) {
+            cerr << _F("ERROR: %s is invalid with %s",
+                       (grc == LONG_OPT_COMPILE_DAEMON
+                        ? "--compile-daemon" : "--use-compile-daemon"),
+                       "--client-options") << endl;
+            return 1;
+          }
+          assert(optarg);
+          if (grc == LONG_OPT_COMPILE_DAEMON)
+            compile_daemon = optarg;
+          else
+            use_compile_daemon = optarg;
+          break;
+
+        case LONG_OPT_TIME_TRACE:
+          if (client_options) {
+            cerr << _F("ERROR: %s is invalid with %s", "--time-trace", "--client-options") << endl;
+            return 1;
+          }
+          assert(optarg);
+          time_trace_file = optarg;
+          break;
+
+        case LONG_OPT_HWTRACE:
+          assert(optarg);
+          hwtrace_file = optarg;
+          break;
+
+        case LONG_OPT_HANDOFF:
+          handoff = true;
+          if (optarg)
+            handoff_module = optarg;
+          break;
+
 	case '?':
 	  // Invalid/unrecognized option given or argument required, but
 	  // not given. In both cases getopt_long() will have printed the
@@ -1840,6 +1996,23 @@ systemtap_session::check_options (int argc, char * const argv [])
       cerr << _("Cannot specify --monitor with -l/-L/--dump-* switches.") << endl;
       usage(1);
     }
+  if (!hwtrace_file.empty() && cmd.empty() && target_pid == 0)
+    {
+      cerr << _("--hwtrace needs a target process, from -c or -x.") << endl;
+      usage(1);
+    }
+  if (handoff && runtime_mode != kernel_runtime)
+    {
+      cerr << _("--handoff is only supported with --runtime=kernel.") << endl;
+      usage(1);
+    }
+  // The module only takes unwind data from a stapio running as root;
+  // anyone else's would leave the user backtraces stopping short.
+  if (lazy_unwind && last_pass > 4 && remote_uris.empty() && geteuid() != 0)
+    {
+      print_warning(_("--lazy-unwind needs root to run the module, embedding the unwind tables instead"));
+      lazy_unwind = false;
+    }
   // FIXME: we need to think through other options that shouldn't be
   // used with '-i'.
 
@@ -2311,43 +2484,297 @@ systemtap_session::setup_kernel_release (const string& kstr)
 void
 systemtap_session::register_library_aliases()
 {
+  // With lazily loaded tapsets, first pull in every tapset file that
+  // defines aliases the user script might use.
+  for (unsigned f = 0; f < user_files.size(); ++f)
+    demand_library_aliases (user_files[f]);
+
   vector<stapfile*> files(library_files);
   files.insert(files.end(), user_files.begin(), user_files.end());
 
   for (unsigned f = 0; f < files.size(); ++f)
+    register_library_aliases (files[f]);
+
+  // Tapset files loaded from now on register their own aliases.
+  library_aliases_registered = true;
+}
+
+
+void
+systemtap_session::register_library_aliases(stapfile* file)
+{
+  for (unsigned a = 0; a < file->aliases.size(); ++a)
     {
-      stapfile * file = files[f];
-      for (unsigned a = 0; a < file->aliases.size(); ++a)
+      probe_alias * alias = file->aliases[a];
+      try
+	{
+	  for (unsigned n = 0; n < alias->alias_names.size(); ++n)
+	    {
+	      probe_point * name = alias->alias_names[n];
+	      match_node * mn = pattern_root;
+	      for (unsigned c = 0; c < name->components.size(); ++c)
+		{
+		  probe_point::component * comp = name->components[c];
+		  // XXX: alias parameters
+		  if (comp->arg)
+		    throw SEMANTIC_ERROR(_F("alias component %s contains illegal parameter",
+					    comp->functor.to_string().c_str()));
+		  mn = mn->bind(comp->functor);
+		}
+	      // PR 12916: All probe aliases are OK for all users. The actual
+	      // referenced probe points will be checked when the alias is resolved.
+	      mn->bind_privilege (pr_all);
+	      mn->bind(new alias_expansion_builder(alias));
+	    }
+	}
+      catch (const semantic_error& e)
 	{
-	  probe_alias * alias = file->aliases[a];
-          try
+	  semantic_error er(ERR_SRC, _("while registering probe alias"),
+			    alias->tok, NULL, &e);
+	  print_error (er);
+	}
+    }
+}
+
+
+// Collect the first component of every probe point used by the probes
+// and aliases of the given file.  (Those of the alias names themselves
+// are not included.)
+static void
+collect_probe_prefixes (stapfile* file, set<string>& prefixes)
+{
+  for (unsigned i = 0; i < file->probes.size(); ++i)
+    {
+      const vector<probe_point*>& locs = file->probes[i]->locations;
+      for (unsigned j = 0; j < locs.size(); ++j)
+        if (!locs[j]->components.empty())
+          prefixes.insert (locs[j]->components[0]->functor);
+    }
+  for (unsigned i = 0; i < file->aliases.size(); ++i)
+    {
+      const vector<probe_point*>& locs = file->aliases[i]->locations;
+      for (unsigned j = 0; j < locs.size(); ++j)
+        if (!locs[j]->components.empty())
+          prefixes.insert (locs[j]->components[0]->functor);
+    }
+}
+
+
+#define TAPSET_INDEX_MAGIC "STAPTIDX 1"
+
+// Set up lazy loading of the tapset files in library_stubs.  The index
+// records which functions, globals and alias prefixes each file
+// defines; it is keyed by everything that can change the parse of a
+// tapset (see find_tapset_index_hash).  Without a usable index, every
+// file is parsed right away as usual and a new index is written.
+// Returns true if loading is now deferred.
+bool
+systemtap_session::load_library_index()
+{
+  library_stub_base = library_files.size();
+
+  string hash = find_tapset_index_hash (*this);
+  string path = get_build_id_cache_path (*this, "tapsets", hash, ".idx");
+
+  ifstream idx;
+  if (!path.empty() && !poison_cache)
+    idx.open (path.c_str());
+
+  string line;
+  if (idx.good() && getline (idx, line) && line == TAPSET_INDEX_MAGIC)
+    {
+      library_stub* stub = 0;
+      unsigned next = 0;
+      bool ok = true;
+      while (ok && getline (idx, line))
+        {
+          if (line.size() < 2 || line[1] != ' ')
+            ok = false;
+          else if (line[0] == 'F')
             {
-              for (unsigned n = 0; n < alias->alias_names.size(); ++n)
-                {
-                  probe_point * name = alias->alias_names[n];
-                  match_node * mn = pattern_root;
-                  for (unsigned c = 0; c < name->components.size(); ++c)
-                    {
-                      probe_point::component * comp = name->components[c];
-                      // XXX: alias parameters
-                      if (comp->arg)
-                        throw SEMANTIC_ERROR(_F("alias component %s contains illegal parameter",
-                                                comp->functor.to_string().c_str()));
-                      mn = mn->bind(comp->functor);
-                    }
-		  // PR 12916: All probe aliases are OK for all users. The actual
-		  // referenced probe points will be checked when the alias is resolved.
-		  mn->bind_privilege (pr_all);
-                  mn->bind(new alias_expansion_builder(alias));
-                }
+              ok = (next < library_stubs.size()
+                    && library_stubs[next]->path == line.substr(2));
+              if (ok)
+                stub = library_stubs[next++];
             }
-          catch (const semantic_error& e)
+          else if (!stub)
+            ok = false;
+          else if (line[0] == 'f')
+            stub->functions.push_back (line.substr(2));
+          else if (line[0] == 'g')
+            stub->globals.push_back (line.substr(2));
+          else if (line[0] == 'a')
+            stub->alias_prefixes.push_back (line.substr(2));
+          else
+            ok = false;
+        }
+
+      if (ok && next == library_stubs.size())
+        {
+          for (unsigned i = 0; i < library_stubs.size(); ++i)
             {
-              semantic_error er(ERR_SRC, _("while registering probe alias"),
-                                alias->tok, NULL, &e);
-              print_error (er);
+              library_stub* st = library_stubs[i];
+              for (unsigned j = 0; j < st->functions.size(); ++j)
+                library_functions.insert (make_pair (st->functions[j], st));
+              for (unsigned j = 0; j < st->globals.size(); ++j)
+                library_globals.insert (make_pair (st->globals[j], st));
             }
-	}
+          touch_cache_index_entry (*this, path);
+          if (verbose > 1)
+            clog << _F("Deferring parse of %zu tapset files, using index %s",
+                       library_stubs.size(), path.c_str()) << endl;
+          return true;
+        }
+
+      if (verbose > 1)
+        clog << _F("Ignoring stale tapset index %s", path.c_str()) << endl;
+      for (unsigned i = 0; i < library_stubs.size(); ++i)
+        {
+          library_stubs[i]->functions.clear();
+          library_stubs[i]->globals.clear();
+          library_stubs[i]->alias_prefixes.clear();
+        }
+    }
+
+  // Parse everything now, recording what each file defines.
+  ostringstream index;
+  bool clean = true;
+  index << TAPSET_INDEX_MAGIC << endl;
+  for (unsigned i = 0; i < library_stubs.size(); ++i)
+    {
+      library_stub* stub = library_stubs[i];
+      stapfile* f = load_library_stub (stub);
+      index << "F " << stub->path << endl;
+      if (f == 0)
+        {
+          clean = false;
+          continue;
+        }
+
+      // NB: private symbols can only be referenced from their own
+      // file, which is loaded by then, so they needn't be indexed.
+      set<string> names;
+      for (unsigned j = 0; j < f->functions.size(); ++j)
+        if (! f->functions[j]->name.starts_with("__private_"))
+          names.insert (f->functions[j]->unmangled_name);
+      for (auto it = names.begin(); it != names.end(); ++it)
+        index << "f " << *it << endl;
+
+      names.clear();
+      for (unsigned j = 0; j < f->globals.size(); ++j)
+        if (! f->globals[j]->name.starts_with("__private_"))
+          {
+            names.insert (f->globals[j]->unmangled_name);
+            names.insert (f->globals[j]->name);
+          }
+      for (auto it = names.begin(); it != names.end(); ++it)
+        index << "g " << *it << endl;
+
+      names.clear();
+      for (unsigned j = 0; j < f->aliases.size(); ++j)
+        {
+          const vector<probe_point*>& names_pp = f->aliases[j]->alias_names;
+          for (unsigned k = 0; k < names_pp.size(); ++k)
+            if (!names_pp[k]->components.empty())
+              names.insert (names_pp[k]->components[0]->functor);
+        }
+      for (auto it = names.begin(); it != names.end(); ++it)
+        index << "a " << *it << endl;
+    }
+
+  // NB: with all files parsed, there's nothing left to be lazy about.
+  for (unsigned i = 0; i < library_stubs.size(); ++i)
+    delete library_stubs[i];
+  library_stubs.clear();
+
+  // Only record an index that reflects a clean parse, so that broken
+  // tapsets keep being reported on every run.
+  if (clean && num_errors() == 0)
+    add_data_to_cache (*this, path, index.str());
+  return false;
+}
+
+
+// Parse a deferred tapset file, if not done already, and pull in the
+// files defining any aliases its probes use.
+stapfile*
+systemtap_session::load_library_stub(library_stub* stub)
+{
+  if (stub->loaded)
+    return stub->file;
+  stub->loaded = true;
+
+  if (verbose>2)
+    clog << _F("Processing tapset \"%s\"", stub->path.c_str()) << endl;
+
+  // NB: see main.cxx on why tapset files need not be privilege-checked.
+  stapfile* f = parse (*this, stub->path, stub->flags);
+  if (f == 0)
+    {
+      print_warning(_F("tapset \"%s\" has errors, and will be skipped", stub->path.c_str()));
+      return 0;
+    }
+  assert (f->privileged);
+  stub->file = f;
+
+  // Keep library_files in the same order as a full load would have.
+  library_files.resize (library_stub_base);
+  for (unsigned i = 0; i < library_stubs.size(); ++i)
+    if (library_stubs[i]->file)
+      library_files.push_back (library_stubs[i]->file);
+
+  if (library_aliases_registered)
+    register_library_aliases (f);
+  demand_library_aliases (f);
+  return f;
+}
+
+
+// Make sure all the tapset files that define a function or global of
+// the given name have been loaded.
+void
+systemtap_session::demand_library_symbol(const string& name, bool global_p)
+{
+  if (!lazy_library_p())
+    return;
+
+  multimap<string, library_stub*>& m = global_p ? library_globals : library_functions;
+  auto range = m.equal_range (name);
+  for (auto it = range.first; it != range.second; ++it)
+    if (!it->second->loaded)
+      {
+        if (verbose > 2)
+          clog << _F("Loading tapset \"%s\" for %s %s", it->second->path.c_str(),
+                     global_p ? "global" : "function", name.c_str()) << endl;
+        load_library_stub (it->second);
+      }
+}
+
+
+// Make sure all the tapset files that define aliases possibly matching
+// the probe points used in the given file have been loaded.
+void
+systemtap_session::demand_library_aliases(stapfile* file)
+{
+  if (!lazy_library_p())
+    return;
+
+  set<string> prefixes;
+  collect_probe_prefixes (file, prefixes);
+
+  for (unsigned i = 0; i < library_stubs.size(); ++i)
+    {
+      library_stub* stub = library_stubs[i];
+      bool wanted = false;
+      for (unsigned j = 0; !wanted && j < stub->alias_prefixes.size(); ++j)
+        for (auto it = prefixes.begin(); !wanted && it != prefixes.end(); ++it)
+          wanted = (fnmatch (it->c_str(), stub->alias_prefixes[j].c_str(), 0) == 0);
+      if (wanted && !stub->loaded)
+        {
+          if (verbose > 2)
+            clog << _F("Loading tapset \"%s\" for probe aliases", stub->path.c_str()) << endl;
+          load_library_stub (stub);
+        }
     }
 }
 
@@ -46,6 +46,7 @@ extern "C" {
 class stap_hash;
 class match_node;
 struct stapfile;
+struct library_stub;
 struct vardecl;
 struct token;
 struct functiondecl;
@@ -76,6 +77,7 @@ struct semantic_error;
 struct module_cache;
 struct update_visitor;
 struct compile_server_cache;
+struct dwflpp;
 
 // XXX: a generalized form of this descriptor could be associated with
 // a vardecl instead of out here at the systemtap_session level.
@@ -83,13 +85,14 @@ struct statistic_decl
 {
   statistic_decl(int _stat_ops = 0)
     : type(none),
-      linear_low(0), linear_high(0), linear_step(0), bit_shift(0),
-      stat_ops(_stat_ops)
+      linear_low(0), linear_high(0), linear_step(0), hdr_bits(0),
+      bit_shift(0), stat_ops(_stat_ops)
   {}
-  enum { none, linear, logarithmic } type;
+  enum { none, linear, logarithmic, hdr, quantile, distinct } type;
   int64_t linear_low;
   int64_t linear_high;
   int64_t linear_step;
+  int64_t hdr_bits;
   int bit_shift;
   int stat_ops;
   bool operator==(statistic_decl const & other)
@@ -97,12 +100,28 @@ struct statistic_decl
     return type == other.type
       && linear_low == other.linear_low
       && linear_high == other.linear_high
-      && linear_step == other.linear_step;
+      && linear_step == other.linear_step
+      && hdr_bits == other.hdr_bits;
   }
 };
 
 struct macrodecl; // defined in parse.h
 
+// A tapset file that is only parsed on demand.  The symbol lists come
+// from the tapset index (see systemtap_session::load_library_index).
+struct library_stub
+{
+  std::string path;
+  unsigned flags; // parse_flag bits to use
+  bool loaded;
+  stapfile* file; // once loaded, or 0 if it failed to parse
+  std::vector<std::string> functions; // unmangled names, non-private only
+  std::vector<std::string> globals; // unmangled and mangled names, ditto
+  std::vector<std::string> alias_prefixes; // first component of each alias
+  library_stub (const std::string& p, unsigned f):
+    path (p), flags (f), loaded (false), file (0) {}
+};
+
 struct parse_error: public std::runtime_error
 {
   const token* tok;
@@ -230,8 +249,10 @@ public:
   bool tapset_compile_coverage;
   bool need_uprobes;
   bool need_unwind;
+  bool need_user_unwind;
   bool need_symbols;
   bool need_lines;
+  bool need_stack_ids;
   std::string uprobes_path;
   std::string uprobes_hash;
   bool load_only; // flight recorder mode
@@ -243,6 +264,7 @@ public:
   bool monitor;
   int monitor_interval;
   int timeout; // in ms
+  unsigned jobs; // worker threads for parallelizable translator work
   std::map<std::string,std::string> typequery_memo;
   
   enum
@@ -264,6 +286,20 @@ public:
   bool interactive_mode;
   bool run_example;
   bool no_global_var_display;
+  bool binary_output; // printf writes schema-tagged binary records
+  bool defer_symbols; // backtraces are symbolized by stap-symbolize
+  bool lazy_unwind; // user unwind data comes from stapio when first needed
+  bool handoff; // the module can take over, or hand over, its globals
+  std::string handoff_module; // the running module to take over from
+  bool pgo; // lay out and hint the generated code from the coverage db
+  std::string pgo_report; // a -t report to add to the coverage db first
+  std::map<std::string, int64_t> pgo_probe_hits; // "pp@file:line:col" -> hits
+  std::map<std::string, std::pair<int64_t, int64_t> > pgo_branch_hits; // location -> taken, not taken
+  std::string compile_daemon; // socket to serve --use-compile-daemon clients on
+  std::string use_compile_daemon; // socket of a --compile-daemon to run this on
+  dwflpp* warm_kernel_dw; // kernel debuginfo opened by a --compile-daemon
+  std::string time_trace_file; // where to write the --time-trace spans
+  std::string hwtrace_file; // where stapio writes the target's processor trace
   bool pass_1a_complete;
 
   enum { color_never, color_auto, color_always } color_mode;
@@ -337,6 +373,8 @@ public:
   std::string cache_path;       // usually ~/.systemtap/cache
   std::string hash_path;        // path to the cached script module
   std::string stapconf_path;    // path to the cached stapconf
+  std::string remote_cache_url; // shared module store, if any
+  bool remote_cache_hit;        // the module came from the remote store
   stap_hash *base_hash;         // hash common to all caching
 
   // Skip bad $ vars
@@ -353,6 +391,7 @@ public:
 
   match_node* pattern_root;
   void register_library_aliases();
+  void register_library_aliases(stapfile* file);
 
   // data for various preprocessor library macros
   std::map<std::string, macrodecl*> library_macros;
@@ -361,6 +400,19 @@ public:
   std::vector<stapfile*> user_files;
   std::vector<stapfile*> library_files;
 
+  // tapset files whose parsing is deferred until one of their symbols
+  // is referenced, as listed by the cached tapset symbol index
+  std::vector<library_stub*> library_stubs;
+  std::multimap<std::string, library_stub*> library_functions;
+  std::multimap<std::string, library_stub*> library_globals;
+  unsigned library_stub_base; // library_files slots not from library_stubs
+  bool library_aliases_registered;
+  bool lazy_library_p() const { return !library_stubs.empty(); }
+  bool load_library_index();
+  stapfile* load_library_stub(library_stub* stub);
+  void demand_library_symbol(const std::string& name, bool global_p);
+  void demand_library_aliases(stapfile* file);
+
   std::string script_name(); // usually user_files[0]->name
   std::string script_basename(); // basename of script_name()
 
@@ -383,9 +435,11 @@ public:
   std::vector<derived_probe*> unused_probes; // see also *_probes groups below
   std::vector<functiondecl*> unused_functions;
   std::set<derived_probe*> empty_probes;
+  unsigned opt_local_counter; // names the locals the optimizer adds uniquely
 
   // resolved/compiled regular expressions for the run
   std::map<std::string, stapdfa*> dfas;
+  std::map<std::vector<std::string>, stapdfa*> dfa_chains; // NULL if not worth it
   unsigned dfa_counter; // used to give unique names
   unsigned dfa_maxmap;  // used for subexpression-tracking data structure
   unsigned dfa_maxtag;  // ditto
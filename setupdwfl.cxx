@@ -20,6 +20,10 @@
 #include <sstream>
 #include <set>
 #include <string>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 extern "C" {
 #include <fnmatch.h>
@@ -34,6 +38,10 @@ extern "C" {
 #include <limits.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+
+#ifdef HAVE_LIBDEBUGINFOD
+#include <elfutils/debuginfod.h>
+#endif
 }
 
 // XXX: also consider adding $HOME/.debug/ for perf build-id-cache
@@ -350,6 +358,180 @@ void debuginfo_path_insert_sysroot(string sysroot)
   debuginfo_usr_path = path_insert_sysroot(sysroot, debuginfo_usr_path);
 }
 
+#ifdef HAVE_LIBDEBUGINFOD
+// Debuginfo files fetched by prefetch_debuginfo(), by build-id, which
+// internal_find_debuginfo() hands to libdwfl directly.
+static map<string, string> debuginfod_fetched;
+static mutex debuginfod_fetched_lock;
+
+// Downloads are bound by the network rather than by cpus, so run at
+// least this many of them at once, whatever --jobs says.
+static const unsigned debuginfod_min_fetches = 8;
+
+struct debuginfod_fetch
+{
+  string module;
+  string build_id;
+  vector<unsigned char> bits;
+};
+
+// Whether debuginfo for the module is already at hand: in the main
+// file itself, or installed under one of the usual build-id paths.
+static bool
+have_local_debuginfo (Dwfl_Module *mod, const string &hex, const string &sysroot)
+{
+  GElf_Addr bias;
+  Elf *elf = dwfl_module_getelf (mod, &bias);
+  size_t shstrndx;
+  if (elf && elf_getshdrstrndx (elf, &shstrndx) == 0)
+    for (Elf_Scn *scn = elf_nextscn (elf, NULL); scn; scn = elf_nextscn (elf, scn))
+      {
+        GElf_Shdr shdr_mem, *shdr = gelf_getshdr (scn, &shdr_mem);
+        const char *name = shdr ? elf_strptr (elf, shstrndx, shdr->sh_name) : NULL;
+        if (name && strcmp (name, ".debug_info") == 0)
+          return true;
+      }
+
+  static const char *dirs[] = { "/usr/lib/debug", "/var/cache/abrt-di/usr/lib/debug" };
+  for (auto dir : dirs)
+    {
+      string path = sysroot + dir + "/.build-id/" + hex.substr (0, 2)
+        + "/" + hex.substr (2) + ".debug";
+      if (access (path.c_str (), R_OK) == 0)
+        return true;
+    }
+  return false;
+}
+
+static int
+collect_debuginfod_fetch (Dwfl_Module *mod, void **, const char *name,
+                          Dwarf_Addr, void *arg)
+{
+  pair<systemtap_session*, vector<debuginfod_fetch>*> *p
+    = (pair<systemtap_session*, vector<debuginfod_fetch>*> *) arg;
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id (mod, &bits, &vaddr);
+  if (bits_length <= 0)
+    return DWARF_CB_OK;
+
+  string hex = hex_dump (bits, bits_length);
+  {
+    lock_guard<mutex> lock (debuginfod_fetched_lock);
+    if (debuginfod_fetched.count (hex))
+      return DWARF_CB_OK;
+  }
+  if (have_local_debuginfo (mod, hex, p->first->sysroot))
+    return DWARF_CB_OK;
+
+  debuginfod_fetch f;
+  f.module = name;
+  f.build_id = hex;
+  f.bits.assign (bits, bits + bits_length);
+  p->second->push_back (f);
+  return DWARF_CB_OK;
+}
+
+static void
+debuginfod_fetch_worker (const systemtap_session *s,
+                         vector<debuginfod_fetch> *work, atomic<size_t> *next)
+{
+  // A client isn't thread-safe, so each worker has its own.
+  debuginfod_client *client = debuginfod_begin ();
+  if (client == NULL)
+    return;
+
+  for (size_t i = (*next)++; i < work->size (); i = (*next)++)
+    {
+      debuginfod_fetch &f = (*work)[i];
+      char *path = NULL;
+      int fd = debuginfod_find_debuginfo (client, f.bits.data (), f.bits.size (), &path);
+      if (fd < 0)
+        {
+          if (s->verbose > 1)
+            clog << _F("debuginfod has no debuginfo for %s (build-id %s): %s",
+                       f.module.c_str (), f.build_id.c_str (), strerror (-fd)) << endl;
+          continue;
+        }
+      close (fd);
+      if (s->verbose > 1)
+        clog << _F("debuginfod fetched %s for %s", path, f.module.c_str ()) << endl;
+      lock_guard<mutex> lock (debuginfod_fetched_lock);
+      debuginfod_fetched[f.build_id] = path;
+      free (path);
+    }
+  debuginfod_end (client);
+}
+
+// Fetch the debuginfo of all the reported modules that lack it from
+// debuginfod up front, several at a time, rather than one by one as
+// libdwfl gets to each module.  The files land in the stap cache,
+// under debuginfod/BUILDID/, unless DEBUGINFOD_CACHE_PATH says
+// otherwise.
+static void
+prefetch_debuginfo (Dwfl *dwfl, systemtap_session &s)
+{
+  const char *urls = getenv ("DEBUGINFOD_URLS");
+  if (dwfl == NULL || urls == NULL || *urls == '\0')
+    return;
+
+  if (getenv ("DEBUGINFOD_CACHE_PATH") == NULL && s.use_cache
+      && !s.cache_path.empty ())
+    {
+      string dir = s.cache_path + "/debuginfod";
+      if (create_dir (dir.c_str ()) == 0)
+        setenv ("DEBUGINFOD_CACHE_PATH", dir.c_str (), 0);
+    }
+
+  vector<debuginfod_fetch> work;
+  pair<systemtap_session*, vector<debuginfod_fetch>*> arg (&s, &work);
+  dwfl_getmodules (dwfl, collect_debuginfod_fetch, &arg, 0);
+  if (work.empty ())
+    return;
+
+  unsigned jobs = min ((size_t) max (s.jobs, debuginfod_min_fetches), work.size ());
+  if (s.verbose > 1)
+    clog << _F("Fetching debuginfo for %zu modules from debuginfod, %u at a time.",
+               work.size (), jobs) << endl;
+
+  atomic<size_t> next (0);
+  vector<thread> workers;
+  for (unsigned i = 0; i < jobs; ++i)
+    workers.push_back (thread (debuginfod_fetch_worker, &s, &work, &next));
+  for (auto &w : workers)
+    w.join ();
+  assert_no_interrupts ();
+}
+
+// Hand over debuginfo fetched up front, if any.
+static int
+find_fetched_debuginfo (Dwfl_Module *mod, char **debuginfo_file_name)
+{
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id (mod, &bits, &vaddr);
+  if (bits_length <= 0)
+    return -1;
+
+  string path;
+  {
+    lock_guard<mutex> lock (debuginfod_fetched_lock);
+    auto it = debuginfod_fetched.find (hex_dump (bits, bits_length));
+    if (it == debuginfod_fetched.end ())
+      return -1;
+    path = it->second;
+  }
+
+  int fd = open (path.c_str (), O_RDONLY);
+  if (fd >= 0)
+    *debuginfo_file_name = strdup (path.c_str ());
+  return fd;
+}
+#else
+static void prefetch_debuginfo (Dwfl *, systemtap_session &) {}
+static int find_fetched_debuginfo (Dwfl_Module *, char **) { return -1; }
+#endif /* HAVE_LIBDEBUGINFOD */
+
 static Dwfl *
 setup_dwfl_kernel (unsigned *modules_found, systemtap_session &s)
 {
@@ -435,6 +617,7 @@ setup_dwfl_kernel (unsigned *modules_found, systemtap_session &s)
 
   DWFL_ASSERT ("dwfl_report_end", dwfl_report_end(dwfl, NULL, NULL));
   *modules_found = offline_modules_found;
+  prefetch_debuginfo (dwfl, s);
 
   return dwfl;
 }
@@ -494,6 +677,62 @@ setup_dwfl_user(const std::string &name)
   return dwfl;
 }
 
+static int
+private_report_kernel_p (const char *modname, const char *)
+{
+  return strcmp (modname, "kernel") == 0;
+}
+
+// A Dwfl reporting just one object, NAME being "kernel" or a full
+// user-space path, for use from worker threads.  Unlike the functions
+// above, this touches no static state and never tries to download
+// debuginfo; it just finds what is already installed.
+Dwfl*
+setup_dwfl_private(const std::string &name, const systemtap_session &s)
+{
+  static const Dwfl_Callbacks private_kernel_callbacks =
+    {
+      dwfl_linux_kernel_find_elf,
+      dwfl_standard_find_debuginfo,
+      dwfl_offline_section_address,
+      (char **) & debuginfo_path
+    };
+  static const Dwfl_Callbacks private_user_callbacks =
+    {
+      NULL,
+      dwfl_standard_find_debuginfo,
+      NULL,
+      (char **) & debuginfo_usr_path
+    };
+
+  bool kernel_p = (name == "kernel");
+  Dwfl *dwfl = dwfl_begin (kernel_p ? &private_kernel_callbacks
+                                    : &private_user_callbacks);
+  if (!dwfl)
+    return NULL;
+  dwfl_report_begin (dwfl);
+
+  if (kernel_p)
+    {
+      // Same choice of path as setup_dwfl_kernel() above.
+      string path = s.kernel_build_tree;
+      if (path == s.sysroot + "/lib/modules/" + s.kernel_release + "/build")
+        path = (s.sysroot != "") ? s.sysroot + "/lib/modules/" + s.kernel_release
+                                 : s.kernel_release;
+      (void) dwfl_linux_kernel_report_offline (dwfl, path.c_str(),
+                                               &private_report_kernel_p);
+    }
+  else
+    (void) dwfl_report_offline (dwfl, name.c_str(), name.c_str(), -1);
+
+  if (dwfl_report_end (dwfl, NULL, NULL) != 0)
+    {
+      dwfl_end (dwfl);
+      return NULL;
+    }
+  return dwfl;
+}
+
 Dwfl*
 setup_dwfl_user(std::vector<std::string>::const_iterator &begin,
 		const std::vector<std::string>::const_iterator &end,
@@ -539,6 +778,7 @@ setup_dwfl_user(std::vector<std::string>::const_iterator &begin,
 
   if (dwfl)
     DWFL_ASSERT ("dwfl_report_end", dwfl_report_end(dwfl, NULL, NULL));
+  prefetch_debuginfo (dwfl, s);
 
   return dwfl;
 }
@@ -566,6 +806,11 @@ internal_find_debuginfo (Dwfl_Module *mod,
   /* To Keep track of whether the abrt successfully installed the debuginfo */
   static int install_dbinfo_failed = 0;
 
+  /* Use debuginfo that prefetch_debuginfo() got from debuginfod */
+  int fetched_fd = find_fetched_debuginfo (mod, debuginfo_file_name);
+  if (fetched_fd >= 0)
+    return fetched_fd;
+
   /* Make sure the current session variable is not null */
   if(current_session_for_find_debuginfo == NULL)
     goto call_dwfl_standard_find_debuginfo;
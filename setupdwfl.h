@@ -34,6 +34,8 @@ Dwfl *setup_dwfl_kernel(const std::set<std::string> &names,
 			  systemtap_session &s);
 
 Dwfl *setup_dwfl_user(const std::string &name);
+Dwfl *setup_dwfl_private(const std::string &name,
+                         const systemtap_session &s);
 Dwfl *setup_dwfl_user(std::vector<std::string>::const_iterator &begin,
 		        const std::vector<std::string>::const_iterator &end,
 		        bool all_needed, systemtap_session &s);
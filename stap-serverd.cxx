@@ -27,7 +27,12 @@
 #include <climits>
 #include <iostream>
 #include <map>
+#include <set>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
 
 extern "C" {
 #include <unistd.h>
@@ -65,6 +70,7 @@ extern "C" {
 #include "nsscommon.h"
 #include "cscommon.h"
 #include "cmdline.h"
+#include "hash.h"
 
 using namespace std;
 
@@ -99,6 +105,22 @@ sem_t sem_client;
 static int pending_interrupts;
 #define CONCURRENCY_TIMEOUT_S 3
 
+/* Connections may outnumber the translators allowed to run at once
+   (max_threads) by this factor; the extra ones wait their turn in
+   translator_slot, instead of in the kernel's short listen queue. */
+#define QUEUED_REQUESTS_PER_THREAD 4
+static long max_connections;
+
+/* Translator runs in progress and waiting, and what's been seen. */
+static mutex translator_mutex;
+static condition_variable translator_cond;
+static long translators_running;
+static long translators_queued;
+static long translators_queued_peak;
+static unsigned long translator_requests;
+static unsigned long translator_requests_coalesced;
+static set<string> translator_keys; // of the requests being translated
+
 // Message handling.
 // Server_error messages are printed to stderr and logged, if requested.
 static void
@@ -931,11 +953,13 @@ cleanup ()
 
 /* Function:  readDataFromSocket()
  *
- * Purpose:  Read data from the socket into a temporary file.
+ * Purpose:  Read data from the socket into a temporary file, or, if the
+ * client streams its request, straight into the request directory.
  *
  */
 static PRInt32
-readDataFromSocket(PRFileDesc *sslSocket, const char *requestFileName)
+readDataFromSocket(PRFileDesc *sslSocket, const char *requestFileName,
+		   const char *requestDirName, bool &streamed)
 {
   PRFileDesc *local_file_fd = 0;
   PRInt32     numBytesExpected;
@@ -968,6 +992,18 @@ readDataFromSocket(PRFileDesc *sslSocket, const char *requestFileName)
   if (numBytesExpected == 0)
     return 0;
 
+  /* A streamed request is unpacked as it arrives, within the limit on
+     the uncompressed size of a zipped one. */
+  if (numBytesExpected == CS_STREAM_REQUEST_SIZE)
+    {
+      streamed = true;
+      PRInt64 streamBytes = nss_receive_tree (sslSocket, requestDirName,
+					      max_uncompressed_req_size);
+      if (streamBytes < 0)
+	return -1;
+      return (PRInt32) min (streamBytes, (PRInt64) PR_INT32_MAX);
+    }
+
   /* Impose a limit to prevent disk space consumption DoS */
   if (numBytesExpected > (PRInt32) max_compressed_req_size)
     {
@@ -1487,8 +1523,140 @@ getRequestedPrivilege (const vector<string> &stapargv)
 
 /* Run the translator on the data in the request directory, and produce output
    in the given output directory. */
+/* Add the names and contents of the files under DIR to the hash, in a
+   stable order. */
+static void
+add_request_files (stap_hash &h, const string &dir)
+{
+  DIR *d = opendir (dir.c_str ());
+  if (!d)
+    return;
+  vector<string> names;
+  struct dirent *e;
+  while ((e = readdir (d)) != NULL)
+    if (strcmp (e->d_name, ".") && strcmp (e->d_name, ".."))
+      names.push_back (e->d_name);
+  closedir (d);
+  sort (names.begin (), names.end ());
+
+  for (size_t i = 0; i < names.size (); i++)
+    {
+      string path = dir + "/" + names[i];
+      struct stat st;
+      if (lstat (path.c_str (), &st) != 0)
+        continue;
+      if (S_ISDIR (st.st_mode))
+        {
+          h.add ("Directory: ", names[i]);
+          add_request_files (h, path);
+          h.add ("End of directory: ", names[i]);
+        }
+      else if (S_ISREG (st.st_mode))
+        {
+          ifstream f (path.c_str ());
+          string contents ((istreambuf_iterator<char> (f)), istreambuf_iterator<char> ());
+          h.add ("File: ", names[i]);
+          h.add ("Contents: ", contents);
+        }
+    }
+}
+
+/* What makes translating a request give the same result as another:
+   the translator and its command line (less the request's own
+   temporary directory), its environment, the kernel build tree and
+   server certificate it builds and signs with, and every file the
+   client sent. */
+static string
+request_key (const vector<string> &stapargv, const vector<string> &envVec,
+             const string &kernel_version, const string &requestDirName)
+{
+  stap_hash h;
+  h.add_path ("Translator ", stapargv[0]);
+  for (size_t i = 1; i < stapargv.size (); i++)
+    if (stapargv[i].compare (0, 9, "--tmpdir=") != 0)
+      h.add ("Argument: ", stapargv[i]);
+  for (size_t i = 0; i < envVec.size (); i++)
+    h.add ("Environment: ", envVec[i]);
+  h.add_path ("Kernel config ", kernel_build_tree[kernel_version] + "/.config");
+  h.add_path ("Kernel symbols ", kernel_build_tree[kernel_version] + "/Module.symvers");
+  h.add_path ("Certificate ", server_cert_file ());
+  add_request_files (h, requestDirName);
+
+  string result;
+  h.result (result);
+  return result;
+}
+
+/* Where the response to a request with the given key is kept, or ""
+   if there's no usable cache directory. */
+static string
+response_cache_file (const string &key, bool streamed)
+{
+  const char *s_d = getenv ("SYSTEMTAP_DIR");
+  string dir = string (s_d ?: (get_home_directory () + string ("/.systemtap")).c_str ())
+    + "/cache/server";
+  if (create_dir (dir.c_str (), 0700) != 0)
+    {
+      server_error (_F("Could not create response cache directory %s: %s",
+                       dir.c_str (), strerror (errno)));
+      return "";
+    }
+  return dir + "/" + key + (streamed ? ".stream" : ".zip");
+}
+
+/* A turn to run the translator.  At most max_threads requests hold one
+   at once.  A request identical to one being translated also waits for
+   that to finish, so that it finds the module in the cache instead of
+   building it a second time. */
+class translator_slot
+{
+  string key;
+
+public:
+  translator_slot (const string &k): key (k)
+  {
+    unique_lock<mutex> lock (translator_mutex);
+    long limit = max (max_threads, 1L);
+    bool duplicate = translator_keys.count (key);
+
+    translator_requests++;
+    if (duplicate)
+      translator_requests_coalesced++;
+    if (duplicate || translators_running >= limit)
+      {
+        translators_queued++;
+        translators_queued_peak = max (translators_queued_peak, translators_queued);
+        if (duplicate)
+          log (_F("Request waiting for an identical one (%ld running, %ld queued)",
+                  translators_running, translators_queued));
+        else
+          log (_F("Request queued (%ld running, %ld queued)",
+                  translators_running, translators_queued));
+        translator_cond.wait (lock, [&] {
+            return translators_running < limit && !translator_keys.count (key);
+          });
+        translators_queued--;
+      }
+    translators_running++;
+    translator_keys.insert (key);
+  }
+
+  ~translator_slot ()
+  {
+    lock_guard<mutex> lock (translator_mutex);
+    translators_running--;
+    translator_keys.erase (key);
+    translator_cond.notify_all ();
+  }
+};
+
+/* Translate a request into the response directory.  If the same request
+   has been answered before, set CACHED and CACHEFILENAME to the response
+   as it was sent, zipped or STREAMED, instead.  Otherwise, CACHEFILENAME
+   is where the response may be kept, if the translation succeeds. */
 static void
-handleRequest (const string &requestDirName, const string &responseDirName, string stapstderr)
+handleRequest (const string &requestDirName, const string &responseDirName, string stapstderr,
+               bool streamed, string &cacheFileName, bool &cached)
 {
   vector<string> stapargv;
   cs_protocol_version client_version = "1.0"; // Assumed until discovered otherwise
@@ -1671,10 +1839,33 @@ handleRequest (const string &requestDirName, const string &responseDirName, stri
   if (! mok_fingerprint.empty ())
     stapargv.push_back("--sign-module=" + mok_path + "/" + mok_fingerprint);
 
-  /* All ready, let's run the translator! */
+  /* All ready, let's run the translator!  Unless the same request was
+     answered before, or is answered while this one waits its turn. */
+  string key = request_key (stapargv, envVec, kernel_version, requestDirName);
+  string cacheFile = response_cache_file (key, streamed);
+  if (! cacheFile.empty () && file_exists (cacheFile))
+    {
+      log (_F("Answering request from the cache: %s", cacheFile.c_str ()));
+      cacheFileName = cacheFile;
+      cached = true;
+      wordfree (& words);
+      return;
+    }
+
   int staprc;
-  rc = spawn_and_wait(stapargv, &staprc, "/dev/null", stapstdout.c_str (),
-                      stapstderr.c_str (), requestDirName.c_str (), envVec);
+  {
+    translator_slot slot (key);
+    if (! cacheFile.empty () && file_exists (cacheFile))
+      {
+        log (_F("Answering request from the cache: %s", cacheFile.c_str ()));
+        cacheFileName = cacheFile;
+        cached = true;
+        wordfree (& words);
+        return;
+      }
+    rc = spawn_and_wait(stapargv, &staprc, "/dev/null", stapstdout.c_str (),
+                        stapstderr.c_str (), requestDirName.c_str (), envVec);
+  }
   if (rc != PR_SUCCESS)
     {
       server_error(_("Failed spawning translator"));
@@ -1777,6 +1968,10 @@ handleRequest (const string &requestDirName, const string &responseDirName, stri
   ofs << staprc;
   ofs.close();
 
+  // Only a successful translation is worth keeping.
+  if (staprc == 0)
+    cacheFileName = cacheFile;
+
   /* If uprobes.ko is required, it will have been built or cache-copied into
    * the temp directory.  We need to pack it into the response where the client
    * can find it, and sign, if necessary, for unprivileged users.
@@ -1980,6 +2175,7 @@ handle_connection (void *arg)
                         copy for each connection.*/
   vector<string>     argv;
   PRInt32            bytesRead;
+  bool               streamed = false;
   int		     retlen;
 
   /* Detatch to avoid a memory leak */
@@ -2093,7 +2289,7 @@ handle_connection (void *arg)
   /* Read data from the socket.
    * If the user is requesting/requiring authentication, authenticate
    * the socket.  */
-  bytesRead = readDataFromSocket(sslSocket, requestFileName);
+  bytesRead = readDataFromSocket(sslSocket, requestFileName, requestDirName, streamed);
   if (bytesRead < 0) // Error
     goto cleanup;
   if (bytesRead == 0) // No request -- not an error
@@ -2111,37 +2307,80 @@ handle_connection (void *arg)
     }
 #endif
 
-  /* Just before we do any kind of processing, we want to check that the request there will
-   * be enough memory to unzip the file. */
-  if (check_uncompressed_request_size(requestFileName))
-    {
-      goto cleanup;
-    }
-
-  /* Unzip the request. */
+  /* A streamed request is already unpacked. */
   secStatus = SECFailure;
-  argv = { "unzip", "-q", "-d", requestDirName, requestFileName };
-  rc = stap_system (0, argv);
-  if (rc != 0)
+  if (! streamed)
     {
-      server_error (_("Unable to extract client request"));
-      goto cleanup;
+      /* Just before we do any kind of processing, we want to check that the request there will
+       * be enough memory to unzip the file. */
+      if (check_uncompressed_request_size(requestFileName))
+        {
+          goto cleanup;
+        }
+
+      /* Unzip the request. */
+      argv = { "unzip", "-q", "-d", requestDirName, requestFileName };
+      rc = stap_system (0, argv);
+      if (rc != 0)
+        {
+          server_error (_("Unable to extract client request"));
+          goto cleanup;
+        }
     }
 
   /* Handle the request zip file.  An error therein should still result
      in a response zip file (containing stderr etc.) so we don't have to
      have a result code here.  */
-  handleRequest(requestDirName, responseDirName, stapstderr);
+  {
+    string cacheFileName;
+    bool cached = false;
+    handleRequest(requestDirName, responseDirName, stapstderr, streamed, cacheFileName, cached);
+    if (cached)
+      {
+        secStatus = writeDataToSocket (sslSocket, cacheFileName.c_str ());
+        goto cleanup;
+      }
 
-  /* Zip the response. */
-  int ziprc;
-  argv = { "zip", "-q", "-r", responseFileName, "." };
-  rc = spawn_and_wait (argv, &ziprc, NULL, NULL, NULL, responseDirName);
-  if (rc != PR_SUCCESS || ziprc != 0)
-    {
-      server_error (_("Unable to compress server response"));
-      goto cleanup;
-    }
+    /* Stream the response back the way the request came. */
+    if (streamed)
+      {
+        secStatus = nss_send_tree (sslSocket, responseDirName);
+
+        /* Keep the same stream for the next identical request, written
+           to a temporary file first, so readers never see a partial one. */
+        if (secStatus == SECSuccess && ! cacheFileName.empty ())
+          {
+            string tmp = cacheFileName + "." + lex_cast (getpid ()) + "."
+              + lex_cast (pthread_self ());
+            PRFileDesc *cache_fd = PR_Open (tmp.c_str (), PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE,
+                                            PR_IRUSR | PR_IWUSR);
+            if (cache_fd != NULL)
+              {
+                SECStatus cacheStatus = nss_send_tree (cache_fd, responseDirName);
+                PR_Close (cache_fd);
+                if (cacheStatus != SECSuccess
+                    || rename (tmp.c_str (), cacheFileName.c_str ()) != 0)
+                  unlink (tmp.c_str ());
+              }
+          }
+        goto cleanup;
+      }
+
+    /* Zip the response. */
+    int ziprc;
+    argv = { "zip", "-q", "-r", responseFileName, "." };
+    rc = spawn_and_wait (argv, &ziprc, NULL, NULL, NULL, responseDirName);
+    if (rc != PR_SUCCESS || ziprc != 0)
+      {
+        server_error (_("Unable to compress server response"));
+        goto cleanup;
+      }
+
+    /* Keep it for the next identical request.  copy_file() goes through
+       a temporary file, so readers never see a partial one. */
+    if (! cacheFileName.empty ())
+      copy_file (responseFileName, cacheFileName);
+  }
 
   secStatus = writeDataToSocket (sslSocket, responseFileName);
 
@@ -2260,10 +2499,10 @@ accept_connections (PRFileDesc *listenSocket, CERTCertificate *cert)
           sem_getvalue(&sem_client, &idle_threads);
           if(idle_threads <= 0)
             log(_("Server is overloaded. Processing times may be longer than normal."));
-          else if (idle_threads == max_threads)
+          else if (idle_threads == max_connections)
             log(_("Processing 1 request..."));
           else
-            log(_F("Processing %d concurrent requests...", ((int)max_threads - idle_threads) + 1));
+            log(_F("Processing %d concurrent requests...", ((int)max_connections - idle_threads) + 1));
 
           sem_wait(&sem_client);
         }
@@ -2379,9 +2618,9 @@ server_main (PRFileDesc *listenSocket)
    * If we got here from an interrupt, exit immediately if
    * the timeout is reached. Otherwise, wait indefinitiely
    * until the threads exit (or an interrupt is recieved).*/
-  if(idle_threads < max_threads)
-    log(_F("Waiting for %d outstanding requests to complete...", (int)max_threads - idle_threads));
-  while(idle_threads < max_threads)
+  if(idle_threads < max_connections)
+    log(_F("Waiting for %d outstanding requests to complete...", (int)max_connections - idle_threads));
+  while(idle_threads < max_connections)
     {
       if(pending_interrupts && timeout++ > CONCURRENCY_TIMEOUT_S)
         {
@@ -2395,6 +2634,14 @@ server_main (PRFileDesc *listenSocket)
     }
 
  done:
+  {
+    lock_guard<mutex> lock (translator_mutex);
+    if (translator_requests)
+      log (_F("Translated %lu requests, %lu of them after an identical one; at most %ld queued at once",
+              translator_requests, translator_requests_coalesced,
+              translators_queued_peak));
+  }
+
   // Clean up
   if (cert)
     CERT_DestroyCertificate (cert);
@@ -2513,8 +2760,9 @@ listen ()
     log (_("Concurrency disabled"));
 
   // Listen for connection on the socket.  The second argument is the maximum size of the queue
-  // for pending connections.
-  prStatus = PR_Listen (listenSocket, 5);
+  // for pending connections.  Requests mostly wait in translator_slot, but a burst of clients
+  // shouldn't be turned away before they get there.
+  prStatus = PR_Listen (listenSocket, 128);
   if (prStatus != PR_SUCCESS)
     {
       server_error (_("Error listening on socket"));
@@ -2522,10 +2770,11 @@ listen ()
       goto done;
     }
 
-  /* Initialize semephore with the maximum number of threads
-   * defined by --max-threads. If it is not defined, the
-   * default is the number of processors */
-  sem_init(&sem_client, 0, max_threads);
+  /* Initialize semephore with the maximum number of connections,
+   * which is based on the number of threads defined by --max-threads.
+   * If it is not defined, the default is the number of processors */
+  max_connections = max_threads * (1 + QUEUED_REQUESTS_PER_THREAD);
+  sem_init(&sem_client, 0, max_connections);
 
   // Loop forever. We check our certificate (and regenerate, if necessary) and then start the
   // server. The server will go down when our certificate is no longer valid (e.g. expired). We
@@ -26,7 +26,14 @@
 #include <deque>
 #include <algorithm>
 #include <type_traits>
+#include <map>
+#include <mutex>
+#include <fstream>
+#include <sstream>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <gelf.h>
 #include "bpfinterp.h"
 #include "libbpf.h"
 #include "../bpf-internal.h"
@@ -299,6 +306,89 @@ foreach_state_cleanup(foreach_state &s)
     free(ptr);
 }
 
+// Looks up a long element of a percpu map, summed over all cpus:
+static int
+map_lookup_percpu_sum(int fd, void *key, uint64_t *value,
+                      bpf_transport_context *ctx)
+{
+  uint64_t *data = (uint64_t *)calloc(ctx->ncpus, sizeof(uint64_t));
+  if (data == 0)
+    return -1;
+  int res = bpf_lookup_elem(fd, key, data);
+  if (!res)
+    {
+      *value = 0;
+      for (unsigned i = 0; i < ctx->ncpus; i++)
+        *value += data[i];
+    }
+  free(data);
+  return res;
+}
+
+#ifdef HAVE_BPF_MAP_LOOKUP_BATCH
+// Reads all elements of a map into s with a few BPF_MAP_LOOKUP_BATCH
+// calls, instead of a get_next_key and a lookup call for each one.
+// Returns false, with s left alone, if the kernel can't do that.
+static bool
+foreach_state_fill_batch(int fd_idx, const foreach_info &fi, foreach_state &s,
+                         bool use_val, bool col_long,
+                         bpf_transport_context *ctx)
+{
+  const bpf_map_def &attr = ctx->map_attrs[fd_idx];
+  int fd = (*ctx->map_fds)[fd_idx];
+  bool percpu = attr.type == BPF_MAP_TYPE_PERCPU_HASH;
+  size_t key_size = attr.key_size;
+  // The values of a percpu map come as one 8-aligned slot per cpu:
+  size_t value_size = percpu ? ((attr.value_size + 7) & ~7u) * ctx->ncpus
+                             : attr.value_size;
+  // A map never holds more than max_entries, so this takes one call
+  // unless the map is exactly full.
+  size_t cap = attr.max_entries + 1;
+  std::vector<uint64_t> keys((cap * key_size + 7) / 8);
+  std::vector<uint64_t> values((cap * value_size + 7) / 8);
+  // The batch tokens are opaque, a bucket number for hash maps:
+  std::vector<uint64_t> in_batch((key_size + 7) / 8 + 1);
+  std::vector<uint64_t> out_batch(in_batch.size());
+  size_t n = 0;
+
+  for (bool first = true; n < cap; first = false)
+    {
+      unsigned count = cap - n;
+      int rc = bpf_lookup_batch(fd, first ? NULL : in_batch.data(),
+                                out_batch.data(),
+                                (char *)keys.data() + n * key_size,
+                                (char *)values.data() + n * value_size,
+                                &count);
+      if (rc && errno != ENOENT)
+        return false;
+      n += count;
+      if (rc) // ENOENT: that was the last of them
+        break;
+      in_batch = out_batch;
+    }
+
+  for (size_t i = 0; i < n; i++)
+    {
+      uint64_t *kp = (uint64_t *)((char *)keys.data() + i * key_size);
+      if (!use_val)
+        {
+          foreach_state_add(fi, s, kp, kp, col_long);
+          continue;
+        }
+      uint64_t *vp = (uint64_t *)((char *)values.data() + i * value_size);
+      uint64_t sum = 0;
+      if (percpu)
+        {
+          for (unsigned c = 0; c < ctx->ncpus; c++)
+            sum += vp[c * ((attr.value_size + 7) / 8)];
+          vp = &sum;
+        }
+      foreach_state_add(fi, s, kp, vp, col_long);
+    }
+  return true;
+}
+#endif
+
 // Wrapper for bpf_get_next_key that includes logic for accessing
 // keys in ascending or descending order, or
 // (PR23858) in ascending or descending order by value.
@@ -424,7 +514,15 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
       uint64_t *np = (uint64_t *)_n;
       foreach_state s;
 
-      int rc = bpf_get_next_key(fd, 0, as_ptr(np));
+      int rc = 0;
+#ifdef HAVE_BPF_MAP_LOOKUP_BATCH
+      if (!bpf_foreach_no_batch
+          && foreach_state_fill_batch(fd_idx, fi, s, use_val,
+                                      use_val ? val_long : key_long, ctx))
+        rc = -1; // all read already
+      else
+#endif
+        rc = bpf_get_next_key(fd, 0, as_ptr(np));
       while (!rc)
         {
           if (use_val)
@@ -432,7 +530,11 @@ map_get_next_key(int fd_idx, int64_t key, int64_t next_key,
               char _v[BPF_MAXKEYLEN_PLUS];
               _v[BPF_MAXSTRINGLEN] = _v[BPF_MAXKEYLEN] = '\0';
               uint64_t *vp = (uint64_t *)_v;
-              int res = bpf_lookup_elem(fd, as_ptr(np), as_ptr(vp));
+              int res;
+              if (ctx->map_attrs[fd_idx].type == BPF_MAP_TYPE_PERCPU_HASH)
+                res = map_lookup_percpu_sum(fd, np, vp, ctx);
+              else
+                res = bpf_lookup_elem(fd, as_ptr(np), as_ptr(vp));
               if (res) // element could not be found
                 stapbpf_abort("bpf_map_get_next_key BUG: could not find key " \
                               "returned by bpf_get_next_key");
@@ -632,6 +734,8 @@ stapbpf_stat_get(bpf::globals::agg_idx agg_id, uint64_t idx,
     case sc_min:
     case sc_max:
     case sc_variance:
+    case sc_quantile:
+    case sc_distinct:
     default:
       stapbpf_abort("unsupported aggregate");
     }
@@ -685,6 +789,218 @@ bpf_get_procfs_value(bpf_transport_context* ctx)
   return (uint64_t) (ctx->procfs_msg.data());
 }
 
+// Symbols of backtraces, by address:
+struct bpf_symbol {
+  uint64_t addr;
+  uint64_t size; // -- 0 if unknown
+  std::string name;
+  std::string module;
+  bool operator< (const bpf_symbol &o) const { return addr < o.addr; }
+};
+
+// The kernel's, from /proc/kallsyms, where the next one starts is
+// where each ends:
+static std::vector<bpf_symbol> kernel_symbols;
+
+static void
+load_kernel_symbols()
+{
+  std::ifstream kallsyms("/proc/kallsyms");
+  std::string line;
+
+  while (std::getline(kallsyms, line))
+    {
+      std::istringstream l(line);
+      bpf_symbol sym;
+      std::string type;
+      l >> std::hex >> sym.addr >> type >> sym.name;
+      if (!l || sym.addr == 0 || (type != "t" && type != "T"))
+        continue;
+      if (!(l >> sym.module))
+        sym.module = "kernel";
+      else if (sym.module.size() > 2 && sym.module[0] == '[')
+        sym.module = sym.module.substr(1, sym.module.size() - 2);
+      sym.size = 0;
+      kernel_symbols.push_back(sym);
+    }
+  std::sort(kernel_symbols.begin(), kernel_symbols.end());
+  for (size_t i = 0; i + 1 < kernel_symbols.size(); i++)
+    kernel_symbols[i].size = kernel_symbols[i+1].addr - kernel_symbols[i].addr;
+}
+
+// The function symbols of an ELF file, and its PT_LOAD segments to map
+// file offsets to their addresses:
+struct bpf_elf_symbols {
+  std::vector<bpf_symbol> symbols;
+  std::vector<GElf_Phdr> loads;
+};
+static std::map<std::string, bpf_elf_symbols> elf_symbols;
+
+static const bpf_elf_symbols &
+load_elf_symbols(const std::string &path)
+{
+  auto it = elf_symbols.find(path);
+  if (it != elf_symbols.end())
+    return it->second;
+
+  bpf_elf_symbols &es = elf_symbols[path];
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return es;
+  elf_version(EV_CURRENT);
+  Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
+  if (elf != NULL)
+    {
+      size_t nphdrs = 0;
+      elf_getphdrnum(elf, &nphdrs);
+      for (size_t i = 0; i < nphdrs; i++)
+        {
+          GElf_Phdr phdr;
+          if (gelf_getphdr(elf, i, &phdr) && phdr.p_type == PT_LOAD)
+            es.loads.push_back(phdr);
+        }
+
+      // Prefer the full .symtab, which stripped files lack:
+      for (unsigned type : { SHT_SYMTAB, SHT_DYNSYM })
+        {
+          Elf_Scn *scn = NULL;
+          while ((scn = elf_nextscn(elf, scn)) != NULL)
+            {
+              GElf_Shdr shdr;
+              if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != type
+                  || shdr.sh_entsize == 0)
+                continue;
+              Elf_Data *data = elf_getdata(scn, NULL);
+              size_t n = shdr.sh_size / shdr.sh_entsize;
+              for (size_t i = 0; data && i < n; i++)
+                {
+                  GElf_Sym s;
+                  if (!gelf_getsym(data, i, &s)
+                      || GELF_ST_TYPE(s.st_info) != STT_FUNC || s.st_value == 0)
+                    continue;
+                  const char *name = elf_strptr(elf, shdr.sh_link, s.st_name);
+                  if (name)
+                    es.symbols.push_back({ s.st_value, s.st_size, name, path });
+                }
+            }
+          if (!es.symbols.empty())
+            break;
+        }
+      std::sort(es.symbols.begin(), es.symbols.end());
+      elf_end(elf);
+    }
+  close(fd);
+  return es;
+}
+
+// The symbol addr falls in, if any:
+static const bpf_symbol *
+find_symbol(const std::vector<bpf_symbol> &symbols, uint64_t addr)
+{
+  auto it = std::upper_bound(symbols.begin(), symbols.end(),
+                             bpf_symbol{ addr, 0, "", "" });
+  if (it == symbols.begin())
+    return NULL;
+  --it;
+  if (it->size != 0 && addr >= it->addr + it->size)
+    return NULL;
+  return &*it;
+}
+
+// A file mapping of a process, from /proc/PID/maps:
+struct bpf_mapping {
+  uint64_t start, end, offset;
+  std::string path;
+};
+
+static std::vector<bpf_mapping>
+read_mappings(unsigned pid)
+{
+  std::vector<bpf_mapping> maps;
+  std::ifstream f("/proc/" + std::to_string(pid) + "/maps");
+  std::string line;
+
+  while (std::getline(f, line))
+    {
+      std::istringstream l(line);
+      bpf_mapping m;
+      std::string perms, dev, inode;
+      char dash;
+      l >> std::hex >> m.start >> dash >> m.end >> perms >> m.offset
+        >> dev >> inode >> m.path;
+      if (l && !m.path.empty() && m.path[0] == '/'
+          && perms.find('x') != std::string::npos)
+        maps.push_back(m);
+    }
+  return maps;
+}
+
+static void
+print_frame(FILE *f, uint64_t addr, const bpf_symbol *sym, uint64_t sym_addr)
+{
+  if (sym == NULL)
+    fprintf(f, " 0x%" PRIx64 "\n", addr);
+  else
+    fprintf(f, " 0x%" PRIx64 " : %s+0x%" PRIx64 "/0x%" PRIx64 " [%s]\n",
+            addr, sym->name.c_str(), sym_addr - sym->addr, sym->size,
+            sym->module.c_str());
+}
+
+// Print the backtrace a backtrace() or ubacktrace() id names, from the
+// stack map.  User ids carry the process in their upper half, whose
+// mappings tell the files of the frames, as long as it still runs.
+static void
+bpf_print_stack(uint64_t id, bool user, bpf_transport_context *ctx)
+{
+  uint32_t key = (uint32_t)id - 1;
+  uint64_t ips[BPF_MAXSTACKDEPTH];
+  int fd = -1;
+
+  if ((uint32_t)id == 0)
+    return;
+  for (size_t i = 0; i < ctx->map_fds->size(); i++)
+    if (ctx->map_attrs[i].type == BPF_MAP_TYPE_STACK_TRACE)
+      fd = (*ctx->map_fds)[i];
+  memset(ips, 0, sizeof(ips));
+  if (fd < 0 || bpf_lookup_elem(fd, &key, ips) != 0)
+    return;
+
+  std::vector<bpf_mapping> maps;
+  if (user)
+    maps = read_mappings(id >> 32);
+  else if (kernel_symbols.empty())
+    load_kernel_symbols();
+
+  for (unsigned i = 0; i < BPF_MAXSTACKDEPTH && ips[i] != 0; i++)
+    {
+      uint64_t addr = ips[i];
+      if (!user)
+        {
+          print_frame(ctx->output_f, addr, find_symbol(kernel_symbols, addr), addr);
+          continue;
+        }
+
+      const bpf_symbol *sym = NULL;
+      uint64_t vaddr = 0;
+      for (const bpf_mapping &m : maps)
+        if (addr >= m.start && addr < m.end)
+          {
+            const bpf_elf_symbols &es = load_elf_symbols(m.path);
+            uint64_t off = addr - m.start + m.offset;
+            for (const GElf_Phdr &p : es.loads)
+              if (off >= p.p_offset && off < p.p_offset + p.p_filesz)
+                {
+                  vaddr = off - p.p_offset + p.p_vaddr;
+                  sym = find_symbol(es.symbols, vaddr);
+                  break;
+                }
+            break;
+          }
+      print_frame(ctx->output_f, addr, sym, vaddr);
+    }
+  fflush(ctx->output_f);
+}
+
 enum bpf_perf_event_ret
 bpf_handle_transport_msg(void *buf, size_t size,
                          bpf_transport_context *ctx)
@@ -695,7 +1011,8 @@ bpf_handle_transport_msg(void *buf, size_t size,
     BPF_TRANSPORT_ARG content_start;
   };
   bpf_transport_msg *_msg = (bpf_transport_msg *) buf;
-  bpf::globals::perf_event_type msg_type = (bpf::globals::perf_event_type)_msg->type;
+  bpf::globals::perf_event_type msg_type
+    = (bpf::globals::perf_event_type)(_msg->type & BPF_TRANSPORT_TYPE_MASK);
   void *msg_content = (void*)&_msg->content_start;
   size_t msg_size = size - sizeof(BPF_TRANSPORT_ARG);
 
@@ -810,42 +1127,175 @@ bpf_handle_transport_msg(void *buf, size_t size,
       ctx->printf_arg_types.push_back(msg_type);
       break;
 
+    case bpf::globals::STP_PRINT_STACK:
+    case bpf::globals::STP_PRINT_USTACK:
+      if (msg_size != sizeof(BPF_TRANSPORT_ARG))
+        stapbpf_abort("wrong argument size");
+      bpf_print_stack(*(BPF_TRANSPORT_ARG*)msg_content,
+                      msg_type == bpf::globals::STP_PRINT_USTACK, ctx);
+      break;
+
     default:
       stapbpf_abort("unknown transport message");
     } 
   return LIBBPF_PERF_EVENT_CONT;
 }
 
-uint64_t
-bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
-              bpf_transport_context *ctx)
-{
-  uint64_t result = 0; // return value
-  uint64_t stack[65536 / 8]; // see MAX_BPF_USER_STACK in bpf-internal.h
-  uint64_t regs[MAX_BPF_REG];
-  memset(regs, 0x0, sizeof(uint64_t) * MAX_BPF_REG);
-  const struct bpf_insn *i = insns;
-  static std::vector<uint64_t *> map_values;
-
-  // Multiple threads accessing strings can cause concurrency issues for
-  // procfs_probes. However, the procfs_lock should prevent this and thus,
-  // clearing it on exit is unecessary for now.
-  static std::vector<std::string> strings;
+// What the helper calls of a run of the interpreter work with:
+struct interp_state {
+  bpf_transport_context *ctx;
+  std::vector<uint64_t *> &map_values;
+  std::vector<std::string> &strings;
+  foreach_stack *foreach_ctxs;
+};
 
+// Runs the helper function fn with the arguments in regs[1..5].
+static uint64_t
+bpf_interp_call(uint64_t fn, const uint64_t regs[], interp_state &st)
+{
+  bpf_transport_context *ctx = st.ctx;
   bpf_map_def *map_attrs = ctx->map_attrs;
   std::vector<int> &map_fds = *ctx->map_fds;
+  std::vector<uint64_t *> &map_values = st.map_values;
+  std::vector<std::string> &strings = st.strings;
+  foreach_stack *foreach_ctxs = st.foreach_ctxs;
   FILE *output_f = ctx->output_f;
+  uint64_t dr = 0;
+  bpf_perf_event_ret tr;
 
-  foreach_stack foreach_ctxs[map_fds.size()];
+  switch (fn)
+    {
+    case BPF_FUNC_map_lookup_elem:
+      {
+        // allocate correctly sized buffer and store it in map_values
+        uint64_t *lookup_tmp = (uint64_t *)malloc(map_attrs[regs[1]].value_size);
+        map_values.push_back(lookup_tmp);
+
+        int res;
+        // A percpu counter reads as the sum of its cpus:
+        if (map_attrs[regs[1]].type == BPF_MAP_TYPE_PERCPU_HASH)
+          res = map_lookup_percpu_sum(map_fds[regs[1]],
+                                      as_ptr(regs[2]), lookup_tmp,
+                                      ctx);
+        else
+          res = bpf_lookup_elem(map_fds[regs[1]], as_ptr(regs[2]),
+                                as_ptr(lookup_tmp));
 
-  map_values.clear(); // XXX: avoid double free
+        if (res)
+          // element could not be found
+          dr = 0;
+        else
+          dr = as_int(lookup_tmp);
+      }
+      break;
+    case BPF_FUNC_map_update_elem:
+      dr = bpf_update_elem(map_fds[regs[1]], as_ptr(regs[2]),
+                           as_ptr(regs[3]), regs[4]);
+      break;
+    case BPF_FUNC_map_delete_elem:
+      dr = bpf_delete_elem(map_fds[regs[1]], as_ptr(regs[2]));
+      break;
+    case BPF_FUNC_ktime_get_ns:
+      dr = bpf_ktime_get_ns();
+      break;
+    case BPF_FUNC_perf_event_output:
+      /* XXX ignored, but could be checked: regs[1], regs[2], regs[3] */
+      tr = bpf_handle_transport_msg
+        ((void *)regs[4], (size_t)regs[5], ctx);
+      /* Normalize return value to match the helper API.
+         XXX: May want to look at errno as well? */
+      dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
+      break;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+    case BPF_FUNC_ringbuf_output:
+      /* XXX ignored, but could be checked: regs[1], regs[4] */
+      tr = bpf_handle_transport_msg
+        ((void *)regs[2], (size_t)regs[3], ctx);
+      dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
+      break;
+#endif
+    case BPF_FUNC_get_smp_processor_id:
+      dr = ctx->cpu;
+      break;
+    case BPF_FUNC_get_stackid:
+      /* No stack to take in begin and end probes. */
+      dr = -EOPNOTSUPP;
+      break;
+    case BPF_FUNC_trace_printk:
+      /* XXX no longer need this code after PR22330 */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+      // regs[2] is the strlen(regs[1]) - not used by printf(3);
+      // instead we assume regs[1] string is \0 terminated
+      dr = fprintf(output_f, remove_tag(as_str(regs[1])).c_str(),
+                   /*regs[2],*/ regs[3], regs[4], regs[5]);
+      fflush(output_f);
+#pragma GCC diagnostic pop
+      break;
+    case bpf::BPF_FUNC_sprintf:
+      dr = bpf_sprintf(strings, as_str(regs[1]),
+                       regs[3], regs[4], regs[5]);
+      break;
+    case bpf::BPF_FUNC_text_str:
+      dr = bpf_text_str(strings, as_str(regs[1]), false);
+      break;
+    case bpf::BPF_FUNC_string_quoted:
+      dr = bpf_text_str(strings, as_str(regs[1]), true);
+      break;
+    case bpf::BPF_FUNC_str_concat:
+      dr = bpf_str_concat(strings, as_str(regs[1]), 
+                          as_str(regs[2]));
+      break;
+    case bpf::BPF_FUNC_map_get_next_key:
+      dr = map_get_next_key(regs[1], regs[2], regs[3],
+                            regs[4], regs[5],
+                            ctx, foreach_ctxs[regs[1]],
+                            strings, map_values);
+      break;
+    case bpf::BPF_FUNC_stapbpf_stat_get:
+      dr = stapbpf_stat_get((bpf::globals::agg_idx)regs[1], regs[2],
+                             bpf::globals::deintern_sc_type(regs[3]), ctx);
+      break;
+    case bpf::BPF_FUNC_gettimeofday_ns:
+      dr = bpf_gettimeofday_ns();
+      break;
+    case bpf::BPF_FUNC_get_target:
+      dr = bpf_get_target();
+      break;
+    case bpf::BPF_FUNC_set_procfs_value:
+      dr = bpf_set_procfs_value(as_str(regs[1]), ctx);
+      break;
+    case bpf::BPF_FUNC_append_procfs_value:
+      dr = bpf_append_procfs_value(as_str(regs[1]), ctx);
+      break;
+    case bpf::BPF_FUNC_get_procfs_value:
+      dr = bpf_get_procfs_value(ctx);
+      break;
+    default:
+      stapbpf_abort("unknown helper function");
+    }
+  return dr;
+}
 
-  regs[BPF_REG_10] = (uintptr_t)stack + sizeof(stack);
+// Set by stapbpf --interp=switch:
+bool bpf_interp_use_switch = false;
+
+// Set by stapbpf --no-batch:
+bool bpf_foreach_no_batch = false;
+
+extern int verbose; // set from stapbpf command line
+
+// The plain interpreter, which decodes each instruction as it runs it.
+static uint64_t
+bpf_interpret_switch(size_t ninsns, const struct bpf_insn insns[],
+                     uint64_t regs[], interp_state &st, uint64_t &icount)
+{
+  const struct bpf_insn *i = insns;
 
   while ((size_t)(i - insns) < ninsns)
     {
+      icount++;
       uint64_t dr, sr, si, s1;
-      bpf_perf_event_ret tr;
 
       dr = regs[i->dst_reg];
       sr = regs[i->src_reg];
@@ -918,7 +1368,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  if (s1 == 0)
             {
               // TODO: Signal a proper error.
-              result = 0; goto cleanup;
+              return 0;
             }
 	  dr /= s1;
 	  break;
@@ -927,7 +1377,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  if (s1 == 0)
             {
               // TODO: Signal a proper error.
-              result = 0; goto cleanup;
+              return 0;
             }
 	  dr %= s1;
 	  break;
@@ -960,7 +1410,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  if ((uint32_t)s1 == 0)
             {
               // TODO: Signal a proper error.
-              result = 0; goto cleanup;
+              return 0;
             }
 	  dr = (uint32_t)dr / (uint32_t)s1;
 	  break;
@@ -969,7 +1419,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  if ((uint32_t)s1 == 0)
             {
               // TODO: Signal a proper error.
-              result = 0; goto cleanup;
+              return 0;
             }
 	  dr = (uint32_t)dr % (uint32_t)s1;
 	  break;
@@ -981,11 +1431,10 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	      dr = (uint32_t)si | ((uint64_t)i[1].imm << 32);
 	      break;
 	    case BPF_PSEUDO_MAP_FD:
-	      if (si >= map_fds.size())
+	      if (si >= st.ctx->map_fds->size())
                 {
                   // TODO: Signal a proper error.
-                  result = 0;
-                  goto cleanup;
+                  return 0;
                 }
 	      dr = si;
 	      break;
@@ -1037,95 +1486,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  continue;
 
 	case BPF_JMP | BPF_CALL:
-	  switch (si)
-	    {
-	    case BPF_FUNC_map_lookup_elem:
-	      {
-                // allocate correctly sized buffer and store it in map_values
-                uint64_t *lookup_tmp = (uint64_t *)malloc(map_attrs[regs[1]].value_size);
-                map_values.push_back(lookup_tmp);
-
-	        int res = bpf_lookup_elem(map_fds[regs[1]], as_ptr(regs[2]),
-			                  as_ptr(lookup_tmp));
-
-	        if (res)
-		  // element could not be found
-	          dr = 0;
-	        else
-	          dr = as_int(lookup_tmp);
-	      }
-	      break;
-	    case BPF_FUNC_map_update_elem:
-	      dr = bpf_update_elem(map_fds[regs[1]], as_ptr(regs[2]),
-			           as_ptr(regs[3]), regs[4]);
-	      break;
-	    case BPF_FUNC_map_delete_elem:
-	      dr = bpf_delete_elem(map_fds[regs[1]], as_ptr(regs[2]));
-	      break;
-	    case BPF_FUNC_ktime_get_ns:
-              dr = bpf_ktime_get_ns();
-              break;
-            case BPF_FUNC_perf_event_output:
-              /* XXX ignored, but could be checked: regs[1], regs[2], regs[3] */
-              tr = bpf_handle_transport_msg
-                ((void *)regs[4], (size_t)regs[5], ctx);
-              /* Normalize return value to match the helper API.
-                 XXX: May want to look at errno as well? */
-              dr = (tr != LIBBPF_PERF_EVENT_ERROR) ? 0 : -1;
-              break;
-	    case BPF_FUNC_trace_printk:
-              /* XXX no longer need this code after PR22330 */
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-nonliteral"
-              // regs[2] is the strlen(regs[1]) - not used by printf(3);
-              // instead we assume regs[1] string is \0 terminated
-	      dr = fprintf(output_f, remove_tag(as_str(regs[1])).c_str(),
-                           /*regs[2],*/ regs[3], regs[4], regs[5]);
-              fflush(output_f);
-#pragma GCC diagnostic pop
-	      break;
-            case bpf::BPF_FUNC_sprintf:
-              dr = bpf_sprintf(strings, as_str(regs[1]),
-                               regs[3], regs[4], regs[5]);
-              break;
-            case bpf::BPF_FUNC_text_str:
-              dr = bpf_text_str(strings, as_str(regs[1]), false);
-              break;
-            case bpf::BPF_FUNC_string_quoted:
-              dr = bpf_text_str(strings, as_str(regs[1]), true);
-              break;
-            case bpf::BPF_FUNC_str_concat:
-              dr = bpf_str_concat(strings, as_str(regs[1]), 
-                                  as_str(regs[2]));
-              break;
-            case bpf::BPF_FUNC_map_get_next_key:
-              dr = map_get_next_key(regs[1], regs[2], regs[3],
-                                    regs[4], regs[5],
-                                    ctx, foreach_ctxs[regs[1]],
-                                    strings, map_values);
-              break;
-            case bpf::BPF_FUNC_stapbpf_stat_get:
-              dr = stapbpf_stat_get((bpf::globals::agg_idx)regs[1], regs[2],
-                                     bpf::globals::deintern_sc_type(regs[3]), ctx);
-              break;
-            case bpf::BPF_FUNC_gettimeofday_ns:
-              dr = bpf_gettimeofday_ns();
-              break;
-            case bpf::BPF_FUNC_get_target:
-              dr = bpf_get_target();
-              break;
-            case bpf::BPF_FUNC_set_procfs_value:
-              dr = bpf_set_procfs_value(as_str(regs[1]), ctx);
-              break;
-            case bpf::BPF_FUNC_append_procfs_value:
-              dr = bpf_append_procfs_value(as_str(regs[1]), ctx);
-              break;
-            case bpf::BPF_FUNC_get_procfs_value:
-              dr = bpf_get_procfs_value(ctx);
-              break;
-	    default:
-	      stapbpf_abort("unknown helper function");
-	    }
+	  dr = bpf_interp_call(si, regs, st);
 	  regs[0] = dr;
 	  regs[1] = 0xea7bee75;
 	  regs[2] = 0xea7bee75;
@@ -1135,8 +1496,7 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
 	  goto nowrite;
 
 	case BPF_JMP | BPF_EXIT:
-	  result = regs[0];
-          goto cleanup;
+	  return regs[0];
 
 	default:
 	  stapbpf_abort("unknown bpf opcode");
@@ -1146,8 +1506,306 @@ bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
     nowrite:
       i++;
     }
-  result = 0;
- cleanup:
+  return 0;
+}
+
+#ifdef __GNUC__
+// An instruction of a program predecoded for bpf_interpret_threaded():
+struct threaded_insn {
+  const void *op;         // -- label of the code running it
+  uint8_t dst, src;
+  int16_t off;
+  uint64_t imm;           // -- sign extended, or the whole 64-bit immediate
+  const threaded_insn *target; // -- of a jump
+};
+
+// The threaded code interpreter.  Each program is decoded once, into
+// the address of the code for each instruction and its operands, and
+// each instruction jumps straight to the code of the next, instead of
+// going through a switch.  The behaviour is the same as the switch
+// interpreter's.
+static uint64_t
+bpf_interpret_threaded(size_t ninsns, const struct bpf_insn insns[],
+                       uint64_t regs[], interp_state &st, uint64_t &icount)
+{
+  static std::mutex decoded_lock;
+  static std::map<const struct bpf_insn *, std::vector<threaded_insn>> decoded;
+  const threaded_insn *ip;
+  uint64_t n = 0;
+
+  {
+    std::lock_guard<std::mutex> guard(decoded_lock);
+    auto it = decoded.find(insns);
+    if (it == decoded.end())
+      {
+        // One slot per instruction so that jump offsets carry over,
+        // and one past the end, which ends the program like running
+        // off the end does.
+        std::vector<threaded_insn> p(ninsns + 1);
+        for (size_t k = 0; k <= ninsns; k++)
+          {
+            threaded_insn &t = p[k];
+            t.op = &&op_end;
+            t.target = &p[0] + ninsns;
+            if (k == ninsns)
+              break;
+
+            const struct bpf_insn *i = &insns[k];
+            t.dst = i->dst_reg;
+            t.src = i->src_reg;
+            t.off = i->off;
+            t.imm = (uint64_t)(int64_t)i->imm;
+            if (BPF_CLASS(i->code) == BPF_JMP)
+              {
+                int64_t to = (int64_t)k + 1 + i->off;
+                if (to >= 0 && (size_t)to <= ninsns)
+                  t.target = &p[0] + to;
+              }
+
+            switch (i->code)
+              {
+#define OP(code, label) case code: t.op = &&label; break
+#define OP_XK(code, label) \
+  OP(code | BPF_X, label##_x); OP(code | BPF_K, label##_k)
+                OP(BPF_LDX | BPF_MEM | BPF_B, op_ldx_b);
+                OP(BPF_LDX | BPF_MEM | BPF_H, op_ldx_h);
+                OP(BPF_LDX | BPF_MEM | BPF_W, op_ldx_w);
+                OP(BPF_LDX | BPF_MEM | BPF_DW, op_ldx_dw);
+                OP(BPF_ST | BPF_MEM | BPF_B, op_st_b);
+                OP(BPF_ST | BPF_MEM | BPF_H, op_st_h);
+                OP(BPF_ST | BPF_MEM | BPF_W, op_st_w);
+                OP(BPF_ST | BPF_MEM | BPF_DW, op_st_dw);
+                OP(BPF_STX | BPF_MEM | BPF_B, op_stx_b);
+                OP(BPF_STX | BPF_MEM | BPF_H, op_stx_h);
+                OP(BPF_STX | BPF_MEM | BPF_W, op_stx_w);
+                OP(BPF_STX | BPF_MEM | BPF_DW, op_stx_dw);
+
+                OP_XK(BPF_ALU64 | BPF_ADD, op_add64);
+                OP_XK(BPF_ALU64 | BPF_SUB, op_sub64);
+                OP_XK(BPF_ALU64 | BPF_AND, op_and64);
+                OP_XK(BPF_ALU64 | BPF_OR, op_or64);
+                OP_XK(BPF_ALU64 | BPF_LSH, op_lsh64);
+                OP_XK(BPF_ALU64 | BPF_RSH, op_rsh64);
+                OP_XK(BPF_ALU64 | BPF_XOR, op_xor64);
+                OP_XK(BPF_ALU64 | BPF_MUL, op_mul64);
+                OP_XK(BPF_ALU64 | BPF_MOV, op_mov64);
+                OP_XK(BPF_ALU64 | BPF_ARSH, op_arsh64);
+                OP_XK(BPF_ALU64 | BPF_DIV, op_div64);
+                OP_XK(BPF_ALU64 | BPF_MOD, op_mod64);
+                OP(BPF_ALU64 | BPF_NEG, op_neg64);
+
+                OP_XK(BPF_ALU | BPF_ADD, op_add32);
+                OP_XK(BPF_ALU | BPF_SUB, op_sub32);
+                OP_XK(BPF_ALU | BPF_AND, op_and32);
+                OP_XK(BPF_ALU | BPF_OR, op_or32);
+                OP_XK(BPF_ALU | BPF_LSH, op_lsh32);
+                OP_XK(BPF_ALU | BPF_RSH, op_rsh32);
+                OP_XK(BPF_ALU | BPF_XOR, op_xor32);
+                OP_XK(BPF_ALU | BPF_MUL, op_mul32);
+                OP_XK(BPF_ALU | BPF_MOV, op_mov32);
+                OP_XK(BPF_ALU | BPF_ARSH, op_arsh32);
+                OP_XK(BPF_ALU | BPF_DIV, op_div32);
+                OP_XK(BPF_ALU | BPF_MOD, op_mod32);
+                OP(BPF_ALU | BPF_NEG, op_neg32);
+
+                OP_XK(BPF_JMP | BPF_JEQ, op_jeq);
+                OP_XK(BPF_JMP | BPF_JNE, op_jne);
+                OP_XK(BPF_JMP | BPF_JGT, op_jgt);
+                OP_XK(BPF_JMP | BPF_JGE, op_jge);
+                OP_XK(BPF_JMP | BPF_JSGT, op_jsgt);
+                OP_XK(BPF_JMP | BPF_JSGE, op_jsge);
+                OP_XK(BPF_JMP | BPF_JSET, op_jset);
+                OP(BPF_JMP | BPF_JA, op_ja);
+                OP(BPF_JMP | BPF_CALL, op_call);
+                OP(BPF_JMP | BPF_EXIT, op_exit);
+#undef OP_XK
+#undef OP
+
+              case BPF_LD | BPF_IMM | BPF_DW:
+                if (k + 1 >= ninsns)
+                  t.op = &&op_bad_ld;
+                else if (i->src_reg == 0)
+                  {
+                    t.op = &&op_ld_imm64;
+                    t.imm = (uint32_t)i->imm | ((uint64_t)i[1].imm << 32);
+                  }
+                else if (i->src_reg == BPF_PSEUDO_MAP_FD)
+                  t.op = &&op_ld_map_fd;
+                else
+                  t.op = &&op_bad_ld;
+                break;
+
+              default:
+                t.op = &&op_unknown;
+              }
+          }
+        it = decoded.insert(std::make_pair(insns, std::move(p))).first;
+      }
+    ip = it->second.data();
+  }
+
+#define NEXT do { ip++; n++; goto *ip->op; } while (0)
+#define JUMP do { ip = ip->target; n++; goto *ip->op; } while (0)
+#define D regs[ip->dst]
+#define S regs[ip->src]
+#define ALU(label, expr) \
+  label##_x: { uint64_t dr = D, s1 = S; D = (expr); NEXT; } \
+  label##_k: { uint64_t dr = D, s1 = ip->imm; D = (expr); NEXT; }
+#define ALU_DIV(label, zero, expr) \
+  label##_x: { uint64_t dr = D, s1 = S; if (zero) goto div_zero; \
+               D = (expr); NEXT; } \
+  label##_k: { uint64_t dr = D, s1 = ip->imm; if (zero) goto div_zero; \
+               D = (expr); NEXT; }
+#define COND_JMP(label, cond) \
+  label##_x: { uint64_t dr = D, s1 = S; if (cond) JUMP; NEXT; } \
+  label##_k: { uint64_t dr = D, s1 = ip->imm; if (cond) JUMP; NEXT; }
+
+  n++;
+  goto *ip->op;
+
+ op_ldx_b:  D = *(uint8_t *)((uintptr_t)S + ip->off); NEXT;
+ op_ldx_h:  D = *(uint16_t *)((uintptr_t)S + ip->off); NEXT;
+ op_ldx_w:  D = *(uint32_t *)((uintptr_t)S + ip->off); NEXT;
+ op_ldx_dw: D = *(uint64_t *)((uintptr_t)S + ip->off); NEXT;
+ op_st_b:   *(uint8_t *)((uintptr_t)D + ip->off) = ip->imm; NEXT;
+ op_st_h:   *(uint16_t *)((uintptr_t)D + ip->off) = ip->imm; NEXT;
+ op_st_w:   *(uint32_t *)((uintptr_t)D + ip->off) = ip->imm; NEXT;
+ op_st_dw:  *(uint64_t *)((uintptr_t)D + ip->off) = ip->imm; NEXT;
+ op_stx_b:  *(uint8_t *)((uintptr_t)D + ip->off) = S; NEXT;
+ op_stx_h:  *(uint16_t *)((uintptr_t)D + ip->off) = S; NEXT;
+ op_stx_w:  *(uint32_t *)((uintptr_t)D + ip->off) = S; NEXT;
+ op_stx_dw: *(uint64_t *)((uintptr_t)D + ip->off) = S; NEXT;
+
+ ALU(op_add64, dr + s1)
+ ALU(op_sub64, dr - s1)
+ ALU(op_and64, dr & s1)
+ ALU(op_or64, dr | s1)
+ ALU(op_lsh64, dr << s1)
+ ALU(op_rsh64, dr >> s1)
+ ALU(op_xor64, dr ^ s1)
+ ALU(op_mul64, dr * s1)
+ op_mov64_x: D = S; NEXT;
+ op_mov64_k: D = ip->imm; NEXT;
+ ALU(op_arsh64, (int64_t)dr >> s1)
+ ALU_DIV(op_div64, s1 == 0, dr / s1)
+ ALU_DIV(op_mod64, s1 == 0, dr % s1)
+ op_neg64: D = -S; NEXT;
+
+ ALU(op_add32, (uint32_t)(dr + s1))
+ ALU(op_sub32, (uint32_t)(dr - s1))
+ ALU(op_and32, (uint32_t)(dr & s1))
+ ALU(op_or32, (uint32_t)(dr | s1))
+ ALU(op_lsh32, (uint64_t)((uint32_t)dr << s1))
+ ALU(op_rsh32, (uint32_t)dr >> s1)
+ ALU(op_xor32, (uint32_t)(dr ^ s1))
+ ALU(op_mul32, (uint32_t)(dr * s1))
+ op_mov32_x: D = (uint32_t)S; NEXT;
+ op_mov32_k: D = (uint32_t)ip->imm; NEXT;
+ ALU(op_arsh32, (uint64_t)((int32_t)dr >> s1))
+ ALU_DIV(op_div32, (uint32_t)s1 == 0, (uint32_t)dr / (uint32_t)s1)
+ ALU_DIV(op_mod32, (uint32_t)s1 == 0, (uint32_t)dr % (uint32_t)s1)
+ op_neg32: D = -(uint32_t)S; NEXT;
+
+ op_ld_imm64:
+  D = ip->imm;
+  ip++;
+  NEXT;
+ op_ld_map_fd:
+  if (ip->imm >= st.ctx->map_fds->size())
+    {
+      // TODO: Signal a proper error.
+      icount += n;
+      return 0;
+    }
+  D = ip->imm;
+  ip++;
+  NEXT;
+ op_bad_ld:
+  stapbpf_just_abort();
+
+ COND_JMP(op_jeq, dr == s1)
+ COND_JMP(op_jne, dr != s1)
+ COND_JMP(op_jgt, dr > s1)
+ COND_JMP(op_jge, dr >= s1)
+ COND_JMP(op_jsgt, (int64_t)dr > (int64_t)s1)
+ COND_JMP(op_jsge, (int64_t)dr >= (int64_t)s1)
+ COND_JMP(op_jset, dr & s1)
+ op_ja: JUMP;
+
+ op_call:
+  regs[0] = bpf_interp_call(ip->imm, regs, st);
+  regs[1] = 0xea7bee75;
+  regs[2] = 0xea7bee75;
+  regs[3] = 0xea7bee75;
+  regs[4] = 0xea7bee75;
+  regs[5] = 0xea7bee75;
+  NEXT;
+
+ op_exit:
+  icount += n;
+  return regs[0];
+
+ div_zero:
+  // TODO: Signal a proper error.
+ op_end:
+  icount += n;
+  return 0;
+
+ op_unknown:
+  stapbpf_abort("unknown bpf opcode");
+
+#undef COND_JMP
+#undef ALU_DIV
+#undef ALU
+#undef S
+#undef D
+#undef JUMP
+#undef NEXT
+}
+#endif
+
+uint64_t
+bpf_interpret(size_t ninsns, const struct bpf_insn insns[],
+              bpf_transport_context *ctx)
+{
+  uint64_t result = 0; // return value
+  uint64_t stack[65536 / 8]; // see MAX_BPF_USER_STACK in bpf-internal.h
+  uint64_t regs[MAX_BPF_REG];
+  memset(regs, 0x0, sizeof(uint64_t) * MAX_BPF_REG);
+  static std::vector<uint64_t *> map_values;
+
+  // Multiple threads accessing strings can cause concurrency issues for
+  // procfs_probes. However, the procfs_lock should prevent this and thus,
+  // clearing it on exit is unecessary for now.
+  static std::vector<std::string> strings;
+
+  foreach_stack foreach_ctxs[ctx->map_fds->size()];
+  interp_state st = { ctx, map_values, strings, foreach_ctxs };
+
+  map_values.clear(); // XXX: avoid double free
+
+  regs[BPF_REG_10] = (uintptr_t)stack + sizeof(stack);
+
+  // With -vv, how fast each program ran:
+  uint64_t icount = 0;
+  uint64_t start = verbose > 1 ? bpf_ktime_get_ns() : 0;
+
+#ifdef __GNUC__
+  if (!bpf_interp_use_switch)
+    result = bpf_interpret_threaded(ninsns, insns, regs, st, icount);
+  else
+#endif
+    result = bpf_interpret_switch(ninsns, insns, regs, st, icount);
+
+  if (verbose > 1)
+    {
+      uint64_t ns = bpf_ktime_get_ns() - start;
+      fprintf(stderr, "interpreter: %" PRIu64 " insns in %" PRIu64 " ns"
+              " (%" PRIu64 " insns/s, %s)\n", icount, ns,
+              ns ? (uint64_t)(icount * 1e9 / ns) : 0,
+              bpf_interp_use_switch ? "switch" : "threaded");
+    }
+
   for (uint64_t *ptr : map_values)
     free(ptr);
   map_values.clear(); // XXX: avoid double free
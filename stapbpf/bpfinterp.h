@@ -89,6 +89,14 @@ uint64_t bpf_interpret(size_t ninsns,
                        const struct bpf_insn insns[],
                        bpf_transport_context *ctx);
 
+// Whether bpf_interpret uses the plain switch interpreter rather than
+// the threaded code one:
+extern bool bpf_interp_use_switch;
+
+// Whether sorted foreach loops read their map a key at a time even
+// where BPF_MAP_LOOKUP_BATCH would do:
+extern bool bpf_foreach_no_batch;
+
 extern "C" {
 extern int target_pid;
 };
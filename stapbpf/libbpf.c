@@ -1,4 +1,5 @@
 /* eBPF mini library */
+#include "config.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <linux/unistd.h>
@@ -90,45 +91,53 @@ int bpf_get_next_key(int fd, void *key, void *next_key)
 	return syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
 }
 
+#ifdef HAVE_BPF_MAP_LOOKUP_BATCH
+int bpf_lookup_batch(int fd, void *in_batch, void *out_batch, void *keys,
+		     void *values, unsigned *count)
+{
+	union bpf_attr attr;
+	int rc;
+        memset(&attr, 0, sizeof(union bpf_attr));
+	attr.batch.map_fd = fd;
+	attr.batch.in_batch = ptr_to_u64(in_batch);
+	attr.batch.out_batch = ptr_to_u64(out_batch);
+	attr.batch.keys = ptr_to_u64(keys);
+	attr.batch.values = ptr_to_u64(values);
+	attr.batch.count = *count;
+
+	rc = syscall(__NR_bpf, BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+	/* The kernel reports how many elements it copied, also on error. */
+	*count = attr.batch.count;
+	return rc;
+}
+#endif
+
 #define ROUND_UP(x, n) (((x) + (n) - 1u) & ~((n) - 1u))
 
 char bpf_log_buf[LOG_BUF_SIZE];
 extern int verbose; // set from stapbpf command line
 
-int bpf_prog_load(enum bpf_prog_type prog_type,
-		  const struct bpf_insn *insns, int prog_len,
-		  const char *license, int kern_version)
+static int prog_load_attr(union bpf_attr *attr)
 {
-	union bpf_attr attr;
-        memset (&attr, 0, sizeof(attr)); // kernel asserts 0 pad values
-	attr.prog_type = prog_type;
-	attr.insns = ptr_to_u64((void *) insns);
-	attr.insn_cnt = prog_len / sizeof(struct bpf_insn);
-	attr.license = ptr_to_u64((void *) license);
-
         /* If the syscall fails, retry with higher verbosity to get
            the eBPF verifier output */
         int retry = 0;
  do_retry:
         if (verbose || retry)
           {
-            attr.log_buf = ptr_to_u64(bpf_log_buf);
-            attr.log_size = LOG_BUF_SIZE;
-            attr.log_level = retry ? verbose + 1 : verbose;
+            attr->log_buf = ptr_to_u64(bpf_log_buf);
+            attr->log_size = LOG_BUF_SIZE;
+            attr->log_level = retry ? verbose + 1 : verbose;
             /* they hang together, or they hang separately with -EINVAL */
           }
 
-	/* assign one field outside of struct init to make sure any
-	 * padding is zero initialized
-	 */
-	attr.kern_version = kern_version;
-
 	bpf_log_buf[0] = 0;
 
         if (verbose > 1)
-          fprintf(stderr, "Loading probe type %d, size %d\n", prog_type, prog_len);
+          fprintf(stderr, "Loading probe type %d, size %d\n",
+                  attr->prog_type, (int) (attr->insn_cnt * sizeof(struct bpf_insn)));
 
-        int rc = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+        int rc = syscall(__NR_bpf, BPF_PROG_LOAD, attr, sizeof(*attr));
         if (rc < 0 && verbose == 0 && !retry)
           {
             retry = 1; goto do_retry;
@@ -136,6 +145,44 @@ int bpf_prog_load(enum bpf_prog_type prog_type,
         return rc;
 }
 
+int bpf_prog_load(enum bpf_prog_type prog_type,
+		  const struct bpf_insn *insns, int prog_len,
+		  const char *license, int kern_version)
+{
+	union bpf_attr attr;
+        memset (&attr, 0, sizeof(attr)); // kernel asserts 0 pad values
+	attr.prog_type = prog_type;
+	attr.insns = ptr_to_u64((void *) insns);
+	attr.insn_cnt = prog_len / sizeof(struct bpf_insn);
+	attr.license = ptr_to_u64((void *) license);
+
+	/* assign one field outside of struct init to make sure any
+	 * padding is zero initialized
+	 */
+	attr.kern_version = kern_version;
+
+	return prog_load_attr(&attr);
+}
+
+#ifdef HAVE_BPF_TRACE_FENTRY
+int bpf_prog_load_btf(enum bpf_prog_type prog_type,
+		      enum bpf_attach_type attach_type, unsigned btf_id,
+		      const struct bpf_insn *insns, int prog_len,
+		      const char *license)
+{
+	union bpf_attr attr;
+        memset (&attr, 0, sizeof(attr)); // kernel asserts 0 pad values
+	attr.prog_type = prog_type;
+	attr.expected_attach_type = attach_type;
+	attr.attach_btf_id = btf_id;
+	attr.insns = ptr_to_u64((void *) insns);
+	attr.insn_cnt = prog_len / sizeof(struct bpf_insn);
+	attr.license = ptr_to_u64((void *) license);
+
+	return prog_load_attr(&attr);
+}
+#endif
+
 int bpf_obj_pin(int fd, const char *pathname)
 {
 	union bpf_attr attr;
@@ -10,10 +10,19 @@ int bpf_update_elem(int fd, void *key, void *value, unsigned long long flags);
 int bpf_lookup_elem(int fd, void *key, void *value);
 int bpf_delete_elem(int fd, void *key);
 int bpf_get_next_key(int fd, void *key, void *next_key);
+/* Only with HAVE_BPF_MAP_LOOKUP_BATCH: */
+int bpf_lookup_batch(int fd, void *in_batch, void *out_batch, void *keys,
+		     void *values, unsigned *count);
 
 int bpf_prog_load(enum bpf_prog_type prog_type,
 		  const struct bpf_insn *insns, int insn_len,
 		  const char *license, int kern_version);
+/* Only with HAVE_BPF_TRACE_FENTRY, for programs attached through the
+   kernel BTF type btf_id: */
+int bpf_prog_load_btf(enum bpf_prog_type prog_type,
+		      enum bpf_attach_type attach_type, unsigned btf_id,
+		      const struct bpf_insn *insns, int insn_len,
+		      const char *license);
 
 int bpf_obj_pin(int fd, const char *pathname);
 int bpf_obj_get(const char *pathname);
@@ -42,6 +42,7 @@
 #include <sys/utsname.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
 #include <pwd.h>
 #include "bpfinterp.h"
 #include "../util.h"
@@ -49,6 +50,7 @@
 extern "C" {
 #include <linux/bpf.h>
 #include <linux/perf_event.h>
+#include <linux/btf.h>
 /* Introduced in 4.1. */
 #ifndef PERF_EVENT_IOC_SET_BPF
 #define PERF_EVENT_IOC_SET_BPF _IOW('$', 8, __u32)
@@ -139,6 +141,16 @@ static int perf_event_page_size;
 static int perf_event_page_count = 8;
 static int perf_event_mmap_size;
 
+// Number of CPUs the transport serves, set when its map is created:
+static unsigned transport_ncpus;
+
+// The ring buffer transport, when the perf_event_map is a RINGBUF:
+static bool use_ringbuf = false;
+static unsigned long *ringbuf_consumer_pos;
+static const unsigned long *ringbuf_producer_pos;
+static const char *ringbuf_data; // -- mapped twice in a row
+static size_t ringbuf_size;
+
 // Table of interned strings:
 static std::vector<std::string> interned_strings;
 
@@ -269,6 +281,7 @@ static std::vector<timer_data> timers;
 static std::vector<perf_data> perf_probes;
 static std::vector<trace_data> tracepoint_probes;
 static std::vector<trace_data> raw_tracepoint_probes;
+static std::vector<trace_data> fentry_probes;
 static std::vector<uprobe_data> uprobes;
 
 // TODO: Move fatal() to bpfinterp.h and replace abort() calls in the interpreter.
@@ -453,11 +466,14 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
          have max_entries equal to the number of active CPUs, which we
          wouldn't know for sure at translate time. Set it now: */
       bpf_map_type map_type = static_cast<bpf_map_type>(attrs[i].type);
-      if (map_type == BPF_MAP_TYPE_PERF_EVENT_ARRAY)
+      bool transport_p = (map_type == BPF_MAP_TYPE_PERF_EVENT_ARRAY);
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+      transport_p = transport_p || map_type == BPF_MAP_TYPE_RINGBUF;
+#endif
+      if (transport_p)
         {
-          /* XXX: Assume our only perf_event_map is the percpu transport one: */
+          /* XXX: Assume our only perf_event_map is the transport one: */
           assert(i == bpf::globals::perf_event_map_idx);
-          assert(attrs[i].max_entries == bpf::globals::NUM_CPUS_PLACEHOLDER);
 
           // TODO: perf_event buffers can only be created for currently
           // active CPUs. For now we imitate Certain Other Tools and
@@ -473,8 +489,23 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
             fprintf(stderr, "WARNING: could not get number of CPUs, falling back to 1\n"); // XXX no errno
           //unsigned ncpus = get_nprocs_conf();
           mark_active_cpus((unsigned)ncpus);
-          attrs[i].max_entries = ncpus;
+          transport_ncpus = ncpus;
         }
+      if (map_type == BPF_MAP_TYPE_PERF_EVENT_ARRAY)
+        {
+          assert(attrs[i].max_entries == bpf::globals::NUM_CPUS_PLACEHOLDER);
+          attrs[i].max_entries = transport_ncpus;
+        }
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+      else if (map_type == BPF_MAP_TYPE_RINGBUF)
+        {
+          // The kernel wants a power of two multiple of pages:
+          unsigned page_size = getpagesize();
+          while (attrs[i].max_entries < page_size)
+            attrs[i].max_entries *= 2;
+          use_ringbuf = true;
+        }
+#endif
 
       if (verbose > 2)
         fprintf(stderr, "creating map type %u entry %zu: key_size %u, value_size %u, "
@@ -484,38 +515,164 @@ instantiate_maps (Elf64_Shdr *shdr, Elf_Data *data)
       int fd = bpf_create_map(static_cast<bpf_map_type>(attrs[i].type),
 			      attrs[i].key_size, attrs[i].value_size,
 			      attrs[i].max_entries, attrs[i].map_flags);
+      if (fd < 0 && use_ringbuf && i == bpf::globals::perf_event_map_idx)
+        fatal("map entry %zu: %s (this kernel may lack the BPF ring buffer, "
+              "translate with -DSTAPBPF_RINGBUF=0)\n", i, strerror(errno));
       if (fd < 0)
 	fatal("map entry %zu: %s\n", i, strerror(errno));
       map_fds[i] = fd;
     }
 }
 
+// Returns the BTF type id of the vmlinux function FUNC, or -1 if the
+// kernel has no BTF or no such function.
+static int
+btf_func_id(const string &func)
+{
+  static std::unordered_map<string, int> funcs;
+  static bool read_btf = false;
+
+  if (!read_btf)
+    {
+      read_btf = true;
+      ifstream f("/sys/kernel/btf/vmlinux", ios::binary);
+      std::vector<char> buf((std::istreambuf_iterator<char>(f)),
+                            std::istreambuf_iterator<char>());
+      const btf_header *hdr = reinterpret_cast<const btf_header *>(buf.data());
+      if (buf.size() < sizeof(btf_header) || hdr->magic != BTF_MAGIC
+          || (size_t) hdr->hdr_len + hdr->str_off + hdr->str_len > buf.size()
+          || (size_t) hdr->hdr_len + hdr->type_off + hdr->type_len > buf.size())
+        return -1;
+
+      const char *types = buf.data() + hdr->hdr_len + hdr->type_off;
+      const char *strs = buf.data() + hdr->hdr_len + hdr->str_off;
+      size_t off = 0;
+      for (int id = 1; off + sizeof(btf_type) <= hdr->type_len; ++id)
+        {
+          const btf_type *t = reinterpret_cast<const btf_type *>(types + off);
+          unsigned vlen = BTF_INFO_VLEN(t->info);
+          off += sizeof(btf_type);
+          switch (BTF_INFO_KIND(t->info))
+            {
+            case BTF_KIND_INT:
+            case BTF_KIND_VAR:
+            case 17: // BTF_KIND_DECL_TAG
+              off += 4;
+              break;
+            case BTF_KIND_ARRAY:
+              off += sizeof(btf_array);
+              break;
+            case BTF_KIND_STRUCT:
+            case BTF_KIND_UNION:
+            case BTF_KIND_DATASEC:
+            case 19: // BTF_KIND_ENUM64
+              off += vlen * 12;
+              break;
+            case BTF_KIND_ENUM:
+            case BTF_KIND_FUNC_PROTO:
+              off += vlen * 8;
+              break;
+            case BTF_KIND_FUNC:
+              if (t->name_off < hdr->str_len)
+                funcs.emplace(strs + t->name_off, id);
+              break;
+            default: // no trailing data
+              break;
+            }
+        }
+    }
+
+  auto it = funcs.find(func);
+  return it == funcs.end() ? -1 : it->second;
+}
+
+// Loads the program of an fentry/FUNC or fexit/FUNC[/NARGS] section,
+// attached through the kernel BTF of FUNC.
+static int
+prog_load_fentry(Elf_Data *data, const char *name)
+{
+  bool fexit = strncmp(name, "fexit/", 6) == 0;
+  string func = name + (fexit ? 6 : 7);
+  func = func.substr(0, func.find('/'));
+
+#ifndef HAVE_BPF_TRACE_FENTRY
+  (void) data;
+  fatal("BPF fentry/fexit programs unsupported, translate "
+        "with -DSTAPBPF_FENTRY=0\n");
+#else
+  int btf_id = btf_func_id(func);
+  if (btf_id < 0)
+    fatal("function %s not found in the kernel BTF, translate "
+          "with -DSTAPBPF_FENTRY=0\n", func.c_str());
+
+  if (data->d_size % sizeof(bpf_insn))
+    fatal("program size not a multiple of %zu\n", sizeof(bpf_insn));
+
+  if (kmsg != NULL)
+    {
+      fprintf (kmsg, "%s (%s): stapbpf: %s, name: %s, d_size: %lu\n",
+               module_basename, script_name, VERSION, name, (unsigned long)data->d_size);
+      fflush (kmsg);
+    }
+  int fd = bpf_prog_load_btf(BPF_PROG_TYPE_TRACING,
+                             fexit ? BPF_TRACE_FEXIT : BPF_TRACE_FENTRY,
+                             btf_id, static_cast<bpf_insn *>(data->d_buf),
+                             data->d_size, module_license);
+  if (fd < 0)
+    {
+      if (bpf_log_buf[0] != 0)
+	fatal("bpf program load failed: %s (translate with "
+	      "-DSTAPBPF_FENTRY=0 to use kprobes)\n%s\n",
+	      strerror(errno), bpf_log_buf);
+      else
+	fatal("bpf program load failed: %s (translate with "
+	      "-DSTAPBPF_FENTRY=0 to use kprobes)\n", strerror(errno));
+    }
+  return fd;
+#endif
+}
+
 static int
 prog_load(Elf_Data *data, const char *name)
 {
   enum bpf_prog_type prog_type;
+  const char *type_name = name;
 
-  if (strncmp(name, "kprobe", 6) == 0)
+  // A later part of a split probe handler, tailcall/MAP/IDX/SECTION,
+  // has the program type of the probe's SECTION.
+  if (strncmp(type_name, "tailcall/", 9) == 0)
+    {
+      unsigned map, idx;
+      int n = 0;
+      if (sscanf(name, "tailcall/%u/%u/%n", &map, &idx, &n) != 2 || n == 0)
+        fatal("invalid tail call section \"%s\"\n", name);
+      type_name += n;
+    }
+
+  if (strncmp(type_name, "kprobe", 6) == 0)
     prog_type = BPF_PROG_TYPE_KPROBE;
-  else if (strncmp(name, "kretprobe", 9) == 0)
+  else if (strncmp(type_name, "kretprobe", 9) == 0)
     prog_type = BPF_PROG_TYPE_KPROBE;
-  else if (strncmp(name, "uprobe", 6) == 0)
+  else if (strncmp(type_name, "uprobe", 6) == 0)
     prog_type = BPF_PROG_TYPE_KPROBE;
-  else if (strncmp(name, "timer", 5) == 0)
+  else if (strncmp(type_name, "timer", 5) == 0)
     prog_type = BPF_PROG_TYPE_PERF_EVENT;
-  else if (strncmp(name, "trace", 5) == 0)
+  else if (strncmp(type_name, "trace", 5) == 0)
     prog_type = BPF_PROG_TYPE_TRACEPOINT;
 #ifdef HAVE_BPF_PROG_TYPE_RAW_TRACEPOINT
-  else if (strncmp(name, "raw_trace", 9) == 0)
+  else if (strncmp(type_name, "raw_trace", 9) == 0)
     prog_type = BPF_PROG_TYPE_RAW_TRACEPOINT;
 #endif
-  else if (strncmp(name, "perf", 4) == 0)
+  else if (strncmp(type_name, "perf", 4) == 0)
     {
-      if (name[5] == '2' && name[6] == '/')
+      if (type_name[5] == '2' && type_name[6] == '/')
         prog_type = BPF_PROG_TYPE_TRACEPOINT;
       else
         prog_type = BPF_PROG_TYPE_PERF_EVENT;
     }
+  else if (strncmp(type_name, "fentry/", 7) == 0
+           || strncmp(type_name, "fexit/", 6) == 0)
+    return prog_load_fentry(data, name);
   else
     fatal("unhandled program type for section \"%s\"\n", name);
 
@@ -609,7 +766,9 @@ maybe_collect_kprobe(const char *name, unsigned name_idx,
   char type;
   string arg;
 
-  if (strncmp(name, "kprobe/", 7) == 0)
+  if (strncmp(name, "kprobe/", 7) == 0 && strncmp(name + 7, "0x", 2) != 0)
+    type = 'p', arg = name + 7; // kprobe.function(), or an fentry fallback
+  else if (strncmp(name, "kprobe/", 7) == 0)
     {
       string line;
       const char *stext = NULL;
@@ -784,6 +943,23 @@ collect_raw_tracepoint(const char *name, unsigned name_idx, unsigned fd_idx)
   raw_tracepoint_probes.push_back(trace_data(tp_system, tp_name, fd));
 }
 
+static void
+collect_fentry(const char *name, unsigned name_idx, unsigned fd_idx)
+{
+  char type[8];
+  char func[512];
+
+  int res = sscanf(name, "%7[^/]/%511[^/]", type, func);
+  if (res != 2)
+    fatal("unable to parse name of probe %u section %u\n", name_idx, fd_idx);
+
+  int fd = -1;
+  if (fd_idx >= prog_fds.size() || (fd = prog_fds[fd_idx]) < 0)
+    fatal("probe %u section %u not loaded\n", name_idx, fd_idx);
+
+  fentry_probes.push_back(trace_data(type, func, fd));
+}
+
 static void
 kprobe_collect_from_syms(Elf_Data *sym_data, Elf_Data *str_data)
 {
@@ -1111,6 +1287,50 @@ unregister_raw_tracepoints(const size_t nprobes)
     close(raw_tracepoint_probes[i].event_fd);
 }
 
+static void
+unregister_fentries(const size_t nprobes)
+{
+  for (size_t i = 0; i < nprobes; ++i)
+    if (fentry_probes[i].event_fd >= 0)
+      close(fentry_probes[i].event_fd);
+}
+
+// Attaches the fentry and fexit programs.  Unlike the perf event
+// based probes, they can't be enabled together through group_fd, so
+// this is only done once the begin probes ran.
+static void
+register_fentries()
+{
+  size_t nprobes = fentry_probes.size();
+  if (nprobes == 0)
+    return;
+
+#ifdef HAVE_BPF_TRACE_FENTRY
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  for (size_t i = 0; i < nprobes; ++i)
+    {
+      trace_data &t = fentry_probes[i];
+      attr.raw_tracepoint.prog_fd = t.prog_fd;
+
+      if (verbose > 1)
+        fprintf(stderr, "Attaching probe %zu to %s %s\n",
+                i, t.system.c_str(), t.name.c_str());
+
+      int fd = syscall(__NR_bpf, BPF_RAW_TRACEPOINT_OPEN, &attr, sizeof(attr));
+      if (fd < 0)
+        {
+          fprintf(stderr, "Error attaching probe %s %s: %s\n",
+                  t.system.c_str(), t.name.c_str(), strerror(errno));
+          unregister_fentries(i);
+          exit(1);
+        }
+      t.event_fd = fd;
+    }
+#endif
+}
+
 static void
 register_tracepoints()
 {
@@ -1349,13 +1569,61 @@ init_internal_globals()
       fatal("Error updating pid: %s\n", strerror(errno));
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+// Map the ring buffer: the consumer position, which we advance, then
+// the producer position and the data, which the kernel maps twice in
+// a row so that no message wraps around.
+static void
+init_ringbuf_transport()
+{
+  using namespace bpf;
+
+  int fd = map_fds[globals::perf_event_map_idx];
+  size_t page_size = getpagesize();
+  ringbuf_size = map_attrs[globals::perf_event_map_idx].max_entries;
+
+  void *cons = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (cons == MAP_FAILED)
+    fatal("error mmapping ring buffer consumer page: %s\n", strerror(errno));
+  void *prod = mmap(NULL, page_size + 2 * ringbuf_size, PROT_READ, MAP_SHARED,
+                    fd, page_size);
+  if (prod == MAP_FAILED)
+    fatal("error mmapping ring buffer data: %s\n", strerror(errno));
+  ringbuf_consumer_pos = (unsigned long *)cons;
+  ringbuf_producer_pos = (const unsigned long *)prod;
+  ringbuf_data = (const char *)prod + page_size;
+
+  // Messages still come apart by cpu, for the printf state:
+  for (unsigned cpu = 0; cpu < transport_ncpus; cpu++)
+    {
+      if (!cpu_online[cpu]) // -- skip inactive CPUs.
+        {
+          transport_contexts.push_back(nullptr);
+          continue;
+        }
+      bpf_transport_context *ctx
+        = new bpf_transport_context(cpu, fd, transport_ncpus, map_attrs,
+                                    &map_fds, output_f, &interned_strings,
+                                    &aggregates, &foreach_loop_info, &error);
+      transport_contexts.push_back(ctx);
+    }
+  if (verbose > 2)
+    fprintf(stderr, "Initialized ring buffer output of %zu bytes\n", ringbuf_size);
+}
+#endif
+
 // PR22330: Initialize perf_event_map and perf_fds.
 static void
 init_perf_transport()
 {
   using namespace bpf;
 
-  unsigned ncpus = map_attrs[globals::perf_event_map_idx].max_entries;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (use_ringbuf)
+    return init_ringbuf_transport();
+#endif
+
+  unsigned ncpus = transport_ncpus;
 
   for (unsigned cpu = 0; cpu < ncpus; cpu++)
     {
@@ -1691,6 +1959,20 @@ load_bpf_file(const char *module)
 	prog_fds[i] = prog_load(sh_data[i], sh_name[i]);
     }
 
+  // Chain the parts of split probe handlers.
+  for (unsigned i = 1; i < shnum; ++i)
+    {
+      unsigned map, idx;
+      if (prog_fds[i] < 0
+          || sscanf(sh_name[i], "tailcall/%u/%u/", &map, &idx) != 2)
+        continue;
+      if (map >= map_fds.size())
+        fatal("invalid tail call map %u\n", map);
+      if (bpf_update_elem(map_fds[map], &idx, &prog_fds[i], BPF_ANY) != 0)
+        fatal("could not chain program %s: %s\n", sh_name[i],
+              strerror(errno));
+    }
+
   // Remember begin, end, error and procfs-like probes.
   if (begin_idx)
     {
@@ -1757,6 +2039,9 @@ load_bpf_file(const char *module)
       collect_tracepoint(sh_name[i], i, i);
     if (strncmp(sh_name[i], "raw_trace", 9) == 0)
       collect_raw_tracepoint(sh_name[i], i, i);
+    if (strncmp(sh_name[i], "fentry/", 7) == 0
+        || strncmp(sh_name[i], "fexit/", 6) == 0)
+      collect_fentry(sh_name[i], i, i);
     if (strncmp(sh_name[i], "perf", 4) == 0)
       collect_perf(sh_name[i], i, i);
     if (strncmp(sh_name[i], "timer", 5) == 0)
@@ -1837,6 +2122,83 @@ perf_event_handle(struct perf_event_header *hdr, void *private_data)
   return LIBBPF_PERF_EVENT_CONT;
 }
 
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+// Pass all the messages in the ring buffer on to the transport context
+// of the cpu that sent them, and free their space.  Stops early, with
+// LIBBPF_PERF_EVENT_DONE, at an exit message.
+static enum bpf_perf_event_ret
+ringbuf_drain()
+{
+  unsigned long cons = *ringbuf_consumer_pos;
+  unsigned long prod = __atomic_load_n(ringbuf_producer_pos, __ATOMIC_ACQUIRE);
+  enum bpf_perf_event_ret ret = LIBBPF_PERF_EVENT_CONT;
+
+  while (cons < prod && ret == LIBBPF_PERF_EVENT_CONT)
+    {
+      const char *rec = ringbuf_data + (cons & (ringbuf_size - 1));
+      uint32_t len = __atomic_load_n((const uint32_t *)rec, __ATOMIC_ACQUIRE);
+      if (len & BPF_RINGBUF_BUSY_BIT) // -- still being written
+        break;
+      uint32_t size = len & ~(BPF_RINGBUF_BUSY_BIT | BPF_RINGBUF_DISCARD_BIT);
+
+      if (!(len & BPF_RINGBUF_DISCARD_BIT)
+          && size >= sizeof(BPF_TRANSPORT_VAL))
+        {
+          const char *data = rec + BPF_RINGBUF_HDR_SZ;
+          unsigned cpu = *(const BPF_TRANSPORT_VAL *)data >> BPF_TRANSPORT_CPU_SHIFT;
+          bpf_transport_context *ctx = cpu < transport_contexts.size()
+            ? transport_contexts[cpu] : nullptr;
+          if (ctx == nullptr)
+            ctx = transport_contexts[default_cpu];
+          ret = bpf_handle_transport_msg((void *)data, size, ctx);
+        }
+
+      cons += (size + BPF_RINGBUF_HDR_SZ + 7) & ~7UL;
+      __atomic_store_n(ringbuf_consumer_pos, cons, __ATOMIC_RELEASE);
+    }
+  return ret;
+}
+
+// Listen for the ring buffer, and drain it whole at each wakeup.
+static void
+ringbuf_event_loop(pthread_t main_thread)
+{
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0)
+    fatal("Error creating epoll fd: %s\n", strerror(errno));
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD,
+                map_fds[bpf::globals::perf_event_map_idx], &ev) < 0)
+    fatal("Error polling the ring buffer: %s\n", strerror(errno));
+
+  for (;;)
+    {
+      if (verbose > 3)
+        fprintf(stderr, "Polling for ring buffer data...\n");
+      int ready = epoll_wait(epfd, &ev, 1, 1000);
+      if (ready < 0 && errno == EINTR)
+        break;
+      if (ready < 0)
+        fatal("Error checking for ring buffer data: %s\n", strerror(errno));
+
+      // Messages may have been committed since the wakeup, so drain
+      // even after a timeout:
+      while (ringbuf_drain() == LIBBPF_PERF_EVENT_DONE)
+        // Saw STP_EXIT message. If the exit flag is set,
+        // wake up main thread to begin program shutdown.
+        if (get_exit_status())
+          goto signal_exit;
+    }
+
+ signal_exit:
+  pthread_kill(main_thread, SIGINT);
+  close(epfd);
+}
+#endif
+
 // PR22330: Listen for perf_events.
 static void
 perf_event_loop(pthread_t main_thread)
@@ -1848,8 +2210,12 @@ perf_event_loop(pthread_t main_thread)
   void *data = NULL;
   size_t len = 0;
 
-  unsigned ncpus
-    = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
+#ifdef HAVE_BPF_MAP_TYPE_RINGBUF
+  if (use_ringbuf)
+    return ringbuf_event_loop(main_thread);
+#endif
+
+  unsigned ncpus = transport_ncpus;
   unsigned n_active_cpus
     = count_active_cpus();
   struct pollfd *pmu_fds
@@ -2102,7 +2468,7 @@ procfs_spawn(bpf_transport_context* uctx)
 static void
 usage(const char *argv0)
 {
-  printf(_("Usage: %s [-v][-w][-V][-h] [-c cmd] [-x pid] [-o FILE] <bpf-file>\n"), argv0);
+  printf(_("Usage: %s [-v][-w][-V][-h] [-c cmd] [-x pid] [-o FILE] [--interp=KIND] [--no-batch] <bpf-file>\n"), argv0);
   printf(_("-h, --help       Show this help text.\n"
            "-v, --verbose    Increase verbosity.\n"
            "-V, --version    Show version.\n"
@@ -2111,7 +2477,11 @@ usage(const char *argv0)
            "                 exit when it does.  The '_stp_target' variable\n"
            "                 will contain the pid for the command.\n"
            "-x pid           Sets the '_stp_target' variable to pid.\n"
-           "-o FILE          Send output to FILE.\n"));
+           "-o FILE          Send output to FILE.\n"
+           "--interp=KIND    Run begin, end and procfs probes with the\n"
+           "                 'threaded' (default) or 'switch' interpreter.\n"
+           "--no-batch       Read maps for sorted foreach loops a key at a\n"
+           "                 time, not in batches.\n"));
 }
 
 
@@ -2181,6 +2551,9 @@ main(int argc, char **argv)
     { "help", 0, NULL, 'h' },
     { "verbose", 0, NULL, 'v' },
     { "version", 0, NULL, 'V' },
+    { "interp", 1, NULL, 'I' },
+    { "no-batch", 0, NULL, 'B' },
+    { NULL, 0, NULL, 0 },
   };
 
   int rc;
@@ -2211,6 +2584,19 @@ main(int argc, char **argv)
           }
         break;
 
+      case 'I':
+        if (strcmp(optarg, "switch") == 0)
+          bpf_interp_use_switch = true;
+        else if (strcmp(optarg, "threaded") == 0)
+          bpf_interp_use_switch = false;
+        else
+          goto do_usage;
+        break;
+
+      case 'B':
+        bpf_foreach_no_batch = true;
+        break;
+
       case 'V':
         printf("Systemtap BPF loader/runner (version %s, %s)\n"
                "Copyright (C) 2016-2022 Red Hat, Inc. and others\n" // PRERELEASE
@@ -2250,7 +2636,7 @@ main(int argc, char **argv)
   // XXX Done before begin probes, after load_bpf_file() sets __name__.
 
   // Create a bpf_transport_context for userspace programs:
-  unsigned ncpus = map_attrs[bpf::globals::perf_event_map_idx].max_entries;
+  unsigned ncpus = transport_ncpus;
   bpf_transport_context uctx(default_cpu, -1/*pmu_fd*/, ncpus,
                              map_attrs, &map_fds, output_f,
                              &interned_strings, &aggregates,
@@ -2301,6 +2687,7 @@ main(int argc, char **argv)
     // Now that the begin probe has run and the perf_event listener is active, enable the kprobes.
     ioctl(group_fd, PERF_EVENT_IOC_ENABLE, 0);
     perf_ioc_enabled = true;
+    register_fentries();
   }
 
   // Wait for STP_EXIT message:
@@ -2310,6 +2697,7 @@ main(int argc, char **argv)
 
  cleanup_and_exit:
   // Disable the kprobes before deregistering and running exit probes.
+  unregister_fentries(fentry_probes.size());
   if (perf_ioc_enabled)
     ioctl(group_fd, PERF_EVENT_IOC_DISABLE, 0);
   close(group_fd);
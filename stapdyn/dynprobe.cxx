@@ -56,6 +56,10 @@ find_dynprobes(void* module, vector<dynprobe_target>& targets)
   decltype(&stp_dyninst_probe_flags) probe_flags = NULL;
   set_dlsym(probe_flags, module, "stp_dyninst_probe_flags", false);
 
+  // This is optional too - added in 4.9
+  decltype(&stp_dyninst_probe_regs) probe_regs = NULL;
+  set_dlsym(probe_regs, module, "stp_dyninst_probe_regs", false);
+
   // Construct all the targets in the module.
   const uint64_t ntargets = target_count();
   for (uint64_t i = 0; i < ntargets; ++i)
@@ -76,7 +80,8 @@ find_dynprobes(void* module, vector<dynprobe_target>& targets)
       uint64_t offset = probe_offset(i);
       uint64_t semaphore = probe_semaphore(i);
       uint64_t flags = probe_flags ? probe_flags(i) : 0;
-      dynprobe_location p(i, offset, semaphore, flags);
+      uint64_t regs = probe_regs ? probe_regs(i) : ~(uint64_t)0;
+      dynprobe_location p(i, offset, semaphore, flags, regs);
       if (p.validate() && target_index < ntargets)
         targets[target_index].probes.push_back(p);
     }
@@ -90,7 +95,8 @@ find_dynprobes(void* module, vector<dynprobe_target>& targets)
       for (uint64_t j = 0; j < t.probes.size(); ++j)
         staplog(3) << "  offset:" << lex_cast_hex(t.probes[j].offset)
                    << " semaphore:" << lex_cast_hex(t.probes[j].semaphore)
-                   << " flags:" << lex_cast_hex(t.probes[j].flags) << endl;
+                   << " flags:" << lex_cast_hex(t.probes[j].flags)
+                 << " regs:" << lex_cast_hex(t.probes[j].regs) << endl;
     }
 
   return 0;
@@ -98,9 +104,10 @@ find_dynprobes(void* module, vector<dynprobe_target>& targets)
 
 
 dynprobe_location::dynprobe_location(uint64_t index, uint64_t offset,
-                                     uint64_t semaphore, uint64_t flags):
+                                     uint64_t semaphore, uint64_t flags,
+                                     uint64_t regs):
       index(index), offset(offset), semaphore(semaphore),
-      flags(flags), return_p(flags & STAPDYN_PROBE_FLAG_RETURN)
+      flags(flags), regs(regs), return_p(flags & STAPDYN_PROBE_FLAG_RETURN)
 {
 }
 
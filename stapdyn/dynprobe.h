@@ -23,10 +23,12 @@ struct dynprobe_location {
     uint64_t offset;    // The file offset of the probe's address.
     uint64_t semaphore; // The file offset of the probe's semaphore.
     uint64_t flags;	// The probe's flags.
+    uint64_t regs;      // The DWARF registers the handler reads, by bit.
     bool return_p;      // This is flagged as a return probe
 
     dynprobe_location(uint64_t index, uint64_t offset,
-                      uint64_t semaphore, uint64_t flags);
+                      uint64_t semaphore, uint64_t flags,
+                      uint64_t regs=~(uint64_t)0);
 
     bool validate();
 };
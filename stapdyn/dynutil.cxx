@@ -215,6 +215,9 @@ bool stapdyn_suppress_warnings = false;
 // Output file name, set by -o
 char *stapdyn_outfile_name = NULL;
 
+// Whether to have the kernel trap SDT sites, set by -u
+bool stapdyn_sdt_uprobes = false;
+
 // Return a stream for logging at the given verbosity level.
 ostream&
 staplog(unsigned level)
@@ -52,6 +52,9 @@ extern bool stapdyn_suppress_warnings;
 // Output file name, set by -o
 extern char *stapdyn_outfile_name;
 
+// Whether to have the kernel trap SDT sites, set by -u
+extern bool stapdyn_sdt_uprobes;
+
 // Return a stream for logging at the given verbosity level.
 std::ostream& staplog(unsigned level=0);
 
@@ -10,9 +10,16 @@
 
 extern "C" {
 #include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <linux/perf_event.h>
 }
 
+#include <fstream>
+#include <set>
+
 #include <dyninst/BPatch_function.h>
 #include <dyninst/BPatch_image.h>
 #include <dyninst/BPatch_module.h>
@@ -124,7 +131,9 @@ class mutatee_freezer {
 mutatee::mutatee(BPatch_process* process):
   pid(process? process->getPid() : 0),
   process(process), stap_dso(NULL),
-  utrace_enter_function(NULL)
+  utrace_enter_function(NULL),
+  fork_parent(NULL), fork_snippets(0), fork_semaphores(0),
+  sdt_trap_handler(false)
 {
   get_dwarf_registers(process, registers);
 }
@@ -186,6 +195,198 @@ mutatee::update_semaphores(unsigned short delta, size_t start)
 }
 
 
+// Remember the SDT semaphore of a probe, if it has one, to be updated
+// along with the others.
+void
+mutatee::add_semaphore(BPatch_object* object, const dynprobe_target& target,
+                       const dynprobe_location& probe)
+{
+  if (!probe.semaphore)
+    return;
+
+  Dyninst::Address sem_address = object->fileOffsetToAddr(probe.semaphore);
+  if (sem_address == BPatch_object::E_OUT_OF_BOUNDS)
+    stapwarn() << "Couldn't convert semaphore " << target.path << "+"
+               << lex_cast_hex(probe.offset) << " to an address" << endl;
+  else
+    {
+      // Create a variable to represent this semaphore
+      BPatch_type *sem_type = process->getImage()->findType("unsigned short");
+      BPatch_variableExpr *semaphore = process->createVariable(sem_address, sem_type);
+      if (semaphore)
+        semaphores.push_back(semaphore);
+    }
+}
+
+
+// The kernel's uprobe perf PMU, or -1 if it has none.
+static int
+uprobe_pmu_type()
+{
+  static int type = -2;
+  if (type == -2)
+    {
+      ifstream f("/sys/bus/event_source/devices/uprobe/type");
+      if (!(f >> type))
+        type = -1;
+    }
+  return type;
+}
+
+// Open a perf uprobe event on PATH+OFFSET in thread TID, which sends the
+// thread a SIGTRAP carrying INDEX each time it gets there.
+static int
+open_sdt_trap(pid_t tid, const string& path, uint64_t offset, uint64_t index)
+{
+#ifdef PERF_ATTR_SIZE_VER7
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = uprobe_pmu_type();
+  attr.config1 = (uint64_t)(uintptr_t)path.c_str(); // uprobe_path
+  attr.config2 = offset; // probe_offset
+  attr.sample_period = 1;
+  attr.inherit = 1;
+  attr.inherit_thread = 1;
+  attr.remove_on_exec = 1;
+  attr.sigtrap = 1;
+  attr.sig_data = index;
+  return syscall(__NR_perf_event_open, &attr, tid, -1, -1,
+                 PERF_FLAG_FD_CLOEXEC);
+#else
+  // Built against headers older than sigtrap.
+  (void) tid; (void) path; (void) offset; (void) index;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+
+// Have the kernel trap this target's probes in the object, if they're all
+// at distinct SDT sites, and leave the object unpatched.  Then nothing needs
+// the object's functions parsed, which is what makes attaching to programs
+// with many SDT sites slow.  Returns false if the object needs patching
+// after all.
+bool
+mutatee::trap_sdt_probes(BPatch_object* object, const dynprobe_target& target)
+{
+  const uint64_t utrace_flags = (STAPDYN_PROBE_FLAG_PROC_BEGIN
+                                 | STAPDYN_PROBE_FLAG_PROC_END
+                                 | STAPDYN_PROBE_FLAG_THREAD_BEGIN
+                                 | STAPDYN_PROBE_FLAG_THREAD_END);
+
+  if (uprobe_pmu_type() < 0)
+    return false;
+
+  // Nothing in the object may be patched: Dyninst moves the code of the
+  // functions it instruments, and a trap left in the old copy would never
+  // be hit.  Each site gets one event, since a signal that's already
+  // pending can't be sent again.
+  set<uint64_t> offsets;
+  for (size_t i = 0; i < target.probes.size(); ++i)
+    {
+      const dynprobe_location& probe = target.probes[i];
+      if (probe.flags & utrace_flags)
+        continue;
+      if (!(probe.flags & STAPDYN_PROBE_FLAG_SDT) || probe.return_p
+          || !offsets.insert(probe.offset).second)
+        return false;
+    }
+  if (offsets.empty())
+    return false;
+
+  mutatee_freezer mf(*this);
+  if (!is_stopped())
+    return false;
+
+  // The handler must be there before the first trap.
+  if (!sdt_trap_handler)
+    {
+      vector<BPatch_function *> functions;
+      stap_dso->findFunction("stp_dyninst_sdt_trap_init", functions, false);
+      if (functions.empty())
+        return false;
+      vector<BPatch_snippet *> args;
+      BPatch_funcCallExpr call(*functions[0], args);
+      int rc = (int)(intptr_t)process->oneTimeCode(call);
+      if (rc != 0)
+        {
+          staplog(1) << "couldn't set up SDT traps in pid " << pid
+                     << ": " << strerror(-rc) << endl;
+          return false;
+        }
+      sdt_trap_handler = true;
+    }
+
+  size_t start = sdt_traps.size();
+  for (size_t i = 0; i < target.probes.size(); ++i)
+    {
+      const dynprobe_location& probe = target.probes[i];
+      if (probe.flags & STAPDYN_PROBE_FLAG_SDT)
+        sdt_traps.push_back({ target.path, probe.offset, probe.index });
+    }
+  if (!open_sdt_traps(start))
+    {
+      sdt_traps.resize(start);
+      return false;
+    }
+  staplog(1) << "trapping " << sdt_traps.size() - start << " SDT sites in \""
+             << target.path << "\" in pid " << pid << endl;
+
+  for (size_t i = 0; i < target.probes.size(); ++i)
+    {
+      const dynprobe_location& probe = target.probes[i];
+      if (probe.flags & utrace_flags)
+        instrument_utrace_dynprobe(probe);
+      else
+        add_semaphore(object, target, probe);
+    }
+  return true;
+}
+
+
+// Open the events of sdt_traps[start...] in every thread.  If any fails,
+// the ones just opened are closed again.
+bool
+mutatee::open_sdt_traps(size_t start)
+{
+  vector<BPatch_thread *> threads;
+  process->getThreads(threads);
+
+  size_t fd_start = sdt_trap_fds.size();
+  for (size_t i = start; i < sdt_traps.size(); ++i)
+    for (size_t j = 0; j < threads.size(); ++j)
+      {
+        const sdt_trap& trap = sdt_traps[i];
+        int fd = open_sdt_trap(threads[j]->getLWP(), trap.path,
+                               trap.offset, trap.index);
+        if (fd < 0)
+          {
+            staplog(1) << "couldn't trap \"" << trap.path << "\"+"
+                       << lex_cast_hex(trap.offset) << " in pid " << pid
+                       << ": " << strerror(errno) << endl;
+            for (size_t k = fd_start; k < sdt_trap_fds.size(); ++k)
+              close(sdt_trap_fds[k]);
+            sdt_trap_fds.resize(fd_start);
+            return false;
+          }
+        sdt_trap_fds.push_back(fd);
+      }
+  return true;
+}
+
+
+// Remove the kernel's traps, along with those its threads inherited.
+void
+mutatee::close_sdt_traps()
+{
+  for (size_t i = 0; i < sdt_trap_fds.size(); ++i)
+    close(sdt_trap_fds[i]);
+  sdt_trap_fds.clear();
+  sdt_traps.clear();
+}
+
+
 void
 mutatee::call_utrace_dynprobes(const vector<dynprobe_location>& probes,
 			       BPatch_thread* thread)
@@ -273,12 +474,16 @@ mutatee::instrument_dynprobe_target(BPatch_object* object,
 
   vector<BPatch_function *> functions;
   BPatch_function* enter_function = NULL;
+  BPatch_function* enter_function_no_regs = NULL;
   bool use_pt_regs = false;
 
   staplog(1) << "found target \"" << target.path << "\" in pid " << pid
 	     << ", inserting " << target.probes.size() << " probes" << endl;
 
-  process->beginInsertionSet();
+  if (stapdyn_sdt_uprobes && trap_sdt_probes(object, target))
+    return;
+
+  // NB: the caller batches insertions; see instrument_object_targets().
   for (size_t j = 0; j < target.probes.size(); ++j)
     {
       const dynprobe_location& probe = target.probes[j];
@@ -383,11 +588,37 @@ mutatee::instrument_dynprobe_target(BPatch_object* object,
       if (points.empty())
         continue;
 
+      // A handler that doesn't look at the registers can skip capturing
+      // them, by calling the pt_regs entry with NULL.
+      if (!use_pt_regs && (probe.flags & STAPDYN_PROBE_FLAG_NO_REGS)
+          && !enter_function_no_regs)
+        {
+          functions.clear();
+          stap_dso->findFunction("enter_dyninst_uprobe", functions, false);
+          if (!functions.empty())
+            enter_function_no_regs = functions[0];
+        }
+
+      // Registers the handler doesn't read are passed as 0, so that the
+      // probe site doesn't have to capture them.
+      BPatch_snippet* no_reg = new BPatch_constExpr((unsigned long)0);
+      auto wanted = [&](unsigned long regno) {
+          return regno >= 64 || (probe.regs >> regno) & 1;
+      };
+
       // The entry function needs the index of this particular probe, then
       // the registers in whatever form we chose above.
       vector<BPatch_snippet *> args;
       args.push_back(new BPatch_constExpr((int64_t)probe.index));
-      if (use_pt_regs) {
+      if (!use_pt_regs && enter_function_no_regs
+          && (probe.flags & STAPDYN_PROBE_FLAG_NO_REGS)) {
+          args.push_back(new BPatch_constExpr((void*)NULL)); // pt_regs
+          BPatch_funcCallExpr call(*enter_function_no_regs, args);
+          BPatchSnippetHandle* handle = process->insertSnippet(call, points);
+          if (handle)
+            snippets.push_back(handle);
+        }
+      else if (use_pt_regs) {
           args.push_back(new BPatch_constExpr((void*)NULL)); // pt_regs
           BPatch_funcCallExpr call(*enter_function, args);
           BPatchSnippetHandle* handle = process->insertSnippet(call, points);
@@ -412,11 +643,19 @@ mutatee::instrument_dynprobe_target(BPatch_object* object,
           long unsigned first_reg [] = {0, 6, 12, 18, 24, 30, 32};
           for (int first = (sizeof(first_reg)/sizeof(long))-2; first >= 0; first--)
             {
+              // The last chunk (30) makes the call, so it's always
+              // needed; the others only for registers the handler reads.
+              bool chunk_wanted = (first_reg[first] == 30);
+              for (long unsigned regidx = first_reg[first]; regidx < first_reg[first+1]; regidx++)
+                chunk_wanted = chunk_wanted || wanted(regidx);
+              if (!chunk_wanted)
+                continue;
+
               args[1] = new BPatch_constExpr((int64_t)first_reg[first]);
               int argidx = 2;
               for (long unsigned regidx = first_reg[first]; regidx < first_reg[first+1]; regidx++)
                 {
-                  args[argidx++] = registers[regidx+1];
+                  args[argidx++] = wanted(regidx) ? registers[regidx+1] : no_reg;
                 }
               // registers[0] is BPatch_originalAddressExpr; append to the end
               if (!ip_added) {
@@ -440,8 +679,15 @@ mutatee::instrument_dynprobe_target(BPatch_object* object,
                 registers.pop_back();
               }
 #endif
-          args.push_back(new BPatch_constExpr((unsigned long)registers.size()));
-          args.insert(args.end(), registers.begin(), registers.end());
+          // Pass the PC, then registers up to the last one wanted.
+          size_t nregs = 1;
+          for (size_t i = 1; i < registers.size(); ++i)
+            if (wanted(i - 1))
+              nregs = i + 1;
+          args.push_back(new BPatch_constExpr((unsigned long)nregs));
+          args.push_back(registers[0]);
+          for (size_t i = 1; i < nregs; ++i)
+            args.push_back(wanted(i - 1) ? registers[i] : no_reg);
 
           BPatch_funcCallExpr call(*enter_function, args);
           BPatchSnippetHandle* handle = process->insertSnippet(call, points);
@@ -450,23 +696,8 @@ mutatee::instrument_dynprobe_target(BPatch_object* object,
       }
 
       // Update SDT semaphores as needed.
-      if (probe.semaphore)
-        {
-          Dyninst::Address sem_address = object->fileOffsetToAddr(probe.semaphore);
-          if (sem_address == BPatch_object::E_OUT_OF_BOUNDS)
-            stapwarn() << "Couldn't convert semaphore " << target.path << "+"
-                       << lex_cast_hex(probe.offset) << " to an address" << endl;
-          else
-            {
-              // Create a variable to represent this semaphore
-              BPatch_type *sem_type = process->getImage()->findType("unsigned short");
-              BPatch_variableExpr *semaphore = process->createVariable(sem_address, sem_type);
-              if (semaphore)
-                semaphores.push_back(semaphore);
-            }
-        }
+      add_semaphore(object, target, probe);
     }
-  process->finalizeInsertionSet(false);
 }
 
 
@@ -489,23 +720,18 @@ mutatee::instrument_global_dynprobes(const vector<dynprobe_target>& targets)
 }
 
 
-// Look for all matches between this object and the targets
-// we want to probe, then do the instrumentation.
+// Match the object to our targets, and instrument matches.  The caller
+// opens and finalizes the insertion set around this, so that Dyninst can
+// relocate and write all of the snippets at once.
 void
-mutatee::instrument_object_dynprobes(BPatch_object* object,
-                                     const vector<dynprobe_target>& targets)
+mutatee::instrument_object_targets(BPatch_object* object,
+                                   const vector<dynprobe_target>& targets)
 {
-  if (!process || !stap_dso || !object || targets.empty())
-    return;
-
   // We want to map objects by their full path, but the pathName from
   // Dyninst might be relative, so fill it out.
   string path = resolve_path(object->pathName());
   staplog(2) << "found object \"" << path << "\" in pid " << pid << endl;
 
-  size_t semaphore_start = semaphores.size();
-
-  // Match the object to our targets, and instrument matches.
   for (size_t i = 0; i < targets.size(); ++i)
     {
       const dynprobe_target& target = targets[i];
@@ -514,6 +740,23 @@ mutatee::instrument_object_dynprobes(BPatch_object* object,
       if (path == target.path)
         instrument_dynprobe_target(object, target);
     }
+}
+
+
+// Look for all matches between this object and the targets
+// we want to probe, then do the instrumentation.
+void
+mutatee::instrument_object_dynprobes(BPatch_object* object,
+                                     const vector<dynprobe_target>& targets)
+{
+  if (!process || !stap_dso || !object || targets.empty())
+    return;
+
+  size_t semaphore_start = semaphores.size();
+
+  process->beginInsertionSet();
+  instrument_object_targets(object, targets);
+  process->finalizeInsertionSet(false);
 
   // Increment new semaphores
   update_semaphores(1, semaphore_start);
@@ -626,23 +869,39 @@ mutatee::instrument_dynprobes(const vector<dynprobe_target>& targets)
   // Match non object/path specific probes.
   instrument_global_dynprobes(targets);
 
-  // Read all of the objects in the process.
+  size_t semaphore_start = semaphores.size();
+
+  // Read all of the objects in the process, and instrument them all in
+  // one insertion set.
   vector<BPatch_object *> objects;
   image->getObjects(objects);
+  process->beginInsertionSet();
   for (size_t i = 0; i < objects.size(); ++i)
-    instrument_object_dynprobes(objects[i], targets);
+    instrument_object_targets(objects[i], targets);
+  process->finalizeInsertionSet(false);
+
+  // Increment new semaphores
+  update_semaphores(1, semaphore_start);
 }
 
 
 // Copy data for forked instrumentation
+//
+// The child already runs the parent's patched code, so only our own
+// bookkeeping needs to follow.  The snippet handles and semaphore
+// variables are only needed to take the instrumentation out again, so
+// they're looked up later, in inherit_forked_instrumentation(), leaving
+// the cost of a fork independent of the number of probes.
 void
 mutatee::copy_forked_instrumentation(mutatee& other)
 {
   if (!process)
     return;
 
-  // Freeze both processes, so we have a stable base.
-  mutatee_freezer mf_parent(other), mf(*this);
+  // A fork of a fork starts from a parent with all of its handles.
+  other.inherit_forked_instrumentation();
+
+  mutatee_freezer mf(*this);
 
   // Find the same stap module in the fork
   if (other.stap_dso)
@@ -663,8 +922,60 @@ mutatee::copy_forked_instrumentation(mutatee& other)
 	  }
     }
 
+  // The kernel's traps don't follow a fork, so set them up again.  The
+  // child has its parent's SIGTRAP handler already.
+  if (!other.sdt_traps.empty())
+    {
+      sdt_trap_handler = true;
+      sdt_traps = other.sdt_traps;
+      if (!open_sdt_traps(0))
+        {
+          stapwarn() << "Couldn't trap SDT sites in forked pid " << pid << endl;
+          sdt_traps.clear();
+        }
+    }
+
+  // Remember what's inherited, for later.
+  fork_parent = &other;
+  fork_snippets = other.snippets.size();
+  fork_semaphores = other.semaphores.size();
+  for (size_t i = 0; i < other.fork_children.size();)
+    if (other.fork_children[i].expired())
+      other.fork_children.erase(other.fork_children.begin() + i);
+    else
+      ++i;
+  other.fork_children.push_back(shared_from_this());
+
+  // Update utrace probes to match, except PID-based probes.
+  // (A forked PID will never be the same as the parent.)
+  for (size_t i = 0; i < other.attached_probes.size(); ++i)
+    {
+      const dynprobe_location& probe = other.attached_probes[i];
+      if (probe.offset == 0)
+	instrument_utrace_dynprobe(probe);
+    }
+}
+
+
+// Get our own handles for the snippets and semaphores inherited from our
+// fork parent, if we haven't yet.
+void
+mutatee::inherit_forked_instrumentation()
+{
+  if (!fork_parent)
+    return;
+
+  mutatee& other = *fork_parent;
+  fork_parent = NULL;
+  if (!process || process->isTerminated())
+    return;
+
+  mutatee_freezer mf(*this);
+  staplog(2) << "inheriting " << fork_snippets << " snippets in pid "
+             << pid << " from pid " << other.pid << endl;
+
   // Get new handles for all inserted snippets
-  for (size_t i = 0; i < other.snippets.size(); ++i)
+  for (size_t i = 0; i < fork_snippets; ++i)
     {
       BPatchSnippetHandle *handle =
 	process->getInheritedSnippet(*other.snippets[i]);
@@ -673,22 +984,27 @@ mutatee::copy_forked_instrumentation(mutatee& other)
     }
 
   // Get new variable representations of semaphores
-  for (size_t i = 0; i < other.semaphores.size(); ++i)
+  for (size_t i = 0; i < fork_semaphores; ++i)
     {
       BPatch_variableExpr *semaphore =
         process->getInheritedVariable(*other.semaphores[i]);
       if (semaphore)
         semaphores.push_back(semaphore);
     }
+}
 
-  // Update utrace probes to match, except PID-based probes.
-  // (A forked PID will never be the same as the parent.)
-  for (size_t i = 0; i < other.attached_probes.size(); ++i)
+
+// Let forked children take their handles from ours, before ours change.
+void
+mutatee::finish_forked_children()
+{
+  for (size_t i = 0; i < fork_children.size(); ++i)
     {
-      const dynprobe_location& probe = other.attached_probes[i];
-      if (probe.offset == 0)
-	instrument_utrace_dynprobe(probe);
+      auto child = fork_children[i].lock();
+      if (child)
+        child->inherit_forked_instrumentation();
     }
+  fork_children.clear();
 }
 
 
@@ -696,10 +1012,18 @@ mutatee::copy_forked_instrumentation(mutatee& other)
 void
 mutatee::exec_reset_instrumentation()
 {
-  // Reset members that are now out of date
+  finish_forked_children();
+
+  // The inherited instrumentation went away with the old image.
+  fork_parent = NULL;
+
+  // Reset members that are now out of date.  The exec took the kernel's
+  // traps out already.
   stap_dso = NULL;
   snippets.clear();
   semaphores.clear();
+  close_sdt_traps();
+  sdt_trap_handler = false;
 
   // NB: the utrace process.end probes are saved, so they can run right
   // before the new process does its process.begin.
@@ -714,14 +1038,24 @@ mutatee::exec_reset_instrumentation()
 void
 mutatee::remove_instrumentation()
 {
-  if (!process || snippets.empty())
+  finish_forked_children();
+  inherit_forked_instrumentation();
+
+  // The SIGTRAP handler stays, since the module can't be unloaded; with
+  // the events gone, only traps already underway still reach it.
+  close_sdt_traps();
+
+  if (!process || (snippets.empty() && semaphores.empty()))
     return;
 
-  process->beginInsertionSet();
-  for (size_t i = 0; i < snippets.size(); ++i)
-    process->deleteSnippet(snippets[i]);
-  process->finalizeInsertionSet(false);
-  snippets.clear();
+  if (!snippets.empty())
+    {
+      process->beginInsertionSet();
+      for (size_t i = 0; i < snippets.size(); ++i)
+        process->deleteSnippet(snippets[i]);
+      process->finalizeInsertionSet(false);
+      snippets.clear();
+    }
 
   // Decrement all semaphores
   update_semaphores(-1);
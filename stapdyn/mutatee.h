@@ -9,6 +9,7 @@
 #ifndef MUTATEE_H
 #define MUTATEE_H
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -21,7 +22,7 @@
 
 
 // A mutatee is created for each attached process
-class mutatee {
+class mutatee : public std::enable_shared_from_this<mutatee> {
   private:
     pid_t pid; // The system's process ID.
     BPatch_process* process; // Dyninst's handle for this process
@@ -39,17 +40,47 @@ class mutatee {
     // process.end probes saved to run after exec
     std::vector<dynprobe_location> exec_proc_end_probes;
 
+    // A forked child doesn't look up its inherited snippets and
+    // semaphores until it needs them; until then it remembers how many
+    // of its parent's it has.  The parent hands them over before it
+    // changes or drops its own.
+    mutatee* fork_parent;
+    size_t fork_snippets, fork_semaphores;
+    std::vector<std::weak_ptr<mutatee> > fork_children;
+
+    // SDT sites the kernel traps for us, with -u, rather than being
+    // patched.  Their perf uprobe events are opened in each thread, and
+    // inherited by the threads those create.
+    struct sdt_trap {
+      std::string path;
+      uint64_t offset, index;
+    };
+    std::vector<sdt_trap> sdt_traps;
+    std::vector<int> sdt_trap_fds;
+    bool sdt_trap_handler; // stp_dyninst_sdt_trap_init() has run
+
+    bool trap_sdt_probes(BPatch_object* object, const dynprobe_target& target);
+    bool open_sdt_traps(size_t start);
+    void close_sdt_traps();
+
+    void inherit_forked_instrumentation();
+    void finish_forked_children();
+
     // disable implicit constructors by not implementing these
     mutatee (const mutatee& other);
     mutatee& operator= (const mutatee& other);
 
     void update_semaphores(unsigned short delta, size_t start=0);
+    void add_semaphore(BPatch_object* object, const dynprobe_target& target,
+                       const dynprobe_location& probe);
 
     void call_utrace_dynprobes(const std::vector<dynprobe_location>& probes,
                                BPatch_thread* thread=NULL);
     void instrument_utrace_dynprobe(const dynprobe_location& probe);
     void instrument_global_dynprobe_target(const dynprobe_target& target);
     void instrument_global_dynprobes(const std::vector<dynprobe_target>& targets);
+    void instrument_object_targets(BPatch_object* object,
+                                   const std::vector<dynprobe_target>& targets);
 
   public:
     mutatee(BPatch_process* process);
@@ -287,6 +287,20 @@ mutator::create_process(const string& command)
 // Attach to a specific existing process.
 bool
 mutator::attach_process(pid_t pid)
+{
+  return attach_processes(vector<pid_t>(1, pid));
+}
+
+// Attach to several existing processes; the first is the target.
+//
+// Dyninst keeps one parse of each binary for all of the processes that
+// this BPatch attaches, so instrumenting many processes of the same
+// program only pays for its symbol and CFG analysis once.  Each step is
+// done for all processes before the next, which keeps that cache warm,
+// and each process gets its snippets in one insertion set.  (BPatch
+// isn't thread-safe, so there's no doing this on several threads.)
+bool
+mutator::attach_processes(const vector<pid_t>& pids)
 {
   if (target_mutatee)
     {
@@ -294,24 +308,34 @@ mutator::attach_process(pid_t pid)
       return false;
     }
 
-  BPatch_process* app = patch.processAttach(NULL, pid);
-  if (!app)
+  vector<shared_ptr<mutatee> > attached;
+  for (size_t i = 0; i < pids.size(); ++i)
     {
-      staperror() << "Couldn't attach to the target process" << endl;
-      return false;
-    }
+      BPatch_process* app = patch.processAttach(NULL, pids[i]);
+      if (!app)
+        {
+          staperror() << "Couldn't attach to the target process "
+                      << pids[i] << endl;
+          return false;
+        }
 
-  auto m = make_shared<mutatee>(app);
-  mutatees.push_back(m);
-  target_mutatee = m;
+      auto m = make_shared<mutatee>(app);
+      mutatees.push_back(m);
+      attached.push_back(m);
+      if (!target_mutatee)
+        target_mutatee = m;
+    }
   p_target_created = false;
 
-  if (!m->load_stap_dso(module_name))
-    return false;
+  for (size_t i = 0; i < attached.size(); ++i)
+    if (!attached[i]->load_stap_dso(module_name))
+      return false;
 
   if (!targets.empty())
-    m->instrument_dynprobes(targets);
+    for (size_t i = 0; i < attached.size(); ++i)
+      attached[i]->instrument_dynprobes(targets);
 
+  staplog(1) << "attached to " << attached.size() << " processes" << endl;
   return true;
 }
 
@@ -491,12 +515,13 @@ mutator::run_module_init()
       return false;
     }
 
-  // Now we map the shared-memory into the target
+  // Now we map the shared-memory into the targets
   if (target_mutatee && !module_shmem.empty())
     {
       vector<BPatch_snippet *> args;
       args.push_back(new BPatch_constExpr(module_shmem.c_str()));
-      target_mutatee->call_function("stp_dyninst_shm_connect", args);
+      for (size_t i = 0; i < mutatees.size(); ++i)
+        mutatees[i]->call_function("stp_dyninst_shm_connect", args);
     }
 
   return true;
@@ -586,9 +611,11 @@ mutator::run ()
   // And away we go!
   if (target_mutatee)
     {
-      // For our first event, fire the target's process.begin probes (if any)
-      target_mutatee->begin_callback();
-      target_mutatee->continue_execution();
+      // For our first event, fire the targets' process.begin probes (if any)
+      for (size_t i = 0; i < mutatees.size(); ++i)
+        mutatees[i]->begin_callback();
+      for (size_t i = 0; i < mutatees.size(); ++i)
+        mutatees[i]->continue_execution();
 
       // Dyninst's notification FD was fixed in 8.1; for earlier versions we'll
       // fall back to the fully-blocking wait for now.
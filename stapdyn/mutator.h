@@ -87,6 +87,9 @@ class mutator {
     bool attach_process(BPatch_process* process);
     bool attach_process(pid_t pid);
 
+    // Attach to several existing processes; the first is the target.
+    bool attach_processes(const std::vector<pid_t>& pids);
+
     // Start the actual systemtap session!
     bool run ();
 
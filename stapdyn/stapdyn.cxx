@@ -43,17 +43,21 @@ static void __attribute__ ((noreturn))
 usage (int rc)
 {
   cout << "Usage: " << program_invocation_short_name
-       << " MODULE [-v] [-c CMD | -x PID] [-o FILE] [-C WHEN] [globalname=value ...] [-V] [-h]" << endl
+       << " MODULE [-v] [-c CMD | -x PID...] [-o FILE] [-C WHEN] [-u] [globalname=value ...] [-V] [-h]" << endl
        << "-v              Increase verbosity." << endl
        << "-w              Suppress warnings from the script." << endl
        << "-c cmd          Command \'cmd\' will be run and " << program_invocation_short_name << " will" << endl
        << "                exit when it does.  The '_stp_target' variable" << endl
        << "                will contain the pid for the command." << endl
-       << "-x pid          Sets the '_stp_target' variable to pid." << endl
+       << "-x pid          Sets the '_stp_target' variable to pid.  May be" << endl
+       << "                repeated to attach to more processes; the first" << endl
+       << "                one is the target." << endl
        << "-o FILE         Send output to FILE. This supports strftime(3)" << endl
        << "                formats for FILE." << endl
        << "-C WHEN         Enable colored errors. WHEN must be either 'auto'," << endl
        << "                'never', or 'always'. Set to 'auto' by default." << endl
+       << "-u              Have the kernel trap SDT probe sites with uprobes," << endl
+       << "                where permitted, rather than patching them." << endl
        << "-V              Show version." << endl
        << "-h              Show this help text." << endl;
 
@@ -65,7 +69,7 @@ usage (int rc)
 int
 main(int argc, char * const argv[])
 {
-  pid_t pid = 0;
+  vector<pid_t> pids;
   const char* command = NULL;
   const char* module = NULL;
 
@@ -75,7 +79,7 @@ main(int argc, char * const argv[])
 
   // First, option parsing.
   int opt;
-  while ((opt = getopt (argc, argv, "c:x:vwo:VhC:")) != -1)
+  while ((opt = getopt (argc, argv, "c:x:vwo:VhC:u")) != -1)
     {
       switch (opt)
         {
@@ -84,7 +88,7 @@ main(int argc, char * const argv[])
           break;
 
         case 'x':
-          pid = atoi(optarg);
+          pids.push_back(atoi(optarg));
           break;
 
         case 'v':
@@ -99,6 +103,10 @@ main(int argc, char * const argv[])
 	  stapdyn_outfile_name = optarg;
 	  break;
 
+        case 'u':
+          stapdyn_sdt_uprobes = true;
+          break;
+
         case 'V':
           printf("Systemtap Dyninst loader/runner (version %s/%s, %s)\n"
                  "Copyright (C) 2012-2022 Red Hat, Inc. and others\n"  // PRERELEASE
@@ -137,13 +145,13 @@ main(int argc, char * const argv[])
       modoptions.push_back(string(argv[optind++]));
     }
 
-  if (!module || (command && pid))
+  if (!module || (command && !pids.empty()))
     usage (1);
 
   // Make sure that environment variables and selinux are set ok.
   if (!check_dyninst_rt())
     return 1;
-  if (!check_dyninst_sebools(pid != 0))
+  if (!check_dyninst_sebools(!pids.empty()))
     return 1;
 
   unique_ptr<mutator> session(new mutator(module, modoptions));
@@ -156,7 +164,7 @@ main(int argc, char * const argv[])
   if (command && !session->create_process(command))
     return 1;
 
-  if (pid && !session->attach_process(pid))
+  if (!pids.empty() && !session->attach_processes(pids))
     return 1;
 
   if (!session->run())
@@ -38,6 +38,14 @@
 // (only when testing using the standalone regtest module):
 //#define STAPREGEX_DEBUG_MATCH
 
+// Untagged DFAs with at least this many states are emitted as tables
+// rather than as switch statements.  The switches run faster while they
+// stay in cache, but take a couple of KB per state; from around here
+// the much smaller tables come out ahead when the probe's cache is cold:
+#ifndef STAPREGEX_TABLE_STATES
+#define STAPREGEX_TABLE_STATES 64
+#endif
+
 // Uncomment for a detailed walkthrough of the tagged-NFA conversion:
 //#define STAPREGEX_DEBUG_TNFA
 
@@ -48,9 +56,8 @@ namespace stapregex {
 regexp *pad_re = NULL;
 regexp *fail_re = NULL;
 
-dfa *
-stapregex_compile (regexp *re, const std::string& match_snippet,
-                   const std::string& fail_snippet)
+static void
+stapregex_init_scaffolding ()
 {
   if (pad_re == NULL) {
     // build regexp for ".*"
@@ -68,6 +75,16 @@ stapregex_compile (regexp *re, const std::string& match_snippet,
     // XXX: this approach creates one extra spurious-but-safe state
     // (safe because the matching procedure stops after encountering '\0')
   }
+}
+
+static dfa *compile_rules (regexp *re, int num_tags, vector<string>& outcomes,
+                           const vector<unsigned>& ins_outcome);
+
+dfa *
+stapregex_compile (regexp *re, const std::string& match_snippet,
+                   const std::string& fail_snippet)
+{
+  stapregex_init_scaffolding();
 
   vector<string> outcomes(2);
   outcomes[0] = fail_snippet;
@@ -81,6 +98,93 @@ stapregex_compile (regexp *re, const std::string& match_snippet,
   re = new rule_op(re, 1);
   re = new alt_op(re, fail_re);
 
+  dfa *d = compile_rules(re, num_tags, outcomes, vector<unsigned>());
+
+  // Carefully deallocate temporary scaffolding:
+  if (!anchored) delete ((rule_op*) ((alt_op*) re)->a)->re; // -- new cat_op
+  delete ((alt_op*) re)->a; // -- new rule_op
+  delete re; // -- new alt_op
+  // NB: deleting a regular expression DOES NOT deallocate its
+  // children. The original re parameter is presumed to be retained
+  // indefinitely as part of a stapdfa table, or such....
+
+  return d;
+}
+
+dfa *
+stapregex_compile (const vector<regexp *>& res,
+                   const vector<string>& match_snippets,
+                   const string& fail_snippet)
+{
+  assert(!res.empty() && res.size() == match_snippets.size());
+  stapregex_init_scaffolding();
+
+  // The first pattern gets the highest outcome, since the dfa prefers
+  // those; failure is still outcome 0:
+  unsigned n = res.size();
+  vector<string> outcomes(n + 1);
+  outcomes[0] = fail_snippet;
+
+  // Each pattern becomes ".*re(.*$)?", so that it accepts again at the
+  // '\0' however early it matched.  The final state reached on the '\0'
+  // then holds the outcomes of all the patterns that matched, and the
+  // dfa picks the best of them there.  The empty alternative is for
+  // patterns that end in '$' themselves, which has already used up the
+  // '\0' by the time they accept:
+  vector<regexp *> scaffolding;
+  regexp *tail = new cat_op(pad_re, new anchor_op('$'));
+  scaffolding.push_back(((cat_op *) tail)->b);
+  scaffolding.push_back(tail);
+  tail = new alt_op(tail, new null_op);
+  scaffolding.push_back(((alt_op *) tail)->b);
+  scaffolding.push_back(tail);
+
+  regexp *re = fail_re;
+  for (unsigned k = n; k-- > 0; )
+    {
+      regexp *r = res[k];
+      outcomes[n - k] = match_snippets[k];
+      if (!r->anchored ()) // -- left-padding
+        {
+          r = new cat_op(pad_re, r);
+          scaffolding.push_back(r);
+        }
+      r = new cat_op(r, tail);
+      scaffolding.push_back(r);
+      r = new rule_op(r, n - k);
+      scaffolding.push_back(r);
+      re = new alt_op(r, re);
+      scaffolding.push_back(re);
+    }
+
+  // Note which pattern each ins belongs to.  Each alt_op puts a FORK
+  // before its first alternative and a GOTO after it; those, and
+  // fail_re (which keeps every state with a way forward), are never
+  // forgotten:
+  vector<unsigned> ins_outcome(re->ins_size() + 1, n + 1);
+  unsigned pos = 0;
+  for (regexp *r = re; r != fail_re; r = ((alt_op *) r)->b)
+    {
+      regexp *rule = ((alt_op *) r)->a;
+      unsigned outcome = ((rule_op *) rule)->outcome;
+      for (unsigned j = 0; j < rule->ins_size(); j++)
+        ins_outcome[pos + 1 + j] = outcome;
+      pos += rule->ins_size() + 2;
+    }
+
+  dfa *d = compile_rules(re, 0, outcomes, ins_outcome);
+
+  // NB: as above, this leaves the patterns themselves alone:
+  for (unsigned i = 0; i < scaffolding.size(); i++)
+    delete scaffolding[i];
+
+  return d;
+}
+
+static dfa *
+compile_rules (regexp *re, int num_tags, vector<string>& outcomes,
+               const vector<unsigned>& ins_outcome)
+{
 #ifdef STAPREGEX_DEBUG_INS
   cerr << "RESULTING INS FROM REGEX " << re << ":" << endl;
 #endif
@@ -114,17 +218,7 @@ stapregex_compile (regexp *re, const std::string& match_snippet,
   cerr << endl;
 #endif
 
-  dfa *d = new dfa(i, num_tags, outcomes);
-
-  // Carefully deallocate temporary scaffolding:
-  if (!anchored) delete ((rule_op*) ((alt_op*) re)->a)->re; // -- new cat_op
-  delete ((alt_op*) re)->a; // -- new rule_op
-  delete re; // -- new alt_op
-  // NB: deleting a regular expression DOES NOT deallocate its
-  // children. The original re parameter is presumed to be retained
-  // indefinitely as part of a stapdfa table, or such....
-
-  return d;
+  return new dfa(i, num_tags, outcomes, 1, ins_outcome);
 }
 
 // ------------------------------------------------------------------------
@@ -289,12 +383,58 @@ rebalance_priorities(stack<kernel_point> &worklist, stack<kernel_point> &new_wor
     }
 }
 
+/* Without tags, no path to an insn is preferred over another, so the
+   closure is just the set of insns reachable by e-transitions, and none
+   of the priority bookkeeping below is needed. */
+state_kernel *
+e_closure (state_kernel *start, bool is_initial)
+{
+  state_kernel *closure = new state_kernel;
+  set<ins *> seen;
+  stack<ins *> worklist;
+
+  for (state_kernel::iterator it = start->begin(); it != start->end(); it++)
+    if (seen.insert(it->i).second)
+      {
+        add_kernel(closure, it->i);
+        worklist.push(it->i);
+      }
+
+  while (!worklist.empty())
+    {
+      ins *i = worklist.top(); worklist.pop();
+      ins *targets[2] = { NULL, NULL };
+
+      if (i->i.tag == TAG || (i->i.tag == INIT && is_initial))
+        targets[0] = &i[1];
+      else if (i->i.tag == FORK)
+        {
+          targets[0] = &i[1];
+          targets[1] = (ins *) i->i.link;
+        }
+      else if (i->i.tag == GOTO)
+        targets[0] = (ins *) i->i.link;
+
+      for (unsigned k = 0; k < 2; k++)
+        if (targets[k] && seen.insert(targets[k]).second)
+          {
+            add_kernel(closure, targets[k]);
+            worklist.push(targets[k]);
+          }
+    }
+
+  return closure;
+}
+
 /* Compute the set of kernel_points that are 'tag-wise unambiguously
    reachable' from a given initial set of points. Absent tagging, this
    becomes a bog-standard NFA e_closure construction. */
 state_kernel *
 te_closure (dfa *dfa, state_kernel *start, int ntags, bool is_initial = false)
 {
+  if (ntags == 0)
+    return e_closure(start, is_initial);
+
   state_kernel *closure = new state_kernel(*start);
   stack<kernel_point> base_worklist; // -- with old priorities
   stack<kernel_point> worklist; // -- with rebalanced priorities
@@ -833,9 +973,10 @@ dfa::compute_finalizer (state *s)
 /* The main DFA-construction algorithm: */
 
 dfa::dfa (ins *i, int ntags, vector<string>& outcome_snippets,
-          int accept_outcome)
+          int accept_outcome, const vector<unsigned>& ins_outcome)
   : orig_nfa(i), nstates(0), nmapitems(0), ntags(ntags),
-    outcome_snippets(outcome_snippets), success_outcome(accept_outcome)
+    outcome_snippets(outcome_snippets), success_outcome(accept_outcome),
+    defer_accept(!ins_outcome.empty()), ins_outcome(ins_outcome)
 {
 #ifdef STAPREGEX_DEBUG_TNFA
   cerr << "DFA CONSTRUCTION (ntags=" << ntags << "):" << endl;
@@ -856,6 +997,7 @@ dfa::dfa (ins *i, int ntags, vector<string>& outcome_snippets,
   state_kernel *seed_kernel = make_kernel(start);
   state_kernel *initial_kernel = te_closure(this, seed_kernel, ntags, true);
   delete seed_kernel;
+  prune_kernel(initial_kernel);
   state *initial = add_state(new state(this, initial_kernel));
   queue<state *> worklist; worklist.push(initial);
 
@@ -955,6 +1097,7 @@ dfa::dfa (ins *i, int ntags, vector<string>& outcome_snippets,
         {
           /* Set up candidate target state: */
           state_kernel *u_pairs = te_closure(this, it->reach_pairs, ntags);
+          prune_kernel(u_pairs);
           state *target = new state(this, u_pairs);
 
           /* Generate position-save commands for any map items
@@ -1007,6 +1150,37 @@ dfa::~dfa ()
   delete orig_nfa;
 }
 
+/* Once a pattern has matched, the ones it beats no longer matter.
+   Dropping them keeps a set of patterns from needing a state for every
+   combination of their progress. */
+void
+dfa::prune_kernel (state_kernel *k) const
+{
+  if (!defer_accept)
+    return;
+
+  unsigned best = 0;
+  for (state_kernel::iterator it = k->begin(); it != k->end(); it++)
+    if (it->i->i.tag == ACCEPT && it->i->i.param > best)
+      best = it->i->i.param;
+  if (best == 0)
+    return;
+
+  for (state_kernel::iterator it = k->begin(); it != k->end(); )
+    if (ins_outcome[it->i - orig_nfa] < best)
+      it = k->erase(it);
+    else
+      it++;
+}
+
+/* Can matching stop as soon as state s is reached? */
+bool
+dfa::is_final (const state *s) const
+{
+  return s->accepts && (!defer_accept
+                        || s->accept_outcome == outcome_snippets.size() - 1);
+}
+
 // ------------------------------------------------------------------------
 
 void
@@ -1018,7 +1192,7 @@ span::emit_jump (translator_output *o, const dfa *d) const
   o->newline () << "_stp_print_flush();";
 #endif
 
-  if (to->accepts)
+  if (d->is_final(to))
     {
       emit_final(o, d);
       return;
@@ -1170,20 +1344,113 @@ dfa::emit (translator_output *o) const
     {
       emit_action(o, first->finalizer);
     }
-  if (first->accepts && ntags == 0) // XXX workaround for empty regex
+  if (is_final(first) && ntags == 0) // XXX workaround for empty regex
     {
       o->newline() << outcome_snippets[first->accept_outcome];
       o->newline() << "goto yyfinish;";      
     }
 
-  for (state *s = first; s; s = s->next)
-    s->emit(o, this);
+  if (ntags == 0 && nstates >= STAPREGEX_TABLE_STATES)
+    emit_table(o);
+  else
+    for (state *s = first; s; s = s->next)
+      s->emit(o, this);
 
   o->newline() << "yyfinish: ;";
   o->newline(-1) << "}";
 #endif
 }
 
+/* Emit an untagged DFA as a transition table instead of as code, which
+   keeps big automata down to a byte or two per state and character
+   class.  Characters that every state treats alike share a class.  An
+   entry below nstates is the next state; nstates + k ends the match
+   with outcome k.  (With no tags there are no actions to run.) */
+void
+dfa::emit_table (translator_output *o) const
+{
+  assert (ntags == 0);
+
+  vector<vector<unsigned> > column(NUM_REAL_CHARS, vector<unsigned>(nstates));
+  for (state *s = first; s; s = s->next)
+    for (list<span>::const_iterator it = s->spans.begin();
+         it != s->spans.end(); it++)
+      for (unsigned c = it->lb; c <= (unsigned) it->ub; c++)
+        {
+          // As in state::emit, a '\0' always ends the match:
+          if (c == '\0' || is_final(it->to))
+            {
+              assert (it->to->accepts);
+              column[c][s->label] = nstates + it->to->accept_outcome;
+            }
+          else
+            column[c][s->label] = it->to->label;
+        }
+
+  map<vector<unsigned>, unsigned> classes;
+  vector<vector<unsigned> *> class_column;
+  vector<unsigned> char_class(NUM_REAL_CHARS);
+  for (unsigned c = 0; c < NUM_REAL_CHARS; c++)
+    {
+      map<vector<unsigned>, unsigned>::iterator it = classes.find(column[c]);
+      if (it == classes.end())
+        {
+          it = classes.insert(make_pair(column[c], class_column.size())).first;
+          class_column.push_back(&column[c]);
+        }
+      char_class[c] = it->second;
+    }
+
+  // Entries are stored premultiplied by the row length, which saves a
+  // multiplication per character in the matching loop:
+  unsigned nclasses = class_column.size();
+  unsigned limit = nstates * nclasses;
+  unsigned entries = limit + outcome_snippets.size();
+  const char *entry_type = (entries <= 256 ? "unsigned char"
+                            : entries <= 65536 ? "unsigned short"
+                            : "unsigned int");
+
+  o->newline() << "{";
+  o->newline(1) << "static const unsigned char yyclass[256] = {";
+  o->indent(1);
+  for (unsigned c = 0; c < 256; c++)
+    {
+      // -- all of the non-ASCII chars are the 'unknown character'
+      unsigned k = char_class[min(c, (unsigned) NUM_REAL_CHARS - 1)];
+      if (c % 16 == 0)
+        o->newline();
+      o->line() << k << ",";
+    }
+  o->newline(-1) << "};";
+  o->newline() << "static const " << entry_type << " yytable["
+               << limit << "] = {";
+  o->indent(1);
+  for (state *s = first; s; s = s->next)
+    {
+      o->newline();
+      for (unsigned k = 0; k < nclasses; k++)
+        {
+          unsigned e = (*class_column[k])[s->label];
+          o->line() << (e < nstates ? e * nclasses : e - nstates + limit) << ",";
+        }
+    }
+  o->newline(-1) << "};";
+  o->newline() << "unsigned yys = " << first->label * nclasses << ";";
+  o->newline() << "do";
+  o->newline(1) << "yys = yytable[yys + yyclass[(unsigned char) *YYCURSOR++]];";
+  o->newline(-1) << "while (yys < " << limit << ");";
+  o->newline() << "switch (yys - " << limit << ") {";
+  for (unsigned k = 0; k < outcome_snippets.size(); k++)
+    {
+      o->newline() << "case " << k << ":";
+      o->newline(1) << outcome_snippets[k];
+      o->newline() << "goto yyfinish;";
+      o->indent(-1);
+    }
+  o->newline() << "}";
+  o->newline(-1) << "}";
+}
+
 void
 dfa::emit_action (translator_output *o, const tdfa_action &act) const
 {
@@ -149,11 +149,23 @@ struct dfa {
   int success_outcome;
   int fail_outcome;
 
+  // When matching several patterns at once, a state that accepts partway
+  // through the string is only final if no better outcome is possible;
+  // otherwise the outcome is decided at the '\0'.  ins_outcome gives the
+  // outcome of the pattern each ins belongs to, so that the patterns a
+  // better one already beat can be forgotten:
+  bool defer_accept;
+  std::vector<unsigned> ins_outcome;
+
   dfa (ins *i, int ntags, std::vector<std::string>& outcome_snippets,
-       int accept_outcome = 1);
+       int accept_outcome = 1,
+       const std::vector<unsigned>& ins_outcome = std::vector<unsigned>());
+
+  bool is_final (const state *s) const;
   ~dfa ();
 
   void emit (translator_output *o) const;
+  void emit_table (translator_output *o) const;
 
   void emit_action (translator_output *o, const tdfa_action &act) const;
   void emit_tagsave (translator_output *o, std::string tag_states,
@@ -168,6 +180,7 @@ private:
   state *find_equivalent (state *s, tdfa_action &r);
   tdfa_action compute_action (state_kernel *old_k, state_kernel *new_k);
   tdfa_action compute_finalizer (state *s);
+  void prune_kernel (state_kernel *k) const;
 };
 
 std::ostream& operator << (std::ostream &o, const dfa& d);
@@ -177,6 +190,13 @@ std::ostream& operator << (std::ostream &o, const dfa* d);
    or fail outcomes for an unanchored (by default) match of re. */
 dfa *stapregex_compile (regexp *re, const std::string& match_snippet, const std::string& fail_snippet);
 
+/* Produces an untagged dfa that scans the string once and runs the
+   match snippet of the first of res that matches it, or else the fail
+   snippet. */
+dfa *stapregex_compile (const std::vector<regexp *>& res,
+                        const std::vector<std::string>& match_snippets,
+                        const std::string& fail_snippet);
+
 };
 
 #endif
@@ -504,6 +504,105 @@ str_to_re(const string& str)
   return re;
 }
 
+// What is known about the literal text of every match of a regexp,
+// in the manner of grep's "must" strings:
+struct literal_info {
+  bool exact_p;        // -- every match is exactly this string
+  string exact;
+  string left, right;  // -- every match starts/ends with these
+  string in;           // -- every match contains this
+  literal_info () : exact_p(false) {}
+  literal_info (const string& s) : exact_p(true), exact(s),
+                                   left(s), right(s), in(s) {}
+};
+
+static const string&
+longest (const string& a, const string& b)
+{
+  return a.length() >= b.length() ? a : b;
+}
+
+static literal_info
+literals (const regexp *re)
+{
+  if (dynamic_cast<const null_op *>(re)
+      || dynamic_cast<const anchor_op *>(re) // -- '$' matches the '\0'
+      || dynamic_cast<const tag_op *>(re))
+    return literal_info("");
+
+  if (const match_op *m = dynamic_cast<const match_op *>(re))
+    {
+      const deque<segment>& s = m->ran->segments;
+      // -- not '\0', nor the 'unknown character' standing for many
+      if (s.size() == 1 && s[0].first == s[0].second
+          && s[0].first != '\0' && s[0].first < NUM_REAL_CHARS - 1)
+        return literal_info(string(1, s[0].first));
+      return literal_info();
+    }
+
+  if (const cat_op *c = dynamic_cast<const cat_op *>(re))
+    {
+      literal_info a = literals(c->a), b = literals(c->b);
+      if (a.exact_p && b.exact_p)
+        return literal_info(a.exact + b.exact);
+
+      literal_info r;
+      r.left = a.exact_p ? a.exact + b.left : a.left;
+      r.right = b.exact_p ? a.right + b.exact : b.right;
+      r.in = longest(longest(a.in, b.in), a.right + b.left);
+      r.in = longest(r.in, longest(r.left, r.right));
+      return r;
+    }
+
+  if (const alt_op *c = dynamic_cast<const alt_op *>(re))
+    {
+      literal_info a = literals(c->a), b = literals(c->b);
+      if (a.exact_p && b.exact_p && a.exact == b.exact)
+        return a;
+
+      literal_info r;
+      unsigned n = 0;
+      while (n < a.left.length() && n < b.left.length()
+             && a.left[n] == b.left[n])
+        n++;
+      r.left = a.left.substr(0, n);
+      n = 0;
+      while (n < a.right.length() && n < b.right.length()
+             && a.right[a.right.length() - 1 - n] == b.right[b.right.length() - 1 - n])
+        n++;
+      r.right = a.right.substr(a.right.length() - n);
+      r.in = longest(r.left, r.right);
+      return r;
+    }
+
+  if (const closev_op *c = dynamic_cast<const closev_op *>(re))
+    {
+      if (c->nmin <= 0)
+        return literal_info();
+
+      literal_info a = literals(c->re);
+      if (a.exact_p && c->nmin == c->nmax)
+        {
+          string s;
+          for (int i = 0; i < c->nmin; i++)
+            s += a.exact;
+          return literal_info(s);
+        }
+      a.exact_p = false;
+      a.exact.clear();
+      return a;
+    }
+
+  // -- close_op and anything else may match without any text at all
+  return literal_info();
+}
+
+string
+required_literal(const regexp *re)
+{
+  return literals(re).in;
+}
+
 regexp *
 do_alt(regexp *a, regexp *b)
 {
@@ -264,6 +264,10 @@ regexp *str_to_re(const std::string& str);
 regexp *make_alt(regexp* a, regexp* b);
 regexp *make_dot(bool allow_zero = false);
 
+/* The longest literal string that every match of re must contain
+   (possibly empty), for a cheap test before running the dfa: */
+std::string required_literal(const regexp *re);
+
 // ------------------------------------------------------------------------
 
 struct regex_error: public std::runtime_error
@@ -16,11 +16,16 @@
 
 #include "session.h"
 #include "staptree.h" // needed to use semantic_error
+#include "parse.h"
+#include "cache.h"
+#include "hash.h"
 
 #include <iostream>
 #include <cstdlib>
 #include <string>
 #include <algorithm>
+#include <fstream>
+#include <iterator>
 
 using namespace std;
 
@@ -43,7 +48,7 @@ regex_to_stapdfa (systemtap_session *s, const string& input, const token *tok)
   if (s->dfas.find(input) != s->dfas.end())
     return s->dfas[input];
 
-  stapdfa *dfa = new stapdfa ("__stp_dfa" + lex_cast(s->dfa_counter++), input, tok, true, do_tag);
+  stapdfa *dfa = new stapdfa ("__stp_dfa" + lex_cast(s->dfa_counter++), input, tok, true, do_tag, s);
 
   // Update required size of subexpression-tracking data structure:
   s->dfa_maxmap = max(s->dfa_maxmap, dfa->num_map_items());
@@ -53,17 +58,214 @@ regex_to_stapdfa (systemtap_session *s, const string& input, const token *tok)
   return dfa;
 }
 
+bool
+regex_chain (if_statement *s, vector<regex_query *>& chain)
+{
+  chain.clear();
+  for (statement *st = s; st; st = s->elseblock)
+    {
+      s = dynamic_cast<if_statement *>(st);
+      regex_query *q = s ? dynamic_cast<regex_query *>(s->condition) : NULL;
+      if (!q || q->op != "=~")
+        break;
+
+      // Reading a plain variable has no side effects, so it doesn't
+      // matter that the combined dfa reads it only once:
+      symbol *sym = dynamic_cast<symbol *>(q->left);
+      if (!sym || !sym->referent
+          || (!chain.empty()
+              && sym->referent != ((symbol *) chain[0]->left)->referent))
+        break;
+      chain.push_back(q);
+    }
+  return chain.size() >= 2;
+}
+
+stapdfa *
+regex_chain_to_stapdfa (systemtap_session *s, const vector<regex_query *>& chain)
+{
+  // The result says nothing about subexpressions, so matched() can't
+  // be used with it:
+  if (s->need_tagged_dfa)
+    return NULL;
+
+  vector<string> inputs;
+  unsigned separate_states = 0;
+  for (unsigned i = 0; i < chain.size(); i++)
+    {
+      inputs.push_back(chain[i]->right->value);
+      separate_states += regex_to_stapdfa (s, inputs.back(),
+                                           chain[i]->right->tok)->num_states();
+    }
+
+  map<vector<string>, stapdfa*>::iterator it = s->dfa_chains.find(inputs);
+  if (it != s->dfa_chains.end())
+    return it->second;
+
+  stapdfa *dfa = new stapdfa ("__stp_dfa" + lex_cast(s->dfa_counter++), inputs,
+                              chain[0]->right->tok, s);
+
+  // Patterns that can match anywhere in the string can multiply each
+  // other's states; past a point, the code size isn't worth it.
+  if (dfa->num_states() > 4 * separate_states)
+    {
+      if (s->verbose > 2)
+        clog << _F("not combining %zu regexes at %s, which would need %u states",
+                   chain.size(), lex_cast(chain[0]->tok->location).c_str(),
+                   dfa->num_states()) << endl;
+      delete dfa;
+      dfa = NULL;
+    }
+
+  s->dfa_chains[inputs] = dfa;
+  return dfa;
+}
+
 // ------------------------------------------------------------------------
 
+// The pattern(s) as a C comment would quote them:
+static string
+quoted_inputs (const stapdfa *d)
+{
+  if (d->chain_inputs.empty())
+    return "\"" + d->orig_input + "\"";
+
+  string s;
+  for (unsigned i = 0; i < d->chain_inputs.size(); i++)
+    s += (i ? ", \"" : "\"") + d->chain_inputs[i] + "\"";
+  return s;
+}
+
+#define DFA_CACHE_MAGIC "STAPDFA1"
+
+string
+stapdfa::cache_path (systemtap_session *s, const string& kind,
+                     const vector<string>& res) const
+{
+  if (!s)
+    return "";
+  string hash = find_regex_hash (*s, kind, res);
+  return get_build_id_cache_path (*s, "regex", hash, ".dfa");
+}
+
+// The cache file is a line with the magic string, the dfa's sizes and
+// the length of its code, then the code and its tag-saving epilogue as
+// emitted at indentation level 0.
+bool
+stapdfa::load_cache (systemtap_session *s, const string& path)
+{
+  if (path.empty() || s->poison_cache)
+    return false;
+
+  ifstream f (path.c_str(), ios::in | ios::binary);
+  if (!f)
+    return false;
+
+  string magic;
+  size_t len;
+  f >> magic >> nstates >> nmapitems >> ntags >> len;
+  if (!f || magic != DFA_CACHE_MAGIC || f.get() != '\n')
+    goto bad;
+
+  body.resize (len);
+  f.read (&body[0], len);
+  if (!f)
+    goto bad;
+  tagsave.assign (istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+
+  touch_cache_index_entry (*s, path);
+  if (s->verbose > 2)
+    clog << _F("Using cached DFA for %s from %s",
+               quoted_inputs(this).c_str(), path.c_str()) << endl;
+  return true;
+
+bad:
+  if (s->verbose > 1)
+    clog << _F("Ignoring corrupt regex cache file %s", path.c_str()) << endl;
+  body.clear ();
+  return false;
+}
+
+// Render the freshly compiled dfa, and save it if there's a cache.
+void
+stapdfa::finish (systemtap_session *s, const string& path)
+{
+  nstates = content->nstates;
+  nmapitems = content->nmapitems;
+  ntags = content->ntags;
+
+  ostringstream code, save;
+  translator_output o(code);
+  content->emit(&o);
+  body = code.str();
+  if (do_tag)
+    {
+      translator_output t(save);
+      content->emit_tagsave(&t, "c->last_match.tag_states", "c->last_match.tag_vals", "c->last_match.num_final_tags");
+      tagsave = save.str();
+    }
+
+  if (!path.empty())
+    {
+      ostringstream data;
+      data << DFA_CACHE_MAGIC << " " << nstates << " " << nmapitems
+           << " " << ntags << " " << body.size() << "\n" << body << tagsave;
+      add_data_to_cache (*s, path, data.str());
+    }
+}
+
 stapdfa::stapdfa (const string& func_name, const string& re,
-                  const token *tok, bool do_unescape, bool do_tag)
-  : func_name(func_name), orig_input(re), tok(tok), do_tag(do_tag)
+                  const token *tok, bool do_unescape, bool do_tag,
+                  systemtap_session *s)
+  : func_name(func_name), orig_input(re), tok(tok), content(NULL),
+    do_tag(do_tag), nstates(0), nmapitems(0), ntags(0)
 {
   try
     {
       regex_parser p(re, do_unescape);
-      ast = p.parse (do_tag);
-      content = stapregex_compile (ast, "goto match_success;", "goto match_fail;");
+      asts.push_back(p.parse (do_tag));
+      prefilter = required_literal (asts[0]);
+
+      string kind = string("single") + (do_tag ? " tagged" : "")
+                    + (do_unescape ? " unescaped" : "");
+      string path = cache_path (s, kind, vector<string>(1, re));
+      if (load_cache (s, path))
+        return;
+
+      content = stapregex_compile (asts[0], "goto match_success;", "goto match_fail;");
+      finish (s, path);
+    }
+  catch (const regex_error &e)
+    {
+      if (e.pos >= 0)
+        throw SEMANTIC_ERROR(_F("regex compilation error (at position %d): %s",
+                                e.pos, e.what()), tok);
+      else
+        throw SEMANTIC_ERROR(_F("regex compilation error: %s", e.what()), tok);
+    }
+}
+
+stapdfa::stapdfa (const string& func_name, const vector<string>& res,
+                  const token *tok, systemtap_session *s)
+  : func_name(func_name), chain_inputs(res), tok(tok), content(NULL),
+    do_tag(false), nstates(0), nmapitems(0), ntags(0)
+{
+  try
+    {
+      vector<string> snippets;
+      for (unsigned i = 0; i < res.size(); i++)
+        {
+          regex_parser p(res[i], true);
+          asts.push_back(p.parse (false));
+          snippets.push_back("return " + lex_cast(i + 1) + ";");
+        }
+
+      string path = cache_path (s, "chain", res);
+      if (load_cache (s, path))
+        return;
+
+      content = stapregex_compile (asts, snippets, "return 0;");
+      finish (s, path);
     }
   catch (const regex_error &e)
     {
@@ -78,31 +280,46 @@ stapdfa::stapdfa (const string& func_name, const string& re,
 stapdfa::~stapdfa ()
 {
   delete content;
-  delete ast;
+  for (unsigned i = 0; i < asts.size(); i++)
+    delete asts[i];
 }
 
 unsigned
 stapdfa::num_states () const
 {
-  return content->nstates;
+  return nstates;
 }
 
 unsigned
 stapdfa::num_map_items () const
 {
-  return content->nmapitems;
+  return nmapitems;
 }
 
 unsigned
 stapdfa::num_tags () const
 {
-  return content->ntags;
+  return ntags;
+}
+
+// Re-indent code rendered at level 0 to o's current level:
+static void
+emit_code (translator_output *o, const string& code)
+{
+  size_t pos = 0, nl;
+  while ((nl = code.find('\n', pos)) != string::npos)
+    {
+      o->line() << code.substr(pos, nl - pos);
+      o->newline();
+      pos = nl + 1;
+    }
+  o->line() << code.substr(pos);
 }
 
 void
 stapdfa::emit_declaration (translator_output *o) const
 {
-  o->newline() << "// DFA for \"" << orig_input << "\"";
+  o->newline() << "// DFA for " << quoted_inputs(this);
   o->newline() << "int " << func_name << " (struct context * __restrict__ c, const char *str) {";
   o->indent(1);
   
@@ -116,6 +333,18 @@ stapdfa::emit_declaration (translator_output *o) const
   o->newline() << "const char *start = cur;";
   o->newline() << "const char *mar;";
 
+  // Strings without the pattern's literal part can't match.  In user
+  // space, the C library finds a substring (with SIMD, where it can)
+  // far faster than the dfa can step through the string.
+  if (!prefilter.empty())
+    {
+      o->newline() << "#ifdef __DYNINST__";
+      o->newline() << "if (strstr (str, " << lex_cast_qstring(prefilter)
+                   << ") == NULL)";
+      o->newline(1) << "goto match_fail;";
+      o->newline(-1) << "#endif";
+    }
+
   if (do_tag)
     {
       o->newline() << "#define YYTAG(t,s) (c->last_match.tag_states[(t)][(s)])";
@@ -130,18 +359,7 @@ stapdfa::emit_declaration (translator_output *o) const
   // XXX: YYFILL is disabled as it doesn't play well with ^
   o->newline();
 
-  try
-    {
-      content->emit(o);
-    }
-  catch (const regex_error &e)
-    {
-      if (e.pos >= 0)
-        throw SEMANTIC_ERROR(_F("regex compilation error (at position %d): %s",
-                                e.pos, e.what()), tok);
-      else
-        throw SEMANTIC_ERROR(_F("regex compilation error: %s", e.what()), tok);
-    }
+  emit_code (o, body);
 
   if (do_tag)
     {
@@ -155,12 +373,20 @@ stapdfa::emit_declaration (translator_output *o) const
   o->newline() << "#undef YYLIMIT";
   o->newline() << "#undef YYMARKER";
 
+  // A chain's dfa returns its outcome directly:
+  if (!chain_inputs.empty())
+    {
+      o->newline() << "return 0;";
+      o->newline(-1) << "}";
+      return;
+    }
+
   o->newline() << "match_success:";
   if (do_tag)
     {
       o->newline() << "strlcpy (c->last_match.matched_str, str, MAXSTRINGLEN);";
       o->newline() << "c->last_match.result = 1;";
-      content->emit_tagsave(o, "c->last_match.tag_states", "c->last_match.tag_vals", "c->last_match.num_final_tags");
+      emit_code (o, tagsave);
     }
   o->newline() << "return 1;";
 
@@ -196,8 +422,11 @@ stapdfa::print (std::ostream& o) const
 void
 stapdfa::print (translator_output *o) const
 {
-  o->line() << "STAPDFA (" << func_name << ", \"" << orig_input << "\") {";
-  content->print(o);
+  o->line() << "STAPDFA (" << func_name << ", " << quoted_inputs(this) << ") {";
+  if (content)
+    content->print(o);
+  else
+    o->newline(1) << "(cached)";
   o->newline(-1) << "}";
 }
 
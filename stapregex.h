@@ -16,11 +16,14 @@
 
 #include <string>
 #include <iostream>
+#include <vector>
 
 #include "stapregex-defines.h"
 
 struct systemtap_session; /* from session.h */
 struct token; /* from parse.h */
+struct if_statement; /* from staptree.h */
+struct regex_query; /* from staptree.h */
 class translator_output; /* from translator-output.h */
 
 namespace stapregex {
@@ -31,10 +34,19 @@ namespace stapregex {
 struct stapdfa {
   std::string func_name;
   std::string orig_input;
+  std::vector<std::string> chain_inputs; // -- when matching several at once
+  std::string prefilter; // -- a literal that every match contains
   const token *tok;
 
+  /* With a session, the emitted code is cached in its cache directory
+     (under regex/), since building big dfas takes a while: */
   stapdfa (const std::string& func_name, const std::string& re,
-           const token *tok = NULL, bool do_unescape = true, bool do_tag = true);
+           const token *tok = NULL, bool do_unescape = true, bool do_tag = true,
+           systemtap_session *s = NULL);
+  /* A dfa for a chain of patterns, which returns the (1-based) index of
+     the first one that matches, or 0 if none does: */
+  stapdfa (const std::string& func_name, const std::vector<std::string>& res,
+           const token *tok = NULL, systemtap_session *s = NULL);
   ~stapdfa ();
   unsigned num_states() const;
   unsigned num_map_items() const;
@@ -47,9 +59,18 @@ struct stapdfa {
   void print(translator_output *o) const;
   void print(std::ostream& o) const;
 private:
-  stapregex::regexp *ast;
-  stapregex::dfa *content;
+  std::vector<stapregex::regexp *> asts;
+  stapregex::dfa *content; // -- NULL if the code came from the cache
   bool do_tag;
+
+  // The code emitted for content, with its sizes:
+  std::string body, tagsave;
+  unsigned nstates, nmapitems, ntags;
+
+  std::string cache_path (systemtap_session *s, const std::string& kind,
+                          const std::vector<std::string>& res) const;
+  bool load_cache (systemtap_session *s, const std::string& path);
+  void finish (systemtap_session *s, const std::string& path);
 };
 
 std::ostream& operator << (std::ostream &o, const stapdfa& d);
@@ -58,6 +79,16 @@ std::ostream& operator << (std::ostream &o, const stapdfa& d);
    retrieves the corresponding dfa from s->dfas if already there: */
 stapdfa *regex_to_stapdfa (systemtap_session *s, const std::string& input, const token* tok);
 
+/* If s heads a chain of if/else-if statements testing the same variable
+   against several patterns with =~, collects their conditions in order: */
+bool regex_chain (if_statement *s, std::vector<regex_query *>& chain);
+
+/* Likewise for a dfa that matches all of a chain's patterns in one scan;
+   NULL if that would take too many more states than matching them one
+   at a time: */
+stapdfa *regex_chain_to_stapdfa (systemtap_session *s,
+                                 const std::vector<regex_query *>& chain);
+
 #endif
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
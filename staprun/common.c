@@ -35,6 +35,7 @@ char *outfile_name;
 int rename_mod;
 int attach_mod;
 int delete_mod;
+int query_mod;
 int load_only;
 int need_uprobes;
 const char *uprobes_path = NULL;
@@ -49,6 +50,12 @@ int color_errors;
 color_modes color_mode;
 int monitor;
 int monitor_interval;
+int relay_mmap;
+int reader_pool;
+int compress_output;
+int snapshot_secs;
+char *hwtrace_name;
+char *handoff_name;
 
 /* module variables */
 char *modname = NULL;
@@ -121,6 +128,7 @@ void parse_args(int argc, char **argv)
 	rename_mod = 0;
 	attach_mod = 0;
 	delete_mod = 0;
+	query_mod = 0;
         read_stdin = 0;
 	load_only = 0;
 	need_uprobes = 0;
@@ -129,6 +137,11 @@ void parse_args(int argc, char **argv)
 	fnum_max = 0;
 	monitor = 0;
         monitor_interval = 1;
+        relay_mmap = 0;
+        reader_pool = 0;
+        compress_output = 0;
+        snapshot_secs = 0;
+        handoff_name = NULL;
         remote_id = -1;
         remote_uri = NULL;
         relay_basedir_fd = -1;
@@ -136,7 +149,7 @@ void parse_args(int argc, char **argv)
         color_errors = isatty(STDERR_FILENO)
                 && strcmp(getenv("TERM") ?: "notdumb", "dumb");
 
-	while ((c = getopt(argc, argv, "ALu::vihb:t:dc:o:x:N:S:DwRr:VT:C:M:"
+	while ((c = getopt(argc, argv, "ALu::vihb:t:dqc:o:x:N:S:DwRr:VT:C:M:mP:zs:H:O:"
 #ifdef HAVE_OPENAT
                            "F:"
 #endif
@@ -176,6 +189,10 @@ void parse_args(int argc, char **argv)
 			/* delete module */
 			delete_mod = 1;
 			break;
+		case 'q':
+			/* print the stats of a running module */
+			query_mod = 1;
+			break;
 		case 'c':
 			target_cmd = optarg;
 			break;
@@ -268,11 +285,51 @@ void parse_args(int argc, char **argv)
 				err(_("Invalid monitor interval\n"));
 			}
 			break;
+		case 'm':
+			relay_mmap = 1;
+			break;
+		case 'z':
+			compress_output = 1;
+			break;
+		case 's':
+			snapshot_secs = atoi(optarg);
+			if (snapshot_secs < 1) {
+				err(_("Invalid snapshot length '%s' (should be >= 1).\n"), optarg);
+				usage(argv[0],1);
+			}
+			break;
+		case 'H':
+			hwtrace_name = get_abspath(optarg);
+			if (hwtrace_name == NULL) {
+				err(_("File name is too long.\n"));
+				usage(argv[0],1);
+			}
+			hwtrace_name = strdup(hwtrace_name);
+			break;
+		case 'O':
+			handoff_name = optarg;
+			break;
+		case 'P':
+			reader_pool = atoi(optarg);
+			if (reader_pool < 1) {
+				err(_("Invalid number of reader threads '%s' (should be >= 1).\n"), optarg);
+				usage(argv[0],1);
+			}
+			break;
 		default:
 			usage(argv[0],1);
 		}
 	}
-	if (outfile_name) {
+	if (outfile_name && is_sink_uri(outfile_name)) {
+		if (fsize_max) {
+			err(_("You can't specify the '-S' option with an output URI.\n"));
+			usage(argv[0],1);
+		}
+		if (relay_mmap) {
+			err(_("You can't specify the '-m' option with an output URI.\n"));
+			usage(argv[0],1);
+		}
+	} else if (outfile_name) {
 		char tmp[PATH_MAX];
 		int ret;
 		outfile_name = get_abspath(outfile_name);
@@ -317,6 +374,17 @@ void parse_args(int argc, char **argv)
 		usage(argv[0],1);
 	}
 
+	if (query_mod && (attach_mod || load_only || delete_mod || daemon_mode
+			  || target_cmd || target_pid)) {
+		err(_("You can't specify the '-q' option with '-A', '-L', '-d', '-D', '-c' or '-x'.\n"));
+		usage(argv[0],1);
+	}
+
+	if (handoff_name && (attach_mod || load_only || delete_mod || query_mod)) {
+		err(_("You can't specify the '-O' option with '-A', '-L', '-d' or '-q'.\n"));
+		usage(argv[0],1);
+	}
+
 	if (daemon_mode && load_only) {
 		err(_("You can't specify the '-D' and '-L' options together.\n"));
 		usage(argv[0],1);
@@ -337,12 +405,48 @@ void parse_args(int argc, char **argv)
 		err(_("You have to specify output FILE with '-S' option.\n"));
 		usage(argv[0],1);
 	}
+	if (relay_mmap && fsize_max) {
+		err(_("You can't specify the '-m' and '-S' options together.\n"));
+		usage(argv[0],1);
+	}
+	if (relay_mmap && monitor) {
+		err(_("You can't specify the '-m' and '-M' options together.\n"));
+		usage(argv[0],1);
+	}
+	if (reader_pool && relay_mmap) {
+		err(_("You can't specify the '-P' and '-m' options together.\n"));
+		usage(argv[0],1);
+	}
+	if (reader_pool && monitor) {
+		err(_("You can't specify the '-P' and '-M' options together.\n"));
+		usage(argv[0],1);
+	}
+	if (compress_output && outfile_name == NULL) {
+		err(_("You have to specify output FILE with '-z' option.\n"));
+		usage(argv[0],1);
+	}
+	if (compress_output && (relay_mmap || monitor)) {
+		err(_("You can't specify the '-z' option with '-m' or '-M'.\n"));
+		usage(argv[0],1);
+	}
+	if (snapshot_secs && !attach_mod) {
+		err(_("You have to specify '-A' with '-s' option.\n"));
+		usage(argv[0],1);
+	}
+	if (snapshot_secs && (fsize_max || relay_mmap || reader_pool || monitor)) {
+		err(_("You can't specify the '-s' option with '-S', '-m', '-P' or '-M'.\n"));
+		usage(argv[0],1);
+	}
+	/* stapio has to know the buffer geometry to map it, so don't
+	   let the runtime pick its own size. */
+	if (relay_mmap && !buffer_size)
+		buffer_size = 16;
 }
 
 void usage(char *prog, int rc)
 {
-	printf(_("\n%s [-v] [-w] [-V] [-h] [-u] [-c cmd ] [-x pid] [-u user] [-A|-L|-d] [-C WHEN]\n"
-                "\t[-b bufsize] [-R] [-r N:URI] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
+	printf(_("\n%s [-v] [-w] [-V] [-h] [-u] [-c cmd ] [-x pid] [-u user] [-A [-s secs]|-L|-d|-q] [-O module] [-C WHEN]\n"
+                "\t[-b bufsize] [-m] [-P threads] [-z] [-R] [-r N:URI] [-o FILE [-D] [-S size[,N]]] MODULE [module-options]\n"), prog);
 	printf(_("-v              Increase verbosity.\n"
 	"-V              Print version number and exit.\n"
 	"-h              Print this help text and exit.\n"
@@ -354,7 +458,8 @@ void usage(char *prog, int rc)
 	"-x pid          Sets the '_stp_target' variable to pid.\n"
   "-N pid          Sets the '_stp_namespaces_pid' variable to pid.\n"
 	"-o FILE         Send output to FILE. This supports strftime(3)\n"
-	"                formats for FILE.\n"
+	"                formats for FILE.  To stream the output to a\n"
+	"                socket, use tcp://HOST:PORT or unix://PATH.\n"
 	"-b buffer size  The systemtap module specifies a buffer size.\n"
 	"                Setting one here will override that value.  The\n"
 	"                value should be an integer between 1 and 4095 \n"
@@ -362,6 +467,8 @@ void usage(char *prog, int rc)
 	"                That value will be per-cpu in bulk mode.\n"
 	"-L              Load module and start probes, then detach.\n"
 	"-A              Attach to loaded systemtap module.\n"
+	"-s secs         With -A, dump the last secs seconds of a flight\n"
+	"                recorder module's output, then detach.\n"
 	"-C WHEN         Enable colored errors. WHEN must be either 'auto',\n"
 	"                'never', or 'always'. Set to 'auto' by default.\n"
 #ifdef HAVE_MONITOR_LIBS                 
@@ -370,6 +477,9 @@ void usage(char *prog, int rc)
         "-d              Delete a module.  Only detached or unused modules\n"
 	"                the user has permission to access will be deleted. Use \"*\"\n"
 	"                (quoted) to delete all unused modules.\n"
+	"-q              Print the statistics of a running module: its\n"
+	"                error and skip counts, buffer overruns, probe\n"
+	"                handler runs and cycles, and array sizes.\n"
         "-R              Have staprun create a new name for the module before\n"
         "                inserting it. This allows the same module to be inserted\n"
         "                more than once.\n"
@@ -385,6 +495,19 @@ void usage(char *prog, int rc)
         "-T timeout      Specifies upper limit on amount of time reader thread\n"
         "                will wait for new full trace buffer. Value should be an\n"
         "                integer >= 1, which is timeout value in ms. Default 200ms.\n"
+        "-m              In bulk mode, map the trace buffers and write them out\n"
+        "                directly instead of read()ing them.  The buffer size\n"
+        "                defaults to 16MB per-cpu.\n"
+        "-P threads      In bulk mode, read all the trace buffers with the given\n"
+        "                number of threads, in large batches, instead of with\n"
+        "                one thread per cpu.\n"
+        "-z              Compress the output files with zstd.\n"
+        "-H FILE         Record the control flow of the -c/-x target with\n"
+        "                Intel PT or CoreSight into FILE, and its mappings\n"
+        "                into FILE.maps, for offline decoding.\n"
+        "-O module       Take over from the running module, copying its\n"
+        "                globals, once this one has started.  Both have\n"
+        "                to be built with stap --handoff.\n"
 #ifdef HAVE_OPENAT
         "-F fd           Specifies file descriptor for module relay directory\n"
 #endif
@@ -13,6 +13,7 @@
 #include "staprun.h"
 
 #define CTL_CHANNEL_NAME ".cmd"
+#define STATS_FILE_NAME "stats"
 
 
 #ifndef HAVE_OPENAT
@@ -20,6 +21,27 @@
 #endif
 
 
+// Open the running module's directory, first under debugfs, then under
+// procfs.  Return the fd, or -1.
+int open_module_dir(const char *name)
+{
+        char buf[PATH_MAX] = "";
+        struct statfs st;
+        int fd = -1;
+
+        if (sprintf_chk(buf, "/sys/kernel/debug/systemtap/%s", name))
+                return -1;
+        if (statfs("/sys/kernel/debug", &st) == 0 && (int)st.f_type == (int)DEBUGFS_MAGIC)
+                fd = open (buf, O_DIRECTORY | O_RDONLY);
+        if (fd >= 0)
+                return fd;
+
+        if (sprintf_chk(buf, "/proc/systemtap/%s", name))
+                return -1;
+        return open (buf, O_DIRECTORY | O_RDONLY);
+}
+
+
 // This function does multiple things:
 //
 // 1) if needed, open the running module's directory (the one that
@@ -41,27 +63,10 @@ int init_ctl_channel(const char *name, int verb)
         if (control_channel >= 0 && relay_basedir_fd >= 0)
                 return 0;
 
-        // Need relay_basedir_fd .... ok try /sys/kernel/debug/systemtap/
-        if (relay_basedir_fd < 0) {
-                char buf[PATH_MAX] = "";
-                struct statfs st;
-
-                if (sprintf_chk(buf, "/sys/kernel/debug/systemtap/%s", name))
-                        return -EINVAL;
-                
-                if (statfs("/sys/kernel/debug", &st) == 0 && (int)st.f_type == (int)DEBUGFS_MAGIC)
-                        relay_basedir_fd = open (buf, O_DIRECTORY | O_RDONLY);                        
-        }
-
-        // Still need relay_basedir_fd ... ok try /proc/systemtap/
-        if (relay_basedir_fd < 0) {
-                char buf[PATH_MAX] = "";
-
-                if (sprintf_chk(buf, "/proc/systemtap/%s", name))
-                        return -EINVAL;
-                
-                relay_basedir_fd = open (buf, O_DIRECTORY | O_RDONLY);                        
-        }
+        // Need relay_basedir_fd .... ok try /sys/kernel/debug/systemtap/,
+        // then /proc/systemtap/
+        if (relay_basedir_fd < 0)
+                relay_basedir_fd = open_module_dir(name);
 
         // Got relay_basedir_fd, need .ctl
         if (relay_basedir_fd >= 0) {
@@ -82,6 +87,46 @@ int init_ctl_channel(const char *name, int verb)
 	return 0;
 }
 
+// Print the running module's stats file, which the module keeps up
+// to date while it runs (see runtime/linux/session_stats.c).  Unlike
+// the control channel, this works with a stapio attached.  Return 0 on
+// success.
+int print_module_stats(const char *name)
+{
+        char buf[4096];
+        ssize_t n;
+        int dirfd, fd;
+
+        dirfd = open_module_dir(name);
+        if (dirfd < 0) {
+                err(_("Cannot find module %s; not running?\n"), name);
+                return 1;
+        }
+
+        // As for .cmd, the file has to be accessible to our real uid/gid.
+        if (faccessat(dirfd, STATS_FILE_NAME, R_OK, 0) != 0) {
+                err(_("Cannot read the stats of module %s: %s\n"), name,
+                    errno == ENOENT ? _("the module does not keep them")
+                                    : strerror(errno));
+                close(dirfd);
+                return 1;
+        }
+        fd = openat_cloexec(dirfd, STATS_FILE_NAME, O_RDONLY, 0);
+        close(dirfd);
+        if (fd < 0) {
+                perr(_("Cannot open the stats of module %s"), name);
+                return 1;
+        }
+
+        while ((n = read(fd, buf, sizeof(buf))) > 0)
+                if (fwrite(buf, 1, n, stdout) != (size_t) n)
+                        break;
+        if (n < 0)
+                perr(_("Cannot read the stats of module %s"), name);
+        close(fd);
+        return n < 0 || fflush(stdout) != 0;
+}
+
 void close_ctl_channel(void)
 {
 	if (control_channel >= 0) {
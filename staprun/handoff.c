@@ -0,0 +1,137 @@
+/* -*- linux-c -*-
+ *
+ * handoff.c - stapio taking over from a running module, for -O MODULE
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * Both modules are built with stap --handoff.  staprun loads the new
+ * one with __handoff_enabled=0, so that none of its probes run, not
+ * even begin.  Once it has started, we freeze the old module through
+ * its "handoff" procfs file, copy its globals over line by line from
+ * its "state" file to ours (see runtime/linux/handoff.c), thaw ours,
+ * and tell the old one to exit.  Events that come in while both are
+ * frozen are missed; that is as long as the copy takes.
+ */
+
+#include "staprun.h"
+
+#define HANDOFF_STATE_NAME "state"
+
+static int handoff_command(const char *name, const char *cmd)
+{
+	char path[PATH_MAX];
+	int fd, rc = 0;
+
+	if (sprintf_chk(path, "/proc/systemtap/%s/handoff", name))
+		return -1;
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0 || write(fd, cmd, strlen(cmd)) != (ssize_t) strlen(cmd)) {
+		err(_("Cannot %s module %s: %s\n"), cmd, name, strerror(errno));
+		rc = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+	return rc;
+}
+
+/* Copies the old module's globals to ours, warning once for each
+   global that we don't have, or can't take.  Returns 0 if the copy
+   could be made at all. */
+static int handoff_copy(const char *old)
+{
+	char **skipped = NULL;
+	unsigned nskipped = 0, lines = 0, i;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int dirfd, fd, out;
+	FILE *in;
+
+	dirfd = open_module_dir(old);
+	if (dirfd < 0) {
+		err(_("Cannot find module %s; not running?\n"), old);
+		return -1;
+	}
+	fd = openat_cloexec(dirfd, HANDOFF_STATE_NAME, O_RDONLY, 0);
+	close(dirfd);
+	if (fd < 0 || (in = fdopen(fd, "r")) == NULL) {
+		perr(_("Cannot read the globals of module %s"), old);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	out = openat_cloexec(relay_basedir_fd, HANDOFF_STATE_NAME, O_WRONLY, 0);
+	if (out < 0) {
+		perr(_("Cannot write the globals of module %s"), modname);
+		fclose(in);
+		return -1;
+	}
+
+	while ((len = getline(&line, &size, in)) > 0) {
+		char *name;
+		int e;
+
+		if (write(out, line, len) == len) {
+			lines++;
+			continue;
+		}
+		e = errno;
+		name = strndup(line, strcspn(line, " \n"));
+		for (i = 0; name && i < nskipped; i++)
+			if (strcmp(skipped[i], name) == 0)
+				break;
+		if (name == NULL || i < nskipped) {
+			free(name);
+			continue;
+		}
+		skipped = realloc(skipped, (nskipped + 1) * sizeof(*skipped));
+		if (skipped == NULL) {
+			free(name);
+			nskipped = 0;
+			continue;
+		}
+		skipped[nskipped++] = name;
+		if (strncmp(name, "__global_", 9) == 0)
+			name += 9;
+		warn(_("Global %s of module %s not carried over: %s\n"), name,
+		     old, e == ENOENT ? _("no such global here")
+		     : e == EINVAL ? _("it has another type here")
+		     : e == EOPNOTSUPP ? _("statistics are not carried over")
+		     : e == ENOSPC ? _("the array is full") : strerror(e));
+	}
+	dbug(1, "carried over %u values from module %s\n", lines, old);
+
+	for (i = 0; i < nskipped; i++)
+		free(skipped[i]);
+	free(skipped);
+	free(line);
+	fclose(in);
+	close(out);
+	return 0;
+}
+
+/**
+ *	handoff_from - take over from the running module @old
+ *
+ *	Called once our module has started, with its probes still held
+ *	off.  On failure the old module is left running, and we should
+ *	exit.
+ */
+int handoff_from(const char *old)
+{
+	if (handoff_command(old, "freeze") != 0)
+		return -1;
+	if (handoff_copy(old) != 0 || handoff_command(modname, "thaw") != 0) {
+		handoff_command(old, "thaw");
+		return -1;
+	}
+	/* A stapio attached to the old module removes it; a detached one
+	   stays, stopped, until staprun -d. */
+	handoff_command(old, "exit");
+	return 0;
+}
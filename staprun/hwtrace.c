@@ -0,0 +1,255 @@
+/* -*- linux-c -*-
+ *
+ * hwtrace.c - stapio processor trace of the target process, for -H FILE
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2024 Red Hat Inc.
+ *
+ * Rather than single-stepping the target as process.insn probes do,
+ * this has the processor record its control flow: Intel PT on x86,
+ * CoreSight ETM on arm.  stapio opens the trace PMU as a perf event on
+ * the target, and a thread copies the AUX buffer to FILE as it fills.
+ * The mappings the target makes, from the perf sideband, go to
+ * FILE.maps as "START-END PGOFF PATH" lines.  Together they let a
+ * decoder such as libipt's ptxed, or perf's own, rebuild the
+ * instruction flow offline from the same binaries.
+ */
+
+#include "staprun.h"
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Pages of sideband records, and of trace: both powers of two. */
+#define HWTRACE_DATA_PAGES 64
+#define HWTRACE_AUX_PAGES 1024
+
+static int hw_fd = -1;
+static FILE *hw_out, *hw_maps;
+static char *hw_base, *hw_aux;
+static size_t hw_base_len, hw_aux_len;
+static unsigned long long hw_bytes, hw_lost;
+static pthread_t hw_thread;
+static volatile int hw_stop;
+
+/**
+ *	hwtrace_pmu - find the processor trace PMU
+ *
+ *	Returns its perf event type, or -1.
+ */
+static int hwtrace_pmu(const char **name)
+{
+	static const char *pmus[] = { "intel_pt", "cs_etm" };
+	unsigned i;
+
+	for (i = 0; i < sizeof(pmus) / sizeof(pmus[0]); i++) {
+		char path[PATH_MAX];
+		FILE *f;
+		int type;
+
+		snprintf(path, sizeof(path),
+			 "/sys/bus/event_source/devices/%s/type", pmus[i]);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if (fscanf(f, "%d", &type) != 1)
+			type = -1;
+		fclose(f);
+		if (type >= 0) {
+			*name = pmus[i];
+			return type;
+		}
+	}
+	return -1;
+}
+
+/* Copies out the trace, and the mappings from the sideband records. */
+static void hwtrace_drain(void)
+{
+	struct perf_event_mmap_page *pc = (struct perf_event_mmap_page *)hw_base;
+	char *data = hw_base + pc->data_offset;
+	uint64_t size = pc->data_size;
+	uint64_t head, tail;
+
+	head = __atomic_load_n(&pc->aux_head, __ATOMIC_ACQUIRE);
+	tail = pc->aux_tail;
+	while (tail < head) {
+		size_t off = tail & (hw_aux_len - 1);
+		size_t n = head - tail;
+
+		if (n > hw_aux_len - off)
+			n = hw_aux_len - off;
+		if (fwrite(hw_aux + off, 1, n, hw_out) != n)
+			break;
+		tail += n;
+		hw_bytes += n;
+	}
+	__atomic_store_n(&pc->aux_tail, tail, __ATOMIC_RELEASE);
+
+	head = __atomic_load_n(&pc->data_head, __ATOMIC_ACQUIRE);
+	tail = pc->data_tail;
+	while (tail < head) {
+		union {
+			struct perf_event_header h;
+			char bytes[PATH_MAX + 128];
+		} rec;
+		size_t off = tail & (size - 1);
+		size_t len, first;
+
+		memcpy(&rec.h, data + off, sizeof(rec.h));
+		len = rec.h.size;
+		if (len < sizeof(rec.h) || len > sizeof(rec))
+			break;
+		first = size - off < len ? size - off : len;
+		memcpy(rec.bytes, data + off, first);
+		memcpy(rec.bytes + first, data, len - first);
+		tail += len;
+
+		if (rec.h.type == PERF_RECORD_MMAP2) {
+			/* pid, tid, addr, len, pgoff, 24 bytes of device
+			   and inode, prot, flags, filename */
+			uint64_t *v = (uint64_t *)(rec.bytes + 16);
+			const char *file = rec.bytes + 16 + 3 * 8 + 24 + 8;
+
+			fprintf(hw_maps, "%llx-%llx %llx %.*s\n",
+				(unsigned long long)v[0],
+				(unsigned long long)(v[0] + v[1]),
+				(unsigned long long)v[2],
+				(int)(rec.bytes + len - file), file);
+		} else if (rec.h.type == PERF_RECORD_AUX) {
+			/* aux_offset, aux_size, flags */
+			uint64_t *v = (uint64_t *)(rec.bytes + sizeof(rec.h));
+
+			if (v[2] & PERF_AUX_FLAG_TRUNCATED)
+				hw_lost++;
+		}
+	}
+	__atomic_store_n(&pc->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void *hwtrace_thread(void *arg)
+{
+	struct pollfd pfd = { .fd = hw_fd, .events = POLLIN };
+
+	(void)arg;
+	while (!hw_stop) {
+		poll(&pfd, 1, 100);
+		hwtrace_drain();
+	}
+	return NULL;
+}
+
+/**
+ *	hwtrace_start - start tracing the target process into @name
+ *	@pid: the target
+ *	@on_exec: whether the target is yet to exec its command, and
+ *	should only be traced from then on
+ *
+ *	Failures are only warned about: the script runs on without.
+ */
+void hwtrace_start(int pid, const char *name, int on_exec)
+{
+	struct perf_event_attr attr;
+	struct perf_event_mmap_page *pc;
+	const char *pmu = NULL;
+	long page = sysconf(_SC_PAGESIZE);
+	char *maps_name;
+	int type = hwtrace_pmu(&pmu);
+
+	if (type < 0) {
+		warn(_("No Intel PT or CoreSight trace PMU, -H %s ignored.\n"),
+		     name);
+		return;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.mmap = 1;
+	attr.mmap2 = 1;
+	attr.disabled = on_exec;
+	attr.enable_on_exec = on_exec;
+	hw_fd = syscall(__NR_perf_event_open, &attr, pid, -1, -1,
+			PERF_FLAG_FD_CLOEXEC);
+	if (hw_fd < 0) {
+		warn(_("Couldn't open %s event on pid %d: %s\n"), pmu, pid,
+		     strerror(errno));
+		return;
+	}
+
+	hw_base_len = (1 + HWTRACE_DATA_PAGES) * page;
+	hw_base = mmap(NULL, hw_base_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       hw_fd, 0);
+	if (hw_base == MAP_FAILED)
+		goto fail;
+	pc = (struct perf_event_mmap_page *)hw_base;
+	hw_aux_len = HWTRACE_AUX_PAGES * page;
+	pc->aux_offset = hw_base_len;
+	pc->aux_size = hw_aux_len;
+	hw_aux = mmap(NULL, hw_aux_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      hw_fd, pc->aux_offset);
+	if (hw_aux == MAP_FAILED)
+		goto fail;
+
+	hw_out = fopen(name, "w");
+	if (asprintf(&maps_name, "%s.maps", name) < 0)
+		maps_name = NULL;
+	hw_maps = maps_name ? fopen(maps_name, "w") : NULL;
+	free(maps_name);
+	if (hw_out == NULL || hw_maps == NULL)
+		goto fail;
+
+	if (pthread_create(&hw_thread, NULL, hwtrace_thread, NULL) != 0)
+		goto fail;
+	dbug(1, "tracing pid %d with %s into %s\n", pid, pmu, name);
+	return;
+
+fail:
+	warn(_("Couldn't set up the %s trace into %s: %s\n"), pmu, name,
+	     strerror(errno));
+	if (hw_out)
+		fclose(hw_out);
+	if (hw_maps)
+		fclose(hw_maps);
+	hw_out = hw_maps = NULL;
+	if (hw_aux && hw_aux != MAP_FAILED)
+		munmap(hw_aux, hw_aux_len);
+	if (hw_base && hw_base != MAP_FAILED)
+		munmap(hw_base, hw_base_len);
+	hw_aux = hw_base = NULL;
+	close(hw_fd);
+	hw_fd = -1;
+}
+
+/**
+ *	hwtrace_stop - stop the trace and write out what is left
+ */
+void hwtrace_stop(void)
+{
+	if (hw_out == NULL)
+		return;
+
+	hw_stop = 1;
+	pthread_join(hw_thread, NULL);
+	ioctl(hw_fd, PERF_EVENT_IOC_DISABLE, 0);
+	hwtrace_drain();
+	if (hw_lost)
+		warn(_("The processor trace lost data %llu times; "
+		       "the target ran ahead of stapio.\n"), hw_lost);
+	dbug(1, "wrote %llu bytes of processor trace\n", hw_bytes);
+
+	fclose(hw_out);
+	fclose(hw_maps);
+	hw_out = hw_maps = NULL;
+	munmap(hw_aux, hw_aux_len);
+	munmap(hw_base, hw_base_len);
+	close(hw_fd);
+	hw_fd = -1;
+}
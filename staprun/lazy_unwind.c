@@ -0,0 +1,211 @@
+/* -*- linux-c -*-
+ *
+ * lazy_unwind.c - stapio side of stap --lazy-unwind
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2024 Red Hat Inc.
+ */
+
+#include "staprun.h"
+#include <elf.h>
+
+/* Where the sections the module asks for are in the file. */
+struct lazy_sections {
+	off_t eh_frame_off, unwind_hdr_off;
+	size_t eh_frame_len, unwind_hdr_len;
+	unsigned char build_id[STP_LAZY_BUILD_ID_LEN];
+	size_t build_id_len;
+};
+
+static int read_at(int fd, void *buf, size_t len, off_t off)
+{
+	return pread(fd, buf, len, off) == (ssize_t) len ? 0 : -1;
+}
+
+/* Pick the GNU build-id out of a SHT_NOTE section. */
+static void find_build_id(int fd, off_t off, size_t size,
+			  struct lazy_sections *ls)
+{
+	unsigned char *notes, *p;
+
+	if (size == 0 || size > 4096 || (notes = malloc(size)) == NULL)
+		return;
+	if (read_at(fd, notes, size, off) == 0) {
+		for (p = notes; p + sizeof(Elf64_Nhdr) <= notes + size; ) {
+			/* Elf32_Nhdr and Elf64_Nhdr are the same. */
+			Elf64_Nhdr nh;
+			size_t name = (size_t) (p - notes) + sizeof(nh);
+			size_t desc, next;
+
+			memcpy(&nh, p, sizeof(nh));
+			desc = name + ((nh.n_namesz + 3) & ~3u);
+			next = desc + ((nh.n_descsz + 3) & ~3u);
+			if (next > size)
+				break;
+			if (nh.n_type == NT_GNU_BUILD_ID && nh.n_namesz == 4
+			    && memcmp(notes + name, "GNU", 4) == 0
+			    && nh.n_descsz <= sizeof(ls->build_id)) {
+				memcpy(ls->build_id, notes + desc, nh.n_descsz);
+				ls->build_id_len = nh.n_descsz;
+				break;
+			}
+			p = notes + next;
+		}
+	}
+	free(notes);
+}
+
+/* Find .eh_frame, .eh_frame_hdr and the build-id of an ELF file of
+   either class, in the host's byte order.  */
+static int find_sections(int fd, struct lazy_sections *ls)
+{
+	unsigned char ident[EI_NIDENT];
+	uint64_t shoff, str_off = 0, str_size = 0;
+	unsigned shnum, shentsize, shstrndx, i;
+	char *strtab = NULL;
+	int is64, rc = -1;
+
+	if (read_at(fd, ident, sizeof(ident), 0) != 0
+	    || memcmp(ident, ELFMAG, SELFMAG) != 0)
+		return -1;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	if (ident[EI_DATA] != ELFDATA2LSB)
+		return -1;
+#else
+	if (ident[EI_DATA] != ELFDATA2MSB)
+		return -1;
+#endif
+	is64 = (ident[EI_CLASS] == ELFCLASS64);
+	if (is64) {
+		Elf64_Ehdr eh;
+		if (read_at(fd, &eh, sizeof(eh), 0) != 0)
+			return -1;
+		shoff = eh.e_shoff;
+		shnum = eh.e_shnum;
+		shentsize = eh.e_shentsize;
+		shstrndx = eh.e_shstrndx;
+	} else {
+		Elf32_Ehdr eh;
+		if (read_at(fd, &eh, sizeof(eh), 0) != 0)
+			return -1;
+		shoff = eh.e_shoff;
+		shnum = eh.e_shnum;
+		shentsize = eh.e_shentsize;
+		shstrndx = eh.e_shstrndx;
+	}
+	if (shentsize != (is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr))
+	    || shstrndx >= shnum)
+		return -1;
+
+	/* Two passes: the section names, then the sections. */
+	for (int pass = 0; pass < 2; pass++) {
+		for (i = (pass ? 0 : shstrndx); i < (pass ? shnum : shstrndx + 1); i++) {
+			uint64_t name, type, off, size;
+			const char *sname;
+
+			if (is64) {
+				Elf64_Shdr sh;
+				if (read_at(fd, &sh, sizeof(sh), shoff + i * sizeof(sh)) != 0)
+					goto out;
+				name = sh.sh_name; type = sh.sh_type;
+				off = sh.sh_offset; size = sh.sh_size;
+			} else {
+				Elf32_Shdr sh;
+				if (read_at(fd, &sh, sizeof(sh), shoff + i * sizeof(sh)) != 0)
+					goto out;
+				name = sh.sh_name; type = sh.sh_type;
+				off = sh.sh_offset; size = sh.sh_size;
+			}
+			if (!pass) {
+				str_off = off;
+				str_size = size;
+				continue;
+			}
+			if (strtab == NULL) {
+				if (str_size == 0 || (strtab = malloc(str_size + 1)) == NULL
+				    || read_at(fd, strtab, str_size, str_off) != 0)
+					goto out;
+				strtab[str_size] = '\0';
+			}
+			if (name >= str_size || type == SHT_NOBITS)
+				continue;
+			sname = strtab + name;
+			if (strcmp(sname, ".eh_frame") == 0) {
+				ls->eh_frame_off = off;
+				ls->eh_frame_len = size;
+			} else if (strcmp(sname, ".eh_frame_hdr") == 0) {
+				ls->unwind_hdr_off = off;
+				ls->unwind_hdr_len = size;
+			} else if (type == SHT_NOTE && ls->build_id_len == 0)
+				find_build_id(fd, off, size, ls);
+		}
+	}
+	rc = ls->eh_frame_len ? 0 : -1;
+out:
+	free(strtab);
+	return rc;
+}
+
+/* Answer a module's STP_LAZY_UNWIND request with the unwind data of
+   the file.  Failures only cost the backtraces through it, so they
+   are just noted.  */
+void send_lazy_unwind(struct _stp_msg_lazy_unwind *req)
+{
+	struct lazy_sections ls;
+	struct _stp_msg_lazy_unwind_data reply;
+	uint32_t type = STP_LAZY_UNWIND;
+	char *buf = NULL, *p;
+	size_t len;
+	int fd;
+
+	req->path[sizeof(req->path) - 1] = '\0';
+	memset(&ls, 0, sizeof(ls));
+	fd = open_cloexec(req->path, O_RDONLY, 0);
+	if (fd < 0) {
+		dbug(1, "lazy unwind: can't open %s: %s\n", req->path, strerror(errno));
+		return;
+	}
+	if (find_sections(fd, &ls) != 0) {
+		dbug(1, "lazy unwind: no .eh_frame in %s\n", req->path);
+		goto out;
+	}
+	if (req->build_id_len
+	    && (req->build_id_len != ls.build_id_len
+		|| memcmp(req->build_id, ls.build_id, ls.build_id_len) != 0)) {
+		if (!suppress_warnings)
+			warn(_("%s has changed since it was translated, its user backtraces will be incomplete\n"),
+			     req->path);
+		goto out;
+	}
+	if (ls.eh_frame_len > UINT32_MAX || ls.unwind_hdr_len > UINT32_MAX)
+		goto out;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.index = req->index;
+	reply.eh_frame_len = ls.eh_frame_len;
+	reply.unwind_hdr_len = ls.unwind_hdr_len;
+	len = sizeof(type) + sizeof(reply) + ls.eh_frame_len + ls.unwind_hdr_len;
+	if ((buf = malloc(len)) == NULL)
+		goto out;
+	p = buf;
+	memcpy(p, &type, sizeof(type));
+	p += sizeof(type);
+	memcpy(p, &reply, sizeof(reply));
+	p += sizeof(reply);
+	if (read_at(fd, p, ls.eh_frame_len, ls.eh_frame_off) != 0
+	    || read_at(fd, p + ls.eh_frame_len, ls.unwind_hdr_len,
+		       ls.unwind_hdr_off) != 0)
+		goto out;
+
+	dbug(2, "lazy unwind: sending %zu+%zu bytes for %s\n",
+	     ls.eh_frame_len, ls.unwind_hdr_len, req->path);
+	if (write(control_channel, buf, len) < 0)
+		dbug(1, "lazy unwind: write: %s\n", strerror(errno));
+out:
+	free(buf);
+	close(fd);
+}
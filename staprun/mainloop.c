@@ -24,6 +24,7 @@
 /* globals */
 int ncpus;
 static int pending_interrupts = 0;
+static volatile int pending_probe_stats = 0;
 static int target_pid_failed_p = 0;
 
 /* Setup by setup_main_signals, used by signal_thread to notify the
@@ -94,6 +95,9 @@ static void *signal_thread(void *arg)
                || signum == SIGPIPE)
     {
       pending_interrupts ++;
+    } else if (signum == SIGUSR1) {
+      pending_probe_stats = 1;
+      pthread_kill (main_thread, SIGURG);
     }
     if (pending_interrupts > 2) {
       set_nonblocking_std_fds();
@@ -195,6 +199,7 @@ static void setup_main_signals(void)
   sigaddset(s, SIGHUP);
   sigaddset(s, SIGQUIT);
   sigaddset(s, SIGPIPE);
+  sigaddset(s, SIGUSR1);
   pthread_sigmask(SIG_SETMASK, s, NULL);
   if (pthread_create(&tid, NULL, signal_thread, s) < 0) {
     _perr(_("failed to create thread"));
@@ -278,6 +283,10 @@ int init_stapio(void)
             close_ctl_channel();
             return -1;
     }
+    /* -s: the snapshot has been written; detach, and leave the
+       module to go back to overwriting its buffers. */
+    if (snapshot_secs)
+            cleanup_and_exit(1 /* = detach */, 0);
     return 0;
   }
 
@@ -361,6 +370,8 @@ void cleanup_and_exit(int detach, int rc)
      for another reason.  So, we no longer   while(...wait()...);  here.
    */
 
+  hwtrace_stop();
+
   if (pending_interrupts > 2)
     kill_relayfs();
   else
@@ -438,6 +449,77 @@ void cleanup_and_exit(int detach, int rc)
  *	stp_main_loop - loop forever reading data
  */
 
+/* Whether the module accepted STP_CTL_BATCH, and the rest of the last
+   batch read from the control channel.  */
+static int ctl_batch;
+static char ctl_batch_buf[65536];
+static size_t ctl_batch_len, ctl_batch_off;
+
+/* Read the next control message into buf, as read() would.  In batch
+   mode, refill ctl_batch_buf only once the messages already in it have
+   been handed out.  */
+static ssize_t read_ctl_msg(void *buf, size_t size, int flags)
+{
+  ssize_t nb;
+  uint32_t len;
+
+  if (ctl_batch_off >= ctl_batch_len) {
+    fcntl(control_channel, F_SETFL, flags | O_NONBLOCK);
+    if (ctl_batch)
+      nb = read(control_channel, ctl_batch_buf, sizeof(ctl_batch_buf));
+    else
+      nb = read(control_channel, buf, size);
+    fcntl(control_channel, F_SETFL, flags);
+    if (!ctl_batch || nb <= 0)
+      return nb;
+    ctl_batch_len = nb;
+    ctl_batch_off = 0;
+  }
+
+  if (ctl_batch_len - ctl_batch_off < sizeof(len))
+    goto bad;
+  memcpy(&len, ctl_batch_buf + ctl_batch_off, sizeof(len));
+  ctl_batch_off += sizeof(len);
+  if (len > size || len > ctl_batch_len - ctl_batch_off)
+    goto bad;
+  memcpy(buf, ctl_batch_buf + ctl_batch_off, len);
+  ctl_batch_off += len;
+  return len;
+
+bad:
+  ctl_batch_off = ctl_batch_len;
+  errno = EPROTO;
+  return -1;
+}
+
+
+/* Prints the module's answer to SIGUSR1: the probes that took the most
+   cycles, then the totals. */
+static void print_probe_stats(const struct _stp_msg_probe_stats *ps)
+{
+  static int listed = 0;
+
+  if (ps->index >= 0) {
+    if (listed++ == 0)
+      eprintf("%14s %12s %10s  %s\n", "cycles", "runs", "cycles/run",
+              "probe");
+    eprintf("%14llu %12llu %10llu  %.*s\n",
+            (unsigned long long) ps->cycles, (unsigned long long) ps->runs,
+            (unsigned long long) (ps->runs ? ps->cycles / ps->runs : 0),
+            (int) sizeof(ps->pp), ps->pp);
+    return;
+  }
+
+  listed = 0;
+  if (ps->enabled)
+    eprintf(_("%llu cycles in %llu runs of %u probes\n"),
+            (unsigned long long) ps->cycles, (unsigned long long) ps->runs,
+            ps->probes);
+  else
+    warn(_("The module doesn't keep probe stats.\n"));
+}
+
+
 int stp_main_loop(void)
 {
   ssize_t nb;
@@ -451,6 +533,10 @@ int stp_main_loop(void)
       struct _stp_msg_start start;
       struct _stp_msg_cmd cmd;
       struct _stp_msg_ns_pid nspid;
+      struct _stp_msg_transport_stats stats;
+      struct _stp_msg_lazy_unwind lazy;
+      struct _stp_msg_probes_armed armed;
+      struct _stp_msg_probe_stats pstats;
     } payload;
   } recvbuf;
   int error_detected = 0;
@@ -476,6 +562,10 @@ int stp_main_loop(void)
     /* NOTREACHED */
   }
 
+  /* Older modules don't know this one, and reject it.  */
+  ctl_batch = (send_request(STP_CTL_BATCH, NULL, 0) == 0);
+  dbug(2, "ctl_batch: %d\n", ctl_batch);
+
   flags = fcntl(control_channel, F_GETFL);
 
   /* Make select return immediately.  We just check whether
@@ -536,16 +626,18 @@ int stp_main_loop(void)
            {} /* await STP_EXIT reply message to kill staprun */
     }
 
+    if (pending_probe_stats) {
+      pending_probe_stats = 0;
+      if (send_request(STP_PROBE_STATS, NULL, 0) != 0)
+        warn(_("The module doesn't keep probe stats.\n"));
+    }
+
     /* If the runtime does not implement select() on the command
        filehandle, we have to poll periodically.  The polling interval can
        be relatively large, since we don't receive EAGAIN during the
        time-sensitive startup period (packets go back-to-back). */
 
-    flags |= O_NONBLOCK;
-    fcntl(control_channel, F_SETFL, flags);
-    nb = read(control_channel, &recvbuf, sizeof(recvbuf));
-    flags &= ~O_NONBLOCK;
-    fcntl(control_channel, F_SETFL, flags);
+    nb = read_ctl_msg(&recvbuf, sizeof(recvbuf), flags & ~O_NONBLOCK);
 
     dbug(3, "nb=%ld\n", (long)nb);
     if (nb < (ssize_t) sizeof(recvbuf.type)) {
@@ -693,7 +785,15 @@ int stp_main_loop(void)
             kill(target_pid, SIGKILL);
           cleanup_and_exit(0, 1);
 	  /* NOTREACHED */
-        } else if (target_cmd) {
+        }
+        if (handoff_name && handoff_from(handoff_name) != 0) {
+          if (target_cmd)
+            kill(target_pid, SIGKILL);
+          cleanup_and_exit(0, 1);
+        }
+        if (hwtrace_name && target_pid)
+          hwtrace_start(target_pid, hwtrace_name, target_cmd != NULL);
+        if (target_cmd) {
           dbug(1, "detaching pid %d\n", target_pid);
           int rc = resume_cmd();
           if (rc < 0)
@@ -714,6 +814,38 @@ int stp_main_loop(void)
         dbug(2, "STP_NAMESPACES_PID: %d\n", nspid->target);
         break;
       }
+    case STP_TRANSPORT_STATS:
+      {
+        struct _stp_msg_transport_stats *st = &recvbuf.payload.stats;
+        if (st->cpu < 0)
+          dbug(1, "transport: %llu reader wakeups, %llu buffer overruns, "
+               "peak %u of %u sub-buffers\n",
+               (unsigned long long) st->wakeups,
+               (unsigned long long) st->overruns, st->peak, st->n_subbufs);
+        else if (st->overruns && !suppress_warnings)
+          warn(_("The trace buffer of cpu %d overran %llu times; try a larger -s.\n"),
+               st->cpu, (unsigned long long) st->overruns);
+        else
+          dbug(1, "transport: cpu %d had up to %u of %u sub-buffers unread\n",
+               st->cpu, st->peak, st->n_subbufs);
+        break;
+      }
+    case STP_LAZY_UNWIND:
+      send_lazy_unwind(&recvbuf.payload.lazy);
+      break;
+    case STP_PROBES_ARMED:
+      {
+        struct _stp_msg_probes_armed *a = &recvbuf.payload.armed;
+        if (a->done)
+          dbug(1, "armed %u of %u kprobes\n", a->armed, a->total);
+        else
+          dbug(2, "arming kprobes: %u of %u tried, %u armed\n",
+               a->tried, a->total, a->armed);
+        break;
+      }
+    case STP_PROBE_STATS:
+      print_probe_stats(&recvbuf.payload.pstats);
+      break;
     case STP_TRANSPORT:
       {
         struct _stp_msg_start ts;
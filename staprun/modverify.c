@@ -19,7 +19,14 @@
 */
 
 #include "../config.h"
+#ifdef STAP
+/* Also built into stap, which checks modules fetched from a remote
+   cache against the same trusted signers as staprun.  */
+#include <string.h>
+static int verbose = 0;
+#else
 #include "staprun.h"
+#endif
 
 #include <stdio.h>
 
@@ -37,6 +44,7 @@
 #include "../nsscommon.h"
 #include "modverify.h"
 
+#ifndef STAP
 // Called by some of the functions in nsscommon.cxx.
 void
 nsscommon_error (const char *msg, int logit __attribute ((unused)))
@@ -44,6 +52,7 @@ nsscommon_error (const char *msg, int logit __attribute ((unused)))
   fprintf (stderr, "%s\n", msg);
   fflush (stderr);
 }
+#endif
 
 /* Function: int check_cert_db_permissions (const char *cert_db_path);
  *
@@ -11,6 +11,11 @@
  */
 
 #include "staprun.h"
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 
 int out_fd[MAX_NR_CPUS];
 int monitor_end = 0;
@@ -20,16 +25,53 @@ static int avail_cpus[MAX_NR_CPUS];
 static int switch_file[MAX_NR_CPUS];
 static pthread_mutex_t mutex[MAX_NR_CPUS];
 static int bulkmode = 0;
-static volatile int stop_threads = 0;
+volatile int stop_threads = 0;
 static time_t *time_backlog[MAX_NR_CPUS];
+static char *relay_map[MAX_NR_CPUS];
+static size_t relay_map_size;
+static uint32_t subbuf_size, n_subbufs;
 static int backlog_order=0;
 #define BACKLOG_MASK ((1 << backlog_order) - 1)
 #define MONITORLINELENGTH 4096
+/* NB: maximum possible output amount from a single probe hit's print_flush */
+#define RECORD_MAX (128*1024)
+
+/* The -P reader pool.  Each thread reads up to POOL_BATCH bytes of
+   records from a buffer at a time, carrying any record cut off at the
+   end over to the next read. */
+#define POOL_BATCH (1024*1024)
+#define POOL_RECORD_MAX (sizeof(struct _stp_trace) + RECORD_MAX)
+static pthread_t *pool;
+static int npool;
+static struct pool_cpu {
+	char *carry;
+	size_t carry_len;
+	off_t wsize;
+	int fnum;
+} pool_cpus[MAX_NR_CPUS];
 
-/* tracking message sequence #s for cross-cpu merging */
-static uint32_t last_sequence_number;
-static pthread_mutex_t last_sequence_number_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t last_sequence_number_changed = PTHREAD_COND_INITIALIZER;
+/* Stream mode merges the cpus' records by their global sequence
+   numbers as they are read.  Each reader queues its whole records, and
+   then, holding merge_lock, writes out every queued record whose turn
+   has come: the next one in sequence, or one that has waited
+   MERGE_WINDOW_MS for those before it, which may have been lost or be
+   sitting unread on a quiet cpu.  A cpu with MERGE_QUEUE_MAX bytes
+   queued waits for nobody. */
+#define MERGE_WINDOW_MS 100
+#define MERGE_QUEUE_MAX (4*1024*1024)
+struct merge_rec {
+	uint64_t when;		/* ms when queued */
+	struct _stp_trace hdr;
+};
+static pthread_mutex_t merge_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t merge_last;	/* sequence number last written */
+static size_t merge_queued;	/* bytes queued across all cpus */
+static struct merge_cpu {
+	char *buf;
+	size_t head, len, size;	/* queued records are buf[head, head+len) */
+	off_t wsize;
+	int fnum;
+} merge_cpus[MAX_NR_CPUS];
 
 #ifdef NEED_PPOLL
 int ppoll(struct pollfd *fds, nfds_t nfds,
@@ -76,6 +118,180 @@ time_t read_backlog(int cpu, int fnum)
 	return time_backlog[cpu][fnum & BACKLOG_MASK];
 }
 
+/**
+ *	write_all - write out a whole buffer, retrying partial writes
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t rc = write(fd, buf, len);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* For -o URI, the connection standing in for each output file. */
+static struct sink *out_sink[MAX_NR_CPUS];
+
+static int out_raw_write(int i, const void *buf, size_t len)
+{
+	if (out_sink[i])
+		return sink_write(out_sink[i], buf, len);
+	return write_all(out_fd[i], buf, len);
+}
+
+#ifdef HAVE_LIBZSTD
+/* For -z, the zstd stream of each output file, indexed like out_fd[].
+   In stream mode several reader threads can share one. */
+static struct out_zstd {
+	ZSTD_CCtx *cctx;
+	char *buf;
+	size_t size;
+	pthread_mutex_t lock;
+} *out_zstd[MAX_NR_CPUS];
+
+/**
+ *	out_zstd_flush - compress into, and write out, one output file
+ *	@i: index of the file in out_fd[]
+ *	@in: data to compress
+ *	@mode: ZSTD_e_continue, or ZSTD_e_end to finish the frame
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+static int out_zstd_flush(int i, ZSTD_inBuffer *in, ZSTD_EndDirective mode)
+{
+	struct out_zstd *z = out_zstd[i];
+	size_t rc;
+
+	do {
+		ZSTD_outBuffer out = { z->buf, z->size, 0 };
+		rc = ZSTD_compressStream2(z->cctx, &out, in, mode);
+		if (ZSTD_isError(rc)) {
+			err("Couldn't compress output: %s\n", ZSTD_getErrorName(rc));
+			return -1;
+		}
+		if (out_raw_write(i, z->buf, out.pos) < 0)
+			return -1;
+	} while (mode == ZSTD_e_end ? rc != 0 : in->pos < in->size);
+	return 0;
+}
+#endif
+
+/**
+ *	init_compress - start compressing output file out_fd[@i], for -z
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+static int init_compress(int i)
+{
+#ifdef HAVE_LIBZSTD
+	struct out_zstd *z = calloc(1, sizeof(*z));
+
+	if (z == NULL || (z->cctx = ZSTD_createCCtx()) == NULL
+	    || (z->buf = malloc(z->size = ZSTD_CStreamOutSize())) == NULL) {
+		_err("Memory allocation failed\n");
+		return -1;
+	}
+	/* Level 1: trade as little cpu time as we can for the space. */
+	ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, 1);
+	pthread_mutex_init(&z->lock, NULL);
+	out_zstd[i] = z;
+	return 0;
+#else
+	(void) i;
+	_err("stapio was built without zstd support.\n");
+	return -1;
+#endif
+}
+
+/**
+ *	out_write - write to output file out_fd[@i]
+ *
+ *	Compresses the data first for -z.  Returns 0 if successful,
+ *	negative otherwise.
+ */
+static int out_write(int i, const void *buf, size_t len)
+{
+#ifdef HAVE_LIBZSTD
+	if (out_zstd[i]) {
+		ZSTD_inBuffer in = { buf, len, 0 };
+		int rc;
+
+		pthread_mutex_lock(&out_zstd[i]->lock);
+		rc = out_zstd_flush(i, &in, ZSTD_e_continue);
+		pthread_mutex_unlock(&out_zstd[i]->lock);
+		return rc;
+	}
+#endif
+	return out_raw_write(i, buf, len);
+}
+
+/**
+ *	out_sync - send on what's been written to output @i, for -o URI
+ *
+ *	Readers call this after each batch of records.
+ */
+static int out_sync(int i)
+{
+	if (out_sink[i])
+		return sink_sync(out_sink[i]);
+	return 0;
+}
+
+/**
+ *	out_close - close output file out_fd[@i]
+ *
+ *	For -z, this first ends the file's zstd frame; the compressor is
+ *	kept for the next file opened at @i.  A connection sends what's
+ *	left before it's closed.
+ */
+static int out_close(int i)
+{
+	int rc = 0;
+
+#ifdef HAVE_LIBZSTD
+	if (out_zstd[i]) {
+		ZSTD_inBuffer in = { NULL, 0, 0 };
+
+		pthread_mutex_lock(&out_zstd[i]->lock);
+		rc = out_zstd_flush(i, &in, ZSTD_e_end);
+		pthread_mutex_unlock(&out_zstd[i]->lock);
+		if (rc < 0)
+			perr("Couldn't finish output %d", out_fd[i]);
+	}
+#endif
+	if (out_sink[i]) {
+		if (sink_close(out_sink[i]) < 0)
+			rc = -1;
+		out_sink[i] = NULL;
+	} else
+		close(out_fd[i]);
+	return rc;
+}
+
+static void free_compress(int i)
+{
+#ifdef HAVE_LIBZSTD
+	if (out_zstd[i]) {
+		ZSTD_freeCCtx(out_zstd[i]->cctx);
+		free(out_zstd[i]->buf);
+		pthread_mutex_destroy(&out_zstd[i]->lock);
+		free(out_zstd[i]);
+		out_zstd[i] = NULL;
+	}
+#else
+	(void) i;
+#endif
+}
+
 static int open_outfile(int fnum, int cpu, int remove_file)
 {
 	char buf[PATH_MAX];
@@ -113,7 +329,7 @@ static int switch_outfile(int cpu, int *fnum)
 	int remove_file = 0;
 
 	dbug(3, "thread %d switching file\n", cpu);
-	close(out_fd[cpu]);
+	out_close(cpu);
 	*fnum += 1;
 	if (fnum_max && *fnum >= fnum_max)
 		remove_file = 1;
@@ -125,28 +341,25 @@ static int switch_outfile(int cpu, int *fnum)
 }
 
 /**
- *	reader_thread - per-cpu channel buffer reader
+ *	reader_thread_init - common setup of a per-cpu reader thread
+ *	@cpu: cpu whose channel buffer the thread reads
+ *	@sigs: returns the signal mask to use with ppoll()
+ *	@tim: storage for the ppoll() timeout
+ *
+ *	Returns the ppoll() timeout, which may be NULL.
  */
-static void *reader_thread(void *data)
+static struct timespec *reader_thread_init(int cpu, sigset_t *sigs,
+					   struct timespec *tim)
 {
-        char buf[128*1024]; // NB: maximum possible output amount from a single probe hit's print_flush
-        struct _stp_trace bufhdr;
-
-        int rc, cpu = (int)(long)data;
-        struct pollfd pollfd;
-        /* 200ms, close to human level of "instant" */
-	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000}, *timeout = &tim;
-	sigset_t sigs;
-	off_t wsize = 0;
-	int fnum = 0;
+	struct timespec *timeout = tim;
 	cpu_set_t cpu_mask;
-                
-	sigemptyset(&sigs);
-	sigaddset(&sigs,SIGUSR2);
-	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
 
-	sigfillset(&sigs);
-	sigdelset(&sigs,SIGUSR2);
+	sigemptyset(sigs);
+	sigaddset(sigs,SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, sigs, NULL);
+
+	sigfillset(sigs);
+	sigdelset(sigs,SIGUSR2);
 
 	CPU_ZERO(&cpu_mask);
 	CPU_SET(cpu, &cpu_mask);
@@ -165,13 +378,216 @@ static void *reader_thread(void *data)
                 timeout->tv_sec = reader_timeout_ms / 1000;
                 timeout->tv_nsec = (reader_timeout_ms - timeout->tv_sec * 1000) * 1000000;
         }
+	return timeout;
+}
+
+/**
+ *	reader_write_record - write out one trace record
+ *	@cpu: cpu whose buffer the record came from
+ *	@bufhdr: its header
+ *	@data: its pdu_len bytes of data
+ *	@wsize: bytes written to the current output file
+ *	@fnum: number of the current output file
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+static int reader_write_record(int cpu, struct _stp_trace *bufhdr,
+			       char *data, off_t *wsize, int *fnum)
+{
+        int wbytes = bufhdr->pdu_len;
+        char *wbuf = data;
+
+        /* Switching file */
+        pthread_mutex_lock(&mutex[cpu]);
+        if ((fsize_max && ((*wsize + wbytes) > fsize_max)) ||
+            switch_file[cpu]) {
+                if (switch_outfile(cpu, fnum) < 0) {
+                        switch_file[cpu] = 0;
+                        pthread_mutex_unlock(&mutex[cpu]);
+                        return -1;
+                }
+                switch_file[cpu] = 0;
+                *wsize = 0;
+        }
+        pthread_mutex_unlock(&mutex[cpu]);
+
+        /* Copy loop.  The monitor takes the data a chunk at a time;
+           out_write() repeats write(2) in case of a pipe overflow or
+           other transient fullness. */
+        while (wbytes > 0) {
+                if (monitor) {
+                        ssize_t bytes = wbytes > MONITORLINELENGTH ? MONITORLINELENGTH : wbytes;
+                        /* Start scanning the wbuf[] for lines - \n.
+                           Plop each one found into the h_queue.lines[] ring. */
+                        char *p = wbuf; /* scan position */
+                        char *p_end = wbuf + bytes; /* one past last byte */
+                        char *line = p;
+                        while (p < p_end) {
+                                if (*p == '\n') { /* got a line */
+                                        monitor_remember_output_line(line, (p-line)+1); /* strlen, including \n */
+                                        line = p+1;
+                                }
+                                p++;
+                        }
+                        /* Flush remaining output */
+                        if (line != p_end)
+                                monitor_remember_output_line(line, (p_end - line));
+                        wbytes -= bytes;
+                        wbuf += bytes;
+                        *wsize += bytes;
+                } else {
+                        /* Only bulkmode and fsize_max use per-cpu output files. Otherwise,
+                           there's just a single output fd stored at out_fd[avail_cpus[0]]. */
+                        int o = (bulkmode || fsize_max) ? cpu : avail_cpus[0];
+                        if ((bulkmode && out_write(o, bufhdr, sizeof(*bufhdr)) < 0) // write header
+                            || out_write(o, wbuf, wbytes) < 0) { // write payload
+                                perr("Couldn't write to output %d for cpu %d, exiting.",
+                                     out_fd[o], cpu);
+                                return -1;
+                        }
+                        *wsize += wbytes;
+                        wbytes = 0;
+                }
+        }
+        return 0;
+}
+
+static uint64_t merge_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ *	merge_queue - queue a stream mode record for merge_write()
+ *	@cpu: cpu whose buffer the record came from
+ *	@bufhdr: its header
+ *	@data: its pdu_len bytes of data
+ *	@now: merge_now()
+ *
+ *	Call with merge_lock held.  Returns 0 if successful, negative
+ *	otherwise.
+ */
+static int merge_queue(int cpu, const struct _stp_trace *bufhdr,
+		       const char *data, uint64_t now)
+{
+	struct merge_cpu *mc = &merge_cpus[cpu];
+	struct merge_rec rec = { .when = now, .hdr = *bufhdr };
+	size_t need = sizeof(rec) + bufhdr->pdu_len;
+
+	if (mc->head + mc->len + need > mc->size) {
+		memmove(mc->buf, mc->buf + mc->head, mc->len);
+		mc->head = 0;
+	}
+	if (mc->len + need > mc->size) {
+		size_t size = mc->size ? 2 * mc->size : 4 * RECORD_MAX;
+		char *p;
+
+		while (size < mc->len + need)
+			size *= 2;
+		p = realloc(mc->buf, size);
+		if (p == NULL) {
+			_err("Memory allocation failed\n");
+			return -1;
+		}
+		mc->buf = p;
+		mc->size = size;
+	}
+	memcpy(mc->buf + mc->head + mc->len, &rec, sizeof(rec));
+	memcpy(mc->buf + mc->head + mc->len + sizeof(rec), data, bufhdr->pdu_len);
+	mc->len += need;
+	merge_queued += need;
+	return 0;
+}
+
+/**
+ *	merge_write - write out the queued stream mode records whose turn has come
+ *	@now: merge_now()
+ *	@all: write out everything, as at the end
+ *
+ *	Call with merge_lock held.  Returns 0 if successful, negative
+ *	otherwise.
+ */
+static int merge_write(uint64_t now, int all)
+{
+	for (;;) {
+		struct merge_rec rec, best_rec;
+		int i, cpu, best = -1, full = 0;
+		struct merge_cpu *mc;
+		size_t need;
+
+		for (i = 0; i < ncpus; i++) {
+			mc = &merge_cpus[avail_cpus[i]];
+			if (mc->len == 0)
+				continue;
+			memcpy(&rec, mc->buf + mc->head, sizeof(rec));
+			if (best < 0 || (int32_t) (rec.hdr.sequence
+						   - best_rec.hdr.sequence) < 0) {
+				best = avail_cpus[i];
+				best_rec = rec;
+			}
+			if (mc->len >= MERGE_QUEUE_MAX)
+				full = 1;
+		}
+		if (best < 0)
+			return 0;
+		if (!all && !full && best_rec.hdr.sequence != merge_last + 1
+		    && now - best_rec.when < MERGE_WINDOW_MS)
+			return 0;
+
+		cpu = best;
+		mc = &merge_cpus[cpu];
+		if (reader_write_record(cpu, &best_rec.hdr,
+					mc->buf + mc->head + sizeof(rec),
+					&mc->wsize, &mc->fnum) < 0)
+			return -1;
+		need = sizeof(rec) + best_rec.hdr.pdu_len;
+		mc->head += need;
+		mc->len -= need;
+		merge_queued -= need;
+		merge_last = best_rec.hdr.sequence;
+	}
+}
+
+/**
+ *	reader_thread - per-cpu channel buffer reader
+ *
+ *	Each read() takes as much of the buffer as fits, usually many
+ *	records, which are then written out one by one, or in stream mode
+ *	queued for merge_write().  A record cut off at the end of a read
+ *	is kept for the next one.
+ */
+static void *reader_thread(void *data)
+{
+        /* Room for a whole record left over from the last read plus
+           as much again of new data. */
+        char buf[2*RECORD_MAX + sizeof(struct _stp_trace)];
+        struct _stp_trace bufhdr;
+
+        int rc, cpu = (int)(long)data;
+        struct pollfd pollfd;
+        /* 200ms, close to human level of "instant" */
+	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000}, *timeout;
+	struct timespec window = {.tv_sec=0, .tv_nsec=MERGE_WINDOW_MS*1000000};
+	sigset_t sigs;
+	off_t wsize = 0, *wsizep = bulkmode ? &wsize : &merge_cpus[cpu].wsize;
+	int fnum = 0, *fnump = bulkmode ? &fnum : &merge_cpus[cpu].fnum;
+	size_t len = 0, pos;
+	uint64_t now = 0;
+
+	timeout = reader_thread_init(cpu, &sigs, &tim);
 
 	pollfd.fd = relay_fd[cpu];
 	pollfd.events = POLLIN;
 
         do {
 		dbug(3, "thread %d start ppoll\n", cpu);
-                rc = ppoll(&pollfd, 1, timeout, &sigs);
+                /* Come back for queued records whose wait is over. */
+                rc = ppoll(&pollfd, 1,
+                           (!bulkmode && __atomic_load_n(&merge_queued, __ATOMIC_RELAXED))
+                           ? &window : timeout, &sigs);
 		dbug(3, "thread %d end ppoll:%d\n", cpu, rc);
                 if (rc < 0) {
 			dbug(3, "cpu=%d poll=%d errno=%d\n", cpu, rc, errno);
@@ -179,146 +595,80 @@ static void *reader_thread(void *data)
 				if (stop_threads)
 					break;
 
+				/* In stream mode, merge_write() owns the files. */
+				if (!bulkmode)
+					pthread_mutex_lock(&merge_lock);
 				pthread_mutex_lock(&mutex[cpu]);
+				rc = 0;
 				if (switch_file[cpu]) {
-					if (switch_outfile(cpu, &fnum) < 0) {
-						switch_file[cpu] = 0;
-						pthread_mutex_unlock(&mutex[cpu]);
-						goto error_out;
-					}
+					rc = switch_outfile(cpu, fnump);
 					switch_file[cpu] = 0;
-					wsize = 0;
+					*wsizep = 0;
 				}
 				pthread_mutex_unlock(&mutex[cpu]);
+				if (!bulkmode)
+					pthread_mutex_unlock(&merge_lock);
+				if (rc < 0)
+					goto error_out;
 			} else {
 				_perr("poll error");
 				goto error_out;
 			}
                 }
 
-                /* Read the header. */
-                rc = read(relay_fd[cpu], &bufhdr, sizeof(bufhdr));
-                if (rc == 0) /* seen during normal shutdown */
-                        continue;
-                if (rc != sizeof(bufhdr)) {
-                        _perr("bufhdr read error, attempting resync");
-                        rc = read(relay_fd[cpu], buf, sizeof(buf)); /* drain the buffers */
-                        (void) rc;
+                rc = read(relay_fd[cpu], buf + len, sizeof(buf) - len);
+                if (rc <= 0) { /* nothing there, or seen during normal shutdown */
+                        if (!bulkmode) {
+                                pthread_mutex_lock(&merge_lock);
+                                rc = merge_write(merge_now(), 0);
+                                pthread_mutex_unlock(&merge_lock);
+                                if (rc < 0 || out_sync((fsize_max) ? cpu : avail_cpus[0]) < 0)
+                                        goto error_out;
+                        }
                         continue;
                 }
-
-                /* Validate it slightly.  Because of lost messages, we might be getting
-                   not a proper _stp_trace struct but the interior of some piece of 
-                   trace text message.  XXX: validate bufhdr.sequence a little bit too? */
-                if (bufhdr.pdu_len == 0 || bufhdr.pdu_len > sizeof(buf)) {
-                        /* _perr("bufhdr corrupt, attempting resync"); */ 
-                        rc = read(relay_fd[cpu], buf, sizeof(buf)); /* drain the buffers */
-                        (void) rc;
-                        continue; /* may resync at next subbuf boundary so don't give up */
+                dbug(3, "cpu %d: read %d bytes of data\n", cpu, rc);
+                len += rc;
+                if (!bulkmode) {
+                        now = merge_now();
+                        pthread_mutex_lock(&merge_lock);
                 }
 
-                /* Read the message, perhaps in pieces (such as if crossing
-                 * relayfs subbuf boundaries). */
-                size_t bufread = 0;
-                while (bufread < bufhdr.pdu_len) {
-                        rc = read(relay_fd[cpu], buf+bufread, bufhdr.pdu_len-bufread);
-                        if (rc <= 0) {
-                                /* _perr("partial message received"); */
-                                break; /* still process it; hope we can resync next time. */
-                        }
-                        bufread += rc;
-                }
+                /* Write out the complete records read so far. */
+                for (pos = 0; len - pos >= sizeof(bufhdr);
+                     pos += sizeof(bufhdr) + bufhdr.pdu_len) {
+                        memcpy(&bufhdr, buf + pos, sizeof(bufhdr));
 
-                if (! bulkmode) {
-                        /* Wait until the bufhdr.sequence number indicates it's OUR TURN to go ahead. */
-                        struct timespec ts = {.tv_sec=time(NULL)+2, .tv_nsec=0}; /* wait 1-2 seconds */
-                        pthread_mutex_lock(& last_sequence_number_mutex);
-                        while ((last_sequence_number+1 != bufhdr.sequence) && /* normal case */
-                               (last_sequence_number < bufhdr.sequence)) { /* we're late!!! */
-                                int rc = pthread_cond_timedwait (& last_sequence_number_changed,
-                                                                 & last_sequence_number_mutex,
-                                                                 & ts);
-                                if (rc == ETIMEDOUT) {
-                                        /* _perr("message sequencing timeout"); */
-                                        break;
-                                }
+                        /* Validate it slightly.  Because of lost messages, we might be getting
+                           not a proper _stp_trace struct but the interior of some piece of
+                           trace text message.  XXX: validate bufhdr.sequence a little bit too? */
+                        if (bufhdr.pdu_len == 0 || bufhdr.pdu_len > RECORD_MAX) {
+                                /* _perr("bufhdr corrupt, attempting resync"); */
+                                pos = len; /* drop the rest; may resync at next subbuf boundary */
+                                break;
                         }
-                        pthread_mutex_unlock(& last_sequence_number_mutex);
-                }
-                
-                int wbytes = rc;
-                char *wbuf = buf;
+                        if (len - pos < sizeof(bufhdr) + bufhdr.pdu_len)
+                                break; /* the rest comes with the next read */
 
-                dbug(3, "cpu %d: read %d bytes of data\n", cpu, rc);
-
-                /* Switching file */
-                pthread_mutex_lock(&mutex[cpu]);
-                if ((fsize_max && ((wsize + rc) > fsize_max)) ||
-                    switch_file[cpu]) {
-                        if (switch_outfile(cpu, &fnum) < 0) {
-                                switch_file[cpu] = 0;
-                                pthread_mutex_unlock(&mutex[cpu]);
-                                goto error_out;
-                        }
-                        switch_file[cpu] = 0;
-                        wsize = 0;
+                        if (!bulkmode)
+                                rc = merge_queue(cpu, &bufhdr, buf + pos + sizeof(bufhdr), now);
+                        else
+                                rc = reader_write_record(cpu, &bufhdr, buf + pos + sizeof(bufhdr),
+                                                         &wsize, &fnum);
+                        if (rc < 0)
+                                break;
                 }
-                pthread_mutex_unlock(&mutex[cpu]);
-
-                /* Copy loop.  Must repeat write(2) in case of a pipe overflow
-                   or other transient fullness. */
-                while (wbytes > 0) {
-                        if (monitor) {
-                                ssize_t bytes = wbytes > MONITORLINELENGTH ? MONITORLINELENGTH : wbytes;
-                                /* Start scanning the wbuf[] for lines - \n.
-                                   Plop each one found into the h_queue.lines[] ring. */
-                                char *p = wbuf; /* scan position */
-                                char *p_end = wbuf + bytes; /* one past last byte */
-                                char *line = p;
-                                while (p < p_end) {
-                                        if (*p == '\n') { /* got a line */
-                                                monitor_remember_output_line(line, (p-line)+1); /* strlen, including \n */
-                                                line = p+1;
-                                        }
-                                        p++;
-                                }
-                                /* Flush remaining output */
-                                if (line != p_end)
-                                        monitor_remember_output_line(line, (p_end - line));
-                                wbytes -= bytes;
-                                wbuf += bytes;
-                                wsize += bytes;
-                        } else {
-                                int fd;
-                                /* Only bulkmode and fsize_max use per-cpu output files. Otherwise,
-                                   there's just a single output fd stored at out_fd[avail_cpus[0]]. */
-                                if (bulkmode || fsize_max)
-                                        fd = out_fd[cpu];
-                                else
-                                        fd = out_fd[avail_cpus[0]];
-                                rc = 0;
-                                if (bulkmode)
-                                        rc = write(fd, &bufhdr, sizeof(bufhdr)); // write header
-                                rc |= write(fd, wbuf, wbytes); // write payload
-                                if (rc <= 0) {
-                                        perr("Couldn't write to output %d for cpu %d, exiting.",
-                                             fd, cpu);
-                                        goto error_out;
-                                }
-                                wbytes -= rc;
-                                wbuf += rc;
-                                wsize += rc;
-                        }
-                }
-
-                /* update the sequence number & let other cpus go ahead */
-                pthread_mutex_lock(& last_sequence_number_mutex);
-                if (last_sequence_number < bufhdr.sequence) { /* not if someone leapfrogged us */
-                        last_sequence_number = bufhdr.sequence;
-                        pthread_cond_broadcast (& last_sequence_number_changed);
+                if (!bulkmode) {
+                        if (rc >= 0)
+                                rc = merge_write(now, 0);
+                        pthread_mutex_unlock(&merge_lock);
                 }
-                pthread_mutex_unlock(& last_sequence_number_mutex);
-                
+                if (rc < 0)
+                        goto error_out;
+                len -= pos;
+                memmove(buf, buf + pos, len);
+                if (out_sync((bulkmode || fsize_max) ? cpu : avail_cpus[0]) < 0)
+                        goto error_out;
         } while (!stop_threads);
 	dbug(3, "exiting thread for cpu %d\n", cpu);
 	return(NULL);
@@ -330,12 +680,587 @@ error_out:
 	return(NULL);
 }
 
+/**
+ *	next_subbufs - find the complete sub-buffers of a mapped buffer
+ *	@cpu: cpu whose buffer to look at
+ *	@seq: sequence number of the next sub-buffer to write out
+ *	@iov: returns where the data of each one is
+ *	@max: size of iov
+ *
+ *	Returns the number of complete sub-buffers from @seq on.
+ */
+static int next_subbufs(int cpu, uint32_t seq, struct iovec *iov, int max)
+{
+	int n;
+
+	for (n = 0; n < max && (uint32_t) n < n_subbufs; n++, seq++) {
+		char *subbuf = relay_map[cpu] + (size_t)(seq % n_subbufs) * subbuf_size;
+		struct _stp_subbuf_hdr *hdr = (struct _stp_subbuf_hdr *) subbuf;
+		uint32_t padding;
+
+		/* The module sets padding before produced when starting a
+		   sub-buffer, and padding last when completing it. */
+		if (__atomic_load_n(&hdr->produced, __ATOMIC_ACQUIRE) != seq)
+			break;
+		padding = __atomic_load_n(&hdr->padding, __ATOMIC_ACQUIRE);
+		if (padding == STP_SUBBUF_FILLING)
+			break;
+		if (padding > subbuf_size - sizeof(*hdr))
+			padding = subbuf_size - sizeof(*hdr);
+		iov[n].iov_base = subbuf + sizeof(*hdr);
+		iov[n].iov_len = subbuf_size - sizeof(*hdr) - padding;
+	}
+	return n;
+}
+
+/**
+ *	write_subbufs - write out sub-buffer data straight from the mapping
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+static int write_subbufs(int fd, struct iovec *iov, int n)
+{
+	while (n > 0) {
+		ssize_t rc = writev(fd, iov, n);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		/* Skip what was written, in case of a partial write. */
+		while (n > 0 && (size_t) rc >= iov->iov_len) {
+			rc -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+/**
+ *	mmap_reader_thread - per-cpu channel buffer reader, for -m
+ *
+ *	Instead of read()ing the trace file, this writes out each
+ *	sub-buffer's data directly from the mapped relay buffer once
+ *	the module has completed it, and then hands the sub-buffers
+ *	back with a STP_SUBBUFS_CONSUMED message.  Only used in bulk
+ *	mode, whose output files hold the records as the module wrote
+ *	them.
+ */
+static void *mmap_reader_thread(void *data)
+{
+	struct iovec iov[64];
+	struct _stp_msg_consumed cons;
+	int rc, n, cpu = (int)(long)data;
+	struct pollfd pollfd;
+	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000}, *timeout;
+	sigset_t sigs;
+	uint32_t seq = 0;
+
+	timeout = reader_thread_init(cpu, &sigs, &tim);
+
+	pollfd.fd = relay_fd[cpu];
+	pollfd.events = POLLIN;
+	cons.cpu = cpu;
+
+	do {
+		rc = ppoll(&pollfd, 1, timeout, &sigs);
+		if (rc < 0 && errno != EINTR) {
+			_perr("poll error");
+			goto error_out;
+		}
+
+		/* Drain what's complete; on the way out, all of it. */
+		do {
+			n = next_subbufs(cpu, seq, iov, sizeof(iov)/sizeof(iov[0]));
+			dbug(3, "cpu %d: %d sub-buffers from %u\n", cpu, n, seq);
+			if (n && write_subbufs(out_fd[cpu], iov, n) < 0) {
+				perr("Couldn't write to output %d for cpu %d, exiting.",
+				     out_fd[cpu], cpu);
+				goto error_out;
+			}
+			seq += n;
+
+			/* With none complete, this asks the module to
+			   switch out a partly filled sub-buffer like a
+			   read() would. */
+			cons.consumed = n;
+			if (send_request(STP_SUBBUFS_CONSUMED, &cons, sizeof(cons)) != 0
+			    && !stop_threads) {
+				_perr("Couldn't release sub-buffers for cpu %d", cpu);
+				goto error_out;
+			}
+		} while (stop_threads && n);
+	} while (!stop_threads);
+	dbug(3, "exiting thread for cpu %d\n", cpu);
+	return(NULL);
+
+error_out:
+	/* Signal the main thread that we need to quit */
+	kill(getpid(), SIGTERM);
+	dbug(2, "exiting thread for cpu %d after error\n", cpu);
+	return(NULL);
+}
+
+/**
+ *	pool_write_records - write out the complete records of a batch
+ *	@cpu: cpu whose buffer the batch was read from
+ *	@buf: the batch
+ *	@len: its length
+ *
+ *	Runs of records are written with one write(2), switching output
+ *	files between records for -S.  Returns the length of the
+ *	incomplete record left at the end of @buf, or negative on error.
+ */
+static ssize_t pool_write_records(int cpu, const char *buf, size_t len)
+{
+	struct pool_cpu *pc = &pool_cpus[cpu];
+	size_t start = 0, pos = 0, left;
+	struct _stp_trace bufhdr;
+
+	while (len - pos >= sizeof(bufhdr)) {
+		size_t rec;
+
+		memcpy(&bufhdr, buf + pos, sizeof(bufhdr));
+
+		/* As in reader_thread, drop the rest of the batch if
+		   this doesn't look like a header; we may resync at the
+		   next sub-buffer boundary. */
+		if (bufhdr.pdu_len == 0
+		    || bufhdr.pdu_len > POOL_RECORD_MAX - sizeof(bufhdr)) {
+			dbug(3, "cpu %d: dropping %zu bytes\n", cpu, len - pos);
+			len = pos;
+			break;
+		}
+		rec = sizeof(bufhdr) + bufhdr.pdu_len;
+		if (len - pos < rec)
+			break;
+
+		if (fsize_max && pc->wsize + (off_t) (pos - start + rec) > fsize_max
+		    && (pc->wsize || pos > start)) {
+			if (out_write(cpu, buf + start, pos - start) < 0)
+				goto write_error;
+			if (switch_outfile(cpu, &pc->fnum) < 0)
+				return -1;
+			pc->wsize = 0;
+			start = pos;
+		}
+		pos += rec;
+	}
+
+	left = len - pos;
+	if (out_write(cpu, buf + start, pos - start) < 0)
+		goto write_error;
+	pc->wsize += pos - start;
+	return left;
+
+write_error:
+	perr("Couldn't write to output %d for cpu %d, exiting.",
+	     out_fd[cpu], cpu);
+	return -1;
+}
+
+/**
+ *	pool_read_cpu - read and write out what's in one cpu's buffer
+ *	@cpu: cpu whose buffer to drain
+ *	@buf: POOL_BATCH bytes of scratch space
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+static int pool_read_cpu(int cpu, char *buf)
+{
+	struct pool_cpu *pc = &pool_cpus[cpu];
+	ssize_t rc, left;
+	size_t len;
+
+	pthread_mutex_lock(&mutex[cpu]);
+	if (switch_file[cpu]) {
+		switch_file[cpu] = 0;
+		if (switch_outfile(cpu, &pc->fnum) < 0) {
+			pthread_mutex_unlock(&mutex[cpu]);
+			return -1;
+		}
+		pc->wsize = 0;
+	}
+	pthread_mutex_unlock(&mutex[cpu]);
+
+	for (;;) {
+		len = pc->carry_len;
+		memcpy(buf, pc->carry, len);
+		rc = read(relay_fd[cpu], buf + len, POOL_BATCH - len);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		/* Nothing more for now (-ENODATA or -EAGAIN), or it
+		   went away during shutdown. */
+		if (rc <= 0)
+			break;
+		dbug(3, "cpu %d: read %zd bytes of data\n", cpu, rc);
+
+		left = pool_write_records(cpu, buf, len + rc);
+		if (left < 0)
+			return -1;
+		memcpy(pc->carry, buf + len + rc - left, left);
+		pc->carry_len = left;
+
+		/* A short read means we've caught up. */
+		if ((size_t) rc < POOL_BATCH - len)
+			break;
+	}
+	return out_sync(cpu);
+}
+
+/**
+ *	pool_thread - reader for a share of the cpus, for -P
+ *
+ *	Thread N of the pool waits with epoll on the buffers of every
+ *	Nth cpu, and drains each one that has data in POOL_BATCH sized
+ *	reads.  Only used in bulk mode, whose per-cpu output files need
+ *	no ordering across cpus.
+ */
+static void *pool_thread(void *data)
+{
+	struct epoll_event events[64];
+	int i, n, epfd, t = (int)(long)data;
+	char *buf;
+	sigset_t sigs;
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs,SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	sigfillset(&sigs);
+	sigdelset(&sigs,SIGUSR2);
+
+	buf = malloc(POOL_BATCH);
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (buf == NULL || epfd < 0) {
+		_perr("failed to set up reader %d", t);
+		goto error_out;
+	}
+	for (i = t; i < ncpus; i += npool) {
+		struct epoll_event ev = { .events = EPOLLIN };
+		ev.data.u32 = avail_cpus[i];
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, relay_fd[avail_cpus[i]], &ev) < 0) {
+			_perr("couldn't wait on cpu %d", avail_cpus[i]);
+			goto error_out;
+		}
+	}
+
+	do {
+		n = epoll_pwait(epfd, events, sizeof(events)/sizeof(events[0]),
+				reader_timeout_ms ? (int) reader_timeout_ms : -1,
+				&sigs);
+		dbug(3, "reader %d: %d buffers ready\n", t, n);
+		if (n < 0 && errno != EINTR) {
+			_perr("epoll error");
+			goto error_out;
+		}
+		if (n > 0) {
+			for (i = 0; i < n; i++)
+				if (pool_read_cpu(events[i].data.u32, buf) < 0)
+					goto error_out;
+			continue;
+		}
+
+		/* Timed out, or signalled to switch files or to stop:
+		   look at all of ours. */
+		for (i = t; i < ncpus; i += npool)
+			if (pool_read_cpu(avail_cpus[i], buf) < 0)
+				goto error_out;
+	} while (!stop_threads);
+	dbug(3, "exiting reader %d\n", t);
+	close(epfd);
+	free(buf);
+	return(NULL);
+
+error_out:
+	/* Signal the main thread that we need to quit */
+	kill(getpid(), SIGTERM);
+	dbug(2, "exiting reader %d after error\n", t);
+	if (epfd >= 0)
+		close(epfd);
+	free(buf);
+	return(NULL);
+}
+
+/**
+ *	start_pool - start the -P reader threads
+ *
+ *	Returns 0 if successful, negative otherwise
+ */
+static int start_pool(void)
+{
+	int i;
+
+	npool = reader_pool < ncpus ? reader_pool : ncpus;
+	pool = calloc(npool, sizeof(pthread_t));
+	if (pool == NULL) {
+		_err("Memory allocation failed\n");
+		return -1;
+	}
+	for (i = 0; i < ncpus; i++) {
+		pool_cpus[avail_cpus[i]].carry = malloc(POOL_RECORD_MAX);
+		if (pool_cpus[avail_cpus[i]].carry == NULL) {
+			_err("Memory allocation failed\n");
+			return -1;
+		}
+	}
+
+	dbug(2, "starting %d reader threads for %d cpus\n", npool, ncpus);
+	for (i = 0; i < npool; i++) {
+		if (pthread_create(&pool[i], NULL, pool_thread,
+				   (void *)(long)i) < 0) {
+			_perr("failed to create thread");
+			npool = i;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void stop_pool(int cancel)
+{
+	int i;
+
+	for (i = 0; i < npool; i++)
+		pthread_kill(pool[i], SIGUSR2);
+	for (i = 0; i < npool; i++) {
+		if (cancel)
+			pthread_cancel(pool[i]); /* no wait */
+		else
+			pthread_join(pool[i], NULL);
+	}
+	if (cancel)
+		return;
+	for (i = 0; i < ncpus; i++) {
+		free(pool_cpus[avail_cpus[i]].carry);
+		pool_cpus[avail_cpus[i]].carry = NULL;
+	}
+	free(pool);
+	pool = NULL;
+	npool = 0;
+}
+
+/**
+ *	map_relayfs - map the per-cpu trace buffers for -m
+ *
+ *	Returns 0 if successful, negative otherwise
+ */
+static int map_relayfs(void)
+{
+	struct _stp_subbuf_hdr *hdr;
+	long pagesize = sysconf(_SC_PAGESIZE);
+	int i;
+
+	/* The module picks the same geometry, for an explicit -b. */
+	subbuf_size = pagesize;
+	n_subbufs = (size_t)buffer_size * 1024 * 1024 / pagesize;
+	relay_map_size = (size_t)subbuf_size * n_subbufs;
+
+	for (i = 0; i < ncpus; i++) {
+		int cpu = avail_cpus[i];
+		relay_map[cpu] = mmap(NULL, relay_map_size, PROT_READ, MAP_SHARED,
+				      relay_fd[cpu], 0);
+		if (relay_map[cpu] == MAP_FAILED) {
+			relay_map[cpu] = NULL;
+			perr("Couldn't map trace buffer for cpu %d", cpu);
+			return -1;
+		}
+		hdr = (struct _stp_subbuf_hdr *) relay_map[cpu];
+		if (hdr->subbuf_size != subbuf_size || hdr->n_subbufs != n_subbufs) {
+			err("Unexpected trace buffer layout for cpu %d "
+			    "(%u x %u bytes). Was the module loaded with -m?\n",
+			    cpu, hdr->n_subbufs, hdr->subbuf_size);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void unmap_relayfs(void)
+{
+	int i;
+	for (i = 0; i < ncpus; i++) {
+		if (relay_map[avail_cpus[i]])
+			munmap(relay_map[avail_cpus[i]], relay_map_size);
+		relay_map[avail_cpus[i]] = NULL;
+	}
+}
+
+/* The -s snapshot of one cpu's buffer, read whole. */
+struct snap_cpu {
+	char *buf;
+	size_t len, pos;	/* pos is the next record's header */
+};
+
+/* Does a record header of a plausible size start at @pos? */
+static int snap_header_at(const struct snap_cpu *sc, size_t pos,
+			  struct _stp_trace *hdr)
+{
+	if (sc->len - pos < sizeof(*hdr))
+		return 0;
+	memcpy(hdr, sc->buf + pos, sizeof(*hdr));
+	return hdr->pdu_len > 0 && hdr->pdu_len <= RECORD_MAX;
+}
+
+/**
+ *	snap_next_record - find the next record of a snapshot
+ *
+ *	The oldest sub-buffer left may start partway into a record that
+ *	began in one since overwritten, and the last record before the
+ *	buffers froze may have been cut short.  So a record is only
+ *	taken as such if the header of a later one follows on from it,
+ *	or the data ends there; otherwise the search goes on a byte
+ *	further.
+ *	Returns 1 with @hdr filled in, or 0 at the end.
+ */
+static int snap_next_record(struct snap_cpu *sc, struct _stp_trace *hdr)
+{
+	struct _stp_trace next;
+	size_t end;
+
+	for (; sc->pos < sc->len; sc->pos++) {
+		if (!snap_header_at(sc, sc->pos, hdr)
+		    || sc->len - sc->pos - sizeof(*hdr) < hdr->pdu_len)
+			continue;
+		end = sc->pos + sizeof(*hdr) + hdr->pdu_len;
+		if (end == sc->len
+		    || (snap_header_at(sc, end, &next)
+			&& (int32_t) (next.sequence - hdr->sequence) > 0))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ *	dump_relayfs - write out a flight recorder snapshot, for -s
+ *
+ *	Has the module freeze its buffers and skip what is older than
+ *	asked for, then reads what is left of each whole.  Stream mode
+ *	output is put back in sequence across the cpus; bulk mode output
+ *	goes to each cpu's file as usual.  Returns 0 if successful,
+ *	negative otherwise.
+ */
+static int dump_relayfs(void)
+{
+	struct _stp_msg_snapshot snap = { .seconds = snapshot_secs };
+	struct snap_cpu *sc;
+	struct _stp_trace hdr;
+	int i, cpu, o, rc = -1;
+	size_t size;
+	ssize_t n;
+
+	if (send_request(STP_SNAPSHOT, &snap, sizeof(snap)) != 0) {
+		err("The module doesn't support snapshots.\n");
+		return -1;
+	}
+
+	sc = calloc(ncpus, sizeof(*sc));
+	if (sc == NULL) {
+		_err("Memory allocation failed\n");
+		return -1;
+	}
+	for (i = 0; i < ncpus; i++) {
+		size = 0;
+		for (;;) {
+			if (size - sc[i].len < RECORD_MAX) {
+				char *p;
+
+				size = size ? 2 * size : 4 * RECORD_MAX;
+				p = realloc(sc[i].buf, size);
+				if (p == NULL) {
+					_err("Memory allocation failed\n");
+					goto out;
+				}
+				sc[i].buf = p;
+			}
+			n = read(relay_fd[avail_cpus[i]], sc[i].buf + sc[i].len,
+				 size - sc[i].len);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) /* ENODATA once it's all read */
+				break;
+			sc[i].len += n;
+		}
+		dbug(2, "cpu %d: %zu bytes in snapshot\n", avail_cpus[i], sc[i].len);
+	}
+
+	if (bulkmode) {
+		for (i = 0; i < ncpus; i++) {
+			cpu = avail_cpus[i];
+			while (snap_next_record(&sc[i], &hdr)) {
+				if (out_write(cpu, sc[i].buf + sc[i].pos,
+					      sizeof(hdr) + hdr.pdu_len) < 0)
+					goto write_error;
+				sc[i].pos += sizeof(hdr) + hdr.pdu_len;
+			}
+			if (out_sync(cpu) < 0)
+				goto write_error;
+		}
+		rc = 0;
+		goto out;
+	}
+
+	/* Stream mode: always take the lowest sequence number next. */
+	o = avail_cpus[0];
+	for (;;) {
+		struct _stp_trace best_hdr;
+		int best = -1;
+
+		for (i = 0; i < ncpus; i++) {
+			if (!snap_next_record(&sc[i], &hdr))
+				continue;
+			if (best < 0
+			    || (int32_t) (hdr.sequence - best_hdr.sequence) < 0) {
+				best = i;
+				best_hdr = hdr;
+			}
+		}
+		if (best < 0)
+			break;
+		if (out_write(o, sc[best].buf + sc[best].pos + sizeof(hdr),
+			      best_hdr.pdu_len) < 0)
+			goto write_error;
+		sc[best].pos += sizeof(hdr) + best_hdr.pdu_len;
+	}
+	if (out_sync(o) < 0)
+		goto write_error;
+	rc = 0;
+	goto out;
+
+write_error:
+	perr("Couldn't write the snapshot");
+out:
+	for (i = 0; i < ncpus; i++)
+		free(sc[i].buf);
+	free(sc);
+	return rc;
+}
+
 static void switchfile_handler(int sig)
 {
 	int i;
-	if (stop_threads || !outfile_name)
+	/* -m writes out whole sub-buffers, which needn't end on a
+	   record boundary, so it doesn't switch files. */
+	if (stop_threads || !outfile_name || relay_mmap)
 		return;
 
+	if (npool) {
+		for (i = 0; i < ncpus; i++) {
+			pthread_mutex_lock(&mutex[avail_cpus[i]]);
+			switch_file[avail_cpus[i]] = 1;
+			pthread_mutex_unlock(&mutex[avail_cpus[i]]);
+		}
+		for (i = 0; i < npool; i++)
+			if (!pthread_equal(pthread_self(), pool[i]))
+				pthread_kill(pool[i], SIGUSR2);
+		return;
+	}
+
 	for (i = 0; i < ncpus; i++) {
 		pthread_mutex_lock(&mutex[avail_cpus[i]]);
 		if (reader[avail_cpus[i]] && switch_file[avail_cpus[i]]) {
@@ -444,6 +1369,17 @@ int init_relayfs(void)
         if (load_only)
                 return 0;
 
+	if (relay_mmap && !bulkmode) {
+		warn("The -m option only has an effect in bulk mode.\n");
+		relay_mmap = 0;
+	}
+	if (relay_mmap && map_relayfs() < 0)
+		return -1;
+	if (reader_pool && !bulkmode) {
+		warn("The -P option only has an effect in bulk mode.\n");
+		reader_pool = 0;
+	}
+
 	if (fsize_max) {
 		/* switch file mode */
 		for (i = 0; i < ncpus; i++) {
@@ -454,7 +1390,13 @@ int init_relayfs(void)
 		}
 	} else if (bulkmode) {
 		for (i = 0; i < ncpus; i++) {
-			if (outfile_name) {
+			if (outfile_name && is_sink_uri(outfile_name)) {
+				/* one connection per cpu */
+				out_sink[avail_cpus[i]] = sink_open(outfile_name);
+				if (out_sink[avail_cpus[i]] == NULL)
+					return -1;
+				continue;
+			} else if (outfile_name) {
 				/* special case: for testing we sometimes want to write to /dev/null */
 				if (strcmp(outfile_name, "/dev/null") == 0) {
 					/* This strcpy() is OK, since
@@ -485,7 +1427,11 @@ int init_relayfs(void)
 		}
 	} else {
 		/* stream mode */
-		if (outfile_name) {
+		if (outfile_name && is_sink_uri(outfile_name)) {
+			out_sink[avail_cpus[0]] = sink_open(outfile_name);
+			if (out_sink[avail_cpus[0]] == NULL)
+				return -1;
+		} else if (outfile_name) {
 			len = stap_strfloctime(buf, PATH_MAX,
 						 outfile_name, time(NULL));
 			if (len < 0) {
@@ -501,6 +1447,14 @@ int init_relayfs(void)
 			out_fd[avail_cpus[0]] = STDOUT_FILENO;
 	}
 
+	if (compress_output) {
+		for (i = 0; i < ncpus; i++) {
+			if ((i == 0 || bulkmode || fsize_max)
+			    && init_compress(avail_cpus[i]) < 0)
+				return -1;
+		}
+	}
+
         memset(&sa, 0, sizeof(sa));
         sa.sa_handler = switchfile_handler;
         sa.sa_flags = 0;
@@ -514,8 +1468,14 @@ int init_relayfs(void)
                         return -1;
 		}
 	}
+	if (snapshot_secs)
+		return dump_relayfs();
+	if (reader_pool)
+		return start_pool();
+
         for (i = 0; i < ncpus; i++) {
-                if (pthread_create(&reader[avail_cpus[i]], NULL, reader_thread,
+                if (pthread_create(&reader[avail_cpus[i]], NULL,
+                                   relay_mmap ? mmap_reader_thread : reader_thread,
                                    (void *)(long)avail_cpus[i]) < 0) {
                         _perr("failed to create thread");
                         return -1;
@@ -530,6 +1490,8 @@ void close_relayfs(void)
 	int i;
 	stop_threads = 1;
 	dbug(2, "closing\n");
+	if (npool)
+		stop_pool(0);
 	for (i = 0; i < ncpus; i++) {
 		if (reader[avail_cpus[i]])
 			pthread_kill(reader[avail_cpus[i]], SIGUSR2);
@@ -542,6 +1504,23 @@ void close_relayfs(void)
 		else
 			break;
 	}
+	unmap_relayfs();
+	if (!bulkmode) {
+		/* What's still queued has nothing more to wait for. */
+		if (merge_write(0, 1) < 0)
+			err("Couldn't write out the last of the output\n");
+		for (i = 0; i < ncpus; i++) {
+			free(merge_cpus[avail_cpus[i]].buf);
+			merge_cpus[avail_cpus[i]].buf = NULL;
+		}
+	}
+	for (i = 0; i < ncpus; i++) {
+		if (out_sink[avail_cpus[i]]
+		    || (compress_output && (i == 0 || bulkmode || fsize_max))) {
+			out_close(avail_cpus[i]);
+			free_compress(avail_cpus[i]);
+		}
+	}
 	for (i = 0; i < ncpus; i++) {
 		if (relay_fd[avail_cpus[i]] >= 0)
 			close(relay_fd[avail_cpus[i]]);
@@ -559,6 +1538,8 @@ void kill_relayfs(void)
 	int i;
 	stop_threads = 1;
 	dbug(2, "killing\n");
+	if (npool)
+		stop_pool(1);
 	for (i = 0; i < ncpus; i++) {
 		if (reader[avail_cpus[i]])
 			pthread_kill(reader[avail_cpus[i]], SIGUSR2);
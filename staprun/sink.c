@@ -0,0 +1,283 @@
+/* -*- linux-c -*-
+ *
+ * sink.c - stapio output to a tcp or unix socket, for -o URI
+ *
+ * This file is part of systemtap, and is free software.  You can
+ * redistribute it and/or modify it under the terms of the GNU General
+ * Public License (GPL); either version 2, or (at your option) any
+ * later version.
+ *
+ * Copyright (C) 2024 Red Hat Inc.
+ */
+
+#include "staprun.h"
+#include <netdb.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Output is gathered into batches of SINK_BATCH bytes before it is sent,
+   unless the reader asks for it to go out sooner.  Up to SINK_BUFSIZE
+   bytes wait while the receiver is slow or away; past that, the reader
+   waits too, and the module's own buffers take up the slack. */
+#define SINK_BATCH (64*1024)
+#define SINK_BUFSIZE (4*1024*1024)
+
+struct sink {
+	const char *uri;
+	char *host, *port;	/* tcp://HOST:PORT */
+	char *path;		/* unix://PATH */
+	int fd;
+	char *buf;
+	size_t head, len;	/* unsent data is buf[head, head+len) */
+	pthread_mutex_t lock;
+};
+
+/**
+ *	sink_connect - (re)connect a sink to its receiver
+ *
+ *	Returns the new socket, or -1.
+ */
+static int sink_connect(struct sink *s)
+{
+	int fd = -1, one = 1;
+
+	if (s->path) {
+		struct sockaddr_un addr;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(s->path) >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(addr.sun_path, s->path);
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *) &addr,
+				       sizeof(addr)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		struct addrinfo hints, *res, *ai;
+		int rc;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		rc = getaddrinfo(s->host, s->port, &hints, &res);
+		if (rc != 0) {
+			dbug(2, "%s: %s\n", s->uri, gai_strerror(rc));
+			errno = EHOSTUNREACH;
+			return -1;
+		}
+		for (ai = res; ai; ai = ai->ai_next) {
+			fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+				    ai->ai_protocol);
+			if (fd < 0)
+				continue;
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd >= 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+
+	/* Sends don't block; sink_flush() waits for room itself. */
+	if (fd >= 0)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+/**
+ *	sink_open - connect to a -o URI
+ *
+ *	Returns the sink, or NULL after reporting an error.
+ */
+struct sink *sink_open(const char *uri)
+{
+	struct sink *s = calloc(1, sizeof(*s));
+	char *colon;
+
+	if (s == NULL || (s->buf = malloc(SINK_BUFSIZE)) == NULL) {
+		_err("Memory allocation failed\n");
+		free(s);
+		return NULL;
+	}
+	s->uri = uri;
+	pthread_mutex_init(&s->lock, NULL);
+
+	if (strncmp(uri, "unix://", 7) == 0)
+		s->path = strdup(uri + 7);
+	else {
+		/* tcp://HOST:PORT, where an IPv6 HOST is in brackets. */
+		s->host = strdup(uri + 6);
+		colon = s->host ? strrchr(s->host, ':') : NULL;
+		if (colon == NULL || colon[1] == '\0') {
+			err("Missing port in output URI '%s'\n", uri);
+			goto error;
+		}
+		*colon = '\0';
+		s->port = colon + 1;
+		if (s->host[0] == '[' && colon[-1] == ']') {
+			colon[-1] = '\0';
+			memmove(s->host, s->host + 1, strlen(s->host));
+		}
+	}
+
+	s->fd = sink_connect(s);
+	if (s->fd < 0) {
+		perr("Couldn't connect to %s", uri);
+		goto error;
+	}
+	dbug(2, "connected to %s\n", uri);
+	return s;
+
+error:
+	free(s->host);
+	free(s->path);
+	free(s->buf);
+	free(s);
+	return NULL;
+}
+
+/**
+ *	sink_reconnect - replace a broken connection
+ *
+ *	Tries once a second until it succeeds or stapio is stopping.
+ *	What's still unsent is sent on the new connection.
+ */
+static int sink_reconnect(struct sink *s)
+{
+	warn("Lost connection to %s, reconnecting.\n", s->uri);
+	close(s->fd);
+	for (;;) {
+		s->fd = sink_connect(s);
+		if (s->fd >= 0)
+			break;
+		if (stop_threads)
+			return -1;
+		sleep(1);
+	}
+	warn("Reconnected to %s.\n", s->uri);
+	return 0;
+}
+
+/**
+ *	sink_flush - send what has built up
+ *	@s: the sink
+ *	@room: how much must be free in the buffer afterwards
+ *
+ *	Sends as much as the socket takes without waiting, and then waits
+ *	only as long as needed to make @room.  Pass SINK_BUFSIZE to send
+ *	everything.  Call with @s->lock held.  Returns 0 if successful,
+ *	negative otherwise.
+ */
+static int sink_flush(struct sink *s, size_t room)
+{
+	while (s->len) {
+		ssize_t rc = send(s->fd, s->buf + s->head, s->len,
+				  MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc > 0) {
+			s->head += rc;
+			s->len -= rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { .fd = s->fd, .events = POLLOUT };
+			int n;
+
+			if (SINK_BUFSIZE - s->len >= room)
+				break;
+			/* Back-pressure: wait for the receiver, but not
+			   past a second without progress once stopping. */
+			n = poll(&pfd, 1, 1000);
+			if (n > 0 || (n < 0 && errno == EINTR))
+				continue;
+			if (n == 0 && !stop_threads)
+				continue;
+			if (n == 0) {
+				err("Gave up sending %zu bytes to %s\n",
+				    s->len, s->uri);
+				return -1;
+			}
+		}
+		dbug(2, "send to %s: %s\n", s->uri, strerror(errno));
+		if (sink_reconnect(s) < 0)
+			return -1;
+	}
+
+	/* Keep the unsent data at the front. */
+	if (s->head) {
+		memmove(s->buf, s->buf + s->head, s->len);
+		s->head = 0;
+	}
+	return 0;
+}
+
+/**
+ *	sink_write - queue output for a sink, sending it once a batch is ready
+ *
+ *	Returns 0 if successful, negative otherwise.
+ */
+int sink_write(struct sink *s, const void *data, size_t len)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&s->lock);
+	while (len && rc == 0) {
+		size_t n = len;
+
+		if (s->len + n > SINK_BUFSIZE)
+			rc = sink_flush(s, n < SINK_BUFSIZE ? n : SINK_BUFSIZE);
+		if (rc == 0) {
+			if (n > SINK_BUFSIZE - s->len)
+				n = SINK_BUFSIZE - s->len;
+			memcpy(s->buf + s->len, data, n);
+			s->len += n;
+			data = (const char *) data + n;
+			len -= n;
+			if (s->len >= SINK_BATCH)
+				rc = sink_flush(s, 0);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return rc;
+}
+
+/**
+ *	sink_sync - send what's queued without waiting, at the end of a batch
+ */
+int sink_sync(struct sink *s)
+{
+	int rc;
+
+	pthread_mutex_lock(&s->lock);
+	rc = sink_flush(s, 0);
+	pthread_mutex_unlock(&s->lock);
+	return rc;
+}
+
+/**
+ *	sink_close - send everything that's left and disconnect
+ */
+int sink_close(struct sink *s)
+{
+	int rc;
+
+	pthread_mutex_lock(&s->lock);
+	rc = sink_flush(s, SINK_BUFSIZE);
+	pthread_mutex_unlock(&s->lock);
+	close(s->fd);
+	pthread_mutex_destroy(&s->lock);
+	free(s->host);
+	free(s->path);
+	free(s->buf);
+	free(s);
+	return rc;
+}
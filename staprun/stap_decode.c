@@ -0,0 +1,403 @@
+/*
+ * stap_decode.c - render binary systemtap printf records
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Red Hat Inc, 2024
+ *
+ * Reads the output of a script run with stap --output-format=binary,
+ * where printf writes NUL-framed records instead of text (see
+ * runtime/vsprintf.h), and formats them offline as text, JSON or CSV.
+ * Anything outside of a record is output text from other sources,
+ * and is passed through.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+enum out_format { OUT_TEXT, OUT_JSON, OUT_CSV };
+
+/* One argument of an event record. */
+struct arg {
+	int64_t num;
+	const char *str;	/* for %s, else NULL */
+	uint32_t len;
+};
+
+static char **formats;
+static uint32_t nformats;
+
+static void usage (char *prog)
+{
+	fprintf(stderr, "%s [-f text|json|csv] [-o output_filename] [input_file]\n", prog);
+	exit(-1);
+}
+
+static void *xrealloc (void *p, size_t size)
+{
+	p = realloc(p, size);
+	if (p == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	return p;
+}
+
+static void read_all (FILE *fp, void *buf, size_t len)
+{
+	if (len && fread(buf, len, 1, fp) != 1) {
+		fprintf(stderr, "truncated record\n");
+		exit(-3);
+	}
+}
+
+/* Output a string quoted for JSON or CSV. */
+static void put_quoted (FILE *ofp, const char *s, size_t len, enum out_format fmt)
+{
+	size_t i;
+
+	fputc('"', ofp);
+	for (i = 0; i < len; i++) {
+		unsigned char c = s[i];
+		if (fmt == OUT_CSV) {
+			if (c == '"')
+				fputc('"', ofp);
+			fputc(c, ofp);
+		} else if (c == '"' || c == '\\')
+			fprintf(ofp, "\\%c", c);
+		else if (c == '\n')
+			fputs("\\n", ofp);
+		else if (c == '\t')
+			fputs("\\t", ofp);
+		else if (c < 0x20)
+			fprintf(ofp, "\\u%04x", c);
+		else
+			fputc(c, ofp);
+	}
+	fputc('"', ofp);
+}
+
+/* Output text that was not part of a record. */
+static void put_text (FILE *ofp, const char *s, size_t len, enum out_format fmt)
+{
+	if (len == 0)
+		return;
+	if (fmt == OUT_TEXT) {
+		fwrite(s, len, 1, ofp);
+		return;
+	}
+	fputs(fmt == OUT_JSON ? "{\"text\":" : "text,", ofp);
+	put_quoted(ofp, s, len, fmt);
+	fputs(fmt == OUT_JSON ? "}\n" : "\n", ofp);
+}
+
+/* One conversion of a format string. */
+struct conv {
+	char flags[8];
+	int width, prec;		/* -1 if unspecified */
+	int dyn_width, dyn_prec;	/* given as '*' */
+	char type;
+};
+
+/* Parse the conversion at p, just after its '%', into cv.  Returns
+ * the position after it. */
+static const char *parse_conv (const char *p, struct conv *cv)
+{
+	size_t n = 0;
+
+	memset(cv, 0, sizeof(*cv));
+	cv->width = cv->prec = -1;
+	while (*p && strchr("0+ -#", *p)) {
+		if (n < sizeof(cv->flags) - 2)
+			cv->flags[n++] = *p;
+		p++;
+	}
+	if (*p == '*') {
+		cv->dyn_width = 1;
+		p++;
+	} else if (*p >= '0' && *p <= '9')
+		cv->width = strtol(p, (char **) &p, 10);
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			cv->dyn_prec = 1;
+			p++;
+		} else
+			cv->prec = strtol(p, (char **) &p, 10);
+	}
+	while (*p == 'l' || *p == 'h' || *p == 'z')
+		p++;
+	cv->type = *p;
+	return *p ? p + 1 : p;
+}
+
+/* Take the next int64 argument out of an event record. */
+static int get_num (const char *data, uint32_t len, uint32_t *off,
+		    struct arg *arg)
+{
+	if (*off + sizeof(int64_t) > len)
+		return 0;
+	memcpy(&arg->num, data + *off, sizeof(int64_t));
+	arg->str = NULL;
+	*off += sizeof(int64_t);
+	return 1;
+}
+
+/* Decode the arguments of an event record according to format f. */
+static unsigned decode_args (const char *f, const char *data, uint32_t len,
+			     struct arg *args, unsigned max)
+{
+	unsigned n = 0;
+	uint32_t off = 0;
+	struct conv cv;
+
+	while (*f && n + 3 <= max) {
+		if (*f++ != '%')
+			continue;
+		if (*f == '%') {
+			f++;
+			continue;
+		}
+		f = parse_conv(f, &cv);
+		/* dynamic width and precision come first */
+		if (cv.dyn_width && !get_num(data, len, &off, &args[n++]))
+			return n - 1;
+		if (cv.dyn_prec && !get_num(data, len, &off, &args[n++]))
+			return n - 1;
+		if (cv.type == 's') {
+			uint32_t slen;
+			if (off + sizeof(slen) > len)
+				break;
+			memcpy(&slen, data + off, sizeof(slen));
+			off += sizeof(slen);
+			if (off + slen > len)
+				break;
+			args[n].str = data + off;
+			args[n++].len = slen;
+			off += slen;
+		} else if (!get_num(data, len, &off, &args[n++]))
+			return n - 1;
+	}
+	return n;
+}
+
+/* Render an event record as text, the way the runtime would have. */
+static void put_event_text (FILE *ofp, const char *f, struct arg *args, unsigned nargs)
+{
+	unsigned a = 0;
+	char cfmt[32];
+	struct conv cv;
+	int width, prec, size;
+
+	while (*f) {
+		if (*f != '%') {
+			fputc(*f++, ofp);
+			continue;
+		}
+		f++;
+		if (*f == '%') {
+			fputc(*f++, ofp);
+			continue;
+		}
+		f = parse_conv(f, &cv);
+
+		width = cv.width;
+		prec = cv.prec;
+		if (cv.dyn_width && a < nargs)
+			width = args[a++].num;
+		if (cv.dyn_prec && a < nargs)
+			prec = args[a++].num;
+		if (a >= nargs)
+			return;
+		if (width < 0)
+			width = 0;
+
+		switch (cv.type) {
+		case 's':
+			if (prec < 0 || prec > (int) args[a].len)
+				prec = args[a].len;
+			snprintf(cfmt, sizeof(cfmt), "%%%s*.*s", cv.flags);
+			fprintf(ofp, cfmt, width, prec, args[a].str ? args[a].str : "");
+			break;
+		case 'c':
+			snprintf(cfmt, sizeof(cfmt), "%%%s*c", cv.flags);
+			fprintf(ofp, cfmt, width, (int) args[a].num);
+			break;
+		case 'b':
+			/* raw binary, of the given byte width */
+			size = (width == 1 || width == 2 || width == 4) ? width : 8;
+			fwrite(&args[a].num, size, 1, ofp);
+			break;
+		case 'p':
+			if (args[a].num == 0) {
+				fprintf(ofp, "%*s", width, "0x0");
+				break;
+			}
+			cv.type = 'x';
+			if (!strchr(cv.flags, '#'))
+				strcat(cv.flags, "#");
+			/* fallthrough */
+		default:
+			if (!cv.type || !strchr("diouxX", cv.type)) {
+				fprintf(stderr, "unknown conversion %%%c\n", cv.type);
+				break;
+			}
+			snprintf(cfmt, sizeof(cfmt), "%%%s*.*ll%c", cv.flags, cv.type);
+			if (cv.type == 'd' || cv.type == 'i')
+				fprintf(ofp, cfmt, width, prec, (long long) args[a].num);
+			else
+				fprintf(ofp, cfmt, width, prec,
+					(unsigned long long) args[a].num);
+			break;
+		}
+		a++;
+	}
+}
+
+static void put_event (FILE *ofp, uint32_t id, const char *data, uint32_t len,
+		       enum out_format fmt)
+{
+	struct arg args[128];
+	unsigned i, nargs;
+
+	if (id >= nformats || formats[id] == NULL) {
+		fprintf(stderr, "record for unknown format %u\n", id);
+		return;
+	}
+	nargs = decode_args(formats[id], data, len, args, 128);
+
+	if (fmt == OUT_TEXT) {
+		put_event_text(ofp, formats[id], args, nargs);
+		return;
+	}
+
+	if (fmt == OUT_JSON) {
+		fprintf(ofp, "{\"id\":%u,\"format\":", id);
+		put_quoted(ofp, formats[id], strlen(formats[id]), fmt);
+		fputs(",\"args\":[", ofp);
+	} else
+		fprintf(ofp, "%u", id);
+	for (i = 0; i < nargs; i++) {
+		if (fmt == OUT_JSON && i > 0)
+			fputc(',', ofp);
+		else if (fmt == OUT_CSV)
+			fputc(',', ofp);
+		if (args[i].str)
+			put_quoted(ofp, args[i].str, args[i].len, fmt);
+		else
+			fprintf(ofp, "%lld", (long long) args[i].num);
+	}
+	fputs(fmt == OUT_JSON ? "]}\n" : "\n", ofp);
+}
+
+int main (int argc, char *argv[])
+{
+	char *buf = NULL, *text = NULL, *outfile_name = NULL;
+	size_t bufsize = 0, textlen = 0, textsize = 0;
+	enum out_format fmt = OUT_TEXT;
+	FILE *fp = stdin, *ofp = stdout;
+	int c;
+
+	while ((c = getopt (argc, argv, "f:o:")) != EOF)  {
+		switch (c) {
+		case 'f':
+			if (!strcmp(optarg, "text"))
+				fmt = OUT_TEXT;
+			else if (!strcmp(optarg, "json"))
+				fmt = OUT_JSON;
+			else if (!strcmp(optarg, "csv"))
+				fmt = OUT_CSV;
+			else
+				usage(argv[0]);
+			break;
+		case 'o':
+			outfile_name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind + 1 < argc)
+		usage (argv[0]);
+	if (optind < argc) {
+		fp = fopen(argv[optind], "r");
+		if (!fp) {
+			fprintf(stderr, "error opening file %s.\n", argv[optind]);
+			return -1;
+		}
+	}
+	if (outfile_name) {
+		ofp = fopen(outfile_name, "w");
+		if (!ofp) {
+			fprintf(stderr, "ERROR: couldn't open output file %s: errcode = %s\n",
+				outfile_name, strerror(errno));
+			return -1;
+		}
+	}
+
+	while ((c = getc(fp)) != EOF) {
+		uint32_t id, len;
+		int type;
+
+		if (c != '\0') {
+			if (textlen == textsize) {
+				textsize = textsize ? 2 * textsize : 4096;
+				text = xrealloc(text, textsize);
+			}
+			text[textlen++] = c;
+			continue;
+		}
+
+		put_text(ofp, text, textlen, fmt);
+		textlen = 0;
+
+		type = getc(fp);
+		if (type != 'S' && type != 'E') {
+			fprintf(stderr, "bad record type %d\n", type);
+			return -3;
+		}
+		read_all(fp, &id, sizeof(id));
+		read_all(fp, &len, sizeof(len));
+		if (len + 1 > bufsize) {
+			bufsize = len + 1;
+			buf = xrealloc(buf, bufsize);
+		}
+		read_all(fp, buf, len);
+
+		if (type == 'S') {
+			if (id >= nformats) {
+				formats = xrealloc(formats, (id + 1) * sizeof(char *));
+				memset(formats + nformats, 0,
+				       (id + 1 - nformats) * sizeof(char *));
+				nformats = id + 1;
+			}
+			free(formats[id]);
+			formats[id] = xrealloc(NULL, len + 1);
+			memcpy(formats[id], buf, len);
+			formats[id][len] = '\0';
+		} else
+			put_event(ofp, id, buf, len, fmt);
+	}
+	put_text(ofp, text, textlen, fmt);
+
+	if (fp != stdin)
+		fclose(fp);
+	fclose(ofp);
+	return 0;
+}
@@ -18,38 +18,560 @@
  *
  */
 
+#include "../config.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
 
 static void usage (char *prog)
 {
-	fprintf(stderr, "%s [-v] [-o output_filename] input_files ...\n", prog);
+	fprintf(stderr, "%s [-v] [-j jobs] [-o output_filename] input_files ...\n", prog);
 	exit(-1);
 }
 
-#define TIMESTAMP_SIZE (sizeof(int))
+/* The record header written by stapio in bulk mode; see struct
+ * _stp_trace in runtime/transport/transport_msgs.h. */
+struct trace_hdr {
+	uint32_t sequence;	/* per-cpu event number */
+	uint32_t pdu_len;	/* length of data after this header */
+	uint64_t timestamp;	/* trace clock ns */
+};
+
 #define MAX_NR_CPUS 1024
 
-int main (int argc, char *argv[])
+#ifdef HAVE_LIBZSTD
+/* An input file written by stapio -z, read through a zstd stream. */
+struct zstd_input {
+	FILE *fp;
+	ZSTD_DCtx *dctx;
+	ZSTD_inBuffer in;
+	char *buf;
+	size_t size;
+	int eof;		/* the file is all read */
+};
+
+static ssize_t zstd_read (void *cookie, char *data, size_t len)
 {
-	char *buf, *outfile_name = NULL;
-	int c, i, j, rc, dropped=0;
-	long count=0, min, num[MAX_NR_CPUS] = { 0 };
-	FILE *ofp = NULL;
-	FILE *fp[MAX_NR_CPUS] = { 0 };
-	int ncpus, len, verbose = 0;
-	int bufsize = 65536;
+	struct zstd_input *z = cookie;
+	ZSTD_outBuffer out = { data, len, 0 };
+
+	while (out.pos == 0) {
+		size_t rc;
+		if (z->in.pos == z->in.size && !z->eof) {
+			z->in.size = fread ((char *) z->buf, 1, z->size, z->fp);
+			z->in.pos = 0;
+			if (z->in.size == 0)
+				z->eof = 1;
+		}
+		/* At EOF this still drains what the decoder holds back. */
+		rc = ZSTD_decompressStream (z->dctx, &out, &z->in);
+		if (ZSTD_isError (rc)) {
+			fprintf(stderr, "zstd error: %s\n", ZSTD_getErrorName (rc));
+			errno = EIO;
+			return -1;
+		}
+		if (z->eof && out.pos == 0) {
+			/* Nothing more comes out; a frame should have ended. */
+			if (rc != 0) {
+				fprintf(stderr, "zstd error: truncated input\n");
+				errno = EIO;
+				return -1;
+			}
+			break;
+		}
+	}
+	return out.pos;
+}
+
+static int zstd_close (void *cookie)
+{
+	struct zstd_input *z = cookie;
+	int rc = fclose (z->fp);
+
+	ZSTD_freeDCtx (z->dctx);
+	free (z->buf);
+	free (z);
+	return rc;
+}
+#endif
+
+/* An input file.  Plain files are mapped; others, such as compressed
+ * ones or pipes, are read with stdio. */
+struct input {
+	FILE *fp;		/* when not mapped */
+	char *buf;		/* data of the current record, for fp */
+	size_t bufsize;
+	int mapped;
+	const char *map;
+	size_t size;
+	/* for the parallel merge */
+	struct sample *samples;
+	size_t nsamples;
+	uint32_t last;
+	int dropped;
+};
+
+/* A position in an input: the next record to read from, and where to
+ * stop.  The whole file, or one chunk of it for the parallel merge. */
+struct cursor {
+	struct input *in;
+	size_t pos, end;
+	struct trace_hdr hdr;	/* the current record */
+	const char *data;
+};
+
+/* Every SAMPLE_BYTES or so of each mapped input, the scan notes the
+ * timestamp there, from which the parallel merge picks its chunks. */
+#define SAMPLE_BYTES (1024*1024)
+struct sample {
+	uint64_t timestamp;
+	size_t pos;		/* offset of the record */
+	uint64_t bytes;		/* data bytes in the records before it */
+};
+
+#define OUTPUT_BUFSIZE (1024*1024)
+
+/* Where merged data goes: a stdio stream, or with the parallel merge,
+ * a region of the output file written with pwrite(). */
+struct output {
+	FILE *fp;
+	int fd;
+	off_t off;
+	char *buf;
+	size_t len;
+};
+
+/* Open input file name into in, mapping it if we can, decompressing it
+ * as it is read if it is a zstd stream, as stapio -z writes. */
+static int open_input (const char *name, struct input *in)
+{
+	struct stat st;
+	int fd = open (name, O_RDONLY);
+#ifdef HAVE_LIBZSTD
+	static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+	unsigned char magic[4];
+	struct zstd_input *z;
+	cookie_io_functions_t io = { .read = zstd_read, .close = zstd_close };
+	int zstd;
+#endif
+
+	memset (in, 0, sizeof(*in));
+	if (fd < 0)
+		return -1;
+
+#ifdef HAVE_LIBZSTD
+	zstd = pread (fd, magic, sizeof(magic), 0) == sizeof(magic)
+		&& memcmp (magic, zstd_magic, sizeof(magic)) == 0;
+	if (!zstd)
+#endif
+	if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode)) {
+		in->size = st.st_size;
+		in->mapped = 1;
+		if (in->size) {
+			in->map = mmap (NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (in->map == MAP_FAILED)
+				in->mapped = 0;
+			else
+				madvise ((void *) in->map, in->size, MADV_SEQUENTIAL);
+		}
+		if (in->mapped) {
+			close (fd);
+			return 0;
+		}
+	}
+
+	in->fp = fdopen (fd, "r");
+	if (!in->fp)
+		return -1;
+#ifdef HAVE_LIBZSTD
+	if (zstd) {
+		z = calloc (1, sizeof(*z));
+		if (z == NULL || (z->dctx = ZSTD_createDCtx ()) == NULL
+		    || (z->buf = malloc (z->size = ZSTD_DStreamInSize ())) == NULL) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(-2);
+		}
+		z->fp = in->fp;
+		z->in.src = z->buf;
+		in->fp = fopencookie (z, "r", io);
+		if (!in->fp)
+			return -1;
+	}
+#endif
+	return 0;
+}
+
+static void close_input (struct input *in)
+{
+	if (in->fp)
+		fclose (in->fp);
+	if (in->map)
+		munmap ((void *) in->map, in->size);
+	free (in->buf);
+	free (in->samples);
+}
+
+/* Read the record at c into c->hdr and c->data, and move past it.
+ * Returns 0 at the end of c. */
+static int next_record (struct cursor *c)
+{
+	struct input *in = c->in;
+	int rc;
+
+	if (in->mapped) {
+		if (c->end - c->pos < sizeof(c->hdr))
+			return 0;
+		memcpy (&c->hdr, in->map + c->pos, sizeof(c->hdr));
+		if (c->end - c->pos - sizeof(c->hdr) < c->hdr.pdu_len) {
+			fprintf(stderr, "truncated record at offset %zu\n", c->pos);
+			exit(-3);
+		}
+		c->data = in->map + c->pos + sizeof(c->hdr);
+		c->pos += sizeof(c->hdr) + c->hdr.pdu_len;
+		return 1;
+	}
+
+	if (fread (&c->hdr, sizeof(c->hdr), 1, in->fp) != 1) {
+		if (ferror (in->fp)) {
+			fprintf(stderr, "ERROR: couldn't read input\n");
+			exit(-3);
+		}
+		return 0;
+	}
+	if (c->hdr.pdu_len > in->bufsize) {
+		in->bufsize = c->hdr.pdu_len;
+		in->buf = realloc(in->buf, in->bufsize);
+		if (in->buf == NULL) {
+			fprintf(stderr, "Memory allocation failed.\n");
+			exit(-2);
+		}
+	}
+	if (c->hdr.pdu_len
+	    && (rc = fread(in->buf, c->hdr.pdu_len, 1, in->fp)) <= 0) {
+		fprintf(stderr, "fread error: got %d\n", rc);
+		exit(-3);
+	}
+	c->data = in->buf;
+	return 1;
+}
+
+static void flush_output (struct output *o)
+{
+	size_t done = 0;
+
+	while (done < o->len) {
+		ssize_t rc = pwrite (o->fd, o->buf + done, o->len - done, o->off);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0) {
+			fprintf(stderr, "ERROR: couldn't write output: %s\n",
+				strerror(errno));
+			exit(-3);
+		}
+		done += rc;
+		o->off += rc;
+	}
+	o->len = 0;
+}
+
+static void write_output (struct output *o, const char *data, size_t len)
+{
+	if (o->fp) {
+		if (len && fwrite(data, len, 1, o->fp) != 1) {
+			fprintf(stderr, "fwrite error\n");
+			exit(-3);
+		}
+		return;
+	}
+	if (o->len + len > OUTPUT_BUFSIZE)
+		flush_output (o);
+	if (len > OUTPUT_BUFSIZE) {
+		o->buf = (char *) data;	/* write it straight from the input */
+		o->len = len;
+		flush_output (o);
+		o->buf = NULL;
+		return;
+	}
+	if (o->buf == NULL && (o->buf = malloc(OUTPUT_BUFSIZE)) == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	memcpy (o->buf + o->len, data, len);
+	o->len += len;
+}
+
+/* Is the current record of cursor a older than that of cursor b?  Ties
+ * go to the earlier input, i.e. by (timestamp, cpu, sequence). */
+static int older (struct cursor c[], int a, int b)
+{
+	return c[a].hdr.timestamp < c[b].hdr.timestamp
+		|| (c[a].hdr.timestamp == c[b].hdr.timestamp && a < b);
+}
+
+static void sift_down (struct cursor c[], int heap[], int n, int i)
+{
+	for (;;) {
+		int l = 2*i + 1, r = l + 1, m = i, t;
+		if (l < n && older (c, heap[l], heap[m]))
+			m = l;
+		if (r < n && older (c, heap[r], heap[m]))
+			m = r;
+		if (m == i)
+			return;
+		t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+		i = m;
+	}
+}
+
+/* Merge the records of cursors c[0..n) into o, oldest first, keeping
+ * the cursors in a heap ordered by their current record.  With last,
+ * checks each input's sequence numbers and counts the drops. */
+static void merge (struct cursor c[], int n, struct output *o, int verbose,
+		   uint32_t last[], int *dropped)
+{
+	int *heap = malloc(n * sizeof(int));
+	int i, j, nheap = 0;
+
+	if (heap == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	for (i = 0; i < n; i++)
+		if (next_record (&c[i]))
+			heap[nheap++] = i;
+	for (i = nheap / 2 - 1; i >= 0; i--)
+		sift_down (c, heap, nheap, i);
+
+	while (nheap) {
+		j = heap[0];
+		if (verbose)
+			fprintf(stdout, "[CPU:%d, seq=%u, time=%llu, length=%u]\n", j,
+				c[j].hdr.sequence,
+				(unsigned long long) c[j].hdr.timestamp,
+				c[j].hdr.pdu_len);
+		write_output (o, c[j].data, c[j].hdr.pdu_len);
 
-	buf = malloc(bufsize);
-	if (buf == NULL) {
+		if (last) {
+			if (c[j].hdr.sequence != last[j] + 1) {
+				fprintf(stderr, "cpu %d: got %u. expected %u\n", j,
+					c[j].hdr.sequence, last[j] + 1);
+				*dropped += c[j].hdr.sequence - last[j] - 1;
+			}
+			last[j] = c[j].hdr.sequence;
+		}
+
+		if (!next_record (&c[j]))
+			heap[0] = heap[--nheap];
+		sift_down (c, heap, nheap, 0);
+	}
+	free (heap);
+}
+
+/* State shared by the threads of the parallel merge. */
+static struct input *inputs;
+static int ninputs, njobs, output_fd;
+static size_t (*bounds)[2];	/* per chunk and input: offset, data bytes */
+
+#define BOUND(chunk, i) bounds[(chunk) * ninputs + (i)]
+
+/* Scan the record headers of every njobs'th input from data, noting
+ * samples and checking sequence numbers. */
+static void *scan_inputs (void *data)
+{
+	int i;
+
+	for (i = (int)(long) data; i < ninputs; i += njobs) {
+		struct input *in = &inputs[i];
+		struct cursor c = { in, 0, in->size, { 0, 0, 0 }, NULL };
+		size_t pos = 0, next_sample = 0, alloc = 0;
+		uint64_t bytes = 0;
+
+		while (next_record (&c)) {
+			if (pos >= next_sample) {
+				if (in->nsamples == alloc) {
+					alloc = alloc ? 2 * alloc : 64;
+					in->samples = realloc(in->samples,
+							      alloc * sizeof(struct sample));
+					if (in->samples == NULL) {
+						fprintf(stderr, "Memory allocation failed.\n");
+						exit(-2);
+					}
+				}
+				in->samples[in->nsamples].timestamp = c.hdr.timestamp;
+				in->samples[in->nsamples].pos = pos;
+				in->samples[in->nsamples].bytes = bytes;
+				in->nsamples++;
+				next_sample = pos + SAMPLE_BYTES;
+			}
+			if (c.hdr.sequence != in->last + 1) {
+				fprintf(stderr, "cpu %d: got %u. expected %u\n", i,
+					c.hdr.sequence, in->last + 1);
+				in->dropped += c.hdr.sequence - in->last - 1;
+			}
+			in->last = c.hdr.sequence;
+			bytes += c.hdr.pdu_len;
+			pos = c.pos;
+		}
+		/* The end, as a last bound. */
+		BOUND(njobs, i)[0] = pos;
+		BOUND(njobs, i)[1] = bytes;
+	}
+	return NULL;
+}
+
+/* Find the first record of input i with a timestamp of at least ts. */
+static void find_bound (int i, uint64_t ts, size_t bound[2])
+{
+	struct input *in = &inputs[i];
+	struct cursor c = { in, 0, in->size, { 0, 0, 0 }, NULL };
+	size_t lo = 0, hi = in->nsamples, pos;
+	uint64_t bytes;
+
+	/* Start from the last sample before ts. */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (in->samples[mid].timestamp < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0) {
+		bound[0] = bound[1] = 0;
+		return;
+	}
+	c.pos = pos = in->samples[lo - 1].pos;
+	bytes = in->samples[lo - 1].bytes;
+	while (next_record (&c) && c.hdr.timestamp < ts) {
+		bytes += c.hdr.pdu_len;
+		pos = c.pos;
+	}
+	if (c.hdr.timestamp < ts) {	/* ran off the end */
+		pos = BOUND(njobs, i)[0];
+		bytes = BOUND(njobs, i)[1];
+	}
+	bound[0] = pos;
+	bound[1] = bytes;
+}
+
+static int compare_samples (const void *a, const void *b)
+{
+	uint64_t x = ((const struct sample *) a)->timestamp;
+	uint64_t y = ((const struct sample *) b)->timestamp;
+	return x < y ? -1 : x > y;
+}
+
+/* Merge chunk data of every input into its place in the output. */
+static void *merge_chunk (void *data)
+{
+	int chunk = (int)(long) data, i;
+	struct cursor *c = calloc(ninputs, sizeof(struct cursor));
+	struct output out = { NULL, output_fd, 0, NULL, 0 };
+
+	if (c == NULL) {
 		fprintf(stderr, "Memory allocation failed.\n");
 		exit(-2);
 	}
+	for (i = 0; i < ninputs; i++) {
+		c[i].in = &inputs[i];
+		c[i].pos = BOUND(chunk, i)[0];
+		c[i].end = BOUND(chunk + 1, i)[0];
+		out.off += BOUND(chunk, i)[1];
+	}
+	merge (c, ninputs, &out, 0, NULL, NULL);
+	flush_output (&out);
+	free (out.buf);
+	free (c);
+	return NULL;
+}
+
+/* Run fn(0) .. fn(njobs - 1) in threads of their own. */
+static void run_jobs (void *(*fn)(void *))
+{
+	pthread_t *threads = malloc(njobs * sizeof(pthread_t));
+	int i;
 
-	while ((c = getopt (argc, argv, "vo:")) != EOF)  {
+	if (threads == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	for (i = 0; i < njobs; i++) {
+		if (pthread_create (&threads[i], NULL, fn, (void *)(long) i) != 0) {
+			fprintf(stderr, "couldn't start thread %d\n", i);
+			exit(-4);
+		}
+	}
+	for (i = 0; i < njobs; i++)
+		pthread_join (threads[i], NULL);
+	free (threads);
+}
+
+/* The parallel merge: scan the inputs for where the timestamps fall,
+ * cut the whole span of time into njobs chunks holding about as much
+ * data each, and merge every chunk straight into its own region of the
+ * output file.  Returns the number of dropped records. */
+static int merge_parallel (void)
+{
+	struct sample *all;
+	size_t n = 0, k;
+	int i, chunk, dropped = 0;
+
+	bounds = calloc((njobs + 1) * ninputs, sizeof(*bounds));
+	if (bounds == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	run_jobs (scan_inputs);
+
+	for (i = 0; i < ninputs; i++) {
+		n += inputs[i].nsamples;
+		dropped += inputs[i].dropped;
+	}
+	all = malloc((n ? n : 1) * sizeof(struct sample));
+	if (all == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	for (i = 0, k = 0; i < ninputs; i++) {
+		memcpy (all + k, inputs[i].samples,
+			inputs[i].nsamples * sizeof(struct sample));
+		k += inputs[i].nsamples;
+	}
+	qsort (all, n, sizeof(struct sample), compare_samples);
+
+	/* Chunk 0 starts at the beginning of every input. */
+	for (chunk = 1; n && chunk < njobs; chunk++)
+		for (i = 0; i < ninputs; i++)
+			find_bound (i, all[chunk * n / njobs].timestamp,
+				    BOUND(chunk, i));
+	free (all);
+
+	run_jobs (merge_chunk);
+	free (bounds);
+	return dropped;
+}
+
+int main (int argc, char *argv[])
+{
+	char *outfile_name = NULL;
+	int c, i, dropped=0;
+	uint32_t last[MAX_NR_CPUS] = { 0 };
+	struct cursor cur[MAX_NR_CPUS];
+	struct output out = { NULL, -1, 0, NULL, 0 };
+	FILE *ofp = NULL;
+	int mapped = 1, verbose = 0;
+
+	njobs = 1;
+	while ((c = getopt (argc, argv, "vo:j:")) != EOF)  {
 		switch (c) {
 		case 'v':
 			verbose = 1;
@@ -57,6 +579,11 @@ int main (int argc, char *argv[])
 		case 'o':
 			outfile_name = optarg;
 			break;
+		case 'j':
+			njobs = atoi(optarg);
+			if (njobs < 1)
+				usage(argv[0]);
+			break;
 		default:
 			usage(argv[0]);
 		}
@@ -65,24 +592,25 @@ int main (int argc, char *argv[])
 	if (optind == argc)
 		usage (argv[0]);
 
+	inputs = calloc(MAX_NR_CPUS, sizeof(struct input));
+	if (inputs == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
 	i = 0;
 	while (optind < argc) {
                 if (i >= MAX_NR_CPUS) {
                         fprintf(stderr, "too many files (MAX_NR_CPUS=%d)\n", MAX_NR_CPUS);
 			return -1;
 		}                  
-		fp[i] = fopen(argv[optind++], "r");
-		if (!fp[i]) {
+		if (open_input(argv[optind++], &inputs[i]) < 0) {
 			fprintf(stderr, "error opening file %s.\n", argv[optind - 1]);
 			return -1;
 		}
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[i]))
-			num[i] = *((int *)buf);
-		else
-			num[i] = 0;
+		mapped &= inputs[i].mapped;
 		i++;
 	}
-	ncpus = i;
+	ninputs = i;
 
 	if (!outfile_name)
 		ofp = stdout;
@@ -94,53 +622,25 @@ int main (int argc, char *argv[])
 			return -1;
 		}
 	}
-	
-	do {
-		min = num[0];
-		j = 0;
-		for (i = 1; i < ncpus; i++) {
-			if (min == 0 || (num[i] && num[i] < min)) {
-				min = num[i];
-				j = i;
-			}
-		}
 
-		if (fread(&len, sizeof(int), 1, fp[j])) {
-			if (verbose)
-				fprintf(stdout, "[CPU:%d, seq=%ld, length=%d]\n", j, min, len);
-			if (len > bufsize) {
-				bufsize = len;
-				if (verbose) fprintf(stderr, "reallocating %d bytes\n", bufsize);
-				buf = realloc(buf, bufsize);
-				if (buf == NULL) {
-					fprintf(stderr, "Memory allocation failed.\n");	
-					exit(-2);
-				}
-			}
-			if ((rc = fread(buf, len, 1, fp[j])) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
-			if ((rc = fwrite(buf, len, 1, ofp)) <= 0 ) {
-				fprintf(stderr, "fread error: got %d\n", rc);
-				exit(-3);
-			}
+	/* The parallel merge writes to its place in the output file, and
+	 * needs to know where every input's records are. */
+	if (njobs > 1 && outfile_name && !verbose && mapped) {
+		output_fd = fileno(ofp);
+		dropped = merge_parallel ();
+	} else {
+		for (i = 0; i < ninputs; i++) {
+			cur[i].in = &inputs[i];
+			cur[i].pos = 0;
+			cur[i].end = inputs[i].size;
 		}
+		out.fp = ofp;
+		merge (cur, ninputs, &out, verbose, last, &dropped);
+	}
 
-		if (min && ++count != min) {
-			fprintf(stderr, "got %ld. expected %ld\n", min, count);
-			dropped += min - count ;
-			count = min;
-		}
-
-		if (fread (buf, TIMESTAMP_SIZE, 1, fp[j]))
-			num[j] = *((int *)buf);
-		else
-			num[j] = 0;
-	} while (min);
-
-	for (i = 0; i < ncpus; i++)
-		fclose (fp[i]);
+	for (i = 0; i < ninputs; i++)
+		close_input (&inputs[i]);
+	free (inputs);
 	fclose (ofp);
 	printf ("sequence had %d drops\n", dropped);
 	return 0;
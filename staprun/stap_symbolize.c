@@ -0,0 +1,384 @@
+/*
+ * stap_symbolize.c - resolve deferred systemtap backtrace addresses
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) Red Hat Inc, 2024
+ *
+ * Reads the output of a script run with stap --defer-symbols, where
+ * backtrace addresses are printed as "<path:build-id:section+offset>"
+ * (see runtime/sym.c), and replaces those with the symbol and offset
+ * they fall in.  The ELF files are found by build-id, through
+ * debuginfod when available and the usual /usr/lib/debug/.build-id
+ * tree, or else at the path the module had when the script was built.
+ */
+
+#include "../config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libelf.h>
+#include <gelf.h>
+#ifdef HAVE_LIBDEBUGINFOD
+#include <elfutils/debuginfod.h>
+#endif
+
+/* A function symbol, with its address in the ELF file. */
+struct sym {
+	unsigned long addr, size;
+	const char *name;
+	size_t shndx;
+};
+
+/* An ELF file and its sorted function symbols. */
+struct elf_file {
+	struct elf_file *next;
+	char *path, *build_id;	/* as printed by the runtime */
+	int fd;
+	Elf *elf;
+	Elf_Scn *symtab;
+	struct sym *syms;
+	size_t nsyms;
+};
+
+static struct elf_file *files;
+#ifdef HAVE_LIBDEBUGINFOD
+static debuginfod_client *client;
+#endif
+
+static void usage (char *prog)
+{
+	fprintf(stderr, "%s [-o output_filename] [input_file]\n", prog);
+	exit(-1);
+}
+
+static int sym_cmp (const void *a, const void *b)
+{
+	const struct sym *x = a, *y = b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* Open the ELF file with the given build-id, which is "-" if unknown,
+ * else the one at path.  Returns -1 if there is none. */
+static int open_elf (const char *path, const char *build_id)
+{
+	char debug_path[PATH_MAX];
+	int fd;
+
+	if (strcmp(build_id, "-") && strlen(build_id) > 2) {
+#ifdef HAVE_LIBDEBUGINFOD
+		if (client == NULL)
+			client = debuginfod_begin();
+		if (client) {
+			fd = debuginfod_find_debuginfo(client,
+				(const unsigned char *) build_id, 0, NULL);
+			if (fd >= 0)
+				return fd;
+		}
+#endif
+		snprintf(debug_path, sizeof(debug_path),
+			 "/usr/lib/debug/.build-id/%.2s/%s.debug",
+			 build_id, build_id + 2);
+		fd = open(debug_path, O_RDONLY);
+		if (fd >= 0)
+			return fd;
+	}
+	return open(path, O_RDONLY);
+}
+
+/* Collect the function symbols of the symbol table, or else of the
+ * dynamic one. */
+static void load_syms (struct elf_file *f)
+{
+	Elf_Scn *scn = NULL, *symtab = NULL;
+	GElf_Shdr shdr, symshdr;
+	Elf_Data *data;
+	size_t i, n, alloc = 0;
+
+	while ((scn = elf_nextscn(f->elf, scn)) != NULL) {
+		if (gelf_getshdr(scn, &shdr) == NULL)
+			continue;
+		if (shdr.sh_type == SHT_SYMTAB
+		    || (shdr.sh_type == SHT_DYNSYM && symtab == NULL)) {
+			symtab = scn;
+			symshdr = shdr;
+		}
+	}
+	if (symtab == NULL || (data = elf_getdata(symtab, NULL)) == NULL)
+		return;
+	f->symtab = symtab;
+
+	n = symshdr.sh_entsize ? symshdr.sh_size / symshdr.sh_entsize : 0;
+	for (i = 0; i < n; i++) {
+		GElf_Sym sym;
+		const char *name;
+
+		if (gelf_getsym(data, i, &sym) == NULL
+		    || GELF_ST_TYPE(sym.st_info) != STT_FUNC
+		    || sym.st_shndx == SHN_UNDEF)
+			continue;
+		name = elf_strptr(f->elf, symshdr.sh_link, sym.st_name);
+		if (name == NULL || *name == '\0')
+			continue;
+		if (f->nsyms == alloc) {
+			alloc = alloc ? 2 * alloc : 256;
+			f->syms = realloc(f->syms, alloc * sizeof(*f->syms));
+			if (f->syms == NULL) {
+				fprintf(stderr, "Memory allocation failed.\n");
+				exit(-2);
+			}
+		}
+		f->syms[f->nsyms].addr = sym.st_value;
+		f->syms[f->nsyms].size = sym.st_size;
+		f->syms[f->nsyms].name = name;
+		f->syms[f->nsyms].shndx = sym.st_shndx;
+		f->nsyms++;
+	}
+	qsort(f->syms, f->nsyms, sizeof(*f->syms), sym_cmp);
+}
+
+static struct elf_file *get_elf (const char *path, const char *build_id)
+{
+	struct elf_file *f;
+
+	for (f = files; f; f = f->next)
+		if (!strcmp(f->path, path) && !strcmp(f->build_id, build_id))
+			return f;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL || (f->path = strdup(path)) == NULL
+	    || (f->build_id = strdup(build_id)) == NULL) {
+		fprintf(stderr, "Memory allocation failed.\n");
+		exit(-2);
+	}
+	f->fd = open_elf(path, build_id);
+	if (f->fd >= 0)
+		f->elf = elf_begin(f->fd, ELF_C_READ_MMAP, NULL);
+	if (f->elf)
+		load_syms(f);
+	else
+		fprintf(stderr, "no ELF file for %s (build-id %s)\n",
+			path, build_id);
+	f->next = files;
+	files = f;
+	return f;
+}
+
+/* Find the value of any symbol by name. */
+static int find_named (struct elf_file *f, const char *name,
+		       unsigned long *value)
+{
+	GElf_Shdr shdr;
+	Elf_Data *data;
+	size_t i, n;
+
+	if (f->symtab == NULL || gelf_getshdr(f->symtab, &shdr) == NULL
+	    || (data = elf_getdata(f->symtab, NULL)) == NULL)
+		return -1;
+	n = shdr.sh_entsize ? shdr.sh_size / shdr.sh_entsize : 0;
+	for (i = 0; i < n; i++) {
+		GElf_Sym sym;
+		const char *s;
+
+		if (gelf_getsym(data, i, &sym) == NULL
+		    || sym.st_shndx == SHN_UNDEF)
+			continue;
+		s = elf_strptr(f->elf, shdr.sh_link, sym.st_name);
+		if (s && !strcmp(s, name)) {
+			*value = sym.st_value;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Find the address in the ELF file of an offset into a section as the
+ * runtime names them: the kernel is relative to _stext, user modules
+ * already are in ELF addresses, and kernel modules are relocatable,
+ * so their symbols are matched inside the section itself. */
+static int elf_address (struct elf_file *f, const char *secname,
+			unsigned long offset, unsigned long *addr,
+			size_t *shndx)
+{
+	Elf_Scn *scn = NULL;
+	GElf_Shdr shdr;
+	GElf_Ehdr ehdr;
+	size_t shstrndx;
+
+	*shndx = 0;
+	*addr = offset;
+	if (!strcmp(secname, ".dynamic") || !strcmp(secname, ".absolute"))
+		return 0;
+
+	if (secname[0] != '.' && find_named(f, secname, addr) == 0) {
+		*addr += offset;
+		return 0;
+	}
+
+	if (gelf_getehdr(f->elf, &ehdr) == NULL
+	    || elf_getshdrstrndx(f->elf, &shstrndx) < 0)
+		return -1;
+	while ((scn = elf_nextscn(f->elf, scn)) != NULL) {
+		const char *name;
+		if (gelf_getshdr(scn, &shdr) == NULL)
+			continue;
+		name = elf_strptr(f->elf, shstrndx, shdr.sh_name);
+		if (name && !strcmp(name, secname)) {
+			if (ehdr.e_type == ET_REL)
+				*shndx = elf_ndxscn(scn);
+			else
+				*addr = shdr.sh_addr + offset;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Find the symbol an address falls in.  Symbols without a size cover
+ * everything up to the next one. */
+static const struct sym *find_sym (struct elf_file *f, unsigned long addr,
+				   size_t shndx)
+{
+	const struct sym *best = NULL;
+	size_t lo = 0, hi = f->nsyms;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (f->syms[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (lo-- > 0) {
+		const struct sym *s = &f->syms[lo];
+		if (shndx && s->shndx != shndx)
+			continue;
+		if (s->size == 0 || addr < s->addr + s->size)
+			best = s;
+		break;
+	}
+	return best;
+}
+
+/* Resolve one "<path:build-id:section+offset>" token, of length len.
+ * Returns 0 if it is not one. */
+static int put_symbol (FILE *ofp, const char *tok, size_t len)
+{
+	char buf[PATH_MAX + 256], *build_id, *secname, *plus, *end, *slash;
+	unsigned long offset, addr;
+	struct elf_file *f;
+	const struct sym *s;
+	size_t shndx;
+
+	if (len < 2 || len - 2 >= sizeof(buf))
+		return 0;
+	memcpy(buf, tok + 1, len - 2);
+	buf[len - 2] = '\0';
+
+	/* The path may contain colons, so split from the right. */
+	if ((secname = strrchr(buf, ':')) == NULL)
+		return 0;
+	*secname++ = '\0';
+	if ((build_id = strrchr(buf, ':')) == NULL)
+		return 0;
+	*build_id++ = '\0';
+	if (strcmp(build_id, "-")
+	    && (*build_id == '\0'
+		|| build_id[strspn(build_id, "0123456789abcdef")] != '\0'))
+		return 0;
+	if ((plus = strrchr(secname, '+')) == NULL)
+		return 0;
+	*plus++ = '\0';
+	errno = 0;
+	offset = strtoul(plus, &end, 16);
+	if (errno || *end)
+		return 0;
+
+	f = get_elf(buf, build_id);
+	slash = strrchr(buf, '/');
+	if (f->elf && elf_address(f, secname, offset, &addr, &shndx) == 0
+	    && (s = find_sym(f, shndx ? offset : addr, shndx)) != NULL)
+		fprintf(ofp, ": %s+%#lx/%#lx [%s]", s->name,
+			(shndx ? offset : addr) - s->addr, s->size,
+			slash ? slash + 1 : buf);
+	else
+		fprintf(ofp, "[%s+%#lx]", slash ? slash + 1 : buf, offset);
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	char *line = NULL, *outfile_name = NULL;
+	size_t linesize = 0;
+	ssize_t n;
+	FILE *fp = stdin, *ofp = stdout;
+	int c;
+
+	while ((c = getopt (argc, argv, "o:")) != EOF)  {
+		switch (c) {
+		case 'o':
+			outfile_name = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind + 1 < argc)
+		usage (argv[0]);
+	if (optind < argc) {
+		fp = fopen(argv[optind], "r");
+		if (!fp) {
+			fprintf(stderr, "error opening file %s.\n", argv[optind]);
+			return -1;
+		}
+	}
+	if (outfile_name) {
+		ofp = fopen(outfile_name, "w");
+		if (!ofp) {
+			fprintf(stderr, "ERROR: couldn't open output file %s: errcode = %s\n",
+				outfile_name, strerror(errno));
+			return -1;
+		}
+	}
+
+	elf_version(EV_CURRENT);
+
+	while ((n = getline(&line, &linesize, fp)) > 0) {
+		char *p = line, *lt, *gt;
+
+		while ((lt = memchr(p, '<', line + n - p)) != NULL
+		       && (gt = memchr(lt, '>', line + n - lt)) != NULL) {
+			fwrite(p, lt - p, 1, ofp);
+			if (!put_symbol(ofp, lt, gt - lt + 1))
+				fwrite(lt, gt - lt + 1, 1, ofp);
+			p = gt + 1;
+		}
+		fwrite(p, line + n - p, 1, ofp);
+	}
+
+#ifdef HAVE_LIBDEBUGINFOD
+	if (client)
+		debuginfod_end(client);
+#endif
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	fclose(ofp);
+	return 0;
+}
@@ -184,9 +184,13 @@ static int insert_stap_module(privilege_t *user_credentials)
         char fips_mode = '0';
         char *misc = "";
 
-	/* Add the _stp_bufsize option.  */
+	/* Add the _stp_bufsize, and any _stp_relay_mmap, option.  With
+	   -O, hold the probes off until stapio has handed over the
+	   globals; see handoff.c.  */
 	if (snprintf_chk(special_options, sizeof (special_options),
-			 "_stp_bufsize=%d", (int)buffer_size))
+			 "_stp_bufsize=%d%s%s", (int)buffer_size,
+			 relay_mmap ? " _stp_relay_mmap=1" : "",
+			 handoff_name ? " __handoff_enabled=0" : ""))
 		return -1;
 
         fips_mode_fd = open("/proc/sys/crypto/fips_enabled", O_RDONLY);
@@ -402,6 +406,8 @@ int init_staprun(void)
 		return -1;
 
 	rc = 0;
+	if (query_mod)
+		exit(print_module_stats(modname));
 	if (delete_mod)
 		exit(remove_module(modname, 1));
         if (attach_mod) {
@@ -415,6 +421,23 @@ int init_staprun(void)
 
                 disable_kprobes_optimization();
 
+		if (handoff_name) {
+			/* As for .cmd, the old module's state has to be
+			   accessible to our real uid/gid. */
+			int dirfd = open_module_dir(handoff_name);
+			if (dirfd < 0 || faccessat(dirfd, "state", R_OK|W_OK, 0) != 0) {
+				err(_("Cannot take over from module %s: %s\n"),
+				    handoff_name,
+				    dirfd < 0 ? _("not running?")
+				    : errno == ENOENT ? _("not built with stap --handoff")
+				    : strerror(errno));
+				if (dirfd >= 0)
+					close(dirfd);
+				return -1;
+			}
+			close(dirfd);
+		}
+
 		if (insert_stap_module(& user_credentials) < 0) {
 			if(!rename_mod && errno == EEXIST)
 				err("Rerun with staprun option '-R' to rename this module.\n");
@@ -183,9 +183,12 @@ int init_staprun(void);
 int init_stapio(void);
 int stp_main_loop(void);
 int send_request(int type, void *data, int len);
+void send_lazy_unwind(struct _stp_msg_lazy_unwind *req);
 void cleanup_and_exit (int, int);
 int init_ctl_channel(const char *name, int verb);
 void close_ctl_channel(void);
+int print_module_stats(const char *name);
+int open_module_dir(const char *name);
 int init_relayfs(void);
 void close_relayfs(void);
 void kill_relayfs(void);
@@ -196,8 +199,25 @@ void setup_signals(void);
 int make_outfile_name(char *buf, int max, int fnum, int cpu,
 		      time_t t, int bulk);
 int init_backlog(int cpu);
+extern volatile int stop_threads;
 void write_backlog(int cpu, int fnum, time_t t);
 time_t read_backlog(int cpu, int fnum);
+/* sink.c */
+struct sink;
+static inline int is_sink_uri(const char *name)
+{
+	return strncmp(name, "tcp://", 6) == 0
+		|| strncmp(name, "unix://", 7) == 0;
+}
+struct sink *sink_open(const char *uri);
+int sink_write(struct sink *s, const void *data, size_t len);
+int sink_sync(struct sink *s);
+int sink_close(struct sink *s);
+/* hwtrace.c */
+void hwtrace_start(int pid, const char *name, int on_exec);
+void hwtrace_stop(void);
+/* handoff.c */
+int handoff_from(const char *old);
 void read_stdin_setup(void);
 void read_stdin_cleanup(void);
 /* staprun_funcs.c */
@@ -294,6 +314,7 @@ extern int read_stdin;
 extern int rename_mod;
 extern int attach_mod;
 extern int delete_mod;
+extern int query_mod;
 extern int load_only;
 extern int need_uprobes;
 extern const char *uprobes_path;
@@ -306,6 +327,12 @@ extern int relay_basedir_fd;
 extern int color_errors;
 extern int monitor;
 extern int monitor_interval;
+extern int relay_mmap;
+extern int reader_pool;
+extern int compress_output;
+extern int snapshot_secs;
+extern char *hwtrace_name;
+extern char *handoff_name;
 
 typedef enum {color_never, color_auto, color_always} color_modes;
 extern color_modes color_mode;
@@ -40,6 +40,12 @@
 //            only, and limited to roughly "[a-z0-9][a-z0-9._]*".  The DATA is
 //            read as raw bytes following the command's newline.
 //
+//   command: fetch NAME URL
+//     reply: OK / error message
+//      desc: Create a file called NAME, as with "file", but by downloading
+//            it from the quoted-printable URL with curl, such as from a
+//            stap --remote-cache.  Introduced in v4.9.
+//
 //   command: run ARG1 ARG2 ...
 //     reply: OK / error message
 //      desc: Start staprun with the given quoted-printable arguments.  When
@@ -58,6 +64,12 @@
 // Since v2.4, the program can also be run in listening mode, compatible with
 // QEMU's virtio-serial feature. In this mode, stapsh will listen for commands
 // on the port. Behaviour is otherwise the same.
+//
+// Since v4.9, it can instead accept a connection on a virtio vsock port
+// (-V PORT), which a host stap reaches directly with vsock://CID:PORT,
+// without stapvirt and libvirtd passing every byte along.  It serves
+// that one connection, then exits.  Only the host's root may connect:
+// the peer must be the host (or loopback) on a privileged port.
 
 
 #include "../config.h"
@@ -72,6 +84,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -80,9 +93,15 @@
 #include <fcntl.h>
 #include <poll.h>
 
+#ifdef AF_VSOCK
+#include <linux/vm_sockets.h>
+#endif
+
 #define STAPSH_TOK_DELIM " \t\r\n"
 #define STAPSH_MAX_FILE_SIZE 32000000 // XXX should be cumulative?
 #define STAPSH_MAX_ARGS 256
+#define STAPSH_BATCH (64*1024) // most staprun output sent in one block
+#define STAPSH_VSOCK_BUFFER (1024*1024) // vsock buffer, to keep the link busy
 
 
 struct stapsh_handler {
@@ -94,6 +113,7 @@ struct stapsh_handler {
 static int do_hello(void);
 static int do_option(void);
 static int do_file(void);
+static int do_fetch(void);
 static int do_run(void);
 static int do_quit(void);
 
@@ -105,6 +125,7 @@ static const struct stapsh_handler commands[] = {
       { "stap", do_hello },
       { "option", do_option },
       { "file", do_file },
+      { "fetch", do_fetch },
       { "run", do_run },
       { "quit", do_quit },
 };
@@ -141,6 +162,9 @@ static const unsigned noptions = sizeof(options) / sizeof(*options);
 static char *listening_port = NULL;
 static int listening_port_fd = -1;
 
+// if != NULL, then we serve a connection on this vsock port
+static char *vsock_port = NULL;
+
 static struct utsname uts;
 
 static FILE *stapsh_in, *stapsh_out, *stapsh_err;
@@ -246,7 +270,7 @@ cleanup(int status)
   if (prefix_data)
     reply("quit\n");
 
-  if (listening_port)
+  if (listening_port || vsock_port)
     {
       fclose(stapsh_in);
       fclose(stapsh_out);
@@ -310,7 +334,7 @@ setup_signals (void)
 static void __attribute__ ((noreturn))
 usage (char *prog, int status)
 {
-  fprintf (stapsh_err, "%s [-v] [-l PORT]\n", prog);
+  fprintf (stapsh_err, "%s [-v] [-l PORT | -V PORT]\n", prog);
   exit (status);
 }
 
@@ -318,7 +342,7 @@ static void
 parse_args(int argc, char* const argv[])
 {
   int c;
-  while ((c = getopt (argc, argv, "vl:")) != -1)
+  while ((c = getopt (argc, argv, "vl:V:")) != -1)
     switch (c)
       {
       case 'v':
@@ -327,6 +351,9 @@ parse_args(int argc, char* const argv[])
       case 'l':
         listening_port = optarg;
         break;
+      case 'V':
+        vsock_port = optarg;
+        break;
       case '?':
       default:
         usage (argv[0], 2);
@@ -336,6 +363,105 @@ parse_args(int argc, char* const argv[])
       fprintf (stapsh_err, "%s: invalid extraneous arguments\n", argv[0]);
       usage (argv[0], 2);
     }
+  if (listening_port && vsock_port)
+    {
+      fprintf (stapsh_err, "%s: -l and -V are exclusive\n", argv[0]);
+      usage (argv[0], 2);
+    }
+}
+
+#ifdef AF_VSOCK
+// Is the peer root on the host, or on this machine through loopback?
+static int
+vsock_peer_trusted(const struct sockaddr_vm *peer)
+{
+  if (peer->svm_family != AF_VSOCK || peer->svm_port >= 1024)
+    return 0;
+#ifdef VMADDR_CID_LOCAL
+  if (peer->svm_cid == VMADDR_CID_LOCAL)
+    return 1;
+#endif
+  return peer->svm_cid == VMADDR_CID_HOST;
+}
+#endif
+
+// Wait for the host to connect to our vsock port, and return the
+// connection, or -1.
+static int
+accept_vsock(void)
+{
+#ifdef AF_VSOCK
+  char *end;
+  unsigned long port = strtoul(vsock_port, &end, 10);
+  if (*vsock_port == '\0' || *end != '\0' || port > 0xffffffffUL)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  int fd = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+
+  struct sockaddr_vm addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.svm_family = AF_VSOCK;
+  addr.svm_cid = VMADDR_CID_ANY;
+  addr.svm_port = port;
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || listen(fd, 1) < 0)
+    {
+      int olderrno = errno;
+      close(fd);
+      errno = olderrno;
+      return -1;
+    }
+
+  // Anyone on the host can connect to a guest's vsock ports, so only
+  // take connections from the host (or loopback) coming from a
+  // privileged port, which only root there can bind.  Others are
+  // turned away, and we keep waiting.
+  int conn;
+  for (;;)
+    {
+      conn = accept(fd, NULL, NULL);
+      if (conn < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+
+      struct sockaddr_vm peer;
+      socklen_t peerlen = sizeof(peer);
+      memset(&peer, 0, sizeof(peer));
+      if (getpeername(conn, (struct sockaddr *)&peer, &peerlen) == 0
+          && vsock_peer_trusted(&peer))
+        break;
+
+      fprintf(stderr, "stapsh: refusing vsock connection from %u:%u\n",
+              peer.svm_cid, peer.svm_port);
+      close(conn);
+    }
+  int olderrno = errno;
+  close(fd);
+  errno = olderrno;
+  if (conn < 0)
+    return -1;
+
+  // The default 256K lets a busy script's output stall on the round
+  // trips of the credit updates; the host asks for the same.
+  unsigned long long size = STAPSH_VSOCK_BUFFER;
+  if (setsockopt(conn, AF_VSOCK, SO_VM_SOCKETS_BUFFER_MAX_SIZE,
+                 &size, sizeof(size)) < 0
+      || setsockopt(conn, AF_VSOCK, SO_VM_SOCKETS_BUFFER_SIZE,
+                    &size, sizeof(size)) < 0)
+    dbug(1, "can't grow the vsock buffer: %s\n", strerror(errno));
+  return conn;
+#else
+  errno = EAFNOSUPPORT;
+  return -1;
+#endif
 }
 
 
@@ -409,6 +535,25 @@ do_option()
   return reply("ERROR: Invalid option\n");
 }
 
+// Check a NAME given to "file" or "fetch".  Returns nonzero after
+// replying with an error if it isn't acceptable.
+static int
+check_file_name(const char* name)
+{
+  const char* arg;
+  for (arg = name; *arg; ++arg)
+    {
+      if (dyninst && *arg != 's')
+        dyninst--;
+      if (*arg == '.')
+        dyninst +=2;
+      if (!isalnum(*arg) &&
+          !(arg > name && (*arg == '.' || *arg == '_')))
+        return reply ("ERROR: Bad character '%c' in file name\n", *arg) ?: 1;
+    }
+  return 0;
+}
+
 static int
 do_file()
 {
@@ -426,16 +571,8 @@ do_file()
   const char* name = strtok(NULL, STAPSH_TOK_DELIM);
   if (!name)
     return reply ("ERROR: Missing file name\n");
-  for (arg = name; *arg; ++arg)
-    {
-      if (dyninst && *arg != 's')
-        dyninst--;
-      if (*arg == '.')
-        dyninst +=2;
-      if (!isalnum(*arg) &&
-          !(arg > name && (*arg == '.' || *arg == '_')))
-        return reply ("ERROR: Bad character '%c' in file name\n", *arg);
-    }
+  if ((ret = check_file_name(name)) != 0)
+    return ret;
 
   FILE* f = fopen(name, "w");
   if (!f)
@@ -474,6 +611,59 @@ do_file()
   return ret;
 }
 
+static int
+do_fetch()
+{
+  if (staprun_pid > 0)
+    return 1;
+
+  int ret;
+  const char* name = strtok(NULL, STAPSH_TOK_DELIM);
+  if (!name)
+    return reply ("ERROR: Missing file name\n");
+  if ((ret = check_file_name(name)) != 0)
+    return ret;
+
+  char* url = strtok(NULL, STAPSH_TOK_DELIM);
+  if (!url || qpdecode(url) != 0 || url[0] == '-' || !strstr(url, "://"))
+    return reply ("ERROR: Bad URL\n");
+
+  // Our SIGCHLD handler would take curl's exit for staprun's.
+  struct sigaction sa, old_sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_DFL;
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGCHLD, &sa, &old_sa);
+
+  // Keep curl off our protocol channels.
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&fa, 1, "/dev/null", O_WRONLY, 0);
+
+  pid_t pid;
+  int status = -1;
+  const char* argv[] = { "curl", "-fsS", "-o", name, url, NULL };
+  ret = posix_spawnp(&pid, argv[0], &fa, NULL, (char* const*)argv, environ);
+  posix_spawn_file_actions_destroy(&fa);
+  if (ret != 0)
+    ret = reply ("ERROR: Can't run curl: %s\n", strerror(ret));
+  else if (waitpid(pid, &status, 0) != pid
+           || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+      unlink(name);
+      ret = reply ("ERROR: Can't fetch \"%s\"\n", url);
+    }
+  else
+    {
+      ret = 0;
+      reply ("OK\n");
+    }
+
+  sigaction (SIGCHLD, &old_sa, NULL);
+  return ret;
+}
+
 // From util.cxx
 static int
 pipe_child_fd(posix_spawn_file_actions_t* fa, int pipefd[2], int childfd)
@@ -604,12 +794,14 @@ do_run()
   if (access(staprun, X_OK) != 0)
     return reply ("ERROR: Can't execute %s (%s)\n", staprun, strerror(errno));
 
-  // We pipe staprun under two conditions:
+  // We pipe staprun under three conditions:
   // 1. The "data" option is on: we need to prefix all the output from staprun with data headers
   // 2. We're in listening mode: staprun needs to use the same port for
   //    writing, but would fail to open it since stapsh is already using it
+  // 3. We're on a vsock connection, which staprun's stdout isn't
+  int piped = prefix_data || listening_port != NULL || vsock_port != NULL;
   pid_t pid;
-  if (prefix_data || listening_port != NULL)
+  if (piped)
     pid = spawn_staprun_piped(args);
   else
     pid = spawn_staprun(args);
@@ -620,7 +812,7 @@ do_run()
       return reply ("ERROR: Failed to spawn staprun\n");
     }
 
-  if (prefix_data || listening_port != NULL)
+  if (piped)
     {
       // make staprun fds non-blocking and prep polling array
       int flags;
@@ -690,19 +882,34 @@ process_command(void)
 static void
 prefix_staprun(int i, FILE *out, const char *stream)
 {
-  char buf[4096];
-  ssize_t n = read(pfds[i].fd, buf, sizeof buf);
-  if (n > 0)
+  // Take as much as staprun has written, up to STAPSH_BATCH, so that a
+  // busy script goes out in few large "data" blocks rather than many
+  // small ones, each of which stap has to parse.
+  static char buf[STAPSH_BATCH];
+  size_t len = 0;
+  ssize_t n = -1;
+  while (len < sizeof buf
+         && (n = read(pfds[i].fd, buf + len, sizeof buf - len)) != 0)
+    {
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break; // EAGAIN: that's all for now
+        }
+      len += n;
+    }
+  if (len > 0)
     {
       // actually check if we need to prefix data (we could also be piping for
       // other reasons, e.g. listening_mode != NULL)
       if (prefix_data)
-        fprintf(out, "data %s %zd\n", stream, n);
-      if (fwrite(buf, n, 1, out) != 1)
+        fprintf(out, "data %s %zu\n", stream, len);
+      if (fwrite(buf, len, 1, out) != 1)
         dbug(2, "failed fwrite\n"); // appease older gccs (don't ignore fwrite rc)
       fflush(out);
     }
-  else if (n == 0) // eof
+  if (n == 0) // eof
     pfds[i].events = 0;
 }
 
@@ -752,6 +959,28 @@ main(int argc, char* const argv[])
       if (!stapsh_in || !stapsh_out)
         die("Could not open serial port");
     }
+  else if (vsock_port != NULL)
+    {
+      int fd = accept_vsock();
+      if (fd == -1)
+        die("Error accepting a vsock connection on port %s", vsock_port);
+
+      // As above, a FILE* for each direction, each on its own fd so
+      // that closing one doesn't pull the other's out from under it.
+      int fd2 = dup(fd);
+      stapsh_in  = fdopen(fd, "r");
+      stapsh_out = fd2 >= 0 ? fdopen(fd2, "w") : NULL;
+      if (!stapsh_in || !stapsh_out)
+        {
+          stapsh_in = stdin;
+          stapsh_out = stdout;
+          die("Could not open vsock connection");
+        }
+      stapsh_err = stapsh_out;
+
+      // Let whole STAPSH_BATCH blocks through stdio in one write().
+      setvbuf(stapsh_out, NULL, _IOFBF, STAPSH_BATCH + 256);
+    }
 
   umask(0077);
   snprintf(tmpdir, sizeof(tmpdir), "%s/stapsh.XXXXXX",
@@ -163,7 +163,7 @@ probe_point::component::component (interned_string f,
 
 vardecl::vardecl ():
   arity_tok(0), arity (-1), maxsize(0), init(NULL), synthetic(false), wrap(false),
-  char_ptr_arg(false)
+  topk(false), char_ptr_arg(false)
 {
 }
 
@@ -213,7 +213,7 @@ vardecl::compatible_arity (int a)
 
 functiondecl::functiondecl ():
   body (0), synthetic (false), mangle_oldstyle (false), has_next(false), cloned_p(false),
-  priority(1)
+  inlined_p(false), priority(1)
 {
 }
 
@@ -618,6 +618,8 @@ void vardecl::print (ostream& o) const
   o << ((unmangled_name != "") ? unmangled_name : name); // unmangled_name empty for some synthesized vardecls
   if(wrap)
     o << "%";
+  if(topk)
+    o << "@topk";
   if (maxsize > 0)
     o << "[" << maxsize << "]";
   if (arity > 0 || index_types.size() > 0)
@@ -638,6 +640,8 @@ void vardecl::printsig (ostream& o) const
     o << name;
   if(wrap)
      o << "%";
+  if(topk)
+     o << "@topk";
   if (maxsize > 0)
     o << "[" << maxsize << "]";
   o << ":" << type;
@@ -1187,6 +1191,14 @@ void stat_op::print (ostream& o) const
       o << "variance(";
       break;
 
+    case sc_quantile:
+      o << "quantile(";
+      break;
+
+    case sc_distinct:
+      o << "distinct(";
+      break;
+
     case sc_none:
       assert (0); // should not happen, as sc_none is only used in foreach sorts
       break;
@@ -1195,6 +1207,9 @@ void stat_op::print (ostream& o) const
 
   if (ctype == sc_variance && params.size() == 1)
     o << ", " << params[0];
+  else if (ctype == sc_quantile)
+    for (unsigned i = 0; i < params.size(); ++i)
+      o << ", " << params[i];
 
   o << ")";
 }
@@ -1222,6 +1237,13 @@ hist_op::print (ostream& o) const
       stat->print(o);
       o << ")";
       break;
+
+    case hist_hdr:
+      assert(params.size() == 1);
+      o << "hist_hdr(";
+      stat->print(o);
+      o << ", " << params[0] << ")";
+      break;
     }
 }
 
@@ -138,6 +138,10 @@ struct visitable
 {
   virtual void visit (visitor* u) = 0;
   virtual ~visitable ();
+
+  // Parse tree nodes are small and numerous; see pool_alloc.
+  static void *operator new (size_t size) { return pool_alloc (size); }
+  static void operator delete (void *p, size_t size) { pool_free (p, size); }
 };
 
 struct symbol;
@@ -596,6 +600,8 @@ enum stat_component_type
     sc_max,
     sc_none,
     sc_variance,
+    sc_quantile,
+    sc_distinct,
   };
 
 struct stat_op: public expression
@@ -610,7 +616,8 @@ struct stat_op: public expression
 enum histogram_type
   {
     hist_linear,
-    hist_log
+    hist_log,
+    hist_hdr
   };
 
 struct hist_op: public indexable
@@ -660,6 +667,7 @@ struct vardecl: public symboldecl
   literal *init; // for global scalars only
   bool synthetic; // for probe locals only, don't init on entry; for globals, skip some checking
   bool wrap;
+  bool topk; // stats arrays only: keep the heaviest keys
   bool char_ptr_arg; // set in ::emit_common_header(), only used if a formal_arg
 };
 
@@ -686,6 +694,7 @@ struct functiondecl: public symboldecl
   bool mangle_oldstyle;
   bool has_next;
   bool cloned_p; // during probe-derivation time
+  bool inlined_p; // some calls replaced by its body
   int64_t priority;
   functiondecl ();
   void print (std::ostream& o) const;
@@ -954,22 +954,44 @@ cmd_port_list()
 
 int disconnect = 0;
 
+// Big enough for a whole block of staprun output, as stapsh batches it
+// (see STAPSH_BATCH in stapsh.c), so that it goes through in one piece.
+#define RELAY_BUFSIZE (64*1024)
+
+// The pending bytes of each buffer are [start, off).  They are only moved
+// back to the front when the buffer has filled up to its end, rather than
+// after every partial write.
 typedef struct {
     virStreamPtr st;
     int    stdin_w;
     int    stdout_w;
-    char   termbuf[1024]; /* term to st */
+    char   termbuf[RELAY_BUFSIZE]; /* term to st */
+    size_t termbuf_start;
     size_t termbuf_off;
-    char   stbuf[1024]; /* st to term */
+    char   stbuf[RELAY_BUFSIZE]; /* st to term */
+    size_t stbuf_start;
     size_t stbuf_off;
 } event_context;
 
+// Makes room at the end of BUF, if it's full up to there.
+static void
+relay_compact(char *buf, size_t *start, size_t *off, size_t size)
+{
+    if (*off < size || *start == 0)
+        return;
+    memmove(buf, buf + *start, *off - *start);
+    *off -= *start;
+    *start = 0;
+}
+
 static void
 stdin_event(__attribute__((unused)) int watch, int fd,
                                     int events, void *opaque)
 {
     event_context *ctxt = opaque;
 
+    relay_compact(ctxt->termbuf, &ctxt->termbuf_start, &ctxt->termbuf_off,
+                  sizeof(ctxt->termbuf));
     if ((events & VIR_EVENT_HANDLE_READABLE)
             && (ctxt->termbuf_off < sizeof(ctxt->termbuf))) {
         // if there's no space in the buffer, we need to wait until more has
@@ -991,7 +1013,7 @@ stdin_event(__attribute__((unused)) int watch, int fd,
         ctxt->termbuf_off += bytes_read;
     }
 
-    if (ctxt->termbuf_off) { // we have stuff to write to the stream
+    if (ctxt->termbuf_off > ctxt->termbuf_start) { // we have stuff to write to the stream
         virStreamEventUpdateCallback(ctxt->st, VIR_STREAM_EVENT_READABLE
                                              | VIR_STREAM_EVENT_WRITABLE);
     }
@@ -1006,17 +1028,18 @@ stdout_event(__attribute__((unused)) int watch, int fd,
 {
     event_context *ctxt = opaque;
 
-    if (events & VIR_EVENT_HANDLE_WRITABLE && ctxt->stbuf_off) {
-        ssize_t bytes_written = write(fd, ctxt->stbuf, ctxt->stbuf_off);
+    if (events & VIR_EVENT_HANDLE_WRITABLE
+            && ctxt->stbuf_off > ctxt->stbuf_start) {
+        ssize_t bytes_written = write(fd, ctxt->stbuf + ctxt->stbuf_start,
+                                      ctxt->stbuf_off - ctxt->stbuf_start);
         if (bytes_written < 0) {
             if (errno != EAGAIN)
                 disconnect = 1;
             return;
         }
-        // shift down
-        memmove(ctxt->stbuf, ctxt->stbuf + bytes_written,
-                             ctxt->stbuf_off - bytes_written);
-        ctxt->stbuf_off -= bytes_written;
+        ctxt->stbuf_start += bytes_written;
+        if (ctxt->stbuf_start == ctxt->stbuf_off)
+            ctxt->stbuf_start = ctxt->stbuf_off = 0;
     }
 
     if (ctxt->stbuf_off == 0) // there's nothing else to write to stdout
@@ -1031,6 +1054,8 @@ stream_event(virStreamPtr st, int events, void *opaque)
 {
     event_context *ctxt = opaque;
 
+    relay_compact(ctxt->stbuf, &ctxt->stbuf_start, &ctxt->stbuf_off,
+                  sizeof(ctxt->stbuf));
     if ((events & VIR_STREAM_EVENT_READABLE)
             && (ctxt->stbuf_off < sizeof(ctxt->stbuf))) {
         // if there's no space in the buffer, we need to wait until more has
@@ -1052,19 +1077,20 @@ stream_event(virStreamPtr st, int events, void *opaque)
     if (ctxt->stbuf_off) // we have stuff to write to stdout
         virEventUpdateHandle(ctxt->stdout_w, VIR_EVENT_HANDLE_WRITABLE);
 
-    if (events & VIR_STREAM_EVENT_WRITABLE && ctxt->termbuf_off) {
-        ssize_t bytes_sent = virStreamSend(st, ctxt->termbuf,
-                                               ctxt->termbuf_off);
+    if (events & VIR_STREAM_EVENT_WRITABLE
+            && ctxt->termbuf_off > ctxt->termbuf_start) {
+        ssize_t bytes_sent = virStreamSend(st,
+                                ctxt->termbuf + ctxt->termbuf_start,
+                                ctxt->termbuf_off - ctxt->termbuf_start);
         if (bytes_sent == -2)
             return;
         if (bytes_sent < 0) {
             disconnect = 1;
             return;
         }
-        // shift down
-        memmove(ctxt->termbuf, ctxt->termbuf + bytes_sent,
-                               ctxt->termbuf_off - bytes_sent);
-        ctxt->termbuf_off -= bytes_sent;
+        ctxt->termbuf_start += bytes_sent;
+        if (ctxt->termbuf_start == ctxt->termbuf_off)
+            ctxt->termbuf_start = ctxt->termbuf_off = 0;
     }
 
     if (!ctxt->termbuf_off) // there's nothing else to write to the stream
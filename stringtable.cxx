@@ -14,6 +14,7 @@
 #include <string>
 #include <cstring>
 #include <fstream>
+#include <mutex>
 #include <unordered_set>
 
 
@@ -30,40 +31,14 @@ static bool whitespace_p (char c)
 #endif
 
 
-#if INTERNED_STRING_CUSTOM_HASH
-// A custom hash 
 struct stringtable_hash
 {
-  size_t operator()(const string& c) const {
-    const char* b = c.data();
-    size_t real_length = c.size();
-    const size_t blocksize = 32; // a cache line or two
-
-    // hash the length
-    size_t hash = real_length;
-
-    // hash the beginning
-    size_t length = real_length;
-    if (length > blocksize)
-      length = blocksize;
-    while (length-- > 0)
-      hash = (hash * 131) + *b++;
-
-    // hash the middle
-    if (real_length > blocksize * 3)
-      {
-        length = blocksize; // more likely not to span a cache line
-        b = (const char*)c.data() + (real_length/2);
-        while (length-- > 0)
-          hash = (hash * 131) + *b++;
-      }
-
-    // the ends, especially of generated bits, are likely to be } } }
-    // \n kinds of similar things
+  size_t operator()(const string_ref& c) const {
+    size_t hash = interned_string::hash (c.data(), c.size());
 
 #if INTERNED_STRING_INSTRUMENT
     ofstream f ("/tmp/hash.log", ios::app);
-    string s = c.substr(0,32);
+    string s = c.substr(0,32).to_string();
     s.erase (remove_if(s.begin(), s.end(), whitespace_p), s.end());
     f << hash << " " << c.length() << " " << s << endl;
     f.close();
@@ -72,41 +47,83 @@ struct stringtable_hash
     return hash;
   }
 };
-typedef unordered_set<std::string, stringtable_hash> stringtable_t;
-#else
-typedef unordered_set<std::string> stringtable_t;
-#endif
 
 
+// The table is split into shards by hash, each with its own lock, so
+// that threads interning different strings rarely wait for each other.
+// The strings themselves are packed into big chunks of memory owned by
+// their shard, rather than allocated one by one.
+static const unsigned stringtable_shards = 16;
+static const size_t stringtable_chunk_size = 64 * 1024;
+
+struct stringtable_shard
+{
+  mutex lock;
+  unordered_set<string_ref, stringtable_hash> strings;
+  char *next, *end; // the unused rest of the current chunk
+
+  stringtable_shard(): next(0), end(0) {}
+
+  // Copy the string into the shard's memory, with a NUL after it.
+  string_ref store (const string_ref& value)
+  {
+    size_t size = value.size() + 1;
+    char *p;
+    if (size > stringtable_chunk_size / 4)
+      p = new char[size];
+    else
+      {
+        if ((size_t) (end - next) < size)
+          {
+            next = new char[stringtable_chunk_size];
+            end = next + stringtable_chunk_size;
+          }
+        p = next;
+        next += size;
+      }
+    memcpy (p, value.data(), value.size());
+    p[value.size()] = '\0';
+    return string_ref (p, value.size());
+  }
+};
+
 static char chartable[256];
-static stringtable_t stringtable;
+static stringtable_shard stringtable[stringtable_shards];
 // XXX: set a larger initial size?  For reference, a
 //
 //    probe kernel.function("*") {}
 //
 // can intern some 450,000 entries.
 
+static struct chartable_init
+{
+  chartable_init()
+  {
+    for (unsigned i = 0; i < 256; i++)
+      chartable[i] = (char) i;
+  }
+} chartable_init;
+
 
 // Generate a long-lived string_ref for the given input string.  In
 // the absence of proper refcounting, memory is kept for the whole
 // duration of the systemtap run.  Try to reuse the same string
-// object for multiple invocations.  Old string_refs remain valid 
-// because std::set<> guarantees iterator validity across inserts,
-// which means that our value strings stay put.
+// object for multiple invocations.  The strings never move or go
+// away, so old string_refs remain valid.
 
 // static
-interned_string interned_string::intern(const string& value)
+interned_string interned_string::intern_ref(const string_ref& value)
 {
-  if (value.empty())
-    return interned_string ();
-
-  if (value.size() == 1)
-    return intern(value[0]);
+  size_t hash = stringtable_hash() (value);
+  stringtable_shard& shard = stringtable[hash % stringtable_shards];
 
-  pair<stringtable_t::iterator,bool> result = stringtable.insert(value);
-  PROBE2(stap, intern_string, value.c_str(), result.second);
-  stringtable_t::iterator it = result.first; // persistent iterator!
-  return string_ref (it->data(), it->length()); // hope for RVO/elision
+  lock_guard<mutex> guard (shard.lock);
+  auto it = shard.strings.find (value);
+  bool added = (it == shard.strings.end());
+  if (added)
+    it = shard.strings.insert (shard.store (value)).first;
+  PROBE2(stap, intern_string, it->data(), added);
+  return *it;
 
   // XXX: for future consideration, consider searching the stringtable
   // for instances where 'value' is a substring.  We could string_ref
@@ -115,6 +132,18 @@ interned_string interned_string::intern(const string& value)
   // mucho CPU.
 }
 
+// static
+interned_string interned_string::intern(const string& value)
+{
+  if (value.empty())
+    return interned_string ();
+
+  if (value.size() == 1)
+    return intern(value[0]);
+
+  return intern_ref(string_ref (value));
+}
+
 // static
 interned_string interned_string::intern(const char* value)
 {
@@ -124,7 +153,7 @@ interned_string interned_string::intern(const char* value)
   if (!value[1])
     return intern(value[0]);
 
-  return intern(string(value));
+  return intern_ref(string_ref (value));
 }
 
 // static
@@ -133,11 +162,7 @@ interned_string interned_string::intern(char value)
   if (!value)
     return interned_string ();
 
-  size_t i = (unsigned char) value;
-  if (!chartable[i]) // lazy init
-    chartable[i] = value;
-
-  return string_ref (&chartable[i], 1);
+  return string_ref (&chartable[(unsigned char) value], 1);
 }
 
 #if INTERNED_STRING_FIND_MEMMEM
@@ -104,11 +104,51 @@ struct interned_string: public boost::string_ref
   {
     return find (static_cast<const boost::string_ref&> (f));
   }
-  
+
+  // The hash of the given bytes, as used by std::hash<interned_string>
+  // and the string table itself.
+  static size_t hash (const char* b, size_t real_length)
+  {
+    // hash the length
+    size_t hash = real_length;
+
+#if INTERNED_STRING_CUSTOM_HASH
+    // Look at no more than the beginning and the middle, so that even
+    // long strings (like embedded-C blocks) hash in constant time.
+    const size_t blocksize = 32; // a cache line or two
+
+    // hash the beginning
+    size_t length = real_length;
+    if (length > blocksize)
+      length = blocksize;
+    while (length-- > 0)
+      hash = (hash * 131) + *b++;
+
+    // hash the middle
+    if (real_length > blocksize * 3)
+      {
+        length = blocksize; // more likely not to span a cache line
+        b += (real_length/2) - blocksize;
+        while (length-- > 0)
+          hash = (hash * 131) + *b++;
+      }
+
+    // the ends, especially of generated bits, are likely to be } } }
+    // \n kinds of similar things
+#else
+    for (size_t i = real_length; i > 0; i--)
+      hash = (hash * 131) + *b++;
+#endif
+    return hash;
+  }
+
 private:
+  // NB: interning is thread-safe, so worker threads may create and use
+  // interned_strings too.
   static interned_string intern(const std::string& value);
   static interned_string intern(const char* value);
   static interned_string intern(char value);
+  static interned_string intern_ref(const boost::string_ref& value);
 
   // This is private so we can be sure of ownership, from our interned string table.
   interned_string(const boost::string_ref& value): boost::string_ref(value) {}
@@ -122,13 +162,7 @@ namespace std {
       // function in std::hash, but there isn't one.  We don't want
       // to copy the interned_string into a temporary string just to
       // hash the thing.
-      //
-      // This code is based on the g++ _Fnv_hash_base ptr/length case.
-      size_t hash = 0;
-      const char* x = s.data();
-      for (size_t i=s.length(); i>0; i--)
-        hash = (hash * 131) + *x++;
-      return hash;
+      return interned_string::hash (s.data(), s.length());
     }
   };
 }
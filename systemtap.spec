@@ -179,6 +179,7 @@ BuildRequires: sqlite-devel > 3.7
 BuildRequires: pkgconfig(json-c)
 BuildRequires: pkgconfig(ncurses)
 %endif
+BuildRequires: pkgconfig(libzstd)
 %if %{with_systemd}
 BuildRequires: systemd
 %endif
@@ -796,6 +797,7 @@ done
       install -p -m 644 staprun/guest/99-stapsh.rules $RPM_BUILD_ROOT%{udevrulesdir}
       mkdir -p $RPM_BUILD_ROOT%{_unitdir}
       install -p -m 644 staprun/guest/stapsh@.service $RPM_BUILD_ROOT%{_unitdir}
+      install -p -m 644 staprun/guest/stapsh-vsock.service $RPM_BUILD_ROOT%{_unitdir}
    %else
       install -p -m 644 staprun/guest/99-stapsh-init.rules $RPM_BUILD_ROOT%{udevrulesdir}
       install -p -m 755 staprun/guest/stapshd $RPM_BUILD_ROOT%{initdir}
@@ -1123,6 +1125,8 @@ exit 0
 %attr(4110,root,stapusr) %{_bindir}/staprun
 %{_bindir}/stapsh
 %{_bindir}/stap-merge
+%{_bindir}/stap-decode
+%{_bindir}/stap-symbolize
 %{_bindir}/stap-report
 %if %{with_dyninst}
 %{_bindir}/stapdyn
@@ -1175,6 +1179,8 @@ exit 0
 %{_mandir}/man1/stap.1*
 %{_mandir}/man1/stap-prep.1*
 %{_mandir}/man1/stap-merge.1*
+%{_mandir}/man1/stap-decode.1*
+%{_mandir}/man1/stap-symbolize.1*
 %{_mandir}/man1/stap-report.1*
 %{_mandir}/man1/stapref.1*
 %{_mandir}/man3/*
@@ -1257,6 +1263,7 @@ exit 0
 %if %{with_systemd}
    %{udevrulesdir}/99-stapsh.rules
    %{_unitdir}/stapsh@.service
+   %{_unitdir}/stapsh-vsock.service
 %else
    %{udevrulesdir}/99-stapsh-init.rules
    %dir %{_libexecdir}/systemtap
@@ -41,11 +41,12 @@ struct dynprobe_info
   const Dwarf_Addr semaphore_addr;
   const string flags_string;
   const string probe_init;
+  const uint64_t regs_mask; // DWARF registers the handler reads
 
   dynprobe_info(bool hp, const Dwarf_Addr o, const Dwarf_Addr sa,
-		const string fs, const string pi):
+		const string fs, const string pi, uint64_t rm):
     has_path(hp), offset(o), semaphore_addr(sa), flags_string(fs),
-    probe_init(pi) { }
+    probe_init(pi), regs_mask(rm) { }
 };
 
 struct dynprobe_derived_probe_group: public generic_dpg<dynprobe_derived_probe>
@@ -66,7 +67,7 @@ public:
 
   void add(const string& path, const Dwarf_Addr offset,
 	   const Dwarf_Addr semaphore_addr, const string& flags_string,
-	   const string& probe_init);
+	   const string& probe_init, uint64_t regs_mask = ~(uint64_t)0);
 };
 
 
@@ -74,11 +75,13 @@ void
 dynprobe_derived_probe_group::add(const string& path, const Dwarf_Addr offset,
 				  const Dwarf_Addr semaphore_addr,
 				  const string& flags_string,
-				  const string& probe_init)
+				  const string& probe_init,
+				  uint64_t regs_mask)
 {
   struct dynprobe_info *info = new dynprobe_info(!path.empty(), offset,
 						 semaphore_addr,
-						 flags_string, probe_init);
+						 flags_string, probe_init,
+						 regs_mask);
   if (!path.empty())
     info_by_path[path].push_back(info);
   else
@@ -108,6 +111,7 @@ dynprobe_derived_probe_group::emit_info(systemtap_session& s,
     s.op->line() << " .semaphore=" << lex_cast_hex(info->semaphore_addr)
 		 << "ULL,";
   s.op->line() << " .flags=" << info->flags_string << ",";
+  s.op->line() << " .regs=" << lex_cast_hex(info->regs_mask) << "ULL,";
   s.op->line() << " .probe=" << info->probe_init << ",";
   s.op->line() << " },";
 }
@@ -178,11 +182,12 @@ void enable_dynprobes(systemtap_session& s)
 void
 dynprobe_add_uprobe(systemtap_session& s, const string& path,
 		    const Dwarf_Addr offset, const Dwarf_Addr semaphore_addr,
-		    const string flags_string, const string probe_init)
+		    const string flags_string, const string probe_init,
+		    uint64_t regs_mask)
 {
   enable_dynprobes(s);
   s.dynprobe_derived_probes->add(path, offset, semaphore_addr, flags_string,
-				 probe_init);
+				 probe_init, regs_mask);
 }
 		    
 void
@@ -16,7 +16,8 @@ void
 dynprobe_add_uprobe(systemtap_session& s, const std::string& path,
 		    const Dwarf_Addr offset, const Dwarf_Addr semaphore_addr,
 		    const std::string flags_string,
-		    const std::string probe_init);
+		    const std::string probe_init,
+		    uint64_t regs_mask = ~(uint64_t)0);
 		    
 void
 dynprobe_add_utrace_path(systemtap_session& s, const std::string& path,
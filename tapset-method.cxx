@@ -25,6 +25,7 @@
 
 extern "C" {
 #include <fnmatch.h>
+#include <glob.h>
 }
 
 using namespace std;
@@ -40,6 +41,7 @@ static const string TOK_RETURN ("return");
 static const string TOK_BEGIN ("begin");
 static const string TOK_END ("end");
 static const string TOK_ERROR ("error");
+static const string TOK_HOTSPOT ("hotspot");
 
 // --------------------------------------------------------------------------
 
@@ -71,6 +73,13 @@ private:
   typedef pair<java_cache_const_iterator_t, java_cache_const_iterator_t>
     java_cache_const_iterator_pair_t;
   java_cache_t java_cache;
+  string libjvm;
+
+  void build_hotspot (systemtap_session & sess,
+		      probe * base,
+		      probe_point * location,
+		      literal_map_t const & parameters,
+		      vector <derived_probe *> & finished_results);
 
 public:
   java_builder () {}
@@ -91,6 +100,12 @@ java_builder::build (systemtap_session & sess,
 		     literal_map_t const & parameters,
 		     vector <derived_probe *> & finished_results)
 {
+  if (parameters.find (TOK_HOTSPOT) != parameters.end ())
+    {
+      build_hotspot (sess, base, loc, parameters, finished_results);
+      return;
+    }
+
   interned_string method_str_val;
   interned_string method_line_val;
   bool has_method_str = get_param (parameters, TOK_METHOD, method_str_val);
@@ -335,6 +350,118 @@ java_builder::build (systemtap_session & sess,
   derive_probes (sess, new_end_probe, finished_results);
 }
 
+// Finds the libjvm.so of the java in $PATH, under either the JDK 9+
+// or the JDK 8 layout of its home directory.
+static string
+find_libjvm (systemtap_session & sess)
+{
+  string java = resolve_path (find_executable ("java", sess.sysroot,
+					       sess.sysenv));
+  size_t bin = java.rfind ("/bin/java");
+  if (bin == string::npos || bin + 9 != java.size ())
+    return "";
+  string home = java.substr (0, bin);
+
+  const char *layouts[] = { "/lib/server/libjvm.so",
+			    "/lib/*/server/libjvm.so",
+			    "/jre/lib/*/server/libjvm.so" };
+  for (unsigned i = 0; i < sizeof (layouts) / sizeof (layouts[0]); i++)
+    {
+      glob_t g;
+      string found;
+      if (glob ((home + layouts[i]).c_str (), 0, NULL, &g) == 0
+	  && g.gl_pathc > 0)
+	found = g.gl_pathv[0];
+      globfree (&g);
+      if (!found.empty ())
+	return found;
+    }
+  return "";
+}
+
+// Appends a check that the string at $ADDR, $LEN bytes long and not
+// nul-terminated, is NAME, unless NAME is "*".  The length goes
+// first, so that most calls are turned away without a string copy.
+static void
+hotspot_filter (stringstream & code, unsigned addr, unsigned len,
+		const string & name)
+{
+  if (name == "*")
+    return;
+  code << "if ($arg" << len << " != " << name.size ()
+       << " || user_string_n($arg" << addr << ", " << name.size ()
+       << ", \"\") != " << lex_cast_qstring (name) << ") next;" << endl;
+}
+
+/* The hotspot JVM has its own sys/sdt.h markers at every method entry
+   and return, enabled with -XX:+ExtendedDTraceProbes (or just
+   -XX:+DTraceMethodProbes), that pass the class name, method name and
+   signature of the method.  A java.hotspot probe is a plain marker
+   probe on libjvm.so that checks those against its own, so it needs no
+   byteman rules in the JVM, no JNI call per method invocation, and
+   nothing to install or uninstall at startup and shutdown. */
+void
+java_builder::build_hotspot (systemtap_session & sess,
+			     probe * base,
+			     probe_point * loc,
+			     literal_map_t const & parameters,
+			     vector <derived_probe *> & finished_results)
+{
+  interned_string class_str_val, method_str_val, libjvm_str_val;
+  bool has_return = has_null_param (parameters, TOK_RETURN);
+  get_param (parameters, TOK_CLASS, class_str_val);
+  get_param (parameters, TOK_METHOD, method_str_val);
+
+  string lib;
+  if (get_param (parameters, TOK_HOTSPOT, libjvm_str_val))
+    lib = find_executable (libjvm_str_val, sess.sysroot, sess.sysenv);
+  else
+    {
+      if (libjvm.empty ())
+	libjvm = find_libjvm (sess);
+      if (libjvm.empty ())
+	throw SEMANTIC_ERROR (_("can't find libjvm.so of the java in $PATH, "
+				"use java.hotspot(\"PATH\")"));
+      lib = libjvm;
+    }
+
+  // The markers pass the class in its internal form, java/lang/Object.
+  string class_name = class_str_val;
+  replace (class_name.begin (), class_name.end (), '.', '/');
+  string method_name = method_str_val;
+  if (method_name.find_first_of ("(:") != string::npos)
+    throw SEMANTIC_ERROR (_("java.hotspot probes take a bare method name"));
+
+  loc->well_formed = true;
+
+  stringstream code;
+  const token* tok = base->body->tok;
+  code << "probe process(" << literal_string (lib) << ")"
+       << ".provider(\"hotspot\").mark("
+       << (has_return ? "\"method__return\"" : "\"method__entry\"")
+       << ") {" << endl;
+
+  // $arg1 is the thread id, then come the class name, method name and
+  // signature, each as an address and a length.
+  hotspot_filter (code, 2, 3, class_name);
+  hotspot_filter (code, 4, 5, method_name);
+  code << "thread_id = $arg1;" << endl;
+  code << "classname = str_replace(user_string_n($arg2, $arg3, \"\"), "
+       << "\"/\", \".\");" << endl;
+  code << "methodname = user_string_n($arg4, $arg5, \"\");" << endl;
+  code << "signature = user_string_n($arg6, $arg7, \"\");" << endl;
+  code << "}" << endl;
+
+  probe* new_mark_probe = parse_synthetic_probe (sess, code, tok);
+  if (!new_mark_probe)
+    throw SEMANTIC_ERROR (_("can't create java hotspot probe"), tok);
+
+  new_mark_probe->base = new probe(base, loc);
+  new_mark_probe->body = new block (new_mark_probe->body, base->body);
+
+  derive_probes (sess, new_mark_probe, finished_results);
+}
+
 void
 register_tapset_java (systemtap_session& s)
 {
@@ -366,6 +493,21 @@ register_tapset_java (systemtap_session& s)
     ->bind_privilege(pr_all)
     ->bind (builder);
 #endif
+
+  // The hotspot markers need neither byteman nor the HelperSDT
+  // library.
+  derived_probe_builder *hotspot_builder = new java_builder ();
+  vector<match_node*> hotspots;
+  hotspots.push_back (s.pattern_root->bind (TOK_JAVA)->bind (TOK_HOTSPOT));
+  hotspots.push_back (s.pattern_root->bind (TOK_JAVA)->bind_str (TOK_HOTSPOT));
+  for (unsigned i = 0; i < hotspots.size (); i++)
+    {
+      match_node* method = hotspots[i]->bind_str (TOK_CLASS)
+	->bind_str (TOK_METHOD);
+      method->bind_privilege (pr_all)->bind (hotspot_builder);
+      method->bind (TOK_RETURN)->bind_privilege (pr_all)
+	->bind (hotspot_builder);
+    }
 }
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
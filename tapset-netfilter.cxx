@@ -14,6 +14,7 @@
 #include <cstring>
 #include <string>
 #include <limits.h>
+#include <netinet/in.h>
 
 using namespace std;
 using namespace __gnu_cxx;
@@ -22,6 +23,10 @@ static const string TOK_NETFILTER("netfilter");
 static const string TOK_HOOK("hook");
 static const string TOK_PF("pf");
 static const string TOK_PRIORITY("priority");
+static const string TOK_TCP("tcp");
+static const string TOK_UDP("udp");
+static const string TOK_SPORT("sport");
+static const string TOK_DPORT("dport");
 
 // ------------------------------------------------------------------------
 // netfilter derived probes
@@ -35,12 +40,20 @@ struct netfilter_derived_probe: public derived_probe
   string priority;
   unsigned nf_index;
 
+  // Packet header predicates, checked in the hook before a context is
+  // taken; -1 matches anything.
+  int64_t protocol, sport, dport;
+
   set<string> context_vars;
 
   netfilter_derived_probe (systemtap_session &, probe* p,
                            probe_point* l, string h,
-                           string protof, string pri);
+                           string protof, string pri,
+                           int64_t proto, int64_t sp, int64_t dp);
   virtual void join_group (systemtap_session& s);
+
+  bool filtered_p () const
+    { return protocol >= 0 || sport >= 0 || dport >= 0; }
 };
 
 
@@ -67,8 +80,11 @@ struct netfilter_var_expanding_visitor: public var_expanding_visitor
 
 netfilter_derived_probe::netfilter_derived_probe (systemtap_session &s, probe* p,
                                                   probe_point* l, string h,
-                                                  string protof, string pri):
-  derived_probe (p, l), hook (h), pf (protof), priority (pri)
+                                                  string protof, string pri,
+                                                  int64_t proto, int64_t sp,
+                                                  int64_t dp):
+  derived_probe (p, l), hook (h), pf (protof), priority (pri),
+  protocol (proto), sport (sp), dport (dp)
 {
   static unsigned nf_index_ctr = 0;
   this->nf_index = nf_index_ctr++; // PR14137: need to generate unique
@@ -206,6 +222,14 @@ netfilter_derived_probe::netfilter_derived_probe (systemtap_session &s, probe* p
             (_F("unsupported netfilter protocol family \"%s\"; need stap -g", pf.c_str()));
     }
 
+  // The packet filters only know the ipv4 and ipv6 headers
+  if (filtered_p() && pf != "2" && pf != "10")
+    throw SEMANTIC_ERROR (_("netfilter packet filters need an ipv4 or ipv6 probe"));
+  if ((sport >= 0 || dport >= 0) && protocol < 0)
+    throw SEMANTIC_ERROR (_("netfilter port filters need a tcp or udp probe"));
+  if (sport > 65535 || dport > 65535)
+    throw SEMANTIC_ERROR (_("netfilter port out of range"));
+
   // Expand local variables in the probe body
   netfilter_var_expanding_visitor v (s);
   var_expand_const_fold_loop (s, this->body, v);
@@ -317,6 +341,19 @@ netfilter_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->newline() << "#elif defined(STAPCONF_NETFILTER_V41)";
       s.op->newline() << "int (*nf_okfn)(struct sock *, struct sk_buff *) = nf_state->okfn;";
       s.op->newline() << "#endif";
+
+      // Let the packets the probe point filters out go before any
+      // context is taken.
+      if (np->filtered_p())
+        {
+          s.op->newline() << "if (!_stp_nf_match(nf_skb, " << np->pf << ", "
+                          << np->protocol << ", " << np->sport << ", "
+                          << np->dport << "))";
+          s.op->newline(1) << "return NF_ACCEPT;";
+          s.op->indent(-1);
+        }
+      s.op->newline() << "{";
+      s.op->indent(1);
       common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "stp",
                                      "stp_probe_type_netfilter",
                                      false);
@@ -355,6 +392,7 @@ netfilter_derived_probe_group::emit_module_decls (systemtap_session& s)
 
       if (np->context_vars.find("__nf_verdict") != np->context_vars.end())
         s.op->newline() << "if (c != NULL) nf_verdict = (int) "+c_p+"." + s.up->c_localname("__nf_verdict") + ";";
+      s.op->newline(-1) << "}";
 
       s.op->newline() << "return nf_verdict;";
       s.op->newline(-1) << "}";
@@ -517,6 +555,7 @@ netfilter_builder::build(systemtap_session & sess,
   interned_string hook;                // no default
   interned_string pf; // no default
   interned_string priority = "0";      // Default: somewhere in the middle
+  int64_t protocol = -1, sport = -1, dport = -1; // Default: any packet
 
   if(!get_param(parameters, TOK_HOOK, hook))
     throw SEMANTIC_ERROR (_("missing hooknum"));
@@ -526,7 +565,38 @@ netfilter_builder::build(systemtap_session & sess,
 
   get_param(parameters, TOK_PRIORITY, priority);
 
-  finished_results.push_back(new netfilter_derived_probe(sess, base, location, hook, pf, priority));
+  if (has_null_param(parameters, TOK_TCP))
+    protocol = IPPROTO_TCP;
+  else if (has_null_param(parameters, TOK_UDP))
+    protocol = IPPROTO_UDP;
+  get_param(parameters, TOK_SPORT, sport);
+  get_param(parameters, TOK_DPORT, dport);
+  if (sport < -1 || dport < -1)
+    throw SEMANTIC_ERROR (_("netfilter port out of range"));
+
+  finished_results.push_back(new netfilter_derived_probe(sess, base, location, hook, pf, priority,
+                                                         protocol, sport, dport));
+}
+
+
+// Each netfilter probe point may end in .tcp or .udp, optionally
+// followed by .sport(N) and/or .dport(N), which the hook checks before
+// running the handler.  These usually come as alias suffixes, as in
+// netfilter.ipv4.pre_routing.tcp.dport(443).
+static void
+bind_netfilter_filters (match_node* node, derived_probe_builder* builder)
+{
+  node->bind(builder);
+
+  const string* protos[] = { &TOK_TCP, &TOK_UDP };
+  for (unsigned i = 0; i < 2; i++)
+    {
+      match_node* p = node->bind(*protos[i]);
+      p->bind(builder);
+      p->bind_num(TOK_SPORT)->bind(builder);
+      p->bind_num(TOK_SPORT)->bind_num(TOK_DPORT)->bind(builder);
+      p->bind_num(TOK_DPORT)->bind(builder);
+    }
 }
 
 void
@@ -537,16 +607,16 @@ register_tapset_netfilter(systemtap_session& s)
 
 
   //netfilter.hook().pf()
-  root->bind(TOK_NETFILTER)->bind_str(TOK_HOOK)->bind_str(TOK_PF)->bind(builder);
+  bind_netfilter_filters(root->bind(TOK_NETFILTER)->bind_str(TOK_HOOK)->bind_str(TOK_PF), builder);
 
   //netfilter.pf().hook()
-  root->bind(TOK_NETFILTER)->bind_str(TOK_PF)->bind_str(TOK_HOOK)->bind(builder);
+  bind_netfilter_filters(root->bind(TOK_NETFILTER)->bind_str(TOK_PF)->bind_str(TOK_HOOK), builder);
 
   //netfilter.hook().pf().priority()
-  root->bind(TOK_NETFILTER)->bind_str(TOK_HOOK)->bind_str(TOK_PF)->bind_str(TOK_PRIORITY)->bind(builder);
+  bind_netfilter_filters(root->bind(TOK_NETFILTER)->bind_str(TOK_HOOK)->bind_str(TOK_PF)->bind_str(TOK_PRIORITY), builder);
 
   //netfilter.pf().hook().priority()
-  root->bind(TOK_NETFILTER)->bind_str(TOK_PF)->bind_str(TOK_HOOK)->bind_str(TOK_PRIORITY)->bind(builder);
+  bind_netfilter_filters(root->bind(TOK_NETFILTER)->bind_str(TOK_PF)->bind_str(TOK_HOOK)->bind_str(TOK_PRIORITY), builder);
 }
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
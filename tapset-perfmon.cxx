@@ -31,6 +31,7 @@ static const string TOK_SAMPLE("sample");
 static const string TOK_HZ("hz");
 static const string TOK_PROCESS("process");
 static const string TOK_COUNTER("counter");
+static const string TOK_PROFILE("profile");
 
 
 // ------------------------------------------------------------------------
@@ -47,10 +48,12 @@ struct perf_derived_probe: public derived_probe
   bool has_process;
   bool has_counter;
   bool has_freq;
+  bool profile;
   string process_name;
   string counter;
   perf_derived_probe (probe* p, probe_point* l, int64_t type, int64_t config,
-		      int64_t i, bool pp, bool cp, bool freq, string pn, string cv);
+		      int64_t i, bool pp, bool cp, bool freq, bool prof,
+		      string pn, string cv);
   virtual void join_group (systemtap_session& s);
 };
 
@@ -61,6 +64,11 @@ struct perf_derived_probe_group: public generic_dpg<perf_derived_probe>
 			   ,perf_derived_probe_group *pg,
                            sort_for_bpf_probe_arg_vector &v);
 
+  // For each probe, the probes run off its events, itself first; empty
+  // for probes run off another's.
+  vector<vector<unsigned> > sharers;
+  void share_events ();
+
   void emit_module_decls (systemtap_session& s);
   void emit_module_init (systemtap_session& s);
   void emit_module_exit (systemtap_session& s);
@@ -74,13 +82,14 @@ perf_derived_probe::perf_derived_probe (probe* p, probe_point* l,
 					bool process_p,
 					bool counter_p,
 					bool freq,
+					bool prof,
 					string process_n,
 					string counter):
   
   derived_probe (p, l, true /* .components soon rewritten */),
   event_type (type), event_config (config), interval (i),
   has_process (process_p), has_counter (counter_p), has_freq(freq),
-  process_name (process_n), counter (counter)
+  profile (prof), process_name (process_n), counter (counter)
 {
   vector<probe_point::component*>& comps = this->sole_location()->components;
   comps.clear();
@@ -92,6 +101,8 @@ perf_derived_probe::perf_derived_probe (probe* p, probe_point* l,
     comps.push_back (new probe_point::component (TOK_PROCESS, new literal_string (process_name)));
   if (has_counter)
     comps.push_back (new probe_point::component (TOK_COUNTER, new literal_string (counter)));
+  if (profile)
+    comps.push_back (new probe_point::component (TOK_PROFILE));
 }
 
 
@@ -108,20 +119,53 @@ perf_derived_probe::join_group (systemtap_session& s)
 }
 
 
+// System-wide probes on the same event, such as several timer.profile
+// probes falling back to perf.sw.cpu_clock, run off one set of per-cpu
+// events rather than each opening its own: that's one interrupt per
+// sample on each cpu, as with the single profiling timer hook.
+void
+perf_derived_probe_group::share_events ()
+{
+  sharers.assign (probes.size(), vector<unsigned>());
+  for (unsigned i=0; i < probes.size(); i++)
+    {
+      perf_derived_probe *p = probes[i];
+      unsigned j = 0;
+      if (!p->has_process && !p->has_counter)
+        for (; j < i; j++)
+          {
+            perf_derived_probe *q = probes[j];
+            if (!sharers[j].empty()
+                && !q->has_process && !q->has_counter
+                && q->event_type == p->event_type
+                && q->event_config == p->event_config
+                && q->interval == p->interval
+                && q->has_freq == p->has_freq)
+              break;
+          }
+      sharers[j < i ? j : i].push_back (i);
+    }
+}
+
+
 void
 perf_derived_probe_group::emit_module_decls (systemtap_session& s)
 {
   bool have_a_process_tag = false;
+  bool have_a_profile = false;
 
   for (unsigned i=0; i < probes.size(); i++)
-    if (probes[i]->has_process && !probes[i]->has_counter)
-      {
+    {
+      if (probes[i]->has_process && !probes[i]->has_counter)
 	have_a_process_tag = true;
-	break;
-      }
+      if (probes[i]->profile)
+	have_a_profile = true;
+    }
 
   if (probes.empty()) return;
 
+  share_events ();
+
   s.op->newline() << "/* ---- perf probes ---- */";
   s.op->newline() << "#include <linux/perf_event.h>";
   s.op->newline() << "#include \"linux/perf.h\"";
@@ -129,6 +173,8 @@ perf_derived_probe_group::emit_module_decls (systemtap_session& s)
 
   /* declarations */
   s.op->newline() << "static void handle_perf_probe (unsigned i, struct pt_regs *regs);";
+  if (have_a_profile)
+    s.op->newline() << "static void handle_perf_profile (struct stap_perf_sample *sample);";
   for (unsigned i=0; i < probes.size(); i++)
     {
       s.op->newline() << "#ifdef STAPCONF_PERF_HANDLER_NMI";
@@ -209,6 +255,10 @@ perf_derived_probe_group::emit_module_decls (systemtap_session& s)
 	}
       else
 	s.op->newline() << ".system_wide=" << "1, ";
+      if (sharers[i].empty())
+	s.op->newline() << ".shared=" << "1, ";
+      if (probes[i]->profile)
+	s.op->newline() << ".profile=" << "1, ";
       s.op->newline() << ".cb_lock = __MUTEX_INITIALIZER(stap_perf_probes[" << i << "].cb_lock),";
       s.op->newline(-1) << "},";
     }
@@ -230,11 +280,16 @@ perf_derived_probe_group::emit_module_decls (systemtap_session& s)
                       << "struct pt_regs *regs)";
       s.op->newline() << "#endif";
       s.op->newline() << "{";
-      s.op->newline(1) << "handle_perf_probe(" << i << ", regs);";
+      s.op->indent(1);
+      for (unsigned j=0; j < sharers[i].size(); j++)
+        s.op->newline() << "handle_perf_probe(" << sharers[i][j] << ", regs);";
       s.op->newline(-1) << "}";
     }
   s.op->newline();
 
+  if (have_a_profile)
+    s.op->newline() << "#include \"linux/perf_profile.c\"";
+
   s.op->newline() << "static void handle_perf_probe (unsigned i, struct pt_regs *regs)";
   s.op->newline() << "{";
   s.op->newline(1) << "struct stap_perf_probe* stp = & stap_perf_probes [i];";
@@ -247,10 +302,36 @@ perf_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline(1) << "c->kregs = regs;";
   s.op->newline(-1) << "}";
 
-  s.op->newline() << "(*stp->probe->ph) (c);";
+  if (have_a_profile)
+    {
+      // Profile samples only get their stacks taken here; the handler
+      // runs later for each distinct one, see handle_perf_profile.
+      s.op->newline() << "if (stp->profile)";
+      s.op->newline(1) << "_stp_perf_profile_sample(c, i);";
+      s.op->newline(-1) << "else";
+      s.op->newline(1) << "(*stp->probe->ph) (c);";
+      s.op->indent(-1);
+    }
+  else
+    s.op->newline() << "(*stp->probe->ph) (c);";
   common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
   s.op->newline(-1) << "}";
   s.op->newline();
+
+  if (have_a_profile)
+    {
+      s.op->newline() << "static void handle_perf_profile (struct stap_perf_sample *sample)";
+      s.op->newline() << "{";
+      s.op->newline(1) << "struct stap_perf_probe* stp = & stap_perf_probes [sample->probe];";
+      common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "stp->probe",
+				     "stp_probe_type_perf");
+      s.op->newline() << "c->perf_sample = sample;";
+      s.op->newline() << "(*stp->probe->ph) (c);";
+      s.op->newline() << "c->perf_sample = NULL;";
+      common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
+      s.op->newline(-1) << "}";
+      s.op->newline();
+    }
   if (have_a_process_tag)
     s.op->newline() << "#define STP_PERF_USE_TASK_FINDER 1";
   s.op->newline() << "#include \"linux/perf.c\"";
@@ -263,8 +344,24 @@ perf_derived_probe_group::emit_module_init (systemtap_session& s)
 {
   if (probes.empty()) return;
 
-  s.op->newline() << "rc = _stp_perf_init_n (stap_perf_probes, "
-		  << probes.size() << ", &probe_point);";
+  bool have_a_profile = false;
+  for (unsigned i=0; i < probes.size(); i++)
+    if (probes[i]->profile)
+      have_a_profile = true;
+
+  if (have_a_profile)
+    {
+      s.op->newline() << "rc = _stp_perf_profile_init ();";
+      s.op->newline() << "if (rc == 0) {";
+      s.op->newline(1) << "rc = _stp_perf_init_n (stap_perf_probes, "
+		       << probes.size() << ", &probe_point);";
+      s.op->newline() << "if (rc)";
+      s.op->newline(1) << "_stp_perf_profile_exit ();";
+      s.op->newline(-2) << "}";
+    }
+  else
+    s.op->newline() << "rc = _stp_perf_init_n (stap_perf_probes, "
+		    << probes.size() << ", &probe_point);";
 }
 
 
@@ -275,6 +372,13 @@ perf_derived_probe_group::emit_module_exit (systemtap_session& s)
 
   s.op->newline() << "_stp_perf_del_n (stap_perf_probes, "
 		  << probes.size() << ");";
+
+  for (unsigned i=0; i < probes.size(); i++)
+    if (probes[i]->profile)
+      {
+	s.op->newline() << "_stp_perf_profile_exit ();";
+	break;
+      }
 }
 
 
@@ -349,6 +453,19 @@ perf_builder::build(systemtap_session & sess,
       base->body = new block (n, base->body);
     }
 
+  bool profile = has_null_param(parameters, TOK_PROFILE);
+  if (profile)
+    {
+      if (sess.runtime_mode == systemtap_session::bpf_runtime)
+	throw SEMANTIC_ERROR(_("perf profile probes are not supported by the bpf runtime"),
+			     base->tok);
+      // The samples are taken as kernel and user stack ids.
+      sess.need_unwind = true;
+      sess.need_user_unwind = true;
+      sess.need_stack_ids = true;
+      enable_vma_tracker(sess);
+    }
+
   bool proc_p;
   interned_string proc_n;
   if ((proc_p = has_null_param(parameters, TOK_PROCESS)))
@@ -372,9 +489,10 @@ perf_builder::build(systemtap_session & sess,
     proc_n = find_executable (proc_n, sess.sysroot, sess.sysenv);
 
   if (sess.verbose > 1)
-    clog << _F("perf probe type=%" PRId64 " config=%" PRId64 " %s=%" PRId64 " process=%s counter=%s",
+    clog << _F("perf probe type=%" PRId64 " config=%" PRId64 " %s=%" PRId64 " process=%s counter=%s%s",
 	       type, config, has_freq ? "freq" : "period", has_freq ? freq : period,
-               proc_n.to_string().c_str(), var.to_string().c_str()) << endl;
+               proc_n.to_string().c_str(), var.to_string().c_str(),
+	       profile ? " profile" : "") << endl;
 
   // The user-provided pp is already well-formed. Let's add a copy on the chain
   // and set it as the new base
@@ -385,7 +503,7 @@ perf_builder::build(systemtap_session & sess,
   finished_results.push_back
     (new perf_derived_probe(new_base, location, type, config,
                             has_freq ? freq : period, proc_p,
-			    has_counter, has_freq, proc_n, var));
+			    has_counter, has_freq, profile, proc_n, var));
   if (!var.empty())
     sess.perf_counters.push_back(make_pair (var, proc_n));
 }
@@ -407,6 +525,13 @@ register_tapset_perf(systemtap_session& s)
   event->bind(TOK_PROCESS)->bind(builder);
   event->bind_str(TOK_COUNTER)->bind(builder);
   event->bind_str(TOK_PROCESS)->bind_str(TOK_COUNTER)->bind(builder);
+
+  // Sampling profiler mode, see handle_perf_profile.
+  event->bind(TOK_PROFILE)->bind(builder);
+  event->bind_num(TOK_SAMPLE)->bind(TOK_PROFILE)->bind(builder);
+  event->bind_num(TOK_HZ)->bind(TOK_PROFILE)->bind(builder);
+  event->bind_str(TOK_PROCESS)->bind(TOK_PROFILE)->bind(builder);
+  event->bind(TOK_PROCESS)->bind(TOK_PROFILE)->bind(builder);
 }
 
 bool
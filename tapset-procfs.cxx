@@ -26,6 +26,8 @@ static const string TOK_READ("read");
 static const string TOK_WRITE("write");
 static const string TOK_MAXSIZE("maxsize");
 static const string TOK_UMASK("umask");
+static const string TOK_CACHE("cache");
+static const string TOK_MMAP("mmap");
 
 // ------------------------------------------------------------------------
 // procfs file derived probes
@@ -39,10 +41,13 @@ struct procfs_derived_probe: public derived_probe
   bool target_symbol_seen;
   int64_t maxsize_val;
   int64_t umask; 
+  int64_t cache_ms;
+  bool mmap;
   string variable_name;
 
-  procfs_derived_probe (systemtap_session &, probe* p, probe_point* l, string ps, bool w, int64_t m, int64_t umask); 
+  procfs_derived_probe (systemtap_session &, probe* p, probe_point* l, string ps, bool w, int64_t m, int64_t umask, int64_t cache_ms = 0, bool mmap = false); 
   void join_group (systemtap_session& s);
+  bool writes_rarely () { return write; }
 
   // Set up this procfs probe to use a static C variable as input
   // instead using the probe body.
@@ -130,9 +135,10 @@ struct procfs_var_expanding_visitor: public var_expanding_visitor
 
 procfs_derived_probe::procfs_derived_probe (systemtap_session &s, probe* p,
                                             probe_point* l, string ps, bool w,
-					    int64_t m, int64_t umask):  
+					    int64_t m, int64_t umask,
+					    int64_t cache_ms, bool mmap):
     derived_probe(p, l), path(ps), write(w), target_symbol_seen(false),
-    maxsize_val(m), umask(umask) 
+    maxsize_val(m), umask(umask), cache_ms(cache_ms), mmap(mmap)
 {
   // Expand local variables in the probe body
   procfs_var_expanding_visitor v (s, path, write);
@@ -260,6 +266,17 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
 	}
       else
 	s.op->line() << "[MAXSTRINGLEN];";
+
+      // A cached read probe renders into one buffer while readers
+      // copy from the other.
+      if (pset->read_probe != NULL && pset->read_probe->cache_ms)
+        {
+          s.op->newline() << "char cbuf_" << (buf_index - 1);
+	  if (pset->read_probe->maxsize_val == 0)
+	    s.op->line() << "[STP_PROCFS_BUFSIZE];";
+	  else
+	    s.op->line() << "[" << pset->read_probe->maxsize_val << "];";
+        }
     }
   s.op->newline(-1) << "} stap_procfs_probe_buffers;";
 
@@ -345,6 +362,16 @@ procfs_derived_probe_group::emit_module_decls (systemtap_session& s)
 	  else
 	    s.op->line() << " .bufsize=MAXSTRINGLEN,";
 
+	  if (pset->read_probe != NULL && pset->read_probe->cache_ms)
+	    {
+	      s.op->line() << " .cache=stap_procfs_probe_buffers.cbuf_"
+			   << (buf_index - 1) << ",";
+	      s.op->line() << " .cache_ms=" << pset->read_probe->cache_ms
+			   << ",";
+	      if (pset->read_probe->mmap)
+		s.op->line() << " .mmap=1,";
+	    }
+
 	  s.op->line() << " .permissions="
 		       << (((pset->read_probe ? 0444 : 0) 
 			    | (pset->write_probes.size() > 0 ? 0222 : 0)) &~
@@ -475,8 +502,10 @@ procfs_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline(1) << "probe_point = \"internal buffer\";";
   s.op->indent(-1);
 
-  s.op->newline() << "_spp_init(spp);";
-  s.op->newline() << "rc = _stp_create_procfs(spp->path, &_stp_proc_fops, spp->permissions, spp);";
+  s.op->newline() << "rc = _spp_init(spp);";
+  s.op->newline() << "if (!rc)";
+  s.op->newline(1) << "rc = _stp_create_procfs(spp->path, &_stp_proc_fops, spp->permissions, spp);";
+  s.op->indent(-1);
 
   s.op->newline() << "if (rc) {";
   s.op->newline(1) << "_stp_close_procfs();";
@@ -497,6 +526,9 @@ procfs_derived_probe_group::emit_module_exit (systemtap_session& s)
   if (probes_by_path.empty())
     return;
 
+  s.op->newline() << "for (i = 0; i < " << probes_by_path.size() << "; i++)";
+  s.op->newline(1) << "_spp_stop(&stap_procfs_probes[i]);";
+  s.op->indent(-1);
   s.op->newline() << "_stp_close_procfs();";
   s.op->newline() << "for (i = 0; i < " << probes_by_path.size() << "; i++) {";
   s.op->newline(1) << "struct stap_procfs_probe *spp = &stap_procfs_probes[i];";
@@ -698,6 +730,16 @@ procfs_builder::build(systemtap_session & sess,
 	throw SEMANTIC_ERROR (_("maxsize must be greater than 0"));
     }
 
+  // Validate '.cache(MS)', if it exists.
+  int64_t cache_ms = 0;
+  if (get_param(parameters, TOK_CACHE, cache_ms))
+    {
+      if (cache_ms <= 0 || cache_ms > 3600000)
+	throw SEMANTIC_ERROR (_("cache period must be between 1 and 3600000 ms"));
+      if (sess.runtime_mode == systemtap_session::bpf_runtime)
+	throw SEMANTIC_ERROR (_("procfs read probes can't be cached in the bpf runtime"));
+    }
+
   // If no procfs path, default to "command".  The runtime will do
   // this for us, but if we don't do it here, we'll think the
   // following 2 probes are attached to different paths:
@@ -748,7 +790,9 @@ procfs_builder::build(systemtap_session & sess,
 
   finished_results.push_back(new procfs_derived_probe(sess, base, location,
                                                       path, has_write,
-						      maxsize_val, umask_val));
+						      maxsize_val, umask_val,
+						      cache_ms,
+						      parameters.find(TOK_MMAP) != parameters.end()));
 }
 
 
@@ -766,6 +810,18 @@ register_tapset_procfs(systemtap_session& s)
   root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind(builder);
   root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(builder);
   root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind(builder);
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(builder);
+  root->bind(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(TOK_MMAP)->bind(builder);
+  root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(TOK_MMAP)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(TOK_MMAP)->bind(builder);
+  root->bind_str(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_READ)->bind_num(TOK_MAXSIZE)->bind_num(TOK_CACHE)->bind(TOK_MMAP)->bind(builder);
 
   root->bind(TOK_PROCFS)->bind(TOK_WRITE)->bind(builder);
   root->bind(TOK_PROCFS)->bind_num(TOK_UMASK)->bind(TOK_WRITE)->bind(builder);
@@ -24,6 +24,9 @@ static const string TOK_MODULE("module");
 static const string TOK_FUNCTION("function");
 static const string TOK_CALL("call");
 static const string TOK_RETURN("return");
+static const string TOK_SAMPLE("sample");
+static const string TOK_HZ("hz");
+static const string TOK_LIBRARY("library");
 
 
 // ------------------------------------------------------------------------
@@ -102,6 +105,11 @@ private:
 	      interned_string module,
 	      interned_string function,
 	      vector<python_probe_info *> &results);
+  int resolve_library(systemtap_session& s, string& library);
+  void build_sample(systemtap_session & sess, probe * base,
+		    probe_point * location,
+		    literal_map_t const & parameters,
+		    vector<derived_probe *> & finished_results);
 
   // python2-related info
   derived_probe* python2_procfs_probe;
@@ -110,6 +118,7 @@ private:
   // python3-related info
   derived_probe* python3_procfs_probe;
   unsigned python3_key;
+  string python3_library;
 
 public:
   python_builder() : python2_procfs_probe(NULL),
@@ -463,12 +472,166 @@ python_builder::resolve(systemtap_session& s,
   return stap_waitpid(s.verbose, child);
 }
 
+// Find the shared library that holds the interpreter of the python3
+// found at configure time, or the executable itself if it is
+// statically linked, for python3.sample probes that do not name one.
+int
+python_builder::resolve_library(systemtap_session& s, string& library)
+{
+  vector<string> args;
+  int child_out = -1;
+
+  assert_no_interrupts();
+
+  args.push_back(PYTHON3_BASENAME);
+  args.push_back("-c");
+  args.push_back("import os, sys, sysconfig\n"
+		 "lib = os.path.join(sysconfig.get_config_var('LIBDIR') or '',\n"
+		 "                   sysconfig.get_config_var('INSTSONAME') or '')\n"
+		 "if not sysconfig.get_config_var('Py_ENABLE_SHARED') \\\n"
+		 "   or not os.path.exists(lib):\n"
+		 "    lib = sys.executable\n"
+		 "print(sys.version_info[0], sys.version_info[1],"
+		 " os.path.realpath(lib))\n");
+
+  pid_t child = stap_spawn_piped(s.verbose, args, NULL, &child_out);
+  if (child <= 0)
+      return -1;
+
+  // Read stdout from the child: 'MAJOR MINOR LIBRARY'.
+  stdio_filebuf<char> buf(child_out, ios_base::in);
+  istream in(&buf);
+  unsigned major = 0, minor = 0;
+  in >> major >> minor;
+  getline(in >> ws, library);
+  buf.close();
+
+  int rc = stap_waitpid(s.verbose, child);
+  if (rc != 0 || library.empty())
+      return -1;
+
+  // The interpreter frames we walk came with python 3.11, and their
+  // thread state link with python 3.12.
+  if (major < 3 || (major == 3 && minor < 12))
+    throw SEMANTIC_ERROR(_F("python3.sample needs python 3.12 or later, "
+			    "but %s is python %u.%u", PYTHON3_BASENAME,
+			    major, minor));
+  return 0;
+}
+
+
+// Returns the code of an expression that reads the python unicode
+// object OBJ (compact, as code object names and filenames are) as a
+// string.
+static string
+python3_sample_string(const string& obj, const string& lib)
+{
+  return "(@cast(" + obj + ", \"PyASCIIObject\", \"" + lib
+    + "\")->state->ascii ? user_string(" + obj
+    + " + @cast_sizeof(\"PyASCIIObject\", \"" + lib + "\"), \"\")"
+    + " : user_string(@cast(" + obj + ", \"PyCompactUnicodeObject\", \""
+    + lib + "\")->utf8, \"\"))";
+}
+
+
+// A python3.sample probe reads the python function running on the
+// sampled thread straight out of the interpreter's own state, rather
+// than from the HelperSDT module's trace hook: a perf cpu clock probe
+// finds the thread state of the current thread in _PyRuntime, and the
+// innermost python frame in it, using the libpython debuginfo.  The
+// traced program runs unmodified between samples.
+void
+python_builder::build_sample(systemtap_session & sess, probe * base,
+			     probe_point * location,
+			     literal_map_t const & parameters,
+			     vector<derived_probe *> & finished_results)
+{
+  int64_t hz = 100;
+  interned_string library;
+
+  if (get_param (parameters, TOK_HZ, hz) && hz <= 0)
+    throw SEMANTIC_ERROR(_("python3.sample frequency must be positive"),
+			 parameters.find(TOK_HZ)->second->tok);
+
+  string lib;
+  if (get_param (parameters, TOK_LIBRARY, library))
+    {
+      if (library == "")
+	throw SEMANTIC_ERROR(_("The python library name must be specified."));
+      lib = find_executable (library, sess.sysroot, sess.sysenv);
+    }
+  else
+    {
+      if (python3_library.empty()
+	  && resolve_library(sess, python3_library) != 0)
+	throw SEMANTIC_ERROR(_F("The library of %s cannot be resolved.",
+				PYTHON3_BASENAME));
+      lib = python3_library;
+    }
+
+  string ts = "@cast(__py3_tstate, \"PyThreadState\", \"" + lib + "\")";
+  string fr = "@cast(__py3_frame, \"_PyInterpreterFrame\", \"" + lib + "\")";
+  string co = "@cast(__py3_code, \"PyCodeObject\", \"" + lib + "\")";
+
+  stringstream code;
+  const token* tok = base->body->tok;
+  code << "probe perf.sw.cpu_clock.hz(" << hz << ") {" << endl;
+  code << "  __py3_frame = 0" << endl;
+  code << "  try {" << endl;
+  // Threads of other programs have no _PyRuntime mapped.
+  code << "    if (&@var(\"_PyRuntime\", \"" << lib << "\") != 0) {" << endl;
+  code << "      __py3_tstate = @var(\"_PyRuntime\", \"" << lib
+       << "\")->interpreters->head->threads->head" << endl;
+  code << "      while (__py3_tstate && " << ts
+       << "->native_thread_id != tid())" << endl;
+  code << "        __py3_tstate = " << ts << "->next" << endl;
+  code << "      if (__py3_tstate)" << endl;
+  code << "        __py3_frame = @choose_defined(" << ts
+       << "->current_frame, " << ts << "->cframe->current_frame)" << endl;
+  // Skip the shim frames that C code pushes when it calls into python.
+  code << "      while (__py3_frame && " << fr << "->owner == 3)" << endl;
+  code << "        __py3_frame = " << fr << "->previous" << endl;
+  code << "    }" << endl;
+  code << "    if (__py3_frame) {" << endl;
+  code << "      __py3_code = @choose_defined(" << fr << "->f_executable, "
+       << fr << "->f_code)" << endl;
+  code << "      funcname = "
+       << python3_sample_string(co + "->co_qualname", lib) << endl;
+  code << "      filename = "
+       << python3_sample_string(co + "->co_filename", lib) << endl;
+  code << "      lineno = " << co << "->co_firstlineno" << endl;
+  code << "    }" << endl;
+  // A thread changing its frames under us is no reason to give up.
+  code << "  } catch { __py3_frame = 0 }" << endl;
+  code << "  if (__py3_frame == 0) next" << endl;
+  code << "}" << endl;
+
+  probe *sample_probe = parse_synthetic_probe (sess, code, tok);
+  if (!sample_probe)
+    throw SEMANTIC_ERROR (_("can't create python sample probe"), tok);
+
+  probe_point *pp = new probe_point (*location);
+  pp->well_formed = true;
+  probe *base_copy = new probe(base, pp);
+  sample_probe->base = new probe(base_copy, pp);
+  sample_probe->body = new block(sample_probe->body, base_copy->body);
+
+  derive_probes(sess, sample_probe, finished_results);
+}
+
+
 void
 python_builder::build(systemtap_session & sess, probe * base,
 		      probe_point * location,
 		      literal_map_t const & parameters,
 		      vector<derived_probe *> & finished_results)
 {
+  if (has_null_param (parameters, TOK_SAMPLE))
+    {
+      build_sample(sess, base, location, parameters, finished_results);
+      return;
+    }
+
   interned_string module, function;
   unsigned python_version = has_null_param (parameters, TOK_PYTHON2) ? 2 : 3;
   bool has_module = get_param (parameters, TOK_MODULE, module);
@@ -708,7 +871,8 @@ python_builder::build(systemtap_session & sess, probe * base,
 void
 register_tapset_python(systemtap_session& s)
 {
-#if defined(HAVE_PYTHON2_PROBES) || defined(HAVE_PYTHON3_PROBES)
+#if defined(HAVE_PYTHON2_PROBES) || defined(HAVE_PYTHON3_PROBES) \
+    || defined(PYTHON3_EXISTS)
   match_node* root = s.pattern_root;
   derived_probe_builder *builder = new python_builder();
 
@@ -734,6 +898,20 @@ register_tapset_python(systemtap_session& s)
 	->bind_privilege(pr_all)
 	->bind(builder);
     }
+
+#if defined(PYTHON3_EXISTS)
+  // Sampling reads the interpreter state directly, so it needs no
+  // HelperSDT module.
+  vector<match_node*> samples;
+  samples.push_back(root->bind(TOK_PYTHON3)->bind(TOK_SAMPLE));
+  samples.push_back(root->bind(TOK_PYTHON3)->bind_str(TOK_LIBRARY)
+		    ->bind(TOK_SAMPLE));
+  for (unsigned i = 0; i < samples.size(); ++i)
+    {
+      samples[i]->bind(builder);
+      samples[i]->bind_num(TOK_HZ)->bind(builder);
+    }
+#endif
 #else
   (void) s;
 #endif
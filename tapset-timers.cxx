@@ -231,6 +231,14 @@ struct hrtimer_derived_probe_group: public generic_dpg<hrtimer_derived_probe>
 			   hrtimer_derived_probe_group *hr,
                            timer_derived_probe_group *t,
                            sort_for_bpf_probe_arg_vector &v);
+
+  // For each probe, the probe whose timer it runs off, the next probe
+  // run off the same timer (or -1), and how many expiries apart.
+  vector<unsigned> leads;
+  vector<int> nexts;
+  vector<int64_t> ticks;
+  void share_timers ();
+
 public:
   void emit_module_decls (systemtap_session& s);
   void emit_module_init (systemtap_session& s);
@@ -256,11 +264,63 @@ hrtimer_derived_probe::join_group (systemtap_session& s)
 }
 
 
+// Rather than arming a timer per probe, which wakes the cpu once for
+// each of them, let probes without randomization run off the timer of
+// another whose interval divides theirs: timer.ms(100) and
+// timer.ms(500) then both run off a single 100ms timer.  Randomized
+// probes keep a timer to themselves, since each draws its own jitter.
+void
+hrtimer_derived_probe_group::share_timers ()
+{
+  leads.assign (probes.size(), 0);
+  nexts.assign (probes.size(), -1);
+  ticks.assign (probes.size(), 1);
+
+  // Shortest intervals first, so that each timer is led by the probe
+  // with the shortest interval on it.
+  vector<unsigned> order;
+  for (unsigned i=0; i < probes.size(); i++)
+    order.push_back (i);
+  stable_sort (order.begin(), order.end(), [&](unsigned a, unsigned b)
+               { return probes[a]->interval < probes[b]->interval; });
+
+  vector<unsigned> timers, tails;
+  for (unsigned i : order)
+    {
+      hrtimer_derived_probe *p = probes[i];
+      unsigned t = 0;
+      if (p->randomize == 0)
+        for (; t < timers.size(); t++)
+          if (probes[timers[t]]->randomize == 0
+              && p->interval % probes[timers[t]]->interval == 0)
+            break;
+
+      if (p->randomize != 0 || t == timers.size())
+        {
+          leads[i] = i;
+          timers.push_back (i);
+          tails.push_back (i);
+          continue;
+        }
+
+      leads[i] = timers[t];
+      ticks[i] = p->interval / probes[timers[t]]->interval;
+      nexts[tails[t]] = i;
+      tails[t] = i;
+    }
+}
+
+
 void
 hrtimer_derived_probe_group::emit_module_decls (systemtap_session& s)
 {
   if (probes.empty()) return;
 
+  // NB: stapdyn has a timer per probe, as ever
+  bool shared_p = !s.runtime_usermode_p();
+  if (shared_p)
+    share_timers ();
+
   s.op->newline() << "/* ---- hrtimer probes ---- */";
   s.op->newline() << "#include \"timer.c\"";
   s.op->newline() << "static struct stap_hrtimer_probe stap_hrtimer_probes [" << probes.size() << "] = {";
@@ -272,6 +332,13 @@ hrtimer_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->line() << " .probe=" << common_probe_init (probes[i]) << ",";
       s.op->line() << " .intrv=" << probes[i]->interval << "LL,";
       s.op->line() << " .rnd=" << probes[i]->randomize << "LL";
+      if (shared_p)
+        {
+          s.op->line() << ", .lead=&stap_hrtimer_probes[" << leads[i] << "],";
+          if (nexts[i] >= 0)
+            s.op->line() << " .next=&stap_hrtimer_probes[" << nexts[i] << "],";
+          s.op->line() << " .ticks=" << ticks[i];
+        }
       s.op->line() << " },";
     }
   s.op->newline(-1) << "};";
@@ -282,22 +349,28 @@ hrtimer_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->newline() << "static hrtimer_return_t _stp_hrtimer_notify_function (struct hrtimer *timer) {";
 
       s.op->newline(1) << "int rc = HRTIMER_NORESTART;";
-      s.op->newline() << "struct stap_hrtimer_probe *stp = container_of(timer, struct stap_hrtimer_probe, hrtimer);";
+      s.op->newline() << "struct stap_hrtimer_probe *lead = container_of(timer, struct stap_hrtimer_probe, hrtimer);";
+      s.op->newline() << "struct stap_hrtimer_probe *stp;";
 
       // Update the timer with the next trigger time
       s.op->newline() << "if ((atomic_read (session_state()) == STAP_SESSION_STARTING) ||";
       s.op->newline() << "    (atomic_read (session_state()) == STAP_SESSION_RUNNING)) {";
-      s.op->newline(1) << "_stp_hrtimer_update(stp);";
+      s.op->newline(1) << "_stp_hrtimer_update(lead);";
       s.op->newline() << "rc = HRTIMER_RESTART;";
       s.op->newline(-1) << "}";
 
-      s.op->newline() << "{";
+      // Run each probe on this timer that is due
+      s.op->newline() << "for (stp = lead; stp != NULL; stp = stp->next) {";
+      s.op->newline(1) << "if (!_stp_hrtimer_due(stp))";
+      s.op->newline(1) << "continue;";
+      s.op->newline(-1) << "{";
       s.op->indent(1);
       common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "stp->probe",
 				     "stp_probe_type_hrtimer");
       s.op->newline() << "(*stp->probe->ph) (c);";
       common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
       s.op->newline(-1) << "}";
+      s.op->newline(-1) << "}";
       s.op->newline() << "return rc;";
       s.op->newline(-1) << "}";
     }
@@ -335,6 +408,8 @@ hrtimer_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline( 0) <<  "for (i=0; i<" << probes.size() << "; i++) {";
   s.op->newline(+1) <<    "struct stap_hrtimer_probe* stp = & stap_hrtimer_probes [i];";
   s.op->newline( 0) <<    "probe_point = stp->probe->pp;";
+  if (!s.runtime_usermode_p())
+    s.op->newline( 0) <<    "if (stp->lead != stp) continue;"; // runs off another's timer
 
   // Note: no partial failure rollback is needed for kernel hrtimer
   // probes (hrtimer_start only "fails" if the timer was already
@@ -354,8 +429,9 @@ hrtimer_derived_probe_group::emit_module_init (systemtap_session& s)
   // on-the-fly starting/stopping is not supported.
   if (!s.runtime_usermode_p())
     {
-      // If the probe condition is off, then don't bother starting the timer
-      s.op->newline( 0) <<    "if (!stp->probe->cond_enabled) {";
+      // If no probe on the timer has its condition on, then don't
+      // bother starting it
+      s.op->newline( 0) <<    "if (!_stp_hrtimer_wanted(stp)) {";
       s.op->newline(+1) <<      "dbug_otf(\"not starting (hrtimer) pidx %zu\\n\",";
       s.op->newline( 0) <<               "stp->probe->index);";
       s.op->newline( 0) <<      "continue;";
@@ -386,19 +462,23 @@ hrtimer_derived_probe_group::emit_module_refresh (systemtap_session& s)
 {
   if (probes.empty() || s.runtime_usermode_p()) return;
 
-  // Check if we need to enable/disable any timers
+  // Check if we need to start or stop any timers; a shared timer runs
+  // while any of its probes has its condition on
   s.op->newline( 0) << "for (i=0; i <" << probes.size() << "; i++) {";
   s.op->newline(+1) <<   "struct stap_hrtimer_probe* stp = &stap_hrtimer_probes[i];";
+  s.op->newline( 0) <<   "int wanted;";
+  s.op->newline( 0) <<   "if (stp->lead != stp) continue;";
+  s.op->newline( 0) <<   "wanted = _stp_hrtimer_wanted(stp);";
   // timer disabled, but condition says enabled?
-  s.op->newline( 0) <<   "if (!stp->enabled && stp->probe->cond_enabled) {";
+  s.op->newline( 0) <<   "if (!stp->enabled && wanted) {";
   s.op->newline(+1) <<     "dbug_otf(\"enabling (hrtimer) pidx %zu\\n\", stp->probe->index);";
   s.op->newline( 0) <<     "_stp_hrtimer_start(stp);";
   // timer enabled, but condition says disabled?
-  s.op->newline(-1) <<   "} else if (stp->enabled && !stp->probe->cond_enabled) {";
+  s.op->newline(-1) <<   "} else if (stp->enabled && !wanted) {";
   s.op->newline(+1) <<     "dbug_otf(\"disabling (hrtimer) pidx %zu\\n\", stp->probe->index);";
   s.op->newline( 0) <<     "_stp_hrtimer_cancel(stp);";
   s.op->newline(-1) <<   "}";
-  s.op->newline( 0) <<   "stp->enabled = stp->probe->cond_enabled;";
+  s.op->newline( 0) <<   "stp->enabled = wanted;";
   s.op->newline(-1) << "}";
 }
 
@@ -44,6 +44,7 @@
 #include <cassert>
 #include <iomanip>
 #include <cerrno>
+#include <climits>
 
 extern "C" {
 #include <fcntl.h>
@@ -60,6 +61,7 @@ extern "C" {
 #include <math.h>
 #include <regex.h>
 #include <unistd.h>
+#include <sys/utsname.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -122,6 +124,13 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "#ifdef STP_TIMING";
   s.op->newline() << "Stat stat = probe_timing(" << probe << "->index);";
   s.op->newline() << "#endif";
+  if (! s.runtime_usermode_p())
+    {
+      s.op->newline() << "#ifdef STP_PROBE_ACCOUNT";
+      s.op->newline() << "const struct stap_probe *stp_account_probe = " << probe << ";";
+      s.op->newline() << "cycles_t account_atstart = 0;";
+      s.op->newline() << "#endif";
+    }
   if (declaration_callback)
     declaration_callback(s, callback_data);
   if (overload_processing && !s.runtime_usermode_p())
@@ -175,6 +184,27 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "goto probe_epilogue;";
   s.op->newline(-1) << "}";
 
+  // A conditional probe that can tell from the current task alone that
+  // its condition is false bails out cheaply, before taking a context.
+  s.op->newline() << "#ifdef STP_NEED_PREFILTER";
+  s.op->newline() << "if (" << probe << "->prefilter && !" << probe << "->prefilter())";
+  s.op->newline(1) << "goto probe_epilogue;";
+  s.op->indent(-1);
+  s.op->newline() << "#endif";
+
+  // Hits a .sample() doesn't pick, or of a throttled probe, bail out too.
+  if (! s.runtime_usermode_p())
+    {
+      s.op->newline() << "#if defined(STP_THROTTLE) || defined(STP_NEED_PROBE_SAMPLE)";
+      s.op->newline() << "if (_stp_probe_skip(" << probe << "))";
+      s.op->newline(1) << "goto probe_epilogue;";
+      s.op->indent(-1);
+      s.op->newline() << "#endif";
+      s.op->newline() << "#ifdef STP_PROBE_ACCOUNT";
+      s.op->newline() << "account_atstart = get_cycles ();";
+      s.op->newline() << "#endif";
+    }
+
   if (pre_context_callback)
     {
       s.op->newline() << "#if INTERRUPTIBLE";
@@ -206,6 +236,15 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "#endif";
   if (s.runtime_usermode_p())
     s.op->newline() << "c->probe_index = " << probe << "->index;";
+  else
+    {
+      s.op->newline() << "#ifdef STP_OUTPUT_RATE";
+      s.op->newline() << "c->probe_index = " << probe << "->index;";
+      s.op->newline() << "#endif";
+      s.op->newline() << "#ifdef STP_COVERAGE";
+      s.op->newline() << "_stp_coverage_hit(" << probe << "->index);";
+      s.op->newline() << "#endif";
+    }
   s.op->newline() << "c->probe_point = " << probe << "->pp;";
   s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
   s.op->newline() << "c->probe_name = " << probe << "->pn;";
@@ -236,8 +275,10 @@ common_probe_entryfn_prologue (systemtap_session& s,
   s.op->newline() << "#endif";
   */
 
-  s.op->newline() << "#if defined(STP_NEED_UNWIND_DATA)";
+  s.op->newline() << "#if defined(STP_NEED_USER_UNWIND_DATA)";
   s.op->newline() << "c->uwcache_user.state = uwcache_uninitialized;";
+  s.op->newline() << "#endif";
+  s.op->newline() << "#if defined(STP_NEED_UNWIND_DATA)";
   s.op->newline() << "c->uwcache_kernel.state = uwcache_uninitialized;";
   s.op->newline() << "#endif";
 
@@ -330,6 +371,18 @@ common_probe_entryfn_epilogue (systemtap_session& s,
   s.op->newline(-1) << "}";
   s.op->newline() << "#endif";
 
+  if (! s.runtime_usermode_p())
+    {
+      // The per-probe stats and the throttle, see probe_throttle.c.
+      s.op->newline() << "#ifdef STP_PROBE_ACCOUNT";
+      s.op->newline() << "{";
+      s.op->newline(1) << "cycles_t account_atend = get_cycles ();";
+      s.op->newline() << "_stp_probe_account(stp_account_probe, "
+                      << "(u32)account_atend - (u32)account_atstart);";
+      s.op->newline(-1) << "}";
+      s.op->newline() << "#endif";
+    }
+
   s.op->newline() << "c->probe_point = 0;"; // vacated
   s.op->newline() << "#ifdef STP_NEED_PROBE_NAME";
   s.op->newline() << "c->probe_name = 0;";
@@ -431,8 +484,17 @@ struct generic_kprobe_derived_probe: public derived_probe
   unsigned saved_longs, saved_strings;
   generic_kprobe_derived_probe* entry_handler;
 
+  // Whether the probe is on a function entry that ftrace can hook
+  // instead of a kprobe, or an fprobe instead of a kretprobe, see
+  // stapkp_fentry_arm() and stapkp_fexit_arm().  In the bpf runtime,
+  // whether it may be an fentry or fexit program of sym_name_for_bpf.
+  bool fentry_ok;
+
   std::string args_for_bpf() const;
   interned_string sym_name_for_bpf;
+  // The u64 slots the arguments take in the context of an fexit
+  // program, before the return value, or -1 if unknown.
+  int bpf_arg_slots;
 };
 
 generic_kprobe_derived_probe::generic_kprobe_derived_probe(probe *base,
@@ -449,7 +511,8 @@ generic_kprobe_derived_probe::generic_kprobe_derived_probe(probe *base,
   module(module), section(section), addr(addr), has_return(has_return),
   has_maxactive(has_maxactive), maxactive_val(maxactive_val),
   symbol_name(symbol_name), offset(offset),
-  saved_longs(0), saved_strings(0), entry_handler(0)
+  saved_longs(0), saved_strings(0), entry_handler(0), fentry_ok(false),
+  bpf_arg_slots(-1)
 {
 }
 
@@ -465,6 +528,7 @@ static const string TOK_CALL("call");
 static const string TOK_EXPORTED("exported");
 static const string TOK_RETURN("return");
 static const string TOK_MAXACTIVE("maxactive");
+static const string TOK_SAMPLE("sample");
 static const string TOK_STATEMENT("statement");
 static const string TOK_ABSOLUTE("absolute");
 static const string TOK_PROCESS("process");
@@ -607,6 +671,7 @@ private:
 struct uprobe_derived_probe: public dwarf_derived_probe
 {
   int pid; // 0 => unrestricted
+  bool sdt_p; // at an SDT site, from process.mark
 
   interned_string build_id_val;
   GElf_Addr build_id_vaddr;
@@ -627,7 +692,8 @@ struct uprobe_derived_probe: public dwarf_derived_probe
                         int pid,
                         Dwarf_Addr addr,
                         bool has_return):
-    dwarf_derived_probe(base, location, addr, has_return), pid(pid)
+    dwarf_derived_probe(base, location, addr, has_return), pid(pid),
+    sdt_p(false)
   {}
 
   void join_group (systemtap_session& s);
@@ -857,6 +923,7 @@ struct dwarf_query : public base_query
   virtual void handle_query_module();
   void query_module_dwarf();
   void query_module_symtab();
+  bool module_lacks_function();
   void query_library (const char *data);
   void query_plt (const char *entry, size_t addr);
 
@@ -917,6 +984,9 @@ struct dwarf_query : public base_query
   bool has_maxactive;
   int64_t maxactive_val;
 
+  bool has_sample;
+  int64_t sample_val;
+
   bool has_label;
   interned_string label_val;
 
@@ -941,6 +1011,9 @@ struct dwarf_query : public base_query
   // Holds the prologue end of the current function
   Dwarf_Addr prologue_end;
 
+  // Holds the entrypc of the current function, while probing it there
+  Dwarf_Addr func_entrypc;
+
   set<string> filtered_srcfiles;
 
   // Map official entrypc -> func_info object
@@ -952,6 +1025,10 @@ struct dwarf_query : public base_query
 
   void query_module_functions ();
 
+  // CUs in which query_all_cus found functions
+  vector<Dwarf_Off> matched_cus;
+  void query_all_cus ();
+
   interned_string final_function_name(interned_string final_func,
                                       interned_string final_file,
                                       int final_line);
@@ -970,7 +1047,7 @@ uprobe_derived_probe::uprobe_derived_probe (interned_string function,
                         Dwarf_Die* scope_die):
     dwarf_derived_probe(function, filename, line, module, section,
                         dwfl_addr, addr, q, scope_die),
-    pid(q.pid_val), build_id_vaddr(0)
+    pid(q.pid_val), sdt_p(q.has_mark), build_id_vaddr(0)
   {
     // Process parameter is given as a build-id
     if (q.build_id_val.size() > 0)
@@ -1011,7 +1088,16 @@ struct dwarf_builder: public derived_probe_builder
   dwflpp *get_kern_dw(systemtap_session& sess, const string& module, bool debuginfo_needed = true)
   {
     if (kern_dw[module] == 0)
-      kern_dw[module] = new dwflpp(sess, module, true, debuginfo_needed); // might throw
+      {
+        if (module == TOK_KERNEL && sess.warm_kernel_dw)
+          {
+            // opened ahead of time by a --compile-daemon
+            kern_dw[module] = sess.warm_kernel_dw;
+            sess.warm_kernel_dw = 0;
+          }
+        else
+          kern_dw[module] = new dwflpp(sess, module, true, debuginfo_needed); // might throw
+      }
     return kern_dw[module];
   }
 
@@ -1066,12 +1152,13 @@ dwarf_query::dwarf_query(probe * base_probe,
     has_call(false), has_exported(false), has_inline(false),
     has_return(false), has_nearest(false),
     has_maxactive(false), maxactive_val(0),
+    has_sample(false), sample_val(0),
     has_label(false), has_callee(false),
     has_callees_num(false), callees_num_val(0),
     has_absolute(false), has_mark(false),
     spec_type(function_alone),
     lineno_type(ABSOLUTE),
-    prologue_end(0)
+    prologue_end(0), func_entrypc(0)
 {
   // Reduce the query to more reasonable semantic values (booleans,
   // extracted strings, numbers, etc).
@@ -1102,6 +1189,7 @@ dwarf_query::dwarf_query(probe * base_probe,
   has_return = has_null_param(params, TOK_RETURN);
   has_nearest = has_null_param(params, TOK_NEAREST);
   has_maxactive = get_number_param(params, TOK_MAXACTIVE, maxactive_val);
+  has_sample = get_number_param(params, TOK_SAMPLE, sample_val);
   has_absolute = has_null_param(params, TOK_ABSOLUTE);
   has_mark = false;
 
@@ -1146,8 +1234,62 @@ dwarf_query::query_module_dwarf()
           !startswith(function, "_Z"))
         query_module_functions();
       else
-        dw.iterate_over_cus(&query_cu, this, false);
+        query_all_cus();
+    }
+}
+
+
+static int
+query_cu_recording (Dwarf_Die * cudie, dwarf_query * q)
+{
+  int rc = query_cu (cudie, q);
+  if (!q->filtered_functions.empty() || !q->filtered_inlines.empty())
+    q->matched_cus.push_back (dwflpp::cu_offset (cudie));
+  return rc;
+}
+
+
+// Run query_cu over the module's CUs.  The CUs in which this probe point
+// found any functions are remembered per debuginfo build-id, so a later
+// run resolving the same probe point, with only the handlers edited,
+// visits just those CUs instead of scanning the whole module again.
+// Failing that, the module's .debug_names or .gdb_index table may
+// narrow down the CUs whose function names match.
+void
+dwarf_query::query_all_cus ()
+{
+  string key = base_loc->str(false);
+  vector<Dwarf_Die> cus;
+
+  if (dw.get_probe_point_cus(key, cus))
+    {
+      if (sess.verbose > 2)
+        clog << _F("%s: querying %zu cached CUs of %s", key.c_str(),
+                   cus.size(), dw.module_name.c_str()) << endl;
+
+      for (auto i = cus.begin(); i != cus.end(); ++i)
+        if (query_cu (&*i, this) != DWARF_CB_OK)
+          break;
+      return;
+    }
+
+  matched_cus.clear();
+  unsigned errors = sess.num_errors();
+  if (function != "*" && !startswith(function, "_Z")
+      && dw.get_function_name_cus(function, cus))
+    {
+      if (sess.verbose > 2)
+        clog << _F("%s: querying %zu CUs of %s named by its accelerator table",
+                   key.c_str(), cus.size(), dw.module_name.c_str()) << endl;
+
+      for (auto i = cus.begin(); i != cus.end(); ++i)
+        if (query_cu_recording (&*i, this) != DWARF_CB_OK)
+          break;
     }
+  else
+    dw.iterate_over_cus(&query_cu_recording, this, false);
+  if (!pending_interrupts && sess.num_errors() == errors)
+    dw.set_probe_point_cus(key, matched_cus);
 }
 
 static void query_func_info (Dwarf_Addr entrypc, func_info & fi,
@@ -1224,6 +1366,45 @@ dwarf_query::query_module_symtab()
     }
 }
 
+// Whether the module in focus can't have the probe point's function,
+// as told by its cached function index or, when the probe point can't
+// match an inlined copy, which has no symbol, by its ELF symbol table.
+// This lets module("*").function("foo") skip opening the DWARF of all
+// the modules but the few that have a foo.
+bool
+dwarf_query::module_lacks_function()
+{
+  if (!has_module || !dw.name_has_wildcard(module_val)
+      || dw.module_name == TOK_KERNEL
+      || !has_function_str || spec_type != function_alone
+      || !scopes.empty() || function == "*")
+    return false;
+
+  bool known;
+  if (dw.cached_functions_match(function, known))
+    return false;
+  if (!known && !has_call && !has_return && !has_exported)
+    return false;
+
+  module_info *mi = dw.mod_info;
+  mi->get_symtab();
+  if (mi->symtab_status != info_present)
+    return known;
+  for (auto it = mi->sym_table->map_by_addr.begin();
+       it != mi->sym_table->map_by_addr.end(); ++it)
+    {
+      // compiler clones like foo.isra.0 count as foo
+      string name = it->second->name;
+      size_t dot = name.find('.', 1);
+      if (dot != string::npos)
+        name.erase(dot);
+      if (dw.function_name_matches_pattern(name, function))
+        return false;
+    }
+  return true;
+}
+
+
 void
 dwarf_query::handle_query_module()
 {
@@ -1233,6 +1414,14 @@ dwarf_query::handle_query_module()
       return;
     }
 
+  if (module_lacks_function())
+    {
+      if (sess.verbose > 2)
+        clog << _F("skipping module '%s' without a function matching '%s'\n",
+                   dw.module_name.c_str(), function.to_string().c_str());
+      return;
+    }
+
   // PR25841.  We may only need dwarf depending on the context-related
   // constructs in the probe handler and/or transitively called
   // functions.  Otherwise, for some probe types (as per the former
@@ -2081,8 +2270,10 @@ query_func_info (Dwarf_Addr entrypc,
       if (fi.prologue_end == 0 || q->has_return)
         {
           q->prologue_end = fi.prologue_end;
+          q->func_entrypc = entrypc;
           query_statement (fi.name, fi.decl_file, fi.decl_line,
                            &fi.die, entrypc, q);
+          q->func_entrypc = 0;
         }
       else
         {
@@ -3308,6 +3499,7 @@ private:
   bool print_chars (Dwarf_Die* type, target_symbol* e, print_format* pf);
 
   void init_ts (const target_symbol& e);
+  expression* shared_printer_call ();
   expression* deref (target_symbol* e);
   bool push_deref (print_format* pf, const string& fmt, target_symbol* e);
 };
@@ -3394,15 +3586,21 @@ dwarf_pretty_print::expand ()
         ts->components[i].expr_index = sym;
       }
 
-  // Create the return sprintf.
-  print_format* pf = print_format::create(ts->tok, "sprintf");
   return_statement* rs = new return_statement;
   rs->tok = ts->tok;
-  rs->value = pf;
+  if (!pointer)
+    rs->value = shared_printer_call ();
 
-  // Recurse into the actual values.
-  recurse (&base_type, ts, pf, true);
-  pf->components = print_format::string_to_components(pf->raw_components);
+  if (!rs->value)
+    {
+      // Create the return sprintf.
+      print_format* pf = print_format::create(ts->tok, "sprintf");
+      rs->value = pf;
+
+      // Recurse into the actual values.
+      recurse (&base_type, ts, pf, true);
+      pf->components = print_format::string_to_components(pf->raw_components);
+    }
 
   // Create the try-catch net
   try_block* tb = new try_block;
@@ -3421,6 +3619,89 @@ dwarf_pretty_print::expand ()
 }
 
 
+// A struct or union printed whole, or through a top-level pointer, is
+// printed by a function of its address that is shared by every probe
+// printing the same type, so that $$parms$ over many functions doesn't
+// expand each of them again.  Returns a call of it, or NULL if the
+// value should be expanded in place, e.g. because it lives in a
+// register and has no address.
+expression*
+dwarf_pretty_print::shared_printer_call ()
+{
+  target_symbol* e = new target_symbol(*ts);
+  Dwarf_Die type;
+  expression* addr;
+  try
+    {
+      dw.resolve_unqualified_inner_typedie (&base_type, &type, e);
+      if (dwarf_tag (&type) == DW_TAG_pointer_type)
+        {
+          Dwarf_Die pointee;
+          if (!dwarf_attr_die (&type, DW_AT_type, &pointee))
+            return NULL;
+          dw.resolve_unqualified_inner_typedie (&pointee, &type, e);
+        }
+      else
+        e->addressof = true;
+
+      int tag = dwarf_tag (&type);
+      if (tag != DW_TAG_structure_type && tag != DW_TAG_union_type
+          && tag != DW_TAG_class_type)
+        return NULL;
+      if (dwarf_hasattr (&type, DW_AT_declaration))
+        {
+          Dwarf_Die *resolved = dw.declaration_resolve (&type);
+          if (!resolved)
+            return NULL;
+          type = *resolved;
+        }
+
+      addr = deref (e);
+    }
+  catch (const semantic_error&)
+    {
+      return NULL;
+    }
+
+  // NB: the DIE's own data pointer, since the type may come from a
+  // dwz alternate file, whose offsets overlap the module's.
+  ostringstream key;
+  key << dw.module << ' ' << type.addr << ' '
+      << userspace_p << print_full << ' ' << ts->tok->location.file->name;
+
+  auto it = dw.pretty_printers.find (key.str());
+  if (it != dw.pretty_printers.end())
+    {
+      functiondecl* fdecl = it->second;
+      auto f = dw.sess.functions.find (fdecl->name);
+      if (f != dw.sess.functions.end() && f->second == fdecl)
+        {
+          functioncall* fcall = new functioncall;
+          fcall->tok = ts->tok;
+          fcall->referents.push_back (fdecl);
+          fcall->function = fdecl->name;
+          fcall->type = pe_string;
+          fcall->args.push_back (addr);
+          if (dw.sess.verbose > 3)
+            clog << _F("reusing %s for %s",
+                       fdecl->unmangled_name.to_string().c_str(),
+                       ts->sym_name().c_str()) << endl;
+          return fcall;
+        }
+      dw.pretty_printers.erase (it); // optimized away since
+    }
+
+  target_symbol pe (*ts);
+  pe.components.clear ();
+  pe.components.push_back (target_symbol::component (ts->tok,
+                                                     print_full ? "$$" : "$",
+                                                     true));
+  dwarf_pretty_print dpp (dw, &type, addr, true, userspace_p, pe, false);
+  functioncall* fcall = dpp.expand ();
+  dw.pretty_printers[key.str()] = fcall->referents[0];
+  return fcall;
+}
+
 void
 dwarf_pretty_print::recurse (Dwarf_Die* start_type, target_symbol* e,
                              print_format* pf, bool top)
@@ -4064,6 +4345,72 @@ synthetic_embedded_deref_call(dwflpp& dw, location_context &ctx,
   return fcall;
 }
 
+
+// Remember the accessor function that N calls under KEY, from
+// dwflpp::tvar_accessor_key(), unless the translation left anything
+// else behind that a reuse wouldn't recreate.
+static void
+remember_deref_call(dwflpp& dw, const string& key, location_context& ctx,
+                    functioncall* n)
+{
+  if (key.empty() || !ctx.globals.empty() || !ctx.entry_probes.empty())
+    return;
+
+  bool fp32 = (n->function == "fp32_to_fp64");
+  functioncall* call = fp32 ? static_cast<functioncall*>(n->args[0]) : n;
+  if (call->referents.size() == 1)
+    dw.tvar_accessors[key] = make_pair(call->referents[0], fp32);
+}
+
+
+// A call of the accessor remembered under KEY for target symbol E,
+// with E's own index expressions, or NULL.
+static functioncall*
+reuse_deref_call(dwflpp& dw, const string& key, target_symbol* e)
+{
+  if (key.empty())
+    return NULL;
+  auto it = dw.tvar_accessors.find(key);
+  if (it == dw.tvar_accessors.end())
+    return NULL;
+
+  functiondecl* fdecl = it->second.first;
+  auto f = dw.sess.functions.find(fdecl->name);
+  if (f == dw.sess.functions.end() || f->second != fdecl)
+    {
+      // Optimized away since.
+      dw.tvar_accessors.erase(it);
+      return NULL;
+    }
+
+  functioncall* fcall = new functioncall;
+  fcall->tok = e->tok;
+  fcall->referents.push_back(fdecl);
+  fcall->function = fdecl->name;
+  fcall->type = fdecl->type;
+  fcall->type_details = fdecl->type_details;
+  for (auto c = e->components.begin(); c != e->components.end(); ++c)
+    if (c->type == target_symbol::comp_expression_array_index)
+      fcall->args.push_back(c->expr_index);
+
+  if (it->second.second)
+    {
+      functioncall* conv_fcall = new functioncall();
+      conv_fcall->function = "fp32_to_fp64";
+      conv_fcall->tok = e->tok;
+      conv_fcall->type = pe_long;
+      conv_fcall->type_details = fcall->type_details;
+      conv_fcall->args.push_back(fcall);
+      fcall = conv_fcall;
+    }
+
+  if (dw.sess.verbose > 3)
+    clog << _F("reusing %s for %s", fdecl->unmangled_name.to_string().c_str(),
+               e->sym_name().c_str()) << endl;
+  return fcall;
+}
+
+
 expression*
 dwarf_pretty_print::deref (target_symbol* e)
 {
@@ -4077,6 +4424,12 @@ dwarf_pretty_print::deref (target_symbol* e)
 
   bool lvalue_p = false;
 
+  string key;
+  if (!pointer && !local.empty())
+    key = dw.tvar_accessor_key (scopes, pc, local, e, userspace_p);
+  if (functioncall* n = reuse_deref_call (dw, key, e))
+    return n;
+
   location_context ctx(e, pointer);
   ctx.pc = pc;
   ctx.userspace_p = userspace_p;
@@ -4090,8 +4443,11 @@ dwarf_pretty_print::deref (target_symbol* e)
     dw.literal_stmt_for_return (ctx, &scopes[0], ctx.e, lvalue_p, &endtype);
 
   string name = "_dwarf_pretty_print_deref_" + lex_cast(tick++);
-  return synthetic_embedded_deref_call(dw, ctx, name, &endtype, userspace_p,
-				       lvalue_p, pointer);
+  functioncall* n = synthetic_embedded_deref_call(dw, ctx, name, &endtype,
+                                                  userspace_p, lvalue_p,
+                                                  pointer);
+  remember_deref_call (dw, key, ctx, n);
+  return n;
 }
 
 
@@ -4727,6 +5083,17 @@ dwarf_var_expanding_visitor::visit_target_symbol (target_symbol *e)
         }
 
       bool userspace_p = q.has_process;
+
+      string key;
+      if (!lvalue && !q.has_return)
+        key = q.dw.tvar_accessor_key (getscopes(e), addr, e->sym_name(),
+                                      e, userspace_p);
+      if (functioncall* n = reuse_deref_call (q.dw, key, e))
+        {
+          provide(n);
+          return;
+        }
+
       location_context ctx(e);
       ctx.pc = addr;
       ctx.userspace_p = userspace_p;
@@ -4742,7 +5109,8 @@ dwarf_var_expanding_visitor::visit_target_symbol (target_symbol *e)
 
       // Now that have location information check if change to variable has any effect
       if (lvalue) {
-	      if (liveness(q.sess, e, q.dw.mod_info->elf_path, addr, ctx) < 0) {
+	      if (liveness(q.sess, e, q.dw.mod_info->elf_path, q.dw.module,
+			   addr, ctx) < 0) {
 		      q.sess.print_warning(_F("write at %p will have no effect",
 					      (void *)addr), e->tok);
 	      }
@@ -4768,6 +5136,7 @@ dwarf_var_expanding_visitor::visit_target_symbol (target_symbol *e)
       functioncall* n = synthetic_embedded_deref_call(q.dw, ctx, fname,
 						      &endtype, userspace_p,
 						      lvalue);
+      remember_deref_call (q.dw, key, ctx, n);
 
       if (lvalue)
 	provide_lvalue_call (n);
@@ -5097,6 +5466,32 @@ void dwarf_cast_expanding_visitor::visit_cast_op (cast_op* e)
   for (unsigned i = 0; !result && i < modules.size(); ++i)
     {
       string& module = modules[i];
+
+      // For "kernel<header>", the kernel's own debuginfo usually already
+      // describes the type, so look there before compiling a typequery
+      // module for the header.
+      if (startswith(module, "kernel<") && module[module.size() - 1] == '>'
+          && !compiled_headers.count(module))
+        {
+          try
+            {
+              dwflpp* dw = db.get_kern_dw(sess, "kernel");
+              dwarf_cast_query q (*dw, "kernel", *e, lvalue, false, result);
+              dw->iterate_over_modules<base_query>(&query_module, &q);
+            }
+          catch (const semantic_error& er)
+            {
+              /* fall back to the typequery module */
+            }
+          if (result)
+            {
+              if (sess.verbose > 2)
+                clog << _F("Pass 2: resolved @cast type '%s' for %s from kernel debuginfo",
+                           ((string)e->type_name).c_str(), module.c_str()) << endl;
+              break;
+            }
+        }
+
       filter_special_modules(module);
 
       // NB: This uses '/' to distinguish between kernel modules and userspace,
@@ -5498,6 +5893,53 @@ check_process_probe_kernel_support(systemtap_session& s)
 }
 
 
+// Whether bpf kernel probes may attach as fentry/fexit programs, through
+// the BTF of the kernel rather than through kprobes.  -DSTAPBPF_FENTRY=0
+// keeps them on kprobes.
+static bool
+bpf_fentry_supported(systemtap_session& s)
+{
+  if (s.runtime_mode != systemtap_session::bpf_runtime)
+    return false;
+  for (auto it = s.c_macros.begin(); it != s.c_macros.end(); ++it)
+    if (*it == "STAPBPF_FENTRY=0")
+      return false;
+  return (s.kernel_config["CONFIG_DEBUG_INFO_BTF"] == "y"
+          && s.kernel_functions.count("bpf_tracing_prog_attach") > 0
+          && s.kernel_functions.count("arch_prepare_bpf_trampoline") > 0);
+}
+
+// Returns the u64 slots the arguments of the function at scope_die take
+// in the context of an fentry/fexit program, or -1 if unknown.
+static int
+bpf_func_arg_slots(Dwarf_Die *scope_die)
+{
+  if (null_die(scope_die) || dwarf_tag(scope_die) != DW_TAG_subprogram)
+    return -1;
+
+  Dwarf_Die child;
+  int slots = 0;
+  if (dwarf_child(scope_die, &child) != 0)
+    return 0;
+  do
+    {
+      if (dwarf_tag(&child) == DW_TAG_unspecified_parameters)
+        return -1;
+      if (dwarf_tag(&child) != DW_TAG_formal_parameter)
+        continue;
+
+      Dwarf_Die type;
+      Dwarf_Word size;
+      if (!dwarf_attr_die(&child, DW_AT_type, &type)
+          || dwarf_aggregate_size(&type, &size) != 0 || size > 16)
+        return -1;
+      slots += (size + 7) / 8;
+    }
+  while (dwarf_siblingof(&child, &child) == 0);
+  return slots;
+}
+
+
 dwarf_derived_probe::dwarf_derived_probe(interned_string funcname,
                                          interned_string filename,
                                          int line,
@@ -5564,6 +6006,36 @@ dwarf_derived_probe::dwarf_derived_probe(interned_string funcname,
         throw SEMANTIC_ERROR (_("missing relocation basis"), tok);
       if (section != "" && dwfl_addr == addr) // addr should be an offset
         throw SEMANTIC_ERROR (_("inconsistent relocation address"), tok);
+
+      // Plain entries of kernel functions may be armed through ftrace,
+      // which costs much less per hit than a kprobe, and their returns
+      // through an fprobe.  The runtime falls back to a k[ret]probe for
+      // functions ftrace doesn't trace.
+      if (q.has_kernel && !q.has_maxactive
+          && q.func_entrypc != 0 && dwfl_addr == q.func_entrypc
+          && q.sess.runtime_mode == systemtap_session::kernel_runtime)
+        fentry_ok = true;
+
+      // In the bpf runtime, they may be fentry/fexit programs, found
+      // by name in the kernel BTF.  That name must only be the one of
+      // this function, not also of some static one elsewhere.
+      if (q.has_kernel && !q.has_maxactive
+          && q.func_entrypc != 0 && dwfl_addr == q.func_entrypc
+          && bpf_fentry_supported(q.sess))
+        {
+          module_info *mi = q.dw.mod_info;
+          if (mi && mi->symtab_status == info_unknown)
+            mi->get_symtab();
+          set<Dwarf_Addr> addrs;
+          if (mi && mi->symtab_status == info_present)
+            addrs = mi->sym_table->lookup_symbol_address(funcname);
+          if (addrs.size() == 1 && *addrs.begin() == dwfl_addr)
+            {
+              fentry_ok = true;
+              sym_name_for_bpf = funcname;
+              bpf_arg_slots = bpf_func_arg_slots(scope_die);
+            }
+        }
     }
 
   // XXX: hack for strange g++/gcc's
@@ -5576,6 +6048,14 @@ dwarf_derived_probe::dwarf_derived_probe(interned_string funcname,
     throw SEMANTIC_ERROR (_F("maxactive value out of range [0,%s]",
                           lex_cast(USHRT_MAX).c_str()), q.base_loc->components.front()->tok);
 
+  if (q.has_sample)
+    {
+      if (q.sample_val < 1 || q.sample_val > UINT_MAX)
+        throw SEMANTIC_ERROR (_F("sample value out of range [1,%s]",
+                              lex_cast(UINT_MAX).c_str()), q.base_loc->components.front()->tok);
+      sample = q.sample_val;
+    }
+
   // Expand target variables in the probe body. Even if the scope_die is
   // invalid, we still want to expand things such as $$vars/$$parms/etc...
   // (PR15999, PR16473). Access to specific context vars e.g. $argc will not be
@@ -5752,6 +6232,9 @@ dwarf_derived_probe::dwarf_derived_probe(interned_string funcname,
   if (has_maxactive)
     comps.push_back (new probe_point::component
                      (TOK_MAXACTIVE, new literal_number(maxactive_val)));
+  if (q.has_sample)
+    comps.push_back (new probe_point::component
+                     (TOK_SAMPLE, new literal_number(q.sample_val)));
 
   // Overwrite it.
   this->sole_location()->components = comps;
@@ -6022,6 +6505,14 @@ dwarf_derived_probe::register_function_variants(match_node * root,
     {
       root->bind(TOK_RETURN)
         ->bind_num(TOK_MAXACTIVE)->bind(dw);
+
+      // Kernel probes may run their handler on only some hits.
+      root->bind_num(TOK_SAMPLE)->bind(dw);
+      root->bind(TOK_CALL)->bind_num(TOK_SAMPLE)->bind(dw);
+      root->bind(TOK_EXPORTED)->bind_num(TOK_SAMPLE)->bind(dw);
+      root->bind(TOK_RETURN)->bind_num(TOK_SAMPLE)->bind(dw);
+      root->bind(TOK_RETURN)->bind_num(TOK_MAXACTIVE)
+        ->bind_num(TOK_SAMPLE)->bind(dw);
     }
 }
 
@@ -6262,6 +6753,25 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
 
 #undef CALCIT
 
+  // Return probes keeping @entry data need the kretprobe instances.
+  size_t fentry_cnt = 0, fexit_cnt = 0;
+  for (auto it = probes_by_module.begin(); it != probes_by_module.end(); it++)
+    {
+      generic_kprobe_derived_probe* p = it->second;
+      if (!p->fentry_ok)
+        continue;
+      if (!p->has_return)
+        fentry_cnt++;
+      else if (!p->entry_handler && !p->saved_longs && !p->saved_strings)
+        fexit_cnt++;
+      else
+        p->fentry_ok = false;
+    }
+  if (fentry_cnt)
+    s.op->newline() << "#define STP_KPROBES_FENTRY_MAX " << fentry_cnt;
+  if (fexit_cnt)
+    s.op->newline() << "#define STP_KPROBES_FEXIT_MAX " << fexit_cnt;
+
   s.op->newline() << "#include \"linux/kprobes.c\"";
 
 #define UNDEFIT(var) s.op->newline() << "#undef STAP_KPROBE_PROBE_STR_" << #var
@@ -6309,6 +6819,8 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
         }
       if (p->locations[0]->optional)
         s.op->line() << " .optional_p=1,";
+      if (p->fentry_ok)
+        s.op->line() << " .fentry_p=1,";
       s.op->line() << " .address=(unsigned long)0x" << hex << p->addr << dec << "ULL,";
       s.op->line() << " .module=\"" << p->module << "\",";
       s.op->line() << " .section=\"" << p->section << "\",";
@@ -6365,6 +6877,56 @@ generic_kprobe_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline() << "return 0;";
   s.op->newline(-1) << "}";
 
+  // Same for function entries armed through ftrace, see stapkp_fentry_arm()
+  if (fentry_cnt)
+    {
+      s.op->newline() << "#ifdef STAPKP_FENTRY";
+      s.op->newline() << "static void enter_fentry_probe (struct stap_kprobe_probe *skp,";
+      s.op->line() << " unsigned long addr, struct pt_regs *regs) {";
+      s.op->indent(1);
+      common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "skp->probe",
+				     "stp_probe_type_kprobe");
+      s.op->newline() << "c->kregs = regs;";
+
+      // As for kprobes, the IP is that of the probed function while the
+      // handler runs, then what ftrace had.
+      s.op->newline() << "{";
+      s.op->indent(1);
+      s.op->newline() << "unsigned long fentry_ip = REG_IP(c->kregs);";
+      s.op->newline() << "SET_REG_IP(regs, addr);";
+      s.op->newline() << "(*skp->probe->ph) (c);";
+      s.op->newline() << "SET_REG_IP(regs, fentry_ip);";
+      s.op->newline(-1) << "}";
+
+      common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
+      s.op->newline(-1) << "}";
+      s.op->newline() << "#endif";
+    }
+
+  // Same for returns hooked with an fprobe, see stapkp_fexit_arm()
+  if (fexit_cnt)
+    {
+      s.op->newline() << "#ifdef STAPKP_FEXIT";
+      s.op->newline() << "static void enter_fexit_probe (struct stap_kprobe_probe *skp,";
+      s.op->line() << " unsigned long ret_ip, struct pt_regs *regs) {";
+      s.op->indent(1);
+      common_probe_entryfn_prologue (s, "STAP_SESSION_RUNNING", "", "skp->probe",
+				     "stp_probe_type_kretprobe");
+      s.op->newline() << "c->kregs = regs;";
+      // No kretprobe instance: backtraces start from the return address.
+      s.op->newline() << "c->ips.krp.pi = NULL;";
+      s.op->newline() << "c->ips.krp.pi_longs = 0;";
+      s.op->newline() << "{";
+      s.op->newline(1) << "unsigned long fexit_ip = REG_IP(c->kregs);";
+      s.op->newline() << "SET_REG_IP(regs, ret_ip);";
+      s.op->newline() << "(*skp->probe->ph) (c);";
+      s.op->newline() << "SET_REG_IP(regs, fexit_ip);";
+      s.op->newline(-1) << "}";
+      common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
+      s.op->newline(-1) << "}";
+      s.op->newline() << "#endif";
+    }
+
   // Same for kretprobes
   s.op->newline();
   s.op->newline() << "static int enter_kretprobe_common (struct kretprobe_instance *inst,";
@@ -6434,8 +6996,20 @@ generic_kprobe_derived_probe::args_for_bpf() const
 {
   std::stringstream o;
 
-  if (has_return)
+  // An fexit section also has the argument slots, where known, for
+  // the translator to find the return value with.
+  if (fentry_ok && has_return)
+    {
+      o << "fexit/" << sym_name_for_bpf;
+      if (bpf_arg_slots >= 0)
+        o << "/" << bpf_arg_slots;
+    }
+  else if (fentry_ok)
+    o << "fentry/" << sym_name_for_bpf;
+  else if (has_return)
     o << "kretprobe/" << sym_name_for_bpf;
+  else if (!sym_name_for_bpf.empty())
+    o << "kprobe/" << sym_name_for_bpf;
   else
     o << "kprobe/" << "0x" << std::hex << addr;
 
@@ -8676,17 +9250,18 @@ dwarf_builder::build(systemtap_session & sess,
               if(file.empty())
                 throw SEMANTIC_ERROR(_("unspecified process probe is invalid without"
                                        " a -c COMMAND or -x PID [man stapprobes]"));
+              // Name a -x target by its executable, not by /proc/PID/exe,
+              // so the resulting probes (and so the cached module) are the
+              // same whichever process -x picks; target() still comes
+              // from staprun at run time.
+              if (sess.target_pid)
+                file = resolve_path(file);
               module_name = sess.sysroot + file;
               filled_parameters[TOK_PROCESS] = new literal_string(module_name);// this needs to be used in place of the blank map
               // in the case of TOK_MARK we need to modify locations as well   // XXX why?
               if(location->components[0]->functor==TOK_PROCESS &&
                  location->components[0]->arg == 0)
-                {
-                  if (sess.target_pid)
-                    location->components[0]->arg = new literal_number(sess.target_pid);
-                  else
-                    location->components[0]->arg = new literal_string(module_name);
-                }
+                location->components[0]->arg = new literal_string(module_name);
             }
         }
 
@@ -9380,7 +9955,8 @@ module_info::get_symtab()
 // that a statement probe isn't needed.  In return, it also adds aliases to the
 // function table for names that share the same addr/die.
 void
-module_info::update_symtab(cu_function_cache_t *funcs)
+module_info::update_symtab(cu_function_cache_t *funcs,
+                           const unordered_set<void*> *inline_dies)
 {
   if (!sym_table)
     return;
@@ -9391,7 +9967,9 @@ module_info::update_symtab(cu_function_cache_t *funcs)
        func != funcs->end(); func++)
     {
       // optimization: inlines will never be in the symbol table
-      if (dwarf_func_inline(&func->second) != 0)
+      // (and a function index already knows which ones those are)
+      if (inline_dies ? inline_dies->count(func->second.addr) != 0
+                      : dwarf_func_inline(&func->second) != 0)
         {
           inlined_funcs.insert(func->first);
           continue;
@@ -10187,6 +10765,45 @@ uprobe_derived_probe_group::emit_module_inode_exit (systemtap_session& s)
 }
 
 
+// Which user registers does a dyninst probe handler, or anything it
+// calls, look at?  stapdyn only captures those at the probe site, which
+// is most of the cost of a hit.  Target variables read registers through
+// target_register nodes, by DWARF number.  Anything else is conservative:
+// any embedded C that might reach the registers, directly or by passing
+// the whole CONTEXT to a helper, counts as using all of them.
+struct uregs_use_visitor: public functioncall_traversing_visitor
+{
+  bool used; // all of them
+  uint64_t regs; // by DWARF number
+  uregs_use_visitor(): used(false), regs(0) {}
+
+  uint64_t mask() const { return used ? ~(uint64_t)0 : regs; }
+
+  void check_code(const interned_string& code)
+    {
+      static const char *const uses[] = {
+        "regs", "REG_", "CONTEXT,", "CONTEXT)", "_stp_stack", "pragma:unwind",
+      };
+      for (auto u: uses)
+        if (code.find(u) != interned_string::npos)
+          used = true;
+    }
+
+  void visit_embeddedcode (embeddedcode *s) { check_code(s->code); }
+  void visit_embedded_expr (embedded_expr *e) { check_code(e->code); }
+  void visit_target_symbol (target_symbol *) { used = true; }
+  void visit_target_register (target_register *e)
+    {
+      if (e->regno < 64)
+        regs |= (uint64_t)1 << e->regno;
+      else
+        used = true;
+    }
+  void visit_cast_op (cast_op *) { used = true; }
+  void visit_entry_op (entry_op *) { used = true; }
+};
+
+
 void
 uprobe_derived_probe_group::emit_module_dyninst_decls (systemtap_session& s)
 {
@@ -10202,9 +10819,16 @@ uprobe_derived_probe_group::emit_module_dyninst_decls (systemtap_session& s)
     {
       uprobe_derived_probe *p = probes[i];
 
+      uregs_use_visitor uv;
+      p->body->visit(&uv);
+      string flags = p->has_return ? "STAPDYN_PROBE_FLAG_RETURN" : "0";
+      if (uv.mask() == 0)
+        flags += "|STAPDYN_PROBE_FLAG_NO_REGS";
+      if (p->sdt_p && !p->has_return)
+        flags += "|STAPDYN_PROBE_FLAG_SDT";
+
       dynprobe_add_uprobe(s, p->module, p->addr, p->sdt_semaphore_addr,
-			  (p->has_return ? "STAPDYN_PROBE_FLAG_RETURN" : "0"),
-			  common_probe_init(p));
+			  flags, common_probe_init(p), uv.mask());
     }
   // loc2c-generated code assumes pt_regs are available, so use this to make
   // sure we always have *something* for it to dereference...
@@ -10460,6 +11084,16 @@ kprobe_derived_probe::kprobe_derived_probe (systemtap_session& sess,
   if (has_maxactive)
     comps.push_back (new probe_point::component(TOK_MAXACTIVE, new literal_number(maxactive_val)));
 
+  // The bpf runtime attaches a kernel function by its name, through
+  // fentry/fexit where the kernel BTF allows.
+  if (sess.runtime_mode == systemtap_session::bpf_runtime
+      && !has_statement && !has_path && !has_library
+      && name.find(':') == string::npos)
+    {
+      sym_name_for_bpf = name;
+      fentry_ok = !has_maxactive && bpf_fentry_supported(sess);
+    }
+
   kprobe_var_expanding_visitor v (sess, has_return);
   // PR25841: no need for this as kprobe.* probes don't support $context vars at all
   // if (sess.symbol_resolver)
@@ -10891,6 +11525,15 @@ hwbkpt_derived_probe_group::emit_module_decls (systemtap_session& s)
       s.op->line() << " },";
     }
   s.op->newline(-1) << "};";
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "static atomic_long_t stap_hwbkpt_hits[" << hwbkpt_probes.size() << "];";
+  s.op->newline() << "static unsigned long stap_hwbkpt_armed[" << hwbkpt_probes.size() << "];";
+  s.op->newline() << "static unsigned long stap_hwbkpt_since[" << hwbkpt_probes.size() << "];";
+  s.op->newline() << "static unsigned long stap_hwbkpt_start;";
+  s.op->newline() << "static unsigned stap_hwbkpt_next, stap_hwbkpt_queued;";
+  s.op->newline() << "static int stap_hwbkpt_rotating;";
+  s.op->newline() << "static struct delayed_work stap_hwbkpt_work;";
+  s.op->newline() << "#endif";
 
   // Emit the hwbkpt callback function
   s.op->newline() ;
@@ -10919,12 +11562,63 @@ hwbkpt_derived_probe_group::emit_module_decls (systemtap_session& s)
   s.op->newline(-1) << "} else {";
   s.op->newline(1) << "c->kregs = regs;";
   s.op->newline(-1) << "}";
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "atomic_long_inc(&stap_hwbkpt_hits[i]);";
+  s.op->newline() << "#endif";
   s.op->newline() << "(*skp->probe->ph) (c);";
   common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
   s.op->newline(-1) << "}";
   s.op->newline(-1) << "}";
   s.op->newline() << "return;";
   s.op->newline(-1) << "}";
+
+  // With -DSTP_HWBKPT_ROTATE_MS, the watches that find no free debug
+  // register at init are queued rather than dropped.  Every
+  // STP_HWBKPT_ROTATE_MS, a work item disarms all the watches and arms
+  // as many as fit again, starting with the first one left out the
+  // last time, so that each watch is armed its share of the time.
+  // Registering hw breakpoints may sleep, hence a work item rather
+  // than a timer.
+  s.op->newline();
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "static int stap_hwbkpt_arm(unsigned i) {";
+  s.op->newline(1) << "struct perf_event **bp;";
+  s.op->newline() << "#ifdef STAPCONF_HW_BREAKPOINT_CONTEXT";
+  s.op->newline() << "bp = register_wide_hw_breakpoint(&stap_hwbkpt_probe_array[i], &enter_hwbkpt_probe, NULL);";
+  s.op->newline() << "#else";
+  s.op->newline() << "bp = register_wide_hw_breakpoint(&stap_hwbkpt_probe_array[i], &enter_hwbkpt_probe);";
+  s.op->newline() << "#endif";
+  s.op->newline() << "if (IS_ERR(bp))";
+  s.op->newline(1) << "return PTR_ERR(bp);";
+  s.op->newline(-1) << "stap_hwbkpt_ret_array[i] = bp;";
+  s.op->newline() << "stap_hwbkpt_probes[i].registered_p = 1;";
+  s.op->newline() << "stap_hwbkpt_since[i] = jiffies;";
+  s.op->newline() << "return 0;";
+  s.op->newline(-1) << "}";
+  s.op->newline();
+  s.op->newline() << "static void stap_hwbkpt_disarm(unsigned i) {";
+  s.op->newline(1) << "if (stap_hwbkpt_probes[i].registered_p == 0) return;";
+  s.op->newline() << "unregister_wide_hw_breakpoint(stap_hwbkpt_ret_array[i]);";
+  s.op->newline() << "stap_hwbkpt_ret_array[i] = NULL;";
+  s.op->newline() << "stap_hwbkpt_probes[i].registered_p = 0;";
+  s.op->newline() << "stap_hwbkpt_armed[i] += jiffies - stap_hwbkpt_since[i];";
+  s.op->newline(-1) << "}";
+  s.op->newline();
+  s.op->newline() << "static void stap_hwbkpt_rotate(struct work_struct *work) {";
+  s.op->newline(1) << "unsigned i, k, n = " << hwbkpt_probes.size() << ";";
+  s.op->newline() << "for (i=0; i<n; i++)";
+  s.op->newline(1) << "stap_hwbkpt_disarm(i);";
+  s.op->newline(-1) << "for (k=0; k<n; k++) {";
+  s.op->newline(1) << "i = (stap_hwbkpt_next + k) % n;";
+  // Watches whose symbol did not resolve never take part.
+  s.op->newline() << "if (stap_hwbkpt_probe_array[i].bp_addr == 0) continue;";
+  s.op->newline() << "if (stap_hwbkpt_arm(i) == -ENOSPC) break;";
+  s.op->newline(-1) << "}";
+  s.op->newline() << "stap_hwbkpt_next = (stap_hwbkpt_next + k) % n;";
+  s.op->newline() << "if (*(volatile int *)&stap_hwbkpt_rotating)";
+  s.op->newline(1) << "schedule_delayed_work(&stap_hwbkpt_work, msecs_to_jiffies(STP_HWBKPT_ROTATE_MS));";
+  s.op->newline(-2) << "}";
+  s.op->newline() << "#endif";
 }
 
 void
@@ -10979,24 +11673,68 @@ hwbkpt_derived_probe_group::emit_module_init (systemtap_session& s)
   s.op->newline(1) << "rc = PTR_ERR(stap_hwbkpt_ret_array[i]);";
   s.op->newline() << "stap_hwbkpt_ret_array[i] = 0;";
   s.op->newline(-1) << "}";
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "if (rc == -ENOSPC) {"; // queued for stap_hwbkpt_rotate
+  s.op->newline(1) << "skp->registered_p = 0;";
+  s.op->newline() << "rc = 0;";
+  s.op->newline() << "stap_hwbkpt_queued++;";
+  s.op->newline() << "continue;";
+  s.op->newline(-1) << "}";
+  s.op->newline() << "stap_hwbkpt_since[i] = jiffies;";
+  s.op->newline() << "#endif";
   s.op->newline() << "if (rc) {";
   s.op->newline(1) << "_stp_warn(\"Hwbkpt probe %s: registration error [man warning::pass5] %d, addr %p, name %s\", probe_point, rc, addr, hwbkpt_symbol_name);";
   s.op->newline() << "skp->registered_p = 0;";
   s.op->newline(-1) << "}";
   s.op->newline() << " else skp->registered_p = 1;";
   s.op->newline(-1) << "}"; // for loop
+
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "stap_hwbkpt_start = jiffies;";
+  s.op->newline() << "if (stap_hwbkpt_queued) {";
+  s.op->newline(1) << "INIT_DELAYED_WORK(&stap_hwbkpt_work, stap_hwbkpt_rotate);";
+  s.op->newline() << "stap_hwbkpt_rotating = 1;";
+  s.op->newline() << "schedule_delayed_work(&stap_hwbkpt_work, msecs_to_jiffies(STP_HWBKPT_ROTATE_MS));";
+  s.op->newline(-1) << "}";
+  s.op->newline() << "#endif";
 }
 
 void
 hwbkpt_derived_probe_group::emit_module_exit (systemtap_session& s)
 {
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "if (stap_hwbkpt_rotating) {";
+  s.op->newline(1) << "stap_hwbkpt_rotating = 0;";
+  s.op->newline() << "cancel_delayed_work_sync(&stap_hwbkpt_work);";
+  s.op->newline(-1) << "}";
+  s.op->newline() << "#endif";
+
   //Unregister hwbkpt probes.
   s.op->newline() << "for (i=0; i<" << hwbkpt_probes.size() << "; i++) {";
   s.op->newline(1) << "struct stap_hwbkpt_probe *skp = & stap_hwbkpt_probes[i];";
   s.op->newline() << "if (skp->registered_p == 0) continue;";
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "stap_hwbkpt_disarm(i);";
+  s.op->newline() << "#else";
   s.op->newline() << "unregister_wide_hw_breakpoint(stap_hwbkpt_ret_array[i]);";
   s.op->newline() << "skp->registered_p = 0;";
+  s.op->newline() << "#endif";
   s.op->newline(-1) << "}";
+
+  // Report how often each watch was hit, and for how much of the run
+  // it was armed, to tell a quiet address from one rarely watched.
+  s.op->newline() << "#ifdef STP_HWBKPT_ROTATE_MS";
+  s.op->newline() << "for (i=0; i<" << hwbkpt_probes.size() << "; i++) {";
+  s.op->newline(1) << "if (stap_hwbkpt_probe_array[i].bp_addr == 0) continue;";
+  s.op->newline() << "_stp_printf(\"hwbkpt %s, addr %p: %ld hits, armed %u of %u ms\\n\",";
+  s.op->newline(1) << "stap_hwbkpt_probes[i].probe->pp,";
+  s.op->newline() << "(void *) (unsigned long) stap_hwbkpt_probe_array[i].bp_addr,";
+  s.op->newline() << "atomic_long_read(&stap_hwbkpt_hits[i]),";
+  s.op->newline() << "jiffies_to_msecs(stap_hwbkpt_armed[i]),";
+  s.op->newline() << "jiffies_to_msecs(jiffies - stap_hwbkpt_start));";
+  s.op->newline(-2) << "}";
+  s.op->newline() << "_stp_print_flush();";
+  s.op->newline() << "#endif";
 }
 
 
@@ -11121,6 +11859,9 @@ struct tracepoint_derived_probe: public derived_probe
   systemtap_session& sess;
   string tracepoint_system, tracepoint_name, header;
   vector <struct tracepoint_arg> args;
+  vector <string> syscall_nrs; // C constants its syscall gate lets through
+
+  bool syscall_dispatch_p () const { return !syscall_nrs.empty(); }
 
   void build_args(dwflpp& dw, Dwarf_Die& func_die);
   void build_args_for_bpf(dwflpp& dw, Dwarf_Die& struct_die);
@@ -11139,6 +11880,16 @@ struct tracepoint_derived_probe_group: public generic_dpg<tracepoint_derived_pro
   void emit_module_decls (systemtap_session& s);
   void emit_module_init (systemtap_session& s);
   void emit_module_exit (systemtap_session& s);
+
+private:
+  // The raw_syscalls probes that name their syscall numbers, by
+  // tracepoint.  Two or more share one registered callback, which
+  // looks up the probes to call by syscall number.
+  map<string, vector<unsigned> > syscall_groups;
+
+  void emit_syscall_dispatch (systemtap_session& s, const string& name,
+                              const vector<unsigned>& group,
+                              translator_output* tpop);
 };
 
 
@@ -11365,6 +12116,40 @@ tracepoint_var_expanding_visitor::visit_target_symbol (target_symbol* e)
 }
 
 
+// Collect the syscall numbers of the __syscall_dispatch() calls that a
+// raw_syscalls probe body starts with (see the gates in syscalls.stpm),
+// passing over other tapset statements that merely set up.  Returns
+// false once the body gets to something else; OK is cleared if a
+// dispatch call names anything but a constant.
+static bool
+leading_syscall_nrs (statement* st, vector<string>& nrs, bool& ok)
+{
+  if (block* b = dynamic_cast<block*>(st))
+    {
+      for (unsigned i = 0; i < b->statements.size(); i++)
+        if (!leading_syscall_nrs (b->statements[i], nrs, ok))
+          return false;
+      return true;
+    }
+
+  expr_statement* es = dynamic_cast<expr_statement*>(st);
+  functioncall* fc = es ? dynamic_cast<functioncall*>(es->value) : NULL;
+  if (!fc || !fc->tok->location.file->privileged)
+    return false;
+  if (fc->function != "__syscall_dispatch")
+    return true;
+
+  for (unsigned i = 0; i < fc->args.size(); i++)
+    if (embedded_expr* ee = dynamic_cast<embedded_expr*>(fc->args[i]))
+      nrs.push_back (ee->code);
+    else if (literal_number* ln = dynamic_cast<literal_number*>(fc->args[i]))
+      nrs.push_back (lex_cast(ln->value));
+    else
+      ok = false;
+  return true;
+}
+
+
 tracepoint_derived_probe::tracepoint_derived_probe (systemtap_session& s,
                                                     dwflpp& dw, Dwarf_Die& func_die,
                                                     const string& tracepoint_system,
@@ -11406,6 +12191,18 @@ tracepoint_derived_probe::tracepoint_derived_probe (systemtap_session& s,
   if (header_pos != string::npos)
     header.erase(header_pos, 12);
 
+  // A raw_syscalls probe whose gate names its syscall numbers is only
+  // called for those, from one callback shared by all such probes.
+  if (s.runtime_mode == systemtap_session::kernel_runtime
+      && tracepoint_system == "raw_syscalls"
+      && (tracepoint_name == "sys_enter" || tracepoint_name == "sys_exit"))
+    {
+      bool ok = true;
+      leading_syscall_nrs (this->body, syscall_nrs, ok);
+      if (!ok)
+        syscall_nrs.clear();
+    }
+
   // Now expand the local variables in the probe body
   tracepoint_var_expanding_visitor v (dw, args);
   // PR25841 -- not yet, need to put tracepoint parameters somewhere else, so
@@ -12212,10 +13009,29 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
   map<string,translator_output*> per_header_aux;
   // GC NB: the translator_output* structs are owned/retained by the systemtap_session.
 
+  syscall_groups.clear();
+  for (unsigned i = 0; i < probes.size(); ++i)
+    if (probes[i]->syscall_dispatch_p())
+      syscall_groups[probes[i]->tracepoint_name].push_back (i);
+  for (auto it = syscall_groups.begin(); it != syscall_groups.end(); )
+    {
+      bool usable = it->second.size() > 1;
+      const vector<tracepoint_arg>& args = probes[it->second[0]]->args;
+      for (unsigned j = 0; j < args.size(); ++j)
+        usable = usable && args[j].usable;
+      if (usable)
+        ++it;
+      else
+        it = syscall_groups.erase (it);
+    }
+  vector<string> registrations; // suffixes of the register_/unregister_ functions
+
   for (unsigned i = 0; i < probes.size(); ++i)
     {
       tracepoint_derived_probe *p = probes[i];
       string header = p->header;
+      bool dispatched = syscall_groups.count (p->tracepoint_name)
+                        && p->syscall_dispatch_p();
 
       // We cache the auxiliary output files on a per-header basis.  We don't
       // need one aux file per tracepoint, only one per tracepoint-header.
@@ -12247,24 +13063,29 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
           used_args.push_back(&p->args[j]);
 
       // forward-declare the generated-side tracepoint callback, and define the
-      // generated-side tracepoint callback in the main translator-output
+      // generated-side tracepoint callback in the main translator-output;
+      // a dispatched one is only called from the main translator-output
       string enter_real_fn = "enter_real_tracepoint_probe_" + lex_cast(i);
       if (used_args.empty())
         {
-          tpop->newline() << "STP_TRACE_ENTER_REAL_NOARGS(" << enter_real_fn << ");";
+          if (!dispatched)
+            tpop->newline() << "STP_TRACE_ENTER_REAL_NOARGS(" << enter_real_fn << ");";
           s.op->newline() << "STP_TRACE_ENTER_REAL_NOARGS(" << enter_real_fn << ")";
         }
       else
         {
-          tpop->newline() << "STP_TRACE_ENTER_REAL(" << enter_real_fn;
+          if (!dispatched)
+            tpop->newline() << "STP_TRACE_ENTER_REAL(" << enter_real_fn;
           s.op->newline() << "STP_TRACE_ENTER_REAL(" << enter_real_fn;
           s.op->indent(2);
           for (unsigned j = 0; j < used_args.size(); ++j)
             {
-              tpop->line() << ", int64_t";
+              if (!dispatched)
+                tpop->line() << ", int64_t";
               s.op->newline() << ", int64_t __tracepoint_arg_" << used_args[j]->name;
             }
-          tpop->line() << ");";
+          if (!dispatched)
+            tpop->line() << ");";
           s.op->newline() << ")";
           s.op->indent(-2);
         }
@@ -12289,6 +13110,12 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
       common_probe_entryfn_epilogue (s, true, otf_safe_context(s));
       s.op->newline(-1) << "}";
 
+      if (dispatched)
+        {
+          tpop->assert_0_indent();
+          continue;
+        }
+
       // define the real tracepoint callback function
       string enter_fn = "enter_tracepoint_probe_" + lex_cast(i);
       if (p->args.empty())
@@ -12335,21 +13162,30 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
       // declare normalized registration functions
       s.op->newline() << "int register_tracepoint_probe_" << i << "(void);";
       s.op->newline() << "void unregister_tracepoint_probe_" << i << "(void);";
+      registrations.push_back ("tracepoint_probe_" + lex_cast(i));
 
       tpop->assert_0_indent();
     }
 
+  if (!syscall_groups.empty())
+    s.op->newline() << "#include \"linux/syscall_dispatch.h\"";
+  for (auto it = syscall_groups.begin(); it != syscall_groups.end(); ++it)
+    emit_syscall_dispatch (s, it->first, it->second,
+                           per_header_aux[probes[it->second[0]]->header]);
+  for (auto it = syscall_groups.begin(); it != syscall_groups.end(); ++it)
+    registrations.push_back ("syscall_tracepoint_" + it->first);
+
   // emit an array of registration functions for easy init/shutdown
   s.op->newline() << "static struct stap_tracepoint_probe {";
   s.op->newline(1) << "int (*reg)(void);";
   s.op->newline(0) << "void (*unreg)(void);";
   s.op->newline(-1) << "} stap_tracepoint_probes[] = {";
   s.op->indent(1);
-  for (unsigned i = 0; i < probes.size(); ++i)
+  for (unsigned i = 0; i < registrations.size(); ++i)
     {
       s.op->newline () << "{";
-      s.op->line() << " .reg=&register_tracepoint_probe_" << i << ",";
-      s.op->line() << " .unreg=&unregister_tracepoint_probe_" << i;
+      s.op->line() << " .reg=&register_" << registrations[i] << ",";
+      s.op->line() << " .unreg=&unregister_" << registrations[i];
       s.op->line() << " },";
     }
   s.op->newline(-1) << "};";
@@ -12357,6 +13193,101 @@ tracepoint_derived_probe_group::emit_module_decls (systemtap_session& s)
 }
 
 
+// Emit the one callback that NAME's dispatched probes share: the aux
+// file registers it and passes it all the tracepoint's arguments, and
+// the main file looks up the syscall number in a table of the numbers
+// each probe named and calls the probes found.
+void
+tracepoint_derived_probe_group::emit_syscall_dispatch (systemtap_session& s,
+                                                       const string& name,
+                                                       const vector<unsigned>& group,
+                                                       translator_output* tpop)
+{
+  const vector<tracepoint_arg>& args = probes[group[0]]->args;
+  string table = "stp_syscall_dispatch_" + name;
+  string enter_real_fn = "enter_real_syscall_tracepoint_" + name;
+  string enter_fn = "enter_syscall_tracepoint_" + name;
+
+  tpop->newline() << "STP_TRACE_ENTER_REAL(" << enter_real_fn;
+  for (unsigned j = 0; j < args.size(); ++j)
+    tpop->line() << ", int64_t";
+  tpop->line() << ");";
+  tpop->newline() << "static STP_TRACE_ENTER(" << enter_fn;
+  for (unsigned j = 0; j < args.size(); ++j)
+    tpop->newline(j ? 0 : 2) << ", " << args[j].c_decl;
+  tpop->newline() << ")";
+  tpop->newline(-2) << "{";
+  tpop->newline(1) << enter_real_fn << "(";
+  for (unsigned j = 0; j < args.size(); ++j)
+    tpop->line() << (j ? ", " : "") << "(int64_t)" << args[j].typecast
+                 << "__tracepoint_arg_" << args[j].name;
+  tpop->line() << ");";
+  tpop->newline(-1) << "}";
+  tpop->newline() << "int register_syscall_tracepoint_" << name << "(void) {";
+  tpop->newline(1) << "return STP_TRACE_REGISTER(" << name << ", " << enter_fn << ");";
+  tpop->newline(-1) << "}";
+  tpop->newline() << "void unregister_syscall_tracepoint_" << name << "(void) {";
+  tpop->newline(1) << "(void) STP_TRACE_UNREGISTER(" << name << ", " << enter_fn << ");";
+  tpop->newline(-1) << "}";
+  tpop->newline();
+  tpop->assert_0_indent();
+
+  s.op->newline() << "int register_syscall_tracepoint_" << name << "(void);";
+  s.op->newline() << "void unregister_syscall_tracepoint_" << name << "(void);";
+
+  // NB: sorted, and its duplicates dropped, in emit_module_init
+  s.op->newline() << "static struct _stp_syscall_dispatch " << table << "[] = {";
+  s.op->indent(1);
+  for (unsigned k = 0; k < group.size(); ++k)
+    {
+      const vector<string>& nrs = probes[group[k]]->syscall_nrs;
+      for (unsigned n = 0; n < nrs.size(); ++n)
+        s.op->newline() << "{ " << nrs[n] << ", " << k << " },";
+    }
+  s.op->newline(-1) << "};";
+  s.op->newline() << "static size_t " << table << "_count;";
+
+  s.op->newline() << "STP_TRACE_ENTER_REAL(" << enter_real_fn;
+  s.op->indent(2);
+  for (unsigned j = 0; j < args.size(); ++j)
+    s.op->newline() << (j ? ", " : "") << "int64_t __tracepoint_arg_" << args[j].name;
+  s.op->newline() << ")";
+  s.op->newline(-2) << "{";
+  s.op->indent(1);
+  // sys_enter has the number as an argument, sys_exit only in the regs
+  if (name == "sys_enter")
+    s.op->newline() << "long nr = (long) __tracepoint_arg_id;";
+  else
+    s.op->newline() << "long nr = _stp_syscall_get_nr(current, "
+                    << "(struct pt_regs *)(uintptr_t) __tracepoint_arg_regs);";
+  s.op->newline() << "const struct _stp_syscall_dispatch *d = "
+                  << "_stp_syscall_dispatch_find(" << table << ", "
+                  << table << "_count, nr);";
+  s.op->newline() << "const struct _stp_syscall_dispatch *end = "
+                  << table << " + " << table << "_count;";
+  s.op->newline() << "for (; d && d < end && d->nr == nr; d++) {";
+  s.op->newline(1) << "switch (d->probe) {";
+  for (unsigned k = 0; k < group.size(); ++k)
+    {
+      tracepoint_derived_probe *p = probes[group[k]];
+      s.op->newline() << "case " << k << ": enter_real_tracepoint_probe_"
+                      << group[k] << "(";
+      bool first = true;
+      for (unsigned j = 0; j < p->args.size(); ++j)
+        if (p->args[j].used)
+          {
+            s.op->line() << (first ? "" : ", ") << "__tracepoint_arg_" << p->args[j].name;
+            first = false;
+          }
+      s.op->line() << "); break;";
+    }
+  s.op->newline() << "}";
+  s.op->newline(-1) << "}";
+  s.op->newline(-1) << "}";
+  s.op->assert_0_indent();
+}
+
+
 void
 tracepoint_derived_probe_group::emit_module_init (systemtap_session &s)
 {
@@ -12364,7 +13295,12 @@ tracepoint_derived_probe_group::emit_module_init (systemtap_session &s)
     return;
 
   s.op->newline() << "/* init tracepoint probes */";
-  s.op->newline() << "for (i=0; i<" << probes.size() << "; i++) {";
+  // the dispatch tables' syscall numbers are only known at compile time
+  for (auto it = syscall_groups.begin(); it != syscall_groups.end(); ++it)
+    s.op->newline() << "stp_syscall_dispatch_" << it->first << "_count = "
+                    << "_stp_syscall_dispatch_sort(stp_syscall_dispatch_" << it->first
+                    << ", ARRAY_SIZE(stp_syscall_dispatch_" << it->first << "));";
+  s.op->newline() << "for (i=0; i<ARRAY_SIZE(stap_tracepoint_probes); i++) {";
   s.op->newline(1) << "rc = stap_tracepoint_probes[i].reg();";
   s.op->newline() << "if (rc) {";
   s.op->newline(1) << "for (j=i-1; j>=0; j--)"; // partial rollback
@@ -12392,7 +13328,7 @@ tracepoint_derived_probe_group::emit_module_exit (systemtap_session& s)
     return;
 
   s.op->newline() << "/* deregister tracepoint probes */";
-  s.op->newline() << "for (i=0; i<" << probes.size() << "; i++)";
+  s.op->newline() << "for (i=0; i<ARRAY_SIZE(stap_tracepoint_probes); i++)";
   s.op->newline(1) << "stap_tracepoint_probes[i].unreg();";
   s.op->indent(-1);
 
@@ -12677,23 +13613,46 @@ tracepoint_query::tracepoint_query_type (Dwarf_Die *type, bool has_inner_types,
 struct tracepoint_builder: public derived_probe_builder
 {
 private:
-  dwflpp *dw;
-  bool init_dw(systemtap_session& s);
+  // One dwflpp per batch of tracequery modules; later batches are only
+  // added when a tracepoint pattern needs headers not yet queried.
+  vector<dwflpp*> dws;
+  bool headers_found;
+  vector<string> system_headers;
+  set<string> queried_headers;
+
+  // tracefs view of the running kernel: system -> event names
+  bool tracefs_scanned;
+  map<string, set<string> > tracefs_events;
+  map<string, set<string> > header_systems;
+  set<string> bare_headers; // with DECLARE_TRACE, which tracefs doesn't list
+
+  void find_system_headers(systemtap_session& s);
+  void scan_tracefs(systemtap_session& s);
+  void select_headers(systemtap_session& s, const string& tracepoint,
+                      vector<string>& headers);
+  bool init_dw(systemtap_session& s, const string& tracepoint);
   void get_tracequery_modules(systemtap_session& s,
                               const vector<string>& headers,
                               vector<string>& modules);
 
+  void release_dws()
+  {
+    for (unsigned i = 0; i < dws.size(); ++i)
+      delete dws[i];
+    dws.clear();
+  }
+
 public:
 
-  tracepoint_builder(): dw(0) {}
-  ~tracepoint_builder() { delete dw; }
+  tracepoint_builder(): headers_found(false), tracefs_scanned(false) {}
+  ~tracepoint_builder() { release_dws(); }
 
   void build_no_more (systemtap_session& s)
   {
-    if (dw && s.verbose > 3)
+    if (!dws.empty() && s.verbose > 3)
       clog << _("tracepoint_builder releasing dwflpp") << endl;
-    delete dw;
-    dw = NULL;
+    release_dws();
+    queried_headers.clear();
 
     delete_session_module_cache (s);
   }
@@ -12934,14 +13893,12 @@ tracepoint_builder::get_tracequery_modules(systemtap_session& s,
 
 
 
-bool
-tracepoint_builder::init_dw(systemtap_session& s)
+void
+tracepoint_builder::find_system_headers(systemtap_session& s)
 {
-  if (dw != NULL)
-    return true;
-
-  vector<string> tracequery_modules;
-  vector<string> system_headers;
+  if (headers_found)
+    return;
+  headers_found = true;
 
   glob_t trace_glob;
 
@@ -13095,13 +14052,170 @@ tracepoint_builder::init_dw(systemtap_session& s)
       globfree(&trace_glob);
     }
 
-  // Build tracequery modules
-  get_tracequery_modules(s, system_headers, tracequery_modules);
-
   // TODO: consider other sources of tracepoint headers too, like from
   // a command-line parameter or some environment or .systemtaprc
+}
+
+
+// Record which tracepoints the running kernel exposes through tracefs, so
+// that select_headers() can skip building tracequery modules for headers
+// that cannot define the requested tracepoints.  Only meaningful when we
+// are translating for the running kernel.
+
+void
+tracepoint_builder::scan_tracefs(systemtap_session& s)
+{
+  if (tracefs_scanned)
+    return;
+  tracefs_scanned = true;
+
+  struct utsname buf;
+  if (uname (&buf) != 0 || s.kernel_release != buf.release
+      || !s.sysroot.empty())
+    return;
+
+  const char *event_globs[] = {
+    "/sys/kernel/tracing/events/*/*/format",
+    "/sys/kernel/debug/tracing/events/*/*/format",
+  };
+
+  for (unsigned i = 0; i < sizeof(event_globs)/sizeof(event_globs[0]); ++i)
+    {
+      glob_t event_glob;
+      if (glob(event_globs[i], 0, NULL, &event_glob) == 0)
+        for (unsigned j = 0; j < event_glob.gl_pathc; ++j)
+          {
+            // .../events/SYSTEM/EVENT/format
+            string path(event_glob.gl_pathv[j]);
+            size_t event_end = path.rfind('/');
+            size_t event_pos = path.rfind('/', event_end - 1);
+            size_t system_pos = path.rfind('/', event_pos - 1);
+            tracefs_events[path.substr(system_pos + 1, event_pos - system_pos - 1)]
+              .insert(path.substr(event_pos + 1, event_end - event_pos - 1));
+          }
+      globfree(&event_glob);
+
+      if (!tracefs_events.empty())
+        break;
+    }
+
+  if (s.verbose > 2)
+    clog << _F("Pass 2: found %zu tracefs event systems", tracefs_events.size()) << endl;
+}
+
 
-  dw = new dwflpp(s, tracequery_modules, true);
+// Pick the headers whose tracequery modules may define TRACEPOINT (in the
+// same SYSTEM:NAME form that tracepoint_query accepts).  Without a tracefs
+// match this is every system header, as before.  tracefs only lists the
+// events of DEFINE_EVENT and the like, so only the headers that have
+// nothing but those can be left out.
+
+void
+tracepoint_builder::select_headers(systemtap_session& s,
+                                   const string& tracepoint,
+                                   vector<string>& headers)
+{
+  string system_pattern = "*", name_pattern = tracepoint;
+  size_t sys_pos = tracepoint.find(':');
+  if (sys_pos != string::npos)
+    {
+      system_pattern = tracepoint.substr(0, sys_pos);
+      name_pattern = tracepoint.substr(sys_pos+1);
+    }
+
+  scan_tracefs(s);
+
+  set<string> systems;
+  for (auto it = tracefs_events.begin(); it != tracefs_events.end(); ++it)
+    {
+      if (fnmatch(system_pattern.c_str(), it->first.c_str(), 0) != 0)
+        continue;
+      for (auto e = it->second.begin(); e != it->second.end(); ++e)
+        if (fnmatch(name_pattern.c_str(), e->c_str(), 0) == 0)
+          {
+            systems.insert(it->first);
+            break;
+          }
+    }
+
+  // Nothing matched: it may be a bare DECLARE_TRACE tracepoint, which has
+  // no tracefs event, or tracefs is unavailable.  Query everything.
+  if (systems.empty())
+    {
+      headers = system_headers;
+      return;
+    }
+
+  for (unsigned i = 0; i < system_headers.size(); ++i)
+    {
+      const string& header = system_headers[i];
+      auto hs = header_systems.find(header);
+      if (hs == header_systems.end())
+        {
+          // Collect every "#define TRACE_SYSTEM foo" in the header, and
+          // note whether it declares any bare tracepoints.
+          set<string>& found = header_systems[header];
+          ifstream in(header.c_str());
+          string line;
+          while (getline(in, line))
+            {
+              if (line.find("DECLARE_TRACE") != string::npos)
+                bare_headers.insert(header);
+              size_t pos = line.find_first_not_of(" \t");
+              if (pos == string::npos || line[pos] != '#')
+                continue;
+              pos = line.find_first_not_of(" \t", pos + 1);
+              if (pos == string::npos || line.compare(pos, 6, "define") != 0)
+                continue;
+              pos = line.find_first_not_of(" \t", pos + 6);
+              if (pos == string::npos || line.compare(pos, 12, "TRACE_SYSTEM") != 0)
+                continue;
+              pos += 12;
+              if (pos >= line.size() || (line[pos] != ' ' && line[pos] != '\t'))
+                continue;
+              pos = line.find_first_not_of(" \t", pos);
+              if (pos == string::npos)
+                continue;
+              size_t end = line.find_first_of(" \t/", pos);
+              found.insert(line.substr(pos, end == string::npos ? end : end - pos));
+            }
+          hs = header_systems.find(header);
+        }
+
+      // Headers without a recognizable TRACE_SYSTEM are kept to be safe,
+      // and so are those with bare tracepoints, which may match too.
+      bool wanted = hs->second.empty() || bare_headers.count(header);
+      for (auto it = hs->second.begin(); !wanted && it != hs->second.end(); ++it)
+        wanted = systems.count(*it);
+      if (wanted)
+        headers.push_back(header);
+    }
+
+  if (s.verbose > 2)
+    clog << _F("Pass 2: tracefs narrowed '%s' to %zu of %zu tracepoint headers",
+               tracepoint.c_str(), headers.size(), system_headers.size()) << endl;
+}
+
+
+bool
+tracepoint_builder::init_dw(systemtap_session& s, const string& tracepoint)
+{
+  find_system_headers(s);
+
+  vector<string> headers, new_headers;
+  select_headers(s, tracepoint, headers);
+  for (unsigned i = 0; i < headers.size(); ++i)
+    if (queried_headers.insert(headers[i]).second)
+      new_headers.push_back(headers[i]);
+
+  if (new_headers.empty())
+    return !dws.empty();
+
+  // Build tracequery modules
+  vector<string> tracequery_modules;
+  get_tracequery_modules(s, new_headers, tracequery_modules);
+
+  dws.push_back(new dwflpp(s, tracequery_modules, true));
   return true;
 }
 
@@ -13121,22 +14235,29 @@ tracepoint_builder::build(systemtap_session& s,
                                   "by target kernel (or use --compatible=4.1 option)"));
   }
 
-  if (!init_dw(s))
-    return;
-
   interned_string tracepoint;
   assert(get_param (parameters, TOK_TRACE, tracepoint));
 
-  tracepoint_query q(*dw, tracepoint, base, location, finished_results);
+  if (!init_dw(s, tracepoint))
+    return;
+
   unsigned results_pre = finished_results.size();
-  dw->iterate_over_modules<base_query>(&query_module, &q);
+  set<string> probed_names, visited_modules;
+  for (unsigned i = 0; i < dws.size(); ++i)
+    {
+      tracepoint_query q(*dws[i], tracepoint, base, location, finished_results);
+      q.probed_names.swap(probed_names);
+      dws[i]->iterate_over_modules<base_query>(&query_module, &q);
+      q.probed_names.swap(probed_names);
+      visited_modules.insert(q.visited_modules.begin(), q.visited_modules.end());
+    }
   unsigned results_post = finished_results.size();
 
   // Did we fail to find a match? Let's suggest something!
   if (results_pre == results_post)
     {
       size_t pos;
-      string sugs = suggest_dwarf_functions(s, q.visited_modules, tracepoint);
+      string sugs = suggest_dwarf_functions(s, visited_modules, tracepoint);
       while ((pos = sugs.find("stapprobe_")) != string::npos)
         sugs.erase(pos, string("stapprobe_").size());
       if (!sugs.empty())
@@ -13166,6 +14287,74 @@ sort_for_bpf(systemtap_session& s,
   return true;
 }
 
+// With --jobs, look over the user script's own probe points for
+// kernel.function/statement and process("path").function/statement
+// probes, and have their function indexes built concurrently before
+// derive_probes gets to them one at a time.  Globs and anything else
+// that needs derivation to resolve are left alone.
+void
+prefetch_dwarf_function_indexes (systemtap_session& s)
+{
+  if (s.jobs <= 1 || !s.use_cache)
+    return;
+
+  set<string> objects;
+  for (unsigned f = 0; f < s.user_files.size(); ++f)
+    for (unsigned i = 0; i < s.user_files[f]->probes.size(); ++i)
+      {
+        const vector<probe_point*>& locs = s.user_files[f]->probes[i]->locations;
+        for (unsigned j = 0; j < locs.size(); ++j)
+          {
+            const vector<probe_point::component*>& c = locs[j]->components;
+            if (c.size() < 2
+                || (c[1]->functor != TOK_FUNCTION && c[1]->functor != TOK_STATEMENT))
+              continue;
+
+            if (c[0]->functor == TOK_KERNEL && !c[0]->arg)
+              objects.insert (TOK_KERNEL);
+            else if (c[0]->functor == TOK_PROCESS)
+              {
+                literal_string* ls = dynamic_cast<literal_string*>(c[0]->arg);
+                if (!ls || contains_glob_chars (ls->value))
+                  continue;
+                string path = find_executable (ls->value, s.sysroot, s.sysenv);
+                if (path.find('/') == string::npos)
+                  path = find_executable (ls->value, s.sysroot, s.sysenv,
+                                          "LD_LIBRARY_PATH");
+                if (path.find('/') != string::npos && access (path.c_str(), R_OK) == 0)
+                  objects.insert (path);
+              }
+          }
+      }
+
+  prefetch_function_indexes (s, objects);
+}
+
+
+struct warm_up_query : public base_query
+{
+  warm_up_query(dwflpp& dw): base_query(dw, TOK_KERNEL) {}
+
+  void handle_query_module() { dw.declaration_resolve_other_cus(""); }
+  void query_library (const char *) {}
+  void query_plt (const char *, size_t) {}
+};
+
+
+// For --compile-daemon: open the kernel debuginfo before any script
+// arrives and build its CU list and global type index, which @cast and
+// $var->member resolution walk the whole module for.  The dwarf builder
+// adopts the result on its first kernel lookup.
+void
+warm_kernel_debuginfo (systemtap_session& s)
+{
+  dwflpp* dw = new dwflpp(s, TOK_KERNEL, true); // might throw
+  warm_up_query q(*dw);
+  dw->iterate_over_modules<base_query>(&query_module, &q);
+  s.warm_kernel_dw = dw;
+}
+
+
 // ------------------------------------------------------------------------
 //  Standard tapset registry.
 // ------------------------------------------------------------------------
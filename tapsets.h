@@ -18,6 +18,8 @@
 void check_process_probe_kernel_support(systemtap_session& s);
 
 void register_standard_tapsets(systemtap_session& sess);
+void prefetch_dwarf_function_indexes(systemtap_session& s);
+void warm_kernel_debuginfo(systemtap_session& s);
 std::vector<derived_probe_group*> all_session_groups(systemtap_session& s);
 std::string common_probe_init (derived_probe* p);
 void common_probe_entryfn_prologue (systemtap_session& s, std::string statestr,
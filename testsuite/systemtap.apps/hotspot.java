@@ -0,0 +1,12 @@
+class hotspot
+{
+    public static int hit(int i) { return i + 1; }
+
+    public static void main(String[] args)
+    {
+	int n = 0;
+	for (int i = 0; i < 100; i++)
+	    n = hit(n);
+	System.out.println(n);
+    }
+}
@@ -0,0 +1,8 @@
+/* Built once per N as a shared library, each with its own build-id. */
+#define CAT(a, b) a ## b
+#define FN(n) CAT(prefetch_f, n)
+
+int FN(N) (int x)
+{
+  return x + N;
+}
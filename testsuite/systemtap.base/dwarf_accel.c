@@ -0,0 +1,19 @@
+/* Built once per N, as a CU of its own. */
+#define CAT(a, b) a ## b
+#define FN(n) CAT(accel_f, n)
+
+int FN(N) (int x)
+{
+  return x + N;
+}
+
+#if N == 0
+int accel_f1 (int);
+int accel_f2 (int);
+int accel_f3 (int);
+
+int main (void)
+{
+  return accel_f0 (0) + accel_f1 (0) + accel_f2 (0) + accel_f3 (0) - 6;
+}
+#endif
@@ -0,0 +1,20 @@
+/* A process that keeps calling a probed function, until killed.  */
+
+#include <unistd.h>
+
+void __attribute__((noinline))
+attach_tick (void)
+{
+  asm volatile ("" : : : "memory");
+}
+
+int
+main (void)
+{
+  for (;;)
+    {
+      attach_tick ();
+      usleep (10000);
+    }
+  return 0;
+}
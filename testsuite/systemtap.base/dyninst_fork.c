@@ -0,0 +1,46 @@
+/* Children that hit a probed function and exit, or exec first.  */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define CHILDREN 20
+
+void __attribute__((noinline))
+fork_probe (int n)
+{
+  asm volatile ("" : : "r" (n) : "memory");
+}
+
+int
+main (void)
+{
+  int i;
+
+  fork_probe (-1);
+  for (i = 0; i < CHILDREN; i++)
+    {
+      pid_t pid = fork ();
+      if (pid < 0)
+        exit (1);
+      if (pid == 0)
+        {
+          /* Every fifth child leaves before its probe.  */
+          if (i % 5 == 4)
+            _exit (0);
+          fork_probe (i);
+          _exit (0);
+        }
+      waitpid (pid, NULL, 0);
+    }
+
+  /* And the last one runs something else.  */
+  if (fork () == 0)
+    {
+      execl ("/bin/true", "true", (char *) NULL);
+      _exit (1);
+    }
+  wait (NULL);
+  fork_probe (CHILDREN);
+  return 0;
+}
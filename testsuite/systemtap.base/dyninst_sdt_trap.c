@@ -0,0 +1,16 @@
+/* Two SDT sites, hit in a loop.  */
+
+#include <sys/sdt.h>
+
+int
+main (void)
+{
+  int i;
+
+  for (i = 0; i < 100; i++)
+    {
+      STAP_PROBE1 (dyninst_sdt_trap, even, i * 2);
+      STAP_PROBE1 (dyninst_sdt_trap, odd, i * 2 + 1);
+    }
+  return 0;
+}
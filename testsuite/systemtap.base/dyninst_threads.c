@@ -0,0 +1,37 @@
+/* Threads that each hit a probed function many times.  */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define THREADS 8
+#define CALLS 5000
+
+void __attribute__((noinline))
+thread_call (long thread, long call)
+{
+  asm volatile ("" : : "r" (thread), "r" (call) : "memory");
+}
+
+static void *
+thread_main (void *arg)
+{
+  long thread = (long) arg, call;
+
+  for (call = 0; call < CALLS; call++)
+    thread_call (thread, call);
+  return NULL;
+}
+
+int
+main (void)
+{
+  pthread_t threads[THREADS];
+  long i;
+
+  for (i = 0; i < THREADS; i++)
+    if (pthread_create (&threads[i], NULL, thread_main, (void *) i))
+      exit (1);
+  for (i = 0; i < THREADS; i++)
+    pthread_join (threads[i], NULL);
+  return 0;
+}
@@ -0,0 +1,19 @@
+/* Functions for function_index.exp to look up.  */
+
+int __attribute__((noinline))
+index_exact (int x)
+{
+  return x * 2;
+}
+
+int __attribute__((noinline))
+index_other (int x)
+{
+  return x + 3;
+}
+
+int
+main (void)
+{
+  return index_exact (1) + index_other (2) - 7;
+}
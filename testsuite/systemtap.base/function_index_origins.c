@@ -0,0 +1,31 @@
+/* Inline instances and call sites for function_index_origins.exp.  */
+
+static inline __attribute__((always_inline)) int
+origins_inl (int x)
+{
+  return x * 3;
+}
+
+int __attribute__((noinline))
+origins_callee (int x)
+{
+  return x + 1;
+}
+
+int __attribute__((noinline))
+origins_caller (int x)
+{
+  return origins_callee (x) + origins_callee (origins_inl (x));
+}
+
+int __attribute__((noinline))
+origins_other (int x)
+{
+  return origins_inl (x + 1) - origins_inl (x);
+}
+
+int
+main (int argc, char *argv[])
+{
+  return origins_caller (argc) + origins_other (argc) + origins_inl (argc) > 0 ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+struct inner { char name[8]; };
+struct point { int x, y; struct inner in; };
+
+int __attribute__((noinline)) pp_f1 (struct point *p) { return p->x; }
+int __attribute__((noinline)) pp_f2 (struct point *p) { return p->x; }
+int __attribute__((noinline)) pp_f3 (struct point *p) { return p->x; }
+int __attribute__((noinline)) pp_f4 (struct point *p) { return p->x; }
+
+int
+main (void)
+{
+  struct point a = { 1, 2, { "one" } }, b = { 3, 4, { "two" } };
+
+  return pp_f1 (&a) + pp_f2 (&b) + pp_f3 (&a) + pp_f4 (&b) == 8 ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+/* The first of two compile units; see probe_cus2.c.  */
+
+int cus_two (int x);
+
+int __attribute__((noinline))
+cus_one (int x)
+{
+  return x + 1;
+}
+
+int
+main (void)
+{
+  return cus_one (1) + cus_two (2) != 6;
+}
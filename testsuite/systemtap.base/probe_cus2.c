@@ -0,0 +1,7 @@
+/* The second compile unit of probe_cus.  */
+
+int __attribute__((noinline))
+cus_two (int x)
+{
+  return x + 1;
+}
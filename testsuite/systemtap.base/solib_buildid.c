@@ -0,0 +1,41 @@
+#ifdef SOLIB
+/* Two builds of the library, with different build-ids.  */
+int
+solib_func (int x)
+{
+  return x + SOLIB;
+}
+#else
+#include <dlfcn.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Load the library at argv[1] three times, from each of the files
+   that follow, moved into its place: the probed build, another build
+   with the same name, then a copy of the probed one.  */
+int
+main (int argc, char **argv)
+{
+  char tmp[4096];
+  int i, j, sum = 0;
+
+  for (i = 2; i < argc; i++)
+    {
+      snprintf (tmp, sizeof (tmp), "%s.tmp", argv[1]);
+      if (link (argv[i], tmp) != 0 || rename (tmp, argv[1]) != 0)
+        return 1;
+      for (j = 0; j < 3; j++)
+        {
+          void *h = dlopen (argv[1], RTLD_NOW);
+          int (*f) (int);
+
+          if (!h)
+            return 1;
+          f = (int (*) (int)) dlsym (h, "solib_func");
+          sum += f (j);
+          dlclose (h);
+        }
+    }
+  return sum == 0;
+}
+#endif
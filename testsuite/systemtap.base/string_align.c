@@ -0,0 +1,71 @@
+/* Hands strings of many lengths and alignments to check_string(), for
+   string_align.stp to read with user_string(): within a page, across a
+   page boundary, and ending right before an unmapped page.  */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static long calls;
+
+void __attribute__((noinline))
+check_string (const char *s, long len)
+{
+  asm volatile ("" : : "r" (s), "r" (len) : "memory");
+}
+
+void __attribute__((noinline))
+done (long n)
+{
+  asm volatile ("" : : "r" (n) : "memory");
+}
+
+static void
+put (char *s, long len)
+{
+  long i;
+  for (i = 0; i < len; i++)
+    s[i] = 'a' + (i + len) % 26;
+  s[len] = '\0';
+  check_string (s, len);
+  calls++;
+}
+
+int
+main (void)
+{
+  long page = sysconf (_SC_PAGESIZE);
+  char *map = mmap (NULL, 3 * page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  long align, len;
+
+  if (map == MAP_FAILED)
+    return 1;
+  /* The third page goes away, so that nothing can be read past the
+     second.  */
+  munmap (map + 2 * page, page);
+
+  /* Every alignment, with lengths around the word size and the
+     MAXSTRINGLEN buffer.  */
+  for (align = 0; align < 8; align++)
+    {
+      for (len = 0; len <= 40; len++)
+        put (map + align, len);
+      for (len = 505; len <= 520; len++)
+        put (map + align, len);
+    }
+
+  /* Across the boundary between the first two pages.  */
+  for (align = 1; align <= 24; align++)
+    for (len = 0; len <= 40; len++)
+      put (map + page - align, len);
+
+  /* Ending right before the unmapped page, at every alignment.  */
+  for (len = 0; len <= 80; len++)
+    put (map + 2 * page - 1 - len, len);
+  for (len = 505; len <= 520; len++)
+    put (map + 2 * page - 1 - len, len);
+
+  done (calls);
+  return 0;
+}
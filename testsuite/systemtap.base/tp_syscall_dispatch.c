@@ -0,0 +1,22 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+int
+main (void)
+{
+  char buf[123] = { 0 };
+  int fd = open ("/dev/zero", O_RDWR);
+  int i;
+
+  /* An fd of our own, for the probes to tell these calls from
+     the loader's.  */
+  dup2 (fd, 100);
+  close (fd);
+  for (i = 0; i < 3; i++)
+    syscall (SYS_write, 100, buf, 123);
+  for (i = 0; i < 2; i++)
+    syscall (SYS_read, 100, buf, 77);
+  syscall (SYS_close, 100);
+  return 0;
+}
@@ -0,0 +1,17 @@
+struct pair { long a, b; };
+
+long __attribute__((noinline))
+pair_sum_1 (struct pair *p)
+{
+  return p->a + p->b;
+}
+
+long pair_sum_2 (struct pair *p);
+
+int
+main (void)
+{
+  struct pair x = { 1, 2 }, y = { 30, 40 };
+
+  return pair_sum_1 (&x) + pair_sum_2 (&y) == 73 ? 0 : 1;
+}
@@ -0,0 +1,7 @@
+struct pair { long a, b; };
+
+long __attribute__((noinline))
+pair_sum_2 (struct pair *p)
+{
+  return p->a + p->b;
+}
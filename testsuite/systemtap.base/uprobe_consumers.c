@@ -0,0 +1,22 @@
+/* Many functions in one file, each a uprobe consumer of its own.  */
+
+#define F(n) \
+  int __attribute__((noinline)) consumer_f##n (int x) { return x + n; }
+F(0) F(1) F(2) F(3) F(4) F(5) F(6) F(7) F(8) F(9)
+F(10) F(11) F(12) F(13) F(14) F(15) F(16) F(17) F(18) F(19)
+
+int
+main (void)
+{
+  int i, sum = 0;
+
+  for (i = 0; i < 3; i++)
+    sum += consumer_f0 (i) + consumer_f1 (i) + consumer_f2 (i)
+      + consumer_f3 (i) + consumer_f4 (i) + consumer_f5 (i)
+      + consumer_f6 (i) + consumer_f7 (i) + consumer_f8 (i)
+      + consumer_f9 (i) + consumer_f10 (i) + consumer_f11 (i)
+      + consumer_f12 (i) + consumer_f13 (i) + consumer_f14 (i)
+      + consumer_f15 (i) + consumer_f16 (i) + consumer_f17 (i)
+      + consumer_f18 (i) + consumer_f19 (i);
+  return sum == 0;
+}
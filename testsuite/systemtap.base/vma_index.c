@@ -0,0 +1,50 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define N 64
+
+/* The probe looks up the module name of each address. */
+void __attribute__((noinline)) mark (uint64_t *addrs, int n)
+{
+  asm volatile ("" : : "r" (addrs), "r" (n) : "memory");
+}
+
+int main (int argc, char *argv[])
+{
+  uint64_t addrs[N], more[N / 2];
+  int fd = open ("/proc/self/exe", O_RDONLY);
+  int i;
+
+  if (fd < 0)
+    return 1;
+
+  /* Many mappings of one file, each its own entry in the index. */
+  for (i = 0; i < N; i++)
+    {
+      void *p = mmap (NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED)
+	return 1;
+      addrs[i] = (uintptr_t) p;
+    }
+  mark (addrs, N);
+
+  /* Removing half of them must leave those addresses unknown, even
+     if a lookup just found them. */
+  for (i = 1; i < N; i += 2)
+    munmap ((void *) (uintptr_t) addrs[i], 4096);
+  mark (addrs, N);
+
+  for (i = 0; i < N / 2; i++)
+    {
+      void *p = mmap (NULL, 4096, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED)
+	return 1;
+      more[i] = (uintptr_t) p;
+    }
+  mark (more, N / 2);
+
+  close (fd);
+  return 0;
+}
@@ -0,0 +1,72 @@
+/* Workload for probe_hit.exp: raises one kind of event COUNT times,
+   and prints how many nanoseconds each took on average.
+
+     syscall  getppid(), for the kprobe and tracepoint benchmarks
+     call     bench_fn(), for the uprobe ones
+     fault    a first touch of a fresh page, for the perf ones  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+long bench_fn(long arg) __attribute__((noinline));
+long bench_fn(long arg)
+{
+  asm volatile ("" : : : "memory");
+  return arg + 1;
+}
+
+static double now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+  long count, i, sum = 0;
+  long page = sysconf(_SC_PAGESIZE);
+  char *mem = NULL;
+  double start, end;
+
+  if (argc != 3 || (count = atol(argv[2])) <= 0)
+    {
+      fprintf(stderr, "usage: %s syscall|call|fault COUNT\n", argv[0]);
+      return 2;
+    }
+
+  if (strcmp(argv[1], "fault") == 0)
+    {
+      mem = mmap(NULL, count * page, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mem == MAP_FAILED)
+        {
+          perror("mmap");
+          return 1;
+        }
+    }
+
+  start = now_ns();
+  if (strcmp(argv[1], "syscall") == 0)
+    for (i = 0; i < count; i++)
+      sum += syscall(SYS_getppid);
+  else if (strcmp(argv[1], "call") == 0)
+    for (i = 0; i < count; i++)
+      sum += bench_fn(i);
+  else if (mem != NULL)
+    for (i = 0; i < count; i++)
+      mem[i * page] = 1;
+  else
+    return 2;
+  end = now_ns();
+
+  if (mem != NULL)
+    munmap(mem, count * page);
+  printf("%.1f\n", (end - start) / count);
+  return sum == -1;
+}
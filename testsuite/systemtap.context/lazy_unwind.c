@@ -0,0 +1,27 @@
+#include <unistd.h>
+
+int __attribute__((noinline))
+leaf (int i)
+{
+  return i + 1;
+}
+
+int __attribute__((noinline))
+outer (int i)
+{
+  return leaf (i) * 2;
+}
+
+int
+main (void)
+{
+  int i, sum = 0;
+
+  /* Give stapio time to hand the unwind data over between calls.  */
+  for (i = 0; i < 3; i++)
+    {
+      sum += outer (i);
+      usleep (500000);
+    }
+  return sum == 12 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+/* Enough lines, over two compilation units, for the line table to
+   span several blocks and files.  */
+
+int part2 (int x);
+
+int __attribute__((noinline))
+part1 (int x)
+{
+  x = x * 3 + 0;
+  x = x * 3 + 1;
+  x = x * 3 + 2;
+  x = x * 3 + 3;
+  x = x * 3 + 4;
+  x = x * 3 + 5;
+  x = x * 3 + 6;
+  x = x * 3 + 7;
+  x = x * 3 + 8;
+  x = x * 3 + 9;
+  x = x * 3 + 10;
+  x = x * 3 + 11;
+  x = x * 3 + 12;
+  x = x * 3 + 13;
+  x = x * 3 + 14;
+  x = x * 3 + 15;
+  x = x * 3 + 16;
+  x = x * 3 + 17;
+  x = x * 3 + 18;
+  x = x * 3 + 19;
+  x = x * 3 + 20;
+  x = x * 3 + 21;
+  x = x * 3 + 22;
+  x = x * 3 + 23;
+  x = x * 3 + 24;
+  x = x * 3 + 25;
+  x = x * 3 + 26;
+  x = x * 3 + 27;
+  x = x * 3 + 28;
+  x = x * 3 + 29;
+  x = x * 3 + 30;
+  x = x * 3 + 31;
+  x = x * 3 + 32;
+  x = x * 3 + 33;
+  x = x * 3 + 34;
+  x = x * 3 + 35;
+  x = x * 3 + 36;
+  x = x * 3 + 37;
+  x = x * 3 + 38;
+  x = x * 3 + 39;
+  return x;
+}
+
+int
+main (void)
+{
+  return part1 (1) + part2 (2) == 42;
+}
@@ -0,0 +1,45 @@
+int __attribute__((noinline))
+part2 (int x)
+{
+  x = x ^ (x << 1);
+  x = x ^ (x << 2);
+  x = x ^ (x << 3);
+  x = x ^ (x << 4);
+  x = x ^ (x << 5);
+  x = x ^ (x << 6);
+  x = x ^ (x << 7);
+  x = x ^ (x << 1);
+  x = x ^ (x << 2);
+  x = x ^ (x << 3);
+  x = x ^ (x << 4);
+  x = x ^ (x << 5);
+  x = x ^ (x << 6);
+  x = x ^ (x << 7);
+  x = x ^ (x << 1);
+  x = x ^ (x << 2);
+  x = x ^ (x << 3);
+  x = x ^ (x << 4);
+  x = x ^ (x << 5);
+  x = x ^ (x << 6);
+  x = x ^ (x << 7);
+  x = x ^ (x << 1);
+  x = x ^ (x << 2);
+  x = x ^ (x << 3);
+  x = x ^ (x << 4);
+  x = x ^ (x << 5);
+  x = x ^ (x << 6);
+  x = x ^ (x << 7);
+  x = x ^ (x << 1);
+  x = x ^ (x << 2);
+  x = x ^ (x << 3);
+  x = x ^ (x << 4);
+  x = x ^ (x << 5);
+  x = x ^ (x << 6);
+  x = x ^ (x << 7);
+  x = x ^ (x << 1);
+  x = x ^ (x << 2);
+  x = x ^ (x << 3);
+  x = x ^ (x << 4);
+  x = x ^ (x << 5);
+  return x;
+}
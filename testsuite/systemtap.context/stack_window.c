@@ -0,0 +1,20 @@
+#include <string.h>
+
+/* Each frame takes over 1KB of stack, so that the backtrace from the
+   deepest one reaches well past the default 4096-byte stack window.  */
+int __attribute__((noinline))
+deep (int n)
+{
+  volatile char pad[1024];
+
+  memset ((char *) pad, n, sizeof (pad));
+  if (n == 0)
+    return pad[0];
+  return deep (n - 1) + pad[n];
+}
+
+int
+main (void)
+{
+  return deep (12);
+}
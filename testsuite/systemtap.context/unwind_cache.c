@@ -0,0 +1,30 @@
+/* The same call chain, taken over and over, unwinds through the same
+   pcs each time.  */
+
+int __attribute__((noinline))
+leaf (int n)
+{
+  return n + 1;
+}
+
+int __attribute__((noinline))
+middle (int n)
+{
+  return leaf (n) * 2;
+}
+
+int __attribute__((noinline))
+outer (int n)
+{
+  return middle (n) - 1;
+}
+
+int
+main (void)
+{
+  int i, sum = 0;
+
+  for (i = 0; i < 20; i++)
+    sum += outer (i);
+  return sum == 0;
+}
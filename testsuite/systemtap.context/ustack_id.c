@@ -0,0 +1,21 @@
+int __attribute__((noinline))
+leaf (int n)
+{
+  return n + 1;
+}
+
+int __attribute__((noinline))
+middle (int n)
+{
+  return n % 3 ? leaf (n) : middle (n - 1) + 1;
+}
+
+int
+main (void)
+{
+  int i, sum = 0;
+
+  for (i = 1; i <= 200; i++)
+    sum += middle (i);
+  return sum == 0;
+}
@@ -0,0 +1,13 @@
+/* Target variables for optimize.exp's target read cases.  */
+
+int __attribute__((noinline))
+f (int x)
+{
+  return x + 1;
+}
+
+int
+main (void)
+{
+  return f (1) - 2;
+}
@@ -0,0 +1,114 @@
+/* Compare the runtime's digit conversion (runtime/vsprintf_number.h)
+ * with the digit-at-a-time loop number() used before, and check it
+ * against snprintf.  Prints ns per conversion for each, then "ok".
+ *
+ *   number_bench [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define do_div(n,base) ({					\
+	uint32_t __base = (base);				\
+	uint32_t __rem;						\
+	__rem = ((uint64_t)(n)) % __base;			\
+	(n) = ((uint64_t)(n)) / __base;				\
+	__rem;							\
+ })
+
+#include "vsprintf_number.h"
+
+#define NVALUES 4096
+
+static uint64_t values[NVALUES];
+static volatile char sink;
+
+/* number() before vsprintf_number.h: one division per digit, into a
+   reversed buffer. */
+static int old_number(char *buf, uint64_t num, int base)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[66];
+	int i = 0, n = 0;
+
+	if (num == 0)
+		tmp[i++] = '0';
+	else while (num != 0)
+		tmp[i++] = digits[do_div(num, base)];
+	while (i-- > 0)
+		buf[n++] = tmp[i];
+	return n;
+}
+
+static int new_number(char *buf, uint64_t num, int base)
+{
+	int n = _stp_number_digits(num, base);
+	_stp_number_fill(buf + n, num, base, 0);
+	return n;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double bench(int (*fn)(char *, uint64_t, int), int base, long iters)
+{
+	char buf[66];
+	double t0 = now();
+	long i;
+
+	for (i = 0; i < iters; i++) {
+		int n = fn(buf, values[i % NVALUES], base);
+		sink = buf[n - 1];
+	}
+	return (now() - t0) / iters;
+}
+
+int main(int argc, char **argv)
+{
+	long iters = argc > 1 ? atol(argv[1]) : 10000000;
+	char buf[66], ref[66];
+	int i, n, bases[] = { 10, 16, 8 };
+	unsigned b;
+
+	/* Counters, addresses and everything in between. */
+	srandom(1);
+	for (i = 0; i < NVALUES; i++) {
+		uint64_t r = ((uint64_t) random() << 33) ^ ((uint64_t) random() << 11) ^ random();
+		switch (i % 4) {
+		case 0: values[i] = i; break;
+		case 1: values[i] = r % 1000000; break;
+		case 2: values[i] = 0xffffffff80000000ULL | (r & 0x7fffffff); break;
+		default: values[i] = r >> (i % 64); break;
+		}
+	}
+	values[5] = 0;
+	values[6] = ~0ULL;
+	values[7] = 10000000000000000000ULL;
+	values[9] = 9999999999999999999ULL;
+
+	for (b = 0; b < sizeof(bases) / sizeof(bases[0]); b++)
+		for (i = 0; i < NVALUES; i++) {
+			n = new_number(buf, values[i], bases[b]);
+			buf[n] = '\0';
+			snprintf(ref, sizeof(ref), bases[b] == 10 ? "%llu"
+				 : bases[b] == 16 ? "%llx" : "%llo",
+				 (unsigned long long) values[i]);
+			if (strcmp(buf, ref) != 0) {
+				printf("base %d: %s, expected %s\n", bases[b], buf, ref);
+				return 1;
+			}
+		}
+
+	for (b = 0; b < sizeof(bases) / sizeof(bases[0]); b++)
+		printf("base %d: old %.1f ns, new %.1f ns\n", bases[b],
+		       bench(old_number, bases[b], iters),
+		       bench(new_number, bases[b], iters));
+	printf("ok\n");
+	return 0;
+}
@@ -36,10 +36,21 @@ while {[string match -* [lindex $argv $index]]} {
     incr index
 }
 
+# Each record starts with a struct _stp_trace header: a per-cpu
+# sequence number, the payload length and a 64-bit timestamp.
 if {$tcl_platform(byteOrder) == "littleEndian"} {
-    set int_format i
+    set hdr_format iiw
 } else {
-    set int_format I
+    set hdr_format IIW
+}
+
+proc read_hdr {n} {
+    global fd hdr_format seq len timestamp
+    if {![binary scan [read $fd($n) 16] $hdr_format seq($n) len($n) timestamp($n)]} {
+	unset fd($n)
+	return
+    }
+    set seq($n) [expr $seq($n) & 0xFFFFFFFF]
 }
 
 set files [lrange $argv $index end]
@@ -51,10 +62,7 @@ foreach file $files {
 	exit 1
     }
     fconfigure $fd($n) -translation binary
-    if {![binary scan [read $fd($n) 4] $int_format timestamp($n)]} {
-	continue
-    }
-    set timestamp($n) [expr $timestamp($n) & 0xFFFFFFFF]
+    read_hdr $n
     incr n
 }
 set ncpus $n
@@ -67,35 +75,23 @@ if {$outfile != "stdout"} {
 }
 fconfigure $outfile -translation binary
 
+# Merge by (timestamp, cpu); each file is already in sequence order.
 while {1} {
     set mincpu -1
     for {set n 0} {$n < $ncpus} {incr n} {
-	if {[info exists fd($n)] && (![info exists min] || $timestamp($n) <= $min)} {
-	    set min $timestamp($n)
+	if {[info exists fd($n)] && ($mincpu < 0 || $timestamp($n) < $timestamp($mincpu))} {
 	    set mincpu $n
 	}
     }
 
-    if {![info exists min]} {break}
-
-    if {![binary scan [read $fd($mincpu) 4] $int_format len]} {
-	puts stderr "Error reading length from channel $mincpu"
-	exit 1
-    }
+    if {$mincpu < 0} {break}
 
     if {$verbose == 1} {
-	puts stderr "\[CPU:$mincpu, seq=$min, length=$len\]"
+	puts stderr "\[CPU:$mincpu, seq=$seq($mincpu), time=$timestamp($mincpu), length=$len($mincpu)\]"
     }
 
-    set data [read $fd($mincpu) $len]
+    set data [read $fd($mincpu) $len($mincpu)]
     puts -nonewline $outfile $data
 
-    set data [read $fd($mincpu) 4]
-    if {$data == ""} {
-	unset fd($mincpu)
-    } else {
-	binary scan $data $int_format timestamp($mincpu)
-	set timestamp($mincpu) [expr $timestamp($mincpu) & 0xFFFFFFFF]
-    }
-    unset min
+    read_hdr $mincpu
 }
@@ -0,0 +1,10 @@
+import time
+
+def spin(seconds):
+    end = time.time() + seconds
+    n = 0
+    while time.time() < end:
+        n += 1
+    return n
+
+spin(3)
@@ -20,6 +20,7 @@
 #include "task_finder.h"
 #include "runtime/k_syms.h"
 #include "dwflpp.h"
+#include "coveragedb.h"
 #include "stapregex.h"
 #include "stringtable.h"
 
@@ -89,6 +90,23 @@ struct c_unparser: public unparser, public visitor
   bool already_checked_action_count;
 
   varuse_collecting_visitor vcv_needs_global_locks; // tracks union of all probe handler body reads/writes
+  varuse_collecting_visitor vcv_frequent_writes; // same, leaving out the probes that write rarely
+  set<vardecl*> striped_maps; // maps of longs whose single-key operations lock their buckets
+  set<vardecl*> sorted_maps; // maps that some foreach sorts
+  map<foreach_loop*, delete_statement*> snapshot_loops; // see snapshot_foreach_visitor
+  set<delete_statement*> snapshot_deletes; // their deletes, which need no locks
+  set<delete_statement*> snapshot_taken; // those whose loop did take a snapshot
+  set<vardecl*> snapshot_maps; // maps with a spare for snapshots
+  set<vardecl*> probe_snapshots; // snapshots taken by the current probe
+  set<derived_probe*> deferred_probes; // probes that queue their updates if their locks are contended
+  vector<derived_probe*> defer_queues; // those of them emitted, each with its queue
+  map<if_statement*, unsigned> branch_ids; // -t counters of if statements
+
+  // The =~ conditions of if/else-if chains matched by one dfa, each with
+  // the tmpvar holding its result and its 1-based place in the chain.
+  struct regex_chain_slot { stapdfa *dfa; string result; unsigned index; };
+  map<regex_query*, regex_chain_slot> regex_chain_slots;
+  set<derived_probe*> hot_probes, cold_probes; // --pgo handler placement
 
   map<string, probe*> probe_contents;
 
@@ -129,7 +147,8 @@ struct c_unparser: public unparser, public visitor
     session (ss), o (op ?: ss->op), current_probe(0), current_function (0),
     assigned_functioncall (0), assigned_functioncall_retval (0),
     tmpvar_counter (0), label_counter (0), action_counter(0), fc_counter(0),
-    already_checked_action_count(false), vcv_needs_global_locks (*ss) {}
+    already_checked_action_count(false), vcv_needs_global_locks (*ss),
+    vcv_frequent_writes (*ss) {}
   ~c_unparser () {}
 
   // The main c_unparser doesn't write declarations as it traverses,
@@ -152,6 +171,10 @@ struct c_unparser: public unparser, public visitor
   void emit_module_init ();
   void emit_module_refresh ();
   void emit_module_exit ();
+  void emit_global_stats ();
+  void emit_map_refill ();
+  void emit_map_report ();
+  void emit_handoff ();
   void emit_function (functiondecl* v);
   void emit_lock_decls (const varuse_collecting_visitor& v);
   void emit_lock ();
@@ -162,6 +185,9 @@ struct c_unparser: public unparser, public visitor
   void emit_probe_condition_update(derived_probe* v);
 
   void emit_compiled_printfs ();
+  void emit_binary_printf (const string& name, unsigned id,
+                           const vector<print_format::format_component>& components);
+  void emit_fast_printf (const vector<print_format::format_component>& components);
   void emit_compiled_printf_locals ();
   void declare_compiled_printf (bool print_to_stream, const string& format);
   virtual const string& get_compiled_printf (bool print_to_stream,
@@ -210,6 +236,7 @@ struct c_unparser: public unparser, public visitor
   void c_strcpy (const string& lvalue, expression* rvalue);
 
   bool is_local (vardecl const* r, token const* tok);
+  bool lockless_global_p (vardecl* v);
 
   tmpvar gensym(exp_type ty);
   aggvar gensym_aggregate();
@@ -283,6 +310,20 @@ struct c_unparser: public unparser, public visitor
   // wrap one child visit of a compound statement
   virtual void wrap_compound_visit (expression *e) { if (e) e->visit (this); }
   virtual void wrap_compound_visit (statement *s) { if (s) s->visit (this); }
+
+  // start/close expressions whose children are evaluated one after the
+  // other, each one's temporaries dead before the next one's are needed
+  virtual void start_compound_expression (std::ostream::pos_type &,
+                                          std::ostream::pos_type &,
+                                          const char*, expression*) { }
+  virtual void close_compound_expression (std::ostream::pos_type,
+                                          std::ostream::pos_type) { }
+
+  // start/close the temporaries of one such child
+  virtual void start_struct_def (std::ostream::pos_type &,
+                                 std::ostream::pos_type &, const token*) { }
+  virtual void close_struct_def (std::ostream::pos_type,
+                                 std::ostream::pos_type) { }
 };
 
 // A shadow visitor, meant to generate temporary variable declarations
@@ -313,10 +354,17 @@ struct c_tmpcounter cxx_final: public c_unparser
   void wrap_compound_visit (expression *e) cxx_override;
   void wrap_compound_visit (statement *s) cxx_override;
 
+  void start_compound_expression (std::ostream::pos_type &before,
+                                  std::ostream::pos_type &after,
+                                  const char* tag, expression *e) cxx_override;
+  void close_compound_expression (std::ostream::pos_type before,
+                                  std::ostream::pos_type after) cxx_override;
+
   void start_struct_def (std::ostream::pos_type &before,
-                         std::ostream::pos_type &after, const token* tok);
+                         std::ostream::pos_type &after,
+                         const token* tok) cxx_override;
   void close_struct_def (std::ostream::pos_type before,
-                         std::ostream::pos_type after);
+                         std::ostream::pos_type after) cxx_override;
 };
 
 struct c_unparser_assignment:
@@ -397,6 +445,7 @@ protected:
   statistic_decl sd;
   string name;
   bool do_mangle;
+  bool once; // a long some readers load without the lock
 
 private:
   mutable bool declaration_needed;
@@ -406,23 +455,23 @@ public:
   var(c_unparser *u, bool local, exp_type ty,
       statistic_decl const & sd, string const & name)
     : u(u), local(local), ty(ty), sd(sd), name(name),
-      do_mangle(true), declaration_needed(false)
+      do_mangle(true), once(false), declaration_needed(false)
   {}
 
   var(c_unparser *u, bool local, exp_type ty, string const & name)
     : u(u), local(local), ty(ty), name(name),
-      do_mangle(true), declaration_needed(false)
+      do_mangle(true), once(false), declaration_needed(false)
   {}
 
   var(c_unparser *u, bool local, exp_type ty,
       string const & name, bool do_mangle)
     : u(u), local(local), ty(ty), name(name),
-      do_mangle(do_mangle), declaration_needed(false)
+      do_mangle(do_mangle), once(false), declaration_needed(false)
   {}
 
   var(c_unparser *u, bool local, exp_type ty, unsigned & counter)
     : u(u), local(local), ty(ty), name("__tmp" + lex_cast(counter++)),
-      do_mangle(false), declaration_needed(true)
+      do_mangle(false), once(false), declaration_needed(true)
   {}
 
   virtual ~var() {}
@@ -454,6 +503,13 @@ public:
 	assert(hop.htype == hist_log);
 	assert(hop.params.size() == 0);
 	break;
+      case statistic_decl::hdr:
+	assert(hop.htype == hist_hdr);
+	assert(hop.params.size() == 1);
+	assert(hop.params[0] == sd.hdr_bits);
+	break;
+      case statistic_decl::quantile:
+      case statistic_decl::distinct:
       case statistic_decl::none:
 	assert(false);
       }
@@ -503,10 +559,18 @@ public:
 
     if (local)
       return "l->" + c_name();
+    else if (once)
+      // READ_ONCE() isn't available on all supported kernels.
+      return "(*(volatile int64_t *)&global(" + c_name() + "))";
     else
       return "global(" + c_name() + ")";
   }
 
+  void set_once()
+  {
+    once = true;
+  }
+
   virtual string hist() const
   {
     assert (ty == pe_stats);
@@ -563,6 +627,19 @@ public:
               prefix += string("KEY_HIST_TYPE, HIST_LOG, ");
               break;
 
+            case statistic_decl::hdr:
+              prefix += string("KEY_HIST_TYPE, HIST_HDR, ")
+                + lex_cast(sd.hdr_bits) + ", ";
+              break;
+
+            case statistic_decl::quantile:
+              prefix += string("KEY_HIST_TYPE, HIST_HDR, STP_QUANTILE_BITS, ");
+              break;
+
+            case statistic_decl::distinct:
+              prefix += string("KEY_HIST_TYPE, HIST_HLL, STP_DISTINCT_BITS, ");
+              break;
+
             default:
               throw SEMANTIC_ERROR(_F("unsupported stats type for %s", value().c_str()));
             }
@@ -697,21 +774,35 @@ struct mapvar
   vector<exp_type> index_types;
   int maxsize;
   bool wrap;
+  bool topk;
+  bool striped;
+  bool sorted;
   mapvar (c_unparser *u,
           bool local, exp_type ty,
 	  statistic_decl const & sd,
 	  string const & name,
 	  vector<exp_type> const & index_types,
-	  int maxsize, bool wrap)
+	  int maxsize, bool wrap, bool topk = false, bool striped = false,
+	  bool sorted = false)
     : var (u, local, ty, sd, name),
       index_types (index_types),
-      maxsize (maxsize), wrap(wrap)
+      maxsize (maxsize), wrap(wrap), topk(topk), striped(striped),
+      sorted(sorted)
   {}
 
   static string shortname(exp_type e);
   static string key_typename(exp_type e);
   static string value_typename(exp_type e);
 
+  // The spare that a snapshot foreach swaps in for this map.
+  mapvar snapshot () const
+  {
+    mapvar snap (*this);
+    snap.name = "snap_" + c_name ();
+    snap.do_mangle = false;
+    return snap;
+  }
+
   string keysym () const
   {
     string result;
@@ -847,6 +938,8 @@ struct mapvar
     // impedance matching: empty strings -> NULL
     if (type() == pe_stats)
       res += (call_prefix("add", indices) + ", " + val.value() + ", " + stat_op_parms() + ")");
+    else if (type() == pe_long)
+      res += (call_prefix("add", indices) + ", " + val.value() + ")");
     else
       throw SEMANTIC_ERROR(_("adding a value of an unsupported map type"));
 
@@ -904,12 +997,18 @@ struct mapvar
     prefix += function_keysym("new") + " ("
       + (is_parallel() ? stat_op_tokens() : "")
       + "KEY_MAPENTRIES, " + (maxsize > 0 ? lex_cast(maxsize) : "MAXMAPENTRIES") + ", "
-      + ((wrap == true) ? "KEY_STAT_WRAP, " : "");
+      + ((wrap == true) ? "KEY_STAT_WRAP, " : "")
+      + (topk ? "KEY_STAT_TOPK, " : "")
+      + (striped ? "KEY_MAP_STRIPED, " : "");
 
     // See also var::init().
 
     // Check for errors during allocation.
     string suffix = "if (" + value () + " == NULL) rc = -ENOMEM;";
+    if (sorted)
+      suffix += " else if (" + string(is_parallel() ? "_stp_pmap_init_sort"
+                                                    : "_stp_map_init_sort")
+        + " (" + value () + ")) rc = -ENOMEM;";
 
     if (type() == pe_stats)
       {
@@ -930,6 +1029,19 @@ struct mapvar
 	  case statistic_decl::logarithmic:
 	    prefix = prefix + "KEY_HIST_TYPE, HIST_LOG, ";
 	    break;
+
+	  case statistic_decl::hdr:
+	    prefix = prefix + "KEY_HIST_TYPE, HIST_HDR, "
+	      + lex_cast(sdecl().hdr_bits) + ", ";
+	    break;
+
+	  case statistic_decl::quantile:
+	    prefix = prefix + "KEY_HIST_TYPE, HIST_HDR, STP_QUANTILE_BITS, ";
+	    break;
+
+	  case statistic_decl::distinct:
+	    prefix = prefix + "KEY_HIST_TYPE, HIST_HLL, STP_DISTINCT_BITS, ";
+	    break;
 	  }
       }
 
@@ -1327,10 +1439,99 @@ c_unparser::emit_compiled_printf_locals ()
   o->newline() << "#endif // STP_LEGACY_PRINT";
 }
 
+// Formats whose arguments can all be recorded by value get binary
+// records.  %m and %M read memory at print time, so those stay text.
+static bool
+binary_printf_p (const vector<print_format::format_component>& components)
+{
+  for (auto c = components.begin(); c != components.end(); ++c)
+    if (c->type == print_format::conv_memory
+        || c->type == print_format::conv_memory_hex)
+      return false;
+  return true;
+}
+
+
+// The format string as stap-decode will parse it: like the normalized
+// format, but with literal text that is only %-escaped.
+static string
+binary_printf_schema (const vector<print_format::format_component>& components)
+{
+  string schema;
+  for (auto c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        {
+          for (auto j = c->literal_string.begin(); j != c->literal_string.end(); ++j)
+            {
+              if (*j == '%')
+                schema += '%';
+              schema += *j;
+            }
+        }
+      else
+        schema += print_format::components_to_string (vector<print_format::format_component> (1, *c));
+    }
+  return schema;
+}
+
+
+// Formats whose conversions all take no width or precision, and have
+// a fast path in runtime/vsprintf.c, get it.  stap < 1.3's %p has its
+// own padding, so that one doesn't.
+static bool
+fast_printf_p (const vector<print_format::format_component>& components,
+               bool old_pointers)
+{
+  for (auto c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        continue;
+      if (c->widthtype != print_format::width_unspecified
+          || c->prectype != print_format::prec_unspecified)
+        return false;
+
+      switch (c->type)
+        {
+        case print_format::conv_pointer:
+          if (old_pointers)
+            return false;
+          /* Fallthrough */
+        case print_format::conv_number:
+          if (c->base == 10)
+            {
+              if (c->flags & ~print_format::fmt_flag_sign)
+                return false;
+            }
+          else if (c->base == 16)
+            {
+              if (c->flags & ~(print_format::fmt_flag_special
+                               | print_format::fmt_flag_large))
+                return false;
+            }
+          else
+            return false;
+          break;
+
+        case print_format::conv_string:
+        case print_format::conv_char:
+          if (c->flags)
+            return false;
+          break;
+
+        default:
+          return false;
+        }
+    }
+  return true;
+}
+
+
 void
 c_unparser::emit_compiled_printfs ()
 {
   o->newline() << "#ifndef STP_LEGACY_PRINT";
+  vector<string> binary_formats;
   map<pair<bool, string>, string>::iterator it;
   for (it = compiled_printfs.begin(); it != compiled_printfs.end(); ++it)
     {
@@ -1342,6 +1543,14 @@ c_unparser::emit_compiled_printfs ()
 
       o->newline();
 
+      if (print_to_stream && session->binary_output
+          && binary_printf_p (components))
+        {
+          emit_binary_printf (name, binary_formats.size(), components);
+          binary_formats.push_back (binary_printf_schema (components));
+          continue;
+        }
+
       // Might be nice to output the format string in a comment, but we'd have
       // to be extra careful about format strings not escaping the comment...
       o->newline() << "static void " << name
@@ -1356,13 +1565,21 @@ c_unparser::emit_compiled_printfs ()
       o->newline() << "int num_bytes;";
 
       if (print_to_stream)
+        {
 	  o->newline() << "unsigned long irqflags;";
+	  o->newline() << "void *entry = NULL;";
+        }
 
       o->newline() << "(void) width;";
       o->newline() << "(void) precision;";
       o->newline() << "(void) ptr_value;";
       o->newline() << "(void) num_bytes;";
 
+      if (print_to_stream
+          && fast_printf_p (components,
+                            strverscmp(session->compatible.c_str(), "1.3") < 0))
+        emit_fast_printf (components);
+
       if (print_to_stream)
         {
 	  // Compute the buffer size needed for these arguments.
@@ -1458,7 +1675,7 @@ c_unparser::emit_compiled_printfs ()
 	  o->newline() << "num_bytes = clamp(num_bytes, 0, STP_BUFFER_SIZE);";
 	  o->newline() << "if (!_stp_print_trylock_irqsave(&irqflags))";
 	  o->newline(1) << "return;";
-	  o->newline(-1) << "str = (char*)_stp_reserve_bytes(num_bytes);";
+	  o->newline(-1) << "str = (char*)_stp_reserve_print_bytes(num_bytes, &entry);";
 	  o->newline() << "end = str ? str + num_bytes - 1 : 0;";
         }
       else // !print_to_stream
@@ -1554,7 +1771,7 @@ c_unparser::emit_compiled_printfs ()
 	      o->indent(1);
 	      if (print_to_stream)
                 {
-		  o->newline() << "_stp_unreserve_bytes(num_bytes);";
+		  o->newline() << "_stp_unreserve_print_bytes(num_bytes, entry);";
 	          o->newline() << "goto err_unlock;";
                 }
               else
@@ -1584,6 +1801,8 @@ c_unparser::emit_compiled_printfs ()
 	  o->newline(1) << "*end = '\\0';";
 	  o->indent(-1);
 	}
+      else
+	o->newline() << "_stp_commit_print_bytes(entry);";
 
       o->newline(-1) << "}";
 
@@ -1594,10 +1813,184 @@ c_unparser::emit_compiled_printfs ()
         }
       o->newline(-1) << "}";
     }
+
+  if (session->binary_output)
+    {
+      // The format of each binary record id, for stap-decode.
+      o->newline();
+      if (!binary_formats.empty())
+        {
+          o->newline() << "static const char * const stp_printf_schema[] = {";
+          o->indent(1);
+          for (unsigned i = 0; i < binary_formats.size(); ++i)
+            o->newline() << lex_cast_qstring (binary_formats[i]) << ",";
+          o->newline(-1) << "};";
+        }
+      o->newline() << "static void stp_print_binary_schema (void) {";
+      if (!binary_formats.empty())
+        o->newline(1) << "_stp_print_binary_schema (stp_printf_schema, "
+                      << binary_formats.size() << ");";
+      else
+        o->newline(1) << "_stp_print_binary_schema (NULL, 0);";
+      o->newline(-1) << "}";
+    }
   o->newline() << "#endif // STP_LEGACY_PRINT";
 }
 
 
+// Emit the fast path of a compiled printf whose format passed
+// fast_printf_p: each argument's exact size is worked out once, the
+// literal text and %c count towards a constant, and the conversions
+// themselves are straight-line copies.  Output that would not fit in
+// STP_BUFFER_SIZE falls through to the general code, for it to
+// truncate the usual way.
+void
+c_unparser::emit_fast_printf (const vector<print_format::format_component>& components)
+{
+  o->newline() << "#ifndef STP_GENERIC_PRINTF";
+  o->newline() << "{";
+  o->indent(1);
+
+  size_t arg_ix = 0;
+  vector<print_format::format_component>::const_iterator c;
+  for (c = components.begin(); c != components.end(); ++c)
+    if (c->type == print_format::conv_string
+        || c->type == print_format::conv_number
+        || c->type == print_format::conv_pointer)
+      o->newline() << "int len" << arg_ix++ << ";";
+    else if (c->type != print_format::conv_literal)
+      arg_ix++;
+
+  o->newline() << "num_bytes = 0;";
+  for (c = components.begin(), arg_ix = 0; c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        {
+          literal_string ls(c->literal_string);
+          o->newline() << "num_bytes += sizeof(";
+          visit_literal_string(&ls);
+          o->line() << ") - 1;"; // don't count the '\0'
+          continue;
+        }
+      string ix = lex_cast(arg_ix++);
+      if (c->type == print_format::conv_char)
+        o->newline() << "num_bytes += 1;";
+      else if (c->type == print_format::conv_string)
+        {
+          o->newline() << "if ((unsigned long)l->arg" << ix << " < PAGE_SIZE)";
+          o->newline(1) << "l->arg" << ix << " = \"<NULL>\";";
+          o->newline(-1) << "len" << ix << " = strnlen(l->arg" << ix
+                         << ", STP_BUFFER_SIZE);";
+        }
+      else
+        o->newline() << "len" << ix << " = _stp_fast_number_size(l->arg" << ix
+                     << ", " << c->base << ", " << c->flags << ");";
+      if (c->type != print_format::conv_char)
+        o->newline() << "num_bytes += len" << ix << ";";
+    }
+
+  o->newline() << "if (likely(num_bytes <= STP_BUFFER_SIZE)) {";
+  o->newline(1) << "if (!_stp_print_trylock_irqsave(&irqflags))";
+  o->newline(1) << "return;";
+  o->newline(-1) << "str = (char*)_stp_reserve_print_bytes(num_bytes, &entry);";
+  o->newline() << "if (str) {";
+  o->indent(1);
+  for (c = components.begin(), arg_ix = 0; c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        {
+          literal_string ls(c->literal_string);
+          o->newline() << "{ static const char lit[] = ";
+          visit_literal_string(&ls);
+          o->line() << ";";
+          o->newline(1) << "memcpy(str, lit, sizeof(lit) - 1);";
+          o->newline() << "str += sizeof(lit) - 1; }";
+          o->indent(-1);
+          continue;
+        }
+      string ix = lex_cast(arg_ix++);
+      if (c->type == print_format::conv_char)
+        o->newline() << "*str++ = l->arg" << ix << ";";
+      else if (c->type == print_format::conv_string)
+        {
+          o->newline() << "memcpy(str, l->arg" << ix << ", len" << ix << ");";
+          o->newline() << "str += len" << ix << ";";
+        }
+      else
+        o->newline() << "str = _stp_fast_number(str, l->arg" << ix
+                     << ", len" << ix << ", " << c->base << ", "
+                     << c->flags << ");";
+    }
+  o->newline() << "_stp_commit_print_bytes(entry);";
+  o->newline(-1) << "}";
+  o->newline() << "_stp_print_unlock_irqrestore(&irqflags);";
+  o->newline() << "return;";
+  o->newline(-1) << "}";
+  o->newline(-1) << "}";
+  o->newline() << "#endif";
+}
+
+
+// Emit a compiled printf that writes a binary record: the format's
+// schema id followed by the raw argument values, leaving all the
+// formatting to stap-decode.
+void
+c_unparser::emit_binary_printf (const string& name, unsigned id,
+                                const vector<print_format::format_component>& components)
+{
+  o->newline() << "static void " << name
+               << " (struct context* __restrict__ c) {";
+  o->newline(1) << "struct " << name << "_locals * __restrict__ l = "
+                << "& c->printf_locals." << name << ";";
+  o->newline() << "char *str;";
+  o->newline() << "int num_bytes = STP_BINARY_RECORD_HDR_SIZE;";
+  o->newline() << "unsigned long irqflags;";
+  o->newline() << "void *entry = NULL;";
+
+  // Collect each argument, with the length of the string ones.
+  vector<pair<string, bool> > args;
+  size_t arg_ix = 0;
+  for (auto c = components.begin(); c != components.end(); ++c)
+    {
+      if (c->type == print_format::conv_literal)
+        continue;
+      if (c->widthtype == print_format::width_dynamic)
+        args.push_back (make_pair ("l->arg" + lex_cast(arg_ix++), false));
+      if (c->prectype == print_format::prec_dynamic)
+        args.push_back (make_pair ("l->arg" + lex_cast(arg_ix++), false));
+      args.push_back (make_pair ("l->arg" + lex_cast(arg_ix++),
+                                 c->type == print_format::conv_string));
+    }
+
+  for (unsigned i = 0; i < args.size(); ++i)
+    if (args[i].second)
+      {
+        o->newline() << "uint32_t len" << i << " = strnlen("
+                     << args[i].first << ", MAXSTRINGLEN);";
+        o->newline() << "num_bytes += sizeof(uint32_t) + len" << i << ";";
+      }
+    else
+      o->newline() << "num_bytes += sizeof(int64_t);";
+
+  o->newline() << "if (!_stp_print_trylock_irqsave(&irqflags))";
+  o->newline(1) << "return;";
+  o->newline(-1) << "str = (char*)_stp_reserve_print_bytes(num_bytes, &entry);";
+  o->newline() << "if (str) {";
+  o->newline(1) << "str = _stp_binary_record_hdr(str, " << id << ", num_bytes);";
+  for (unsigned i = 0; i < args.size(); ++i)
+    if (args[i].second)
+      o->newline() << "str = _stp_binary_record_string(str, "
+                   << args[i].first << ", len" << i << ");";
+    else
+      o->newline() << "str = _stp_binary_record_int64(str, "
+                   << args[i].first << ");";
+  o->newline() << "_stp_commit_print_bytes(entry);";
+  o->newline(-1) << "}";
+  o->newline() << "_stp_print_unlock_irqrestore(&irqflags);";
+  o->newline(-1) << "}";
+}
+
+
 void
 c_unparser::emit_global_param (vardecl *v)
 {
@@ -1711,6 +2104,12 @@ c_unparser::emit_global (vardecl *v)
   else
     o->newline() << type << " " << vn << ";";
 
+  if (snapshot_maps.count (v))
+    {
+      o->newline() << type << " snap_" << vn << ";";
+      o->newline() << "atomic_t snap_" << vn << "_busy;";
+    }
+
   o->newline() << "stp_rwlock_t " << vn << "_lock;";
   o->newline() << "#ifdef STP_TIMING";
   o->newline() << "atomic_t " << vn << "_lock_skip_count;";
@@ -2006,6 +2405,8 @@ c_unparser::emit_module_init ()
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
+      if (snapshot_maps.count (v))
+	o->newline() << getmap (v).snapshot().init();
       if (v->index_types.size() > 0)
 	o->newline() << getmap (v).init();
       else if (session->runtime_usermode_p() && v->arity == 0
@@ -2028,6 +2429,17 @@ c_unparser::emit_module_init ()
       o->newline() << "#endif";
     }
 
+  for (unsigned i=0; i<defer_queues.size(); i++)
+    {
+      string name = defer_queues[i]->name();
+      o->newline() << "rc = stp_defer_init (&" << name << "_defer, "
+                   << "sizeof (struct " << name << "_locals));";
+      o->newline() << "if (rc) {";
+      o->newline(1) << "_stp_error (\"couldn't allocate the update queue of " << name << "\");";
+      o->newline() << "goto out;";
+      o->newline(-1) << "}";
+    }
+
   // Print a message to the kernel log about this module.  This is
   // intended to help debug problems with systemtap modules.
   if (! session->runtime_usermode_p())
@@ -2054,6 +2466,47 @@ c_unparser::emit_module_init ()
       o->newline() << "#else";
       o->newline() << "INIT_WORK(&module_refresher_work, module_refresher);";
       o->newline() << "#endif";
+
+      o->newline() << "#ifdef STP_PROBE_COUNTS";
+      o->newline() << "rc = _stp_probe_throttle_init();";
+      o->newline() << "if (rc) {";
+      o->newline(1) << "_stp_error (\"couldn't allocate the probe counters\");";
+      o->newline() << "goto out;";
+      o->newline(-1) << "}";
+      o->newline() << "#endif";
+
+      o->newline() << "#ifdef STP_OUTPUT_RATE";
+      o->newline() << "rc = _stp_output_limit_init();";
+      o->newline() << "if (rc) {";
+      o->newline(1) << "_stp_error (\"couldn't allocate the output rate limits\");";
+      o->newline() << "goto out;";
+      o->newline(-1) << "}";
+      o->newline() << "#endif";
+
+      o->newline() << "#ifdef STP_COVERAGE";
+      o->newline() << "rc = _stp_coverage_init();";
+      o->newline() << "if (rc) {";
+      o->newline(1) << "_stp_error (\"couldn't allocate the coverage counters\");";
+      o->newline() << "goto out;";
+      o->newline(-1) << "}";
+      o->newline() << "#endif";
+    }
+
+  // Maps may grow from the begin probes on.
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef MAP_GROWABLE";
+      o->newline() << "_stp_map_grow_start();";
+      o->newline() << "#endif";
+    }
+
+  // Binary printf records are meaningless without their schema, so
+  // it has to go out ahead of anything begin probes print.
+  if (session->binary_output)
+    {
+      o->newline() << "#ifndef STP_LEGACY_PRINT";
+      o->newline() << "stp_print_binary_schema();";
+      o->newline() << "#endif";
     }
 
   // Run all probe registrations.  This actually runs begin probes.
@@ -2147,14 +2600,24 @@ c_unparser::emit_module_init ()
 
   // If any registrations failed, we will need to deregister the globals,
   // as this is our only chance.
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef MAP_GROWABLE";
+      o->newline() << "_stp_map_grow_stop();";
+      o->newline() << "#endif";
+    }
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
+      if (snapshot_maps.count (v))
+	o->newline() << getmap (v).snapshot().fini();
       if (v->index_types.size() > 0)
 	o->newline() << getmap (v).fini();
       else
 	o->newline() << getvar (v).fini();
     }
+  for (unsigned i=0; i<defer_queues.size(); i++)
+    o->newline() << "stp_defer_free (&" << defer_queues[i]->name() << "_defer);";
 
   // For any partially registered/unregistered kernel facilities.
   o->newline() << "atomic_set (session_state(), STAP_SESSION_STOPPED);";
@@ -2165,6 +2628,19 @@ c_unparser::emit_module_init ()
   o->newline() << " stp_tracepoint_exit();";
   o->newline() << "#endif";
 
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef STP_PROBE_COUNTS";
+      o->newline() << " _stp_probe_throttle_exit();";
+      o->newline() << "#endif";
+      o->newline() << "#ifdef STP_OUTPUT_RATE";
+      o->newline() << " _stp_output_limit_exit();";
+      o->newline() << "#endif";
+      o->newline() << "#ifdef STP_COVERAGE";
+      o->newline() << " _stp_coverage_exit();";
+      o->newline() << "#endif";
+    }
+
   // In case gettimeofday was started, it needs to be stopped
   o->newline() << "#ifdef STAP_NEED_GETTIMEOFDAY";
   o->newline() << " _stp_kill_time();";  // An error is no cause to hurry...
@@ -2273,6 +2749,12 @@ c_unparser::emit_module_exit ()
       o->newline() << "#ifdef STP_ON_THE_FLY_TIMER_ENABLE";
       o->newline() << "hrtimer_cancel(&module_refresh_timer);";
       o->newline() << "#endif";
+      o->newline() << "#ifdef STP_PROBE_COUNTS";
+      o->newline() << "_stp_probe_throttle_stop();";
+      o->newline() << "#endif";
+      o->newline() << "#ifdef STP_OUTPUT_RATE";
+      o->newline() << "_stp_output_limit_stop();";
+      o->newline() << "#endif";
     }
 
   // cargo cult prologue ... hope to flush any pending workqueue items too
@@ -2305,6 +2787,15 @@ c_unparser::emit_module_exit ()
   // user context, say during module unload.  Among other things, this
   // means we can sleep a while.
   o->newline() << "_stp_runtime_context_wait();";
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef STP_PROBE_COUNTS";
+      o->newline() << "_stp_probe_throttle_exit();";
+      o->newline() << "#endif";
+      o->newline() << "#ifdef STP_OUTPUT_RATE";
+      o->newline() << "_stp_output_limit_exit();";
+      o->newline() << "#endif";
+    }
 
   // cargo cult epilogue
   o->newline() << "atomic_set (session_state(), STAP_SESSION_STOPPED);";
@@ -2313,14 +2804,27 @@ c_unparser::emit_module_exit ()
   // XXX: might like to have an escape hatch, in case some probe is
   // genuinely stuck somehow
 
+  // The arrays are reported on before they go.
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef MAP_GROWABLE";
+      o->newline() << "_stp_map_grow_stop();";
+      o->newline() << "#endif";
+      emit_map_report ();
+    }
+
   for (unsigned i=0; i<session->globals.size(); i++)
     {
       vardecl* v = session->globals[i];
+      if (snapshot_maps.count (v))
+	o->newline() << getmap (v).snapshot().fini();
       if (v->index_types.size() > 0)
 	o->newline() << getmap (v).fini();
       else
 	o->newline() << getvar (v).fini();
     }
+  for (unsigned i=0; i<defer_queues.size(); i++)
+    o->newline() << "stp_defer_free (&" << defer_queues[i]->name() << "_defer);";
 
   // We're finished with the contexts if we're not in dyninst
   // mode. The dyninst mode needs the contexts, since print buffers
@@ -2397,9 +2901,29 @@ c_unparser::emit_module_exit ()
       o->newline() << "#endif"; // STP_TIMING
     }
 
+  if (!branch_ids.empty())
+    {
+      o->newline() << "_stp_printf(\"----- branch report:\\n\");";
+      o->newline() << "for (i = 0; i < ARRAY_SIZE(stp_branch_locations); ++i) {";
+      o->newline(1) << "int taken = atomic_read (&stp_branch_counts[i][1]);";
+      o->newline() << "int not_taken = atomic_read (&stp_branch_counts[i][0]);";
+      o->newline() << "if (taken || not_taken)";
+      o->newline(1) << "_stp_printf (\"%s, taken: %d, not taken: %d\\n\",";
+      o->newline(2) << "stp_branch_locations[i], taken, not_taken);";
+      o->newline(-3) << "}";
+    }
+
   o->newline() << "_stp_print_flush();";
   o->newline() << "#endif";
 
+  // print the probe and function hits for stap -q
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef STP_COVERAGE";
+      o->newline() << "_stp_coverage_report();";
+      o->newline() << "#endif";
+    }
+
   //print lock contentions if non-zero
   o->newline() << "#ifdef STP_TIMING";
   o->newline() << "{";
@@ -2413,6 +2937,9 @@ c_unparser::emit_module_exit ()
 	           << lex_cast_qstring(orig_vn) << ", ctr);";
     }
   o->newline(-1) << "}";
+  o->newline() << "#if defined(STP_USE_DWARF_UNWINDER) && STP_UNWIND_CACHE_SIZE > 0";
+  o->newline() << "_stp_unwind_cache_report();";
+  o->newline() << "#endif";
   o->newline() << "_stp_print_flush();";
   o->newline () << "#endif";
 
@@ -2451,6 +2978,13 @@ c_unparser::emit_module_exit ()
   // NB: PR13386 needs to restore preemption-blocking counts
   o->newline() << "preempt_enable_no_resched();";
 
+  if (!session->runtime_usermode_p())
+    {
+      o->newline() << "#ifdef STP_COVERAGE";
+      o->newline() << "_stp_coverage_exit();";
+      o->newline() << "#endif";
+    }
+
   // In dyninst mode, now we're done with the contexts, transport, everything!
   if (session->runtime_usermode_p())
     {
@@ -2462,62 +2996,344 @@ c_unparser::emit_module_exit ()
   o->newline(-1) << "}\n";
 }
 
-struct max_action_info: public functioncall_traversing_visitor
-{
-  max_action_info(systemtap_session& s): sess(s), statement_count(0) {}
-
-  systemtap_session& sess;
-  unsigned statement_count;
-  static const unsigned max_statement_count = ~0;
-
-  void add_stmt_count (unsigned val)
-    {
-      statement_count = (statement_count > max_statement_count - val) ? max_statement_count : statement_count + val;
-    }
-  void add_max_stmt_count () { statement_count = max_statement_count; }
-  bool statement_count_finite() { return statement_count < max_statement_count; }
 
-  void visit_for_loop (for_loop*) { add_max_stmt_count(); }
-  void visit_foreach_loop (foreach_loop*) { add_max_stmt_count(); }
-  void visit_expr_statement (expr_statement *stmt)
-    {
-      add_stmt_count(1);
-      traversing_visitor::visit_expr_statement(stmt); // which will trigger visit_functioncall, if applicable
-    }
-  void visit_if_statement (if_statement *stmt)
+// The globals' part of the stats file of runtime/linux/session_stats.c:
+// how full each array is, and under STP_TIMING, how often its lock was
+// contended or timed out.
+void
+c_unparser::emit_global_stats ()
+{
+  o->newline() << "static void _stp_global_stats (struct seq_file *m) {";
+  o->indent(1);
+  for (unsigned i=0; i<session->globals.size(); i++)
     {
-      add_stmt_count(1);
-      stmt->condition->visit(this);
-
-      // Create new visitors for the two forks.  Copy the nested[] set
-      // to prevent infinite recursion for a   function f () { if (a) f() }
-      max_action_info tmp_visitor_then (*this);
-      max_action_info tmp_visitor_else (*this);
-      stmt->thenblock->visit(& tmp_visitor_then);
-      if (stmt->elseblock)
+      vardecl* v = session->globals[i];
+      string name = lex_cast_qstring (v->unmangled_name);
+      string vn = c_globalname (v->name);
+      if (v->index_types.size() > 0)
         {
-          stmt->elseblock->visit(& tmp_visitor_else);
+          mapvar mv = getmap (v);
+          o->newline() << "seq_printf (m, \"global %s entries: %u/%u\\n\", " << name << ", ";
+          if (mv.is_parallel())
+            o->line() << "(unsigned) _stp_pmap_fullest (" << mv.value() << "), "
+                      << mv.fetch_existing_aggregate() << "->maxnum);";
+          else
+            o->line() << "_stp_map_size (" << mv.value() << "), "
+                      << mv.value() << "->maxnum);";
         }
-
-      // Simply overwrite our copy of statement_count, since these
-      // visitor copies already included our starting count.
-      statement_count = max(tmp_visitor_then.statement_count, tmp_visitor_else.statement_count);
+      o->newline() << "#ifdef STP_TIMING";
+      o->newline() << "seq_printf (m, \"global %s contended: %d skipped: %d\\n\", " << name << ", ";
+      o->newline(1) << "atomic_read (global_contended(" << vn << ")), "
+                    << "atomic_read (global_skipped(" << vn << ")));";
+      o->indent(-1);
+      o->newline() << "#endif";
     }
+  o->newline() << "(void) m;";
+  o->newline(-1) << "}\n";
+}
 
-  void note_recursive_functioncall (functioncall *) { add_max_stmt_count(); }
-
-  void visit_null_statement (null_statement *) { add_stmt_count(1); }
-  void visit_return_statement (return_statement *) { add_stmt_count(1); }
-  void visit_delete_statement (delete_statement *) { add_stmt_count(1); }
-  void visit_next_statement (next_statement *) { add_stmt_count(1); }
-  void visit_break_statement (break_statement *) { add_stmt_count(1); }
-  void visit_continue_statement (continue_statement *) { add_stmt_count(1); }
-};
 
+// The refill of runtime/linux/map_grow.c: the per-cpu maps of every
+// statistics array, and of the spare its snapshots swap in, may grow.
 void
-c_tmpcounter::emit_function (functiondecl* fd)
+c_unparser::emit_map_refill ()
 {
-  this->current_probe = 0;
+  o->newline() << "#ifdef MAP_GROWABLE";
+  o->newline() << "static void _stp_map_refill_all (void) {";
+  o->indent(1);
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (v->index_types.size() == 0)
+        continue;
+      mapvar mv = getmap (v);
+      if (!mv.is_parallel())
+        continue;
+      o->newline() << "_stp_pmap_refill (" << mv.value() << ");";
+      if (snapshot_maps.count (v))
+        o->newline() << "_stp_pmap_refill (" << mv.snapshot().value() << ");";
+    }
+  o->newline(-1) << "}";
+  o->newline() << "#endif\n";
+}
+
+
+// The most entries each array held at once, for sizing its limit in
+// the next run, under -t or -DSTP_MAP_GROW, and with the latter, how
+// often an array that grows was full before its limit.
+void
+c_unparser::emit_map_report ()
+{
+  bool any = false;
+  for (unsigned i=0; i<session->globals.size() && !any; i++)
+    any = session->globals[i]->index_types.size() > 0;
+  if (!any)
+    return;
+
+  o->newline() << "#if defined(STP_TIMING) || defined(MAP_GROWABLE)";
+  o->newline() << "preempt_disable();"; // see PR13386 below
+  o->newline() << "_stp_printf(\"----- array report:\\n\");";
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (v->index_types.size() == 0)
+        continue;
+      mapvar mv = getmap (v);
+      string name = lex_cast_qstring (v->unmangled_name);
+      bool snap = snapshot_maps.count (v);
+      string hwm, snap_hwm, maxnum;
+      if (mv.is_parallel())
+        {
+          hwm = "_stp_pmap_hwm (" + mv.value() + ")";
+          snap_hwm = snap ? "_stp_pmap_hwm (" + mv.snapshot().value() + ")" : "";
+          maxnum = mv.fetch_existing_aggregate() + "->maxnum";
+        }
+      else
+        {
+          hwm = mv.value() + "->hwm";
+          snap_hwm = snap ? mv.snapshot().value() + "->hwm" : "";
+          maxnum = mv.value() + "->maxnum";
+        }
+      if (snap)
+        hwm = "max_t(unsigned, " + hwm + ", " + snap_hwm + ")";
+      o->newline() << "_stp_printf (\"global %s peak entries: %u/%u\\n\", "
+                   << name << ", " << hwm << ", " << maxnum << ");";
+      if (mv.is_parallel())
+        {
+          string misses = "_stp_pmap_grow_misses (" + mv.value() + ")";
+          if (snap)
+            misses += " + _stp_pmap_grow_misses (" + mv.snapshot().value() + ")";
+          o->newline() << "#ifdef MAP_GROWABLE";
+          o->newline() << "{";
+          o->newline(1) << "unsigned misses = " << misses << ";";
+          o->newline() << "if (misses)";
+          o->newline(1) << "_stp_printf (\"global %s full while growing: %u\\n\", "
+                        << name << ", misses);";
+          o->newline(-2) << "}";
+          o->newline() << "#endif";
+        }
+    }
+  o->newline() << "_stp_print_flush();";
+  o->newline() << "preempt_enable_no_resched();";
+  o->newline() << "#endif";
+}
+
+
+// The globals' part of the state file of runtime/linux/handoff.c, for
+// --handoff: the export writes one line per scalar or array element,
+// and the import sets one from such a line, if this script has a global
+// of that name and type.
+void
+c_unparser::emit_handoff ()
+{
+  vector<vardecl*> vars;
+  for (unsigned i=0; i<session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (v->synthetic || v->name == "__global___handoff_enabled")
+        continue;
+      // XXX: statistics would need their per-cpu data merged into the
+      // next module's; for now they are only listed, as not carried over.
+      if (v->type == pe_stats)
+        session->print_warning (_F("statistic '%s' is not carried over by --handoff",
+                                   v->unmangled_name.to_string().c_str()), v->tok);
+      vars.push_back (v);
+    }
+
+  // The state file may be read while the probes run, not only while
+  // they are frozen.  Walking an array needs its lock exclusively, as
+  // single-key writers of striped arrays add and remove nodes under
+  // the shared lock.  IRQs are left on while a large array is
+  // formatted: a probe from an interrupt only tries the lock, and is
+  // skipped if it doesn't get it in time.
+  o->newline() << "static void _stp_handoff_export (struct seq_file *m) {";
+  o->newline(1) << "struct map_node *n;";
+  for (unsigned i=0; i<vars.size(); i++)
+    {
+      vardecl* v = vars[i];
+      string name = lex_cast_qstring (v->name);
+      string vn = c_globalname (v->name);
+
+      if (v->type == pe_stats)
+        {
+          o->newline() << "seq_printf (m, \"%s x\\n\", " << name << ");";
+          continue;
+        }
+
+      o->newline() << "stp_write_lock (global_lock(" << vn << "));";
+      if (v->arity == 0)
+        {
+          o->newline() << "seq_printf (m, \"%s " << (v->type == pe_long ? "i" : "s")
+                       << "\", " << name << ");";
+          if (v->type == pe_long)
+            o->newline() << "_stp_handoff_put_int (m, global(" << vn << "));";
+          else
+            o->newline() << "_stp_handoff_put_str (m, global(" << vn << "));";
+          o->newline() << "seq_putc (m, '\\n');";
+        }
+      else
+        {
+          mapvar mv = getmap (v);
+          o->newline() << "for (n = _stp_map_start (" << mv.value() << "); n; "
+                       << "n = _stp_map_iter (" << mv.value() << ", n)) {";
+          o->newline(1) << "seq_printf (m, \"%s " << mv.keysym() << "\", " << name << ");";
+          for (unsigned k=0; k<mv.index_types.size(); k++)
+            if (mv.index_types[k] == pe_long)
+              o->newline() << "_stp_handoff_put_int (m, "
+                           << mv.function_keysym("key_get_int64") << " (n, " << k+1 << "));";
+            else
+              o->newline() << "_stp_handoff_put_str (m, "
+                           << mv.function_keysym("key_get_str") << " (n, " << k+1 << "));";
+          if (v->type == pe_long)
+            o->newline() << "_stp_handoff_put_int (m, "
+                         << mv.function_keysym("get_int64") << " (n));";
+          else
+            o->newline() << "_stp_handoff_put_str (m, "
+                         << mv.function_keysym("get_str") << " (n));";
+          o->newline() << "seq_putc (m, '\\n');";
+          o->newline(-1) << "}";
+        }
+      o->newline() << "stp_write_unlock (global_lock(" << vn << "));";
+    }
+  o->newline() << "(void) n;";
+  o->newline(-1) << "}\n";
+
+  o->newline() << "static int _stp_handoff_import (char *line) {";
+  o->newline(1) << "unsigned long flags;";
+  o->newline() << "char *name = _stp_handoff_word (&line);";
+  o->newline() << "char *sig = name ? _stp_handoff_word (&line) : NULL;";
+  o->newline() << "int rc = 0;";
+  o->newline() << "if (sig == NULL) return -EBADMSG;";
+  for (unsigned i=0; i<vars.size(); i++)
+    {
+      vardecl* v = vars[i];
+      string name = lex_cast_qstring (v->name);
+      if (v->type == pe_stats)
+        {
+          o->newline() << "if (strcmp (name, " << name << ") == 0) return -EOPNOTSUPP;";
+          continue;
+        }
+
+      string vn = c_globalname (v->name);
+      vector<exp_type> types;
+      string sig;
+      if (v->arity == 0)
+        sig = (v->type == pe_long) ? "i" : "s";
+      else
+        {
+          mapvar mv = getmap (v);
+          types = mv.index_types;
+          sig = mv.keysym ();
+        }
+      types.push_back (v->type);
+
+      o->newline() << "if (strcmp (name, " << name << ") == 0) {";
+      o->newline(1) << "if (strcmp (sig, \"" << sig << "\") != 0) return -EINVAL;";
+
+      // Parse the keys and the value, the last of the types.
+      vector<string> vals;
+      for (unsigned k=0; k<types.size(); k++)
+        {
+          if (types[k] == pe_long)
+            {
+              o->newline() << "rc = rc ?: _stp_handoff_get_int (&line, &_stp_handoff_ints[" << k << "]);";
+              vals.push_back ("_stp_handoff_ints[" + lex_cast(k) + "]");
+            }
+          else
+            {
+              o->newline() << "rc = rc ?: _stp_handoff_get_str (&line, _stp_handoff_strs[" << k << "]);";
+              vals.push_back ("_stp_handoff_strs[" + lex_cast(k) + "]");
+            }
+        }
+      o->newline() << "if (rc || *line) return -EBADMSG;";
+
+      o->newline() << "stp_write_lock_irqsave (global_lock(" << vn << "), flags);";
+      if (v->arity == 0)
+        {
+          if (v->type == pe_long)
+            o->newline() << "global_set(" << vn << ", " << vals[0] << ");";
+          else
+            o->newline() << "strlcpy (global(" << vn << "), " << vals[0] << ", MAXSTRINGLEN);";
+        }
+      else
+        {
+          mapvar mv = getmap (v);
+          o->newline() << "rc = " << mv.function_keysym("set") << " (" << mv.value();
+          for (unsigned k=0; k<vals.size(); k++)
+            {
+              // impedance matching: empty string values -> NULL
+              if (k == vals.size() - 1 && v->type == pe_string)
+                o->line() << ", (" << vals[k] << "[0] ? " << vals[k] << " : NULL)";
+              else
+                o->line() << ", " << vals[k];
+            }
+          o->line() << ") ? -ENOSPC : 0;";
+        }
+      o->newline() << "stp_write_unlock_irqrestore (global_lock(" << vn << "), flags);";
+      o->newline() << "return rc;";
+      o->newline(-1) << "}";
+    }
+  o->newline() << "(void) flags; (void) rc;";
+  o->newline() << "return -ENOENT;";
+  o->newline(-1) << "}\n";
+}
+
+struct max_action_info: public functioncall_traversing_visitor
+{
+  max_action_info(systemtap_session& s): sess(s), statement_count(0) {}
+
+  systemtap_session& sess;
+  unsigned statement_count;
+  static const unsigned max_statement_count = ~0;
+
+  void add_stmt_count (unsigned val)
+    {
+      statement_count = (statement_count > max_statement_count - val) ? max_statement_count : statement_count + val;
+    }
+  void add_max_stmt_count () { statement_count = max_statement_count; }
+  bool statement_count_finite() { return statement_count < max_statement_count; }
+
+  void visit_for_loop (for_loop*) { add_max_stmt_count(); }
+  void visit_foreach_loop (foreach_loop*) { add_max_stmt_count(); }
+  void visit_expr_statement (expr_statement *stmt)
+    {
+      add_stmt_count(1);
+      traversing_visitor::visit_expr_statement(stmt); // which will trigger visit_functioncall, if applicable
+    }
+  void visit_if_statement (if_statement *stmt)
+    {
+      add_stmt_count(1);
+      stmt->condition->visit(this);
+
+      // Create new visitors for the two forks.  Copy the nested[] set
+      // to prevent infinite recursion for a   function f () { if (a) f() }
+      max_action_info tmp_visitor_then (*this);
+      max_action_info tmp_visitor_else (*this);
+      stmt->thenblock->visit(& tmp_visitor_then);
+      if (stmt->elseblock)
+        {
+          stmt->elseblock->visit(& tmp_visitor_else);
+        }
+
+      // Simply overwrite our copy of statement_count, since these
+      // visitor copies already included our starting count.
+      statement_count = max(tmp_visitor_then.statement_count, tmp_visitor_else.statement_count);
+    }
+
+  void note_recursive_functioncall (functioncall *) { add_max_stmt_count(); }
+
+  void visit_null_statement (null_statement *) { add_stmt_count(1); }
+  void visit_return_statement (return_statement *) { add_stmt_count(1); }
+  void visit_delete_statement (delete_statement *) { add_stmt_count(1); }
+  void visit_next_statement (next_statement *) { add_stmt_count(1); }
+  void visit_break_statement (break_statement *) { add_stmt_count(1); }
+  void visit_continue_statement (continue_statement *) { add_stmt_count(1); }
+};
+
+void
+c_tmpcounter::emit_function (functiondecl* fd)
+{
+  this->current_probe = 0;
   this->current_function = fd;
   this->tmpvar_counter = 0;
   this->action_counter = 0;
@@ -2673,6 +3489,19 @@ c_unparser::emit_function (functiondecl* v)
   o->newline(1) << "c->nesting ++;";
   o->newline(-1) << "}";
 
+  // count the call for stap -q, by the function's place in s.functions
+  if (!session->runtime_usermode_p())
+    {
+      map<string,functiondecl*>::iterator it = session->functions.find (v->name);
+      if (it != session->functions.end() && it->second == v)
+        {
+          o->newline() << "#ifdef STP_COVERAGE";
+          o->newline() << "_stp_coverage_hit (STP_PROBE_COUNT + "
+                       << distance (session->functions.begin(), it) << ");";
+          o->newline() << "#endif";
+        }
+    }
+
   // initialize runtime overloading flag
   o->newline() << "c->next = 0;";
   o->newline() << "#define STAP_NEXT do { c->next = 1; goto out; } while(0)";
@@ -2873,7 +3702,15 @@ c_unparser::emit_probe (derived_probe* v)
   else // This probe is unique.  Remember it and output it.
     {
       o->newline();
-      o->newline() << "static void " << v->name() << " (struct context * __restrict__ c) ";
+      if (deferred_probes.count (v))
+        {
+          o->newline() << "static struct stp_defer_queue " << v->name() << "_defer;";
+          defer_queues.push_back (v);
+        }
+      o->newline() << "static "
+                   << (hot_probes.count (v) ? "__attribute__ ((hot)) "
+                       : cold_probes.count (v) ? "__attribute__ ((cold)) " : "")
+                   << "void " << v->name() << " (struct context * __restrict__ c) ";
       o->line () << "{";
       o->indent (1);
 
@@ -2918,8 +3755,25 @@ c_unparser::emit_probe (derived_probe* v)
       // initialize frame pointer
       o->newline() << "struct " << v->name() << "_locals * __restrict__ l = "
                    << "& c->probe_locals." << v->name() << ";";
+      if (deferred_probes.count (v))
+        o->newline() << "unsigned stp_defer_replays = 0;";
       o->newline() << "(void) l;"; // make sure "l" is marked used
 
+      // A queue of updates only drains as the probe runs again, so
+      // begin/end/error probes first replay whatever is left, with
+      // c->locked == 3 making each handler pop one and take its locks.
+      if (deferred_probes.count (v))
+        {
+          o->newline() << "if (unlikely (c->locked == 3)) {";
+          o->newline(1) << "c->locked = 0;";
+          o->newline() << "if (!stp_defer_pop(&" << v->name() << "_defer, l))";
+          o->newline(1) << "goto out;";
+          o->newline(-1) << "goto stp_defer_lock;";
+          o->newline(-1) << "}";
+        }
+      else if (!v->needs_global_locks () && !deferred_probes.empty())
+        o->newline() << "stp_defer_drain (c);";
+
       // Emit runtime safety net for unprivileged mode.
       // NB: In usermode, the system restricts our privilege for us.
       if (!session->runtime_usermode_p())
@@ -3010,6 +3864,33 @@ c_unparser::emit_probe (derived_probe* v)
       if (v->needs_global_locks ())
 	emit_unlock ();
 
+      // A snapshot still held here was taken by a loop that didn't get
+      // to its delete, after an error or a next.  Its entries go back
+      // into the array, where those written since stay.
+      for (auto it = probe_snapshots.begin(); it != probe_snapshots.end(); ++it)
+        {
+          mapvar live = getmap (*it);
+          mapvar snap = live.snapshot ();
+          o->newline() << "if (c->snapshot_busy == &global(" << snap.c_name()
+                       << "_busy)) {";
+          o->newline(1) << "if (stp_snapshot_lock(global_lock(" << live.c_name()
+                        << "))) {";
+          o->newline(1) << "unsigned lost = " << live.function_keysym("merge")
+                        << " (" << live << ", " << snap << ");";
+          o->newline() << "stp_write_unlock(global_lock(" << live.c_name() << "));";
+          o->newline() << "if (unlikely(lost))";
+          o->newline(1) << "_stp_warn(\"%u entries of " << (*it)->unmangled_name
+                        << " dropped, the array is full\", lost);";
+          o->newline(-2) << "} else";
+          o->newline(1) << "_stp_warn(\"entries of " << (*it)->unmangled_name
+                        << " dropped, its lock is busy\");";
+          o->newline(-1) << (snap.is_parallel() ? "_stp_pmap_clear" : "_stp_map_clear")
+                         << " (" << snap << ");";
+          o->newline() << "stp_snapshot_release(&c->snapshot_busy);";
+          o->newline(-1) << "}";
+        }
+      probe_snapshots.clear ();
+
       // XXX: do this flush only if the body included a
       // print/printf/etc. routine!
       o->newline() << "_stp_print_flush();";
@@ -3058,10 +3939,486 @@ c_unparser::emit_probe_condition_update(derived_probe* v)
   o->newline(-1) << "}";
 }
 
+// Collects the if statements of probe and function bodies, for -t to
+// count which way each goes.
+struct branch_collecting_visitor: public traversing_visitor
+{
+  vector<if_statement*> branches;
+
+  void visit_if_statement (if_statement *s)
+  {
+    branches.push_back (s);
+    traversing_visitor::visit_if_statement (s);
+  }
+};
+
+
+// Orders probes by their --pgo hits, hottest first.
+struct probe_hits_cmp
+{
+  map<derived_probe*, int64_t>& hits;
+  probe_hits_cmp (map<derived_probe*, int64_t>& h): hits (h) {}
+  bool operator() (derived_probe* a, derived_probe* b) const
+  {
+    return hits[a] > hits[b];
+  }
+};
+
+
+// Sorts the global arrays a probe handler uses into those it only
+// touches one key at a time, by reading, setting, adding to, deleting
+// or testing an element, and those it uses whole.  A handler that both
+// reads and writes elements of an array counts as using it whole too,
+// since it may count on nothing changing in between.
+struct map_key_use_visitor: public functioncall_traversing_visitor
+{
+  set<vardecl*> keyed;
+  set<vardecl*> whole;
+  set<vardecl*> written;
+  set<vardecl*> read;
+  map<vardecl*, unsigned> indexed; // visits of an element
+  map<vardecl*, unsigned> stored; // visits of an element as an lvalue
+  expression* stmt_value = 0; // a value the statement drops
+
+  vardecl* array_of (expression* e);
+  vardecl* note_store (expression* result, expression* lvalue);
+  void visit_expr_statement (expr_statement* s);
+  void visit_arrayindex (arrayindex* e);
+  void visit_assignment (assignment* e);
+  void visit_pre_crement (pre_crement* e);
+  void visit_post_crement (post_crement* e);
+  void visit_delete_statement (delete_statement* s);
+  void visit_foreach_loop (foreach_loop* s);
+
+  bool reads (vardecl* v) const
+  {
+    auto i = indexed.find (v), s = stored.find (v);
+    return read.count (v)
+      || (i != indexed.end() && (s == stored.end() || i->second > s->second));
+  }
+  bool keyed_only (vardecl* v) const
+  {
+    return keyed.count (v) && !whole.count (v)
+      && !(written.count (v) && reads (v));
+  }
+};
+
+vardecl*
+map_key_use_visitor::array_of (expression* e)
+{
+  arrayindex* ai = dynamic_cast<arrayindex*>(e);
+  symbol* array;
+  hist_op* hist;
+  if (!ai)
+    return 0;
+  classify_indexable (ai->base, array, hist);
+  return array ? array->referent : 0;
+}
+
+// Notes a store into lvalue, whose result is read unless the statement
+// drops it.
+vardecl*
+map_key_use_visitor::note_store (expression* result, expression* lvalue)
+{
+  vardecl* v = array_of (lvalue);
+  if (v)
+    {
+      written.insert (v);
+      stored[v]++;
+      if (result != stmt_value)
+        read.insert (v);
+    }
+  return v;
+}
+
+void
+map_key_use_visitor::visit_expr_statement (expr_statement* s)
+{
+  stmt_value = s->value;
+  functioncall_traversing_visitor::visit_expr_statement (s);
+}
+
+void
+map_key_use_visitor::visit_arrayindex (arrayindex* e)
+{
+  if (vardecl* v = array_of (e))
+    {
+      keyed.insert (v);
+      indexed[v]++;
+      // A wildcard index makes it a slice of the array.
+      for (unsigned i = 0; i < e->indexes.size(); i++)
+        if (e->indexes[i] == NULL)
+          whole.insert (v);
+    }
+  functioncall_traversing_visitor::visit_arrayindex (e);
+}
+
+void
+map_key_use_visitor::visit_assignment (assignment* e)
+{
+  vardecl* v = note_store (e, e->left);
+  // Other operators read and then set the element.
+  if (v && e->op != "=" && e->op != "+=" && e->op != "-=")
+    whole.insert (v);
+  functioncall_traversing_visitor::visit_assignment (e);
+}
+
+void
+map_key_use_visitor::visit_pre_crement (pre_crement* e)
+{
+  note_store (e, e->operand);
+  functioncall_traversing_visitor::visit_pre_crement (e);
+}
+
+void
+map_key_use_visitor::visit_post_crement (post_crement* e)
+{
+  note_store (e, e->operand);
+  functioncall_traversing_visitor::visit_post_crement (e);
+}
+
+void
+map_key_use_visitor::visit_delete_statement (delete_statement* s)
+{
+  stmt_value = s->value;
+  note_store (s->value, s->value);
+  symbol* sym = dynamic_cast<symbol*>(s->value);
+  if (sym && sym->referent && sym->referent->arity > 0)
+    whole.insert (sym->referent);
+  functioncall_traversing_visitor::visit_delete_statement (s);
+}
+
+void
+map_key_use_visitor::visit_foreach_loop (foreach_loop* s)
+{
+  symbol* array;
+  hist_op* hist;
+  classify_indexable (s->base, array, hist);
+  if (array && array->referent)
+    whole.insert (array->referent);
+  functioncall_traversing_visitor::visit_foreach_loop (s);
+}
+
+
+// Collects the arrays that some foreach sorts, to give them the arrays
+// that the runtime sorts them with.
+struct sorted_foreach_visitor: public traversing_visitor
+{
+  set<vardecl*> sorted;
+
+  void visit_foreach_loop (foreach_loop* s)
+  {
+    symbol* array;
+    hist_op* hist;
+    classify_indexable (s->base, array, hist);
+    if (s->sort_direction && array && array->referent)
+      sorted.insert (array->referent);
+    traversing_visitor::visit_foreach_loop (s);
+  }
+};
+
+
+// Whether an expression or statement reaches an array only through the
+// element that a foreach over it is visiting, as the c_unparser renders
+// those from the loop's own iterator.
+struct snapshot_use_visitor: public functioncall_traversing_visitor
+{
+  vardecl* array;
+  string loopai;
+  bool other_use;
+
+  snapshot_use_visitor (vardecl* array, const string& loopai)
+    : array (array), loopai (loopai), other_use (false) {}
+
+  void visit_symbol (symbol* e)
+  {
+    if (e->referent == array)
+      other_use = true;
+  }
+
+  void visit_arrayindex (arrayindex* e)
+  {
+    if (lex_cast (*e) == loopai)
+      {
+        for (unsigned i=0; i<e->indexes.size(); i++)
+          if (e->indexes[i])
+            e->indexes[i]->visit (this);
+      }
+    else
+      functioncall_traversing_visitor::visit_arrayindex (e);
+  }
+
+  void visit_array_in (array_in* e)
+  {
+    symbol* a;
+    hist_op* h;
+    classify_indexable (e->operand->base, a, h);
+    if (a && a->referent == array)
+      other_use = true;
+    else
+      functioncall_traversing_visitor::visit_array_in (e);
+  }
+};
+
+
+// Finds the foreach loops over a global array that are followed by a
+// delete of the whole array, as in "foreach (k in a) print (a[k]);
+// delete a", and whose bodies use no global but the elements they
+// visit.  When such a loop ends the locked part of its handler, it
+// swaps the array for an empty spare under the locks, lets go of them,
+// and iterates over the snapshot, which the delete then clears.  A
+// handler that doesn't get to the delete merges the snapshot back into
+// the array at its end.  Writers then wait for the swap, not
+// for the whole loop.
+struct snapshot_foreach_visitor: public traversing_visitor
+{
+  systemtap_session& session;
+  map<foreach_loop*, delete_statement*> loops;
+
+  snapshot_foreach_visitor (systemtap_session& s): session (s) {}
+
+  bool eligible (foreach_loop* s, delete_statement* d);
+  void visit_block (block* b);
+};
+
+bool
+snapshot_foreach_visitor::eligible (foreach_loop* s, delete_statement* d)
+{
+  symbol* array;
+  hist_op* hist;
+  classify_indexable (s->base, array, hist);
+  if (!array || !array->referent
+      || find (session.globals.begin(), session.globals.end(), array->referent)
+         == session.globals.end())
+    return false;
+  vardecl* v = array->referent;
+
+  symbol* deleted = dynamic_cast<symbol*> (d->value);
+  if (!deleted || deleted->referent != v)
+    return false;
+
+  // The loop's value must be the element it visits throughout, as
+  // visit_foreach_loop_value() requires to render it so.
+  set<vardecl*> indexes;
+  for (unsigned i=0; i<s->indexes.size(); i++)
+    indexes.insert (s->indexes[i]->referent);
+  varuse_collecting_visitor vut (session);
+  s->block->visit (&vut);
+  vut.embedded_seen = false;
+  if (!vut.side_effect_free_wrt (indexes))
+    return false;
+
+  if (s->limit)
+    s->limit->visit (&vut);
+  for (unsigned i=0; i<s->array_slice.size(); i++)
+    if (s->array_slice[i])
+      s->array_slice[i]->visit (&vut);
+  for (unsigned i=0; i<session.globals.size(); i++)
+    {
+      vardecl* g = session.globals[i];
+      if (vut.written.count (g) || (g != v && vut.read.count (g)))
+        return false;
+    }
+
+  arrayindex ai;
+  ai.base = s->base;
+  for (unsigned i=0; i<s->indexes.size(); i++)
+    ai.indexes.push_back (s->indexes[i]);
+  snapshot_use_visitor suv (v, lex_cast (ai));
+  s->block->visit (&suv);
+  if (s->limit)
+    s->limit->visit (&suv);
+  for (unsigned i=0; i<s->array_slice.size(); i++)
+    if (s->array_slice[i])
+      s->array_slice[i]->visit (&suv);
+  return !suv.other_use;
+}
+
+void
+snapshot_foreach_visitor::visit_block (block* b)
+{
+  for (unsigned i=0; i+1<b->statements.size(); i++)
+    {
+      foreach_loop* s = dynamic_cast<foreach_loop*> (b->statements[i]);
+      delete_statement* d = dynamic_cast<delete_statement*> (b->statements[i+1]);
+      if (s && d && eligible (s, d))
+        loops[s] = d;
+    }
+  traversing_visitor::visit_block (b);
+}
+
+
+// Whether e may be evaluated ahead of the locks of its handler: it has
+// no side effects and reads no globals.
+static bool
+defer_operand_p (systemtap_session& s, expression* e)
+{
+  varuse_collecting_visitor vut (s);
+  e->visit (&vut);
+  if (!vut.side_effect_free ())
+    return false;
+  for (auto it = vut.read.begin(); it != vut.read.end(); ++it)
+    if (find (s.globals.begin(), s.globals.end(), *it) != s.globals.end())
+      return false;
+  return true;
+}
+
+// Returns the global updated by st, if it only increments, decrements,
+// adds to or subtracts from a long, or adds a value to a statistic,
+// with operands that defer_operand_p.  These all commute, so they can
+// be replayed in any order.
+static vardecl*
+deferrable_update (systemtap_session& s, statement* st)
+{
+  expr_statement* es = dynamic_cast<expr_statement*>(st);
+  if (!es)
+    return 0;
+
+  expression* lvalue = 0;
+  expression* rvalue = 0;
+  bool stat_p = false;
+  if (pre_crement* e = dynamic_cast<pre_crement*>(es->value))
+    lvalue = e->operand;
+  else if (post_crement* e = dynamic_cast<post_crement*>(es->value))
+    lvalue = e->operand;
+  else if (assignment* e = dynamic_cast<assignment*>(es->value))
+    {
+      if (e->op != "+=" && e->op != "-=" && e->op != "<<<")
+        return 0;
+      lvalue = e->left;
+      rvalue = e->right;
+      stat_p = (e->op == "<<<");
+    }
+  if (!lvalue || (rvalue && !defer_operand_p (s, rvalue)))
+    return 0;
+
+  vardecl* v = 0;
+  if (symbol* sym = dynamic_cast<symbol*>(lvalue))
+    v = sym->referent;
+  else if (arrayindex* ai = dynamic_cast<arrayindex*>(lvalue))
+    {
+      symbol* array;
+      hist_op* hist;
+      classify_indexable (ai->base, array, hist);
+      if (!array)
+        return 0;
+      for (unsigned i = 0; i < ai->indexes.size(); i++)
+        if (!ai->indexes[i] || !defer_operand_p (s, ai->indexes[i]))
+          return 0;
+      v = array->referent;
+    }
+  if (!v || v->type != (stat_p ? pe_stats : pe_long)
+      || find (s.globals.begin(), s.globals.end(), v) == s.globals.end())
+    return 0;
+  return v;
+}
+
+// Lets a probe handler that only sets locals and then makes commutative
+// updates of globals queue its updates when its locks are contended,
+// see stp_lock_probe_or_defer().  The operands of the updates are moved
+// into locals set ahead of them, so that a copy of the locals is all a
+// later run of the handler needs to replay them.
+static bool
+defer_probe_updates (systemtap_session& s, derived_probe* p)
+{
+  block* b = dynamic_cast<block*>(p->body);
+  if (!b || !p->needs_global_locks ()
+      || !p->probes_with_affected_conditions.empty())
+    return false;
+
+  // Locals first, then updates.
+  unsigned first_update = b->statements.size();
+  for (unsigned i = 0; i < b->statements.size(); i++)
+    {
+      if (deferrable_update (s, b->statements[i]))
+        {
+          first_update = min (first_update, i);
+          continue;
+        }
+      expr_statement* es = dynamic_cast<expr_statement*>(b->statements[i]);
+      assignment* a = es ? dynamic_cast<assignment*>(es->value) : 0;
+      symbol* sym = a ? dynamic_cast<symbol*>(a->left) : 0;
+      if (i > first_update || !sym || a->op != "=" || !sym->referent
+          || find (s.globals.begin(), s.globals.end(), sym->referent)
+             != s.globals.end()
+          || !defer_operand_p (s, a->right))
+        return false;
+    }
+  if (first_update == b->statements.size())
+    return false;
+
+  vector<statement*> statements (b->statements.begin(),
+                                 b->statements.begin() + first_update);
+  unsigned counter = 0;
+  for (unsigned i = first_update; i < b->statements.size(); i++)
+    {
+      expr_statement* es = static_cast<expr_statement*>(b->statements[i]);
+      vector<expression**> operands;
+      expression* lvalue = es->value;
+      if (pre_crement* e = dynamic_cast<pre_crement*>(es->value))
+        lvalue = e->operand;
+      else if (post_crement* e = dynamic_cast<post_crement*>(es->value))
+        lvalue = e->operand;
+      else if (assignment* e = dynamic_cast<assignment*>(es->value))
+        {
+          lvalue = e->left;
+          operands.push_back (&e->right);
+        }
+      if (arrayindex* ai = dynamic_cast<arrayindex*>(lvalue))
+        for (unsigned j = 0; j < ai->indexes.size(); j++)
+          operands.push_back (&ai->indexes[j]);
+
+      for (unsigned j = 0; j < operands.size(); j++)
+        {
+          expression* e = *operands[j];
+          symbol* sym = dynamic_cast<symbol*>(e);
+          if (dynamic_cast<literal*>(e) || (sym && sym->referent
+                                            && sym->referent->arity == 0))
+            continue;
+
+          vardecl* v = new vardecl;
+          v->unmangled_name = v->name = "__defer_" + lex_cast(counter++);
+          v->tok = e->tok;
+          v->set_arity(0, e->tok);
+          v->type = e->type;
+          v->synthetic = true;
+          p->locals.push_back(v);
+
+          sym = new symbol;
+          sym->name = v->name;
+          sym->tok = e->tok;
+          sym->referent = v;
+          sym->type = e->type;
+
+          assignment* a = new assignment;
+          a->tok = e->tok;
+          a->op = "=";
+          a->left = sym;
+          a->right = e;
+          a->type = e->type;
+          expr_statement* set = new expr_statement;
+          set->tok = e->tok;
+          set->value = a;
+          statements.push_back (set);
+
+          sym = new symbol (*sym);
+          *operands[j] = sym;
+        }
+    }
+  statements.insert (statements.end(), b->statements.begin() + first_update,
+                     b->statements.end());
+  b->statements = statements;
+  return true;
+}
+
+
 void
 c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
 {
   unsigned numvars = 0;
+  map_key_use_visitor mkuv;
+  if (!striped_maps.empty())
+    current_probe->body->visit (&mkuv);
 
   if (session->verbose > 1)
     clog << "probe " << current_probe->session_index << " "
@@ -3106,6 +4463,21 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       if (!written_p && read_p && !write_p)
         continue;
 
+      // Nor "read-mostly" long scalars, whose other writers only write
+      // rarely, like procfs write probes: where longs are 64 bits, the
+      // aligned load of the value can't see half a store.  The writers
+      // still lock it, so they exclude each other.
+      bool lockless_p = read_p && !write_p && lockless_global_p (v);
+
+      // A striped map locks the buckets of each single-key operation
+      // itself, so a handler that only does those shares the map lock.
+      // Then any other use has to exclude them.
+      bool striped_p = striped_maps.count(v) > 0;
+      if (striped_p)
+        write_p = !mkuv.keyed_only (v);
+      if (lockless_p)
+        o->newline() << "#if BITS_PER_LONG < 64";
+
       o->newline() << "{";
       o->newline(1) << ".lock = global_lock(" + c_globalname(v->name) + "),";
       o->newline() << ".write_p = " << (write_p ? 1 : 0) << ",";
@@ -3114,11 +4486,14 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       o->newline() << ".contention = global_contended(" << c_globalname (v->name) << "),";
       o->newline() << "#endif";
       o->newline(-1) << "},";
+      if (lockless_p)
+        o->newline() << "#endif";
 
       numvars ++;
       if (session->verbose > 1)
         clog << " " << v->name << "[" << (read_p ? "r" : "")
-             << (write_p ? "w" : "")  << "]";
+             << (write_p ? "w" : "") << (lockless_p ? ", unlocked on 64-bit" : "")
+             << (striped_p && !write_p ? ", striped" : "") << "]";
     }
 
   o->newline(-1) << "};";
@@ -3141,16 +4516,28 @@ c_unparser::emit_lock()
   if (this->session->verbose > 3)
     clog << "emit lock" << endl;
   
+  // A probe that queues its updates on contention locks and replays
+  // them from here, see emit_probe().
+  bool defer_p = current_probe && deferred_probes.count (current_probe);
+  if (defer_p)
+    o->newline() << "stp_defer_lock: __attribute__((unused));";
+
   // Emit code to lock, if we haven't already done it during this
   // probe handler run.
   o->newline() << "if (c->locked == 0) {";
-  o->newline(1) << "if (!stp_lock_probe(locks, ARRAY_SIZE(locks)))";
+  if (defer_p)
+    o->newline(1) << "if (!stp_lock_probe_or_defer(locks, ARRAY_SIZE(locks), &"
+                  << current_probe->name() << "_defer, l))";
+  else
+    o->newline(1) << "if (!stp_lock_probe(locks, ARRAY_SIZE(locks)))";
   o->newline(1) << "goto out;"; // bypass try/catch etc.
   o->newline(-1) << "else";
   o->newline(1) << "c->locked = 1;";
   o->newline(-2) << "} else if (unlikely(c->locked == 2)) {";
   o->newline(1) << "_stp_error(\"invalid lock state\");";
   o->newline(-1) << "}";
+  if (defer_p)
+    o->newline() << "stp_defer_replay: __attribute__((unused));";
 }
     
 
@@ -3193,6 +4580,12 @@ c_unparser::locks_needed_p(visitable *s) // statement OR expression
   // locks/unlocks are emitted early/late always.
   if (strverscmp(this->session->compatible.c_str(), "4.3") <= 0)
     return true;
+
+  // The delete after a snapshot foreach is left to the snapshot, and
+  // else runs with the locks the loop still holds.
+  delete_statement* d = dynamic_cast<delete_statement*>(s);
+  if (d && snapshot_deletes.count (d))
+    return false;
   
   varuse_collecting_visitor vut(*session);
   s->visit (& vut);
@@ -3217,7 +4610,16 @@ c_unparser::emit_unlock()
     clog << "emit unlock" << endl;
   
   o->newline() << "if (c->locked == 1) {";
-  o->newline(1) << "stp_unlock_probe(locks, ARRAY_SIZE(locks));";
+  o->indent(1);
+  // Replay a few queued updates while still holding the locks.
+  if (current_probe && deferred_probes.count (current_probe))
+    {
+      o->newline() << "if (c->last_error == 0 && stp_defer_replays++ < STP_DEFER_QUEUE";
+      o->newline() << "    && stp_defer_pop(&" << current_probe->name() << "_defer, l))";
+      o->newline(1) << "goto stp_defer_replay;";
+      o->indent(-1);
+    }
+  o->newline() << "stp_unlock_probe(locks, ARRAY_SIZE(locks));";
   o->newline() << "c->locked = 2;"; // NB: 2 so it won't re-lock
   o->newline(-1) << "}";
 }
@@ -3321,6 +4723,10 @@ c_unparser::emit_map_type_instantiations ()
   for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
     collect_map_index_types(it->second->locals, types);
 
+  set< pair<vector<exp_type>, exp_type> > snapshot_types;
+  for (auto it = snapshot_maps.begin(); it != snapshot_maps.end(); ++it)
+    snapshot_types.insert (make_pair ((*it)->index_types, (*it)->type));
+
   if (!types.empty())
     o->newline() << "#include \"alloc.c\"";
 
@@ -3333,8 +4739,9 @@ c_unparser::emit_map_type_instantiations ()
 	  string ktype = mapvar::key_typename(i->first.at(j));
 	  o->newline() << "#define KEY" << (j+1) << "_TYPE " << ktype;
 	}
-      /* For statistics, flag map-gen to pull in nested pmap-gen too.  */
-      if (i->second == pe_stats)
+      /* For statistics, flag map-gen to pull in nested pmap-gen too.
+         Snapshot maps need its merge too.  */
+      if (i->second == pe_stats || snapshot_types.count (*i))
 	o->newline() << "#define MAP_DO_PMAP 1";
       o->newline() << "#include \"map-gen.c\"";
       o->newline() << "#undef MAP_DO_PMAP";
@@ -3475,7 +4882,7 @@ c_unparser::c_global_write_def(vardecl* v)
       if (v->type == pe_string)
           o->line() << "strlcpy(global(" << c_globalname(v->name) << "), val, MAXSTRINGLEN)";
       else if (v->type == pe_long)
-          o->line() << "global_set(" << c_globalname(v->name) << ", val)";
+          o->line() << "(" << getvar (v).value() << " = (val))";
     }
 }
 
@@ -3491,7 +4898,7 @@ c_unparser::c_global_read_def(vardecl* v)
   else
     {
       o->newline() << "#define STAP_GLOBAL_GET_" << v->unmangled_name << "() "
-                   << "global(" << c_globalname(v->name) << ")";
+                   << getvar (v).value();
     }
 }
 
@@ -3872,11 +5279,29 @@ c_unparser::getvar(vardecl *v, token const *tok)
       i = session->stat_decls.find(v->name);
       if (i != session->stat_decls.end())
 	sd = i->second;
-      return var (this, loc, v->type, sd, v->name);
+      var gv (this, loc, v->type, sd, v->name);
+      if (lockless_global_p (v))
+        gv.set_once();
+      return gv;
     }
 }
 
 
+// Whether v is a long scalar written only by probes that write rarely,
+// like procfs write probes.  emit_lock_decls lets its readers load it
+// without the lock where longs are 64 bits, so all its accesses are
+// volatile, each a single load or store the compiler can't tear,
+// merge or repeat.
+bool
+c_unparser::lockless_global_p(vardecl *v)
+{
+  return (v->arity == 0 && v->type == pe_long
+          && vcv_needs_global_locks.written.count(v) > 0
+          && vcv_frequent_writes.written.count(v) == 0
+          && !session->runtime_usermode_p());
+}
+
+
 mapvar
 c_unparser::getmap(vardecl *v, token const *tok)
 {
@@ -3888,7 +5313,8 @@ c_unparser::getmap(vardecl *v, token const *tok)
   if (i != session->stat_decls.end())
     sd = i->second;
   return mapvar (this, is_local (v, tok), v->type, sd,
-      v->name, v->index_types, v->maxsize, v->wrap);
+      v->name, v->index_types, v->maxsize, v->wrap, v->topk,
+      striped_maps.count (v) > 0, sorted_maps.count (v) > 0);
 }
 
 
@@ -4203,6 +5629,30 @@ c_tmpcounter::close_struct_def (std::ostream::pos_type before,
     o->newline() << "};";
 }
 
+void
+c_tmpcounter::start_compound_expression (std::ostream::pos_type &before,
+                                         std::ostream::pos_type &after,
+                                         const char* tag, expression *e)
+{
+  // Like start_struct_def, but the parts share their storage.
+  const source_loc& loc = e->tok->location;
+  translator_output *o = parent->o;
+  before = o->tellp();
+  o->newline() << "union { /* " << tag << ": "
+               << loc.file->name << ":"
+               << lex_cast(loc.line) << " */";
+  o->indent(1);
+  after = o->tellp();
+}
+
+void
+c_tmpcounter::close_compound_expression (std::ostream::pos_type before,
+                                         std::ostream::pos_type after)
+{
+  // Reuse close_struct_def's cleanup, for a union with no members.
+  close_struct_def (before, after);
+}
+
 void
 c_tmpcounter::start_compound_statement (const char* tag, statement *s)
 {
@@ -4227,6 +5677,31 @@ c_unparser::visit_if_statement (if_statement *s)
 {
   record_actions(1, s->tok, true);
 
+  // At the head of a chain with a combined dfa, make room for its result
+  // outside the union of this statement's parts, where the later tests
+  // of the chain can still see it.
+  vector<regex_query*> chain;
+  bool chain_head = false;
+  if (regex_chain (s, chain)
+      && regex_chain_slots.find (chain[0]) == regex_chain_slots.end())
+    {
+      vector<string> inputs;
+      for (unsigned i = 0; i < chain.size(); i++)
+        inputs.push_back (chain[i]->right->value);
+      map<vector<string>, stapdfa*>::const_iterator it
+        = session->dfa_chains.find (inputs);
+      if (it != session->dfa_chains.end() && it->second)
+        {
+          tmpvar result = gensym (pe_long);
+          for (unsigned i = 0; i < chain.size(); i++)
+            {
+              regex_chain_slot slot = { it->second, result.value(), i + 1 };
+              regex_chain_slots[chain[i]] = slot;
+            }
+          chain_head = true;
+        }
+    }
+
   start_compound_statement ("if_statement", s);
 
   bool condition_nl = locks_needed_p (s->condition);
@@ -4239,11 +5714,35 @@ c_unparser::visit_if_statement (if_statement *s)
   if (condition_nl && pushdown_lock_p(s))
     emit_lock(); // and then thenblock/elseblock don't need to lock or pushdown!
   
+  // With --pgo, hint the branches that the profile shows going one
+  // way nearly always; with -t, count which way they go.
+  const char *hint = "";
+  map<string, pair<int64_t, int64_t> >::const_iterator ph
+    = session->pgo_branch_hits.find (lex_cast (s->tok->location));
+  if (ph != session->pgo_branch_hits.end())
+    {
+      int64_t taken = ph->second.first;
+      int64_t total = taken + ph->second.second;
+      if (total >= 100 && taken * 20 >= total * 19)
+        hint = "likely ";
+      else if (total >= 100 && taken * 20 <= total)
+        hint = "unlikely ";
+    }
+  map<if_statement*, unsigned>::const_iterator bi = branch_ids.find (s);
+
   o->newline() << "if (";
+  if (*hint)
+    o->line() << hint << "(";
+  if (bi != branch_ids.end())
+    o->line() << "stp_branch_hit (" << bi->second << ", ";
   o->indent (1);
 
   wrap_compound_visit (s->condition);
   o->indent (-1);
+  if (bi != branch_ids.end())
+    o->line() << ")";
+  if (*hint)
+    o->line() << ")";
   o->line() << ")";
   
   o->line() << "{";
@@ -4290,6 +5789,12 @@ c_unparser::visit_if_statement (if_statement *s)
     }
 
   close_compound_statement ("if_statement", s);
+
+  // The same statement may be emitted again elsewhere, with a tmpvar
+  // of its own.
+  if (chain_head)
+    for (unsigned i = 0; i < chain.size(); i++)
+      regex_chain_slots.erase (chain[i]);
 }
 
 
@@ -4467,9 +5972,32 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
   if (pushdown_lock_p(s))
     emit_lock();
 
+  // A snapshot foreach that ends the locked part of its handler swaps
+  // its array for the empty spare, and lets go of the locks before it
+  // iterates over what it took.  See snapshot_foreach_visitor.
+  bool snapshot_p = array && pushdown_unlock_p(s) && snapshot_loops.count(s);
+  if (snapshot_p)
+    {
+      mapvar live = getmap (array->referent, s->tok);
+      mapvar snap = live.snapshot ();
+      o->newline() << "if (!stp_snapshot_claim(&global(" << snap.c_name()
+                   << "_busy), &c->snapshot_busy))";
+      o->newline(1) << "goto out;";
+      o->newline(-1) << "{";
+      o->newline(1) << (live.is_parallel() ? "PMAP" : "MAP")
+                    << " snap = " << live << ";";
+      o->newline() << "global_set(" << live.c_name() << ", " << snap << ");";
+      o->newline() << "global_set(" << snap.c_name() << ", snap);";
+      o->newline(-1) << "}";
+      emit_unlock ();
+      snapshot_taken.insert (snapshot_loops[s]);
+      probe_snapshots.insert (array->referent);
+    }
+
   if (array)
     {
-      mapvar mv = getmap (array->referent, s->tok);
+      mapvar mv = snapshot_p ? getmap (array->referent, s->tok).snapshot ()
+                             : getmap (array->referent, s->tok);
       vector<var> keys;
 
       // NB: structure parallels for_loop
@@ -4996,6 +6524,23 @@ c_unparser::visit_delete_statement (delete_statement* s)
 
   if (ln && pushdown_lock_p(s))
     emit_lock();
+
+  if (snapshot_taken.count (s))
+    {
+      // The array was swapped for its empty spare, see
+      // snapshot_foreach_visitor, so only the snapshot is left to
+      // clear before the spare is handed back.
+      symbol* array = static_cast<symbol*> (s->value);
+      mapvar snap = getmap (array->referent, s->tok).snapshot ();
+      o->newline() << "if (c->snapshot_busy == &global(" << snap.c_name()
+                   << "_busy)) {";
+      o->newline(1) << (snap.is_parallel() ? "_stp_pmap_clear" : "_stp_map_clear")
+                    << " (" << snap << ");";
+      o->newline() << "stp_snapshot_release(&c->snapshot_busy);";
+      o->newline(-1) << "}";
+      record_actions(1, s->tok);
+      return;
+    }
   
   delete_statement_operand_visitor dv (this);
   s->value->visit (&dv);
@@ -5226,11 +6771,15 @@ c_unparser::visit_logical_or_expr (logical_or_expr* e)
       e->right->type != pe_long)
     throw SEMANTIC_ERROR (_("expected numeric types"), e->tok);
 
+  // The left value is used up before the right one is computed.
+  std::ostream::pos_type before, after;
+  start_compound_expression (before, after, "logical_or_expr", e);
   o->line() << "((";
-  e->left->visit (this);
+  wrap_compound_visit (e->left);
   o->line() << ") " << e->op << " (";
-  e->right->visit (this);
+  wrap_compound_visit (e->right);
   o->line() << "))";
+  close_compound_expression (before, after);
 }
 
 
@@ -5242,11 +6791,15 @@ c_unparser::visit_logical_and_expr (logical_and_expr* e)
       e->right->type != pe_long)
     throw SEMANTIC_ERROR (_("expected numeric types"), e->tok);
 
+  // The left value is used up before the right one is computed.
+  std::ostream::pos_type before, after;
+  start_compound_expression (before, after, "logical_and_expr", e);
   o->line() << "((";
-  e->left->visit (this);
+  wrap_compound_visit (e->left);
   o->line() << ") " << e->op << " (";
-  e->right->visit (this);
+  wrap_compound_visit (e->right);
   o->line() << "))";
+  close_compound_expression (before, after);
 }
 
 
@@ -5380,6 +6933,28 @@ c_unparser::visit_array_in (array_in* e)
 void
 c_unparser::visit_regex_query (regex_query* e)
 {
+  // Part of a chain: the head runs the combined dfa, and each test
+  // checks whether its own pattern was the first to match.
+  map<regex_query*, regex_chain_slot>::const_iterator it
+    = regex_chain_slots.find (e);
+  if (it != regex_chain_slots.end())
+    {
+      const regex_chain_slot& slot = it->second;
+      o->line() << "(";
+      if (slot.index == 1)
+        {
+          o->line() << "(" << slot.result << " = ";
+          slot.dfa->emit_matchop_start (o);
+          e->left->visit(this);
+          slot.dfa->emit_matchop_end (o);
+          o->line() << ")";
+        }
+      else
+        o->line() << slot.result;
+      o->line() << " == " << slot.index << ")";
+      return;
+    }
+
   o->line() << "(";
   o->indent(1);
   o->newline();
@@ -5452,13 +7027,37 @@ c_unparser::visit_concatenation (concatenation* e)
       e->right->type != pe_string)
     throw SEMANTIC_ERROR (_("expected string types"), e->tok);
 
+  // A chain like a . b . c parses as ((a . b) . c).  Append all of its
+  // pieces to one temporary, keeping track of its length, rather than
+  // copying the partial result again at each level and rescanning it
+  // for its end with strlcat.
+  vector<expression*> pieces;
+  expression *left = e;
+  concatenation *c;
+  while ((c = dynamic_cast<concatenation*>(left)) && c->op == ".")
+    {
+      if (c->left->type != pe_string || c->right->type != pe_string)
+        throw SEMANTIC_ERROR (_("expected string types"), c->tok);
+      pieces.push_back (c->right);
+      left = c->left;
+    }
+  pieces.push_back (left);
+  reverse (pieces.begin(), pieces.end());
+
   tmpvar t = gensym (e->type);
+  tmpvar len = gensym (pe_long);
 
   o->line() << "({ ";
   o->indent(1);
   // o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
-  c_assign (t.value(), e->left, "assignment");
-  c_strcat (t.value(), e->right);
+  o->newline() << len << " = 0;";
+  for (unsigned i = 0; i < pieces.size(); i++)
+    {
+      o->newline() << len << " = _stp_string_append (" << t << ", "
+                   << len << ", ";
+      pieces[i]->visit (this);
+      o->line() << ");";
+    }
   o->newline() << t << ";";
   o->newline(-1) << "})";
 }
@@ -5475,13 +7074,17 @@ c_unparser::visit_ternary_expression (ternary_expression* e)
       (e->truevalue->type != pe_long && e->truevalue->type != pe_string))
     throw SEMANTIC_ERROR (_("expected matching types"), e->tok);
 
+  // Only one of the values is computed, after the condition is used up.
+  std::ostream::pos_type before, after;
+  start_compound_expression (before, after, "ternary_expression", e);
   o->line() << "((";
-  e->cond->visit (this);
+  wrap_compound_visit (e->cond);
   o->line() << ") ? (";
-  e->truevalue->visit (this);
+  wrap_compound_visit (e->truevalue);
   o->line() << ") : (";
-  e->falsevalue->visit (this);
+  wrap_compound_visit (e->falsevalue);
   o->line() << "))";
+  close_compound_expression (before, after);
 }
 
 
@@ -6014,10 +7617,29 @@ c_unparser_assignment::visit_arrayindex (arrayindex *e)
 	{
 	  mapvar mvar = parent->getmap (array->referent, e->tok);
 	  o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
-	  if (op != "=") // don't bother fetch slot if we will just overwrite it
-	    parent->c_assign (lvar, mvar.get(idx), e->tok);
-	  c_assignop (res, lvar, rvar, e->tok);
-	  o->newline() << mvar.set (idx, lvar) << ";";
+	  if (mvar.striped && op != "=")
+	    {
+	      // Another handler may change the element between a get and
+	      // a set of a striped map, so add to it in one step.  The
+	      // result then includes what others added meanwhile.
+	      assert (op == "+=" || op == "-=" || op == "++" || op == "--");
+	      tmpvar delta = rvar;
+	      if (op == "-=" || op == "--")
+		delta.override ("(-" + rvar.value() + ")");
+	      o->newline() << mvar.add (idx, delta) << ";";
+	      parent->c_assign (lvar, mvar.get(idx), e->tok);
+	      o->newline() << res << " = " << lvar;
+	      if (post)
+		o->line() << " - " << delta;
+	      o->line() << ";";
+	    }
+	  else
+	    {
+	      if (op != "=") // don't bother fetch slot if we will just overwrite it
+		parent->c_assign (lvar, mvar.get(idx), e->tok);
+	      c_assignop (res, lvar, rvar, e->tok);
+	      o->newline() << mvar.set (idx, lvar) << ";";
+	    }
 	}
 
       o->newline() << res << ";";
@@ -6075,11 +7697,25 @@ c_unparser::visit_functioncall (functioncall* e)
           && is_local(sym_out->referent, sym_out->tok))
         t.override(getvar(sym_out->referent, sym_out->tok).value());
       else
-        c_assign (t, e->args[i],
-                  _("function actual argument evaluation"));
+        t.value(); // NB: declared here, outside the union below
       tmp.push_back(t);
     }
 
+  // Each argument's own temporaries are done with once its value is
+  // copied, so the arguments can share their storage.
+  std::ostream::pos_type before, after;
+  start_compound_expression (before, after, "functioncall", e);
+  for (unsigned i=0; i<e->args.size(); i++)
+    if (!tmp[i].is_overridden())
+      {
+        std::ostream::pos_type before_arg, after_arg;
+        start_struct_def (before_arg, after_arg, e->args[i]->tok);
+        c_assign (tmp[i], e->args[i],
+                  _("function actual argument evaluation"));
+        close_struct_def (before_arg, after_arg);
+      }
+  close_compound_expression (before, after);
+
   // overloading execution logic for functioncall:
   //
   // - copy in computed function arguments for overload_0
@@ -6545,6 +8181,16 @@ c_unparser::visit_stat_op (stat_op* e)
         case sc_variance:
           c_assign(res, agg.value() + "->variance", e->tok);
           break;
+        case sc_quantile:
+          c_assign(res, ("_stp_stat_quantile(" + v->hist() + ", " + agg.value() + ", "
+                         + lex_cast(e->params[0]) + "LL, "
+                         + lex_cast(e->params.size() > 1 ? e->params[1] : 100) + "LL)"),
+                   e->tok);
+          break;
+        case sc_distinct:
+          c_assign(res, ("_stp_stat_distinct(" + v->hist() + ", " + agg.value() + ")"),
+                   e->tok);
+          break;
         case sc_none:
           assert (0); // should not happen, as sc_none is only used in foreach sorts
         }
@@ -6579,6 +8225,19 @@ c_unparser::visit_hist_op (hist_op*)
 
 typedef map<Dwarf_Addr,const char*> addrmap_t; // NB: plain map, sorted by address
 
+// Rows per block of the line and symbol tables, as runtime/sym.h.
+#define STP_LINE_BLOCK 16
+#define STP_SYMBOL_BLOCK 16
+
+// Mirrors struct _stp_line_block in runtime/sym.h.
+struct line_table_block
+{
+  Dwarf_Addr addr;
+  size_t rows;
+  unsigned line;
+  unsigned file;
+};
+
 struct unwindsym_dump_context
 {
   systemtap_session& session;
@@ -6607,8 +8266,13 @@ struct unwindsym_dump_context
   size_t eh_frame_hdr_len;
   Dwarf_Addr eh_addr;
   Dwarf_Addr eh_frame_hdr_addr;
-  void *debug_line;
-  size_t debug_line_len;
+  vector<line_table_block> line_blocks;
+  string line_rows;
+  size_t num_line_rows;
+  vector<string> line_files;
+
+  string symbol_names; // the _stp_symbol_names pool
+  map<string, unsigned> symbol_name_offsets;
 
   set<string> undone_unwindsym_modules;
 };
@@ -7024,118 +8688,156 @@ static void find_debug_frame_offset (Dwfl_Module *m,
     }
 }
 
-static int
-dump_line_tables_check (void *data, size_t data_len)
+// Rows of the line table given to the runtime.  A row covers the
+// addresses up to the next one; line 0 marks a gap between sequences.
+struct line_table_row
 {
-  uint64_t unit_length = 0,  header_length = 0;
-  uint16_t version = 0;
-  uint8_t *ptr = (uint8_t *)data, *endunitptr, opcode_base = 0;
-  unsigned length = 4;
-
-  while (ptr < ((uint8_t *)data + data_len))
-   {
-      if (ptr + 4 > (uint8_t *)data + data_len)
-        return DWARF_CB_ABORT;
-
-      unit_length = *((uint32_t *) ptr);
-      ptr += 4;
-      if (unit_length == 0xffffffff)
-        {
-          if (ptr + 8 > (uint8_t *)data + data_len)
-            return DWARF_CB_ABORT;
-          length = 8;
-          unit_length = *((uint64_t *) ptr);
-          ptr += 8;
-        }
-
-      if ((ptr + unit_length > (uint8_t *)data + data_len) || unit_length <= 2)
-        return DWARF_CB_ABORT;
-
-      endunitptr = ptr + unit_length;
+  Dwarf_Addr addr;
+  int line;
+  unsigned file;
+};
 
-      version  = *((uint16_t *)ptr);
-      ptr += 2;
+static bool
+line_table_row_less (const line_table_row& a, const line_table_row& b)
+{
+  // at the same address, a gap sorts before the row that fills it
+  return a.addr < b.addr || (a.addr == b.addr && a.line == 0 && b.line != 0);
+}
 
-      if (unit_length <= (2 + length))
-        return DWARF_CB_ABORT;
+static void
+put_uleb128 (string& out, uint64_t v)
+{
+  do
+    {
+      uint8_t b = v & 0x7f;
+      v >>= 7;
+      out += (char) (v ? b | 0x80 : b);
+    }
+  while (v);
+}
 
-      if (length == 4)
-        {
-          header_length = *((uint32_t *) ptr);
-          ptr += 4;
-        }
-      else
+static void
+put_sleb128 (string& out, int64_t v)
+{
+  for (;;)
+    {
+      uint8_t b = v & 0x7f;
+      v >>= 7;
+      if ((v == 0 && !(b & 0x40)) || (v == -1 && (b & 0x40)))
         {
-          header_length = *((uint64_t *) ptr);
-          ptr += 8;
+          out += (char) b;
+          return;
         }
-
-      // safety check for the next few jumps
-      if (header_length <= ((version >= 4 ? 5 : 4) + 2)
-          || (unit_length - (2 + length) < header_length))
-        return DWARF_CB_ABORT;
-
-      // skip past min instr length, max ops per instr, and line base
-      if (version >= 4)
-        ptr += 3;
-      else
-        ptr += 2;
-
-      // check that the line range is not 0
-      if (*ptr == 0)
-        return DWARF_CB_ABORT;
-      ptr++;
-
-      // check that the header accomodates the std opcode lens section
-      opcode_base = *((uint8_t *) ptr);
-      if (header_length <= (uint64_t) (opcode_base + (version >= 4 ? 7 : 6)))
-        return DWARF_CB_ABORT;
-
-      // the initial checks stop here, before the directory table
-      ptr = endunitptr;
+      out += (char) (b | 0x80);
     }
-  return DWARF_CB_OK;
 }
 
+// Decode the line programs of all CUs at translation time into a
+// sorted address table, so the runtime only has to do a binary search.
+// Every STP_LINE_BLOCK rows start a block with an absolute address,
+// line and file; the other rows are stored as deltas from their
+// predecessor (see _stp_linenumber_lookup in runtime/sym.c).
 static void
 dump_line_tables (Dwfl_Module *m, unwindsym_dump_context *c,
-                  const char *, Dwarf_Addr)
+                  const char *name, Dwarf_Addr)
 {
-  Elf* elf;
-  Elf_Scn* scn = NULL;
-  Elf_Data* data;
-  GElf_Ehdr *ehdr, ehdr_mem;
-  GElf_Shdr* shdr, shdr_mem;
-  Dwarf_Addr bias, start;
+  Dwarf_Addr bias;
+  Dwarf *dw = dwfl_module_getdwarf (m, &bias);
+  if (dw == NULL)
+    return;
 
-  dwfl_module_info (m, NULL, &start, NULL, NULL, NULL, NULL, NULL);
+  map<string, unsigned> file_index;
+  vector<line_table_row> rows;
+  Dwarf_Off off = 0, next_off;
+  size_t hsize;
+  while (dwarf_nextcu (dw, off, &next_off, &hsize, NULL, NULL, NULL) == 0)
+    {
+      Dwarf_Die cudie;
+      Dwarf_Lines *lines;
+      size_t nlines;
+      if (dwarf_offdie (dw, off + hsize, &cudie) != NULL
+          && dwarf_getsrclines (&cudie, &lines, &nlines) == 0)
+        for (size_t i = 0; i < nlines; i++)
+          {
+            Dwarf_Line *line = dwarf_onesrcline (lines, i);
+            line_table_row row = { 0, 0, 0 };
+            bool end = false;
+
+            if (dwarf_lineaddr (line, &row.addr) != 0
+                || dwarf_lineendsequence (line, &end) != 0)
+              continue;
+            const char *src = end ? NULL : dwarf_linesrc (line, NULL, NULL);
+            if (src && dwarf_lineno (line, &row.line) == 0 && row.line > 0)
+              row.file = file_index.insert (make_pair (string (src),
+                                                       file_index.size ()))
+                           .first->second;
+            else
+              row.line = 0;
+
+            // of several rows at one address, the last one counts
+            if (!rows.empty () && rows.back ().addr == row.addr
+                && rows.back ().line != 0)
+              rows.back () = row;
+            else
+              rows.push_back (row);
+          }
+      off = next_off;
+    }
 
-  elf = dwfl_module_getelf (m, &bias);
-  if (elf == NULL)
+  stable_sort (rows.begin (), rows.end (), line_table_row_less);
+  vector<line_table_row> table;
+  for (size_t i = 0; i < rows.size (); i++)
+    {
+      if (!table.empty () && table.back ().addr == rows[i].addr)
+        table.pop_back ();
+      if (table.empty () ? rows[i].line == 0
+          : (table.back ().line == rows[i].line
+             && table.back ().file == rows[i].file))
+        continue;
+      table.push_back (rows[i]);
+    }
+  if (table.empty ())
     return;
 
-  // we do not have the index for debug_line, so we can't use elf_getscn()
-  // instead, we need to seach through the sections for the correct one as in
-  // get_unwind_data()
-  ehdr = gelf_getehdr(elf, &ehdr_mem);
-  while ((scn = elf_nextscn(elf, scn)))
+  for (size_t i = 0; i < table.size (); i++)
     {
-      shdr = gelf_getshdr(scn, &shdr_mem);
-      if (strcmp(elf_strptr(elf, ehdr->e_shstrndx, shdr->sh_name),
-                 ".debug_line") == 0)
+      if (i % STP_LINE_BLOCK == 0)
         {
-          data = elf_rawdata(scn, NULL);
-          if (dump_line_tables_check(data->d_buf, data->d_size) == DWARF_CB_ABORT)
-            return;
-          c->debug_line = data->d_buf;
-          c->debug_line_len = data->d_size;
-          break;
+          line_table_block b = { table[i].addr, c->line_rows.size (),
+                                 (unsigned) table[i].line, table[i].file };
+          c->line_blocks.push_back (b);
+          continue;
         }
+      const line_table_row& prev = table[i - 1];
+      bool new_file = table[i].file != prev.file;
+      put_uleb128 (c->line_rows, table[i].addr - prev.addr);
+      put_sleb128 (c->line_rows,
+                   (int64_t) (table[i].line - prev.line) * 2 + new_file);
+      if (new_file)
+        put_uleb128 (c->line_rows, table[i].file);
+    }
+  c->num_line_rows = table.size ();
+
+  size_t len = c->line_rows.size ()
+    + c->line_blocks.size () * sizeof (line_table_block);
+  if (len > MAX_UNWIND_TABLE_SIZE)
+    {
+      c->session.print_warning (_F("skipping module %s line table (too big: %zi > %zi)",
+                                   name, len, (size_t)MAX_UNWIND_TABLE_SIZE));
+      c->line_blocks.clear ();
+      c->line_rows.clear ();
+      c->num_line_rows = 0;
+      return;
     }
 
+  c->line_files.resize (file_index.size ());
+  for (map<string, unsigned>::iterator it = file_index.begin ();
+       it != file_index.end (); it++)
+    c->line_files[it->second] = it->first;
+
   // still need to get some kind of information about the sec_load_offset for
   // kernel addresses if there is no unwind data
-  if (c->debug_line_len > 0 && !c->session.need_unwind)
+  if (!c->session.need_unwind)
     find_debug_frame_offset (m, c);
 }
 
@@ -7426,11 +9128,7 @@ dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
       return;
     }
 
-  // if it is the debug_line data, do not need the unwind flags to be defined
-  if(table == "debug_line")
-    output << "#if defined(STP_NEED_LINE_DATA)\n";
-  else
-    output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
+  output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
   output << "static uint8_t _stp_module_" << modindex << "_" << table;
   if (!secname.empty())
     output << "_" << secindex;
@@ -7444,10 +9142,67 @@ dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
 	output << "\n" << "   ";
     }
   output << "};\n";
-  if (table == "debug_line")
-    output << "#endif /* STP_NEED_LINE_DATA */\n";
-  else
-    output << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA */\n";
+  output << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA */\n";
+}
+
+// Return the offset of name in the shared symbol name pool, adding it
+// if it is not there yet.
+static unsigned
+symbol_name_offset (unwindsym_dump_context *c, const string& name)
+{
+  map<string, unsigned>::iterator it = c->symbol_name_offsets.find (name);
+  if (it != c->symbol_name_offsets.end ())
+    return it->second;
+
+  unsigned off = c->symbol_names.size ();
+  c->symbol_names += name;
+  c->symbol_names += '\0';
+  c->symbol_name_offsets.insert (make_pair (name, off));
+  return off;
+}
+
+// Emit the symbols of a section, sorted by address, in the block form
+// described at struct _stp_symbol_block in runtime/sym.h.  Returns the
+// C expression for their rows, NULL when every symbol heads a block.
+static string
+dump_symbol_blocks (unwindsym_dump_context *c, unsigned stpmod_idx,
+                    unsigned secidx,
+                    const vector<pair<Dwarf_Addr, string> >& syms)
+{
+  string rows;
+
+  c->output << "static struct _stp_symbol_block "
+            << "_stp_module_" << stpmod_idx << "_symbols_" << secidx << "[] = {\n";
+  for (size_t i = 0; i < syms.size (); i++)
+    {
+      unsigned name = symbol_name_offset (c, syms[i].second);
+      if (i % STP_SYMBOL_BLOCK == 0)
+        {
+          c->output << "  { 0x" << hex << syms[i].first << dec
+                    << ", " << rows.size () << ", " << name << " },\n";
+          continue;
+        }
+      put_uleb128 (rows, syms[i].first - syms[i - 1].first);
+      put_uleb128 (rows, name);
+    }
+  c->output << "};\n";
+
+  if (rows.empty ())
+    return "NULL";
+
+  string rows_name = "_stp_module_" + lex_cast (stpmod_idx)
+                     + "_symbol_rows_" + lex_cast (secidx);
+  c->output << "static uint8_t " << rows_name << "[] = \n";
+  c->output << "  {";
+  for (size_t i = 0; i < rows.size (); i++)
+    {
+      int h = (uint8_t) rows[i];
+      c->output << h << ","; // decimal is less wordy than hex
+      if ((i + 1) % 16 == 0)
+        c->output << "\n" << "   ";
+    }
+  c->output << "};\n";
+  return rows_name;
 }
 
 static int
@@ -7468,8 +9223,19 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   size_t eh_frame_hdr_len = c->eh_frame_hdr_len;
   Dwarf_Addr eh_addr = c->eh_addr;
   Dwarf_Addr eh_frame_hdr_addr = c->eh_frame_hdr_addr;
-  void *debug_line = c->debug_line;
-  size_t debug_line_len = c->debug_line_len;
+
+  // With --lazy-unwind, leave the unwind tables of user modules out;
+  // the runtime has stapio read the .eh_frame from the file instead,
+  // the first time it meets the module.  The addresses still apply.
+  bool lazy_unwind = (c->session.lazy_unwind
+		      && !c->session.runtime_usermode_p ()
+		      && is_user_module (modname)
+		      && eh_frame != NULL && eh_frame_hdr != NULL);
+  if (lazy_unwind)
+    {
+      debug_frame = debug_frame_hdr = eh_frame = eh_frame_hdr = NULL;
+      debug_len = debug_frame_hdr_len = eh_len = eh_frame_hdr_len = 0;
+    }
 
   dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
 			   "debug_frame", debug_frame, debug_len);
@@ -7480,10 +9246,41 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
 			   "eh_frame_hdr", eh_frame_hdr, eh_frame_hdr_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
-			   "debug_line", debug_line, debug_line_len);
+  if (!c->line_blocks.empty())
+    {
+      c->output << "#if defined(STP_NEED_LINE_DATA)\n";
+      c->output << "static const char *_stp_module_" << stpmod_idx
+		<< "_line_files[] = {\n";
+      for (size_t i = 0; i < c->line_files.size(); i++)
+	c->output << "  " << lex_cast_qstring (c->line_files[i]) << ",\n";
+      c->output << "};\n";
+      c->output << "static struct _stp_line_block _stp_module_" << stpmod_idx
+		<< "_line_blocks[] = {\n";
+      for (size_t i = 0; i < c->line_blocks.size(); i++)
+	{
+	  const line_table_block& b = c->line_blocks[i];
+	  c->output << "  { 0x" << hex << b.addr << dec << ", " << b.rows
+		    << ", " << b.line << ", " << b.file << " },\n";
+	}
+      c->output << "};\n";
+      c->output << "static uint8_t _stp_module_" << stpmod_idx
+		<< "_line_rows[] = \n";
+      c->output << "  {";
+      for (size_t i = 0; i < c->line_rows.size(); i++)
+	{
+	  int h = (uint8_t) c->line_rows[i];
+	  c->output << h << ","; // decimal is less wordy than hex
+	  if ((i + 1) % 16 == 0)
+	    c->output << "\n" << "   ";
+	}
+      if (c->line_rows.empty())
+	c->output << "0";
+      c->output << "};\n";
+      c->output << "#endif /* STP_NEED_LINE_DATA */\n";
+    }
 
-  if (c->session.need_unwind && debug_frame == NULL && eh_frame == NULL)
+  if (c->session.need_unwind && debug_frame == NULL && eh_frame == NULL
+      && !lazy_unwind)
     {
       // There would be only a small benefit to warning.  A user
       // likely can't do anything about this; backtraces for the
@@ -7494,23 +9291,23 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 				  + ", " + dwfl_errmsg (-1));
     }
 
-  if (c->session.need_lines && debug_line == NULL)
+  if (c->session.need_lines && c->line_blocks.empty())
     {
       if (c->session.verbose > 2)
         c->session.print_warning ("No debug line data for " + modname + ", " +
                                   dwfl_errmsg (-1));
     }
 
+  vector<size_t> num_symbols;
+  vector<string> symbol_rows;
   for (unsigned secidx = 0; secidx < c->seclist.size(); secidx++)
     {
-      c->output << "static struct _stp_symbol "
-                << "_stp_module_" << stpmod_idx<< "_symbols_" << secidx << "[] = {\n";
-
       string secname = c->seclist[secidx].first;
       Dwarf_Addr extra_offset;
       extra_offset = (secname == "_stext") ? c->stext_offset : 0;
 
       // Only include symbols if they will be used
+      vector<pair<Dwarf_Addr, string> > syms;
       if (c->session.need_symbols)
 	{
 	  // We write out a *sorted* symbol table, so the runtime doesn't
@@ -7522,15 +9319,13 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 	      if (it->first < extra_offset)
 		continue;
 
-	      c->output << "  { 0x" << hex << it->first-extra_offset << dec
-			<< ", " << lex_cast_qstring (it->second) << " },\n";
-              // XXX: these literal strings all suffer ELF relocation bloat too.
-              // See if the tapsets.cxx:dwarf_derived_probe_group::emit_module_decls
-              // CALCIT hack could work here.
+	      syms.push_back (make_pair (it->first - extra_offset,
+					 string (it->second)));
 	    }
 	}
 
-      c->output << "};\n";
+      symbol_rows.push_back (dump_symbol_blocks (c, stpmod_idx, secidx, syms));
+      num_symbols.push_back (syms.size ());
 
       /* For now output debug_frame index only in "magic" sections. */
       if (secname == ".dynamic" || secname == ".absolute"
@@ -7552,7 +9347,8 @@ dump_unwindsym_cxt (Dwfl_Module *m,
                 << ".name = " << lex_cast_qstring(c->seclist[secidx].first) << ",\n"
                 << ".size = 0x" << hex << c->seclist[secidx].second << dec << ",\n"
                 << ".symbols = _stp_module_" << stpmod_idx << "_symbols_" << secidx << ",\n"
-                << ".num_symbols = " << c->addrmap[secidx].size() << ",\n";
+                << ".symbol_rows = " << symbol_rows[secidx] << ",\n"
+                << ".num_symbols = " << num_symbols[secidx] << ",\n";
 
       /* For now output debug_frame index only in "magic" sections. */
       string secname = c->seclist[secidx].first;
@@ -7675,19 +9471,31 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   if (eh_frame != NULL)
     c->output << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA*/\n";
 
-  if (debug_line != NULL)
+  if (lazy_unwind)
+    {
+      c->output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
+      c->output << ".lazy_unwind = 1, /* _stp_lazy_wanted */\n";
+      c->output << "#endif /* STP_USE_DWARF_UNWINDER && STP_NEED_UNWIND_DATA*/\n";
+    }
+
+  if (!c->line_blocks.empty())
     {
       c->output << "#if defined(STP_NEED_LINE_DATA)\n";
-      c->output << ".debug_line = "
-		<< "_stp_module_" << stpmod_idx << "_debug_line, \n";
-      c->output << ".debug_line_len = " << debug_line_len << ", \n";
+      c->output << ".line_blocks = "
+		<< "_stp_module_" << stpmod_idx << "_line_blocks, \n";
+      c->output << ".line_rows = "
+		<< "_stp_module_" << stpmod_idx << "_line_rows, \n";
+      c->output << ".line_files = "
+		<< "_stp_module_" << stpmod_idx << "_line_files, \n";
+      c->output << ".num_line_blocks = " << c->line_blocks.size() << ", \n";
+      c->output << ".num_line_rows = " << c->num_line_rows << ", \n";
       c->output << "#else\n";
     }
 
-  c->output << ".debug_line = NULL,\n";
-  c->output << ".debug_line_len = 0,\n";
+  c->output << ".line_blocks = NULL,\n";
+  c->output << ".num_line_blocks = 0,\n";
 
-  if (debug_line != NULL)
+  if (!c->line_blocks.empty())
     c->output << "#endif /* STP_NEED_LINE_DATA */\n";
 
   c->output << ".sections = _stp_module_" << stpmod_idx << "_sections" << ",\n";
@@ -7742,19 +9550,23 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   return DWARF_CB_OK;
 }
 
+static bool
+pair_first_less (const pair<Dwarf_Addr, string>& a,
+                 const pair<Dwarf_Addr, string>& b)
+{
+  return a.first < b.first;
+}
+
 static void dump_kallsyms(unwindsym_dump_context *c)
 {
   ifstream kallsyms("/proc/kallsyms");
   unsigned stpmod_idx = c->stp_module_index;
   string line;
-  unsigned size = 0;
+  vector<pair<Dwarf_Addr, string> > syms;
   Dwarf_Addr start = 0;
   Dwarf_Addr end = 0;
   Dwarf_Addr prev = 0;
 
-  c->output << "static struct _stp_symbol "
-            << "_stp_module_" << stpmod_idx << "_symbols_" << 0 << "[] = {\n";
-
   while (getline(kallsyms, line))
     {
       Dwarf_Addr addr;
@@ -7776,20 +9588,20 @@ static void dump_kallsyms(unwindsym_dump_context *c)
       if (!start || addr == 0 || prev == addr)
         continue;
 
-      c->output << "  { 0x" << hex << addr - start << dec
-			<< ", " << lex_cast_qstring(name) << " },\n";
-
-      size++;
+      syms.push_back (make_pair (addr - start, name));
       prev = addr;
     }
 
-  c->output << "};\n";
+  // the blocks store address deltas, so the order must be strict
+  stable_sort (syms.begin(), syms.end(), pair_first_less);
+  string symbol_rows = dump_symbol_blocks (c, stpmod_idx, 0, syms);
   c->output << "static struct _stp_section _stp_module_" << stpmod_idx << "_sections[] = {\n";
   c->output << "{\n"
             << ".name = " << lex_cast_qstring(KERNEL_RELOC_SYMBOL) << ",\n"
             << ".size = 0x" << hex << end - start << dec << ",\n"
             << ".symbols = _stp_module_" << stpmod_idx << "_symbols_" << 0 << ",\n"
-            << ".num_symbols = " << size << ",\n";
+            << ".symbol_rows = " << symbol_rows << ",\n"
+            << ".num_symbols = " << syms.size() << ",\n";
   c->output << "},\n";
   c->output << "};\n";
   c->output << "static struct _stp_module _stp_module_" << stpmod_idx << " = {\n";
@@ -7867,11 +9679,13 @@ dump_unwindsyms (Dwfl_Module *m,
   if (res == DWARF_CB_OK && c->session.need_unwind)
     res = dump_unwind_tables (m, c, name, base);
 
-  c->debug_line = NULL;
-  c->debug_line_len = 0;
+  c->line_blocks.clear();
+  c->line_rows.clear();
+  c->num_line_rows = 0;
+  c->line_files.clear();
   if (res == DWARF_CB_OK && c->session.need_lines)
     // we dont set res = dump_line_tables() because unwindsym stuff should still
-    // get dumped to the output even if gathering debug_line data fails
+    // get dumped to the output even if gathering line data fails
     (void) dump_line_tables (m, c, name, base);
 
   /* And finally dump everything collected in the output. */
@@ -8038,8 +9852,12 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* eh_frame_hdr_len */
 				 0, /* eh_addr */
 				 0, /* eh_frame_hdr_addr */
-				 NULL, /* debug_line */
-				 0, /* debug_line_len */
+				 vector<line_table_block>(), /* line_blocks */
+				 "", /* line_rows */
+				 0, /* num_line_rows */
+				 vector<string>(), /* line_files */
+				 "", /* symbol_names */
+				 map<string, unsigned>(), /* symbol_name_offsets */
 				 s.unwindsym_modules };
 
   // Micro optimization, mainly to speed up tiny regression tests
@@ -8115,8 +9933,8 @@ void
 self_unwind_declarations(unwindsym_dump_context *ctx)
 {
   ctx->output << "static uint8_t _stp_module_self_eh_frame [] = {0,};\n";
-  ctx->output << "struct _stp_symbol _stp_module_self_symbols_0[] = {{0},};\n";
-  ctx->output << "struct _stp_symbol _stp_module_self_symbols_1[] = {{0},};\n";
+  ctx->output << "struct _stp_symbol_block _stp_module_self_symbols_0[] = {{0},};\n";
+  ctx->output << "struct _stp_symbol_block _stp_module_self_symbols_1[] = {{0},};\n";
   ctx->output << "struct _stp_section _stp_module_self_sections[] = {\n";
   ctx->output << "{.name = \".symtab\", .symbols = _stp_module_self_symbols_0, .num_symbols = 0},\n";
   ctx->output << "{.name = \".text\", .symbols = _stp_module_self_symbols_1, .num_symbols = 0},\n";
@@ -8133,8 +9951,8 @@ self_unwind_declarations(unwindsym_dump_context *ctx)
   ctx->output << ".unwind_hdr_len = 0,\n";
   ctx->output << ".debug_frame = NULL,\n";
   ctx->output << ".debug_frame_len = 0,\n";
-  ctx->output << ".debug_line = NULL,\n";
-  ctx->output << ".debug_line_len = 0,\n";
+  ctx->output << ".line_blocks = NULL,\n";
+  ctx->output << ".num_line_blocks = 0,\n";
   ctx->output << "};\n";
 }
 
@@ -8163,6 +9981,21 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
   ctx->output << "};\n";
   ctx->output << "const unsigned _stp_num_modules = ARRAY_SIZE(_stp_modules);\n";
 
+  // The names of all symbols, each once, referred to by offset.
+  ctx->output << "const char _stp_symbol_names[] =\n";
+  size_t pos = 0;
+  while (pos < ctx->symbol_names.size())
+    {
+      size_t nul = ctx->symbol_names.find('\0', pos);
+      string q = lex_cast_qstring (ctx->symbol_names.substr(pos, nul - pos));
+      q.insert (q.size() - 1, "\\0");
+      ctx->output << "  " << q << "\n";
+      pos = nul + 1;
+    }
+  if (ctx->symbol_names.empty())
+    ctx->output << "  \"\"\n";
+  ctx->output << ";\n";
+
   ctx->output << "unsigned long _stp_kretprobe_trampoline = ";
   // Special case for -1, which is invalid in hex if host width > target width.
   if (ctx->stp_kretprobe_trampoline_addr == (unsigned long) -1)
@@ -8259,6 +10092,45 @@ prepare_translate_pass (systemtap_session& s)
 }
 
 
+// Runtime code that depends on nothing the script configures is
+// compiled in an auxiliary unit of its own rather than #included into
+// the module source.  buildrun.cxx caches aux objects by content and
+// kernel configuration, so such a unit is compiled once per kernel and
+// then reused by every script that pulls it in.  Embeds opt in with a
+// pragma, and see a macro telling them to include only declarations.
+static void
+emit_runtime_units (systemtap_session& s)
+{
+  static const struct {
+    const char *pragma;
+    const char *macro;
+    const char *source;
+  } units[] = {
+    { "/* pragma:softfloat_unit */", "STP_SOFTFLOAT_UNIT", "softfloat.c" },
+  };
+
+  for (unsigned u = 0; u < sizeof(units) / sizeof(units[0]); u++)
+    {
+      bool wanted = false;
+      for (unsigned i = 0; i < s.embeds.size() && !wanted; i++)
+        wanted = s.embeds[i]->tagged_p (units[u].pragma);
+      if (!wanted)
+        continue;
+
+      translator_output *o = s.op_create_auxiliary ();
+      o->newline() << "#include <linux/types.h>";
+      o->newline() << "#include <linux/string.h>";
+      o->newline() << "#include \"" << units[u].source << "\"";
+      o->newline();
+      o->assert_0_indent (); // flush to disk
+
+      s.op->newline() << "#define " << units[u].macro << " 1";
+      if (s.verbose > 2)
+        clog << _F("Compiling runtime %s as a separate unit", units[u].source) << endl;
+    }
+}
+
+
 int
 translate_pass (systemtap_session& s)
 {
@@ -8275,6 +10147,15 @@ translate_pass (systemtap_session& s)
 
   try
     {
+#ifdef HAVE_LIBSQLITE3
+      if (s.pgo)
+        {
+          if (!s.pgo_report.empty())
+            import_pgo_report (s, s.pgo_report);
+          load_pgo_profile (s);
+        }
+#endif
+
       int64_t major=0, minor=0;
       try
 	{
@@ -8367,12 +10248,27 @@ translate_pass (systemtap_session& s)
       if (s.timing || s.monitor)
 	s.op->hdr->newline() << "#define STP_TIMING";
 
+      if (s.tapset_compile_coverage && !s.runtime_usermode_p())
+	s.op->hdr->newline() << "#define STP_COVERAGE";
+
+      if (s.handoff)
+	s.op->hdr->newline() << "#define STP_HANDOFF 1";
+
       if (s.need_unwind)
 	s.op->hdr->newline() << "#define STP_NEED_UNWIND_DATA 1";
 
+      if (s.need_unwind && s.need_user_unwind)
+	s.op->hdr->newline() << "#define STP_NEED_USER_UNWIND_DATA 1";
+
       if (s.need_lines)
         s.op->hdr->newline() << "#define STP_NEED_LINE_DATA 1";
 
+      if (s.need_stack_ids)
+        s.op->hdr->newline() << "#define STP_NEED_STACK_IDS 1";
+
+      if (s.defer_symbols)
+        s.op->hdr->newline() << "#define STP_DEFER_SYMBOLS 1";
+
       // Emit the total number of probes (not regarding merged probe handlers)
       s.op->hdr->newline() << "#define STP_PROBE_COUNT " << s.probes.size();
 
@@ -8412,12 +10308,62 @@ translate_pass (systemtap_session& s)
           s.op->newline() << "#endif";
         }
 
+      if (!s.runtime_usermode_p())
+        emit_runtime_units (s);
+
       // Emit embeds ahead of time, in case they affect context layout
       for (unsigned i=0; i<s.embeds.size(); i++)
         {
           s.op->newline() << s.embeds[i]->code << "\n";
         }
 
+      // With -DSTP_DEFER_UPDATES, probes that only make commutative
+      // updates queue them when their locks are contended, instead of
+      // being skipped.  Their locals have to be settled before the
+      // context is laid out.
+      bool defer_p = false;
+      for (auto it = s.c_macros.begin(); it != s.c_macros.end(); ++it)
+        if (startswith (*it, "STP_DEFER_UPDATES"))
+          defer_p = (*it != "STP_DEFER_UPDATES=0");
+      if (s.runtime_usermode_p() || strverscmp(s.compatible.c_str(), "4.3") <= 0)
+        defer_p = false;
+      for (unsigned i=0; defer_p && i<s.probes.size(); i++)
+        if (defer_probe_updates (s, s.probes[i]))
+          {
+            cup.deferred_probes.insert (s.probes[i]);
+            if (s.verbose > 2)
+              clog << _F("Probe %s queues its updates on lock contention",
+                         s.probes[i]->name().c_str()) << endl;
+          }
+
+      // Iterate over snapshots of the arrays that are printed and
+      // cleared, unless -DSTP_NO_MAP_SNAPSHOT.  Their spares are
+      // declared with the globals, and need the merge of pmap-gen.
+      bool snapshots_p = !s.runtime_usermode_p();
+      for (auto it = s.c_macros.begin(); it != s.c_macros.end(); ++it)
+        if (*it == "STP_NO_MAP_SNAPSHOT"
+            || startswith (*it, "STP_NO_MAP_SNAPSHOT="))
+          snapshots_p = false;
+      for (unsigned i=0; snapshots_p && i<s.probes.size(); i++)
+        if (s.probes[i]->needs_global_locks())
+          {
+            snapshot_foreach_visitor sfv (s);
+            s.probes[i]->body->visit (&sfv);
+            for (auto it = sfv.loops.begin(); it != sfv.loops.end(); ++it)
+              {
+                symbol* array;
+                hist_op* hist;
+                classify_indexable (it->first->base, array, hist);
+                cup.snapshot_loops.insert (*it);
+                cup.snapshot_deletes.insert (it->second);
+                if (cup.snapshot_maps.insert (array->referent).second
+                    && s.verbose > 2)
+                  clog << _F("Iterating over snapshots of global '%s'",
+                             array->referent->unmangled_name.to_string().c_str())
+                       << endl;
+              }
+          }
+
       s.up->emit_common_header (); // context etc.
 
       if (s.need_unwind)
@@ -8489,6 +10435,22 @@ translate_pass (systemtap_session& s)
               s.print_error(e);
             }
         }
+      for (map<vector<string>,stapdfa*>::iterator it = s.dfa_chains.begin();
+           it != s.dfa_chains.end(); it++)
+        {
+          assert_no_interrupts();
+          if (!it->second)
+            continue;
+          s.op->newline();
+          try
+            {
+              it->second->emit_declaration (s.op);
+            }
+          catch (const semantic_error &e)
+            {
+              s.print_error(e);
+            }
+        }
       s.op->assert_0_indent();
 
       for (map<string,functiondecl*>::iterator it = s.functions.begin(); it != s.functions.end(); it++)
@@ -8538,12 +10500,25 @@ translate_pass (systemtap_session& s)
             clog << "*" << endl;                                                \
         }
 
+      bool need_prefilter = false, need_sample = false;
+      for (unsigned i=0; i<s.probes.size(); i++)
+        {
+          if (! s.probes[i]->prefilter.empty())
+            need_prefilter = true;
+          if (s.probes[i]->sample > 1)
+            need_sample = true;
+        }
+      if (need_prefilter)
+        s.op->newline() << "#define STP_NEED_PREFILTER 1";
+      if (need_sample)
+        s.op->newline() << "#define STP_NEED_PROBE_SAMPLE 1";
+
       s.op->newline();
       s.op->newline() << "struct stap_probe {";
       s.op->newline(1) << "const size_t index;";
       s.op->newline() << "void (* const ph) (struct context*);";
       s.op->newline() << "unsigned cond_enabled:1;"; // just one bit required
-      s.op->newline() << "#if defined(STP_TIMING) || defined(STP_ALIBI)";
+      s.op->newline() << "#if defined(STP_TIMING) || defined(STP_ALIBI) || defined(STP_COVERAGE)";
       CALCIT(location);
       CALCIT(derivation);
       s.op->newline() << "#define STAP_PROBE_INIT_TIMING(L, D) "
@@ -8558,15 +10533,129 @@ translate_pass (systemtap_session& s)
       s.op->newline() << "#else";
       s.op->newline() << "#define STAP_PROBE_INIT_NAME(PN)";
       s.op->newline() << "#endif";
-      s.op->newline() << "#define STAP_PROBE_INIT(I, PH, PP, PN, L, D) "
+      s.op->newline() << "#ifdef STP_NEED_PREFILTER";
+      s.op->newline() << "int (* const prefilter) (void);";
+      s.op->newline() << "#define STAP_PROBE_INIT_PREFILTER(F) .prefilter=(F),";
+      s.op->newline() << "#else";
+      s.op->newline() << "#define STAP_PROBE_INIT_PREFILTER(F)";
+      s.op->newline() << "#endif";
+      s.op->newline() << "#ifdef STP_NEED_PROBE_SAMPLE";
+      s.op->newline() << "const unsigned sample;";
+      s.op->newline() << "#define STAP_PROBE_INIT_SAMPLE(S) .sample=(S),";
+      s.op->newline() << "#else";
+      s.op->newline() << "#define STAP_PROBE_INIT_SAMPLE(S)";
+      s.op->newline() << "#endif";
+      s.op->newline() << "#define STAP_PROBE_INIT(I, PH, PP, PN, L, D, F, S) "
                       << "{ .index=(I), .ph=(PH), .cond_enabled=1, .pp=(PP), "
                       << "STAP_PROBE_INIT_NAME(PN) "
                       << "STAP_PROBE_INIT_TIMING(L, D) "
+                      << "STAP_PROBE_INIT_PREFILTER(F) "
+                      << "STAP_PROBE_INIT_SAMPLE(S) "
                       << "}";
       s.op->newline(-1) << "} static stap_probes[];";
       s.op->assert_0_indent();
+
+      if (!s.runtime_usermode_p())
+        {
+          s.op->newline() << "#define STP_PROBE_COUNT " << s.probes.size();
+          s.op->newline() << "#include \"linux/probe_throttle.c\"";
+          s.op->newline() << "#include \"linux/session_stats.c\"";
+          s.op->newline() << "#include \"linux/map_grow.c\"";
+          if (s.handoff)
+            s.op->newline() << "#include \"linux/handoff.c\"";
+          s.op->newline() << "#include \"linux/output_limit.c\"";
+
+          s.op->newline() << "#ifdef STP_COVERAGE";
+          s.op->newline() << "#define STP_FUNCTION_COUNT " << s.functions.size();
+          s.op->newline() << "static const struct { const char *name, *location; }";
+          s.op->newline() << "stp_coverage_functions[] = {";
+          s.op->indent(1);
+          for (map<string,functiondecl*>::iterator it = s.functions.begin();
+               it != s.functions.end(); it++)
+            s.op->newline() << "{ " << lex_cast_qstring (it->second->name) << ", "
+                            << lex_cast_qstring (it->second->tok->location) << " },";
+          s.op->newline() << "{ NULL, NULL }";
+          s.op->newline(-1) << "};";
+          s.op->newline() << "#include \"linux/coverage.c\"";
+          s.op->newline() << "#endif";
+        }
 #undef CALCIT
 
+      // Stripe the long maps that some locking handler writes one key
+      // at a time, unless -DSTP_MAP_STRIPES=0.
+      bool stripes_p = !s.runtime_usermode_p();
+      for (auto it = s.c_macros.begin(); it != s.c_macros.end(); ++it)
+        if (*it == "STP_MAP_STRIPES=0")
+          stripes_p = false;
+      for (unsigned i=0; stripes_p && i<s.probes.size(); i++)
+        if (s.probes[i]->needs_global_locks())
+          {
+            map_key_use_visitor mkuv;
+            s.probes[i]->body->visit (&mkuv);
+            for (auto it = mkuv.written.begin(); it != mkuv.written.end(); ++it)
+              {
+                vardecl* v = *it;
+                if (mkuv.keyed_only (v) && v->type == pe_long && !v->wrap
+                    && !v->topk && v->arity > 0
+                    && find (s.globals.begin(), s.globals.end(), v) != s.globals.end()
+                    && cup.striped_maps.insert (v).second && s.verbose > 2)
+                  clog << _F("Striping the locks of global '%s'",
+                             v->unmangled_name.to_string().c_str()) << endl;
+              }
+          }
+
+      // Sort the arrays that foreach sorts through arrays of their
+      // nodes, rather than their node lists.
+      {
+        sorted_foreach_visitor sfv;
+        for (unsigned i=0; i<s.probes.size(); i++)
+          s.probes[i]->body->visit (&sfv);
+        for (auto it = s.functions.begin(); it != s.functions.end(); ++it)
+          it->second->body->visit (&sfv);
+        for (auto it = sfv.sorted.begin(); it != sfv.sorted.end(); ++it)
+          if (find (s.globals.begin(), s.globals.end(), *it) != s.globals.end())
+            cup.sorted_maps.insert (*it);
+      }
+
+      // With --pgo, lay the handlers out hottest first.  Those the
+      // profile saw run at least a tenth as often as the hottest are
+      // marked hot, and those it never saw run are marked cold, for gcc
+      // to move them out of line into .text.unlikely.
+      if (!s.pgo_probe_hits.empty())
+        {
+          map<derived_probe*, int64_t> hits;
+          int64_t max_hits = 0;
+          for (unsigned i=0; i<s.probes.size(); i++)
+            {
+              derived_probe* p = s.probes[i];
+              map<string, int64_t>::const_iterator it
+                = s.pgo_probe_hits.find (lex_cast (*p->sole_location()) + "@"
+                                         + lex_cast (p->tok->location));
+              if (it == s.pgo_probe_hits.end())
+                continue;
+              hits[p] = it->second;
+              max_hits = max (max_hits, it->second);
+            }
+
+          // A profile of some other script says nothing about this one.
+          if (!hits.empty())
+            {
+              stable_sort (s.probes.begin(), s.probes.end(), probe_hits_cmp (hits));
+              for (unsigned i=0; i<s.probes.size(); i++)
+                {
+                  derived_probe* p = s.probes[i];
+                  if (!hits.count (p))
+                    cup.cold_probes.insert (p);
+                  else if (max_hits > 0 && hits[p] * 10 >= max_hits)
+                    cup.hot_probes.insert (p);
+                }
+              if (s.verbose > 1)
+                clog << _F("Profile found for %zu probes, %zu hot and %zu cold",
+                           hits.size(), cup.hot_probes.size(),
+                           cup.cold_probes.size()) << endl;
+            }
+        }
+
       // Run a varuse_collecting_visitor over probes that need global
       // variable locks.  We'll use this information later in
       // emit_lock()/emit_unlock().
@@ -8576,10 +10665,50 @@ translate_pass (systemtap_session& s)
           s.probes[i]->session_index = i;
           if (s.probes[i]->needs_global_locks())
 	    s.probes[i]->body->visit (&cup.vcv_needs_global_locks);
+          if (s.probes[i]->needs_global_locks()
+              && !s.probes[i]->writes_rarely())
+	    s.probes[i]->body->visit (&cup.vcv_frequent_writes);
           // XXX: also visit s.probes[i]->sole_condition() ?
 	}
       s.op->assert_0_indent();
 
+      if (!cup.deferred_probes.empty())
+        s.op->newline() << "static void stp_defer_drain (struct context * __restrict__ c);";
+
+      // Count which way each if statement goes, for the branch report
+      // that --pgo reads back.
+      if (s.timing)
+        {
+          branch_collecting_visitor bcv;
+          for (unsigned i=0; i<s.probes.size(); i++)
+            s.probes[i]->body->visit (&bcv);
+          for (map<string,functiondecl*>::iterator it = s.functions.begin();
+               it != s.functions.end(); it++)
+            it->second->body->visit (&bcv);
+          for (unsigned i=0; i<bcv.branches.size(); i++)
+            cup.branch_ids.insert (make_pair (bcv.branches[i], cup.branch_ids.size()));
+
+          if (!cup.branch_ids.empty())
+            {
+              s.op->newline() << "static atomic_t stp_branch_counts["
+                              << cup.branch_ids.size() << "][2];";
+              s.op->newline() << "static const char * const stp_branch_locations[] = {";
+              s.op->indent(1);
+              vector<if_statement*> by_id (cup.branch_ids.size());
+              for (map<if_statement*, unsigned>::iterator it = cup.branch_ids.begin();
+                   it != cup.branch_ids.end(); it++)
+                by_id[it->second] = it->first;
+              for (unsigned i=0; i<by_id.size(); i++)
+                s.op->newline() << lex_cast_qstring (by_id[i]->tok->location) << ",";
+              s.op->newline(-1) << "};";
+              s.op->newline() << "static inline int stp_branch_hit (unsigned i, int64_t taken) {";
+              s.op->newline(1) << "atomic_inc (&stp_branch_counts[i][taken != 0]);";
+              s.op->newline() << "return taken != 0;";
+              s.op->newline(-1) << "}";
+              s.op->assert_0_indent();
+            }
+        }
+
       for (unsigned i=0; i<s.probes.size(); i++)
         {
           assert_no_interrupts();
@@ -8587,6 +10716,42 @@ translate_pass (systemtap_session& s)
         }
       s.op->assert_0_indent();
 
+      // Replay the updates still queued, before an end probe reads them.
+      if (!cup.deferred_probes.empty())
+        {
+          s.op->newline() << "static void stp_defer_drain (struct context * __restrict__ c) {";
+          s.op->indent(1);
+          for (unsigned i=0; i<cup.defer_queues.size(); i++)
+            {
+              string name = cup.defer_queues[i]->name();
+              s.op->newline() << "while (stp_defer_pending(&" << name << "_defer)"
+                              << " && c->last_error == 0) {";
+              s.op->newline(1) << "c->locked = 3;";
+              s.op->newline() << name << " (c);";
+              s.op->newline(-1) << "}";
+            }
+          s.op->newline() << "c->locked = 0;";
+          s.op->newline(-1) << "}";
+          s.op->assert_0_indent();
+        }
+
+      // The fast rejection tests of conditional probes, see
+      // common_probe_entryfn_prologue().
+      if (need_prefilter)
+        {
+          s.op->newline() << "#include \"linux/prefilter.h\"";
+          for (unsigned i=0; i<s.probes.size(); ++i)
+            {
+              derived_probe* p = s.probes[i];
+              if (p->prefilter.empty())
+                continue;
+              s.op->newline() << "static int " << p->name() << "_prefilter (void) {";
+              s.op->newline(1) << "return " << p->prefilter << ";";
+              s.op->newline(-1) << "}";
+            }
+          s.op->assert_0_indent();
+        }
+
       s.op->newline() << "static struct stap_probe stap_probes[] = {";
       s.op->indent(1);
       for (unsigned i=0; i<s.probes.size(); ++i)
@@ -8596,7 +10761,10 @@ translate_pass (systemtap_session& s)
                           << lex_cast_qstring (*p->sole_location()) << ", "
                           << lex_cast_qstring (*p->script_location()) << ", "
                           << lex_cast_qstring (p->tok->location) << ", "
-                          << lex_cast_qstring (p->derived_locations()) << "),";
+                          << lex_cast_qstring (p->derived_locations()) << ", "
+                          << (p->prefilter.empty() ? string("NULL")
+                              : "&" + p->name() + "_prefilter") << ", "
+                          << (p->sample > 1 ? p->sample : 0) << "),";
         }
       s.op->newline(-1) << "};";
 
@@ -8627,6 +10795,21 @@ translate_pass (systemtap_session& s)
       s.op->newline();
       s.up->emit_module_exit ();
       s.op->assert_0_indent();
+      if (!s.runtime_usermode_p())
+        {
+          s.op->newline();
+          s.up->emit_global_stats ();
+          s.op->assert_0_indent();
+          s.op->newline();
+          s.up->emit_map_refill ();
+          s.op->assert_0_indent();
+        }
+      if (s.handoff)
+        {
+          s.op->newline();
+          s.up->emit_handoff ();
+          s.op->assert_0_indent();
+        }
       s.up->emit_kernel_module_init ();
       s.op->assert_0_indent();
       s.up->emit_kernel_module_exit ();
@@ -8667,13 +10850,16 @@ translate_pass (systemtap_session& s)
 
   s.op->line() << "\n";
 
+  // The outputs are kept in memory until now; write them with --jobs.
+  vector<translator_output*> outputs (1, s.op);
+  outputs.insert (outputs.end(), s.auxiliary_outputs.begin(),
+                  s.auxiliary_outputs.end());
+  translator_output::close_all (outputs, s.jobs);
+
   delete s.op;
   s.op = 0;
   s.up = 0;
 
- for (unsigned i=0; i<s.auxiliary_outputs.size(); i++)
-   s.auxiliary_outputs[i]->close();
-  
   return rc + s.num_errors();
 }
 
@@ -76,6 +76,19 @@ struct unparser
   virtual void emit_module_exit () = 0;
   // startup, probe refresh/activation, shutdown
 
+  virtual void emit_global_stats () = 0;
+  // static void _stp_global_stats (struct seq_file *m);
+  // -- for the stats file of a running kernel module
+
+  virtual void emit_handoff () = 0;
+  // static void _stp_handoff_export (struct seq_file *m);
+  // static int _stp_handoff_import (char *line);
+  // -- for passing the globals on to the next module, with --handoff
+
+  virtual void emit_map_refill () = 0;
+  // static void _stp_map_refill_all (void);
+  // -- for the worker that grows the maps, with -DSTP_MAP_GROW
+
   virtual void emit_function (functiondecl* v) = 0;
   // void function_NAME (struct context* c) {
   //   ....
@@ -8,28 +8,185 @@
 // Public License (GPL); either version 2, or (at your option) any
 // later version.
 
+#include "config.h"
 #include "translator-output.h"
+#include "util.h"
 
 #include <string>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <thread>
+
+extern "C" {
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
 
 using namespace std;
 
+
+translator_rope::translator_rope (size_t chunk_size):
+  chunk_size (chunk_size), full_size (0)
+{
+  next_chunk ();
+}
+
+
+translator_rope::~translator_rope ()
+{
+  for (unsigned i=0; i<chunks.size(); i++)
+    delete [] chunks[i];
+}
+
+
+void
+translator_rope::next_chunk ()
+{
+  if (!chunks.empty())
+    {
+      lengths.push_back (pptr() - pbase());
+      full_size += lengths.back();
+    }
+  char *c = new char[chunk_size];
+  chunks.push_back (c);
+  setp (c, c + chunk_size);
+}
+
+
+translator_rope::int_type
+translator_rope::overflow (int_type c)
+{
+  if (traits_type::eq_int_type (c, traits_type::eof()))
+    return traits_type::not_eof (c);
+  if (pptr() == epptr())
+    next_chunk ();
+  *pptr() = traits_type::to_char_type (c);
+  pbump (1);
+  return c;
+}
+
+
+streamsize
+translator_rope::xsputn (const char* s, streamsize n)
+{
+  streamsize done = 0;
+  while (done < n)
+    {
+      if (pptr() == epptr())
+        next_chunk ();
+      streamsize k = min (n - done, (streamsize) (epptr() - pptr()));
+      memcpy (pptr(), s + done, k);
+      pbump (k);
+      done += k;
+    }
+  return n;
+}
+
+
+translator_rope::pos_type
+translator_rope::seekoff (off_type off, ios_base::seekdir dir,
+                          ios_base::openmode which)
+{
+  if (dir == ios_base::cur)
+    return seekpos (pos_type (off_type (size()) + off), which);
+  if (dir == ios_base::end)
+    return seekpos (pos_type (off_type (size()) + off), which);
+  return seekpos (pos_type (off), which);
+}
+
+
+translator_rope::pos_type
+translator_rope::seekpos (pos_type pos, ios_base::openmode which)
+{
+  off_type p = pos;
+  if (!(which & ios_base::out) || p < 0 || (size_t) p > size())
+    return pos_type (off_type (-1));
+
+  // Drop the chunks past pos, and continue writing at pos.
+  while ((size_t) p < full_size)
+    {
+      delete [] chunks.back();
+      chunks.pop_back();
+      full_size -= lengths.back();
+      lengths.pop_back();
+    }
+  char *c = chunks.back();
+  setp (c, c + chunk_size);
+  pbump (p - full_size);
+  return pos;
+}
+
+
+bool
+translator_rope::write_to (const string& filename) const
+{
+  int fd = open (filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+  if (fd < 0)
+    return false;
+
+  vector<struct iovec> iov (chunks.size());
+  for (unsigned i=0; i<chunks.size(); i++)
+    {
+      iov[i].iov_base = chunks[i];
+      iov[i].iov_len = (i < lengths.size()) ? lengths[i] : (size_t) (pptr() - pbase());
+    }
+
+  // Write IOV_MAX chunks at a time, picking up after short writes.
+  bool ok = true;
+  size_t i = 0;
+  while (ok && i < iov.size())
+    {
+      if (iov[i].iov_len == 0)
+        {
+          i++;
+          continue;
+        }
+      ssize_t n = writev (fd, &iov[i], min (iov.size() - i, (size_t) IOV_MAX));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        {
+          ok = false;
+          break;
+        }
+      while (n > 0)
+        {
+          size_t k = min ((size_t) n, iov[i].iov_len);
+          iov[i].iov_base = (char *) iov[i].iov_base + k;
+          iov[i].iov_len -= k;
+          n -= k;
+          if (iov[i].iov_len == 0)
+            i++;
+        }
+    }
+
+  int saved_errno = errno;
+  if (::close (fd) < 0 && ok)
+    return false;
+  errno = saved_errno;
+  return ok;
+}
+
+
 translator_output::translator_output (ostream& f):
-  buf(0), o2 (0), o (f), tablevel (0), trailer_p(false), hdr (NULL)
+  rope (0), o2 (0), o (f), tablevel (0), closed (false), trailer_p(false), hdr (NULL)
 {
 }
 
 
 translator_output::translator_output (const string& filename, size_t bufsize):
-  buf (new char[bufsize]),
-  o2 (new ofstream (filename.c_str ())),
+  rope (new translator_rope (bufsize)),
+  o2 (new ostream (rope)),
   o (*o2),
   tablevel (0),
+  closed (false),
   filename (filename),
   trailer_p (false),
   hdr (NULL)
 {
-  o2->rdbuf()->pubsetbuf(buf, bufsize);
 }
 
 
@@ -52,15 +209,45 @@ translator_output::new_common_header (const string& filename, size_t bufsize)
 void
 translator_output::close()
 {
-  if (o2)
-    o2->close();
+  if (rope && !closed)
+    {
+      closed = true;
+      o2->flush();
+      if (!rope->write_to (filename))
+        cerr << _F("Cannot write %s: %s", filename.c_str(), strerror (errno)) << endl;
+    }
+}
+
+
+void
+translator_output::close_all (const vector<translator_output*>& outputs,
+                              unsigned jobs)
+{
+  jobs = min ((size_t) jobs, outputs.size());
+  if (jobs <= 1)
+    {
+      for (unsigned i=0; i<outputs.size(); i++)
+        outputs[i]->close();
+      return;
+    }
+
+  atomic<size_t> next (0);
+  vector<thread> workers;
+  for (unsigned j=0; j<jobs; j++)
+    workers.push_back (thread ([&outputs, &next] {
+      for (size_t i = next++; i < outputs.size(); i = next++)
+        outputs[i]->close();
+    }));
+  for (auto& w : workers)
+    w.join();
 }
 
 
 translator_output::~translator_output ()
 {
+  close ();
   delete o2;
-  delete [] buf;
+  delete rope;
 }
 
 
@@ -71,9 +258,14 @@ translator_output::newline (int indent)
   assert (indent > 0 || tablevel >= (unsigned)-indent);
 
   tablevel += indent;
-  o << "\n";
-  for (unsigned i=0; i<tablevel; i++)
-    o << "  ";
+  static const char spaces[] = "                                                                ";
+  o.put ('\n');
+  for (size_t n = 2 * tablevel; n > 0; )
+    {
+      size_t k = min (n, sizeof (spaces) - 1);
+      o.write (spaces, k);
+      n -= k;
+    }
   return o;
 }
 
@@ -12,16 +12,45 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <vector>
 #include <cassert>
 
+// An in-memory stream buffer for generated sources.  Text goes into
+// large chunks, one after the other, and is written out with a few
+// writev calls at the end.  Seeking back truncates.
+class translator_rope: public std::streambuf
+{
+  std::vector<char*> chunks; // the last one is being filled
+  std::vector<size_t> lengths; // bytes used in each full chunk
+  size_t chunk_size;
+  size_t full_size; // sum of lengths
+
+  void next_chunk ();
+
+protected:
+  int_type overflow (int_type c);
+  std::streamsize xsputn (const char* s, std::streamsize n);
+  pos_type seekoff (off_type off, std::ios_base::seekdir dir,
+                    std::ios_base::openmode which);
+  pos_type seekpos (pos_type pos, std::ios_base::openmode which);
+
+public:
+  translator_rope (size_t chunk_size);
+  ~translator_rope ();
+
+  size_t size () const { return full_size + (pptr() - pbase()); }
+  bool write_to (const std::string& filename) const;
+};
+
 // Output context for systemtap translation, intended to allow
 // pretty-printing.
 class translator_output
 {
-  char *buf;
-  std::ofstream* o2;
+  translator_rope* rope;
+  std::ostream* o2;
   std::ostream& o;
   unsigned tablevel;
+  bool closed;
 
 public:
   std::string filename;
@@ -30,13 +59,17 @@ public:
   translator_output* hdr;  /* for stap_common.h file */
 
   translator_output (std::ostream& file);
-  translator_output (const std::string& filename, size_t bufsize = 8192);
+  translator_output (const std::string& filename, size_t bufsize = 1 << 20);
   ~translator_output ();
 
   void new_common_header (std::ostream& file);
-  void new_common_header (const std::string& filename, size_t bufsize = 8192);
+  void new_common_header (const std::string& filename, size_t bufsize = 1 << 20);
 
   void close ();
+
+  // Close several outputs at once, writing up to JOBS files in parallel.
+  static void close_all (const std::vector<translator_output*>& outputs,
+                         unsigned jobs);
   
   std::ostream& newline (int indent = 0);
   void indent (int indent = 0);
@@ -30,6 +30,7 @@
 #include <cctype>
 #include <locale>
 #include <memory>
+#include <chrono>
 
 extern "C" {
 #include <elf.h>
@@ -326,7 +327,8 @@ in_group_id (gid_t target_gid)
 /*
  * Returns a string describing memory resource usage.
  * Since it seems getrusage() doesn't maintain the mem related fields,
- * this routine parses /proc/self/statm to get the statistics.
+ * this routine parses /proc/self/statm and /proc/self/status to get the
+ * statistics.
  */
 string
 getmemusage ()
@@ -354,7 +356,19 @@ getmemusage ()
   long kb7 = pages * sz / 1024; // dirty
   (void) kb7;
 
-  oss << _F("using %ldvirt/%ldres/%ldshr/%lddata kb, ", kb1, kb2, kb3, kb6);
+  // The high water mark of the resident set, which statm lacks.
+  long kb8 = kb2;
+  ifstream status("/proc/self/status");
+  string line;
+  while (getline(status, line))
+    if (startswith(line, "VmHWM:"))
+      {
+        kb8 = atol(line.c_str() + 6);
+        break;
+      }
+
+  oss << _F("using %ldvirt/%ldres/%ldpeak/%ldshr/%lddata kb, ",
+            kb1, kb2, kb8, kb3, kb6);
   return oss.str();
 }
 
@@ -1886,4 +1900,193 @@ get_distro_info(vector<string> &info)
     return false;
 }
 
+
+namespace {
+struct time_trace_event
+{
+  const char *name;
+  string detail;
+  unsigned tid;
+  long long start, duration; // microseconds since time_trace_start()
+};
+
+bool time_trace_on = false;
+chrono::steady_clock::time_point time_trace_epoch;
+mutex time_trace_mutex;
+vector<time_trace_event> time_trace_events;
+unsigned time_trace_threads = 0;
+
+struct time_trace_thread
+{
+  unsigned tid;
+  vector<time_trace_event> open;
+  time_trace_thread ()
+  {
+    lock_guard<mutex> lock (time_trace_mutex);
+    tid = ++time_trace_threads;
+  }
+};
+thread_local time_trace_thread time_trace_self;
+
+long long
+time_trace_now ()
+{
+  return chrono::duration_cast<chrono::microseconds>
+    (chrono::steady_clock::now () - time_trace_epoch).count ();
+}
+
+string
+time_trace_quote (const string& str)
+{
+  string q = "\"";
+  for (unsigned char c : str)
+    {
+      if (c == '"' || c == '\\')
+        {
+          q += '\\';
+          q += c;
+        }
+      else if (c < 0x20)
+        {
+          char buf[8];
+          snprintf (buf, sizeof buf, "\\u%04x", c);
+          q += buf;
+        }
+      else
+        q += c;
+    }
+  return q + "\"";
+}
+}
+
+void
+time_trace_start ()
+{
+  time_trace_epoch = chrono::steady_clock::now ();
+  time_trace_on = true;
+}
+
+bool
+time_trace_active ()
+{
+  return time_trace_on;
+}
+
+void
+time_trace_begin (const char *name, const string& detail)
+{
+  if (!time_trace_on)
+    return;
+  time_trace_event e;
+  e.name = name;
+  e.detail = detail;
+  e.tid = time_trace_self.tid;
+  e.start = time_trace_now ();
+  e.duration = 0;
+  time_trace_self.open.push_back (e);
+}
+
+void
+time_trace_end ()
+{
+  if (!time_trace_on || time_trace_self.open.empty ())
+    return;
+  time_trace_event e = time_trace_self.open.back ();
+  time_trace_self.open.pop_back ();
+  e.duration = time_trace_now () - e.start;
+  lock_guard<mutex> lock (time_trace_mutex);
+  time_trace_events.push_back (e);
+}
+
+int
+time_trace_write (const string& filename)
+{
+  if (!time_trace_on)
+    return 0;
+
+  // Spans still open here, say a pass cut short by an error, end now.
+  while (!time_trace_self.open.empty ())
+    time_trace_end ();
+
+  ofstream o (filename.c_str ());
+  lock_guard<mutex> lock (time_trace_mutex);
+  o << "{\"traceEvents\":[" << endl;
+  o << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << getpid ()
+    << ",\"tid\":0,\"args\":{\"name\":\"stap\"}}";
+  for (auto it = time_trace_events.begin (); it != time_trace_events.end (); ++it)
+    {
+      o << "," << endl << "{\"name\":" << time_trace_quote (it->name)
+        << ",\"ph\":\"X\",\"pid\":" << getpid () << ",\"tid\":" << it->tid
+        << ",\"ts\":" << it->start << ",\"dur\":" << it->duration;
+      if (!it->detail.empty ())
+        o << ",\"args\":{\"detail\":" << time_trace_quote (it->detail) << "}";
+      o << "}";
+    }
+  o << endl << "]}" << endl;
+  o.close ();
+  if (o.fail ())
+    {
+      cerr << _F("ERROR: couldn't write time trace '%s': %s",
+                 filename.c_str (), strerror (errno)) << endl;
+      return 1;
+    }
+  return 0;
+}
+
+
+namespace {
+  const size_t pool_granule = 16;     // keeps every object suitably aligned
+  const size_t pool_max_size = 256;   // bigger objects go to malloc
+  const size_t pool_chunk_size = 256 * 1024;
+
+  struct object_pool
+  {
+    char *next, *end;                 // the unused rest of the current chunk
+    void *free_list[pool_max_size / pool_granule + 1];
+  };
+
+  thread_local object_pool pool;
+}
+
+void *
+pool_alloc (size_t size)
+{
+  if (size == 0 || size > pool_max_size)
+    return ::operator new (size);
+
+  size_t cls = (size + pool_granule - 1) / pool_granule;
+  void *p = pool.free_list[cls];
+  if (p)
+    {
+      pool.free_list[cls] = *(void **) p;
+      return p;
+    }
+
+  size_t bytes = cls * pool_granule;
+  if ((size_t) (pool.end - pool.next) < bytes)
+    {
+      pool.next = (char *) ::operator new (pool_chunk_size);
+      pool.end = pool.next + pool_chunk_size;
+    }
+  p = pool.next;
+  pool.next += bytes;
+  return p;
+}
+
+void
+pool_free (void *p, size_t size)
+{
+  if (!p)
+    return;
+  if (size == 0 || size > pool_max_size)
+    {
+      ::operator delete (p);
+      return;
+    }
+
+  size_t cls = (size + pool_granule - 1) / pool_granule;
+  *(void **) p = pool.free_list[cls];
+  pool.free_list[cls] = p;
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -424,6 +424,57 @@ void rtrim(std::string &s);
 void trim(std::string &s);
 
 bool get_distro_info(std::vector<std::string> &info);
+
+// Memory for the translator's many small objects, such as tokens and
+// parse tree nodes: they are carved out of big chunks, and freed ones
+// are kept for reuse by size, so neither costs a trip through malloc.
+// The chunks are never returned, since the objects mostly live as
+// long as the process anyway.  Each thread has a pool of its own.
+void *pool_alloc (size_t size);
+void pool_free (void *p, size_t size);
+
+// --time-trace: spans of the translator's own work, written out in the
+// Chrome trace event format (chrome://tracing, Perfetto, speedscope).
+// Spans nest per thread; recording is off unless time_trace_start() ran.
+void time_trace_start ();
+bool time_trace_active ();
+void time_trace_begin (const char *name, const std::string& detail = "");
+void time_trace_end ();
+int time_trace_write (const std::string& filename);
+
+class time_trace_scope
+{
+public:
+  time_trace_scope (const char *name)
+    : active (time_trace_active ())
+  {
+    if (active) time_trace_begin (name);
+  }
+  // The detail, such as a probe point or file name, is only built when
+  // the trace is being recorded.
+  template <typename F>
+  time_trace_scope (const char *name, F detail)
+    : active (time_trace_active ())
+  {
+    if (active) time_trace_begin (name, detail ());
+  }
+  ~time_trace_scope ()
+  {
+    close ();
+  }
+  // Ends the span before the scope does, for a span over just part of
+  // a function; returns out of that part still end it.
+  void close ()
+  {
+    if (active) time_trace_end ();
+    active = false;
+  }
+private:
+  bool active;
+  time_trace_scope (const time_trace_scope&) = delete;
+  time_trace_scope& operator= (const time_trace_scope&) = delete;
+};
+
 #endif // UTIL_H
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */